@@ -0,0 +1,99 @@
+/* 
+ * Copyright (C) Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2.1 only
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+
+#include "tap-ctl.h"
+
+/*
+ * Sends @n requests in one batch, each replaced by its response.
+ * Returns how many failed, or -errno if the batch did not go through.
+ */
+int
+tap_ctl_batch(const int id, tapdisk_message_t *messages, int n, int flags,
+	      struct timeval *timeout)
+{
+	tapdisk_message_t message;
+	int i, err, sfd, failed;
+
+	if (n <= 0 || n > TAPDISK_MESSAGE_BATCH_MAX)
+		return -EINVAL;
+
+	err = tap_ctl_connect_id(id, &sfd);
+	if (err)
+		return err;
+
+	memset(&message, 0, sizeof(message));
+	message.type          = TAPDISK_MESSAGE_BATCH;
+	message.cookie        = -1;
+	message.u.batch.count = n;
+	message.u.batch.flags = flags;
+
+	err = tap_ctl_write_message(sfd, &message, timeout);
+	for (i = 0; !err && i < n; i++)
+		err = tap_ctl_write_message(sfd, &messages[i], timeout);
+	if (err)
+		goto out;
+
+	err = tap_ctl_read_message(sfd, &message, timeout);
+	if (err)
+		goto out;
+
+	if (message.type != TAPDISK_MESSAGE_BATCH_RSP) {
+		err = message.type == TAPDISK_MESSAGE_ERROR ?
+			-message.u.response.error : -EINVAL;
+		EPRINTF("batch of %d rejected by %d: %d\n", n, id, err);
+		goto out;
+	}
+
+	failed = 0;
+
+	for (i = 0; i < n; i++) {
+		err = tap_ctl_read_message(sfd, &messages[i], timeout);
+		if (err)
+			goto out;
+
+		failed += !!tap_ctl_batch_error(&messages[i]);
+	}
+
+	err = failed;
+out:
+	close(sfd);
+	return err;
+}
+
+/* the error a batch response reports, 0 on success */
+int
+tap_ctl_batch_error(tapdisk_message_t *message)
+{
+	switch (message->type) {
+	case TAPDISK_MESSAGE_ERROR:
+		return message->u.response.error ? : EINVAL;
+	case TAPDISK_MESSAGE_OPEN_RSP:
+		return 0;
+	default:
+		return message->u.response.error;
+	}
+}
@@ -30,7 +30,8 @@
 
 int
 tap_ctl_create(const char *params, char **devname, int flags, int parent_minor,
-		char *secondary, int timeout)
+		char *secondary, int timeout, int bm_cache, int lazy_depth,
+		const char *loop_cpus, const char *helper_cpus)
 {
 	int err, id, minor;
 
@@ -38,18 +39,25 @@ tap_ctl_create(const char *params, char **devname, int flags, int parent_minor,
 	if (err)
 		return err;
 
-	id = tap_ctl_spawn();
+	/* pooled tapdisks run wherever they were spawned */
+	id = -1;
+	if (!loop_cpus && !helper_cpus)
+		id = tap_ctl_pool_claim();
+	if (id < 0)
+		id = tap_ctl_spawn(-1, loop_cpus, helper_cpus);
 	if (id < 0) {
 		err = id;
 		goto destroy;
 	}
 
+	tap_ctl_pool_refill();
+
 	err = tap_ctl_attach(id, minor);
 	if (err)
 		goto destroy;
 
 	err = tap_ctl_open(id, minor, params, flags, parent_minor, secondary,
-			timeout);
+			timeout, bm_cache, lazy_depth);
 	if (err)
 		goto detach;
 
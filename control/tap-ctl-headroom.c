@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2.1 only
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+
+#include "tap-ctl.h"
+
+/*
+ * @flags TAPDISK_MESSAGE_HEADROOM_*. With WAIT, blocks until headroom
+ * of the VBD runs low. @hr gets the headroom the response carries.
+ */
+int
+tap_ctl_headroom(const int id, const int minor, int flags,
+		 unsigned int lead_s, unsigned int hold_ms,
+		 tapdisk_message_headroom_t *hr)
+{
+	int err;
+	tapdisk_message_t message;
+
+	memset(&message, 0, sizeof(message));
+	message.type = TAPDISK_MESSAGE_HEADROOM;
+	message.cookie = minor;
+	message.u.headroom.flags   = flags;
+	message.u.headroom.lead_s  = lead_s;
+	message.u.headroom.hold_ms = hold_ms;
+
+	err = tap_ctl_connect_send_and_receive(id, &message, NULL);
+	if (err)
+		return err;
+
+	if (message.type == TAPDISK_MESSAGE_HEADROOM_RSP) {
+		err = message.u.headroom.error;
+		if (hr)
+			*hr = message.u.headroom;
+	} else {
+		err = EINVAL;
+		EPRINTF("got unexpected result '%s' from %d\n",
+			tapdisk_message_name(message.type), id);
+	}
+
+	return err;
+}
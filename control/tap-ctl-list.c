@@ -25,11 +25,17 @@
 #include <unistd.h>
 #include <string.h>
 #include <glob.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #include "tap-ctl.h"
 #include "blktap2.h"
 #include "list.h"
 
+#define TAP_CTL_LIST_TIMEOUT 10000 /* ms, for all tapdisks together */
+
 static tap_list_t*
 _tap_list_alloc(void)
 {
@@ -162,6 +168,10 @@ fail:
 	goto out;
 }
 
+/*
+ * Control socket ids are tapdisk pids. Stale sockets are found out
+ * when the query fails to connect.
+ */
 int
 _tap_ctl_find_tapdisks(struct list_head *list)
 {
@@ -197,19 +207,13 @@ _tap_ctl_find_tapdisks(struct list_head *list)
 		}
 
 		n = sscanf(glbuf.gl_pathv[i], format, &tl->pid);
-		if (n != 1)
-			goto skip;
-
-		tl->pid = tap_ctl_get_pid(tl->pid);
-		if (tl->pid < 0)
-			goto skip;
+		if (n != 1 || tl->pid < 0) {
+			_tap_list_free(tl);
+			continue;
+		}
 
 		list_add_tail(&tl->entry, list);
 		n_taps++;
-		continue;
-
-skip:
-		_tap_list_free(tl);
 	}
 
 done:
@@ -225,113 +229,300 @@ fail:
 	goto out;
 }
 
-int
-_tap_ctl_list_tapdisk(pid_t pid, struct list_head *list)
+/*
+ * One LIST query per tapdisk, all of them in flight at once, over
+ * non-blocking sockets. Whatever has not completed by the deadline
+ * is reported as it stands.
+ */
+struct tap_ctl_list_query {
+	tap_list_t          *tapdisk;
+	int                  sfd;
+	int                  err;
+	size_t               off;
+	tapdisk_message_t    message;
+	struct list_head     vbds;
+};
+
+static long
+_tap_ctl_list_remaining(const struct timespec *deadline)
+{
+	struct timespec now;
+	long ms;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	ms  = (deadline->tv_sec - now.tv_sec) * 1000;
+	ms += (deadline->tv_nsec - now.tv_nsec) / 1000000;
+
+	return ms > 0 ? ms : 0;
+}
+
+static int
+_tap_ctl_list_send(struct tap_ctl_list_query *q)
 {
-	struct timeval timeout = { .tv_sec = 10, .tv_usec = 0 };
+	struct sockaddr_un saddr;
 	tapdisk_message_t message;
-	tap_list_t *tl;
-	int err, sfd;
+	char *name;
+	ssize_t n;
+	int err;
 
-	err = tap_ctl_connect_id(pid, &sfd);
+	q->sfd = socket(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+	if (q->sfd < 0)
+		return -errno;
+
+	name = tap_ctl_socket_name(q->tapdisk->pid);
+	if (!name)
+		return -ENOMEM;
+
+	memset(&saddr, 0, sizeof(saddr));
+	saddr.sun_family = AF_UNIX;
+	snprintf(saddr.sun_path, sizeof(saddr.sun_path), "%s", name);
+	free(name);
+
+	/* EAGAIN: the backlog is full, nobody seems to be accepting */
+	err = connect(q->sfd, (const struct sockaddr *)&saddr, sizeof(saddr));
 	if (err)
-		return err;
+		return -errno;
 
 	memset(&message, 0, sizeof(message));
 	message.type   = TAPDISK_MESSAGE_LIST;
 	message.cookie = -1;
 
-	err = tap_ctl_write_message(sfd, &message, &timeout);
-	if (err)
-		return err;
+	n = write(q->sfd, &message, sizeof(message));
+	if (n != sizeof(message))
+		return n < 0 ? -errno : -EIO;
 
-	INIT_LIST_HEAD(list);
+	return 0;
+}
+
+/* reads what is there, 1 once the list is complete */
+static int
+_tap_ctl_list_receive(struct tap_ctl_list_query *q)
+{
+	tapdisk_message_t *message = &q->message;
+	tap_list_t *tl;
+	ssize_t n;
+	int err;
 
 	do {
-		err = tap_ctl_read_message(sfd, &message, &timeout);
-		if (err) {
-			err = -EPROTO;
-			goto fail;
-		}
+		n = read(q->sfd, (char *)message + q->off,
+			 sizeof(*message) - q->off);
+		if (n < 0)
+			return errno == EAGAIN || errno == EINTR ? 0 : -errno;
+		if (n == 0)
+			return -EPROTO;
+
+		q->off += n;
+		if (q->off < sizeof(*message))
+			continue;
 
-		if (message.u.list.count == 0)
-			break;
+		q->off = 0;
+
+		if (message->type != TAPDISK_MESSAGE_LIST_RSP)
+			return -EPROTO;
+
+		if (message->u.list.count == 0)
+			return 1;
 
 		tl = _tap_list_alloc();
-		if (!tl) {
-			err = -ENOMEM;
-			goto fail;
-		}
+		if (!tl)
+			return -ENOMEM;
 
-		tl->pid    = pid;
-		tl->minor  = message.u.list.minor;
-		tl->state  = message.u.list.state;
+		tl->pid    = q->tapdisk->pid;
+		tl->minor  = message->u.list.minor;
+		tl->state  = message->u.list.state;
 
-		if (message.u.list.path[0] != 0) {
-			err = _parse_params(message.u.list.path,
+		if (message->u.list.path[0] != 0) {
+			err = _parse_params(message->u.list.path,
 					    &tl->type, &tl->path);
 			if (err) {
 				_tap_list_free(tl);
-				goto fail;
+				return err;
 			}
 		}
 
-		list_add(&tl->entry, list);
+		list_add(&tl->entry, &q->vbds);
 	} while (1);
+}
+
+static void
+_tap_ctl_list_done(struct tap_ctl_list_query *q, int err)
+{
+	close(q->sfd);
+	q->sfd = -1;
+	q->err = err;
+}
+
+/*
+ * Lists the VBDs of all @tapdisks, in their order, into @list.
+ * Tapdisks without VBDs are listed by themselves. Those no longer
+ * there are dropped, the VBDs of an incomplete answer kept.
+ */
+static int
+_tap_ctl_list_tapdisks(struct list_head *tapdisks, int n_taps,
+		       struct list_head *list, long timeout)
+{
+	struct tap_ctl_list_query *queries, *q;
+	struct timespec deadline;
+	struct pollfd *pfds;
+	tap_list_t *t, *next_t;
+	int i, n, err, pending;
+
+	if (!n_taps)
+		return 0;
+
+	queries = calloc(n_taps, sizeof(*queries));
+	pfds    = calloc(n_taps, sizeof(*pfds));
+	if (!queries || !pfds) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec  += timeout / 1000;
+	deadline.tv_nsec += (timeout % 1000) * 1000000;
+	if (deadline.tv_nsec >= 1000000000) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
+
+	pending = 0;
+	i = 0;
+
+	tap_list_for_each_entry(t, tapdisks) {
+		q = &queries[i++];
+
+		q->tapdisk = t;
+		q->sfd     = -1;
+		INIT_LIST_HEAD(&q->vbds);
+
+		err = _tap_ctl_list_send(q);
+		if (err) {
+			_tap_ctl_list_done(q, err);
+			continue;
+		}
+
+		q->err = -ETIMEDOUT;
+		pending++;
+	}
+
+	while (pending) {
+		n = 0;
+		for (i = 0; i < n_taps; i++)
+			if (queries[i].sfd >= 0) {
+				pfds[n].fd     = queries[i].sfd;
+				pfds[n].events = POLLIN;
+				n++;
+			}
+
+		n = poll(pfds, n, _tap_ctl_list_remaining(&deadline));
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			EPRINTF("list: poll failed: %d\n", -errno);
+			break;
+		}
+
+		if (n == 0)
+			break;
+
+		for (i = 0, n = 0; i < n_taps; i++) {
+			q = &queries[i];
+			if (q->sfd < 0)
+				continue;
+
+			if (pfds[n++].revents) {
+				err = _tap_ctl_list_receive(q);
+				if (err) {
+					_tap_ctl_list_done(q, err < 0 ? err : 0);
+					pending--;
+				}
+			}
+		}
+	}
+
+	for (i = 0; i < n_taps; i++) {
+		q = &queries[i];
+
+		if (q->sfd >= 0) {
+			EPRINTF("tapdisk %d: no complete list in %ld ms, "
+				"%s\n", q->tapdisk->pid, timeout,
+				list_empty(&q->vbds) ? "skipped" : "partial");
+			_tap_ctl_list_done(q, q->err);
+		}
+
+		switch (q->err) {
+		case 0:
+		case -ETIMEDOUT:
+			break;
+		case -ENOENT:
+		case -ECONNREFUSED:
+			_tap_list_free(q->tapdisk);
+			continue;
+		default:
+			tap_ctl_list_free(&q->vbds);
+			break;
+		}
+
+		if (list_empty(&q->vbds)) {
+			list_move_tail(&q->tapdisk->entry, list);
+			continue;
+		}
+
+		list_splice_tail(&q->vbds, list);
+		_tap_list_free(q->tapdisk);
+	}
 
 	err = 0;
 out:
-	close(sfd);
-	return 0;
+	free(queries);
+	free(pfds);
 
-fail:
-	tap_ctl_list_free(list);
-	goto out;
+	/* only left on failure */
+	tap_list_for_each_entry_safe(t, next_t, tapdisks)
+		_tap_list_free(t);
+
+	return err;
 }
 
 int
 tap_ctl_list(struct list_head *list)
 {
-	struct list_head minors, tapdisks, vbds;
-	tap_list_t *t, *next_t, *v, *next_v, *m, *next_m;
-	int err;
+	struct list_head minors, tapdisks;
+	tap_list_t *t, *m, *next_m;
+	int err, n_taps;
 
 	/*
 	 * Find all minors, find all tapdisks, then list all minors
 	 * they attached to. Output is a 3-way outer join.
 	 */
 
+	INIT_LIST_HEAD(list);
+
 	err = _tap_ctl_find_minors(&minors);
 	if (err < 0)
-		goto fail;
+		return err;
 
-	err = _tap_ctl_find_tapdisks(&tapdisks);
-	if (err < 0)
+	n_taps = _tap_ctl_find_tapdisks(&tapdisks);
+	if (n_taps < 0) {
+		err = n_taps;
 		goto fail;
+	}
 
-	INIT_LIST_HEAD(list);
-
-	tap_list_for_each_entry_safe(t, next_t, &tapdisks) {
-
-		err = _tap_ctl_list_tapdisk(t->pid, &vbds);
+	err = _tap_ctl_list_tapdisks(&tapdisks, n_taps, list,
+				     TAP_CTL_LIST_TIMEOUT);
+	if (err)
+		goto fail;
 
-		if (err || list_empty(&vbds)) {
-			list_move_tail(&t->entry, list);
+	tap_list_for_each_entry(t, list) {
+		if (t->minor < 0)
 			continue;
-		}
-
-		tap_list_for_each_entry_safe(v, next_v, &vbds) {
 
-			tap_list_for_each_entry_safe(m, next_m, &minors)
-				if (m->minor == v->minor) {
-					_tap_list_free(m);
-					break;
-				}
-
-			list_move_tail(&v->entry, list);
-		}
-
-		_tap_list_free(t);
+		tap_list_for_each_entry_safe(m, next_m, &minors)
+			if (m->minor == t->minor) {
+				_tap_list_free(m);
+				break;
+			}
 	}
 
 	/* orphaned minors */
@@ -341,9 +532,6 @@ tap_ctl_list(struct list_head *list)
 
 fail:
 	tap_ctl_list_free(list);
-
-	tap_ctl_list_free(&vbds);
-	tap_ctl_list_free(&tapdisks);
 	tap_ctl_list_free(&minors);
 
 	return err;
@@ -352,25 +540,21 @@ fail:
 int
 tap_ctl_list_pid(pid_t pid, struct list_head *list)
 {
+	struct list_head tapdisks;
 	tap_list_t *t;
-	int err;
+
+	INIT_LIST_HEAD(list);
+	INIT_LIST_HEAD(&tapdisks);
 
 	t = _tap_list_alloc();
 	if (!t)
 		return -ENOMEM;
 
-	t->pid = tap_ctl_get_pid(pid);
-	if (t->pid < 0) {
-		_tap_list_free(t);
-		return 0;
-	}
-
-	err = _tap_ctl_list_tapdisk(t->pid, list);
+	t->pid = pid;
+	list_add_tail(&t->entry, &tapdisks);
 
-	if (err || list_empty(list))
-		list_add_tail(&t->entry, list);
-
-	return 0;
+	return _tap_ctl_list_tapdisks(&tapdisks, 1, list,
+				      TAP_CTL_LIST_TIMEOUT);
 }
 
 int
@@ -30,7 +30,8 @@
 
 int
 tap_ctl_open(const int id, const int minor, const char *params, int flags,
-		const int prt_minor, const char *secondary, int timeout)
+		const int prt_minor, const char *secondary, int timeout,
+		int bm_cache, int lazy_depth)
 {
 	int err;
 	tapdisk_message_t message;
@@ -41,6 +42,8 @@ tap_ctl_open(const int id, const int minor, const char *params, int flags,
 	message.u.params.devnum = minor;
 	message.u.params.prt_devnum = prt_minor;
 	message.u.params.req_timeout = timeout;
+	message.u.params.bm_cache = bm_cache;
+	message.u.params.lazy_depth = lazy_depth;
 	message.u.params.flags = flags;
 
 	err = snprintf(message.u.params.path,
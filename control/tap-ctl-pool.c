@@ -0,0 +1,304 @@
+/* 
+ * Copyright (C) Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2.1 only
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <signal.h>
+#include <glob.h>
+#include <dirent.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "tap-ctl.h"
+#include "blktap2.h"
+#include "tapdisk-shmstats.h"
+
+/*
+ * A pool of idle tapdisks, spawned ahead of tap_ctl_create. Each has
+ * an entry in TAP_CTL_POOL_DIR, named after its control socket, and
+ * whoever unlinks it first owns the tapdisk. The pool size is kept
+ * in TAP_CTL_POOL_SIZE, 0 or none disables it.
+ */
+#define TAP_CTL_POOL_DIR     BLKTAP2_CONTROL_DIR"/pool"
+#define TAP_CTL_POOL_ENTRY   TAP_CTL_POOL_DIR"/"BLKTAP2_CONTROL_SOCKET"%d"
+#define TAP_CTL_POOL_SIZE    TAP_CTL_POOL_DIR"/size"
+#define TAP_CTL_POOL_LOCK    TAP_CTL_POOL_DIR"/lock"
+
+static int
+tap_ctl_pool_mkdir(void)
+{
+	if (mkdir(BLKTAP2_CONTROL_DIR, 0755) && errno != EEXIST)
+		goto fail;
+
+	if (mkdir(TAP_CTL_POOL_DIR, 0755) && errno != EEXIST)
+		goto fail;
+
+	return 0;
+
+fail:
+	EPRINTF("pool: mkdir failed: %d\n", errno);
+	return -errno;
+}
+
+int
+tap_ctl_pool_get_size(void)
+{
+	FILE *f;
+	int size;
+
+	f = fopen(TAP_CTL_POOL_SIZE, "r");
+	if (!f)
+		return 0;
+
+	if (fscanf(f, "%d", &size) != 1 || size < 0)
+		size = 0;
+
+	fclose(f);
+	return size;
+}
+
+/* idle tapdisks, their ids in @ids if not NULL */
+int
+tap_ctl_pool_idle(int *ids, int max)
+{
+	glob_t glbuf = { 0 };
+	int i, id, n;
+
+	n = 0;
+
+	if (glob(TAP_CTL_POOL_DIR"/"BLKTAP2_CONTROL_SOCKET"*",
+		 0, NULL, &glbuf))
+		goto out;
+
+	for (i = 0; i < glbuf.gl_pathc; i++) {
+		if (sscanf(glbuf.gl_pathv[i], TAP_CTL_POOL_ENTRY, &id) != 1)
+			continue;
+
+		if (ids && n < max)
+			ids[n] = id;
+		n++;
+	}
+
+out:
+	globfree(&glbuf);
+	return n;
+}
+
+/* an idle tapdisk for the caller alone, or -ENOENT */
+int
+tap_ctl_pool_claim(void)
+{
+	glob_t glbuf = { 0 };
+	int i, id, err;
+
+	err = -ENOENT;
+
+	if (glob(TAP_CTL_POOL_DIR"/"BLKTAP2_CONTROL_SOCKET"*",
+		 0, NULL, &glbuf))
+		goto out;
+
+	for (i = 0; i < glbuf.gl_pathc; i++) {
+		if (sscanf(glbuf.gl_pathv[i], TAP_CTL_POOL_ENTRY, &id) != 1)
+			continue;
+
+		if (unlink(glbuf.gl_pathv[i]))
+			continue;
+
+		if (tap_ctl_get_pid(id) == id) {
+			err = id;
+			break;
+		}
+
+		EPRINTF("pool: tapdisk %d is gone\n", id);
+	}
+
+out:
+	globfree(&glbuf);
+	return err;
+}
+
+/* spawns tapdisks until the pool is full, unless someone else does */
+int
+tap_ctl_pool_fill(void)
+{
+	char path[256];
+	int fd, lock, size, id, n, err;
+
+	size = tap_ctl_pool_get_size();
+	if (!size)
+		return 0;
+
+	err = tap_ctl_pool_mkdir();
+	if (err)
+		return err;
+
+	lock = open(TAP_CTL_POOL_LOCK, O_RDWR|O_CREAT|O_CLOEXEC, 0644);
+	if (lock < 0)
+		return -errno;
+
+	if (flock(lock, LOCK_EX|LOCK_NB)) {
+		err = errno == EWOULDBLOCK ? 0 : -errno;
+		goto out;
+	}
+
+	for (n = 0; tap_ctl_pool_idle(NULL, 0) < size; n++) {
+		id = tap_ctl_spawn(-1, NULL, NULL);
+		if (id < 0) {
+			err = id;
+			EPRINTF("pool: spawn failed: %d\n", err);
+			goto out;
+		}
+
+		snprintf(path, sizeof(path), TAP_CTL_POOL_ENTRY, id);
+
+		fd = open(path, O_WRONLY|O_CREAT|O_EXCL, 0644);
+		if (fd < 0) {
+			err = -errno;
+			EPRINTF("pool: %s: %d\n", path, err);
+			kill(id, SIGTERM);
+			goto out;
+		}
+		close(fd);
+	}
+
+	err = n;
+out:
+	close(lock);
+	return err;
+}
+
+static void
+tap_ctl_pool_detach_fds(void)
+{
+	struct dirent *d;
+	DIR *dir;
+	int fd;
+
+	fd = open("/dev/null", O_RDWR);
+	if (fd >= 0) {
+		dup2(fd, STDIN_FILENO);
+		dup2(fd, STDOUT_FILENO);
+		dup2(fd, STDERR_FILENO);
+		if (fd > STDERR_FILENO)
+			close(fd);
+	}
+
+	/* nothing the caller waits on may stay open behind it */
+	dir = opendir("/proc/self/fd");
+	if (!dir)
+		return;
+
+	while ((d = readdir(dir))) {
+		fd = atoi(d->d_name);
+		if (fd > STDERR_FILENO && fd != dirfd(dir))
+			close(fd);
+	}
+
+	closedir(dir);
+}
+
+/* fills the pool behind the caller, which does not wait for it */
+int
+tap_ctl_pool_refill(void)
+{
+	pid_t child;
+	int status;
+
+	if (!tap_ctl_pool_get_size())
+		return 0;
+
+	child = fork();
+	if (child < 0)
+		return -errno;
+
+	if (!child) {
+		if (fork())
+			_exit(0);
+
+		setsid();
+		tap_ctl_pool_detach_fds();
+		_exit(tap_ctl_pool_fill() < 0);
+	}
+
+	if (waitpid(child, &status, 0) < 0)
+		return -errno;
+
+	return 0;
+}
+
+/*
+ * Sets the pool size. Idle tapdisks beyond it are shut down, none are
+ * spawned here.
+ */
+int
+tap_ctl_pool_set_size(int size)
+{
+	char path[256], *tmp = TAP_CTL_POOL_SIZE".tmp";
+	int n, id, err;
+	FILE *f;
+
+	if (size < 0)
+		return -EINVAL;
+
+	err = tap_ctl_pool_mkdir();
+	if (err)
+		return err;
+
+	f = fopen(tmp, "w");
+	if (!f)
+		return -errno;
+
+	fprintf(f, "%d\n", size);
+
+	if (fclose(f) || rename(tmp, TAP_CTL_POOL_SIZE)) {
+		err = -errno;
+		unlink(tmp);
+		return err;
+	}
+
+	for (n = tap_ctl_pool_idle(NULL, 0); n > size; n--) {
+		id = tap_ctl_pool_claim();
+		if (id < 0)
+			break;
+
+		/* idle, nothing to clean up but its sockets */
+		if (kill(id, SIGTERM))
+			continue;
+
+		snprintf(path, sizeof(path), "%s/%s%d",
+			 BLKTAP2_CONTROL_DIR, BLKTAP2_CONTROL_SOCKET, id);
+		unlink(path);
+
+		snprintf(path, sizeof(path), "%s/nbdclient%d",
+			 BLKTAP2_CONTROL_DIR, id);
+		unlink(path);
+
+		snprintf(path, sizeof(path), TD_SHMSTATS_PATH, id);
+		unlink(path);
+	}
+
+	return 0;
+}
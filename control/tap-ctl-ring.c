@@ -0,0 +1,75 @@
+/*
+ * Copyright (C) Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2.1 only
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "tap-ctl.h"
+
+/* NULL @path stops serving */
+int
+tap_ctl_ring(const int id, const int minor, const char *path,
+	     unsigned int slots, unsigned int size, unsigned int poll_us)
+{
+	int err;
+	tapdisk_message_t message;
+
+	memset(&message, 0, sizeof(message));
+	message.type = TAPDISK_MESSAGE_RING;
+	message.cookie = minor;
+
+	if (path) {
+		char cwd[TAPDISK_MESSAGE_MAX_PATH_LENGTH];
+		int len;
+
+		/* the tapdisk has a cwd of its own */
+		if (path[0] == '/')
+			cwd[0] = '\0';
+		else if (!getcwd(cwd, sizeof(cwd)))
+			return errno;
+
+		len = snprintf(message.u.ring.path,
+			       sizeof(message.u.ring.path), "%s%s%s",
+			       cwd, cwd[0] ? "/" : "", path);
+		if (len >= sizeof(message.u.ring.path))
+			return ENAMETOOLONG;
+
+		message.u.ring.slots   = slots;
+		message.u.ring.size    = size;
+		message.u.ring.poll_us = poll_us;
+	}
+
+	err = tap_ctl_connect_send_and_receive(id, &message, NULL);
+	if (err)
+		return err;
+
+	if (message.type == TAPDISK_MESSAGE_RING_RSP)
+		err = message.u.response.error;
+	else {
+		err = EINVAL;
+		EPRINTF("got unexpected result '%s' from %d\n",
+			tapdisk_message_name(message.type), id);
+	}
+
+	return err;
+}
@@ -31,10 +31,11 @@
 #include "blktap2.h"
 
 static pid_t
-__tap_ctl_spawn(int *readfd)
+__tap_ctl_spawn(int *readfd, int numa_node,
+		const char *loop_cpus, const char *helper_cpus)
 {
-	int child, channel[2];
-	char *tapdisk;
+	int child, channel[2], argc;
+	char *tapdisk, *argv[8], node[16];
 
 	if (pipe(channel)) {
 		EPRINTF("pipe failed: %d\n", errno);
@@ -65,21 +66,37 @@ __tap_ctl_spawn(int *readfd)
 	close(channel[0]);
 	close(channel[1]);
 
+	argc = 1;
+	if (numa_node >= 0) {
+		snprintf(node, sizeof(node), "%d", numa_node);
+		argv[argc++] = "-n";
+		argv[argc++] = node;
+	}
+	if (loop_cpus) {
+		argv[argc++] = "-c";
+		argv[argc++] = (char *)loop_cpus;
+	}
+	if (helper_cpus) {
+		argv[argc++] = "-T";
+		argv[argc++] = (char *)helper_cpus;
+	}
+	argv[argc] = NULL;
+
 	tapdisk = getenv("TAPDISK");
 	if (!tapdisk)
 		tapdisk = getenv("TAPDISK2");
 
 	if (tapdisk) {
-		execlp(tapdisk, tapdisk, NULL);
+		argv[0] = tapdisk;
+		execvp(tapdisk, argv);
 		exit(errno);
 	}
 
-	execl(TAPDISK_EXECDIR "/" TAPDISK_EXEC, TAPDISK_EXEC,
-	      NULL);
+	argv[0] = TAPDISK_EXEC;
+	execv(TAPDISK_EXECDIR "/" TAPDISK_EXEC, argv);
 
 	if (errno == ENOENT)
-		execl(TAPDISK_BUILDDIR "/" TAPDISK_EXEC, TAPDISK_EXEC,
-		      NULL);
+		execv(TAPDISK_BUILDDIR "/" TAPDISK_EXEC, argv);
 
 	exit(errno);
 }
@@ -160,7 +177,7 @@ tap_ctl_get_child_id(int readfd)
 }
 
 int
-tap_ctl_spawn(void)
+tap_ctl_spawn(int numa_node, const char *loop_cpus, const char *helper_cpus)
 {
 	pid_t child;
 	int err, id, readfd;
@@ -168,7 +185,7 @@ tap_ctl_spawn(void)
 	readfd = -1;
 
 again:
-	child = __tap_ctl_spawn(&readfd);
+	child = __tap_ctl_spawn(&readfd, numa_node, loop_cpus, helper_cpus);
 	if (child < 0)
 		return child;
 
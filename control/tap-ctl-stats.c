@@ -20,6 +20,7 @@
 #endif
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/mman.h>
@@ -155,3 +156,53 @@ out:
 
 	return err;
 }
+
+/*
+ * stats of all VBDs on @sfd, connected with tap_ctl_connect_id, which
+ * the tapdisk keeps open for the next call. *buf grows to fit.
+ */
+ssize_t
+tap_ctl_stats_keep(int sfd, char **buf, size_t *size,
+		   struct timeval *timeout)
+{
+	tapdisk_message_t message;
+	ssize_t len;
+	char *b;
+	int err;
+
+	memset(&message, 0, sizeof(message));
+	message.type         = TAPDISK_MESSAGE_STATS;
+	message.cookie       = (uint16_t)-1;
+	message.u.info.flags = TAPDISK_MESSAGE_STATS_KEEP;
+
+	err = tap_ctl_write_message(sfd, &message, timeout);
+	if (err)
+		return err;
+
+	err = tap_ctl_read_message(sfd, &message, timeout);
+	if (err)
+		return err;
+
+	if (message.type != TAPDISK_MESSAGE_STATS_RSP)
+		return -EPROTO;
+
+	len = message.u.info.length;
+	if (len < 0)
+		return len;
+
+	if (*size < len + 1) {
+		b = realloc(*buf, len + 1);
+		if (!b)
+			return -ENOMEM;
+		*buf  = b;
+		*size = len + 1;
+	}
+
+	err = tap_ctl_read_raw(sfd, *buf, len, timeout);
+	if (err)
+		return err;
+
+	(*buf)[len] = 0;
+
+	return len;
+}
@@ -0,0 +1,76 @@
+/*
+ * Copyright (C) Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2.1 only
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "tap-ctl.h"
+
+/*
+ * @flags TAPDISK_MESSAGE_SUBSCRIBE_*, @minor -1 for every VBD. On
+ * success, @sfd stays connected for tap_ctl_subscribe_next().
+ */
+int
+tap_ctl_subscribe(const int id, const int minor, int flags,
+		  unsigned int interval, int *sfd)
+{
+	int err;
+	tapdisk_message_t message;
+
+	err = tap_ctl_connect_id(id, sfd);
+	if (err)
+		return err;
+
+	memset(&message, 0, sizeof(message));
+	message.type = TAPDISK_MESSAGE_SUBSCRIBE;
+	message.cookie = minor;
+	message.u.subscribe.flags    = flags;
+	message.u.subscribe.interval = interval;
+
+	err = tap_ctl_send_and_receive(*sfd, &message, NULL);
+	if (err)
+		goto out;
+
+	if (message.type == TAPDISK_MESSAGE_SUBSCRIBE_RSP)
+		err = message.u.subscribe.error;
+	else {
+		err = EINVAL;
+		EPRINTF("got unexpected result '%s' from %d\n",
+			tapdisk_message_name(message.type), id);
+	}
+
+out:
+	if (err) {
+		close(*sfd);
+		*sfd = -1;
+	}
+
+	return err;
+}
+
+/* Blocks for the next EVENT or COUNTERS message pushed. */
+int
+tap_ctl_subscribe_next(int sfd, tapdisk_message_t *message)
+{
+	return tap_ctl_read_message(sfd, message, NULL);
+}
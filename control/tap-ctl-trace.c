@@ -0,0 +1,92 @@
+/*
+ * Copyright (C) Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2.1 only
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "tap-ctl.h"
+
+/*
+ * sets tracing in tapdisk @id on or off with TAPDISK_MESSAGE_TRACE_*
+ * @flags, 0 leaves it, and returns its trace buffers in *buf, to free()
+ */
+int
+tap_ctl_trace(const int id, int flags, void **buf, size_t *len)
+{
+	tapdisk_message_t message;
+	ssize_t length;
+	void *b;
+	int sfd, err;
+
+	*buf = NULL;
+	*len = 0;
+
+	err = tap_ctl_connect_id(id, &sfd);
+	if (err)
+		return err;
+
+	memset(&message, 0, sizeof(message));
+	message.type         = TAPDISK_MESSAGE_TRACE;
+	message.u.info.flags = flags;
+
+	err = tap_ctl_write_message(sfd, &message, NULL);
+	if (err)
+		goto out;
+
+	err = tap_ctl_read_message(sfd, &message, NULL);
+	if (err)
+		goto out;
+
+	if (message.type != TAPDISK_MESSAGE_TRACE_RSP) {
+		err = -EPROTO;
+		EPRINTF("got unexpected result '%s' from %d\n",
+			tapdisk_message_name(message.type), id);
+		goto out;
+	}
+
+	length = message.u.info.length;
+	if (length < 0) {
+		err = length;
+		goto out;
+	}
+
+	b = malloc(length ? : 1);
+	if (!b) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	err = tap_ctl_read_raw(sfd, b, length, NULL);
+	if (err) {
+		free(b);
+		goto out;
+	}
+
+	*buf = b;
+	*len = length;
+
+out:
+	close(sfd);
+	return err;
+}
@@ -28,6 +28,7 @@
 #include <sys/time.h>
 
 #include "tap-ctl.h"
+#include "tapdisk-trace.h"
 
 typedef int (*tap_ctl_func_t) (int, char **);
 
@@ -249,24 +250,33 @@ tap_cli_create_usage(FILE *stream)
 		"[-r turn on read caching into leaf node] [-2 <path> "
 		"use secondary image (in mirror mode if no -s)] [-s "
 		"fail over to the secondary image on ENOSPC] "
-		"[-t request timeout in seconds]\n");
+		"[-A mirror to the secondary asynchronously] "
+		"[-t request timeout in seconds] "
+		"[-b vhd bitmap cache size, in bitmaps] "
+		"[-L <depth> open parents from this depth on first use] "
+		"[-c <cpus> pin the event loop] "
+		"[-T <cpus> pin helper threads]\n");
 }
 
 static int
 tap_cli_create(int argc, char **argv)
 {
-	int c, err, flags, prt_minor, timeout;
-	char *args, *devname, *secondary;
+	int c, err, flags, prt_minor, timeout, bm_cache, lazy;
+	char *args, *devname, *secondary, *loop_cpus, *helper_cpus;
 
 	args      = NULL;
 	devname   = NULL;
 	secondary = NULL;
+	loop_cpus   = NULL;
+	helper_cpus = NULL;
 	prt_minor = -1;
 	flags     = 0;
 	timeout   = 0;
+	bm_cache  = 0;
+	lazy      = 0;
 
 	optind = 0;
-	while ((c = getopt(argc, argv, "a:Rd:e:r2:st:h")) != -1) {
+	while ((c = getopt(argc, argv, "a:Rd:e:r2:sAt:b:L:c:T:h")) != -1) {
 		switch (c) {
 		case 'a':
 			args = optarg;
@@ -291,9 +301,26 @@ tap_cli_create(int argc, char **argv)
 		case 's':
 			flags |= TAPDISK_MESSAGE_FLAG_STANDBY;
 			break;
+		case 'A':
+			flags |= TAPDISK_MESSAGE_FLAG_ASYNC;
+			break;
 		case 't':
 			timeout = atoi(optarg);
 			break;
+		case 'b':
+			bm_cache = atoi(optarg);
+			break;
+		case 'L':
+			lazy = atoi(optarg);
+			if (lazy < 0)
+				goto usage;
+			break;
+		case 'c':
+			loop_cpus = optarg;
+			break;
+		case 'T':
+			helper_cpus = optarg;
+			break;
 		case '?':
 			goto usage;
 		case 'h':
@@ -306,7 +333,7 @@ tap_cli_create(int argc, char **argv)
 		goto usage;
 
 	err = tap_ctl_create(args, &devname, flags, prt_minor, secondary,
-			timeout);
+			timeout, bm_cache, lazy, loop_cpus, helper_cpus);
 	if (!err)
 		printf("%s\n", devname);
 
@@ -383,18 +410,35 @@ usage:
 static void
 tap_cli_spawn_usage(FILE *stream)
 {
-	fprintf(stream, "usage: spawn\n");
+	fprintf(stream, "usage: spawn [-n numa node] [-c event loop cpus] "
+		"[-T helper thread cpus]\n");
 }
 
 static int
 tap_cli_spawn(int argc, char **argv)
 {
-	int c, tty;
+	int c, tty, node;
+	char *loop_cpus, *helper_cpus;
 	pid_t pid;
 
+	node        = -1;
+	loop_cpus   = NULL;
+	helper_cpus = NULL;
+
 	optind = 0;
-	while ((c = getopt(argc, argv, "h")) != -1) {
+	while ((c = getopt(argc, argv, "n:c:T:h")) != -1) {
 		switch (c) {
+		case 'n':
+			node = atoi(optarg);
+			if (node < 0)
+				goto usage;
+			break;
+		case 'c':
+			loop_cpus = optarg;
+			break;
+		case 'T':
+			helper_cpus = optarg;
+			break;
 		case '?':
 			goto usage;
 		case 'h':
@@ -403,7 +447,7 @@ tap_cli_spawn(int argc, char **argv)
 		}
 	}
 
-	pid = tap_ctl_spawn();
+	pid = tap_ctl_spawn(node, loop_cpus, helper_cpus);
 	if (pid < 0)
 		return pid;
 
@@ -554,20 +598,54 @@ usage:
 	return EINVAL;
 }
 
+/* several minors go out as one batch, per-minor errors on stderr */
+static int
+tap_cli_batch(int pid, int type, int *minors, int n,
+	      struct timeval *timeout)
+{
+	tapdisk_message_t messages[TAPDISK_MESSAGE_BATCH_MAX];
+	int i, err, rv;
+
+	memset(messages, 0, sizeof(messages));
+	for (i = 0; i < n; i++) {
+		messages[i].type   = type;
+		messages[i].cookie = minors[i];
+	}
+
+	err = tap_ctl_batch(pid, messages, n, 0, timeout);
+	if (err <= 0)
+		return -err;
+
+	rv = 0;
+	for (i = 0; i < n; i++) {
+		err = tap_ctl_batch_error(&messages[i]);
+		if (!err)
+			continue;
+
+		fprintf(stderr, "%s %d: %s\n", tapdisk_message_name(type),
+			minors[i], strerror(err));
+		rv = rv ? : err;
+	}
+
+	return rv;
+}
+
 static void
 tap_cli_pause_usage(FILE *stream)
 {
-	fprintf(stream, "usage: pause <-p pid> <-m minor>\n");
+	fprintf(stream, "usage: pause <-p pid> <-m minor> [-m minor ...]\n");
 }
 
 static int
 tap_cli_pause(int argc, char **argv)
 {
-	int c, pid, minor;
+	int c, pid, minor, n;
+	int minors[TAPDISK_MESSAGE_BATCH_MAX];
 	struct timeval *timeout;
 
 	pid     = -1;
 	minor   = -1;
+	n       = 0;
 	timeout = NULL;
 
 	optind = 0;
@@ -578,6 +656,9 @@ tap_cli_pause(int argc, char **argv)
 			break;
 		case 'm':
 			minor = atoi(optarg);
+			if (n == TAPDISK_MESSAGE_BATCH_MAX)
+				goto usage;
+			minors[n++] = minor;
 			break;
 		case 't':
 			timeout = tap_cli_timeout(optarg);
@@ -594,6 +675,10 @@ tap_cli_pause(int argc, char **argv)
 	if (pid == -1 || minor == -1)
 		goto usage;
 
+	if (n > 1)
+		return tap_cli_batch(pid, TAPDISK_MESSAGE_PAUSE,
+				     minors, n, timeout);
+
 	return tap_ctl_pause(pid, minor, timeout);
 
 usage:
@@ -605,7 +690,8 @@ static void
 tap_cli_unpause_usage(FILE *stream)
 {
 	fprintf(stream, "usage: unpause <-p pid> <-m minor> [-a args] "
-			"[-2 secondary]\n");
+			"[-2 secondary]\n"
+			"       unpause <-p pid> <-m minor> [-m minor ...]\n");
 }
 
 int
@@ -613,10 +699,12 @@ tap_cli_unpause(int argc, char **argv)
 {
 	const char *args;
 	char *secondary;
-	int c, pid, minor, flags;
+	int c, pid, minor, flags, n;
+	int minors[TAPDISK_MESSAGE_BATCH_MAX];
 
 	pid   = -1;
 	minor = -1;
+	n     = 0;
 	args  = NULL;
 	secondary = NULL;
 	flags = 0;
@@ -629,6 +717,9 @@ tap_cli_unpause(int argc, char **argv)
 			break;
 		case 'm':
 			minor = atoi(optarg);
+			if (n == TAPDISK_MESSAGE_BATCH_MAX)
+				goto usage;
+			minors[n++] = minor;
 			break;
 		case 'a':
 			args = optarg;
@@ -648,6 +739,13 @@ tap_cli_unpause(int argc, char **argv)
 	if (pid == -1 || minor == -1)
 		goto usage;
 
+	if (n > 1) {
+		if (args || secondary)
+			goto usage;
+		return tap_cli_batch(pid, TAPDISK_MESSAGE_RESUME,
+				     minors, n, NULL);
+	}
+
 	return tap_ctl_unpause(pid, minor, args, flags, secondary);
 
 usage:
@@ -656,80 +754,124 @@ usage:
 }
 
 static void
-tap_cli_major_usage(FILE *stream)
+tap_cli_poll_usage(FILE *stream)
 {
-	fprintf(stream, "usage: major [-h]\n");
+	fprintf(stream, "usage: poll <-p pid> <-m minor> <-u max_usecs>\n"
+		"  busy-poll the ring for up to max_usecs after requests "
+		"arrive, 0 disables\n");
 }
 
 static int
-tap_cli_major(int argc, char **argv)
+tap_cli_poll(int argc, char **argv)
 {
-	int c, chr, major;
+	int c, pid, minor, usecs;
 
-	chr = 0;
+	pid   = -1;
+	minor = -1;
+	usecs = -1;
 
-	while ((c = getopt(argc, argv, "bch")) != -1) {
+	optind = 0;
+	while ((c = getopt(argc, argv, "p:m:u:h")) != -1) {
 		switch (c) {
-		case 'b':
-			chr = 0;
+		case 'p':
+			pid = atoi(optarg);
 			break;
-		case 'c':
-			chr = 1;
+		case 'm':
+			minor = atoi(optarg);
+			break;
+		case 'u':
+			usecs = atoi(optarg);
 			break;
 		case '?':
 			goto usage;
 		case 'h':
-			tap_cli_major_usage(stdout);
+			tap_cli_poll_usage(stdout);
 			return 0;
-		default:
-			goto usage;
 		}
 	}
 
-	if (chr)
-		major = -EINVAL;
-	else
-		major = tap_ctl_blk_major();
+	if (pid == -1 || minor == -1 || usecs < 0)
+		goto usage;
 
-	if (major < 0)
-		return -major;
+	return tap_ctl_poll(pid, minor, usecs);
 
-	printf("%d\n", major);
+usage:
+	tap_cli_poll_usage(stderr);
+	return EINVAL;
+}
 
-	return 0;
+static void
+tap_cli_sched_usage(FILE *stream)
+{
+	fprintf(stream, "usage: sched <-p pid> <-m minor> [-s fifo|deadline] "
+		"[-w weight]\n"
+		"  weight scales queue depth, 100 is the default\n");
+}
+
+static int
+tap_cli_sched(int argc, char **argv)
+{
+	const char *policy;
+	int c, pid, minor, weight;
+
+	pid    = -1;
+	minor  = -1;
+	policy = NULL;
+	weight = 0;
+
+	optind = 0;
+	while ((c = getopt(argc, argv, "p:m:s:w:h")) != -1) {
+		switch (c) {
+		case 'p':
+			pid = atoi(optarg);
+			break;
+		case 'm':
+			minor = atoi(optarg);
+			break;
+		case 's':
+			policy = optarg;
+			break;
+		case 'w':
+			weight = atoi(optarg);
+			if (weight <= 0)
+				goto usage;
+			break;
+		case '?':
+			goto usage;
+		case 'h':
+			tap_cli_sched_usage(stdout);
+			return 0;
+		}
+	}
+
+	if (pid == -1 || minor == -1 || (!policy && !weight))
+		goto usage;
+
+	return tap_ctl_sched(pid, minor, policy, weight);
 
 usage:
-	tap_cli_major_usage(stderr);
+	tap_cli_sched_usage(stderr);
 	return EINVAL;
 }
 
 static void
-tap_cli_open_usage(FILE *stream)
+tap_cli_coalesce_usage(FILE *stream)
 {
-	fprintf(stream, "usage: open <-p pid> <-m minor> <-a args> [-R readonly] "
-		"[-e <minor> stack on existing tapdisk for the parent chain] "
-		"[-r turn on read caching into leaf node] [-2 <path> "
-		"use secondary image (in mirror mode if no -s)] [-s "
-		"fail over to the secondary image on ENOSPC] "
-		"[-t request timeout in seconds]\n");
+	fprintf(stream, "usage: coalesce <-p pid> <-m minor> [-r MiB/s]\n"
+		"  merges the parent of the leaf onto its own parent, live\n");
 }
 
 static int
-tap_cli_open(int argc, char **argv)
+tap_cli_coalesce(int argc, char **argv)
 {
-	const char *args, *secondary;
-	int c, pid, minor, flags, prt_minor, timeout;
+	int c, pid, minor, rate;
 
-	flags     = 0;
-	pid       = -1;
-	minor     = -1;
-	prt_minor = -1;
-	timeout   = 0;
-	args      = NULL;
-	secondary = NULL;
+	pid   = -1;
+	minor = -1;
+	rate  = 0;
 
 	optind = 0;
-	while ((c = getopt(argc, argv, "a:Rm:p:e:r2:st:h")) != -1) {
+	while ((c = getopt(argc, argv, "p:m:r:h")) != -1) {
 		switch (c) {
 		case 'p':
 			pid = atoi(optarg);
@@ -737,42 +879,1034 @@ tap_cli_open(int argc, char **argv)
 		case 'm':
 			minor = atoi(optarg);
 			break;
-		case 'a':
-			args = optarg;
+		case 'r':
+			rate = atoi(optarg);
+			if (rate < 0)
+				goto usage;
 			break;
-		case 'R':
-			flags |= TAPDISK_MESSAGE_FLAG_RDONLY;
+		case '?':
+			goto usage;
+		case 'h':
+			tap_cli_coalesce_usage(stdout);
+			return 0;
+		}
+	}
+
+	if (pid == -1 || minor == -1)
+		goto usage;
+
+	return tap_ctl_coalesce(pid, minor, rate);
+
+usage:
+	tap_cli_coalesce_usage(stderr);
+	return EINVAL;
+}
+
+static void
+tap_cli_migrate_usage(FILE *stream)
+{
+	fprintf(stream, "usage: migrate <-p pid> <-m minor> <-t type:/path> "
+		"[-r MiB/s]\n"
+		"  copies the disk onto the target live, then switches to it\n");
+}
+
+static int
+tap_cli_migrate(int argc, char **argv)
+{
+	int c, pid, minor, rate;
+	const char *target;
+
+	pid    = -1;
+	minor  = -1;
+	rate   = 0;
+	target = NULL;
+
+	optind = 0;
+	while ((c = getopt(argc, argv, "p:m:t:r:h")) != -1) {
+		switch (c) {
+		case 'p':
+			pid = atoi(optarg);
+			break;
+		case 'm':
+			minor = atoi(optarg);
+			break;
+		case 't':
+			target = optarg;
 			break;
 		case 'r':
-			flags |= TAPDISK_MESSAGE_FLAG_ADD_LCACHE;
+			rate = atoi(optarg);
+			if (rate < 0)
+				goto usage;
 			break;
-		case 'e':
-			flags |= TAPDISK_MESSAGE_FLAG_REUSE_PRT;
-			prt_minor = atoi(optarg);
+		case '?':
+			goto usage;
+		case 'h':
+			tap_cli_migrate_usage(stdout);
+			return 0;
+		}
+	}
+
+	if (pid == -1 || minor == -1 || !target)
+		goto usage;
+
+	return tap_ctl_migrate(pid, minor, target, rate);
+
+usage:
+	tap_cli_migrate_usage(stderr);
+	return EINVAL;
+}
+
+static void
+tap_cli_record_usage(FILE *stream)
+{
+	fprintf(stream, "usage: record <-p pid> <-m minor> "
+		"[-f file [-s MiB]]\n"
+		"  records the requests of the disk to a ring file of -s MiB "
+		"(default 64),\n"
+		"  for td-bench -r to replay; without -f, stops\n");
+}
+
+static int
+tap_cli_record(int argc, char **argv)
+{
+	int c, pid, minor, size;
+	const char *path;
+
+	pid   = -1;
+	minor = -1;
+	size  = 64;
+	path  = NULL;
+
+	optind = 0;
+	while ((c = getopt(argc, argv, "p:m:f:s:h")) != -1) {
+		switch (c) {
+		case 'p':
+			pid = atoi(optarg);
 			break;
-		case '2':
-			flags |= TAPDISK_MESSAGE_FLAG_SECONDARY;
-			secondary = optarg;
+		case 'm':
+			minor = atoi(optarg);
+			break;
+		case 'f':
+			path = optarg;
 			break;
 		case 's':
-			flags |= TAPDISK_MESSAGE_FLAG_STANDBY;
+			size = atoi(optarg);
+			if (size <= 0)
+				goto usage;
 			break;
-		case 't':
-			timeout = atoi(optarg);
+		case '?':
+			goto usage;
+		case 'h':
+			tap_cli_record_usage(stdout);
+			return 0;
+		}
+	}
+
+	if (pid == -1 || minor == -1)
+		goto usage;
+
+	return tap_ctl_record(pid, minor, path, path ? size : 0);
+
+usage:
+	tap_cli_record_usage(stderr);
+	return EINVAL;
+}
+
+static void
+tap_cli_ring_usage(FILE *stream)
+{
+	fprintf(stream, "usage: ring <-p pid> <-m minor> "
+		"[-f location [-n slots] [-s MiB] [-P usecs]]\n"
+		"  serves the disk to a userspace client on a shared ring at "
+		"location.shm\n"
+		"  and location.cfd, of -n slots (default 256) and -s MiB of "
+		"data (default 16),\n"
+		"  busy-polling up to -P usecs; without -f, stops\n");
+}
+
+static int
+tap_cli_ring(int argc, char **argv)
+{
+	int c, pid, minor, slots, size, poll_us;
+	const char *path;
+
+	pid     = -1;
+	minor   = -1;
+	slots   = 256;
+	size    = 16;
+	poll_us = 0;
+	path    = NULL;
+
+	optind = 0;
+	while ((c = getopt(argc, argv, "p:m:f:n:s:P:h")) != -1) {
+		switch (c) {
+		case 'p':
+			pid = atoi(optarg);
+			break;
+		case 'm':
+			minor = atoi(optarg);
+			break;
+		case 'f':
+			path = optarg;
+			break;
+		case 'n':
+			slots = atoi(optarg);
+			if (slots <= 0)
+				goto usage;
+			break;
+		case 's':
+			size = atoi(optarg);
+			if (size <= 0)
+				goto usage;
+			break;
+		case 'P':
+			poll_us = atoi(optarg);
+			if (poll_us < 0)
+				goto usage;
 			break;
 		case '?':
 			goto usage;
 		case 'h':
-			tap_cli_open_usage(stdout);
+			tap_cli_ring_usage(stdout);
 			return 0;
 		}
 	}
 
-	if (pid == -1 || minor == -1 || !args)
+	if (pid == -1 || minor == -1)
 		goto usage;
 
-	return tap_ctl_open(pid, minor, args, flags, prt_minor, secondary,
-			timeout);
+	return tap_ctl_ring(pid, minor, path, slots, path ? size : 0, poll_us);
+
+usage:
+	tap_cli_ring_usage(stderr);
+	return EINVAL;
+}
+
+#define TAP_CLI_HEADROOM_HOLD_MS 5000
+
+static void
+tap_cli_headroom_usage(FILE *stream)
+{
+	fprintf(stream, "usage: headroom <-p pid> <-m minor> "
+		"[-l lead_secs [-H hold_ms]] [-w]\n"
+		"  -l warns lead_secs before the leaf fills up at its "
+		"allocation rate, 0 stops;\n"
+		"  ENOSPC writes are held up to hold_ms meanwhile "
+		"(default %d). -w waits for\n"
+		"  headroom to run low. Prints the headroom.\n",
+		TAP_CLI_HEADROOM_HOLD_MS);
+}
+
+static int
+tap_cli_headroom(int argc, char **argv)
+{
+	tapdisk_message_headroom_t hr;
+	int c, pid, minor, lead, hold, flags, err;
+
+	pid   = -1;
+	minor = -1;
+	lead  = -1;
+	hold  = TAP_CLI_HEADROOM_HOLD_MS;
+	flags = 0;
+
+	optind = 0;
+	while ((c = getopt(argc, argv, "p:m:l:H:wh")) != -1) {
+		switch (c) {
+		case 'p':
+			pid = atoi(optarg);
+			break;
+		case 'm':
+			minor = atoi(optarg);
+			break;
+		case 'l':
+			lead = atoi(optarg);
+			if (lead < 0)
+				goto usage;
+			flags |= TAPDISK_MESSAGE_HEADROOM_SET;
+			break;
+		case 'H':
+			hold = atoi(optarg);
+			if (hold < 0)
+				goto usage;
+			break;
+		case 'w':
+			flags |= TAPDISK_MESSAGE_HEADROOM_WAIT;
+			break;
+		case '?':
+			goto usage;
+		case 'h':
+			tap_cli_headroom_usage(stdout);
+			return 0;
+		}
+	}
+
+	if (pid == -1 || minor == -1)
+		goto usage;
+
+	err = tap_ctl_headroom(pid, minor, flags, lead, hold, &hr);
+	if (err)
+		return err;
+
+	printf("lead_s=%u hold_ms=%u space=%lld rate=%llu low=%u events=%llu\n",
+	       hr.lead_s, hr.hold_ms, (long long)hr.space,
+	       (unsigned long long)hr.rate, hr.low,
+	       (unsigned long long)hr.events);
+
+	return 0;
+
+usage:
+	tap_cli_headroom_usage(stderr);
+	return EINVAL;
+}
+
+static void
+tap_cli_heat_usage(FILE *stream)
+{
+	fprintf(stream, "usage: heat <-p pid> <-m minor> [-e] [-D shift] "
+		"[-f file] [-d]\n"
+		"  counts reads and writes of every 2 MiB block of the disk "
+		"from -e on;\n"
+		"  -D halves the counts shift times, -f saves the map to "
+		"file, -d stops.\n"
+		"  Prints the blocks of the map, and how many were hit.\n");
+}
+
+static int
+tap_cli_heat(int argc, char **argv)
+{
+	tapdisk_message_heat_t heat;
+	int c, pid, minor, decay, flags, err;
+	const char *path;
+
+	pid   = -1;
+	minor = -1;
+	decay = 0;
+	flags = 0;
+	path  = NULL;
+
+	optind = 0;
+	while ((c = getopt(argc, argv, "p:m:eD:f:dh")) != -1) {
+		switch (c) {
+		case 'p':
+			pid = atoi(optarg);
+			break;
+		case 'm':
+			minor = atoi(optarg);
+			break;
+		case 'e':
+			flags |= TAPDISK_MESSAGE_HEAT_START;
+			break;
+		case 'D':
+			decay = atoi(optarg);
+			if (decay <= 0)
+				goto usage;
+			flags |= TAPDISK_MESSAGE_HEAT_DECAY;
+			break;
+		case 'f':
+			path = optarg;
+			flags |= TAPDISK_MESSAGE_HEAT_SNAPSHOT;
+			break;
+		case 'd':
+			flags |= TAPDISK_MESSAGE_HEAT_STOP;
+			break;
+		case '?':
+			goto usage;
+		case 'h':
+			tap_cli_heat_usage(stdout);
+			return 0;
+		}
+	}
+
+	if (pid == -1 || minor == -1)
+		goto usage;
+
+	err = tap_ctl_heat(pid, minor, flags, decay, path, &heat);
+	if (err)
+		return err;
+
+	printf("blocks=%llu hot=%llu\n",
+	       (unsigned long long)heat.blocks,
+	       (unsigned long long)heat.hot);
+
+	return 0;
+
+usage:
+	tap_cli_heat_usage(stderr);
+	return EINVAL;
+}
+
+#define TAP_CLI_WARM_RATE 16
+
+static void
+tap_cli_warm_usage(FILE *stream)
+{
+	fprintf(stream, "usage: warm <-p pid> <-m minor> [-f file "
+		"[-s MiB] [-r MiB/s]]\n"
+		"  reads the hottest blocks of heat map file ahead into the "
+		"caches, up to\n"
+		"  -s MiB of them (default all), at -r MiB/s (default %d, "
+		"0 unlimited),\n"
+		"  while the disk is otherwise idle; without -f, stops\n",
+		TAP_CLI_WARM_RATE);
+}
+
+static int
+tap_cli_warm(int argc, char **argv)
+{
+	int c, pid, minor, size, rate, err;
+	const char *path;
+	uint64_t blocks;
+
+	pid   = -1;
+	minor = -1;
+	size  = 0;
+	rate  = TAP_CLI_WARM_RATE;
+	path  = NULL;
+
+	optind = 0;
+	while ((c = getopt(argc, argv, "p:m:f:s:r:h")) != -1) {
+		switch (c) {
+		case 'p':
+			pid = atoi(optarg);
+			break;
+		case 'm':
+			minor = atoi(optarg);
+			break;
+		case 'f':
+			path = optarg;
+			break;
+		case 's':
+			size = atoi(optarg);
+			if (size < 0)
+				goto usage;
+			break;
+		case 'r':
+			rate = atoi(optarg);
+			if (rate < 0)
+				goto usage;
+			break;
+		case '?':
+			goto usage;
+		case 'h':
+			tap_cli_warm_usage(stdout);
+			return 0;
+		}
+	}
+
+	if (pid == -1 || minor == -1)
+		goto usage;
+
+	err = tap_ctl_warm(pid, minor, path, size, rate, &blocks);
+	if (err)
+		return err;
+
+	if (path)
+		printf("blocks=%llu\n", (unsigned long long)blocks);
+
+	return 0;
+
+usage:
+	tap_cli_warm_usage(stderr);
+	return EINVAL;
+}
+
+static void
+tap_cli_subscribe_usage(FILE *stream)
+{
+	fprintf(stream, "usage: subscribe <-p pid> [-m minor] [-e] "
+		"[-s secs]\n"
+		"  prints VBD events (-e) and, every secs, the counters "
+		"changed since (-s),\n"
+		"  of one VBD or all, as they are pushed. Runs until "
+		"tapdisk goes away.\n");
+}
+
+static int
+tap_cli_subscribe(int argc, char **argv)
+{
+	tapdisk_message_t message;
+	tapdisk_message_counters_t *c;
+	tapdisk_message_event_t *ev;
+	int opt, pid, minor, secs, flags, sfd, err;
+
+	pid   = -1;
+	minor = -1;
+	secs  = 0;
+	flags = 0;
+
+	optind = 0;
+	while ((opt = getopt(argc, argv, "p:m:es:h")) != -1) {
+		switch (opt) {
+		case 'p':
+			pid = atoi(optarg);
+			break;
+		case 'm':
+			minor = atoi(optarg);
+			break;
+		case 'e':
+			flags |= TAPDISK_MESSAGE_SUBSCRIBE_EVENTS;
+			break;
+		case 's':
+			secs = atoi(optarg);
+			if (secs <= 0)
+				goto usage;
+			flags |= TAPDISK_MESSAGE_SUBSCRIBE_COUNTERS;
+			break;
+		case '?':
+			goto usage;
+		case 'h':
+			tap_cli_subscribe_usage(stdout);
+			return 0;
+		}
+	}
+
+	if (pid == -1 || !flags)
+		goto usage;
+
+	err = tap_ctl_subscribe(pid, minor, flags, secs, &sfd);
+	if (err)
+		return err;
+
+	while (!(err = tap_ctl_subscribe_next(sfd, &message))) {
+		switch (message.type) {
+		case TAPDISK_MESSAGE_EVENT:
+			ev = &message.u.event;
+			printf("minor=%d event=%s error=%d state=0x%x "
+			       "count=%u seq=%llu dropped=%llu\n",
+			       message.cookie, tapdisk_event_name(ev->event),
+			       ev->error, ev->state, ev->count,
+			       (unsigned long long)ev->seq,
+			       (unsigned long long)ev->dropped);
+			break;
+		case TAPDISK_MESSAGE_COUNTERS:
+			c = &message.u.counters;
+			printf("minor=%d state=0x%x inflight=%u/%u "
+			       "received=%llu returned=%llu errors=%llu "
+			       "retries=%llu rd_secs=%llu wr_secs=%llu "
+			       "zero_secs=%llu flushes=%llu held=%llu "
+			       "expired=%llu dropped=%u\n",
+			       message.cookie, c->state,
+			       c->inflight[0], c->inflight[1],
+			       (unsigned long long)c->received,
+			       (unsigned long long)c->returned,
+			       (unsigned long long)c->errors,
+			       (unsigned long long)c->retries,
+			       (unsigned long long)c->secs[0],
+			       (unsigned long long)c->secs[1],
+			       (unsigned long long)c->zero_secs,
+			       (unsigned long long)c->flushes,
+			       (unsigned long long)c->held,
+			       (unsigned long long)c->expired,
+			       c->dropped);
+			break;
+		}
+		fflush(stdout);
+	}
+
+	close(sfd);
+	return err == -EIO ? 0 : err;
+
+usage:
+	tap_cli_subscribe_usage(stderr);
+	return EINVAL;
+}
+
+static void
+tap_cli_trace_usage(FILE *stream)
+{
+	fprintf(stream, "usage: trace <-p pid> [-e|-d] [-o file|-s]\n"
+		"  turns the hot-path trace on (-e) or off (-d), and dumps "
+		"it: as text,\n"
+		"  raw to a file (-o), or as latencies between tracepoints "
+		"(-s)\n");
+}
+
+static int
+tap_cli_trace_cmp(const void *_a, const void *_b)
+{
+	const struct td_trace_rec *a = _a, *b = _b;
+
+	if (a->id != b->id)
+		return a->id < b->id ? -1 : 1;
+	return a->ts < b->ts ? -1 : a->ts > b->ts;
+}
+
+static int
+tap_cli_trace_ull_cmp(const void *_a, const void *_b)
+{
+	const unsigned long long *a = _a, *b = _b;
+
+	return *a < *b ? -1 : *a > *b;
+}
+
+static void
+tap_cli_trace_stage(const char *name, unsigned long long *lat, size_t n)
+{
+	if (!n)
+		return;
+
+	qsort(lat, n, sizeof(*lat), tap_cli_trace_ull_cmp);
+	printf("%-18s n %8zu  p50 %10llu  p99 %10llu  p999 %10llu  "
+	       "max %10llu ns\n", name, n, lat[n / 2], lat[n * 99 / 100],
+	       lat[n * 999 / 1000], lat[n - 1]);
+}
+
+/*
+ * Time from each point to the next one of the same id, by pair of
+ * points. Going backwards means the id was reused, and is skipped.
+ */
+static int
+tap_cli_trace_summary(struct td_trace_rec *recs, size_t n)
+{
+	unsigned long long *lat[TD_TRACE_POINTS][TD_TRACE_POINTS];
+	size_t cnt[TD_TRACE_POINTS][TD_TRACE_POINTS];
+	struct td_trace_rec *prev;
+	char name[32];
+	size_t i;
+	int f, t;
+
+	memset(lat, 0, sizeof(lat));
+	memset(cnt, 0, sizeof(cnt));
+
+	qsort(recs, n, sizeof(*recs), tap_cli_trace_cmp);
+
+	for (i = 1; i < n; i++) {
+		prev = &recs[i - 1];
+		f    = prev->point;
+		t    = recs[i].point;
+
+		if (prev->id != recs[i].id ||
+		    t <= f || t >= TD_TRACE_POINTS)
+			continue;
+
+		if (!lat[f][t]) {
+			lat[f][t] = malloc(n * sizeof(**lat[f]));
+			if (!lat[f][t])
+				return ENOMEM;
+		}
+
+		lat[f][t][cnt[f][t]++] = recs[i].ts - prev->ts;
+	}
+
+	for (f = 0; f < TD_TRACE_POINTS; f++)
+		for (t = 0; t < TD_TRACE_POINTS; t++) {
+			snprintf(name, sizeof(name), "%s-%s",
+				 td_trace_point_name(f), td_trace_point_name(t));
+			tap_cli_trace_stage(name, lat[f][t], cnt[f][t]);
+			free(lat[f][t]);
+		}
+
+	return 0;
+}
+
+static int
+tap_cli_trace_print(void *buf, size_t len, int summary)
+{
+	struct td_trace_header *hdr = buf;
+	struct td_trace_thread *th;
+	struct td_trace_rec *r, *all;
+	size_t total, n;
+	void *p, *end;
+	unsigned int i;
+	int err;
+
+	end = buf + len;
+
+	if (len < sizeof(*hdr) || hdr->magic != TD_TRACE_MAGIC ||
+	    hdr->version != TD_TRACE_VERSION ||
+	    hdr->rec_size != sizeof(struct td_trace_rec)) {
+		fprintf(stderr, "bad trace dump\n");
+		return EINVAL;
+	}
+
+	all   = NULL;
+	total = 0;
+	if (summary) {
+		all = malloc(len);
+		if (!all)
+			return ENOMEM;
+	}
+
+	printf("tracing %s, %u threads\n",
+	       hdr->enabled ? "on" : "off", hdr->threads);
+
+	p = hdr + 1;
+	for (i = 0; i < hdr->threads; i++) {
+		th = p;
+		r  = (void *)(th + 1);
+		p  = r + th->count;
+		if (p > end) {
+			fprintf(stderr, "truncated trace dump\n");
+			free(all);
+			return EINVAL;
+		}
+
+		printf("thread %u: %u records, %llu lost\n",
+		       th->tid, th->count, (unsigned long long)th->lost);
+
+		if (summary) {
+			memcpy(all + total, r, th->count * sizeof(*r));
+			total += th->count;
+			continue;
+		}
+
+		for (n = 0; n < th->count; n++, r++)
+			printf("%llu.%09llu %-8s %c %llu+%u err %d id 0x%llx\n",
+			       (unsigned long long)r->ts / 1000000000,
+			       (unsigned long long)r->ts % 1000000000,
+			       td_trace_point_name(r->point),
+			       r->op ? 'w' : 'r',
+			       (unsigned long long)r->sec, r->secs, r->err,
+			       (unsigned long long)r->id);
+	}
+
+	err = 0;
+	if (summary)
+		err = tap_cli_trace_summary(all, total);
+
+	free(all);
+	return err;
+}
+
+static int
+tap_cli_trace(int argc, char **argv)
+{
+	int c, pid, flags, summary, err;
+	const char *out;
+	void *buf;
+	size_t len;
+	FILE *f;
+
+	pid     = -1;
+	flags   = 0;
+	summary = 0;
+	out     = NULL;
+
+	optind = 0;
+	while ((c = getopt(argc, argv, "p:edo:sh")) != -1) {
+		switch (c) {
+		case 'p':
+			pid = atoi(optarg);
+			break;
+		case 'e':
+			flags = TAPDISK_MESSAGE_TRACE_ON;
+			break;
+		case 'd':
+			flags = TAPDISK_MESSAGE_TRACE_OFF;
+			break;
+		case 'o':
+			out = optarg;
+			break;
+		case 's':
+			summary = 1;
+			break;
+		case '?':
+			goto usage;
+		case 'h':
+			tap_cli_trace_usage(stdout);
+			return 0;
+		}
+	}
+
+	if (pid == -1 || (out && summary))
+		goto usage;
+
+	err = tap_ctl_trace(pid, flags, &buf, &len);
+	if (err)
+		return err;
+
+	if (out) {
+		f = fopen(out, "w");
+		if (!f) {
+			err = errno;
+			goto done;
+		}
+		if (fwrite(buf, len, 1, f) != 1 && len)
+			err = errno;
+		if (fclose(f) && !err)
+			err = errno;
+	} else if (!flags || summary)
+		err = tap_cli_trace_print(buf, len, summary);
+
+done:
+	free(buf);
+	return err;
+
+usage:
+	tap_cli_trace_usage(stderr);
+	return EINVAL;
+}
+
+static void
+tap_cli_cache_usage(FILE *stream)
+{
+	fprintf(stream, "usage: cache <-p pid> [-s MiB] [-H|-P] [-d on|off]\n"
+		"  sets the block cache budget, for the host (-H) "
+		"or the process (-P)\n"
+		"  -d  holds identical blocks once in the caches of the "
+		"process\n");
+}
+
+static int
+tap_cli_cache(int argc, char **argv)
+{
+	int c, pid, size, flags, dedup, err;
+	char buf[TAPDISK_MESSAGE_STRING_LENGTH];
+
+	pid   = -1;
+	size  = 0;
+	flags = 0;
+	dedup = 0;
+
+	optind = 0;
+	while ((c = getopt(argc, argv, "p:s:HPd:h")) != -1) {
+		switch (c) {
+		case 'p':
+			pid = atoi(optarg);
+			break;
+		case 's':
+			size = atoi(optarg);
+			if (size <= 0)
+				goto usage;
+			break;
+		case 'H':
+			flags = TAPDISK_MESSAGE_CACHE_HOST;
+			break;
+		case 'P':
+			flags = TAPDISK_MESSAGE_CACHE_PROCESS;
+			break;
+		case 'd':
+			if (!strcmp(optarg, "on"))
+				dedup = TAPDISK_MESSAGE_CACHE_DEDUP;
+			else if (!strcmp(optarg, "off"))
+				dedup = TAPDISK_MESSAGE_CACHE_NODEDUP;
+			else
+				goto usage;
+			break;
+		case '?':
+			goto usage;
+		case 'h':
+			tap_cli_cache_usage(stdout);
+			return 0;
+		}
+	}
+
+	if (pid == -1)
+		goto usage;
+
+	err = tap_ctl_cache(pid, size, flags | dedup, buf, sizeof(buf));
+	if (!err)
+		printf("%s\n", buf);
+
+	return err;
+
+usage:
+	tap_cli_cache_usage(stderr);
+	return EINVAL;
+}
+
+static void
+tap_cli_pool_usage(FILE *stream)
+{
+	fprintf(stream, "usage: pool [-n size]\n"
+		"  keeps size idle tapdisks spawned for create, "
+		"0 shuts them down\n");
+}
+
+static int
+tap_cli_pool(int argc, char **argv)
+{
+	int c, i, n, size, err;
+	int ids[64];
+
+	size = -1;
+
+	optind = 0;
+	while ((c = getopt(argc, argv, "n:h")) != -1) {
+		switch (c) {
+		case 'n':
+			size = atoi(optarg);
+			if (size < 0)
+				goto usage;
+			break;
+		case '?':
+			goto usage;
+		case 'h':
+			tap_cli_pool_usage(stdout);
+			return 0;
+		}
+	}
+
+	if (size >= 0) {
+		err = tap_ctl_pool_set_size(size);
+		if (!err)
+			err = tap_ctl_pool_fill();
+		if (err < 0)
+			return -err;
+	}
+
+	n = tap_ctl_pool_idle(ids, 64);
+
+	printf("size=%d idle=%d", tap_ctl_pool_get_size(), n);
+	for (i = 0; i < n && i < 64; i++)
+		printf(" %d", ids[i]);
+	printf("\n");
+
+	return 0;
+
+usage:
+	tap_cli_pool_usage(stderr);
+	return EINVAL;
+}
+
+static void
+tap_cli_major_usage(FILE *stream)
+{
+	fprintf(stream, "usage: major [-h]\n");
+}
+
+static int
+tap_cli_major(int argc, char **argv)
+{
+	int c, chr, major;
+
+	chr = 0;
+
+	while ((c = getopt(argc, argv, "bch")) != -1) {
+		switch (c) {
+		case 'b':
+			chr = 0;
+			break;
+		case 'c':
+			chr = 1;
+			break;
+		case '?':
+			goto usage;
+		case 'h':
+			tap_cli_major_usage(stdout);
+			return 0;
+		default:
+			goto usage;
+		}
+	}
+
+	if (chr)
+		major = -EINVAL;
+	else
+		major = tap_ctl_blk_major();
+
+	if (major < 0)
+		return -major;
+
+	printf("%d\n", major);
+
+	return 0;
+
+usage:
+	tap_cli_major_usage(stderr);
+	return EINVAL;
+}
+
+static void
+tap_cli_open_usage(FILE *stream)
+{
+	fprintf(stream, "usage: open <-p pid> <-m minor> <-a args> [-R readonly] "
+		"[-e <minor> stack on existing tapdisk for the parent chain] "
+		"[-r turn on read caching into leaf node] [-2 <path> "
+		"use secondary image (in mirror mode if no -s)] [-s "
+		"fail over to the secondary image on ENOSPC] "
+		"[-A mirror to the secondary asynchronously] "
+		"[-t request timeout in seconds] "
+		"[-b vhd bitmap cache size, in bitmaps] "
+		"[-L <depth> open parents from this depth on first use] "
+		"[-W <file> warm the caches from a heat map, see warm]\n");
+}
+
+static int
+tap_cli_open(int argc, char **argv)
+{
+	const char *args, *secondary, *heat;
+	int c, pid, minor, flags, prt_minor, timeout, bm_cache, lazy, err;
+
+	flags     = 0;
+	pid       = -1;
+	minor     = -1;
+	prt_minor = -1;
+	timeout   = 0;
+	bm_cache  = 0;
+	args      = NULL;
+	secondary = NULL;
+	heat      = NULL;
+	lazy      = 0;
+
+	optind = 0;
+	while ((c = getopt(argc, argv, "a:Rm:p:e:r2:sAt:b:L:W:h")) != -1) {
+		switch (c) {
+		case 'p':
+			pid = atoi(optarg);
+			break;
+		case 'm':
+			minor = atoi(optarg);
+			break;
+		case 'a':
+			args = optarg;
+			break;
+		case 'R':
+			flags |= TAPDISK_MESSAGE_FLAG_RDONLY;
+			break;
+		case 'r':
+			flags |= TAPDISK_MESSAGE_FLAG_ADD_LCACHE;
+			break;
+		case 'e':
+			flags |= TAPDISK_MESSAGE_FLAG_REUSE_PRT;
+			prt_minor = atoi(optarg);
+			break;
+		case '2':
+			flags |= TAPDISK_MESSAGE_FLAG_SECONDARY;
+			secondary = optarg;
+			break;
+		case 's':
+			flags |= TAPDISK_MESSAGE_FLAG_STANDBY;
+			break;
+		case 'A':
+			flags |= TAPDISK_MESSAGE_FLAG_ASYNC;
+			break;
+		case 't':
+			timeout = atoi(optarg);
+			break;
+		case 'b':
+			bm_cache = atoi(optarg);
+			break;
+		case 'L':
+			lazy = atoi(optarg);
+			if (lazy < 0)
+				goto usage;
+			break;
+		case 'W':
+			heat = optarg;
+			break;
+		case '?':
+			goto usage;
+		case 'h':
+			tap_cli_open_usage(stdout);
+			return 0;
+		}
+	}
+
+	if (pid == -1 || minor == -1 || !args)
+		goto usage;
+
+	err = tap_ctl_open(pid, minor, args, flags, prt_minor, secondary,
+			   timeout, bm_cache, lazy);
+	if (err || !heat)
+		return err;
+
+	/* a stale or missing snapshot leaves the disk open, just cold */
+	err = tap_ctl_warm(pid, minor, heat, 0, TAP_CLI_WARM_RATE, NULL);
+	if (err)
+		fprintf(stderr, "warm-up from %s failed: %d\n", heat, err);
+
+	return 0;
 
 usage:
 	tap_cli_open_usage(stderr);
@@ -867,6 +2001,19 @@ struct command commands[] = {
 	{ .name = "pause",        .func = tap_cli_pause         },
 	{ .name = "unpause",      .func = tap_cli_unpause       },
 	{ .name = "stats",        .func = tap_cli_stats         },
+	{ .name = "poll",         .func = tap_cli_poll          },
+	{ .name = "sched",        .func = tap_cli_sched         },
+	{ .name = "coalesce",     .func = tap_cli_coalesce      },
+	{ .name = "migrate",      .func = tap_cli_migrate       },
+	{ .name = "cache",        .func = tap_cli_cache         },
+	{ .name = "trace",        .func = tap_cli_trace         },
+	{ .name = "record",       .func = tap_cli_record        },
+	{ .name = "ring",         .func = tap_cli_ring          },
+	{ .name = "headroom",     .func = tap_cli_headroom      },
+	{ .name = "subscribe",    .func = tap_cli_subscribe     },
+	{ .name = "heat",         .func = tap_cli_heat          },
+	{ .name = "warm",         .func = tap_cli_warm          },
+	{ .name = "pool",         .func = tap_cli_pool          },
 	{ .name = "major",        .func = tap_cli_major         },
 	{ .name = "check",        .func = tap_cli_check         },
 };
@@ -0,0 +1,774 @@
+/*
+ * Copyright (C) Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2.1 only
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Prometheus exporter: polls the stats of every tapdisk on the host,
+ * over control connections kept open, and serves them over HTTP in
+ * the text exposition format.
+ *
+ * Metric names follow the stats: tapdisk_<key>_<key>..., labeled by
+ * tapdisk pid and vbd name. Array elements are labeled by the key of
+ * the array, with the element's "name", else its index. Strings other
+ * than names are left out, booleans are 0/1.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <signal.h>
+#include <glob.h>
+#include <ctype.h>
+#include <netdb.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "tap-ctl.h"
+#include "blktap2.h"
+
+#define MIN(a, b)                ((a) < (b) ? (a) : (b))
+#define MAX(a, b)                ((a) > (b) ? (a) : (b))
+
+#define TAP_EXPORTER_PORT        "9180"
+#define TAP_EXPORTER_INTERVAL    10	/* s */
+#define TAP_EXPORTER_TIMEOUT     2	/* s, per tapdisk */
+#define TAP_EXPORTER_CLIENTS     16
+#define TAP_EXPORTER_LABELS      8
+#define TAP_EXPORTER_NAME_MAX    128
+
+struct tap_exporter_disk {
+	int                      id;
+	int                      sfd;
+	int                      seen;
+	struct list_head         entry;
+};
+
+struct tap_exporter_sample {
+	char                    *name;
+	char                    *line;
+	int                      seq;
+};
+
+struct tap_exporter_label {
+	char                     name[TAP_EXPORTER_NAME_MAX];
+	char                     value[TAP_EXPORTER_NAME_MAX];
+};
+
+struct tap_exporter {
+	struct list_head         disks;
+	char                    *buf;
+	size_t                   bufsz;
+
+	struct tap_exporter_sample *samples;
+	int                      n_samples;
+	int                      max_samples;
+
+	/* while parsing */
+	const char              *pos;
+	struct tap_exporter_label labels[TAP_EXPORTER_LABELS];
+	int                      n_labels;
+
+	/* what we serve */
+	char                    *page;
+	size_t                   page_len;
+
+	int                      sock;
+	int                      clients[TAP_EXPORTER_CLIENTS];
+};
+
+static void
+usage(FILE *stream)
+{
+	fprintf(stream,
+		"usage: tap-exporter [-h] [-l [<addr>:]<port>] "
+		"[-i <interval s>] [-f]\n");
+}
+
+static void
+tap_exporter_sanitize(char *s)
+{
+	for (; *s; s++)
+		if (!isalnum((unsigned char)*s) && *s != '_')
+			*s = '_';
+}
+
+static int
+tap_exporter_add_sample(struct tap_exporter *x, const char *name,
+			const char *value)
+{
+	struct tap_exporter_sample *s;
+	char labels[TAP_EXPORTER_LABELS * 2 * TAP_EXPORTER_NAME_MAX];
+	int i, n;
+
+	if (x->n_samples == x->max_samples) {
+		int max = x->max_samples ? x->max_samples * 2 : 256;
+
+		s = realloc(x->samples, max * sizeof(*s));
+		if (!s)
+			return -ENOMEM;
+
+		x->samples     = s;
+		x->max_samples = max;
+	}
+
+	labels[0] = 0;
+	for (i = n = 0; i < x->n_labels; i++)
+		n += snprintf(labels + n, sizeof(labels) - n, "%s%s=\"%s\"",
+			      i ? "," : "", x->labels[i].name,
+			      x->labels[i].value);
+
+	s = &x->samples[x->n_samples];
+
+	s->name = strdup(name);
+	if (!s->name)
+		return -ENOMEM;
+
+	if (asprintf(&s->line, "%s{%s} %s\n", name, labels, value) < 0) {
+		free(s->name);
+		return -ENOMEM;
+	}
+
+	s->seq = x->n_samples++;
+
+	return 0;
+}
+
+static void
+tap_exporter_skip_ws(struct tap_exporter *x)
+{
+	while (isspace((unsigned char)*x->pos))
+		x->pos++;
+}
+
+/* a JSON string into @s, without escapes kept */
+static int
+tap_exporter_parse_string(struct tap_exporter *x, char *s, size_t size)
+{
+	size_t n = 0;
+
+	if (*x->pos != '"')
+		return -EINVAL;
+
+	for (x->pos++; *x->pos && *x->pos != '"'; x->pos++) {
+		char c = *x->pos;
+
+		if (c == '\\' && x->pos[1])
+			c = *++x->pos;
+
+		/* label values: no quotes or backslashes */
+		if (c == '"' || c == '\\' || c == '\n')
+			c = '_';
+
+		if (n + 1 < size)
+			s[n++] = c;
+	}
+
+	if (*x->pos != '"')
+		return -EINVAL;
+
+	x->pos++;
+	s[n] = 0;
+
+	return 0;
+}
+
+static int tap_exporter_parse_value(struct tap_exporter *, const char *);
+
+static int
+tap_exporter_parse_object(struct tap_exporter *x, const char *prefix)
+{
+	char key[TAP_EXPORTER_NAME_MAX], name[TAP_EXPORTER_NAME_MAX * 4];
+	int err;
+
+	x->pos++;
+
+	for (;;) {
+		tap_exporter_skip_ws(x);
+
+		if (*x->pos == '}') {
+			x->pos++;
+			return 0;
+		}
+
+		err = tap_exporter_parse_string(x, key, sizeof(key));
+		if (err)
+			return err;
+
+		tap_exporter_sanitize(key);
+
+		tap_exporter_skip_ws(x);
+		if (*x->pos++ != ':')
+			return -EINVAL;
+
+		snprintf(name, sizeof(name), "%s_%s", prefix, key);
+
+		err = tap_exporter_parse_value(x, name);
+		if (err)
+			return err;
+
+		tap_exporter_skip_ws(x);
+		if (*x->pos == ',')
+			x->pos++;
+	}
+}
+
+/* the "name" of the object at x->pos, if any, to label it by */
+static int
+tap_exporter_object_name(struct tap_exporter *x, char *s, size_t size)
+{
+	const char *p = x->pos, *end;
+	size_t n;
+
+	if (*p != '{')
+		return 0;
+
+	p   = strstr(p, "\"name\": \"");
+	end = strpbrk(x->pos + 1, "{}");
+	if (!p || (end && end < p))
+		return 0;
+
+	p  += strlen("\"name\": \"");
+	end = strchr(p, '"');
+	if (!end)
+		return 0;
+
+	n = MIN(end - p, size - 1);
+	memcpy(s, p, n);
+	s[n] = 0;
+
+	return 1;
+}
+
+static int
+tap_exporter_parse_array(struct tap_exporter *x, const char *prefix)
+{
+	struct tap_exporter_label *label = NULL;
+	const char *key;
+	int i, err;
+
+	key = strrchr(prefix, '_');
+	key = key ? key + 1 : prefix;
+
+	if (x->n_labels < TAP_EXPORTER_LABELS) {
+		label = &x->labels[x->n_labels++];
+		snprintf(label->name, sizeof(label->name), "%s", key);
+	}
+
+	x->pos++;
+
+	for (i = 0, err = 0; !err; i++) {
+		tap_exporter_skip_ws(x);
+
+		if (*x->pos == ']') {
+			x->pos++;
+			break;
+		}
+
+		if (label &&
+		    !tap_exporter_object_name(x, label->value,
+					      sizeof(label->value)))
+			snprintf(label->value, sizeof(label->value), "%d", i);
+
+		err = tap_exporter_parse_value(x, prefix);
+
+		tap_exporter_skip_ws(x);
+		if (*x->pos == ',')
+			x->pos++;
+	}
+
+	if (label)
+		x->n_labels--;
+
+	return err;
+}
+
+static int
+tap_exporter_parse_value(struct tap_exporter *x, const char *name)
+{
+	char s[TAP_EXPORTER_NAME_MAX];
+	const char *start;
+
+	tap_exporter_skip_ws(x);
+
+	switch (*x->pos) {
+	case '{':
+		return tap_exporter_parse_object(x, name);
+
+	case '[':
+		return tap_exporter_parse_array(x, name);
+
+	case '"':
+		return tap_exporter_parse_string(x, s, sizeof(s));
+
+	case 't':
+	case 'f':
+	case 'n':
+		start = x->pos;
+		while (isalpha((unsigned char)*x->pos))
+			x->pos++;
+
+		if (!strncmp(start, "null", 4))
+			return 0;
+
+		return tap_exporter_add_sample(x, name,
+					       *start == 't' ? "1" : "0");
+
+	default:
+		start = x->pos;
+		while (*x->pos && strchr("+-.0123456789eE", *x->pos))
+			x->pos++;
+
+		if (start == x->pos)
+			return -EINVAL;
+
+		snprintf(s, sizeof(s), "%.*s", (int)(x->pos - start), start);
+
+		return tap_exporter_add_sample(x, name, s);
+	}
+}
+
+/* one tapdisk's stats: an array of VBDs */
+static int
+tap_exporter_parse(struct tap_exporter *x, int id, const char *json)
+{
+	struct tap_exporter_label *vbd;
+	char key[TAP_EXPORTER_NAME_MAX];
+	int err = 0;
+
+	x->pos      = json;
+	x->n_labels = 2;
+	snprintf(x->labels[0].name, sizeof(x->labels[0].name), "pid");
+	snprintf(x->labels[0].value, sizeof(x->labels[0].value), "%d", id);
+
+	vbd = &x->labels[1];
+	snprintf(vbd->name, sizeof(vbd->name), "vbd");
+
+	tap_exporter_skip_ws(x);
+	if (*x->pos++ != '[')
+		return -EINVAL;
+
+	while (!err) {
+		tap_exporter_skip_ws(x);
+
+		if (*x->pos == ']')
+			break;
+
+		snprintf(vbd->value, sizeof(vbd->value), "?");
+		tap_exporter_object_name(x, vbd->value, sizeof(vbd->value));
+
+		if (*x->pos != '{')
+			return -EINVAL;
+
+		snprintf(key, sizeof(key), "tapdisk");
+		err = tap_exporter_parse_object(x, key);
+
+		tap_exporter_skip_ws(x);
+		if (*x->pos == ',')
+			x->pos++;
+	}
+
+	return err;
+}
+
+static int
+tap_exporter_sample_cmp(const void *_a, const void *_b)
+{
+	const struct tap_exporter_sample *a = _a, *b = _b;
+	int d;
+
+	d = strcmp(a->name, b->name);
+
+	return d ? : a->seq - b->seq;
+}
+
+static void
+tap_exporter_free_samples(struct tap_exporter *x)
+{
+	int i;
+
+	for (i = 0; i < x->n_samples; i++) {
+		free(x->samples[i].name);
+		free(x->samples[i].line);
+	}
+
+	x->n_samples = 0;
+}
+
+/* a page of all samples, each metric in one group */
+static int
+tap_exporter_render(struct tap_exporter *x, int n_disks)
+{
+	size_t len = 0, l;
+	char *page;
+	int i;
+
+	qsort(x->samples, x->n_samples, sizeof(x->samples[0]),
+	      tap_exporter_sample_cmp);
+
+	for (i = 0; i < x->n_samples; i++)
+		len += strlen(x->samples[i].line);
+
+	page = malloc(len + 64);
+	if (!page)
+		return -ENOMEM;
+
+	len = sprintf(page, "tapdisk_exporter_tapdisks %d\n", n_disks);
+
+	for (i = 0; i < x->n_samples; i++) {
+		l = strlen(x->samples[i].line);
+		memcpy(page + len, x->samples[i].line, l);
+		len += l;
+	}
+
+	free(x->page);
+	x->page     = page;
+	x->page_len = len;
+
+	return 0;
+}
+
+static struct tap_exporter_disk *
+tap_exporter_find_disk(struct tap_exporter *x, int id)
+{
+	struct tap_exporter_disk *d;
+
+	list_for_each_entry(d, &x->disks, entry)
+		if (d->id == id)
+			return d;
+
+	return NULL;
+}
+
+static void
+tap_exporter_drop_disk(struct tap_exporter_disk *d)
+{
+	if (d->sfd >= 0)
+		close(d->sfd);
+	list_del(&d->entry);
+	free(d);
+}
+
+/* new tapdisks get a connection, gone ones lose theirs */
+static void
+tap_exporter_scan(struct tap_exporter *x)
+{
+	const char *pattern, *format;
+	struct tap_exporter_disk *d, *next;
+	glob_t glbuf = { 0 };
+	int i, id, err;
+
+	pattern = BLKTAP2_CONTROL_DIR"/"BLKTAP2_CONTROL_SOCKET"*";
+	format  = BLKTAP2_CONTROL_DIR"/"BLKTAP2_CONTROL_SOCKET"%d";
+
+	list_for_each_entry(d, &x->disks, entry)
+		d->seen = 0;
+
+	err = glob(pattern, 0, NULL, &glbuf);
+	for (i = 0; !err && i < glbuf.gl_pathc; i++) {
+		if (sscanf(glbuf.gl_pathv[i], format, &id) != 1)
+			continue;
+
+		d = tap_exporter_find_disk(x, id);
+		if (!d) {
+			d = calloc(1, sizeof(*d));
+			if (!d)
+				break;
+
+			d->id  = id;
+			d->sfd = -1;
+			list_add_tail(&d->entry, &x->disks);
+		}
+
+		d->seen = 1;
+	}
+
+	if (glbuf.gl_pathv)
+		globfree(&glbuf);
+
+	list_for_each_entry_safe(d, next, &x->disks, entry)
+		if (!d->seen)
+			tap_exporter_drop_disk(d);
+}
+
+static void
+tap_exporter_poll(struct tap_exporter *x)
+{
+	struct tap_exporter_disk *d, *next;
+	int n_disks = 0, err;
+	ssize_t len;
+
+	tap_exporter_scan(x);
+	tap_exporter_free_samples(x);
+
+	list_for_each_entry_safe(d, next, &x->disks, entry) {
+		struct timeval tv = { .tv_sec = TAP_EXPORTER_TIMEOUT };
+
+		if (d->sfd < 0) {
+			err = tap_ctl_connect_id(d->id, &d->sfd);
+			if (err) {
+				d->sfd = -1;
+				continue;
+			}
+		}
+
+		len = tap_ctl_stats_keep(d->sfd, &x->buf, &x->bufsz, &tv);
+		if (len < 0) {
+			EPRINTF("tapdisk %d: stats: %zd\n", d->id, len);
+			close(d->sfd);
+			d->sfd = -1;
+			continue;
+		}
+
+		err = tap_exporter_parse(x, d->id, x->buf);
+		if (err)
+			EPRINTF("tapdisk %d: bad stats at offset %td\n",
+				d->id, x->pos - x->buf);
+
+		n_disks++;
+	}
+
+	err = tap_exporter_render(x, n_disks);
+	if (err)
+		EPRINTF("rendering metrics: %d\n", err);
+}
+
+static int
+tap_exporter_listen(struct tap_exporter *x, char *addr)
+{
+	struct addrinfo hints, *ai = NULL;
+	char *port;
+	int on = 1, err;
+
+	port = strrchr(addr, ':');
+	if (port)
+		*port++ = 0;
+	else {
+		port = addr;
+		addr = NULL;
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family   = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags    = AI_PASSIVE;
+
+	err = getaddrinfo(addr, port, &hints, &ai);
+	if (err) {
+		EPRINTF("%s:%s: %s\n", addr ? : "*", port, gai_strerror(err));
+		return -EINVAL;
+	}
+
+	x->sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+	if (x->sock < 0) {
+		err = -errno;
+		goto out;
+	}
+
+	setsockopt(x->sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+	if (bind(x->sock, ai->ai_addr, ai->ai_addrlen) ||
+	    listen(x->sock, TAP_EXPORTER_CLIENTS)) {
+		err = -errno;
+		PERROR("%s:%s", addr ? : "*", port);
+		goto out;
+	}
+
+	err = 0;
+out:
+	freeaddrinfo(ai);
+	return err;
+}
+
+static int
+tap_exporter_send(int fd, const char *buf, size_t size)
+{
+	ssize_t n;
+
+	while (size) {
+		n = send(fd, buf, size, MSG_NOSIGNAL);
+		if (n <= 0)
+			return -errno;
+		buf  += n;
+		size -= n;
+	}
+
+	return 0;
+}
+
+/* any request gets the page: the one thing we serve */
+static void
+tap_exporter_serve(struct tap_exporter *x, int fd)
+{
+	char req[1024], hdr[256];
+	ssize_t n;
+	int len;
+
+	n = recv(fd, req, sizeof(req) - 1, MSG_DONTWAIT);
+	if (n <= 0)
+		return;
+	req[n] = 0;
+
+	if (strncmp(req, "GET ", 4)) {
+		len = snprintf(hdr, sizeof(hdr),
+			       "HTTP/1.0 405 Method Not Allowed\r\n"
+			       "Content-Length: 0\r\n\r\n");
+		tap_exporter_send(fd, hdr, len);
+		return;
+	}
+
+	len = snprintf(hdr, sizeof(hdr),
+		       "HTTP/1.0 200 OK\r\n"
+		       "Content-Type: text/plain; version=0.0.4\r\n"
+		       "Content-Length: %zu\r\n\r\n", x->page_len);
+
+	if (!tap_exporter_send(fd, hdr, len))
+		tap_exporter_send(fd, x->page, x->page_len);
+}
+
+static void
+tap_exporter_accept(struct tap_exporter *x)
+{
+	struct timeval tv = { .tv_sec = TAP_EXPORTER_TIMEOUT };
+	int fd, i;
+
+	fd = accept(x->sock, NULL, NULL);
+	if (fd < 0)
+		return;
+
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	for (i = 0; i < TAP_EXPORTER_CLIENTS; i++)
+		if (x->clients[i] < 0) {
+			x->clients[i] = fd;
+			return;
+		}
+
+	close(fd);
+}
+
+static int
+tap_exporter_run(struct tap_exporter *x, int interval)
+{
+	struct timeval now, next = { 0 }, tv;
+	fd_set rfds;
+	int i, n, max;
+
+	for (;;) {
+		gettimeofday(&now, NULL);
+
+		if (!timercmp(&now, &next, <)) {
+			tap_exporter_poll(x);
+			next = now;
+			next.tv_sec += interval;
+			continue;
+		}
+
+		timersub(&next, &now, &tv);
+
+		FD_ZERO(&rfds);
+		FD_SET(x->sock, &rfds);
+		max = x->sock;
+
+		for (i = 0; i < TAP_EXPORTER_CLIENTS; i++)
+			if (x->clients[i] >= 0) {
+				FD_SET(x->clients[i], &rfds);
+				max = MAX(max, x->clients[i]);
+			}
+
+		n = select(max + 1, &rfds, NULL, NULL, &tv);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			PERROR("select");
+			return -errno;
+		}
+
+		for (i = 0; i < TAP_EXPORTER_CLIENTS; i++)
+			if (x->clients[i] >= 0 &&
+			    FD_ISSET(x->clients[i], &rfds)) {
+				tap_exporter_serve(x, x->clients[i]);
+				close(x->clients[i]);
+				x->clients[i] = -1;
+			}
+
+		if (FD_ISSET(x->sock, &rfds))
+			tap_exporter_accept(x);
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct tap_exporter _x, *x = &_x;
+	char *addr = TAP_EXPORTER_PORT;
+	int interval = TAP_EXPORTER_INTERVAL;
+	int foreground = 0, c, i, err;
+
+	while ((c = getopt(argc, argv, "l:i:fh")) != -1) {
+		switch (c) {
+		case 'l':
+			addr = optarg;
+			break;
+		case 'i':
+			interval = atoi(optarg);
+			if (interval <= 0)
+				goto usage;
+			break;
+		case 'f':
+			foreground = 1;
+			break;
+		case 'h':
+			usage(stdout);
+			return 0;
+		default:
+			goto usage;
+		}
+	}
+
+	memset(x, 0, sizeof(*x));
+	INIT_LIST_HEAD(&x->disks);
+	for (i = 0; i < TAP_EXPORTER_CLIENTS; i++)
+		x->clients[i] = -1;
+
+	signal(SIGPIPE, SIG_IGN);
+
+	err = tap_exporter_listen(x, strdup(addr));
+	if (err) {
+		fprintf(stderr, "tap-exporter: listen on %s: %s\n",
+			addr, strerror(-err));
+		return -err;
+	}
+
+	if (!foreground && daemon(0, 0)) {
+		PERROR("daemon");
+		return errno;
+	}
+
+	err = tap_exporter_run(x, interval);
+
+	return -err;
+
+usage:
+	usage(stderr);
+	return EINVAL;
+}
@@ -1,4 +1,25 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <netinet/tcp.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+
+#include "tapdisk.h"
 #include "adaptdr.h"
+#include "dr-tls.h"
 
 int sendexact(int s, char *buf, int len)
 {	// code to be sure to send all the data in buf up to length len
@@ -38,3 +59,700 @@ int recvexact(int s, char *buf, int len)
     return n==-1?-1:0; // return -1 on failure, 0 on success
 }
 
+/*
+ * Send a whole iovec array, restarting after short writes. The array
+ * is consumed in the process. Returns 0, or -1 with errno set.
+ */
+int sendvexact(int s, struct iovec *iov, int iovcnt)
+{
+	ssize_t n;
+
+	while (iovcnt > 0) {
+		int cnt = iovcnt > IOV_MAX ? IOV_MAX : iovcnt;
+
+		n = writev(s, iov, cnt);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		while (iovcnt > 0 && n >= (ssize_t)iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+
+		if (n) {
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * sendvexact() by sendmsg() with 'flags'. With MSG_ZEROCOPY, '*calls'
+ * counts the sends the kernel is going to report completion of; once
+ * it runs out of memory for notifications, the rest goes out copied.
+ */
+int sendmsgexact(int s, struct iovec *iov, int iovcnt, int flags,
+		 unsigned int *calls)
+{
+	struct msghdr msg;
+	ssize_t n;
+
+	*calls = 0;
+
+	while (iovcnt > 0) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov    = iov;
+		msg.msg_iovlen = iovcnt > IOV_MAX ? IOV_MAX : iovcnt;
+
+		n = sendmsg(s, &msg, flags);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+#ifdef MSG_ZEROCOPY
+			if (errno == ENOBUFS && (flags & MSG_ZEROCOPY)) {
+				flags &= ~MSG_ZEROCOPY;
+				continue;
+			}
+#endif
+			return -1;
+		}
+
+#ifdef MSG_ZEROCOPY
+		if (flags & MSG_ZEROCOPY)
+			(*calls)++;
+#endif
+
+		while (iovcnt > 0 && n >= (ssize_t)iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+
+		if (n) {
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Hold back partial frames while a batch is being written. Clearing
+ * the cork pushes out whatever is left.
+ */
+int dr_sock_cork(int s, int on)
+{
+	return setsockopt(s, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+}
+
+static int dr_parse_size(const char *val, size_t *size)
+{
+	unsigned long long v;
+	char *end;
+
+	errno = 0;
+	v = strtoull(val, &end, 0);
+	if (errno || end == val)
+		return -EINVAL;
+
+	switch (*end) {
+	case 'G': case 'g': v <<= 10;
+	case 'M': case 'm': v <<= 10;
+	case 'K': case 'k': v <<= 10;
+		end++;
+	}
+
+	if (*end)
+		return -EINVAL;
+
+	*size = v;
+	return 0;
+}
+
+/*
+ * Split ",key=value" options off the end of an image path, in place.
+ * Unknown keys are an error, so typos do not go unnoticed.
+ */
+int dr_parse_options(char *path, struct dr_options *opts)
+{
+	char *opt, *val, *next;
+	size_t v;
+	int err;
+
+	opts->window = DR_ACK_WINDOW;
+	opts->ring = DR_RING_BYTES;
+	opts->rpo_ms = DR_RPO_MS;
+	opts->lag_max = 0;
+	opts->pace = 1;
+	opts->absorb = 1;
+	opts->crc = 1;
+	opts->codec  = DR_CODEC_NONE;
+	opts->spill  = NULL;
+	opts->spill_max = DR_SPILL_MAX;
+	opts->resync = 0;
+	opts->epoch_ms = DR_EPOCH_MS;
+	opts->epoch_writes = DR_EPOCH_WRITES;
+	opts->n_targets = 0;
+	opts->quorum = 0;
+	opts->mux = 0;
+	opts->valve = NULL;
+	opts->dedup = 0;
+	opts->filter = 0;
+	opts->seed = NULL;
+	opts->group = NULL;
+	opts->coalesce = 1;
+	opts->tls = NULL;
+	opts->failback = NULL;
+	opts->sock.sockbuf = 0;
+	opts->sock.sockbuf_auto = 0;
+	opts->sock.bw = 0;
+	opts->sock.nodelay = 1;
+	opts->sock.cork = 1;
+	opts->sock.zerocopy = 0;
+	opts->sock.uring = 0;
+
+	opt = strchr(path, ',');
+	if (!opt)
+		return 0;
+
+	*opt++ = '\0';
+
+	for (; opt; opt = next) {
+		next = strchr(opt, ',');
+		if (next)
+			*next++ = '\0';
+
+		val = strchr(opt, '=');
+		if (val)
+			*val++ = '\0';
+
+		if (!strcmp(opt, "window") && val)
+			err = dr_parse_size(val, &opts->window);
+		else if (!strcmp(opt, "ring") && val) {
+			err = dr_parse_size(val, &opts->ring);
+			if (!err && opts->ring > DR_RING_MAX)
+				err = -ERANGE;
+			if (!err && opts->ring < DR_RING_MIN)
+				opts->ring = DR_RING_MIN;
+		}
+		else if (!strcmp(opt, "rpo") && val) {
+			err = dr_parse_size(val, &v);
+			if (!err && v > UINT_MAX)
+				err = -ERANGE;
+			opts->rpo_ms = v;
+		} else if (!strcmp(opt, "lag_max") && val)
+			err = dr_parse_size(val, &opts->lag_max);
+		else if (!strcmp(opt, "pace") && val) {
+			err = dr_parse_size(val, &v);
+			opts->pace = !!v;
+		} else if (!strcmp(opt, "crc") && val) {
+			err = dr_parse_size(val, &v);
+			opts->crc = !!v;
+		} else if (!strcmp(opt, "absorb") && val) {
+			err = dr_parse_size(val, &v);
+			opts->absorb = !!v;
+		} else if (!strcmp(opt, "spill") && val && *val) {
+			opts->spill = val;
+			err = 0;
+		} else if (!strcmp(opt, "spill_max") && val)
+			err = dr_parse_size(val, &opts->spill_max);
+		else if (!strcmp(opt, "resync") && val) {
+			err = dr_parse_size(val, &v);
+			opts->resync = !!v;
+		} else if (!strcmp(opt, "epoch") && val) {
+			err = dr_parse_size(val, &v);
+			if (!err && v > UINT_MAX)
+				err = -ERANGE;
+			opts->epoch_ms = v;
+		} else if (!strcmp(opt, "epoch_writes") && val) {
+			err = dr_parse_size(val, &v);
+			if (!err && v > UINT_MAX)
+				err = -ERANGE;
+			opts->epoch_writes = v;
+		} else if (!strcmp(opt, "target") && val && strchr(val, ':')) {
+			err = -E2BIG;
+			if (opts->n_targets < DR_MAX_TARGETS - 1) {
+				opts->targets[opts->n_targets++] = val;
+				err = 0;
+			}
+		} else if (!strcmp(opt, "quorum") && val) {
+			err = dr_parse_size(val, &v);
+			if (!err && (!v || v > DR_MAX_TARGETS))
+				err = -ERANGE;
+			opts->quorum = v;
+		} else if (!strcmp(opt, "valve") && val && *val) {
+			opts->valve = val;
+			err = 0;
+		} else if (!strcmp(opt, "dedup") && val) {
+			err = 0;
+			if (!strcmp(val, "delta"))
+				opts->dedup = DR_DEDUP_DELTA;
+			else {
+				err = dr_parse_size(val, &v);
+				opts->dedup = !!v;
+			}
+		} else if (!strcmp(opt, "sockbuf") && val) {
+			err = 0;
+			if (!strcmp(val, "auto"))
+				opts->sock.sockbuf_auto = 1;
+			else
+				err = dr_parse_size(val, &opts->sock.sockbuf);
+			if (!err && opts->sock.sockbuf > INT_MAX)
+				err = -ERANGE;
+		} else if (!strcmp(opt, "bw") && val)
+			err = dr_parse_size(val, &opts->sock.bw);
+		else if (!strcmp(opt, "nodelay") && val) {
+			err = dr_parse_size(val, &v);
+			opts->sock.nodelay = !!v;
+		} else if (!strcmp(opt, "cork") && val) {
+			err = dr_parse_size(val, &v);
+			opts->sock.cork = !!v;
+		} else if (!strcmp(opt, "zerocopy") && val) {
+			err = dr_parse_size(val, &v);
+			opts->sock.zerocopy = !!v;
+		} else if (!strcmp(opt, "uring") && val) {
+			err = dr_parse_size(val, &v);
+			opts->sock.uring = !!v;
+		} else if (!strcmp(opt, "seed") && val && *val) {
+			opts->seed = val;
+			err = 0;
+		} else if (!strcmp(opt, "group") && val && *val &&
+			   !strchr(val, '/')) {
+			opts->group = val;
+			err = 0;
+		} else if (!strcmp(opt, "tls") && val && *val) {
+			opts->tls = val;
+			err = 0;
+		} else if (!strcmp(opt, "failback") && val && *val) {
+			opts->failback = val;
+			err = 0;
+		} else if (!strcmp(opt, "coalesce") && val) {
+			err = dr_parse_size(val, &v);
+			opts->coalesce = !!v;
+		} else if (!strcmp(opt, "filter") && val) {
+			err = dr_parse_size(val, &v);
+			opts->filter = !!v;
+		} else if (!strcmp(opt, "mux") && val) {
+			err = dr_parse_size(val, &v);
+			opts->mux = !!v;
+		} else if (!strcmp(opt, "compress") && val) {
+			err = 0;
+			if (!strcmp(val, "lz4"))
+				opts->codec = DR_CODEC_LZ4;
+			else if (!strcmp(val, "none"))
+				opts->codec = DR_CODEC_NONE;
+			else
+				err = -EINVAL;
+		} else
+			err = -EINVAL;
+
+		if (err)
+			return err;
+	}
+
+	/* resync reads the raw image */
+	if (opts->filter && opts->resync)
+		return -EINVAL;
+
+	/* a group moves on by epochs */
+	if (opts->group && !opts->epoch_ms && !opts->epoch_writes)
+		return -EINVAL;
+
+	/* the ring is only reused once acked, and the kernel done too */
+	if (opts->sock.zerocopy && !opts->window)
+		return -EINVAL;
+
+	return 0;
+}
+
+/* connect(), but for at most DR_CONNECT_MS. */
+static int dr_connect_addr(int s, const struct sockaddr *addr,
+			   socklen_t len)
+{
+	struct pollfd pfd;
+	socklen_t elen = sizeof(int);
+	int flags, err;
+
+	flags = fcntl(s, F_GETFL);
+	if (flags < 0 || fcntl(s, F_SETFL, flags | O_NONBLOCK) < 0)
+		return -errno;
+
+	err = 0;
+	if (connect(s, addr, len) < 0) {
+		if (errno != EINPROGRESS)
+			return -errno;
+
+		pfd.fd     = s;
+		pfd.events = POLLOUT;
+		do
+			err = poll(&pfd, 1, DR_CONNECT_MS);
+		while (err < 0 && errno == EINTR);
+		if (err < 0)
+			return -errno;
+		if (!err)
+			return -ETIMEDOUT;
+
+		if (getsockopt(s, SOL_SOCKET, SO_ERROR, &err, &elen) < 0)
+			return -errno;
+		err = -err;
+	}
+
+	if (!err && fcntl(s, F_SETFL, flags) < 0)
+		err = -errno;
+
+	return err;
+}
+
+/*
+ * Open a TCP connection to a backup, with Nagle off: records are
+ * batched by the sender already. Every address the name resolves to is
+ * tried, each for DR_CONNECT_MS at most, and the handshake reply is
+ * waited for as long; dr_connected() lifts that. With 'tls', the CA to
+ * verify the backup against, the connection is encrypted by the kernel
+ * (dr-tls.h) before anything else goes on it. Returns the socket, or
+ * -errno.
+ */
+int dr_connect(const char *host, int port, const char *tls)
+{
+	struct addrinfo hints, *res, *ai;
+	struct timeval tv;
+	char service[16];
+	int s = -1, err, one = 1;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family   = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	snprintf(service, sizeof(service), "%d", port);
+
+	err = getaddrinfo(host, service, &hints, &res);
+	if (err) {
+		DPRINTF("no such host %s: %s\n", host, gai_strerror(err));
+		return -EHOSTUNREACH;
+	}
+
+	err = -EHOSTUNREACH;
+	for (ai = res; ai; ai = ai->ai_next) {
+		s = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (s < 0) {
+			err = -errno;
+			continue;
+		}
+
+		err = dr_connect_addr(s, ai->ai_addr, ai->ai_addrlen);
+		if (!err)
+			break;
+
+		close(s);
+		s = -1;
+	}
+	freeaddrinfo(res);
+
+	if (s < 0) {
+		DPRINTF("ERROR CONNECTING to %s:%d: %d\n", host, port, err);
+		return err;
+	}
+
+	if (setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)))
+		DPRINTF("ERROR SETTING SOCKOPT!");
+
+	tv.tv_sec  = DR_CONNECT_MS / 1000;
+	tv.tv_usec = DR_CONNECT_MS % 1000 * 1000;
+	if (setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)))
+		DPRINTF("cannot bound the handshake: %d\n", -errno);
+
+	if (tls) {
+		err = dr_tls_client(s, tls, host);
+		if (err) {
+			close(s);
+			return err;
+		}
+	}
+
+	return s;
+}
+
+/* The handshake is done: acks may be as far apart as they like. */
+void dr_connected(int s)
+{
+	struct timeval tv = { 0, 0 };
+
+	setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+}
+
+/*
+ * Send the image path the backup should write to. A codec is requested
+ * on a second line ("compress=lz4"), dedup on another ("dedup"), and
+ * deltas with it on a third ("delta"); each is only used if the backup
+ * echoes the request in its reply. Returns the codec agreed on, lowers
+ * *dedup to what was agreed, and leaves the reply in 'reply'.
+ */
+static int __dr_handshake(int s, const char *hello, int codec,
+			  int *dedup, char *reply, size_t size)
+{
+	char buffer[256];
+	int n;
+
+#ifndef HAVE_LZ4
+	if (codec == DR_CODEC_LZ4) {
+		DPRINTF("built without lz4, not compressing\n");
+		codec = DR_CODEC_NONE;
+	}
+#endif
+
+	bzero(buffer, sizeof(buffer));
+	snprintf(buffer, sizeof(buffer), "%s%s%s%s", hello,
+		 codec == DR_CODEC_LZ4 ? "\ncompress=lz4" : "",
+		 dedup && *dedup ? "\ndedup" : "",
+		 dedup && *dedup == DR_DEDUP_DELTA ? "\ndelta" : "");
+
+	n = write(s, buffer, strlen(buffer));
+	if (n < 0) {
+		DPRINTF("ERROR writing to socket");
+		return -errno;
+	}
+
+	bzero(reply, size);
+	n = read(s, reply, size - 1);
+	if (n < 0) {
+		DPRINTF("ERROR reading from socket");
+		return -errno;
+	}
+
+	DPRINTF("read: %s", reply);
+
+	if (codec == DR_CODEC_LZ4 && !strstr(reply, "compress=lz4")) {
+		DPRINTF("backup declined compression\n");
+		codec = DR_CODEC_NONE;
+	}
+
+	if (dedup && *dedup && !strstr(reply, "dedup")) {
+		DPRINTF("backup declined dedup\n");
+		*dedup = 0;
+	}
+
+	if (dedup && *dedup == DR_DEDUP_DELTA && !strstr(reply, "delta")) {
+		DPRINTF("backup declined dedup deltas\n");
+		*dedup = 1;
+	}
+
+	return codec;
+}
+
+int dr_handshake(int s, const char *image, int codec, int *dedup)
+{
+	char reply[256];
+
+	return __dr_handshake(s, image, codec, dedup, reply, sizeof(reply));
+}
+
+/* Open a multiplexed link; fails on backups that do not know them. */
+int dr_mux_handshake(int s, int codec, int *dedup)
+{
+	char reply[256];
+
+	codec = __dr_handshake(s, DR_MUX_HELLO, codec, dedup,
+			       reply, sizeof(reply));
+	if (codec >= 0 && strncmp(reply, "ok mux", 6)) {
+		DPRINTF("backup does not multiplex\n");
+		return -EPROTONOSUPPORT;
+	}
+
+	return codec;
+}
+
+static int dr_shm_path(const char *name, char *path, size_t size)
+{
+	if (!*name || strchr(name, '/') ||
+	    snprintf(path, size, "/dr_%s", name) >= size)
+		return -EINVAL;
+
+	return 0;
+}
+
+/* Create /dr_<name> for a ring of 'size' bytes, replacing any left. */
+int dr_shm_create(const char *name, const char *image, uint32_t size,
+		  struct dr_shm **shm)
+{
+	char path[NAME_MAX];
+	struct dr_shm *hdr;
+	int fd, err;
+
+	err = dr_shm_path(name, path, sizeof(path));
+	if (err)
+		return err;
+
+	if (strlen(image) >= sizeof(hdr->image))
+		return -ENAMETOOLONG;
+
+	fd = shm_open(path, O_CREAT | O_TRUNC | O_RDWR, 0600);
+	if (fd < 0)
+		return -errno;
+
+	if (ftruncate(fd, DR_SHM_HDR + (off_t)size)) {
+		err = -errno;
+		goto fail;
+	}
+
+	hdr = mmap(NULL, DR_SHM_HDR + (size_t)size, PROT_READ | PROT_WRITE,
+		   MAP_SHARED, fd, 0);
+	if (hdr == MAP_FAILED) {
+		err = -errno;
+		goto fail;
+	}
+	close(fd);
+
+	hdr->size = size;
+	snprintf(hdr->image, sizeof(hdr->image), "%s", image);
+	__atomic_store_n(&hdr->magic, DR_SHM_MAGIC, __ATOMIC_RELEASE);
+
+	*shm = hdr;
+	return 0;
+
+fail:
+	close(fd);
+	shm_unlink(path);
+	return err;
+}
+
+/* Map a /dr_<name> a sender created. */
+int dr_shm_attach(const char *name, struct dr_shm **shm)
+{
+	char path[NAME_MAX];
+	struct dr_shm *hdr;
+	struct stat st;
+	int fd, err;
+
+	err = dr_shm_path(name, path, sizeof(path));
+	if (err)
+		return err;
+
+	fd = shm_open(path, O_RDWR, 0);
+	if (fd < 0)
+		return -errno;
+
+	err = -EINVAL;
+	if (fstat(fd, &st) || st.st_size < DR_SHM_HDR)
+		goto out;
+
+	hdr = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		   fd, 0);
+	if (hdr == MAP_FAILED) {
+		err = -errno;
+		goto out;
+	}
+
+	if (__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != DR_SHM_MAGIC ||
+	    DR_SHM_HDR + (off_t)hdr->size != st.st_size) {
+		DPRINTF("%s: not a DR ring\n", path);
+		munmap(hdr, st.st_size);
+		goto out;
+	}
+
+	*shm = hdr;
+	err  = 0;
+out:
+	close(fd);
+	return err;
+}
+
+void dr_shm_detach(struct dr_shm *shm)
+{
+	munmap(shm, DR_SHM_HDR + (size_t)shm->size);
+}
+
+void dr_shm_unlink(const char *name)
+{
+	char path[NAME_MAX];
+
+	if (!dr_shm_path(name, path, sizeof(path)))
+		shm_unlink(path);
+}
+
+/* The index behind 'seq' moved: wake the other side if it sleeps. */
+void dr_shm_wake(uint32_t *seq, uint32_t *wanted)
+{
+	__atomic_add_fetch(seq, 1, __ATOMIC_RELEASE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	if (__atomic_exchange_n(wanted, 0, __ATOMIC_ACQ_REL))
+		syscall(SYS_futex, seq, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+/* Sleep while 'seq' is still 'seen', for 'ms' at most. */
+void dr_shm_wait(uint32_t *seq, uint32_t *wanted, uint32_t seen, int ms)
+{
+	struct timespec ts;
+
+	__atomic_store_n(wanted, 1, __ATOMIC_RELEASE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(seq, __ATOMIC_ACQUIRE) != seen)
+		return;
+
+	ts.tv_sec  = ms / 1000;
+	ts.tv_nsec = ms % 1000 * 1000000L;
+	syscall(SYS_futex, seq, FUTEX_WAIT, seen, &ts, NULL, 0);
+}
+
+/* Map /drgroup_<name>, creating the group if it is not there yet. */
+int dr_group_join(const char *name, struct dr_group **group)
+{
+	char path[NAME_MAX];
+	struct dr_group *g;
+	struct timeval tv;
+	uint32_t magic;
+	uint64_t epoch;
+	int fd, err;
+
+	if (!*name || strchr(name, '/') ||
+	    snprintf(path, sizeof(path), "/drgroup_%s", name) >= sizeof(path))
+		return -EINVAL;
+
+	fd = shm_open(path, O_CREAT | O_RDWR, 0600);
+	if (fd < 0)
+		return -errno;
+
+	/* members racing to create it all truncate to the same size */
+	if (ftruncate(fd, sizeof(*g))) {
+		err = -errno;
+		close(fd);
+		return err;
+	}
+
+	g = mmap(NULL, sizeof(*g), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	err = g == MAP_FAILED ? -errno : 0;
+	close(fd);
+	if (err)
+		return err;
+
+	magic = 0;
+	if (!__atomic_compare_exchange_n(&g->magic, &magic, DR_GROUP_MAGIC, 0,
+					 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) &&
+	    magic != DR_GROUP_MAGIC) {
+		DPRINTF("%s: not a DR group\n", path);
+		munmap(g, sizeof(*g));
+		return -EINVAL;
+	}
+
+	/* whoever comes first starts the count */
+	gettimeofday(&tv, NULL);
+	epoch = 0;
+	__atomic_compare_exchange_n(&g->epoch, &epoch,
+				    (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec,
+				    0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+
+	*group = g;
+	return 0;
+}
+
+void dr_group_leave(struct dr_group *group)
+{
+	munmap(group, sizeof(*group));
+}
@@ -5,36 +5,404 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netdb.h>
+#include <sys/uio.h>
 
-#define REQ_INFO_SIZE 24
-/* Size of req_info struct -- needs to be hardcoded since used to determine array size in
- * block-yncdr.c
+/* !TW! Circular buffer for holding requests waiting to be asyncly sent.
+ * Records are variable length (req_info + data); the default ring is
+ * sized to hold DRBUFSIZE writes of DR_MAX_WRITE_SIZE bytes.
  */
-/* !TW! Circular buffer for holding requests waiting to be asyncly sent */
 #define DRBUFSIZE 10000
-#define DR_MAX_WRITE_SIZE 1024*4
-// buffer can hold DRBUFSIZE disk requests
+#define DR_MAX_WRITE_SIZE (1024*4)
+#define DR_RING_BYTES (DRBUFSIZE * DR_MAX_WRITE_SIZE)
+
+/* the largest write a VBD passes down, a full indirect request */
+#define DR_MAX_REQUEST_BYTES (256 * 4096)
+
+/*
+ * bounds on a ring size given per VBD; smaller rings are raised to the
+ * largest write, with its record header and an epoch barrier's
+ */
+#define DR_RING_MIN (DR_MAX_REQUEST_BYTES + 2 * sizeof(struct req_info))
+#define DR_RING_MAX (1U << 31)
 
 
 #define ACK_PORT 9990
 // DR_PORT is specified in config file
 
-/* !TW! MUST KEEP IN SYNC WITH backupServer.c / block-adpatdr.c */
+/* default unacknowledged bytes the sender keeps in flight */
+#define DR_ACK_WINDOW (16 << 20)
+
+/* default cap on the overflow journal */
+#define DR_SPILL_MAX (1ULL << 30)
+
+/* backups one device can replicate to */
+#define DR_MAX_TARGETS 4
+
+/* default recovery point objective of the adaptive driver, in ms */
+#define DR_RPO_MS 1000
+
+/* a paced device may complete this much worth of its rate at once */
+#define DR_PACE_BURST_MS 10
+
+/*
+ * A connect, or the handshake reply, gives up after DR_CONNECT_MS. A
+ * lost backup is tried again after DR_RECONNECT_MIN_MS, doubling up to
+ * DR_RECONNECT_MAX_MS between attempts.
+ */
+#define DR_CONNECT_MS 5000
+#define DR_RECONNECT_MIN_MS 100
+#define DR_RECONNECT_MAX_MS 30000
+
+/*
+ * Writes within one epoch may reach the backup out of order, or not at
+ * all when a later write in the same epoch overwrote them; the backup
+ * only exposes epoch boundaries. By default the sender closes an epoch
+ * after DR_EPOCH_WRITES writes, or DR_EPOCH_MS after its first write.
+ */
+#define DR_EPOCH_WRITES 256
+#define DR_EPOCH_MS 100
+
+/*
+ * !TW! MUST KEEP IN SYNC WITH td-drbackup.c / block-adaptdr.c
+ *
+ * The wire header of every record. crc used to be padding, and only
+ * means anything with DR_REC_CRC set in state.
+ */
 struct req_info {
 	uint64_t writeID;
 	int size;
+	uint32_t crc;
 	uint64_t offset;
-	char* dataPtr;	// NOT USED /////
+	uint64_t state;	// ring state, plus DR_REC_* flags (was dataPtr)
+};
+
+/*
+ * Records without data are markers: a barrier closes an epoch, its
+ * writeID is the last write in the epoch and its offset the epoch
+ * number, never 0. A member of a consistency group that has not
+ * written yet still closes epochs, with writeID 0. A zeroed req_info
+ * closes the stream.
+ */
+#define dr_rec_barrier(_r) \
+	((_r)->size == 0 && ((_r)->writeID != 0 || (_r)->offset != 0))
+#define dr_rec_close(_r) \
+	((_r)->size == 0 && (_r)->writeID == 0 && (_r)->offset == 0)
+
+/* stream codecs, negotiated in the connect handshake */
+#define DR_CODEC_NONE   0
+#define DR_CODEC_LZ4    1
+
+/*
+ * With a codec, every batch goes on the wire as a struct dr_frame
+ * followed by 'len' bytes: the batch compressed, or as is when
+ * len == raw.
+ */
+#define DR_FRAME_MAGIC  0x44524652	/* "DRFR" */
+
+struct dr_frame {
+	uint32_t magic;
+	uint32_t raw;
+	uint32_t len;
+};
+
+/*
+ * Multiplexed links carry the streams of many devices over one
+ * connection to a backup. A link opens with the handshake DR_MUX_HELLO
+ * (plus "\ncompress=lz4"), which the backup answers with "ok mux" (plus
+ * " compress=lz4"); the codec then holds for every device on the link.
+ * Everything after is struct dr_mux messages, each followed by 'len'
+ * bytes: DR_MUX_OPEN names the image of a new device, DR_MUX_DATA
+ * carries its stream exactly as a connection of its own would, and
+ * DR_MUX_CLOSE ends it. Acks name the device in deviceID.
+ */
+#define DR_MUX_HELLO    "mux"
+#define DR_MUX_MAGIC    0x44524d58	/* "DRMX" */
+
+#define DR_MUX_OPEN     1
+#define DR_MUX_DATA     2
+#define DR_MUX_CLOSE    3
+
+struct dr_mux {
+	uint32_t magic;
+	uint32_t type;
+	uint32_t device;
+	uint32_t len;
+};
+
+/* req_info.state */
+#define DR_REC_QUEUED   0
+#define DR_REC_SENT     1
+#define DR_REC_ABSORBED 2	// superseded before it was sent
+#define DR_REC_SUMMING  3	// claimed, crc being computed
+
+/*
+ * Headers with DR_REC_CRC set carry the CRC32C of the record's data
+ * (dr-crc32c.h) in crc; the sender sums once, when the record is first
+ * claimed for sending. A receiver that finds a mismatch drops the
+ * stream, so the primary sends again from the last ack. Receivers
+ * that know nothing of it read crc as padding, so it needs no
+ * handshake.
+ */
+#define DR_REC_CRC      (1ULL << 33)
+
+/*
+ * Content dedup, agreed in the handshake with a "dedup" line the
+ * backup echoes. Records of at least one DR_DEDUP_BLOCK may then go on
+ * the wire with DR_REC_DEDUP set in their state: the req_info, one
+ * struct dr_dedup_blk per whole block, the data of every block not
+ * sent as DR_DEDUP_REF, then the bytes past the last whole block.
+ *
+ * The sender owns a table of DR_DEDUP_SLOTS blocks the backup keeps
+ * for it. DR_DEDUP_KEEP stores a block in 'slot', DR_DEDUP_REF stands
+ * for the block last stored there, provided its hash still matches.
+ * Both are applied in stream order, for duplicates of records already
+ * applied too, so the tables agree.
+ */
+#define DR_REC_DEDUP    (1ULL << 32)
+
+#define DR_DEDUP_BLOCK  4096
+#define DR_DEDUP_SLOTS  4096
+
+#define DR_DEDUP_RAW    0
+#define DR_DEDUP_KEEP   1
+#define DR_DEDUP_REF    2
+#define DR_DEDUP_XOR    3
+
+/*
+ * With a "delta" line agreed as well, a block rewritten at the offset
+ * a slot was last stored for may go as DR_DEDUP_XOR against it: its
+ * data is then a uint32_t length, and that many bytes of runs, each a
+ * struct dr_delta_run and the run's bytes of the new block XORed with
+ * the slot's. The result replaces the slot, and must match 'hash'.
+ * Runs start and end on 8 byte boundaries, so a delta costs a few
+ * words per change, and sending one only pays below DR_DELTA_MAX.
+ */
+#define DR_DEDUP_DELTA  2	/* dedup=delta, as asked for and agreed */
+
+#define DR_DELTA_MAX    (DR_DEDUP_BLOCK / 2)
+
+struct dr_delta_run {
+	uint16_t off;
+	uint16_t len;
 };
 
+struct dr_dedup_blk {
+	uint32_t op;
+	uint32_t slot;
+	uint64_t hash[2];
+};
+
+/*
+ * Shared-memory transport, for a backup on the same host: target
+ * "shm:<name>" maps the sender's ring into POSIX shared memory
+ * /dr_<name>, after a DR_SHM_HDR page holding struct dr_shm. There is
+ * no handshake; the header names the image, is never compressed nor
+ * deduplicated, and needs ack tracking.
+ *
+ * The ring holds the record stream as it would go on the wire, plus
+ * the records the sender absorbed (state DR_REC_ABSORBED), which the
+ * backup skips. Everything below 'head' is final. The backup copies
+ * records out from 'tail' on, and acks by raising 'acked', which lets
+ * the sender reuse the ring below 'kept'; a backup attaching starts
+ * there, records it applied already are dropped by writeID. Each side bumps a futex word when it
+ * moves its index, and only wakes the other when it set 'wanted'
+ * before sleeping. 'closed' replaces the close marker.
+ */
+#define DR_SHM_MAGIC    0x4452534d	/* "DRSM" */
+#define DR_SHM_HDR      4096
+
+struct dr_shm {
+	uint32_t magic;
+	uint32_t size;		/* ring bytes, after the header */
+	char     image[256];
+
+	uint64_t head;		/* readable up to, by the sender */
+	uint64_t kept;		/* unacked from, by the sender */
+	uint32_t head_seq;
+	uint32_t head_wanted;
+	uint32_t closed;
+
+	uint64_t tail;		/* copied out up to, by the backup */
+	uint64_t acked;		/* writeID on the backup's disk */
+	uint32_t ack_seq;
+	uint32_t ack_wanted;
+	uint32_t attached;
+};
+
+/*
+ * Consistency groups: the streams of several devices, e.g. the disks
+ * of one VM, in one or more tapdisks on a host, share the epoch
+ * counter in POSIX shared memory /drgroup_<name>. A member closing an
+ * epoch moves the group on; every member then closes its own epoch
+ * with a barrier numbered group epoch - 1 before it queues another
+ * write, idle members on their epoch timer. So a write queued after
+ * another, on any member, never lands in an earlier epoch, and the
+ * backup may expose an epoch once every member has applied a barrier
+ * at or past it. A new group starts at the current time in
+ * microseconds, so its epochs keep increasing across host restarts.
+ */
+#define DR_GROUP_MAGIC  0x44524750	/* "DRGP" */
+
+struct dr_group {
+	uint32_t magic;
+	uint32_t pad;
+	uint64_t epoch;		/* current */
+};
+
+/* Cumulative: the backup has applied every record up to writeID. */
 struct dr_ack {
 	int deviceID;
 	uint64_t writeID;
 
 };
 
+/*
+ * Socket tuning. sockbuf sets both SO_SNDBUF and SO_RCVBUF; auto sizes
+ * them to the bandwidth-delay product, bw times the measured RTT, and
+ * follows the RTT as it moves, or without bw, to the ack window, which
+ * bounds what is ever in flight. By default the kernel sizes them.
+ * nodelay=0 lets Nagle coalesce small sends; cork=0 stops holding back
+ * partial frames over a batch (mux links always cork). zerocopy=1 sends
+ * raw batches of a connection of their own straight from the ring with
+ * MSG_ZEROCOPY; it needs ack tracking, and is left off for compressed,
+ * deduplicated or multiplexed streams, which send from buffers of
+ * their own. The ring is then locked in memory, which RLIMIT_MEMLOCK
+ * must allow for; zerocopy still works, if slower, when it does not.
+ * uring=1 has a mux link opened by the stream send each round over
+ * its devices as one io_uring submission (dr-uring.h) instead of a
+ * corked sendmsg() per device; links without it, or on kernels
+ * without, send as before.
+ */
+struct dr_sockopts {
+	size_t sockbuf;
+	int sockbuf_auto;
+	size_t bw;
+	int nodelay;
+	int cork;
+	int zerocopy;
+	int uring;
+};
+
+/*
+ * Per-VBD tunables, given as ",key=value" pairs after the image path:
+ *
+ *   host:port:/path/to/image[,window=<bytes>][,rpo=<ms>][,absorb=0|1][,compress=lz4]
+ *                          [,lag_max=<bytes>][,pace=0|1][,ring=<bytes>]
+ *                          [,crc=0|1]
+ *                          [,spill=<journal path>][,spill_max=<bytes>]
+ *                          [,resync=0|1][,epoch=<ms>][,epoch_writes=<n>]
+ *                          [,target=host:port|shm:<name>]...[,quorum=<n>]
+ *                          [,mux=0|1][,valve=<td-rated name>]
+ *                          [,dedup=0|1|delta]
+ *                          [,filter=0|1][,seed=<vhd path>]
+ *                          [,sockbuf=<bytes>|auto][,bw=<bytes/s>]
+ *                          [,nodelay=0|1][,cork=0|1][,zerocopy=0|1]
+ *                          [,uring=0|1]
+ *                          [,group=<name>][,coalesce=0|1][,tls=<CA path>]
+ *                          [,failback=<bitmap path>]
+ *
+ * window=0 disables ACK tracking, for receivers that do not send
+ * struct dr_ack; records are then released as soon as they are sent.
+ * ring sizes the buffer of records not yet released, DR_RING_BYTES by
+ * default; it is allocated at open, on huge pages where it can be.
+ * crc=0 sends records without checksums (DR_REC_CRC).
+ * rpo is how far, in time, adaptdr lets the backup trail before it
+ * makes writes wait for the backup, lag_max the same bound in bytes not
+ * yet acknowledged. Past half of either bound, pace=1 holds back write
+ * completions to a rate that shrinks towards the drain rate of the
+ * backups as the bound nears, so guests slow down gradually instead of
+ * at once. absorb=0 sends every write, even
+ * when a newer one to the same extent is queued behind it. compress
+ * asks the backup for a compressed stream in the handshake; a receiver
+ * that does not echo it back gets the stream uncompressed. spill names
+ * an overflow journal that takes records while the ring is full. resync
+ * falls back to a dirty bitmap once even the journal is full. epoch
+ * and epoch_writes bound an epoch in time and in writes; with both 0
+ * the stream carries no barriers, and absorb spans the whole stream.
+ * Each target adds a backup to replicate to, up to DR_MAX_TARGETS in
+ * all, and writes count as replicated once quorum of them acknowledged
+ * them; by default, all of them. shm:<name>, as a target or in place
+ * of host:port, is a backup on this host reading the ring from shared
+ * memory (struct dr_shm), at most one per VBD. mux=1 shares one connection and one
+ * pair of threads per backup between all devices that ask for it.
+ * valve names a td-rated bridge, as the valve driver takes it, to pay
+ * for every byte sent with its tokens. dedup=1 asks the backup to
+ * index recently sent blocks, so repeated ones go out as references.
+ * dedup=delta also keeps their contents here, so that a block
+ * rewritten in place goes out as an XOR delta against the version the
+ * backup holds (DR_DEDUP_XOR); a backup without deltas gets dedup=1.
+ * filter=1 stacks the driver over the image below it in the chain (an
+ * x-chain), e.g. a vhd, instead of opening the path as a raw image:
+ * I/O is forwarded, and the path only names the backup's image. There
+ * is no local fd to resync from, so resync needs filter=0. seed copies
+ * the allocated contents of a vhd chain, normally the one the driver
+ * sits on, to a fresh backup while live writes go on. group joins
+ * a consistency group (struct dr_group); it needs epochs. coalesce=0
+ * sends every write as a record of its own, even when the extents of
+ * queued ones follow one another. tls encrypts every connection to a
+ * backup in the kernel (dr-tls.h), verifying it against the CA file or
+ * directory given; shm:<name> backups are local and left plain. There
+ * are no zerocopy sends over TLS. failback, on the site failed over
+ * to, replicates back to the original primary: it resyncs the extents
+ * of a bitmap td-drbackup left there when it rolled the image back,
+ * and keeps the bitmap of what the original still lacks when the
+ * driver closes, so failback copies only what changed. It needs
+ * resync.
+ *
+ * The rest tune every socket of the stream, see struct dr_sockopts.
+ */
+struct dr_options {
+	size_t window;
+	size_t ring;
+	unsigned int rpo_ms;
+	size_t lag_max;
+	int pace;
+	int absorb;
+	int crc;
+	int codec;
+	char *spill;
+	size_t spill_max;
+	int resync;
+	unsigned int epoch_ms;
+	unsigned int epoch_writes;
+	char *targets[DR_MAX_TARGETS - 1];
+	int n_targets;
+	int quorum;
+	int mux;
+	char *valve;
+	int dedup;
+	int filter;
+	char *seed;
+	char *group;
+	int coalesce;
+	char *tls;
+	char *failback;
+	struct dr_sockopts sock;
+};
+
+int dr_parse_options(char *path, struct dr_options *opts);
+int dr_connect(const char *host, int port, const char *tls);
+void dr_connected(int s);
+int dr_handshake(int s, const char *image, int codec, int *dedup);
+int dr_mux_handshake(int s, int codec, int *dedup);
+
+int dr_shm_create(const char *name, const char *image, uint32_t size,
+		  struct dr_shm **shm);
+int dr_shm_attach(const char *name, struct dr_shm **shm);
+void dr_shm_detach(struct dr_shm *shm);
+void dr_shm_unlink(const char *name);
+void dr_shm_wake(uint32_t *seq, uint32_t *wanted);
+void dr_shm_wait(uint32_t *seq, uint32_t *wanted, uint32_t seen, int ms);
+
+int dr_group_join(const char *name, struct dr_group **group);
+void dr_group_leave(struct dr_group *group);
+
 int sendexact(int s, char *buf, int len);
 int recvexact(int s, char *buf, int len);
+int sendvexact(int s, struct iovec *iov, int iovcnt);
+int sendmsgexact(int s, struct iovec *iov, int iovcnt, int flags,
+		 unsigned int *calls);
+int dr_sock_cork(int s, int on);
 
 
 #endif
@@ -35,6 +35,7 @@
 #include <sys/statvfs.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#include <sys/timerfd.h>
 #include <linux/fs.h>
 
 
@@ -47,12 +48,15 @@
 #include "tapdisk.h"
 #include "tapdisk-driver.h"
 #include "tapdisk-interface.h"
+#include "tapdisk-server.h"
 
 // !TW! extra libs
 #include "adaptdr.h"
+#include "dr-stream.h"
 #include <pthread.h>
 
-#define MAX_AIO_REQS         TAPDISK_DATA_REQUESTS
+#define MIN(a, b)            ((a) < (b) ? (a) : (b))
+#define MAX(a, b)            ((a) > (b) ? (a) : (b))
 
 struct tdadaptdr_state;
 
@@ -60,39 +64,279 @@ struct adaptdr_request {
 	td_request_t         treq;
 	struct tiocb         tiocb;
 	struct tdadaptdr_state  *state;
+
+	uint64_t             writeID;
+	int                  sync;	// completion waits for the backup
+	int                  err;	// local result, while waiting
+	int                  secs;	// forwarded, still to complete
+	struct list_head     next;
 };
 
 struct tdadaptdr_state {
 	int                  fd;
 	td_driver_t         *driver;
 
-	int                  adaptdr_free_count;
-	struct adaptdr_request   adaptdr_requests[MAX_AIO_REQS];
-	struct adaptdr_request  *adaptdr_free_list[MAX_AIO_REQS];
+	struct td_pool       adaptdr_pool;
 
 	uint64_t pendingWrite;	// epoch of last started write (get from kblock?)
 	uint64_t committedWrite; // epoch of last committed write
-	int backupSocket;
-	//int backupSocketId;	// was going to use this for event handler stuff
 
 	// backup server info
 	char* backupHost;
+	char* backupTarget;	// "host:port", or "shm:<name>"
 	int backupPort;
 	char* imageFile;
 
+	/* per-device replication stream to the backup */
+	struct dr_stream stream;
+	struct dr_options opts;
+
+	/*
+	 * Replication mode. Async completes writes once they are local;
+	 * sync also waits for the backup's ACK. We go sync when the
+	 * backup trails by more than the RPO target, or the ring is
+	 * filling up, and back to async with some hysteresis.
+	 */
+	int sync;
+	uint64_t modeSwitches;
+	struct list_head waiting;	// local done, waiting for ACK
+	event_id_t ackEvent;
+
+	/*
+	 * Pacing. Once the backlog is past half its bound, async writes
+	 * complete at paceRate bytes/s at most, out of a token bucket
+	 * which one write may overdraw. paceRate is 0 while not pacing.
+	 */
+	uint64_t paceRate;
+	int64_t paceTokens;
+	uint64_t paceStamp;
+	uint64_t pacedWrites;
+	struct list_head paced;		// local done, held back
+	int paceFd;			// timerfd, to release them
+	event_id_t paceEvent;
 };
 
+static void
+tdadaptdr_finish_request(struct tdadaptdr_state *prv,
+			 struct adaptdr_request *adaptdr, int err)
+{
+	td_complete_request(adaptdr->treq, err);
+	td_pool_put(&prv->adaptdr_pool, adaptdr);
+}
+
+/*
+ * Pick the pacing rate from how close the backlog is to the nearest of
+ * its bounds, in per mille: twice the drain rate at half way, down to
+ * the drain rate itself at the bound, where we go sync anyway.
+ */
+static void
+tdadaptdr_update_pace(struct tdadaptdr_state *prv)
+{
+	uint64_t drain, pending, p, q, rate = 0;
+
+	if (!prv->opts.pace || !prv->opts.window ||
+	    __atomic_load_n(&prv->stream.ack_failed, __ATOMIC_ACQUIRE))
+		goto out;
+
+	drain = dr_stream_drain_rate(&prv->stream);
+	if (!drain)
+		goto out;
+
+	pending = dr_stream_pending(&prv->stream);
+
+	p = pending * 4000 / (3ULL * prv->stream.ring.size);
+	if (prv->opts.rpo_ms) {
+		q = dr_stream_lag_us(&prv->stream) / prv->opts.rpo_ms;
+		p = MAX(p, q);
+	}
+	if (prv->opts.lag_max) {
+		q = pending * 1000 / prv->opts.lag_max;
+		p = MAX(p, q);
+	}
+
+	if (p < 500)
+		goto out;
+
+	p    = MIN(p, 1000);
+	rate = drain + drain * 2 * (1000 - p) / 1000;
+
+out:
+	if (!rate != !prv->paceRate) {
+		DPRINTF("adaptdr: %s pacing writes, %u bytes pending, "
+			"drain rate %llu bytes/s\n", rate ? "start" : "stop",
+			dr_stream_pending(&prv->stream),
+			(unsigned long long)dr_stream_drain_rate(&prv->stream));
+		prv->paceTokens = 0;
+		prv->paceStamp  = dr_stream_now();
+	}
+
+	prv->paceRate = rate;
+}
+
+static void
+tdadaptdr_update_mode(struct tdadaptdr_state *prv)
+{
+	uint64_t lag, rpo, pending;
+	uint32_t occupancy;
+	int sync;
+
+	tdadaptdr_update_pace(prv);
+
+	if (!prv->opts.window ||
+	    __atomic_load_n(&prv->stream.ack_failed, __ATOMIC_ACQUIRE)) {
+		sync = 0;
+		goto out;
+	}
+
+	lag       = dr_stream_lag_us(&prv->stream);
+	rpo       = (uint64_t)prv->opts.rpo_ms * 1000;
+	pending   = dr_stream_pending(&prv->stream);
+	occupancy = pending * 4ULL / prv->stream.ring.size;
+
+	if (!prv->sync)
+		sync = lag > rpo || occupancy >= 3 ||
+			(prv->opts.lag_max && pending > prv->opts.lag_max);
+	else
+		sync = lag >= rpo / 2 || occupancy >= 1 ||
+			(prv->opts.lag_max && pending >= prv->opts.lag_max / 2);
+
+out:
+	if (sync == prv->sync)
+		return;
+
+	DPRINTF("adaptdr: switching to %s replication, lag %lluus, "
+		"%u bytes pending\n", sync ? "sync" : "async",
+		(unsigned long long)dr_stream_lag_us(&prv->stream),
+		dr_stream_pending(&prv->stream));
+
+	prv->sync = sync;
+	prv->modeSwitches++;
+}
+
+/*
+ * Complete held back writes as far as the tokens go, oldest first, and
+ * set the timer for when the next one may go. Without a rate, all go.
+ */
+static void
+tdadaptdr_pace_release(struct tdadaptdr_state *prv)
+{
+	struct adaptdr_request *adaptdr;
+	struct itimerspec its;
+	uint64_t now, dt, us;
+
+	now = dr_stream_now();
+	if (prv->paceRate) {
+		dt = MIN(now - prv->paceStamp, 1000000);
+		prv->paceTokens += dt * prv->paceRate / 1000000;
+		prv->paceTokens  = MIN(prv->paceTokens, (int64_t)
+				       (prv->paceRate * DR_PACE_BURST_MS / 1000));
+	}
+	prv->paceStamp = now;
+
+	while (!list_empty(&prv->paced)) {
+		if (prv->paceRate && prv->paceTokens < 0)
+			break;
+
+		adaptdr = list_entry(prv->paced.next,
+				     struct adaptdr_request, next);
+		list_del_init(&adaptdr->next);
+
+		if (prv->paceRate)
+			prv->paceTokens -= (int64_t)adaptdr->treq.secs <<
+				SECTOR_SHIFT;
+		tdadaptdr_finish_request(prv, adaptdr, adaptdr->err);
+	}
+
+	memset(&its, 0, sizeof(its));
+	if (!list_empty(&prv->paced)) {
+		us = -prv->paceTokens * 1000000 / prv->paceRate + 1;
+		its.it_value.tv_sec  = us / 1000000;
+		its.it_value.tv_nsec = (us % 1000000) * 1000;
+	}
+	timerfd_settime(prv->paceFd, 0, &its, NULL);
+}
+
+static void
+tdadaptdr_pace_event(event_id_t id, char mode, void *private)
+{
+	struct tdadaptdr_state *prv = private;
+	uint64_t val;
+	int gcc = read(prv->paceFd, &val, sizeof(val));
+	if (gcc) {};
+
+	tdadaptdr_update_pace(prv);
+	tdadaptdr_pace_release(prv);
+}
+
+/* The scheduler counts timeouts in seconds, pacing needs finer ones. */
+static int
+tdadaptdr_pace_init(struct tdadaptdr_state *prv)
+{
+	int err;
+
+	prv->paceFd = timerfd_create(CLOCK_MONOTONIC,
+				     TFD_NONBLOCK | TFD_CLOEXEC);
+	if (prv->paceFd < 0) {
+		err = -errno;
+		DPRINTF("unable to create pacing timer: %d\n", err);
+		return err;
+	}
+
+	prv->paceEvent =
+		tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
+					      prv->paceFd, 0,
+					      tdadaptdr_pace_event, prv);
+	if (prv->paceEvent < 0) {
+		err = prv->paceEvent;
+		prv->paceEvent = 0;
+		close(prv->paceFd);
+		prv->paceFd = -1;
+		return err;
+	}
+
+	return 0;
+}
+
+static void
+tdadaptdr_pace_free(struct tdadaptdr_state *prv)
+{
+	if (prv->paceEvent) {
+		tapdisk_server_unregister_event(prv->paceEvent);
+		prv->paceEvent = 0;
+	}
+
+	if (prv->paceFd >= 0) {
+		close(prv->paceFd);
+		prv->paceFd = -1;
+	}
+}
+
+/*
+ * Complete the writes the backup has caught up with. Once we are back
+ * to async, or the backup is gone, nobody waits any longer.
+ */
+static void
+tdadaptdr_ack_event(event_id_t id, char mode, void *private)
+{
+	struct tdadaptdr_state *prv = private;
+	struct adaptdr_request *adaptdr, *tmp;
+	uint64_t acked;
+
+	dr_stream_ack_drain(&prv->stream);
+	tdadaptdr_update_mode(prv);
 
-pthread_mutex_t adaptdr_bufPtrsMutex     = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t  adaptdr_bufPtrsCondition  = PTHREAD_COND_INITIALIZER;
-uint64_t adaptdr_writePtr = 0;
-uint64_t adaptdr_readPtr = 0;
-//struct req_info circRinfo[DRBUFSIZE];
-//char circData[DRBUFSIZE*DR_MAX_WRITE_SIZE];	// TODO this assumes max of 4K per request
+	acked = dr_stream_acked(&prv->stream);
 
-char adaptdr_circRinfoAndData[(DR_MAX_WRITE_SIZE + REQ_INFO_SIZE)*DRBUFSIZE];
+	list_for_each_entry_safe(adaptdr, tmp, &prv->waiting, next) {
+		if (prv->sync && adaptdr->writeID > acked)
+			continue;
 
-void *adaptdr_thread_dispatch_writes(void *ptr);
+		list_del_init(&adaptdr->next);
+		tdadaptdr_finish_request(prv, adaptdr, adaptdr->err);
+	}
+
+	tdadaptdr_pace_release(prv);
+}
 
 
 /*Get Image size, secsize*/
@@ -123,30 +367,18 @@ static int tdadaptdr_get_image_info(int fd, td_disk_info_t *info)
 			(long long unsigned)(info->size << SECTOR_SHIFT),
 			(long long unsigned)info->size);
 
-		/*Get the sector size*/
-#if defined(BLKSSZGET)
-		{
-			info->sector_size = DEFAULT_SECTOR_SIZE;
-			ioctl(fd, BLKSSZGET, &info->sector_size);
-			
-			if (info->sector_size != DEFAULT_SECTOR_SIZE)
-				DPRINTF("Note: sector size is %ld (not %d)\n",
-					info->sector_size, DEFAULT_SECTOR_SIZE);
-		}
-#else
-		info->sector_size = DEFAULT_SECTOR_SIZE;
-#endif
-
 	} else {
 		/*Local file? try fstat instead*/
 		info->size = (stat.st_size >> SECTOR_SHIFT);
-		info->sector_size = DEFAULT_SECTOR_SIZE;
 		DPRINTF("Image size: \n\tpre sector_shift  [%llu]\n\tpost "
 			"sector_shift [%llu]\n",
 			(long long unsigned)(info->size << SECTOR_SHIFT),
 			(long long unsigned)info->size);
 	}
 
+	tapdisk_get_sector_size(fd, &info->sector_size,
+				&info->physical_sector_size);
+
 	if (info->size == 0) {		
 		info->size =((uint64_t) 16836057);
 		info->sector_size = DEFAULT_SECTOR_SIZE;
@@ -156,9 +388,45 @@ static int tdadaptdr_get_image_info(int fd, td_disk_info_t *info)
 	return 0;
 }
 
+/* Open a raw image, with O_DIRECT if we can, and get its size. */
+static int tdadaptdr_open_image(td_driver_t *driver, const char *path,
+			       td_flag_t flags)
+{
+	int fd, err, o_flags;
+
+	o_flags = O_DIRECT | O_LARGEFILE |
+		((flags & TD_OPEN_RDONLY) ? O_RDONLY : O_RDWR);
+	fd = open(path, o_flags);
+
+	if (fd == -1 && errno == EINVAL) {
+		/* Maybe O_DIRECT isn't supported. */
+		o_flags &= ~O_DIRECT;
+		fd = open(path, o_flags);
+		if (fd != -1)
+			DPRINTF("WARNING: Accessing image without "
+				"O_DIRECT! (%s)\n", path);
+	} else if (fd != -1)
+		DPRINTF("open(%s) with O_DIRECT\n", path);
+
+	if (fd == -1) {
+		err = -errno;
+		DPRINTF("Unable to open [%s] (%d)!\n", path, err);
+		return err;
+	}
+
+	err = tdadaptdr_get_image_info(fd, &driver->info);
+	if (err) {
+		close(fd);
+		return err;
+	}
+
+	return fd;
+}
+
 /* Find out the server name, port, and disk image file
  *
  *  name has format = obelix29:9000:/home/twood/vms/testdisk.img
+ *  or, for a backup on this host, shm:<name>:/home/twood/vms/testdisk.img
  *
  * */
 int tdadaptdr_get_args(td_driver_t *driver, const char* name)
@@ -189,6 +457,10 @@ int tdadaptdr_get_args(td_driver_t *driver, const char* name)
 		DPRINTF("unable to allocate port\n");
 		return -ENOMEM;
 	}
+	if (!(state->backupTarget = strndup(name, seperator - name))) {
+		DPRINTF("unable to allocate target\n");
+		return -ENOMEM;
+	}
 	portnum = atoi(port);
 
 	seperator++; // move past ":"
@@ -198,6 +470,11 @@ int tdadaptdr_get_args(td_driver_t *driver, const char* name)
 		return -ENOMEM;
 	}
 
+	if (dr_parse_options(state->imageFile, &state->opts)) {
+		DPRINTF("bad DR options in %s\n", file);
+		return -EINVAL;
+	}
+
 	state->backupPort = portnum;
 
 	DPRINTF("host: %s, port: %d, image path: %s\n",
@@ -208,88 +485,22 @@ int tdadaptdr_get_args(td_driver_t *driver, const char* name)
 	return 0;
 }
 
-int tdadaptdr_connectTobackup(struct tdadaptdr_state *state) {
-	int portno, n;
-	struct sockaddr_in serv_addr;
-	struct hostent *server;
-	char buffer[256];
-
-
-	state->backupSocket = socket(AF_INET, SOCK_STREAM, 0);
-	if (state->backupSocket < 0) {
-		DPRINTF("ERROR opening socket");
-		return -1;
-	}
-
-	portno = state->backupPort;
-	server = gethostbyname(state->backupHost);
-
-	if (server == NULL) {
-		DPRINTF("no such host");
-		return -1;
-	}
-	bzero((char *) &serv_addr, sizeof(serv_addr));
-	serv_addr.sin_family = AF_INET;
-	bcopy((char *)server->h_addr,
-		 (char *)&serv_addr.sin_addr.s_addr,
-		 server->h_length);
-	serv_addr.sin_port = htons(portno);
-	if (connect(state->backupSocket,&serv_addr,sizeof(serv_addr)) < 0){
-		DPRINTF("ERROR CONNECTING");
-		return -1;
-	}
-
-	bzero(buffer,256);
-	strcpy(buffer,state->imageFile);
-
-	n = write(state->backupSocket,buffer,strlen(buffer));
-	if (n < 0) {
-		DPRINTF("ERROR writing to socket");
-		return -1;
-	}
-	bzero(buffer,256);
-	n = read(state->backupSocket,buffer,255);
-	if (n < 0) {
-		DPRINTF("ERROR reading from socket");
-		return -1;
-	}
-
-	DPRINTF("read: %s", buffer);
-/*
- * UNfinished attempt at registering event handlers?????
-	if((state->backupSocketId = tapdisk_server_register_event(SCHEDULER_POLL_READ_FD, state->backupSocket, 0, eventRecvFromBackup, state)) < 0) {
-		DPRINTF("error registering client event handler: %s\n", strerror(state->backupSocketId));
-		//close(fd);
-		return -1;
-	}
-*/
-
-	return 0;
-}
-
 
 /* Open the disk file and initialize adaptdr state. */
 int tdadaptdr_open(td_driver_t *driver, const char *name, td_flag_t flags)
 {
-	int i, fd, ret, o_flags;
+	int i, fd, ret;
 	struct tdadaptdr_state *prv;
-	pthread_t thread1;
 
 	ret = 0;
 	prv = (struct tdadaptdr_state *)driver->data;
 
 	DPRINTF("block-adaptdr open('%s')", name);
 
-	if(sizeof(struct req_info) > REQ_INFO_SIZE)
-	{
-		DPRINTF("DR ERROR -- REQ_INFO_SIZE is set too small: %d > %d", (int) sizeof(struct req_info), (int) REQ_INFO_SIZE);
-	}
-
 	memset(prv, 0, sizeof(struct tdadaptdr_state));
 
-	prv->adaptdr_free_count = MAX_AIO_REQS;
-	for (i = 0; i < MAX_AIO_REQS; i++)
-		prv->adaptdr_free_list[i] = &prv->adaptdr_requests[i];
+	td_pool_init(&prv->adaptdr_pool, sizeof(struct adaptdr_request),
+		     TD_POOL_CHUNK, TD_POOL_LIMIT);
 
 	ret = tdadaptdr_get_args(driver, name);
 	if(ret) {
@@ -297,39 +508,120 @@ int tdadaptdr_open(td_driver_t *driver, const char *name, td_flag_t flags)
 		goto done;
 	}
 
-	/* Open the file */
-	o_flags = O_DIRECT | O_LARGEFILE |
-		((flags & TD_OPEN_RDONLY) ? O_RDONLY : O_RDWR);
-        fd = open(prv->imageFile, o_flags);
+	/* Open the file, unless the image below does the I/O */
+	fd = -1;
+	if (!prv->opts.filter) {
+		fd = tdadaptdr_open_image(driver, prv->imageFile, flags);
+		if (fd < 0) {
+			ret = fd;
+			goto done;
+		}
+	}
 
-        if ( (fd == -1) && (errno == EINVAL) ) {
+	/* Setup state for network/backup server */
+	prv->pendingWrite = 0;
+	prv->committedWrite = 0;
+	INIT_LIST_HEAD(&prv->waiting);
+	INIT_LIST_HEAD(&prv->paced);
+	prv->paceFd = -1;
 
-                /* Maybe O_DIRECT isn't supported. */
-		o_flags &= ~O_DIRECT;
-                fd = open(prv->imageFile, o_flags);
-                if (fd != -1) DPRINTF("WARNING: Accessing image without"
-                                     "O_DIRECT! (%s)\n", prv->imageFile);
+	ret = dr_stream_init(&prv->stream, prv->opts.ring);
+	if (ret) {
+		DPRINTF("unable to allocate replication ring: %d\n", ret);
+		close(fd);
+		goto done;
+	}
+	prv->stream.absorb = prv->opts.absorb;
+	prv->stream.crc = prv->opts.crc;
+	prv->stream.coalesce = prv->opts.coalesce;
+	dr_stream_sockopts(&prv->stream, &prv->opts.sock);
 
-        } else if (fd != -1) DPRINTF("open(%s) with O_DIRECT\n", prv->imageFile);
+	ret = dr_stream_epochs(&prv->stream, prv->opts.epoch_writes,
+			       prv->opts.epoch_ms);
+	if (ret) {
+		dr_stream_free(&prv->stream);
+		close(fd);
+		goto done;
+	}
 
-        if (fd == -1) {
-		DPRINTF("Unable to open [%s] (%d)!\n", prv->imageFile, 0 - errno);
-        	ret = 0 - errno;
-        	goto done;
-        }
+	if (prv->opts.group) {
+		ret = dr_stream_group(&prv->stream, prv->opts.group);
+		if (ret) {
+			dr_stream_free(&prv->stream);
+			close(fd);
+			goto done;
+		}
+	}
 
-	ret = tdadaptdr_get_image_info(fd, &driver->info);
+	if (prv->opts.tls) {
+		ret = dr_stream_tls(&prv->stream, prv->opts.tls);
+		if (ret) {
+			dr_stream_free(&prv->stream);
+			close(fd);
+			goto done;
+		}
+	}
 
-	/* Setup state for network/backup server */
-	prv->pendingWrite = 0;
-	prv->committedWrite = 0;
+	if (prv->opts.valve) {
+		ret = dr_stream_valve(&prv->stream, prv->opts.valve);
+		if (ret) {
+			dr_stream_free(&prv->stream);
+			close(fd);
+			goto done;
+		}
+	}
+
+	if (prv->opts.spill) {
+		ret = dr_stream_spill(&prv->stream, prv->opts.spill,
+				      prv->opts.spill_max);
+		if (ret) {
+			dr_stream_free(&prv->stream);
+			close(fd);
+			goto done;
+		}
+	}
+
+	if (prv->opts.resync) {
+		ret = dr_stream_resync(&prv->stream, driver, fd,
+				       &prv->pendingWrite);
+		if (ret) {
+			dr_stream_free(&prv->stream);
+			close(fd);
+			goto done;
+		}
+	}
+
+	/* connected to in the background, see dr_target_reconnect() */
+	ret = dr_stream_connect(&prv->stream, prv->backupTarget,
+				prv->imageFile, prv->opts.codec,
+				prv->opts.dedup, prv->opts.mux);
+	for (i = 0; !ret && i < prv->opts.n_targets; i++)
+		ret = dr_stream_connect(&prv->stream, prv->opts.targets[i],
+					prv->imageFile, prv->opts.codec,
+					prv->opts.dedup, prv->opts.mux);
+	if (ret) {
+		DPRINTF("unable to add backup: %d\n", ret);
+		dr_stream_free(&prv->stream);
+		close(fd);
+		goto done;
+	}
 
+	if (!prv->opts.window)
+		DPRINTF("adaptdr: window=0, no ACKs, staying async\n");
 
-	DPRINTF("Connecting to backup...");
-	tdadaptdr_connectTobackup(prv);
-	DPRINTF("connection made!");
+	prv->ackEvent =
+		tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
+					      dr_stream_ack_fd(&prv->stream), 0,
+					      tdadaptdr_ack_event, prv);
+	if (prv->ackEvent < 0) {
+		ret = prv->ackEvent;
+		prv->ackEvent = 0;
+	} else
+		ret = tdadaptdr_pace_init(prv);
 
-	ret = pthread_create( &thread1, NULL, adaptdr_thread_dispatch_writes,prv);
+	if (!ret)
+		ret = dr_stream_start(&prv->stream, prv->opts.window,
+				      prv->opts.quorum);
 
 	if(ret) {
 		DPRINTF("pthread error: %d\n", ret);
@@ -338,7 +630,18 @@ int tdadaptdr_open(td_driver_t *driver, const char *name, td_flag_t flags)
 		DPRINTF("Thread started correctly\n");
 	}
 
+	if (!ret && prv->opts.seed)
+		ret = dr_stream_seed(&prv->stream, driver, prv->opts.seed,
+				     &prv->pendingWrite);
+
+	if (!ret && prv->opts.failback)
+		ret = dr_stream_failback(&prv->stream, prv->opts.failback);
+
 	if (ret) {
+		if (prv->ackEvent)
+			tapdisk_server_unregister_event(prv->ackEvent);
+		tdadaptdr_pace_free(prv);
+		dr_stream_free(&prv->stream);
 		close(fd);
 		goto done;
 	}
@@ -354,8 +657,37 @@ void tdadaptdr_complete(void *arg, struct tiocb *tiocb, int err)
 	struct adaptdr_request *adaptdr = (struct adaptdr_request *)arg;
 	struct tdadaptdr_state *prv = adaptdr->state;
 
-	td_complete_request(adaptdr->treq, err);
-	prv->adaptdr_free_list[prv->adaptdr_free_count++] = adaptdr;
+	if (!err && adaptdr->sync && prv->sync &&
+	    adaptdr->writeID > dr_stream_acked(&prv->stream)) {
+		adaptdr->err = err;
+		list_add_tail(&adaptdr->next, &prv->waiting);
+		return;
+	}
+
+	/* behind any held back already, to keep completions in order */
+	if (!err && adaptdr->writeID &&
+	    (prv->paceRate || !list_empty(&prv->paced))) {
+		adaptdr->err = err;
+		list_add_tail(&adaptdr->next, &prv->paced);
+		prv->pacedWrites++;
+		tdadaptdr_pace_release(prv);
+		return;
+	}
+
+	tdadaptdr_finish_request(prv, adaptdr, err);
+}
+
+/* The chain may complete a forwarded write in pieces. */
+static void
+tdadaptdr_forward_done(td_request_t treq, int err)
+{
+	struct adaptdr_request *adaptdr = treq.cb_data;
+
+	adaptdr->secs -= treq.secs;
+	adaptdr->err   = adaptdr->err ? : err;
+
+	if (!adaptdr->secs)
+		tdadaptdr_complete(adaptdr, NULL, adaptdr->err);
 }
 
 void tdadaptdr_queue_read(td_driver_t *driver, td_request_t treq)
@@ -366,15 +698,22 @@ void tdadaptdr_queue_read(td_driver_t *driver, td_request_t treq)
 	struct tdadaptdr_state *prv;
 
 	prv    = (struct tdadaptdr_state *)driver->data;
-	size   = treq.secs * driver->info.sector_size;
-	offset = treq.sec  * (uint64_t)driver->info.sector_size;
+	size   = treq.secs << SECTOR_SHIFT;
+	offset = (uint64_t)treq.sec << SECTOR_SHIFT;
+
+	if (prv->opts.filter) {
+		td_forward_request(treq);
+		return;
+	}
 
-	if (prv->adaptdr_free_count == 0)
+	adaptdr = td_pool_get(&prv->adaptdr_pool);
+	if (!adaptdr)
 		goto fail;
 
-	adaptdr        = prv->adaptdr_free_list[--prv->adaptdr_free_count];
 	adaptdr->treq  = treq;
 	adaptdr->state = prv;
+	adaptdr->sync  = 0;
+	adaptdr->writeID = 0;
 
 	td_prep_read(&adaptdr->tiocb, prv->fd, treq.buf,
 		     size, offset, tdadaptdr_complete, adaptdr);
@@ -388,100 +727,179 @@ fail:
 
 void tdadaptdr_queue_write(td_driver_t *driver, td_request_t treq)
 {
-	int size;
+	int size, err;
 	uint64_t offset;
 	struct adaptdr_request *adaptdr;
 	struct tdadaptdr_state *prv;
-	// data for sending request to backup !TW!
-	struct req_info *rinfo;
-	char* dataptr;
 
 
 	prv     = (struct tdadaptdr_state *)driver->data;
-	size    = treq.secs * driver->info.sector_size;
-	offset  = treq.sec  * (uint64_t)driver->info.sector_size;
+	size    = treq.secs << SECTOR_SHIFT;
+	offset  = (uint64_t)treq.sec << SECTOR_SHIFT;
 
-	if (prv->adaptdr_free_count == 0)
+	err     = -EBUSY;
+	adaptdr = td_pool_get(&prv->adaptdr_pool);
+	if (!adaptdr)
 		goto fail;
 
-	adaptdr        = prv->adaptdr_free_list[--prv->adaptdr_free_count];
-	adaptdr->treq  = treq;
-	adaptdr->state = prv;
+	/*
+	 * Never sleep on a full ring here, that would stall the whole
+	 * server. Bounce the write before touching the local image; the
+	 * vbd requeues it and retries once the ring drains.
+	 */
+	err = dr_stream_reserve(&prv->stream, size);
+	if (err) {
+		td_pool_put(&prv->adaptdr_pool, adaptdr);
+		goto fail;
+	}
+
+	tdadaptdr_update_mode(prv);
+
+	adaptdr->treq    = treq;
+	adaptdr->state   = prv;
+	adaptdr->writeID = ++prv->pendingWrite;
+	adaptdr->sync    = prv->sync;
+	adaptdr->err     = 0;
+
+	dr_stream_queue_write(&prv->stream, adaptdr->writeID,
+			      offset, treq.buf, size);
+
+	if (prv->opts.filter) {
+		td_request_t clone = treq;
+
+		adaptdr->secs = treq.secs;
+		clone.cb      = tdadaptdr_forward_done;
+		clone.cb_data = adaptdr;
+		td_forward_request(clone);
+		return;
+	}
 
 	td_prep_write(&adaptdr->tiocb, prv->fd, treq.buf,
 		      size, offset, tdadaptdr_complete, adaptdr);
 	td_queue_tiocb(driver, &adaptdr->tiocb);
 
+	return;
 
-	/*** WRITER (PRODUCER) */
-	pthread_mutex_lock(&adaptdr_bufPtrsMutex);
-	while(adaptdr_writePtr - adaptdr_readPtr >= DRBUFSIZE) { // while FULL
-		pthread_cond_wait( &adaptdr_bufPtrsCondition, &adaptdr_bufPtrsMutex );
-	}
-	pthread_mutex_unlock(&adaptdr_bufPtrsMutex);
-
-	//DPRINTF("Handling request %llu\n", (unsigned long long)adaptdr_writePtr);
-	// fill in write request info
-	////////rinfo = (struct req_info*) &(circRinfo[adaptdr_writePtr % DRBUFSIZE]);
-	rinfo = (struct req_info*) &(adaptdr_circRinfoAndData
-			[adaptdr_writePtr*(REQ_INFO_SIZE + DR_MAX_WRITE_SIZE)
-			 % (DRBUFSIZE*(REQ_INFO_SIZE + DR_MAX_WRITE_SIZE))]);
-	rinfo->size = size;
-	rinfo->offset = offset;
-	rinfo->writeID = ++prv->pendingWrite;
-
-	//DPRINTF("Copying data buffer\n");
-	// copy data buffer
-	//////rinfo->dataPtr = &(circData[(adaptdr_writePtr*DR_MAX_WRITE_SIZE) % (DRBUFSIZE*DR_MAX_WRITE_SIZE)]);
-	//dataptr = (char*)(rinfo + sizeof(struct req_info));
-	dataptr	= (char*)&(adaptdr_circRinfoAndData
-				[adaptdr_writePtr*(REQ_INFO_SIZE + DR_MAX_WRITE_SIZE)
-				 % (DRBUFSIZE*(REQ_INFO_SIZE + DR_MAX_WRITE_SIZE))
-				 + sizeof(struct req_info)]);
-	memcpy(dataptr, treq.buf, size);
-
-	pthread_mutex_lock(&adaptdr_bufPtrsMutex);
-	adaptdr_writePtr++;
-	if(adaptdr_writePtr != adaptdr_readPtr)
-		pthread_cond_signal(&adaptdr_bufPtrsCondition);
-	pthread_mutex_unlock(&adaptdr_bufPtrsMutex);
+fail:
+	td_complete_request(treq, dr_stream_reserve_error(err));
+}
 
+/*
+ * Discards are not replicated, the backup keeps the old blocks, which
+ * is what a discarded range may read back as anyway.
+ */
+void tdadaptdr_queue_discard(td_driver_t *driver, td_request_t treq)
+{
+	uint64_t size, offset;
+	struct tdadaptdr_state *prv;
+	int err;
 
-	return;
+	prv     = (struct tdadaptdr_state *)driver->data;
+	size    = (uint64_t)treq.secs << SECTOR_SHIFT;
+	offset  = (uint64_t)treq.sec << SECTOR_SHIFT;
 
-fail:
-	td_complete_request(treq, -EBUSY);
+	if (prv->opts.filter) {
+		td_forward_request(treq);
+		return;
+	}
+
+	err = tapdisk_discard_range(prv->fd, offset, size);
+	td_complete_request(treq, err);
 }
 
-int tdadaptdr_close(td_driver_t *driver)
+/*
+ * Backups are fed by their own stream and not flushed along; a filter's
+ * child is flushed as an image of its own.
+ */
+int tdadaptdr_sync(td_driver_t *driver)
 {
-	struct req_info rinfo; // send zero'd out req_info to indicate close
-	int rc;
 	struct tdadaptdr_state *prv = (struct tdadaptdr_state *)driver->data;
 
-	bzero(&rinfo, sizeof(struct req_info));
+	if (prv->opts.filter || prv->fd < 0)
+		return 0;
+
+	return fdatasync(prv->fd) ? -errno : 0;
+}
 
-	rc = sendexact(prv->backupSocket, (char*)(&rinfo), sizeof(struct req_info));
-	if (rc < 0) {
-		DPRINTF("ERROR writing req info to socket");
-		return -1;
+int tdadaptdr_close(td_driver_t *driver)
+{
+	struct tdadaptdr_state *prv = (struct tdadaptdr_state *)driver->data;
+
+	if (prv->ackEvent) {
+		tapdisk_server_unregister_event(prv->ackEvent);
+		prv->ackEvent = 0;
 	}
-	close(prv->backupSocket);
+	tdadaptdr_pace_free(prv);
 
-	close(prv->fd);
+	/* also sends the close marker to every backup */
+	dr_stream_free(&prv->stream);
+
+	if (prv->fd >= 0)
+		close(prv->fd);
+	td_pool_destroy(&prv->adaptdr_pool);
 
 	return 0;
 }
 
+/* Stacked, the image below comes from the chain, not from us. */
 int tdadaptdr_get_parent_id(td_driver_t *driver, td_disk_id_t *id)
 {
-	return TD_NO_PARENT;
+	struct tdadaptdr_state *prv = (struct tdadaptdr_state *)driver->data;
+
+	return prv->opts.filter ? -EINVAL : TD_NO_PARENT;
 }
 
 int tdadaptdr_validate_parent(td_driver_t *driver,
 			  td_driver_t *pdriver, td_flag_t flags)
 {
-	return -EINVAL;
+	struct tdadaptdr_state *prv = (struct tdadaptdr_state *)driver->data;
+
+	return prv->opts.filter ? 0 : -EINVAL;
+}
+
+void tdadaptdr_stats(td_driver_t *driver, td_stats_t *st)
+{
+	struct tdadaptdr_state *prv = (struct tdadaptdr_state *)driver->data;
+
+	tapdisk_stats_field(st, "reqs", "{");
+	td_pool_stats(&prv->adaptdr_pool, st);
+	tapdisk_stats_leave(st, '}');
+
+	/*
+	 * writes is [ last queued, last acknowledged ]
+	 */
+	tapdisk_stats_field(st, "dr", "{");
+	tapdisk_stats_field(st, "writes", "[");
+	tapdisk_stats_val(st, "llu", prv->pendingWrite);
+	tapdisk_stats_val(st, "llu", dr_stream_acked(&prv->stream));
+	tapdisk_stats_leave(st, ']');
+
+	tapdisk_stats_field(st, "mode", "s", prv->sync ? "sync" : "async");
+	tapdisk_stats_field(st, "switches", "llu", prv->modeSwitches);
+	tapdisk_stats_field(st, "rpo_ms", "u", prv->opts.rpo_ms);
+	tapdisk_stats_field(st, "lag_max", "llu",
+			    (unsigned long long)prv->opts.lag_max);
+
+	/*
+	 * pace is [ bytes/s allowed now, 0 if unpaced, writes held back so far ]
+	 */
+	tapdisk_stats_field(st, "pace", "[");
+	tapdisk_stats_val(st, "llu", prv->paceRate);
+	tapdisk_stats_val(st, "llu", prv->pacedWrites);
+	tapdisk_stats_leave(st, ']');
+	dr_stream_stats(&prv->stream, st);
+	tapdisk_stats_leave(st, '}');
+}
+
+int tdadaptdr_footprint(td_driver_t *driver, int trim, uint64_t *bytes)
+{
+	struct tdadaptdr_state *prv = (struct tdadaptdr_state *)driver->data;
+
+	if (trim)
+		td_pool_trim(&prv->adaptdr_pool);
+
+	*bytes = td_pool_bytes(&prv->adaptdr_pool);
+	return 0;
 }
 
 struct tap_disk tapdisk_adaptdr = {
@@ -492,66 +910,11 @@ struct tap_disk tapdisk_adaptdr = {
 	.td_close           = tdadaptdr_close,
 	.td_queue_read      = tdadaptdr_queue_read,
 	.td_queue_write     = tdadaptdr_queue_write,
+	.td_queue_discard   = tdadaptdr_queue_discard,
+	.td_sync            = tdadaptdr_sync,
 	.td_get_parent_id   = tdadaptdr_get_parent_id,
 	.td_validate_parent = tdadaptdr_validate_parent,
 	.td_debug           = NULL,
+	.td_stats           = tdadaptdr_stats,
+	.td_footprint       = tdadaptdr_footprint,
 };
-
-/* !TW! Function used for worker thread that does all network sends */
-void *adaptdr_thread_dispatch_writes(void *stateptr) {
-	struct req_info *rinfo;
-	int done=0;
-	int rc;
-	struct tdadaptdr_state *state = (struct tdadaptdr_state *)stateptr;
-
-	DPRINTF("Thread started!\n");
-
-	while(!done) {
-
-		pthread_mutex_lock(&adaptdr_bufPtrsMutex);
-		while(adaptdr_readPtr == adaptdr_writePtr) {	//while empty
-			pthread_cond_wait( &adaptdr_bufPtrsCondition, &adaptdr_bufPtrsMutex );
-		}
-		pthread_mutex_unlock(&adaptdr_bufPtrsMutex);
-		//DPRINTF("Thread: Handling request %llu\n", (unsigned long long)adaptdr_readPtr);
-		//rinfo = (struct req_info*) &(circRinfo[adaptdr_readPtr  % DRBUFSIZE]);
-
-		rinfo = (struct req_info*) &(adaptdr_circRinfoAndData
-					[adaptdr_readPtr*(REQ_INFO_SIZE + DR_MAX_WRITE_SIZE)
-					 % (DRBUFSIZE*(REQ_INFO_SIZE + DR_MAX_WRITE_SIZE))]);
-
-
-		//DPRINTF("Thread: Req %llu   size: %d   offset: %llu \n",
-		//    			(unsigned long long) rinfo->writeID, rinfo->size, (unsigned long long)rinfo->offset);
-
-		// send rinfo and data
-		rc = sendexact(state->backupSocket, (char*)(rinfo),
-				sizeof(struct req_info) + rinfo->size);
-		if (rc < 0) {
-			DPRINTF("ERROR writing combined req + data info to socket");
-			//return;
-			continue;
-		}
-
-		/* NOT NEEDED SINCE INCLUDED IN PREVIOUS SEND
-		rc = sendexact(state->backupSocket,rinfo->dataPtr,rinfo->size);
-		if (rc < 0) {
-			DPRINTF("ERROR writing buffer to socket");
-			//return;
-			continue;
-		}
-		*/
-
-		pthread_mutex_lock(&adaptdr_bufPtrsMutex);
-		adaptdr_readPtr++;
-		if(adaptdr_writePtr - adaptdr_readPtr < DRBUFSIZE)
-			pthread_cond_signal(&adaptdr_bufPtrsCondition);
-		pthread_mutex_unlock(&adaptdr_bufPtrsMutex);
-	}
-
-
-
-	DPRINTF("Thread done.\n");
-
-	return NULL;
-}
@@ -24,6 +24,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <sys/uio.h>
 #include <sys/statvfs.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
@@ -33,8 +34,6 @@
 #include "tapdisk-driver.h"
 #include "tapdisk-interface.h"
 
-#define MAX_AIO_REQS         TAPDISK_DATA_REQUESTS
-
 struct tdaio_state;
 
 struct aio_request {
@@ -47,9 +46,13 @@ struct tdaio_state {
 	int                  fd;
 	td_driver_t         *driver;
 
-	int                  aio_free_count;	
-	struct aio_request   aio_requests[MAX_AIO_REQS];
-	struct aio_request  *aio_free_list[MAX_AIO_REQS];
+	struct td_pool       aio_pool;
+
+	int                  nowait;
+	struct {
+		unsigned long long hits;
+		unsigned long long misses;
+	} nowait_reads;
 };
 
 /*Get Image size, secsize*/
@@ -80,30 +83,18 @@ static int tdaio_get_image_info(int fd, td_disk_info_t *info)
 			(long long unsigned)(info->size << SECTOR_SHIFT),
 			(long long unsigned)info->size);
 
-		/*Get the sector size*/
-#if defined(BLKSSZGET)
-		{
-			info->sector_size = DEFAULT_SECTOR_SIZE;
-			ioctl(fd, BLKSSZGET, &info->sector_size);
-			
-			if (info->sector_size != DEFAULT_SECTOR_SIZE)
-				DPRINTF("Note: sector size is %ld (not %d)\n",
-					info->sector_size, DEFAULT_SECTOR_SIZE);
-		}
-#else
-		info->sector_size = DEFAULT_SECTOR_SIZE;
-#endif
-
 	} else {
 		/*Local file? try fstat instead*/
 		info->size = (stat.st_size >> SECTOR_SHIFT);
-		info->sector_size = DEFAULT_SECTOR_SIZE;
 		DPRINTF("Image size: \n\tpre sector_shift  [%llu]\n\tpost "
 			"sector_shift [%llu]\n",
 			(long long unsigned)(info->size << SECTOR_SHIFT),
 			(long long unsigned)info->size);
 	}
 
+	tapdisk_get_sector_size(fd, &info->sector_size,
+				&info->physical_sector_size);
+
 	if (info->size == 0) {		
 		info->size =((uint64_t) 16836057);
 		info->sector_size = DEFAULT_SECTOR_SIZE;
@@ -116,7 +107,7 @@ static int tdaio_get_image_info(int fd, td_disk_info_t *info)
 /* Open the disk file and initialize aio state. */
 int tdaio_open(td_driver_t *driver, const char *name, td_flag_t flags)
 {
-	int i, fd, ret, o_flags;
+	int fd, ret, o_flags;
 	struct tdaio_state *prv;
 
 	ret = 0;
@@ -126,16 +117,18 @@ int tdaio_open(td_driver_t *driver, const char *name, td_flag_t flags)
 
 	memset(prv, 0, sizeof(struct tdaio_state));
 
-	prv->aio_free_count = MAX_AIO_REQS;
-	for (i = 0; i < MAX_AIO_REQS; i++)
-		prv->aio_free_list[i] = &prv->aio_requests[i];
+	td_pool_init(&prv->aio_pool, sizeof(struct aio_request),
+		     TD_POOL_CHUNK, TD_POOL_LIMIT);
 
 	/* Open the file */
 	o_flags = O_DIRECT | O_LARGEFILE | 
 		((flags & TD_OPEN_RDONLY) ? O_RDONLY : O_RDWR);
+	if (driver->profile.direct == TD_IO_DIRECT_NONE)
+		o_flags &= ~O_DIRECT;
         fd = open(name, o_flags);
 
-        if ( (fd == -1) && (errno == EINVAL) ) {
+        if ( (fd == -1) && (errno == EINVAL) && (o_flags & O_DIRECT) &&
+	     driver->profile.direct != TD_IO_DIRECT_REQUIRE ) {
 
                 /* Maybe O_DIRECT isn't supported. */
 		o_flags &= ~O_DIRECT;
@@ -158,6 +151,11 @@ int tdaio_open(td_driver_t *driver, const char *name, td_flag_t flags)
 	}
 
         prv->fd = fd;
+#ifdef RWF_NOWAIT
+	prv->nowait = !(o_flags & O_DIRECT);
+#endif
+	if (prv->nowait)
+		DPRINTF("%s: buffered, RWF_NOWAIT reads\n", name);
 
 done:
 	return ret;	
@@ -169,7 +167,35 @@ void tdaio_complete(void *arg, struct tiocb *tiocb, int err)
 	struct tdaio_state *prv = aio->state;
 
 	td_complete_request(aio->treq, err);
-	prv->aio_free_list[prv->aio_free_count++] = aio;
+	td_pool_put(&prv->aio_pool, aio);
+}
+
+/*
+ * Buffered reads first try the page cache inline, completing now on a
+ * hit. Anything short goes to the queue as a whole.
+ */
+static int
+tdaio_read_nowait(struct tdaio_state *prv, td_request_t treq,
+		  int size, uint64_t offset)
+{
+#ifdef RWF_NOWAIT
+	struct iovec iov = { .iov_base = treq.buf, .iov_len = size };
+	ssize_t n;
+
+	n = preadv2(prv->fd, &iov, 1, offset, RWF_NOWAIT);
+	if (n == size) {
+		prv->nowait_reads.hits++;
+		return 0;
+	}
+
+	if (n < 0 && errno == EOPNOTSUPP) {
+		DPRINTF("RWF_NOWAIT not supported, reads queued\n");
+		prv->nowait = 0;
+	}
+
+	prv->nowait_reads.misses++;
+#endif
+	return -EAGAIN;
 }
 
 void tdaio_queue_read(td_driver_t *driver, td_request_t treq)
@@ -180,13 +206,18 @@ void tdaio_queue_read(td_driver_t *driver, td_request_t treq)
 	struct tdaio_state *prv;
 
 	prv    = (struct tdaio_state *)driver->data;
-	size   = treq.secs * driver->info.sector_size;
-	offset = treq.sec  * (uint64_t)driver->info.sector_size;
+	size   = treq.secs << SECTOR_SHIFT;
+	offset = (uint64_t)treq.sec << SECTOR_SHIFT;
+
+	if (prv->nowait && !tdaio_read_nowait(prv, treq, size, offset)) {
+		td_complete_request(treq, 0);
+		return;
+	}
 
-	if (prv->aio_free_count == 0)
+	aio = td_pool_get(&prv->aio_pool);
+	if (!aio)
 		goto fail;
 
-	aio        = prv->aio_free_list[--prv->aio_free_count];
 	aio->treq  = treq;
 	aio->state = prv;
 
@@ -208,13 +239,13 @@ void tdaio_queue_write(td_driver_t *driver, td_request_t treq)
 	struct tdaio_state *prv;
 
 	prv     = (struct tdaio_state *)driver->data;
-	size    = treq.secs * driver->info.sector_size;
-	offset  = treq.sec  * (uint64_t)driver->info.sector_size;
+	size    = treq.secs << SECTOR_SHIFT;
+	offset  = (uint64_t)treq.sec << SECTOR_SHIFT;
 
-	if (prv->aio_free_count == 0)
+	aio = td_pool_get(&prv->aio_pool);
+	if (!aio)
 		goto fail;
 
-	aio        = prv->aio_free_list[--prv->aio_free_count];
 	aio->treq  = treq;
 	aio->state = prv;
 
@@ -228,11 +259,38 @@ fail:
 	td_complete_request(treq, -EBUSY);
 }
 
+/*
+ * Deallocation is synchronous, neither hole punching nor BLKDISCARD
+ * has an aio counterpart.
+ */
+void tdaio_queue_discard(td_driver_t *driver, td_request_t treq)
+{
+	uint64_t size, offset;
+	struct tdaio_state *prv;
+	int err;
+
+	prv     = (struct tdaio_state *)driver->data;
+	size    = (uint64_t)treq.secs << SECTOR_SHIFT;
+	offset  = (uint64_t)treq.sec << SECTOR_SHIFT;
+
+	err = tapdisk_discard_range(prv->fd, offset, size);
+
+	td_complete_request(treq, err);
+}
+
+int tdaio_sync(td_driver_t *driver)
+{
+	struct tdaio_state *prv = (struct tdaio_state *)driver->data;
+
+	return fdatasync(prv->fd) ? -errno : 0;
+}
+
 int tdaio_close(td_driver_t *driver)
 {
 	struct tdaio_state *prv = (struct tdaio_state *)driver->data;
 	
 	close(prv->fd);
+	td_pool_destroy(&prv->aio_pool);
 
 	return 0;
 }
@@ -251,16 +309,29 @@ int tdaio_validate_parent(td_driver_t *driver,
 void tdaio_stats(td_driver_t *driver, td_stats_t *st)
 {
 	struct tdaio_state *prv = (struct tdaio_state *)driver->data;
-	int n_pending;
-
-	n_pending = MAX_AIO_REQS - prv->aio_free_count;
 
 	tapdisk_stats_field(st, "reqs", "{");
-	tapdisk_stats_field(st, "max", "lu", MAX_AIO_REQS);
-	tapdisk_stats_field(st, "pending", "d", n_pending);
+	td_pool_stats(&prv->aio_pool, st);
+	tapdisk_stats_leave(st, '}');
+
+	tapdisk_stats_field(st, "nowait", "d", prv->nowait);
+	tapdisk_stats_field(st, "nowait_reads", "{");
+	tapdisk_stats_field(st, "hits", "llu", prv->nowait_reads.hits);
+	tapdisk_stats_field(st, "misses", "llu", prv->nowait_reads.misses);
 	tapdisk_stats_leave(st, '}');
 }
 
+int tdaio_footprint(td_driver_t *driver, int trim, uint64_t *bytes)
+{
+	struct tdaio_state *prv = (struct tdaio_state *)driver->data;
+
+	if (trim)
+		td_pool_trim(&prv->aio_pool);
+
+	*bytes = td_pool_bytes(&prv->aio_pool);
+	return 0;
+}
+
 struct tap_disk tapdisk_aio = {
 	.disk_type          = "tapdisk_aio",
 	.flags              = 0,
@@ -269,8 +340,11 @@ struct tap_disk tapdisk_aio = {
 	.td_close           = tdaio_close,
 	.td_queue_read      = tdaio_queue_read,
 	.td_queue_write     = tdaio_queue_write,
+	.td_queue_discard   = tdaio_queue_discard,
+	.td_sync            = tdaio_sync,
 	.td_get_parent_id   = tdaio_get_parent_id,
 	.td_validate_parent = tdaio_validate_parent,
 	.td_debug           = NULL,
 	.td_stats           = tdaio_stats,
+	.td_footprint       = tdaio_footprint,
 };
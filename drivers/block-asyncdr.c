@@ -51,10 +51,9 @@
 
 // !TW! extra libs
 #include "adaptdr.h"
+#include "dr-stream.h"
 #include <pthread.h>
 
-#define MAX_AIO_REQS         TAPDISK_DATA_REQUESTS
-
 struct tdasyncdr_state;
 
 struct asyncdr_request {
@@ -67,33 +66,23 @@ struct tdasyncdr_state {
 	int                  fd;
 	td_driver_t         *driver;
 
-	int                  asyncdr_free_count;
-	struct asyncdr_request   asyncdr_requests[MAX_AIO_REQS];
-	struct asyncdr_request  *asyncdr_free_list[MAX_AIO_REQS];
+	struct td_pool       asyncdr_pool;
 
 	uint64_t pendingWrite;	// epoch of last started write (get from kblock?)
 	uint64_t committedWrite; // epoch of last committed write
-	int backupSocket;
-	//int backupSocketId;	// was going to use this for event handler stuff
 
 	// backup server info
 	char* backupHost;
+	char* backupTarget;	// "host:port", or "shm:<name>"
 	int backupPort;
 	char* imageFile;
 
+	/* per-device replication stream to the backup */
+	struct dr_stream stream;
+	struct dr_options opts;
 };
 
 
-pthread_mutex_t bufPtrsMutex     = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t  bufPtrsCondition  = PTHREAD_COND_INITIALIZER;
-uint64_t writePtr = 0;
-uint64_t readPtr = 0;
-struct req_info circRinfo[DRBUFSIZE];
-char circData[DRBUFSIZE*DR_MAX_WRITE_SIZE];	// TODO this assumes max of 4K per request
-
-void *thread_dispatch_writes(void *ptr);
-
-
 /*Get Image size, secsize*/
 static int tdasyncdr_get_image_info(int fd, td_disk_info_t *info)
 {
@@ -122,30 +111,18 @@ static int tdasyncdr_get_image_info(int fd, td_disk_info_t *info)
 			(long long unsigned)(info->size << SECTOR_SHIFT),
 			(long long unsigned)info->size);
 
-		/*Get the sector size*/
-#if defined(BLKSSZGET)
-		{
-			info->sector_size = DEFAULT_SECTOR_SIZE;
-			ioctl(fd, BLKSSZGET, &info->sector_size);
-			
-			if (info->sector_size != DEFAULT_SECTOR_SIZE)
-				DPRINTF("Note: sector size is %ld (not %d)\n",
-					info->sector_size, DEFAULT_SECTOR_SIZE);
-		}
-#else
-		info->sector_size = DEFAULT_SECTOR_SIZE;
-#endif
-
 	} else {
 		/*Local file? try fstat instead*/
 		info->size = (stat.st_size >> SECTOR_SHIFT);
-		info->sector_size = DEFAULT_SECTOR_SIZE;
 		DPRINTF("Image size: \n\tpre sector_shift  [%llu]\n\tpost "
 			"sector_shift [%llu]\n",
 			(long long unsigned)(info->size << SECTOR_SHIFT),
 			(long long unsigned)info->size);
 	}
 
+	tapdisk_get_sector_size(fd, &info->sector_size,
+				&info->physical_sector_size);
+
 	if (info->size == 0) {		
 		info->size =((uint64_t) 16836057);
 		info->sector_size = DEFAULT_SECTOR_SIZE;
@@ -155,9 +132,45 @@ static int tdasyncdr_get_image_info(int fd, td_disk_info_t *info)
 	return 0;
 }
 
+/* Open a raw image, with O_DIRECT if we can, and get its size. */
+static int tdasyncdr_open_image(td_driver_t *driver, const char *path,
+			       td_flag_t flags)
+{
+	int fd, err, o_flags;
+
+	o_flags = O_DIRECT | O_LARGEFILE |
+		((flags & TD_OPEN_RDONLY) ? O_RDONLY : O_RDWR);
+	fd = open(path, o_flags);
+
+	if (fd == -1 && errno == EINVAL) {
+		/* Maybe O_DIRECT isn't supported. */
+		o_flags &= ~O_DIRECT;
+		fd = open(path, o_flags);
+		if (fd != -1)
+			DPRINTF("WARNING: Accessing image without "
+				"O_DIRECT! (%s)\n", path);
+	} else if (fd != -1)
+		DPRINTF("open(%s) with O_DIRECT\n", path);
+
+	if (fd == -1) {
+		err = -errno;
+		DPRINTF("Unable to open [%s] (%d)!\n", path, err);
+		return err;
+	}
+
+	err = tdasyncdr_get_image_info(fd, &driver->info);
+	if (err) {
+		close(fd);
+		return err;
+	}
+
+	return fd;
+}
+
 /* Find out the server name, port, and disk image file
  *
  *  name has format = obelix29:9000:/home/twood/vms/testdisk.img
+ *  or, for a backup on this host, shm:<name>:/home/twood/vms/testdisk.img
  *
  * */
 int tdasyncdr_get_args(td_driver_t *driver, const char* name)
@@ -188,6 +201,10 @@ int tdasyncdr_get_args(td_driver_t *driver, const char* name)
 		DPRINTF("unable to allocate port\n");
 		return -ENOMEM;
 	}
+	if (!(state->backupTarget = strndup(name, seperator - name))) {
+		DPRINTF("unable to allocate target\n");
+		return -ENOMEM;
+	}
 	portnum = atoi(port);
 
 	seperator++; // move past ":"
@@ -197,6 +214,11 @@ int tdasyncdr_get_args(td_driver_t *driver, const char* name)
 		return -ENOMEM;
 	}
 
+	if (dr_parse_options(state->imageFile, &state->opts)) {
+		DPRINTF("bad DR options in %s\n", file);
+		return -EINVAL;
+	}
+
 	state->backupPort = portnum;
 
 	DPRINTF("host: %s, port: %d, image path: %s\n",
@@ -207,81 +229,12 @@ int tdasyncdr_get_args(td_driver_t *driver, const char* name)
 	return 0;
 }
 
-int tdasyncdr_connectTobackup(struct tdasyncdr_state *state) {
-	int portno, n;
-	struct sockaddr_in serv_addr;
-	struct hostent *server;
-	char buffer[256];
-	int sflag = 1;	// used for setsockopt
-
-	state->backupSocket = socket(AF_INET, SOCK_STREAM, 0);
-	if (state->backupSocket < 0) {
-		DPRINTF("ERROR opening socket");
-		return -1;
-	}
-
-
-	if(setsockopt(state->backupSocket, IPPROTO_TCP, TCP_NODELAY, &sflag, sizeof(sflag)))
-	{
-		DPRINTF("ERROR SETTING SOCKOPT!");
-	}
-	else {
-		DPRINTF("Set sockopt to non-blocking");
-	}
-
-	portno = state->backupPort;
-	server = gethostbyname(state->backupHost);
-
-	if (server == NULL) {
-		DPRINTF("no such host");
-		return -1;
-	}
-	bzero((char *) &serv_addr, sizeof(serv_addr));
-	serv_addr.sin_family = AF_INET;
-	bcopy((char *)server->h_addr,
-		 (char *)&serv_addr.sin_addr.s_addr,
-		 server->h_length);
-	serv_addr.sin_port = htons(portno);
-	if (connect(state->backupSocket,&serv_addr,sizeof(serv_addr)) < 0){
-		DPRINTF("ERROR CONNECTING");
-		return -1;
-	}
-
-	bzero(buffer,256);
-	strcpy(buffer,state->imageFile);
-
-	n = write(state->backupSocket,buffer,strlen(buffer));
-	if (n < 0) {
-		DPRINTF("ERROR writing to socket");
-		return -1;
-	}
-	bzero(buffer,256);
-	n = read(state->backupSocket,buffer,255);
-	if (n < 0) {
-		DPRINTF("ERROR reading from socket");
-		return -1;
-	}
-
-	DPRINTF("read: %s", buffer);
-/*
- * UNfinished attempt at registering event handlers?????
-	if((state->backupSocketId = tapdisk_server_register_event(SCHEDULER_POLL_READ_FD, state->backupSocket, 0, eventRecvFromBackup, state)) < 0) {
-		DPRINTF("error registering client event handler: %s\n", strerror(state->backupSocketId));
-		//close(fd);
-		return -1;
-	}
-*/
-
-	return 0;
-}
-
 
 /* Open the disk file and initialize asyncdr state. */
 int tdasyncdr_open(td_driver_t *driver, const char *name, td_flag_t flags)
 {
-	int i, fd, ret, o_flags;
+	int i, fd, ret;
 	struct tdasyncdr_state *prv;
-	pthread_t thread1;
 
 	ret = 0;
 	prv = (struct tdasyncdr_state *)driver->data;
@@ -290,9 +243,8 @@ int tdasyncdr_open(td_driver_t *driver, const char *name, td_flag_t flags)
 
 	memset(prv, 0, sizeof(struct tdasyncdr_state));
 
-	prv->asyncdr_free_count = MAX_AIO_REQS;
-	for (i = 0; i < MAX_AIO_REQS; i++)
-		prv->asyncdr_free_list[i] = &prv->asyncdr_requests[i];
+	td_pool_init(&prv->asyncdr_pool, sizeof(struct asyncdr_request),
+		     TD_POOL_CHUNK, TD_POOL_LIMIT);
 
 	ret = tdasyncdr_get_args(driver, name);
 	if(ret) {
@@ -300,39 +252,104 @@ int tdasyncdr_open(td_driver_t *driver, const char *name, td_flag_t flags)
 		goto done;
 	}
 
-	/* Open the file */
-	o_flags = O_DIRECT | O_LARGEFILE |
-		((flags & TD_OPEN_RDONLY) ? O_RDONLY : O_RDWR);
-        fd = open(prv->imageFile, o_flags);
+	/* Open the file, unless the image below does the I/O */
+	fd = -1;
+	if (!prv->opts.filter) {
+		fd = tdasyncdr_open_image(driver, prv->imageFile, flags);
+		if (fd < 0) {
+			ret = fd;
+			goto done;
+		}
+	}
+
+	/* Setup state for network/backup server */
+	prv->pendingWrite = 0;
+	prv->committedWrite = 0;
 
-        if ( (fd == -1) && (errno == EINVAL) ) {
 
-                /* Maybe O_DIRECT isn't supported. */
-		o_flags &= ~O_DIRECT;
-                fd = open(prv->imageFile, o_flags);
-                if (fd != -1) DPRINTF("WARNING: Accessing image without"
-                                     "O_DIRECT! (%s)\n", prv->imageFile);
+	ret = dr_stream_init(&prv->stream, prv->opts.ring);
+	if (ret) {
+		DPRINTF("unable to allocate replication ring: %d\n", ret);
+		close(fd);
+		goto done;
+	}
+	prv->stream.absorb = prv->opts.absorb;
+	prv->stream.crc = prv->opts.crc;
+	prv->stream.coalesce = prv->opts.coalesce;
+	dr_stream_sockopts(&prv->stream, &prv->opts.sock);
 
-        } else if (fd != -1) DPRINTF("open(%s) with O_DIRECT\n", prv->imageFile);
+	ret = dr_stream_epochs(&prv->stream, prv->opts.epoch_writes,
+			       prv->opts.epoch_ms);
+	if (ret) {
+		dr_stream_free(&prv->stream);
+		close(fd);
+		goto done;
+	}
 
-        if (fd == -1) {
-		DPRINTF("Unable to open [%s] (%d)!\n", prv->imageFile, 0 - errno);
-        	ret = 0 - errno;
-        	goto done;
-        }
+	if (prv->opts.group) {
+		ret = dr_stream_group(&prv->stream, prv->opts.group);
+		if (ret) {
+			dr_stream_free(&prv->stream);
+			close(fd);
+			goto done;
+		}
+	}
 
-	ret = tdasyncdr_get_image_info(fd, &driver->info);
+	if (prv->opts.tls) {
+		ret = dr_stream_tls(&prv->stream, prv->opts.tls);
+		if (ret) {
+			dr_stream_free(&prv->stream);
+			close(fd);
+			goto done;
+		}
+	}
 
-	/* Setup state for network/backup server */
-	prv->pendingWrite = 0;
-	prv->committedWrite = 0;
+	if (prv->opts.valve) {
+		ret = dr_stream_valve(&prv->stream, prv->opts.valve);
+		if (ret) {
+			dr_stream_free(&prv->stream);
+			close(fd);
+			goto done;
+		}
+	}
 
+	if (prv->opts.spill) {
+		ret = dr_stream_spill(&prv->stream, prv->opts.spill,
+				      prv->opts.spill_max);
+		if (ret) {
+			dr_stream_free(&prv->stream);
+			close(fd);
+			goto done;
+		}
+	}
 
-	DPRINTF("Connecting to backup...");
-	tdasyncdr_connectTobackup(prv);
-	DPRINTF("connection made!");
+	if (prv->opts.resync) {
+		ret = dr_stream_resync(&prv->stream, driver, fd,
+				       &prv->pendingWrite);
+		if (ret) {
+			dr_stream_free(&prv->stream);
+			close(fd);
+			goto done;
+		}
+	}
+
+	/* connected to in the background, see dr_target_reconnect() */
+	ret = dr_stream_connect(&prv->stream, prv->backupTarget,
+				prv->imageFile, prv->opts.codec,
+				prv->opts.dedup, prv->opts.mux);
+	for (i = 0; !ret && i < prv->opts.n_targets; i++)
+		ret = dr_stream_connect(&prv->stream, prv->opts.targets[i],
+					prv->imageFile, prv->opts.codec,
+					prv->opts.dedup, prv->opts.mux);
+	if (ret) {
+		DPRINTF("unable to add backup: %d\n", ret);
+		dr_stream_free(&prv->stream);
+		close(fd);
+		goto done;
+	}
 
-	ret = pthread_create( &thread1, NULL, thread_dispatch_writes,prv);
+	ret = dr_stream_start(&prv->stream, prv->opts.window,
+			      prv->opts.quorum);
 
 	if(ret) {
 		DPRINTF("pthread error: %d\n", ret);
@@ -341,7 +358,15 @@ int tdasyncdr_open(td_driver_t *driver, const char *name, td_flag_t flags)
 		DPRINTF("Thread started correctly\n");
 	}
 
+	if (!ret && prv->opts.seed)
+		ret = dr_stream_seed(&prv->stream, driver, prv->opts.seed,
+				     &prv->pendingWrite);
+
+	if (!ret && prv->opts.failback)
+		ret = dr_stream_failback(&prv->stream, prv->opts.failback);
+
 	if (ret) {
+		dr_stream_free(&prv->stream);
 		close(fd);
 		goto done;
 	}
@@ -358,7 +383,7 @@ void tdasyncdr_complete(void *arg, struct tiocb *tiocb, int err)
 	struct tdasyncdr_state *prv = asyncdr->state;
 
 	td_complete_request(asyncdr->treq, err);
-	prv->asyncdr_free_list[prv->asyncdr_free_count++] = asyncdr;
+	td_pool_put(&prv->asyncdr_pool, asyncdr);
 }
 
 void tdasyncdr_queue_read(td_driver_t *driver, td_request_t treq)
@@ -369,13 +394,18 @@ void tdasyncdr_queue_read(td_driver_t *driver, td_request_t treq)
 	struct tdasyncdr_state *prv;
 
 	prv    = (struct tdasyncdr_state *)driver->data;
-	size   = treq.secs * driver->info.sector_size;
-	offset = treq.sec  * (uint64_t)driver->info.sector_size;
+	size   = treq.secs << SECTOR_SHIFT;
+	offset = (uint64_t)treq.sec << SECTOR_SHIFT;
 
-	if (prv->asyncdr_free_count == 0)
+	if (prv->opts.filter) {
+		td_forward_request(treq);
+		return;
+	}
+
+	asyncdr = td_pool_get(&prv->asyncdr_pool);
+	if (!asyncdr)
 		goto fail;
 
-	asyncdr        = prv->asyncdr_free_list[--prv->asyncdr_free_count];
 	asyncdr->treq  = treq;
 	asyncdr->state = prv;
 
@@ -391,22 +421,38 @@ fail:
 
 void tdasyncdr_queue_write(td_driver_t *driver, td_request_t treq)
 {
-	int size;
+	int size, err;
 	uint64_t offset;
 	struct asyncdr_request *asyncdr;
 	struct tdasyncdr_state *prv;
-	// data for sending request to backup !TW!
-	struct req_info *rinfo;
 
 
 	prv     = (struct tdasyncdr_state *)driver->data;
-	size    = treq.secs * driver->info.sector_size;
-	offset  = treq.sec  * (uint64_t)driver->info.sector_size;
+	size    = treq.secs << SECTOR_SHIFT;
+	offset  = (uint64_t)treq.sec << SECTOR_SHIFT;
+
+	/*
+	 * Never sleep on a full ring here, that would stall the whole
+	 * server. Bounce the write before touching the local image; the
+	 * vbd requeues it and retries once the ring drains.
+	 */
+	err = dr_stream_reserve(&prv->stream, size);
+	if (err)
+		goto fail;
+
+	/* queued first: the forward may complete, and recycle buf, inline */
+	if (prv->opts.filter) {
+		dr_stream_queue_write(&prv->stream, ++prv->pendingWrite,
+				      offset, treq.buf, size);
+		td_forward_request(treq);
+		return;
+	}
 
-	if (prv->asyncdr_free_count == 0)
+	err     = -EBUSY;
+	asyncdr = td_pool_get(&prv->asyncdr_pool);
+	if (!asyncdr)
 		goto fail;
 
-	asyncdr        = prv->asyncdr_free_list[--prv->asyncdr_free_count];
 	asyncdr->treq  = treq;
 	asyncdr->state = prv;
 
@@ -414,68 +460,111 @@ void tdasyncdr_queue_write(td_driver_t *driver, td_request_t treq)
 		      size, offset, tdasyncdr_complete, asyncdr);
 	td_queue_tiocb(driver, &asyncdr->tiocb);
 
+	dr_stream_queue_write(&prv->stream, ++prv->pendingWrite,
+			      offset, treq.buf, size);
 
-	/*** WRITER (PRODUCER) */
-	pthread_mutex_lock(&bufPtrsMutex);
-	while(writePtr - readPtr >= DRBUFSIZE) { // while FULL
-		pthread_cond_wait( &bufPtrsCondition, &bufPtrsMutex );
-	}
-	pthread_mutex_unlock(&bufPtrsMutex);
+	return;
 
-	//DPRINTF("Handling request %llu\n", (unsigned long long)writePtr);
-	// fill in write request info
-	rinfo = (struct req_info*) &(circRinfo[writePtr % DRBUFSIZE]);
-	rinfo->size = size;
-	rinfo->offset = offset;
-	rinfo->writeID = ++prv->pendingWrite;
+fail:
+	td_complete_request(treq, dr_stream_reserve_error(err));
+}
 
-	//DPRINTF("Copying data buffer\n");
-	// copy data buffer
-	rinfo->dataPtr = &(circData[(writePtr*DR_MAX_WRITE_SIZE) % (DRBUFSIZE*DR_MAX_WRITE_SIZE)]);
-	memcpy(rinfo->dataPtr, treq.buf, size);
+/*
+ * Discards are not replicated, the backup keeps the old blocks, which
+ * is what a discarded range may read back as anyway.
+ */
+void tdasyncdr_queue_discard(td_driver_t *driver, td_request_t treq)
+{
+	uint64_t size, offset;
+	struct tdasyncdr_state *prv;
+	int err;
 
-	pthread_mutex_lock(&bufPtrsMutex);
-	writePtr++;
-	if(writePtr != readPtr)
-		pthread_cond_signal(&bufPtrsCondition);
-	pthread_mutex_unlock(&bufPtrsMutex);
+	prv     = (struct tdasyncdr_state *)driver->data;
+	size    = (uint64_t)treq.secs << SECTOR_SHIFT;
+	offset  = (uint64_t)treq.sec << SECTOR_SHIFT;
 
+	if (prv->opts.filter) {
+		td_forward_request(treq);
+		return;
+	}
 
-	return;
+	err = tapdisk_discard_range(prv->fd, offset, size);
+	td_complete_request(treq, err);
+}
 
-fail:
-	td_complete_request(treq, -EBUSY);
+/*
+ * Backups are fed by their own stream and not flushed along; a filter's
+ * child is flushed as an image of its own.
+ */
+int tdasyncdr_sync(td_driver_t *driver)
+{
+	struct tdasyncdr_state *prv = (struct tdasyncdr_state *)driver->data;
+
+	if (prv->opts.filter || prv->fd < 0)
+		return 0;
+
+	return fdatasync(prv->fd) ? -errno : 0;
 }
 
 int tdasyncdr_close(td_driver_t *driver)
 {
-	struct req_info rinfo; // send zero'd out req_info to indicate close
-	int rc;
 	struct tdasyncdr_state *prv = (struct tdasyncdr_state *)driver->data;
 
-	bzero(&rinfo, sizeof(struct req_info));
-
-	rc = sendexact(prv->backupSocket, (char*)(&rinfo), sizeof(struct req_info));
-	if (rc < 0) {
-		DPRINTF("ERROR writing req info to socket");
-		return -1;
-	}
-	close(prv->backupSocket);
+	/* also sends the close marker to every backup */
+	dr_stream_free(&prv->stream);
 
-	close(prv->fd);
+	if (prv->fd >= 0)
+		close(prv->fd);
+	td_pool_destroy(&prv->asyncdr_pool);
 
 	return 0;
 }
 
+/* Stacked, the image below comes from the chain, not from us. */
 int tdasyncdr_get_parent_id(td_driver_t *driver, td_disk_id_t *id)
 {
-	return TD_NO_PARENT;
+	struct tdasyncdr_state *prv = (struct tdasyncdr_state *)driver->data;
+
+	return prv->opts.filter ? -EINVAL : TD_NO_PARENT;
 }
 
 int tdasyncdr_validate_parent(td_driver_t *driver,
 			  td_driver_t *pdriver, td_flag_t flags)
 {
-	return -EINVAL;
+	struct tdasyncdr_state *prv = (struct tdasyncdr_state *)driver->data;
+
+	return prv->opts.filter ? 0 : -EINVAL;
+}
+
+void tdasyncdr_stats(td_driver_t *driver, td_stats_t *st)
+{
+	struct tdasyncdr_state *prv = (struct tdasyncdr_state *)driver->data;
+
+	tapdisk_stats_field(st, "reqs", "{");
+	td_pool_stats(&prv->asyncdr_pool, st);
+	tapdisk_stats_leave(st, '}');
+
+	/*
+	 * writes is [ last queued, last acknowledged ]
+	 */
+	tapdisk_stats_field(st, "dr", "{");
+	tapdisk_stats_field(st, "writes", "[");
+	tapdisk_stats_val(st, "llu", prv->pendingWrite);
+	tapdisk_stats_val(st, "llu", dr_stream_acked(&prv->stream));
+	tapdisk_stats_leave(st, ']');
+	dr_stream_stats(&prv->stream, st);
+	tapdisk_stats_leave(st, '}');
+}
+
+int tdasyncdr_footprint(td_driver_t *driver, int trim, uint64_t *bytes)
+{
+	struct tdasyncdr_state *prv = (struct tdasyncdr_state *)driver->data;
+
+	if (trim)
+		td_pool_trim(&prv->asyncdr_pool);
+
+	*bytes = td_pool_bytes(&prv->asyncdr_pool);
+	return 0;
 }
 
 struct tap_disk tapdisk_asyncdr = {
@@ -486,68 +575,11 @@ struct tap_disk tapdisk_asyncdr = {
 	.td_close           = tdasyncdr_close,
 	.td_queue_read      = tdasyncdr_queue_read,
 	.td_queue_write     = tdasyncdr_queue_write,
+	.td_queue_discard   = tdasyncdr_queue_discard,
+	.td_sync            = tdasyncdr_sync,
 	.td_get_parent_id   = tdasyncdr_get_parent_id,
 	.td_validate_parent = tdasyncdr_validate_parent,
 	.td_debug           = NULL,
+	.td_stats           = tdasyncdr_stats,
+	.td_footprint       = tdasyncdr_footprint,
 };
-
-/* !TW! Function used for worker thread that does all network sends */
-void *thread_dispatch_writes(void *stateptr) {
-	struct req_info *rinfo;
-	int done=0;
-	int rc;
-	struct tdasyncdr_state *state = (struct tdasyncdr_state *)stateptr;
-	struct iovec iov[2];
-
-	DPRINTF("Thread started!\n");
-
-	while(!done) {
-
-		pthread_mutex_lock(&bufPtrsMutex);
-		while(readPtr == writePtr) {	//while empty
-			pthread_cond_wait( &bufPtrsCondition, &bufPtrsMutex );
-		}
-		pthread_mutex_unlock(&bufPtrsMutex);
-		//DPRINTF("Thread: Handling request %llu\n", (unsigned long long)readPtr);
-		rinfo = (struct req_info*) &(circRinfo[readPtr  % DRBUFSIZE]);
-
-		//DPRINTF("Thread: Req %llu   size: %d   offset: %llu \n",
-		//    			(unsigned long long) rinfo->writeID, rinfo->size, (unsigned long long)rinfo->offset);
-
-		// send rinfo and data -- use two io vectors since data is not contiguous
-		iov[0].iov_base = rinfo;
-		iov[0].iov_len = sizeof(struct req_info);
-		iov[1].iov_base = rinfo->dataPtr;
-		iov[1].iov_len = rinfo->size;
-
-		rc = writev(state->backupSocket, iov, 2);
-
-		/*
-		rc = sendexact(state->backupSocket, (char*)(rinfo), sizeof(struct req_info));
-		if (rc < 0) {
-			DPRINTF("ERROR writing req info to socket");
-			//return;
-			continue;
-		}
-
-		rc = sendexact(state->backupSocket,rinfo->dataPtr,rinfo->size);
-		*/
-		if (rc < 0) {
-			DPRINTF("ERROR writing buffer to socket");
-			//return;
-			continue;
-		}
-
-		pthread_mutex_lock(&bufPtrsMutex);
-		readPtr++;
-		if(writePtr - readPtr < DRBUFSIZE)
-			pthread_cond_signal(&bufPtrsCondition);
-		pthread_mutex_unlock(&bufPtrsMutex);
-	}
-
-
-
-	DPRINTF("Thread done.\n");
-
-	return NULL;
-}
@@ -23,13 +23,19 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <signal.h>
+#include <pthread.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "tapdisk.h"
 #include "tapdisk-utils.h"
 #include "tapdisk-driver.h"
 #include "tapdisk-server.h"
 #include "tapdisk-interface.h"
+#include "tapdisk-shm-cache.h"
+#include "block-cache.h"
+#include "dr-dedup.h"
 
 #ifdef DEBUG
 #define DBG(_f, _a...) tlog_write(TLOG_DBG, _f, ##_a)
@@ -39,6 +45,9 @@
 
 #define WARN(_f, _a...) tlog_write(TLOG_WARN, _f, ##_a)
 
+#define MIN(a, b)                       ((a) < (b) ? (a) : (b))
+#define MAX(a, b)                       ((a) > (b) ? (a) : (b))
+
 #define RADIX_TREE_PAGE_SHIFT           12 /* 4K pages */
 #define RADIX_TREE_PAGE_SIZE            (1 << RADIX_TREE_PAGE_SHIFT)
 
@@ -48,9 +57,21 @@
 
 #define BLOCK_CACHE_NODES_PER_PAGE      (1 << (RADIX_TREE_PAGE_SHIFT - RADIX_TREE_NODE_SHIFT))
 
-#define BLOCK_CACHE_MAX_SIZE            (10 << 20) /* 100MB cache */
+/*
+ * Leaves cover 2^shift sectors, from a page up to 64K. Caches start at
+ * a page and settle, once, after BLOCK_CACHE_LEAF_SAMPLE reads, on the
+ * largest leaf at least 3/4 of them cover. Fewer, larger leaves mean a
+ * lower tree and less metadata per byte; a read is one lookup per
+ * leaf, and reads spanning more than BLOCK_CACHE_LEAVES go uncached.
+ */
+#define BLOCK_CACHE_LEAF_SHIFT_MIN      (RADIX_TREE_PAGE_SHIFT - RADIX_TREE_NODE_SHIFT)
+#define BLOCK_CACHE_LEAF_SHIFT_MAX      7
+#define BLOCK_CACHE_LEAF_SAMPLE         256
+#define BLOCK_CACHE_LEAVES              16
+
+#define BLOCK_CACHE_BUDGET              (100ULL << 20) /* default, all caches */
 #define BLOCK_CACHE_REQUESTS            (TAPDISK_DATA_REQUESTS << 3)
-#define BLOCK_CACHE_PAGE_IDLETIME       60
+#define BLOCK_CACHE_GC_INTERVAL         120 /* reap emptied nodes */
 
 typedef struct radix_tree               radix_tree_t;
 typedef struct radix_tree_node          radix_tree_node_t;
@@ -61,12 +82,16 @@ typedef struct radix_tree_page          radix_tree_page_t;
 typedef struct block_cache              block_cache_t;
 typedef struct block_cache_request      block_cache_request_t;
 typedef struct block_cache_stats        block_cache_stats_t;
+typedef struct block_cache_blob         block_cache_blob_t;
 
 struct radix_tree_page {
 	char                           *buf;
 	size_t                          size;
+	block_cache_blob_t             *blob;      /* holding buf, if dedup */
 	uint64_t                        sec;
-	radix_tree_link_t              *owners[BLOCK_CACHE_NODES_PER_PAGE];
+	radix_tree_link_t              *owners[BLOCK_CACHE_LEAVES];
+	struct list_head                lru;
+	int                             referenced;
 };
 
 struct radix_tree_leaf {
@@ -75,7 +100,6 @@ struct radix_tree_leaf {
 };
 
 struct radix_tree_link {
-	uint32_t                        time;
 	union {
 		radix_tree_node_t      *next;
 		radix_tree_leaf_t       leaf;
@@ -89,6 +113,7 @@ struct radix_tree_node {
 
 struct radix_tree {
 	int                             height;
+	int                             shift;     /* sectors per leaf */
 	uint64_t                        size;
 	uint32_t                        nodes;
 	radix_tree_node_t              *root;
@@ -99,6 +124,9 @@ struct radix_tree {
 struct block_cache_request {
 	int                             err;
 	char                           *buf;
+	uint64_t                        sec;       /* range read, whole leaves */
+	uint64_t                        count;
+	int                             shift;
 	uint64_t                        secs;
 	td_request_t                    treq;
 	block_cache_t                  *cache;
@@ -109,6 +137,11 @@ struct block_cache_stats {
 	uint64_t                        hits;
 	uint64_t                        misses;
 	uint64_t                        prunes;
+	uint64_t                        evictions;
+	uint64_t                        refused;
+	uint64_t                        shared_hits;
+	uint64_t                        fill_failures;
+	uint64_t                        dedup_leaves;   /* found in the pool */
 };
 
 struct block_cache {
@@ -117,17 +150,494 @@ struct block_cache {
 
 	uint64_t                        sectors;
 
-	block_cache_request_t           requests[BLOCK_CACHE_REQUESTS];
-	block_cache_request_t          *request_free_list[BLOCK_CACHE_REQUESTS];
-	int                             requests_free;
+	int                             sampled;
+	uint32_t                        sizes[BLOCK_CACHE_LEAF_SHIFT_MAX + 1];
+
+	struct td_pool                  requests;
 
 	event_id_t                      timeout_id;
 
 	radix_tree_t                    tree;
+	struct list_head                lru;       /* pages, clock order */
+	struct list_head                entry;
+
+	int                             shared;
+	uint8_t                         uuid[TAPDISK_SHM_CACHE_UUID_SIZE];
 
 	block_cache_stats_t             stats;
 };
 
+/*
+ * One budget covers the pages and nodes of all trees. A cache may fill
+ * free budget, or grow to its fair share, the budget over the number
+ * of caches, even past the limit. Then every cache sheds its part of
+ * the excess, in proportion to its size, on its next read, or by the
+ * gc timer when idle. A cache over its share and out of budget
+ * recycles its own pages as it inserts.
+ *
+ * Pages are evicted by CLOCK: a hit only marks the page referenced;
+ * the hand, the head of the list, gives marked pages a second chance
+ * at the tail and evicts the first unmarked one.
+ *
+ * Caches only ever evict from their own tree, on their own loop, so
+ * only the counters need the lock. In shared memory, the budget holds
+ * a slot per process, reclaimed once the process is gone.
+ */
+#define BLOCK_CACHE_SHM_MAGIC           0x74646263
+#define BLOCK_CACHE_SHM_SLOTS           1024
+
+struct block_cache_budget_slot {
+	pid_t                           pid;
+	uint32_t                        caches;
+	uint64_t                        used;
+};
+
+struct block_cache_budget {
+	uint32_t                        magic;
+	pthread_mutex_t                 lock;
+	uint64_t                        limit;
+	uint64_t                        used;
+	uint32_t                        caches;
+	struct block_cache_budget_slot  slots[BLOCK_CACHE_SHM_SLOTS];
+};
+
+static struct block_cache_budget block_cache_local = {
+	.lock  = PTHREAD_MUTEX_INITIALIZER,
+	.limit = BLOCK_CACHE_BUDGET,
+};
+
+static struct {
+	struct block_cache_budget      *budget;
+	struct block_cache_budget_slot *slot;      /* when shared */
+	uint64_t                        used;
+	uint32_t                        caches;
+	pthread_mutex_t                 lock;      /* the list */
+	struct list_head                list;
+} block_caches = {
+	.budget = &block_cache_local,
+	.lock   = PTHREAD_MUTEX_INITIALIZER,
+	.list   = LIST_HEAD_INIT(block_caches.list),
+};
+
+/*
+ * In dedup mode, fills go into the pool a leaf at a time: one copy of
+ * each content per process, found by a 128 bit hash of it and checked
+ * byte for byte. Pages then hold a reference on a blob rather than a
+ * buffer of their own, whatever the tree, and the budget is charged
+ * once per blob. Trees count the bytes they map; evicting a page
+ * frees its share of the blob, its size over its references. Clones
+ * of a few images, under parents of different uuids, then cache each
+ * block once. Turning it off leaves the pool to drain with its pages.
+ */
+#define BLOCK_CACHE_POOL_BUCKETS        (1 << 16)
+
+struct block_cache_blob {
+	uint64_t                        hash[2];
+	size_t                          size;
+	uint32_t                        refs;
+	char                           *buf;
+	block_cache_blob_t             *next;      /* hash chain */
+};
+
+static struct {
+	int                             enabled;
+	pthread_mutex_t                 lock;
+	block_cache_blob_t            **buckets;
+	uint64_t                        blobs;
+	uint64_t                        bytes;     /* held */
+	uint64_t                        mapped;    /* by all the trees */
+} block_cache_pool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static void
+block_cache_budget_lock(struct block_cache_budget *b)
+{
+	if (pthread_mutex_lock(&b->lock) == EOWNERDEAD)
+		pthread_mutex_consistent(&b->lock);
+}
+
+static void
+block_cache_budget_unlock(struct block_cache_budget *b)
+{
+	pthread_mutex_unlock(&b->lock);
+}
+
+static void
+block_cache_charge(int64_t bytes)
+{
+	struct block_cache_budget *b = block_caches.budget;
+
+	block_cache_budget_lock(b);
+	b->used           += bytes;
+	block_caches.used += bytes;
+	if (block_caches.slot)
+		block_caches.slot->used += bytes;
+	block_cache_budget_unlock(b);
+}
+
+static void
+block_cache_count(int n)
+{
+	struct block_cache_budget *b = block_caches.budget;
+
+	block_cache_budget_lock(b);
+	b->caches           += n;
+	block_caches.caches += n;
+	if (block_caches.slot)
+		block_caches.slot->caches += n;
+	block_cache_budget_unlock(b);
+}
+
+/* with b locked */
+static void
+block_cache_budget_reap(struct block_cache_budget *b)
+{
+	struct block_cache_budget_slot *slot;
+	int i;
+
+	if (b == &block_cache_local)
+		return;
+
+	for (i = 0; i < BLOCK_CACHE_SHM_SLOTS; i++) {
+		slot = &b->slots[i];
+
+		if (!slot->pid || !kill(slot->pid, 0) || errno != ESRCH)
+			continue;
+
+		b->used   -= MIN(b->used, slot->used);
+		b->caches -= MIN(b->caches, slot->caches);
+		memset(slot, 0, sizeof(*slot));
+	}
+}
+
+static int
+block_cache_shm_init(struct block_cache_budget *b, uint64_t limit)
+{
+	pthread_mutexattr_t attr;
+	int err;
+
+	err = pthread_mutexattr_init(&attr);
+	if (!err)
+		err = pthread_mutexattr_setpshared(&attr,
+						   PTHREAD_PROCESS_SHARED);
+	if (!err)
+		err = pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	if (!err)
+		err = pthread_mutex_init(&b->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+	if (err)
+		return -err;
+
+	b->limit = limit;
+	__sync_synchronize();
+	b->magic = BLOCK_CACHE_SHM_MAGIC;
+
+	return 0;
+}
+
+/* the first to attach sets it up, with this process' limit */
+static struct block_cache_budget *
+block_cache_shm_attach(uint64_t limit)
+{
+	struct block_cache_budget *b;
+	struct stat st;
+	int fd, err, i, created;
+
+	b       = MAP_FAILED;
+	created = 1;
+
+	fd = shm_open(BLOCK_CACHE_SHM, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd == -1 && errno == EEXIST) {
+		created = 0;
+		fd = shm_open(BLOCK_CACHE_SHM, O_RDWR, 0);
+	}
+	if (fd == -1)
+		goto fail;
+
+	if (created && ftruncate(fd, sizeof(*b)))
+		goto fail;
+
+	for (i = 0; i < 100; i++) {
+		if (fstat(fd, &st))
+			goto fail;
+		if (st.st_size >= sizeof(*b))
+			break;
+		usleep(10000);
+	}
+	if (st.st_size < sizeof(*b)) {
+		errno = EINVAL;
+		goto fail;
+	}
+
+	b = mmap(NULL, sizeof(*b), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (b == MAP_FAILED)
+		goto fail;
+
+	close(fd);
+	fd = -1;
+
+	if (created) {
+		err = block_cache_shm_init(b, limit);
+		if (err) {
+			errno = -err;
+			goto fail;
+		}
+	}
+
+	for (i = 0; b->magic != BLOCK_CACHE_SHM_MAGIC && i < 100; i++)
+		usleep(10000);
+	if (b->magic != BLOCK_CACHE_SHM_MAGIC) {
+		errno = EINVAL;
+		goto fail;
+	}
+
+	return b;
+
+fail:
+	err = errno;
+	EPRINTF("attaching %s: %d\n", BLOCK_CACHE_SHM, -err);
+	if (b != MAP_FAILED)
+		munmap(b, sizeof(*b));
+	if (fd != -1)
+		close(fd);
+	errno = err;
+	return NULL;
+}
+
+/* hands the caches of the process over from one budget to another */
+static int
+block_cache_move_budget(struct block_cache_budget *to)
+{
+	struct block_cache_budget *from = block_caches.budget;
+	struct block_cache_budget_slot *slot;
+	int i;
+
+	slot = NULL;
+
+	if (to != &block_cache_local) {
+		block_cache_budget_lock(to);
+		block_cache_budget_reap(to);
+		for (i = 0; i < BLOCK_CACHE_SHM_SLOTS; i++)
+			if (!to->slots[i].pid) {
+				slot = &to->slots[i];
+				break;
+			}
+		if (!slot) {
+			block_cache_budget_unlock(to);
+			return -ENOSPC;
+		}
+		slot->pid    = getpid();
+		slot->used   = block_caches.used;
+		slot->caches = block_caches.caches;
+		block_cache_budget_unlock(to);
+	}
+
+	block_cache_budget_lock(from);
+	from->used   -= MIN(from->used, block_caches.used);
+	from->caches -= MIN(from->caches, block_caches.caches);
+	if (block_caches.slot)
+		memset(block_caches.slot, 0, sizeof(*block_caches.slot));
+	block_cache_budget_unlock(from);
+
+	block_cache_budget_lock(to);
+	to->used   += block_caches.used;
+	to->caches += block_caches.caches;
+	block_cache_budget_unlock(to);
+
+	if (from != &block_cache_local)
+		munmap(from, sizeof(*from));
+
+	block_caches.budget = to;
+	block_caches.slot   = slot;
+
+	return 0;
+}
+
+static void block_cache_balance(block_cache_t *);
+
+int
+block_cache_set_budget(uint64_t limit, int mode)
+{
+	struct block_cache_budget *b;
+	block_cache_t *cache;
+	int err;
+
+	b = block_caches.budget;
+
+	if (mode == BLOCK_CACHE_BUDGET_HOST && b == &block_cache_local) {
+		b = block_cache_shm_attach(limit ? : b->limit);
+		if (!b)
+			return -errno;
+
+		err = block_cache_move_budget(b);
+		if (err) {
+			munmap(b, sizeof(*b));
+			return err;
+		}
+	}
+
+	if (mode == BLOCK_CACHE_BUDGET_PROCESS && b != &block_cache_local) {
+		err = block_cache_move_budget(&block_cache_local);
+		if (err)
+			return err;
+	}
+
+	b = block_caches.budget;
+
+	if (limit) {
+		block_cache_budget_lock(b);
+		b->limit = limit;
+		block_cache_budget_unlock(b);
+	}
+
+	pthread_mutex_lock(&block_caches.lock);
+	list_for_each_entry(cache, &block_caches.list, entry)
+		block_cache_balance(cache);
+	pthread_mutex_unlock(&block_caches.lock);
+
+	return 0;
+}
+
+void
+block_cache_get_budget(uint64_t *limit, uint64_t *used,
+		       uint32_t *caches, int *mode)
+{
+	struct block_cache_budget *b = block_caches.budget;
+
+	block_cache_budget_lock(b);
+	*limit  = b->limit;
+	*used   = b->used;
+	*caches = b->caches;
+	block_cache_budget_unlock(b);
+
+	*mode = b == &block_cache_local ?
+		BLOCK_CACHE_BUDGET_PROCESS : BLOCK_CACHE_BUDGET_HOST;
+}
+
+int
+block_cache_set_dedup(int enable)
+{
+	block_cache_blob_t **buckets;
+
+	pthread_mutex_lock(&block_cache_pool.lock);
+
+	if (enable && !block_cache_pool.buckets) {
+		buckets = calloc(BLOCK_CACHE_POOL_BUCKETS, sizeof(*buckets));
+		if (!buckets) {
+			pthread_mutex_unlock(&block_cache_pool.lock);
+			return -ENOMEM;
+		}
+		block_cache_pool.buckets = buckets;
+	}
+
+	block_cache_pool.enabled = enable;
+	pthread_mutex_unlock(&block_cache_pool.lock);
+
+	return 0;
+}
+
+void
+block_cache_get_dedup(int *enabled, uint64_t *held, uint64_t *mapped)
+{
+	pthread_mutex_lock(&block_cache_pool.lock);
+	*enabled = block_cache_pool.enabled;
+	*held    = block_cache_pool.bytes;
+	*mapped  = block_cache_pool.mapped;
+	pthread_mutex_unlock(&block_cache_pool.lock);
+}
+
+/*
+ * a reference on the blob holding @size bytes of @buf, new or found;
+ * a new blob takes @buf itself if @adopt, else copies it
+ */
+static block_cache_blob_t *
+block_cache_blob_get(char *buf, size_t size, int adopt, int *found)
+{
+	block_cache_blob_t *blob, **bucket;
+	uint64_t hash[2];
+	void *copy;
+
+	dr_dedup_hash(buf, size, hash);
+
+	pthread_mutex_lock(&block_cache_pool.lock);
+
+	bucket = &block_cache_pool.buckets[hash[0] % BLOCK_CACHE_POOL_BUCKETS];
+	for (blob = *bucket; blob; blob = blob->next)
+		if (blob->hash[0] == hash[0] && blob->hash[1] == hash[1] &&
+		    blob->size == size && !memcmp(blob->buf, buf, size)) {
+			blob->refs++;
+			block_cache_pool.mapped += size;
+			pthread_mutex_unlock(&block_cache_pool.lock);
+			*found = 1;
+			return blob;
+		}
+
+	pthread_mutex_unlock(&block_cache_pool.lock);
+
+	blob = calloc(1, sizeof(*blob));
+	if (!blob)
+		return NULL;
+
+	if (adopt)
+		copy = buf;
+	else if (posix_memalign(&copy, RADIX_TREE_NODE_SIZE, size)) {
+		free(blob);
+		return NULL;
+	} else
+		memcpy(copy, buf, size);
+
+	blob->hash[0] = hash[0];
+	blob->hash[1] = hash[1];
+	blob->size    = size;
+	blob->refs    = 1;
+	blob->buf     = copy;
+
+	/* a twin filled meanwhile would only cost memory */
+	pthread_mutex_lock(&block_cache_pool.lock);
+	blob->next = *bucket;
+	*bucket    = blob;
+	block_cache_pool.blobs++;
+	block_cache_pool.bytes  += size;
+	block_cache_pool.mapped += size;
+	pthread_mutex_unlock(&block_cache_pool.lock);
+
+	block_cache_charge(size);
+	*found = 0;
+
+	return blob;
+}
+
+static void
+block_cache_blob_put(block_cache_blob_t *blob)
+{
+	block_cache_blob_t **p;
+	size_t size = blob->size;
+
+	pthread_mutex_lock(&block_cache_pool.lock);
+
+	block_cache_pool.mapped -= size;
+	if (--blob->refs) {
+		pthread_mutex_unlock(&block_cache_pool.lock);
+		return;
+	}
+
+	p = &block_cache_pool.buckets[blob->hash[0] % BLOCK_CACHE_POOL_BUCKETS];
+	for (; *p; p = &(*p)->next)
+		if (*p == blob) {
+			*p = blob->next;
+			break;
+		}
+
+	block_cache_pool.blobs--;
+	block_cache_pool.bytes -= size;
+	pthread_mutex_unlock(&block_cache_pool.lock);
+
+	block_cache_charge(-(int64_t)size);
+	free(blob->buf);
+	free(blob);
+}
+
 static inline uint64_t
 radix_tree_calculate_size(int height)
 {
@@ -192,6 +702,7 @@ radix_tree_allocate_node(radix_tree_t *tree, int height)
 
 	node->height = height;
 	tree->nodes++;
+	block_cache_charge(sizeof(radix_tree_node_t));
 
 	return node;
 }
@@ -210,6 +721,7 @@ radix_tree_free_node(radix_tree_t *tree, radix_tree_node_t *node)
 
 	free(node);
 	tree->nodes--;
+	block_cache_charge(-(int64_t)sizeof(radix_tree_node_t));
 }
 
 static inline radix_tree_page_t *
@@ -226,10 +738,46 @@ radix_tree_allocate_page(radix_tree_t *tree,
 	page->sec   = sec;
 	page->size  = size;
 	tree->size += size;
+	list_add_tail(&page->lru, &tree->cache->lru);
+	block_cache_charge(size);
 
 	return page;
 }
 
+/* a page of one leaf, on the reference to @blob the caller got */
+static inline radix_tree_page_t *
+radix_tree_allocate_blob_page(radix_tree_t *tree,
+			      block_cache_blob_t *blob, uint64_t sec)
+{
+	radix_tree_page_t *page;
+
+	page = calloc(1, sizeof(radix_tree_page_t));
+	if (!page)
+		return NULL;
+
+	page->buf   = blob->buf;
+	page->blob  = blob;
+	page->sec   = sec;
+	page->size  = blob->size;
+	tree->size += blob->size;
+	list_add_tail(&page->lru, &tree->cache->lru);
+
+	return page;
+}
+
+/* the bytes freeing @page gives back, or its share of them */
+static inline uint64_t
+radix_tree_page_bytes(radix_tree_page_t *page)
+{
+	uint32_t refs;
+
+	if (!page->blob)
+		return page->size;
+
+	refs = __atomic_load_n(&page->blob->refs, __ATOMIC_RELAXED);
+	return page->size / MAX(refs, 1);
+}
+
 static inline void
 radix_tree_free_page(radix_tree_t *tree, radix_tree_page_t *page)
 {
@@ -241,7 +789,15 @@ radix_tree_free_page(radix_tree_t *tree, radix_tree_page_t *page)
 
 	tree->cache->stats.prunes += (page->size >> RADIX_TREE_NODE_SHIFT);
 	tree->size -= page->size;
-	free(page->buf);
+	list_del(&page->lru);
+
+	if (page->blob)
+		block_cache_blob_put(page->blob);
+	else {
+		block_cache_charge(-(int64_t)page->size);
+		free(page->buf);
+	}
+
 	free(page);
 }
 
@@ -257,7 +813,7 @@ radix_tree_remove_page(radix_tree_t *tree, radix_tree_page_t *page)
 	if (!page)
 		return;
 
-	for (i = 0; i < BLOCK_CACHE_NODES_PER_PAGE; i++)
+	for (i = 0; i < BLOCK_CACHE_LEAVES; i++)
 		radix_tree_clear_link(page->owners[i]);
 
 	radix_tree_free_page(tree, page);
@@ -269,10 +825,10 @@ radix_tree_insert_leaf(radix_tree_t *tree, radix_tree_link_t *link,
 {
 	int i;
 
-	if (off + RADIX_TREE_NODE_SIZE > page->size)
+	if (off >= page->size)
 		return;
 
-	for (i = 0; i < BLOCK_CACHE_NODES_PER_PAGE; i++) {
+	for (i = 0; i < BLOCK_CACHE_LEAVES; i++) {
 		if (page->owners[i])
 			continue;
 
@@ -284,24 +840,25 @@ radix_tree_insert_leaf(radix_tree_t *tree, radix_tree_link_t *link,
 	}
 }
 
-static char *
+/*
+ * leaves are keyed by their index, @sector >> tree->shift
+ */
+static radix_tree_leaf_t *
 radix_tree_find_leaf(radix_tree_t *tree, uint64_t sector)
 {
 	int idx;
-	struct timeval now;
 	radix_tree_link_t *link;
 	radix_tree_node_t *node;
 
-	node = tree->root;
-	gettimeofday(&now, NULL);
+	node   = tree->root;
+	sector = sector >> tree->shift;
 
 	do {
-		idx        = radix_tree_index(node, sector);
-		link       = node->links + idx;
-		link->time = now.tv_sec;
+		idx  = radix_tree_index(node, sector);
+		link = node->links + idx;
 
 		if (radix_tree_node_contains_leaves(tree, node))
-			return link->u.leaf.buf;
+			return link->u.leaf.buf ? &link->u.leaf : NULL;
 
 		if (!link->u.next)
 			return NULL;
@@ -315,17 +872,15 @@ radix_tree_add_leaf(radix_tree_t *tree, uint64_t sector,
 		    radix_tree_page_t *page, off_t off)
 {
 	int idx;
-	struct timeval now;
 	radix_tree_link_t *link;
 	radix_tree_node_t *node;
 
-	node = tree->root;
-	gettimeofday(&now, NULL);
+	node   = tree->root;
+	sector = sector >> tree->shift;
 
 	do {
-		idx        = radix_tree_index(node, sector);
-		link       = node->links + idx;
-		link->time = now.tv_sec;
+		idx  = radix_tree_index(node, sector);
+		link = node->links + idx;
 
 		if (radix_tree_node_contains_leaves(tree, node)) {
 			radix_tree_remove_page(tree, link->u.leaf.page);
@@ -344,11 +899,14 @@ radix_tree_add_leaf(radix_tree_t *tree, uint64_t sector,
 	} while (1);
 }
 
+/*
+ * @sector starts a leaf; @sectors cover whole leaves, or end the disk
+ */
 static int
 radix_tree_add_leaves(radix_tree_t *tree, char *buf,
 		      uint64_t sector, uint64_t sectors)
 {
-	int i;
+	uint64_t i;
 	radix_tree_page_t *page;
 
 	page = radix_tree_allocate_page(tree, buf, sector,
@@ -356,8 +914,8 @@ radix_tree_add_leaves(radix_tree_t *tree, char *buf,
 	if (!page)
 		return -ENOMEM;
 
-	for (i = 0; i < sectors; i++)
-		if (!radix_tree_add_leaf(tree, sector + i, 
+	for (i = 0; i < sectors; i += 1ULL << tree->shift)
+		if (!radix_tree_add_leaf(tree, sector + i,
 					 page, (i << RADIX_TREE_NODE_SHIFT)))
 			goto fail;
 
@@ -369,6 +927,59 @@ fail:
 	return -ENOMEM;
 }
 
+/*
+ * as radix_tree_add_leaves, in dedup mode: a page per leaf, its blob
+ * found in the pool or copied there. @buf goes to the pool, if one
+ * leaf and new, or is freed.
+ */
+static int
+radix_tree_add_blob_leaves(radix_tree_t *tree, char *buf,
+			   uint64_t sector, uint64_t sectors)
+{
+	uint64_t i, n, leaf = 1ULL << tree->shift;
+	block_cache_blob_t *blob;
+	radix_tree_page_t *page;
+	int err, found, adopt, taken;
+
+	adopt = sectors <= leaf;
+	taken = 0;
+
+	for (i = 0; i < sectors; i += leaf) {
+		n    = MIN(leaf, sectors - i);
+		blob = block_cache_blob_get(buf + (i << RADIX_TREE_NODE_SHIFT),
+					    n << RADIX_TREE_NODE_SHIFT,
+					    adopt, &found);
+		if (!blob) {
+			err = -ENOMEM;
+			goto out;
+		}
+
+		if (found)
+			tree->cache->stats.dedup_leaves++;
+		else
+			taken = adopt;
+
+		page = radix_tree_allocate_blob_page(tree, blob, sector + i);
+		if (!page) {
+			block_cache_blob_put(blob);
+			err = -ENOMEM;
+			goto out;
+		}
+
+		if (!radix_tree_add_leaf(tree, sector + i, page, 0)) {
+			radix_tree_remove_page(tree, page);
+			err = -ENOMEM;
+			goto out;
+		}
+	}
+
+	err = 0;
+out:
+	if (!taken)
+		free(buf);
+	return err;
+}
+
 static void
 radix_tree_delete_branch(radix_tree_t *tree, radix_tree_node_t *node)
 {
@@ -403,8 +1014,7 @@ radix_tree_destroy(radix_tree_t *tree)
  * returns 1 if @node is empty after pruning, 0 otherwise
  */
 static int
-radix_tree_prune_branch(radix_tree_t *tree,
-			radix_tree_node_t *node, uint32_t now)
+radix_tree_prune_branch(radix_tree_t *tree, radix_tree_node_t *node)
 {
 	int i, empty;
 	radix_tree_link_t *link;
@@ -416,26 +1026,19 @@ radix_tree_prune_branch(radix_tree_t *tree,
 	for (i = 0; i < RADIX_TREE_NODE_SIZE; i++) {
 		link = node->links + i;
 
-		if (now - link->time < BLOCK_CACHE_PAGE_IDLETIME) {
-			if (radix_tree_node_contains_leaves(tree, node)) {
-				empty = 0;
-				continue;
-			}
-
-			if (radix_tree_prune_branch(tree, link->u.next, now))
-				radix_tree_clear_link(link);
-			else
+		if (radix_tree_node_contains_leaves(tree, node)) {
+			if (link->u.leaf.page)
 				empty = 0;
-
 			continue;
 		}
 
-		if (radix_tree_node_contains_leaves(tree, node))
-			radix_tree_remove_page(tree, link->u.leaf.page);
-		else
-			radix_tree_delete_branch(tree, link->u.next);
+		if (!link->u.next)
+			continue;
 
-		radix_tree_clear_link(link);
+		if (radix_tree_prune_branch(tree, link->u.next))
+			radix_tree_clear_link(link);
+		else
+			empty = 0;
 	}
 
 	if (empty && !radix_tree_node_is_root(tree, node))
@@ -445,30 +1048,30 @@ radix_tree_prune_branch(radix_tree_t *tree,
 }
 
 /*
- * walk tree and free any node that has been idle for too long
+ * walk tree and free the nodes eviction left without leaves
  */
 static void
 radix_tree_prune(radix_tree_t *tree)
 {
-	struct timeval now;
-
 	if (!tree->root)
 		return;
 
 	DPRINTF("tree %s has %"PRIu64" bytes\n",
 		tree->cache->name, tree->size);
 
-	gettimeofday(&now, NULL);
-	radix_tree_prune_branch(tree, tree->root, now.tv_sec);
+	radix_tree_prune_branch(tree, tree->root);
 
 	DPRINTF("tree %s now has %"PRIu64" bytes\n",
 		tree->cache->name, tree->size);
 }
 
 static inline int
-radix_tree_initialize(radix_tree_t *tree, uint64_t sectors)
+radix_tree_initialize(radix_tree_t *tree, uint64_t sectors, int shift)
 {
-	tree->height = radix_tree_calculate_height(sectors);
+	uint64_t leaves = (sectors + (1ULL << shift) - 1) >> shift;
+
+	tree->shift  = shift;
+	tree->height = radix_tree_calculate_height(leaves);
 	tree->root   = radix_tree_allocate_node(tree, tree->height);
 	if (!tree->root)
 		return -ENOMEM;
@@ -482,38 +1085,114 @@ radix_tree_free(radix_tree_t *tree)
 	radix_tree_destroy(tree);
 }
 
+/*
+ * advance the clock of @cache until @bytes are freed, returns the bytes
+ * freed. every step clears a mark or evicts, at worst two sweeps.
+ */
+static uint64_t
+block_cache_evict(block_cache_t *cache, uint64_t bytes)
+{
+	radix_tree_page_t *page;
+	uint64_t freed;
+
+	freed = 0;
+
+	while (freed < bytes && !list_empty(&cache->lru)) {
+		page = list_entry(cache->lru.next, radix_tree_page_t, lru);
+
+		if (page->referenced) {
+			page->referenced = 0;
+			list_move_tail(&page->lru, &cache->lru);
+			continue;
+		}
+
+		freed += radix_tree_page_bytes(page);
+		cache->stats.evictions += page->size >> RADIX_TREE_NODE_SHIFT;
+		radix_tree_remove_page(&cache->tree, page);
+	}
+
+	return freed;
+}
+
+/*
+ * shed the share of @cache in the excess over the budget
+ */
+static void
+block_cache_balance(block_cache_t *cache)
+{
+	struct block_cache_budget *b = block_caches.budget;
+	uint64_t limit, used, mine;
+
+	block_cache_budget_lock(b);
+	limit = b->limit;
+	used  = b->used;
+	block_cache_budget_unlock(b);
+
+	if (used <= limit)
+		return;
+
+	mine = radix_tree_size(&cache->tree);
+	block_cache_evict(cache, (double)(used - limit) * mine / used);
+}
+
+static int
+block_cache_admit(block_cache_t *cache, size_t size)
+{
+	struct block_cache_budget *b = block_caches.budget;
+	uint64_t limit, used, share;
+
+	block_cache_budget_lock(b);
+	limit = b->limit;
+	used  = b->used;
+	share = b->limit / MAX(b->caches, 1);
+	block_cache_budget_unlock(b);
+
+	if (used + size <= limit)
+		return 1;
+
+	if (radix_tree_size(&cache->tree) + size <= share)
+		return 1;
+
+	return block_cache_evict(cache, size) >= size;
+}
+
 static void
 block_cache_prune_event(event_id_t id, char mode, void *private)
 {
+	struct block_cache_budget *b = block_caches.budget;
 	radix_tree_t *tree;
 	block_cache_t *cache;
 
 	cache = (block_cache_t *)private;
 	tree  = &cache->tree;
 
+	if (b != &block_cache_local) {
+		block_cache_budget_lock(b);
+		block_cache_budget_reap(b);
+		block_cache_budget_unlock(b);
+	}
+
 	radix_tree_prune(tree);
+	block_cache_balance(cache);
 }
 
 static inline block_cache_request_t *
 block_cache_get_request(block_cache_t *cache)
 {
-	if (!cache->requests_free)
-		return NULL;
-
-	return cache->request_free_list[--cache->requests_free];
+	return td_pool_get(&cache->requests);
 }
 
 static inline void
 block_cache_put_request(block_cache_t *cache, block_cache_request_t *breq)
 {
 	memset(breq, 0, sizeof(block_cache_request_t));
-	cache->request_free_list[cache->requests_free++] = breq;
+	td_pool_put(&cache->requests, breq);
 }
 
 static int
 block_cache_open(td_driver_t *driver, const char *name, td_flag_t flags)
 {
-	int i, err;
+	int err;
 	radix_tree_t *tree;
 	block_cache_t *cache;
 
@@ -529,28 +1208,37 @@ block_cache_open(td_driver_t *driver, const char *name, td_flag_t flags)
 		return -ENOMEM;
 
 	cache->sectors = driver->info.size;
+	INIT_LIST_HEAD(&cache->lru);
 
-	tree = &cache->tree;
-	err  = radix_tree_initialize(tree, cache->sectors);
+	tree        = &cache->tree;
+	tree->cache = cache;
+	err         = radix_tree_initialize(tree, cache->sectors,
+					    BLOCK_CACHE_LEAF_SHIFT_MIN);
 	if (err)
 		goto fail;
 
-	tree->cache = cache;
-	cache->requests_free = BLOCK_CACHE_REQUESTS;
-	for (i = 0; i < BLOCK_CACHE_REQUESTS; i++)
-		cache->request_free_list[i] = cache->requests + i;
+	td_pool_init(&cache->requests, sizeof(block_cache_request_t),
+		     TD_POOL_CHUNK, BLOCK_CACHE_REQUESTS);
 
 	cache->timeout_id = tapdisk_server_register_event(SCHEDULER_POLL_TIMEOUT,
 							  -1, /* dummy fd */
-							  BLOCK_CACHE_PAGE_IDLETIME << 1,
+							  BLOCK_CACHE_GC_INTERVAL,
 							  block_cache_prune_event,
 							  cache);
-	if (cache->timeout_id < 0)
+	if (cache->timeout_id < 0) {
+		err = cache->timeout_id;
 		goto fail;
+	}
+
+	pthread_mutex_lock(&block_caches.lock);
+	list_add_tail(&cache->entry, &block_caches.list);
+	pthread_mutex_unlock(&block_caches.lock);
+	block_cache_count(1);
 
 	DPRINTF("opening cache for %s, sectors: %"PRIu64", "
-		"tree: %p, height: %d\n",
-		cache->name, cache->sectors, tree, tree->height);
+		"tree: %p, height: %d, leaf: %d\n",
+		cache->name, cache->sectors, tree, tree->height,
+		RADIX_TREE_NODE_SIZE << tree->shift);
 
 	if (mlockall(MCL_CURRENT | MCL_FUTURE))
 		DPRINTF("mlockall failed: %d\n", -errno);
@@ -575,7 +1263,17 @@ block_cache_close(td_driver_t *driver)
 	DPRINTF("closing cache for %s\n", cache->name);
 
 	tapdisk_server_unregister_event(cache->timeout_id);
+
+	pthread_mutex_lock(&block_caches.lock);
+	list_del(&cache->entry);
+	pthread_mutex_unlock(&block_caches.lock);
+	block_cache_count(-1);
+
+	if (cache->shared)
+		tapdisk_shm_cache_put();
+
 	radix_tree_free(tree);
+	td_pool_destroy(&cache->requests);
 	free(cache->name);
 
 	return 0;
@@ -599,20 +1297,117 @@ block_cache_hash(block_cache_t *cache, char *buf)
 	return ~cksm;
 }
 
+int
+block_cache_share(td_driver_t *driver, const uint8_t *uuid)
+{
+	block_cache_t *cache = (block_cache_t *)driver->data;
+	int err;
+
+	if (cache->shared)
+		return 0;
+
+	err = tapdisk_shm_cache_get();
+	if (err)
+		return err;
+
+	memcpy(cache->uuid, uuid, sizeof(cache->uuid));
+	cache->shared = 1;
+
+	DPRINTF("%s: sharing blocks host-wide\n", cache->name);
+	return 0;
+}
+
+/*
+ * the host cache holds whole pages: reads within one may hit, reads
+ * covering whole ones fill them
+ */
+static inline int
+block_cache_shared_page(block_cache_t *cache, td_request_t treq)
+{
+	int off = treq.sec & (BLOCK_CACHE_NODES_PER_PAGE - 1);
+
+	return cache->shared && off + treq.secs <= BLOCK_CACHE_NODES_PER_PAGE;
+}
+
+static inline int
+block_cache_shared_fill(block_cache_t *cache, uint64_t sec, uint64_t secs)
+{
+	uint64_t first, end;
+
+	first = (sec + BLOCK_CACHE_NODES_PER_PAGE - 1) /
+		BLOCK_CACHE_NODES_PER_PAGE;
+	end   = (sec + secs) / BLOCK_CACHE_NODES_PER_PAGE;
+
+	return cache->shared && end > first;
+}
+
+static void
+block_cache_shared_write(block_cache_t *cache, char *buf,
+			 uint64_t sec, uint64_t secs)
+{
+	uint64_t page, end;
+	size_t off;
+
+	page = (sec + BLOCK_CACHE_NODES_PER_PAGE - 1) /
+		BLOCK_CACHE_NODES_PER_PAGE;
+	end  = (sec + secs) / BLOCK_CACHE_NODES_PER_PAGE;
+
+	for (; page < end; page++) {
+		off = (page * BLOCK_CACHE_NODES_PER_PAGE - sec) <<
+			RADIX_TREE_NODE_SHIFT;
+		tapdisk_shm_cache_write(cache->uuid, page, buf + off);
+	}
+}
+
+static int
+block_cache_shared_hit(block_cache_t *cache, td_request_t treq)
+{
+	uint64_t page;
+	size_t off;
+	int err;
+
+	page = treq.sec / BLOCK_CACHE_NODES_PER_PAGE;
+	off  = (treq.sec % BLOCK_CACHE_NODES_PER_PAGE) << RADIX_TREE_NODE_SHIFT;
+
+	err = tapdisk_shm_cache_read(cache->uuid, page, off,
+				     treq.secs << RADIX_TREE_NODE_SHIFT,
+				     treq.buf);
+	if (err)
+		return 0;
+
+	cache->stats.shared_hits += treq.secs;
+	td_complete_request(treq, 0);
+
+	return 1;
+}
+
+/*
+ * @iov holds the leaves @treq spans, in order
+ */
 static void
 block_cache_hit(block_cache_t *cache, td_request_t treq, char *iov[])
 {
+	radix_tree_t *tree = &cache->tree;
+	uint64_t sec, end, next;
+	char *buf;
 	int i;
-	off_t off;
 
 	cache->stats.hits += treq.secs;
 
-	for (i = 0; i < treq.secs; i++) {
+	sec = treq.sec;
+	end = treq.sec + treq.secs;
+	buf = treq.buf;
+
+	for (i = 0; sec < end; i++, sec = next) {
+		next = MIN(((sec >> tree->shift) + 1) << tree->shift, end);
+
 		DBG("%s: block cache hit: sec 0x%08llx, hash: 0x%08llx\n",
-		    cache->name, treq.sec + i, block_cache_hash(cache, iov[i]));
+		    cache->name, sec, block_cache_hash(cache, iov[i]));
 
-		off = i << RADIX_TREE_NODE_SHIFT;
-		memcpy(treq.buf + off, iov[i], RADIX_TREE_NODE_SIZE);
+		memcpy(buf, iov[i] + ((sec & ((1ULL << tree->shift) - 1)) <<
+				      RADIX_TREE_NODE_SHIFT),
+		       (next - sec) << RADIX_TREE_NODE_SHIFT);
+		buf += (next - sec) << RADIX_TREE_NODE_SHIFT;
 	}
 
 	td_complete_request(treq, 0);
@@ -621,7 +1416,6 @@ block_cache_hit(block_cache_t *cache, td_request_t treq, char *iov[])
 static void
 block_cache_populate_cache(td_request_t clone, int err)
 {
-	int i;
 	radix_tree_t *tree;
 	block_cache_t *cache;
 	block_cache_request_t *breq;
@@ -636,63 +1430,109 @@ block_cache_populate_cache(td_request_t clone, int err)
 		return;
 
 	if (breq->err) {
+		cache->stats.fill_failures += breq->treq.secs;
 		free(breq->buf);
 		goto out;
 	}
 
-	for (i = 0; i < breq->treq.secs; i++) {
-		off_t off = i << RADIX_TREE_NODE_SHIFT;
-		DBG("%s: populating sec 0x%08llx\n",
-		    cache->name, breq->treq.sec + i);
-		memcpy(breq->treq.buf + off,
-		       breq->buf + off, RADIX_TREE_NODE_SIZE);
+	if (block_cache_shared_fill(cache, breq->sec, breq->count))
+		block_cache_shared_write(cache, breq->buf ? : breq->treq.buf,
+					 breq->sec, breq->count);
+
+	/* read straight into the request, for the host cache only */
+	if (!breq->buf)
+		goto out;
+
+	DBG("%s: populating sec 0x%08llx, secs: %llu\n",
+	    cache->name, breq->sec, breq->count);
+	memcpy(breq->treq.buf,
+	       breq->buf + ((breq->treq.sec - breq->sec) <<
+			    RADIX_TREE_NODE_SHIFT),
+	       breq->treq.secs << RADIX_TREE_NODE_SHIFT);
+
+	/* the tree settled on other leaves meanwhile */
+	if (breq->shift != tree->shift || !tree->root) {
+		free(breq->buf);
+		goto out;
 	}
 
-	if (radix_tree_add_leaves(tree, breq->buf,
-				  breq->treq.sec, breq->treq.secs))
+	if (block_cache_pool.enabled) {
+		if (radix_tree_add_blob_leaves(tree, breq->buf,
+					       breq->sec, breq->count))
+			cache->stats.fill_failures += breq->treq.secs;
+	} else if (radix_tree_add_leaves(tree, breq->buf,
+					 breq->sec, breq->count)) {
+		cache->stats.fill_failures += breq->treq.secs;
 		free(breq->buf);
+	}
 
 out:
 	td_complete_request(breq->treq, breq->err);
 	block_cache_put_request(cache, breq);
 }
 
+/*
+ * misses read the whole leaves @treq spans
+ */
 static void
 block_cache_miss(block_cache_t *cache, td_request_t treq)
 {
+	radix_tree_t *tree = &cache->tree;
+	uint64_t sec, end;
 	void *buf;
 	size_t size;
 	td_request_t clone;
-	radix_tree_t *tree;
 	block_cache_request_t *breq;
 
 	DBG("%s: block cache miss: sec 0x%08llx\n", cache->name, treq.sec);
 
+	if (block_cache_shared_page(cache, treq) &&
+	    block_cache_shared_hit(cache, treq))
+		return;
+
+	sec   = (treq.sec >> tree->shift) << tree->shift;
+	end   = ((treq.sec + treq.secs - 1) >> tree->shift) + 1;
+	end   = MIN(end << tree->shift, cache->sectors);
+
 	clone = treq;
-	tree  = &cache->tree;
-	size  = treq.secs << RADIX_TREE_NODE_SHIFT;
+	size  = (end - sec) << RADIX_TREE_NODE_SHIFT;
+	buf   = NULL;
 
 	cache->stats.misses += treq.secs;
 
-	if (radix_tree_size(tree) + size >= BLOCK_CACHE_MAX_SIZE)
-		goto out;
+	if (!block_cache_admit(cache, size))
+		cache->stats.refused += treq.secs;
+	else if (posix_memalign(&buf, RADIX_TREE_NODE_SIZE, size)) {
+		cache->stats.fill_failures += treq.secs;
+		buf = NULL;
+	}
 
-	breq = block_cache_get_request(cache);
-	if (!breq)
-		goto out;
+	if (!buf) {
+		sec = treq.sec;
+		end = treq.sec + treq.secs;
+		if (!block_cache_shared_fill(cache, sec, end - sec))
+			goto out;
+	}
 
-	if (posix_memalign(&buf, RADIX_TREE_NODE_SIZE, size)) {
-		block_cache_put_request(cache, breq);
+	breq = block_cache_get_request(cache);
+	if (!breq) {
+		cache->stats.fill_failures += treq.secs;
+		free(buf);
 		goto out;
 	}
 
 	breq->treq    = treq;
-	breq->secs    = treq.secs;
+	breq->sec     = sec;
+	breq->count   = end - sec;
+	breq->shift   = tree->shift;
+	breq->secs    = end - sec;
 	breq->err     = 0;
 	breq->buf     = buf;
 	breq->cache   = cache;
 
-	clone.buf     = buf;
+	clone.sec     = sec;
+	clone.secs    = end - sec;
+	clone.buf     = buf ? : treq.buf;
 	clone.cb      = block_cache_populate_cache;
 	clone.cb_data = breq;
 
@@ -700,26 +1540,90 @@ out:
 	td_forward_request(clone);
 }
 
+/*
+ * bin the first BLOCK_CACHE_LEAF_SAMPLE reads by size, then rebuild the
+ * tree on the largest leaf at least 3/4 of them cover
+ */
+static void
+block_cache_sample(block_cache_t *cache, uint64_t secs)
+{
+	radix_tree_t *tree = &cache->tree;
+	int bin, shift, covered;
+
+	if (cache->sampled > BLOCK_CACHE_LEAF_SAMPLE)
+		return;
+
+	if (cache->sampled++ < BLOCK_CACHE_LEAF_SAMPLE) {
+		for (bin = 0;
+		     bin < BLOCK_CACHE_LEAF_SHIFT_MAX && secs >> (bin + 1);
+		     bin++)
+			;
+		cache->sizes[bin]++;
+		return;
+	}
+
+	covered = 0;
+	for (shift = BLOCK_CACHE_LEAF_SHIFT_MAX;
+	     shift > BLOCK_CACHE_LEAF_SHIFT_MIN; shift--) {
+		covered += cache->sizes[shift];
+		if (covered * 4 >= BLOCK_CACHE_LEAF_SAMPLE * 3)
+			break;
+	}
+
+	if (shift == tree->shift)
+		return;
+
+	radix_tree_destroy(tree);
+	if (radix_tree_initialize(tree, cache->sectors, shift)) {
+		EPRINTF("%s: no tree for %d byte leaves\n", cache->name,
+			RADIX_TREE_NODE_SIZE << shift);
+		shift = BLOCK_CACHE_LEAF_SHIFT_MIN;
+		if (radix_tree_initialize(tree, cache->sectors, shift))
+			return;
+	}
+
+	DPRINTF("%s: leaves now %d bytes, height: %d\n", cache->name,
+		RADIX_TREE_NODE_SIZE << tree->shift, tree->height);
+}
+
 static void
 block_cache_queue_read(td_driver_t *driver, td_request_t treq)
 {
-	int i;
+	int i, leaves;
+	uint64_t first;
 	radix_tree_t *tree;
 	block_cache_t *cache;
-	char *iov[BLOCK_CACHE_NODES_PER_PAGE];
+	radix_tree_leaf_t *leaf;
+	struct block_cache_budget *b;
+	char *iov[BLOCK_CACHE_LEAVES];
 
 	cache = (block_cache_t *)driver->data;
 	tree  = &cache->tree;
+	b     = block_caches.budget;
 
 	cache->stats.reads += treq.secs;
 
-	if (treq.secs > BLOCK_CACHE_NODES_PER_PAGE)
+	if (b->used > b->limit)
+		block_cache_balance(cache);
+
+	block_cache_sample(cache, treq.secs);
+
+	if (!tree->root)
+		return td_forward_request(treq);
+
+	first  = treq.sec >> tree->shift;
+	leaves = ((treq.sec + treq.secs - 1) >> tree->shift) - first + 1;
+
+	if (leaves > BLOCK_CACHE_LEAVES)
 		return td_forward_request(treq);
 
-	for (i = 0; i < treq.secs; i++) {
-		iov[i] = radix_tree_find_leaf(tree, treq.sec + i);
-		if (!iov[i])
+	for (i = 0; i < leaves; i++) {
+		leaf = radix_tree_find_leaf(tree, (first + i) << tree->shift);
+		if (!leaf)
 			return block_cache_miss(cache, treq);
+
+		iov[i] = leaf->buf;
+		leaf->page->referenced = 1;
 	}
 
 	return block_cache_hit(cache, treq, iov);
@@ -755,14 +1659,95 @@ block_cache_debug(td_driver_t *driver)
 {
 	block_cache_t *cache;
 	block_cache_stats_t *stats;
+	uint64_t limit, used;
+	uint32_t caches;
+	uint64_t held, mapped;
+	int mode, dedup;
 
 	cache = (block_cache_t *)driver->data;
 	stats = &cache->stats;
 
+	block_cache_get_budget(&limit, &used, &caches, &mode);
+
 	WARN("BLOCK CACHE %s\n", cache->name);
 	WARN("reads: %"PRIu64", hits: %"PRIu64", "
 	     "misses: %"PRIu64", prunes: %"PRIu64"\n",
 	     stats->reads, stats->hits, stats->misses, stats->prunes);
+	WARN("evictions: %"PRIu64", refused: %"PRIu64", size: %"PRIu64"\n",
+	     stats->evictions, stats->refused, radix_tree_size(&cache->tree));
+	WARN("shared: %d, shared hits: %"PRIu64", leaf: %d\n",
+	     cache->shared, stats->shared_hits,
+	     RADIX_TREE_NODE_SIZE << cache->tree.shift);
+	WARN("budget: %s, limit: %"PRIu64", used: %"PRIu64", caches: %u\n",
+	     mode == BLOCK_CACHE_BUDGET_HOST ? "host" : "process",
+	     limit, used, caches);
+
+	block_cache_get_dedup(&dedup, &held, &mapped);
+	WARN("dedup: %d, leaves: %"PRIu64", held: %"PRIu64", "
+	     "mapped: %"PRIu64"\n", dedup, stats->dedup_leaves, held, mapped);
+}
+
+static void
+block_cache_stats(td_driver_t *driver, td_stats_t *st)
+{
+	block_cache_t *cache = driver->data;
+	block_cache_stats_t *stats = &cache->stats;
+	uint64_t limit, used;
+	uint32_t caches;
+	uint64_t held, mapped;
+	int mode, dedup;
+
+	block_cache_get_budget(&limit, &used, &caches, &mode);
+
+	tapdisk_stats_field(st, "reads", "llu", stats->reads);
+	tapdisk_stats_field(st, "hits", "llu", stats->hits);
+	tapdisk_stats_field(st, "shared_hits", "llu", stats->shared_hits);
+	tapdisk_stats_field(st, "misses", "llu", stats->misses);
+	tapdisk_stats_field(st, "bytes_served", "llu",
+			    (stats->hits + stats->shared_hits) <<
+			    RADIX_TREE_NODE_SHIFT);
+	tapdisk_stats_field(st, "evictions", "llu", stats->evictions);
+	tapdisk_stats_field(st, "prunes", "llu", stats->prunes);
+	tapdisk_stats_field(st, "refused", "llu", stats->refused);
+	tapdisk_stats_field(st, "fill_failures", "llu", stats->fill_failures);
+	tapdisk_stats_field(st, "resident", "llu",
+			    radix_tree_size(&cache->tree));
+	tapdisk_stats_field(st, "shared", "d", cache->shared);
+	tapdisk_stats_field(st, "leaf_size", "d",
+			    RADIX_TREE_NODE_SIZE << cache->tree.shift);
+
+	tapdisk_stats_field(st, "budget", "{");
+	tapdisk_stats_field(st, "mode", "s",
+			    mode == BLOCK_CACHE_BUDGET_HOST ?
+			    "host" : "process");
+	tapdisk_stats_field(st, "limit", "llu", limit);
+	tapdisk_stats_field(st, "used", "llu", used);
+	tapdisk_stats_field(st, "caches", "u", caches);
+	tapdisk_stats_leave(st, '}');
+
+	block_cache_get_dedup(&dedup, &held, &mapped);
+	tapdisk_stats_field(st, "dedup", "{");
+	tapdisk_stats_field(st, "enabled", "d", dedup);
+	tapdisk_stats_field(st, "leaves", "llu", stats->dedup_leaves);
+	tapdisk_stats_field(st, "held", "llu", held);
+	tapdisk_stats_field(st, "mapped", "llu", mapped);
+	tapdisk_stats_leave(st, '}');
+
+	tapdisk_stats_field(st, "reqs", "{");
+	td_pool_stats(&cache->requests, st);
+	tapdisk_stats_leave(st, '}');
+}
+
+static int
+block_cache_footprint(td_driver_t *driver, int trim, uint64_t *bytes)
+{
+	block_cache_t *cache = driver->data;
+
+	if (trim)
+		td_pool_trim(&cache->requests);
+
+	*bytes = td_pool_bytes(&cache->requests);
+	return 0;
 }
 
 struct tap_disk tapdisk_block_cache = {
@@ -776,4 +1761,6 @@ struct tap_disk tapdisk_block_cache = {
 	.td_get_parent_id           = block_cache_get_parent_id,
 	.td_validate_parent         = block_cache_validate_parent,
 	.td_debug                   = block_cache_debug,
+	.td_stats                   = block_cache_stats,
+	.td_footprint               = block_cache_footprint,
 };
@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2.1 only
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef _TAPDISK_BLOCK_CACHE_H_
+#define _TAPDISK_BLOCK_CACHE_H_
+
+#include <stdint.h>
+
+#include "tapdisk.h"
+
+/*
+ * Memory budget of the block caches, shared by every cache of the
+ * process or, attached to BLOCK_CACHE_SHM, of the host.
+ */
+#define BLOCK_CACHE_SHM                  "/tapdisk-block-cache"
+
+#define BLOCK_CACHE_BUDGET_PROCESS       0
+#define BLOCK_CACHE_BUDGET_HOST          1
+
+/* with every loop entered; limit 0 leaves it, mode -1 as is */
+int block_cache_set_budget(uint64_t limit, int mode);
+void block_cache_get_budget(uint64_t *limit, uint64_t *used,
+			    uint32_t *caches, int *mode);
+
+/*
+ * Fill the caches of the process, from now on, through one pool keyed
+ * by content, so identical blocks under different parents are held
+ * once. @held are the bytes in the pool, @mapped those the trees map.
+ */
+int block_cache_set_dedup(int enable);
+void block_cache_get_dedup(int *enabled, uint64_t *held, uint64_t *mapped);
+
+/* serve and fill the host-wide cache for the parent named by @uuid */
+int block_cache_share(td_driver_t *, const uint8_t *uuid);
+
+#endif
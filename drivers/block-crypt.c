@@ -0,0 +1,646 @@
+/*
+ * Copyright (C) Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2.1 only
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * At-rest encryption of everything below the filter.
+ *
+ * Sectors are XTS-AES encrypted as 512-byte data units, the tweak
+ * being the sector number, little-endian (as dm-crypt's plain64). The
+ * key file named as the image holds the raw XTS key: 32 bytes for
+ * AES-128, 64 for AES-256. OpenSSL picks AES-NI or VAES where the cpu
+ * has them.
+ *
+ * Crypto runs on helper threads of the vbd, never on the event loop.
+ * Writes are encrypted into a bounce buffer before being forwarded,
+ * reads decrypted in place once all of their fragments completed.
+ * Discards complete without being forwarded: a discarded range
+ * reading back zeros would decrypt to garbage.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#ifdef HAVE_OPENSSL
+#include <openssl/evp.h>
+#include <openssl/crypto.h>
+#endif
+
+#include "tapdisk.h"
+#include "tapdisk-driver.h"
+#include "tapdisk-server.h"
+#include "tapdisk-interface.h"
+#include "tapdisk-log.h"
+#include "scheduler.h"
+#include "libaio-compat.h"
+
+#define BUG_ON(_cond)           if (unlikely(_cond)) { td_panic(); }
+
+#define TD_CRYPT_THREADS        2
+#define TD_CRYPT_ALIGN          4096
+#define TD_CRYPT_KEY_MAX        64
+#define TD_CRYPT_UNIT           (1 << SECTOR_SHIFT)
+
+typedef struct td_crypt         td_crypt_t;
+typedef struct td_crypt_req     td_crypt_req_t;
+typedef struct td_crypt_worker  td_crypt_worker_t;
+
+struct td_crypt_req {
+	td_request_t            treq;
+	char                   *buf;      /* ciphertext, for writes */
+	int                     pending;  /* sectors forwarded */
+	int                     error;
+
+	struct list_head        entry;
+	td_crypt_t             *s;
+};
+
+struct td_crypt_worker {
+	pthread_t               thread;
+	int                     started;
+#ifdef HAVE_OPENSSL
+	EVP_CIPHER_CTX         *enc;
+	EVP_CIPHER_CTX         *dec;
+#endif
+	td_crypt_t             *s;
+};
+
+struct td_crypt_stats {
+	unsigned long long      reads;
+	unsigned long long      writes;
+	unsigned long long      discards;
+	unsigned long long      secs;     /* encrypted or decrypted */
+	unsigned long long      errors;
+};
+
+struct td_crypt {
+	int                     key_len;
+	unsigned char           key[TD_CRYPT_KEY_MAX];
+
+	td_crypt_worker_t       workers[TD_CRYPT_THREADS];
+	int                     stop;
+
+	pthread_mutex_t         lock;
+	pthread_cond_t          cond;
+	struct list_head        queued;
+	struct list_head        finished;
+	int                     n_queued; /* queued or running */
+
+	int                     efd;
+	event_id_t              event;
+
+	struct td_pool          reqs;
+	struct td_crypt_stats   stats;
+};
+
+#ifdef HAVE_OPENSSL
+
+static const EVP_CIPHER *
+crypt_cipher(td_crypt_t *s)
+{
+	return s->key_len == 32 ? EVP_aes_128_xts() : EVP_aes_256_xts();
+}
+
+static int
+crypt_sectors(EVP_CIPHER_CTX *ctx, td_sector_t sec,
+	      const char *src, char *dst, int secs)
+{
+	unsigned char iv[16];
+	int i, len;
+
+	for (i = 0; i < secs; i++, sec++) {
+		memset(iv, 0, sizeof(iv));
+		*(uint64_t *)iv = htole64(sec);
+
+		if (!EVP_CipherInit_ex(ctx, NULL, NULL, NULL, iv, -1))
+			return -EIO;
+
+		if (!EVP_CipherUpdate(ctx, (unsigned char *)dst, &len,
+				      (const unsigned char *)src,
+				      TD_CRYPT_UNIT))
+			return -EIO;
+
+		src += TD_CRYPT_UNIT;
+		dst += TD_CRYPT_UNIT;
+	}
+
+	return 0;
+}
+
+static int
+crypt_request(td_crypt_worker_t *w, td_crypt_req_t *req)
+{
+	td_request_t *treq = &req->treq;
+
+	if (treq->op == TD_OP_WRITE)
+		return crypt_sectors(w->enc, treq->sec, treq->buf,
+				     req->buf, treq->secs);
+
+	return crypt_sectors(w->dec, treq->sec, treq->buf,
+			     treq->buf, treq->secs);
+}
+
+static void
+crypt_worker_free(td_crypt_worker_t *w)
+{
+	EVP_CIPHER_CTX_free(w->enc);
+	EVP_CIPHER_CTX_free(w->dec);
+	w->enc = NULL;
+	w->dec = NULL;
+}
+
+static int
+crypt_worker_init(td_crypt_t *s, td_crypt_worker_t *w)
+{
+	w->s   = s;
+	w->enc = EVP_CIPHER_CTX_new();
+	w->dec = EVP_CIPHER_CTX_new();
+	if (!w->enc || !w->dec)
+		goto fail;
+
+	if (!EVP_CipherInit_ex(w->enc, crypt_cipher(s), NULL, s->key, NULL, 1))
+		goto fail;
+
+	if (!EVP_CipherInit_ex(w->dec, crypt_cipher(s), NULL, s->key, NULL, 0))
+		goto fail;
+
+	return 0;
+
+fail:
+	crypt_worker_free(w);
+	return -EINVAL;
+}
+
+static void
+crypt_forget_key(td_crypt_t *s)
+{
+	OPENSSL_cleanse(s->key, sizeof(s->key));
+	s->key_len = 0;
+}
+
+#else
+
+static int
+crypt_request(td_crypt_worker_t *w, td_crypt_req_t *req)
+{
+	return -EOPNOTSUPP;
+}
+
+static void
+crypt_worker_free(td_crypt_worker_t *w)
+{
+}
+
+static int
+crypt_worker_init(td_crypt_t *s, td_crypt_worker_t *w)
+{
+	EPRINTF("built without openssl, cannot encrypt\n");
+	return -EOPNOTSUPP;
+}
+
+static void
+crypt_forget_key(td_crypt_t *s)
+{
+	memset(s->key, 0, sizeof(s->key));
+	s->key_len = 0;
+}
+
+#endif
+
+static void *
+crypt_thread(void *arg)
+{
+	td_crypt_worker_t *w = arg;
+	td_crypt_t *s = w->s;
+	td_crypt_req_t *req;
+	uint64_t val = 1;
+	int gcc;
+
+	pthread_mutex_lock(&s->lock);
+
+	for (;;) {
+		while (list_empty(&s->queued) && !s->stop)
+			pthread_cond_wait(&s->cond, &s->lock);
+
+		if (s->stop)
+			break;
+
+		req = list_entry(s->queued.next, td_crypt_req_t, entry);
+		list_del(&req->entry);
+		pthread_mutex_unlock(&s->lock);
+
+		req->error = crypt_request(w, req);
+
+		pthread_mutex_lock(&s->lock);
+		list_add_tail(&req->entry, &s->finished);
+
+		gcc = write(s->efd, &val, sizeof(val));
+		if (gcc) {};
+	}
+
+	pthread_mutex_unlock(&s->lock);
+
+	return NULL;
+}
+
+static void
+crypt_queue(td_crypt_t *s, td_crypt_req_t *req)
+{
+	pthread_mutex_lock(&s->lock);
+	list_add_tail(&req->entry, &s->queued);
+	s->n_queued++;
+	pthread_cond_signal(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+}
+
+static td_crypt_req_t *
+crypt_alloc_request(td_crypt_t *s, td_request_t treq)
+{
+	td_crypt_req_t *req;
+
+	req = td_pool_get(&s->reqs);
+	if (!req)
+		return NULL;
+
+	memset(req, 0, sizeof(*req));
+	req->treq = treq;
+	req->s    = s;
+	INIT_LIST_HEAD(&req->entry);
+
+	return req;
+}
+
+static void
+crypt_free_request(td_crypt_t *s, td_crypt_req_t *req)
+{
+	free(req->buf);
+	td_pool_put(&s->reqs, req);
+}
+
+static void
+crypt_complete(td_crypt_t *s, td_crypt_req_t *req, int error)
+{
+	if (error)
+		s->stats.errors++;
+
+	td_complete_request(req->treq, error);
+	crypt_free_request(s, req);
+}
+
+static void
+__crypt_write_cb(td_request_t treq, int error)
+{
+	td_crypt_req_t *req = treq.cb_data;
+
+	BUG_ON(req->pending < treq.secs);
+
+	req->pending -= treq.secs;
+	if (error && !req->error)
+		req->error = error;
+
+	if (!req->pending)
+		crypt_complete(req->s, req, req->error);
+}
+
+static void
+__crypt_read_cb(td_request_t treq, int error)
+{
+	td_crypt_req_t *req = treq.cb_data;
+	td_crypt_t *s = req->s;
+
+	BUG_ON(req->pending < treq.secs);
+
+	req->pending -= treq.secs;
+	if (error && !req->error)
+		req->error = error;
+
+	if (req->pending)
+		return;
+
+	if (req->error)
+		crypt_complete(s, req, req->error);
+	else
+		crypt_queue(s, req);
+}
+
+/* back from a worker, on the event loop */
+static void
+crypt_finish(td_crypt_t *s, td_crypt_req_t *req)
+{
+	td_request_t clone;
+
+	s->stats.secs += req->treq.secs;
+
+	if (req->error || req->treq.op == TD_OP_READ) {
+		crypt_complete(s, req, req->error);
+		return;
+	}
+
+	req->pending  = req->treq.secs;
+
+	clone         = req->treq;
+	clone.buf     = req->buf;
+	clone.cb      = __crypt_write_cb;
+	clone.cb_data = req;
+
+	td_forward_request(clone);
+}
+
+static void
+crypt_event(event_id_t id, char mode, void *private)
+{
+	td_crypt_t *s = private;
+	td_crypt_req_t *req, *next;
+	struct list_head done;
+	uint64_t val;
+	int gcc;
+
+	gcc = read(s->efd, &val, sizeof(val));
+	if (gcc) {};
+
+	INIT_LIST_HEAD(&done);
+
+	pthread_mutex_lock(&s->lock);
+	list_splice(&s->finished, &done);
+	INIT_LIST_HEAD(&s->finished);
+	pthread_mutex_unlock(&s->lock);
+
+	list_for_each_entry_safe(req, next, &done, entry) {
+		list_del_init(&req->entry);
+		s->n_queued--;
+		crypt_finish(s, req);
+	}
+}
+
+static void
+crypt_queue_read(td_driver_t *driver, td_request_t treq)
+{
+	td_crypt_t *s = driver->data;
+	td_crypt_req_t *req;
+	td_request_t clone;
+
+	req = crypt_alloc_request(s, treq);
+	if (!req) {
+		td_complete_request(treq, -EBUSY);
+		return;
+	}
+
+	s->stats.reads++;
+
+	req->pending  = treq.secs;
+
+	clone         = treq;
+	clone.cb      = __crypt_read_cb;
+	clone.cb_data = req;
+
+	td_forward_request(clone);
+}
+
+static void
+crypt_queue_write(td_driver_t *driver, td_request_t treq)
+{
+	td_crypt_t *s = driver->data;
+	td_crypt_req_t *req;
+	int err;
+
+	req = crypt_alloc_request(s, treq);
+	if (!req) {
+		td_complete_request(treq, -EBUSY);
+		return;
+	}
+
+	err = posix_memalign((void **)&req->buf, TD_CRYPT_ALIGN,
+			     treq.secs << SECTOR_SHIFT);
+	if (err) {
+		req->buf = NULL;
+		crypt_complete(s, req, -ENOMEM);
+		return;
+	}
+
+	s->stats.writes++;
+	crypt_queue(s, req);
+}
+
+static void
+crypt_queue_discard(td_driver_t *driver, td_request_t treq)
+{
+	td_crypt_t *s = driver->data;
+
+	s->stats.discards++;
+	td_complete_request(treq, 0);
+}
+
+static int
+crypt_read_key(td_crypt_t *s, const char *name)
+{
+	unsigned char buf[TD_CRYPT_KEY_MAX + 1];
+	ssize_t n;
+	int fd, err;
+
+	fd = open(name, O_RDONLY);
+	if (fd < 0) {
+		err = -errno;
+		EPRINTF("opening key %s: %d\n", name, err);
+		return err;
+	}
+
+	n = read(fd, buf, sizeof(buf));
+	err = n < 0 ? -errno : 0;
+	close(fd);
+
+	if (!err && n != 32 && n != 64)
+		err = -EINVAL;
+
+	/* xts halves must differ */
+	if (!err && !memcmp(buf, buf + n / 2, n / 2))
+		err = -EINVAL;
+
+	if (!err) {
+		memcpy(s->key, buf, n);
+		s->key_len = n;
+	} else
+		EPRINTF("key %s: need 32 or 64 bytes of xts key: %d\n",
+			name, err);
+
+	memset(buf, 0, sizeof(buf));
+	return err;
+}
+
+static void
+crypt_stop(td_crypt_t *s)
+{
+	td_crypt_worker_t *w;
+
+	pthread_mutex_lock(&s->lock);
+	s->stop = 1;
+	pthread_cond_broadcast(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+
+	for (w = s->workers; w < &s->workers[TD_CRYPT_THREADS]; w++) {
+		if (w->started)
+			pthread_join(w->thread, NULL);
+		w->started = 0;
+		crypt_worker_free(w);
+	}
+
+	if (s->event >= 0)
+		tapdisk_server_unregister_event(s->event);
+	if (s->efd >= 0)
+		close(s->efd);
+
+	s->event = -1;
+	s->efd   = -1;
+}
+
+static int
+crypt_close(td_driver_t *driver)
+{
+	td_crypt_t *s = driver->data;
+
+	BUG_ON(s->n_queued);
+
+	crypt_stop(s);
+	crypt_forget_key(s);
+	pthread_mutex_destroy(&s->lock);
+	pthread_cond_destroy(&s->cond);
+	td_pool_destroy(&s->reqs);
+
+	return 0;
+}
+
+static int
+crypt_open(td_driver_t *driver, const char *name, td_flag_t flags)
+{
+	td_crypt_t *s = driver->data;
+	td_crypt_worker_t *w;
+	int err;
+
+	memset(s, 0, sizeof(*s));
+	s->efd   = -1;
+	s->event = -1;
+	INIT_LIST_HEAD(&s->queued);
+	INIT_LIST_HEAD(&s->finished);
+	pthread_mutex_init(&s->lock, NULL);
+	pthread_cond_init(&s->cond, NULL);
+	td_pool_init(&s->reqs, sizeof(td_crypt_req_t),
+		     TD_POOL_CHUNK, TD_POOL_LIMIT);
+
+	err = crypt_read_key(s, name);
+	if (err)
+		goto fail;
+
+	s->efd = tapdisk_sys_eventfd(0);
+	if (s->efd < 0) {
+		err = -errno;
+		goto fail;
+	}
+
+	s->event = tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
+						 s->efd, 0, crypt_event, s);
+	if (s->event < 0) {
+		err = s->event;
+		goto fail;
+	}
+
+	for (w = s->workers; w < &s->workers[TD_CRYPT_THREADS]; w++) {
+		err = crypt_worker_init(s, w);
+		if (err)
+			goto fail;
+
+		err = pthread_create(&w->thread, NULL, crypt_thread, w);
+		if (err) {
+			err = -err;
+			goto fail;
+		}
+
+		w->started = 1;
+		tapdisk_server_place_thread(w->thread);
+	}
+
+	return 0;
+
+fail:
+	crypt_close(driver);
+	return err;
+}
+
+static int
+crypt_get_parent_id(td_driver_t *driver, td_disk_id_t *id)
+{
+	return -EINVAL;
+}
+
+static int
+crypt_validate_parent(td_driver_t *driver,
+		      td_driver_t *pdriver, td_flag_t flags)
+{
+	return 0;
+}
+
+static void
+crypt_stats(td_driver_t *driver, td_stats_t *st)
+{
+	td_crypt_t *s = driver->data;
+
+	tapdisk_stats_field(st, "reqs", "{");
+	td_pool_stats(&s->reqs, st);
+	tapdisk_stats_leave(st, '}');
+
+	tapdisk_stats_field(st, "key_bits", "d", s->key_len * 4);
+	tapdisk_stats_field(st, "threads", "d", TD_CRYPT_THREADS);
+	tapdisk_stats_field(st, "queued", "d", s->n_queued);
+	tapdisk_stats_field(st, "reads", "llu", s->stats.reads);
+	tapdisk_stats_field(st, "writes", "llu", s->stats.writes);
+	tapdisk_stats_field(st, "discards", "llu", s->stats.discards);
+	tapdisk_stats_field(st, "secs", "llu", s->stats.secs);
+	tapdisk_stats_field(st, "errors", "llu", s->stats.errors);
+}
+
+static int
+crypt_footprint(td_driver_t *driver, int trim, uint64_t *bytes)
+{
+	td_crypt_t *s = driver->data;
+
+	if (trim)
+		td_pool_trim(&s->reqs);
+
+	*bytes = td_pool_bytes(&s->reqs);
+	return 0;
+}
+
+struct tap_disk tapdisk_crypt = {
+	.disk_type                  = "tapdisk_crypt",
+	.flags                      = 0,
+	.private_data_size          = sizeof(td_crypt_t),
+	.td_open                    = crypt_open,
+	.td_close                   = crypt_close,
+	.td_queue_read              = crypt_queue_read,
+	.td_queue_write             = crypt_queue_write,
+	.td_queue_discard           = crypt_queue_discard,
+	.td_get_parent_id           = crypt_get_parent_id,
+	.td_validate_parent         = crypt_validate_parent,
+	.td_stats                   = crypt_stats,
+	.td_footprint               = crypt_footprint,
+};
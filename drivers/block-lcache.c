@@ -34,6 +34,7 @@
 #include "tapdisk-driver.h"
 #include "tapdisk-server.h"
 #include "tapdisk-interface.h"
+#include "tapdisk-vbd.h"
 
 #define DEBUG 1
 
@@ -51,9 +52,22 @@
 
 #define MIN(a, b)       ((a) < (b) ? (a) : (b))
 
-#define TD_LCACHE_MAX_REQ               (MAX_REQUESTS*2)
+#define TD_LCACHE_MAX_REQ               (MAX_REQUESTS*3)
 #define TD_LCACHE_BUFSZ                 (MAX_SEGMENTS_PER_REQ * \
 					 sysconf(_SC_PAGE_SIZE))
+#define TD_LCACHE_BUFSECS               (TD_LCACHE_BUFSZ >> SECTOR_SHIFT)
+
+/*
+ * Stores and read-ahead run in the background, on buffers of their
+ * own: they hold no more than TD_LCACHE_MAX_BG, so reads always find
+ * one. Sequential runs of misses
+ * past TD_LCACHE_SCAN_SECS are scans, not worth a store; shorter ones
+ * read TD_LCACHE_PREFETCH buffers ahead, 0 for none.
+ */
+#define TD_LCACHE_MAX_BG                (MAX_REQUESTS*2)
+#define TD_LCACHE_STORE_DEPTH           8
+#define TD_LCACHE_SCAN_SECS             ((64 << 20) >> SECTOR_SHIFT)
+#define TD_LCACHE_PREFETCH              4
 
 
 typedef struct lcache                   td_lcache_t;
@@ -70,6 +84,10 @@ struct lcache_request {
 	struct td_iovec                 iov;
 
 	td_lcache_t                    *cache;
+	td_vbd_t                       *vbd;
+	int                             store;
+	int                             retries;
+	struct list_head                next;
 };
 
 struct lcache {
@@ -78,21 +96,85 @@ struct lcache {
 	td_lcache_req_t                 reqv[TD_LCACHE_MAX_REQ];
 	td_lcache_req_t                *free[TD_LCACHE_MAX_REQ];
 	int                             n_free;
+	int                             n_mapped;
 
 	char                           *buf;
 	size_t                          bufsz;
 
 	int                             wr_en;
 	struct timeval                  ts;
+
+	td_sector_t                     sectors;
+	td_vbd_t                       *vbd;
+
+	int                             n_bg;
+	int                             n_storing;
+	struct list_head                stores;
+
+	td_sector_t                     seq_next;
+	td_sector_t                     seq_secs;
+	td_sector_t                     pf_next;
+
+	struct {
+		unsigned long long      stored;
+		unsigned long long      skipped;
+		unsigned long long      scans;
+		unsigned long long      prefetched;
+		unsigned long long      uncached;
+		unsigned long long      misses;
+		unsigned long long      dropped;
+		unsigned long long      store_errors;
+	} stats;
 };
 
+/* Buffers are mapped on first use, see lcache_footprint(). */
+static int
+lcache_map_buffer(td_lcache_t *cache, td_lcache_req_t *req)
+{
+	int prot, flags;
+
+	prot  = PROT_READ|PROT_WRITE;
+	flags = MAP_ANONYMOUS|MAP_PRIVATE|MAP_LOCKED;
+
+	req->buf = mmap(NULL, TD_LCACHE_BUFSZ, prot, flags, -1, 0);
+	if (req->buf == MAP_FAILED) {
+		req->buf = NULL;
+		return -errno;
+	}
+
+	cache->n_mapped++;
+	return 0;
+}
+
+static void
+lcache_unmap_buffer(td_lcache_t *cache, td_lcache_req_t *req)
+{
+	if (req->buf) {
+		munmap(req->buf, TD_LCACHE_BUFSZ);
+		req->buf = NULL;
+		cache->n_mapped--;
+	}
+}
+
 static td_lcache_req_t *
 lcache_alloc_request(td_lcache_t *cache)
 {
 	td_lcache_req_t *req = NULL;
+	int err;
 
-	if (likely(cache->n_free))
-		req = cache->free[--cache->n_free];
+	if (likely(cache->n_free)) {
+		req = cache->free[cache->n_free - 1];
+
+		if (unlikely(!req->buf)) {
+			err = lcache_map_buffer(cache, req);
+			if (err) {
+				EPRINTF("Buffer map failure: %d", err);
+				return NULL;
+			}
+		}
+
+		cache->n_free--;
+	}
 
 	return req;
 }
@@ -104,53 +186,46 @@ lcache_free_request(td_lcache_t *cache, td_lcache_req_t *req)
 	cache->free[cache->n_free++] = req;
 }
 
+static void
+lcache_put_bg(td_lcache_t *cache, td_lcache_req_t *req)
+{
+	BUG_ON(!cache->n_bg);
+	cache->n_bg--;
+	lcache_free_request(cache, req);
+}
+
 static void
 lcache_destroy_buffers(td_lcache_t *cache)
 {
-	td_lcache_req_t *req;
+	int i;
 
-	do {
-		req = lcache_alloc_request(cache);
-		if (req)
-			munmap(req->buf, TD_LCACHE_BUFSZ);
-	} while (req);
+	for (i = 0; i < TD_LCACHE_MAX_REQ; i++)
+		lcache_unmap_buffer(cache, &cache->reqv[i]);
 }
 
-static int
+static void
 lcache_create_buffers(td_lcache_t *cache)
 {
-	int prot, flags, i, err;
+	int i;
 
-	prot  = PROT_READ|PROT_WRITE;
-	flags = MAP_ANONYMOUS|MAP_PRIVATE|MAP_LOCKED;
-
-	cache->n_free = 0;
-
-	for (i = 0; i < TD_LCACHE_MAX_REQ; i++) {
-		td_lcache_req_t *req = &cache->reqv[i];
-
-		req->buf = mmap(NULL, TD_LCACHE_BUFSZ, prot, flags, -1, 0);
-		if (req->buf == MAP_FAILED) {
-			req->buf = NULL;
-			err = -errno;
-			goto fail;
-		}
-
-		lcache_free_request(cache, req);
-	}
+	cache->n_free   = 0;
+	cache->n_mapped = 0;
 
-	return 0;
-
-fail:
-	EPRINTF("Buffer init failure: %d", err);
-	lcache_destroy_buffers(cache);
-	return err;
+	for (i = 0; i < TD_LCACHE_MAX_REQ; i++)
+		lcache_free_request(cache, &cache->reqv[i]);
 }
 
 static int
 lcache_close(td_driver_t *driver)
 {
 	td_lcache_t *cache = driver->data;
+	td_lcache_req_t *req, *tmp;
+
+	/* stores not yet issued; the vbd drained the rest */
+	list_for_each_entry_safe(req, tmp, &cache->stores, next) {
+		list_del(&req->next);
+		lcache_put_bg(cache, req);
+	}
 
 	lcache_destroy_buffers(cache);
 
@@ -165,13 +240,14 @@ lcache_open(td_driver_t *driver, const char *name, td_flag_t flags)
 	td_lcache_t *cache = driver->data;
 	int err;
 
+	INIT_LIST_HEAD(&cache->stores);
+	cache->sectors = driver->info.size;
+
 	err  = tapdisk_namedup(&cache->name, (char *)name);
 	if (err)
 		goto fail;
 
-	err = lcache_create_buffers(cache);
-	if (err)
-		goto fail;
+	lcache_create_buffers(cache);
 
 	timerclear(&cache->ts);
 	cache->wr_en = 1;
@@ -237,6 +313,8 @@ lcache_wr_enabled(td_lcache_t *cache)
 	return cache->wr_en;
 }
 
+static void lcache_kick_stores(td_lcache_t *);
+
 static void
 __lcache_write_cb(td_vbd_request_t *vreq, int error,
 		  void *token, int final)
@@ -246,10 +324,21 @@ __lcache_write_cb(td_vbd_request_t *vreq, int error,
 
 	if (error == -ENOSPC)
 		cache->wr_en = 0;
+	if (error)
+		cache->stats.store_errors += req->treq.secs;
 
-	lcache_free_request(cache, req);
+	cache->n_storing--;
+	lcache_put_bg(cache, req);
+	lcache_kick_stores(cache);
 }
 
+/*
+ * Reads are stored through the vbd, into the leaf: a VHD on local
+ * storage, above this driver. They persist with the BAT, bitmaps and
+ * batmap of that VHD, so a cache reopened after a restart or back on
+ * the same host is as warm as it was left, without a map of our own.
+ * Only what the leaf doesn't hold ever reaches us, or the SR.
+ */
 static void
 lcache_store_read(td_lcache_t *cache, td_lcache_req_t *req)
 {
@@ -263,6 +352,7 @@ lcache_store_read(td_lcache_t *cache, td_lcache_req_t *req)
 	iov->secs    = req->treq.secs;
 
 	vreq         = &req->vreq;
+	memset(vreq, 0, sizeof(*vreq));
 	vreq->op     = TD_OP_WRITE;
 	vreq->sec    = req->treq.sec;
 	vreq->iov    = iov;
@@ -270,12 +360,58 @@ lcache_store_read(td_lcache_t *cache, td_lcache_req_t *req)
 	vreq->cb     = __lcache_write_cb;
 	vreq->token  = cache;
 
-	vbd = req->treq.vreq->vbd;
+	vbd = req->vbd;
 
 	err = tapdisk_vbd_queue_request(vbd, vreq);
 	BUG_ON(err);
 }
 
+/*
+ * A store lands after the guest may have written the same sectors to
+ * the leaf, so only go ahead where the leaf still holds nothing.
+ * Leaves which can't tell are stored to, as they always were. Blocks
+ * still being allocated by an earlier store look taken, so a store
+ * refused while others are in flight waits on some of them.
+ */
+static int
+lcache_store_safe(td_lcache_req_t *req)
+{
+	td_image_t *leaf = tapdisk_vbd_first_image(req->vbd);
+	int err;
+
+	err = td_allocated(leaf, req->treq.sec, req->treq.secs);
+
+	return !err || err == -EOPNOTSUPP;
+}
+
+static void
+lcache_kick_stores(td_lcache_t *cache)
+{
+	td_lcache_req_t *req;
+
+	while (cache->n_storing < TD_LCACHE_STORE_DEPTH &&
+	       !list_empty(&cache->stores)) {
+		req = list_entry(cache->stores.next, td_lcache_req_t, next);
+		list_del(&req->next);
+
+		if (!lcache_store_safe(req)) {
+			if (req->retries++ < TD_LCACHE_STORE_DEPTH &&
+			    cache->n_storing) {
+				list_add(&req->next, &cache->stores);
+				break;
+			}
+
+			cache->stats.skipped += req->treq.secs;
+			lcache_put_bg(cache, req);
+			continue;
+		}
+
+		cache->stats.stored += req->treq.secs;
+		cache->n_storing++;
+		lcache_store_read(cache, req);
+	}
+}
+
 static void
 lcache_complete_read(td_lcache_t *cache, td_lcache_req_t *req)
 {
@@ -286,12 +422,101 @@ lcache_complete_read(td_lcache_t *cache, td_lcache_req_t *req)
 
 	td_complete_request(req->treq, req->err);
 
-	if (unlikely(req->err) || !lcache_wr_enabled(cache)) {
+	if (unlikely(req->err) || !req->store ||
+	    cache->n_bg >= TD_LCACHE_MAX_BG || !lcache_wr_enabled(cache)) {
+		if (req->store)
+			cache->stats.dropped += req->treq.secs;
 		lcache_free_request(cache, req);
 		return;
 	}
 
-	lcache_store_read(cache, req);
+	/* hand the buffer over to the store queue */
+	cache->n_bg++;
+	list_add_tail(&req->next, &cache->stores);
+	lcache_kick_stores(cache);
+}
+
+static void
+__lcache_prefetch_cb(td_vbd_request_t *vreq, int error,
+		     void *token, int final)
+{
+	td_lcache_req_t *req = containerof(vreq, td_lcache_req_t, vreq);
+	td_lcache_t *cache = token;
+
+	/* what the leaf lacked was stored on the way */
+	lcache_put_bg(cache, req);
+}
+
+/*
+ * read ahead of a sequential run, through the vbd: the leaf answers
+ * what it holds, and the misses come back here to be stored
+ */
+static void
+lcache_prefetch(td_lcache_t *cache, td_vbd_t *vbd)
+{
+	td_vbd_request_t *vreq;
+	td_lcache_req_t *req;
+	td_sector_t end;
+	int secs, err;
+
+	end = MIN(cache->seq_next + TD_LCACHE_PREFETCH * TD_LCACHE_BUFSECS,
+		  cache->sectors);
+
+	if (cache->pf_next < cache->seq_next || cache->pf_next > end)
+		cache->pf_next = cache->seq_next;
+
+	/* stores come first */
+	while (cache->pf_next < end && cache->n_bg < TD_LCACHE_MAX_BG / 2) {
+		req = lcache_alloc_request(cache);
+		if (!req)
+			break;
+
+		secs            = MIN(TD_LCACHE_BUFSECS, end - cache->pf_next);
+		req->cache      = cache;
+		req->vbd        = vbd;
+		req->iov.base   = req->buf;
+		req->iov.secs   = secs;
+
+		vreq            = &req->vreq;
+		memset(vreq, 0, sizeof(*vreq));
+		vreq->op        = TD_OP_READ;
+		vreq->sec       = cache->pf_next;
+		vreq->iov       = &req->iov;
+		vreq->iovcnt    = 1;
+		vreq->cb        = __lcache_prefetch_cb;
+		vreq->token     = cache;
+
+		cache->n_bg++;
+		cache->pf_next          += secs;
+		cache->stats.prefetched += secs;
+
+		err = tapdisk_vbd_queue_request(vbd, vreq);
+		BUG_ON(err);
+	}
+}
+
+/*
+ * whether to store a miss: not when part of a long sequential run,
+ * which would only ever be read once
+ */
+static int
+lcache_admit(td_lcache_t *cache, td_request_t treq)
+{
+	if (treq.sec == cache->seq_next)
+		cache->seq_secs += treq.secs;
+	else
+		cache->seq_secs  = treq.secs;
+	cache->seq_next = treq.sec + treq.secs;
+
+	if (cache->seq_secs > TD_LCACHE_SCAN_SECS) {
+		cache->stats.scans += treq.secs;
+		return 0;
+	}
+
+	if (TD_LCACHE_PREFETCH && cache->seq_secs > treq.secs)
+		lcache_prefetch(cache, treq.vreq->vbd);
+
+	return 1;
 }
 
 static void
@@ -314,15 +539,35 @@ lcache_queue_read(td_driver_t *driver, td_request_t treq)
 	td_lcache_t *cache = driver->data;
 	td_request_t clone;
 	td_lcache_req_t *req;
+	int store;
+
+	/* indirect requests may outgrow the bounce buffers */
+	if (treq.secs << SECTOR_SHIFT > TD_LCACHE_BUFSZ) {
+		td_forward_request(treq);
+		return;
+	}
+
+	/* our own read-ahead is stored, but never reads ahead */
+	if (treq.vreq->cb == __lcache_prefetch_cb)
+		store = 1;
+	else {
+		cache->vbd           = treq.vreq->vbd;
+		cache->stats.misses += treq.secs;
+		store = lcache_admit(cache, treq);
+	}
 
 	req = lcache_alloc_request(cache);
 	if (!req) {
-		td_complete_request(treq, -EBUSY);
+		cache->stats.uncached += treq.secs;
+		td_forward_request(treq);
 		return;
 	}
 
 	req->treq    = treq;
 	req->cache   = cache;
+	req->vbd     = treq.vreq->vbd;
+	req->store   = store;
+	req->retries = 0;
 
 	req->secs    = req->treq.secs;
 	req->err     = 0;
@@ -351,6 +596,70 @@ lcache_validate_parent(td_driver_t *driver,
 	return 0;
 }
 
+static void
+lcache_debug(td_driver_t *driver)
+{
+	td_lcache_t *cache = driver->data;
+
+	INFO("LOCAL CACHE %s: free: %d, background: %d, storing: %d, "
+	     "stored: %llu, skipped: %llu, scans: %llu, prefetched: %llu, "
+	     "uncached: %llu\n", cache->name, cache->n_free, cache->n_bg,
+	     cache->n_storing, cache->stats.stored, cache->stats.skipped,
+	     cache->stats.scans, cache->stats.prefetched,
+	     cache->stats.uncached);
+}
+
+/*
+ * Hits never get here: the leaf answers them, and counts them with
+ * its own image stats. Nor does anything get evicted, the leaf only
+ * grows.
+ */
+static void
+lcache_stats(td_driver_t *driver, td_stats_t *st)
+{
+	td_lcache_t *cache = driver->data;
+	unsigned long long hits = 0;
+	td_image_t *leaf;
+
+	if (cache->vbd) {
+		leaf = tapdisk_vbd_first_image(cache->vbd);
+		if (leaf)
+			hits = leaf->stats.hits.rd;
+	}
+
+	tapdisk_stats_field(st, "hits", "llu", hits);
+	tapdisk_stats_field(st, "misses", "llu", cache->stats.misses);
+	tapdisk_stats_field(st, "bytes_served", "llu", hits << SECTOR_SHIFT);
+	tapdisk_stats_field(st, "stored", "llu", cache->stats.stored);
+	tapdisk_stats_field(st, "prefetched", "llu", cache->stats.prefetched);
+	tapdisk_stats_field(st, "scans", "llu", cache->stats.scans);
+	tapdisk_stats_field(st, "fill_failures", "llu",
+			    cache->stats.skipped + cache->stats.uncached +
+			    cache->stats.dropped + cache->stats.store_errors);
+	tapdisk_stats_field(st, "skipped", "llu", cache->stats.skipped);
+	tapdisk_stats_field(st, "uncached", "llu", cache->stats.uncached);
+	tapdisk_stats_field(st, "dropped", "llu", cache->stats.dropped);
+	tapdisk_stats_field(st, "store_errors", "llu",
+			    cache->stats.store_errors);
+	tapdisk_stats_field(st, "writes", "d", cache->wr_en);
+	tapdisk_stats_field(st, "storing", "d", cache->n_storing);
+	tapdisk_stats_field(st, "buffers", "d", cache->n_mapped);
+}
+
+static int
+lcache_footprint(td_driver_t *driver, int trim, uint64_t *bytes)
+{
+	td_lcache_t *cache = driver->data;
+	int i;
+
+	if (trim)
+		for (i = 0; i < cache->n_free; i++)
+			lcache_unmap_buffer(cache, cache->free[i]);
+
+	*bytes = (uint64_t)cache->n_mapped * TD_LCACHE_BUFSZ;
+	return 0;
+}
+
 struct tap_disk tapdisk_lcache = {
 	.disk_type                  = "tapdisk_lcache",
 	.flags                      = 0,
@@ -360,4 +669,7 @@ struct tap_disk tapdisk_lcache = {
 	.td_queue_read              = lcache_queue_read,
 	.td_get_parent_id           = lcache_get_parent_id,
 	.td_validate_parent         = lcache_validate_parent,
+	.td_debug                   = lcache_debug,
+	.td_stats                   = lcache_stats,
+	.td_footprint               = lcache_footprint,
 };
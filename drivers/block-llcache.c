@@ -20,9 +20,15 @@
 #endif
 
 #include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
 
+#include "libvhd.h"
 #include "tapdisk.h"
 #include "tapdisk-vbd.h"
+#include "tapdisk-server.h"
 #include "tapdisk-driver.h"
 #include "tapdisk-interface.h"
 #include "tapdisk-disktype.h"
@@ -53,6 +59,111 @@ void ll_log_switch(int type, int error,
 	     tapdisk_disk_types[shared->type]->name, shared->name);
 }
 
+/*
+ * Reads are counted by who answered them: a hit is any part coming
+ * back from the image caching it, a miss any part coming from further
+ * down the chain. Reads are wrapped for that, so the vbd still sees
+ * each part complete from where it came.
+ */
+typedef struct llcache_reads            td_llcache_reads_t;
+typedef struct llcache_read             td_llcache_read_t;
+#define TD_LLCACHE_MAX_READ             (MAX_REQUESTS*2)
+
+struct llcache_read {
+	td_request_t            treq;
+	td_image_t             *cache;
+	int                     pending;
+	td_llcache_reads_t     *reads;
+};
+
+struct llcache_reads {
+	td_llcache_read_t       reqv[TD_LLCACHE_MAX_READ];
+	td_llcache_read_t      *free[TD_LLCACHE_MAX_READ];
+	int                     n_free;
+
+	struct {
+		unsigned long long hits;
+		unsigned long long misses;
+		unsigned long long uncounted;
+	} stats;
+};
+
+static void
+ll_reads_init(td_llcache_reads_t *r)
+{
+	int i;
+
+	r->n_free = 0;
+	for (i = 0; i < TD_LLCACHE_MAX_READ; i++)
+		r->free[r->n_free++] = &r->reqv[i];
+}
+
+static void
+__ll_read_cb(td_request_t treq, int error)
+{
+	td_llcache_read_t *rd = treq.cb_data;
+	td_llcache_reads_t *r = rd->reads;
+
+	if (treq.image == rd->cache)
+		r->stats.hits += treq.secs;
+	else
+		r->stats.misses += treq.secs;
+
+	BUG_ON(rd->pending < treq.secs);
+	rd->pending  -= treq.secs;
+
+	treq.cb       = rd->treq.cb;
+	treq.cb_data  = rd->treq.cb_data;
+
+	if (!rd->pending)
+		r->free[r->n_free++] = rd;
+
+	td_complete_request(treq, error);
+}
+
+/*
+ * Issue a read to @local, a driver image of our own, or else forward
+ * it to the caching image next in the chain.
+ */
+static void
+ll_queue_read(td_llcache_reads_t *r, td_image_t *local, td_request_t treq)
+{
+	td_llcache_read_t *rd;
+	td_request_t clone;
+
+	if (unlikely(!r->n_free)) {
+		r->stats.uncounted += treq.secs;
+		goto issue;
+	}
+
+	rd            = r->free[--r->n_free];
+	rd->treq      = treq;
+	rd->cache     = local ? treq.image : tapdisk_vbd_next_image(treq.image);
+	rd->pending   = treq.secs;
+	rd->reads     = r;
+
+	clone         = treq;
+	clone.cb      = __ll_read_cb;
+	clone.cb_data = rd;
+	treq          = clone;
+
+issue:
+	if (local)
+		td_queue_read(local, treq);
+	else
+		td_forward_request(treq);
+}
+
+static void
+ll_reads_stats(td_llcache_reads_t *r, td_stats_t *st)
+{
+	tapdisk_stats_field(st, "hits", "llu", r->stats.hits);
+	tapdisk_stats_field(st, "misses", "llu", r->stats.misses);
+	tapdisk_stats_field(st, "bytes_served", "llu",
+			    r->stats.hits << SECTOR_SHIFT);
+	tapdisk_stats_field(st, "uncounted", "llu", r->stats.uncounted);
+}
+
 /*
  * LLP: Local leaf persistent cache
  *      -- Persistent write caching in local storage.
@@ -128,6 +239,7 @@ struct llpcache_request {
 struct llpcache {
 	td_image_t             *local;
 	int                     mode;
+	td_llcache_reads_t      reads;
 
 	td_llpcache_req_t       reqv[TD_LLPCACHE_MAX_REQ];
 	td_llpcache_req_t      *free[TD_LLPCACHE_MAX_REQ];
@@ -242,7 +354,7 @@ llpcache_fork_write(td_llpcache_t *s, td_request_t treq)
 		return;
 	}
 
-	memset(req, 0, sizeof(req));
+	memset(req, 0, sizeof(*req));
 
 	req->treq     = treq;
 
@@ -305,10 +417,12 @@ llpcache_queue_read(td_driver_t *driver, td_request_t treq)
 
 	switch (s->mode) {
 	case LLP_MIRROR:
-		td_queue_read(s->local, treq);
+		ll_queue_read(&s->reads, s->local, treq);
 		break;
 	case LLP_SHARED:
+		s->reads.stats.misses += treq.secs;
 		td_forward_request(treq);
+		break;
 	default:
 		BUG();
 	}
@@ -334,6 +448,7 @@ llpcache_open(td_driver_t *driver, const char *name, td_flag_t flags)
 	int i, err;
 
 	s->mode = LLP_MIRROR;
+	ll_reads_init(&s->reads);
 
 	for (i = 0; i < TD_LLPCACHE_MAX_REQ; i++)
 		llpcache_free_request(s, &s->reqv[i]);
@@ -351,6 +466,16 @@ fail:
 	return err;
 }
 
+static void
+llpcache_stats(td_driver_t *driver, td_stats_t *st)
+{
+	td_llpcache_t *s = driver->data;
+
+	tapdisk_stats_field(st, "mode", "s",
+			    s->mode == LLP_MIRROR ? "mirror" : "shared");
+	ll_reads_stats(&s->reads, st);
+}
+
 static int
 llcache_get_parent_id(td_driver_t *driver, td_disk_id_t *id)
 {
@@ -382,6 +507,7 @@ struct tap_disk tapdisk_llpcache = {
 	.td_queue_write             = llpcache_queue_write,
 	.td_get_parent_id           = llcache_get_parent_id,
 	.td_validate_parent         = llcache_validate_parent,
+	.td_stats                   = llpcache_stats,
 };
 
 /*
@@ -442,6 +568,7 @@ struct llecache_request {
 struct llecache {
 	td_image_t             *shared;
 	int                     mode;
+	td_llcache_reads_t      reads;
 
 	td_llecache_req_t       reqv[TD_LLECACHE_MAX_REQ];
 	td_llecache_req_t      *free[TD_LLECACHE_MAX_REQ];
@@ -486,6 +613,7 @@ llecache_open(td_driver_t *driver, const char *name, td_flag_t flags)
 	int i, err;
 
 	s->mode = LLE_LOCAL;
+	ll_reads_init(&s->reads);
 
 	for (i = 0; i < TD_LLECACHE_MAX_REQ; i++)
 		llecache_free_request(s, &s->reqv[i]);
@@ -542,7 +670,7 @@ llecache_forward_write(td_llecache_t *s, td_request_t treq)
 		return;
 	}
 
-	memset(req, 0, sizeof(req));
+	memset(req, 0, sizeof(*req));
 
 	req->treq       = treq;
 	req->pending    = treq.secs;
@@ -577,9 +705,10 @@ llecache_queue_read(td_driver_t *driver, td_request_t treq)
 
 	switch (s->mode) {
 	case LLE_LOCAL:
-		td_forward_request(treq);
+		ll_queue_read(&s->reads, NULL, treq);
 		break;
 	case LLE_SHARED:
+		s->reads.stats.misses += treq.secs;
 		td_queue_read(s->shared, treq);
 		break;
 	default:
@@ -587,6 +716,16 @@ llecache_queue_read(td_driver_t *driver, td_request_t treq)
 	}
 }
 
+static void
+llecache_stats(td_driver_t *driver, td_stats_t *st)
+{
+	td_llecache_t *s = driver->data;
+
+	tapdisk_stats_field(st, "mode", "s",
+			    s->mode == LLE_LOCAL ? "local" : "shared");
+	ll_reads_stats(&s->reads, st);
+}
+
 struct tap_disk tapdisk_llecache = {
 	.disk_type                  = "tapdisk_llecache",
 	.flags                      = 0,
@@ -597,4 +736,826 @@ struct tap_disk tapdisk_llecache = {
 	.td_queue_write             = llecache_queue_write,
 	.td_get_parent_id           = llcache_get_parent_id,
 	.td_validate_parent         = llcache_validate_parent,
+	.td_stats                   = llecache_stats,
+};
+
+/*
+ * LLW: Local leaf write-back cache
+ *      -- Write caching in local storage, destaged to shared storage.
+ *
+ *    VBD
+ *      \
+ *       +--r/w--> llw+vhd:/local/leaf
+ *        \
+ *         +--r/w--> vhd:/shared/leaf
+ *          \
+ *           +--r/o--> vhd:/shared/parent
+ *
+ * Same chain as LLP. But writes complete once on LOCAL, which holds
+ * the only copy until destaged to SHARED in the background. SHARED
+ * alone is consistent only after a drain: quiescing the vbd, hence
+ * any pause, waits for every dirty sector to reach SHARED.
+ *
+ * Dirty sectors are tracked in memory only. A marker file next to
+ * LOCAL (<local>.llw) exists while it may hold sectors SHARED
+ * lacks. Found at open, whatever LOCAL holds is destaged again.
+ */
+enum {
+	LLW_WRITEBACK = 1,
+	/*
+	 * LLW_WRITEBACK:
+	 *
+	 * Writes are issued to LOCAL only, then marked dirty. Reads
+	 * are issued to LOCAL.
+	 *
+	 * Dirty sectors are copied to SHARED in ascending order,
+	 * adjacent ones in a single request, a sweep being started
+	 * every TD_LLW_DESTAGE_INTERVAL. Writers are held while more
+	 * than TD_LLW_DIRTY_RATIO percent of the disk is dirty.
+	 *
+	 * Failure to write LOCAL for lack of space is recoverable.
+	 * The driver holds writes until all dirty sectors are
+	 * destaged and transitions to LLW_SHARED.
+	 *
+	 * Failure to write SHARED leaves sectors dirty, to be
+	 * retried with the next sweep.
+	 */
+
+	LLW_SHARED = 2,
+	/*
+	 * LLW_SHARED:
+	 *
+	 * Writes are issued to SHARED only. As are reads. As with
+	 * LLP, LOCAL is stale from there on.
+	 *
+	 * Failure to write SHARED is irrecoverable.
+	 */
+};
+
+typedef struct llwcache                 td_llwcache_t;
+typedef struct llwcache_request         td_llwcache_req_t;
+typedef struct llwcache_destage         td_llwcache_destage_t;
+typedef struct llwcache_chunk           td_llwcache_chunk_t;
+#define TD_LLWCACHE_MAX_REQ             (MAX_REQUESTS*2)
+
+#define TD_LLW_CHUNK_SHIFT              12      /* 2MB of dirty bits */
+#define TD_LLW_CHUNK_SECS               (1 << TD_LLW_CHUNK_SHIFT)
+#define TD_LLW_DIRTY_RATIO              10      /* percent */
+#define TD_LLW_DESTAGE_SECS             1024
+#define TD_LLW_DESTAGE_DEPTH            4
+#define TD_LLW_DESTAGE_INTERVAL         1       /* seconds */
+#define TD_LLW_MARKER                   ".llw"
+
+struct llwcache_request {
+	td_llwcache_t          *s;
+	td_request_t            treq;
+	int                     pending;
+	int                     error;
+	struct list_head        entry;
+};
+
+struct llwcache_destage {
+	td_llwcache_t          *s;
+	td_vbd_request_t        vreq;
+	char                   *buf;
+
+	td_sector_t             sec;
+	int                     secs;
+	int                     pending;
+	int                     error;
+};
+
+struct llwcache_chunk {
+	int                     dirty;
+	char                    map[TD_LLW_CHUNK_SECS >> 3];
+};
+
+struct llwcache {
+	td_image_t             *local;
+	td_image_t             *image;
+	td_vbd_t               *vbd;
+	int                     mode;
+	int                     error;
+	char                   *marker;
+
+	td_llwcache_chunk_t   **chunks;
+	uint64_t                n_chunks;
+	uint64_t                dirty;
+	uint64_t                dirty_max;
+
+	td_sector_t             cursor;
+	int                     sweep;
+	int                     n_writing;
+	int                     n_destaging;
+	event_id_t              timer;
+
+	struct list_head        held;
+	td_llcache_reads_t      reads;
+
+	td_llwcache_destage_t   destage[TD_LLW_DESTAGE_DEPTH];
+
+	td_llwcache_req_t       reqv[TD_LLWCACHE_MAX_REQ];
+	td_llwcache_req_t      *free[TD_LLWCACHE_MAX_REQ];
+	int                     n_free;
+
+	struct {
+		unsigned long long destaged;
+		unsigned long long held;
+		unsigned long long errors;
+	} stats;
+};
+
+static td_llwcache_req_t *
+llwcache_alloc_request(td_llwcache_t *s)
+{
+	td_llwcache_req_t *req = NULL;
+
+	if (likely(s->n_free))
+		req = s->free[--s->n_free];
+
+	return req;
+}
+
+static void
+llwcache_free_request(td_llwcache_t *s, td_llwcache_req_t *req)
+{
+	BUG_ON(s->n_free >= TD_LLWCACHE_MAX_REQ);
+	s->free[s->n_free++] = req;
+}
+
+static void
+llwcache_mark(td_llwcache_t *s, td_sector_t sec, int secs)
+{
+	td_llwcache_chunk_t *chunk;
+	uint64_t idx;
+	int bit;
+
+	for (; secs > 0; sec++, secs--) {
+		idx   = sec >> TD_LLW_CHUNK_SHIFT;
+		bit   = sec & (TD_LLW_CHUNK_SECS - 1);
+		chunk = s->chunks[idx];
+
+		if (!chunk) {
+			chunk = calloc(1, sizeof(*chunk));
+			if (!chunk) {
+				/* no way to remember; sync now rather */
+				WARN("no memory, sector %llu stays on LOCAL ",
+				     (unsigned long long)sec);
+				continue;
+			}
+			s->chunks[idx] = chunk;
+		}
+
+		if (test_bit(chunk->map, bit))
+			continue;
+
+		set_bit(chunk->map, bit);
+		chunk->dirty++;
+		s->dirty++;
+	}
+}
+
+static void
+llwcache_unmark(td_llwcache_t *s, td_sector_t sec, int secs)
+{
+	td_llwcache_chunk_t *chunk;
+	uint64_t idx;
+	int bit;
+
+	for (; secs > 0; sec++, secs--) {
+		idx   = sec >> TD_LLW_CHUNK_SHIFT;
+		bit   = sec & (TD_LLW_CHUNK_SECS - 1);
+		chunk = s->chunks[idx];
+
+		if (!chunk || !test_bit(chunk->map, bit))
+			continue;
+
+		clear_bit(chunk->map, bit);
+		s->dirty--;
+
+		if (!--chunk->dirty) {
+			free(chunk);
+			s->chunks[idx] = NULL;
+		}
+	}
+}
+
+static int
+llwcache_destaging(td_llwcache_t *s, td_sector_t sec, int secs)
+{
+	td_llwcache_destage_t *d;
+	int i;
+
+	for (i = 0; i < TD_LLW_DESTAGE_DEPTH; i++) {
+		d = &s->destage[i];
+		if (d->pending &&
+		    sec < d->sec + d->secs && d->sec < sec + secs)
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Next run of dirty sectors at or past the cursor, within a chunk.
+ * Runs overlapping a destage in flight wait for it, or SHARED might
+ * see the older data written last.
+ */
+static int
+llwcache_find_run(td_llwcache_t *s, td_sector_t *_sec, int *_secs)
+{
+	td_llwcache_chunk_t *chunk;
+	uint64_t idx;
+	int bit, end, secs;
+
+	for (idx = s->cursor >> TD_LLW_CHUNK_SHIFT; idx < s->n_chunks; idx++) {
+		chunk = s->chunks[idx];
+		if (!chunk)
+			continue;
+
+		bit = 0;
+		if (idx == s->cursor >> TD_LLW_CHUNK_SHIFT)
+			bit = s->cursor & (TD_LLW_CHUNK_SECS - 1);
+
+		while (bit < TD_LLW_CHUNK_SECS && !chunk->map[bit >> 3])
+			bit = (bit | 7) + 1;
+		while (bit < TD_LLW_CHUNK_SECS && !test_bit(chunk->map, bit))
+			bit++;
+		if (bit >= TD_LLW_CHUNK_SECS)
+			continue;
+
+		end = bit;
+		while (end < TD_LLW_CHUNK_SECS &&
+		       end - bit < TD_LLW_DESTAGE_SECS &&
+		       test_bit(chunk->map, end))
+			end++;
+
+		*_sec  = (idx << TD_LLW_CHUNK_SHIFT) + bit;
+		*_secs = secs = end - bit;
+
+		if (llwcache_destaging(s, *_sec, secs))
+			return -EBUSY;
+
+		return 0;
+	}
+
+	return -ENOENT;
+}
+
+static void llwcache_kick(td_llwcache_t *);
+
+static void
+llwcache_destage_done(td_llwcache_t *s, td_llwcache_destage_t *d)
+{
+	s->n_destaging--;
+
+	if (d->error) {
+		if (!s->stats.errors++)
+			WARN("destaging %d sectors at %llu: %d ", d->secs,
+			     (unsigned long long)d->sec, d->error);
+		llwcache_mark(s, d->sec, d->secs);
+		/* retry with the next sweep */
+		s->sweep = 0;
+	} else
+		s->stats.destaged += d->secs;
+
+	llwcache_kick(s);
+}
+
+static void
+__llwcache_destage_write_cb(td_request_t treq, int error)
+{
+	td_llwcache_destage_t *d = treq.cb_data;
+
+	BUG_ON(d->pending < treq.secs);
+
+	d->pending -= treq.secs;
+	d->error    = d->error ? : error;
+
+	if (!d->pending)
+		llwcache_destage_done(d->s, d);
+}
+
+static void
+__llwcache_destage_read_cb(td_request_t treq, int error)
+{
+	td_llwcache_destage_t *d = treq.cb_data;
+	td_llwcache_t *s = d->s;
+	td_image_t *shared;
+
+	BUG_ON(d->pending < treq.secs);
+
+	d->pending -= treq.secs;
+	d->error    = d->error ? : error;
+
+	if (d->pending)
+		return;
+
+	if (d->error) {
+		llwcache_destage_done(s, d);
+		return;
+	}
+
+	shared        = tapdisk_vbd_next_image(s->image);
+
+	treq.op       = TD_OP_WRITE;
+	treq.buf      = d->buf;
+	treq.sec      = d->sec;
+	treq.secs     = d->secs;
+	treq.image    = shared;
+	treq.cb       = __llwcache_destage_write_cb;
+	treq.cb_data  = d;
+	treq.sidx     = 0;
+	treq.vreq     = &d->vreq;
+
+	d->pending    = d->secs;
+
+	td_queue_write(shared, treq);
+}
+
+static void
+llwcache_destage(td_llwcache_t *s, td_llwcache_destage_t *d)
+{
+	td_request_t treq;
+
+	llwcache_unmark(s, d->sec, d->secs);
+	s->cursor     = d->sec + d->secs;
+	s->n_destaging++;
+
+	d->vreq.vbd   = s->vbd;
+	d->pending    = d->secs;
+	d->error      = 0;
+
+	/* all dirty, so LOCAL won't forward */
+	memset(&treq, 0, sizeof(treq));
+	treq.op       = TD_OP_READ;
+	treq.buf      = d->buf;
+	treq.sec      = d->sec;
+	treq.secs     = d->secs;
+	treq.image    = s->image;
+	treq.cb       = __llwcache_destage_read_cb;
+	treq.cb_data  = d;
+	treq.vreq     = &d->vreq;
+
+	td_queue_read(s->local, treq);
+}
+
+static void
+llwcache_write_local(td_llwcache_t *s, td_llwcache_req_t *req);
+
+static void
+llwcache_release(td_llwcache_t *s)
+{
+	td_llwcache_req_t *req;
+
+	if (s->error) {
+		/* switch once LOCAL holds nothing SHARED lacks */
+		if (s->dirty || s->n_destaging || s->n_writing)
+			return;
+
+		if (s->mode != LLW_SHARED) {
+			s->mode = LLW_SHARED;
+			unlink(s->marker);
+		}
+
+		while (!list_empty(&s->held)) {
+			req = list_entry(s->held.next, td_llwcache_req_t, entry);
+			list_del(&req->entry);
+			td_forward_request(req->treq);
+			llwcache_free_request(s, req);
+		}
+
+		return;
+	}
+
+	while (!list_empty(&s->held) && s->dirty < s->dirty_max) {
+		req = list_entry(s->held.next, td_llwcache_req_t, entry);
+		list_del(&req->entry);
+		llwcache_write_local(s, req);
+	}
+}
+
+static void
+llwcache_kick(td_llwcache_t *s)
+{
+	td_llwcache_destage_t *d;
+	int i, err, wrapped;
+
+	if (!s->image)
+		return;
+
+	if (s->error || !list_empty(&s->held))
+		s->sweep = 1;
+
+	wrapped = 0;
+
+	for (i = 0; s->sweep && i < TD_LLW_DESTAGE_DEPTH; i++) {
+		d = &s->destage[i];
+		if (d->pending)
+			continue;
+
+		err = llwcache_find_run(s, &d->sec, &d->secs);
+		if (err == -ENOENT && !wrapped && s->cursor) {
+			s->cursor = 0;
+			wrapped   = 1;
+			err = llwcache_find_run(s, &d->sec, &d->secs);
+		}
+
+		if (err == -ENOENT && !s->n_destaging)
+			s->sweep = 0;
+		if (err)
+			break;
+
+		llwcache_destage(s, d);
+	}
+
+	llwcache_release(s);
+}
+
+static void
+llwcache_timer(event_id_t id, char mode, void *private)
+{
+	td_llwcache_t *s = private;
+
+	if (s->dirty && !s->sweep) {
+		s->sweep = 1;
+		llwcache_kick(s);
+	}
+}
+
+static void
+llwcache_track(td_llwcache_t *s, td_request_t treq)
+{
+	if (unlikely(!s->image)) {
+		s->image = treq.image;
+		s->vbd   = treq.vreq->vbd;
+		llwcache_timer(0, 0, s);
+	}
+}
+
+static void
+__llwcache_write_cb(td_request_t treq, int error)
+{
+	td_llwcache_req_t *req = treq.cb_data;
+	td_llwcache_t *s = req->s;
+
+	BUG_ON(req->pending < treq.secs);
+
+	req->pending -= treq.secs;
+	req->error    = req->error ? : error;
+
+	if (req->pending)
+		return;
+
+	s->n_writing--;
+
+	if (req->error == -ENOSPC) {
+		if (!s->error)
+			ll_log_switch(DISK_TYPE_LLWCACHE, req->error,
+				      s->local,
+				      tapdisk_vbd_next_image(s->image));
+		s->error = req->error;
+		list_add(&req->entry, &s->held);
+		llwcache_kick(s);
+		return;
+	}
+
+	if (!req->error)
+		llwcache_mark(s, req->treq.sec, req->treq.secs);
+
+	td_complete_request(req->treq, req->error);
+	llwcache_free_request(s, req);
+
+	if (s->error)
+		llwcache_release(s);
+}
+
+static void
+llwcache_write_local(td_llwcache_t *s, td_llwcache_req_t *req)
+{
+	td_request_t clone;
+
+	req->pending    = req->treq.secs;
+	req->error      = 0;
+
+	clone           = req->treq;
+	clone.cb        = __llwcache_write_cb;
+	clone.cb_data   = req;
+
+	s->n_writing++;
+	td_queue_write(s->local, clone);
+}
+
+static void
+llwcache_queue_write(td_driver_t *driver, td_request_t treq)
+{
+	td_llwcache_t *s = driver->data;
+	td_llwcache_req_t *req;
+
+	llwcache_track(s, treq);
+
+	if (s->mode == LLW_SHARED) {
+		td_forward_request(treq);
+		return;
+	}
+
+	req = llwcache_alloc_request(s);
+	if (!req) {
+		td_complete_request(treq, -EBUSY);
+		return;
+	}
+
+	memset(req, 0, sizeof(*req));
+	req->s    = s;
+	req->treq = treq;
+
+	if (s->error || !list_empty(&s->held) || s->dirty >= s->dirty_max) {
+		list_add_tail(&req->entry, &s->held);
+		s->stats.held++;
+		llwcache_kick(s);
+		return;
+	}
+
+	llwcache_write_local(s, req);
+}
+
+static void
+llwcache_queue_read(td_driver_t *driver, td_request_t treq)
+{
+	td_llwcache_t *s = driver->data;
+
+	llwcache_track(s, treq);
+
+	switch (s->mode) {
+	case LLW_WRITEBACK:
+		ll_queue_read(&s->reads, s->local, treq);
+		break;
+	case LLW_SHARED:
+		s->reads.stats.misses += treq.secs;
+		td_forward_request(treq);
+		break;
+	default:
+		BUG();
+	}
+}
+
+static int
+llwcache_drain(td_driver_t *driver)
+{
+	td_llwcache_t *s = driver->data;
+
+	if (s->mode == LLW_SHARED)
+		return 0;
+
+	if (!s->dirty && !s->n_destaging && list_empty(&s->held))
+		return 0;
+
+	if (!s->image) {
+		/* never saw SHARED, the marker stays */
+		WARN("%llu sectors left to destage on %s ",
+		     (unsigned long long)s->dirty, s->local->name);
+		return 0;
+	}
+
+	s->sweep = 1;
+	llwcache_kick(s);
+
+	return -EAGAIN;
+}
+
+static int
+llwcache_sync(td_driver_t *driver)
+{
+	td_llwcache_t *s = driver->data;
+	td_driver_t *local = s->local->driver;
+
+	return local->ops->td_sync ? local->ops->td_sync(local) : 0;
+}
+
+/*
+ * Whatever LOCAL holds may be newer than SHARED.
+ */
+static int
+llwcache_recover(td_llwcache_t *s, const char *name)
+{
+	vhd_context_t vhd;
+	uint32_t blk, i;
+	char *map;
+	int err;
+
+	err = vhd_open(&vhd, name, VHD_OPEN_RDONLY);
+	if (err)
+		return err;
+
+	err = vhd_get_bat(&vhd);
+	if (err)
+		goto out;
+
+	for (blk = 0; blk < vhd.bat.entries; blk++) {
+		if (*vhd_bat_slot(&vhd.bat, blk) == DD_BLK_UNUSED)
+			continue;
+
+		err = vhd_read_bitmap(&vhd, blk, &map);
+		if (err)
+			goto out;
+
+		for (i = 0; i < vhd.spb; i++)
+			if (vhd_bitmap_test(&vhd, map, i))
+				llwcache_mark(s, (uint64_t)blk * vhd.spb + i, 1);
+
+		free(map);
+	}
+
+	INFO("%s: %llu sectors to destage after unclean close\n",
+	     name, (unsigned long long)s->dirty);
+
+out:
+	vhd_close(&vhd);
+	return err;
+}
+
+static int
+llwcache_close(td_driver_t *driver)
+{
+	td_llwcache_t *s = driver->data;
+	td_driver_t *shared;
+	uint64_t i;
+	int err;
+
+	if (s->timer > 0) {
+		tapdisk_server_unregister_event(s->timer);
+		s->timer = -1;
+	}
+
+	if (s->marker && s->mode == LLW_WRITEBACK) {
+		if (s->dirty || s->n_destaging) {
+			WARN("%llu sectors not destaged from %s ",
+			     (unsigned long long)s->dirty, s->local->name);
+		} else {
+			/* SHARED must keep what LOCAL won't be asked for */
+			err = 0;
+			shared = s->image ?
+				tapdisk_vbd_next_image(s->image)->driver : NULL;
+			if (shared && shared->ops->td_sync)
+				err = shared->ops->td_sync(shared);
+			if (!err)
+				unlink(s->marker);
+		}
+	}
+
+	if (s->local) {
+		tapdisk_image_close(s->local);
+		s->local = NULL;
+	}
+
+	if (s->chunks) {
+		for (i = 0; i < s->n_chunks; i++)
+			free(s->chunks[i]);
+		free(s->chunks);
+		s->chunks = NULL;
+	}
+
+	for (i = 0; i < TD_LLW_DESTAGE_DEPTH; i++) {
+		free(s->destage[i].buf);
+		s->destage[i].buf = NULL;
+	}
+
+	free(s->marker);
+	s->marker = NULL;
+
+	return 0;
+}
+
+static int
+llwcache_open(td_driver_t *driver, const char *name, td_flag_t flags)
+{
+	td_llwcache_t *s = driver->data;
+	td_llwcache_destage_t *d;
+	int i, fd, err, recover;
+
+	s->mode  = LLW_WRITEBACK;
+	s->timer = -1;
+	INIT_LIST_HEAD(&s->held);
+	ll_reads_init(&s->reads);
+
+	for (i = 0; i < TD_LLWCACHE_MAX_REQ; i++)
+		llwcache_free_request(s, &s->reqv[i]);
+
+	for (i = 0; i < TD_LLW_DESTAGE_DEPTH; i++) {
+		d = &s->destage[i];
+		d->s         = s;
+		d->vreq.name = "llw-destage";
+
+		err = posix_memalign((void **)&d->buf, getpagesize(),
+				     TD_LLW_DESTAGE_SECS << SECTOR_SHIFT);
+		if (err) {
+			d->buf = NULL;
+			err    = -err;
+			goto fail;
+		}
+	}
+
+	err = asprintf(&s->marker, "%s%s", name, TD_LLW_MARKER);
+	if (err < 0) {
+		s->marker = NULL;
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	err = tapdisk_image_open(DISK_TYPE_VHD, name, flags, &s->local);
+	if (err)
+		goto fail;
+
+	driver->info = s->local->driver->info;
+
+	s->n_chunks  = (driver->info.size + TD_LLW_CHUNK_SECS - 1) >>
+		TD_LLW_CHUNK_SHIFT;
+	s->dirty_max = driver->info.size * TD_LLW_DIRTY_RATIO / 100 ? : 1;
+
+	s->chunks = calloc(s->n_chunks, sizeof(*s->chunks));
+	if (!s->chunks) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	recover = !access(s->marker, F_OK);
+
+	fd = open(s->marker, O_WRONLY|O_CREAT, 0644);
+	if (fd < 0 || fsync(fd)) {
+		err = -errno;
+		if (fd >= 0)
+			close(fd);
+		goto fail;
+	}
+	close(fd);
+
+	if (recover) {
+		err = llwcache_recover(s, name);
+		if (err)
+			goto fail;
+	}
+
+	s->timer = tapdisk_server_register_event(SCHEDULER_POLL_TIMEOUT,
+						 -1, TD_LLW_DESTAGE_INTERVAL,
+						 llwcache_timer, s);
+	if (s->timer < 0) {
+		err = s->timer;
+		goto fail;
+	}
+
+	return 0;
+
+fail:
+	/* a marker found stays for the next open */
+	free(s->marker);
+	s->marker = NULL;
+	llwcache_close(driver);
+	return err;
+}
+
+static void
+llwcache_debug(td_driver_t *driver)
+{
+	td_llwcache_t *s = driver->data;
+
+	INFO("LLW %s: mode: %d, error: %d, dirty: %llu/%llu, "
+	     "writing: %d, destaging: %d, destaged: %llu, held: %llu, "
+	     "errors: %llu\n", s->local ? s->local->name : "?",
+	     s->mode, s->error, (unsigned long long)s->dirty,
+	     (unsigned long long)s->dirty_max, s->n_writing,
+	     s->n_destaging, s->stats.destaged, s->stats.held,
+	     s->stats.errors);
+}
+
+static void
+llwcache_stats(td_driver_t *driver, td_stats_t *st)
+{
+	td_llwcache_t *s = driver->data;
+
+	tapdisk_stats_field(st, "mode", "s",
+			    s->mode == LLW_WRITEBACK ? "writeback" : "shared");
+	ll_reads_stats(&s->reads, st);
+	tapdisk_stats_field(st, "dirty", "llu",
+			    (unsigned long long)s->dirty << SECTOR_SHIFT);
+	tapdisk_stats_field(st, "dirty_max", "llu",
+			    (unsigned long long)s->dirty_max << SECTOR_SHIFT);
+	tapdisk_stats_field(st, "destaged", "llu", s->stats.destaged);
+	tapdisk_stats_field(st, "held", "llu", s->stats.held);
+	tapdisk_stats_field(st, "errors", "llu", s->stats.errors);
+}
+
+struct tap_disk tapdisk_llwcache = {
+	.disk_type                  = "tapdisk_llwcache",
+	.flags                      = 0,
+	.private_data_size          = sizeof(td_llwcache_t),
+	.td_open                    = llwcache_open,
+	.td_close                   = llwcache_close,
+	.td_queue_read              = llwcache_queue_read,
+	.td_queue_write             = llwcache_queue_write,
+	.td_sync                    = llwcache_sync,
+	.td_debug                   = llwcache_debug,
+	.td_stats                   = llwcache_stats,
+	.td_drain                   = llwcache_drain,
+	.td_get_parent_id           = llcache_get_parent_id,
+	.td_validate_parent         = llcache_validate_parent,
 };
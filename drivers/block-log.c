@@ -25,6 +25,10 @@
  *   u32 count;
  * }
  * terminated by { 0, 0 }
+ *
+ * Clients read the data back over the shared ring: each request names
+ * an extent and where in the data area it goes, and is read through
+ * the vbd straight into place.
  */
 
 #ifdef HAVE_CONFIG_H
@@ -36,6 +40,7 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/un.h>
@@ -45,18 +50,47 @@
 #include "tapdisk-server.h"
 #include "tapdisk-driver.h"
 #include "tapdisk-interface.h"
+#include "tapdisk-vbd.h"
+#include "writelog.h"
 
 #define MAX_CONNECTIONS 1
 
+#define TDLOG_GRAN_SHIFT 3 /* 4K chunks */
+
 typedef struct poll_fd {
   int          fd;
   event_id_t   id;
 } poll_fd_t;
 
+struct tdlog_reads;
+
+struct tdlog_read {
+  td_vbd_request_t    vreq;
+  struct td_iovec     iov;
+  log_request_t       req;
+};
+
+/* outlives the driver while reads are queued, with the shm they fill */
+struct tdlog_reads {
+  struct tdlog_state* s;
+  void*               shm;
+  int                 pending;
+  int                 orphan;
+  int                 reset;    /* the ring, once they are in */
+
+  int                 nfree;
+  struct tdlog_read** free;
+  struct tdlog_read*  slots;
+};
+
 struct tdlog_state {
   uint64_t     size;
 
-  void*        writelog;
+  td_vbd_t*    vbd;
+  struct tdlog_reads* reads;
+  int          kickfd;          /* to notify once the reads are done */
+
+  struct writelog writelog;
 
   char*        ctlpath;
   poll_fd_t    ctl;
@@ -80,115 +114,28 @@ static void ctl_request(event_id_t, char, void *);
 
 /* -- write log -- */
 
-/* large flat bitmaps don't scale particularly well either in size or scan
- * time, but they'll do for now */
-#define BITS_PER_LONG (sizeof(unsigned long) * 8)
-#define BITS_TO_LONGS(bits) (((bits)+BITS_PER_LONG-1)/BITS_PER_LONG)
-
-#define BITMAP_ENTRY(_nr, _bmap) ((unsigned long*)(_bmap))[(_nr)/BITS_PER_LONG]
-#define BITMAP_SHIFT(_nr) ((_nr) % BITS_PER_LONG)
-
-static inline int test_bit(int nr, void* bmap)
-{
-  return (BITMAP_ENTRY(nr, bmap) >> BITMAP_SHIFT(nr)) & 1;
-}
-
-static inline void clear_bit(int nr, void* bmap)
-{
-  BITMAP_ENTRY(nr, bmap) &= ~(1UL << BITMAP_SHIFT(nr));
-}
-
-static inline void set_bit(int nr, void* bmap)
-{
-  BITMAP_ENTRY(nr, bmap) |= (1UL << BITMAP_SHIFT(nr));
-}
-
-static inline int bitmap_size(uint64_t sz)
-{
-  return sz >> 3;
-}
-
-static int writelog_create(struct tdlog_state *s)
-{
-  uint64_t bmsize;
-
-  bmsize = bitmap_size(s->size);
-
-  BDPRINTF("allocating %"PRIu64" bytes for dirty bitmap", bmsize);
-
-  if (!(s->writelog = calloc(bmsize, 1))) {
-    BWPRINTF("could not allocate dirty bitmap of size %"PRIu64, bmsize);
-    return -1;
-  }
-
-  return 0;
-}
-
-static int writelog_free(struct tdlog_state *s)
-{
-  if (s->writelog)
-    free(s->writelog);
-
-  return 0;
-}
-
-static int writelog_set(struct tdlog_state* s, uint64_t sector, int count)
-{
-  int i;
-
-  for (i = 0; i < count; i++) 
-    set_bit(sector + i, s->writelog);
-
-  return 0;
-}
-
-/* if end is 0, clear to end of disk */
-int writelog_clear(struct tdlog_state* s, uint64_t start, uint64_t end)
-{
-  if (!end)
-    end = s->size;
-
-  /* clear to word boundaries */
-  while (BITMAP_SHIFT(start))
-    clear_bit(start++, s->writelog);
-  while (BITMAP_SHIFT(end))
-    clear_bit(end--, s->writelog);
-
-  memset(s->writelog + start / BITS_PER_LONG, 0, (end - start) >> 3);
-
-  return 0;
-}
-
 /* returns last block exported (may not be end of disk if shm region
  * overflows) */
 static uint64_t writelog_export(struct tdlog_state* s)
 {
   struct disk_range* range = s->shm;
-  uint64_t i = 0;
+  uint64_t i = 0, sector, count;
 
   BDPRINTF("sector count: %"PRIu64, s->size);
 
-  for (i = 0; i < s->size; i++) {
-    if (test_bit(i, s->writelog)) {
-      /* range start */
-      range->sector = i;
-      range->count = 1;
-      /* find end */
-      for (i++; i < s->size && test_bit(i, s->writelog); i++)
-	range->count++;
-
-      BDPRINTF("export: dirty extent %"PRIu64":%u",
-	       range->sector, range->count);
-      range++;
-
-      /* out of space in shared memory region */
-      if ((void*)range >= bmend(s->shm)) {
-	BDPRINTF("out of space in shm region at sector %"PRIu64, i);
-	return i;
-      }
-
-      /* undo forloop increment */
-      i--;
+  while (!writelog_next(&s->writelog, i, UINT32_MAX, &sector, &count)) {
+    range->sector = sector;
+    range->count = count;
+    i = sector + count;
+
+    BDPRINTF("export: dirty extent %"PRIu64":%u",
+	     range->sector, range->count);
+    range++;
+
+    /* out of space in shared memory region */
+    if ((void*)range >= bmend(s->shm)) {
+      BDPRINTF("out of space in shm region at sector %"PRIu64, i);
+      return i;
     }
   }
 
@@ -196,7 +143,7 @@ static uint64_t writelog_export(struct tdlog_state* s)
   range->sector = 0;
   range->count = 0;
 
-  return i;
+  return s->size;
 }
 
 /* -- communication channel -- */
@@ -337,6 +284,12 @@ static int ctl_open(struct tdlog_state* s, const char* name)
   return -1;
 }
 
+static void tdlog_ring_reset(struct tdlog_state* s)
+{
+  SHARED_RING_INIT(s->sring);
+  BACK_RING_INIT(&s->bring, s->sring, SRINGSIZE);
+}
+
 static int ctl_close(struct tdlog_state* s)
 {
   while (s->connected) {
@@ -360,12 +313,11 @@ static int ctl_close(struct tdlog_state* s)
     s->ctlpath = NULL;
   }
 
-  /* XXX this must be fixed once requests are actually in flight */
-  /* could just drain the existing ring here first */
-  if (s->sring) {
-    SHARED_RING_INIT(s->sring);
-    BACK_RING_INIT(&s->bring, s->sring, SRINGSIZE);
-  }
+  s->kickfd = -1;
+
+  /* reads still in flight were orphaned by tdlog_close */
+  if (s->sring)
+    tdlog_ring_reset(s);
 
   return 0;
 }
@@ -382,6 +334,13 @@ static int ctl_close_sock(struct tdlog_state* s, int fd)
       s->connections[i].fd = -1;
       s->connections[i].id = 0;
       s->connected--;
+      if (s->kickfd == fd)
+        s->kickfd = -1;
+      /* the next client starts on a fresh ring */
+      if (s->reads->pending)
+        s->reads->reset = 1;
+      else
+        tdlog_ring_reset(s);
       return 0;
     }
   }
@@ -467,7 +426,7 @@ static int ctl_clear_writes(struct tdlog_state* s, int fd)
 
   BDPRINTF("ctl: clearing bitmap");
 
-  writelog_clear(s, 0, 0);
+  writelog_clear(&s->writelog, 0, 0);
 
   if ((rc = write(fd, "done", CTLRSPLEN_CLEAR)) < 0) {
     BWPRINTF("error writing clear ack: %s", strerror(errno));
@@ -485,7 +444,7 @@ static int ctl_get_writes(struct tdlog_state* s, int fd)
   BDPRINTF("ctl: getting bitmap");
 
   writelog_export(s);
-  writelog_clear(s, 0, 0);
+  writelog_clear(&s->writelog, 0, 0);
 
   if ((rc = write(fd, "done", CTLRSPLEN_GET)) < 0) {
     BWPRINTF("error writing get ack: %s", strerror(errno));
@@ -495,17 +454,162 @@ static int ctl_get_writes(struct tdlog_state* s, int fd)
   return 0;
 }
 
-/* get requests from ring */
+static int ctl_notify(int fd)
+{
+  struct log_ctlmsg msg;
+  int rc;
+
+  memset(&msg, 0, sizeof(msg));
+  memcpy(msg.msg, LOGCMD_KICK, 4);
+  if ((rc = write(fd, &msg, sizeof(msg))) < 0) {
+    BWPRINTF("error sending notify: %s", strerror(errno));
+    return -1;
+  } else if (rc < sizeof(msg)) {
+    BWPRINTF("short notify write (%d/%zd)", rc, sizeof(msg));
+    return -1;
+  }
+
+  return 0;
+}
+
+static void tdlog_respond(struct tdlog_state* s, const log_response_t* rsp)
+{
+  memcpy(RING_GET_RESPONSE(&s->bring, s->bring.rsp_prod_pvt), rsp,
+	 sizeof(*rsp));
+  s->bring.rsp_prod_pvt++;
+}
+
+/* responses go out, and the client hears of them, once a kick is done */
+static void tdlog_kick_done(struct tdlog_state* s)
+{
+  RING_PUSH_RESPONSES(&s->bring);
+
+  if (s->kickfd >= 0) {
+    ctl_notify(s->kickfd);
+    s->kickfd = -1;
+  }
+}
+
+static void tdlog_reads_free(struct tdlog_reads* r)
+{
+  if (r->shm)
+    munmap(r->shm, SHMSIZE);
+  free(r->free);
+  free(r->slots);
+  free(r);
+}
+
+static struct tdlog_reads* tdlog_reads_alloc(struct tdlog_state* s)
+{
+  struct tdlog_reads* r;
+  int i, n = RING_SIZE(&s->bring);
+
+  r = calloc(1, sizeof(*r));
+  if (!r)
+    return NULL;
+
+  r->s = s;
+  r->slots = calloc(n, sizeof(*r->slots));
+  r->free = calloc(n, sizeof(*r->free));
+  if (!r->slots || !r->free) {
+    tdlog_reads_free(r);
+    return NULL;
+  }
+
+  for (i = 0; i < n; i++)
+    r->free[r->nfree++] = &r->slots[i];
+
+  return r;
+}
+
+/* a failed read comes back with a count of 0 */
+static void tdlog_read_done(td_vbd_request_t* vreq, int error,
+			    void* token, int final)
+{
+  struct tdlog_read* rd = containerof(vreq, struct tdlog_read, vreq);
+  struct tdlog_reads* r = token;
+  log_response_t rsp;
+
+  r->pending--;
+  r->free[r->nfree++] = rd;
+
+  if (r->orphan) {
+    if (!r->pending)
+      tdlog_reads_free(r);
+    return;
+  }
+
+  rsp = rd->req;
+  if (error) {
+    BWPRINTF("read of %"PRIu64":%u failed: %d", rsp.sector, rsp.count, error);
+    rsp.count = 0;
+  }
+
+  if (r->reset) {
+    if (!r->pending) {
+      r->reset = 0;
+      tdlog_ring_reset(r->s);
+    }
+    return;
+  }
+
+  tdlog_respond(r->s, &rsp);
+
+  if (!r->pending)
+    tdlog_kick_done(r->s);
+}
+
+static void tdlog_submit_read(struct tdlog_state* s, const log_request_t* req)
+{
+  struct tdlog_reads* r = s->reads;
+  struct tdlog_read* rd;
+  log_response_t rsp;
+  uint64_t len;
+
+  len = (uint64_t)req->count << SECTOR_SHIFT;
+
+  if (!s->vbd || !r->nfree || !req->count ||
+      req->offset & ((1 << SECTOR_SHIFT) - 1) ||
+      req->offset + len > sdataend(s->shm) - sdatastart(s->shm) ||
+      req->sector + req->count > s->size) {
+    BWPRINTF("bad read request %"PRIu64":%u at %u",
+	     req->sector, req->count, req->offset);
+    rsp = *req;
+    rsp.count = 0;
+    tdlog_respond(s, &rsp);
+    return;
+  }
+
+  rd = r->free[--r->nfree];
+  rd->req = *req;
+
+  memset(&rd->vreq, 0, sizeof(rd->vreq));
+  rd->iov.base = sdatastart(s->shm) + req->offset;
+  rd->iov.secs = req->count;
+  rd->vreq.op = TD_OP_READ;
+  rd->vreq.sec = req->sector;
+  rd->vreq.iov = &rd->iov;
+  rd->vreq.iovcnt = 1;
+  rd->vreq.cb = tdlog_read_done;
+  rd->vreq.token = r;
+  rd->vreq.name = "log";
+
+  r->pending++;
+  tapdisk_vbd_queue_request(s->vbd, &rd->vreq);
+}
+
+/* get requests from ring, and read the extents into the data area */
 static int ctl_kick(struct tdlog_state* s, int fd)
 {
   RING_IDX reqstart, reqend;
   log_request_t req;
 
-  /* XXX testing */
-  RING_IDX rspstart, rspend;
-  log_response_t rsp;
-  struct log_ctlmsg msg;
-  int rc;
+  /* a previous client's reads are still landing on the old ring */
+  if (s->reads->reset) {
+    BWPRINTF("ctl: ring busy, %d reads in flight", s->reads->pending);
+    ctl_notify(fd);
+    return 0;
+  }
 
   reqstart = s->bring.req_cons;
   reqend = s->sring->req_prod;
@@ -513,28 +617,16 @@ static int ctl_kick(struct tdlog_state* s, int fd)
   BDPRINTF("ctl: ring kicked (start = %u, end = %u)", reqstart, reqend);
 
   while (reqstart != reqend) {
-    /* XXX actually submit these! */
     memcpy(&req, RING_GET_REQUEST(&s->bring, reqstart), sizeof(req));
     BDPRINTF("ctl: read request %"PRIu64":%u", req.sector, req.count);
     s->bring.req_cons = ++reqstart;
 
-    rsp.sector = req.sector;
-    rsp.count = req.count;
-    memcpy(RING_GET_RESPONSE(&s->bring, s->bring.rsp_prod_pvt), &rsp,
-	   sizeof(rsp));
-    s->bring.rsp_prod_pvt++;
+    tdlog_submit_read(s, &req);
   }
 
-  RING_PUSH_RESPONSES(&s->bring);
-  memset(&msg, 0, sizeof(msg));
-  memcpy(msg.msg, LOGCMD_KICK, 4);
-  if ((rc = write(fd, &msg, sizeof(msg))) < 0) {
-    BWPRINTF("error sending notify: %s", strerror(errno));
-    return -1;
-  } else if (rc < sizeof(msg)) {
-    BWPRINTF("short notify write (%d/%zd)", rc, sizeof(msg));
-    return -1;
-  }
+  s->kickfd = fd;
+  if (!s->reads->pending)
+    tdlog_kick_done(s);
 
   return 0;
 }
@@ -599,52 +691,123 @@ static void ctl_request(event_id_t id, char mode, void *private)
 
 /* -- interface -- */
 
+/* splits ",gran=<bytes>" off the name: a power of two, 512 to 1M */
+static int tdlog_parse_gran(char* name, unsigned int* shift)
+{
+  unsigned long long v;
+  char *opt, *end;
+
+  *shift = TDLOG_GRAN_SHIFT;
+
+  opt = strstr(name, ",gran=");
+  if (!opt)
+    return 0;
+  *opt = '\0';
+
+  errno = 0;
+  v = strtoull(opt + strlen(",gran="), &end, 0);
+  if (errno || end == opt + strlen(",gran="))
+    return -EINVAL;
+
+  switch (*end) {
+  case 'M': case 'm': v <<= 10;
+  case 'K': case 'k': v <<= 10;
+    end++;
+  }
+
+  if (*end || v < 512 || v > (1 << 20) || (v & (v - 1)))
+    return -EINVAL;
+
+  *shift = __builtin_ctzll(v) - 9;
+  return 0;
+}
+
 static int tdlog_close(td_driver_t*);
 
 static int tdlog_open(td_driver_t* driver, const char* name, td_flag_t flags)
 {
   struct tdlog_state* s = (struct tdlog_state*)driver->data;
+  unsigned int shift;
+  char* path;
   int rc;
 
   memset(s, 0, sizeof(*s));
+  s->kickfd = -1;
 
   s->size = driver->info.size;
 
-  if ((rc = writelog_create(s))) {
-    tdlog_close(driver);
-    return rc;
-  }
-  if ((rc = shmem_open(s, name))) {
-    tdlog_close(driver);
+  path = strdup(name);
+  if (!path)
+    return -ENOMEM;
+
+  if ((rc = tdlog_parse_gran(path, &shift))) {
+    BWPRINTF("bad granularity in %s", name);
+    free(path);
     return rc;
   }
-  if ((rc = ctl_open(s, name))) {
-    tdlog_close(driver);
-    return rc;
+
+  BDPRINTF("allocating dirty bitmap for %"PRIu64" sectors, %u per bit",
+	   s->size, 1U << shift);
+  if ((rc = writelog_create(&s->writelog, s->size, shift))) {
+    BWPRINTF("could not allocate dirty bitmap");
+    goto fail;
   }
+  if ((rc = shmem_open(s, path)))
+    goto fail;
+  if ((rc = ctl_open(s, path)))
+    goto fail;
+
+  free(path);
 
   s->sring = (log_sring_t*)sringstart(s->shm);
-  SHARED_RING_INIT(s->sring);
-  BACK_RING_INIT(&s->bring, s->sring, SRINGSIZE);
+  tdlog_ring_reset(s);
+
+  s->reads = tdlog_reads_alloc(s);
+  if (!s->reads) {
+    rc = -ENOMEM;
+    goto fail_ring;
+  }
 
   BDPRINTF("opened ctl socket");
 
   return 0;
+
+fail:
+  free(path);
+fail_ring:
+  tdlog_close(driver);
+  return rc;
 }
 
 static int tdlog_close(td_driver_t* driver)
 {
   struct tdlog_state* s = (struct tdlog_state*)driver->data;
+  struct tdlog_reads* r = s->reads;
+
+  /* queued reads keep the data area they fill, and free it when done */
+  if (r && r->pending) {
+    BWPRINTF("closing with %d reads in flight", r->pending);
+    r->orphan = 1;
+    r->shm = s->shm;
+    s->shm = NULL;
+    s->sring = NULL;
+  } else if (r)
+    tdlog_reads_free(r);
+  s->reads = NULL;
 
   ctl_close(s);
   shmem_close(s);
-  writelog_free(s);
+  writelog_free(&s->writelog);
 
   return 0;
 }
 
 static void tdlog_queue_read(td_driver_t* driver, td_request_t treq)
 {
+  struct tdlog_state* s = (struct tdlog_state*)driver->data;
+
+  if (!s->vbd)
+    s->vbd = treq.vreq->vbd;
   td_forward_request(treq);
 }
 
@@ -653,7 +816,9 @@ static void tdlog_queue_write(td_driver_t* driver, td_request_t treq)
   struct tdlog_state* s = (struct tdlog_state*)driver->data;
   int rc;
 
-  writelog_set(s, treq.sec, treq.secs);
+  if (!s->vbd)
+    s->vbd = treq.vreq->vbd;
+  writelog_set(&s->writelog, treq.sec, treq.secs);
   td_forward_request(treq);
 }
 
@@ -676,6 +841,7 @@ struct tap_disk tapdisk_log = {
   .td_close           = tdlog_close,
   .td_queue_read      = tdlog_queue_read,
   .td_queue_write     = tdlog_queue_write,
+  .td_queue_discard   = tdlog_queue_write,
   .td_get_parent_id   = tdlog_get_parent_id,
   .td_validate_parent = tdlog_validate_parent,
 };
@@ -28,6 +28,7 @@
 #include <arpa/inet.h>
 #include <netinet/tcp.h>
 #include <netinet/in.h>
+#include <pthread.h>
 #include "tapdisk.h"
 #include "tapdisk-server.h"
 #include "tapdisk-driver.h"
@@ -35,6 +36,7 @@
 #include "tapdisk-utils.h"
 #include "tapdisk-fdreceiver.h"
 #include "tapdisk-nbd.h"
+#include "libaio-compat.h"
 
 #ifdef HAVE_CONFIG_H
 #include "config.h"
@@ -47,7 +49,14 @@
 #define TAPDISK_NBDCLIENT_MAX_PATH_LEN 256
 #define TAPDISK_NBDCLIENT_LISTEN_SOCK_PATH "/var/run/blktap-control/nbdclient"
 #define MAX_NBD_REQS TAPDISK_DATA_REQUESTS
+#define NBD_MAX_DEPTH 4096
 #define NBD_TIMEOUT 30
+#define NBD_RECONNECT_TIMEOUT NBD_TIMEOUT
+#define NBD_RECONNECT_INTERVAL 1
+#define NBD_SEND_IOVS 128
+#define NBD_RECV_BUFFER (64 << 10)
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
 
 /* 
  * We'll only ever have one nbdclient fd receiver per tapdisk process, so let's 
@@ -72,8 +81,10 @@ struct nbd_queued_io {
 struct td_nbd_request {
 	td_request_t            treq;
 	struct nbd_request      nreq;
-	int                     timeout_event;
+	struct timeval          issued;
+	int                     idx;
 	int                     fake;
+	int                     sent;
 	struct nbd_queued_io    header;
 	struct nbd_queued_io    body;     /* in or out, depending on whether
 					     type is read or write. */
@@ -86,13 +97,17 @@ struct tdnbd_data
 	struct list_head        sent_reqs;
 	struct list_head        pending_reqs;
 	struct list_head        free_reqs;
-	struct td_nbd_request   requests[MAX_NBD_REQS];
+	struct td_nbd_request  *requests;
+	int                     depth;
 	int                     nr_free_count;
+	event_id_t              timeout_event;
 
 	int                     reader_event_id;
 	struct nbd_reply        current_reply;
-	struct nbd_queued_io    cur_reply_qio;
 	struct td_nbd_request  *curr_reply_req;
+	char                    rbuf[NBD_RECV_BUFFER];
+	int                     rbuf_start;
+	int                     rbuf_end;
 
 	int                     socket;
 	struct sockaddr_in     *remote;
@@ -102,11 +117,28 @@ struct tdnbd_data
 
 	int                     flags;
 	int                     closed;
-};
+	uint32_t                server_flags;
+	td_driver_t            *driver;
+
+	int                     reconnecting;
+	struct timeval          lost;
+	event_id_t              reconnect_event;
+	uint64_t                reconnects;
 
-int global_id = 0;
+	/*
+	 * Syncs come from the flush thread, the request goes out on the
+	 * loop: sync_efd wakes it, sync_cond signals the reply.
+	 */
+	int                     sync_efd;
+	event_id_t              sync_event;
+	pthread_mutex_t         sync_lock;
+	pthread_cond_t          sync_cond;
+	int                     sync_done;
+	int                     sync_err;
+};
 
 static void disable_write_queue(struct tdnbd_data *prv);
+static void tdnbd_connection_lost(struct tdnbd_data *prv, int err);
 
 
 /* -- fdreceiver bits and pieces -- */
@@ -181,7 +213,17 @@ tdnbd_fdreceiver_stop()
 }
 
 static void
-__cancel_req(int i, struct td_nbd_request *pos, int e)
+tdnbd_sync_complete(struct tdnbd_data *prv, int err)
+{
+	pthread_mutex_lock(&prv->sync_lock);
+	prv->sync_err  = err;
+	prv->sync_done = 1;
+	pthread_cond_signal(&prv->sync_cond);
+	pthread_mutex_unlock(&prv->sync_lock);
+}
+
+static void
+__cancel_req(struct tdnbd_data *prv, int i, struct td_nbd_request *pos, int e)
 {
 	char handle[9];
 	memcpy(handle, pos->nreq.handle, 8);
@@ -189,12 +231,10 @@ __cancel_req(int i, struct td_nbd_request *pos, int e)
 	INFO("Entry %d: handle='%s' type=%d -- reporting errno: %d",
 			i, handle, ntohl(pos->nreq.type), e);
 
-	if (pos->timeout_event >= 0) {
-		tapdisk_server_unregister_event(pos->timeout_event);
-		pos->timeout_event = -1;
-	}
-
-	td_complete_request(pos->treq, e);
+	if (pos->fake)
+		tdnbd_sync_complete(prv, -e);
+	else
+		td_complete_request(pos->treq, e);
 }
 
 static void
@@ -207,119 +247,182 @@ tdnbd_disable(struct tdnbd_data *prv, int e)
 
 	tapdisk_server_unregister_event(prv->writer_event_id);
 	tapdisk_server_unregister_event(prv->reader_event_id);
+	prv->writer_event_id = -1;
+	prv->reader_event_id = -1;
+
+	if (prv->timeout_event >= 0) {
+		tapdisk_server_unregister_event(prv->timeout_event);
+		prv->timeout_event = -1;
+	}
+
+	if (prv->reconnect_event >= 0) {
+		tapdisk_server_unregister_event(prv->reconnect_event);
+		prv->reconnect_event = -1;
+	}
+	prv->reconnecting = 0;
 
 	list_for_each_entry_safe(pos, q, &prv->sent_reqs, queue)
-		__cancel_req(i++, pos, e);
+		__cancel_req(prv, i++, pos, e);
 
 	list_for_each_entry_safe(pos, q, &prv->pending_reqs, queue)
-		__cancel_req(i++, pos, e);
+		__cancel_req(prv, i++, pos, e);
 
 	INFO("Setting closed");
 	prv->closed = 3;
 }
 
-/* NBD writer queue */
-
-/* Return code: how much is left to write, or a negative error code */
 static int
-tdnbd_write_some(int fd, struct nbd_queued_io *data) 
+tdnbd_read_some(int fd, struct nbd_queued_io *data)
 {
 	int left = data->len - data->so_far;
 	int rc;
 	char *code;
 
 	while (left > 0) {
-		rc = send(fd, data->buffer + data->so_far, left, 0);
+		rc = recv(fd, data->buffer + data->so_far, left, 0);
 
 		if (rc == -1) {
+
 			if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
 				return left;
 
 			code = strerror(errno);
-			ERROR("Bad return code %d from send (%s)", rc, 
+			ERROR("Bad return code %d from send (%s)", rc,
 					(code == 0 ? "unknown" : code));
 			return rc;
 		}
 
 		if (rc == 0) {
-			ERROR("Server shutdown prematurely in write_some");
+			ERROR("Server shutdown prematurely in read_some");
 			return -1;
 		}
 
-		left -= rc;
 		data->so_far += rc;
+		left -= rc;
 	}
 
 	return left;
 }
 
-static int
-tdnbd_read_some(int fd, struct nbd_queued_io *data)
+/* one timer for all requests: the oldest not answered in time fails all */
+static void
+tdnbd_timeout_cb(event_id_t eb, char mode, void *data)
 {
-	int left = data->len - data->so_far;
-	int rc;
-	char *code;
+	struct tdnbd_data *prv = data;
+	struct td_nbd_request *req;
+	struct list_head *lists[2];
+	struct timeval now;
+	int i;
 
-	while (left > 0) {
-		rc = recv(fd, data->buffer + data->so_far, left, 0);
+	if (prv->reconnecting)
+		return;
 
-		if (rc == -1) {
+	gettimeofday(&now, NULL);
 
-			if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
-				return left;
+	lists[0] = &prv->sent_reqs;
+	lists[1] = &prv->pending_reqs;
 
-			code = strerror(errno);
-			ERROR("Bad return code %d from send (%s)", rc,
-					(code == 0 ? "unknown" : code));
-			return rc;
-		}
+	for (i = 0; i < 2; i++) {
+		if (list_empty(lists[i]))
+			continue;
 
-		if (rc == 0) {
-			ERROR("Server shutdown prematurely in read_some");
-			return -1;
+		req = list_entry(lists[i]->next, struct td_nbd_request, queue);
+		if (now.tv_sec - req->issued.tv_sec >= NBD_TIMEOUT) {
+			ERROR("Timeout!: %d", eb);
+			tdnbd_connection_lost(prv, ETIMEDOUT);
+			return;
 		}
-
-		data->so_far += rc;
-		left -= rc;
 	}
-
-	return left;
 }
 
-static void
-tdnbd_timeout_cb(event_id_t eb, char mode, void *data)
+static inline int
+tdnbd_has_body(struct td_nbd_request *req)
 {
-	struct tdnbd_data *prv = data;
-	ERROR("Timeout!: %d", eb);
-	tdnbd_disable(prv, ETIMEDOUT);
+	return (ntohl(req->nreq.type) & NBD_CMD_MASK_COMMAND) == NBD_CMD_WRITE;
 }
 
+/*
+ * Everything queued since the last pass goes out in as few sendmsg
+ * calls as it takes: headers and write payloads of up to NBD_SEND_IOVS
+ * pieces at a time, straight from the request buffers.
+ */
 static void
 tdnbd_writer_cb(event_id_t eb, char mode, void *data)
 {
 	struct td_nbd_request *pos, *q;
 	struct tdnbd_data *prv = data;
+	struct iovec iov[NBD_SEND_IOVS];
+	struct nbd_queued_io *qio[NBD_SEND_IOVS];
+	struct msghdr msg;
+	ssize_t n;
+	int i, cnt, left;
 
-	list_for_each_entry_safe(pos, q, &prv->pending_reqs, queue) {
-		if (tdnbd_write_some(prv->socket, &pos->header) > 0)
-			return;
+	while (!list_empty(&prv->pending_reqs)) {
+		cnt = 0;
 
-		if (ntohl(pos->nreq.type) == NBD_CMD_WRITE) {
-			if (tdnbd_write_some(prv->socket, &pos->body) > 0)
+		list_for_each_entry(pos, &prv->pending_reqs, queue) {
+			if (cnt + 2 > NBD_SEND_IOVS)
+				break;
+
+			if (pos->header.so_far < pos->header.len) {
+				iov[cnt].iov_base = pos->header.buffer +
+					pos->header.so_far;
+				iov[cnt].iov_len  = pos->header.len -
+					pos->header.so_far;
+				qio[cnt++]        = &pos->header;
+			}
+
+			if (tdnbd_has_body(pos) &&
+			    pos->body.so_far < pos->body.len) {
+				iov[cnt].iov_base = pos->body.buffer +
+					pos->body.so_far;
+				iov[cnt].iov_len  = pos->body.len -
+					pos->body.so_far;
+				qio[cnt++]        = &pos->body;
+			}
+		}
+
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov    = iov;
+		msg.msg_iovlen = cnt;
+
+		n = sendmsg(prv->socket, &msg, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
 				return;
+
+			ERROR("Bad return code from sendmsg (%s)",
+					strerror(errno));
+			tdnbd_connection_lost(prv, EIO);
+			return;
 		}
 
-		if (ntohl(pos->nreq.type) == NBD_CMD_DISC) {
-			INFO("sent close request");
-			/*
-			 * We don't expect a response from a DISC, so move the
-			 * request back onto the free list
-			 */
-			list_move(&pos->queue, &prv->free_reqs);
-			prv->nr_free_count++;
-			prv->closed = 2;
-		} else {
-			list_move(&pos->queue, &prv->sent_reqs);
+		for (i = 0; i < cnt && n > 0; i++) {
+			left = qio[i]->len - qio[i]->so_far;
+			left = MIN(left, n);
+			qio[i]->so_far += left;
+			n -= left;
+		}
+
+		list_for_each_entry_safe(pos, q, &prv->pending_reqs, queue) {
+			if (pos->header.so_far < pos->header.len ||
+			    (tdnbd_has_body(pos) &&
+			     pos->body.so_far < pos->body.len))
+				return;
+
+			if (ntohl(pos->nreq.type) == NBD_CMD_DISC) {
+				INFO("sent close request");
+				/*
+				 * We don't expect a response from a DISC, so
+				 * move the request back onto the free list
+				 */
+				list_move(&pos->queue, &prv->free_reqs);
+				prv->nr_free_count++;
+				prv->closed = 2;
+			} else {
+				pos->sent = 1;
+				list_move_tail(&pos->queue, &prv->sent_reqs);
+			}
 		}
 	}
 
@@ -360,12 +463,19 @@ disable_write_queue(struct tdnbd_data *prv)
 	prv->writer_event_id = -1;
 }
 
+/*
+ * -EBUSY once all prv->depth requests are out: the vbd retries those,
+ * and the fake ones (syncs) are failed by the caller.
+ */
 static int
 tdnbd_queue_request(struct tdnbd_data *prv, int type, uint64_t offset,
 		char *buffer, uint32_t length, td_request_t treq, int fake)
 {
-	if (prv->nr_free_count == 0) 
+	if (prv->nr_free_count == 0) {
+		if (!fake && type != NBD_CMD_DISC)
+			td_complete_request(treq, -EBUSY);
 		return -EBUSY;
+	}
 
 	if (prv->closed == 3) {
 		td_complete_request(treq, -ETIMEDOUT);
@@ -375,25 +485,11 @@ tdnbd_queue_request(struct tdnbd_data *prv, int type, uint64_t offset,
 	struct td_nbd_request *req = list_entry(prv->free_reqs.next,
 			struct td_nbd_request, queue);
 
-	/* fill in the request */
+	/* fill in the request, the handle names its slot */
 
 	req->treq = treq;
-	int id = global_id++;
-	snprintf(req->nreq.handle, 8, "td%05x", id % 0xffff);
-
-	/* No response from a disconnect, so no need for a timeout */
-	if (type != NBD_CMD_DISC) { 
-		req->timeout_event = tapdisk_server_register_event(
-				SCHEDULER_POLL_TIMEOUT, 
-				-1, /* dummy */
-				NBD_TIMEOUT,
-				tdnbd_timeout_cb,
-				prv);
-	} else {
-		req->timeout_event = -1;
-	}
-
-	INFO("request: %s timeout %d", req->nreq.handle, req->timeout_event);
+	snprintf(req->nreq.handle, 8, "t%06x", req->idx);
+	gettimeofday(&req->issued, NULL);
 
 	req->nreq.magic = htonl(NBD_REQUEST_MAGIC);
 	req->nreq.type = htonl(type);
@@ -406,11 +502,12 @@ tdnbd_queue_request(struct tdnbd_data *prv, int type, uint64_t offset,
 	req->body.len = length;
 	req->body.so_far = 0;
 	req->fake = fake;
+	req->sent = 0;
 
 	list_move_tail(&req->queue, &prv->pending_reqs);
 	prv->nr_free_count--;
 
-	if (prv->writer_event_id < 0)
+	if (prv->writer_event_id < 0 && !prv->reconnecting)
 		enable_write_queue(prv);
 
 	return 0;
@@ -418,100 +515,197 @@ tdnbd_queue_request(struct tdnbd_data *prv, int type, uint64_t offset,
 
 /* NBD Reader callback */
 
+static struct td_nbd_request *
+tdnbd_find_request(struct tdnbd_data *prv, const char *handle)
+{
+	struct td_nbd_request *req;
+	char buf[9], *end;
+	unsigned long idx;
+
+	memcpy(buf, handle, 8);
+	buf[8] = 0;
+
+	if (buf[0] != 't')
+		goto fail;
+
+	idx = strtoul(buf + 1, &end, 16);
+	if (*end || idx >= prv->depth)
+		goto fail;
+
+	req = &prv->requests[idx];
+	if (!req->sent)
+		goto fail;
+
+	return req;
+
+fail:
+	ERROR("Couldn't find request corresponding to reply "
+			"(reply handle='%s')", buf);
+	return NULL;
+}
+
 static void
-tdnbd_reader_cb(event_id_t eb, char mode, void *data)
+tdnbd_finish_reply(struct tdnbd_data *prv)
 {
-	char handle[9];
-	int do_disable = 0;
+	struct td_nbd_request *req = prv->curr_reply_req;
 
-	/* Check to see if we're in the middle of reading a response already */
-	struct tdnbd_data *prv = data;
-	int rc = tdnbd_read_some(prv->socket, &prv->cur_reply_qio);
+	/* remove the state */
+	req->sent = 0;
+	list_move(&req->queue, &prv->free_reqs);
+	prv->nr_free_count++;
 
-	if (rc < 0) {
-		ERROR("Error reading reply header: %d", rc);
-		tdnbd_disable(prv, EIO);
-		return;
+	prv->curr_reply_req = NULL;
+}
+
+/*
+ * A reply header: requests without payload complete here, a read
+ * becomes curr_reply_req until its data is in. -1 if fatal.
+ */
+static int
+tdnbd_handle_reply(struct tdnbd_data *prv)
+{
+	struct td_nbd_request *req;
+	int type, err;
+
+	if (ntohl(prv->current_reply.magic) != NBD_REPLY_MAGIC) {
+		ERROR("Bad reply magic: 0x%x", ntohl(prv->current_reply.magic));
+		return -1;
 	}
 
-	if (rc > 0)
-		return; /* need more data */
+	req = tdnbd_find_request(prv, prv->current_reply.handle);
+	if (!req)
+		return -1;
 
-	/* Got a header. */
-	if (prv->current_reply.error != 0) {
-		ERROR("Error in reply: %d", prv->current_reply.error);
-		tdnbd_disable(prv, EIO);
-		return;
+	prv->curr_reply_req = req;
+
+	type = ntohl(req->nreq.type) & NBD_CMD_MASK_COMMAND;
+	err  = ntohl(prv->current_reply.error);
+
+	/* a failed trim is only a missed hint, anything else is fatal */
+	if (err) {
+		ERROR("Error in reply: %d", err);
+		if (type != NBD_CMD_TRIM)
+			return -1;
+		td_complete_request(req->treq, -err);
+		tdnbd_finish_reply(prv);
+		return 0;
 	}
 
-	/* Have we found the request yet? */
-	if (prv->curr_reply_req == NULL) {
-		struct td_nbd_request *pos, *q;
-		list_for_each_entry_safe(pos, q, &prv->sent_reqs, queue) {
-			if (memcmp(pos->nreq.handle, prv->current_reply.handle,
-						8) == 0) {
-				prv->curr_reply_req = pos;
-				break;
+	switch(type) {
+	case NBD_CMD_READ:
+		return 0;
+	case NBD_CMD_WRITE:
+	case NBD_CMD_WRITE_ZEROES:
+	case NBD_CMD_TRIM:
+		td_complete_request(req->treq, 0);
+		break;
+	case NBD_CMD_FLUSH:
+		tdnbd_sync_complete(prv, 0);
+		break;
+	default:
+		ERROR("Unhandled request response: %d", type);
+		return -1;
+	}
+
+	tdnbd_finish_reply(prv);
+	return 0;
+}
+
+/* more replies into the receive buffer: bytes read, 0 for none yet */
+static int
+tdnbd_fill_rbuf(struct tdnbd_data *prv)
+{
+	int rc;
+
+	if (prv->rbuf_start) {
+		memmove(prv->rbuf, prv->rbuf + prv->rbuf_start,
+				prv->rbuf_end - prv->rbuf_start);
+		prv->rbuf_end  -= prv->rbuf_start;
+		prv->rbuf_start = 0;
+	}
+
+	rc = recv(prv->socket, prv->rbuf + prv->rbuf_end,
+			NBD_RECV_BUFFER - prv->rbuf_end, 0);
+	if (rc < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return 0;
+
+		ERROR("Bad return code %d from recv (%s)", rc,
+				strerror(errno));
+		return -1;
+	}
+
+	if (rc == 0) {
+		ERROR("Server shutdown prematurely in fill_rbuf");
+		return -1;
+	}
+
+	prv->rbuf_end += rc;
+	return rc;
+}
+
+/*
+ * Replies are parsed out of a NBD_RECV_BUFFER sized buffer, as many
+ * as one recv brought in. Read data found there is copied out, the
+ * rest goes straight into the request buffer.
+ */
+static void
+tdnbd_reader_cb(event_id_t eb, char mode, void *data)
+{
+	struct tdnbd_data *prv = data;
+	struct nbd_queued_io *body;
+	int rc, avail, n;
+
+	for (;;) {
+		avail = prv->rbuf_end - prv->rbuf_start;
+
+		if (!prv->curr_reply_req) {
+			if (avail < sizeof(struct nbd_reply)) {
+				rc = tdnbd_fill_rbuf(prv);
+				if (rc < 0)
+					goto lost;
+				if (!rc)
+					return; /* need more data */
+				continue;
 			}
-		}
 
-		if (prv->curr_reply_req == NULL) {
-			memcpy(handle, prv->current_reply.handle, 8);
-			handle[8] = 0;
+			memcpy(&prv->current_reply,
+					prv->rbuf + prv->rbuf_start,
+					sizeof(struct nbd_reply));
+			prv->rbuf_start += sizeof(struct nbd_reply);
 
-			ERROR("Couldn't find request corresponding to reply "
-					"(reply handle='%s')", handle);
-			tdnbd_disable(prv, EIO);
-			return;
+			if (tdnbd_handle_reply(prv))
+				goto fail;
+			continue;
 		}
-	}
 
-	switch(ntohl(prv->curr_reply_req->nreq.type)) {
-	case NBD_CMD_READ:
-		rc = tdnbd_read_some(prv->socket,
-				&prv->curr_reply_req->body);
+		body = &prv->curr_reply_req->body;
+
+		n = MIN(avail, body->len - body->so_far);
+		memcpy(body->buffer + body->so_far,
+				prv->rbuf + prv->rbuf_start, n);
+		body->so_far    += n;
+		prv->rbuf_start += n;
 
+		rc = tdnbd_read_some(prv->socket, body);
 		if (rc < 0) {
 			ERROR("Error reading body of request: %d", rc);
-			tdnbd_disable(prv, EIO);
-			return;
+			goto lost;
 		}
 
 		if (rc > 0)
 			return; /* need more data */
 
 		td_complete_request(prv->curr_reply_req->treq, 0);
-
-		break;
-	case NBD_CMD_WRITE:
-		td_complete_request(prv->curr_reply_req->treq, 0);
-
-		break;
-	default:
-		ERROR("Unhandled request response: %d",
-				ntohl(prv->curr_reply_req->nreq.type));
-		do_disable = 1;
-		return;
-	} 
-
-	/* remove the state */
-	list_move(&prv->curr_reply_req->queue, &prv->free_reqs);
-	prv->nr_free_count++;
-
-	prv->cur_reply_qio.so_far = 0;
-	if (prv->curr_reply_req->timeout_event >= 0) {
-		tapdisk_server_unregister_event(
-				prv->curr_reply_req->timeout_event);
+		tdnbd_finish_reply(prv);
 	}
 
-	prv->curr_reply_req = NULL;
+fail:
+	tdnbd_disable(prv, EIO);
+	return;
 
-	/*
-	 * NB: do this here otherwise we cancel the request that has just been 
-	 * moved
-	 */
-	if (do_disable)
-		tdnbd_disable(prv, EIO);
+lost:
+	tdnbd_connection_lost(prv, EIO);
 }
 
 static int
@@ -529,6 +723,83 @@ tdnbd_wait_read(int fd)
 	return rc;
 }
 
+static int
+tdnbd_recv_all(int sock, void *buf, size_t len)
+{
+	size_t done;
+	int rc;
+
+	for (done = 0; done < len; done += rc) {
+		if (tdnbd_wait_read(sock) <= 0)
+			return -ETIMEDOUT;
+
+		rc = recv(sock, (char *)buf + done, len - done, 0);
+		if (rc <= 0)
+			return -EIO;
+	}
+
+	return 0;
+}
+
+/*
+ * Fixed newstyle, as served on the listening socket of tapdisk's NBD
+ * server: past 'NBDMAGIC' and 'IHAVEOPT', ask for the default export.
+ */
+static int
+tdnbd_nbd_negotiate_newstyle(struct tdnbd_data *prv, td_driver_t *driver)
+{
+	int sock = prv->socket;
+	struct nbd_option opt;
+	uint16_t hflags, tx;
+	uint32_t cflags;
+	uint64_t size;
+	char pad[124];
+	int err;
+
+	err = tdnbd_recv_all(sock, &hflags, sizeof(hflags));
+	if (err)
+		goto fail;
+
+	hflags = ntohs(hflags);
+	cflags = htonl(hflags & (NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES));
+
+	opt.magic  = htonll(NBD_OPTS_MAGIC);
+	opt.option = htonl(NBD_OPT_EXPORT_NAME);
+	opt.length = 0;
+
+	if (send(sock, &cflags, sizeof(cflags), 0) != sizeof(cflags) ||
+	    send(sock, &opt, sizeof(opt), 0) != sizeof(opt)) {
+		err = -errno;
+		goto fail;
+	}
+
+	err = tdnbd_recv_all(sock, &size, sizeof(size));
+	if (!err)
+		err = tdnbd_recv_all(sock, &tx, sizeof(tx));
+	if (!err && !(hflags & NBD_FLAG_NO_ZEROES))
+		err = tdnbd_recv_all(sock, pad, sizeof(pad));
+	if (err)
+		goto fail;
+
+	INFO("Got size: %"PRIu64", flags: 0x%x", ntohll(size), ntohs(tx));
+
+	driver->info.size = ntohll(size) >> SECTOR_SHIFT;
+	driver->info.sector_size = DEFAULT_SECTOR_SIZE;
+	driver->info.info = 0;
+	prv->server_flags = ntohs(tx);
+
+	INFO("Successfully connected to NBD server");
+
+	fcntl(sock, F_SETFL, O_NONBLOCK);
+
+	return 0;
+
+fail:
+	ERROR("Error in newstyle negotiation: %d", err);
+	close(sock);
+	return -1;
+}
+
 static int
 tdnbd_nbd_negotiate(struct tdnbd_data *prv, td_driver_t *driver)
 {
@@ -584,10 +855,13 @@ tdnbd_nbd_negotiate(struct tdnbd_data *prv, td_driver_t *driver)
 	rc = recv(sock, &magic, sizeof(magic), 0);
 	if (rc < 8) {
 		ERROR("Short read in negotiation(2) (%d)\n", rc);
-
+		close(sock);
 		return -1;
 	} 
 
+	if (ntohll(magic) == NBD_OPTS_MAGIC)
+		return tdnbd_nbd_negotiate_newstyle(prv, driver);
+
 	if (ntohll(magic) != NBD_NEGOTIATION_MAGIC) {
 		ERROR("Not enough magic in negotiation(2) (%"PRIu64")\n",
 				ntohll(magic));
@@ -628,6 +902,7 @@ tdnbd_nbd_negotiate(struct tdnbd_data *prv, td_driver_t *driver)
 	} 
 
 	INFO("Got flags: %"PRIu32"", ntohl(flags));
+	prv->server_flags = ntohl(flags);
 
 	while (padbytes > 0) {
 		if (tdnbd_wait_read(sock) <= 0) {
@@ -673,7 +948,7 @@ tdnbd_connect_import_session(struct tdnbd_data *prv, td_driver_t* driver)
 	}
 
 	prv->remote = (struct sockaddr_in *)malloc(
-			sizeof(struct sockaddr_in *));
+			sizeof(struct sockaddr_in));
 	if (!prv->remote) {
 		ERROR("struct sockaddr_in malloc failure\n");
 		close(sock);
@@ -709,16 +984,265 @@ tdnbd_connect_import_session(struct tdnbd_data *prv, td_driver_t* driver)
 	return tdnbd_nbd_negotiate(prv, driver);
 }
 
+/*
+ * Reconnection. The requests in flight go back to the head of the
+ * queue, in the order they were sent, and go out again on the next
+ * connection: reads, writes, zeroes, trims and flushes can all be
+ * repeated. Until then new requests queue behind them. Connects are
+ * tried once a second, from the passed fds or the peer address, for
+ * NBD_RECONNECT_TIMEOUT seconds.
+ */
+
+static void tdnbd_reconnect_cb(event_id_t, char, void *);
+
+static int
+tdnbd_reconnected(struct tdnbd_data *prv)
+{
+	td_driver_t *driver = prv->driver;
+	td_sector_t size = driver->info.size;
+	struct td_nbd_request *pos;
+	int n = 0;
+
+	if (tdnbd_nbd_negotiate(prv, driver) < 0) {
+		driver->info.size = size;
+		prv->socket = -1;
+		return -1;
+	}
+
+	if (driver->info.size != size) {
+		ERROR("Export changed size on reconnect (%"PRIu64" != %"PRIu64")",
+				driver->info.size, size);
+		driver->info.size = size;
+		tdnbd_disable(prv, EIO);
+		return 0;
+	}
+
+	prv->reader_event_id =
+		tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
+				prv->socket, 0,
+				tdnbd_reader_cb,
+				(void *)prv);
+	if (prv->reader_event_id < 0) {
+		tdnbd_disable(prv, EIO);
+		return 0;
+	}
+
+	list_for_each_entry(pos, &prv->pending_reqs, queue) {
+		gettimeofday(&pos->issued, NULL);
+		n++;
+	}
+
+	INFO("Reconnected, replaying %d requests", n);
+
+	prv->reconnecting = 0;
+	prv->reconnects++;
+
+	if (n)
+		enable_write_queue(prv);
+
+	return 0;
+}
+
+static void
+tdnbd_reconnect_wait(struct tdnbd_data *prv, int fd, int mode, int timeout)
+{
+	prv->reconnect_event =
+		tapdisk_server_register_event(mode, fd, timeout,
+				tdnbd_reconnect_cb, prv);
+	if (prv->reconnect_event < 0) {
+		ERROR("Can't wait to reconnect: %d", prv->reconnect_event);
+		if (prv->socket >= 0)
+			close(prv->socket);
+		prv->socket = -1;
+		tdnbd_disable(prv, EIO);
+	}
+}
+
+static void
+tdnbd_reconnect(struct tdnbd_data *prv)
+{
+	struct timeval now;
+	int sock, opt = 1;
+
+	gettimeofday(&now, NULL);
+	if (now.tv_sec - prv->lost.tv_sec >= NBD_RECONNECT_TIMEOUT) {
+		ERROR("Couldn't reconnect in %ds, giving up",
+				NBD_RECONNECT_TIMEOUT);
+		tdnbd_disable(prv, EIO);
+		return;
+	}
+
+	if (prv->name) {
+		prv->socket = tdnbd_retreive_passed_fd(prv->name);
+		if (prv->socket >= 0) {
+			INFO("Found passed fd. Reconnecting...");
+			fcntl(prv->socket, F_SETFL,
+					fcntl(prv->socket, F_GETFL) & ~O_NONBLOCK);
+			if (!tdnbd_reconnected(prv))
+				return;
+		}
+		goto retry;
+	}
+
+	sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (sock < 0) {
+		ERROR("Could not create socket: %s\n", strerror(errno));
+		goto retry;
+	}
+
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (void *)&opt, sizeof(opt));
+	fcntl(sock, F_SETFL, O_NONBLOCK);
+	prv->socket = sock;
+
+	if (connect(sock, (struct sockaddr *)prv->remote,
+				sizeof(struct sockaddr_in)) < 0) {
+		if (errno == EINPROGRESS) {
+			tdnbd_reconnect_wait(prv, sock,
+					SCHEDULER_POLL_WRITE_FD |
+					SCHEDULER_POLL_TIMEOUT,
+					NBD_RECONNECT_INTERVAL);
+			return;
+		}
+
+		close(sock);
+		prv->socket = -1;
+		goto retry;
+	}
+
+	fcntl(sock, F_SETFL, 0);
+	if (!tdnbd_reconnected(prv))
+		return;
+
+retry:
+	tdnbd_reconnect_wait(prv, -1, SCHEDULER_POLL_TIMEOUT,
+			NBD_RECONNECT_INTERVAL);
+}
+
+static void
+tdnbd_reconnect_cb(event_id_t id, char mode, void *data)
+{
+	struct tdnbd_data *prv = data;
+	socklen_t len;
+	int err = 0;
+
+	tapdisk_server_unregister_event(prv->reconnect_event);
+	prv->reconnect_event = -1;
+
+	if (prv->socket < 0) {
+		tdnbd_reconnect(prv);
+		return;
+	}
+
+	/* a connect in progress */
+	if (mode & SCHEDULER_POLL_WRITE_FD) {
+		len = sizeof(err);
+		if (getsockopt(prv->socket, SOL_SOCKET, SO_ERROR, &err, &len))
+			err = errno;
+	} else
+		err = ETIMEDOUT;
+
+	if (!err) {
+		fcntl(prv->socket, F_SETFL, 0);
+		if (!tdnbd_reconnected(prv))
+			return;
+	} else {
+		ERROR("Could not connect to peer: %s", strerror(err));
+		close(prv->socket);
+		prv->socket = -1;
+	}
+
+	tdnbd_reconnect_wait(prv, -1, SCHEDULER_POLL_TIMEOUT,
+			NBD_RECONNECT_INTERVAL);
+}
+
+static void
+tdnbd_connection_lost(struct tdnbd_data *prv, int err)
+{
+	struct td_nbd_request *pos;
+
+	if (prv->closed || prv->reconnecting || !prv->driver) {
+		tdnbd_disable(prv, err);
+		return;
+	}
+
+	ERROR("Connection lost (%d), reconnecting", err);
+
+	tapdisk_server_unregister_event(prv->reader_event_id);
+	prv->reader_event_id = -1;
+	disable_write_queue(prv);
+
+	close(prv->socket);
+	prv->socket = -1;
+
+	list_splice(&prv->sent_reqs, &prv->pending_reqs);
+	INIT_LIST_HEAD(&prv->sent_reqs);
+
+	list_for_each_entry(pos, &prv->pending_reqs, queue) {
+		pos->header.so_far = 0;
+		pos->body.so_far   = 0;
+		pos->sent          = 0;
+	}
+
+	prv->curr_reply_req = NULL;
+	prv->rbuf_start     = 0;
+	prv->rbuf_end       = 0;
+
+	prv->reconnecting = 1;
+	gettimeofday(&prv->lost, NULL);
+
+	tdnbd_reconnect(prv);
+}
+
 /* -- interface -- */
 
 static int tdnbd_close(td_driver_t*);
 
+static void
+tdnbd_sync_cb(event_id_t id, char mode, void *data)
+{
+	struct tdnbd_data *prv = data;
+	td_request_t treq;
+	uint64_t val;
+	int gcc, err;
+
+	gcc = read(prv->sync_efd, &val, sizeof(val));
+	if (gcc) {};
+
+	if (prv->closed == 3) {
+		tdnbd_sync_complete(prv, -EIO);
+		return;
+	}
+
+	bzero(&treq, sizeof(treq));
+
+	err = tdnbd_queue_request(prv, NBD_CMD_FLUSH, 0, NULL, 0, treq, 1);
+	if (err)
+		tdnbd_sync_complete(prv, err);
+}
+
+static void
+tdnbd_sync_destroy(struct tdnbd_data *prv)
+{
+	if (prv->sync_event >= 0) {
+		tapdisk_server_unregister_event(prv->sync_event);
+		prv->sync_event = -1;
+	}
+
+	if (prv->sync_efd >= 0) {
+		close(prv->sync_efd);
+		prv->sync_efd = -1;
+	}
+
+	pthread_cond_destroy(&prv->sync_cond);
+	pthread_mutex_destroy(&prv->sync_lock);
+}
+
 static int
 tdnbd_open(td_driver_t* driver, const char* name, td_flag_t flags)
 {
 	struct tdnbd_data *prv;
 	char peer_ip[256];
-	int port;
+	int port, depth;
 	int rc;
 	int i;
 
@@ -731,19 +1255,37 @@ tdnbd_open(td_driver_t* driver, const char* name, td_flag_t flags)
 	INFO("Opening nbd export to %s (flags=%x)\n", name, flags);
 
 	prv->writer_event_id = -1;
+	prv->reader_event_id = -1;
+	prv->timeout_event = -1;
+	prv->reconnect_event = -1;
+	prv->sync_efd = -1;
+	prv->sync_event = -1;
+	pthread_mutex_init(&prv->sync_lock, NULL);
+	pthread_cond_init(&prv->sync_cond, NULL);
 	INIT_LIST_HEAD(&prv->sent_reqs);
 	INIT_LIST_HEAD(&prv->pending_reqs);
 	INIT_LIST_HEAD(&prv->free_reqs);
-	for (i = 0; i < MAX_NBD_REQS; i++) {
-		INIT_LIST_HEAD(&prv->requests[i].queue);
-		prv->requests[i].timeout_event = -1;
-		list_add(&prv->requests[i].queue, &prv->free_reqs);
-	}
-	prv->nr_free_count = MAX_NBD_REQS;
-	prv->cur_reply_qio.buffer = (char *)&prv->current_reply;
-	prv->cur_reply_qio.len = sizeof(struct nbd_reply);
-	rc = sscanf(name, "%255[^:]:%d", peer_ip, &port);
-	if (rc == 2) {
+
+	/* host:port[:depth], the depth bounds the requests in flight */
+	depth = MAX_NBD_REQS;
+	rc = sscanf(name, "%255[^:]:%d:%d", peer_ip, &port, &depth);
+	if (depth < 1 || depth > NBD_MAX_DEPTH) {
+		ERROR("Bad queue depth %d, max %d", depth, NBD_MAX_DEPTH);
+		return -EINVAL;
+	}
+
+	prv->requests = calloc(depth, sizeof(struct td_nbd_request));
+	if (!prv->requests)
+		return -ENOMEM;
+
+	for (i = 0; i < depth; i++) {
+		prv->requests[i].idx = i;
+		list_add_tail(&prv->requests[i].queue, &prv->free_reqs);
+	}
+	prv->depth = depth;
+	prv->nr_free_count = depth;
+
+	if (rc >= 2) {
 		prv->peer_ip = malloc(strlen(peer_ip) + 1);
 		if (!prv->peer_ip) {
 			ERROR("Failure to malloc for NBD destination");
@@ -779,8 +1321,26 @@ tdnbd_open(td_driver_t* driver, const char* name, td_flag_t flags)
 				tdnbd_reader_cb,
 				(void *)prv);
 
+	if (prv->server_flags & NBD_FLAG_SEND_FLUSH) {
+		prv->sync_efd = tapdisk_sys_eventfd(0);
+		if (prv->sync_efd >= 0)
+			prv->sync_event =
+				tapdisk_server_register_event(
+					SCHEDULER_POLL_READ_FD,
+					prv->sync_efd, 0,
+					tdnbd_sync_cb, prv);
+		if (prv->sync_event < 0)
+			ERROR("No flushes to the server, "
+					"syncs will be no-ops");
+	}
+
+	prv->timeout_event =
+		tapdisk_server_register_event(SCHEDULER_POLL_TIMEOUT,
+				-1, 1, tdnbd_timeout_cb, prv);
+
 	prv->flags = flags;
 	prv->closed = 0;
+	prv->driver = driver;
 
 	if (flags & TD_OPEN_SECONDARY)
 		INFO("Opening in secondary mode: Read requests will be "
@@ -798,12 +1358,17 @@ tdnbd_close(td_driver_t* driver)
 
 	bzero(&treq, sizeof(treq));
 
+	tdnbd_sync_destroy(prv);
+
+	if (prv->reconnecting)
+		tdnbd_disable(prv, EIO);
+
 	if (prv->closed == 3) {
 		INFO("NBD close: already decided that the connection is dead.");
 		if (prv->socket >= 0) 
 			close(prv->socket);
 		prv->socket = -1;
-		return 0;
+		goto out;
 	}
 
 	/* Send a close packet */
@@ -833,6 +1398,15 @@ tdnbd_close(td_driver_t* driver)
 		prv->socket = -1;
 	}
 
+out:
+	if (prv->timeout_event >= 0) {
+		tapdisk_server_unregister_event(prv->timeout_event);
+		prv->timeout_event = -1;
+	}
+
+	free(prv->requests);
+	prv->requests = NULL;
+
 	return 0;
 }
 
@@ -840,8 +1414,8 @@ static void
 tdnbd_queue_read(td_driver_t* driver, td_request_t treq)
 {
 	struct tdnbd_data *prv = (struct tdnbd_data *)driver->data;
-	int      size    = treq.secs * driver->info.sector_size;
-	uint64_t offset  = treq.sec * (uint64_t)driver->info.sector_size;
+	int      size    = treq.secs << SECTOR_SHIFT;
+	uint64_t offset  = (uint64_t)treq.sec << SECTOR_SHIFT;
 
 	if (prv->flags & TD_OPEN_SECONDARY)
 		td_forward_request(treq);
@@ -855,13 +1429,62 @@ static void
 tdnbd_queue_write(td_driver_t* driver, td_request_t treq)
 {
 	struct tdnbd_data *prv = (struct tdnbd_data *)driver->data;
-	int      size    = treq.secs * driver->info.sector_size;
-	uint64_t offset  = treq.sec * (uint64_t)driver->info.sector_size;
+	int      size    = treq.secs << SECTOR_SHIFT;
+	uint64_t offset  = (uint64_t)treq.sec << SECTOR_SHIFT;
+
+	/* zeros cost a header, when the server takes them as such */
+	if ((prv->server_flags & NBD_FLAG_SEND_WRITE_ZEROES) &&
+	    !*(char *)treq.buf && !memcmp(treq.buf, treq.buf + 1, size - 1)) {
+		tdnbd_queue_request(prv, NBD_CMD_WRITE_ZEROES,
+				offset, NULL, size, treq, 0);
+		return;
+	}
 
 	tdnbd_queue_request(prv, NBD_CMD_WRITE,
 			offset, treq.buf, size, treq, 0);
 }
 
+static void
+tdnbd_queue_discard(td_driver_t* driver, td_request_t treq)
+{
+	struct tdnbd_data *prv = (struct tdnbd_data *)driver->data;
+	uint32_t size    = treq.secs << SECTOR_SHIFT;
+	uint64_t offset  = (uint64_t)treq.sec << SECTOR_SHIFT;
+
+	if (!(prv->server_flags & NBD_FLAG_SEND_TRIM)) {
+		td_complete_request(treq, -EOPNOTSUPP);
+		return;
+	}
+
+	tdnbd_queue_request(prv, NBD_CMD_TRIM, offset, NULL, size, treq, 0);
+}
+
+/* called by the flush thread: wait for the server to flush on the loop */
+static int
+tdnbd_sync(td_driver_t *driver)
+{
+	struct tdnbd_data *prv = (struct tdnbd_data *)driver->data;
+	uint64_t val = 1;
+	int err, gcc;
+
+	if (prv->sync_event < 0)
+		return 0;
+
+	pthread_mutex_lock(&prv->sync_lock);
+
+	prv->sync_done = 0;
+	gcc = write(prv->sync_efd, &val, sizeof(val));
+	if (gcc) {};
+
+	while (!prv->sync_done)
+		pthread_cond_wait(&prv->sync_cond, &prv->sync_lock);
+
+	err = prv->sync_err;
+	pthread_mutex_unlock(&prv->sync_lock);
+
+	return err;
+}
+
 static int
 tdnbd_get_parent_id(td_driver_t* driver, td_disk_id_t* id)
 {
@@ -883,6 +1506,8 @@ struct tap_disk tapdisk_nbd = {
 	.td_close           = tdnbd_close,
 	.td_queue_read      = tdnbd_queue_read,
 	.td_queue_write     = tdnbd_queue_write,
+	.td_queue_discard   = tdnbd_queue_discard,
+	.td_sync            = tdnbd_sync,
 	.td_get_parent_id   = tdnbd_get_parent_id,
 	.td_validate_parent = tdnbd_validate_parent,
 };
@@ -0,0 +1,496 @@
+/*
+ * Sequential readahead in front of a slow (e.g. remote) image chain.
+ * Copyright (C) Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2.1 only
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tapdisk.h"
+#include "tapdisk-driver.h"
+#include "tapdisk-server.h"
+#include "tapdisk-interface.h"
+#include "tapdisk-vbd.h"
+
+#define WARN(_f, _a...) tlog_syslog(TLOG_WARN, "WARNING: "_f "in %s:%d", \
+				    ##_a, __func__, __LINE__)
+#define BUG_ON(_cond)   if (unlikely(_cond)) { td_panic(); }
+
+#define MIN(a, b)       ((a) < (b) ? (a) : (b))
+
+#define TD_RA_EXTENTS                   32
+#define TD_RA_EXTENT_SECS               256     /* 128k */
+#define TD_RA_WINDOW_MIN                2       /* extents */
+#define TD_RA_WINDOW_MAX                16
+#define TD_RA_STREAMS                   4
+#define TD_RA_ALIGN                     4096
+
+/*
+ * NB. A read continuing where a stream left off makes the stream
+ * sequential, and the extents of its window beyond the read get
+ * prefetched. The prefetches are queued to the VBD as requests of
+ * their own, they enter the chain above us and are forwarded
+ * when they arrive here. Reads entirely covered by prefetched extents
+ * complete from the buffer, and double the window. Reads which match
+ * no stream recycle the least recently used one, dropping its window.
+ *
+ * Extents are released once a read consumed their end, or reclaimed
+ * least recently used first. Writes and discards invalidate overlapped
+ * extents. A read which overlaps an extent still in flight goes to
+ * the image, as does anything partially cached.
+ */
+
+typedef struct td_ra                    td_ra_t;
+typedef struct td_ra_extent             td_ra_extent_t;
+typedef struct td_ra_stream             td_ra_stream_t;
+
+#define TD_RA_FREE                      0
+#define TD_RA_READING                   1
+#define TD_RA_VALID                     2
+
+struct td_ra_extent {
+	int                             state;
+	int                             stale;
+	int                             hit;
+
+	td_sector_t                     sec;
+	int                             secs;
+	char                           *buf;
+
+	td_vbd_request_t                vreq;
+	struct td_iovec                 iov;
+
+	struct list_head                entry;
+	td_ra_t                        *ra;
+};
+
+struct td_ra_stream {
+	td_sector_t                     next;
+	td_sector_t                     ahead;
+	unsigned int                    window;
+	unsigned long                   used;
+};
+
+struct td_ra_stats {
+	unsigned long long              hits;
+	unsigned long long              misses;
+	unsigned long long              random;
+	unsigned long long              prefetched;
+	unsigned long long              wasted;
+	unsigned long long              invalidated;
+	unsigned long long              errors;
+};
+
+struct td_ra {
+	char                           *buf;
+	td_ra_extent_t                  extv[TD_RA_EXTENTS];
+
+	struct list_head                free;
+	struct list_head                valid;
+	int                             n_reading;
+
+	td_ra_stream_t                  streams[TD_RA_STREAMS];
+	unsigned long                   clock;
+
+	struct td_ra_stats              stats;
+};
+
+#define td_ra_for_each_extent(_ext, _ra)				\
+	for (_ext = (_ra)->extv; _ext < &(_ra)->extv[TD_RA_EXTENTS]; _ext++)
+
+static inline td_sector_t
+ra_extent_end(const td_ra_extent_t *ext)
+{
+	return ext->sec + ext->secs;
+}
+
+static void
+ra_extent_put(td_ra_t *ra, td_ra_extent_t *ext)
+{
+	ext->state = TD_RA_FREE;
+	list_move(&ext->entry, &ra->free);
+}
+
+static td_ra_extent_t *
+ra_extent_get(td_ra_t *ra)
+{
+	td_ra_extent_t *ext;
+
+	if (!list_empty(&ra->free))
+		ext = list_entry(ra->free.next, td_ra_extent_t, entry);
+	else if (!list_empty(&ra->valid)) {
+		ext = list_entry(ra->valid.next, td_ra_extent_t, entry);
+		if (!ext->hit)
+			ra->stats.wasted += ext->secs;
+	} else
+		return NULL;
+
+	list_del_init(&ext->entry);
+	return ext;
+}
+
+static td_ra_extent_t *
+ra_extent_find(td_ra_t *ra, td_sector_t sec)
+{
+	td_ra_extent_t *ext;
+
+	td_ra_for_each_extent(ext, ra)
+		if (ext->state == TD_RA_VALID &&
+		    ext->sec <= sec && sec < ra_extent_end(ext))
+			return ext;
+
+	return NULL;
+}
+
+static int
+ra_covered(td_ra_t *ra, td_sector_t sec, td_sector_t end)
+{
+	td_ra_extent_t *ext;
+
+	while (sec < end) {
+		ext = ra_extent_find(ra, sec);
+		if (!ext)
+			return 0;
+		sec = ra_extent_end(ext);
+	}
+
+	return 1;
+}
+
+static int
+ra_read_cached(td_ra_t *ra, td_request_t treq)
+{
+	td_sector_t sec, end;
+	td_ra_extent_t *ext;
+
+	sec = treq.sec;
+	end = treq.sec + treq.secs;
+
+	if (!ra_covered(ra, sec, end))
+		return 0;
+
+	while (sec < end) {
+		td_sector_t n;
+
+		ext = ra_extent_find(ra, sec);
+		n   = MIN(end, ra_extent_end(ext)) - sec;
+
+		memcpy((char *)treq.buf + ((sec - treq.sec) << SECTOR_SHIFT),
+		       ext->buf + ((sec - ext->sec) << SECTOR_SHIFT),
+		       n << SECTOR_SHIFT);
+
+		ext->hit = 1;
+		sec     += n;
+
+		if (ra_extent_end(ext) <= end)
+			ra_extent_put(ra, ext);
+		else
+			list_move_tail(&ext->entry, &ra->valid);
+	}
+
+	td_complete_request(treq, 0);
+	return 1;
+}
+
+static void
+ra_invalidate(td_ra_t *ra, td_sector_t sec, int secs)
+{
+	td_ra_extent_t *ext;
+
+	td_ra_for_each_extent(ext, ra) {
+		if (ext->state == TD_RA_FREE ||
+		    ra_extent_end(ext) <= sec || sec + secs <= ext->sec)
+			continue;
+
+		ra->stats.invalidated++;
+
+		if (ext->state == TD_RA_READING)
+			ext->stale = 1;
+		else
+			ra_extent_put(ra, ext);
+	}
+}
+
+static void
+__ra_prefetch_done(td_vbd_request_t *vreq, int error,
+		   void *token, int final)
+{
+	td_ra_extent_t *ext = token;
+	td_ra_t *ra = ext->ra;
+
+	BUG_ON(ext->state != TD_RA_READING);
+	ra->n_reading--;
+
+	if (error)
+		ra->stats.errors++;
+
+	if (error || ext->stale) {
+		ra_extent_put(ra, ext);
+		return;
+	}
+
+	ext->state = TD_RA_VALID;
+	list_add_tail(&ext->entry, &ra->valid);
+}
+
+static void
+ra_prefetch_extent(td_ra_t *ra, td_vbd_t *vbd, td_ra_extent_t *ext,
+		   td_sector_t sec, int secs)
+{
+	td_vbd_request_t *vreq;
+	int err;
+
+	ext->state = TD_RA_READING;
+	ext->stale = 0;
+	ext->hit   = 0;
+	ext->sec   = sec;
+	ext->secs  = secs;
+
+	ext->iov.base = ext->buf;
+	ext->iov.secs = secs;
+
+	vreq         = &ext->vreq;
+	memset(vreq, 0, sizeof(*vreq));
+	vreq->op     = TD_OP_READ;
+	vreq->sec    = sec;
+	vreq->iov    = &ext->iov;
+	vreq->iovcnt = 1;
+	vreq->cb     = __ra_prefetch_done;
+	vreq->token  = ext;
+	vreq->name   = "ra";
+
+	ra->n_reading++;
+	ra->stats.prefetched += secs;
+
+	err = tapdisk_vbd_queue_request(vbd, vreq);
+	BUG_ON(err);
+}
+
+static void
+ra_prefetch(td_ra_t *ra, td_driver_t *driver, td_vbd_t *vbd,
+	    td_ra_stream_t *stream)
+{
+	td_sector_t limit, size = driver->info.size;
+	td_ra_extent_t *ext;
+
+	limit = stream->next + stream->window * TD_RA_EXTENT_SECS;
+	limit = MIN(limit, size);
+
+	if (stream->ahead < stream->next)
+		stream->ahead = stream->next;
+
+	while (stream->ahead < limit) {
+		int secs;
+
+		ext = ra_extent_get(ra);
+		if (!ext)
+			break;
+
+		secs = MIN(TD_RA_EXTENT_SECS, size - stream->ahead);
+		ra_prefetch_extent(ra, vbd, ext, stream->ahead, secs);
+
+		stream->ahead += secs;
+	}
+}
+
+static td_ra_stream_t *
+ra_stream_find(td_ra_t *ra, td_sector_t sec)
+{
+	td_ra_stream_t *s, *lru = NULL;
+
+	for (s = ra->streams; s < &ra->streams[TD_RA_STREAMS]; s++) {
+		if (s->used && s->next == sec)
+			return s;
+		if (!lru || s->used < lru->used)
+			lru = s;
+	}
+
+	ra->stats.random++;
+
+	lru->ahead  = 0;
+	lru->window = 0;
+
+	return lru;
+}
+
+static void
+ra_queue_read(td_driver_t *driver, td_request_t treq)
+{
+	td_ra_t *ra = driver->data;
+	td_ra_stream_t *stream;
+	unsigned int max;
+	int hit, seq;
+
+	/* the storage profile's window, once the chain is set up */
+	max = TD_RA_WINDOW_MAX;
+	if (driver->storage > 0)
+		max = driver->profile.readahead;
+
+	/* our own prefetches, on their way down */
+	if (treq.vreq->cb == __ra_prefetch_done) {
+		td_forward_request(treq);
+		return;
+	}
+
+	stream = ra_stream_find(ra, treq.sec);
+	seq    = stream->used != 0 && stream->next == treq.sec;
+
+	hit = ra_read_cached(ra, treq);
+	if (hit)
+		ra->stats.hits++;
+	else {
+		ra->stats.misses++;
+		td_forward_request(treq);
+	}
+
+	if (seq && max) {
+		if (!stream->window)
+			stream->window = MIN(TD_RA_WINDOW_MIN, max);
+		else if (hit)
+			stream->window = MIN(stream->window * 2, max);
+	}
+
+	stream->next = treq.sec + treq.secs;
+	stream->used = ++ra->clock;
+
+	if (stream->window)
+		ra_prefetch(ra, driver, treq.vreq->vbd, stream);
+}
+
+static void
+ra_queue_write(td_driver_t *driver, td_request_t treq)
+{
+	td_ra_t *ra = driver->data;
+
+	ra_invalidate(ra, treq.sec, treq.secs);
+	td_forward_request(treq);
+}
+
+static int
+ra_close(td_driver_t *driver)
+{
+	td_ra_t *ra = driver->data;
+
+	if (ra->n_reading)
+		WARN("%d prefetches in flight\n", ra->n_reading);
+
+	free(ra->buf);
+	ra->buf = NULL;
+
+	return 0;
+}
+
+static int
+ra_open(td_driver_t *driver, const char *name, td_flag_t flags)
+{
+	td_ra_t *ra = driver->data;
+	td_ra_extent_t *ext;
+	size_t size;
+	int err;
+
+	memset(ra, 0, sizeof(*ra));
+	INIT_LIST_HEAD(&ra->free);
+	INIT_LIST_HEAD(&ra->valid);
+
+	size = (size_t)TD_RA_EXTENTS * TD_RA_EXTENT_SECS << SECTOR_SHIFT;
+
+	err = posix_memalign((void **)&ra->buf, TD_RA_ALIGN, size);
+	if (err) {
+		ra->buf = NULL;
+		return -err;
+	}
+
+	td_ra_for_each_extent(ext, ra) {
+		ext->ra  = ra;
+		ext->buf = ra->buf +
+			((ext - ra->extv) * TD_RA_EXTENT_SECS << SECTOR_SHIFT);
+		INIT_LIST_HEAD(&ext->entry);
+		ra_extent_put(ra, ext);
+	}
+
+	return 0;
+}
+
+static int
+ra_get_parent_id(td_driver_t *driver, td_disk_id_t *id)
+{
+	return -EINVAL;
+}
+
+static int
+ra_validate_parent(td_driver_t *driver,
+		   td_driver_t *pdriver, td_flag_t flags)
+{
+	return 0;
+}
+
+static void
+ra_stats(td_driver_t *driver, td_stats_t *st)
+{
+	td_ra_t *ra = driver->data;
+	td_ra_extent_t *ext;
+	td_ra_stream_t *s;
+	int n_valid = 0;
+
+	td_ra_for_each_extent(ext, ra)
+		n_valid += ext->state == TD_RA_VALID;
+
+	tapdisk_stats_field(st, "extents", "{");
+	tapdisk_stats_field(st, "max", "d", TD_RA_EXTENTS);
+	tapdisk_stats_field(st, "secs", "d", TD_RA_EXTENT_SECS);
+	tapdisk_stats_field(st, "valid", "d", n_valid);
+	tapdisk_stats_field(st, "reading", "d", ra->n_reading);
+	tapdisk_stats_leave(st, '}');
+
+	tapdisk_stats_field(st, "streams", "[");
+	for (s = ra->streams; s < &ra->streams[TD_RA_STREAMS]; s++) {
+		if (!s->used)
+			continue;
+		tapdisk_stats_enter(st, '{');
+		tapdisk_stats_field(st, "next", "llu",
+				    (unsigned long long)s->next);
+		tapdisk_stats_field(st, "window", "u", s->window);
+		tapdisk_stats_leave(st, '}');
+	}
+	tapdisk_stats_leave(st, ']');
+
+	tapdisk_stats_field(st, "hits", "llu", ra->stats.hits);
+	tapdisk_stats_field(st, "misses", "llu", ra->stats.misses);
+	tapdisk_stats_field(st, "random", "llu", ra->stats.random);
+	tapdisk_stats_field(st, "prefetched", "llu", ra->stats.prefetched);
+	tapdisk_stats_field(st, "wasted", "llu", ra->stats.wasted);
+	tapdisk_stats_field(st, "invalidated", "llu", ra->stats.invalidated);
+	tapdisk_stats_field(st, "errors", "llu", ra->stats.errors);
+}
+
+struct tap_disk tapdisk_ra = {
+	.disk_type                  = "tapdisk_ra",
+	.flags                      = 0,
+	.private_data_size          = sizeof(td_ra_t),
+	.td_open                    = ra_open,
+	.td_close                   = ra_close,
+	.td_queue_read              = ra_queue_read,
+	.td_queue_write             = ra_queue_write,
+	.td_queue_discard           = ra_queue_write,
+	.td_get_parent_id           = ra_get_parent_id,
+	.td_validate_parent         = ra_validate_parent,
+	.td_stats                   = ra_stats,
+};
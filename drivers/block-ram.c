@@ -24,26 +24,64 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
-#include <sys/statvfs.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
 #include <linux/fs.h>
 #include <string.h>
 
+#include "list.h"
 #include "tapdisk.h"
+#include "tapdisk-utils.h"
 #include "tapdisk-driver.h"
 #include "tapdisk-interface.h"
 
-void *img;
-long int   disksector_size;
-long int   disksize;
-long int   diskinfo;
-static int connections = 0;
+/*
+ * Sparse RAM disk. Memory comes in chunks of TDRAM_CHUNK_SIZE,
+ * hugepages where the host has some, allocated on first write. Until
+ * then, reads come from the image, or are zeroes where the image
+ * holds no data, so opening takes no time and memory grows with use.
+ *
+ * The image is left untouched, unless named wt:<path>: writes then go
+ * through to it before they complete.
+ *
+ * Opens of the same image share its memory.
+ */
+
+#define TDRAM_CHUNK_SHIFT    21
+#define TDRAM_CHUNK_SIZE     (1ULL << TDRAM_CHUNK_SHIFT)
+#define TDRAM_CHUNK_SECS     (TDRAM_CHUNK_SIZE >> SECTOR_SHIFT)
+#define TDRAM_WRITE_THROUGH  "wt:"
+
+enum {
+	TDRAM_UNKNOWN = 0,
+	TDRAM_HOLE,
+	TDRAM_DATA,
+};
+
+struct tdram_image {
+	char                *name;
+	int                  fd;
+	int                  refcnt;
+	int                  wt;
+	td_disk_info_t       info;
+
+	uint64_t             n_chunks;
+	char               **chunks;
+	uint8_t             *backing;
+
+	uint64_t             allocated;
+	uint64_t             huge;
+
+	struct list_head     next;
+};
 
 struct tdram_state {
-        int fd;
+	struct tdram_image  *img;
 };
 
+static LIST_HEAD(tdram_images);
+
 /*Get Image size, secsize*/
 static int get_image_info(int fd, td_disk_info_t *info)
 {
@@ -63,171 +101,375 @@ static int get_image_info(int fd, td_disk_info_t *info)
 			DPRINTF("ERR: BLKGETSIZE failed, couldn't stat image");
 			return -EINVAL;
 		}
-
-		DPRINTF("Image size: \n\tpre sector_shift  [%llu]\n\tpost "
-			"sector_shift [%llu]\n",
-			(long long unsigned)(info->size << SECTOR_SHIFT),
-			(long long unsigned)info->size);
-
-		/*Get the sector size*/
-#if defined(BLKSSZGET)
-		{
-			info->sector_size = DEFAULT_SECTOR_SIZE;
-			ioctl(fd, BLKSSZGET, &info->sector_size);
-			
-			if (info->sector_size != DEFAULT_SECTOR_SIZE)
-				DPRINTF("Note: sector size is %ld (not %d)\n",
-					info->sector_size, DEFAULT_SECTOR_SIZE);
-		}
-#else
-		info->sector_size = DEFAULT_SECTOR_SIZE;
-#endif
-
 	} else {
 		/*Local file? try fstat instead*/
 		info->size = (stat.st_size >> SECTOR_SHIFT);
-		info->sector_size = DEFAULT_SECTOR_SIZE;
-		DPRINTF("Image size: \n\tpre sector_shift  [%llu]\n\tpost "
-			"sector_shift [%llu]\n",
-			(long long unsigned)(info->size << SECTOR_SHIFT),
-			(long long unsigned)info->size);
 	}
 
-	if (info->size == 0) {		
+	DPRINTF("Image size: \n\tpre sector_shift  [%llu]\n\tpost "
+		"sector_shift [%llu]\n",
+		(long long unsigned)(info->size << SECTOR_SHIFT),
+		(long long unsigned)info->size);
+
+	tapdisk_get_sector_size(fd, &info->sector_size,
+				&info->physical_sector_size);
+
+	if (info->size == 0) {
 		info->size =((uint64_t) MAX_RAMDISK_SIZE);
 		info->sector_size = DEFAULT_SECTOR_SIZE;
 	}
 	info->info = 0;
 
-        /*Store variables locally*/
-	disksector_size = info->sector_size;
-	disksize        = info->size;
-	diskinfo        = info->info;
 	DPRINTF("Image sector_size: \n\t[%lu]\n",
 		info->sector_size);
 
 	return 0;
 }
 
-/* Open the disk file and initialize ram state. */
-int tdram_open (td_driver_t *driver, const char *name, td_flag_t flags)
+static char *
+tdram_map_chunk(struct tdram_image *img)
 {
-	char *p;
-	uint64_t size;
-	int i, fd, ret = 0, count = 0, o_flags;
-	struct tdram_state *prv = (struct tdram_state *)driver->data;
+	void *p;
 
-	connections++;
-
-	if (connections > 1) {
-		driver->info.sector_size = disksector_size;
-		driver->info.size        = disksize;
-		driver->info.info        = diskinfo; 
-		DPRINTF("Image already open, returning parameters:\n");
-		DPRINTF("Image size: \n\tpre sector_shift  [%llu]\n\tpost "
-			"sector_shift [%llu]\n",
-			(long long unsigned)(driver->info.size << SECTOR_SHIFT),
-			(long long unsigned)driver->info.size);
-		DPRINTF("Image sector_size: \n\t[%lu]\n",
-			driver->info.sector_size);
-
-		prv->fd = -1;
-		goto done;
-	}
-
-	/* Open the file */
-	o_flags = O_DIRECT | O_LARGEFILE | 
-		((flags == TD_OPEN_RDONLY) ? O_RDONLY : O_RDWR);
-        fd = open(name, o_flags);
-
-        if ((fd == -1) && (errno == EINVAL)) {
-
-                /* Maybe O_DIRECT isn't supported. */
-		o_flags &= ~O_DIRECT;
-                fd = open(name, o_flags);
-                if (fd != -1) DPRINTF("WARNING: Accessing image without"
-                                     "O_DIRECT! (%s)\n", name);
-
-        } else if (fd != -1) DPRINTF("open(%s) with O_DIRECT\n", name);
-	
-        if (fd == -1) {
-		DPRINTF("Unable to open [%s]!\n",name);
-        	ret = 0 - errno;
-        	goto done;
-        }
-
-        prv->fd = fd;
-
-	ret = get_image_info(fd, &driver->info);
-	size = MAX_RAMDISK_SIZE;
-
-	if (driver->info.size > size) {
-		DPRINTF("Disk exceeds limit, must be less than [%d]MB",
-			(MAX_RAMDISK_SIZE<<SECTOR_SHIFT)>>20);
-		return -ENOMEM;
+	p = mmap(NULL, TDRAM_CHUNK_SIZE, PROT_READ|PROT_WRITE,
+		 MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+	if (p != MAP_FAILED) {
+		img->huge++;
+		return p;
 	}
 
-	/*Read the image into memory*/
-	if (posix_memalign(&img, DEFAULT_SECTOR_SIZE,
-			   driver->info.size << SECTOR_SHIFT)) {
-		DPRINTF("Mem malloc failed\n");
-		return -errno;
+	p = mmap(NULL, TDRAM_CHUNK_SIZE, PROT_READ|PROT_WRITE,
+		 MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+
+	madvise(p, TDRAM_CHUNK_SIZE, MADV_HUGEPAGE);
+
+	return p;
+}
+
+static uint64_t
+tdram_chunk_bytes(struct tdram_image *img, uint64_t idx)
+{
+	uint64_t off = idx << TDRAM_CHUNK_SHIFT;
+	uint64_t end = img->info.size << SECTOR_SHIFT;
+
+	return end - off < TDRAM_CHUNK_SIZE ? end - off : TDRAM_CHUNK_SIZE;
+}
+
+/*
+ * Whether the image holds data under chunk @idx. Images which can't
+ * tell, such as block devices, always do.
+ */
+static int
+tdram_backed(struct tdram_image *img, uint64_t idx)
+{
+	off_t off, pos;
+
+	if (img->backing[idx] == TDRAM_UNKNOWN) {
+		off = idx << TDRAM_CHUNK_SHIFT;
+		pos = lseek(img->fd, off, SEEK_DATA);
+
+		if (pos < 0 && errno == ENXIO)
+			img->backing[idx] = TDRAM_HOLE;
+		else if (pos >= 0 &&
+			 pos >= off + (off_t)tdram_chunk_bytes(img, idx))
+			img->backing[idx] = TDRAM_HOLE;
+		else
+			img->backing[idx] = TDRAM_DATA;
 	}
-	p = img;
-	DPRINTF("Reading %llu bytes.......",
-		(long long unsigned)driver->info.size << SECTOR_SHIFT);
 
-	for (i = 0; i < driver->info.size; i++) {
-		ret = read(prv->fd, p, driver->info.sector_size);
-		if (ret != driver->info.sector_size) {
-			DPRINTF("ret = %d, errno = %d\n", ret, errno);
-			ret = 0 - errno;
+	return img->backing[idx] == TDRAM_DATA;
+}
+
+static int
+tdram_read_image(struct tdram_image *img, char *buf,
+		 uint64_t off, size_t size)
+{
+	ssize_t n;
+
+	while (size) {
+		n = pread(img->fd, buf, size, off);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+
+		/* past the end of a file shorter than the disk */
+		if (!n) {
+			memset(buf, 0, size);
 			break;
-		} else {
-			count += ret;
-			p = img + count;
 		}
+
+		buf  += n;
+		off  += n;
+		size -= n;
 	}
-	DPRINTF("[%d]\n",count);
-	if (count != driver->info.size << SECTOR_SHIFT) {
-		ret = -1;
-	} else {
-		ret = 0;
+
+	return 0;
+}
+
+static int
+tdram_write_image(struct tdram_image *img, const char *buf,
+		  uint64_t off, size_t size)
+{
+	ssize_t n;
+
+	while (size) {
+		n = pwrite(img->fd, buf, size, off);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+
+		buf  += n;
+		off  += n;
+		size -= n;
+	}
+
+	return 0;
+}
+
+static char *
+tdram_get_chunk(struct tdram_image *img, uint64_t idx, int *err)
+{
+	char *chunk = img->chunks[idx];
+
+	*err = 0;
+
+	if (chunk)
+		return chunk;
+
+	chunk = tdram_map_chunk(img);
+	if (!chunk) {
+		*err = -ENOMEM;
+		return NULL;
+	}
+
+	/* the rest of the chunk reads as it did before */
+	if (tdram_backed(img, idx)) {
+		*err = tdram_read_image(img, chunk, idx << TDRAM_CHUNK_SHIFT,
+					tdram_chunk_bytes(img, idx));
+		if (*err) {
+			munmap(chunk, TDRAM_CHUNK_SIZE);
+			return NULL;
+		}
+	}
+
+	img->chunks[idx] = chunk;
+	img->allocated++;
+
+	return chunk;
+}
+
+static void
+tdram_free_image(struct tdram_image *img)
+{
+	uint64_t i;
+
+	if (img->chunks) {
+		for (i = 0; i < img->n_chunks; i++)
+			if (img->chunks[i])
+				munmap(img->chunks[i], TDRAM_CHUNK_SIZE);
+		free(img->chunks);
+	}
+
+	if (img->fd >= 0)
+		close(img->fd);
+
+	free(img->backing);
+	free(img->name);
+	free(img);
+}
+
+static int
+tdram_open_image(const char *name, int wt, struct tdram_image **_img)
+{
+	struct tdram_image *img;
+	int err, o_flags;
+
+	img = calloc(1, sizeof(*img));
+	if (!img)
+		return -ENOMEM;
+
+	img->fd   = -1;
+	img->wt   = wt;
+	img->name = strdup(name);
+	if (!img->name) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	o_flags = O_LARGEFILE | (wt ? O_RDWR : O_RDONLY);
+	img->fd = open(name, o_flags);
+	if (img->fd == -1) {
+		err = -errno;
+		DPRINTF("Unable to open [%s]!\n", name);
+		goto fail;
+	}
+
+	err = get_image_info(img->fd, &img->info);
+	if (err)
+		goto fail;
+
+	img->n_chunks = ((img->info.size << SECTOR_SHIFT) +
+			 TDRAM_CHUNK_SIZE - 1) >> TDRAM_CHUNK_SHIFT;
+
+	img->chunks  = calloc(img->n_chunks, sizeof(*img->chunks));
+	img->backing = calloc(img->n_chunks, sizeof(*img->backing));
+	if (!img->chunks || !img->backing) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	*_img = img;
+	return 0;
+
+fail:
+	tdram_free_image(img);
+	return err;
+}
+
+/* Open the disk file and initialize ram state. */
+int tdram_open (td_driver_t *driver, const char *name, td_flag_t flags)
+{
+	struct tdram_state *prv = (struct tdram_state *)driver->data;
+	struct tdram_image *img;
+	int err, wt;
+
+	wt = !strncmp(name, TDRAM_WRITE_THROUGH, strlen(TDRAM_WRITE_THROUGH));
+	if (wt) {
+		name += strlen(TDRAM_WRITE_THROUGH);
+		if (flags & TD_OPEN_RDONLY)
+			wt = 0;
 	}
 
+	list_for_each_entry(img, &tdram_images, next)
+		if (!strcmp(img->name, name) && img->wt == wt) {
+			DPRINTF("Image already open, sharing it\n");
+			goto done;
+		}
+
+	err = tdram_open_image(name, wt, &img);
+	if (err)
+		return err;
+
+	list_add_tail(&img->next, &tdram_images);
+
+	DPRINTF("%s: %llu chunks of %lluMB%s\n", name,
+		(unsigned long long)img->n_chunks, TDRAM_CHUNK_SIZE >> 20,
+		wt ? ", write-through" : "");
+
 done:
-	return ret;
+	img->refcnt++;
+	prv->img     = img;
+	driver->info = img->info;
+
+	return 0;
 }
 
 void tdram_queue_read(td_driver_t *driver, td_request_t treq)
 {
-	int      size    = treq.secs * driver->info.sector_size;
-	uint64_t offset  = treq.sec * (uint64_t)driver->info.sector_size;
+	struct tdram_state *prv = (struct tdram_state *)driver->data;
+	struct tdram_image *img = prv->img;
+	uint64_t offset = (uint64_t)treq.sec << SECTOR_SHIFT;
+	uint64_t end    = offset + ((uint64_t)treq.secs << SECTOR_SHIFT);
+	char *buf = treq.buf;
+	int err = 0;
+
+	while (offset < end) {
+		uint64_t idx  = offset >> TDRAM_CHUNK_SHIFT;
+		uint64_t off  = offset & (TDRAM_CHUNK_SIZE - 1);
+		uint64_t size = TDRAM_CHUNK_SIZE - off;
+		char *chunk   = img->chunks[idx];
+
+		if (size > end - offset)
+			size = end - offset;
+
+		if (chunk)
+			memcpy(buf, chunk + off, size);
+		else if (tdram_backed(img, idx))
+			err = tdram_read_image(img, buf, offset, size);
+		else
+			memset(buf, 0, size);
+
+		if (err)
+			break;
 
-	memcpy(treq.buf, img + offset, size);
+		buf    += size;
+		offset += size;
+	}
 
-	td_complete_request(treq, 0);
+	td_complete_request(treq, err);
 }
 
 void tdram_queue_write(td_driver_t *driver, td_request_t treq)
 {
-	int      size    = treq.secs * driver->info.sector_size;
-	uint64_t offset  = treq.sec * (uint64_t)driver->info.sector_size;
-	
+	struct tdram_state *prv = (struct tdram_state *)driver->data;
+	struct tdram_image *img = prv->img;
+	uint64_t offset = (uint64_t)treq.sec << SECTOR_SHIFT;
+	uint64_t end    = offset + ((uint64_t)treq.secs << SECTOR_SHIFT);
+	char *buf = treq.buf;
+	int err = 0;
+
 	/* We assume that write access is controlled
 	 * at a higher level for multiple disks */
-	memcpy(img + offset, treq.buf, size);
+	if (img->wt) {
+		err = tdram_write_image(img, buf, offset, end - offset);
+		if (err)
+			goto out;
+	}
+
+	while (offset < end) {
+		uint64_t idx  = offset >> TDRAM_CHUNK_SHIFT;
+		uint64_t off  = offset & (TDRAM_CHUNK_SIZE - 1);
+		uint64_t size = TDRAM_CHUNK_SIZE - off;
+		char *chunk;
+
+		if (size > end - offset)
+			size = end - offset;
 
-	td_complete_request(treq, 0);
+		chunk = tdram_get_chunk(img, idx, &err);
+		if (!chunk)
+			break;
+
+		memcpy(chunk + off, buf, size);
+
+		buf    += size;
+		offset += size;
+	}
+
+out:
+	td_complete_request(treq, err);
 }
 
 int tdram_close(td_driver_t *driver)
 {
-	connections--;
-	
+	struct tdram_state *prv = (struct tdram_state *)driver->data;
+	struct tdram_image *img = prv->img;
+
+	if (img && !--img->refcnt) {
+		list_del(&img->next);
+		tdram_free_image(img);
+	}
+	prv->img = NULL;
+
 	return 0;
 }
 
+int tdram_sync(td_driver_t *driver)
+{
+	struct tdram_state *prv = (struct tdram_state *)driver->data;
+	struct tdram_image *img = prv->img;
+
+	if (!img->wt)
+		return 0;
+
+	return fdatasync(img->fd) ? -errno : 0;
+}
+
 int tdram_get_parent_id(td_driver_t *driver, td_disk_id_t *id)
 {
 	return TD_NO_PARENT;
@@ -239,6 +481,24 @@ int tdram_validate_parent(td_driver_t *driver,
 	return -EINVAL;
 }
 
+void tdram_stats(td_driver_t *driver, td_stats_t *st)
+{
+	struct tdram_state *prv = (struct tdram_state *)driver->data;
+	struct tdram_image *img = prv->img;
+
+	tapdisk_stats_field(st, "chunks", "llu",
+			    (unsigned long long)img->n_chunks);
+	tapdisk_stats_field(st, "allocated", "llu",
+			    (unsigned long long)img->allocated);
+	tapdisk_stats_field(st, "hugepages", "llu",
+			    (unsigned long long)img->huge);
+	tapdisk_stats_field(st, "resident", "llu",
+			    (unsigned long long)img->allocated *
+			    TDRAM_CHUNK_SIZE);
+	tapdisk_stats_field(st, "write_through", "d", img->wt);
+	tapdisk_stats_field(st, "users", "d", img->refcnt);
+}
+
 struct tap_disk tapdisk_ram = {
 	.disk_type          = "tapdisk_ram",
 	.flags              = 0,
@@ -247,7 +507,9 @@ struct tap_disk tapdisk_ram = {
 	.td_close           = tdram_close,
 	.td_queue_read      = tdram_queue_read,
 	.td_queue_write     = tdram_queue_write,
+	.td_sync            = tdram_sync,
 	.td_get_parent_id   = tdram_get_parent_id,
 	.td_validate_parent = tdram_validate_parent,
 	.td_debug           = NULL,
+	.td_stats           = tdram_stats,
 };
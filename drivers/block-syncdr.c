@@ -46,10 +46,11 @@
 #include "tapdisk.h"
 #include "tapdisk-driver.h"
 #include "tapdisk-interface.h"
+#include "tapdisk-server.h"
 
 #include "adaptdr.h"
-
-#define MAX_AIO_REQS         TAPDISK_DATA_REQUESTS
+#include "dr-stream.h"
+#include "dr-tls.h"
 
 struct tdsyncdr_state;
 
@@ -57,15 +58,22 @@ struct syncdr_request {
 	td_request_t         treq;
 	struct tiocb         tiocb;
 	struct tdsyncdr_state  *state;
+
+	/* a write completes once both the local tiocb and the
+	 * backup's ACK for its writeID are in */
+	uint64_t             writeID;
+	int                  localDone;
+	int                  localErr;
+	int                  remoteDone;
+	int                  secs;	// forwarded, still to complete
+	struct list_head     next;
 };
 
 struct tdsyncdr_state {
 	int                  fd;
 	td_driver_t         *driver;
 
-	int                  syncdr_free_count;
-	struct syncdr_request   syncdr_requests[MAX_AIO_REQS];
-	struct syncdr_request  *syncdr_free_list[MAX_AIO_REQS];
+	struct td_pool       syncdr_pool;
 
 	uint64_t pendingWrite;	// epoch of last started write (get from kblock?)
 	uint64_t committedWrite; // epoch of last committed write
@@ -77,6 +85,15 @@ struct tdsyncdr_state {
 	int backupPort;
 	char* imageFile;
 
+	/* writes are sent by the stream's dispatch thread; ACKs are read
+	 * from the scheduler, so many writes can be in flight at once */
+	struct dr_stream stream;
+	struct dr_options opts;
+	struct list_head inflight;	// sent, waiting for ACK, by writeID
+	event_id_t ackEvent;
+	char ackBuf[sizeof(struct dr_ack)];
+	int ackLen;
+	int backupFailed;
 };
 
 
@@ -109,30 +126,18 @@ static int tdsyncdr_get_image_info(int fd, td_disk_info_t *info)
 			(long long unsigned)(info->size << SECTOR_SHIFT),
 			(long long unsigned)info->size);
 
-		/*Get the sector size*/
-#if defined(BLKSSZGET)
-		{
-			info->sector_size = DEFAULT_SECTOR_SIZE;
-			ioctl(fd, BLKSSZGET, &info->sector_size);
-			
-			if (info->sector_size != DEFAULT_SECTOR_SIZE)
-				DPRINTF("Note: sector size is %ld (not %d)\n",
-					info->sector_size, DEFAULT_SECTOR_SIZE);
-		}
-#else
-		info->sector_size = DEFAULT_SECTOR_SIZE;
-#endif
-
 	} else {
 		/*Local file? try fstat instead*/
 		info->size = (stat.st_size >> SECTOR_SHIFT);
-		info->sector_size = DEFAULT_SECTOR_SIZE;
 		DPRINTF("Image size: \n\tpre sector_shift  [%llu]\n\tpost "
 			"sector_shift [%llu]\n",
 			(long long unsigned)(info->size << SECTOR_SHIFT),
 			(long long unsigned)info->size);
 	}
 
+	tapdisk_get_sector_size(fd, &info->sector_size,
+				&info->physical_sector_size);
+
 	if (info->size == 0) {		
 		info->size =((uint64_t) 16836057);
 		info->sector_size = DEFAULT_SECTOR_SIZE;
@@ -142,6 +147,41 @@ static int tdsyncdr_get_image_info(int fd, td_disk_info_t *info)
 	return 0;
 }
 
+/* Open a raw image, with O_DIRECT if we can, and get its size. */
+static int tdsyncdr_open_image(td_driver_t *driver, const char *path,
+			       td_flag_t flags)
+{
+	int fd, err, o_flags;
+
+	o_flags = O_DIRECT | O_LARGEFILE |
+		((flags & TD_OPEN_RDONLY) ? O_RDONLY : O_RDWR);
+	fd = open(path, o_flags);
+
+	if (fd == -1 && errno == EINVAL) {
+		/* Maybe O_DIRECT isn't supported. */
+		o_flags &= ~O_DIRECT;
+		fd = open(path, o_flags);
+		if (fd != -1)
+			DPRINTF("WARNING: Accessing image without "
+				"O_DIRECT! (%s)\n", path);
+	} else if (fd != -1)
+		DPRINTF("open(%s) with O_DIRECT\n", path);
+
+	if (fd == -1) {
+		err = -errno;
+		DPRINTF("Unable to open [%s] (%d)!\n", path, err);
+		return err;
+	}
+
+	err = tdsyncdr_get_image_info(fd, &driver->info);
+	if (err) {
+		close(fd);
+		return err;
+	}
+
+	return fd;
+}
+
 /* Find out the server name, port, and disk image file
  *
  *  name has format = obelix29:9000:/home/twood/vms/testdisk.img
@@ -184,6 +224,11 @@ int tdsyncdr_get_args(td_driver_t *driver, const char* name)
 		return -ENOMEM;
 	}
 
+	if (dr_parse_options(state->imageFile, &state->opts)) {
+		DPRINTF("bad DR options in %s\n", file);
+		return -EINVAL;
+	}
+
 	state->backupPort = portnum;
 
 	DPRINTF("host: %s, port: %d, image path: %s\n",
@@ -225,6 +270,11 @@ int tdsyncdr_connectTobackup(struct tdsyncdr_state *state) {
 		return -1;
 	}
 
+	if (state->opts.tls &&
+	    dr_tls_client(state->backupSocket, state->opts.tls,
+			  state->backupHost))
+		return -1;
+
 	bzero(buffer,256);
 	strcpy(buffer,state->imageFile);
 
@@ -254,10 +304,93 @@ int tdsyncdr_connectTobackup(struct tdsyncdr_state *state) {
 }
 
 
+static void
+tdsyncdr_finish_request(struct tdsyncdr_state *prv,
+			struct syncdr_request *syncdr)
+{
+	td_complete_request(syncdr->treq, syncdr->localErr);
+	td_pool_put(&prv->syncdr_pool, syncdr);
+}
+
+/*
+ * The backup ACKs records in stream order, so an ACK for writeID n
+ * covers every in-flight write up to n.
+ */
+static void
+tdsyncdr_ack_writes(struct tdsyncdr_state *prv, uint64_t ack)
+{
+	struct syncdr_request *syncdr, *tmp;
+
+	list_for_each_entry_safe(syncdr, tmp, &prv->inflight, next) {
+		if (syncdr->writeID > ack)
+			break;
+
+		list_del_init(&syncdr->next);
+		syncdr->remoteDone = 1;
+		if (prv->committedWrite < syncdr->writeID)
+			prv->committedWrite = syncdr->writeID;
+
+		if (syncdr->localDone)
+			tdsyncdr_finish_request(prv, syncdr);
+	}
+}
+
+/*
+ * Losing the backup must not hang the guest: stop replicating and let
+ * writes complete on their local result from now on.
+ */
+static void
+tdsyncdr_backup_failed(struct tdsyncdr_state *prv, int err)
+{
+	DPRINTF("backup %s:%d lost (%d), continuing unreplicated\n",
+		prv->backupHost, prv->backupPort, err);
+
+	prv->backupFailed = 1;
+	tapdisk_server_unregister_event(prv->ackEvent);
+	prv->ackEvent = 0;
+
+	tdsyncdr_ack_writes(prv, UINT64_MAX);
+}
+
+static void
+tdsyncdr_ack_event(event_id_t id, char mode, void *private)
+{
+	struct tdsyncdr_state *prv = private;
+	struct dr_ack ack;
+	ssize_t n;
+
+	for (;;) {
+		n = recv(prv->backupSocket, prv->ackBuf + prv->ackLen,
+			 sizeof(prv->ackBuf) - prv->ackLen, MSG_DONTWAIT);
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return;
+			if (errno == EINTR)
+				continue;
+			tdsyncdr_backup_failed(prv, -errno);
+			return;
+		}
+
+		if (n == 0) {
+			tdsyncdr_backup_failed(prv, -ECONNRESET);
+			return;
+		}
+
+		prv->ackLen += n;
+		if (prv->ackLen < sizeof(prv->ackBuf))
+			continue;
+
+		memcpy(&ack, prv->ackBuf, sizeof(ack));
+		prv->ackLen = 0;
+
+		tdsyncdr_ack_writes(prv, ack.writeID);
+	}
+}
+
 /* Open the disk file and initialize syncdr state. */
 int tdsyncdr_open(td_driver_t *driver, const char *name, td_flag_t flags)
 {
-	int i, fd, ret, o_flags;
+	int fd, ret;
 	struct tdsyncdr_state *prv;
 
 	ret = 0;
@@ -267,9 +400,8 @@ int tdsyncdr_open(td_driver_t *driver, const char *name, td_flag_t flags)
 
 	memset(prv, 0, sizeof(struct tdsyncdr_state));
 
-	prv->syncdr_free_count = MAX_AIO_REQS;
-	for (i = 0; i < MAX_AIO_REQS; i++)
-		prv->syncdr_free_list[i] = &prv->syncdr_requests[i];
+	td_pool_init(&prv->syncdr_pool, sizeof(struct syncdr_request),
+		     TD_POOL_CHUNK, TD_POOL_LIMIT);
 
 	ret = tdsyncdr_get_args(driver, name);
 	if(ret) {
@@ -277,40 +409,60 @@ int tdsyncdr_open(td_driver_t *driver, const char *name, td_flag_t flags)
 		goto done;
 	}
 
-	/* Open the file */
-	o_flags = O_DIRECT | O_LARGEFILE |
-		((flags & TD_OPEN_RDONLY) ? O_RDONLY : O_RDWR);
-        fd = open(prv->imageFile, o_flags);
-
-        if ( (fd == -1) && (errno == EINVAL) ) {
-
-                /* Maybe O_DIRECT isn't supported. */
-		o_flags &= ~O_DIRECT;
-                fd = open(prv->imageFile, o_flags);
-                if (fd != -1) DPRINTF("WARNING: Accessing image without"
-                                     "O_DIRECT! (%s)\n", prv->imageFile);
-
-        } else if (fd != -1) DPRINTF("open(%s) with O_DIRECT\n", prv->imageFile);
-
-        if (fd == -1) {
-		DPRINTF("Unable to open [%s] (%d)!\n", prv->imageFile, 0 - errno);
-        	ret = 0 - errno;
-        	goto done;
-        }
-
-	ret = tdsyncdr_get_image_info(fd, &driver->info);
+	/* Open the file, unless the image below does the I/O */
+	fd = -1;
+	if (!prv->opts.filter) {
+		fd = tdsyncdr_open_image(driver, prv->imageFile, flags);
+		if (fd < 0) {
+			ret = fd;
+			goto done;
+		}
+	}
 
 	/* Setup state for network/backup server */
 	prv->pendingWrite = 0;
 	prv->committedWrite = 0;
 
 
+	INIT_LIST_HEAD(&prv->inflight);
+
+	ret = dr_stream_init(&prv->stream, prv->opts.ring);
+	if (ret) {
+		DPRINTF("unable to allocate replication ring: %d\n", ret);
+		close(fd);
+		goto done;
+	}
+	prv->stream.crc = prv->opts.crc;
+	prv->stream.coalesce = prv->opts.coalesce;
+	dr_stream_sockopts(&prv->stream, &prv->opts.sock);
+
 	DPRINTF("Connecting to backup...");
-	tdsyncdr_connectTobackup(prv);
+	ret = tdsyncdr_connectTobackup(prv);
+	if (!ret)
+		ret = dr_stream_add_target(&prv->stream, prv->backupSocket,
+					   DR_CODEC_NONE, 0);
+	if (ret) {
+		DPRINTF("unable to connect to backup: %d\n", ret);
+		dr_stream_free(&prv->stream);
+		close(fd);
+		goto done;
+	}
 	DPRINTF("connection made!");
 
+	prv->ackEvent =
+		tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
+					      prv->backupSocket, 0,
+					      tdsyncdr_ack_event, prv);
+	if (prv->ackEvent < 0) {
+		ret = prv->ackEvent;
+		prv->ackEvent = 0;
+	} else
+		ret = dr_stream_start(&prv->stream, 0, 0);
 
 	if (ret) {
+		if (prv->ackEvent)
+			tapdisk_server_unregister_event(prv->ackEvent);
+		dr_stream_free(&prv->stream);
 		close(fd);
 		goto done;
 	}
@@ -326,8 +478,24 @@ void tdsyncdr_complete(void *arg, struct tiocb *tiocb, int err)
 	struct syncdr_request *syncdr = (struct syncdr_request *)arg;
 	struct tdsyncdr_state *prv = syncdr->state;
 
-	td_complete_request(syncdr->treq, err);
-	prv->syncdr_free_list[prv->syncdr_free_count++] = syncdr;
+	syncdr->localDone = 1;
+	syncdr->localErr  = err;
+
+	if (syncdr->remoteDone)
+		tdsyncdr_finish_request(prv, syncdr);
+}
+
+/* The chain may complete a forwarded write in pieces. */
+static void
+tdsyncdr_forward_done(td_request_t treq, int err)
+{
+	struct syncdr_request *syncdr = treq.cb_data;
+
+	syncdr->secs    -= treq.secs;
+	syncdr->localErr = syncdr->localErr ? : err;
+
+	if (!syncdr->secs)
+		tdsyncdr_complete(syncdr, NULL, syncdr->localErr);
 }
 
 void tdsyncdr_queue_read(td_driver_t *driver, td_request_t treq)
@@ -338,13 +506,18 @@ void tdsyncdr_queue_read(td_driver_t *driver, td_request_t treq)
 	struct tdsyncdr_state *prv;
 
 	prv    = (struct tdsyncdr_state *)driver->data;
-	size   = treq.secs * driver->info.sector_size;
-	offset = treq.sec  * (uint64_t)driver->info.sector_size;
+	size   = treq.secs << SECTOR_SHIFT;
+	offset = (uint64_t)treq.sec << SECTOR_SHIFT;
 
-	if (prv->syncdr_free_count == 0)
+	if (prv->opts.filter) {
+		td_forward_request(treq);
+		return;
+	}
+
+	syncdr = td_pool_get(&prv->syncdr_pool);
+	if (!syncdr)
 		goto fail;
 
-	syncdr        = prv->syncdr_free_list[--prv->syncdr_free_count];
 	syncdr->treq  = treq;
 	syncdr->state = prv;
 
@@ -360,94 +533,161 @@ fail:
 
 void tdsyncdr_queue_write(td_driver_t *driver, td_request_t treq)
 {
-	int size;
+	int size, err;
 	uint64_t offset;
 	struct syncdr_request *syncdr;
 	struct tdsyncdr_state *prv;
-	// data for sending request to backup !TW!
-	struct req_info *rinfo;
-	uint64_t ack;
-	int rc;
-
-	/* We need to make the req_info meta data and the data block
-	 * adjacement in memory, so allocate a byte array with plenty of
-	 * space for both
-	 * TODO -- would need to increase this size if req_info struct changes!
-	 */
-	char req_info_and_data[DR_MAX_WRITE_SIZE+REQ_INFO_SIZE];
-	rinfo = (struct req_info *)&req_info_and_data[0];
 
 	prv     = (struct tdsyncdr_state *)driver->data;
-	size    = treq.secs * driver->info.sector_size;
-	offset  = treq.sec  * (uint64_t)driver->info.sector_size;
+	size    = treq.secs << SECTOR_SHIFT;
+	offset  = (uint64_t)treq.sec << SECTOR_SHIFT;
+
+	err    = -EBUSY;
+	syncdr = td_pool_get(&prv->syncdr_pool);
+	if (!syncdr)
+		goto fail;
 
-	if (prv->syncdr_free_count == 0)
+	/* bounce rather than wait for ring space, see block-asyncdr */
+	err = prv->backupFailed ? 0 : dr_stream_reserve(&prv->stream, size);
+	if (err) {
+		td_pool_put(&prv->syncdr_pool, syncdr);
 		goto fail;
+	}
 
-	syncdr        = prv->syncdr_free_list[--prv->syncdr_free_count];
 	syncdr->treq  = treq;
 	syncdr->state = prv;
+	syncdr->localDone  = 0;
+	syncdr->localErr   = 0;
+	syncdr->remoteDone = prv->backupFailed;
+	INIT_LIST_HEAD(&syncdr->next);
+
+	if (!prv->backupFailed) {
+		/* Send the size and offset, then the actual buffer !TW! */
+		syncdr->writeID = ++prv->pendingWrite;
+		list_add_tail(&syncdr->next, &prv->inflight);
+		dr_stream_queue_write(&prv->stream, syncdr->writeID,
+				      offset, treq.buf, size);
+	}
+
+	if (prv->opts.filter) {
+		td_request_t clone = treq;
+
+		syncdr->secs  = treq.secs;
+		clone.cb      = tdsyncdr_forward_done;
+		clone.cb_data = syncdr;
+		td_forward_request(clone);
+		return;
+	}
 
 	td_prep_write(&syncdr->tiocb, prv->fd, treq.buf,
 		      size, offset, tdsyncdr_complete, syncdr);
 	td_queue_tiocb(driver, &syncdr->tiocb);
 
-	/* Send the size and offset, then the actual buffer !TW! */
-	rinfo->size = size;
-	rinfo->offset = offset;
-	rinfo->writeID = prv->pendingWrite++;
+	return;
 
-	/* Sending meta + block data in one go */
-	memcpy(&req_info_and_data[sizeof(struct req_info)], treq.buf, size);
+fail:
+	td_complete_request(treq, dr_stream_reserve_error(err));
+}
 
-	rc = sendexact(prv->backupSocket,&req_info_and_data[0],size + sizeof(struct req_info));
-	if (rc < 0) {
-		DPRINTF("ERROR writing meta + buffer to socket");
-		return;
-	}
+/*
+ * Discards are not replicated, the backup keeps the old blocks, which
+ * is what a discarded range may read back as anyway.
+ */
+void tdsyncdr_queue_discard(td_driver_t *driver, td_request_t treq)
+{
+	uint64_t size, offset;
+	struct tdsyncdr_state *prv;
+	int err;
 
+	prv     = (struct tdsyncdr_state *)driver->data;
+	size    = (uint64_t)treq.secs << SECTOR_SHIFT;
+	offset  = (uint64_t)treq.sec << SECTOR_SHIFT;
 
-	rc = recvexact(prv->backupSocket,(char*) &ack,sizeof(ack));
-	if (rc < 0) {
-		DPRINTF("ERROR recving ACK from socket");
+	if (prv->opts.filter) {
+		td_forward_request(treq);
 		return;
 	}
 
-	return;
+	err = tapdisk_discard_range(prv->fd, offset, size);
+	td_complete_request(treq, err);
+}
 
-fail:
-	td_complete_request(treq, -EBUSY);
+/*
+ * Backups are fed by their own stream and not flushed along; a filter's
+ * child is flushed as an image of its own.
+ */
+int tdsyncdr_sync(td_driver_t *driver)
+{
+	struct tdsyncdr_state *prv = (struct tdsyncdr_state *)driver->data;
+
+	if (prv->opts.filter || prv->fd < 0)
+		return 0;
+
+	return fdatasync(prv->fd) ? -errno : 0;
 }
 
 int tdsyncdr_close(td_driver_t *driver)
 {
-	struct req_info rinfo; // send zero'd out req_info to indicate close
-	int rc;
 	struct tdsyncdr_state *prv = (struct tdsyncdr_state *)driver->data;
 
-	bzero(&rinfo, sizeof(struct req_info));
+	if (prv->ackEvent)
+		tapdisk_server_unregister_event(prv->ackEvent);
 
-	rc = sendexact(prv->backupSocket, (char*)(&rinfo), sizeof(struct req_info));
-	if (rc < 0) {
-		DPRINTF("ERROR writing req info to socket");
-		return -1;
-	}
-	close(prv->backupSocket);
+	/* also sends the close marker */
+	dr_stream_free(&prv->stream);
 
-	close(prv->fd);
+	if (prv->fd >= 0)
+		close(prv->fd);
+	td_pool_destroy(&prv->syncdr_pool);
 
 	return 0;
 }
 
+/* Stacked, the image below comes from the chain, not from us. */
 int tdsyncdr_get_parent_id(td_driver_t *driver, td_disk_id_t *id)
 {
-	return TD_NO_PARENT;
+	struct tdsyncdr_state *prv = (struct tdsyncdr_state *)driver->data;
+
+	return prv->opts.filter ? -EINVAL : TD_NO_PARENT;
 }
 
 int tdsyncdr_validate_parent(td_driver_t *driver,
 			  td_driver_t *pdriver, td_flag_t flags)
 {
-	return -EINVAL;
+	struct tdsyncdr_state *prv = (struct tdsyncdr_state *)driver->data;
+
+	return prv->opts.filter ? 0 : -EINVAL;
+}
+
+void tdsyncdr_stats(td_driver_t *driver, td_stats_t *st)
+{
+	struct tdsyncdr_state *prv = (struct tdsyncdr_state *)driver->data;
+
+	tapdisk_stats_field(st, "reqs", "{");
+	td_pool_stats(&prv->syncdr_pool, st);
+	tapdisk_stats_leave(st, '}');
+
+	/*
+	 * writes is [ last queued, last acknowledged ]
+	 */
+	tapdisk_stats_field(st, "dr", "{");
+	tapdisk_stats_field(st, "writes", "[");
+	tapdisk_stats_val(st, "llu", prv->pendingWrite);
+	tapdisk_stats_val(st, "llu", prv->committedWrite);
+	tapdisk_stats_leave(st, ']');
+	dr_stream_stats(&prv->stream, st);
+	tapdisk_stats_leave(st, '}');
+}
+
+int tdsyncdr_footprint(td_driver_t *driver, int trim, uint64_t *bytes)
+{
+	struct tdsyncdr_state *prv = (struct tdsyncdr_state *)driver->data;
+
+	if (trim)
+		td_pool_trim(&prv->syncdr_pool);
+
+	*bytes = td_pool_bytes(&prv->syncdr_pool);
+	return 0;
 }
 
 struct tap_disk tapdisk_syncdr = {
@@ -458,7 +698,11 @@ struct tap_disk tapdisk_syncdr = {
 	.td_close           = tdsyncdr_close,
 	.td_queue_read      = tdsyncdr_queue_read,
 	.td_queue_write     = tdsyncdr_queue_write,
+	.td_queue_discard   = tdsyncdr_queue_discard,
+	.td_sync            = tdsyncdr_sync,
 	.td_get_parent_id   = tdsyncdr_get_parent_id,
 	.td_validate_parent = tdsyncdr_validate_parent,
 	.td_debug           = NULL,
+	.td_stats           = tdsyncdr_stats,
+	.td_footprint       = tdsyncdr_footprint,
 };
@@ -31,15 +31,21 @@
 #include "tapdisk-driver.h"
 #include "tapdisk-server.h"
 #include "tapdisk-interface.h"
+#include "tapdisk-latency.h"
 
 #include "block-valve.h"
 
+#define MIN(a, b)               ((a) < (b) ? (a) : (b))
+#define MAX(a, b)               ((a) > (b) ? (a) : (b))
+
 typedef struct td_valve td_valve_t;
 typedef struct td_valve_request td_valve_request_t;
 
 struct td_valve_request {
 	td_request_t            treq;
 	int                     secs;
+	int                     metered; /* completion reported as done */
+	struct timeval          ts;      /* forwarded */
 
 	struct list_head        entry;
 	td_valve_t             *valve;
@@ -48,8 +54,32 @@ struct td_valve_request {
 struct td_valve_stats {
 	unsigned long long      stor;
 	unsigned long long      forw;
+	unsigned long long      local; /* forwarded on leased credit */
+	unsigned long long      sends;
+	unsigned long long      leases;
+	unsigned long long      returns;
+	unsigned long long      timed;
 };
 
+/*
+ * Messages to the bridge go out once per loop iteration, all in one
+ * send, from __valve_sched_event. A valve which had to wait for
+ * credit leases TD_VALVE_LEASE_HZ'th of a second of its observed
+ * rate ahead, and spends it without asking; requests so forwarded
+ * are reported by count. Credit unused over an interval goes back.
+ */
+#define TD_VALVE_BATCH            32
+#define TD_VALVE_LEASE_INTERVAL   1 /* s */
+#define TD_VALVE_LEASE_HZ         10
+#define TD_VALVE_LEASE_MAX        (TD_RLB_REQUEST_MAX / 4)
+
+/*
+ * A bridge asking for latencies gets each flush's completions, stored
+ * or not, as counts per td_latency_bucket(). Requests forwarded
+ * unmetered are timed on requests of their own, up to MAX_REQUESTS.
+ */
+#define TD_VALVE_REQUESTS         (2 * MAX_REQUESTS)
+
 struct td_valve {
 	char                   *brname;
 	unsigned long           flags;
@@ -59,16 +89,30 @@ struct td_valve {
 
 	event_id_t              sched_id;
 	event_id_t              retry_id;
+	event_id_t              lease_id;
 
 	unsigned int            cred;
 	unsigned int            need;
 	unsigned int            done;
 
+	struct td_valve_req     msgv[TD_VALVE_BATCH];
+	int                     n_msgs;
+	unsigned int            ops;     /* spent locally, unreported */
+
+	unsigned int            leasing; /* of need */
+	unsigned int            spent;   /* this interval */
+	unsigned int            rate;    /* B/s, observed */
+
+	int                     latency;
+	unsigned int            lat[TD_LAT_BUCKETS];
+	int                     n_lat, lat_lo, lat_hi;
+	int                     n_timed;
+
 	struct list_head        stor;
 	struct list_head        forw;
 
-	td_valve_request_t      reqv[MAX_REQUESTS];
-	td_valve_request_t     *free[MAX_REQUESTS];
+	td_valve_request_t      reqv[TD_VALVE_REQUESTS];
+	td_valve_request_t     *free[TD_VALVE_REQUESTS];
 	int                     n_free;
 
 	struct td_valve_stats   stats;
@@ -89,6 +133,8 @@ struct td_valve {
 static void valve_schedule_retry(td_valve_t *);
 static void valve_conn_receive(td_valve_t *);
 static void valve_conn_request(td_valve_t *, unsigned long);
+static void valve_conn_flush(td_valve_t *);
+static void valve_conn_send(td_valve_t *);
 static void valve_forward_stored_requests(td_valve_t *);
 static void valve_kill(td_valve_t *);
 
@@ -155,16 +201,15 @@ __valve_sock_event(event_id_t id, char mode, void *private)
 }
 
 static void
-valve_set_done_pending(td_valve_t *valve)
+valve_set_pending(td_valve_t *valve)
 {
-	WARN_ON(valve->done == 0);
-	tapdisk_server_mask_event(valve->sched_id, 0);
+	if (valve->sched_id >= 0)
+		tapdisk_server_mask_event(valve->sched_id, 0);
 }
 
 static void
-valve_clear_done_pending(td_valve_t *valve)
+valve_clear_pending(td_valve_t *valve)
 {
-	WARN_ON(valve->done != 0);
 	tapdisk_server_mask_event(valve->sched_id, 1);
 }
 
@@ -173,14 +218,105 @@ __valve_sched_event(event_id_t id, char mode, void *private)
 {
 	td_valve_t *valve = private;
 
-	if (likely(valve->done > 0))
-		/* flush valve->done */
-		valve_conn_request(valve, 0);
+	valve_conn_flush(valve);
+}
+
+static void
+valve_queue_msg(td_valve_t *valve, unsigned long need, unsigned long done)
+{
+	struct td_valve_req *msg;
+
+	/* room for the ops count and done */
+	if (valve->n_msgs >= TD_VALVE_BATCH - 2)
+		valve_conn_flush(valve);
+
+	if (valve->sock < 0)
+		return;
+
+	msg       = &valve->msgv[valve->n_msgs++];
+	msg->need = need;
+	msg->done = done;
+
+	valve_set_pending(valve);
+}
+
+/* the rate seen, and credit unused since the last interval back */
+static void
+__valve_lease_event(event_id_t id, char mode, void *private)
+{
+	td_valve_t *valve = private;
+
+	valve->rate  = (valve->rate + valve->spent / TD_VALVE_LEASE_INTERVAL) / 2;
+
+	if (!valve->spent && valve->cred && list_empty(&valve->stor)) {
+		valve_queue_msg(valve, TD_VALVE_REQ_RETURN, valve->cred);
+		valve->stats.returns++;
+		valve->cred = 0;
+	}
+
+	valve->spent = 0;
+}
+
+static void
+valve_latency_reset(td_valve_t *valve)
+{
+	valve->latency = 0;
+	valve->n_lat   = 0;
+	memset(valve->lat, 0, sizeof(valve->lat));
+}
+
+static void
+valve_latency_add(td_valve_t *valve, td_valve_request_t *req)
+{
+	struct timeval now;
+	int idx;
+
+	gettimeofday(&now, NULL);
+	idx = td_latency_bucket(td_latency_us(&req->ts, &now));
+
+	if (!valve->n_lat++)
+		valve->lat_lo = valve->lat_hi = idx;
+	else {
+		valve->lat_lo = MIN(valve->lat_lo, idx);
+		valve->lat_hi = MAX(valve->lat_hi, idx);
+	}
+
+	valve->lat[idx]++;
+	valve_set_pending(valve);
+}
+
+/* completions since the last flush, a message per bucket */
+static void
+valve_queue_latency(td_valve_t *valve)
+{
+	struct td_valve_req *msg;
+	int i;
+
+	for (i = valve->lat_lo; i <= valve->lat_hi; i++) {
+		if (!valve->lat[i])
+			continue;
+
+		if (valve->n_msgs >= TD_VALVE_BATCH - 2) {
+			valve_conn_send(valve);
+			if (!valve->latency)
+				return;
+		}
+
+		msg       = &valve->msgv[valve->n_msgs++];
+		msg->need = TD_VALVE_REQ_LATENCY | i;
+		msg->done = valve->lat[i];
+
+		valve->lat[i] = 0;
+	}
+
+	valve->n_lat = 0;
 }
 
 static void
 valve_sock_close(td_valve_t *valve)
 {
+	valve_latency_reset(valve);
+
 	if (valve->sock >= 0) {
 		close(valve->sock);
 		valve->sock = -1;
@@ -195,6 +331,11 @@ valve_sock_close(td_valve_t *valve)
 		tapdisk_server_unregister_event(valve->sched_id);
 		valve->sched_id = -1;
 	}
+
+	if (valve->lease_id >= 0) {
+		tapdisk_server_unregister_event(valve->lease_id);
+		valve->lease_id = -1;
+	}
 }
 
 static int
@@ -247,13 +388,27 @@ valve_sock_open(td_valve_t *valve)
 
 	valve->sched_id = id;
 
+	id = tapdisk_server_register_event(SCHEDULER_POLL_TIMEOUT,
+					   -1, TD_VALVE_LEASE_INTERVAL,
+					   __valve_lease_event,
+					   valve);
+	if (id < 0) {
+		err = id;
+		goto fail;
+	}
+
+	valve->lease_id = id;
+
 	INFO("Connected to %s", addr.sun_path);
 
-	valve->cred = 0;
-	valve->need = 0;
-	valve->done = 0;
+	valve->cred    = 0;
+	valve->need    = 0;
+	valve->done    = 0;
+	valve->n_msgs  = 0;
+	valve->ops     = 0;
+	valve->leasing = 0;
 
-	valve_clear_done_pending(valve);
+	valve_clear_pending(valve);
 
 	return 0;
 
@@ -373,6 +528,13 @@ valve_conn_receive(td_valve_t *valve)
 	}
 
 	for (i = 0; i < n / sizeof(buf[0]); i++) {
+		if (buf[i] == TD_VALVE_RSP_LATENCY) {
+			if (!valve->latency)
+				INFO("%s: reporting latencies", valve->brname);
+			valve->latency = 1;
+			continue;
+		}
+
 		err = WARN_ON(buf[i] >= TD_RLB_REQUEST_MAX);
 		if (err)
 			goto kill;
@@ -385,8 +547,9 @@ valve_conn_receive(td_valve_t *valve)
 		goto reset;
 	}
 
-	valve->cred += cred;
-	valve->need -= cred;
+	valve->cred    += cred;
+	valve->need    -= cred;
+	valve->leasing -= MIN(valve->leasing, cred);
 
 	return;
 
@@ -400,21 +563,52 @@ kill:
 	valve_kill(valve);
 }
 
+/* everything queued for the bridge, in one send */
 static void
-valve_conn_request(td_valve_t *valve, unsigned long size)
+valve_conn_flush(td_valve_t *valve)
 {
-	struct td_valve_req _req;
-	int err;
+	struct td_valve_req *msg;
 
-	_req.need    = size;
-	_req.done    = valve->done;
+	if (valve->n_lat)
+		valve_queue_latency(valve);
 
-	valve->need += size;
-	valve->done  = 0;
+	if (valve->ops) {
+		msg       = &valve->msgv[valve->n_msgs++];
+		msg->need = TD_VALVE_REQ_OPS | valve->ops;
+		msg->done = 0;
+		valve->ops = 0;
+	}
+
+	if (valve->done) {
+		msg = valve->n_msgs ? &valve->msgv[valve->n_msgs - 1] : NULL;
+		if (!msg || (msg->need & (TD_VALVE_REQ_RETURN |
+					  TD_VALVE_REQ_LATENCY))) {
+			msg       = &valve->msgv[valve->n_msgs++];
+			msg->need = 0;
+			msg->done = 0;
+		}
+		msg->done  += valve->done;
+		valve->done = 0;
+	}
+
+	if (valve->sched_id >= 0)
+		valve_clear_pending(valve);
 
-	valve_clear_done_pending(valve);
+	valve_conn_send(valve);
+}
+
+static void
+valve_conn_send(td_valve_t *valve)
+{
+	int err;
+
+	if (!valve->n_msgs || valve->sock < 0)
+		return;
 
-	err = valve_sock_send(valve, &_req, sizeof(_req));
+	err = valve_sock_send(valve, valve->msgv,
+			      valve->n_msgs * sizeof(valve->msgv[0]));
+	valve->n_msgs = 0;
+	valve->stats.sends++;
 	if (!err)
 		return;
 
@@ -422,6 +616,25 @@ valve_conn_request(td_valve_t *valve, unsigned long size)
 	valve_conn_reset(valve);
 }
 
+/* one request's credit, and a lease if none is coming */
+static void
+valve_conn_request(td_valve_t *valve, unsigned long size)
+{
+	unsigned long lease;
+
+	valve->need += size;
+	valve_queue_msg(valve, size, 0);
+
+	lease = MIN(valve->rate / TD_VALVE_LEASE_HZ, TD_VALVE_LEASE_MAX);
+	if (valve->leasing || lease < size)
+		return;
+
+	valve->need    += lease;
+	valve->leasing  = lease;
+	valve->stats.leases++;
+	valve_queue_msg(valve, TD_VALVE_REQ_LEASE | lease, 0);
+}
+
 static int
 valve_expend_request(td_valve_t *valve, const td_request_t treq)
 {
@@ -434,7 +647,8 @@ valve_expend_request(td_valve_t *valve, const td_request_t treq)
 	if (valve->cred < TREQ_SIZE(treq))
 		return -EAGAIN;
 
-	valve->cred -= TREQ_SIZE(treq);
+	valve->cred  -= TREQ_SIZE(treq);
+	valve->spent += TREQ_SIZE(treq);
 
 	return 0;
 }
@@ -448,20 +662,69 @@ __valve_complete_treq(td_request_t treq, int error)
 	BUG_ON(req->secs < treq.secs);
 	req->secs -= treq.secs;
 
-	valve->done += TREQ_SIZE(treq);
-	valve_set_done_pending(valve);
+	if (req->metered) {
+		valve->done += TREQ_SIZE(treq);
+		valve_set_pending(valve);
+	}
 
 	if (!req->secs) {
+		if (valve->latency)
+			valve_latency_add(valve, req);
+
+		if (!req->metered)
+			valve->n_timed--;
+
 		td_complete_request(req->treq, error);
 		valve_free_request(valve, req);
 	}
 }
 
+static void
+valve_forward_clone(td_valve_t *valve, td_valve_request_t *req)
+{
+	td_request_t clone;
+
+	gettimeofday(&req->ts, NULL);
+
+	clone         = req->treq;
+	clone.cb      = __valve_complete_treq;
+	clone.cb_data = req;
+
+	td_forward_request(clone);
+	valve->stats.forw++;
+
+	list_move(&req->entry, &valve->forw);
+}
+
+/* past the valve, timed if the bridge wants latencies */
+static void
+valve_forward_request(td_valve_t *valve, td_request_t treq)
+{
+	td_valve_request_t *req = NULL;
+
+	if (valve->latency && valve->n_timed < MAX_REQUESTS)
+		req = valve_alloc_request(valve);
+
+	if (!req) {
+		td_forward_request(treq);
+		valve->stats.forw++;
+		return;
+	}
+
+	req->treq    = treq;
+	req->secs    = treq.secs;
+	req->metered = 0;
+
+	valve->n_timed++;
+	valve->stats.timed++;
+
+	valve_forward_clone(valve, req);
+}
+
 static void
 valve_forward_stored_requests(td_valve_t *valve)
 {
 	td_valve_request_t *req, *next;
-	td_request_t clone;
 	int err;
 
 	td_valve_for_each_stored_request(req, next, valve) {
@@ -470,14 +733,7 @@ valve_forward_stored_requests(td_valve_t *valve)
 		if (err)
 			break;
 
-		clone         = req->treq;
-		clone.cb      = __valve_complete_treq;
-		clone.cb_data = req;
-
-		td_forward_request(clone);
-		valve->stats.forw++;
-
-		list_move(&req->entry, &valve->forw);
+		valve_forward_clone(valve, req);
 	}
 }
 
@@ -492,8 +748,9 @@ valve_store_request(td_valve_t *valve, td_request_t treq)
 
 	valve_conn_request(valve, TREQ_SIZE(treq));
 
-	req->treq = treq;
-	req->secs = treq.secs;
+	req->treq    = treq;
+	req->secs    = treq.secs;
+	req->metered = 1;
 
 	list_add_tail(&req->entry, &valve->stor);
 	valve->stats.stor++;
@@ -523,6 +780,7 @@ valve_init(td_valve_t *valve, unsigned long flags)
 
 	valve->retry_id = -1;
 	valve->sched_id = -1;
+	valve->lease_id = -1;
 
 	valve->flags    = flags;
 
@@ -598,13 +856,27 @@ td_valve_queue_request(td_driver_t *driver, td_request_t treq)
 
 		goto forward;
 
+	case TD_OP_DISCARD:
+		/* moves no data, nothing to limit */
+		goto forward;
+
 	default:
 		BUG();
 	}
 
-	err = valve_expend_request(valve, treq);
-	if (!err)
-		goto forward;
+	/* leased credit, behind those waiting */
+	if (list_empty(&valve->stor)) {
+		err = valve_expend_request(valve, treq);
+		if (!err) {
+			if (valve->sock >= 0 &&
+			    !(valve->flags & TD_VALVE_KILLED)) {
+				valve->ops++;
+				valve->stats.local++;
+				valve_set_pending(valve);
+			}
+			goto forward;
+		}
+	}
 
 	err = valve_store_request(valve, treq);
 	if (err)
@@ -613,8 +885,7 @@ td_valve_queue_request(td_driver_t *driver, td_request_t treq)
 	return;
 
 forward:
-	td_forward_request(treq);
-	valve->stats.forw++;
+	valve_forward_request(valve, treq);
 }
 
 static int
@@ -643,6 +914,13 @@ td_valve_stats(td_driver_t *driver, td_stats_t *st)
 	tapdisk_stats_field(st, "cred", "d", valve->cred);
 	tapdisk_stats_field(st, "need", "d", valve->need);
 	tapdisk_stats_field(st, "done", "d", valve->done);
+	tapdisk_stats_field(st, "rate", "d", valve->rate);
+	tapdisk_stats_field(st, "local", "llu", valve->stats.local);
+	tapdisk_stats_field(st, "sends", "llu", valve->stats.sends);
+	tapdisk_stats_field(st, "leases", "llu", valve->stats.leases);
+	tapdisk_stats_field(st, "returns", "llu", valve->stats.returns);
+	tapdisk_stats_field(st, "latency", "d", valve->latency);
+	tapdisk_stats_field(st, "timed", "llu", valve->stats.timed);
 
 	/*
 	 * stored is [ waiting, total-waits ]
@@ -679,6 +957,7 @@ struct tap_disk tapdisk_valve = {
 	.td_close                   = td_valve_close,
 	.td_queue_read              = td_valve_queue_request,
 	.td_queue_write             = td_valve_queue_request,
+	.td_queue_discard           = td_valve_queue_request,
 	.td_get_parent_id           = td_valve_get_parent_id,
 	.td_validate_parent         = td_valve_validate_parent,
 	.td_stats                   = td_valve_stats,
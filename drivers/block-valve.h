@@ -22,6 +22,29 @@
 #define TD_RLB_CONN_MAX           1024
 #define TD_RLB_REQUEST_MAX        (8 << 20)
 
+/*
+ * Every request the valve holds asks for its own credit, in bytes: a
+ * message with 'need' set is one request, which bridges may charge
+ * per operation too. 'done' returns completed bytes.
+ *
+ * Flags in 'need', above TD_RLB_REQUEST_MAX:
+ *  LEASE   bytes asked ahead, to spend locally: not a request.
+ *  OPS     requests spent from leased credit, a count: no bytes.
+ *  RETURN  'done' are unused bytes, granted back to the bridge.
+ *  LATENCY 'done' requests completed in td_latency_bucket() 'need'.
+ *
+ * Bridges answer in credit, bytes below TD_RLB_REQUEST_MAX. One which
+ * wants completion latencies asks with TD_VALVE_RSP_LATENCY instead.
+ */
+#define TD_VALVE_REQ_LEASE        (1UL << 30)
+#define TD_VALVE_REQ_OPS          (1UL << 29)
+#define TD_VALVE_REQ_RETURN       (1UL << 28)
+#define TD_VALVE_REQ_LATENCY      (1UL << 27)
+#define TD_VALVE_REQ_FLAGS        (TD_VALVE_REQ_LEASE | TD_VALVE_REQ_OPS | \
+				   TD_VALVE_REQ_RETURN | TD_VALVE_REQ_LATENCY)
+
+#define TD_VALVE_RSP_LATENCY      (1UL << 30)
+
 struct td_valve_req {
 	unsigned long need;
 	unsigned long done;
@@ -46,11 +46,14 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <sys/vfs.h>
+#include <sys/time.h>
 #include <sys/ioctl.h>
 #include <uuid/uuid.h> /* For whatever reason, Linux packages this in */
                        /* e2fsprogs-devel.                            */
 #include <string.h>    /* for memset.                                 */
 #include <libaio.h>
+#include <pthread.h>
 #include <sys/mman.h>
 
 #include "libvhd.h"
@@ -59,6 +62,9 @@
 #include "tapdisk-interface.h"
 #include "tapdisk-disktype.h"
 #include "tapdisk-storage.h"
+#include "tapdisk-stats.h"
+#include "tapdisk-utils.h"
+#include "tapdisk-zpool.h"
 
 unsigned int SPB;
 
@@ -72,10 +78,10 @@ unsigned int SPB;
 	do {								\
 		DBG(TLOG_DBG, "%s: QUEUED: %" PRIu64 ", COMPLETED: %"	\
 		    PRIu64", RETURNED: %" PRIu64 ", DATA_ALLOCATED: "	\
-		    "%u, BBLK: 0x%04x\n",				\
+		    "%u, BAT_ALLOCS: %d\n",				\
 		    s->vhd.file, s->queued, s->completed, s->returned,	\
-		    VHD_REQS_DATA - s->vreq_free_count,			\
-		    s->bat.pbw_blk);					\
+		    s->vreq_pool.used,					\
+		    s->bat.allocs);					\
 	} while(0)
 
 #define __ASSERT(_p)							\
@@ -108,10 +114,19 @@ unsigned int SPB;
 #endif
 
 /******VHD DEFINES******/
-#define VHD_CACHE_SIZE               32
+#define VHD_CACHE_SIZE               32  /* bitmaps allocated at open */
+#define VHD_CACHE_DEFAULT            512
+#define VHD_CACHE_MAX                65536
+#define VHD_BAT_ALLOCS               16
+
+#define VHD_PREALLOC_MIN             2   /* blocks per extent */
+#define VHD_PREALLOC_MAX             64
+#define VHD_PREALLOC_FAST            5   /* s, extents used up faster grow */
+
+#define VHD_ZCACHE_SIZE              4   /* decompressed blocks per vbd */
 
 #define VHD_REQS_DATA                TAPDISK_DATA_REQUESTS
-#define VHD_REQS_META                (VHD_CACHE_SIZE + 2)
+#define VHD_REQS_META                (VHD_CACHE_SIZE + VHD_BAT_ALLOCS + 1)
 #define VHD_REQS_TOTAL               (VHD_REQS_DATA + VHD_REQS_META)
 
 #define VHD_OP_BAT_WRITE             0
@@ -121,6 +136,8 @@ unsigned int SPB;
 #define VHD_OP_BITMAP_WRITE          4
 #define VHD_OP_ZERO_BM_WRITE         5
 #define VHD_OP_REDUNDANT_BM_WRITE    6
+#define VHD_OP_DATA_DISCARD          7
+#define VHD_OP_BAT_RELEASE           8
 
 #define VHD_BM_BAT_LOCKED            0
 #define VHD_BM_BAT_CLEAR             1
@@ -139,6 +156,12 @@ unsigned int SPB;
 #define VHD_FLAG_BAT_LOCKED          1
 #define VHD_FLAG_BAT_WRITE_STARTED   2
 
+#define VHD_ALLOC_FREE               0
+#define VHD_ALLOC_ZERO_WRITE         1
+#define VHD_ALLOC_READY              2
+#define VHD_ALLOC_BAT_WRITE          3
+#define VHD_ALLOC_DONE               4
+
 #define VHD_FLAG_BM_UPDATE_BAT       1
 #define VHD_FLAG_BM_WRITE_PENDING    2
 #define VHD_FLAG_BM_READ_PENDING     4
@@ -152,6 +175,11 @@ unsigned int SPB;
 #define VHD_FLAG_TX_LIVE             1
 #define VHD_FLAG_TX_UPDATE_BAT       2
 
+#define VHD_ZBLOCK_EMPTY             0
+#define VHD_ZBLOCK_READ_PENDING      1
+#define VHD_ZBLOCK_DECODE_PENDING    2
+#define VHD_ZBLOCK_VALID             3
+
 typedef uint8_t vhd_flag_t;
 
 struct vhd_state;
@@ -182,20 +210,64 @@ struct vhd_request {
 	struct vhd_transaction   *tx;
 };
 
+/*
+ * A block allocation, from reserving space at next_db until its bat
+ * entry is on disk. Allocations become ready once their bitmap is
+ * initialized; a single bat write carries every ready allocation
+ * falling into the same bat sector.
+ */
+struct vhd_alloc {
+	uint8_t                   state;
+	uint32_t                  blk;
+	uint64_t                  offset;      /* file offset of block */
+	uint64_t                  lb_end;      /* next_db before reserving */
+	uint64_t                  seqno;       /* allocation order */
+	int                       error;       /* of the bat write */
+	int                       zeroed;      /* space known to read zeros */
+	struct vhd_request        zero_req;    /* for initializing bitmap */
+	struct vhd_transaction   *tx;          /* waiting for bat write */
+};
+
 struct vhd_bat_state {
 	vhd_bat_t                 bat;
 	vhd_batmap_t              batmap;
 	vhd_flag_t                status;
-	uint32_t                  pbw_blk;     /* blk num of pending write */
-	uint64_t                  pbw_offset;  /* file offset of same */
+	int                       allocs;      /* pending allocations */
+	uint64_t                  alloc_seqno;
+	struct vhd_alloc          alloc[VHD_BAT_ALLOCS];
 	struct vhd_request        req;         /* for writing bat table */
-	struct vhd_request        zero_req;    /* for initializing bitmaps */
 	char                     *bat_buf;
+	uint32_t                  released[128]; /* bat sector of pending
+						  * release, as it was */
+	uint64_t                  writes;      /* bat sector writes */
+	uint64_t                  written;     /* allocations they carried */
+};
+
+/*
+ * Space past the end of the file is reserved an extent of several
+ * blocks at a time. Until handed out it reads back as zeros, so
+ * blocks allocated from it need no bitmap initialization. Extents
+ * used up quickly make the next one larger, slow ones shrink it.
+ */
+struct vhd_prealloc {
+	int                       disabled;
+	uint32_t                  blocks;      /* size of next extent */
+	uint64_t                  end;         /* end of reserved space */
+	uint64_t                  clean;       /* start of untouched space */
+	struct timeval            last;        /* when last extent was taken */
+	uint64_t                  extents;
+	uint64_t                  zeroed;      /* blocks allocated from them */
 };
 
+#define VHD_BM_QUEUE_NONE            0
+#define VHD_BM_QUEUE_IN              1
+#define VHD_BM_QUEUE_HOT             2
+
 struct vhd_bitmap {
 	uint32_t                  blk;
-	uint64_t                  seqno;       /* lru sequence number */
+	int                       cacheq;      /* cache queue it is on */
+	struct list_head          lru;
+	struct vhd_bitmap        *hnext;       /* cache hash chain */
 	vhd_flag_t                status;
 
 	char                     *map;         /* map should only be modified
@@ -215,6 +287,71 @@ struct vhd_bitmap {
 	struct vhd_request        req;
 };
 
+/*
+ * The bitmap cache is 2Q: bitmaps read in go on a fifo ('in'). Those
+ * needed again soon after falling off it, as remembered by the ring
+ * of their block numbers ('ghost'), come back onto an lru ('hot'). A
+ * scan or a large random working set only cycles through the fifo,
+ * leaving the hot bitmaps alone.
+ *
+ * The size is set per vbd at open; bitmaps beyond the first
+ * VHD_CACHE_SIZE are allocated as needed.
+ */
+struct vhd_bm_cache {
+	int                       size;        /* max bitmaps */
+	int                       count;       /* allocated */
+	struct vhd_bitmap       **all;
+	int                       free_count;
+	struct vhd_bitmap       **free;
+
+	struct vhd_bitmap       **hash;
+	uint32_t                  hash_mask;
+
+	struct list_head          in;
+	struct list_head          hot;
+	int                       in_count;
+	int                       in_max;
+
+	uint32_t                 *ghost;
+	int                       ghost_size;
+	int                       ghost_next;
+
+	uint64_t                  hits;
+	uint64_t                  misses;
+	uint64_t                  ghost_hits;
+	uint64_t                  evictions;
+};
+
+/*
+ * Blocks of a compressed image (HD_COMPRESSED) are read whole and
+ * decompressed on the zpool threads into a small lru of blocks, which
+ * then serves reads by copy. Requests arriving while a block is in
+ * flight wait on it. Blocks stored raw bypass the cache.
+ */
+struct vhd_zblock {
+	uint32_t                  blk;
+	int                       status;
+	uint64_t                  used;        /* lru stamp */
+	char                     *data;        /* decompressed block */
+	char                     *zbuf;        /* compressed block, as read */
+	uint32_t                  zlen;
+	struct vhd_req_list       waiting;
+	struct tiocb              tiocb;
+	struct td_zjob            job;
+	struct vhd_state         *state;
+};
+
+struct vhd_zcache {
+	int                       active;      /* holds a zpool reference */
+	struct td_zport           port;
+	uint64_t                  stamp;
+	struct vhd_zblock         blocks[VHD_ZCACHE_SIZE];
+
+	uint64_t                  hits;
+	uint64_t                  misses;
+	uint64_t                  errors;
+};
+
 struct vhd_state {
 	vhd_flag_t                flags;
 
@@ -222,23 +359,19 @@ struct vhd_state {
 	vhd_context_t             vhd;
 	uint32_t                  spp;         /* sectors per page */
 	uint32_t                  spb;         /* sectors per block */
+	uint32_t                  shift;       /* vhd_data_shift() */
 	uint64_t                  first_db;    /* pointer to datablock 0 */
 	uint64_t                  next_db;     /* pointer to the next 
 						* (unallocated) datablock */
 
 	struct vhd_bat_state      bat;
+	struct vhd_prealloc       prealloc;
 
-	uint64_t                  bm_lru;      /* lru sequence number */
 	uint32_t                  bm_secs;     /* size of bitmap, in sectors */
-	struct vhd_bitmap        *bitmap[VHD_CACHE_SIZE];
-
-	int                       bm_free_count;
-	struct vhd_bitmap        *bitmap_free[VHD_CACHE_SIZE];
-	struct vhd_bitmap         bitmap_list[VHD_CACHE_SIZE];
+	struct vhd_bm_cache       bm_cache;
+	struct vhd_zcache         zcache;
 
-	int                       vreq_free_count;
-	struct vhd_request       *vreq_free[VHD_REQS_DATA];
-	struct vhd_request        vreq_list[VHD_REQS_DATA];
+	struct td_pool            vreq_pool;
 
 	/* for redundant bitmap writes */
 	int                       padbm_size;
@@ -255,30 +388,44 @@ struct vhd_state {
 	uint64_t                  read_size;
 	uint64_t                  writes;
 	uint64_t                  write_size;
+	uint64_t                  discards;
+	uint64_t                  discard_size;
+	uint64_t                  released;
+	uint64_t                  zero_writes;
+	uint64_t                  zero_size;
 };
 
 #define test_vhd_flag(word, flag)  ((word) & (flag))
 #define set_vhd_flag(word, flag)   ((word) |= (flag))
 #define clear_vhd_flag(word, flag) ((word) &= ~(flag))
 
-#define bat_entry(s, blk)          ((s)->bat.bat.bat[(blk)])
+#define bat_entry(s, blk)          (*vhd_bat_slot(&(s)->bat.bat, (blk)))
+#define bat_mapped(s)              ((s)->bat.bat.map != NULL)
 
 static void vhd_complete(void *, struct tiocb *, int);
+static void vhd_complete_zread(void *, struct tiocb *, int);
 static void finish_data_transaction(struct vhd_state *, struct vhd_bitmap *);
 
+/* parents may be opened on several threads at once */
+static pthread_mutex_t    _vhd_zeros_lock = PTHREAD_MUTEX_INITIALIZER;
 static struct vhd_state  *_vhd_master;
 static unsigned long      _vhd_zsize;
 static char              *_vhd_zeros;
 
 static int
-vhd_initialize(struct vhd_state *s)
+__vhd_initialize(struct vhd_state *s)
 {
 	if (_vhd_zeros)
 		return 0;
 
-	_vhd_zsize = 2 * getpagesize();
+	/*
+	 * shared by every vbd, so sized for the largest block: zeroed
+	 * bitmaps, plus whole blocks when preallocating
+	 */
+	_vhd_zsize = 2 * getpagesize() +
+		(VHD_BLOCK_SIZE_MAX >> (VHD_SECTOR_SHIFT + 3));
 	if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_PREALLOCATE))
-		_vhd_zsize += VHD_BLOCK_SIZE;
+		_vhd_zsize += VHD_BLOCK_SIZE_MAX;
 
 	_vhd_zeros = mmap(0, _vhd_zsize, PROT_READ,
 			  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
@@ -293,8 +440,20 @@ vhd_initialize(struct vhd_state *s)
 	return 0;
 }
 
+static int
+vhd_initialize(struct vhd_state *s)
+{
+	int err;
+
+	pthread_mutex_lock(&_vhd_zeros_lock);
+	err = __vhd_initialize(s);
+	pthread_mutex_unlock(&_vhd_zeros_lock);
+
+	return err;
+}
+
 static void
-vhd_free(struct vhd_state *s)
+__vhd_free(struct vhd_state *s)
 {
 	if (_vhd_master != s || !_vhd_zeros)
 		return;
@@ -306,6 +465,14 @@ vhd_free(struct vhd_state *s)
 	_vhd_master = NULL;
 }
 
+static void
+vhd_free(struct vhd_state *s)
+{
+	pthread_mutex_lock(&_vhd_zeros_lock);
+	__vhd_free(s);
+	pthread_mutex_unlock(&_vhd_zeros_lock);
+}
+
 static char *
 _get_vhd_zeros(const char *func, unsigned long size)
 {
@@ -329,6 +496,13 @@ set_batmap(struct vhd_state *s, uint32_t blk)
 	}
 }
 
+static inline void
+clear_batmap(struct vhd_state *s, uint32_t blk)
+{
+	if (s->bat.batmap.map)
+		vhd_batmap_clear(&s->vhd, &s->bat.batmap, blk);
+}
+
 static inline int
 test_batmap(struct vhd_state *s, uint32_t blk)
 {
@@ -400,12 +574,24 @@ find_next_free_block(struct vhd_state *s)
 static void
 vhd_free_bat(struct vhd_state *s)
 {
-	free(s->bat.bat.bat);
+	vhd_release_bat(&s->bat.bat);
 	free(s->bat.batmap.map);
 	free(s->bat.bat_buf);
 	memset(&s->bat, 0, sizeof(struct vhd_bat));
 }
 
+static void
+vhd_prealloc_init(struct vhd_state *s)
+{
+	struct vhd_prealloc *p = &s->prealloc;
+
+	memset(p, 0, sizeof(*p));
+	p->blocks   = VHD_PREALLOC_MIN;
+	p->disabled = s->vhd.is_block ||
+		test_vhd_flag(s->flags, VHD_FLAG_OPEN_RDONLY) ||
+		!vhd_type_dynamic(&s->vhd);
+}
+
 static int
 vhd_initialize_bat(struct vhd_state *s)
 {
@@ -414,7 +600,12 @@ vhd_initialize_bat(struct vhd_state *s)
 
 	memset(&s->bat, 0, sizeof(struct vhd_bat));
 
-	err = vhd_read_bat(&s->vhd, &s->bat.bat);
+	/* parents only ever look up the blocks read through them */
+	err = -EINVAL;
+	if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_RDONLY))
+		err = vhd_map_bat(&s->vhd, &s->bat.bat);
+	if (err)
+		err = vhd_read_bat(&s->vhd, &s->bat.bat);
 	if (err) {
 		EPRINTF("%s: reading bat: %d\n", s->vhd.file, err);
 		return err;
@@ -427,6 +618,8 @@ vhd_initialize_bat(struct vhd_state *s)
 		err = find_next_free_block(s);
 		if (err)
 			goto fail;
+
+		vhd_prealloc_init(s);
 	}
 
 	if (vhd_has_batmap(&s->vhd)) {
@@ -459,55 +652,111 @@ fail:
 	return err;
 }
 
+static void
+vhd_free_bitmap(struct vhd_bitmap *bm)
+{
+	free(bm->map);
+	free(bm->shadow);
+	free(bm);
+}
+
 static void
 vhd_free_bitmap_cache(struct vhd_state *s)
 {
 	int i;
-	struct vhd_bitmap *bm;
+	struct vhd_bm_cache *c = &s->bm_cache;
 
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
-		bm = s->bitmap_list + i;
-		free(bm->map);
-		free(bm->shadow);
-		s->bitmap_free[i] = NULL;
-	}
+	for (i = 0; i < c->count; i++)
+		vhd_free_bitmap(c->all[i]);
 
-	memset(s->bitmap_list, 0, sizeof(struct vhd_bitmap) * VHD_CACHE_SIZE);
+	free(c->all);
+	free(c->free);
+	free(c->hash);
+	free(c->ghost);
+	memset(c, 0, sizeof(*c));
 }
 
-static int
-vhd_initialize_bitmap_cache(struct vhd_state *s)
+static struct vhd_bitmap *
+vhd_new_bitmap(struct vhd_state *s)
 {
-	int i, err, map_size;
+	int err, map_size;
 	struct vhd_bitmap *bm;
 	void *map, *shadow;
 
-	memset(s->bitmap_list, 0, sizeof(struct vhd_bitmap) * VHD_CACHE_SIZE);
+	map_size = vhd_sectors_to_bytes(s->bm_secs);
 
-	s->bm_lru        = 0;
-	map_size         = vhd_sectors_to_bytes(s->bm_secs);
-	s->bm_free_count = VHD_CACHE_SIZE;
+	bm = calloc(1, sizeof(*bm));
+	if (!bm)
+		return NULL;
 
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
-		bm = s->bitmap_list + i;
+	err = posix_memalign(&map, 512, map_size);
+	if (err)
+		goto fail;
 
-		err = posix_memalign(&map, 512, map_size);
-		if (err)
-			goto fail;
+	bm->map = map;
+
+	err = posix_memalign(&shadow, 512, map_size);
+	if (err)
+		goto fail;
 
-		bm->map = map;
+	bm->shadow = shadow;
 
-		err = posix_memalign(&shadow, 512, map_size);
-		if (err)
-			goto fail;
+	memset(bm->map, 0, map_size);
+	memset(bm->shadow, 0, map_size);
+	INIT_LIST_HEAD(&bm->lru);
 
-		bm->shadow = shadow;
+	s->bm_cache.all[s->bm_cache.count++] = bm;
+	return bm;
 
-		memset(bm->map, 0, map_size);
-		memset(bm->shadow, 0, map_size);
-		s->bitmap_free[i] = bm;
+fail:
+	vhd_free_bitmap(bm);
+	return NULL;
+}
+
+static int
+vhd_initialize_bitmap_cache(struct vhd_state *s, int size)
+{
+	int i, err;
+	uint32_t buckets;
+	struct vhd_bitmap *bm;
+	struct vhd_bm_cache *c = &s->bm_cache;
+
+	memset(c, 0, sizeof(*c));
+
+	if (!size)
+		size = VHD_CACHE_DEFAULT;
+	size = MIN(size, MAX(s->vhd.header.max_bat_size, VHD_CACHE_SIZE));
+	size = MAX(MIN(size, VHD_CACHE_MAX), VHD_CACHE_SIZE);
+
+	for (buckets = 1; buckets < size; buckets <<= 1)
+		;
+
+	err = -ENOMEM;
+	c->size       = size;
+	c->in_max     = MAX(size / 4, 1);
+	c->ghost_size = MAX(size / 2, 1);
+	c->hash_mask  = buckets - 1;
+	INIT_LIST_HEAD(&c->in);
+	INIT_LIST_HEAD(&c->hot);
+
+	c->all   = calloc(size, sizeof(struct vhd_bitmap *));
+	c->free  = calloc(size, sizeof(struct vhd_bitmap *));
+	c->hash  = calloc(buckets, sizeof(struct vhd_bitmap *));
+	c->ghost = malloc(c->ghost_size * sizeof(uint32_t));
+	if (!c->all || !c->free || !c->hash || !c->ghost)
+		goto fail;
+
+	for (i = 0; i < c->ghost_size; i++)
+		c->ghost[i] = DD_BLK_UNUSED;
+
+	for (i = 0; i < VHD_CACHE_SIZE; i++) {
+		bm = vhd_new_bitmap(s);
+		if (!bm)
+			goto fail;
+		c->free[c->free_count++] = bm;
 	}
 
+	DBG(TLOG_INFO, "%s: bitmap cache: %d\n", s->vhd.file, size);
 	return 0;
 
 fail:
@@ -515,8 +764,71 @@ fail:
 	return err;
 }
 
+static void
+vhd_free_zblock(struct vhd_zblock *zb)
+{
+	ASSERT(zb->status != VHD_ZBLOCK_READ_PENDING &&
+	       zb->status != VHD_ZBLOCK_DECODE_PENDING);
+
+	free(zb->data);
+	free(zb->zbuf);
+	zb->data  = NULL;
+	zb->zbuf  = NULL;
+	zb->status = VHD_ZBLOCK_EMPTY;
+}
+
+static void
+vhd_free_zcache(struct vhd_state *s)
+{
+	int i;
+	struct vhd_zcache *c = &s->zcache;
+
+	if (!c->active)
+		return;
+
+	for (i = 0; i < VHD_ZCACHE_SIZE; i++)
+		vhd_free_zblock(&c->blocks[i]);
+
+	td_zpool_put(&c->port);
+	c->active = 0;
+}
+
+/* buffers are allocated as blocks are first read */
+static int
+vhd_initialize_zcache(struct vhd_state *s)
+{
+	int i, err;
+
+	if (!test_vhd_flag(s->flags, VHD_FLAG_OPEN_RDONLY)) {
+		EPRINTF("%s: compressed images are read-only\n", s->vhd.file);
+		return -EROFS;
+	}
+
+	if (s->vhd.header.zcodec != DD_ZCODEC_LZ4) {
+		EPRINTF("%s: unknown codec %u\n",
+			s->vhd.file, s->vhd.header.zcodec);
+		return -EINVAL;
+	}
+
+	err = vhd_get_zmap(&s->vhd);
+	if (err) {
+		EPRINTF("%s: reading zmap: %d\n", s->vhd.file, err);
+		return err;
+	}
+
+	err = td_zpool_get(&s->zcache.port);
+	if (err)
+		return err;
+
+	for (i = 0; i < VHD_ZCACHE_SIZE; i++)
+		s->zcache.blocks[i].state = s;
+
+	s->zcache.active = 1;
+	return 0;
+}
+
 static int
-vhd_initialize_dynamic_disk(struct vhd_state *s)
+vhd_initialize_dynamic_disk(struct vhd_state *s, int bm_cache)
 {
 	uint32_t bm_size;
 	void *buf;
@@ -538,17 +850,24 @@ vhd_initialize_dynamic_disk(struct vhd_state *s)
 	s->spp     = getpagesize() >> VHD_SECTOR_SHIFT;
 	s->spb     = s->vhd.header.block_size >> VHD_SECTOR_SHIFT;
 	s->bm_secs = secs_round_up_no_zero(s->spb >> 3);
+	s->shift   = vhd_data_shift(&s->vhd);
+
+	if (s->shift >= s->spb ||
+	    vhd_data_blocks(&s->vhd) > s->vhd.header.max_bat_size) {
+		EPRINTF("%s: invalid data shift %u\n",
+			s->vhd.file, s->shift);
+		return -EINVAL;
+	}
 
-	s->padbm_size = (s->bm_secs / getpagesize()) * getpagesize();
-	if (s->bm_secs % getpagesize())
-		s->padbm_size += getpagesize();
+	bm_size = s->bm_secs << VHD_SECTOR_SHIFT;
+	s->padbm_size = (bm_size + getpagesize() - 1) /
+		getpagesize() * getpagesize();
 
 	err = posix_memalign(&buf, 512, s->padbm_size);
 	if (err)
 		return -err;
 
 	s->padbm_buf = buf;
-	bm_size = s->bm_secs << VHD_SECTOR_SHIFT;
 	memset(s->padbm_buf, 0, s->padbm_size - bm_size);
 	memset(s->padbm_buf + (s->padbm_size - bm_size), ~0, bm_size);
 	s->debug_skipped_redundant_writes = 0;
@@ -561,15 +880,58 @@ vhd_initialize_dynamic_disk(struct vhd_state *s)
 	if (err)
 		return err;
 
-	err = vhd_initialize_bitmap_cache(s);
+	err = vhd_initialize_bitmap_cache(s, bm_cache);
 	if (err) {
 		vhd_free_bat(s);
 		return err;
 	}
 
+	if (vhd_compressed(&s->vhd)) {
+		err = vhd_initialize_zcache(s);
+		if (err) {
+			vhd_free_bitmap_cache(s);
+			vhd_free_bat(s);
+			return err;
+		}
+	}
+
 	return 0;
 }
 
+/*
+ * Guest pages reach the file on page boundaries as long as every data
+ * block starts on one, which holds for any block we allocate. Older
+ * images placed elsewhere keep 512-byte physical sectors. Metadata
+ * I/O is 512-byte, so the backing device must take that.
+ */
+static long
+vhd_physical_sector_size(struct vhd_state *s)
+{
+	long lsz, psz;
+	uint32_t i, entry;
+
+	tapdisk_get_sector_size(s->vhd.fd, &lsz, &psz);
+	if (lsz > VHD_SECTOR_SIZE)
+		EPRINTF("%s: backing logical block size is %ld, metadata "
+			"writes need %d\n", s->vhd.file, lsz, VHD_SECTOR_SIZE);
+
+	psz = MIN(psz, getpagesize());
+	if (psz <= VHD_SECTOR_SIZE || !vhd_type_dynamic(&s->vhd))
+		return psz;
+
+	if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_NO_CACHE))
+		return VHD_SECTOR_SIZE;
+
+	for (i = 0; i < s->bat.bat.entries; i++) {
+		entry = bat_entry(s, i);
+		if (entry != DD_BLK_UNUSED &&
+		    (entry + s->bm_secs) % (psz >> VHD_SECTOR_SHIFT))
+			return VHD_SECTOR_SIZE;
+	}
+
+	return psz;
+}
+
 static int
 vhd_check_version(struct vhd_state *s)
 {
@@ -605,6 +967,12 @@ vhd_log_open(struct vhd_state *s)
 		return;
 	}
 
+	if (bat_mapped(s)) {
+		DPRINTF("%s version: %s 0x%08x, b: %u, mapped\n", s->vhd.file,
+			buf, s->vhd.footer.crtr_ver, s->bat.bat.entries);
+		return;
+	}
+
 	allocated = 0;
 	full      = 0;
 
@@ -621,9 +989,10 @@ vhd_log_open(struct vhd_state *s)
 }
 
 static int
-__vhd_open(td_driver_t *driver, const char *name, vhd_flag_t flags)
+__vhd_open(td_driver_t *driver, const char *name,
+	   vhd_flag_t flags, int bm_cache)
 {
-        int i, o_flags, err;
+        int o_flags, err;
 	struct vhd_state *s;
 
         DBG(TLOG_INFO, "vhd_open: %s\n", name);
@@ -636,6 +1005,9 @@ __vhd_open(td_driver_t *driver, const char *name, vhd_flag_t flags)
 	s->flags  = flags;
 	s->driver = driver;
 
+	td_pool_init(&s->vreq_pool, sizeof(struct vhd_request),
+		     TD_POOL_CHUNK, VHD_REQS_DATA);
+
 	err = vhd_initialize(s);
 	if (err)
 		return err;
@@ -663,7 +1035,7 @@ __vhd_open(td_driver_t *driver, const char *name, vhd_flag_t flags)
 	s->spb = s->spp = 1;
 
 	if (vhd_type_dynamic(&s->vhd)) {
-		err = vhd_initialize_dynamic_disk(s);
+		err = vhd_initialize_dynamic_disk(s, bm_cache);
 		if (err)
 			goto fail;
 	}
@@ -672,12 +1044,9 @@ __vhd_open(td_driver_t *driver, const char *name, vhd_flag_t flags)
 
 	SPB = s->spb;
 
-	s->vreq_free_count = VHD_REQS_DATA;
-	for (i = 0; i < VHD_REQS_DATA; i++)
-		s->vreq_free[i] = s->vreq_list + i;
-
 	driver->info.size        = s->vhd.footer.curr_size >> VHD_SECTOR_SHIFT;
 	driver->info.sector_size = VHD_SECTOR_SIZE;
+	driver->info.physical_sector_size = vhd_physical_sector_size(s);
 	driver->info.info        = 0;
 
         DBG(TLOG_INFO, "vhd_open: done (sz:%"PRIu64", sct:%lu, inf:%u)\n",
@@ -698,14 +1067,17 @@ __vhd_open(td_driver_t *driver, const char *name, vhd_flag_t flags)
  fail:
 	vhd_free_bat(s);
 	vhd_free_bitmap_cache(s);
+	vhd_free_zcache(s);
 	vhd_close(&s->vhd);
 	vhd_free(s);
+	td_pool_destroy(&s->vreq_pool);
 	return err;
 }
 
 static int
 _vhd_open(td_driver_t *driver, const char *name, td_flag_t flags)
 {
+	int bm_cache;
 	vhd_flag_t vhd_flags = 0;
 
 	if (flags & TD_OPEN_RDONLY)
@@ -727,7 +1099,12 @@ _vhd_open(td_driver_t *driver, const char *name, td_flag_t flags)
 	    driver->storage != TAPDISK_STORAGE_TYPE_LVM)
 		vhd_flags |= VHD_FLAG_OPEN_PREALLOCATE;
 
-	return __vhd_open(driver, name, vhd_flags);
+	bm_cache = 0;
+	if (flags & TD_OPEN_BM_CACHE_MASK)
+		bm_cache = 1 << ((flags & TD_OPEN_BM_CACHE_MASK) >>
+				 TD_OPEN_BM_CACHE_SHIFT);
+
+	return __vhd_open(driver, name, vhd_flags, bm_cache);
 }
 
 static void
@@ -738,6 +1115,19 @@ vhd_log_close(struct vhd_state *s)
 	if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_QUIET))
 		return;
 
+	if (bat_mapped(s)) {
+		for (i = 0, allocated = 0;
+		     i < s->bat.bat.entries; i += 1 << VHD_BAT_CHUNK_SHIFT) {
+			uint32_t chunk = i >> VHD_BAT_CHUNK_SHIFT;
+			if (s->bat.bat.chunks[chunk >> 3] & (1 << (chunk & 7)))
+				allocated++;
+		}
+
+		DPRINTF("%s: b: %u, mapped, chunks decoded: %u\n",
+			s->vhd.file, s->bat.bat.entries, allocated);
+		return;
+	}
+
 	allocated = 0;
 	full      = 0;
 
@@ -794,8 +1184,10 @@ _vhd_close(td_driver_t *driver)
 	vhd_log_close(s);
 	vhd_free_bat(s);
 	vhd_free_bitmap_cache(s);
+	vhd_free_zcache(s);
 	vhd_close(&s->vhd);
 	vhd_free(s);
+	td_pool_destroy(&s->vreq_pool);
 
 	memset(s, 0, sizeof(struct vhd_state));
 
@@ -961,8 +1353,6 @@ init_bat(struct vhd_state *s)
 	s->bat.req.tx     = NULL;
 	s->bat.req.next   = NULL;
 	s->bat.req.error  = 0;
-	s->bat.pbw_blk    = 0;
-	s->bat.pbw_offset = 0;
 	s->bat.status     = 0;
 }
 
@@ -984,11 +1374,42 @@ bat_locked(struct vhd_state *s)
 	return test_vhd_flag(s->bat.status, VHD_FLAG_BAT_LOCKED);
 }
 
+/* the bat has no allocation or release in flight */
+static inline int
+bat_idle(struct vhd_state *s)
+{
+	return !bat_locked(s) && !s->bat.allocs;
+}
+
+static inline struct vhd_alloc *
+find_alloc(struct vhd_state *s, uint32_t blk)
+{
+	int i;
+
+	if (!s->bat.allocs)
+		return NULL;
+
+	for (i = 0; i < VHD_BAT_ALLOCS; i++) {
+		struct vhd_alloc *alloc = &s->bat.alloc[i];
+		if (alloc->state != VHD_ALLOC_FREE && alloc->blk == blk)
+			return alloc;
+	}
+
+	return NULL;
+}
+
+static inline int
+can_allocate(struct vhd_state *s)
+{
+	return !bat_locked(s) && s->bat.allocs < VHD_BAT_ALLOCS;
+}
+
 static inline void
 init_vhd_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 {
 	bm->blk    = 0;
-	bm->seqno  = 0;
+	bm->cacheq = VHD_BM_QUEUE_NONE;
+	bm->hnext  = NULL;
 	bm->status = 0;
 	init_tx(&bm->tx);
 	clear_req_list(&bm->queue);
@@ -998,17 +1419,24 @@ init_vhd_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 	init_vhd_request(s, &bm->req);
 }
 
+static inline uint32_t
+bitmap_hash(struct vhd_state *s, uint32_t blk)
+{
+	return (blk * 2654435761U) & s->bm_cache.hash_mask;
+}
+
 static inline struct vhd_bitmap *
 get_bitmap(struct vhd_state *s, uint32_t block)
 {
-	int i;
 	struct vhd_bitmap *bm;
 
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
-		bm = s->bitmap[i];
-		if (bm && bm->blk == block)
+	if (!s->bm_cache.hash)
+		return NULL;
+
+	bm = s->bm_cache.hash[bitmap_hash(s, block)];
+	for (; bm; bm = bm->hnext)
+		if (bm->blk == block)
 			return bm;
-	}
 
 	return NULL;
 }
@@ -1060,40 +1488,97 @@ bitmap_full(struct vhd_state *s, struct vhd_bitmap *bm)
 	return 1;
 }
 
+static void
+ghost_add(struct vhd_bm_cache *c, uint32_t blk)
+{
+	c->ghost[c->ghost_next] = blk;
+	c->ghost_next = (c->ghost_next + 1) % c->ghost_size;
+}
+
+static int
+ghost_take(struct vhd_bm_cache *c, uint32_t blk)
+{
+	int i;
+
+	for (i = 0; i < c->ghost_size; i++)
+		if (c->ghost[i] == blk) {
+			c->ghost[i] = DD_BLK_UNUSED;
+			return 1;
+		}
+
+	return 0;
+}
+
+static void
+uncache_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
+{
+	struct vhd_bm_cache *c = &s->bm_cache;
+	struct vhd_bitmap **p;
+
+	p = &c->hash[bitmap_hash(s, bm->blk)];
+	while (*p != bm)
+		p = &(*p)->hnext;
+	*p = bm->hnext;
+	bm->hnext = NULL;
+
+	if (bm->cacheq == VHD_BM_QUEUE_IN)
+		c->in_count--;
+	list_del_init(&bm->lru);
+	bm->cacheq = VHD_BM_QUEUE_NONE;
+}
+
+/* oldest bitmap on a queue that isn't locked */
+static struct vhd_bitmap *
+evictable_bitmap(struct list_head *queue)
+{
+	struct vhd_bitmap *bm;
+
+	list_for_each_entry_reverse(bm, queue, lru)
+		if (!bitmap_locked(bm))
+			return bm;
+
+	return NULL;
+}
+
 static struct vhd_bitmap *
 remove_lru_bitmap(struct vhd_state *s)
 {
-	int i, idx = 0;
-	uint64_t seq = s->bm_lru;
-	struct vhd_bitmap *bm, *lru = NULL;
+	struct vhd_bm_cache *c = &s->bm_cache;
+	struct vhd_bitmap *bm = NULL;
 
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
-		bm = s->bitmap[i];
-		if (bm && bm->seqno < seq && !bitmap_locked(bm)) {
-			idx = i;
-			lru = bm;
-			seq = lru->seqno;
-		}
-	}
+	if (c->in_count > c->in_max)
+		bm = evictable_bitmap(&c->in);
+	if (!bm)
+		bm = evictable_bitmap(&c->hot);
+	if (!bm)
+		bm = evictable_bitmap(&c->in);
+	if (!bm)
+		return NULL;
 
-	if (lru) {
-		s->bitmap[idx] = NULL;
-		ASSERT(!bitmap_in_use(lru));
-	}
+	ASSERT(!bitmap_in_use(bm));
 
-	return  lru;
+	if (bm->cacheq == VHD_BM_QUEUE_IN)
+		ghost_add(c, bm->blk);
+	uncache_bitmap(s, bm);
+	c->evictions++;
+
+	return bm;
 }
 
 static int
 alloc_vhd_bitmap(struct vhd_state *s, struct vhd_bitmap **bitmap, uint32_t blk)
 {
-	struct vhd_bitmap *bm;
+	struct vhd_bm_cache *c = &s->bm_cache;
+	struct vhd_bitmap *bm = NULL;
 	
 	*bitmap = NULL;
 
-	if (s->bm_free_count > 0) {
-		bm = s->bitmap_free[--s->bm_free_count];
-	} else {
+	if (c->free_count > 0)
+		bm = c->free[--c->free_count];
+	else if (c->count < c->size)
+		bm = vhd_new_bitmap(s);
+
+	if (!bm) {
 		bm = remove_lru_bitmap(s);
 		if (!bm)
 			return -EBUSY;
@@ -1106,63 +1591,46 @@ alloc_vhd_bitmap(struct vhd_state *s, struct vhd_bitmap **bitmap, uint32_t blk)
 	return 0;
 }
 
-static inline uint64_t
-__bitmap_lru_seqno(struct vhd_state *s)
-{
-	int i;
-	struct vhd_bitmap *bm;
-
-	if (s->bm_lru == 0xffffffff) {
-		s->bm_lru = 0;
-		for (i = 0; i < VHD_CACHE_SIZE; i++) {
-			bm = s->bitmap[i];
-			if (bm) {
-				bm->seqno >>= 1;
-				if (bm->seqno > s->bm_lru)
-					s->bm_lru = bm->seqno;
-			}
-		}
-	}
-
-	return ++s->bm_lru;
-}
-
 static inline void
 touch_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 {
-	bm->seqno = __bitmap_lru_seqno(s);
+	/* references right after the read are correlated, fifo stays put */
+	if (bm->cacheq == VHD_BM_QUEUE_HOT)
+		list_move(&bm->lru, &s->bm_cache.hot);
 }
 
 static inline void
 install_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 {
-	int i;
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
-		if (!s->bitmap[i]) {
-			touch_bitmap(s, bm);
-			s->bitmap[i] = bm;
-			return;
-		}
-	}
+	uint32_t h;
+	struct vhd_bm_cache *c = &s->bm_cache;
+
+	ASSERT(!get_bitmap(s, bm->blk));
 
-	ASSERT(0);
+	h = bitmap_hash(s, bm->blk);
+	bm->hnext  = c->hash[h];
+	c->hash[h] = bm;
+
+	if (ghost_take(c, bm->blk)) {
+		c->ghost_hits++;
+		bm->cacheq = VHD_BM_QUEUE_HOT;
+		list_add(&bm->lru, &c->hot);
+	} else {
+		bm->cacheq = VHD_BM_QUEUE_IN;
+		list_add(&bm->lru, &c->in);
+		c->in_count++;
+	}
 }
 
 static inline void
 free_vhd_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 {
-	int i;
-
-	for (i = 0; i < VHD_CACHE_SIZE; i++)
-		if (s->bitmap[i] == bm)
-			break;
-
 	ASSERT(!bitmap_locked(bm));
 	ASSERT(!bitmap_in_use(bm));
-	ASSERT(i < VHD_CACHE_SIZE);
+	ASSERT(bm->cacheq != VHD_BM_QUEUE_NONE);
 
-	s->bitmap[i] = NULL;
-	s->bitmap_free[s->bm_free_count++] = bm;
+	uncache_bitmap(s, bm);
+	s->bm_cache.free[s->bm_cache.free_count++] = bm;
 }
 
 static int
@@ -1186,7 +1654,7 @@ read_bitmap_cache(struct vhd_state *s, uint64_t sector, uint8_t op)
 
 	if (bat_entry(s, blk) == DD_BLK_UNUSED) {
 		if (op == VHD_OP_DATA_WRITE &&
-		    s->bat.pbw_blk != blk && bat_locked(s))
+		    !find_alloc(s, blk) && !can_allocate(s))
 			return VHD_BM_BAT_LOCKED;
 
 		return VHD_BM_BAT_CLEAR;
@@ -1198,10 +1666,12 @@ read_bitmap_cache(struct vhd_state *s, uint64_t sector, uint8_t op)
 	}
 
 	bm = get_bitmap(s, blk);
-	if (!bm)
+	if (!bm) {
+		s->bm_cache.misses++;
 		return VHD_BM_NOT_CACHED;
+	}
 
-	/* bump lru count */
+	s->bm_cache.hits++;
 	touch_bitmap(s, bm);
 
 	if (test_vhd_flag(bm->status, VHD_FLAG_BM_READ_PENDING))
@@ -1215,7 +1685,6 @@ static int
 read_bitmap_cache_span(struct vhd_state *s, 
 		       uint64_t sector, int nr_secs, int value)
 {
-	int ret;
 	uint32_t blk, sec;
 	struct vhd_bitmap *bm;
 
@@ -1233,33 +1702,44 @@ read_bitmap_cache_span(struct vhd_state *s,
 	
 	ASSERT(bm && bitmap_valid(bm));
 
-	for (ret = 0; sec < s->spb && ret < nr_secs; sec++, ret++)
-		if (vhd_bitmap_test(&s->vhd, bm->map, sec) != value)
-			break;
+	return vhd_bitmap_span(&s->vhd, bm->map, sec,
+			       MIN(s->spb, sec + nr_secs), value);
+}
 
-	return ret;
+/* requests come and go in virtual sectors, see vhd_data_shift() */
+static inline void
+vhd_complete_request(struct vhd_state *s, td_request_t treq, int err)
+{
+	treq.sec -= s->shift;
+	td_complete_request(treq, err);
+}
+
+static inline void
+vhd_forward_request(struct vhd_state *s, td_request_t treq)
+{
+	treq.sec -= s->shift;
+	td_forward_request(treq);
 }
 
 static inline struct vhd_request *
 alloc_vhd_request(struct vhd_state *s)
 {
-	struct vhd_request *req = NULL;
-	
-	if (s->vreq_free_count > 0) {
-		req = s->vreq_free[--s->vreq_free_count];
+	struct vhd_request *req;
+
+	req = td_pool_get(&s->vreq_pool);
+	if (req) {
 		ASSERT(req->treq.secs == 0);
 		init_vhd_request(s, req);
-		return req;
 	}
 
-	return NULL;
+	return req;
 }
 
 static inline void
 free_vhd_request(struct vhd_state *s, struct vhd_request *req)
 {
 	memset(req, 0, sizeof(struct vhd_request));
-	s->vreq_free[s->vreq_free_count++] = req;
+	td_pool_put(&s->vreq_pool, req);
 }
 
 static inline void
@@ -1294,47 +1774,176 @@ aio_write(struct vhd_state *s, struct vhd_request *req, uint64_t offset)
 	TRACE(s);
 }
 
-static inline uint64_t
+/* make sure space up to sector 'need' is reserved in the file */
+static void
+vhd_prealloc_extent(struct vhd_state *s, uint64_t need)
+{
+	int err;
+	off64_t eof;
+	uint64_t from, end;
+	struct timeval now, delta;
+	struct vhd_prealloc *p = &s->prealloc;
+
+	if (p->disabled || need <= p->end)
+		return;
+
+	eof = lseek64(s->vhd.fd, 0, SEEK_END);
+	if (eof == (off64_t)-1)
+		return;
+
+	/* the file grew past our last extent, that part isn't clean */
+	from = secs_round_up(eof);
+	if (from != p->end)
+		p->clean = MAX(p->clean, from);
+	from = MAX(from, p->end);
+
+	gettimeofday(&now, NULL);
+	if (p->extents) {
+		timersub(&now, &p->last, &delta);
+		if (delta.tv_sec < VHD_PREALLOC_FAST)
+			p->blocks = MIN(p->blocks * 2, VHD_PREALLOC_MAX);
+		else
+			p->blocks = MAX(p->blocks / 2, VHD_PREALLOC_MIN);
+	}
+
+	end = need + (p->blocks - 1) * (s->spb + s->bm_secs + s->spp);
+	if (end <= from)
+		return;
+
+	err = fallocate(s->vhd.fd, 0, vhd_sectors_to_bytes(from),
+			vhd_sectors_to_bytes(end - from));
+	if (err) {
+		err = -errno;
+		if (err == -EOPNOTSUPP || err == -ENOSYS) {
+			DPRINTF("%s: no preallocation: %d\n", s->vhd.file, err);
+			p->disabled = 1;
+		} else
+			DBG(TLOG_INFO, "%s: preallocating 0x%08"PRIx64
+			    "-0x%08"PRIx64": %d\n", s->vhd.file, from, end, err);
+		return;
+	}
+
+	DBG(TLOG_DBG, "%s: extent 0x%08"PRIx64"-0x%08"PRIx64", blocks: %u\n",
+	    s->vhd.file, from, end, p->blocks);
+
+	p->end  = end;
+	p->last = now;
+	p->extents++;
+}
+
+/*
+ * Space is handed out at next_db right away, so allocations in
+ * flight never overlap. Whatever a failed allocation reserved is given
+ * back if nothing was reserved after it, and leaked otherwise.
+ */
+static struct vhd_alloc *
 reserve_new_block(struct vhd_state *s, uint32_t blk)
 {
-	int gap = 0;
+	int i, gap = 0;
+	struct vhd_alloc *alloc;
+	struct vhd_prealloc *p = &s->prealloc;
 
-	ASSERT(!test_vhd_flag(s->bat.status, VHD_FLAG_BAT_WRITE_STARTED));
+	ASSERT(can_allocate(s) && !find_alloc(s, blk));
+
+	for (i = 0; i < VHD_BAT_ALLOCS; i++)
+		if (s->bat.alloc[i].state == VHD_ALLOC_FREE)
+			break;
+
+	ASSERT(i < VHD_BAT_ALLOCS);
+	alloc = &s->bat.alloc[i];
 
 	/* data region of segment should begin on page boundary */
 	if ((s->next_db + s->bm_secs) % s->spp)
 		gap = (s->spp - ((s->next_db + s->bm_secs) % s->spp));
 
-	s->bat.pbw_blk    = blk;
-	s->bat.pbw_offset = s->next_db + gap;
+	alloc->state  = VHD_ALLOC_ZERO_WRITE;
+	alloc->blk    = blk;
+	alloc->lb_end = s->next_db;
+	alloc->offset = s->next_db + gap;
+	alloc->seqno  = s->bat.alloc_seqno++;
+	alloc->error  = 0;
+	alloc->tx     = NULL;
+
+	s->next_db    = alloc->offset + s->bm_secs + s->spb;
+	s->bat.allocs++;
+
+	vhd_prealloc_extent(s, s->next_db);
+	if (alloc->lb_end >= p->clean && s->next_db <= p->end) {
+		alloc->zeroed = 1;
+		p->zeroed++;
+	}
+	p->clean = MAX(p->clean, s->next_db);
+
+	DBG(TLOG_DBG, "blk: 0x%04x, offset: 0x%08"PRIx64", allocs: %d\n",
+	    blk, alloc->offset, s->bat.allocs);
 
-	return s->next_db;
+	return alloc;
 }
 
-static int
+static void
+release_alloc(struct vhd_state *s, struct vhd_alloc *alloc)
+{
+	DBG(TLOG_DBG, "blk: 0x%04x, err: %d\n", alloc->blk, alloc->error);
+
+	if (bat_entry(s, alloc->blk) == DD_BLK_UNUSED &&
+	    s->next_db == alloc->offset + s->bm_secs + s->spb)
+		s->next_db = alloc->lb_end;
+
+	memset(alloc, 0, sizeof(*alloc));
+	s->bat.allocs--;
+}
+
+/*
+ * Write the bat sector of the oldest ready allocation, with every
+ * other ready allocation in that sector. Allocations becoming ready
+ * meanwhile go with the next write.
+ */
+static void
 schedule_bat_write(struct vhd_state *s)
 {
-	int i;
-	uint32_t blk;
+	int i, n;
 	char *buf;
+	uint32_t first;
 	uint64_t offset;
+	struct vhd_alloc *alloc, *oldest;
 	struct vhd_request *req;
 
-	ASSERT(bat_locked(s));
+	if (test_vhd_flag(s->bat.status, VHD_FLAG_BAT_WRITE_STARTED))
+		return;
+
+	oldest = NULL;
+	for (i = 0; i < VHD_BAT_ALLOCS; i++) {
+		alloc = &s->bat.alloc[i];
+		if (alloc->state == VHD_ALLOC_READY &&
+		    (!oldest || alloc->seqno < oldest->seqno))
+			oldest = alloc;
+	}
+
+	if (!oldest)
+		return;
 
-	req = &s->bat.req;
-	buf = s->bat.bat_buf;
-	blk = s->bat.pbw_blk;
+	req   = &s->bat.req;
+	buf   = s->bat.bat_buf;
+	first = oldest->blk - (oldest->blk % 128);
 
 	init_vhd_request(s, req);
-	memcpy(buf, &bat_entry(s, blk - (blk % 128)), 512);
+	memcpy(buf, &bat_entry(s, first), 512);
 
-	((uint32_t *)buf)[blk % 128] = s->bat.pbw_offset;
+	for (i = 0, n = 0; i < VHD_BAT_ALLOCS; i++) {
+		alloc = &s->bat.alloc[i];
+		if (alloc->state != VHD_ALLOC_READY ||
+		    alloc->blk - (alloc->blk % 128) != first)
+			continue;
+
+		((uint32_t *)buf)[alloc->blk % 128] = alloc->offset;
+		alloc->state = VHD_ALLOC_BAT_WRITE;
+		n++;
+	}
 
 	for (i = 0; i < 128; i++)
 		BE32_OUT(&((uint32_t *)buf)[i]);
 
-	offset         = s->vhd.header.table_offset + (blk - (blk % 128)) * 4;
+	offset         = s->vhd.header.table_offset + first * 4;
 	req->treq.secs = 1;
 	req->treq.buf  = buf;
 	req->op        = VHD_OP_BAT_WRITE;
@@ -1343,30 +1952,31 @@ schedule_bat_write(struct vhd_state *s)
 	aio_write(s, req, offset);
 	set_vhd_flag(s->bat.status, VHD_FLAG_BAT_WRITE_STARTED);
 
-	DBG(TLOG_DBG, "blk: 0x%04x, pbwo: 0x%08"PRIx64", "
-	    "table_offset: 0x%08"PRIx64"\n", blk, s->bat.pbw_offset, offset);
+	s->bat.writes++;
+	s->bat.written += n;
 
-	return 0;
+	DBG(TLOG_DBG, "first: 0x%04x, allocs: %d, "
+	    "table_offset: 0x%08"PRIx64"\n", first, n, offset);
 }
 
 static void
 schedule_zero_bm_write(struct vhd_state *s,
-		       struct vhd_bitmap *bm, uint64_t lb_end)
+		       struct vhd_bitmap *bm, struct vhd_alloc *alloc)
 {
 	uint64_t offset;
-	struct vhd_request *req = &s->bat.zero_req;
+	struct vhd_request *req = &alloc->zero_req;
 
 	init_vhd_request(s, req);
 
-	offset         = vhd_sectors_to_bytes(lb_end);
+	offset         = vhd_sectors_to_bytes(alloc->lb_end);
 	req->op        = VHD_OP_ZERO_BM_WRITE;
-	req->treq.sec  = s->bat.pbw_blk * s->spb;
-	req->treq.secs = (s->bat.pbw_offset - lb_end) + s->bm_secs;
+	req->treq.sec  = alloc->blk * s->spb;
+	req->treq.secs = (alloc->offset - alloc->lb_end) + s->bm_secs;
 	req->treq.buf  = vhd_zeros(vhd_sectors_to_bytes(req->treq.secs));
 	req->next      = NULL;
 
 	DBG(TLOG_DBG, "blk: 0x%04x, writing zero bitmap at 0x%08"PRIx64"\n",
-	    s->bat.pbw_blk, offset);
+	    alloc->blk, offset);
 
 	lock_bitmap(bm);
 	add_to_transaction(&bm->tx, req);
@@ -1426,15 +2036,15 @@ static int
 update_bat(struct vhd_state *s, uint32_t blk)
 {
 	int err;
-	uint64_t lb_end;
+	struct vhd_alloc *alloc;
 	struct vhd_bitmap *bm;
 
 	ASSERT(bat_entry(s, blk) == DD_BLK_UNUSED);
 	
-	if (bat_locked(s)) {
-		ASSERT(s->bat.pbw_blk == blk);
+	if (find_alloc(s, blk))
 		return 0;
-	}
+
+	ASSERT(can_allocate(s));
 
 	/* empty bitmap could already be in
 	 * cache if earlier bat update failed */
@@ -1448,60 +2058,63 @@ update_bat(struct vhd_state *s, uint32_t blk)
 		install_bitmap(s, bm);
 	}
 
-	lock_bat(s);
-	lb_end = reserve_new_block(s, blk);
-	schedule_zero_bm_write(s, bm, lb_end);
+	alloc = reserve_new_block(s, blk);
 	set_vhd_flag(bm->tx.status, VHD_FLAG_TX_UPDATE_BAT);
 
+	if (!alloc->zeroed) {
+		schedule_zero_bm_write(s, bm, alloc);
+		return 0;
+	}
+
+	lock_bitmap(bm);
+	alloc->state = VHD_ALLOC_READY;
+	schedule_bat_write(s);
+
 	return 0;
 }
 
 static int
 allocate_block(struct vhd_state *s, uint32_t blk)
 {
-	int err, gap;
+	int err;
 	uint64_t offset, size;
+	struct vhd_alloc *alloc;
 	struct vhd_bitmap *bm;
 	ssize_t count;
 
 	ASSERT(bat_entry(s, blk) == DD_BLK_UNUSED);
 
-	if (bat_locked(s)) {
-		ASSERT(s->bat.pbw_blk == blk);
-		if (s->bat.req.error)
+	alloc = find_alloc(s, blk);
+	if (alloc) {
+		if (alloc->error)
 			return -EBUSY;
 		return 0;
 	}
 
-	gap            = 0;
-	s->bat.pbw_blk = blk;
-	offset         = vhd_sectors_to_bytes(s->next_db);
-
-	/* data region of segment should begin on page boundary */
-	if ((s->next_db + s->bm_secs) % s->spp) {
-		gap = (s->spp - ((s->next_db + s->bm_secs) % s->spp));
-		s->next_db += gap;
-	}
+	ASSERT(can_allocate(s));
 
-	s->bat.pbw_offset = s->next_db;
+	alloc  = reserve_new_block(s, blk);
+	offset = vhd_sectors_to_bytes(alloc->lb_end);
 
-	DBG(TLOG_DBG, "blk: 0x%04x, pbwo: 0x%08"PRIx64"\n",
-	    blk, s->bat.pbw_offset);
+	if (alloc->zeroed)
+		goto bitmap;
 
 	if (lseek(s->vhd.fd, offset, SEEK_SET) == (off_t)-1) {
-		ERR(s, -errno, "lseek failed\n");
-		return -errno;
+		err = -errno;
+		ERR(s, err, "lseek failed\n");
+		goto fail;
 	}
 
-	size  = vhd_sectors_to_bytes(s->spb + s->bm_secs + gap);
+	size  = vhd_sectors_to_bytes(s->next_db - alloc->lb_end);
 	count = write(s->vhd.fd, vhd_zeros(size), size);
 	if (count != size) {
 		err = count < 0 ? -errno : -ENOSPC;
 		ERR(s, -errno,
 		    "write failed (%zd, offset %"PRIu64")\n", count, offset);
-		return err;
+		goto fail;
 	}
 
+ bitmap:
 	/* empty bitmap could already be in
 	 * cache if earlier bat update failed */
 	bm = get_bitmap(s, blk);
@@ -1509,17 +2122,22 @@ allocate_block(struct vhd_state *s, uint32_t blk)
 		/* install empty bitmap in cache */
 		err = alloc_vhd_bitmap(s, &bm, blk);
 		if (err) 
-			return err;
+			goto fail;
 
 		install_bitmap(s, bm);
 	}
 
-	lock_bat(s);
 	lock_bitmap(bm);
+	set_vhd_flag(bm->tx.status, VHD_FLAG_TX_UPDATE_BAT);
+	alloc->state = VHD_ALLOC_READY;
 	schedule_bat_write(s);
-	add_to_transaction(&bm->tx, &s->bat.req);
 
 	return 0;
+
+ fail:
+	alloc->error = err;
+	release_alloc(s, alloc);
+	return err;
 }
 
 static int 
@@ -1566,6 +2184,134 @@ schedule_data_read(struct vhd_state *s, td_request_t treq, vhd_flag_t flags)
 	return 0;
 }
 
+static inline int
+vhd_zblock_stored(struct vhd_state *s, uint32_t blk)
+{
+	return s->vhd.zmap[blk] < s->vhd.header.block_size;
+}
+
+static struct vhd_zblock *
+vhd_zcache_lookup(struct vhd_state *s, uint32_t blk)
+{
+	int i;
+	struct vhd_zblock *zb;
+
+	for (i = 0; i < VHD_ZCACHE_SIZE; i++) {
+		zb = &s->zcache.blocks[i];
+		if (zb->status != VHD_ZBLOCK_EMPTY && zb->blk == blk)
+			return zb;
+	}
+
+	return NULL;
+}
+
+/* least recently used idle block, with buffers */
+static struct vhd_zblock *
+vhd_zcache_victim(struct vhd_state *s)
+{
+	int i, err;
+	struct vhd_zblock *zb, *victim;
+
+	victim = NULL;
+
+	for (i = 0; i < VHD_ZCACHE_SIZE; i++) {
+		zb = &s->zcache.blocks[i];
+		if (zb->status == VHD_ZBLOCK_READ_PENDING ||
+		    zb->status == VHD_ZBLOCK_DECODE_PENDING)
+			continue;
+		if (!victim || zb->used < victim->used)
+			victim = zb;
+	}
+
+	if (!victim || victim->data)
+		return victim;
+
+	err = posix_memalign((void **)&victim->data, getpagesize(),
+			     s->vhd.header.block_size);
+	if (err) {
+		victim->data = NULL;
+		return NULL;
+	}
+
+	err = posix_memalign((void **)&victim->zbuf, getpagesize(),
+			     s->vhd.header.block_size);
+	if (err) {
+		free(victim->data);
+		victim->data = NULL;
+		victim->zbuf = NULL;
+		return NULL;
+	}
+
+	return victim;
+}
+
+static int
+schedule_zdata_read(struct vhd_state *s, td_request_t treq)
+{
+	uint64_t offset;
+	uint32_t blk, sec;
+	struct vhd_zblock *zb;
+	struct vhd_request *req;
+
+	blk = treq.sec / s->spb;
+	sec = treq.sec % s->spb;
+	zb  = vhd_zcache_lookup(s, blk);
+
+	if (zb && zb->status == VHD_ZBLOCK_VALID) {
+		memcpy(treq.buf, zb->data + vhd_sectors_to_bytes(sec),
+		       vhd_sectors_to_bytes(treq.secs));
+		zb->used = ++s->zcache.stamp;
+		s->zcache.hits++;
+		vhd_complete_request(s, treq, 0);
+		return 0;
+	}
+
+	req = alloc_vhd_request(s);
+	if (!req)
+		return -EBUSY;
+
+	req->treq = treq;
+	req->op   = VHD_OP_DATA_READ;
+	req->next = NULL;
+
+	if (zb) {
+		s->zcache.hits++;
+		add_to_tail(&zb->waiting, req);
+		return 0;
+	}
+
+	zb = vhd_zcache_victim(s);
+	if (!zb) {
+		free_vhd_request(s, req);
+		return -EBUSY;
+	}
+
+	zb->blk   = blk;
+	zb->status = VHD_ZBLOCK_READ_PENDING;
+	zb->zlen  = s->vhd.zmap[blk];
+	zb->used  = ++s->zcache.stamp;
+	zb->waiting.head = zb->waiting.tail = NULL;
+	add_to_tail(&zb->waiting, req);
+
+	offset = vhd_sectors_to_bytes(bat_entry(s, blk) + s->bm_secs);
+
+	td_prep_read(&zb->tiocb, s->vhd.fd, zb->zbuf,
+		     vhd_bytes_padded(zb->zlen), offset,
+		     vhd_complete_zread, zb);
+	td_queue_tiocb(s->driver, &zb->tiocb);
+
+	s->zcache.misses++;
+	s->queued++;
+	s->reads++;
+	s->read_size += secs_round_up_no_zero(zb->zlen);
+	TRACE(s);
+
+	DBG(TLOG_DBG, "%s: blk: 0x%04x, zlen: %u, offset: 0x%08"PRIx64"\n",
+	    s->vhd.file, blk, zb->zlen, offset);
+
+	return 0;
+}
+
 static int
 schedule_data_write(struct vhd_state *s, td_request_t treq, vhd_flag_t flags)
 {
@@ -1593,7 +2339,7 @@ schedule_data_write(struct vhd_state *s, td_request_t treq, vhd_flag_t flags)
 		if (err)
 			return err;
 
-		offset = s->bat.pbw_offset;
+		offset = find_alloc(s, blk)->offset;
 	}
 
 	offset += s->bm_secs + sec;
@@ -1692,8 +2438,9 @@ schedule_bitmap_write(struct vhd_state *s, uint32_t blk)
 	       !test_vhd_flag(bm->status, VHD_FLAG_BM_WRITE_PENDING));
 
 	if (offset == DD_BLK_UNUSED) {
-		ASSERT(bat_locked(s) && s->bat.pbw_blk == blk);
-		offset = s->bat.pbw_offset;
+		struct vhd_alloc *alloc = find_alloc(s, blk);
+		ASSERT(alloc);
+		offset = alloc->offset;
 	}
 	
 	offset = vhd_sectors_to_bytes(offset);
@@ -1755,7 +2502,7 @@ __vhd_queue_request(struct vhd_state *s, uint8_t op, td_request_t treq)
 }
 
 static void
-vhd_queue_read(td_driver_t *driver, td_request_t treq)
+__vhd_queue_read(td_driver_t *driver, td_request_t treq)
 {
 	struct vhd_state *s = (struct vhd_state *)driver->data;
 
@@ -1776,17 +2523,21 @@ vhd_queue_read(td_driver_t *driver, td_request_t treq)
 
 		case VHD_BM_BAT_CLEAR:
 			clone.secs = MIN(clone.secs, s->spb - (clone.sec % s->spb));
-			td_forward_request(clone);
+			vhd_forward_request(s, clone);
 			break;
 
 		case VHD_BM_BIT_CLEAR:
 			clone.secs = read_bitmap_cache_span(s, clone.sec, clone.secs, 0);
-			td_forward_request(clone);
+			vhd_forward_request(s, clone);
 			break;
 
 		case VHD_BM_BIT_SET:
 			clone.secs = read_bitmap_cache_span(s, clone.sec, clone.secs, 1);
-			err = schedule_data_read(s, clone, 0);
+			if (s->zcache.active &&
+			    vhd_zblock_stored(s, clone.sec / s->spb))
+				err = schedule_zdata_read(s, clone);
+			else
+				err = schedule_data_read(s, clone, 0);
 			if (err)
 				goto fail;
 			break;
@@ -1822,13 +2573,35 @@ vhd_queue_read(td_driver_t *driver, td_request_t treq)
 
 	fail:
 		clone.secs = treq.secs;
-		td_complete_request(clone, err);
+		vhd_complete_request(s, clone, err);
 		break;
 	}
 }
 
+/*
+ * Where a dynamic disk holds no data, unallocated blocks and clear
+ * bitmap bits alike, reads return zeros. Writing zeros there changes
+ * nothing, so it completes without allocating. Differencing disks
+ * have to store them to mask the parent.
+ */
+static int
+vhd_elide_zero_write(struct vhd_state *s, td_request_t clone)
+{
+	if (s->vhd.footer.type == HD_TYPE_DIFF)
+		return 0;
+
+	if (!tapdisk_buf_zero(clone.buf, vhd_sectors_to_bytes(clone.secs)))
+		return 0;
+
+	s->zero_writes++;
+	s->zero_size += clone.secs;
+
+	vhd_complete_request(s, clone, 0);
+	return 1;
+}
+
 static void
-vhd_queue_write(td_driver_t *driver, td_request_t treq)
+__vhd_queue_write(td_driver_t *driver, td_request_t treq)
 {
 	struct vhd_state *s = (struct vhd_state *)driver->data;
 
@@ -1857,6 +2630,8 @@ vhd_queue_write(td_driver_t *driver, td_request_t treq)
 			flags      = (VHD_FLAG_REQ_UPDATE_BAT |
 				      VHD_FLAG_REQ_UPDATE_BITMAP);
 			clone.secs = MIN(clone.secs, s->spb - (clone.sec % s->spb));
+			if (vhd_elide_zero_write(s, clone))
+				break;
 			err        = schedule_data_write(s, clone, flags);
 			if (err)
 				goto fail;
@@ -1865,6 +2640,8 @@ vhd_queue_write(td_driver_t *driver, td_request_t treq)
 		case VHD_BM_BIT_CLEAR:
 			flags      = VHD_FLAG_REQ_UPDATE_BITMAP;
 			clone.secs = read_bitmap_cache_span(s, clone.sec, clone.secs, 0);
+			if (vhd_elide_zero_write(s, clone))
+				break;
 			err        = schedule_data_write(s, clone, flags);
 			if (err)
 				goto fail;
@@ -1907,11 +2684,259 @@ vhd_queue_write(td_driver_t *driver, td_request_t treq)
 
 	fail:
 		clone.secs = treq.secs;
-		td_complete_request(clone, err);
+		vhd_complete_request(s, clone, err);
 		break;
 	}
 }
 
+/*
+ * Discards.
+ *
+ * Whole blocks are released: their bat entries go back to
+ * DD_BLK_UNUSED with a single bat sector write, and once that is on
+ * disk the blocks are punched out of the file. Blocks are still
+ * allocated at next_db, so released space is not reused in the file.
+ *
+ * Partial blocks have their bitmap bits cleared, in a bitmap
+ * transaction of their own, and the data punched. Either needs the
+ * block idle: a bitmap in a transaction, or any bat update in flight,
+ * bounce the discard with -EBUSY for the vbd to retry.
+ */
+static void
+vhd_discard_data(struct vhd_state *s, uint64_t sec, uint64_t secs)
+{
+	int err;
+
+	/* best effort, the metadata no longer points here */
+	err = tapdisk_discard_range(s->vhd.fd, vhd_sectors_to_bytes(sec),
+				    vhd_sectors_to_bytes(secs));
+	if (err && err != -EOPNOTSUPP)
+		DBG(TLOG_INFO, "%s: discard sec 0x%08"PRIx64", secs 0x%"PRIx64
+		    ": %d\n", s->vhd.file, sec, secs, err);
+}
+
+static inline int
+block_idle(struct vhd_state *s, uint32_t blk)
+{
+	struct vhd_bitmap *bm = get_bitmap(s, blk);
+
+	return !bm || (!bitmap_locked(bm) && !bitmap_in_use(bm));
+}
+
+static int
+schedule_bat_release(struct vhd_state *s, td_request_t treq)
+{
+	int i;
+	char *buf;
+	uint64_t offset;
+	uint32_t blk, first, n;
+	struct vhd_bitmap  *bm;
+	struct vhd_request *req;
+
+	ASSERT(bat_idle(s));
+
+	req = alloc_vhd_request(s);
+	if (!req)
+		return -EBUSY;
+
+	blk   = treq.sec / s->spb;
+	n     = treq.secs / s->spb;
+	first = blk - (blk % 128);
+	buf   = s->bat.bat_buf;
+
+	memcpy(s->bat.released, &bat_entry(s, first), 512);
+
+	for (i = 0; i < n; i++) {
+		bm = get_bitmap(s, blk + i);
+		if (bm)
+			free_vhd_bitmap(s, bm);
+
+		clear_batmap(s, blk + i);
+		bat_entry(s, blk + i) = DD_BLK_UNUSED;
+	}
+
+	memcpy(buf, &bat_entry(s, first), 512);
+
+	for (i = 0; i < 128; i++)
+		BE32_OUT(&((uint32_t *)buf)[i]);
+
+	/* no block may be allocated until the release is done */
+	lock_bat(s);
+
+	offset    = s->vhd.header.table_offset + first * 4;
+	req->treq = treq;
+	req->op   = VHD_OP_BAT_RELEASE;
+	req->next = NULL;
+
+	td_prep_write(&req->tiocb, s->vhd.fd, buf, 512,
+		      offset, vhd_complete, req);
+	td_queue_tiocb(s->driver, &req->tiocb);
+
+	s->queued++;
+	s->writes++;
+	s->write_size++;
+	TRACE(s);
+
+	DBG(TLOG_DBG, "blk: 0x%04x, n: %u, table_offset: 0x%08"PRIx64"\n",
+	    blk, n, offset);
+
+	return 0;
+}
+
+static int
+schedule_bitmap_discard(struct vhd_state *s,
+			struct vhd_bitmap *bm, td_request_t treq)
+{
+	int i;
+	uint32_t sec;
+	struct vhd_request *req;
+
+	ASSERT(bitmap_valid(bm) && !bitmap_locked(bm));
+
+	sec = treq.sec % s->spb;
+
+	for (i = 0; i < treq.secs; i++)
+		if (vhd_bitmap_test(&s->vhd, bm->map, sec + i))
+			break;
+
+	/* nothing allocated in range */
+	if (i == treq.secs) {
+		vhd_complete_request(s, treq, 0);
+		return 0;
+	}
+
+	req = alloc_vhd_request(s);
+	if (!req)
+		return -EBUSY;
+
+	req->treq = treq;
+	req->op   = VHD_OP_DATA_DISCARD;
+	req->next = NULL;
+
+	lock_bitmap(bm);
+	add_to_transaction(&bm->tx, req);
+	bm->tx.finished++;
+
+	for (i = 0; i < treq.secs; i++)
+		vhd_bitmap_clear(&s->vhd, bm->shadow, sec + i);
+
+	clear_batmap(s, bm->blk);
+
+	/*
+	 * punched before the bitmap is written: should that fail, the
+	 * range reads back zeros instead, which a discard allows.
+	 */
+	vhd_discard_data(s, bat_entry(s, bm->blk) + s->bm_secs + sec,
+			 treq.secs);
+
+	finish_data_transaction(s, bm);
+
+	return 0;
+}
+
+static void
+__vhd_queue_discard(td_driver_t *driver, td_request_t treq)
+{
+	struct vhd_state *s = (struct vhd_state *)driver->data;
+
+	DBG(TLOG_DBG, "%s: lsec: 0x%08"PRIx64", secs: 0x%04x\n",
+	    s->vhd.file, treq.sec, treq.secs);
+
+	s->discards++;
+	s->discard_size += treq.secs;
+
+	if (s->vhd.footer.type == HD_TYPE_FIXED) {
+		vhd_discard_data(s, treq.sec, treq.secs);
+		vhd_complete_request(s, treq, 0);
+		return;
+	}
+
+	while (treq.secs) {
+		int err;
+		uint32_t blk, sec, n;
+		struct vhd_bitmap *bm;
+		td_request_t clone;
+
+		err   = 0;
+		clone = treq;
+		blk   = clone.sec / s->spb;
+		sec   = clone.sec % s->spb;
+
+		clone.secs = MIN(clone.secs, s->spb - sec);
+
+		if (blk > s->vhd.header.max_bat_size) {
+			err = -EINVAL;
+			goto fail;
+		}
+
+		if (bat_entry(s, blk) == DD_BLK_UNUSED) {
+			vhd_complete_request(s, clone, 0);
+			goto next;
+		}
+
+		if (!sec && clone.secs == s->spb) {
+			if (!bat_idle(s) || !block_idle(s, blk)) {
+				err = -EBUSY;
+				goto fail;
+			}
+
+			/* following whole blocks in the same bat sector */
+			for (n = 1; (blk + n) % 128 &&
+				     (uint32_t)treq.secs >= (n + 1) * s->spb; n++)
+				if (blk + n > s->vhd.header.max_bat_size ||
+				    bat_entry(s, blk + n) == DD_BLK_UNUSED ||
+				    !block_idle(s, blk + n))
+					break;
+
+			clone.secs = n * s->spb;
+			err = schedule_bat_release(s, clone);
+			if (err)
+				goto fail;
+			goto next;
+		}
+
+		bm = get_bitmap(s, blk);
+		if (!bm) {
+			err = schedule_bitmap_read(s, blk);
+			if (err)
+				goto fail;
+
+			err = __vhd_queue_request(s, VHD_OP_DATA_DISCARD, clone);
+			if (err)
+				goto fail;
+		} else if (!bitmap_valid(bm)) {
+			err = __vhd_queue_request(s, VHD_OP_DATA_DISCARD, clone);
+			if (err)
+				goto fail;
+		} else if (bitmap_locked(bm) || bitmap_in_use(bm)) {
+			err = -EBUSY;
+			goto fail;
+		} else {
+			err = schedule_bitmap_discard(s, bm, clone);
+			if (err)
+				goto fail;
+		}
+
+	next:
+		treq.sec  += clone.secs;
+		treq.secs -= clone.secs;
+		continue;
+
+	fail:
+		clone.secs = treq.secs;
+		vhd_complete_request(s, clone, err);
+		break;
+	}
+}
+
+static int
+vhd_sync(td_driver_t *driver)
+{
+	struct vhd_state *s = (struct vhd_state *)driver->data;
+
+	return fdatasync(s->vhd.fd) ? -errno : 0;
+}
+
 static inline void
 signal_completion(struct vhd_request *list, int error)
 {
@@ -1929,7 +2954,7 @@ signal_completion(struct vhd_request *list, int error)
 
 		err  = (error ? error : r->error);
 		next = r->next;
-		td_complete_request(r->treq, err);
+		vhd_complete_request(s, r->treq, err);
 		DBG(TLOG_DBG, "lsec: 0x%08"PRIx64", blk: 0x%04"PRIx64", "
 		    "err: %d\n", r->treq.sec, r->treq.sec / s->spb, err);
 		free_vhd_request(s, r);
@@ -1985,15 +3010,14 @@ start_new_bitmap_transaction(struct vhd_state *s, struct vhd_bitmap *bm)
 static void
 finish_bat_transaction(struct vhd_state *s, struct vhd_bitmap *bm)
 {
+	struct vhd_alloc *alloc;
 	struct vhd_transaction *tx = &bm->tx;
 
-	if (!bat_locked(s))
+	alloc = find_alloc(s, bm->blk);
+	if (!alloc || alloc->state != VHD_ALLOC_DONE)
 		return;
 
-	if (s->bat.pbw_blk != bm->blk)
-		return;
-
-	if (!s->bat.req.error)
+	if (!alloc->error)
 		goto release;
 
 	if (!test_vhd_flag(tx->status, VHD_FLAG_TX_LIVE))
@@ -2003,9 +3027,7 @@ finish_bat_transaction(struct vhd_state *s, struct vhd_bitmap *bm)
 	return;
 
  release:
-	DBG(TLOG_DBG, "blk: 0x%04x\n", bm->blk);
-	unlock_bat(s);
-	init_bat(s);
+	release_alloc(s, alloc);
 }
 
 static void
@@ -2019,15 +3041,13 @@ finish_bitmap_transaction(struct vhd_state *s,
 	tx->error = (tx->error ? tx->error : error);
 	map_size  = vhd_sectors_to_bytes(s->bm_secs);
 
-	if (!test_vhd_flag(s->flags, VHD_FLAG_OPEN_PREALLOCATE)) {
-		if (test_vhd_flag(tx->status, VHD_FLAG_TX_UPDATE_BAT)) {
-			/* still waiting for bat write */
-			ASSERT(bm->blk == s->bat.pbw_blk);
-			ASSERT(test_vhd_flag(s->bat.status, 
-					     VHD_FLAG_BAT_WRITE_STARTED));
-			s->bat.req.tx = tx;
-			return;
-		}
+	if (test_vhd_flag(tx->status, VHD_FLAG_TX_UPDATE_BAT)) {
+		/* still waiting for bat write */
+		struct vhd_alloc *alloc = find_alloc(s, bm->blk);
+		ASSERT(alloc && (alloc->state == VHD_ALLOC_READY ||
+				 alloc->state == VHD_ALLOC_BAT_WRITE));
+		alloc->tx = tx;
+		return;
 	}
 
 	if (tx->error) {
@@ -2067,75 +3087,122 @@ finish_data_transaction(struct vhd_state *s, struct vhd_bitmap *bm)
 }
 
 static void
-finish_bat_write(struct vhd_request *req)
+finish_alloc(struct vhd_state *s, struct vhd_alloc *alloc, int error)
 {
 	struct vhd_bitmap *bm;
 	struct vhd_transaction *tx;
+
+	bm = get_bitmap(s, alloc->blk);
+
+	DBG(TLOG_DBG, "blk 0x%04x, offset: 0x%08"PRIx64", err %d\n",
+	    alloc->blk, alloc->offset, error);
+	ASSERT(bm && bitmap_valid(bm));
+
+	tx = &bm->tx;
+
+	alloc->state = VHD_ALLOC_DONE;
+	alloc->error = error;
+
+	/* no transaction yet if the first write couldn't be queued */
+	if (!error)
+		bat_entry(s, alloc->blk) = alloc->offset;
+	else if (test_vhd_flag(tx->status, VHD_FLAG_TX_LIVE))
+		tx->error = error;
+
+	clear_vhd_flag(tx->status, VHD_FLAG_TX_UPDATE_BAT);
+	if (alloc->tx)
+		finish_bitmap_transaction(s, bm, error);
+
+	finish_bat_transaction(s, bm);
+}
+
+static void
+finish_bat_write(struct vhd_request *req)
+{
+	int i;
 	struct vhd_state *s = req->state;
 
 	s->returned++;
 	TRACE(s);
 
-	bm = get_bitmap(s, s->bat.pbw_blk);
+	DBG(TLOG_DBG, "allocs: %d, err %d\n", s->bat.allocs, req->error);
+	ASSERT(test_vhd_flag(s->bat.status, VHD_FLAG_BAT_WRITE_STARTED));
 
-	DBG(TLOG_DBG, "blk 0x%04x, pbwo: 0x%08"PRIx64", err %d\n",
-	    s->bat.pbw_blk, s->bat.pbw_offset, req->error);
-	ASSERT(bm && bitmap_valid(bm));
-	ASSERT(bat_locked(s) &&
-	       test_vhd_flag(s->bat.status, VHD_FLAG_BAT_WRITE_STARTED));
+	for (i = 0; i < VHD_BAT_ALLOCS; i++) {
+		struct vhd_alloc *alloc = &s->bat.alloc[i];
+		if (alloc->state == VHD_ALLOC_BAT_WRITE)
+			finish_alloc(s, alloc, req->error);
+	}
 
-	tx = &bm->tx;
-	ASSERT(test_vhd_flag(tx->status, VHD_FLAG_TX_LIVE));
+	clear_vhd_flag(s->bat.status, VHD_FLAG_BAT_WRITE_STARTED);
+	schedule_bat_write(s);
+}
 
-	if (!req->error) {
-		bat_entry(s, s->bat.pbw_blk) = s->bat.pbw_offset;
-		s->next_db = s->bat.pbw_offset + s->spb + s->bm_secs;
-	} else
-		tx->error = req->error;
+static void
+finish_bat_release(struct vhd_request *req)
+{
+	uint32_t i, n, blk, first, old;
+	struct vhd_state *s = req->state;
 
-	if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_PREALLOCATE)) {
-		tx->finished++;
-		remove_from_req_list(&tx->requests, req);
-		if (transaction_completed(tx))
-			finish_data_transaction(s, bm);
-	} else {
-		clear_vhd_flag(tx->status, VHD_FLAG_TX_UPDATE_BAT);
-		if (s->bat.req.tx)
-			finish_bitmap_transaction(s, bm, req->error);
+	blk   = req->treq.sec / s->spb;
+	n     = req->treq.secs / s->spb;
+	first = blk - (blk % 128);
+
+	DBG(TLOG_DBG, "blk: 0x%04x, n: %u, err: %d\n", blk, n, req->error);
+	ASSERT(bat_locked(s) && !s->bat.allocs);
+
+	for (i = 0; i < n; i++) {
+		old = s->bat.released[blk + i - first];
+
+		if (req->error)
+			bat_entry(s, blk + i) = old;
+		else
+			vhd_discard_data(s, old, s->bm_secs + s->spb);
 	}
 
-	finish_bat_transaction(s, bm);
+	if (!req->error)
+		s->released += n;
+
+	unlock_bat(s);
+	init_bat(s);
+
+	signal_completion(req, 0);
 }
 
 static void
 finish_zero_bm_write(struct vhd_request *req)
 {
 	uint32_t blk;
+	struct vhd_alloc *alloc;
 	struct vhd_bitmap *bm;
 	struct vhd_transaction *tx = req->tx;
 	struct vhd_state *s = req->state;
+	int err = req->error;
 
 	s->returned++;
 	TRACE(s);
 
-	blk = req->treq.sec / s->spb;
-	bm  = get_bitmap(s, blk);
+	blk   = req->treq.sec / s->spb;
+	bm    = get_bitmap(s, blk);
+	alloc = find_alloc(s, blk);
 
 	DBG(TLOG_DBG, "blk: 0x%04x\n", blk);
-	ASSERT(bat_locked(s));
-	ASSERT(s->bat.pbw_blk == blk);
+	ASSERT(alloc && alloc->state == VHD_ALLOC_ZERO_WRITE);
 	ASSERT(bm && bitmap_valid(bm) && bitmap_locked(bm));
 
 	tx->finished++;
 	remove_from_req_list(&tx->requests, req);
 
-	if (req->error) {
-		unlock_bat(s);
-		init_bat(s);
-		tx->error = req->error;
+	if (err) {
+		/* req is part of alloc, don't touch it from here on */
+		alloc->error = err;
+		release_alloc(s, alloc);
+		tx->error = err;
 		clear_vhd_flag(tx->status, VHD_FLAG_TX_UPDATE_BAT);
-	} else
+	} else {
+		alloc->state = VHD_ALLOC_READY;
 		schedule_bat_write(s);
+	}
 
 	if (transaction_completed(tx))
 		finish_data_transaction(s, bm);
@@ -2193,12 +3260,15 @@ finish_bitmap_read(struct vhd_request *req)
 			free_vhd_request(s, r);
 
 			ASSERT(tmp.op == VHD_OP_DATA_READ || 
-			       tmp.op == VHD_OP_DATA_WRITE);
+			       tmp.op == VHD_OP_DATA_WRITE ||
+			       tmp.op == VHD_OP_DATA_DISCARD);
 
 			if (tmp.op == VHD_OP_DATA_READ)
-				vhd_queue_read(s->driver, tmp.treq);
+				__vhd_queue_read(s->driver, tmp.treq);
 			else if (tmp.op == VHD_OP_DATA_WRITE)
-				vhd_queue_write(s->driver, tmp.treq);
+				__vhd_queue_write(s->driver, tmp.treq);
+			else if (tmp.op == VHD_OP_DATA_DISCARD)
+				__vhd_queue_discard(s->driver, tmp.treq);
 
 			r = next;
 		}
@@ -2249,6 +3319,73 @@ finish_data_read(struct vhd_request *req)
 	signal_completion(req, 0);
 }
 
+static void
+finish_zdata_read(struct vhd_zblock *zb, int error)
+{
+	uint32_t sec;
+	struct vhd_request *r, *list;
+	struct vhd_state *s = zb->state;
+
+	list = zb->waiting.head;
+	zb->waiting.head = zb->waiting.tail = NULL;
+
+	if (error) {
+		s->zcache.errors++;
+		ERR(s, error, "%s: blk: %u, zlen: %u",
+		    s->vhd.file, zb->blk, zb->zlen);
+		zb->status = VHD_ZBLOCK_EMPTY;
+	} else
+		zb->status = VHD_ZBLOCK_VALID;
+
+	for (r = list; r && !error; r = r->next) {
+		sec = r->treq.sec % s->spb;
+		memcpy(r->treq.buf, zb->data + vhd_sectors_to_bytes(sec),
+		       vhd_sectors_to_bytes(r->treq.secs));
+	}
+
+	signal_completion(list, error);
+}
+
+static int
+vhd_zblock_work(struct td_zjob *job)
+{
+	struct vhd_zblock *zb = containerof(job, struct vhd_zblock, job);
+
+	return vhd_zblock_decode(&zb->state->vhd, zb->zbuf,
+				 zb->zlen, zb->data);
+}
+
+static void
+vhd_zblock_done(struct td_zjob *job, int error)
+{
+	struct vhd_zblock *zb = containerof(job, struct vhd_zblock, job);
+
+	finish_zdata_read(zb, error);
+}
+
+static void
+vhd_complete_zread(void *arg, struct tiocb *tiocb, int err)
+{
+	struct vhd_zblock *zb = (struct vhd_zblock *)arg;
+	struct vhd_state *s = zb->state;
+
+	s->completed++;
+	TRACE(s);
+
+	if (err) {
+		finish_zdata_read(zb, err);
+		return;
+	}
+
+	zb->status   = VHD_ZBLOCK_DECODE_PENDING;
+	zb->job.work = vhd_zblock_work;
+	zb->job.done = vhd_zblock_done;
+
+	err = td_zpool_queue(&s->zcache.port, &zb->job);
+	if (err)
+		finish_zdata_read(zb, err);
+}
+
 static void
 finish_data_write(struct vhd_request *req)
 {
@@ -2337,12 +3474,30 @@ vhd_complete(void *arg, struct tiocb *tiocb, int err)
 		finish_bat_write(req);
 		break;
 
+	case VHD_OP_BAT_RELEASE:
+		finish_bat_release(req);
+		break;
+
 	default:
 		ASSERT(0);
 		break;
 	}
 }
 
+static void
+vhd_debug_request(void *obj, unsigned int i, void *arg)
+{
+	struct vhd_request *r = obj;
+	td_request_t *t       = &r->treq;
+	const char *vname     = t->vreq ? t->vreq->name: NULL;
+
+	if (t->secs)
+		DBG(TLOG_WARN, "%u: vreq: %s.%d, err: %d, op: %d,"
+		    " lsec: 0x%08"PRIx64", flags: %d, this: %p, "
+		    "next: %p, tx: %p\n", i, vname, t->sidx, r->error, r->op,
+		    t->sec, r->flags, r, r->next, r->tx);
+}
+
 void 
 vhd_debug(td_driver_t *driver)
 {
@@ -2356,27 +3511,34 @@ vhd_debug(td_driver_t *driver)
 	    s->writes, (s->writes ? ((float)s->write_size / s->writes) : 0.0));
 	DBG(TLOG_WARN, "READS: 0x%08"PRIx64", AVG_READ_SIZE: %f\n",
 	    s->reads, (s->reads ? ((float)s->read_size / s->reads) : 0.0));
-
-	DBG(TLOG_WARN, "ALLOCATED REQUESTS: (%u total)\n", VHD_REQS_DATA);
-	for (i = 0; i < VHD_REQS_DATA; i++) {
-		struct vhd_request *r = &s->vreq_list[i];
-		td_request_t *t       = &r->treq;
-		const char *vname     = t->vreq ? t->vreq->name: NULL;
-		if (t->secs)
-			DBG(TLOG_WARN, "%d: vreq: %s.%d, err: %d, op: %d,"
-			    " lsec: 0x%08"PRIx64", flags: %d, this: %p, "
-			    "next: %p, tx: %p\n", i, vname, t->sidx, r->error, r->op,
-			    t->sec, r->flags, r, r->next, r->tx);
-	}
-
-	DBG(TLOG_WARN, "BITMAP CACHE:\n");
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
+	DBG(TLOG_WARN, "DISCARDS: 0x%08"PRIx64", AVG_DISCARD_SIZE: %f, "
+	    "RELEASED: 0x%08"PRIx64"\n", s->discards,
+	    (s->discards ? ((float)s->discard_size / s->discards) : 0.0),
+	    s->released);
+	DBG(TLOG_WARN, "ZERO_WRITES: 0x%08"PRIx64", ZERO_SIZE: 0x%08"PRIx64"\n",
+	    s->zero_writes, s->zero_size);
+	DBG(TLOG_WARN, "PREALLOC: disabled: %d, extents: 0x%08"PRIx64", "
+	    "blocks: %u, zeroed: 0x%08"PRIx64", end: 0x%08"PRIx64"\n",
+	    s->prealloc.disabled, s->prealloc.extents, s->prealloc.blocks,
+	    s->prealloc.zeroed, s->prealloc.end);
+
+	DBG(TLOG_WARN, "ALLOCATED REQUESTS: (%u of %u total)\n",
+	    s->vreq_pool.count, VHD_REQS_DATA);
+	td_pool_for_each(&s->vreq_pool, vhd_debug_request, NULL);
+
+	DBG(TLOG_WARN, "BITMAP CACHE: size: %d, allocated: %d, in: %d, "
+	    "hits: 0x%08"PRIx64", misses: 0x%08"PRIx64", ghost hits: 0x%08"
+	    PRIx64", evictions: 0x%08"PRIx64"\n", s->bm_cache.size,
+	    s->bm_cache.count, s->bm_cache.in_count, s->bm_cache.hits,
+	    s->bm_cache.misses, s->bm_cache.ghost_hits,
+	    s->bm_cache.evictions);
+	for (i = 0; i < s->bm_cache.count; i++) {
 		int qnum = 0, wnum = 0, rnum = 0;
-		struct vhd_bitmap *bm = s->bitmap[i];
+		struct vhd_bitmap *bm = s->bm_cache.all[i];
 		struct vhd_transaction *tx;
 		struct vhd_request *r;
 
-		if (!bm)
+		if (bm->cacheq == VHD_BM_QUEUE_NONE)
 			continue;
 
 		tx = &bm->tx;
@@ -2398,17 +3560,28 @@ vhd_debug(td_driver_t *driver)
 			r = r->next;
 		}
 
-		DBG(TLOG_WARN, "%d: blk: 0x%04x, status: 0x%08x, q: %p, qnum: %d, w: %p, "
-		    "wnum: %d, locked: %d, in use: %d, tx: %p, tx_error: %d, "
-		    "started: %d, finished: %d, status: %u, reqs: %p, nreqs: %d\n",
-		    i, bm->blk, bm->status, bm->queue.head, qnum, bm->waiting.head,
+		DBG(TLOG_WARN, "%d: blk: 0x%04x, %s, status: 0x%08x, q: %p, "
+		    "qnum: %d, w: %p, wnum: %d, locked: %d, in use: %d, tx: %p, "
+		    "tx_error: %d, started: %d, finished: %d, status: %u, "
+		    "reqs: %p, nreqs: %d\n", i, bm->blk,
+		    bm->cacheq == VHD_BM_QUEUE_HOT ? "hot" : "in",
+		    bm->status, bm->queue.head, qnum, bm->waiting.head,
 		    wnum, bitmap_locked(bm), bitmap_in_use(bm), tx, tx->error,
 		    tx->started, tx->finished, tx->status, tx->requests.head, rnum);
 	}
 
-	DBG(TLOG_WARN, "BAT: status: 0x%08x, pbw_blk: 0x%04x, "
-	    "pbw_off: 0x%08"PRIx64", tx: %p\n", s->bat.status, s->bat.pbw_blk,
-	    s->bat.pbw_offset, s->bat.req.tx);
+	DBG(TLOG_WARN, "BAT: status: 0x%08x, allocs: %d, writes: 0x%08"PRIx64
+	    ", AVG_ALLOCS_PER_WRITE: %f\n", s->bat.status, s->bat.allocs,
+	    s->bat.writes, (s->bat.writes ?
+			    ((float)s->bat.written / s->bat.writes) : 0.0));
+	for (i = 0; i < VHD_BAT_ALLOCS; i++) {
+		struct vhd_alloc *alloc = &s->bat.alloc[i];
+		if (alloc->state != VHD_ALLOC_FREE)
+			DBG(TLOG_WARN, "%d: blk: 0x%04x, state: %u, "
+			    "offset: 0x%08"PRIx64", err: %d, tx: %p\n",
+			    i, alloc->blk, alloc->state, alloc->offset,
+			    alloc->error, alloc->tx);
+	}
 
 /*
 	for (i = 0; i < s->hdr.max_bat_size; i++)
@@ -2416,6 +3589,184 @@ vhd_debug(td_driver_t *driver)
 */
 }
 
+/*
+ * Blocks go at next_db, the footer after them: into the rest of the LV,
+ * or of the file and the free space of its filesystem.
+ */
+static int
+vhd_headroom(td_driver_t *driver, int64_t *space, uint64_t *allocated)
+{
+	struct vhd_state *s = (struct vhd_state *)driver->data;
+	uint64_t end, size, secs;
+	struct statfs fst;
+	uint32_t ssize;
+	int err;
+
+	if (!vhd_type_dynamic(&s->vhd))
+		return -EOPNOTSUPP;
+
+	err = tapdisk_get_image_size(s->vhd.fd, &secs, &ssize);
+	if (err)
+		return err;
+
+	end  = vhd_sectors_to_bytes(s->next_db) + sizeof(vhd_footer_t);
+	size = secs << SECTOR_SHIFT;
+
+	if (driver->storage != TAPDISK_STORAGE_TYPE_LVM) {
+		if (fstatfs(s->vhd.fd, &fst))
+			return -errno;
+		size = MAX(size, end) + (uint64_t)fst.f_bavail * fst.f_bsize;
+	}
+
+	*space     = (int64_t)size - (int64_t)end;
+	*allocated = vhd_sectors_to_bytes(s->next_db);
+
+	return 0;
+}
+
+/*
+ * Whether any of the sectors may hold data, from the BAT and whatever
+ * bitmaps happen to be cached. Blocks not cached are reported as
+ * holding data, so a 0 is final, while a 1 may not be.
+ */
+static int
+vhd_allocated(td_driver_t *driver, td_sector_t sector, int nr_secs)
+{
+	struct vhd_state *s = (struct vhd_state *)driver->data;
+	struct vhd_bitmap *bm;
+	uint64_t blk, start, end, first, last;
+
+	if (!vhd_type_dynamic(&s->vhd))
+		return 1;
+
+	if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_NO_CACHE))
+		return -EOPNOTSUPP;
+
+	sector += s->shift;
+	end     = sector + nr_secs;
+
+	for (blk = sector / s->spb; blk * s->spb < end; blk++) {
+		if (blk >= s->bat.bat.entries)
+			break;
+
+		if (bat_entry(s, blk) == DD_BLK_UNUSED) {
+			if (find_alloc(s, blk))
+				return 1;
+			continue;
+		}
+
+		if (test_batmap(s, blk))
+			return 1;
+
+		bm = get_bitmap(s, blk);
+		if (!bm || !bitmap_valid(bm))
+			return 1;
+
+		start = blk * s->spb;
+		first = MAX(sector, start) - start;
+		last  = MIN(end, start + s->spb) - start;
+
+		if (vhd_bitmap_span(&s->vhd, bm->map, first, last, 0) <
+		    last - first)
+			return 1;
+	}
+
+	return 0;
+}
+
+static int
+vhd_get_uuid(td_driver_t *driver, uint8_t *uuid)
+{
+	struct vhd_state *s = (struct vhd_state *)driver->data;
+
+	memcpy(uuid, s->vhd.footer.uuid, sizeof(s->vhd.footer.uuid));
+	return 0;
+}
+
+static void
+vhd_stats(td_driver_t *driver, td_stats_t *st)
+{
+	struct vhd_state *s = (struct vhd_state *)driver->data;
+	struct vhd_bm_cache *c = &s->bm_cache;
+
+	tapdisk_stats_field(st, "reqs", "{");
+	td_pool_stats(&s->vreq_pool, st);
+	tapdisk_stats_leave(st, '}');
+
+	if (!vhd_type_dynamic(&s->vhd))
+		return;
+
+	tapdisk_stats_field(st, "bitmaps", "{");
+	tapdisk_stats_field(st, "size", "d", c->size);
+	tapdisk_stats_field(st, "allocated", "d", c->count);
+	tapdisk_stats_field(st, "in", "d", c->in_count);
+	tapdisk_stats_field(st, "hits", "llu", c->hits);
+	tapdisk_stats_field(st, "misses", "llu", c->misses);
+	tapdisk_stats_field(st, "ghost_hits", "llu", c->ghost_hits);
+	tapdisk_stats_field(st, "evictions", "llu", c->evictions);
+	tapdisk_stats_leave(st, '}');
+
+	if (!s->zcache.active)
+		return;
+
+	tapdisk_stats_field(st, "zblocks", "{");
+	tapdisk_stats_field(st, "hits", "llu", s->zcache.hits);
+	tapdisk_stats_field(st, "misses", "llu", s->zcache.misses);
+	tapdisk_stats_field(st, "errors", "llu", s->zcache.errors);
+	tapdisk_stats_leave(st, '}');
+}
+
+static int
+vhd_footprint(td_driver_t *driver, int trim, uint64_t *bytes)
+{
+	struct vhd_state *s = (struct vhd_state *)driver->data;
+	struct vhd_zblock *zb;
+	int i;
+
+	if (trim)
+		td_pool_trim(&s->vreq_pool);
+
+	*bytes = td_pool_bytes(&s->vreq_pool);
+
+	for (i = 0; s->zcache.active && i < VHD_ZCACHE_SIZE; i++) {
+		zb = &s->zcache.blocks[i];
+		if (trim && (zb->status == VHD_ZBLOCK_EMPTY ||
+			     zb->status == VHD_ZBLOCK_VALID))
+			vhd_free_zblock(zb);
+		if (zb->data)
+			*bytes += 2 * s->vhd.header.block_size;
+	}
+
+	return 0;
+}
+
+static void
+vhd_queue_read(td_driver_t *driver, td_request_t treq)
+{
+	struct vhd_state *s = (struct vhd_state *)driver->data;
+
+	treq.sec += s->shift;
+	__vhd_queue_read(driver, treq);
+}
+
+static void
+vhd_queue_write(td_driver_t *driver, td_request_t treq)
+{
+	struct vhd_state *s = (struct vhd_state *)driver->data;
+
+	treq.sec += s->shift;
+	__vhd_queue_write(driver, treq);
+}
+
+static void
+vhd_queue_discard(td_driver_t *driver, td_request_t treq)
+{
+	struct vhd_state *s = (struct vhd_state *)driver->data;
+
+	treq.sec += s->shift;
+	__vhd_queue_discard(driver, treq);
+}
+
 struct tap_disk tapdisk_vhd = {
 	.disk_type          = "tapdisk_vhd",
 	.flags              = 0,
@@ -2424,7 +3775,14 @@ struct tap_disk tapdisk_vhd = {
 	.td_close           = _vhd_close,
 	.td_queue_read      = vhd_queue_read,
 	.td_queue_write     = vhd_queue_write,
+	.td_queue_discard   = vhd_queue_discard,
+	.td_sync            = vhd_sync,
 	.td_get_parent_id   = vhd_get_parent_id,
 	.td_validate_parent = vhd_validate_parent,
 	.td_debug           = vhd_debug,
+	.td_stats           = vhd_stats,
+	.td_allocated       = vhd_allocated,
+	.td_get_uuid        = vhd_get_uuid,
+	.td_headroom        = vhd_headroom,
+	.td_footprint       = vhd_footprint,
 };
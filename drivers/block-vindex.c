@@ -29,6 +29,7 @@
 #include "tapdisk-driver.h"
 #include "tapdisk-server.h"
 #include "tapdisk-interface.h"
+#include "tapdisk-stats.h"
 
 #include "libvhd.h"
 #include "libvhd-index.h"
@@ -43,9 +44,12 @@
 		td_panic();					\
 	}
 
+/* index blocks and open files, per vbd; see vhd_index_init_caches */
+#define VHD_INDEX_CACHE_DEFAULT      64
+#define VHD_INDEX_CACHE_MAX          4096
 #define VHD_INDEX_FILE_POOL_SIZE     12
-#define VHD_INDEX_CACHE_SIZE         4
-#define VHD_INDEX_REQUESTS           (TAPDISK_DATA_REQUESTS + VHD_INDEX_CACHE_SIZE)
+#define VHD_INDEX_FILE_POOL_MAX      256
+#define VHD_INDEX_REQUESTS           (TAPDISK_DATA_REQUESTS + 4)
 
 #define VHD_INDEX_BLOCK_READ_PENDING 0x0001
 #define VHD_INDEX_BLOCK_VALID        0x0002
@@ -72,19 +76,52 @@ struct vhd_index_request {
 
 struct vhd_index_block {
 	uint64_t                     blk;
-	uint32_t                     seqno;
 	td_flag_t                    state;
 	vhdi_block_t                 vhdi_block;
 	int                          table_size;
 	struct list_head             queue;
+	struct list_head             lru;
+	vhd_index_block_t           *hnext;
 	vhd_index_request_t          req;
 };
 
+/*
+ * one ref per file table entry; at most pool.size of them hold an
+ * open fd, and those sit on the pool lru, least recently used first
+ */
 struct vhd_index_file_ref {
 	int                          fd;
 	vhdi_file_id_t               fid;
-	uint32_t                     seqno;
+	char                        *path;
 	uint32_t                     refcnt;
+	struct list_head             lru;
+	vhd_index_file_ref_t        *hnext;
+};
+
+struct vhd_index_cache {
+	int                          size;
+	int                          count;
+	uint32_t                     mask;
+	vhd_index_block_t          **all;
+	vhd_index_block_t          **hash;
+	struct list_head             lru;
+
+	unsigned long long           hits;
+	unsigned long long           misses;
+	unsigned long long           evictions;
+};
+
+struct vhd_index_pool {
+	int                          size;
+	int                          open;
+	uint32_t                     mask;
+	vhd_index_file_ref_t        *refs;
+	vhd_index_file_ref_t       **hash;
+	struct list_head             lru;
+
+	unsigned long long           hits;
+	unsigned long long           misses;
+	unsigned long long           evictions;
 };
 
 struct vhd_index {
@@ -94,13 +131,8 @@ struct vhd_index {
 	vhdi_context_t               vhdi;
 	vhdi_file_table_t            files;
 
-	vhd_index_file_ref_t         fds[VHD_INDEX_FILE_POOL_SIZE];
-
-	vhd_index_block_t           *cache[VHD_INDEX_CACHE_SIZE];
-
-	int                          cache_free_cnt;
-	vhd_index_block_t           *cache_free_list[VHD_INDEX_CACHE_SIZE];
-	vhd_index_block_t            cache_list[VHD_INDEX_CACHE_SIZE];
+	struct vhd_index_pool        pool;
+	struct vhd_index_cache       cache;
 
 	int                          requests_free_cnt;
 	vhd_index_request_t         *requests_free_list[VHD_INDEX_REQUESTS];
@@ -139,51 +171,105 @@ vhd_index_init(vhd_index_t *index)
 
 	memset(index, 0, sizeof(vhd_index_t));
 
-	index->cache_free_cnt = VHD_INDEX_CACHE_SIZE;
-	for (i = 0; i < VHD_INDEX_CACHE_SIZE; i++) {
-		index->cache_free_list[i] = index->cache_list + i;
-		vhd_index_initialize_block(index->cache_free_list[i]);
-	}
+	INIT_LIST_HEAD(&index->cache.lru);
+	INIT_LIST_HEAD(&index->pool.lru);
 
 	index->requests_free_cnt = VHD_INDEX_REQUESTS;
 	for (i = 0; i < VHD_INDEX_REQUESTS; i++) {
 		index->requests_free_list[i] = index->requests_list + i;
 		vhd_index_initialize_request(index->requests_free_list[i]);
 	}
+}
+
+static uint32_t
+vhd_index_hash_mask(int size)
+{
+	uint32_t buckets;
+
+	for (buckets = 1; buckets < size; buckets <<= 1)
+		;
 
-	for (i = 0; i < VHD_INDEX_FILE_POOL_SIZE; i++)
-		index->fds[i].fd = -1;
+	return buckets - 1;
 }
 
+/*
+ * the block cache takes the vbd's bitmap cache size (tap-ctl -b) as
+ * its size in index blocks, capped at the disk's block count; tables
+ * are allocated as blocks are first needed.  the file pool may keep
+ * every file in the table open, up to VHD_INDEX_FILE_POOL_MAX.
+ */
 static int
-vhd_index_allocate_cache(vhd_index_t *index)
+vhd_index_init_caches(vhd_index_t *index, int size)
+{
+	int i;
+	vhd_index_file_ref_t *ref;
+	struct vhd_index_pool *pool = &index->pool;
+	struct vhd_index_cache *cache = &index->cache;
+
+	if (!size)
+		size = VHD_INDEX_CACHE_DEFAULT;
+	size = MIN(size, MIN(index->bat.vhd_blocks, VHD_INDEX_CACHE_MAX));
+	size = MAX(size, 1);
+
+	cache->size = size;
+	cache->mask = vhd_index_hash_mask(size);
+	cache->all  = calloc(size, sizeof(vhd_index_block_t *));
+	cache->hash = calloc(cache->mask + 1, sizeof(vhd_index_block_t *));
+	if (!cache->all || !cache->hash)
+		return -ENOMEM;
+
+	pool->size = MIN(MAX(index->files.entries, VHD_INDEX_FILE_POOL_SIZE),
+			 VHD_INDEX_FILE_POOL_MAX);
+	pool->mask = vhd_index_hash_mask(index->files.entries);
+	pool->refs = calloc(index->files.entries,
+			    sizeof(vhd_index_file_ref_t));
+	pool->hash = calloc(pool->mask + 1, sizeof(vhd_index_file_ref_t *));
+	if ((index->files.entries && !pool->refs) || !pool->hash)
+		return -ENOMEM;
+
+	for (i = 0; i < index->files.entries; i++) {
+		ref       = pool->refs + i;
+		ref->fd   = -1;
+		ref->fid  = index->files.table[i].file_id;
+		ref->path = index->files.table[i].path;
+		INIT_LIST_HEAD(&ref->lru);
+
+		ref->hnext = pool->hash[ref->fid & pool->mask];
+		pool->hash[ref->fid & pool->mask] = ref;
+	}
+
+	DBG(TLOG_INFO, "%s: index blocks: %d, files: %d/%d\n",
+	    index->name, cache->size, pool->size, index->files.entries);
+
+	return 0;
+}
+
+static vhd_index_block_t *
+vhd_index_allocate_cache_block(vhd_index_t *index)
 {
 	void *buf;
-	int i, err;
 	size_t size;
+	vhd_index_block_t *block;
 
 	size = vhd_bytes_padded(index->vhdi.spb * sizeof(vhdi_entry_t));
 
-	for (i = 0; i < VHD_INDEX_CACHE_SIZE; i++) {
-		err = posix_memalign(&buf, VHD_SECTOR_SIZE, size);
-		if (err)
-			goto fail;
+	block = calloc(1, sizeof(vhd_index_block_t));
+	if (!block)
+		return NULL;
 
-		memset(buf, 0, size);
-		index->cache_list[i].vhdi_block.table   = (vhdi_entry_t *)buf;
-		index->cache_list[i].vhdi_block.entries = index->vhdi.spb;
-		index->cache_list[i].table_size         = size;
+	if (posix_memalign(&buf, VHD_SECTOR_SIZE, size)) {
+		free(block);
+		return NULL;
 	}
 
-	return 0;
+	block->vhdi_block.table   = (vhdi_entry_t *)buf;
+	block->vhdi_block.entries = index->vhdi.spb;
+	block->table_size         = size;
+	INIT_LIST_HEAD(&block->lru);
 
-fail:
-	for (i = 0; i < VHD_INDEX_CACHE_SIZE; i++) {
-		free(index->cache_list[i].vhdi_block.table);
-		index->cache_list[i].vhdi_block.table = NULL;
-	}
+	index->cache.all[index->cache.count++] = block;
 
-	return -ENOMEM;
+	return block;
 }
 
 static void
@@ -191,12 +277,18 @@ vhd_index_free(vhd_index_t *index)
 {
 	int i;
 
-	for (i = 0; i < VHD_INDEX_CACHE_SIZE; i++)
-		free(index->cache_list[i].vhdi_block.table);
+	for (i = 0; i < index->cache.count; i++) {
+		free(index->cache.all[i]->vhdi_block.table);
+		free(index->cache.all[i]);
+	}
+	free(index->cache.all);
+	free(index->cache.hash);
 
-	for (i = 0; i < VHD_INDEX_FILE_POOL_SIZE; i++)
-		if (index->fds[i].fd != -1)
-			close(index->fds[i].fd);
+	for (i = 0; i < index->files.entries && index->pool.refs; i++)
+		if (index->pool.refs[i].fd != -1)
+			close(index->pool.refs[i].fd);
+	free(index->pool.refs);
+	free(index->pool.hash);
 
 	vhdi_file_table_free(&index->files);
 	free(index->bat.table);
@@ -237,7 +329,7 @@ fail:
 static int
 vhd_index_open(td_driver_t *driver, const char *name, td_flag_t flags)
 {
-	int err;
+	int err, size;
 	vhd_index_t *index;
 
 	index = (vhd_index_t *)driver->data;
@@ -254,8 +346,14 @@ vhd_index_open(td_driver_t *driver, const char *name, td_flag_t flags)
 		return err;
 	}
 
-	err = vhd_index_allocate_cache(index);
+	size = 0;
+	if (flags & TD_OPEN_BM_CACHE_MASK)
+		size = 1 << ((flags & TD_OPEN_BM_CACHE_MASK) >>
+			     TD_OPEN_BM_CACHE_SHIFT);
+
+	err = vhd_index_init_caches(index, size);
 	if (err) {
+		vhdi_close(&index->vhdi);
 		vhd_index_free(index);
 		return err;
 	}
@@ -286,16 +384,6 @@ vhd_index_close(td_driver_t *driver)
 	return 0;
 }
 
-static inline void
-vhd_index_touch_file_ref(vhd_index_t *index, vhd_index_file_ref_t *ref)
-{
-	int i;
-
-	if (++ref->seqno == 0xFFFFFFFF)
-		for (i = 0; i < VHD_INDEX_FILE_POOL_SIZE; i++)
-			index->fds[i].seqno >>= 1;
-}
-
 static inline void
 vhd_index_get_file_ref(vhd_index_file_ref_t *ref)
 {
@@ -309,94 +397,78 @@ vhd_index_put_file_ref(vhd_index_file_ref_t *ref)
 }
 
 static inline vhd_index_file_ref_t *
-vhd_index_find_lru_file_ref(vhd_index_t *index)
+vhd_index_find_file_ref(vhd_index_t *index, vhdi_file_id_t id)
 {
-	int i;
-	uint32_t min;
-	vhd_index_file_ref_t *lru;
-
-	lru = NULL;
-	min = (uint32_t)-1;
-
-	for (i = 1; i < VHD_INDEX_FILE_POOL_SIZE; i++) {
-		if (index->fds[i].refcnt)
-			continue;
+	vhd_index_file_ref_t *ref;
 
-		if (!lru || index->fds[i].seqno < min) {
-			min = index->fds[i].seqno;
-			lru = index->fds + i;
-		}
-	}
+	for (ref = index->pool.hash[id & index->pool.mask];
+	     ref; ref = ref->hnext)
+		if (ref->fid == id)
+			return ref;
 
-	return lru;
+	return NULL;
 }
 
-static inline int
-vhd_index_open_file(vhd_index_t *index,
-		    vhdi_file_id_t id, vhd_index_file_ref_t *ref)
+static inline vhd_index_file_ref_t *
+vhd_index_find_lru_file_ref(vhd_index_t *index)
 {
-	int i;
-	char *path;
+	vhd_index_file_ref_t *ref;
 
-	path = NULL;
+	list_for_each_entry(ref, &index->pool.lru, lru)
+		if (!ref->refcnt)
+			return ref;
 
-	for (i = 0; i < index->files.entries; i++)
-		if (index->files.table[i].file_id == id) {
-			path = index->files.table[i].path;
-			break;
-		}
-
-	if (!path)
-		return -ENOENT;
-
-	ref->fd = open(path, O_RDONLY | O_DIRECT | O_LARGEFILE);
-	if (ref->fd == -1)
-		return -errno;
-
-	ref->fid    = id;
-	ref->refcnt = 0;
+	return NULL;
+}
 
-	return 0;
+static inline void
+vhd_index_close_file(vhd_index_t *index, vhd_index_file_ref_t *ref)
+{
+	close(ref->fd);
+	ref->fd = -1;
+	list_del_init(&ref->lru);
+	index->pool.open--;
 }
 
 static int
 vhd_index_get_file(vhd_index_t *index,
 		   vhdi_file_id_t id, vhd_index_file_ref_t **ref)
 {
-	int i, err;
-	vhd_index_file_ref_t *lru;
+	vhd_index_file_ref_t *file, *lru;
 
 	*ref = NULL;
 
-	for (i = 0; i < VHD_INDEX_FILE_POOL_SIZE; i++)
-		if (id == index->fds[i].fid) {
-			*ref = index->fds + i;
-			vhd_index_touch_file_ref(index, *ref);
-			vhd_index_get_file_ref(*ref);
-			return 0;
-		}
+	file = vhd_index_find_file_ref(index, id);
+	if (!file)
+		return -ENOENT;
 
-	lru = vhd_index_find_lru_file_ref(index);
-	if (!lru)
-		return -EBUSY;
+	if (file->fd != -1) {
+		index->pool.hits++;
+		goto out;
+	}
 
-	if (lru->fd != -1)
-		close(lru->fd);
+	index->pool.misses++;
 
-	err = vhd_index_open_file(index, id, lru);
-	if (err)
-		goto fail;
+	if (index->pool.open >= index->pool.size) {
+		lru = vhd_index_find_lru_file_ref(index);
+		if (!lru)
+			return -EBUSY;
 
-	vhd_index_touch_file_ref(index, lru);
-	vhd_index_get_file_ref(lru);
-	*ref = lru;
-	return 0;
+		vhd_index_close_file(index, lru);
+		index->pool.evictions++;
+	}
 
-fail:
-	lru->fd     = -1;
-	lru->fid    = 0;
-	lru->refcnt = 0;
-	return err;
+	file->fd = open(file->path, O_RDONLY | O_DIRECT | O_LARGEFILE);
+	if (file->fd == -1)
+		return -errno;
+
+	index->pool.open++;
+
+out:
+	list_move_tail(&file->lru, &index->pool.lru);
+	vhd_index_get_file_ref(file);
+	*ref = file;
+	return 0;
 }
 
 static inline vhd_index_request_t *
@@ -431,44 +503,41 @@ vhd_index_block_valid(vhd_index_block_t *block)
 static inline void
 vhd_index_touch_block(vhd_index_t *index, vhd_index_block_t *block)
 {
-	int i;
-
-	if (++block->seqno == 0xFFFFFFFF)
-		for (i = 0; i < VHD_INDEX_CACHE_SIZE; i++)
-			index->cache_list[i].seqno >>= 1;
+	list_move_tail(&block->lru, &index->cache.lru);
 }
 
-static inline vhd_index_block_t *
-vhd_index_get_lru_block(vhd_index_t *index)
+static void
+vhd_index_unhash_block(vhd_index_t *index, vhd_index_block_t *block)
 {
-	int i, idx;
-	uint32_t min;
-	vhd_index_block_t *block, *lru;
+	vhd_index_block_t **b;
 
-	lru = NULL;
-	min = (uint32_t)-1;
-	idx = 0;
+	for (b = &index->cache.hash[block->blk & index->cache.mask];
+	     *b; b = &(*b)->hnext)
+		if (*b == block) {
+			*b = block->hnext;
+			break;
+		}
 
-	for (i = 0; i < VHD_INDEX_CACHE_SIZE; i++) {
-		block = index->cache[i];
+	block->hnext = NULL;
+}
 
-		if (!block)
-			continue;
+static inline vhd_index_block_t *
+vhd_index_get_lru_block(vhd_index_t *index)
+{
+	vhd_index_block_t *block;
 
+	list_for_each_entry(block, &index->cache.lru, lru) {
 		if (td_flag_test(block->state, VHD_INDEX_BLOCK_READ_PENDING))
 			continue;
 
-		if (!lru || block->seqno < min) {
-			lru = block;
-			min = block->seqno;
-			idx = i;
-		}
-	}
+		if (td_flag_test(block->state, VHD_INDEX_BLOCK_VALID))
+			index->cache.evictions++;
 
-	if (lru)
-		index->cache[idx] = NULL;
+		vhd_index_unhash_block(index, block);
+		return block;
+	}
 
-	return lru;
+	return NULL;
 }
 
 static inline int
@@ -478,9 +547,10 @@ vhd_index_allocate_block(vhd_index_t *index, vhd_index_block_t **block)
 
 	*block = NULL;
 
-	if (index->cache_free_cnt > 0)
-		b = index->cache_free_list[--index->cache_free_cnt];
-	else {
+	b = NULL;
+	if (index->cache.count < index->cache.size)
+		b = vhd_index_allocate_cache_block(index);
+	if (!b) {
 		b = vhd_index_get_lru_block(index);
 		if (!b)
 			return -EBUSY;
@@ -497,8 +567,8 @@ static int
 vhd_index_install_block(vhd_index_t *index,
 			vhd_index_block_t **block, uint32_t blk)
 {
-	int i, err;
-	vhd_index_block_t *b;
+	int err;
+	vhd_index_block_t *b, **bucket;
 
 	*block = NULL;
 
@@ -506,15 +576,12 @@ vhd_index_install_block(vhd_index_t *index,
 	if (err)
 		return err;
 
-	b->blk = blk;
+	b->blk   = blk;
 
-	for (i = 0; i < VHD_INDEX_CACHE_SIZE; i++)
-		if (!index->cache[i]) {
-			index->cache[i] = b;
-			break;
-		}
+	bucket   = &index->cache.hash[blk & index->cache.mask];
+	b->hnext = *bucket;
+	*bucket  = b;
 
-	ASSERT(i < VHD_INDEX_CACHE_SIZE);
 	*block = b;
 
 	return 0;
@@ -523,17 +590,12 @@ vhd_index_install_block(vhd_index_t *index,
 static inline vhd_index_block_t *
 vhd_index_get_block(vhd_index_t *index, uint32_t blk)
 {
-	int i;
 	vhd_index_block_t *block;
 
-	for (i = 0; i < VHD_INDEX_CACHE_SIZE; i++) {
-		block = index->cache[i];
-		if (!block)
-			continue;
-
+	for (block = index->cache.hash[blk & index->cache.mask];
+	     block; block = block->hnext)
 		if (block->blk == blk)
 			return block;
-	}
 
 	return NULL;
 }
@@ -553,9 +615,12 @@ vhd_index_read_cache(vhd_index_t *index, uint64_t sector)
 		return VHD_INDEX_BAT_CLEAR;
 
 	block = vhd_index_get_block(index, blk);
-	if (!block)
+	if (!block) {
+		index->cache.misses++;
 		return VHD_INDEX_CACHE_MISS;
+	}
 
+	index->cache.hits++;
 	vhd_index_touch_block(index, block);
 
 	if (td_flag_test(block->state, VHD_INDEX_BLOCK_READ_PENDING))
@@ -768,7 +833,8 @@ vhd_index_signal_completion(vhd_index_t *index,
 			    vhd_index_request_t *req, int err)
 {
 	td_complete_request(req->treq, err);
-	vhd_index_put_file_ref(req->file);
+	if (req->file)
+		vhd_index_put_file_ref(req->file);
 	vhd_index_free_request(index, req);
 }
 
@@ -792,6 +858,8 @@ vhd_index_complete_meta_read(void *arg, struct tiocb *tiocb, int err)
 
 	if (err) {
 		memset(block->vhdi_block.table, 0, block->table_size);
+		vhd_index_unhash_block(index, block);
+		list_move(&block->lru, &index->cache.lru);
 		vhd_index_block_for_each_request(block, r, tmp)
 			vhd_index_signal_completion(index, r, err);
 		return;
@@ -845,22 +913,13 @@ vhd_index_debug(td_driver_t *driver)
 	WARN("VHD INDEX %s\n", index->name);
 	WARN("FILES:\n");
 	for (i = 0; i < index->files.entries; i++) {
-		int j, fd, refcnt;
-
-		fd     = -1;
-		refcnt = 0;
+		vhd_index_file_ref_t *ref = index->pool.refs + i;
 
-		for (j = 0; j < VHD_INDEX_FILE_POOL_SIZE; j++)
-			if (index->fds[j].fid == index->files.table[i].file_id) {
-				fd     = index->fds[j].fd;
-				refcnt = index->fds[j].refcnt;
-			}
-
-		WARN("%s %u %d %d\n",
-		     index->files.table[i].path,
-		     index->files.table[i].file_id,
-		     fd, refcnt);
+		WARN("%s %u %d %d\n", ref->path, ref->fid, ref->fd, ref->refcnt);
 	}
+	WARN("open: %d/%d, hits: %llu, misses: %llu, evictions: %llu\n",
+	     index->pool.open, index->pool.size, index->pool.hits,
+	     index->pool.misses, index->pool.evictions);
 
 	WARN("REQUESTS:\n");
 	for (i = 0; i < VHD_INDEX_REQUESTS; i++) {
@@ -876,16 +935,18 @@ vhd_index_debug(td_driver_t *driver)
 		     req->treq.sec, req->treq.secs, req->file->fid, req->off);
 	}
 
-	WARN("BLOCKS:\n");
-	for (i = 0; i < VHD_INDEX_CACHE_SIZE; i++) {
+	WARN("BLOCKS: %d/%d, hits: %llu, misses: %llu, evictions: %llu\n",
+	     index->cache.count, index->cache.size, index->cache.hits,
+	     index->cache.misses, index->cache.evictions);
+	for (i = 0; i < index->cache.count; i++) {
 		int queued;
 		vhd_index_block_t *block;
 		vhd_index_request_t *req, *tmp;
 
 		queued = 0;
-		block  = index->cache[i];
+		block  = index->cache.all[i];
 
-		if (!block)
+		if (!block->state)
 			continue;
 
 		vhd_index_block_for_each_request(block, req, tmp)
@@ -896,6 +957,28 @@ vhd_index_debug(td_driver_t *driver)
 	}
 }
 
+static void
+vhd_index_stats(td_driver_t *driver, td_stats_t *st)
+{
+	vhd_index_t *index = (vhd_index_t *)driver->data;
+
+	tapdisk_stats_field(st, "index_blocks", "{");
+	tapdisk_stats_field(st, "size", "d", index->cache.size);
+	tapdisk_stats_field(st, "allocated", "d", index->cache.count);
+	tapdisk_stats_field(st, "hits", "llu", index->cache.hits);
+	tapdisk_stats_field(st, "misses", "llu", index->cache.misses);
+	tapdisk_stats_field(st, "evictions", "llu", index->cache.evictions);
+	tapdisk_stats_leave(st, '}');
+
+	tapdisk_stats_field(st, "index_files", "{");
+	tapdisk_stats_field(st, "size", "d", index->pool.size);
+	tapdisk_stats_field(st, "open", "d", index->pool.open);
+	tapdisk_stats_field(st, "hits", "llu", index->pool.hits);
+	tapdisk_stats_field(st, "misses", "llu", index->pool.misses);
+	tapdisk_stats_field(st, "evictions", "llu", index->pool.evictions);
+	tapdisk_stats_leave(st, '}');
+}
+
 struct tap_disk tapdisk_vhd_index = {
 	.disk_type                = "tapdisk_vhd_index",
 	.flags                    = 0,
@@ -907,4 +990,5 @@ struct tap_disk tapdisk_vhd_index = {
 	.td_get_parent_id         = vhd_index_get_parent_id,
 	.td_validate_parent       = vhd_index_validate_parent,
 	.td_debug                 = vhd_index_debug,
+	.td_stats                 = vhd_index_stats,
 };
@@ -0,0 +1,106 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <pthread.h>
+#include <string.h>
+
+#if defined(__aarch64__)
+#include <sys/auxv.h>
+#include <arm_acle.h>
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32 (1 << 7)
+#endif
+#endif
+
+#include "dr-crc32c.h"
+
+#define DR_CRC32C_POLY 0x82f63b78	/* reflected */
+
+typedef uint32_t (*dr_crc32c_fn)(uint32_t, const unsigned char *, size_t);
+
+static uint32_t dr_crc32c_table[256];
+static dr_crc32c_fn dr_crc32c_impl;
+static pthread_once_t dr_crc32c_once = PTHREAD_ONCE_INIT;
+
+static uint32_t
+dr_crc32c_sw(uint32_t crc, const unsigned char *p, size_t len)
+{
+	while (len--)
+		crc = dr_crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+	return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t
+dr_crc32c_hw(uint32_t crc, const unsigned char *p, size_t len)
+{
+	uint64_t c = crc, v;
+
+	for (; len && ((uintptr_t)p & 7); len--)
+		c = __builtin_ia32_crc32qi(c, *p++);
+
+	for (; len >= 8; len -= 8, p += 8) {
+		memcpy(&v, p, sizeof(v));
+		c = __builtin_ia32_crc32di(c, v);
+	}
+
+	for (; len; len--)
+		c = __builtin_ia32_crc32qi(c, *p++);
+
+	return c;
+}
+#elif defined(__aarch64__)
+__attribute__((target("+crc")))
+static uint32_t
+dr_crc32c_hw(uint32_t crc, const unsigned char *p, size_t len)
+{
+	uint64_t v;
+
+	for (; len && ((uintptr_t)p & 7); len--)
+		crc = __crc32cb(crc, *p++);
+
+	for (; len >= 8; len -= 8, p += 8) {
+		memcpy(&v, p, sizeof(v));
+		crc = __crc32cd(crc, v);
+	}
+
+	for (; len; len--)
+		crc = __crc32cb(crc, *p++);
+
+	return crc;
+}
+#endif
+
+static void
+dr_crc32c_init(void)
+{
+	uint32_t c;
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		c = i;
+		for (j = 0; j < 8; j++)
+			c = c & 1 ? (c >> 1) ^ DR_CRC32C_POLY : c >> 1;
+		dr_crc32c_table[i] = c;
+	}
+
+	dr_crc32c_impl = dr_crc32c_sw;
+#if defined(__x86_64__)
+	if (__builtin_cpu_supports("sse4.2"))
+		dr_crc32c_impl = dr_crc32c_hw;
+#elif defined(__aarch64__)
+	if (getauxval(AT_HWCAP) & HWCAP_CRC32)
+		dr_crc32c_impl = dr_crc32c_hw;
+#endif
+}
+
+uint32_t
+dr_crc32c(uint32_t crc, const void *buf, size_t len)
+{
+	pthread_once(&dr_crc32c_once, dr_crc32c_init);
+
+	return ~dr_crc32c_impl(~crc, buf, len);
+}
@@ -0,0 +1,18 @@
+#ifndef _DR_CRC32C_H_
+#define _DR_CRC32C_H_
+
+/*
+ * CRC32C (Castagnoli), the checksum of DR records (DR_REC_CRC in
+ * adaptdr.h). Uses the SSE4.2 or ARMv8 CRC instructions where the CPU
+ * has them, a table otherwise.
+ *
+ * Like zlib's crc32(), 'crc' is the result for the bytes before 'buf',
+ * 0 to start with, so a buffer can be summed in pieces.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+uint32_t dr_crc32c(uint32_t crc, const void *buf, size_t len);
+
+#endif /* _DR_CRC32C_H_ */
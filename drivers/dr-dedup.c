@@ -0,0 +1,420 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dr-dedup.h"
+
+int
+dr_dedup_init(struct dr_dedup *d, int delta)
+{
+	memset(d, 0, sizeof(*d));
+
+	d->slots   = calloc(DR_DEDUP_SLOTS, sizeof(*d->slots));
+	d->buckets = malloc(DR_DEDUP_SLOTS * sizeof(*d->buckets));
+	if (!d->slots || !d->buckets) {
+		dr_dedup_free(d);
+		return -ENOMEM;
+	}
+
+	if (delta) {
+		d->data     = malloc((size_t)DR_DEDUP_SLOTS * DR_DEDUP_BLOCK);
+		d->obuckets = malloc(DR_DEDUP_SLOTS * sizeof(*d->obuckets));
+		if (!d->data || !d->obuckets) {
+			dr_dedup_free(d);
+			return -ENOMEM;
+		}
+		d->delta = 1;
+	}
+
+	dr_dedup_reset(d);
+	return 0;
+}
+
+void
+dr_dedup_free(struct dr_dedup *d)
+{
+	free(d->slots);
+	free(d->buckets);
+	free(d->data);
+	free(d->obuckets);
+	d->slots    = NULL;
+	d->buckets  = NULL;
+	d->data     = NULL;
+	d->obuckets = NULL;
+	d->delta    = 0;
+}
+
+/* Forget every block, e.g. when what was sent may not have arrived. */
+void
+dr_dedup_reset(struct dr_dedup *d)
+{
+	int i;
+
+	INIT_LIST_HEAD(&d->lru);
+
+	for (i = 0; i < DR_DEDUP_SLOTS; i++) {
+		d->slots[i].used   = 0;
+		d->slots[i].chain  = -1;
+		d->slots[i].offset = DR_DEDUP_NO_OFFSET;
+		d->slots[i].ochain = -1;
+		list_add_tail(&d->slots[i].lru, &d->lru);
+		d->buckets[i] = -1;
+		if (d->obuckets)
+			d->obuckets[i] = -1;
+	}
+}
+
+static inline uint64_t
+dr_dedup_fmix(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+/*
+ * Two independently seeded multiply-rotate lanes over 64 bit words,
+ * finished with the murmur3 mixer; not cryptographic, blocks are not
+ * chosen by an adversary.
+ */
+void
+dr_dedup_hash(const void *buf, size_t len, uint64_t hash[2])
+{
+	const unsigned char *p = buf;
+	uint64_t a = 0x9e3779b97f4a7c15ULL ^ len;
+	uint64_t b = 0xc2b2ae3d27d4eb4fULL ^ len;
+	uint64_t w;
+	size_t i;
+
+	for (i = 0; i + sizeof(w) <= len; i += sizeof(w)) {
+		memcpy(&w, p + i, sizeof(w));
+		a = (a ^ (w * 0x87c37b91114253d5ULL)) * 0x4cf5ad432745937fULL;
+		a = (a << 31) | (a >> 33);
+		b = (b + (w ^ (w >> 29))) * 0x9fb21c651e98df25ULL;
+		b = (b << 27) | (b >> 37);
+	}
+
+	for (; i < len; i++) {
+		a = (a ^ p[i]) * 0x100000001b3ULL;
+		b = (b + p[i]) * 0x9fb21c651e98df25ULL;
+	}
+
+	hash[0] = dr_dedup_fmix(a ^ (b >> 17));
+	hash[1] = dr_dedup_fmix(b ^ (a << 13));
+}
+
+#define dr_dedup_bucket(_h)     ((_h)[0] % DR_DEDUP_SLOTS)
+#define dr_dedup_obucket(_o)    (((_o) / DR_DEDUP_BLOCK) % DR_DEDUP_SLOTS)
+
+static int
+dr_dedup_lookup(struct dr_dedup *d, const uint64_t hash[2])
+{
+	int i;
+
+	for (i = d->buckets[dr_dedup_bucket(hash)]; i >= 0;
+	     i = d->slots[i].chain)
+		if (d->slots[i].hash[0] == hash[0] &&
+		    d->slots[i].hash[1] == hash[1])
+			return i;
+
+	return -1;
+}
+
+static void
+dr_dedup_unhash(struct dr_dedup *d, int slot)
+{
+	struct dr_dedup_slot *s = &d->slots[slot];
+	int *p;
+
+	for (p = &d->buckets[dr_dedup_bucket(s->hash)]; *p >= 0;
+	     p = &d->slots[*p].chain)
+		if (*p == slot) {
+			*p = s->chain;
+			break;
+		}
+
+	s->chain = -1;
+}
+
+static void
+dr_dedup_hash_slot(struct dr_dedup *d, int slot, const uint64_t hash[2])
+{
+	struct dr_dedup_slot *s = &d->slots[slot];
+	int b;
+
+	b = dr_dedup_bucket(hash);
+	s->hash[0] = hash[0];
+	s->hash[1] = hash[1];
+	s->chain   = d->buckets[b];
+	d->buckets[b] = slot;
+}
+
+static int
+dr_dedup_olookup(struct dr_dedup *d, uint64_t offset)
+{
+	int i;
+
+	for (i = d->obuckets[dr_dedup_obucket(offset)]; i >= 0;
+	     i = d->slots[i].ochain)
+		if (d->slots[i].offset == offset)
+			return i;
+
+	return -1;
+}
+
+static void
+dr_dedup_ounlink(struct dr_dedup *d, int slot)
+{
+	struct dr_dedup_slot *s = &d->slots[slot];
+	int *p;
+
+	if (s->offset == DR_DEDUP_NO_OFFSET)
+		return;
+
+	for (p = &d->obuckets[dr_dedup_obucket(s->offset)]; *p >= 0;
+	     p = &d->slots[*p].ochain)
+		if (*p == slot) {
+			*p = s->ochain;
+			break;
+		}
+
+	s->offset = DR_DEDUP_NO_OFFSET;
+	s->ochain = -1;
+}
+
+/* Index a slot by 'offset', in place of whatever was stored there. */
+static void
+dr_dedup_okey(struct dr_dedup *d, int slot, uint64_t offset)
+{
+	struct dr_dedup_slot *s = &d->slots[slot];
+	int old, b;
+
+	old = dr_dedup_olookup(d, offset);
+	if (old >= 0)
+		dr_dedup_ounlink(d, old);
+
+	b = dr_dedup_obucket(offset);
+	s->offset = offset;
+	s->ochain = d->obuckets[b];
+	d->obuckets[b] = slot;
+}
+
+static void
+dr_dedup_unlink(struct dr_dedup *d, int slot)
+{
+	dr_dedup_unhash(d, slot);
+	if (d->delta)
+		dr_dedup_ounlink(d, slot);
+	d->slots[slot].used = 0;
+}
+
+/*
+ * Hand the least recently used slot to a new block, 'data' stored for
+ * 'offset'.
+ */
+static int
+dr_dedup_insert(struct dr_dedup *d, const uint64_t hash[2],
+		uint64_t writeID, uint64_t offset, const char *data)
+{
+	struct dr_dedup_slot *s;
+	int slot;
+
+	s    = list_entry(d->lru.prev, struct dr_dedup_slot, lru);
+	slot = s - d->slots;
+
+	if (s->used)
+		dr_dedup_unlink(d, slot);
+
+	dr_dedup_hash_slot(d, slot, hash);
+	s->writeID = writeID;
+	s->used    = 1;
+
+	if (d->delta) {
+		memcpy(d->data + (size_t)slot * DR_DEDUP_BLOCK, data,
+		       DR_DEDUP_BLOCK);
+		dr_dedup_okey(d, slot, offset);
+	}
+
+	list_move(&s->lru, &d->lru);
+	return slot;
+}
+
+/*
+ * Write the runs of words where 'data' differs from 'base' to 'out',
+ * XORed, after their total length. Runs less than two equal words
+ * apart are merged, a run header costs half a word. Returns the bytes
+ * written, or 0 where that would be DR_DELTA_MAX or more.
+ */
+static size_t
+dr_dedup_xor(const char *base, const char *data, char *out)
+{
+	const size_t w = sizeof(uint64_t);
+	struct dr_delta_run run;
+	size_t len, i, j, end;
+	uint64_t a, b;
+	uint32_t n;
+
+	len = sizeof(n);
+	i   = 0;
+
+	while (i < DR_DEDUP_BLOCK) {
+		memcpy(&a, base + i, w);
+		memcpy(&b, data + i, w);
+		if (a == b) {
+			i += w;
+			continue;
+		}
+
+		end = i + w;
+		for (j = end; j < DR_DEDUP_BLOCK && j - end < 2 * w; j += w) {
+			memcpy(&a, base + j, w);
+			memcpy(&b, data + j, w);
+			if (a != b)
+				end = j + w;
+		}
+
+		if (len + sizeof(run) + end - i >= DR_DELTA_MAX)
+			return 0;
+
+		run.off = i;
+		run.len = end - i;
+		memcpy(out + len, &run, sizeof(run));
+		len += sizeof(run);
+
+		for (; i < end; i += w) {
+			memcpy(&a, base + i, w);
+			memcpy(&b, data + i, w);
+			a ^= b;
+			memcpy(out + len, &a, w);
+			len += w;
+		}
+	}
+
+	n = len - sizeof(n);
+	memcpy(out, &n, sizeof(n));
+	return len;
+}
+
+/*
+ * Send a block as a delta against the slot stored for its offset, if
+ * the backup has that one and the delta is small enough. The slot then
+ * takes the block. Returns the bytes written to 'out', 0 if not.
+ */
+static size_t
+dr_dedup_delta(struct dr_dedup *d, uint64_t confirmed, uint64_t writeID,
+	       uint64_t offset, const char *data, const uint64_t hash[2],
+	       char *out, int *_slot)
+{
+	struct dr_dedup_slot *s;
+	char *block;
+	size_t len;
+	int slot;
+
+	slot = dr_dedup_olookup(d, offset);
+	if (slot < 0)
+		return 0;
+
+	s = &d->slots[slot];
+	if (s->writeID > confirmed)
+		return 0;
+
+	block = d->data + (size_t)slot * DR_DEDUP_BLOCK;
+	len   = dr_dedup_xor(block, data, out);
+	if (!len)
+		return 0;
+
+	memcpy(block, data, DR_DEDUP_BLOCK);
+	dr_dedup_unhash(d, slot);
+	dr_dedup_hash_slot(d, slot, hash);
+	s->writeID = writeID;
+	list_move(&s->lru, &d->lru);
+
+	*_slot = slot;
+	return len;
+}
+
+/*
+ * Encode the record at 'rec' into 'out', which has room for the
+ * record plus dr_dedup_overhead(). Blocks stored by records up to
+ * writeID 'confirmed' go out as references, or serve as the base of a
+ * delta. Returns the bytes written.
+ */
+size_t
+dr_dedup_encode(struct dr_dedup *d, uint64_t confirmed,
+		const char *rec, char *out)
+{
+	struct dr_dedup_blk blk;
+	struct req_info rinfo;
+	const char *data;
+	uint64_t offset;
+	size_t tail, len;
+	char *p, *map;
+	int i, n, slot;
+
+	memcpy(&rinfo, rec, sizeof(rinfo));
+
+	/* barriers and small records go as they are */
+	n = rinfo.size / DR_DEDUP_BLOCK;
+	if (!n) {
+		memcpy(out, rec, sizeof(rinfo) + rinfo.size);
+		return sizeof(rinfo) + rinfo.size;
+	}
+
+	rinfo.state |= DR_REC_DEDUP;
+	memcpy(out, &rinfo, sizeof(rinfo));
+
+	data = rec + sizeof(rinfo);
+	map  = out + sizeof(rinfo);
+	p    = map + n * sizeof(blk);
+
+	for (i = 0; i < n; i++, data += DR_DEDUP_BLOCK) {
+		dr_dedup_hash(data, DR_DEDUP_BLOCK, blk.hash);
+		offset = rinfo.offset + (uint64_t)i * DR_DEDUP_BLOCK;
+
+		slot = dr_dedup_lookup(d, blk.hash);
+		if (slot >= 0 && d->slots[slot].writeID <= confirmed) {
+			blk.op   = DR_DEDUP_REF;
+			blk.slot = slot;
+			list_move(&d->slots[slot].lru, &d->lru);
+			d->hits++;
+		} else if (d->delta &&
+			   (len = dr_dedup_delta(d, confirmed, rinfo.writeID,
+						 offset, data, blk.hash, p,
+						 &slot))) {
+			blk.op   = DR_DEDUP_XOR;
+			blk.slot = slot;
+			p += len;
+			d->deltas++;
+			d->delta_bytes += len;
+		} else {
+			/* stored once already, and that is still in flight */
+			if (slot >= 0)
+				blk.op = DR_DEDUP_RAW;
+			else {
+				blk.op = DR_DEDUP_KEEP;
+				slot   = dr_dedup_insert(d, blk.hash,
+							 rinfo.writeID,
+							 offset, data);
+			}
+			blk.slot = slot;
+			memcpy(p, data, DR_DEDUP_BLOCK);
+			p += DR_DEDUP_BLOCK;
+			d->misses++;
+		}
+
+		memcpy(map + i * sizeof(blk), &blk, sizeof(blk));
+	}
+
+	tail = rinfo.size - n * DR_DEDUP_BLOCK;
+	memcpy(p, data, tail);
+	p += tail;
+
+	return p - out;
+}
@@ -0,0 +1,67 @@
+#ifndef _DR_DEDUP_H_
+#define _DR_DEDUP_H_
+
+/*
+ * Sender side of DR content dedup (see DR_REC_DEDUP in adaptdr.h): an
+ * LRU of the DR_DEDUP_SLOTS blocks the backup keeps for one target,
+ * indexed by a 128 bit hash of their contents.
+ *
+ * A slot only stands for its block once the backup acknowledged the
+ * record that stored it; until then a repeat goes out as raw data.
+ * Only the dispatcher of the target touches the table.
+ *
+ * With deltas, the table also keeps every slot's block, and indexes
+ * slots by the offset they were stored for: a block rewritten there,
+ * that differs in few enough words, goes out as DR_DEDUP_XOR against
+ * the slot, which takes its new contents. That costs DR_DEDUP_SLOTS
+ * blocks of memory per target, 16MB.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "list.h"
+#include "adaptdr.h"
+
+struct dr_dedup_slot {
+	uint64_t                hash[2];
+	uint64_t                writeID;	/* record that stored it */
+	int                     used;
+	int                     chain;		/* next in bucket, or -1 */
+	struct list_head        lru;
+
+	/* with deltas: where it was stored for, next in obuckets */
+	uint64_t                offset;
+	int                     ochain;
+};
+
+struct dr_dedup {
+	struct dr_dedup_slot   *slots;
+	int                    *buckets;
+	struct list_head        lru;		/* most recent first */
+
+	/* with deltas: blocks by slot, slots by offset */
+	int                     delta;
+	char                   *data;
+	int                    *obuckets;
+
+	uint64_t                hits;
+	uint64_t                misses;
+	uint64_t                deltas;
+	uint64_t                delta_bytes;
+};
+
+#define DR_DEDUP_NO_OFFSET      UINT64_MAX
+
+/* worst case growth of a record when encoded */
+#define dr_dedup_overhead(_size) \
+	((_size) / DR_DEDUP_BLOCK * sizeof(struct dr_dedup_blk))
+
+int dr_dedup_init(struct dr_dedup *, int delta);
+void dr_dedup_free(struct dr_dedup *);
+void dr_dedup_reset(struct dr_dedup *);
+void dr_dedup_hash(const void *buf, size_t len, uint64_t hash[2]);
+size_t dr_dedup_encode(struct dr_dedup *, uint64_t confirmed,
+		       const char *rec, char *out);
+
+#endif /* _DR_DEDUP_H_ */
@@ -0,0 +1,276 @@
+#ifndef _DR_RING_H_
+#define _DR_RING_H_
+
+/*
+ * Single-producer/single-consumer index ring shared by the DR drivers.
+ *
+ * The ring only manages indices; callers keep their own storage. Units
+ * are whatever the caller makes them: fixed slots addressed with
+ * dr_ring_slot(), or bytes of a record buffer filled and read with
+ * dr_ring_copy_in()/dr_ring_copy_out()/dr_ring_iov(), which handle the
+ * wrap at the end of the buffer.
+ *
+ * The producer is the tapdisk event loop, the consumer is a dispatch
+ * thread. Indices are published with acquire/release semantics, so
+ * neither side takes a lock.
+ *
+ * The consumer may read ahead of the tail (e.g. send records, but only
+ * release them once acknowledged); dr_ring_wait_data() takes the index
+ * it has seen up to.
+ *
+ * Two eventfd doorbells let either side sleep: 'doorbell' is rung by the
+ * producer only when it publishes while the consumer sleeps in
+ * dr_ring_wait_data(), 'space' by the consumer only after a producer
+ * failed dr_ring_reserve(). Both sides must recheck the ring after
+ * waking, wakeups may be spurious.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "libaio-compat.h"
+
+struct dr_ring {
+	uint64_t             head;     /* next unit to produce */
+	uint64_t             tail;     /* next unit to consume */
+	uint32_t             size;
+
+	int                  space_wanted;
+	int                  data_wanted;
+
+	int                  doorbell;
+	int                  space;
+};
+
+static inline void
+__dr_ring_signal(int fd)
+{
+	uint64_t val = 1;
+	int gcc = write(fd, &val, sizeof(val));
+	if (gcc) {};
+}
+
+static inline void
+__dr_ring_wait(int fd)
+{
+	uint64_t val;
+	int gcc = read(fd, &val, sizeof(val));
+	if (gcc) {};
+}
+
+static inline int
+dr_ring_init(struct dr_ring *r, uint32_t size)
+{
+	r->head     = 0;
+	r->tail     = 0;
+	r->size     = size;
+	r->space    = -1;
+
+	r->space_wanted = 0;
+	r->data_wanted  = 0;
+
+	r->doorbell = tapdisk_sys_eventfd(0);
+	if (r->doorbell < 0)
+		return -errno;
+
+	r->space = tapdisk_sys_eventfd(0);
+	if (r->space < 0) {
+		int err = -errno;
+		close(r->doorbell);
+		r->doorbell = -1;
+		return err;
+	}
+
+	return 0;
+}
+
+static inline void
+dr_ring_destroy(struct dr_ring *r)
+{
+	if (r->doorbell >= 0)
+		close(r->doorbell);
+	if (r->space >= 0)
+		close(r->space);
+	r->doorbell = r->space = -1;
+}
+
+#define dr_ring_slot(_r, _idx)   ((_idx) % (_r)->size)
+
+/*
+ * Producer side.
+ */
+static inline uint64_t
+dr_ring_prod_index(struct dr_ring *r)
+{
+	return r->head;
+}
+
+static inline uint32_t
+dr_ring_free(struct dr_ring *r)
+{
+	uint64_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+	return r->size - (uint32_t)(r->head - tail);
+}
+
+static inline int
+dr_ring_full(struct dr_ring *r)
+{
+	return dr_ring_free(r) == 0;
+}
+
+/*
+ * Check for room for n units. On failure the consumer is asked to ring
+ * the space doorbell as soon as it releases anything.
+ */
+static inline int
+dr_ring_reserve(struct dr_ring *r, uint32_t n)
+{
+	if (n > r->size)
+		return -EINVAL;
+
+	if (dr_ring_free(r) >= n)
+		return 0;
+
+	__atomic_store_n(&r->space_wanted, 1, __ATOMIC_RELEASE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	return dr_ring_free(r) >= n ? 0 : -EBUSY;
+}
+
+static inline void
+dr_ring_produce(struct dr_ring *r, uint32_t n)
+{
+	__atomic_store_n(&r->head, r->head + n, __ATOMIC_RELEASE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	if (__atomic_exchange_n(&r->data_wanted, 0, __ATOMIC_ACQ_REL))
+		__dr_ring_signal(r->doorbell);
+}
+
+static inline void
+dr_ring_wait_space(struct dr_ring *r)
+{
+	__dr_ring_wait(r->space);
+}
+
+/*
+ * A producer that must not sleep can instead poll dr_ring_space_fd()
+ * and call dr_ring_ack_space() once it becomes readable.
+ */
+static inline int
+dr_ring_space_fd(struct dr_ring *r)
+{
+	return r->space;
+}
+
+static inline void
+dr_ring_ack_space(struct dr_ring *r)
+{
+	__dr_ring_wait(r->space);
+}
+
+/* Wake the consumer unconditionally, e.g. to have it notice a stop flag. */
+static inline void
+dr_ring_kick(struct dr_ring *r)
+{
+	__dr_ring_signal(r->doorbell);
+}
+
+/*
+ * Consumer side.
+ */
+static inline uint64_t
+dr_ring_cons_index(struct dr_ring *r)
+{
+	return r->tail;
+}
+
+static inline uint64_t
+dr_ring_head(struct dr_ring *r)
+{
+	return __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+}
+
+static inline uint32_t
+dr_ring_count(struct dr_ring *r)
+{
+	return (uint32_t)(dr_ring_head(r) - r->tail);
+}
+
+static inline void
+dr_ring_consume(struct dr_ring *r, uint32_t n)
+{
+	__atomic_store_n(&r->tail, r->tail + n, __ATOMIC_RELEASE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	if (__atomic_exchange_n(&r->space_wanted, 0, __ATOMIC_ACQ_REL))
+		__dr_ring_signal(r->space);
+}
+
+/* Sleep until the producer publishes beyond 'seen' (or a kick). */
+static inline void
+dr_ring_wait_data(struct dr_ring *r, uint64_t seen)
+{
+	__atomic_store_n(&r->data_wanted, 1, __ATOMIC_RELEASE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	if (dr_ring_head(r) == seen)
+		__dr_ring_wait(r->doorbell);
+}
+
+/*
+ * Byte rings: 'buf' holds r->size bytes, positions are ring indices.
+ */
+static inline void
+dr_ring_copy_in(struct dr_ring *r, char *buf, uint64_t pos,
+		const void *src, size_t len)
+{
+	size_t off = dr_ring_slot(r, pos), part;
+
+	part = r->size - off;
+	if (part > len)
+		part = len;
+
+	memcpy(buf + off, src, part);
+	memcpy(buf, (const char *)src + part, len - part);
+}
+
+static inline void
+dr_ring_copy_out(struct dr_ring *r, const char *buf, uint64_t pos,
+		 void *dst, size_t len)
+{
+	size_t off = dr_ring_slot(r, pos), part;
+
+	part = r->size - off;
+	if (part > len)
+		part = len;
+
+	memcpy(dst, buf + off, part);
+	memcpy((char *)dst + part, buf, len - part);
+}
+
+/* Describe len bytes at pos with one or two iovecs, return the count. */
+static inline int
+dr_ring_iov(struct dr_ring *r, char *buf, uint64_t pos,
+	    size_t len, struct iovec *iov)
+{
+	size_t off = dr_ring_slot(r, pos), part;
+
+	part = r->size - off;
+	if (part >= len) {
+		iov[0].iov_base = buf + off;
+		iov[0].iov_len  = len;
+		return 1;
+	}
+
+	iov[0].iov_base = buf + off;
+	iov[0].iov_len  = part;
+	iov[1].iov_base = buf;
+	iov[1].iov_len  = len - part;
+	return 2;
+}
+
+#endif /* _DR_RING_H_ */
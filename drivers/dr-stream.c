@@ -0,0 +1,4072 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <unistd.h>
+#include <netinet/tcp.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#if defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY)
+#include <linux/errqueue.h>
+#define DR_ZEROCOPY
+#endif
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+
+#ifndef MAP_HUGETLB
+#define MAP_HUGETLB 0
+#endif
+
+#include "tapdisk.h"
+#include "tapdisk-server.h"
+#include "tapdisk-driver.h"
+#include "tapdisk-interface.h"
+#include "block-valve.h"
+#include "libvhd.h"
+#include "dr-stream.h"
+#include "dr-crc32c.h"
+#include "dr-uring.h"
+
+/*
+ * A connection to one backup, shared by all streams connecting to it
+ * with mux=1. The link thread pumps a batch of every started device in
+ * turn, with the socket corked over the round, and sleeps on a doorbell
+ * all its devices share once none has anything to send. Devices are
+ * numbered in the order they attach, numbers are never reused on a
+ * link so that no late ack for a detached device is mistaken for
+ * someone else's.
+ *
+ * 'lock' guards dev[] and the devices' 'drained' flags; the ack thread
+ * holds it while it handles an ack, so a device is never freed under
+ * it. 'send_lock' keeps OPEN and CLOSE messages from the tapdisk loop
+ * out of the middle of a batch.
+ *
+ * With a 'uring', the round queues every device's batch instead, and
+ * sends them all at its end with one submission, see dr_link_flush().
+ * Devices only share the wire at message boundaries, so an OPEN or
+ * CLOSE may still go out between two of them.
+ */
+struct dr_link {
+	char                    target[256];
+	char                    host[256];
+	int                     port;
+	int                     sock;
+	int                     codec;
+	int                     dedup;
+	char                   *tls;		/* CA of the backup, or NULL */
+	int                     refs;
+	uint32_t                backoff_ms;
+
+	pthread_t               thread;
+	int                     running;
+	pthread_t               ack_thread;
+	int                     ack_running;
+
+	pthread_mutex_t         lock;
+	pthread_cond_t          cond;		/* a device drained */
+	pthread_mutex_t         send_lock;
+
+	int                     doorbell;
+	int                     stop;
+	int                     failed;
+
+	struct dr_uring        *uring;
+
+	uint32_t                next_device;
+	struct dr_target       *dev[DR_LINK_DEVICES];
+
+	struct dr_link         *next;
+};
+
+/*
+ * Links, and their refs, are taken and dropped from whichever loop
+ * opens or closes a stream, worker loops included.
+ */
+static pthread_mutex_t dr_links_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct dr_link *dr_links;
+
+/* vhd chain levels a seed follows */
+#define DR_SEED_DEPTH           16
+#define DR_SEED_NONE            0xff
+
+/*
+ * A seed in progress, see dr-stream.h. chain[0] is the leaf. owner[]
+ * maps each sector of the current block to the first image in the
+ * chain that allocated it. 'live' marks the sectors written since the
+ * seed began. A read in 'buf' that found no ring space waits there,
+ * 'ready', with 'cursor' at the next sector to send.
+ */
+struct dr_seed {
+	vhd_context_t           chain[DR_SEED_DEPTH];
+	int                     depth;
+	uint64_t                sectors;
+	uint32_t                spb;
+	uint32_t                block;
+	uint32_t                blocks;
+	uint32_t                pos;		/* next sector in block */
+	int                     planned;
+	uint8_t                *owner;
+	struct writelog         live;
+
+	char                   *buf;
+	struct tiocb            tiocb;
+	int                     busy;
+	int                     ready;
+	uint64_t                sector;		/* extent in buf */
+	uint64_t                count;
+	uint64_t                cursor;
+
+	uint64_t                bytes;
+	uint64_t                skipped;	/* superseded by live writes */
+};
+
+static void dr_stream_refill(struct dr_stream *);
+static void dr_stream_resync_pump(struct dr_stream *);
+static void dr_stream_failback_save(struct dr_stream *);
+static void dr_stream_seed_pump(struct dr_stream *);
+static void dr_seed_free(struct dr_seed *);
+static void dr_stream_epoch_check(struct dr_stream *);
+static int dr_stream_group_sync(struct dr_stream *);
+static void dr_stream_produce(struct dr_stream *, uint32_t);
+static void dr_link_detach(struct dr_target *);
+static void dr_link_reconnect(struct dr_link *);
+static void dr_stream_advance(struct dr_stream *);
+static void dr_stream_update_quorum(struct dr_stream *);
+static void *dr_target_ack(void *);
+static int dr_target_writev(struct dr_target *, struct iovec *, int, int);
+
+/*
+ * The dispatch thread rings the space doorbell once a full ring drains.
+ * Waking the server loop is all that is needed: the vbd retries the
+ * writes we bounced with -EBUSY on its next pass. While spilling, it
+ * is our cue to move journaled records back into the ring.
+ */
+static void
+dr_stream_space_event(event_id_t id, char mode, void *private)
+{
+	struct dr_stream *s = private;
+
+	dr_ring_ack_space(&s->ring);
+
+	if (s->spilling)
+		dr_stream_refill(s);
+
+	if (s->resyncing)
+		dr_stream_resync_pump(s);
+
+	if (s->seed)
+		dr_stream_seed_pump(s);
+
+	dr_stream_epoch_check(s);
+}
+
+/* Close an epoch that is due while no writes come in. */
+static void
+dr_stream_epoch_event(event_id_t id, char mode, void *private)
+{
+	dr_stream_epoch_check(private);
+}
+
+/*
+ * The ring is written and sent sequentially at line rate, so back it
+ * with huge pages to spare the TLB: reserved ones if there are any,
+ * else ask for transparent ones.
+ */
+static int
+dr_stream_map(struct dr_stream *s, size_t size)
+{
+	size_t len;
+	void *p;
+
+	len = (size + DR_HUGEPAGE_SIZE - 1) & ~(DR_HUGEPAGE_SIZE - 1);
+	p   = MAP_FAILED;
+	if (MAP_HUGETLB)
+		p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (p != MAP_FAILED) {
+		s->huge = DR_RING_HUGETLB;
+		goto out;
+	}
+
+	len = (size + getpagesize() - 1) & ~((size_t)getpagesize() - 1);
+	p   = mmap(NULL, len, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return -errno;
+
+	s->huge = DR_RING_SMALL;
+	if (!madvise(p, len, MADV_HUGEPAGE))
+		s->huge = DR_RING_THP;
+
+out:
+	s->data   = p;
+	s->mapped = len;
+	DPRINTF("DR ring: %zu bytes, %s pages\n", size,
+		s->huge == DR_RING_HUGETLB ? "huge" :
+		s->huge == DR_RING_THP ? "transparent huge" : "small");
+	return 0;
+}
+
+static void
+dr_stream_unmap(struct dr_stream *s)
+{
+	munmap(s->data, s->mapped);
+	s->data   = NULL;
+	s->mapped = 0;
+	s->huge   = DR_RING_SMALL;
+}
+
+int
+dr_stream_init(struct dr_stream *s, size_t size)
+{
+	int err;
+
+	memset(s, 0, sizeof(*s));
+	s->ack_fd   = -1;
+	s->spill_fd = -1;
+	s->epoch    = 1;
+	pthread_mutex_init(&s->release_lock, NULL);
+
+	s->valve.sock = -1;
+	pthread_mutex_init(&s->valve.lock, NULL);
+
+	s->sock.nodelay = 1;
+	s->sock.cork    = 1;
+
+	s->absorb_slots = calloc(DR_ABSORB_SLOTS, sizeof(*s->absorb_slots));
+	if (!s->absorb_slots)
+		return -ENOMEM;
+
+	/* any write must fit, or it would be bounced forever */
+	if (size < DR_RING_MIN)
+		size = DR_RING_MIN;
+
+	err = dr_stream_map(s, size);
+	if (err)
+		goto fail;
+
+	err = dr_ring_init(&s->ring, size);
+	if (err) {
+		dr_stream_unmap(s);
+		goto fail;
+	}
+
+	s->ack_fd = tapdisk_sys_eventfd(0);
+	if (s->ack_fd < 0) {
+		err = -errno;
+		goto fail;
+	}
+
+	s->space_event =
+		tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
+					      dr_ring_space_fd(&s->ring), 0,
+					      dr_stream_space_event, s);
+	if (s->space_event < 0) {
+		err = s->space_event;
+		s->space_event = 0;
+		goto fail;
+	}
+
+	return 0;
+
+fail:
+	dr_stream_free(s);
+	return err;
+}
+
+/*
+ * Tell the backup we are done: a zeroed req_info, framed if the stream
+ * is. The socket is ours from dr_stream_add_target() on.
+ */
+static void
+dr_target_close(struct dr_target *t)
+{
+	struct {
+		struct dr_frame frame;
+		struct req_info rinfo;
+	} __attribute__((packed)) msg;
+	char *buf = (char *)&msg.rinfo;
+	int len = sizeof(msg.rinfo);
+
+	free(t->zraw);
+	free(t->zbuf);
+	t->zraw = t->zbuf = NULL;
+
+	free(t->cbuf);
+	t->cbuf = NULL;
+
+	dr_dedup_free(&t->dedup);
+	free(t->draw);
+	free(t->dbuf);
+	t->draw = t->dbuf = NULL;
+
+	free(t->host);
+	free(t->image);
+	t->host = t->image = NULL;
+
+	if (t->link) {
+		dr_link_detach(t);
+		return;
+	}
+
+	/* the backup finishes what is below head */
+	if (t->shm) {
+		__atomic_store_n(&t->shm->closed, 1, __ATOMIC_RELEASE);
+		dr_shm_wake(&t->shm->head_seq, &t->shm->head_wanted);
+		t->shm = NULL;
+	}
+
+	if (t->sock < 0)
+		goto out;
+
+	memset(&msg, 0, sizeof(msg));
+	if (t->codec) {
+		msg.frame.magic = DR_FRAME_MAGIC;
+		msg.frame.raw   = sizeof(msg.rinfo);
+		msg.frame.len   = sizeof(msg.rinfo);
+		buf = (char *)&msg;
+		len = sizeof(msg);
+	}
+
+	if (sendexact(t->sock, buf, len) < 0)
+		DPRINTF("ERROR writing DR close marker: %d\n", -errno);
+
+	close(t->sock);
+	t->sock = -1;
+
+out:
+	if (t->doorbell >= 0)
+		close(t->doorbell);
+	t->doorbell = -1;
+}
+
+void
+dr_stream_free(struct dr_stream *s)
+{
+	int i;
+
+	dr_stream_stop(s);
+
+	for (i = 0; i < s->n_targets; i++)
+		dr_target_close(&s->targets[i]);
+	s->n_targets = 0;
+
+	if (s->failback) {
+		dr_stream_failback_save(s);
+		free(s->failback);
+		s->failback = NULL;
+	}
+
+	if (s->space_event) {
+		tapdisk_server_unregister_event(s->space_event);
+		s->space_event = 0;
+	}
+
+	if (s->epoch_event) {
+		tapdisk_server_unregister_event(s->epoch_event);
+		s->epoch_event = 0;
+	}
+
+	if (s->group) {
+		dr_group_leave(s->group);
+		s->group = NULL;
+	}
+
+	if (s->ack_fd >= 0) {
+		close(s->ack_fd);
+		s->ack_fd = -1;
+	}
+
+	if (s->valve.sock >= 0) {
+		close(s->valve.sock);
+		s->valve.sock = -1;
+	}
+	free(s->valve.name);
+	s->valve.name = NULL;
+
+	free(s->tls);
+	s->tls = NULL;
+
+	if (s->spill_fd >= 0) {
+		if (s->spill_wr > s->spill_rd)
+			DPRINTF("DR journal: dropping %llu unreplicated bytes\n",
+				(unsigned long long)(s->spill_wr - s->spill_rd));
+		close(s->spill_fd);
+		s->spill_fd = -1;
+	}
+
+	if (s->data) {
+		dr_ring_destroy(&s->ring);
+		if (s->pinned)
+			munlock(s->data, s->ring.size);
+		s->pinned = 0;
+		if (s->shm) {
+			dr_shm_detach(s->shm);
+			dr_shm_unlink(s->shm_name);
+			s->data = NULL;
+		} else
+			dr_stream_unmap(s);
+	}
+	free(s->shm_name);
+	s->shm      = NULL;
+	s->shm_name = NULL;
+
+	free(s->absorb_slots);
+	s->absorb_slots = NULL;
+
+	if (s->resyncing)
+		DPRINTF("DR resync incomplete, backup is inconsistent\n");
+	writelog_free(&s->dirty);
+
+	/* an in-flight read still owns its buffer */
+	for (i = 0; i < DR_RESYNC_DEPTH; i++) {
+		if (!s->resync[i].busy)
+			free(s->resync[i].buf);
+		s->resync[i].buf = NULL;
+	}
+
+	if (s->seed) {
+		DPRINTF("DR seed incomplete, backup is inconsistent\n");
+		if (!s->seed->busy)
+			dr_seed_free(s->seed);
+		s->seed = NULL;
+	}
+}
+
+uint64_t
+dr_stream_now(void)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (uint64_t)now.tv_sec * 1000000 + now.tv_usec;
+}
+
+/* Called by the owner of the ack fd once it polls readable. */
+void
+dr_stream_ack_drain(struct dr_stream *s)
+{
+	uint64_t val;
+	int gcc = read(s->ack_fd, &val, sizeof(val));
+	if (gcc) {};
+}
+
+/*
+ * How far a backup trails us, in time: one RTT, plus what it takes to
+ * drain the bytes it has not acknowledged at its current ack rate.
+ */
+static uint64_t
+dr_target_lag_us(struct dr_target *t)
+{
+	struct dr_stream *s = t->stream;
+	uint64_t srtt, rate, pending;
+
+	srtt    = __atomic_load_n(&t->srtt_us, __ATOMIC_RELAXED);
+	rate    = __atomic_load_n(&t->ack_rate, __ATOMIC_RELAXED);
+	pending = dr_ring_head(&s->ring) -
+		__atomic_load_n(&t->done, __ATOMIC_ACQUIRE);
+
+	if (!pending)
+		return 0;
+
+	if (!rate)
+		return srtt;
+
+	return srtt + pending * 1000000 / rate;
+}
+
+/*
+ * How far the backups trail us: the lag of the quorum-th closest live
+ * target, or of the farthest one if fewer are left.
+ */
+uint64_t
+dr_stream_lag_us(struct dr_stream *s)
+{
+	uint64_t lag[DR_MAX_TARGETS], l;
+	int i, j, n = 0;
+
+	for (i = 0; i < s->n_targets; i++) {
+		if (__atomic_load_n(&s->targets[i].ack_failed,
+				    __ATOMIC_ACQUIRE) ||
+		    __atomic_load_n(&s->targets[i].offline,
+				    __ATOMIC_ACQUIRE))
+			continue;
+
+		l = dr_target_lag_us(&s->targets[i]);
+		for (j = n++; j > 0 && lag[j - 1] > l; j--)
+			lag[j] = lag[j - 1];
+		lag[j] = l;
+	}
+
+	if (!n)
+		return 0;
+
+	return lag[(s->quorum < n ? s->quorum : n) - 1];
+}
+
+/*
+ * How fast the backups take writes, in bytes per second: the ack rate
+ * of the quorum-th fastest live target, or of the slowest one if fewer
+ * are left. 0 until anything was measured.
+ */
+uint64_t
+dr_stream_drain_rate(struct dr_stream *s)
+{
+	uint64_t rate[DR_MAX_TARGETS], r;
+	int i, j, n = 0;
+
+	for (i = 0; i < s->n_targets; i++) {
+		if (__atomic_load_n(&s->targets[i].ack_failed,
+				    __ATOMIC_ACQUIRE) ||
+		    __atomic_load_n(&s->targets[i].offline,
+				    __ATOMIC_ACQUIRE))
+			continue;
+
+		r = __atomic_load_n(&s->targets[i].ack_rate, __ATOMIC_RELAXED);
+		for (j = n++; j > 0 && rate[j - 1] < r; j--)
+			rate[j] = rate[j - 1];
+		rate[j] = r;
+	}
+
+	if (!n)
+		return 0;
+
+	return rate[(s->quorum < n ? s->quorum : n) - 1];
+}
+
+/*
+ * Give up on the backlog of offline targets, rather than holding
+ * writes until they are back. Returns how many were dropped.
+ */
+static int
+dr_stream_shed(struct dr_stream *s)
+{
+	struct dr_target *t;
+	int i, n = 0;
+
+	pthread_mutex_lock(&s->release_lock);
+
+	for (i = 0; i < s->n_targets; i++) {
+		t = &s->targets[i];
+		if (!__atomic_load_n(&t->offline, __ATOMIC_ACQUIRE) ||
+		    __atomic_load_n(&t->ack_failed, __ATOMIC_ACQUIRE))
+			continue;
+
+		DPRINTF("DR ring full, %s:%d is offline, dropping its backlog\n",
+			t->host, t->port);
+		__atomic_store_n(&t->ack_failed, 1, __ATOMIC_RELEASE);
+		n++;
+	}
+
+	pthread_mutex_unlock(&s->release_lock);
+
+	if (n)
+		dr_stream_advance(s);
+
+	return n;
+}
+
+/*
+ * Check there is room for a record of 'size' data bytes. Must succeed
+ * before the write is queued locally: a bounced write has to leave no
+ * trace, the vbd will send it again.
+ */
+int
+dr_stream_reserve(struct dr_stream *s, int size)
+{
+	int err;
+
+	if (s->resyncing)
+		return 0;
+
+	/* room for the barrier catching up with the group, too */
+	if (s->group && !s->seed &&
+	    __atomic_load_n(&s->group->epoch, __ATOMIC_ACQUIRE) > s->epoch)
+		size += dr_record_size(0);
+
+	if (s->spilling)
+		goto spill;
+
+	err = dr_ring_reserve(&s->ring, dr_record_size(size));
+	if (err != -EBUSY || s->spill_fd < 0)
+		goto out;
+
+	DPRINTF("DR ring full, spilling to journal\n");
+	s->spilling = 1;
+	s->spill_rd = s->spill_wr = 0;
+
+spill:
+	err = 0;
+	if (s->spill_wr + dr_record_size(size) > s->spill_max)
+		err = -EBUSY;
+out:
+	if (!err && s->stall_start) {
+		s->stall_us   += dr_stream_now() - s->stall_start;
+		s->stall_start = 0;
+	}
+
+	if (err == -EBUSY && s->dirty.bitmap) {
+		DPRINTF("DR backlog exceeds ring and journal, "
+			"falling back to dirty bitmap resync\n");
+		s->resyncing  = 1;
+		s->resync_pos = 0;
+		s->resyncs++;
+		return 0;
+	}
+
+	/* the ring is only full for a backup we cannot reach */
+	if (err == -EBUSY && dr_stream_shed(s) && !s->spilling)
+		err = dr_ring_reserve(&s->ring, dr_record_size(size));
+
+	if (!err)
+		err = dr_stream_group_sync(s);
+
+	if (err == -EBUSY) {
+		s->full_busy++;
+		if (!s->stall_start)
+			s->stall_start = dr_stream_now();
+	}
+
+	return err;
+}
+
+/* Journal records that do not fit the ring, from now to 'max' bytes. */
+int
+dr_stream_spill(struct dr_stream *s, const char *path, uint64_t max)
+{
+	s->spill_fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_LARGEFILE,
+			   0600);
+	if (s->spill_fd < 0) {
+		int err = -errno;
+		DPRINTF("DR journal %s: %d\n", path, err);
+		return err;
+	}
+
+	s->spill_max = max;
+	return 0;
+}
+
+/*
+ * Journaled writes we cannot replay, [sector, sector + count): with
+ * resync enabled, mark them dirty and have the resync copy them once
+ * the journal is drained. Without, they are gone.
+ */
+static void
+dr_stream_spill_lost(struct dr_stream *s, uint64_t sector, uint64_t count)
+{
+	s->spill_lost++;
+
+	if (!s->dirty.bitmap)
+		return;
+
+	writelog_set(&s->dirty, sector, count);
+
+	if (!s->resyncing) {
+		DPRINTF("DR journal lost writes, "
+			"falling back to dirty bitmap resync\n");
+		s->resyncing  = 1;
+		s->resync_pos = 0;
+		s->resyncs++;
+	}
+}
+
+/*
+ * Move whole records from the journal into the ring, reading straight
+ * into the free part of the ring and publishing as far as the last
+ * complete record read. Reads are DR_SPILL_CHUNK at most, but never
+ * less than the next record. Once the journal is empty, go back to
+ * queueing into the ring; otherwise stay armed for the next space
+ * wakeup. A journal we cannot parse any further resyncs the whole disk.
+ */
+static void
+dr_stream_refill(struct dr_stream *s)
+{
+	struct req_info rinfo;
+	struct iovec iov[2];
+	uint64_t head, want;
+	uint32_t len, rlen;
+	ssize_t n;
+	int cnt;
+
+	while (s->spill_rd < s->spill_wr) {
+		n = pread(s->spill_fd, &rinfo, sizeof(rinfo), s->spill_rd);
+		if (n != sizeof(rinfo)) {
+			DPRINTF("DR journal read failed: %d\n",
+				n < 0 ? -errno : -EIO);
+			goto lost;
+		}
+
+		want = s->spill_wr - s->spill_rd;
+		if (rinfo.size < 0 || dr_record_size(rinfo.size) > want ||
+		    dr_record_size(rinfo.size) > s->ring.size) {
+			DPRINTF("DR journal corrupt at %llu\n",
+				(unsigned long long)s->spill_rd);
+			goto lost;
+		}
+
+		if (want > DR_SPILL_CHUNK)
+			want = DR_SPILL_CHUNK;
+		if (want > s->ring.size / 4)
+			want = s->ring.size / 4;
+		if (want < dr_record_size(rinfo.size))
+			want = dr_record_size(rinfo.size);
+
+		if (dr_ring_free(&s->ring) < want) {
+			if (dr_ring_reserve(&s->ring, want) == -EBUSY)
+				return;
+		}
+
+		head = dr_ring_prod_index(&s->ring);
+		cnt  = dr_ring_iov(&s->ring, s->data, head, want, iov);
+
+		n = preadv(s->spill_fd, iov, cnt, s->spill_rd);
+		if (n <= 0) {
+			DPRINTF("DR journal read failed: %d\n",
+				n < 0 ? -errno : -EIO);
+			goto lost;
+		}
+
+		len = 0;
+		while (len + sizeof(rinfo) <= n) {
+			dr_ring_copy_out(&s->ring, s->data, head + len,
+					 &rinfo, sizeof(rinfo));
+			rlen = dr_record_size(rinfo.size);
+			if (rinfo.size < 0 || len + rlen > n)
+				break;
+			len += rlen;
+		}
+
+		if (!len) {
+			DPRINTF("DR journal corrupt at %llu\n",
+				(unsigned long long)s->spill_rd);
+			goto lost;
+		}
+
+		dr_stream_produce(s, len);
+		s->spill_rd += len;
+	}
+
+	goto done;
+
+lost:
+	dr_stream_spill_lost(s, 0, s->dirty.size);
+done:
+	DPRINTF("DR journal drained, %llu bytes\n",
+		(unsigned long long)s->spill_wr);
+	s->spilling = 0;
+	s->spill_rd = s->spill_wr = 0;
+	if (ftruncate(s->spill_fd, 0))
+		DPRINTF("DR journal truncate failed: %d\n", -errno);
+
+	if (s->resyncing)
+		dr_stream_resync_pump(s);
+
+	if (s->seed)
+		dr_stream_seed_pump(s);
+}
+
+static void
+dr_stream_journal(struct dr_stream *s, struct req_info *rinfo,
+		  const void *buf, int size)
+{
+	struct iovec iov[2];
+	ssize_t n;
+
+	iov[0].iov_base = rinfo;
+	iov[0].iov_len  = sizeof(*rinfo);
+	iov[1].iov_base = (void *)buf;
+	iov[1].iov_len  = size;
+
+	n = pwritev(s->spill_fd, iov, 2, s->spill_wr);
+	if (n != dr_record_size(size)) {
+		DPRINTF("DR journal write failed: %d, record %llu lost\n",
+			n < 0 ? -errno : -EIO,
+			(unsigned long long)rinfo->writeID);
+		dr_stream_spill_lost(s, rinfo->offset >> SECTOR_SHIFT,
+				     size >> SECTOR_SHIFT);
+		return;
+	}
+
+	s->spill_wr += n;
+	s->spilled++;
+}
+
+/* Publish n bytes, waking every dispatcher waiting for data. */
+static void
+dr_stream_produce(struct dr_stream *s, uint32_t n)
+{
+	struct dr_target *t;
+	int i;
+
+	dr_ring_produce(&s->ring, n);
+
+	for (i = 0; i < s->n_targets; i++) {
+		t = &s->targets[i];
+		if (__atomic_exchange_n(&t->data_wanted, 0, __ATOMIC_ACQ_REL))
+			__dr_ring_signal(t->doorbell);
+	}
+}
+
+static uint64_t *
+dr_stream_state(struct dr_stream *s, uint64_t pos)
+{
+	pos += offsetof(struct req_info, state);
+	return (uint64_t *)(s->data + dr_ring_slot(&s->ring, pos));
+}
+
+/*
+ * Drop the queued record for this extent, if it is still unsent and
+ * in the same epoch, then index the new one in its place.
+ */
+static void
+dr_stream_absorb(struct dr_stream *s, uint64_t write_id,
+		 uint64_t offset, int size, uint64_t pos)
+{
+	struct dr_absorb_slot *slot;
+	uint64_t old, tail;
+
+	slot = &s->absorb_slots[(offset >> SECTOR_SHIFT) % DR_ABSORB_SLOTS];
+	tail = __atomic_load_n(&s->ring.tail, __ATOMIC_ACQUIRE);
+
+	if (slot->writeID && slot->offset == offset && slot->size == size &&
+	    slot->epoch == s->epoch && slot->pos >= tail) {
+		old = DR_REC_QUEUED;
+		if (__atomic_compare_exchange_n(dr_stream_state(s, slot->pos),
+						&old, DR_REC_ABSORBED, 0,
+						__ATOMIC_ACQ_REL,
+						__ATOMIC_ACQUIRE)) {
+			s->absorbed++;
+			s->absorbed_bytes += size;
+		}
+	}
+
+	slot->offset  = offset;
+	slot->pos     = pos;
+	slot->writeID = write_id;
+	slot->epoch   = s->epoch;
+	slot->size    = size;
+}
+
+static void
+__dr_stream_enqueue(struct dr_stream *s, struct req_info *rinfo,
+		    const void *buf)
+{
+	uint64_t pos;
+
+	pos = dr_ring_prod_index(&s->ring);
+	dr_ring_copy_in(&s->ring, s->data, pos, rinfo, sizeof(*rinfo));
+	dr_ring_copy_in(&s->ring, s->data, pos + sizeof(*rinfo),
+			buf, rinfo->size);
+
+	if (s->absorb && rinfo->size)
+		dr_stream_absorb(s, rinfo->writeID, rinfo->offset,
+				 rinfo->size, pos);
+
+	dr_stream_produce(s, dr_record_size(rinfo->size));
+}
+
+void
+dr_stream_queue_write(struct dr_stream *s, uint64_t write_id,
+		      uint64_t offset, const void *buf, int size)
+{
+	struct dr_seed *sd = s->seed;
+	struct req_info rinfo;
+
+	if (sd)
+		writelog_set(&sd->live, offset >> SECTOR_SHIFT,
+			     size >> SECTOR_SHIFT);
+
+	if (s->resyncing) {
+		writelog_set(&s->dirty, offset >> SECTOR_SHIFT,
+			     size >> SECTOR_SHIFT);
+		dr_stream_resync_pump(s);
+		return;
+	}
+
+	memset(&rinfo, 0, sizeof(rinfo));
+	rinfo.writeID = write_id;
+	rinfo.size    = size;
+	rinfo.offset  = offset;
+
+	if (s->spilling) {
+		dr_stream_journal(s, &rinfo, buf, size);
+		if (dr_ring_free(&s->ring) >= s->ring.size / 4)
+			dr_stream_refill(s);
+	} else
+		__dr_stream_enqueue(s, &rinfo, buf);
+
+	if (!s->epoch_writes++)
+		s->epoch_start = dr_stream_now();
+	s->epoch_id = write_id;
+
+	dr_stream_epoch_check(s);
+}
+
+/*
+ * Close epochs after 'writes' writes, or 'ms' after their first write;
+ * 0 disables either. Epochs are off until this is called.
+ */
+int
+dr_stream_epochs(struct dr_stream *s, unsigned int writes, unsigned int ms)
+{
+	s->epoch_max = writes;
+	s->epoch_us  = (uint64_t)ms * 1000;
+
+	if (ms && !s->epoch_event) {
+		/* the scheduler counts timeouts in seconds */
+		s->epoch_event =
+			tapdisk_server_register_event(SCHEDULER_POLL_TIMEOUT,
+						      -1, (ms + 999) / 1000,
+						      dr_stream_epoch_event,
+						      s);
+		if (s->epoch_event < 0) {
+			int err = s->epoch_event;
+			s->epoch_event = 0;
+			return err;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Join the consistency group 'name', taking its epoch from now on.
+ * Epochs must be enabled.
+ */
+int
+dr_stream_group(struct dr_stream *s, const char *name)
+{
+	int err;
+
+	err = dr_group_join(name, &s->group);
+	if (err)
+		return err;
+
+	s->epoch = __atomic_load_n(&s->group->epoch, __ATOMIC_ACQUIRE);
+	DPRINTF("DR group %s, epoch %llu\n", name,
+		(unsigned long long)s->epoch);
+	return 0;
+}
+
+/*
+ * Queue the barrier closing every epoch before 'next'. A barrier
+ * takes ring (or journal) space like any record, -EBUSY if there is
+ * none.
+ */
+static int
+dr_stream_close_epoch(struct dr_stream *s, uint64_t next)
+{
+	struct req_info rinfo;
+
+	memset(&rinfo, 0, sizeof(rinfo));
+	rinfo.writeID = s->epoch_id;
+	rinfo.offset  = next - 1;
+
+	if (s->spilling) {
+		if (s->spill_wr + dr_record_size(0) > s->spill_max)
+			return -EBUSY;
+		dr_stream_journal(s, &rinfo, NULL, 0);
+	} else {
+		if (dr_ring_reserve(&s->ring, dr_record_size(0)))
+			return -EBUSY;
+		__dr_stream_enqueue(s, &rinfo, NULL);
+	}
+
+	s->epoch = next;
+	s->epoch_writes = 0;
+	s->barriers++;
+	return 0;
+}
+
+/* Catch up with the group, if it moved on. */
+static int
+dr_stream_group_sync(struct dr_stream *s)
+{
+	uint64_t epoch;
+
+	if (!s->group || s->resyncing || s->seed)
+		return 0;
+
+	epoch = __atomic_load_n(&s->group->epoch, __ATOMIC_ACQUIRE);
+	if (epoch <= s->epoch)
+		return 0;
+
+	return dr_stream_close_epoch(s, epoch);
+}
+
+/*
+ * Close the current epoch now, e.g. on a guest flush. If there is no
+ * space for the barrier, the epoch stays open and the barrier is
+ * retried once space frees up. Nothing is consistent during a resync
+ * or a seed, so no barriers go out until it ends.
+ */
+void
+dr_stream_barrier(struct dr_stream *s)
+{
+	uint64_t epoch;
+
+	if (s->resyncing || s->seed)
+		return;
+
+	if (s->group) {
+		/* unless another member moved the group on already */
+		epoch = s->epoch;
+		if (s->epoch_writes)
+			__atomic_compare_exchange_n(&s->group->epoch, &epoch,
+						    epoch + 1, 0,
+						    __ATOMIC_ACQ_REL,
+						    __ATOMIC_ACQUIRE);
+		dr_stream_group_sync(s);
+		return;
+	}
+
+	if (s->epoch_writes)
+		dr_stream_close_epoch(s, s->epoch + 1);
+}
+
+static void
+dr_stream_epoch_check(struct dr_stream *s)
+{
+	dr_stream_group_sync(s);
+
+	if (!s->epoch_writes)
+		return;
+
+	if ((s->epoch_max && s->epoch_writes >= s->epoch_max) ||
+	    (s->epoch_us &&
+	     dr_stream_now() - s->epoch_start >= s->epoch_us))
+		dr_stream_barrier(s);
+}
+
+/*
+ * Fall back to a dirty bitmap over the image's 'fd' when the backlog
+ * outgrows the ring (and journal). Resync records take their writeIDs
+ * from the driver's counter.
+ */
+int
+dr_stream_resync(struct dr_stream *s, td_driver_t *driver, int fd,
+		 uint64_t *write_id)
+{
+	int i, err;
+
+	err = writelog_create(&s->dirty, driver->info.size, 0);
+	if (err)
+		return err;
+
+	for (i = 0; i < DR_RESYNC_DEPTH; i++)
+		s->resync[i].stream = s;
+
+	s->driver   = driver;
+	s->fd       = fd;
+	s->write_id = write_id;
+
+	return 0;
+}
+
+static void
+dr_stream_resync_done(void *arg, struct tiocb *tiocb, int err)
+{
+	struct dr_resync_read *r = arg;
+	struct dr_stream *s = r->stream;
+	struct req_info rinfo;
+
+	r->busy = 0;
+	s->resync_busy--;
+	s->resync_held -= dr_record_size(r->count << SECTOR_SHIFT);
+
+	if (err) {
+		DPRINTF("DR resync read at sector %llu failed: %d\n",
+			(unsigned long long)r->sector, err);
+		writelog_set(&s->dirty, r->sector, r->count);
+		return;
+	}
+
+	memset(&rinfo, 0, sizeof(rinfo));
+	rinfo.writeID = ++*s->write_id;
+	rinfo.size    = r->count << SECTOR_SHIFT;
+	rinfo.offset  = r->sector << SECTOR_SHIFT;
+
+	__dr_stream_enqueue(s, &rinfo, r->buf);
+
+	if (!s->epoch_writes++)
+		s->epoch_start = dr_stream_now();
+	s->epoch_id = rinfo.writeID;
+
+	s->resync_bytes += rinfo.size;
+
+	dr_stream_resync_pump(s);
+}
+
+/* a read in flight over any of [sector, sector + count) */
+static int
+dr_stream_resync_busy(struct dr_stream *s, uint64_t sector, uint64_t count)
+{
+	struct dr_resync_read *r;
+	int i;
+
+	for (i = 0; i < DR_RESYNC_DEPTH; i++) {
+		r = &s->resync[i];
+		if (r->busy && r->sector < sector + count &&
+		    sector < r->sector + r->count)
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Copy the next dirty extents, up to DR_RESYNC_DEPTH reads at a time,
+ * once everything that was queued before the fallback has made it into
+ * the ring. The ring space is reserved before each read: in resync
+ * mode nothing else produces, so it is still there on completion. An
+ * extent dirtied again while a read of it is in flight waits for that
+ * read, or the older data could be enqueued last.
+ */
+static void
+dr_stream_resync_pump(struct dr_stream *s)
+{
+	struct dr_resync_read *r;
+	uint64_t sector, count;
+	size_t len;
+	int i, err;
+
+	if (!s->resyncing || s->spilling)
+		return;
+
+next:
+	if (s->resync_busy == DR_RESYNC_DEPTH)
+		return;
+
+	err = writelog_next(&s->dirty, s->resync_pos,
+			    DR_RESYNC_CHUNK >> SECTOR_SHIFT, &sector, &count);
+	if (err && s->resync_pos) {
+		s->resync_pos = 0;
+		err = writelog_next(&s->dirty, 0,
+				    DR_RESYNC_CHUNK >> SECTOR_SHIFT,
+				    &sector, &count);
+	}
+
+	if (err) {
+		if (s->resync_busy)
+			return;
+
+		DPRINTF("DR resync complete, %llu bytes copied\n",
+			(unsigned long long)s->resync_bytes);
+		s->resyncing = 0;
+
+		/* the first consistent point since the fallback */
+		if (s->epoch_max || s->epoch_us)
+			dr_stream_barrier(s);
+
+		if (s->seed)
+			dr_stream_seed_pump(s);
+		return;
+	}
+
+	if (dr_stream_resync_busy(s, sector, count))
+		return;
+
+	for (i = 0; s->resync[i].busy; i++)
+		;
+	r = &s->resync[i];
+
+	if (!r->buf &&
+	    posix_memalign((void **)&r->buf, 4096, DR_RESYNC_CHUNK)) {
+		r->buf = NULL;
+		return;
+	}
+
+	len = count << SECTOR_SHIFT;
+	if (dr_ring_reserve(&s->ring, s->resync_held + dr_record_size(len)))
+		return;
+
+	writelog_clear(&s->dirty, sector, sector + count);
+	s->resync_pos   = sector + count;
+	s->resync_held += dr_record_size(len);
+	s->resync_busy++;
+	r->sector = sector;
+	r->count  = count;
+	r->busy   = 1;
+
+	td_prep_read(&r->tiocb, s->fd, r->buf, len,
+		     sector << SECTOR_SHIFT, dr_stream_resync_done, r);
+	td_queue_tiocb(s->driver, &r->tiocb);
+
+	goto next;
+}
+
+/*
+ * Take up tracking for a failback from the bitmap at 'path', if there
+ * is one, and resync what it marks. Needs resync.
+ */
+int
+dr_stream_failback(struct dr_stream *s, const char *path)
+{
+	uint64_t sector, count;
+	int err;
+
+	if (!s->dirty.bitmap)
+		return -EINVAL;
+
+	err = writelog_load(&s->dirty, path);
+	if (err && err != -ENOENT) {
+		DPRINTF("DR failback: cannot load %s: %d\n", path, err);
+		return err;
+	}
+
+	s->failback = strdup(path);
+	if (!s->failback)
+		return -ENOMEM;
+
+	if (writelog_next(&s->dirty, 0, UINT32_MAX, &sector, &count))
+		return 0;
+
+	DPRINTF("DR failback from %s, resyncing\n", path);
+	s->resyncing  = 1;
+	s->resync_pos = 0;
+	s->resyncs++;
+
+	dr_stream_resync_pump(s);
+	return 0;
+}
+
+/*
+ * Mark what the backups did not acknowledge, once nothing consumes
+ * the ring any more: reads in flight, unreleased records, the journal.
+ */
+static void
+dr_stream_failback_save(struct dr_stream *s)
+{
+	struct req_info rinfo;
+	uint64_t pos, sector, count;
+	int i, err;
+
+	for (i = 0; i < DR_RESYNC_DEPTH; i++)
+		if (s->resync[i].busy)
+			writelog_set(&s->dirty, s->resync[i].sector,
+				     s->resync[i].count);
+
+	for (pos = s->ring.tail; s->data && pos < s->ring.head;
+	     pos += dr_record_size(rinfo.size)) {
+		dr_ring_copy_out(&s->ring, s->data, pos, &rinfo,
+				 sizeof(rinfo));
+		if (rinfo.size < 0)
+			break;
+		writelog_set(&s->dirty, rinfo.offset >> SECTOR_SHIFT,
+			     rinfo.size >> SECTOR_SHIFT);
+	}
+
+	for (pos = s->spill_rd; s->spill_fd >= 0 && pos < s->spill_wr;
+	     pos += dr_record_size(rinfo.size)) {
+		if (pread(s->spill_fd, &rinfo, sizeof(rinfo), pos) !=
+		    sizeof(rinfo) || rinfo.size < 0) {
+			DPRINTF("DR failback: journal unreadable, "
+				"marking the whole disk\n");
+			writelog_set(&s->dirty, 0, s->dirty.size);
+			break;
+		}
+		writelog_set(&s->dirty, rinfo.offset >> SECTOR_SHIFT,
+			     rinfo.size >> SECTOR_SHIFT);
+	}
+
+	if (writelog_next(&s->dirty, 0, UINT32_MAX, &sector, &count)) {
+		DPRINTF("DR failback complete, removing %s\n", s->failback);
+		if (unlink(s->failback) && errno != ENOENT)
+			DPRINTF("DR failback: cannot remove %s: %d\n",
+				s->failback, -errno);
+		return;
+	}
+
+	err = writelog_save(&s->dirty, s->failback);
+	if (err)
+		DPRINTF("DR failback: cannot save %s: %d, "
+			"the next failback copies everything\n",
+			s->failback, err);
+	else
+		DPRINTF("DR failback: dirty extents kept in %s\n",
+			s->failback);
+}
+
+static void
+dr_seed_free(struct dr_seed *sd)
+{
+	int i;
+
+	for (i = 0; i < sd->depth; i++)
+		vhd_close(&sd->chain[i]);
+
+	writelog_free(&sd->live);
+	free(sd->owner);
+	free(sd->buf);
+	free(sd);
+}
+
+/*
+ * Seed from the vhd chain at 'path' (a fixed vhd, or a dynamic one and
+ * its parents). Seed records take their writeIDs from the driver's
+ * counter, like resync ones.
+ */
+int
+dr_stream_seed(struct dr_stream *s, td_driver_t *driver, const char *path,
+	       uint64_t *write_id)
+{
+	struct dr_seed *sd;
+	vhd_context_t *vhd;
+	char *parent = NULL;
+	int err;
+
+	sd = calloc(1, sizeof(*sd));
+	if (!sd)
+		return -ENOMEM;
+
+	do {
+		if (sd->depth == DR_SEED_DEPTH) {
+			err = -ELOOP;
+			goto fail;
+		}
+
+		vhd = &sd->chain[sd->depth];
+		err = vhd_open(vhd, parent ? : path, VHD_OPEN_RDONLY);
+		free(parent);
+		parent = NULL;
+		if (err) {
+			DPRINTF("DR seed: cannot open vhd: %d\n", err);
+			goto fail;
+		}
+
+		if (!sd->depth++) {
+			sd->sectors = vhd->footer.curr_size >> VHD_SECTOR_SHIFT;
+			sd->spb     = vhd_type_dynamic(vhd) ? vhd->spb :
+				DR_RESYNC_CHUNK >> SECTOR_SHIFT;
+		}
+
+		if (!vhd_type_dynamic(vhd))
+			break;
+
+		/* blocks map onto sectors one way along the chain */
+		if (vhd->spb != sd->spb || vhd_data_shift(vhd)) {
+			err = -EINVAL;
+			goto fail;
+		}
+
+		err = vhd_read_bat(vhd, &vhd->bat);
+		if (err)
+			goto fail;
+
+		if (vhd->footer.type != HD_TYPE_DIFF)
+			break;
+
+		err = vhd_parent_locator_get(vhd, &parent);
+		if (err)
+			goto fail;
+	} while (1);
+
+	sd->blocks = (sd->sectors + sd->spb - 1) / sd->spb;
+
+	sd->owner = malloc(sd->spb);
+	if (!sd->owner) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	err = posix_memalign((void **)&sd->buf, 4096, DR_RESYNC_CHUNK);
+	if (err) {
+		sd->buf = NULL;
+		err = -err;
+		goto fail;
+	}
+
+	err = writelog_create(&sd->live, sd->sectors, 0);
+	if (err)
+		goto fail;
+
+	DPRINTF("DR seed from %s: %d images, %u blocks\n",
+		path, sd->depth, sd->blocks);
+
+	s->driver   = driver;
+	s->write_id = write_id;
+	s->seed     = sd;
+
+	dr_stream_seed_pump(s);
+	return 0;
+
+fail:
+	dr_seed_free(sd);
+	return err;
+}
+
+/* Who in the chain holds each sector of the current block. */
+static int
+dr_seed_plan(struct dr_seed *sd)
+{
+	vhd_context_t *vhd;
+	uint32_t k;
+	char *map;
+	int i, err;
+
+	memset(sd->owner, DR_SEED_NONE, sd->spb);
+
+	for (i = 0; i < sd->depth; i++) {
+		vhd = &sd->chain[i];
+
+		if (!vhd_type_dynamic(vhd)) {
+			for (k = 0; k < sd->spb; k++)
+				if (sd->owner[k] == DR_SEED_NONE)
+					sd->owner[k] = i;
+			break;
+		}
+
+		if (sd->block >= vhd->bat.entries ||
+		    vhd->bat.bat[sd->block] == DD_BLK_UNUSED)
+			continue;
+
+		err = vhd_read_bitmap(vhd, sd->block, &map);
+		if (err)
+			return err;
+
+		for (k = 0; k < sd->spb; k++)
+			if (sd->owner[k] == DR_SEED_NONE &&
+			    vhd_bitmap_test(vhd, map, k))
+				sd->owner[k] = i;
+
+		free(map);
+	}
+
+	return 0;
+}
+
+/*
+ * The next run of sectors one image holds, at most DR_RESYNC_CHUNK
+ * long: its first sector and count, the image, and where it is in
+ * that image's file. -ENOENT past the last block.
+ */
+static int
+dr_seed_next(struct dr_seed *sd, uint64_t *sector, uint64_t *count,
+	     vhd_context_t **vhd, uint64_t *off)
+{
+	uint32_t k, end, max = DR_RESYNC_CHUNK >> SECTOR_SHIFT;
+	uint64_t first;
+	int err;
+
+	for (; sd->block < sd->blocks;
+	     sd->block++, sd->pos = 0, sd->planned = 0) {
+		if (!sd->planned) {
+			err = dr_seed_plan(sd);
+			if (err)
+				return err;
+			sd->planned = 1;
+		}
+
+		first = (uint64_t)sd->block * sd->spb;
+
+		k = sd->pos;
+		while (k < sd->spb && sd->owner[k] == DR_SEED_NONE)
+			k++;
+		if (k == sd->spb || first + k >= sd->sectors)
+			continue;
+
+		end = k + 1;
+		while (end < sd->spb && end - k < max &&
+		       first + end < sd->sectors &&
+		       sd->owner[end] == sd->owner[k])
+			end++;
+
+		*vhd    = &sd->chain[sd->owner[k]];
+		*sector = first + k;
+		*count  = end - k;
+
+		if (vhd_type_dynamic(*vhd))
+			*off = vhd_sectors_to_bytes((uint64_t)
+						    (*vhd)->bat.bat[sd->block] +
+						    (*vhd)->bm_secs + k);
+		else
+			*off = vhd_sectors_to_bytes(first + k);
+
+		sd->pos = end;
+		return 0;
+	}
+
+	return -ENOENT;
+}
+
+/*
+ * Send what a completed read still has to offer, in runs no live write
+ * touched since the seed began. -EBUSY if the ring fills up first.
+ */
+static int
+dr_seed_emit(struct dr_stream *s)
+{
+	struct dr_seed *sd = s->seed;
+	uint64_t end, last = sd->sector + sd->count;
+	struct req_info rinfo;
+
+	while (sd->cursor < last) {
+		if (writelog_test(&sd->live, sd->cursor)) {
+			sd->skipped += 1 << SECTOR_SHIFT;
+			sd->cursor++;
+			continue;
+		}
+
+		end = sd->cursor + 1;
+		while (end < last && !writelog_test(&sd->live, end))
+			end++;
+
+		if (dr_ring_reserve(&s->ring,
+				    dr_record_size((end - sd->cursor) <<
+						   SECTOR_SHIFT)))
+			return -EBUSY;
+
+		memset(&rinfo, 0, sizeof(rinfo));
+		rinfo.writeID = ++*s->write_id;
+		rinfo.size    = (end - sd->cursor) << SECTOR_SHIFT;
+		rinfo.offset  = sd->cursor << SECTOR_SHIFT;
+
+		__dr_stream_enqueue(s, &rinfo,
+				    sd->buf + ((sd->cursor - sd->sector) <<
+					       SECTOR_SHIFT));
+
+		if (!s->epoch_writes++)
+			s->epoch_start = dr_stream_now();
+		s->epoch_id = rinfo.writeID;
+
+		sd->bytes  += rinfo.size;
+		sd->cursor  = end;
+	}
+
+	sd->ready = 0;
+	return 0;
+}
+
+static void
+dr_stream_seed_done(void *arg, struct tiocb *tiocb, int err)
+{
+	struct dr_stream *s = arg;
+	struct dr_seed *sd = s->seed;
+
+	/* the stream was freed under us, the seed is lost anyway */
+	if (!sd)
+		return;
+
+	sd->busy = 0;
+
+	if (err) {
+		DPRINTF("DR seed read at sector %llu failed: %d, "
+			"backup is incomplete\n",
+			(unsigned long long)sd->sector, err);
+		dr_seed_free(sd);
+		s->seed = NULL;
+		return;
+	}
+
+	sd->ready  = 1;
+	sd->cursor = sd->sector;
+
+	dr_stream_seed_pump(s);
+}
+
+/*
+ * One read at a time, like resync, and not while the journal or a
+ * resync own the ring. Ring space for the read is checked before it
+ * is issued, but live writes may take it meanwhile: a read that finds
+ * none waits for the space doorbell.
+ */
+static void
+dr_stream_seed_pump(struct dr_stream *s)
+{
+	struct dr_seed *sd = s->seed;
+	uint64_t sector, count, off;
+	vhd_context_t *vhd;
+	size_t len;
+	int err;
+
+	if (sd->busy || s->spilling || s->resyncing)
+		return;
+
+	if (sd->ready && dr_seed_emit(s))
+		return;
+
+	err = dr_seed_next(sd, &sector, &count, &vhd, &off);
+	if (err) {
+		if (err == -ENOENT)
+			DPRINTF("DR seed complete, %llu bytes copied, "
+				"%llu superseded\n",
+				(unsigned long long)sd->bytes,
+				(unsigned long long)sd->skipped);
+		else
+			DPRINTF("DR seed failed at block %u: %d, "
+				"backup is incomplete\n", sd->block, err);
+
+		dr_seed_free(sd);
+		s->seed = NULL;
+
+		if (err == -ENOENT && (s->epoch_max || s->epoch_us))
+			dr_stream_barrier(s);
+		return;
+	}
+
+	len = count << SECTOR_SHIFT;
+	if (dr_ring_reserve(&s->ring, dr_record_size(len))) {
+		/* not lost: take it again once there is space */
+		sd->pos -= count;
+		return;
+	}
+
+	sd->sector = sector;
+	sd->count  = count;
+	sd->busy   = 1;
+
+	td_prep_read(&sd->tiocb, vhd->fd, sd->buf, len, off,
+		     dr_stream_seed_done, s);
+	td_queue_tiocb(s->driver, &sd->tiocb);
+}
+
+/* Sum the data of the record at pos into its header. */
+static void
+dr_stream_checksum(struct dr_stream *s, uint64_t pos)
+{
+	struct req_info rinfo;
+	struct iovec iov[2];
+	uint32_t crc = 0;
+	int i, cnt;
+
+	dr_ring_copy_out(&s->ring, s->data, pos, &rinfo, sizeof(rinfo));
+	cnt = dr_ring_iov(&s->ring, s->data, pos + sizeof(rinfo),
+			  rinfo.size, iov);
+	for (i = 0; i < cnt; i++)
+		crc = dr_crc32c(crc, iov[i].iov_base, iov[i].iov_len);
+
+	dr_ring_copy_in(&s->ring, s->data,
+			pos + offsetof(struct req_info, crc), &crc, sizeof(crc));
+	__atomic_fetch_add(&s->crc_bytes, rinfo.size, __ATOMIC_RELAXED);
+}
+
+/*
+ * Claim a record for sending. Fails only if the loop absorbed it;
+ * records already sent once are sent again when we rewind. With
+ * checksums, the first target to claim a record sums it, and any
+ * other waits for it to finish.
+ */
+static int
+dr_stream_claim(struct dr_stream *s, uint64_t pos)
+{
+	uint64_t *state = dr_stream_state(s, pos);
+	uint64_t old = DR_REC_QUEUED;
+
+	if (__atomic_compare_exchange_n(state, &old,
+					s->crc ? DR_REC_SUMMING : DR_REC_SENT,
+					0, __ATOMIC_ACQ_REL,
+					__ATOMIC_ACQUIRE)) {
+		if (s->crc) {
+			dr_stream_checksum(s, pos);
+			__atomic_store_n(state, DR_REC_SENT | DR_REC_CRC,
+					 __ATOMIC_RELEASE);
+		}
+		return 1;
+	}
+
+	while (old == DR_REC_SUMMING) {
+		sched_yield();
+		old = __atomic_load_n(state, __ATOMIC_ACQUIRE);
+	}
+
+	return old != DR_REC_ABSORBED;
+}
+
+/*
+ * Send a batch as one struct dr_frame. Batches worth compressing are
+ * gathered into zraw first; if compression does not pay they still go
+ * out as is, straight from the ring.
+ */
+static int
+dr_target_send_frame(struct dr_target *t, struct iovec *iov, int cnt)
+{
+	struct iovec out[DR_BATCH_IOVS + 1];
+	struct dr_frame *frame = &t->frame;
+	size_t raw = 0;
+	int i;
+
+	for (i = 0; i < cnt; i++)
+		raw += iov[i].iov_len;
+
+	/* in the target, a link may only send it at the end of its round */
+	frame->magic = DR_FRAME_MAGIC;
+	frame->raw   = raw;
+	frame->len   = raw;
+
+	out[0].iov_base = frame;
+	out[0].iov_len  = sizeof(*frame);
+
+#ifdef HAVE_LZ4
+	if (t->codec == DR_CODEC_LZ4 &&
+	    raw >= DR_COMPRESS_MIN && raw <= DR_MAX_BATCH_BYTES) {
+		size_t off = 0;
+		int len;
+
+		for (i = 0; i < cnt; i++) {
+			memcpy(t->zraw + off, iov[i].iov_base, iov[i].iov_len);
+			off += iov[i].iov_len;
+		}
+
+		len = LZ4_compress_default(t->zraw, t->zbuf, raw, t->zbuf_size);
+		if (len > 0 && len < raw) {
+			frame->len      = len;
+			out[1].iov_base = t->zbuf;
+			out[1].iov_len  = len;
+			t->wire_bytes  += sizeof(*frame) + len;
+
+			return dr_target_writev(t, out, 2, 0);
+		}
+	}
+#endif
+
+	memcpy(out + 1, iov, cnt * sizeof(*iov));
+	t->wire_bytes += sizeof(*frame) + raw;
+
+	return dr_target_writev(t, out, cnt + 1, 0);
+}
+
+static void
+dr_target_kick(struct dr_target *t)
+{
+	__dr_ring_signal(t->doorbell);
+}
+
+/*
+ * Release ring space up to the oldest index a live target still needs.
+ * With every target failed, keep it all: the data is still unreplicated.
+ */
+static void
+dr_stream_advance(struct dr_stream *s)
+{
+	struct dr_target *t;
+	uint64_t done, min = UINT64_MAX, tail;
+	int i;
+
+	pthread_mutex_lock(&s->release_lock);
+
+	for (i = 0; i < s->n_targets; i++) {
+		t = &s->targets[i];
+		if (__atomic_load_n(&t->ack_failed, __ATOMIC_ACQUIRE))
+			continue;
+		done = __atomic_load_n(&t->done, __ATOMIC_ACQUIRE);
+		if (done < min)
+			min = done;
+	}
+
+	tail = dr_ring_cons_index(&s->ring);
+	if (min != UINT64_MAX && min > tail)
+		dr_ring_consume(&s->ring, min - tail);
+
+	pthread_mutex_unlock(&s->release_lock);
+}
+
+/*
+ * Pay for sends with the tokens of td-rated bridge 'name', a socket in
+ * TD_VALVE_SOCKDIR or an absolute path. The bridge is connected to on
+ * the first send.
+ */
+int
+dr_stream_valve(struct dr_stream *s, const char *name)
+{
+	s->valve.name = strdup(name);
+	if (!s->valve.name)
+		return -ENOMEM;
+
+	return 0;
+}
+
+static int
+dr_valve_connect(struct dr_valve *v)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	int sock, err;
+
+	if (v->name[0] == '/')
+		strncpy(addr.sun_path, v->name, sizeof(addr.sun_path) - 1);
+	else
+		snprintf(addr.sun_path, sizeof(addr.sun_path),
+			 "%s/%s", TD_VALVE_SOCKDIR, v->name);
+
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock < 0)
+		return -errno;
+
+	if (connect(sock, (struct sockaddr *)&addr, sizeof(addr))) {
+		err = -errno;
+		close(sock);
+		return err;
+	}
+
+	DPRINTF("DR valve connected to %s\n", addr.sun_path);
+
+	v->sock = sock;
+	v->cred = v->need = v->gntd = 0;
+	return 0;
+}
+
+static void
+dr_valve_reset(struct dr_valve *v, int err)
+{
+	DPRINTF("DR valve %s: %d, not limiting for now\n", v->name, err);
+
+	if (v->sock >= 0)
+		close(v->sock);
+	v->sock     = -1;
+	v->cred     = v->need = v->gntd = 0;
+	v->retry_us = dr_stream_now() + DR_VALVE_RETRY_US;
+}
+
+/*
+ * Wait for the bridge to grant 'bytes', asking for whatever the credit
+ * and earlier requests do not cover. Returns the bytes paid for with
+ * tokens, to be handed to dr_valve_done(), 0 when unlimited.
+ */
+static unsigned long
+dr_valve_take(struct dr_valve *v, unsigned long bytes)
+{
+	struct td_valve_req req;
+	unsigned long grant[32];
+	uint64_t start = 0;
+	ssize_t n;
+	int i, err;
+
+	if (!v->name)
+		return 0;
+
+	if (bytes > TD_RLB_REQUEST_MAX)
+		bytes = TD_RLB_REQUEST_MAX;
+
+	pthread_mutex_lock(&v->lock);
+
+	if (v->sock < 0) {
+		if (dr_stream_now() < v->retry_us) {
+			bytes = 0;
+			goto out;
+		}
+
+		err = dr_valve_connect(v);
+		if (err)
+			goto reset;
+	}
+
+	while (v->cred < bytes) {
+		if (v->cred + v->need < bytes) {
+			req.need = bytes - v->cred - v->need;
+			req.done = 0;
+
+			n = send(v->sock, &req, sizeof(req), MSG_NOSIGNAL);
+			if (n != sizeof(req)) {
+				err = n < 0 ? -errno : -EPROTO;
+				goto reset;
+			}
+			v->need += req.need;
+		}
+
+		if (!start) {
+			start = dr_stream_now();
+			v->waits++;
+		}
+
+		n = recv(v->sock, grant, sizeof(grant), 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			err = n < 0 ? -errno : -ECONNRESET;
+			goto reset;
+		}
+
+		for (i = 0; i < n / sizeof(grant[0]); i++) {
+			if (grant[i] > v->need) {
+				err = -EPROTO;
+				goto reset;
+			}
+			v->cred += grant[i];
+			v->need -= grant[i];
+		}
+	}
+
+	v->cred  -= bytes;
+	v->gntd  += bytes;
+	v->bytes += bytes;
+	goto out;
+
+reset:
+	dr_valve_reset(v, err);
+	bytes = 0;
+out:
+	if (start)
+		v->wait_us += dr_stream_now() - start;
+	pthread_mutex_unlock(&v->lock);
+
+	return bytes;
+}
+
+/* Tell the bridge what was sent; a reset meanwhile forgot the grant. */
+static void
+dr_valve_done(struct dr_valve *v, unsigned long bytes)
+{
+	struct td_valve_req req;
+	ssize_t n;
+
+	if (!bytes)
+		return;
+
+	pthread_mutex_lock(&v->lock);
+
+	if (bytes > v->gntd)
+		bytes = v->gntd;
+
+	if (v->sock >= 0 && bytes) {
+		req.need = 0;
+		req.done = bytes;
+
+		n = send(v->sock, &req, sizeof(req), MSG_NOSIGNAL);
+		if (n == sizeof(req))
+			v->gntd -= bytes;
+		else
+			dr_valve_reset(v, n < 0 ? -errno : -EPROTO);
+	}
+
+	pthread_mutex_unlock(&v->lock);
+}
+
+/* Encrypt connections to backups, see dr-tls.h; before connecting. */
+int
+dr_stream_tls(struct dr_stream *s, const char *ca)
+{
+	s->tls = strdup(ca);
+	if (!s->tls)
+		return -ENOMEM;
+
+	return 0;
+}
+
+/* Set before the first target is added. */
+void
+dr_stream_sockopts(struct dr_stream *s, const struct dr_sockopts *opts)
+{
+	s->sock = *opts;
+
+	if (!s->sock.zerocopy || s->pinned)
+		return;
+
+	if (mlock(s->data, s->ring.size)) {
+		DPRINTF("DR: cannot lock the ring for zerocopy: %d\n", -errno);
+		return;
+	}
+	s->pinned = 1;
+}
+
+static int
+dr_target_fd(struct dr_target *t)
+{
+	return t->link ? t->link->sock : t->sock;
+}
+
+/* Both directions, past the sysctl caps where we may. */
+static void
+dr_target_sockbuf(struct dr_target *t, int size)
+{
+	int sock = dr_target_fd(t);
+
+	if (setsockopt(sock, SOL_SOCKET, SO_SNDBUFFORCE, &size, sizeof(size)) &&
+	    setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size)))
+		DPRINTF("DR: cannot size send buffer: %d\n", -errno);
+
+	if (setsockopt(sock, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) &&
+	    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)))
+		DPRINTF("DR: cannot size receive buffer: %d\n", -errno);
+
+	t->sockbuf = size;
+}
+
+/*
+ * sockbuf=auto: bw times the RTT, or the window without bw. Resized
+ * only once the estimate moved by a quarter.
+ */
+static void
+dr_target_autosize(struct dr_target *t, uint64_t srtt_us)
+{
+	struct dr_stream *s = t->stream;
+	uint64_t want;
+
+	want = s->sock.bw ? s->sock.bw * srtt_us / 1000000 : s->window;
+	if (want < DR_SOCKBUF_MIN)
+		want = DR_SOCKBUF_MIN;
+	if (want > DR_SOCKBUF_MAX)
+		want = DR_SOCKBUF_MAX;
+
+	if (t->sockbuf &&
+	    want > t->sockbuf - t->sockbuf / 4 &&
+	    want < t->sockbuf + t->sockbuf / 4)
+		return;
+
+	DPRINTF("DR: socket buffers %d -> %llu bytes, srtt %lluus\n",
+		t->sockbuf, (unsigned long long)want,
+		(unsigned long long)srtt_us);
+	dr_target_sockbuf(t, want);
+}
+
+/* Apply the stream's socket tuning to a target just added. */
+static void
+dr_target_tune(struct dr_target *t)
+{
+	struct dr_stream *s = t->stream;
+	int sock = dr_target_fd(t), on;
+
+	on = s->sock.nodelay;
+	if (setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)))
+		DPRINTF("DR: cannot set TCP_NODELAY: %d\n", -errno);
+
+	if (s->sock.sockbuf)
+		dr_target_sockbuf(t, s->sock.sockbuf);
+
+	/* other streams use buffers of their own, see struct dr_sockopts */
+	if (!s->sock.zerocopy || t->link || t->codec || t->dedup.slots)
+		return;
+
+	/* kTLS encrypts into buffers of its own */
+	if (s->tls) {
+		DPRINTF("DR: no zerocopy sends over TLS\n");
+		return;
+	}
+
+#ifdef DR_ZEROCOPY
+	on = 1;
+	if (!setsockopt(sock, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on))) {
+		t->zerocopy = 1;
+		return;
+	}
+	DPRINTF("DR: no zerocopy sends: %d\n", -errno);
+#else
+	DPRINTF("DR: no zerocopy sends in this build\n");
+#endif
+}
+
+/* Collect the zerocopy completions the kernel queued, never waiting. */
+static int
+dr_target_zc_reap(struct dr_target *t)
+{
+#ifdef DR_ZEROCOPY
+	struct sock_extended_err *serr;
+	char control[CMSG_SPACE(sizeof(*serr)) + 64];
+	struct cmsghdr *cm;
+	struct msghdr msg;
+	uint32_t n;
+	int reaped = 0;
+
+	for (;;) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control    = control;
+		msg.msg_controllen = sizeof(control);
+
+		if (recvmsg(t->sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+			return reaped;
+
+		for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+			if (cm->cmsg_level != SOL_IP ||
+			    cm->cmsg_type != IP_RECVERR)
+				continue;
+
+			serr = (struct sock_extended_err *)CMSG_DATA(cm);
+			if (serr->ee_errno ||
+			    serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+				continue;
+
+			n = serr->ee_data - serr->ee_info + 1;
+			if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+				t->zc_copied += n;
+			__atomic_store_n(&t->zc_done, serr->ee_data + 1,
+					 __ATOMIC_RELAXED);
+			reaped += n;
+		}
+	}
+#else
+	return 0;
+#endif
+}
+
+/*
+ * Retire the zerocopy batches the kernel let go of, and return where
+ * the first one it still holds starts: the ring may not be reused from
+ * there on.
+ */
+static uint64_t
+dr_target_zc_limit(struct dr_target *t)
+{
+	struct dr_zc_batch *b;
+	uint32_t head;
+
+	head = __atomic_load_n(&t->zc_head, __ATOMIC_ACQUIRE);
+
+	while (t->zc_tail != head) {
+		b = &t->zc[t->zc_tail % DR_ZC_BATCHES];
+		if ((int32_t)(t->zc_done - b->calls) < 0)
+			return b->start;
+
+		__atomic_store_n(&t->zc_tail, t->zc_tail + 1,
+				 __ATOMIC_RELEASE);
+	}
+
+	return UINT64_MAX;
+}
+
+/* Log a zerocopy batch sent from ring position 'start'. */
+static void
+dr_target_zc_sent(struct dr_target *t, uint64_t start)
+{
+	struct dr_zc_batch *b = &t->zc[t->zc_head % DR_ZC_BATCHES];
+
+	b->start = start;
+	b->calls = t->zc_calls;
+	__atomic_store_n(&t->zc_head, t->zc_head + 1, __ATOMIC_RELEASE);
+}
+
+static int
+dr_target_zc_room(struct dr_target *t)
+{
+	return t->zc_head - __atomic_load_n(&t->zc_tail, __ATOMIC_ACQUIRE) <
+		DR_ZC_BATCHES;
+}
+
+/*
+ * Send a batch on the target's own socket, or as DR_MUX_DATA, once the
+ * stream's valve let its wire bytes pass. 'flags' go to sendmsg() on
+ * a socket of its own. On a link with a uring, the batch is only
+ * queued, with the message in the target: dr_link_flush() sends it.
+ */
+static int
+dr_target_writev(struct dr_target *t, struct iovec *iov, int cnt, int flags)
+{
+	struct dr_valve *v = &t->stream->valve;
+	struct dr_link *l = t->link;
+	struct iovec out[DR_BATCH_IOVS + 2];
+	struct dr_mux msg;
+	unsigned long paid;
+	unsigned int calls;
+	size_t len = 0;
+	int i, err;
+
+	for (i = 0; i < cnt; i++)
+		len += iov[i].iov_len;
+
+	if (l)
+		len += sizeof(msg);
+
+	paid = dr_valve_take(v, len);
+
+	if (!l && flags) {
+		err = sendmsgexact(t->sock, iov, cnt, flags, &calls);
+		t->zc_calls += calls;
+		goto out;
+	}
+
+	if (!l) {
+		err = sendvexact(t->sock, iov, cnt);
+		goto out;
+	}
+
+	msg.magic  = DR_MUX_MAGIC;
+	msg.type   = DR_MUX_DATA;
+	msg.device = t->device;
+	msg.len    = len - sizeof(msg);
+
+	/* without a window, the ring is reused once sent */
+	if (l->uring && t->stream->window) {
+		t->mux = msg;
+		t->mux_iov[0].iov_base = &t->mux;
+		t->mux_iov[0].iov_len  = sizeof(t->mux);
+		memcpy(t->mux_iov + 1, iov, cnt * sizeof(*iov));
+
+		if (!dr_uring_queue(l->uring, t->mux_iov, cnt + 1, t)) {
+			t->mux_paid = paid;
+			return 0;
+		}
+	}
+
+	out[0].iov_base = &msg;
+	out[0].iov_len  = sizeof(msg);
+	memcpy(out + 1, iov, cnt * sizeof(*iov));
+
+	pthread_mutex_lock(&l->send_lock);
+	err = sendvexact(l->sock, out, cnt + 1);
+	pthread_mutex_unlock(&l->send_lock);
+
+out:
+	/* the caller reports errno */
+	i = errno;
+	dr_valve_done(v, paid);
+	errno = i;
+	return err;
+}
+
+/*
+ * Replace a batch of whole records by its dedup encoding: gathered into
+ * draw, then encoded record by record into dbuf. Blocks count as on
+ * the backup once it acknowledged the records storing them; without a
+ * window nothing is ever resent, so as soon as they are sent.
+ */
+static int
+dr_target_dedup(struct dr_target *t, struct iovec *iov, int cnt)
+{
+	struct dr_stream *s = t->stream;
+	struct req_info rinfo;
+	uint64_t confirmed;
+	size_t len = 0, pos, out = 0;
+	int i;
+
+	for (i = 0; i < cnt; i++) {
+		memcpy(t->draw + len, iov[i].iov_base, iov[i].iov_len);
+		len += iov[i].iov_len;
+	}
+
+	confirmed = s->window ?
+		__atomic_load_n(&t->acked, __ATOMIC_ACQUIRE) : UINT64_MAX;
+
+	for (pos = 0; pos < len; pos += dr_record_size(rinfo.size)) {
+		memcpy(&rinfo, t->draw + pos, sizeof(rinfo));
+		out += dr_dedup_encode(&t->dedup, confirmed,
+				       t->draw + pos, t->dbuf + out);
+	}
+
+	iov[0].iov_base = t->dbuf;
+	iov[0].iov_len  = out;
+	return 1;
+}
+
+/* Copy the next 'len' bytes of a batch out, from iov[*i] + *off on. */
+static void
+dr_iov_read(struct iovec *iov, int *i, size_t *off, void *dst, size_t len)
+{
+	size_t n;
+
+	while (len) {
+		n = iov[*i].iov_len - *off;
+		if (n > len)
+			n = len;
+
+		memcpy(dst, (char *)iov[*i].iov_base + *off, n);
+		dst   = (char *)dst + n;
+		len  -= n;
+		*off += n;
+
+		if (*off == iov[*i].iov_len) {
+			(*i)++;
+			*off = 0;
+		}
+	}
+}
+
+/*
+ * Replace a batch of whole records by a copy in cbuf, each run of
+ * records with adjacent extents merged into one. Barriers end a run.
+ */
+static int
+dr_target_coalesce(struct dr_target *t, struct iovec *iov, int cnt)
+{
+	struct req_info rinfo, *cur = NULL;
+	size_t out = 0, off = 0;
+	int i = 0;
+
+	while (i < cnt) {
+		dr_iov_read(iov, &i, &off, &rinfo, sizeof(rinfo));
+
+		if (cur && rinfo.size && cur->state == rinfo.state &&
+		    cur->offset + cur->size == rinfo.offset &&
+		    cur->size + rinfo.size <= DR_COALESCE_MAX) {
+			dr_iov_read(iov, &i, &off, t->cbuf + out, rinfo.size);
+			if (cur->state & DR_REC_CRC)
+				cur->crc = dr_crc32c(cur->crc, t->cbuf + out,
+						     rinfo.size);
+			cur->size   += rinfo.size;
+			cur->writeID = rinfo.writeID;
+			out += rinfo.size;
+			t->coalesced++;
+			continue;
+		}
+
+		cur = rinfo.size ? (struct req_info *)(t->cbuf + out) : NULL;
+		memcpy(t->cbuf + out, &rinfo, sizeof(rinfo));
+		out += sizeof(rinfo);
+
+		dr_iov_read(iov, &i, &off, t->cbuf + out, rinfo.size);
+		out += rinfo.size;
+	}
+
+	iov[0].iov_base = t->cbuf;
+	iov[0].iov_len  = out;
+	return 1;
+}
+
+/* what one dr_target_pump() call got done */
+#define DR_PUMP_BUSY    0	/* sent, or found more to do */
+#define DR_PUMP_IDLE    1	/* armed the doorbell, sleep on it */
+#define DR_PUMP_DONE    2	/* stopped and drained, or failed */
+#define DR_PUMP_ERROR   3	/* send failed, rewound, back off */
+
+/*
+ * Everything published between the send cursor and producer index is a
+ * run of complete records, contiguous but for the wrap at the end of
+ * the buffer. Cut it at a record boundary near DR_MAX_BATCH_BYTES, or
+ * what is left of the window, and send it with a single writev. That
+ * takes two iovecs at most, plus two for every run of absorbed records
+ * left out.
+ */
+/* A batch did not go out: rewind to 'tail', the last ack, to resend. */
+static int
+dr_target_resend(struct dr_target *t, uint64_t tail)
+{
+	__atomic_store_n(&t->probe_id, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&t->sent, tail, __ATOMIC_RELEASE);
+	/* whatever the batch stored may not have arrived */
+	if (t->dedup.slots)
+		dr_dedup_reset(&t->dedup);
+	/* resent batches would no longer start in order */
+	t->zerocopy = 0;
+	if (__atomic_load_n(&t->stream->stop, __ATOMIC_ACQUIRE))
+		return DR_PUMP_DONE;
+	return DR_PUMP_ERROR;
+}
+
+static int
+dr_target_pump(struct dr_target *t)
+{
+	struct dr_stream *s = t->stream;
+	struct req_info rinfo;
+	struct iovec iov[DR_BATCH_IOVS];
+	uint64_t head, tail, pos, last, end;
+	uint32_t avail, max, len, rlen, run, bytes;
+	int i, n, cnt, merges, cork, err;
+
+	/* the ring no longer keeps what a failed target missed */
+	if (s->window && __atomic_load_n(&t->ack_failed, __ATOMIC_ACQUIRE))
+		return DR_PUMP_DONE;
+
+	tail = __atomic_load_n(&t->done, __ATOMIC_ACQUIRE);
+	pos  = t->sent;
+	if (pos < tail)
+		pos = tail;
+
+	head = dr_ring_head(&s->ring);
+	if (head == pos) {
+		if (__atomic_load_n(&s->stop, __ATOMIC_ACQUIRE))
+			return DR_PUMP_DONE;
+		__atomic_store_n(&t->data_wanted, 1, __ATOMIC_RELEASE);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		return dr_ring_head(&s->ring) == pos ?
+			DR_PUMP_IDLE : DR_PUMP_BUSY;
+	}
+
+	avail = head - pos;
+	max   = DR_MAX_BATCH_BYTES;
+
+	if (s->window) {
+		if (pos - tail >= s->window) {
+			__atomic_store_n(&t->window_wait, 1, __ATOMIC_RELEASE);
+			__atomic_thread_fence(__ATOMIC_SEQ_CST);
+			return __atomic_load_n(&t->done, __ATOMIC_ACQUIRE) == tail ?
+				DR_PUMP_IDLE : DR_PUMP_BUSY;
+		}
+		if (max > s->window - (pos - tail))
+			max = s->window - (pos - tail);
+	}
+
+	len    = 0;
+	bytes  = 0;
+	run    = 0;
+	last   = 0;
+	n      = 0;
+	cnt    = 0;
+	merges = 0;
+	end    = UINT64_MAX;
+	do {
+		dr_ring_copy_out(&s->ring, s->data, pos + len,
+				 &rinfo, sizeof(rinfo));
+		rlen = dr_record_size(rinfo.size);
+		if (len && len + rlen > max)
+			break;
+
+		if (dr_stream_claim(s, pos + len)) {
+			run   += rlen;
+			bytes += rlen;
+			last   = rinfo.writeID;
+			n++;
+
+			if (rinfo.size && rinfo.offset == end)
+				merges++;
+			end = rinfo.size ? rinfo.offset + rinfo.size
+					 : UINT64_MAX;
+		} else if (run) {
+			cnt += dr_ring_iov(&s->ring, s->data,
+					   pos + len - run, run,
+					   iov + cnt);
+			run  = 0;
+		}
+
+		len += rlen;
+	} while (len < avail && len < max &&
+		 cnt <= DR_BATCH_IOVS - 4);
+
+	if (run)
+		cnt += dr_ring_iov(&s->ring, s->data,
+				   pos + len - run, run, iov + cnt);
+
+	if (!n)
+		goto sent;
+
+	/* the backup reads it from the ring */
+	if (t->shm)
+		goto sent_once;
+
+	/* zerocopy sends the ring itself */
+	if (t->cbuf && merges && !t->zerocopy && bytes <= DR_MAX_BATCH_BYTES)
+		cnt = dr_target_coalesce(t, iov, cnt);
+
+	if (t->dedup.slots && bytes <= DR_MAX_BATCH_BYTES)
+		cnt = dr_target_dedup(t, iov, cnt);
+
+	/* a link corks across all its devices instead */
+	cork = n > 1 && !t->link && s->sock.cork;
+	if (cork)
+		dr_sock_cork(t->sock, 1);
+
+	t->mux_records = n;
+
+	if (t->codec)
+		err = dr_target_send_frame(t, iov, cnt);
+	else {
+		for (i = 0; i < cnt; i++)
+			t->wire_bytes += iov[i].iov_len;
+#ifdef DR_ZEROCOPY
+		if (t->zerocopy && bytes >= DR_ZC_MIN && dr_target_zc_room(t)) {
+			err = dr_target_writev(t, iov, cnt, MSG_ZEROCOPY);
+			dr_target_zc_sent(t, pos);
+		} else
+#endif
+			err = dr_target_writev(t, iov, cnt, 0);
+	}
+
+	if (cork)
+		dr_sock_cork(t->sock, 0);
+
+	if (err) {
+		DPRINTF("ERROR writing %d DR records to socket: %d, "
+			"resending from last ack\n", n, -errno);
+		return dr_target_resend(t, tail);
+	}
+
+sent_once:
+	/*
+	 * Time the last record of this batch, unless a probe is
+	 * already out. Never time retransmissions, their acks may
+	 * belong to the first copy.
+	 */
+	if (s->window && !__atomic_load_n(&t->probe_id, __ATOMIC_ACQUIRE)
+	    && pos >= t->sent_high) {
+		t->probe_us = dr_stream_now();
+		__atomic_store_n(&t->probe_id, last,
+				 __ATOMIC_RELEASE);
+	}
+
+	t->tx_bytes += bytes;
+sent:
+	__atomic_store_n(&t->sent, pos + len, __ATOMIC_RELEASE);
+	if (t->sent_high < pos + len)
+		t->sent_high = pos + len;
+
+	if (t->shm) {
+		__atomic_store_n(&t->shm->head, pos + len, __ATOMIC_RELEASE);
+		dr_shm_wake(&t->shm->head_seq, &t->shm->head_wanted);
+	}
+
+	if (!s->window) {
+		__atomic_store_n(&t->done, pos + len,
+				 __ATOMIC_RELEASE);
+		dr_stream_advance(s);
+	}
+
+	return DR_PUMP_BUSY;
+}
+
+/* Connect and handshake, asking for what the stream was set up with. */
+static int
+dr_target_connect(struct dr_target *t)
+{
+	int sock, codec, dedup, err;
+
+	sock = dr_connect(t->host, t->port, t->stream->tls);
+	if (sock < 0)
+		return sock;
+
+	dedup = t->want_dedup;
+	if (dedup && !t->dedup.slots) {
+		err = dr_dedup_init(&t->dedup, dedup == DR_DEDUP_DELTA);
+		if (err) {
+			close(sock);
+			return err;
+		}
+	}
+
+	codec = dr_handshake(sock, t->image, t->want_codec, &dedup);
+	if (codec < 0) {
+		close(sock);
+		return codec;
+	}
+	dr_connected(sock);
+
+	/* the backup's table starts out empty too */
+	if (dedup) {
+		dr_dedup_reset(&t->dedup);
+		t->dedup.delta = t->dedup.data && dedup == DR_DEDUP_DELTA;
+	} else
+		dr_dedup_free(&t->dedup);
+
+	t->codec = codec;
+	t->sock  = sock;
+	return 0;
+}
+
+/*
+ * The connection is gone, or going: stop the ack thread and forget
+ * about the socket. Zerocopy batches in flight on it will never be
+ * reported, nobody reads what the kernel still holds.
+ */
+static void
+dr_target_disconnect(struct dr_target *t)
+{
+	__atomic_store_n(&t->offline, 1, __ATOMIC_RELEASE);
+	dr_stream_update_quorum(t->stream);
+
+	DPRINTF("DR lost backup %s:%d, reconnecting\n", t->host, t->port);
+
+	shutdown(t->sock, SHUT_RDWR);
+	if (t->ack_running) {
+		pthread_join(t->ack_thread, NULL);
+		t->ack_running = 0;
+	}
+	close(t->sock);
+	t->sock = -1;
+
+	t->zerocopy = 0;
+	t->zc_calls = 0;
+	__atomic_store_n(&t->zc_done, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&t->zc_tail, t->zc_head, __ATOMIC_RELEASE);
+	__atomic_store_n(&t->probe_id, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * Bring an offline target back, trying again with exponential backoff
+ * until it answers or the stream stops. Sending resumes from its last
+ * ack; if its backlog was dropped meanwhile, from the oldest record
+ * still in the ring.
+ */
+static int
+dr_target_reconnect(struct dr_target *t)
+{
+	struct dr_stream *s = t->stream;
+	struct pollfd pfd;
+	uint64_t tail;
+	int err;
+
+	for (;;) {
+		if (__atomic_load_n(&s->stop, __ATOMIC_ACQUIRE))
+			return DR_PUMP_DONE;
+
+		err = dr_target_connect(t);
+		if (!err)
+			break;
+
+		DPRINTF("DR cannot reach %s:%d: %d, next try in %ums\n",
+			t->host, t->port, err, t->backoff_ms);
+
+		/* a kick ends the wait, to notice a stop */
+		pfd.fd     = t->doorbell;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, t->backoff_ms) > 0)
+			__dr_ring_wait(t->doorbell);
+
+		t->backoff_ms *= 2;
+		if (t->backoff_ms > DR_RECONNECT_MAX_MS)
+			t->backoff_ms = DR_RECONNECT_MAX_MS;
+	}
+
+	t->backoff_ms = DR_RECONNECT_MIN_MS;
+	dr_target_tune(t);
+	if (!s->window)
+		t->zerocopy = 0;
+	if (s->sock.sockbuf_auto)
+		dr_target_autosize(t, t->srtt_us);
+
+	pthread_mutex_lock(&s->release_lock);
+
+	if (__atomic_load_n(&t->ack_failed, __ATOMIC_ACQUIRE)) {
+		tail = dr_ring_cons_index(&s->ring);
+		DPRINTF("DR %s:%d missed %llu bytes while offline, "
+			"backup is inconsistent\n", t->host, t->port,
+			(unsigned long long)(tail - t->done));
+		__atomic_store_n(&t->done, tail, __ATOMIC_RELEASE);
+		__atomic_store_n(&t->ack_failed, 0, __ATOMIC_RELEASE);
+	}
+	__atomic_store_n(&t->sent, t->done, __ATOMIC_RELEASE);
+
+	pthread_mutex_unlock(&s->release_lock);
+
+	if (s->window) {
+		err = pthread_create(&t->ack_thread, NULL, dr_target_ack, t);
+		if (err) {
+			DPRINTF("DR cannot start ack thread: %d\n", -err);
+			dr_target_disconnect(t);
+			return DR_PUMP_ERROR;
+		}
+		t->ack_running = 1;
+	}
+
+	t->connects++;
+	__atomic_store_n(&t->offline, 0, __ATOMIC_RELEASE);
+	dr_stream_update_quorum(s);
+
+	DPRINTF("DR connected to %s:%d\n", t->host, t->port);
+	return DR_PUMP_BUSY;
+}
+
+static void *
+dr_target_dispatch(void *arg)
+{
+	struct dr_target *t = arg;
+	struct dr_stream *s = t->stream;
+	int rc;
+
+	DPRINTF("DR dispatch thread started\n");
+
+	do {
+		if (t->host && t->sock < 0) {
+			rc = dr_target_reconnect(t);
+			if (rc == DR_PUMP_ERROR)
+				sleep(1);
+			continue;
+		}
+
+		rc = dr_target_pump(t);
+		if (rc == DR_PUMP_IDLE)
+			__dr_ring_wait(t->doorbell);
+		else if (rc == DR_PUMP_ERROR && !t->host)
+			sleep(1);
+
+		if (!t->host || __atomic_load_n(&s->stop, __ATOMIC_ACQUIRE))
+			continue;
+
+		/* our send failed, or the ack thread found the peer gone */
+		if (rc == DR_PUMP_ERROR || rc == DR_PUMP_DONE ||
+		    __atomic_load_n(&t->offline, __ATOMIC_ACQUIRE)) {
+			dr_target_disconnect(t);
+			rc = DR_PUMP_BUSY;
+		}
+	} while (rc != DR_PUMP_DONE);
+
+	DPRINTF("DR dispatch thread done\n");
+
+	return NULL;
+}
+
+/*
+ * Move a target's release cursor past every sent record it has
+ * acknowledged. Records are queued in writeID order, so this stops at
+ * the first unacked one.
+ */
+static uint32_t
+dr_target_release(struct dr_target *t, uint64_t acked)
+{
+	struct dr_stream *s = t->stream;
+	struct req_info rinfo;
+	uint64_t pos, sent, limit;
+	uint32_t len = 0;
+
+	pos   = t->done;
+	sent  = __atomic_load_n(&t->sent, __ATOMIC_ACQUIRE);
+	limit = dr_target_zc_limit(t);
+	if (sent > limit)
+		sent = limit;
+
+	while (pos + len < sent) {
+		dr_ring_copy_out(&s->ring, s->data, pos + len,
+				 &rinfo, sizeof(rinfo));
+		if (rinfo.writeID > acked)
+			break;
+		len += dr_record_size(rinfo.size);
+	}
+
+	if (!len)
+		return 0;
+
+	__atomic_store_n(&t->done, pos + len, __ATOMIC_RELEASE);
+	dr_stream_advance(s);
+
+	if (__atomic_exchange_n(&t->window_wait, 0, __ATOMIC_ACQ_REL))
+		dr_target_kick(t);
+
+	return len;
+}
+
+/*
+ * Update the link estimates for an ack of 'acked', 'bytes' released.
+ * Both use the 1/8 gain TCP uses for its srtt.
+ */
+static void
+dr_target_estimate(struct dr_target *t, uint64_t acked, uint32_t bytes)
+{
+	uint64_t now, id, rtt, srtt, rate, delta;
+
+	now = dr_stream_now();
+
+	id = __atomic_load_n(&t->probe_id, __ATOMIC_ACQUIRE);
+	if (id && acked >= id) {
+		int b = 0;
+
+		rtt  = now - t->probe_us;
+		while (b < DR_RTT_BUCKETS - 1 &&
+		       rtt >= (1ULL << (DR_RTT_MIN_SHIFT + b)))
+			b++;
+		__atomic_fetch_add(&t->rtt_hist[b], 1, __ATOMIC_RELAXED);
+
+		srtt = t->srtt_us;
+		srtt = srtt ? srtt - srtt / 8 + rtt / 8 : rtt;
+		__atomic_store_n(&t->srtt_us, srtt, __ATOMIC_RELAXED);
+		__atomic_store_n(&t->probe_id, 0, __ATOMIC_RELEASE);
+
+		if (t->stream->sock.sockbuf_auto)
+			dr_target_autosize(t, srtt);
+	}
+
+	if (!t->rate_us)
+		t->rate_us = now;
+
+	t->rate_bytes += bytes;
+	delta = now - t->rate_us;
+	if (delta >= 100000) {
+		rate = t->rate_bytes * 1000000 / delta;
+		if (t->ack_rate)
+			rate = t->ack_rate - t->ack_rate / 8 + rate / 8;
+		__atomic_store_n(&t->ack_rate, rate, __ATOMIC_RELAXED);
+		t->rate_us    = now;
+		t->rate_bytes = 0;
+	}
+}
+
+static void
+dr_stream_signal_ack(struct dr_stream *s)
+{
+	uint64_t val = 1;
+	int gcc = write(s->ack_fd, &val, sizeof(val));
+	if (gcc) {};
+}
+
+/*
+ * Recompute what a quorum of targets acknowledged, and whether a quorum
+ * is alive. Acks of failed or offline targets still count, they hold.
+ */
+static void
+dr_stream_update_quorum(struct dr_stream *s)
+{
+	uint64_t acked[DR_MAX_TARGETS], a;
+	int i, j, live = 0;
+
+	pthread_mutex_lock(&s->release_lock);
+
+	for (i = 0; i < s->n_targets; i++) {
+		a = __atomic_load_n(&s->targets[i].acked, __ATOMIC_ACQUIRE);
+		for (j = i; j > 0 && acked[j - 1] < a; j--)
+			acked[j] = acked[j - 1];
+		acked[j] = a;
+
+		if (!__atomic_load_n(&s->targets[i].ack_failed,
+				     __ATOMIC_ACQUIRE) &&
+		    !__atomic_load_n(&s->targets[i].offline,
+				     __ATOMIC_ACQUIRE))
+			live++;
+	}
+
+	a = acked[s->quorum - 1];
+	if (a > s->acked)
+		__atomic_store_n(&s->acked, a, __ATOMIC_RELEASE);
+
+	/* until an offline target is back */
+	__atomic_store_n(&s->ack_failed, live < s->quorum, __ATOMIC_RELEASE);
+
+	pthread_mutex_unlock(&s->release_lock);
+
+	dr_stream_signal_ack(s);
+}
+
+static void
+dr_target_acked(struct dr_target *t, uint64_t acked)
+{
+	uint32_t len;
+
+	if (acked <= t->acked)
+		return;
+
+	__atomic_store_n(&t->acked, acked, __ATOMIC_RELEASE);
+	len = dr_target_release(t, acked);
+	dr_target_estimate(t, acked, len);
+	dr_stream_update_quorum(t->stream);
+}
+
+/* Stop holding ring space for a target that stopped acking. */
+static void
+dr_target_fail(struct dr_target *t)
+{
+	__atomic_store_n(&t->ack_failed, 1, __ATOMIC_RELEASE);
+	dr_stream_advance(t->stream);
+	dr_stream_update_quorum(t->stream);
+	dr_target_kick(t);
+}
+
+/*
+ * With zerocopy batches in flight, wait for an ack or a completion.
+ * Completions release what acks already covered; return 1 once there
+ * is an ack (or an error) to read.
+ */
+static int
+dr_target_zc_poll(struct dr_target *t)
+{
+	struct pollfd pfd;
+
+	pfd.fd     = t->sock;
+	pfd.events = POLLIN;
+
+	if (poll(&pfd, 1, -1) < 0)
+		return errno == EINTR ? 0 : 1;
+
+	if ((pfd.revents & POLLERR) && dr_target_zc_reap(t)) {
+		dr_target_release(t, t->acked);
+		return !!(pfd.revents & (POLLIN | POLLHUP));
+	}
+
+	return 1;
+}
+
+static void *
+dr_target_ack(void *arg)
+{
+	struct dr_target *t = arg;
+	struct dr_ack ack;
+	int rc;
+
+	DPRINTF("DR ack thread started\n");
+
+	for (;;) {
+		if ((t->zerocopy ||
+		     t->zc_tail != __atomic_load_n(&t->zc_head,
+						   __ATOMIC_ACQUIRE)) &&
+		    !dr_target_zc_poll(t))
+			continue;
+
+		rc = recv(t->sock, &ack, sizeof(ack), MSG_WAITALL);
+		if (rc == sizeof(ack)) {
+			dr_target_acked(t, ack.writeID);
+			continue;
+		}
+
+		if (rc < 0 && errno == EINTR)
+			continue;
+
+		if (rc)
+			DPRINTF("ERROR reading DR ack: %d\n",
+				rc < 0 ? -errno : -EIO);
+		break;
+	}
+
+	/* have the dispatcher reconnect, unless we are stopping */
+	if (t->host && !__atomic_load_n(&t->stream->stop, __ATOMIC_ACQUIRE)) {
+		__atomic_store_n(&t->offline, 1, __ATOMIC_RELEASE);
+		dr_stream_update_quorum(t->stream);
+		shutdown(t->sock, SHUT_WR);
+		dr_target_kick(t);
+		DPRINTF("DR ack thread done\n");
+		return NULL;
+	}
+
+	dr_target_fail(t);
+
+	DPRINTF("DR ack thread done\n");
+
+	return NULL;
+}
+
+/* Acks of a backup on a shared ring, raised in its header. */
+static void *
+dr_target_shm_ack(void *arg)
+{
+	struct dr_target *t = arg;
+	struct dr_shm *shm = t->shm;
+	uint32_t seq;
+	uint64_t acked;
+
+	DPRINTF("DR shared ring ack thread started\n");
+
+	for (;;) {
+		seq   = __atomic_load_n(&shm->ack_seq, __ATOMIC_ACQUIRE);
+		acked = __atomic_load_n(&shm->acked, __ATOMIC_ACQUIRE);
+		dr_target_acked(t, acked);
+		__atomic_store_n(&shm->kept, t->done, __ATOMIC_RELEASE);
+
+		if (__atomic_load_n(&t->stream->stop, __ATOMIC_ACQUIRE))
+			break;
+
+		dr_shm_wait(&shm->ack_seq, &shm->ack_wanted, seq, 1000);
+	}
+
+	DPRINTF("DR shared ring ack thread done\n");
+
+	return NULL;
+}
+
+static int
+dr_link_send(struct dr_link *l, uint32_t type, uint32_t device,
+	     const void *buf, uint32_t len)
+{
+	struct dr_mux msg;
+	struct iovec iov[2];
+	int err;
+
+	msg.magic  = DR_MUX_MAGIC;
+	msg.type   = type;
+	msg.device = device;
+	msg.len    = len;
+
+	iov[0].iov_base = &msg;
+	iov[0].iov_len  = sizeof(msg);
+	iov[1].iov_base = (void *)buf;
+	iov[1].iov_len  = len;
+
+	pthread_mutex_lock(&l->send_lock);
+	err = sendvexact(l->sock, iov, len ? 2 : 1);
+	if (err)
+		err = -errno;
+	pthread_mutex_unlock(&l->send_lock);
+
+	return err;
+}
+
+/*
+ * The result of a batch queued on the uring, from dr_uring_flush(). A
+ * failed one is resent from the last ack, as dr_target_pump() would
+ * have, had the send failed right away.
+ */
+static void
+dr_link_sent(void *data, int err, void *arg)
+{
+	struct dr_target *t = data;
+	struct dr_link *l = arg;
+
+	dr_valve_done(&t->stream->valve, t->mux_paid);
+	if (!err)
+		return;
+
+	DPRINTF("ERROR writing %d DR records for device %u to %s: %d, "
+		"resending from last ack\n",
+		t->mux_records, t->device, l->target, err);
+
+	if (dr_target_resend(t, __atomic_load_n(&t->done, __ATOMIC_ACQUIRE))
+	    == DR_PUMP_DONE) {
+		pthread_mutex_lock(&l->lock);
+		t->drained = 1;
+		pthread_cond_broadcast(&l->cond);
+		pthread_mutex_unlock(&l->lock);
+	}
+}
+
+/* Send the batches a round queued on the uring; 1 if any failed. */
+static int
+dr_link_flush(struct dr_link *l)
+{
+	int failed;
+
+	pthread_mutex_lock(&l->send_lock);
+	failed = dr_uring_flush(l->uring, l->sock, dr_link_sent, l);
+	pthread_mutex_unlock(&l->send_lock);
+
+	return !!failed;
+}
+
+static void *
+dr_link_dispatch(void *arg)
+{
+	struct dr_link *l = arg;
+	struct dr_target *dev[DR_LINK_DEVICES];
+	int i, n, rc, idle, error, cork;
+
+	DPRINTF("DR link thread for %s started\n", l->target);
+
+	for (;;) {
+		if (__atomic_load_n(&l->failed, __ATOMIC_ACQUIRE) &&
+		    !__atomic_load_n(&l->stop, __ATOMIC_ACQUIRE)) {
+			dr_link_reconnect(l);
+			continue;
+		}
+
+		pthread_mutex_lock(&l->lock);
+		for (i = n = 0; i < DR_LINK_DEVICES; i++)
+			if (l->dev[i] && !l->dev[i]->drained)
+				dev[n++] = l->dev[i];
+		pthread_mutex_unlock(&l->lock);
+
+		if (!n && __atomic_load_n(&l->stop, __ATOMIC_ACQUIRE))
+			break;
+
+		idle  = 1;
+		error = 0;
+
+		/* a uring round goes out as one chain, with MSG_MORE */
+		cork = n > 1 && !l->uring;
+		if (cork)
+			dr_sock_cork(l->sock, 1);
+
+		for (i = 0; i < n; i++) {
+			rc = dr_target_pump(dev[i]);
+			switch (rc) {
+			case DR_PUMP_BUSY:
+				idle = 0;
+				break;
+			case DR_PUMP_ERROR:
+				error = 1;
+				break;
+			case DR_PUMP_DONE:
+				pthread_mutex_lock(&l->lock);
+				dev[i]->drained = 1;
+				pthread_cond_broadcast(&l->cond);
+				pthread_mutex_unlock(&l->lock);
+				idle = 0;
+				break;
+			}
+		}
+
+		if (l->uring && dr_link_flush(l))
+			error = 1;
+
+		if (cork)
+			dr_sock_cork(l->sock, 0);
+
+		if (error)
+			sleep(1);
+		else if (idle)
+			__dr_ring_wait(l->doorbell);
+	}
+
+	DPRINTF("DR link thread for %s done\n", l->target);
+
+	return NULL;
+}
+
+/* acks a link reads at once, whatever devices they are for */
+#define DR_LINK_ACKS            64
+
+static void
+dr_link_acked(struct dr_link *l, const struct dr_ack *ack)
+{
+	struct dr_target *t;
+	int i;
+
+	for (i = 0; i < DR_LINK_DEVICES; i++) {
+		t = l->dev[i];
+		if (t && t->device == (uint32_t)ack->deviceID) {
+			if (t->stream->window)
+				dr_target_acked(t, ack->writeID);
+			break;
+		}
+	}
+}
+
+/*
+ * Acks of every device come in on one socket; read as many as are
+ * there, up to DR_LINK_ACKS, with one recv() and one round under the
+ * lock, and keep a partial one for the next.
+ */
+static void *
+dr_link_ack(void *arg)
+{
+	struct dr_link *l = arg;
+	struct dr_target *t;
+	struct dr_ack ack[DR_LINK_ACKS];
+	size_t have = 0, n;
+	int i, rc;
+
+	for (;;) {
+		rc = recv(l->sock, (char *)ack + have, sizeof(ack) - have, 0);
+		if (rc > 0) {
+			have += rc;
+			n = have / sizeof(*ack);
+
+			pthread_mutex_lock(&l->lock);
+			for (i = 0; i < n; i++)
+				dr_link_acked(l, &ack[i]);
+			pthread_mutex_unlock(&l->lock);
+
+			have -= n * sizeof(*ack);
+			if (have)
+				memmove(ack, ack + n, have);
+			continue;
+		}
+
+		if (rc < 0 && errno == EINTR)
+			continue;
+
+		if (rc)
+			DPRINTF("ERROR reading DR ack from %s: %d\n",
+				l->target, rc < 0 ? -errno : -EIO);
+		break;
+	}
+
+	/* offline, as a lost target would be, until the link is back */
+	pthread_mutex_lock(&l->lock);
+	__atomic_store_n(&l->failed, 1, __ATOMIC_RELEASE);
+	for (i = 0; i < DR_LINK_DEVICES; i++) {
+		t = l->dev[i];
+		if (t) {
+			__atomic_store_n(&t->offline, 1, __ATOMIC_RELEASE);
+			dr_stream_update_quorum(t->stream);
+		}
+	}
+	pthread_mutex_unlock(&l->lock);
+
+	if (!__atomic_load_n(&l->stop, __ATOMIC_ACQUIRE))
+		DPRINTF("DR lost link to %s, reconnecting\n", l->target);
+	__dr_ring_signal(l->doorbell);
+
+	return NULL;
+}
+
+/* Let go of the devices of streams stopping while the link is down. */
+static void
+dr_link_drain_stopped(struct dr_link *l)
+{
+	struct dr_target *t;
+	int i;
+
+	pthread_mutex_lock(&l->lock);
+	for (i = 0; i < DR_LINK_DEVICES; i++) {
+		t = l->dev[i];
+		if (t && !t->drained &&
+		    __atomic_load_n(&t->stream->stop, __ATOMIC_ACQUIRE)) {
+			t->drained = 1;
+			pthread_cond_broadcast(&l->cond);
+		}
+	}
+	pthread_mutex_unlock(&l->lock);
+}
+
+/*
+ * Bring a failed link back, trying again with exponential backoff until
+ * the backup answers or the link is put. The backup has to agree on
+ * the codec and dedup the devices were set up with. Each device is then
+ * announced again and resends from its last ack; if its backlog was
+ * dropped meanwhile, from the oldest record still in the ring.
+ */
+static void
+dr_link_reconnect(struct dr_link *l)
+{
+	struct dr_target *dev[DR_LINK_DEVICES], *t;
+	struct dr_stream *s;
+	struct pollfd pfd;
+	uint64_t tail;
+	int i, n, sock, codec, dedup, err;
+
+	if (l->ack_running) {
+		pthread_join(l->ack_thread, NULL);
+		l->ack_running = 0;
+	}
+
+again:
+	pthread_mutex_lock(&l->send_lock);
+	if (l->sock >= 0)
+		close(l->sock);
+	l->sock = -1;
+	pthread_mutex_unlock(&l->send_lock);
+
+	for (;;) {
+		dr_link_drain_stopped(l);
+		if (__atomic_load_n(&l->stop, __ATOMIC_ACQUIRE))
+			return;
+
+		sock = dr_connect(l->host, l->port, l->tls);
+		if (sock >= 0) {
+			dedup = l->dedup;
+			codec = dr_mux_handshake(sock, l->codec, &dedup);
+			if (codec >= 0 &&
+			    (codec != l->codec || dedup != l->dedup))
+				codec = -EPROTO;
+			if (codec >= 0)
+				break;
+			close(sock);
+			sock = codec;
+		}
+
+		DPRINTF("DR cannot reach %s: %d, next try in %ums\n",
+			l->target, sock, l->backoff_ms);
+
+		/* a kick ends the wait, to notice a stop */
+		pfd.fd     = l->doorbell;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, l->backoff_ms) > 0)
+			__dr_ring_wait(l->doorbell);
+
+		l->backoff_ms *= 2;
+		if (l->backoff_ms > DR_RECONNECT_MAX_MS)
+			l->backoff_ms = DR_RECONNECT_MAX_MS;
+	}
+
+	l->backoff_ms = DR_RECONNECT_MIN_MS;
+	dr_connected(sock);
+
+	pthread_mutex_lock(&l->send_lock);
+	l->sock = sock;
+	pthread_mutex_unlock(&l->send_lock);
+
+	pthread_mutex_lock(&l->lock);
+	for (i = n = 0; i < DR_LINK_DEVICES; i++)
+		if (l->dev[i])
+			dev[n++] = l->dev[i];
+	pthread_mutex_unlock(&l->lock);
+
+	for (i = 0; i < n; i++) {
+		t   = dev[i];
+		err = dr_link_send(l, DR_MUX_OPEN, t->device,
+				   t->image, strlen(t->image));
+		if (err) {
+			DPRINTF("ERROR reopening DR device %u on %s: %d\n",
+				t->device, l->target, err);
+			goto again;
+		}
+	}
+
+	__atomic_store_n(&l->failed, 0, __ATOMIC_RELEASE);
+	err = pthread_create(&l->ack_thread, NULL, dr_link_ack, l);
+	if (err) {
+		DPRINTF("DR cannot start link ack thread: %d\n", -err);
+		__atomic_store_n(&l->failed, 1, __ATOMIC_RELEASE);
+		sleep(1);
+		return;
+	}
+	l->ack_running = 1;
+	tapdisk_server_place_thread(l->ack_thread);
+
+	for (i = 0; i < n; i++) {
+		t = dev[i];
+		s = t->stream;
+
+		pthread_mutex_lock(&s->release_lock);
+		if (__atomic_load_n(&t->ack_failed, __ATOMIC_ACQUIRE)) {
+			tail = dr_ring_cons_index(&s->ring);
+			DPRINTF("DR %s device %u missed %llu bytes while "
+				"offline, backup is inconsistent\n",
+				l->target, t->device,
+				(unsigned long long)(tail - t->done));
+			__atomic_store_n(&t->done, tail, __ATOMIC_RELEASE);
+			__atomic_store_n(&t->ack_failed, 0, __ATOMIC_RELEASE);
+		}
+		dr_target_resend(t, t->done);
+		pthread_mutex_unlock(&s->release_lock);
+
+		pthread_mutex_lock(&l->lock);
+		if (t->running && !__atomic_load_n(&s->stop, __ATOMIC_ACQUIRE))
+			t->drained = 0;
+		pthread_mutex_unlock(&l->lock);
+
+		__atomic_store_n(&t->offline, 0, __ATOMIC_RELEASE);
+		dr_stream_update_quorum(s);
+	}
+
+	DPRINTF("DR link to %s back\n", l->target);
+}
+
+static void
+dr_link_put(struct dr_link *l)
+{
+	struct dr_link **pl;
+
+	pthread_mutex_lock(&dr_links_lock);
+
+	if (--l->refs) {
+		pthread_mutex_unlock(&dr_links_lock);
+		return;
+	}
+
+	for (pl = &dr_links; *pl; pl = &(*pl)->next)
+		if (*pl == l) {
+			*pl = l->next;
+			break;
+		}
+
+	pthread_mutex_unlock(&dr_links_lock);
+
+	if (l->running) {
+		__atomic_store_n(&l->stop, 1, __ATOMIC_RELEASE);
+		__dr_ring_signal(l->doorbell);
+		pthread_join(l->thread, NULL);
+	}
+
+	if (l->ack_running) {
+		shutdown(l->sock, SHUT_RD);
+		pthread_join(l->ack_thread, NULL);
+	}
+
+	if (l->sock >= 0)
+		close(l->sock);
+	if (l->doorbell >= 0)
+		close(l->doorbell);
+	dr_uring_destroy(l->uring);
+	free(l->tls);
+
+	pthread_mutex_destroy(&l->lock);
+	pthread_mutex_destroy(&l->send_lock);
+	pthread_cond_destroy(&l->cond);
+	free(l);
+}
+
+/*
+ * Find the live link to 'target', or open one, sending through a uring
+ * if 'uring' asks for one and the kernel has it. The lock is not held
+ * while connecting: two streams racing may open a link each.
+ */
+static int
+dr_link_get(const char *target, const char *host, int port, int codec,
+	    int dedup, const char *tls, int uring, struct dr_link **_l)
+{
+	struct dr_link *l;
+	int err;
+
+	pthread_mutex_lock(&dr_links_lock);
+	for (l = dr_links; l; l = l->next)
+		if (!strcmp(l->target, target) && !l->tls == !tls &&
+		    !__atomic_load_n(&l->failed, __ATOMIC_ACQUIRE)) {
+			l->refs++;
+			pthread_mutex_unlock(&dr_links_lock);
+			*_l = l;
+			return 0;
+		}
+	pthread_mutex_unlock(&dr_links_lock);
+
+	l = calloc(1, sizeof(*l));
+	if (!l)
+		return -ENOMEM;
+
+	snprintf(l->target, sizeof(l->target), "%s", target);
+	snprintf(l->host, sizeof(l->host), "%s", host);
+	l->port = port;
+	l->refs = 1;
+	l->sock = -1;
+	l->doorbell   = -1;
+	l->backoff_ms = DR_RECONNECT_MIN_MS;
+	pthread_mutex_init(&l->lock, NULL);
+	pthread_mutex_init(&l->send_lock, NULL);
+	pthread_cond_init(&l->cond, NULL);
+
+	if (tls) {
+		l->tls = strdup(tls);
+		if (!l->tls) {
+			err = -ENOMEM;
+			goto fail;
+		}
+	}
+
+	l->sock = dr_connect(host, port, tls);
+	if (l->sock < 0) {
+		err = l->sock;
+		goto fail;
+	}
+
+	l->dedup = dedup;
+	l->codec = dr_mux_handshake(l->sock, codec, &l->dedup);
+	if (l->codec < 0) {
+		err = l->codec;
+		goto fail;
+	}
+	dr_connected(l->sock);
+
+	l->doorbell = tapdisk_sys_eventfd(0);
+	if (l->doorbell < 0) {
+		err = -errno;
+		goto fail;
+	}
+
+	if (uring) {
+		err = dr_uring_create(DR_LINK_DEVICES, &l->uring);
+		if (err) {
+			DPRINTF("DR link to %s: no uring sends: %d\n",
+				target, err);
+			l->uring = NULL;
+		}
+	}
+
+	err = pthread_create(&l->thread, NULL, dr_link_dispatch, l);
+	if (err) {
+		err = -err;
+		goto fail;
+	}
+	l->running = 1;
+	tapdisk_server_place_consumer(l->thread);
+
+	err = pthread_create(&l->ack_thread, NULL, dr_link_ack, l);
+	if (err) {
+		err = -err;
+		goto fail;
+	}
+	l->ack_running = 1;
+	tapdisk_server_place_thread(l->ack_thread);
+
+	DPRINTF("DR link to %s open\n", target);
+
+	pthread_mutex_lock(&dr_links_lock);
+	l->next  = dr_links;
+	dr_links = l;
+	pthread_mutex_unlock(&dr_links_lock);
+
+	*_l = l;
+	return 0;
+
+fail:
+	dr_link_put(l);
+	return err;
+}
+
+/* Announce a new device for 'image' on the link. */
+static int
+dr_link_attach(struct dr_link *l, struct dr_target *t, const char *image)
+{
+	int i, err;
+
+	pthread_mutex_lock(&l->lock);
+	for (i = 0; i < DR_LINK_DEVICES && l->dev[i]; i++)
+		;
+	if (i == DR_LINK_DEVICES) {
+		pthread_mutex_unlock(&l->lock);
+		return -ENOSPC;
+	}
+
+	/* kept to announce the device again, see dr_link_reconnect() */
+	t->image = strdup(image);
+	if (!t->image) {
+		pthread_mutex_unlock(&l->lock);
+		return -ENOMEM;
+	}
+
+	t->link    = l;
+	t->device  = l->next_device++;
+	t->drained = 1;
+	l->dev[i]  = t;
+	pthread_mutex_unlock(&l->lock);
+
+	err = dr_link_send(l, DR_MUX_OPEN, t->device, image, strlen(image));
+	if (err) {
+		pthread_mutex_lock(&l->lock);
+		l->dev[i] = NULL;
+		pthread_mutex_unlock(&l->lock);
+		t->link = NULL;
+		free(t->image);
+		t->image = NULL;
+	}
+
+	return err;
+}
+
+/* Close a (stopped) device on its link, and drop the link with it. */
+static void
+dr_link_detach(struct dr_target *t)
+{
+	struct dr_link *l = t->link;
+	int i, err;
+
+	err = dr_link_send(l, DR_MUX_CLOSE, t->device, NULL, 0);
+	if (err)
+		DPRINTF("ERROR closing DR device %u on %s: %d\n",
+			t->device, l->target, err);
+
+	pthread_mutex_lock(&l->lock);
+	for (i = 0; i < DR_LINK_DEVICES; i++)
+		if (l->dev[i] == t)
+			l->dev[i] = NULL;
+	pthread_mutex_unlock(&l->lock);
+
+	t->link     = NULL;
+	t->doorbell = -1;
+	dr_link_put(l);
+}
+
+static int
+__dr_stream_add_target(struct dr_stream *s, int sock, int codec, int dedup,
+		       struct dr_link *l, const char *image)
+{
+	struct dr_target *t;
+	int err;
+
+	if (s->n_targets == DR_MAX_TARGETS)
+		return -ENOSPC;
+
+	t = &s->targets[s->n_targets];
+	memset(t, 0, sizeof(*t));
+	t->stream = s;
+	t->sock   = sock;
+	t->codec  = codec;
+
+	t->doorbell = l ? l->doorbell : tapdisk_sys_eventfd(0);
+	if (t->doorbell < 0)
+		return -errno;
+
+#ifdef HAVE_LZ4
+	if (codec == DR_CODEC_LZ4) {
+		t->zbuf_size = LZ4_compressBound(DR_MAX_BATCH_BYTES);
+		t->zraw      = malloc(DR_MAX_BATCH_BYTES);
+		t->zbuf      = malloc(t->zbuf_size);
+		if (!t->zraw || !t->zbuf) {
+			err = -ENOMEM;
+			goto fail;
+		}
+	}
+#endif
+
+	if (s->coalesce) {
+		t->cbuf = malloc(DR_MAX_BATCH_BYTES);
+		if (!t->cbuf) {
+			err = -ENOMEM;
+			goto fail;
+		}
+	}
+
+	if (dedup) {
+		err = dr_dedup_init(&t->dedup, dedup == DR_DEDUP_DELTA);
+		if (err)
+			goto fail;
+
+		t->draw = malloc(DR_MAX_BATCH_BYTES);
+		t->dbuf = malloc(DR_MAX_BATCH_BYTES +
+				 dr_dedup_overhead(DR_MAX_BATCH_BYTES));
+		if (!t->draw || !t->dbuf) {
+			err = -ENOMEM;
+			goto fail;
+		}
+	}
+
+	if (l) {
+		err = dr_link_attach(l, t, image);
+		if (err)
+			goto fail;
+	}
+
+	if (l || sock >= 0)
+		dr_target_tune(t);
+
+	s->n_targets++;
+	return 0;
+
+fail:
+	free(t->zraw);
+	free(t->zbuf);
+	free(t->cbuf);
+	dr_dedup_free(&t->dedup);
+	free(t->draw);
+	free(t->dbuf);
+	if (!l)
+		close(t->doorbell);
+	return err;
+}
+
+/*
+ * Add a backup to replicate to, with the codec its handshake agreed on.
+ * The stream takes over the socket, and sends the close marker on it
+ * in dr_stream_free().
+ */
+int
+dr_stream_add_target(struct dr_stream *s, int sock, int codec, int dedup)
+{
+	return __dr_stream_add_target(s, sock, codec, dedup, NULL, NULL);
+}
+
+/*
+ * Move the ring into /dr_<name> for a backup on this host, and add
+ * that as a target. Before dr_stream_start().
+ */
+static int
+dr_stream_add_shm(struct dr_stream *s, const char *name, const char *image)
+{
+	struct dr_target *t;
+	struct dr_shm *shm;
+	char *data;
+	int err;
+
+	if (s->shm)
+		return -EEXIST;
+
+	err = dr_shm_create(name, image, s->ring.size, &shm);
+	if (err) {
+		DPRINTF("cannot create DR ring %s: %d\n", name, err);
+		return err;
+	}
+
+	err = __dr_stream_add_target(s, -1, DR_CODEC_NONE, 0, NULL, NULL);
+	if (!err) {
+		s->shm_name = strdup(name);
+		if (!s->shm_name) {
+			s->n_targets--;
+			dr_target_close(&s->targets[s->n_targets]);
+			err = -ENOMEM;
+		}
+	}
+	if (err) {
+		dr_shm_detach(shm);
+		dr_shm_unlink(name);
+		return err;
+	}
+
+	data = (char *)shm + DR_SHM_HDR;
+	memcpy(data, s->data, s->ring.size);
+	if (s->pinned) {
+		munlock(s->data, s->ring.size);
+		s->pinned = !mlock(data, s->ring.size);
+	}
+	dr_stream_unmap(s);
+	s->data = data;
+	s->shm  = shm;
+
+	t = &s->targets[s->n_targets - 1];
+	t->shm = shm;
+	shm->head = shm->kept = shm->tail = t->done;
+
+	DPRINTF("replicating to shared ring %s\n", name);
+	return 0;
+}
+
+/*
+ * Connect to a "host:port" backup and add it as a target. With 'mux',
+ * the stream becomes a device on the tapdisk server's link to it.
+ */
+int
+dr_stream_connect(struct dr_stream *s, const char *target,
+		  const char *image, int codec, int dedup, int mux)
+{
+	struct dr_target *t;
+	struct dr_link *l = NULL;
+	char host[256];
+	const char *sep;
+	int err;
+
+	if (!strncmp(target, "shm:", 4))
+		return dr_stream_add_shm(s, target + 4, image);
+
+	sep = strrchr(target, ':');
+	if (!sep || sep == target || sep - target >= sizeof(host))
+		return -EINVAL;
+
+	memcpy(host, target, sep - target);
+	host[sep - target] = '\0';
+
+	if (mux) {
+		err = dr_link_get(target, host, atoi(sep + 1), codec, dedup,
+				  s->tls, s->sock.uring, &l);
+		if (err)
+			return err;
+
+		/* the link agreed on as much as it could for everyone */
+		err = __dr_stream_add_target(s, -1, l->codec,
+					     dedup < l->dedup ? dedup : l->dedup,
+					     l, image);
+		if (err) {
+			dr_link_put(l);
+			return err;
+		}
+
+		DPRINTF("replicating to %s as device %u\n", target,
+			s->targets[s->n_targets - 1].device);
+		return 0;
+	}
+
+	/* the dispatch thread connects, see dr_target_reconnect() */
+	err = __dr_stream_add_target(s, -1, codec, dedup, NULL, NULL);
+	if (err)
+		return err;
+
+	t = &s->targets[s->n_targets - 1];
+	t->host       = strdup(host);
+	t->image      = strdup(image);
+	t->port       = atoi(sep + 1);
+	t->want_codec = codec;
+	t->want_dedup = dedup;
+	t->codec      = DR_CODEC_NONE;
+	t->offline    = 1;
+	t->backoff_ms = DR_RECONNECT_MIN_MS;
+	if (!t->host || !t->image) {
+		s->n_targets--;
+		dr_target_close(t);
+		return -ENOMEM;
+	}
+
+	DPRINTF("replicating to %s\n", target);
+	return 0;
+}
+
+/*
+ * Start replicating to every target added. A quorum out of range means
+ * all of them.
+ */
+int
+dr_stream_start(struct dr_stream *s, size_t window, int quorum)
+{
+	struct dr_target *t;
+	int i, err;
+
+	if (!s->n_targets)
+		return -ENOTCONN;
+
+	/* the backup has nothing but acks to tell the ring is read */
+	if (s->shm && !window) {
+		DPRINTF("DR shared ring needs a window\n");
+		return -EINVAL;
+	}
+
+	s->stop   = 0;
+	s->window = window;
+	s->quorum = quorum > 0 && quorum <= s->n_targets ?
+		quorum : s->n_targets;
+
+	for (i = 0; i < s->n_targets; i++) {
+		t = &s->targets[i];
+
+		/* nothing would wait for the kernel to release the ring */
+		if (!window)
+			t->zerocopy = 0;
+
+		if (s->sock.sockbuf_auto && (t->link || t->sock >= 0))
+			dr_target_autosize(t, t->srtt_us);
+
+		if (t->link) {
+			pthread_mutex_lock(&t->link->lock);
+			t->drained = 0;
+			pthread_mutex_unlock(&t->link->lock);
+			t->running = 1;
+			dr_target_kick(t);
+			continue;
+		}
+
+		err = pthread_create(&t->thread, NULL, dr_target_dispatch, t);
+		if (err)
+			goto fail;
+		t->running = 1;
+		tapdisk_server_place_consumer(t->thread);
+
+		/* or once the dispatcher connected */
+		if (window && (t->sock >= 0 || t->shm)) {
+			err = pthread_create(&t->ack_thread, NULL,
+					     t->shm ? dr_target_shm_ack :
+					     dr_target_ack, t);
+			if (err)
+				goto fail;
+			t->ack_running = 1;
+			tapdisk_server_place_thread(t->ack_thread);
+		}
+	}
+
+	return 0;
+
+fail:
+	dr_stream_stop(s);
+	return -err;
+}
+
+/*
+ * Let the dispatch threads drain what is queued, then reap them. The
+ * ack threads are unblocked by shutting down our receive side; the
+ * sockets stay writable for the close marker. Links keep running, we
+ * only wait for them to be done with our devices.
+ */
+void
+dr_stream_stop(struct dr_stream *s)
+{
+	struct dr_target *t;
+	int i;
+
+	__atomic_store_n(&s->stop, 1, __ATOMIC_RELEASE);
+
+	for (i = 0; i < s->n_targets; i++) {
+		t = &s->targets[i];
+		if (t->running && t->link) {
+			dr_target_kick(t);
+			pthread_mutex_lock(&t->link->lock);
+			while (!t->drained)
+				pthread_cond_wait(&t->link->cond,
+						  &t->link->lock);
+			pthread_mutex_unlock(&t->link->lock);
+			t->running = 0;
+		} else if (t->running) {
+			dr_target_kick(t);
+			pthread_join(t->thread, NULL);
+			t->running = 0;
+		}
+	}
+
+	for (i = 0; i < s->n_targets; i++) {
+		t = &s->targets[i];
+		if (t->ack_running) {
+			if (t->shm) {
+				__atomic_store_n(&t->shm->ack_wanted, 1,
+						 __ATOMIC_RELEASE);
+				dr_shm_wake(&t->shm->ack_seq,
+					    &t->shm->ack_wanted);
+			} else
+				shutdown(t->sock, SHUT_RD);
+			pthread_join(t->ack_thread, NULL);
+			t->ack_running = 0;
+		}
+	}
+}
+
+/*
+ * buf is [ send, receive ] as the kernel has them, zerocopy is
+ * [ sends, completed, copied after all ]
+ */
+static void
+dr_target_sock_stats(struct dr_target *t, td_stats_t *st)
+{
+	struct dr_stream *s = t->stream;
+	int sock = dr_target_fd(t), snd = 0, rcv = 0;
+	socklen_t len;
+
+	len = sizeof(snd);
+	getsockopt(sock, SOL_SOCKET, SO_SNDBUF, &snd, &len);
+	len = sizeof(rcv);
+	getsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcv, &len);
+
+	tapdisk_stats_field(st, "sock", "{");
+	tapdisk_stats_field(st, "buf", "[");
+	tapdisk_stats_val(st, "d", snd);
+	tapdisk_stats_val(st, "d", rcv);
+	tapdisk_stats_leave(st, ']');
+	tapdisk_stats_field(st, "auto", "d", s->sock.sockbuf_auto);
+	tapdisk_stats_field(st, "nodelay", "d", s->sock.nodelay);
+	tapdisk_stats_field(st, "cork", "d", s->sock.cork);
+	if (t->zerocopy || t->zc_calls) {
+		tapdisk_stats_field(st, "zerocopy", "[");
+		tapdisk_stats_val(st, "u", t->zc_calls);
+		tapdisk_stats_val(st, "u",
+				  __atomic_load_n(&t->zc_done,
+						  __ATOMIC_RELAXED));
+		tapdisk_stats_val(st, "llu", t->zc_copied);
+		tapdisk_stats_leave(st, ']');
+	}
+	tapdisk_stats_leave(st, '}');
+}
+
+static void
+dr_target_stats(struct dr_target *t, td_stats_t *st)
+{
+	int i;
+
+	tapdisk_stats_enter(st, '{');
+
+	/*
+	 * tx is [ record bytes, wire bytes ]
+	 */
+	tapdisk_stats_field(st, "tx", "[");
+	tapdisk_stats_val(st, "llu", t->tx_bytes);
+	tapdisk_stats_val(st, "llu", t->wire_bytes);
+	tapdisk_stats_leave(st, ']');
+
+	if (t->cbuf)
+		tapdisk_stats_field(st, "coalesced", "llu", t->coalesced);
+	tapdisk_stats_field(st, "unsent", "llu",
+			    (unsigned long long)(dr_ring_head(&t->stream->ring) -
+			    __atomic_load_n(&t->sent, __ATOMIC_ACQUIRE)));
+	tapdisk_stats_field(st, "acked", "llu",
+			    __atomic_load_n(&t->acked, __ATOMIC_ACQUIRE));
+	tapdisk_stats_field(st, "srtt_us", "llu", t->srtt_us);
+	tapdisk_stats_field(st, "rate", "llu", t->ack_rate);
+	tapdisk_stats_field(st, "lag_us", "llu", dr_target_lag_us(t));
+	tapdisk_stats_field(st, "failed", "d", t->ack_failed);
+	if (t->shm) {
+		/*
+		 * shm is [ readable up to, copied out up to ]
+		 */
+		tapdisk_stats_field(st, "shm", "[");
+		tapdisk_stats_val(st, "llu",
+				  __atomic_load_n(&t->shm->head,
+						  __ATOMIC_RELAXED));
+		tapdisk_stats_val(st, "llu",
+				  __atomic_load_n(&t->shm->tail,
+						  __ATOMIC_RELAXED));
+		tapdisk_stats_leave(st, ']');
+	}
+	if (t->host) {
+		tapdisk_stats_field(st, "offline", "d", t->offline);
+		tapdisk_stats_field(st, "connects", "llu", t->connects);
+	}
+	if (t->link) {
+		tapdisk_stats_field(st, "device", "u", t->device);
+		if (t->link->uring)
+			dr_uring_stats(t->link->uring, st);
+	} else if (t->running) {
+		char cpus[128];
+
+		tapdisk_server_thread_cpus(t->thread, cpus, sizeof(cpus));
+		tapdisk_stats_field(st, "cpus", "s", cpus);
+	}
+	dr_target_sock_stats(t, st);
+	if (t->dedup.slots) {
+		/*
+		 * dedup is [ blocks referenced, blocks sent ]
+		 */
+		tapdisk_stats_field(st, "dedup", "[");
+		tapdisk_stats_val(st, "llu", t->dedup.hits);
+		tapdisk_stats_val(st, "llu", t->dedup.misses);
+		tapdisk_stats_leave(st, ']');
+	}
+	if (t->dedup.delta) {
+		/*
+		 * delta is [ blocks sent as deltas, their bytes ]
+		 */
+		tapdisk_stats_field(st, "delta", "[");
+		tapdisk_stats_val(st, "llu", t->dedup.deltas);
+		tapdisk_stats_val(st, "llu", t->dedup.delta_bytes);
+		tapdisk_stats_leave(st, ']');
+	}
+	tapdisk_stats_field(st, "rtt_hist", "[");
+	for (i = 0; i < DR_RTT_BUCKETS; i++)
+		tapdisk_stats_val(st, "llu",
+				  __atomic_load_n(&t->rtt_hist[i],
+						  __ATOMIC_RELAXED));
+	tapdisk_stats_leave(st, ']');
+
+	tapdisk_stats_leave(st, '}');
+}
+
+/*
+ * Emit the stream's counters into the enclosing stats object. The send
+ * rate is averaged since the previous call, and summed over targets.
+ */
+void
+dr_stream_stats(struct dr_stream *s, td_stats_t *st)
+{
+	uint64_t now, tx = 0, wire = 0, rate = 0, stall;
+	int i;
+
+	now = dr_stream_now();
+	for (i = 0; i < s->n_targets; i++) {
+		tx   += s->targets[i].tx_bytes;
+		wire += s->targets[i].wire_bytes;
+	}
+	if (s->stats_us && now > s->stats_us)
+		rate = (tx - s->stats_tx) * 1000000 / (now - s->stats_us);
+	s->stats_us = now;
+	s->stats_tx = tx;
+
+	stall = s->stall_us;
+	if (s->stall_start)
+		stall += now - s->stall_start;
+
+	tapdisk_stats_field(st, "ring", "{");
+	tapdisk_stats_field(st, "size", "u", s->ring.size);
+	tapdisk_stats_field(st, "used", "u", dr_ring_count(&s->ring));
+	tapdisk_stats_field(st, "pinned", "d", s->pinned);
+	tapdisk_stats_field(st, "pages", "s",
+			    s->shm ? "shm" :
+			    s->huge == DR_RING_HUGETLB ? "hugetlb" :
+			    s->huge == DR_RING_THP ? "thp" : "small");
+	tapdisk_stats_field(st, "busy", "llu", s->full_busy);
+	tapdisk_stats_field(st, "stall_us", "llu", stall);
+	tapdisk_stats_leave(st, '}');
+
+	/*
+	 * tx is [ record bytes, wire bytes, bytes/s ]
+	 */
+	tapdisk_stats_field(st, "tx", "[");
+	tapdisk_stats_val(st, "llu", tx);
+	tapdisk_stats_val(st, "llu", wire);
+	tapdisk_stats_val(st, "llu", rate);
+	tapdisk_stats_leave(st, ']');
+
+	tapdisk_stats_field(st, "ack", "{");
+	tapdisk_stats_field(st, "window", "zu", s->window);
+	tapdisk_stats_field(st, "quorum", "d", s->quorum);
+	tapdisk_stats_field(st, "acked", "llu", dr_stream_acked(s));
+	tapdisk_stats_field(st, "lag_us", "llu", dr_stream_lag_us(s));
+	tapdisk_stats_field(st, "failed", "d", s->ack_failed);
+	tapdisk_stats_leave(st, '}');
+
+	tapdisk_stats_field(st, "targets", "[");
+	for (i = 0; i < s->n_targets; i++)
+		dr_target_stats(&s->targets[i], st);
+	tapdisk_stats_leave(st, ']');
+
+	/*
+	 * absorbed is [ records, bytes ]
+	 */
+	tapdisk_stats_field(st, "absorbed", "[");
+	tapdisk_stats_val(st, "llu", s->absorbed);
+	tapdisk_stats_val(st, "llu", s->absorbed_bytes);
+	tapdisk_stats_leave(st, ']');
+
+	if (s->crc)
+		tapdisk_stats_field(st, "crc_bytes", "llu",
+				    __atomic_load_n(&s->crc_bytes,
+						    __ATOMIC_RELAXED));
+
+	if (s->epoch_max || s->epoch_us) {
+		tapdisk_stats_field(st, "epoch", "{");
+		tapdisk_stats_field(st, "current", "llu", s->epoch);
+		tapdisk_stats_field(st, "writes", "u", s->epoch_writes);
+		tapdisk_stats_field(st, "barriers", "llu", s->barriers);
+		if (s->group)
+			tapdisk_stats_field(st, "group", "llu",
+					    __atomic_load_n(&s->group->epoch,
+							    __ATOMIC_RELAXED));
+		tapdisk_stats_leave(st, '}');
+	}
+
+	if (s->spill_fd >= 0) {
+		tapdisk_stats_field(st, "spill", "{");
+		tapdisk_stats_field(st, "active", "d", s->spilling);
+		tapdisk_stats_field(st, "bytes", "llu", s->spill_wr - s->spill_rd);
+		tapdisk_stats_field(st, "records", "llu", s->spilled);
+		tapdisk_stats_field(st, "lost", "llu", s->spill_lost);
+		tapdisk_stats_leave(st, '}');
+	}
+
+	if (s->valve.name) {
+		tapdisk_stats_field(st, "valve", "{");
+		tapdisk_stats_field(st, "name", "s", s->valve.name);
+		tapdisk_stats_field(st, "connected", "d", s->valve.sock >= 0);
+		tapdisk_stats_field(st, "bytes", "llu", s->valve.bytes);
+		tapdisk_stats_field(st, "waits", "llu", s->valve.waits);
+		tapdisk_stats_field(st, "wait_us", "llu", s->valve.wait_us);
+		tapdisk_stats_leave(st, '}');
+	}
+
+	if (s->seed) {
+		tapdisk_stats_field(st, "seed", "{");
+		tapdisk_stats_field(st, "block", "[");
+		tapdisk_stats_val(st, "u", s->seed->block);
+		tapdisk_stats_val(st, "u", s->seed->blocks);
+		tapdisk_stats_leave(st, ']');
+		tapdisk_stats_field(st, "bytes", "llu", s->seed->bytes);
+		tapdisk_stats_field(st, "skipped", "llu", s->seed->skipped);
+		tapdisk_stats_leave(st, '}');
+	}
+
+	if (s->dirty.bitmap) {
+		tapdisk_stats_field(st, "resync", "{");
+		tapdisk_stats_field(st, "active", "d", s->resyncing);
+		tapdisk_stats_field(st, "count", "llu", s->resyncs);
+		tapdisk_stats_field(st, "bytes", "llu", s->resync_bytes);
+		tapdisk_stats_leave(st, '}');
+	}
+}
@@ -0,0 +1,448 @@
+#ifndef _DR_STREAM_H_
+#define _DR_STREAM_H_
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "adaptdr.h"
+#include "dr-dedup.h"
+#include "dr-ring.h"
+#include "scheduler.h"
+#include "tapdisk.h"
+#include "tapdisk-stats.h"
+#include "writelog.h"
+
+/* ring lengths are mapped in multiples of this, if on huge pages */
+#define DR_HUGEPAGE_SIZE        (2UL << 20)
+
+/* what backs the ring */
+#define DR_RING_SMALL           0
+#define DR_RING_THP             1   /* madvise(MADV_HUGEPAGE) */
+#define DR_RING_HUGETLB         2   /* mmap(MAP_HUGETLB) */
+
+/* max bytes the dispatch thread coalesces into one send */
+#define DR_MAX_BATCH_BYTES      (4 << 20)
+
+/* largest record the dispatch thread merges from adjacent ones */
+#define DR_COALESCE_MAX         (1 << 20)
+
+/* max iovecs per send, absorbed records split the batch */
+#define DR_BATCH_IOVS           64
+
+/* batches smaller than this go out uncompressed */
+#define DR_COMPRESS_MIN         (16 << 10)
+
+/* overflow journal refill read size */
+#define DR_SPILL_CHUNK          (1 << 20)
+
+/* RTT histogram: bucket i counts RTTs below 128us << i, the last the rest */
+#define DR_RTT_BUCKETS          16
+#define DR_RTT_MIN_SHIFT        7
+
+/* largest extent one resync read copies, and reads in flight */
+#define DR_RESYNC_CHUNK         (1 << 20)
+#define DR_RESYNC_DEPTH         8
+
+/* unsent records indexed for write absorption */
+#define DR_ABSORB_SLOTS         4096
+
+/* devices sharing one multiplexed link */
+#define DR_LINK_DEVICES         256
+
+/* how long an unreachable td-rated bridge is left alone */
+#define DR_VALVE_RETRY_US       (2 * 1000000ULL)
+
+/* bounds of sockbuf=auto */
+#define DR_SOCKBUF_MIN          (256 << 10)
+#define DR_SOCKBUF_MAX          (256 << 20)
+
+/* zerocopy: smallest batch worth it, batches awaiting the kernel */
+#define DR_ZC_MIN               (64 << 10)
+#define DR_ZC_BATCHES           64
+
+/*
+ * Replication stream of one DR device: a byte ring of variable length
+ * records, each a struct req_info immediately followed by 'size' bytes
+ * of data, exactly as they go on the wire. The tapdisk loop produces
+ * records, a dispatch thread sends them to the backup.
+ *
+ * With a non-zero window, records stay in the ring until the backup
+ * acknowledges them with a cumulative struct dr_ack, read by a second
+ * thread. At most 'window' unacknowledged bytes are in flight; after a
+ * send failure the dispatcher rewinds to the oldest unacknowledged
+ * record, the backup drops what it has already applied by writeID.
+ *
+ * Records are whole sectors, so every header is 8 byte aligned and its
+ * state word never wraps.
+ *
+ * With epochs enabled, the loop closes an epoch every 'epoch_max'
+ * writes or 'epoch_us' after its first write, or when a driver calls
+ * dr_stream_barrier(), by queueing a barrier record: no data, writeID
+ * the last write of the epoch, offset the epoch number. The backup is
+ * crash consistent at every barrier it has applied, and free to reorder
+ * writes between two barriers. Correspondingly, the loop absorbs a
+ * queued record when a write to the same extent follows it within its
+ * epoch, by flipping the state
+ * from DR_REC_QUEUED to DR_REC_ABSORBED; the dispatcher claims records
+ * with the opposite exchange to DR_REC_SENT and skips absorbed ones.
+ * The space is still released in order.
+ *
+ * In a consistency group (struct dr_group, adaptdr.h), the epoch
+ * number is the group's: closing an epoch moves the group on, and a
+ * stream the group has moved past closes its own epoch before it
+ * reserves space for another write, so the reservation fails until
+ * that barrier fits.
+ *
+ * With a codec agreed in the handshake, the dispatch thread frames and
+ * compresses each batch itself, keeping the cost off the tapdisk loop.
+ * Likewise with dedup: it encodes each batch of up to DR_MAX_BATCH_BYTES
+ * against its target's table before (possibly) compressing it.
+ *
+ * With coalescing, a batch holding records whose extents follow one
+ * another is first copied out with each such run merged into a single
+ * record of up to DR_COALESCE_MAX bytes, under the writeID of its last
+ * write and with its checksum extended over the lot; acks, which are
+ * cumulative, cover the merged writes alike. Zerocopy batches and
+ * shared-memory backups read the ring as it is.
+ *
+ * With an overflow journal, a full ring no longer bounces writes: the
+ * loop appends records to the journal instead, and keeps doing so,
+ * preserving order, until it has fed the whole journal back into the
+ * ring in DR_SPILL_CHUNK reads as space frees up. Records it cannot
+ * replay, with resync enabled, are resynced instead.
+ *
+ * With resync enabled, a backlog that outgrows the ring and journal
+ * stops being replayed write by write. Writes only mark their sectors
+ * in a dirty bitmap instead, and once the ring and journal have
+ * drained, the loop copies the current contents of the dirty extents
+ * from the local image, in DR_RESYNC_CHUNK reads, until a pass finds
+ * the bitmap clean, up to DR_RESYNC_DEPTH of them at once over
+ * disjoint extents. The backup is not crash consistent until then.
+ *
+ * A failback bitmap (writelog_save()) resyncs the extents it marks
+ * first; it names where the original primary, now a backup, differs.
+ * Writes keep being tracked through it: when the stream is freed, it
+ * gets back everything not yet acknowledged, in the ring, the journal
+ * and the bitmap, or is removed once there is nothing left.
+ *
+ * A seed copies a vhd chain to a fresh (zeroed) backup, alongside live
+ * writes: block by block, from the BATs and sector bitmaps, only the
+ * sectors some image in the chain allocated, in DR_RESYNC_CHUNK reads.
+ * Live writes win: every sector written since the seed began is
+ * marked, and a seed read only sends what is still unmarked once it is
+ * enqueued, so whatever the live stream carries for it comes later.
+ * The backup is not consistent until the seed completes either.
+ *
+ * The ack thread also keeps link estimates for the drivers: a smoothed
+ * RTT, timed on one batch at a time, and the rate at which the backup
+ * acknowledges bytes. A driver wanting to hear about acks polls
+ * dr_stream_ack_fd().
+ *
+ * A stream can replicate to up to DR_MAX_TARGETS backups. Each target
+ * has its own dispatch and ack threads and its own cursors into the
+ * one ring, so a slow site only holds back ring space, never the
+ * others' sends. Space is released once every live target has acked
+ * it; a target whose ack thread failed no longer counts. The stream's
+ * 'acked' is the writeID a quorum of targets acknowledged.
+ *
+ * A target can instead be a device on a struct dr_link, one connection
+ * per backup shared by every stream of the tapdisk server that asks
+ * for it. The link's thread sends for all its streams, a batch of each
+ * in turn, and its ack thread routes acks by device; the protocol is
+ * described next to struct dr_mux. A lost link takes its devices
+ * offline, as below, and its thread connects again with the same
+ * backoff, announcing each device anew.
+ *
+ * A "shm:<name>" target is a backup on this host reading the ring
+ * itself, see struct dr_shm. The ring moves into the shared segment
+ * when the target is added, so there can be one per stream. Its
+ * dispatch thread claims records and publishes how far the backup may
+ * read, with nothing to send; its ack thread sleeps on the segment's
+ * futex instead of a socket.
+ *
+ * Targets given as "host:port" without a link are connected by their
+ * dispatch thread, so a slow or dead backup never holds up the event
+ * loop. Until then, and after losing the connection, the target is
+ * offline: it does not count towards the quorum, but the ring keeps
+ * its records, spilling and resyncing as usual, and the dispatcher
+ * tries again with exponential backoff, resending from the last ack
+ * once back. Only when the ring cannot take a write any other way are
+ * the offline targets given up on; they come back inconsistent, and
+ * say so. Targets added with a socket of their own are not reconnected.
+ *
+ * With zerocopy sends, the kernel may still hold the pages of a batch
+ * when the backup acks it. Each zerocopy batch is logged with its ring
+ * position, and the ring is only released up to the first batch still
+ * held. The ack thread polls the socket's error queue along with the
+ * acks and releases the rest as the completions come in. The ring is
+ * then locked in memory once, so the kernel does not fault pages in on
+ * every send.
+ */
+struct dr_stream;
+struct dr_link;
+struct dr_seed;
+
+struct dr_resync_read {
+	struct dr_stream       *stream;
+	uint64_t                sector;
+	uint64_t                count;
+	char                   *buf;
+	int                     busy;
+	struct tiocb            tiocb;
+};
+
+struct dr_target {
+	struct dr_stream       *stream;
+	int                     sock;
+	int                     codec;
+
+	pthread_t               thread;
+	int                     running;
+
+	/* wakes this target's dispatcher */
+	int                     doorbell;
+	int                     data_wanted;
+
+	/* ring index up to which records were sent, and acknowledged */
+	uint64_t                sent;
+	uint64_t                sent_high;
+	uint64_t                done;
+
+	int                     window_wait;
+	uint64_t                acked;     /* highest acknowledged writeID */
+	pthread_t               ack_thread;
+	int                     ack_running;
+	int                     ack_failed;
+
+	/* where we connect to, if we do: what we ask for, how it goes */
+	char                   *host;
+	int                     port;
+	char                   *image;
+	int                     want_codec;
+	int                     want_dedup;
+	int                     offline;
+	uint32_t                backoff_ms;
+	uint64_t                connects;
+
+	/* RTT probe: one batch timed at a time */
+	uint64_t                probe_id;
+	uint64_t                probe_us;
+	uint64_t                srtt_us;
+
+	/* acked bytes per second, smoothed */
+	uint64_t                ack_rate;
+	uint64_t                rate_us;
+	uint64_t                rate_bytes;
+
+	uint64_t                rtt_hist[DR_RTT_BUCKETS];
+
+	/* socket tuning: buffers as set, zerocopy sends in flight */
+	int                     sockbuf;
+	int                     zerocopy;
+	uint32_t                zc_calls;	/* sends, as the kernel counts */
+	uint32_t                zc_done;	/* completed up to */
+	uint64_t                zc_copied;
+	struct dr_zc_batch {
+		uint64_t        start;
+		uint32_t        calls;	/* zc_calls after it */
+	}                       zc[DR_ZC_BATCHES];
+	uint32_t                zc_head;
+	uint32_t                zc_tail;
+
+	/* a backup on this host, reading the ring in place */
+	struct dr_shm          *shm;
+
+	/* multiplexed: the link, our device on it, not being pumped */
+	struct dr_link         *link;
+	uint32_t                device;
+	int                     drained;
+
+	/* a batch queued on the link's uring, until the round is flushed */
+	struct dr_mux           mux;
+	struct iovec            mux_iov[DR_BATCH_IOVS + 2];
+	unsigned long           mux_paid;
+	int                     mux_records;
+	struct dr_frame         frame;
+
+	uint64_t                tx_bytes;	/* record bytes sent */
+	uint64_t                wire_bytes;	/* after compression */
+
+	char                   *zraw;
+	char                   *zbuf;
+	int                     zbuf_size;
+
+	/* adjacent records merged, the batch they go out as */
+	char                   *cbuf;
+	uint64_t                coalesced;
+
+	/* content dedup, if agreed: the table, the batch in and out */
+	struct dr_dedup         dedup;
+	char                   *draw;
+	char                   *dbuf;
+};
+
+/*
+ * Client side of a td-rated bridge, like the valve driver, shared by
+ * the dispatchers of a stream: every send first waits for tokens worth
+ * its wire bytes, and is reported done once it is out. A bridge with
+ * credit to spare grants at once, so a backlog drains at line rate
+ * while the bucket lasts. While the bridge is unreachable, sends are
+ * not limited.
+ */
+struct dr_valve {
+	char                   *name;
+	int                     sock;
+	pthread_mutex_t         lock;
+
+	unsigned long           cred;	/* granted, not yet spent */
+	unsigned long           need;	/* requested, not yet granted */
+	unsigned long           gntd;	/* spent, not yet reported done */
+	uint64_t                retry_us;
+
+	uint64_t                bytes;	/* sent on tokens */
+	uint64_t                waits;
+	uint64_t                wait_us;
+};
+
+struct dr_absorb_slot {
+	uint64_t                offset;
+	uint64_t                pos;
+	uint64_t                writeID;
+	uint64_t                epoch;
+	int                     size;
+};
+
+struct dr_stream {
+	struct dr_ring          ring;
+	char                   *data;
+	size_t                  mapped;     /* length of the data mapping */
+	int                     huge;       /* DR_RING_* */
+	int                     pinned;     /* data is mlock()ed */
+	struct dr_shm          *shm;        /* data is its ring, if set */
+	char                   *shm_name;
+
+	struct dr_target        targets[DR_MAX_TARGETS];
+	int                     n_targets;
+	int                     stop;
+
+	size_t                  window;
+	int                     quorum;
+	uint64_t                acked;     /* writeID a quorum acknowledged */
+	int                     ack_failed;	/* quorum lost */
+	int                     ack_fd;
+	pthread_mutex_t         release_lock;
+
+	/* time writes spent bounced on a full ring */
+	uint64_t                stall_us;
+	uint64_t                stall_start;
+
+	/* last tapdisk stats sample, for the send rate */
+	uint64_t                stats_us;
+	uint64_t                stats_tx;
+
+	event_id_t              space_event;
+
+	/* writes bounced with -EBUSY because the ring was full */
+	uint64_t                full_busy;
+
+	/* overflow journal */
+	int                     spill_fd;
+	int                     spilling;
+	uint64_t                spill_rd;
+	uint64_t                spill_wr;
+	uint64_t                spill_max;
+	uint64_t                spilled;	/* records through the journal */
+	uint64_t                spill_lost;	/* journal I/O failures */
+
+	/* dirty bitmap resync */
+	int                     resyncing;
+	int                     resync_busy;	/* reads in flight */
+	uint32_t                resync_held;	/* ring bytes they reserved */
+	struct writelog         dirty;
+	uint64_t                resync_pos;
+	struct dr_resync_read   resync[DR_RESYNC_DEPTH];
+	char                   *failback;
+	td_driver_t            *driver;
+	int                     fd;
+	uint64_t               *write_id;
+	uint64_t                resyncs;
+	uint64_t                resync_bytes;
+
+	/* epoch barriers */
+	uint64_t                epoch;		/* current, from 1 */
+	uint64_t                epoch_id;	/* its last writeID */
+	unsigned int            epoch_writes;	/* writes in it */
+	unsigned int            epoch_max;
+	uint64_t                epoch_us;
+	uint64_t                epoch_start;	/* its first write */
+	event_id_t              epoch_event;
+	uint64_t                barriers;
+	struct dr_group        *group;		/* shared counter, or NULL */
+
+	struct dr_valve         valve;
+	struct dr_sockopts      sock;
+
+	struct dr_seed         *seed;
+
+	int                     absorb;
+	int                     coalesce;
+	char                   *tls;        /* CA of the backups, or NULL */
+	struct dr_absorb_slot  *absorb_slots;
+	uint64_t                absorbed;
+	uint64_t                absorbed_bytes;
+
+	int                     crc;        /* sum records, DR_REC_CRC */
+	uint64_t                crc_bytes;
+};
+
+#define dr_record_size(_size)   (sizeof(struct req_info) + (_size))
+
+/*
+ * what to complete a write dr_stream_reserve refused with: -EBUSY is
+ * retried by the vbd, a record no ring could hold never would be
+ */
+#define dr_stream_reserve_error(_err) \
+	((_err) == -EBUSY ? -EBUSY : -EIO)
+
+/* bytes queued but not yet acknowledged (or sent, without a window) */
+#define dr_stream_pending(_s)   dr_ring_count(&(_s)->ring)
+
+#define dr_stream_acked(_s) \
+	__atomic_load_n(&(_s)->acked, __ATOMIC_ACQUIRE)
+
+#define dr_stream_ack_fd(_s)    ((_s)->ack_fd)
+
+int dr_stream_init(struct dr_stream *, size_t size);
+void dr_stream_free(struct dr_stream *);
+int dr_stream_add_target(struct dr_stream *, int sock, int codec,
+			 int dedup);
+int dr_stream_connect(struct dr_stream *, const char *target,
+		      const char *image, int codec, int dedup, int mux);
+int dr_stream_start(struct dr_stream *, size_t window, int quorum);
+void dr_stream_stop(struct dr_stream *);
+
+int dr_stream_spill(struct dr_stream *, const char *path, uint64_t max);
+int dr_stream_resync(struct dr_stream *, td_driver_t *, int fd,
+		     uint64_t *write_id);
+int dr_stream_seed(struct dr_stream *, td_driver_t *, const char *path,
+		   uint64_t *write_id);
+int dr_stream_failback(struct dr_stream *, const char *path);
+int dr_stream_epochs(struct dr_stream *, unsigned int writes,
+		     unsigned int ms);
+int dr_stream_group(struct dr_stream *, const char *name);
+int dr_stream_valve(struct dr_stream *, const char *name);
+int dr_stream_tls(struct dr_stream *, const char *ca);
+void dr_stream_sockopts(struct dr_stream *, const struct dr_sockopts *);
+void dr_stream_barrier(struct dr_stream *);
+int dr_stream_reserve(struct dr_stream *, int size);
+uint64_t dr_stream_now(void);
+void dr_stream_ack_drain(struct dr_stream *);
+uint64_t dr_stream_lag_us(struct dr_stream *);
+uint64_t dr_stream_drain_rate(struct dr_stream *);
+
+void dr_stream_stats(struct dr_stream *, td_stats_t *);
+
+void dr_stream_queue_write(struct dr_stream *, uint64_t write_id,
+			   uint64_t offset, const void *buf, int size);
+
+#endif /* _DR_STREAM_H_ */
@@ -0,0 +1,147 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_OPENSSL
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#endif
+
+#include "tapdisk.h"
+#include "dr-tls.h"
+
+#ifdef HAVE_OPENSSL
+
+static void
+dr_tls_error(const char *what)
+{
+	char buf[256];
+
+	ERR_error_string_n(ERR_get_error(), buf, sizeof(buf));
+	DPRINTF("DR TLS: %s: %s\n", what, buf);
+	ERR_clear_error();
+}
+
+static SSL_CTX *
+dr_tls_ctx(const SSL_METHOD *method)
+{
+	SSL_CTX *ctx;
+
+	ctx = SSL_CTX_new(method);
+	if (!ctx) {
+		dr_tls_error("no context");
+		return NULL;
+	}
+
+	SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+	SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS | SSL_OP_NO_TICKET);
+	return ctx;
+}
+
+/* Run the handshake, then leave the socket to the kernel. */
+static int
+dr_tls_handshake(SSL_CTX *ctx, int sock, const char *host)
+{
+	SSL *ssl;
+	int err = 0;
+
+	ssl = SSL_new(ctx);
+	if (!ssl || !SSL_set_fd(ssl, sock)) {
+		dr_tls_error("no session");
+		SSL_free(ssl);
+		return -ENOMEM;
+	}
+
+	if (host) {
+		SSL_set_tlsext_host_name(ssl, host);
+		SSL_set1_host(ssl, host);
+		err = SSL_connect(ssl) == 1 ? 0 : -ECONNREFUSED;
+	} else
+		err = SSL_accept(ssl) == 1 ? 0 : -ECONNREFUSED;
+
+	if (err)
+		dr_tls_error("handshake failed");
+	else if (!BIO_get_ktls_send(SSL_get_wbio(ssl)) ||
+		 !BIO_get_ktls_recv(SSL_get_rbio(ssl))) {
+		DPRINTF("DR TLS: the kernel did not take %s over (%s), "
+			"is the tls module loaded?\n", SSL_get_cipher(ssl),
+			SSL_get_version(ssl));
+		err = -EOPNOTSUPP;
+	} else
+		DPRINTF("DR TLS: %s, %s in the kernel\n",
+			SSL_get_version(ssl), SSL_get_cipher(ssl));
+
+	/* no close_notify: the session lives on in the kernel */
+	SSL_free(ssl);
+	return err;
+}
+
+int
+dr_tls_client(int sock, const char *ca, const char *host)
+{
+	struct stat st;
+	SSL_CTX *ctx;
+	int dir, err;
+
+	ctx = dr_tls_ctx(TLS_client_method());
+	if (!ctx)
+		return -ENOMEM;
+
+	dir = !stat(ca, &st) && S_ISDIR(st.st_mode);
+	if (!SSL_CTX_load_verify_locations(ctx, dir ? NULL : ca,
+					   dir ? ca : NULL)) {
+		dr_tls_error(ca);
+		SSL_CTX_free(ctx);
+		return -EINVAL;
+	}
+	SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+
+	err = dr_tls_handshake(ctx, sock, host);
+	SSL_CTX_free(ctx);
+	return err;
+}
+
+int
+dr_tls_server(int sock, const char *cert, const char *key)
+{
+	SSL_CTX *ctx;
+	int err;
+
+	ctx = dr_tls_ctx(TLS_server_method());
+	if (!ctx)
+		return -ENOMEM;
+
+	SSL_CTX_set_num_tickets(ctx, 0);
+
+	if (SSL_CTX_use_certificate_chain_file(ctx, cert) != 1 ||
+	    SSL_CTX_use_PrivateKey_file(ctx, key, SSL_FILETYPE_PEM) != 1) {
+		dr_tls_error(cert);
+		SSL_CTX_free(ctx);
+		return -EINVAL;
+	}
+
+	err = dr_tls_handshake(ctx, sock, NULL);
+	SSL_CTX_free(ctx);
+	return err;
+}
+
+#else
+
+int
+dr_tls_client(int sock, const char *ca, const char *host)
+{
+	DPRINTF("DR TLS: built without OpenSSL\n");
+	return -EOPNOTSUPP;
+}
+
+int
+dr_tls_server(int sock, const char *cert, const char *key)
+{
+	DPRINTF("DR TLS: built without OpenSSL\n");
+	return -EOPNOTSUPP;
+}
+
+#endif
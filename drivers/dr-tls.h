@@ -0,0 +1,23 @@
+#ifndef _DR_TLS_H_
+#define _DR_TLS_H_
+
+/*
+ * TLS for DR connections, with the record layer in the kernel (kTLS).
+ * The handshake runs in userspace with OpenSSL, on the connected
+ * socket, before the DR handshake; then the session's keys go to the
+ * kernel for both directions and OpenSSL is done with it. What is left
+ * is a socket like any other, so batched sends and everything reading
+ * it stay as they are. A connection that cannot hand both directions
+ * to the kernel fails instead of falling back to userspace crypto.
+ *
+ * The backup sends no session tickets: with the kernel reading the
+ * socket, any record but application data would fail the stream.
+ */
+
+/* Verify the backup 'host' against the CA file or directory 'ca'. */
+int dr_tls_client(int sock, const char *ca, const char *host);
+
+/* Present 'cert', and its key, to the primary connecting. */
+int dr_tls_server(int sock, const char *cert, const char *key);
+
+#endif /* _DR_TLS_H_ */
@@ -0,0 +1,385 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#endif
+
+#include "adaptdr.h"
+#include "dr-uring.h"
+
+#if defined(HAVE_LINUX_IO_URING_H) && defined(__NR_io_uring_setup) && \
+	defined(IORING_FEAT_FAST_POLL)
+
+struct dr_uring_send {
+	struct msghdr           msg;
+	size_t                  len;
+	void                   *data;
+	int                     res;
+};
+
+struct dr_uring {
+	int                     fd;
+	unsigned int            entries;
+
+	void                   *sq_ring;
+	size_t                  sq_ring_size;
+	unsigned               *sq_tail;
+	unsigned               *sq_mask;
+	unsigned               *sq_array;
+	struct io_uring_sqe    *sqes;
+	size_t                  sqes_size;
+
+	void                   *cq_ring;
+	size_t                  cq_ring_size;
+	unsigned               *cq_head;
+	unsigned               *cq_tail;
+	unsigned               *cq_mask;
+	struct io_uring_cqe    *cqes;
+
+	struct dr_uring_send   *sends;
+	unsigned int            queued;
+
+	int                     dead;
+
+	uint64_t                flushes;
+	uint64_t                sent;
+	uint64_t                fallbacks;
+};
+
+static inline int
+__io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static inline int
+__io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+		 unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		       flags, NULL, 0);
+}
+
+void
+dr_uring_destroy(struct dr_uring *u)
+{
+	if (!u)
+		return;
+
+	if (u->sqes)
+		munmap(u->sqes, u->sqes_size);
+	if (u->cq_ring && u->cq_ring != u->sq_ring)
+		munmap(u->cq_ring, u->cq_ring_size);
+	if (u->sq_ring)
+		munmap(u->sq_ring, u->sq_ring_size);
+	if (u->fd >= 0)
+		close(u->fd);
+
+	free(u->sends);
+	free(u);
+}
+
+static int
+dr_uring_map(struct dr_uring *u, struct io_uring_params *p)
+{
+	char *sq, *cq;
+
+	u->sq_ring_size = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+	u->cq_ring_size = p->cq_off.cqes +
+		p->cq_entries * sizeof(struct io_uring_cqe);
+
+	if (p->features & IORING_FEAT_SINGLE_MMAP) {
+		if (u->cq_ring_size > u->sq_ring_size)
+			u->sq_ring_size = u->cq_ring_size;
+		u->cq_ring_size = u->sq_ring_size;
+	}
+
+	sq = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE,
+		  MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED)
+		return -errno;
+	u->sq_ring = sq;
+
+	cq = sq;
+	if (!(p->features & IORING_FEAT_SINGLE_MMAP)) {
+		cq = mmap(NULL, u->cq_ring_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, u->fd,
+			  IORING_OFF_CQ_RING);
+		if (cq == MAP_FAILED)
+			return -errno;
+	}
+	u->cq_ring = cq;
+
+	u->sqes_size = p->sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED) {
+		u->sqes = NULL;
+		return -errno;
+	}
+
+	u->sq_tail  = (unsigned *)(sq + p->sq_off.tail);
+	u->sq_mask  = (unsigned *)(sq + p->sq_off.ring_mask);
+	u->sq_array = (unsigned *)(sq + p->sq_off.array);
+
+	u->cq_head  = (unsigned *)(cq + p->cq_off.head);
+	u->cq_tail  = (unsigned *)(cq + p->cq_off.tail);
+	u->cq_mask  = (unsigned *)(cq + p->cq_off.ring_mask);
+	u->cqes     = (struct io_uring_cqe *)(cq + p->cq_off.cqes);
+
+	return 0;
+}
+
+int
+dr_uring_create(unsigned int entries, struct dr_uring **_u)
+{
+	struct io_uring_params p;
+	struct dr_uring *u;
+	int err;
+
+	u = calloc(1, sizeof(*u));
+	if (!u)
+		return -ENOMEM;
+
+	u->entries = entries;
+	u->sends   = calloc(entries, sizeof(*u->sends));
+	if (!u->sends) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	memset(&p, 0, sizeof(p));
+	u->fd = __io_uring_setup(entries, &p);
+	if (u->fd < 0) {
+		err = -errno;
+		goto fail;
+	}
+
+	/* before 5.7, a blocked send went to a worker thread */
+	if (!(p.features & IORING_FEAT_FAST_POLL)) {
+		err = -ENOSYS;
+		goto fail;
+	}
+
+	err = dr_uring_map(u, &p);
+	if (err)
+		goto fail;
+
+	*_u = u;
+	return 0;
+
+fail:
+	dr_uring_destroy(u);
+	return err;
+}
+
+int
+dr_uring_queue(struct dr_uring *u, struct iovec *iov, int cnt, void *data)
+{
+	struct dr_uring_send *s;
+	int i;
+
+	if (u->dead)
+		return -EIO;
+
+	if (u->queued == u->entries)
+		return -EBUSY;
+
+	if (cnt > IOV_MAX)
+		return -E2BIG;
+
+	s = &u->sends[u->queued++];
+	memset(s, 0, sizeof(*s));
+	s->msg.msg_iov    = iov;
+	s->msg.msg_iovlen = cnt;
+	s->data           = data;
+
+	for (i = 0; i < cnt; i++)
+		s->len += iov[i].iov_len;
+
+	return 0;
+}
+
+/* Submit the queued sends as one chain, and wait for all of them. */
+static int
+dr_uring_submit(struct dr_uring *u, int sock)
+{
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	unsigned tail, head, idx, i, n, done;
+	int rc;
+
+	n    = u->queued;
+	tail = *u->sq_tail;
+
+	for (i = 0; i < n; i++) {
+		idx = tail & *u->sq_mask;
+		sqe = &u->sqes[idx];
+
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->opcode    = IORING_OP_SENDMSG;
+		sqe->fd        = sock;
+		sqe->addr      = (uintptr_t)&u->sends[i].msg;
+		sqe->len       = 1;
+		sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+		sqe->user_data = i;
+		if (i < n - 1) {
+			sqe->flags      = IOSQE_IO_LINK;
+			sqe->msg_flags |= MSG_MORE;
+		}
+
+		u->sq_array[idx] = idx;
+		tail++;
+		u->sends[i].res = -ECANCELED;
+	}
+
+	__atomic_store_n(u->sq_tail, tail, __ATOMIC_RELEASE);
+
+	done = 0;
+	while (n || done < u->queued) {
+		rc = __io_uring_enter(u->fd, n, u->queued - done,
+				      IORING_ENTER_GETEVENTS);
+		if (rc < 0) {
+			if (errno == EINTR || errno == EAGAIN ||
+			    errno == EBUSY)
+				continue;
+			return -errno;
+		}
+		n -= rc < n ? rc : n;
+
+		head = *u->cq_head;
+		while (head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+			cqe = &u->cqes[head & *u->cq_mask];
+			if (cqe->user_data < u->queued)
+				u->sends[cqe->user_data].res = cqe->res;
+			head++;
+			done++;
+		}
+		__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	return 0;
+}
+
+/* Step past the first 'n' bytes of a send. */
+static void
+dr_uring_skip(struct msghdr *msg, size_t n)
+{
+	while (msg->msg_iovlen && n >= msg->msg_iov->iov_len) {
+		n -= msg->msg_iov->iov_len;
+		msg->msg_iov++;
+		msg->msg_iovlen--;
+	}
+
+	if (n) {
+		msg->msg_iov->iov_base = (char *)msg->msg_iov->iov_base + n;
+		msg->msg_iov->iov_len -= n;
+	}
+}
+
+int
+dr_uring_flush(struct dr_uring *u, int sock,
+	       void (*done)(void *data, int err, void *arg), void *arg)
+{
+	struct dr_uring_send *s;
+	int i, err, broken, failed;
+
+	if (!u->queued)
+		return 0;
+
+	/* whatever it left in the ring would go out with the next flush */
+	err = dr_uring_submit(u, sock);
+	if (err)
+		u->dead = 1;
+
+	u->flushes++;
+	broken = 0;
+	failed = 0;
+
+	for (i = 0; i < u->queued; i++) {
+		s = &u->sends[i];
+
+		if (!err && !broken && s->res == (ssize_t)s->len) {
+			u->sent++;
+			done(s->data, 0, arg);
+			continue;
+		}
+
+		broken = 1;
+
+		/* cut short, or never started after one that was */
+		if (!err && (s->res >= 0 || s->res == -ECANCELED)) {
+			if (s->res > 0)
+				dr_uring_skip(&s->msg, s->res);
+			if (sendvexact(sock, s->msg.msg_iov, s->msg.msg_iovlen))
+				err = -errno;
+			else {
+				u->fallbacks++;
+				done(s->data, 0, arg);
+				continue;
+			}
+		} else if (!err)
+			err = s->res;
+
+		failed++;
+		done(s->data, err, arg);
+	}
+
+	u->queued = 0;
+	return failed;
+}
+
+void
+dr_uring_stats(struct dr_uring *u, td_stats_t *st)
+{
+	tapdisk_stats_field(st, "uring", "[");
+	tapdisk_stats_val(st, "llu", u->flushes);
+	tapdisk_stats_val(st, "llu", u->sent);
+	tapdisk_stats_val(st, "llu", u->fallbacks);
+	tapdisk_stats_leave(st, ']');
+}
+
+#else
+
+int
+dr_uring_create(unsigned int entries, struct dr_uring **_u)
+{
+	return -ENOSYS;
+}
+
+void
+dr_uring_destroy(struct dr_uring *u)
+{
+}
+
+int
+dr_uring_queue(struct dr_uring *u, struct iovec *iov, int cnt, void *data)
+{
+	return -ENOSYS;
+}
+
+int
+dr_uring_flush(struct dr_uring *u, int sock,
+	       void (*done)(void *data, int err, void *arg), void *arg)
+{
+	return 0;
+}
+
+void
+dr_uring_stats(struct dr_uring *u, td_stats_t *st)
+{
+}
+
+#endif
@@ -0,0 +1,51 @@
+#ifndef _DR_URING_H_
+#define _DR_URING_H_
+
+/*
+ * Batched sends on one socket through io_uring, for a thread sending
+ * on behalf of many streams (a mux link). Sends are queued as they are
+ * cut, then go out as one chain of linked IORING_OP_SENDMSG sqes, with
+ * MSG_MORE on all but the last, in a single io_uring_enter that also
+ * waits for them: a round over every device costs one syscall instead
+ * of a sendmsg() each, plus two to cork and uncork.
+ *
+ * Links keep the chain in order on the socket. A send the kernel cut
+ * short ends the chain, and the rest comes back -ECANCELED: the flush
+ * then sends what is left, from where the short one stopped, with
+ * plain blocking sends, so the stream stays intact. Once one send
+ * fails, every one after it fails with it.
+ *
+ * The ring is private to the thread that queues and flushes; rings are
+ * set up with IORING_FEAT_FAST_POLL only, so a full socket parks the
+ * chain on a poll instead of a worker thread. Neither buffers nor the
+ * socket are registered: batches come from the ring and per-device
+ * buffers alike, and the socket is not ours to pin.
+ */
+
+#include <sys/uio.h>
+#include "tapdisk-stats.h"
+
+struct dr_uring;
+
+/* -ENOSYS if this build or the kernel cannot. */
+int dr_uring_create(unsigned int entries, struct dr_uring **);
+void dr_uring_destroy(struct dr_uring *);
+
+/*
+ * Queue a send of iov[0..cnt), which must stay put until the flush;
+ * 'data' comes back with its result. -EBUSY once 'entries' are queued.
+ */
+int dr_uring_queue(struct dr_uring *, struct iovec *iov, int cnt, void *data);
+
+/*
+ * Send everything queued on 'sock', in order, and wait for it. done()
+ * gets every send's 'data', with 0 or -errno, in queue order. Returns
+ * the number of sends that failed.
+ */
+int dr_uring_flush(struct dr_uring *, int sock,
+		   void (*done)(void *data, int err, void *arg), void *arg);
+
+/* "uring": [ flushes, sends, sent by the fallback ] */
+void dr_uring_stats(struct dr_uring *, td_stats_t *);
+
+#endif /* _DR_URING_H_ */
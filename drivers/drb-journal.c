@@ -0,0 +1,707 @@
+/*
+ * Copyright (c) 2007, XenSource Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of XenSource Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <linux/falloc.h>
+
+#include "tapdisk.h"
+#include "dr-crc32c.h"
+#include "writelog.h"
+#include "drb-journal.h"
+
+/* what a merge reads at once, grown for larger records */
+#define DRB_JOURNAL_CHUNK    (8 << 20)
+
+#define DRB_JOURNAL_ALIGN(_n) (((_n) + 511) & ~(uint64_t)511)
+
+size_t
+drb_journal_len(uint32_t size)
+{
+	return DRB_JOURNAL_HDR + DRB_JOURNAL_ALIGN(size);
+}
+
+static uint32_t
+drb_journal_crc(struct drb_journal_hdr *hdr, const char *data)
+{
+	struct drb_journal_hdr h = *hdr;
+	uint32_t crc;
+
+	h.crc = 0;
+	crc   = dr_crc32c(0, &h, sizeof(h));
+	return hdr->size ? dr_crc32c(crc, data, hdr->size) : crc;
+}
+
+static uint32_t
+drb_journal_sb_crc(struct drb_journal_sb *sb)
+{
+	struct drb_journal_sb s = *sb;
+
+	s.crc = 0;
+	return dr_crc32c(0, &s, sizeof(s));
+}
+
+static int
+drb_journal_pread(int fd, void *buf, size_t len, uint64_t off)
+{
+	ssize_t n;
+
+	while (len) {
+		n = pread(fd, buf, len, off);
+		if (n <= 0)
+			return n ? -errno : -EIO;
+		buf  = (char *)buf + n;
+		len -= n;
+		off += n;
+	}
+
+	return 0;
+}
+
+static int
+drb_journal_pwrite(int fd, const void *buf, size_t len, uint64_t off)
+{
+	ssize_t n;
+
+	while (len) {
+		n = pwrite(fd, buf, len, off);
+		if (n <= 0)
+			return n ? -errno : -EIO;
+		buf  = (const char *)buf + n;
+		len -= n;
+		off += n;
+	}
+
+	return 0;
+}
+
+static int
+drb_journal_write_sb(struct drb_journal *j, struct drb_journal_sb *sb)
+{
+	void *buf;
+	int err;
+
+	if (posix_memalign(&buf, 4096, DRB_JOURNAL_SB))
+		return -ENOMEM;
+
+	sb->crc = drb_journal_sb_crc(sb);
+	memset(buf, 0, DRB_JOURNAL_SB);
+	memcpy(buf, sb, sizeof(*sb));
+
+	err = drb_journal_pwrite(j->fd, buf, DRB_JOURNAL_SB, 0);
+	if (!err && fdatasync(j->fd))
+		err = -errno;
+
+	free(buf);
+	return err;
+}
+
+static int
+drb_journal_index(struct drb_journal *j, uint64_t epoch, uint64_t id,
+		  uint64_t end)
+{
+	struct drb_journal_epoch *e;
+	int max;
+
+	if (j->n_epochs == j->max_epochs) {
+		max = j->max_epochs ? j->max_epochs * 2 : 64;
+		e   = realloc(j->epochs, max * sizeof(*e));
+		if (!e)
+			return -ENOMEM;
+		j->epochs     = e;
+		j->max_epochs = max;
+	}
+
+	e = &j->epochs[j->n_epochs++];
+	e->epoch   = epoch;
+	e->writeID = id;
+	e->end     = end;
+
+	return 0;
+}
+
+/* Drop the epochs the base holds now. */
+static void
+drb_journal_trim(struct drb_journal *j)
+{
+	int i;
+
+	for (i = 0; i < j->n_epochs && j->epochs[i].end <= j->sb.base; i++)
+		;
+	memmove(j->epochs, j->epochs + i,
+		(j->n_epochs - i) * sizeof(*j->epochs));
+	j->n_epochs -= i;
+}
+
+/*
+ * Index the epochs past the base, up to the first record which is not
+ * whole, and cut the journal there.
+ */
+static int
+drb_journal_scan(struct drb_journal *j)
+{
+	struct drb_journal_hdr hdr;
+	uint64_t pos = j->sb.base, size;
+	char *buf = NULL, *data;
+	size_t len, max = 0;
+	struct stat st;
+	int err = 0;
+
+	if (fstat(j->fd, &st))
+		return -errno;
+	size = st.st_size;
+
+	j->applied = j->sb.writeID;
+
+	while (pos + DRB_JOURNAL_HDR <= size) {
+		if (max < DRB_JOURNAL_HDR) {
+			max = DRB_JOURNAL_CHUNK;
+			if (posix_memalign((void **)&buf, 4096, max)) {
+				buf = NULL;
+				err = -ENOMEM;
+				break;
+			}
+		}
+
+		err = drb_journal_pread(j->fd, buf, DRB_JOURNAL_HDR, pos);
+		if (err)
+			break;
+
+		memcpy(&hdr, buf, sizeof(hdr));
+		if (hdr.magic != DRB_JOURNAL_MAGIC)
+			break;
+
+		len = drb_journal_len(hdr.size);
+		if (pos + len > size)
+			break;
+
+		if (len > max) {
+			free(buf);
+			max = len;
+			if (posix_memalign((void **)&buf, 4096, max)) {
+				buf = NULL;
+				err = -ENOMEM;
+				break;
+			}
+		}
+
+		data = buf + DRB_JOURNAL_HDR;
+		if (hdr.size) {
+			err = drb_journal_pread(j->fd, data, len -
+						DRB_JOURNAL_HDR,
+						pos + DRB_JOURNAL_HDR);
+			if (err)
+				break;
+		}
+
+		if (drb_journal_crc(&hdr, data) != hdr.crc)
+			break;
+
+		pos += len;
+
+		if (hdr.size) {
+			if (hdr.writeID > j->applied)
+				j->applied = hdr.writeID;
+		} else {
+			err = drb_journal_index(j, hdr.offset, hdr.writeID,
+						pos);
+			if (err)
+				break;
+		}
+	}
+
+	free(buf);
+	if (err)
+		return err;
+
+	if (pos < size) {
+		DPRINTF("%s: cutting %llu bytes of torn records\n", j->path,
+			(unsigned long long)(size - pos));
+		if (ftruncate(j->fd, pos))
+			return -errno;
+	}
+
+	j->tail = pos;
+	return 0;
+}
+
+/*
+ * Call fn on every record in [pos, end), in stream order, reading the
+ * journal sequentially.
+ */
+static int
+drb_journal_walk(struct drb_journal *j, uint64_t pos, uint64_t end,
+		 int (*fn)(struct drb_journal *, struct drb_journal_hdr *,
+			   char *, void *), void *arg)
+{
+	struct drb_journal_hdr hdr;
+	size_t max, n, off, len = 0;
+	char *buf;
+	int err = 0;
+
+	max = DRB_JOURNAL_CHUNK;
+	if (posix_memalign((void **)&buf, 4096, max))
+		return -ENOMEM;
+
+	while (pos < end) {
+		n = end - pos < max ? end - pos : max;
+		err = drb_journal_pread(j->fd, buf, n, pos);
+		if (err)
+			break;
+
+		for (off = 0; off + DRB_JOURNAL_HDR <= n; off += len) {
+			memcpy(&hdr, buf + off, sizeof(hdr));
+			if (hdr.magic != DRB_JOURNAL_MAGIC) {
+				err = -EIO;
+				goto out;
+			}
+
+			len = drb_journal_len(hdr.size);
+			if (off + len > n)
+				break;
+
+			if (!hdr.size)
+				continue;
+
+			err = fn(j, &hdr, buf + off + DRB_JOURNAL_HDR, arg);
+			if (err)
+				goto out;
+		}
+
+		if (!off) {
+			/* a record larger than the chunk */
+			if (len <= max) {
+				err = -EIO;
+				break;
+			}
+			free(buf);
+			max = len;
+			if (posix_memalign((void **)&buf, 4096, max)) {
+				buf = NULL;
+				err = -ENOMEM;
+				break;
+			}
+		}
+
+		pos += off;
+	}
+
+out:
+	free(buf);
+	return err;
+}
+
+static int
+drb_journal_apply(struct drb_journal *j, struct drb_journal_hdr *hdr,
+		  char *data, void *arg)
+{
+	int err;
+
+	err = drb_journal_pwrite(j->image_fd, data, hdr->size, hdr->offset);
+	if (!err)
+		j->merged++;
+
+	return err;
+}
+
+/*
+ * Apply the journal to the base, from where it is up to 'to', then
+ * move the base there.
+ */
+static int
+drb_journal_merge(struct drb_journal *j, struct drb_journal_epoch *to)
+{
+	struct drb_journal_sb sb;
+	uint64_t from;
+	int err;
+
+	pthread_mutex_lock(&j->lock);
+	sb = j->sb;
+	pthread_mutex_unlock(&j->lock);
+
+	from = sb.base;
+	err  = drb_journal_walk(j, from, to->end, drb_journal_apply, NULL);
+	if (err)
+		goto out;
+
+	if (fdatasync(j->image_fd)) {
+		err = -errno;
+		goto out;
+	}
+
+	sb.base    = to->end;
+	sb.epoch   = to->epoch;
+	sb.writeID = to->writeID;
+	err = drb_journal_write_sb(j, &sb);
+	if (err)
+		goto out;
+
+	pthread_mutex_lock(&j->lock);
+	j->sb = sb;
+	pthread_mutex_unlock(&j->lock);
+
+	/* not fatal, the space is only reclaimed later */
+	if (fallocate(j->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		      from & ~4095ULL,
+		      (sb.base & ~4095ULL) - (from & ~4095ULL)) &&
+	    errno != EOPNOTSUPP)
+		DPRINTF("%s: unable to reclaim merged epochs: %d\n",
+			j->path, -errno);
+
+out:
+	if (err)
+		DPRINTF("%s: merge up to epoch %llu failed: %d\n", j->path,
+			(unsigned long long)to->epoch, err);
+	return err;
+}
+
+static void *
+drb_journal_thread(void *arg)
+{
+	struct drb_journal *j = arg;
+	struct drb_journal_epoch to;
+	int err;
+
+	pthread_mutex_lock(&j->lock);
+
+	while (!j->stop && !j->err) {
+		if (j->target.end <= j->sb.base) {
+			pthread_cond_wait(&j->cond, &j->lock);
+			continue;
+		}
+
+		to = j->target;
+		pthread_mutex_unlock(&j->lock);
+
+		err = drb_journal_merge(j, &to);
+
+		pthread_mutex_lock(&j->lock);
+		j->err = err;
+	}
+
+	pthread_mutex_unlock(&j->lock);
+	return NULL;
+}
+
+int
+drb_journal_open(const char *dir, const char *image, int image_fd,
+		 int retain, struct drb_journal **_j)
+{
+	struct drb_journal *j;
+	struct stat st;
+	void *buf = NULL;
+	char *p;
+	int err;
+
+	j = calloc(1, sizeof(*j));
+	if (!j)
+		return -ENOMEM;
+
+	j->fd       = -1;
+	j->image_fd = image_fd;
+	j->retain   = retain;
+	pthread_mutex_init(&j->lock, NULL);
+	pthread_cond_init(&j->cond, NULL);
+
+	if (asprintf(&j->path, "%s/%s.journal", dir, image) == -1) {
+		j->path = NULL;
+		err = -ENOMEM;
+		goto fail;
+	}
+	for (p = j->path + strlen(dir) + 1; *p; p++)
+		if (*p == '/')
+			*p = '_';
+
+	j->fd = open(j->path, O_RDWR | O_CREAT | O_DIRECT | O_LARGEFILE,
+		     0644);
+	if (j->fd == -1 && errno == EINVAL)
+		j->fd = open(j->path, O_RDWR | O_CREAT | O_LARGEFILE, 0644);
+	if (j->fd == -1 || fstat(j->fd, &st)) {
+		err = -errno;
+		goto fail;
+	}
+
+	if (!st.st_size) {
+		j->sb.magic = DRB_JOURNAL_MAGIC;
+		j->sb.base  = DRB_JOURNAL_SB;
+		err = drb_journal_write_sb(j, &j->sb);
+		if (err)
+			goto fail;
+	} else {
+		if (posix_memalign(&buf, 4096, DRB_JOURNAL_SB)) {
+			err = -ENOMEM;
+			goto fail;
+		}
+		err = drb_journal_pread(j->fd, buf, DRB_JOURNAL_SB, 0);
+		if (err)
+			goto fail;
+		memcpy(&j->sb, buf, sizeof(j->sb));
+		if (j->sb.magic != DRB_JOURNAL_MAGIC ||
+		    j->sb.crc != drb_journal_sb_crc(&j->sb) ||
+		    j->sb.base < DRB_JOURNAL_SB) {
+			DPRINTF("%s: not a journal\n", j->path);
+			err = -EINVAL;
+			goto fail;
+		}
+	}
+
+	err = drb_journal_scan(j);
+	if (err)
+		goto fail;
+
+	err = pthread_create(&j->thread, NULL, drb_journal_thread, j);
+	if (err) {
+		err = -err;
+		goto fail;
+	}
+
+	DPRINTF("%s: base at epoch %llu, %d epochs journalled\n", j->path,
+		(unsigned long long)j->sb.epoch, j->n_epochs);
+
+	free(buf);
+	*_j = j;
+	return 0;
+
+fail:
+	DPRINTF("%s: unable to open journal: %d\n",
+		j->path ? j->path : image, err);
+	free(buf);
+	if (j->fd != -1)
+		close(j->fd);
+	free(j->path);
+	free(j);
+	return err;
+}
+
+void
+drb_journal_close(struct drb_journal *j)
+{
+	pthread_mutex_lock(&j->lock);
+	j->stop = 1;
+	pthread_cond_signal(&j->cond);
+	pthread_mutex_unlock(&j->lock);
+	pthread_join(j->thread, NULL);
+	drb_journal_trim(j);
+
+	DPRINTF("%s: closing journal: base at epoch %llu, %d epochs "
+		"journalled, %llu records merged\n", j->path,
+		(unsigned long long)j->sb.epoch, j->n_epochs,
+		(unsigned long long)j->merged);
+
+	if (fdatasync(j->fd))
+		DPRINTF("%s: fdatasync failed: %d\n", j->path, -errno);
+
+	close(j->fd);
+	free(j->epochs);
+	free(j->path);
+	free(j);
+}
+
+uint64_t
+drb_journal_reserve(struct drb_journal *j, char *buf, uint64_t writeID,
+		    uint64_t offset, uint32_t size)
+{
+	struct drb_journal_hdr hdr;
+	size_t len = drb_journal_len(size);
+	uint64_t pos;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic   = DRB_JOURNAL_MAGIC;
+	hdr.writeID = writeID;
+	hdr.offset  = offset;
+	hdr.size    = size;
+	hdr.crc     = drb_journal_crc(&hdr, buf + DRB_JOURNAL_HDR);
+
+	memset(buf, 0, DRB_JOURNAL_HDR);
+	memcpy(buf, &hdr, sizeof(hdr));
+	memset(buf + DRB_JOURNAL_HDR + size, 0, len - DRB_JOURNAL_HDR - size);
+
+	pos      = j->tail;
+	j->tail += len;
+	if (writeID > j->applied)
+		j->applied = writeID;
+
+	return pos;
+}
+
+/*
+ * The marker goes out with the epoch's records, under one sync; should
+ * it land before them, the scan still stops at the first torn one.
+ */
+int
+drb_journal_barrier(struct drb_journal *j, uint64_t epoch,
+		    uint64_t writeID)
+{
+	struct drb_journal_epoch *last;
+	char *buf;
+	int err;
+
+	last = j->n_epochs ? &j->epochs[j->n_epochs - 1] : NULL;
+	if (epoch <= (last ? last->epoch : j->sb.epoch))
+		return 0;
+
+	if (posix_memalign((void **)&buf, 4096, DRB_JOURNAL_HDR))
+		return -ENOMEM;
+
+	drb_journal_reserve(j, buf, writeID, epoch, 0);
+	err = drb_journal_pwrite(j->fd, buf, DRB_JOURNAL_HDR,
+				 j->tail - DRB_JOURNAL_HDR);
+	free(buf);
+	if (!err && fdatasync(j->fd))
+		err = -errno;
+	if (err) {
+		/* the next record must not follow a hole */
+		j->tail -= DRB_JOURNAL_HDR;
+		return err;
+	}
+
+	err = drb_journal_index(j, epoch, writeID, j->tail);
+	if (err)
+		return err;
+
+	pthread_mutex_lock(&j->lock);
+
+	drb_journal_trim(j);
+	if (j->n_epochs > j->retain) {
+		j->target = j->epochs[j->n_epochs - j->retain - 1];
+		pthread_cond_signal(&j->cond);
+	}
+	err = j->err;
+
+	pthread_mutex_unlock(&j->lock);
+
+	return err;
+}
+
+static int
+drb_journal_mark(struct drb_journal *j, struct drb_journal_hdr *hdr,
+		 char *data, void *arg)
+{
+	writelog_set(arg, hdr->offset >> 9, (hdr->size + 511) >> 9);
+	return 0;
+}
+
+/*
+ * Mark the extents of the records a restore drops, past 'from', in a
+ * failback bitmap next to the journal: the original primary wrote
+ * them, the image now differs there.
+ */
+static int
+drb_journal_failback(struct drb_journal *j, uint64_t from)
+{
+	struct writelog wl;
+	uint64_t sector, count;
+	char *path;
+	off_t size;
+	int err;
+
+	size = lseek(j->image_fd, 0, SEEK_END);
+	if (size == -1)
+		return -errno;
+
+	err = writelog_create(&wl, size >> 9, 0);
+	if (err)
+		return err;
+
+	err = drb_journal_walk(j, from, j->tail, drb_journal_mark, &wl);
+	if (err || writelog_next(&wl, 0, UINT32_MAX, &sector, &count))
+		goto out;
+
+	if (asprintf(&path, "%.*s.failback",
+		     (int)(strlen(j->path) - strlen(".journal")),
+		     j->path) == -1) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	/* what an earlier failover left still counts */
+	err = writelog_load(&wl, path);
+	if (!err || err == -ENOENT)
+		err = writelog_save(&wl, path);
+	if (!err)
+		DPRINTF("%s: dropped extents kept in %s\n", j->path, path);
+
+	free(path);
+out:
+	writelog_free(&wl);
+	return err;
+}
+
+/* For a failover; nothing may be journalling meanwhile. */
+int
+drb_journal_restore(struct drb_journal *j, uint64_t epoch)
+{
+	struct drb_journal_epoch to;
+	int i, err;
+
+	if (epoch != j->sb.epoch) {
+		for (i = 0; i < j->n_epochs; i++)
+			if (j->epochs[i].epoch == epoch)
+				break;
+		if (i == j->n_epochs) {
+			DPRINTF("%s: epoch %llu is not journalled, the base "
+				"is at %llu\n", j->path,
+				(unsigned long long)epoch,
+				(unsigned long long)j->sb.epoch);
+			return -ENOENT;
+		}
+
+		to  = j->epochs[i];
+		err = drb_journal_merge(j, &to);
+		if (err)
+			return err;
+	}
+
+	err = drb_journal_failback(j, j->sb.base);
+	if (err) {
+		DPRINTF("%s: unable to record extents for failback: %d\n",
+			j->path, err);
+		return err;
+	}
+
+	if (ftruncate(j->fd, j->sb.base) || fdatasync(j->fd))
+		return -errno;
+
+	j->tail     = j->sb.base;
+	j->n_epochs = 0;
+
+	DPRINTF("%s: restored to epoch %llu, writeID %llu\n", j->path,
+		(unsigned long long)j->sb.epoch,
+		(unsigned long long)j->sb.writeID);
+
+	return 0;
+}
@@ -0,0 +1,127 @@
+/*
+ * Copyright (c) 2007, XenSource Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of XenSource Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _DRB_JOURNAL_H_
+#define _DRB_JOURNAL_H_
+
+#include <stdint.h>
+#include <pthread.h>
+
+/*
+ * Point-in-time journal of a backup image.
+ *
+ * Records are appended instead of written in place, each a
+ * DRB_JOURNAL_HDR header followed by its data, and every epoch barrier
+ * appends a marker closing the epoch. The image itself is the base:
+ * the oldest point the journal can go back to. Once more than 'retain'
+ * epochs are journalled, a thread merges the oldest ones into the
+ * base, reading the journal sequentially, and punches them out of it.
+ *
+ * The first DRB_JOURNAL_SB bytes hold struct drb_journal_sb, where the
+ * merge is at. A header's checksum covers it and its data, so a scan
+ * after a crash stops at the first torn record; the rest is cut off.
+ */
+
+#define DRB_JOURNAL_MAGIC    0x44524a52	/* "DRJR" */
+#define DRB_JOURNAL_SB       4096
+#define DRB_JOURNAL_HDR      512
+#define DRB_JOURNAL_RETAIN   64
+
+struct drb_journal_sb {
+	uint32_t             magic;
+	uint32_t             crc;
+	uint64_t             base;	/* journal offset merged up to */
+	uint64_t             epoch;	/* of the base */
+	uint64_t             writeID;
+};
+
+/* size 0 marks the end of epoch 'offset', at write 'writeID' */
+struct drb_journal_hdr {
+	uint32_t             magic;
+	uint32_t             crc;
+	uint64_t             writeID;
+	uint64_t             offset;
+	uint32_t             size;
+	uint32_t             pad;
+};
+
+struct drb_journal_epoch {
+	uint64_t             epoch;
+	uint64_t             writeID;
+	uint64_t             end;	/* journal offset past its marker */
+};
+
+struct drb_journal {
+	char                *path;
+	int                  fd;
+	int                  image_fd;
+	int                  retain;
+
+	uint64_t             tail;
+	uint64_t             applied;	/* highest writeID journalled */
+
+	/* closed epochs past the base, oldest first */
+	struct drb_journal_epoch *epochs;
+	int                  n_epochs;
+	int                  max_epochs;
+
+	/* the merge thread's target, and where it got */
+	pthread_t            thread;
+	pthread_mutex_t      lock;
+	pthread_cond_t       cond;
+	int                  stop;
+	struct drb_journal_epoch target;
+	struct drb_journal_sb sb;
+	int                  err;
+
+	uint64_t             merged;	/* records */
+};
+
+int drb_journal_open(const char *dir, const char *image, int image_fd,
+		     int retain, struct drb_journal **);
+void drb_journal_close(struct drb_journal *);
+
+/* Where a record of 'size' bytes goes, its header to fill at 'buf'. */
+uint64_t drb_journal_reserve(struct drb_journal *, char *buf,
+			     uint64_t writeID, uint64_t offset,
+			     uint32_t size);
+size_t drb_journal_len(uint32_t size);
+
+/* Close an epoch; everything reserved before is on disk. */
+int drb_journal_barrier(struct drb_journal *, uint64_t epoch,
+			uint64_t writeID);
+
+/*
+ * Merge journalled epochs into the base up to 'epoch', drop the rest;
+ * their extents are kept in <dir>/<image, '/' as '_'>.failback, a
+ * writelog_save() bitmap for the failback=<path> option of the DR
+ * drivers.
+ */
+int drb_journal_restore(struct drb_journal *, uint64_t epoch);
+
+#endif /* _DRB_JOURNAL_H_ */
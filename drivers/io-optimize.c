@@ -51,6 +51,9 @@ opio_free(struct opioctx *ctx)
 
 	free(ctx->event_queue);
 	ctx->event_queue = NULL;
+
+	free(ctx->iovecs);
+	ctx->iovecs = NULL;
 }
 
 int
@@ -66,9 +69,11 @@ opio_init(struct opioctx *ctx, int num_iocbs)
 	ctx->free_opios    = calloc(1, sizeof(struct opio *) * num_iocbs);
 	ctx->iocb_queue    = calloc(1, sizeof(struct iocb *) * num_iocbs);
 	ctx->event_queue   = calloc(1, sizeof(struct io_event) * num_iocbs);
+	ctx->iovecs        = calloc(OPIO_MAX_IOV * num_iocbs,
+				    sizeof(struct iovec));
 
 	if (!ctx->opios || !ctx->free_opios ||
-	    !ctx->iocb_queue || !ctx->event_queue)
+	    !ctx->iocb_queue || !ctx->event_queue || !ctx->iovecs)
 		goto fail;
 
 	for (i = 0; i < num_iocbs; i++)
@@ -101,9 +106,10 @@ restore_iocb(struct opio *op)
 {
 	struct iocb *io = op->iocb;
 
-	io->data        = op->data;
-	io->u.c.buf     = op->buf;
-	io->u.c.nbytes  = op->nbytes;
+	io->data           = op->data;
+	io->aio_lio_opcode = op->opcode;
+	io->u.c.buf        = op->buf;
+	io->u.c.nbytes     = op->nbytes;
 }
 
 static inline int
@@ -116,6 +122,16 @@ iocb_optimized(struct opioctx *ctx, struct iocb *io)
 	return (iop >= start && iop < end);
 }
 
+/* Bytes an iocb moves, vectored or not. */
+static inline unsigned long
+iocb_nbytes(struct opioctx *ctx, struct iocb *io)
+{
+	if (io_iocb_vectored(io) && iocb_optimized(ctx, io))
+		return ((struct opio *)io->data)->iov_bytes;
+
+	return io->u.c.nbytes;
+}
+
 static inline int
 contiguous_sectors(struct iocb *l, struct iocb *r)
 {
@@ -128,13 +144,6 @@ contiguous_buffers(struct iocb *l, struct iocb *r)
 	return (l->u.c.buf + l->u.c.nbytes == r->u.c.buf);
 }
 
-static inline int
-contiguous_iocbs(struct iocb *l, struct iocb *r)
-{
-	return ((l->aio_fildes == r->aio_fildes) &&
-		contiguous_sectors(l, r) &&
-		contiguous_buffers(l, r));
-}
 
 static inline void
 init_opio_list(struct opio *op)
@@ -154,6 +163,7 @@ opio_iocb_init(struct opioctx *ctx, struct iocb *io)
 	op->buf    = io->u.c.buf;
 	op->nbytes = io->u.c.nbytes;
 	op->offset = io->u.c.offset;
+	op->opcode = io->aio_lio_opcode;
 	op->data   = io->data;
 	op->iocb   = io;
 	io->data   = op;
@@ -172,10 +182,58 @@ opio_get(struct opioctx *ctx, struct iocb *io)
 	        return opio_iocb_init(ctx, io);
 }
 
+/*
+ * Turn a head into a vectored iocb over its (so far contiguous) buffer.
+ * Each opio owns OPIO_MAX_IOV iovecs, a head only ever uses its own.
+ */
+static void
+vectorize_head(struct opioctx *ctx, struct opio *ophead, struct iocb *head)
+{
+	ophead->iov       = ctx->iovecs + (ophead - ctx->opios) * OPIO_MAX_IOV;
+	ophead->iov[0].iov_base = head->u.c.buf;
+	ophead->iov[0].iov_len  = head->u.c.nbytes;
+	ophead->iovcnt    = 1;
+	ophead->iov_bytes = head->u.c.nbytes;
+
+	head->aio_lio_opcode = (head->aio_lio_opcode == IO_CMD_PWRITE ?
+				IO_CMD_PWRITEV : IO_CMD_PREADV);
+	head->u.c.nbytes = 0;
+	head->u.v.vec    = ophead->iov;
+	head->u.v.nr     = ophead->iovcnt;
+}
+
+static void
+merge_iov(struct opio *ophead, struct iocb *head, struct iocb *io)
+{
+	struct iovec *last = &ophead->iov[ophead->iovcnt - 1];
+
+	if ((char *)last->iov_base + last->iov_len == io->u.c.buf)
+		last->iov_len += io->u.c.nbytes;
+	else {
+		last++;
+		last->iov_base = io->u.c.buf;
+		last->iov_len  = io->u.c.nbytes;
+		ophead->iovcnt++;
+	}
+
+	ophead->iov_bytes += io->u.c.nbytes;
+	head->u.v.nr       = ophead->iovcnt;
+}
+
 static int
 merge_tail(struct opioctx *ctx, struct iocb *head, struct iocb *io)
 {
 	struct opio *ophead, *opio;
+	int vector;
+
+	vector = io_iocb_vectored(head) || !contiguous_buffers(head, io);
+
+	if (vector && ctx->merge == OPIO_MERGE_CONTIG)
+		return -EINVAL;
+
+	if (vector && iocb_optimized(ctx, head) &&
+	    ((struct opio *)head->data)->iovcnt == OPIO_MAX_IOV)
+		return -EINVAL;
 
 	ophead = opio_get(ctx, head);
 	if (!ophead)
@@ -185,23 +243,44 @@ merge_tail(struct opioctx *ctx, struct iocb *head, struct iocb *io)
 	if (!opio)
 		return -ENOMEM;
 
+	if (vector && !ophead->iov)
+		vectorize_head(ctx, ophead, head);
+
 	opio->head        = ophead;
-	head->u.c.nbytes += io->u.c.nbytes;
+	if (vector)
+		merge_iov(ophead, head, io);
+	else
+		head->u.c.nbytes += io->u.c.nbytes;
 	ophead->list.tail = ophead->list.tail->next = opio;
 	
 	return 0;
 }
 
+/*
+ * Requests merge on sector contiguity alone. Where their buffers are
+ * not contiguous too (guest segments are separate pages), the head
+ * becomes a PREADV/PWRITEV over the buffers.
+ */
 static int
 merge(struct opioctx *ctx, struct iocb *head, struct iocb *io)
 {
-	if (head->aio_lio_opcode != io->aio_lio_opcode)
+	short opcode = head->aio_lio_opcode;
+
+	if (opcode == IO_CMD_PREADV)
+		opcode = IO_CMD_PREAD;
+	if (opcode == IO_CMD_PWRITEV)
+		opcode = IO_CMD_PWRITE;
+
+	if (opcode != io->aio_lio_opcode)
+		return -EINVAL;
+
+	if (head->aio_fildes != io->aio_fildes)
 		return -EINVAL;
 
-	if (!contiguous_iocbs(head, io))
+	if (head->u.c.offset + iocb_nbytes(ctx, head) != io->u.c.offset)
 		return -EINVAL;
 
-	return merge_tail(ctx, head, io);		
+	return merge_tail(ctx, head, io);
 }
 
 #if (defined(TEST) || defined(DEBUG))
@@ -251,6 +330,9 @@ io_merge(struct opioctx *ctx, struct iocb **queue, int num)
 	if (!num)
 		return 0;
 
+	if (ctx->merge == OPIO_MERGE_NONE)
+		return num;
+
 	on_queue = 0;
 	q = ctx->iocb_queue;
 	memcpy(q, queue, num * sizeof(struct iocb *));
@@ -322,7 +404,7 @@ expand_event(struct opioctx *ctx,
 	ophead = (struct opio *)io->data;
 	op     = ophead;
 
-	if (event->res == io->u.c.nbytes)
+	if (event->res == iocb_nbytes(ctx, io))
 		err = 0;
 	else if ((int)event->res < 0)
 		err = (int)event->res;
@@ -374,8 +456,9 @@ static inline void
 __print_iocb(struct opioctx *ctx, struct iocb *io, char *prefix)
 {
 	DBG(ctx, "%soff: %08llx, nbytes: %04lx, buf: %p, type: %s, data: %08lx,"
-	    " optimized: %d\n", prefix, io->u.c.offset, io->u.c.nbytes, 
-	    io->u.c.buf, (io->aio_lio_opcode == IO_CMD_PREAD ? "read" : "write"),
+	    " optimized: %d\n", prefix, io->u.c.offset, iocb_nbytes(ctx, io),
+	    io->u.c.buf, (io->aio_lio_opcode == IO_CMD_PREAD ||
+			  io->aio_lio_opcode == IO_CMD_PREADV ? "read" : "write"),
 	    (unsigned long)io->data, iocb_optimized(ctx, io));
 }
 
@@ -477,7 +560,8 @@ randomize_iocbs(struct iocb **iocbs, int num_iocbs, int num_secs)
 }
 
 static int
-simulate_io(struct iocb **iocbs, struct io_event *events, int num_iocbs)
+simulate_io(struct opioctx *ctx,
+	    struct iocb **iocbs, struct io_event *events, int num_iocbs)
 {
 	int i, done;
 	struct iocb *io;
@@ -492,7 +576,7 @@ simulate_io(struct iocb **iocbs, struct io_event *events, int num_iocbs)
 		io      = iocbs[i];
 		ep      = &events[i];
 		ep->obj = io;
-		ep->res = (random() % 10 < 8 ? io->u.c.nbytes : 0);
+		ep->res = (random() % 10 < 8 ? iocb_nbytes(ctx, io) : 0);
 	}
 
 	return done;
@@ -627,7 +711,8 @@ main(int argc, char **argv)
 			DBG(&ctx, "optimized remaining: %d\n", op_rem);
 
 			DBG(&ctx, "simulating\n");
-			num_events = simulate_io(ioqueue + op_done, events, op_rem);
+			num_events = simulate_io(&ctx, ioqueue + op_done,
+						 events, op_rem);
 			print_events(&ctx, events, num_events);
 
 			DBG(&ctx, "splitting %d\n", num_events);
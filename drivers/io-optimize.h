@@ -19,6 +19,15 @@
 #define __IO_OPTIMIZE_H__
 
 #include <libaio.h>
+#include <sys/uio.h>
+
+/* most buffers a merged, vectored iocb gathers */
+#define OPIO_MAX_IOV        32
+
+/* what io_merge() may merge: across buffers, contiguous ones, nothing */
+#define OPIO_MERGE_VECTOR   0
+#define OPIO_MERGE_CONTIG   1
+#define OPIO_MERGE_NONE     2
 
 struct opio;
 
@@ -34,9 +43,15 @@ struct opio {
 	void               *data;
 	struct iocb        *iocb;
 	struct io_event     event;
+	short               opcode;
 	struct opio        *head;
 	struct opio        *next;
 	struct opio_list    list;
+
+	/* heads only, once merged across non-contiguous buffers */
+	struct iovec       *iov;
+	int                 iovcnt;
+	unsigned long       iov_bytes;
 };
 
 struct opioctx {
@@ -46,6 +61,8 @@ struct opioctx {
 	struct opio       **free_opios;
 	struct iocb       **iocb_queue;
 	struct io_event    *event_queue;
+	struct iovec       *iovecs;	/* OPIO_MAX_IOV per opio */
+	int                 merge;	/* OPIO_MERGE_* */
 };
 
 int opio_init(struct opioctx *ctx, int num_iocbs);
@@ -54,4 +71,11 @@ int io_merge(struct opioctx *ctx, struct iocb **queue, int num);
 int io_split(struct opioctx *ctx, struct io_event *events, int num);
 int io_expand_iocbs(struct opioctx *ctx, struct iocb **queue, int idx, int num);
 
+static inline int
+io_iocb_vectored(struct iocb *io)
+{
+	return (io->aio_lio_opcode == IO_CMD_PREADV ||
+		io->aio_lio_opcode == IO_CMD_PWRITEV);
+}
+
 #endif
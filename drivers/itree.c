@@ -0,0 +1,191 @@
+/*
+ * Copyright (c) 2007, XenSource Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of XenSource Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "itree.h"
+
+static inline int
+itree_less(struct itree_node *a, struct itree_node *b)
+{
+	if (a->start != b->start)
+		return a->start < b->start;
+	return (uintptr_t)a < (uintptr_t)b;
+}
+
+static inline void
+itree_update(struct itree_node *n)
+{
+	n->max = n->end;
+	if (n->left && n->left->max > n->max)
+		n->max = n->left->max;
+	if (n->right && n->right->max > n->max)
+		n->max = n->right->max;
+}
+
+static struct itree_node *
+itree_rotate_right(struct itree_node *n)
+{
+	struct itree_node *l = n->left;
+
+	n->left  = l->right;
+	l->right = n;
+	itree_update(n);
+	itree_update(l);
+
+	return l;
+}
+
+static struct itree_node *
+itree_rotate_left(struct itree_node *n)
+{
+	struct itree_node *r = n->right;
+
+	n->right = r->left;
+	r->left  = n;
+	itree_update(n);
+	itree_update(r);
+
+	return r;
+}
+
+static struct itree_node *
+__itree_insert(struct itree_node *root, struct itree_node *n)
+{
+	if (!root)
+		return n;
+
+	if (itree_less(n, root)) {
+		root->left = __itree_insert(root->left, n);
+		if (root->left->prio > root->prio)
+			return itree_rotate_right(root);
+	} else {
+		root->right = __itree_insert(root->right, n);
+		if (root->right->prio > root->prio)
+			return itree_rotate_left(root);
+	}
+
+	itree_update(root);
+	return root;
+}
+
+static struct itree_node *
+itree_merge(struct itree_node *l, struct itree_node *r)
+{
+	if (!l)
+		return r;
+	if (!r)
+		return l;
+
+	if (l->prio > r->prio) {
+		l->right = itree_merge(l->right, r);
+		itree_update(l);
+		return l;
+	}
+
+	r->left = itree_merge(l, r->left);
+	itree_update(r);
+	return r;
+}
+
+static struct itree_node *
+__itree_remove(struct itree_node *root, struct itree_node *n)
+{
+	if (!root)
+		return NULL;
+
+	if (root == n)
+		return itree_merge(n->left, n->right);
+
+	if (itree_less(n, root))
+		root->left = __itree_remove(root->left, n);
+	else
+		root->right = __itree_remove(root->right, n);
+
+	itree_update(root);
+	return root;
+}
+
+void
+itree_insert(struct itree *t, struct itree_node *n,
+	     uint64_t start, uint64_t end)
+{
+	/* xorshift, priorities only need to be spread out */
+	t->seed ^= t->seed << 13;
+	t->seed ^= t->seed >> 17;
+	t->seed ^= t->seed << 5;
+
+	n->start = start;
+	n->end   = end;
+	n->max   = end;
+	n->prio  = t->seed;
+	n->left  = n->right = NULL;
+
+	t->root = __itree_insert(t->root, n);
+}
+
+void
+itree_remove(struct itree *t, struct itree_node *n)
+{
+	t->root = __itree_remove(t->root, n);
+	n->left = n->right = NULL;
+}
+
+static int
+__itree_foreach(struct itree_node *n, uint64_t start, uint64_t end,
+		int (*fn)(struct itree_node *, void *), void *arg)
+{
+	int rc;
+
+	if (!n || n->max <= start)
+		return 0;
+
+	rc = __itree_foreach(n->left, start, end, fn, arg);
+	if (rc)
+		return rc;
+
+	/* everything right of here starts at or after n */
+	if (n->start >= end)
+		return 0;
+
+	if (n->end > start) {
+		rc = fn(n, arg);
+		if (rc)
+			return rc;
+	}
+
+	return __itree_foreach(n->right, start, end, fn, arg);
+}
+
+int
+itree_foreach_overlap(struct itree *t, uint64_t start, uint64_t end,
+		      int (*fn)(struct itree_node *, void *), void *arg)
+{
+	return __itree_foreach(t->root, start, end, fn, arg);
+}
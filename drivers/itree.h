@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2007, XenSource Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of XenSource Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _ITREE_H_
+#define _ITREE_H_
+
+#include <stdint.h>
+
+/*
+ * Interval tree over half-open ranges [start, end), e.g. byte extents.
+ * Overlapping and duplicate ranges are allowed. Nodes are embedded in
+ * the caller's structures, as with list.h; nothing is allocated.
+ *
+ * A treap ordered by (start, node address), each node caching the
+ * largest end below it, so an overlap query only descends into
+ * subtrees that can contain a hit.
+ */
+struct itree_node {
+	uint64_t             start;
+	uint64_t             end;
+	uint64_t             max;
+	unsigned int         prio;
+	struct itree_node   *left;
+	struct itree_node   *right;
+};
+
+struct itree {
+	struct itree_node   *root;
+	unsigned int         seed;
+};
+
+#define ITREE_INIT       { NULL, 1 }
+
+#define itree_empty(_t)  ((_t)->root == NULL)
+
+static inline void
+itree_init(struct itree *t)
+{
+	t->root = NULL;
+	t->seed = 1;
+}
+
+void itree_insert(struct itree *, struct itree_node *,
+		  uint64_t start, uint64_t end);
+void itree_remove(struct itree *, struct itree_node *);
+
+/*
+ * Call fn on every node overlapping [start, end), in start order,
+ * until it returns non-zero. Returns that value, or 0. fn must not
+ * modify the tree.
+ */
+int itree_foreach_overlap(struct itree *, uint64_t start, uint64_t end,
+			  int (*fn)(struct itree_node *, void *), void *arg);
+
+#endif /* _ITREE_H_ */
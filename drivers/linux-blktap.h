@@ -27,6 +27,8 @@
 #define BLKTAP_IOCTL_FREE_TAP       201
 #define BLKTAP_IOCTL_CREATE_DEVICE  208
 #define BLKTAP_IOCTL_REMOVE_DEVICE  207
+#define BLKTAP_IOCTL_FEATURES       209
+#define BLKTAP_IOCTL_POOL           210
 
 struct blktap_info {
 	unsigned int            ring_major;
@@ -43,6 +45,29 @@ struct blktap_device_info {
 };
 
 #define BLKTAP_DEVICE_RO        0x00000001UL
+#define BLKTAP_DEVICE_DISCARD   0x00000002UL
+#define BLKTAP_DEVICE_FLUSH     0x00000004UL
+
+/*
+ * Features. BLKTAP_IOCTL_FEATURES takes the set userspace wants
+ * before mapping the ring, and returns the subset the kernel grants.
+ */
+
+#define BLKTAP_FEATURE_INDIRECT 0x00000001UL
+#define BLKTAP_FEATURE_PERSISTENT 0x00000002UL
+
+/*
+ * Persistent mappings. The data area becomes a pool of pages the
+ * kernel keeps guest pages mapped in, recycled least recently used
+ * first. Segments then name their pool page instead of being placed
+ * by request id. BLKTAP_IOCTL_POOL takes the pool size userspace
+ * offers and returns the size the kernel will use, at most that.
+ */
+
+struct blktap_pool_info {
+	uint32_t                pages;
+	uint32_t                __rsvd[3];
+};
 
 /*
  * I/O ring
@@ -65,16 +90,27 @@ typedef struct blktap_ring_request  blktap_ring_req_t;
 typedef struct blktap_ring_response blktap_ring_rsp_t;
 
 struct blktap_segment {
-	uint32_t                __pad;
+	uint32_t                page;    /* BLKTAP_FEATURE_PERSISTENT */
 	uint8_t                 first_sect;
 	uint8_t                 last_sect;
 };
 
 #define BLKTAP_OP_READ          0
 #define BLKTAP_OP_WRITE         1
+#define BLKTAP_OP_FLUSH         3
+#define BLKTAP_OP_DISCARD       5
+#define BLKTAP_OP_INDIRECT      6
 
 #define BLKTAP_SEGMENT_MAX      11
 
+/*
+ * Indirect requests carry no segments in the ring entry. With
+ * BLKTAP_FEATURE_INDIRECT each request id owns
+ * BLKTAP_INDIRECT_SEGMENT_MAX data pages, and one page of segment
+ * descriptors in an area following all data pages.
+ */
+#define BLKTAP_INDIRECT_SEGMENT_MAX 256
+
 struct blktap_ring_request {
 	uint8_t                 operation;
 	uint8_t                 nr_segments;
@@ -84,6 +120,14 @@ struct blktap_ring_request {
 	struct blktap_segment   seg[BLKTAP_SEGMENT_MAX];
 };
 
+struct blktap_ring_request_indirect {
+	uint8_t                 operation;
+	uint8_t                 indirect_op;
+	uint16_t                nr_segments;
+	uint64_t                id;
+	uint64_t                sector_number;
+};
+
 #define BLKTAP_RSP_EOPNOTSUPP  -2
 #define BLKTAP_RSP_ERROR       -1
 #define BLKTAP_RSP_OKAY         0
@@ -94,8 +138,27 @@ struct blktap_ring_response {
 	int16_t                 status;
 };
 
+/*
+ * Discards carry no segments either, only a sector range. The device
+ * takes them with BLKTAP_DEVICE_DISCARD.
+ *
+ * Flushes carry nothing, with nr_segments 0. The device takes them
+ * with BLKTAP_DEVICE_FLUSH, and completes one once all writes the
+ * device completed before it are durable.
+ */
+struct blktap_ring_request_discard {
+	uint8_t                 operation;
+	uint8_t                 __pad1;
+	uint16_t                __pad2;
+	uint64_t                id;
+	uint64_t                sector_number;
+	uint64_t                nr_sectors;
+};
+
 union blktap_ring_entry {
 	struct blktap_ring_request  req;
+	struct blktap_ring_request_indirect ind;
+	struct blktap_ring_request_discard discard;
 	struct blktap_ring_response rsp;
 };
 
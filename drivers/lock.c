@@ -30,7 +30,9 @@
 #include <time.h>
 #include <dirent.h>
 #include <limits.h>
+#include <sys/time.h>
 #include "lock.h"
+#include "list.h"
 
 #define unlikely(x) __builtin_expect(!!(x), 0)
 
@@ -49,8 +51,105 @@
 /* random wait - up to .5 seconds */
 #define XSLEEP usleep(random() & 0x7ffff)
 
+/* 
+ * retry backoff: doubles from BACKOFF_MIN up to BACKOFF_MAX usecs,
+ * jittered only once the lock has proven contended
+ */
+#define BACKOFF_MIN 1000
+#define BACKOFF_MAX 0x7ffff
+#define BACKOFF_JITTER 3
+
+/* 
+ * final locks taken or reasserted by this process, with their lease
+ * time. Renewing one is a single utimes() as long as it still exists,
+ * i.e. as long as no one stole it.
+ */
+struct lock_lease {
+        char *flink;
+        int lease_time;
+        struct list_head next;
+};
+
+static LIST_HEAD(lock_leases);
+
 typedef int (*eval_func)(char *name, int readonly);
 
+static void lock_backoff(int attempt)
+{
+        useconds_t usecs = BACKOFF_MAX;
+
+        if (attempt < 10 && (BACKOFF_MIN << attempt) < BACKOFF_MAX)
+                usecs = BACKOFF_MIN << attempt;
+
+        if (attempt >= BACKOFF_JITTER)
+                usecs = usecs / 2 + random() % (usecs / 2 + 1);
+
+        usleep(usecs);
+}
+
+static struct lock_lease *lease_find(const char *flink)
+{
+        struct lock_lease *l;
+
+        list_for_each_entry(l, &lock_leases, next)
+                if (!strcmp(l->flink, flink))
+                        return l;
+
+        return NULL;
+}
+
+static void lease_drop(const char *flink)
+{
+        struct lock_lease *l = lease_find(flink);
+
+        if (l) {
+                list_del(&l->next);
+                free(l->flink);
+                free(l);
+        }
+}
+
+static void lease_cache(const char *flink, int lease_time)
+{
+        struct lock_lease *l = lease_find(flink);
+
+        if (!l) {
+                l = malloc(sizeof(*l));
+                if (unlikely(!l))
+                        return;
+                l->flink = strdup(flink);
+                if (unlikely(!l->flink)) {
+                        free(l);
+                        return;
+                }
+                list_add(&l->next, &lock_leases);
+        }
+
+        l->lease_time = lease_time;
+}
+
+/*
+ * fast path reassert of a lease we hold: bumps the mtime of the final
+ * lock in one metadata operation, in server time as the slow path
+ * does. Returns 0 when renewed.
+ */
+static int lease_renew(const char *flink, int *lease_time)
+{
+        struct lock_lease *l = lease_find(flink);
+
+        if (!l)
+                return -1;
+
+        if (utimes(flink, NULL) == -1) {
+                LOG("renewing %s failed, errno=%d\n", flink, errno);
+                lease_drop(flink);
+                return -1;
+        }
+
+        *lease_time = l->lease_time;
+        return 0;
+}
+
 static char *create_lockfn(char *fn_to_lock)
 {
         char *lockfn;
@@ -239,8 +338,8 @@ static int lock_holder(char *fn, char *lockfn, char *lockfn_link,
                         }
                 }
                 dptr = readdir(pd);
-                if (!dptr && !errno) {
-                    *ioerror = EIO;
+                if (!dptr && errno) {
+                    *ioerror = errno;
                 }
         }
 
@@ -295,6 +394,16 @@ int lock(char *fn_to_lock, char *uuid, int force, int readonly, int *lease_time,
                                           readonly);
         if (unlikely(!lockfn_flink)) { status = ENOMEM; *retstatus = LOCK_ENOMEM; goto finish; }
 
+        /* still ours since we last took it? */
+        if (!force && !lease_renew(lockfn_flink, lease_time)) {
+                LOG("lease on %s renewed\n", lockfn_flink);
+                *retstatus = 1;
+                free(lockfn);
+                free(lockfn_xlink);
+                free(lockfn_flink);
+                return 0;
+        }
+
 try_again:
         if (retry_attempts++ > RETRY_MAX) {
                 if (*retstatus == LOCK_EXLOCK_OPEN) {
@@ -391,7 +500,7 @@ force_lock:
                         }
                         stealx = 1;
                 }
-                XSLEEP;
+                lock_backoff(retry_attempts);
                 *retstatus = LOCK_EXLOCK_OPEN;
                 goto try_again;
         }
@@ -414,7 +523,7 @@ skip:
                 if (unlikely(clstat == -1)) {
                         LOG("fail on close\n");
                 }
-                XSLEEP;
+                lock_backoff(retry_attempts);
                 *retstatus = LOCK_EXLOCK_WRITE;
                 if (unlink(lockfn) == -1)  {
                         LOG("removal of %s lockfile failed, "
@@ -446,7 +555,7 @@ skip:
                                 LOG("error removing linked lock file %s", 
                                     lockfn_xlink);
                         }
-                        XSLEEP;
+                        lock_backoff(retry_attempts);
                         status = LOCK_ESTAT;
                         goto finish;
                 }
@@ -475,7 +584,7 @@ skip:
                                 LOG("error removing linked lock file %s", 
                                     lockfn_xlink);
                         }
-                        XSLEEP;
+                        lock_backoff(retry_attempts);
                         *retstatus = LOCK_EINODE;
                         goto try_again;
                 }
@@ -571,7 +680,7 @@ skip_scan:
                                 if (unlikely(clstat == -1)) {
                                         LOG("fail on close\n");
                                 }
-                                XSLEEP;
+                                lock_backoff(retry_attempts);
                                 *retstatus = LOCK_EUPDATE;
                                 goto try_again;
                         }
@@ -591,6 +700,13 @@ skip_scan:
                 select(0, 0, 0, 0, &timeout);
         }
 
+        if (lockfn_flink) {
+                if (*retstatus >= 0)
+                        lease_cache(lockfn_flink, *lease_time);
+                else
+                        lease_drop(lockfn_flink);
+        }
+
         /* remove exclusive lock, final read/write locks will hold */
         tmpstat = unlink(lockfn);
         if (unlikely(tmpstat == -1)) {
@@ -624,6 +740,8 @@ int unlock(char *fn_to_unlock, char *uuid, int readonly, int *status)
                                          readonly);
         if (unlikely(!lockfn_link)) { *status = LOCK_ENOMEM; goto finish; }
 
+        lease_drop(lockfn_link);
+
         if (unlink(lockfn_link) == -1) {
                 LOG("error removing linked lock file %s", lockfn_link);
                 reterrno = errno;
@@ -753,7 +871,7 @@ static void usage(char *prg)
                "    p <filename> [num iterations]\n"
                "    u <filename> [0|1] [<uniqid>]\n"
                "    l <filename> [0|1] [0|1] [<uniqid>] [<leasetime>]\n", prg);
-        printf("        p : perf test lock take and reassert\n");
+        printf("        p : perf test lock take, reassert, renew and release\n");
         printf("        d : delta lock time\n");
         printf("        t : test the file (after random locks)\n");
         printf("        r : random lock tests (must ^C)\n");
@@ -795,6 +913,7 @@ static void random_locks(char *fn)
         int readonly;
         int lease = DEFAULT_LEASE_TIME_SECS;
         int err;
+        int sysstatus;
 
         /* this will never return, kill to exit */
 
@@ -806,7 +925,9 @@ static void random_locks(char *fn)
         while (1) {
                 XSLEEP;
                 readonly = random()  & 1;
-                sysstatus = lock(fn, uuid, 0, readonly, &lease, status);
+                sysstatus = lock(fn, uuid, 0, readonly, &lease, &status);
+                if (sysstatus)
+                        LOG("lock errno %d\n", sysstatus);
                 if (status == LOCK_OK) {
                         /* got lock, open, read, modify write close file */
                         int fd = open(fn, O_RDWR, 0644);
@@ -857,24 +978,107 @@ static void random_locks(char *fn)
         }
 }
 
+static long long perf_usecs(void)
+{
+        struct timeval tv;
+
+        gettimeofday(&tv, NULL);
+        return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+static int perf_cmp(const void *a, const void *b)
+{
+        long long x = *(const long long *)a, y = *(const long long *)b;
+
+        return x < y ? -1 : x > y;
+}
+
+static void perf_report(const char *what, long long *lat, int n)
+{
+        long long sum = 0;
+        int i;
+
+        if (!n)
+                return;
+
+        qsort(lat, n, sizeof(*lat), perf_cmp);
+        for (i = 0; i < n; i++)
+                sum += lat[i];
+
+        printf("%-9s n %6d  min %7lld  avg %7lld  p50 %7lld  "
+               "p99 %7lld  max %7lld usecs\n", what, n, lat[0], sum / n,
+               lat[n / 2], lat[(n * 99) / 100], lat[n - 1]);
+}
+
+/* 
+ * latency of each step of the protocol on a lock of our own: taking
+ * it, reasserting it the long way, renewing the cached lease, and
+ * letting go.
+ */
 static void perf_lock(char *fn, int loops)
 {
-    int sysstatus;
-    char buf[9];
-    int start = loops;
-    int lease = DEFAULT_LEASE_TIME_SECS;
-
-    sprintf(buf, "%08d", getpid());
-
-    while (loops--) {
-        sysstatus = lock(fn, buf, 0, 0, &lease, &status);
-        if (status < 0) {
-            printf("failed to get lock at iteration %d errno=%d\n", 
-                   start - loops, errno);
-            return;
-        }
-    }
-    unlock(fn, buf, 0, &status);
+        enum { ACQUIRE, REASSERT, RENEW, RELEASE, STEPS };
+        static const char *steps[STEPS] = {
+                "acquire", "reassert", "renew", "release" };
+        long long *lat[STEPS], t;
+        char buf[9], *flink;
+        int lease = DEFAULT_LEASE_TIME_SECS;
+        int status, i, n;
+
+        sprintf(buf, "%08d", getpid());
+
+        flink = create_lockfn_link(fn, LFFL_FORMAT, buf, 0);
+        if (!flink)
+                return;
+
+        for (i = 0; i < STEPS; i++) {
+                lat[i] = calloc(loops, sizeof(long long));
+                if (!lat[i]) {
+                        printf("out of memory for %d iterations\n", loops);
+                        return;
+                }
+        }
+
+        for (n = 0; n < loops; n++) {
+                t = perf_usecs();
+                lock(fn, buf, 0, 0, &lease, &status);
+                lat[ACQUIRE][n] = perf_usecs() - t;
+                if (status < 0)
+                        goto fail;
+
+                lease_drop(flink);
+                t = perf_usecs();
+                lock(fn, buf, 0, 0, &lease, &status);
+                lat[REASSERT][n] = perf_usecs() - t;
+                if (status != 1)
+                        goto fail;
+
+                t = perf_usecs();
+                lock(fn, buf, 0, 0, &lease, &status);
+                lat[RENEW][n] = perf_usecs() - t;
+                if (status != 1)
+                        goto fail;
+
+                t = perf_usecs();
+                unlock(fn, buf, 0, &status);
+                lat[RELEASE][n] = perf_usecs() - t;
+                if (status < 0)
+                        goto fail;
+        }
+
+out:
+        for (i = 0; i < STEPS; i++) {
+                perf_report(steps[i], lat[i], n);
+                free(lat[i]);
+        }
+        free(flink);
+        return;
+
+fail:
+        printf("lock protocol failed at iteration %d, status %d\n",
+               n, status);
+        unlock(fn, buf, 0, &status);
+        goto out;
 }
 
 int main(int argc, char *argv[])
@@ -906,7 +1110,7 @@ int main(int argc, char *argv[])
         } else if (!strcmp(argv[1],"r")) {
                 random_locks(argv[2]);
         } else if (!strcmp(argv[1],"p")) {
-                perf_lock(argv[2], argc < 3 ? 100000 : atoi(argv[3]));
+                perf_lock(argv[2], argc < 4 ? 1000 : atoi(argv[3]));
         } else if (!strcmp(argv[1],"l")) {
                 if (argc < 4) force = 0; else force = atoi(argv[3]);
                 if (argc < 5) readonly = 0; else readonly = atoi(argv[4]);
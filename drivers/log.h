@@ -97,6 +97,10 @@ struct log_extent {
 
 /* struct above should be 16 bytes, or 256 extents/page */
 
+/* a request reads the extent into the data area at 'offset', the
+ * response echoes it once the data is there, with a count of 0 if the
+ * read failed. A LOGCMD_KICK follows once all responses are pushed. */
+
 typedef struct log_extent log_request_t;
 typedef struct log_extent log_response_t;
 
@@ -0,0 +1,196 @@
+/*
+ * Copyright (C) Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2.1 only
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "list.h"
+#include "profile.h"
+
+/*
+ * Only its thread writes a buffer, publishing each record by bumping
+ * 'head'. Dumps copy without stopping it, and keep what was not
+ * overwritten meanwhile.
+ */
+struct td_trace_buf {
+	uint32_t                     tid;
+	uint64_t                     head;      /* records, ever */
+	uint64_t                     base;      /* head when enabled */
+	struct list_head             next;
+	struct td_trace_rec          rec[TD_TRACE_RECS];
+};
+
+int td_trace_enabled;
+
+static pthread_mutex_t td_trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(td_trace_bufs);
+static __thread struct td_trace_buf *td_trace_self;
+static __thread int td_trace_failed;
+
+static struct td_trace_buf *
+td_trace_buf_create(void)
+{
+	struct td_trace_buf *b;
+
+	b = calloc(1, sizeof(*b));
+	if (!b) {
+		td_trace_failed = 1;
+		return NULL;
+	}
+
+	b->tid = syscall(SYS_gettid);
+
+	pthread_mutex_lock(&td_trace_lock);
+	list_add_tail(&b->next, &td_trace_bufs);
+	pthread_mutex_unlock(&td_trace_lock);
+
+	td_trace_self = b;
+	return b;
+}
+
+void
+__td_trace(int point, const void *id, int op,
+	   uint64_t sec, uint32_t secs, int err)
+{
+	struct td_trace_buf *b = td_trace_self;
+	struct td_trace_rec *r;
+	struct timespec now;
+	uint64_t head;
+
+	if (__builtin_expect(!b, 0)) {
+		if (td_trace_failed)
+			return;
+		b = td_trace_buf_create();
+		if (!b)
+			return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	head     = b->head;
+	r        = &b->rec[head & (TD_TRACE_RECS - 1)];
+	r->ts    = now.tv_sec * 1000000000ULL + now.tv_nsec;
+	r->id    = (uintptr_t)id;
+	r->sec   = sec;
+	r->secs  = secs;
+	r->point = point;
+	r->op    = op;
+	r->err   = err;
+
+	__atomic_store_n(&b->head, head + 1, __ATOMIC_RELEASE);
+}
+
+void
+td_trace_set(int enabled)
+{
+	struct td_trace_buf *b;
+
+	pthread_mutex_lock(&td_trace_lock);
+
+	/* a new session starts on empty buffers */
+	if (enabled && !td_trace_enabled)
+		list_for_each_entry(b, &td_trace_bufs, next)
+			b->base = __atomic_load_n(&b->head, __ATOMIC_ACQUIRE);
+
+	td_trace_enabled = !!enabled;
+
+	pthread_mutex_unlock(&td_trace_lock);
+}
+
+static size_t
+td_trace_dump_buf(struct td_trace_buf *b, void *dst)
+{
+	struct td_trace_thread *t = dst;
+	struct td_trace_rec *out = (void *)(t + 1);
+	uint64_t start, end, first, i;
+
+	end   = __atomic_load_n(&b->head, __ATOMIC_ACQUIRE);
+	start = end > TD_TRACE_RECS ? end - TD_TRACE_RECS : 0;
+	if (start < b->base)
+		start = b->base;
+
+	for (i = start; i < end; i++)
+		out[i - start] = b->rec[i & (TD_TRACE_RECS - 1)];
+
+	/* drop the records the writer may have reused while copying */
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	first = __atomic_load_n(&b->head, __ATOMIC_RELAXED);
+	first = first >= TD_TRACE_RECS ? first - TD_TRACE_RECS + 1 : 0;
+	if (first > start) {
+		if (first > end)
+			first = end;
+		memmove(out, out + (first - start),
+			(end - first) * sizeof(*out));
+		start = first;
+	}
+
+	t->tid   = b->tid;
+	t->count = end - start;
+	t->lost  = start - b->base;
+
+	return sizeof(*t) + t->count * sizeof(*out);
+}
+
+int
+td_trace_dump(void **_buf, size_t *_len)
+{
+	struct td_trace_header *hdr;
+	struct td_trace_buf *b;
+	size_t size;
+	void *buf, *p;
+
+	pthread_mutex_lock(&td_trace_lock);
+
+	size = sizeof(*hdr);
+	list_for_each_entry(b, &td_trace_bufs, next)
+		size += sizeof(struct td_trace_thread) +
+			TD_TRACE_RECS * sizeof(struct td_trace_rec);
+
+	buf = malloc(size);
+	if (!buf) {
+		pthread_mutex_unlock(&td_trace_lock);
+		return -ENOMEM;
+	}
+
+	hdr = buf;
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->magic    = TD_TRACE_MAGIC;
+	hdr->version  = TD_TRACE_VERSION;
+	hdr->enabled  = td_trace_enabled;
+	hdr->rec_size = sizeof(struct td_trace_rec);
+
+	p = hdr + 1;
+	list_for_each_entry(b, &td_trace_bufs, next) {
+		p += td_trace_dump_buf(b, p);
+		hdr->threads++;
+	}
+
+	pthread_mutex_unlock(&td_trace_lock);
+
+	*_buf = buf;
+	*_len = p - buf;
+	return 0;
+}
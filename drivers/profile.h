@@ -1,4 +1,4 @@
-/* 
+/*
  * Copyright (C) Citrix Systems Inc.
  *
  * This program is free software; you can redistribute it and/or
@@ -18,163 +18,52 @@
 #ifndef __TAP_PROFILE_H__
 #define __TAP_PROFILE_H__
 
-#ifndef _GNU_SOURCE
-  #define _GNU_SOURCE
-#endif
-
-#include <stdio.h>
-#include <stdlib.h>
-#include <unistd.h>
-#include <string.h>
-#include <syslog.h>
-#include <sys/time.h>
-#include <time.h>
-#include <fcntl.h>
-#include <inttypes.h>
-
-//#define PROFILING
-//#define LOGGING
-
-#define TAPPROF_IN  1
-#define TAPPROF_OUT 2
+#include <stdint.h>
+#include <stddef.h>
 
-struct profile_times {
-	char    *fn_name;
-	uint64_t in, out_sum, cnt;
-};
+#include "tapdisk-trace.h"
 
-struct profile_info {
-	FILE                 *log;
-	int                   size;
-	char                 *name;
-	unsigned long long    seq;
-	struct profile_times *pt;
-};
-
-#ifdef PROFILING
-
-static inline void
-tp_open(struct profile_info *prof, char *tap_name, char *log_name, int size)
-{
-	memset(prof, 0, sizeof(struct profile_info));
-#ifdef LOGGING
-	prof->log  = fopen(log_name, "w");
-#endif
-	prof->size = size;
-	prof->name = strdup(tap_name);
-	prof->pt   = malloc(sizeof(struct profile_times) * prof->size);
-	if (prof->pt)
-		memset(prof->pt, 0, sizeof(struct profile_times) * prof->size);
-}
-
-static inline void
-tp_close(struct profile_info *prof)
-{
-	int i;
-	struct profile_times *pt;
+/*
+ * Hot-path tracepoints.
+ *
+ * Each is a USDT probe 'tapdisk:<point>' where <sys/sdt.h> is around,
+ * a nop until a tracer attaches. Independently, 'tap-ctl trace -e'
+ * has every thread log them into a ring of its own, of TD_TRACE_RECS,
+ * overwriting the oldest. Off, a tracepoint costs a load and a branch.
+ */
 
-	for (i = 0; i < prof->size; i++) {
-		pt = &prof->pt[i];
-		if (pt->fn_name) {
-			syslog(LOG_DEBUG, "%s: %s: cnt: %llu, avg time: %llu\n",
-			       prof->name, pt->fn_name, pt->cnt, 
-			       ((pt->cnt) ? (pt->out_sum / pt->cnt) : 0));
-			free(pt->fn_name);
-		}
-	}
+#define TD_TRACE_RECS            8192    /* per thread, a power of 2 */
 
-#ifdef LOGGING
-	if (prof->log)
-		fclose(prof->log);
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define TD_TRACE_PROBE(_pt, _id, _op, _sec, _secs, _err)		\
+	DTRACE_PROBE5(tapdisk, _pt, _id, _op, _sec, _secs, _err)
+#else
+#define TD_TRACE_PROBE(_pt, _id, _op, _sec, _secs, _err) ((void)0)
 #endif
-	free(prof->name);
-	if (prof->pt)
-		free(prof->pt);
-}
-
-static inline u64
-tp_get_id(struct profile_info *prof)
-{
-	return prof->seq++;
-}
-
-static inline int
-tp_fn_id(struct profile_info *prof, const char *name)
-{
-	int i;
-	struct profile_times *pt;
 
-	for (i = 0; i < prof->size; i++) {
-		pt = &prof->pt[i];
-		if (!pt->fn_name)
-			return i;
-		if (!strcmp(pt->fn_name, name))
-			return i;
-	}
+#define TD_TRACE_arrive          TD_TRACE_ARRIVE
+#define TD_TRACE_queue           TD_TRACE_QUEUE
+#define TD_TRACE_submit          TD_TRACE_SUBMIT
+#define TD_TRACE_complete        TD_TRACE_COMPLETE
+#define TD_TRACE_respond         TD_TRACE_RESPOND
 
-	return prof->size - 1;
-}
+extern int td_trace_enabled;
 
-static inline void
-__tp_in(struct profile_info *prof, const char *func)
-{
-	long long _time;
-	int idx = tp_fn_id(prof, func);
-	struct profile_times *pt = &prof->pt[idx];
+void __td_trace(int point, const void *id, int op,
+		uint64_t sec, uint32_t secs, int err);
 
-	if (!pt->fn_name) 
-		pt->fn_name = strdup(func);
+#define td_trace(_pt, _id, _op, _sec, _secs, _err)			\
+	do {								\
+		TD_TRACE_PROBE(_pt, _id, _op, _sec, _secs, _err);	\
+		if (__builtin_expect(td_trace_enabled, 0))		\
+			__td_trace(TD_TRACE_##_pt, _id, _op,		\
+				   _sec, _secs, _err);			\
+	} while (0)
 
-	asm volatile(".byte 0x0f, 0x31" : "=A" (_time));
-	pt->in = _time;
-}
+void td_trace_set(int enabled);
 
-#define tp_in(prof) __tp_in(prof, __func__)
-
-static inline void
-__tp_out(struct profile_info *prof, const char *func)	
-{
-	long long _time;
-	int idx = tp_fn_id(prof, func);
-	struct profile_times *pt = &prof->pt[idx];
-
-	if (!pt->fn_name || !pt->in)
-		return;
-
-	asm volatile(".byte 0x0f, 0x31" : "=A" (_time));
-	pt->cnt++;
-	pt->out_sum += (_time - pt->in);
-	pt->in       = 0;
-}
-
-#define tp_out(prof) __tp_out(prof, __func__)
-
-static inline void
-__tp_log(struct profile_info *prof, u64 id, const char *func, int direction)
-{
-	long long _time;
-	asm volatile(".byte 0x0f, 0x31" : "=A" (_time));
-
-	if (direction == TAPPROF_IN)
-		__tp_in(prof, func);
-	else 
-		__tp_out(prof, func);
-
-#ifdef LOGGING
-        if (prof->log)
-	        fprintf(prof->log, "%s: %s: %llu, %lld\n", func, 
-			((direction == TAPPROF_IN) ? "in" : "out"), id, _time);
-#endif
-}
-
-#define tp_log(prof, id, direction) __tp_log(prof, id, __func__, direction)
-
-#else
-#define tp_open(prof, tname, lname, size)  ((void)0)
-#define tp_close(prof)                     ((void)0)
-#define tp_in(prof)                        ((void)0)
-#define tp_out(prof)                       ((void)0)
-#define tp_log(prof, sec, direction)       ((void)0)
-#endif
+/* a dump, in the format of tapdisk-trace.h, to free() */
+int td_trace_dump(void **buf, size_t *len);
 
 #endif
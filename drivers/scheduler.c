@@ -23,6 +23,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/time.h>
 
 #include "tapdisk.h"
@@ -33,6 +34,7 @@
 #define BUG_ON(_cond)                if (_cond) td_panic()
 
 #define SCHEDULER_MAX_TIMEOUT        600
+#define SCHEDULER_MAX_READY          128
 #define SCHEDULER_POLL_FD           (SCHEDULER_POLL_READ_FD |	\
 				     SCHEDULER_POLL_WRITE_FD |	\
 				     SCHEDULER_POLL_EXCEPT_FD)
@@ -61,8 +63,251 @@ typedef struct event {
 	void                        *private;
 
 	struct list_head             next;
+	struct list_head             fd_next;	/* scheduler_fd_t events */
+	int                          heap_idx;	/* in s->timers, or -1 */
+	struct list_head             pending_next;	/* s->pending */
 } event_t;
 
+/*
+ * With epoll, the live events on each fd, and what the epoll set holds
+ * for it: the union of what they wait for, unless masked. Regular files
+ * cannot be polled with epoll; like select, we take them as always
+ * ready.
+ */
+struct scheduler_fd {
+	struct list_head             events;
+	uint32_t                     mask;
+	char                         added;
+	char                         always;
+};
+
+#define scheduler_epoll(s)          ((s)->epoll_fd >= 0)
+
+static uint32_t
+scheduler_epoll_mask(char mode)
+{
+	uint32_t mask = 0;
+
+	if (mode & SCHEDULER_POLL_READ_FD)
+		mask |= EPOLLIN;
+	if (mode & SCHEDULER_POLL_WRITE_FD)
+		mask |= EPOLLOUT;
+	if (mode & SCHEDULER_POLL_EXCEPT_FD)
+		mask |= EPOLLPRI;
+
+	return mask;
+}
+
+/* What select would have reported, for an fd epoll found ready. */
+static char
+scheduler_epoll_mode(uint32_t events)
+{
+	char mode = 0;
+
+	if (events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+		mode |= SCHEDULER_POLL_READ_FD;
+	if (events & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+		mode |= SCHEDULER_POLL_WRITE_FD;
+	if (events & EPOLLPRI)
+		mode |= SCHEDULER_POLL_EXCEPT_FD;
+
+	return mode;
+}
+
+static struct scheduler_fd *
+scheduler_get_fd(scheduler_t *s, int fd)
+{
+	struct scheduler_fd *f, **fds;
+	int n;
+
+	if (fd >= s->n_fds) {
+		n   = MAX(fd + 1, 2 * s->n_fds);
+		fds = realloc(s->fds, n * sizeof(*fds));
+		if (!fds)
+			return NULL;
+
+		memset(fds + s->n_fds, 0, (n - s->n_fds) * sizeof(*fds));
+		s->fds   = fds;
+		s->n_fds = n;
+	}
+
+	f = s->fds[fd];
+	if (!f) {
+		f = calloc(1, sizeof(*f));
+		if (!f)
+			return NULL;
+
+		INIT_LIST_HEAD(&f->events);
+		s->fds[fd] = f;
+	}
+
+	return f;
+}
+
+/* Bring the epoll set in line with the events on fd. */
+static void
+scheduler_update_fd(scheduler_t *s, int fd)
+{
+	struct scheduler_fd *f = s->fds[fd];
+	struct epoll_event ev;
+	uint32_t mask = 0;
+	event_t *event;
+	int err = 0;
+
+	list_for_each_entry(event, &f->events, fd_next)
+		if (!event->masked)
+			mask |= scheduler_epoll_mask(event->mode);
+
+	if (list_empty(&f->events))
+		f->always = 0;
+
+	if (f->always || (mask == f->mask && (f->added || !mask))) {
+		f->mask = mask;
+		return;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events  = mask;
+	ev.data.fd = fd;
+
+	if (!mask) {
+		/* gone already, if it was closed first */
+		epoll_ctl(s->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+		f->added = 0;
+	} else if (f->added)
+		err = epoll_ctl(s->epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+	else {
+		err = epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+		if (err && errno == EEXIST)
+			err = epoll_ctl(s->epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+		if (err && errno == EPERM) {
+			f->always = 1;
+			err = 0;
+		} else if (!err)
+			f->added = 1;
+	}
+
+	if (err)
+		tlog_syslog(TLOG_WARN, "scheduler: epoll_ctl on fd %d: %d\n",
+			    fd, -errno);
+
+	f->mask = mask;
+}
+
+/*
+ * Armed timeouts: a binary min-heap on deadline, holding the live,
+ * unmasked SCHEDULER_POLL_TIMEOUT events. Masked events leave the heap
+ * and return with their deadline unchanged, so an unmask after the
+ * deadline fires at once, as before.
+ */
+#define heap_parent(i)               (((i) - 1) / 2)
+#define heap_left(i)                 (2 * (i) + 1)
+
+static void
+scheduler_heap_set(scheduler_t *s, int i, event_t *event)
+{
+	s->timers[i]    = event;
+	event->heap_idx = i;
+}
+
+static void
+scheduler_heap_up(scheduler_t *s, int i)
+{
+	event_t *event = s->timers[i];
+
+	while (i > 0 &&
+	       s->timers[heap_parent(i)]->deadline > event->deadline) {
+		scheduler_heap_set(s, i, s->timers[heap_parent(i)]);
+		i = heap_parent(i);
+	}
+
+	scheduler_heap_set(s, i, event);
+}
+
+static void
+scheduler_heap_down(scheduler_t *s, int i)
+{
+	event_t *event = s->timers[i];
+	int c;
+
+	while ((c = heap_left(i)) < s->n_timers) {
+		if (c + 1 < s->n_timers &&
+		    s->timers[c + 1]->deadline < s->timers[c]->deadline)
+			c++;
+
+		if (s->timers[c]->deadline >= event->deadline)
+			break;
+
+		scheduler_heap_set(s, i, s->timers[c]);
+		i = c;
+	}
+
+	scheduler_heap_set(s, i, event);
+}
+
+static int
+scheduler_heap_insert(scheduler_t *s, event_t *event)
+{
+	if (s->n_timers == s->timers_size) {
+		int n = s->timers_size ? 2 * s->timers_size : 16;
+		event_t **timers = realloc(s->timers, n * sizeof(*timers));
+		if (!timers)
+			return -ENOMEM;
+
+		s->timers      = timers;
+		s->timers_size = n;
+	}
+
+	scheduler_heap_set(s, s->n_timers++, event);
+	scheduler_heap_up(s, event->heap_idx);
+
+	return 0;
+}
+
+static void
+scheduler_heap_remove(scheduler_t *s, event_t *event)
+{
+	int i = event->heap_idx;
+	event_t *last;
+
+	if (i < 0)
+		return;
+
+	event->heap_idx = -1;
+	last = s->timers[--s->n_timers];
+	if (last == event)
+		return;
+
+	scheduler_heap_set(s, i, last);
+	scheduler_heap_up(s, i);
+	scheduler_heap_down(s, last->heap_idx);
+}
+
+/* Put a timeout back in the heap, if it should be there. */
+static void
+scheduler_heap_arm(scheduler_t *s, event_t *event)
+{
+	if (!(event->mode & SCHEDULER_POLL_TIMEOUT) ||
+	    event->dead || event->masked)
+		return;
+
+	if (event->heap_idx >= 0) {
+		scheduler_heap_up(s, event->heap_idx);
+		scheduler_heap_down(s, event->heap_idx);
+	} else if (scheduler_heap_insert(s, event))
+		/* found again on the next unmask or callback */
+		tlog_syslog(TLOG_WARN, "scheduler: no memory to arm "
+			    "timeout for event %d\n", event->id);
+}
+
+static void
+scheduler_set_pending(scheduler_t *s, event_t *event, char mode)
+{
+	event->pending |= mode;
+	if (list_empty(&event->pending_next))
+		list_add_tail(&event->pending_next, &s->pending);
+}
+
 static void
 scheduler_prepare_events(scheduler_t *s)
 {
@@ -70,15 +315,33 @@ scheduler_prepare_events(scheduler_t *s)
 	struct timeval now;
 	event_t *event;
 
-	FD_ZERO(&s->read_fds);
-	FD_ZERO(&s->write_fds);
-	FD_ZERO(&s->except_fds);
-
 	s->max_fd  = -1;
 	s->timeout = SCHEDULER_MAX_TIMEOUT;
 
 	gettimeofday(&now, NULL);
 
+	if (s->n_timers) {
+		event = s->timers[0];
+
+		diff = event->deadline - now.tv_sec;
+		if (diff > 0)
+			s->timeout = MIN(s->timeout, diff);
+		else
+			s->timeout = 0;
+	}
+
+	s->timeout = MIN(s->timeout, s->max_timeout);
+}
+
+static void
+scheduler_prepare_fds(scheduler_t *s)
+{
+	event_t *event;
+
+	FD_ZERO(&s->read_fds);
+	FD_ZERO(&s->write_fds);
+	FD_ZERO(&s->except_fds);
+
 	scheduler_for_each_event(s, event) {
 		if (event->masked || event->dead)
 			continue;
@@ -97,17 +360,7 @@ scheduler_prepare_events(scheduler_t *s)
 			FD_SET(event->fd, &s->except_fds);
 			s->max_fd = MAX(event->fd, s->max_fd);
 		}
-
-		if (event->mode & SCHEDULER_POLL_TIMEOUT) {
-			diff = event->deadline - now.tv_sec;
-			if (diff > 0)
-				s->timeout = MIN(s->timeout, diff);
-			else
-				s->timeout = 0;
-		}
 	}
-
-	s->timeout = MIN(s->timeout, s->max_timeout);
 }
 
 static int
@@ -125,21 +378,21 @@ scheduler_check_fd_events(scheduler_t *s, int nfds)
 		if ((event->mode & SCHEDULER_POLL_READ_FD) &&
 		    FD_ISSET(event->fd, &s->read_fds)) {
 			FD_CLR(event->fd, &s->read_fds);
-			event->pending |= SCHEDULER_POLL_READ_FD;
+			scheduler_set_pending(s, event, SCHEDULER_POLL_READ_FD);
 			--nfds;
 		}
 
 		if ((event->mode & SCHEDULER_POLL_WRITE_FD) &&
 		    FD_ISSET(event->fd, &s->write_fds)) {
 			FD_CLR(event->fd, &s->write_fds);
-			event->pending |= SCHEDULER_POLL_WRITE_FD;
+			scheduler_set_pending(s, event, SCHEDULER_POLL_WRITE_FD);
 			--nfds;
 		}
 
 		if ((event->mode & SCHEDULER_POLL_EXCEPT_FD) &&
 		    FD_ISSET(event->fd, &s->except_fds)) {
 			FD_CLR(event->fd, &s->except_fds);
-			event->pending |= SCHEDULER_POLL_EXCEPT_FD;
+			scheduler_set_pending(s, event, SCHEDULER_POLL_EXCEPT_FD);
 			--nfds;
 		}
 	}
@@ -147,51 +400,85 @@ scheduler_check_fd_events(scheduler_t *s, int nfds)
 	return nfds;
 }
 
+/* Hand what epoll found to every live event waiting for it. */
 static void
-scheduler_check_timeouts(scheduler_t *s)
+scheduler_check_epoll_events(scheduler_t *s, struct epoll_event *ev,
+			     int nfds)
 {
-	struct timeval now;
+	struct scheduler_fd *f;
 	event_t *event;
+	char mode;
+	int i;
+
+	for (i = 0; i < nfds; i++) {
+		f    = s->fds[ev[i].data.fd];
+		mode = scheduler_epoll_mode(ev[i].events);
+
+		list_for_each_entry(event, &f->events, fd_next)
+			if (!event->masked && (event->mode & mode))
+				scheduler_set_pending(s, event,
+						      event->mode & mode &
+						      SCHEDULER_POLL_FD);
+	}
+}
 
-	gettimeofday(&now, NULL);
-
-	scheduler_for_each_event(s, event) {
-		BUG_ON(event->pending && event->masked);
-
-		if (event->dead)
-			continue;
-
-		if (event->pending)
-			continue;
+/* Like select does for them, report regular files ready each time. */
+static int
+scheduler_check_always(scheduler_t *s, int mark)
+{
+	struct scheduler_fd *f;
+	event_t *event;
+	int fd, n = 0;
 
-		if (!(event->mode & SCHEDULER_POLL_TIMEOUT))
+	for (fd = 0; fd < s->n_fds; fd++) {
+		f = s->fds[fd];
+		if (!f || !f->always || !f->mask)
 			continue;
 
-		if (event->deadline > now.tv_sec)
+		n++;
+		if (!mark)
 			continue;
 
-		event->pending = SCHEDULER_POLL_TIMEOUT;
+		list_for_each_entry(event, &f->events, fd_next)
+			if (!event->masked)
+				scheduler_set_pending(s, event,
+						      event->mode &
+						      SCHEDULER_POLL_FD);
 	}
+
+	return n;
 }
 
-static int
-scheduler_check_events(scheduler_t *s, int nfds)
+static void
+scheduler_check_timeouts(scheduler_t *s)
 {
-	if (nfds)
-		nfds = scheduler_check_fd_events(s, nfds);
+	struct timeval now;
+	event_t *event;
 
-	scheduler_check_timeouts(s);
+	gettimeofday(&now, NULL);
 
-	return nfds;
+	/* the callback re-arms them */
+	while (s->n_timers && s->timers[0]->deadline <= now.tv_sec) {
+		event = s->timers[0];
+		scheduler_heap_remove(s, event);
+
+		BUG_ON(event->pending && event->masked);
+
+		if (event->pending)
+			continue;
+
+		scheduler_set_pending(s, event, SCHEDULER_POLL_TIMEOUT);
+	}
 }
 
 static void
-scheduler_event_callback(event_t *event, char mode)
+scheduler_event_callback(scheduler_t *s, event_t *event, char mode)
 {
 	if (event->mode & SCHEDULER_POLL_TIMEOUT) {
 		struct timeval now;
 		gettimeofday(&now, NULL);
 		event->deadline = now.tv_sec + event->timeout;
+		scheduler_heap_arm(s, event);
 	}
 
 	if (!event->masked)
@@ -204,19 +491,21 @@ scheduler_run_events(scheduler_t *s)
 	event_t *event;
 	int n_dispatched = 0;
 
-	scheduler_for_each_event(s, event) {
+	while (!list_empty(&s->pending)) {
 		char pending;
 
-		if (event->dead)
-			continue;
+		event = list_entry(s->pending.next, event_t, pending_next);
+		list_del_init(&event->pending_next);
 
 		pending = event->pending;
-		if (pending) {
-			event->pending = 0;
-			/* NB. must clear before cb */
-			scheduler_event_callback(event, pending);
-			n_dispatched++;
-		}
+		event->pending = 0;
+		/* NB. must clear before cb */
+
+		if (event->dead || !pending)
+			continue;
+
+		scheduler_event_callback(s, event, pending);
+		n_dispatched++;
 	}
 
 	return n_dispatched;
@@ -235,6 +524,13 @@ scheduler_register_event(scheduler_t *s, char mode, int fd,
 	if (!(mode & SCHEDULER_POLL_TIMEOUT) && !(mode & SCHEDULER_POLL_FD))
 		return -EINVAL;
 
+	if ((mode & SCHEDULER_POLL_FD) && fd < 0)
+		return -EINVAL;
+
+	if ((mode & SCHEDULER_POLL_FD) && !scheduler_epoll(s) &&
+	    fd >= FD_SETSIZE)
+		return -EMFILE;
+
 	event = calloc(1, sizeof(event_t));
 	if (!event)
 		return -ENOMEM;
@@ -242,6 +538,8 @@ scheduler_register_event(scheduler_t *s, char mode, int fd,
 	gettimeofday(&now, NULL);
 
 	INIT_LIST_HEAD(&event->next);
+	INIT_LIST_HEAD(&event->fd_next);
+	INIT_LIST_HEAD(&event->pending_next);
 
 	event->mode     = mode;
 	event->fd       = fd;
@@ -251,10 +549,32 @@ scheduler_register_event(scheduler_t *s, char mode, int fd,
 	event->private  = private;
 	event->id       = s->uuid++;
 	event->masked   = 0;
+	event->heap_idx = -1;
 
 	if (!s->uuid)
 		s->uuid++;
 
+	if ((mode & SCHEDULER_POLL_FD) && scheduler_epoll(s)) {
+		struct scheduler_fd *f = scheduler_get_fd(s, fd);
+		if (!f) {
+			free(event);
+			return -ENOMEM;
+		}
+
+		list_add_tail(&event->fd_next, &f->events);
+		scheduler_update_fd(s, fd);
+	}
+
+	if ((mode & SCHEDULER_POLL_TIMEOUT) &&
+	    scheduler_heap_insert(s, event)) {
+		if (!list_empty(&event->fd_next)) {
+			list_del(&event->fd_next);
+			scheduler_update_fd(s, fd);
+		}
+		free(event);
+		return -ENOMEM;
+	}
+
 	list_add_tail(&event->next, &s->events);
 
 	return event->id;
@@ -269,8 +589,14 @@ scheduler_unregister_event(scheduler_t *s, event_id_t id)
 		return;
 
 	scheduler_for_each_event(s, event)
-		if (event->id == id) {
+		if (event->id == id && !event->dead) {
 			event->dead = 1;
+			s->n_dead++;
+			scheduler_heap_remove(s, event);
+			if (!list_empty(&event->fd_next)) {
+				list_del_init(&event->fd_next);
+				scheduler_update_fd(s, event->fd);
+			}
 			break;
 		}
 }
@@ -286,6 +612,12 @@ scheduler_mask_event(scheduler_t *s, event_id_t id, int masked)
 	scheduler_for_each_event(s, event)
 		if (event->id == id) {
 			event->masked = !!masked;
+			if (event->masked)
+				scheduler_heap_remove(s, event);
+			else
+				scheduler_heap_arm(s, event);
+			if (!list_empty(&event->fd_next))
+				scheduler_update_fd(s, event->fd);
 			break;
 		}
 }
@@ -295,11 +627,17 @@ scheduler_gc_events(scheduler_t *s)
 {
 	event_t *event, *next;
 
+	if (!s->n_dead)
+		return;
+
 	scheduler_for_each_event_safe(s, event, next)
 		if (event->dead) {
 			list_del(&event->next);
+			list_del(&event->pending_next);
 			free(event);
 		}
+
+	s->n_dead = 0;
 }
 
 void
@@ -309,11 +647,52 @@ scheduler_set_max_timeout(scheduler_t *s, int timeout)
 		s->max_timeout = MIN(s->max_timeout, timeout);
 }
 
+static int
+scheduler_wait_select(scheduler_t *s)
+{
+	struct timeval tv;
+	int ret;
+
+	scheduler_prepare_fds(s);
+
+	tv.tv_sec  = s->timeout;
+	tv.tv_usec = 0;
+
+	ret = select(s->max_fd + 1, &s->read_fds,
+		     &s->write_fds, &s->except_fds, &tv);
+	if (ret < 0)
+		return ret;
+
+	ret = scheduler_check_fd_events(s, ret);
+	BUG_ON(ret);
+
+	return 0;
+}
+
+static int
+scheduler_wait_epoll(scheduler_t *s)
+{
+	struct epoll_event ev[SCHEDULER_MAX_READY];
+	int ret, timeout;
+
+	timeout = s->timeout * 1000;
+	if (scheduler_check_always(s, 0))
+		timeout = 0;
+
+	ret = epoll_wait(s->epoll_fd, ev, SCHEDULER_MAX_READY, timeout);
+	if (ret < 0)
+		return ret;
+
+	scheduler_check_epoll_events(s, ev, ret);
+	scheduler_check_always(s, 1);
+
+	return 0;
+}
+
 int
 scheduler_wait_for_events(scheduler_t *s)
 {
 	int ret;
-	struct timeval tv;
 
 	s->depth++;
 	ret = 0;
@@ -326,20 +705,18 @@ scheduler_wait_for_events(scheduler_t *s)
 
 	scheduler_prepare_events(s);
 
-	tv.tv_sec  = s->timeout;
-	tv.tv_usec = 0;
-
 	DBG("timeout: %d, max_timeout: %d\n",
 	    s->timeout, s->max_timeout);
 
-	ret = select(s->max_fd + 1, &s->read_fds,
-		     &s->write_fds, &s->except_fds, &tv);
+	if (scheduler_epoll(s))
+		ret = scheduler_wait_epoll(s);
+	else
+		ret = scheduler_wait_select(s);
 
 	if (ret < 0)
 		goto out;
 
-	ret = scheduler_check_events(s, ret);
-	BUG_ON(ret);
+	scheduler_check_timeouts(s);
 
 	s->timeout     = SCHEDULER_MAX_TIMEOUT;
 	s->max_timeout = SCHEDULER_MAX_TIMEOUT;
@@ -368,4 +745,20 @@ scheduler_initialize(scheduler_t *s)
 	FD_ZERO(&s->except_fds);
 
 	INIT_LIST_HEAD(&s->events);
+	INIT_LIST_HEAD(&s->pending);
+
+	/* select() is the fallback, capped at FD_SETSIZE */
+	s->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (s->epoll_fd < 0)
+		tlog_syslog(TLOG_WARN, "scheduler: no epoll (%d), "
+			    "falling back to select\n", -errno);
+}
+
+/* Once its events are gone, for a scheduler not waited on again. */
+void
+scheduler_release(scheduler_t *s)
+{
+	if (s->epoll_fd >= 0)
+		close(s->epoll_fd);
+	s->epoll_fd = -1;
 }
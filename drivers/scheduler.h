@@ -36,15 +36,25 @@ typedef struct scheduler {
 	fd_set                       except_fds;
 
 	struct list_head             events;
+	struct event               **timers;	/* min-heap on deadline */
+	int                          n_timers;
+	int                          timers_size;
+	struct list_head             pending;
+
+	int                          epoll_fd;
+	struct scheduler_fd        **fds;
+	int                          n_fds;
 
 	int                          uuid;
 	int                          max_fd;
 	int                          timeout;
 	int                          max_timeout;
 	int                          depth;
+	int                          n_dead;
 } scheduler_t;
 
 void scheduler_initialize(scheduler_t *);
+void scheduler_release(scheduler_t *);
 event_id_t scheduler_register_event(scheduler_t *, char mode,
 				    int fd, int timeout,
 				    event_cb_t cb, void *private);
@@ -29,12 +29,14 @@
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <time.h>
 
 #include "blktap.h"
 #include "tapdisk-vbd.h"
 #include "tapdisk-blktap.h"
 #include "tapdisk-server.h"
 #include "linux-blktap.h"
+#include "profile.h"
 
 #define BUG(_cond)       td_panic()
 #define BUG_ON(_cond)    if (unlikely(_cond)) { td_panic(); }
@@ -60,13 +62,19 @@
 #define BLKTAP_GET_REQUEST(_tap, _idx) \
 	(&(_tap)->sring->entry[(_idx) % BLKTAP_RING_SIZE].req)
 
+#define tapdisk_blktap_indirect(_tap) \
+	((_tap)->features & BLKTAP_FEATURE_INDIRECT)
+#define tapdisk_blktap_persistent(_tap) \
+	((_tap)->features & BLKTAP_FEATURE_PERSISTENT)
+
 static void __tapdisk_blktap_close(td_blktap_t *);
 
 struct td_blktap_req {
 	td_vbd_request_t        vreq;
 	unsigned int            id;
+	uint8_t                 operation;
 	char                    name[16];
-	struct td_iovec         iov[BLKTAP_SEGMENT_MAX];
+	struct td_iovec        *iov;
 };
 
 td_blktap_req_t *
@@ -99,6 +107,11 @@ tapdisk_blktap_reqs_free(td_blktap_t *tap)
 		free(tap->reqs_free);
 		tap->reqs_free = NULL;
 	}
+
+	if (tap->iovs) {
+		free(tap->iovs);
+		tap->iovs = NULL;
+	}
 }
 
 static int
@@ -118,6 +131,12 @@ tapdisk_blktap_reqs_init(td_blktap_t *tap, int n_reqs)
 		goto fail;
 	}
 
+	tap->iovs = malloc(n_reqs * tap->seg_max * sizeof(struct td_iovec));
+	if (!tap->iovs) {
+		err = -errno;
+		goto fail;
+	}
+
 	tap->n_reqs      = n_reqs;
 	tap->n_reqs_free = 0;
 
@@ -209,10 +228,19 @@ tapdisk_blktap_put_response(td_blktap_t *tap,
 	case TD_OP_WRITE:
 		op = BLKTAP_OP_WRITE;
 		break;
+	case TD_OP_DISCARD:
+		op = BLKTAP_OP_DISCARD;
+		break;
+	case TD_OP_FLUSH:
+		op = BLKTAP_OP_FLUSH;
+		break;
 	default:
 		BUG();
 	}
 
+	if (req->operation == BLKTAP_OP_INDIRECT)
+		op = BLKTAP_OP_INDIRECT;
+
 	rsp->id        = req->id;
 	rsp->operation = op;
 	rsp->status    = tapdisk_blktap_error_status(tap, error);
@@ -225,6 +253,8 @@ tapdisk_blktap_complete_request(td_blktap_t *tap,
 				td_blktap_req_t *req, int error,
 				int final)
 {
+	td_trace(respond, &req->vreq, req->vreq.op, req->vreq.sec, 0, error);
+
 	if (likely(tap->vma))
 		tapdisk_blktap_put_response(tap, req, error, final);
 
@@ -241,9 +271,10 @@ __tapdisk_blktap_request_cb(td_vbd_request_t *vreq, int error,
 	tapdisk_blktap_complete_request(tap, req, error, final);
 }
 
-static void
+static int
 tapdisk_blktap_vector_request(td_blktap_t *tap,
-			      const blktap_ring_req_t *msg,
+			      const struct blktap_segment *segs,
+			      int nr_segments, td_sector_t sector,
 			      td_blktap_req_t *req)
 {
 	td_vbd_request_t *vreq = &req->vreq;
@@ -257,10 +288,16 @@ tapdisk_blktap_vector_request(td_blktap_t *tap,
 	last  = NULL;
 
 	page  = tap->vstart;
-	page += msg->id * BLKTAP_SEGMENT_MAX * BLKTAP_PAGE_SIZE;
+	page += req->id * tap->seg_max * BLKTAP_PAGE_SIZE;
 
-	for (i = 0; i < msg->nr_segments; i++) {
-		seg  = &msg->seg[i];
+	for (i = 0; i < nr_segments; i++) {
+		seg  = &segs[i];
+
+		if (tapdisk_blktap_persistent(tap)) {
+			if (seg->page >= tap->pool_pages)
+				return -EINVAL;
+			page = tap->vstart + seg->page * BLKTAP_PAGE_SIZE;
+		}
 
 		next = page + (seg->first_sect << SECTOR_SHIFT);
 		size = seg->last_sect - seg->first_sect + 1;
@@ -278,7 +315,32 @@ tapdisk_blktap_vector_request(td_blktap_t *tap,
 
 	vreq->iov    = req->iov;
 	vreq->iovcnt = iov - req->iov + 1;
-	vreq->sec    = msg->sector_number;
+	vreq->sec    = sector;
+
+	return 0;
+}
+
+static int
+tapdisk_blktap_parse_discard(td_blktap_t *tap,
+			     const blktap_ring_req_t *msg, td_blktap_req_t *req)
+{
+	const struct blktap_ring_request_discard *discard;
+	td_vbd_request_t *vreq = &req->vreq;
+
+	discard = (const struct blktap_ring_request_discard *)msg;
+
+	if (!discard->nr_sectors || discard->nr_sectors > INT_MAX)
+		return -EINVAL;
+
+	req->iov[0].base = NULL;
+	req->iov[0].secs = discard->nr_sectors;
+
+	vreq->op     = TD_OP_DISCARD;
+	vreq->iov    = req->iov;
+	vreq->iovcnt = 1;
+	vreq->sec    = discard->sector_number;
+
+	return 0;
 }
 
 static int
@@ -286,11 +348,53 @@ tapdisk_blktap_parse_request(td_blktap_t *tap,
 			     const blktap_ring_req_t *msg, td_blktap_req_t *req)
 {
 	td_vbd_request_t *vreq = &req->vreq;
-	int op, err = -EINVAL;
+	const struct blktap_ring_request_indirect *ind;
+	const struct blktap_segment *segs;
+	int op, operation, nr_segments, seg_max, err = -EINVAL;
 
 	memset(req, 0, sizeof(*req));
 
-	switch (msg->operation) {
+	if (msg->id >= BLKTAP_RING_SIZE)
+		goto fail;
+
+	req->id        = msg->id;
+	req->operation = msg->operation;
+	req->iov       = tap->iovs + req->id * tap->seg_max;
+	snprintf(req->name, sizeof(req->name),
+		 "tap-%d.%d", tap->minor, req->id);
+
+	vreq->name  = req->name;
+	vreq->token = tap;
+	vreq->cb    = __tapdisk_blktap_request_cb;
+
+	if (msg->operation == BLKTAP_OP_DISCARD)
+		return tapdisk_blktap_parse_discard(tap, msg, req);
+
+	if (msg->operation == BLKTAP_OP_FLUSH) {
+		vreq->op     = TD_OP_FLUSH;
+		vreq->iov    = req->iov;
+		vreq->iovcnt = 0;
+		vreq->sec    = 0;
+		return 0;
+	}
+
+	operation   = msg->operation;
+	nr_segments = msg->nr_segments;
+	segs        = msg->seg;
+	seg_max     = BLKTAP_SEGMENT_MAX;
+
+	if (operation == BLKTAP_OP_INDIRECT) {
+		if (!tapdisk_blktap_indirect(tap))
+			goto fail;
+
+		ind         = (const struct blktap_ring_request_indirect *)msg;
+		operation   = ind->indirect_op;
+		nr_segments = ind->nr_segments;
+		segs        = tap->vdesc + msg->id * BLKTAP_PAGE_SIZE;
+		seg_max     = tap->seg_max;
+	}
+
+	switch (operation) {
 	case BLKTAP_OP_READ:
 		op = TD_OP_READ;
 		break;
@@ -301,25 +405,13 @@ tapdisk_blktap_parse_request(td_blktap_t *tap,
 		goto fail;
 	}
 
-	if (msg->id > BLKTAP_RING_SIZE)
-		goto fail;
-
-	if (msg->nr_segments < 1 ||
-	    msg->nr_segments > BLKTAP_SEGMENT_MAX)
+	if (nr_segments < 1 || nr_segments > seg_max)
 		goto fail;
 
-	req->id = msg->id;
-	snprintf(req->name, sizeof(req->name),
-		 "tap-%d.%d", tap->minor, req->id);
-
-	vreq->op    = op;
-	vreq->name  = req->name;
-	vreq->token = tap;
-	vreq->cb    = __tapdisk_blktap_request_cb;
-
-	tapdisk_blktap_vector_request(tap, msg, req);
+	vreq->op = op;
 
-	err = 0;
+	err = tapdisk_blktap_vector_request(tap, segs, nr_segments,
+					    msg->sector_number, req);
 fail:
 	return err;
 }
@@ -365,13 +457,122 @@ fail_ring:
 	__tapdisk_blktap_close(tap);
 }
 
+/*
+ * Busy-polling. After the ring delivered requests, a zero timeout
+ * keeps the event loop from sleeping, and each iteration checks
+ * req_prod until poll_us passed without new requests. Requests found
+ * by polling double the window (up to poll_max_us), an idle window
+ * halves it, so an idle VBD goes back to waiting on kicks cheaply.
+ */
+
+static uint64_t
+tapdisk_blktap_now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void
+tapdisk_blktap_poll_stop(td_blktap_t *tap)
+{
+	if (tap->poll_event >= 0) {
+		tapdisk_server_unregister_event(tap->poll_event);
+		tap->poll_event = -1;
+	}
+}
+
+static void tapdisk_blktap_poll_event(event_id_t, char, void *);
+
+static void
+tapdisk_blktap_poll_start(td_blktap_t *tap)
+{
+	event_id_t id;
+
+	tap->poll_deadline = tapdisk_blktap_now_us() + tap->poll_us;
+
+	if (tap->poll_event >= 0)
+		return;
+
+	id = tapdisk_server_register_event(SCHEDULER_POLL_TIMEOUT,
+					   -1, 0,
+					   tapdisk_blktap_poll_event, tap);
+	if (id < 0) {
+		WARN("poll event: %d", id);
+		return;
+	}
+
+	tap->poll_event = id;
+}
+
+static int
+tapdisk_blktap_ring_pending(td_blktap_t *tap)
+{
+	return __atomic_load_n(&tap->sring->req_prod, __ATOMIC_ACQUIRE) !=
+		tap->req_cons;
+}
+
+static void
+tapdisk_blktap_poll_event(event_id_t id, char mode, void *data)
+{
+	td_blktap_t *tap = data;
+
+	if (tap->fd >= 0 && tapdisk_blktap_ring_pending(tap)) {
+		tap->stats.poll.hits++;
+
+		tap->poll_us = tap->poll_us * 2;
+		if (tap->poll_us > tap->poll_max_us)
+			tap->poll_us = tap->poll_max_us;
+
+		tapdisk_blktap_get_requests(tap);
+		if (tap->fd >= 0)
+			tapdisk_blktap_poll_start(tap);
+		return;
+	}
+
+	if (tap->fd >= 0 && tapdisk_blktap_now_us() < tap->poll_deadline)
+		return;
+
+	tap->stats.poll.idle++;
+
+	tap->poll_us = tap->poll_us / 2;
+	if (tap->poll_us < TD_BLKTAP_POLL_MIN_US)
+		tap->poll_us = TD_BLKTAP_POLL_MIN_US;
+
+	tapdisk_blktap_poll_stop(tap);
+}
+
+int
+tapdisk_blktap_set_poll(td_blktap_t *tap, unsigned int max_us)
+{
+	if (max_us && (max_us < TD_BLKTAP_POLL_MIN_US ||
+		       max_us > TD_BLKTAP_POLL_MAX_US))
+		return -EINVAL;
+
+	tap->poll_max_us = max_us;
+	tap->poll_us     = max_us;
+
+	if (!max_us)
+		tapdisk_blktap_poll_stop(tap);
+
+	INFO("busy-poll: %s, up to %uus", max_us ? "on" : "off", max_us);
+
+	return 0;
+}
+
 static void
 tapdisk_blktap_fd_event(event_id_t id, char mode, void *data)
 {
 	td_blktap_t *tap = data;
+	unsigned int cons = tap->req_cons;
 
 	tap->stats.kicks.in++;
 	tapdisk_blktap_get_requests(tap);
+
+	if (tap->poll_max_us && tap->fd >= 0 && tap->req_cons != cons)
+		tapdisk_blktap_poll_start(tap);
 }
 
 int
@@ -428,10 +629,16 @@ tapdisk_blktap_create_device(td_blktap_t *tap,
 
 	flags  = 0;
 	flags |= rdonly ? BLKTAP_DEVICE_RO : 0;
+	if (!rdonly) {
+		if (tapdisk_vbd_discard_supported(tap->vbd))
+			flags |= BLKTAP_DEVICE_DISCARD;
+		if (tapdisk_vbd_flush_supported(tap->vbd))
+			flags |= BLKTAP_DEVICE_FLUSH;
+	}
 
 	bdi.capacity             = info->size;
 	bdi.sector_size          = info->sector_size;
-	bdi.physical_sector_size = info->sector_size;
+	bdi.physical_sector_size = info->physical_sector_size;
 	bdi.flags                = flags;
 
 	INFO("bdev: capacity=%llu sector_size=%u/%u flags=%#lx",
@@ -458,15 +665,100 @@ tapdisk_blktap_unmap(td_blktap_t *tap)
 	}
 }
 
+/*
+ * Offer the whole data area as the persistent pool. A kernel that
+ * shrinks it still gets the same mapping, it just leaves the tail
+ * unused.
+ */
+static int
+tapdisk_blktap_pool(td_blktap_t *tap)
+{
+	struct blktap_pool_info pool;
+	unsigned int pages;
+	int err;
+
+	pages = BLKTAP_RING_SIZE * tap->seg_max;
+
+	memset(&pool, 0, sizeof(pool));
+	pool.pages = pages;
+
+	err = ioctl(tap->fd, BLKTAP_IOCTL_POOL, &pool);
+	if (err)
+		return -errno;
+
+	if (!pool.pages || pool.pages > pages)
+		return -EINVAL;
+
+	tap->pool_pages = pool.pages;
+
+	return 0;
+}
+
+/*
+ * Ask for indirect requests and persistent mappings. Kernels without
+ * the ioctl only do BLKTAP_SEGMENT_MAX segments, mapped per request.
+ * Fails only if the kernel keeps a feature we cannot use: the ring
+ * layout would no longer match.
+ */
+static int
+tapdisk_blktap_features(td_blktap_t *tap)
+{
+	unsigned long features;
+	int err;
+
+	features = BLKTAP_FEATURE_INDIRECT | BLKTAP_FEATURE_PERSISTENT;
+
+	err = ioctl(tap->fd, BLKTAP_IOCTL_FEATURES, &features);
+	if (err) {
+		err = -errno;
+		if (err != -ENOTTY && err != -ENOIOCTLCMD && err != -EINVAL)
+			WARN("features ioctl: %d", err);
+		features = 0;
+	}
+
+	tap->features = features;
+	tap->seg_max  = (tapdisk_blktap_indirect(tap) ?
+			 BLKTAP_INDIRECT_SEGMENT_MAX : BLKTAP_SEGMENT_MAX);
+
+	if (tapdisk_blktap_persistent(tap)) {
+		err = tapdisk_blktap_pool(tap);
+		if (err) {
+			WARN("persistent pool: %d", err);
+
+			/* take the feature back, the kernel granted it */
+			features &= ~BLKTAP_FEATURE_PERSISTENT;
+			err = ioctl(tap->fd, BLKTAP_IOCTL_FEATURES, &features);
+			if (err) {
+				err = -errno;
+				ERR(err, "cannot drop persistent mappings");
+				return err;
+			}
+
+			tap->features = features;
+			tap->seg_max  = (tapdisk_blktap_indirect(tap) ?
+					 BLKTAP_INDIRECT_SEGMENT_MAX :
+					 BLKTAP_SEGMENT_MAX);
+		}
+	}
+
+	INFO("ring: features=%#lx segments=%u pool=%u",
+	     tap->features, tap->seg_max, tap->pool_pages);
+
+	return 0;
+}
+
 static int
 tapdisk_blktap_map(td_blktap_t *tap)
 {
 	int prot, flags, err;
+	size_t desc;
 	void *vma;
 
+	desc = tapdisk_blktap_indirect(tap) ? 1 : 0;
+
 	tap->vma_size =
 		1 + (BLKTAP_RING_SIZE *
-		     BLKTAP_SEGMENT_MAX * BLKTAP_PAGE_SIZE);
+		     (tap->seg_max + desc) * BLKTAP_PAGE_SIZE);
 
 	prot  = PROT_READ | PROT_WRITE;
 	flags = MAP_SHARED;
@@ -479,6 +771,9 @@ tapdisk_blktap_map(td_blktap_t *tap)
 
 	tap->vma    = vma;
 	tap->vstart = vma + BLKTAP_PAGE_SIZE;
+	tap->vdesc  = (desc ?
+		       tap->vstart + BLKTAP_RING_SIZE *
+		       tap->seg_max * BLKTAP_PAGE_SIZE : NULL);
 
 	tap->req_cons     = 0;
 	tap->rsp_prod_pvt = 0;
@@ -506,6 +801,8 @@ __tapdisk_blktap_close(td_blktap_t *tap)
 		tap->event_id = -1;
 	}
 
+	tapdisk_blktap_poll_stop(tap);
+
 	tapdisk_blktap_unmap(tap);
 
 	if (tap->fd >= 0) {
@@ -538,6 +835,7 @@ tapdisk_blktap_open(const char *devname, td_vbd_t *vbd, td_blktap_t **_tap)
 	memset(tap, 0, sizeof(*tap));
 	tap->fd = -1;
 	tap->event_id = -1;
+	tap->poll_event = -1;
 
 	tap->fd = open(devname, O_RDWR);
 	if (tap->fd < 0) {
@@ -554,6 +852,10 @@ tapdisk_blktap_open(const char *devname, td_vbd_t *vbd, td_blktap_t **_tap)
 	tap->vbd   = vbd;
 	tap->minor = minor(st.st_rdev);
 
+	err = tapdisk_blktap_features(tap);
+	if (err)
+		goto fail;
+
 	err = tapdisk_blktap_map(tap);
 	if (err)
 		goto fail;
@@ -588,6 +890,8 @@ void
 tapdisk_blktap_stats(td_blktap_t *tap, td_stats_t *st)
 {
 	tapdisk_stats_field(st, "minor", "d", tap->minor);
+	tapdisk_stats_field(st, "segments", "u", tap->seg_max);
+	tapdisk_stats_field(st, "pool", "u", tap->pool_pages);
 
 	tapdisk_stats_field(st, "reqs", "[");
 	tapdisk_stats_val(st, "llu", tap->stats.reqs.in);
@@ -598,4 +902,11 @@ tapdisk_blktap_stats(td_blktap_t *tap, td_stats_t *st)
 	tapdisk_stats_val(st, "llu", tap->stats.kicks.in);
 	tapdisk_stats_val(st, "llu", tap->stats.kicks.out);
 	tapdisk_stats_leave(st, ']');
+
+	tapdisk_stats_field(st, "poll", "{");
+	tapdisk_stats_field(st, "max_us", "u", tap->poll_max_us);
+	tapdisk_stats_field(st, "window_us", "u", tap->poll_us);
+	tapdisk_stats_field(st, "hits", "llu", tap->stats.poll.hits);
+	tapdisk_stats_field(st, "idle", "llu", tap->stats.poll.idle);
+	tapdisk_stats_leave(st, '}');
 }
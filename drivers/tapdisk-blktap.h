@@ -34,8 +34,16 @@ struct td_blktap_stats {
 		unsigned long long      in;
 		unsigned long long      out;
 	} kicks;
+	struct {
+		unsigned long long      hits;
+		unsigned long long      idle;
+	} poll;
 };
 
+/* busy-poll window bounds, in usecs */
+#define TD_BLKTAP_POLL_MIN_US   5
+#define TD_BLKTAP_POLL_MAX_US   10000
+
 struct td_blktap {
 	int                     minor;
 	td_vbd_t               *vbd;
@@ -50,10 +58,20 @@ struct td_blktap {
 	unsigned int            rsp_prod_pvt;
 
 	int                     event_id;
+	int                     poll_event;
+	unsigned int            poll_max_us;
+	unsigned int            poll_us;
+	uint64_t                poll_deadline;
 	void                   *vstart;
+	void                   *vdesc;
+
+	unsigned long           features;
+	unsigned int            seg_max;
+	unsigned int            pool_pages;
 
 	int                     n_reqs;
 	td_blktap_req_t        *reqs;
+	struct td_iovec        *iovs;
 	int                     n_reqs_free;
 	td_blktap_req_t       **reqs_free;
 
@@ -69,5 +87,6 @@ int tapdisk_blktap_create_device(td_blktap_t *, const td_disk_info_t *, int ro);
 int tapdisk_blktap_remove_device(td_blktap_t *);
 
 void tapdisk_blktap_stats(td_blktap_t *, td_stats_t *);
+int tapdisk_blktap_set_poll(td_blktap_t *, unsigned int max_us);
 
 #endif /* _TAPDISK_BLKTAP_H_ */
@@ -0,0 +1,219 @@
+/*
+ * Copyright (C) Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2.1 only
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tapdisk-chainmap.h"
+#include "tapdisk-image.h"
+#include "tapdisk-interface.h"
+#include "tapdisk-stats.h"
+#include "tapdisk-log.h"
+
+/*
+ * Bit 63 marks a filled entry, bit i image i of the tail, and the last
+ * of those any image from TD_CHAINMAP_DEPTH down.
+ */
+#define TD_CHAINMAP_VALID    (1ULL << 63)
+
+void
+td_chainmap_init(struct td_chainmap *m)
+{
+	memset(m, 0, sizeof(*m));
+}
+
+void
+td_chainmap_reset(struct td_chainmap *m)
+{
+	uint64_t i;
+
+	for (i = 0; i < m->n_pages; i++)
+		free(m->pages[i]);
+
+	free(m->pages);
+	free(m->images);
+
+	m->pages    = NULL;
+	m->n_pages  = 0;
+	m->images   = NULL;
+	m->n_images = 0;
+	m->built    = 0;
+}
+
+/*
+ * The tail is every image below the last writable one. A failed build
+ * leaves an empty map, which routes nothing until the next reset.
+ */
+static void
+td_chainmap_build(struct td_chainmap *m, struct list_head *images)
+{
+	td_image_t *image, *leaf;
+	uint64_t extents;
+	int n;
+
+	m->built = 1;
+
+	if (list_empty(images))
+		return;
+
+	n = 0;
+	tapdisk_for_each_image(image, images) {
+		if (td_flag_test(image->flags, TD_OPEN_RDONLY))
+			n++;
+		else
+			n = 0;
+	}
+
+	if (!n)
+		return;
+
+	leaf    = list_entry(images->next, td_image_t, next);
+	extents = (leaf->info.size + TD_CHAINMAP_SECS - 1) >> TD_CHAINMAP_SHIFT;
+
+	m->n_pages = (extents + TD_CHAINMAP_PAGE - 1) / TD_CHAINMAP_PAGE;
+	m->pages   = calloc(m->n_pages, sizeof(uint64_t *));
+	m->images  = calloc(n, sizeof(td_image_t *));
+	if (!m->pages || !m->images)
+		goto fail;
+
+	m->n_images = 0;
+	tapdisk_for_each_image(image, images) {
+		if (td_flag_test(image->flags, TD_OPEN_RDONLY))
+			m->images[m->n_images++] = image;
+		else
+			m->n_images = 0;
+	}
+
+	DPRINTF("chain map: %d read-only images, %"PRIu64" extents\n",
+		m->n_images, extents);
+	return;
+
+fail:
+	EPRINTF("chain map: out of memory, disabled\n");
+	free(m->pages);
+	free(m->images);
+	m->pages    = NULL;
+	m->n_pages  = 0;
+	m->images   = NULL;
+	m->n_images = 0;
+}
+
+/*
+ * An image smaller than the extent ends the walk, the normal path
+ * zero-fills what lies beyond it.
+ */
+static uint64_t
+td_chainmap_fill(struct td_chainmap *m, uint64_t extent)
+{
+	td_sector_t sec;
+	uint64_t entry;
+	int i;
+
+	sec   = extent << TD_CHAINMAP_SHIFT;
+	entry = TD_CHAINMAP_VALID;
+
+	for (i = 0; i < m->n_images; i++) {
+		td_image_t *image = m->images[i];
+
+		if (i == TD_CHAINMAP_DEPTH ||
+		    sec + TD_CHAINMAP_SECS > image->info.size) {
+			entry |= 1ULL << i;
+			break;
+		}
+
+		if (td_allocated(image, sec, TD_CHAINMAP_SECS))
+			entry |= 1ULL << i;
+	}
+
+	m->fills++;
+
+	return entry;
+}
+
+td_image_t *
+td_chainmap_route(struct td_chainmap *m, struct list_head *images,
+		  td_image_t *parent, const td_request_t *treq)
+{
+	uint64_t extent, *page, entry, mask;
+	int p, q;
+
+	if (treq->op != TD_OP_READ || !treq->secs)
+		return parent;
+
+	if (!m->built)
+		td_chainmap_build(m, images);
+
+	for (p = 0; p < m->n_images; p++)
+		if (m->images[p] == parent)
+			break;
+
+	if (p >= m->n_images || p >= TD_CHAINMAP_DEPTH)
+		return parent;
+
+	extent = treq->sec >> TD_CHAINMAP_SHIFT;
+	if (extent != (treq->sec + treq->secs - 1) >> TD_CHAINMAP_SHIFT)
+		return parent;
+
+	if (extent / TD_CHAINMAP_PAGE >= m->n_pages)
+		return parent;
+
+	page = m->pages[extent / TD_CHAINMAP_PAGE];
+	if (!page) {
+		page = calloc(TD_CHAINMAP_PAGE, sizeof(uint64_t));
+		if (!page)
+			return parent;
+		m->pages[extent / TD_CHAINMAP_PAGE] = page;
+	}
+
+	entry = page[extent % TD_CHAINMAP_PAGE];
+	if (!entry) {
+		entry = td_chainmap_fill(m, extent);
+		page[extent % TD_CHAINMAP_PAGE] = entry;
+	}
+
+	mask = entry & ~TD_CHAINMAP_VALID & (~0ULL << p);
+	if (!mask) {
+		m->zeroed++;
+		m->skipped += m->n_images - p;
+		return NULL;
+	}
+
+	q = __builtin_ctzll(mask);
+	if (q == p)
+		return parent;
+
+	m->routed++;
+	m->skipped += q - p;
+
+	return m->images[q];
+}
+
+void
+td_chainmap_stats(struct td_chainmap *m, td_stats_t *st)
+{
+	tapdisk_stats_field(st, "depth", "d", m->n_images);
+	tapdisk_stats_field(st, "fills", "llu", m->fills);
+	tapdisk_stats_field(st, "routed", "llu", m->routed);
+	tapdisk_stats_field(st, "zeroed", "llu", m->zeroed);
+	tapdisk_stats_field(st, "skipped", "llu", m->skipped);
+}
@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2.1 only
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef _TAPDISK_CHAINMAP_H_
+#define _TAPDISK_CHAINMAP_H_
+
+#include <stdint.h>
+
+#include "tapdisk.h"
+#include "list.h"
+
+/*
+ * Chain allocation map.
+ *
+ * Records, per extent of the vbd, which of the read-only images at the
+ * bottom of its chain may hold data there, so that reads forwarded
+ * into that part of the chain go straight to the next image that may,
+ * or are zero-filled when none does, instead of visiting every layer.
+ *
+ * Entries are filled lazily from the td_allocated op of the images;
+ * images without one, or any error, count as holding data. Read-only
+ * images don't change under the vbd, so the map only needs resetting
+ * when the image list does.
+ */
+
+#define TD_CHAINMAP_SHIFT    12         /* 4096 sectors per extent */
+#define TD_CHAINMAP_SECS     (1ULL << TD_CHAINMAP_SHIFT)
+#define TD_CHAINMAP_PAGE     512        /* extents per page */
+#define TD_CHAINMAP_DEPTH    62         /* deeper images share a bit */
+
+struct td_chainmap {
+	int                          built;
+	int                          n_images;
+	td_image_t                 **images;   /* the read-only tail */
+
+	uint64_t                     n_pages;
+	uint64_t                   **pages;
+
+	uint64_t                     fills;
+	uint64_t                     routed;
+	uint64_t                     skipped;  /* layers not visited */
+	uint64_t                     zeroed;
+};
+
+void td_chainmap_init(struct td_chainmap *);
+void td_chainmap_reset(struct td_chainmap *);
+td_image_t *td_chainmap_route(struct td_chainmap *, struct list_head *,
+			      td_image_t *, const td_request_t *);
+void td_chainmap_stats(struct td_chainmap *, td_stats_t *);
+
+#endif
@@ -27,6 +27,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <inttypes.h>
 #include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/types.h>
@@ -38,15 +39,24 @@
 
 #define BWPRINTF(_f, _a...) fprintf (stderr, "log: " _f "\n", ## _a)
 
+#define DATA_ALIGN 4096
+
 struct writelog {
   char* shmpath;
   uint32_t shmsize;
   void* shm;
+  int shmfd;
 
-  /* next unprocessed item in the writelog */
+  /* next unprocessed item in the writelog, and sectors of it queued */
   void* cur;
+  uint32_t cur_done;
   unsigned int inflight;
 
+  /* responses are spliced from shmfd through the pipe to out */
+  int pipefd[2];
+  int out;
+  int seek;
+
   /* pointer to start and end of free data space for requests */
   void* dhd;
   void* dtl;
@@ -83,7 +93,10 @@ static inline void* dring_advance(struct writelog* wl, void* start, size_t len)
 
 static void usage(void)
 {
-  fprintf(stderr, "usage: tapdisk-client <sock>\n");
+  fprintf(stderr, "usage: tapdisk-client <sock> [p|c|g|r|s <out>|w <image>]\n"
+	  "  s: stream dirty extents to out (- for stdout), each\n"
+	  "     a struct log_extent followed by its data\n"
+	  "  w: write dirty extents in place to image\n");
 }
 
 /* returns socket file descriptor */
@@ -232,22 +245,22 @@ static int ctl_clear_writes(int fd)
 
 static int writelog_map(struct writelog* wl)
 {
-  int fd;
-  void* shm;
-
-  if ((fd = shm_open(wl->shmpath, O_RDWR, 0750)) < 0) {
+  /* kept open, extent data is spliced out of it */
+  if ((wl->shmfd = shm_open(wl->shmpath, O_RDWR, 0750)) < 0) {
     BWPRINTF("could not open shared memory at %s: %s", wl->shmpath,
 	     strerror(errno));
     return -1;
   }
 
-  wl->shm = mmap(NULL, wl->shmsize, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
-  close(fd);
+  wl->shm = mmap(NULL, wl->shmsize, PROT_READ|PROT_WRITE, MAP_SHARED,
+		 wl->shmfd, 0);
   if (wl->shm == MAP_FAILED) {
     BWPRINTF("could not mmap write log shm: %s", strerror(errno));
+    wl->shm = NULL;
     return -1;
   }
   wl->cur = wl->shm;
+  wl->cur_done = 0;
   wl->inflight = 0;
   wl->dhd = wl->dtl = sdatastart(wl->shm);
 
@@ -276,50 +289,128 @@ static int writelog_dump(struct writelog* wl)
   return 0;
 }
 
-/* walk dirty map and enqueue read requests.
+/* walk dirty map and enqueue read requests, each into its own
+ * page-aligned stretch of the data area. Extents larger than the
+ * space left are split. Every batch starts on an empty data area.
  * returns:  0 when entire bitmap has been enqueued,
- *           1 when the ring is full
+ *           1 when the ring or data area is full
  *          -1 on error
  */
 static int writelog_enqueue_requests(struct writelog* wl)
 {
-  struct disk_range* range = wl->shm;
+  struct disk_range* range;
   log_request_t* req;
+  uint32_t count, avail;
 
-  for (range = wl->cur; (void*)range < bmend(wl->shm); range++) {
+  wl->dhd = wl->dtl = sdatastart(wl->shm);
+
+  for (range = wl->cur; (void*)range < bmend(wl->shm); ) {
     if (!range->count)
       break;
 
     if (RING_FULL(&wl->fring))
 	break;
 
-    /* insert range into request stream */
-    /* 1. get next request slot from ring */
-    /* 2. ensure enough shm space is available */
-    
+    avail = (dring_avail(wl) & ~(DATA_ALIGN - 1)) >> 9;
+    if (!avail)
+      break;
+
+    count = range->count - wl->cur_done;
+    if (count > avail)
+      count = avail;
+
     BDPRINTF("enqueueing dirty extent: %"PRIu64":%u (ring space: %d/%d)",
-	     range->sector, range->count, RING_FREE_REQUESTS(&wl->fring),
-	     RING_SIZE(&wl->fring));
+	     range->sector + wl->cur_done, count,
+	     RING_FREE_REQUESTS(&wl->fring), RING_SIZE(&wl->fring));
 
     req = RING_GET_REQUEST(&wl->fring, wl->fring.req_prod_pvt);
 
-    req->sector = range->sector;
-    req->count = range->count;
-    /* ... */
-    req->offset = 0;
+    req->sector = range->sector + wl->cur_done;
+    req->count = count;
+    req->offset = wl->dhd - sdatastart(wl->shm);
 
+    wl->dhd = dring_advance(wl, wl->dhd,
+			    ((count << 9) + DATA_ALIGN - 1) & ~(DATA_ALIGN - 1));
     wl->fring.req_prod_pvt++;
     wl->inflight++;
+
+    wl->cur_done += count;
+    if (wl->cur_done == range->count) {
+      wl->cur_done = 0;
+      range++;
+    }
   }
 
   wl->cur = range;
 
-  if (range->count)
+  if ((void*)range < bmend(wl->shm) && range->count)
     return 1;
 
   return 0;
 }
 
+/* move len bytes at off in the data area to wl->out without copying
+ * them through user space. A socket may still reference the pages
+ * after splice returns, so the next batch should not be kicked before
+ * the peer has them; files and pipes are safe. */
+static int writelog_splice(struct writelog* wl, uint32_t offset, size_t len,
+			   loff_t* off_out)
+{
+  loff_t off_in = (char*)sdatastart(wl->shm) - (char*)wl->shm + offset;
+  ssize_t in, out;
+
+  while (len) {
+    in = splice(wl->shmfd, &off_in, wl->pipefd[1], NULL, len,
+		SPLICE_F_MOVE);
+    if (in <= 0) {
+      BWPRINTF("error splicing from log: %s",
+	       in ? strerror(errno) : "short read");
+      return -1;
+    }
+    len -= in;
+
+    while (in) {
+      out = splice(wl->pipefd[0], NULL, wl->out, off_out, in,
+		   SPLICE_F_MOVE | (len ? SPLICE_F_MORE : 0));
+      if (out <= 0) {
+	BWPRINTF("error splicing to output: %s",
+		 out ? strerror(errno) : "short write");
+	return -1;
+      }
+      in -= out;
+    }
+  }
+
+  return 0;
+}
+
+static int writelog_output(struct writelog* wl, const log_response_t* rsp)
+{
+  struct log_extent hdr;
+  loff_t off;
+  ssize_t rc;
+
+  if (wl->out < 0)
+    return 0;
+
+  if (wl->seek) {
+    off = (loff_t)rsp->sector << 9;
+    return writelog_splice(wl, rsp->offset, (size_t)rsp->count << 9, &off);
+  }
+
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.sector = rsp->sector;
+  hdr.count = rsp->count;
+
+  if ((rc = write(wl->out, &hdr, sizeof(hdr))) != sizeof(hdr)) {
+    BWPRINTF("error writing extent header: %s",
+	     rc < 0 ? strerror(errno) : "short write");
+    return -1;
+  }
+
+  return writelog_splice(wl, rsp->offset, (size_t)rsp->count << 9, NULL);
+}
+
 static int writelog_dequeue_responses(struct writelog* wl)
 {
   RING_IDX rstart, rend;
@@ -335,6 +426,14 @@ static int writelog_dequeue_responses(struct writelog* wl)
     BDPRINTF("ctl: read response %"PRIu64":%u", rsp.sector, rsp.count);
     wl->fring.rsp_cons = ++rstart;
     wl->inflight--;
+
+    if (!rsp.count) {
+      BWPRINTF("read of extent at %"PRIu64" failed", rsp.sector);
+      return -1;
+    }
+
+    if (writelog_output(wl, &rsp) < 0)
+      return -1;
   }
 
   return 0;
@@ -350,6 +449,10 @@ static int writelog_free(struct writelog* wl)
     munmap(wl->shm, wl->shmsize);
     wl->shm = NULL;
   }
+  if (wl->shmfd >= 0) {
+    close(wl->shmfd);
+    wl->shmfd = -1;
+  }
 
   return 0;
 }
@@ -367,6 +470,7 @@ int get_writes(struct writelog* wl, int fd, int peek)
     return rc;
 
   wl->cur = wl->shm;
+  wl->cur_done = 0;
 
   return 0;
 }
@@ -403,40 +507,78 @@ int await_responses(struct writelog* wl, int fd)
  * 1. extract dirty bitmap
  * 2. feed as much as possible onto ring
  * 3. kick
- * 4. as responses come back, feed more of the dirty bitmap
- *    into the ring
- * 5. when entire bitmap has been queued, go to 1?
+ * 4. as responses come back, hand their data to the output
+ * 5. feed more of the dirty bitmap into the ring, until
+ *    the entire bitmap has been queued
+ * Peeking leaves the log dirty, otherwise it is cleared as it is
+ * exported, and writes arriving meanwhile are left for the next run.
  */
-int read_loop(struct writelog* wl, int fd)
+int read_loop(struct writelog* wl, int fd, int peek)
 {
   int rc;
 
-  if (get_writes(wl, fd, 1) < 0)
+  if (get_writes(wl, fd, peek) < 0)
     return -1;
   writelog_dump(wl);
 
   do {
     rc = writelog_enqueue_requests(wl);
+    if (!wl->inflight)
+      break;
 
-    if (RING_FREE_REQUESTS(&wl->fring) < RING_SIZE(&wl->fring))
-      RING_PUSH_REQUESTS(&wl->fring);
+    RING_PUSH_REQUESTS(&wl->fring);
     if (ctl_kick(fd) < 0)
       return -1;
 
-    /* collect responses */
-    if (wl->inflight && await_responses(wl, fd) < 0)
+    /* collect responses, one kick per batch */
+    if (await_responses(wl, fd) < 0)
+      return -1;
+    if (wl->inflight) {
+      BWPRINTF("%u requests unanswered", wl->inflight);
       return -1;
+    }
   } while (rc > 0);
 
   return rc;
 }
 
+static int writelog_open_output(struct writelog* wl, char cmd, const char* path)
+{
+  wl->seek = cmd == 'w';
+
+  if (!wl->seek && !strcmp(path, "-"))
+    wl->out = STDOUT_FILENO;
+  else if (wl->seek)
+    wl->out = open(path, O_WRONLY);
+  else
+    wl->out = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+  if (wl->out < 0) {
+    BWPRINTF("could not open %s: %s", path, strerror(errno));
+    return -1;
+  }
+
+  if (pipe(wl->pipefd) < 0) {
+    BWPRINTF("could not create pipe: %s", strerror(errno));
+    return -1;
+  }
+
+  /* room for a whole data area makes for fewer round trips */
+  fcntl(wl->pipefd[1], F_SETPIPE_SZ,
+	(int)(sdataend(wl->shm) - sdatastart(wl->shm)));
+
+  return 0;
+}
+
 int main(int argc, char* argv[])
 {
   int fd;
   struct writelog wl;
   char cmd;
 
+  memset(&wl, 0, sizeof(wl));
+  wl.shmfd = wl.out = -1;
+
   if (argc < 2) {
     usage();
     return 1;
@@ -448,6 +590,8 @@ int main(int argc, char* argv[])
     cmd = argv[2][0];
     
   fd = tdctl_open(argv[1]);
+  if (fd < 0)
+    return 1;
 
   if (ctl_get_shmem(fd, &wl) < 0)
     return 1;
@@ -473,8 +617,23 @@ int main(int argc, char* argv[])
     writelog_dump(&wl);
     break;
   case 'r':
-    if (read_loop(&wl, fd) < 0)
+    if (read_loop(&wl, fd, 1) < 0)
+      return 1;
+    break;
+  case 's':
+  case 'w':
+    if (argc < 4) {
+      usage();
+      return 1;
+    }
+    if (writelog_open_output(&wl, cmd, argv[3]) < 0)
+      return 1;
+    if (read_loop(&wl, fd, 0) < 0)
+      return 1;
+    if (wl.seek && fsync(wl.out) < 0) {
+      BWPRINTF("error syncing %s: %s", argv[3], strerror(errno));
       return 1;
+    }
     break;
   default:
     usage();
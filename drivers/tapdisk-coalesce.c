@@ -0,0 +1,183 @@
+/*
+ * Copyright (C) Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2.1 only
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/syscall.h>
+
+#include "tapdisk-coalesce.h"
+#include "tapdisk-server.h"
+#include "tapdisk-log.h"
+#include "libaio-compat.h"
+#include "vhd-util.h"
+
+#define IOPRIO_WHO_PROCESS           1
+#define IOPRIO_CLASS_IDLE            3
+#define IOPRIO_CLASS_SHIFT           13
+
+static void *
+td_coalesce_thread(void *arg)
+{
+	struct td_coalesce *c = arg;
+	uint64_t val = 1;
+	int err, gcc;
+
+	/* guest I/O goes first */
+	if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+		    IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT))
+		DPRINTF("coalesce %s: no idle I/O priority: %d\n",
+			c->name, errno);
+
+	err = vhd_util_coalesce_parent(c->name, 0, 0, c->rate);
+
+	pthread_mutex_lock(&c->lock);
+	c->error    = err;
+	c->finished = 1;
+	if (c->orphan) {
+		pthread_mutex_unlock(&c->lock);
+		td_coalesce_free(c);
+		return NULL;
+	}
+	gcc = write(c->efd, &val, sizeof(val));
+	if (gcc) {};
+	pthread_mutex_unlock(&c->lock);
+
+	return NULL;
+}
+
+static void
+td_coalesce_event(event_id_t id, char mode, void *private)
+{
+	struct td_coalesce *c = private;
+	uint64_t val;
+	int err, gcc;
+
+	gcc = read(c->efd, &val, sizeof(val));
+	if (gcc) {};
+
+	tapdisk_server_unregister_event(c->event);
+	c->event = -1;
+
+	pthread_mutex_lock(&c->lock);
+	err = c->error;
+	pthread_mutex_unlock(&c->lock);
+
+	c->done(c, err);
+}
+
+struct td_coalesce *
+td_coalesce_start(const char *name, uint64_t rate,
+		  void (*done)(struct td_coalesce *, int),
+		  void *private, int *_err)
+{
+	struct td_coalesce *c;
+	pthread_attr_t attr;
+	int err;
+
+	c = calloc(1, sizeof(*c));
+	if (!c) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	c->efd     = -1;
+	c->event   = -1;
+	c->rate    = rate;
+	c->done    = done;
+	c->private = private;
+	pthread_mutex_init(&c->lock, NULL);
+	gettimeofday(&c->started, NULL);
+
+	c->name = strdup(name);
+	if (!c->name) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	c->efd = tapdisk_sys_eventfd(0);
+	if (c->efd < 0) {
+		err = -errno;
+		goto fail;
+	}
+
+	c->event = tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
+						 c->efd, 0,
+						 td_coalesce_event, c);
+	if (c->event < 0) {
+		err = c->event;
+		goto fail;
+	}
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	err = pthread_create(&c->thread, &attr, td_coalesce_thread, c);
+	pthread_attr_destroy(&attr);
+	if (err) {
+		err = -err;
+		goto fail;
+	}
+
+	tapdisk_server_place_thread(c->thread);
+
+	DPRINTF("coalescing %s onto its parent\n", name);
+	return c;
+
+fail:
+	if (c)
+		td_coalesce_free(c);
+	*_err = err;
+	return NULL;
+}
+
+/* Only once finished. */
+void
+td_coalesce_free(struct td_coalesce *c)
+{
+	if (c->event >= 0)
+		tapdisk_server_unregister_event(c->event);
+	if (c->efd >= 0)
+		close(c->efd);
+
+	pthread_mutex_destroy(&c->lock);
+	free(c->name);
+	free(c);
+}
+
+void
+td_coalesce_abandon(struct td_coalesce *c)
+{
+	int finished;
+
+	if (c->event >= 0)
+		tapdisk_server_unregister_event(c->event);
+	c->event = -1;
+
+	pthread_mutex_lock(&c->lock);
+	finished = c->finished;
+	c->orphan = 1;
+	pthread_mutex_unlock(&c->lock);
+
+	if (finished)
+		td_coalesce_free(c);
+}
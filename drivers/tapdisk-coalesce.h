@@ -0,0 +1,63 @@
+/*
+ * Copyright (C) Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2.1 only
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef _TAPDISK_COALESCE_H_
+#define _TAPDISK_COALESCE_H_
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "scheduler.h"
+
+/*
+ * Online coalesce helper.
+ *
+ * Merges a read-only VHD onto its parent from a thread of its own, at
+ * idle I/O priority and optionally rate limited, then calls 'done' on
+ * the event loop which started it. The vbd keeps reading the image
+ * while it is merged: what it holds only gets copied to the parent,
+ * where the image itself still shadows it.
+ *
+ * The thread is detached. Abandoning a running coalesce lets it run to
+ * its end, without calling back.
+ */
+
+struct td_coalesce {
+	pthread_t                    thread;
+	pthread_mutex_t              lock;
+	int                          finished;
+	int                          orphan;
+	int                          error;
+
+	int                          efd;
+	event_id_t                   event;
+
+	char                        *name;
+	uint64_t                     rate;      /* bytes/s, 0 for no limit */
+	struct timeval               started;
+
+	void                       (*done)(struct td_coalesce *, int error);
+	void                        *private;
+};
+
+struct td_coalesce *td_coalesce_start(const char *name, uint64_t rate,
+				      void (*done)(struct td_coalesce *, int),
+				      void *private, int *err);
+void td_coalesce_free(struct td_coalesce *);
+void td_coalesce_abandon(struct td_coalesce *);
+
+#endif
@@ -26,6 +26,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <signal.h>
+#include <pthread.h>
 #include <sys/un.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -44,12 +45,19 @@
 #include "tapdisk-stats.h"
 #include "tapdisk-control.h"
 #include "tapdisk-nbdserver.h"
+#include "tapdisk-metrics.h"
+#include "tapdisk-warm.h"
+#include "block-cache.h"
+#include "libaio-compat.h"
+#include "profile.h"
 
 #define TD_CTL_MAX_CONNECTIONS  10
 #define TD_CTL_SOCK_BACKLOG     32
 #define TD_CTL_RECV_TIMEOUT     10
 #define TD_CTL_SEND_TIMEOUT     10
 #define TD_CTL_SEND_BUFSZ       ((size_t)4096)
+#define TD_CTL_PUSH_BUFSZ       ((size_t)64 << 10) /* of subscribers */
+#define TD_CTL_EVENTS           256
 
 #define DBG(_f, _a...)             tlog_syslog(TLOG_DBG, _f, ##_a)
 #define ERR(err, _f, _a...)        tlog_error(err, _f, ##_a)
@@ -84,13 +92,26 @@ struct tapdisk_ctl_conn {
 	struct {
 		int             event_id;
 		int             busy;
+		int             keep;    /* for the next request */
+		int             headroom; /* minor waited on, or -1 */
 	} in;
 
+	struct {
+		uint32_t        flags;    /* TAPDISK_MESSAGE_SUBSCRIBE_* */
+		int             minor;    /* or -1, all */
+		int             event_id; /* counters, every interval */
+		uint32_t        dropped;
+		struct td_ctl_sample *prev; /* per stats slot */
+	} sub;
+
 	struct tapdisk_control_info *info;
 };
 
 #define TAPDISK_MSG_REENTER    (1<<0) /* non-blocking, idempotent */
 #define TAPDISK_MSG_VERBOSE    (1<<1) /* tell syslog about it */
+#define TAPDISK_MSG_VBD        (1<<2) /* runs on the loop of its VBD */
+#define TAPDISK_MSG_NEW_VBD    (1<<3) /* picks the loop of a new VBD */
+#define TAPDISK_MSG_ALL_VBDS   (1<<4) /* parks all worker loops */
 
 struct tapdisk_control_info {
 	void (*handler)(struct tapdisk_ctl_conn *, tapdisk_message_t *);
@@ -107,10 +128,45 @@ struct tapdisk_control {
 	int                n_conn;
 	struct tapdisk_ctl_conn __conn[TD_CTL_MAX_CONNECTIONS];
 	struct tapdisk_ctl_conn *conn[TD_CTL_MAX_CONNECTIONS];
+
+	int                kick_event;
 };
 
 static struct tapdisk_control td_control;
 
+/* counters as last pushed, of a stats slot */
+struct td_ctl_sample {
+	int                         used;
+	uint32_t                    minor;
+	tapdisk_message_counters_t  c;
+};
+
+/*
+ * Events posted from any loop, for the main loop to push. Alike ones
+ * not yet pushed are counted together; past TD_CTL_EVENTS, dropped.
+ */
+struct td_ctl_event {
+	int                         minor;
+	uint32_t                    event;
+	int32_t                     error;
+	uint32_t                    state;
+	uint32_t                    count;
+};
+
+static struct {
+	pthread_mutex_t             lock;
+	struct td_ctl_event         ev[TD_CTL_EVENTS];
+	unsigned int                prod, cons;
+	uint64_t                    seq;
+	uint64_t                    dropped;
+	int                         subscribers;
+} td_control_events = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static void tapdisk_control_unsubscribe(struct tapdisk_ctl_conn *);
+
+/* written from any loop, once headroom runs low somewhere */
+static int td_control_kick_fd = -1;
+
 static inline size_t
 page_align(size_t size)
 {
@@ -135,6 +191,7 @@ tapdisk_ctl_conn_init(struct tapdisk_ctl_conn *conn, size_t bufsz)
 	memset(conn, 0, sizeof(*conn));
 	conn->out.event_id = -1;
 	conn->in.event_id  = -1;
+	conn->sub.event_id = -1;
 
 	conn->out.buf = malloc(bufsz);
 	if (!conn->out.buf) {
@@ -177,8 +234,10 @@ tapdisk_ctl_conn_free(struct tapdisk_ctl_conn *conn)
 static void
 tapdisk_ctl_conn_close(struct tapdisk_ctl_conn *conn)
 {
+	tapdisk_control_unsubscribe(conn);
+
 	if (conn->out.event_id >= 0) {
-		tapdisk_server_unregister_event(conn->out.event_id);
+		tapdisk_server_unregister_main_event(conn->out.event_id);
 		conn->out.event_id = -1;
 	}
 
@@ -187,20 +246,20 @@ tapdisk_ctl_conn_close(struct tapdisk_ctl_conn *conn)
 		conn->fd = -1;
 
 		tapdisk_ctl_conn_free(conn);
-		tapdisk_server_mask_event(td_control.event_id, 0);
+		tapdisk_server_mask_main_event(td_control.event_id, 0);
 	}
 }
 
 static void
 tapdisk_ctl_conn_mask_out(struct tapdisk_ctl_conn *conn)
 {
-	tapdisk_server_mask_event(conn->out.event_id, 1);
+	tapdisk_server_mask_main_event(conn->out.event_id, 1);
 }
 
 static void
 tapdisk_ctl_conn_unmask_out(struct tapdisk_ctl_conn *conn)
 {
-	tapdisk_server_mask_event(conn->out.event_id, 0);
+	tapdisk_server_mask_main_event(conn->out.event_id, 0);
 }
 
 static ssize_t
@@ -241,8 +300,11 @@ tapdisk_ctl_conn_send_event(event_id_t id, char mode, void *private)
 
 	if (rv || conn->out.done || mode & SCHEDULER_POLL_TIMEOUT)
 		tapdisk_ctl_conn_close(conn);
-	else
+	else {
+		conn->out.prod = conn->out.buf;
+		conn->out.cons = conn->out.buf;
 		tapdisk_ctl_conn_mask_out(conn);
+	}
 }
 
 /*
@@ -298,10 +360,10 @@ tapdisk_ctl_conn_open(int fd)
 	conn = td_control.conn[td_control.n_conn++];
 
 	conn->out.event_id =
-		tapdisk_server_register_event(SCHEDULER_POLL_WRITE_FD,
-					      fd, TD_CTL_SEND_TIMEOUT,
-					      tapdisk_ctl_conn_send_event,
-					      conn);
+		tapdisk_server_register_main_event(SCHEDULER_POLL_WRITE_FD,
+					           fd, TD_CTL_SEND_TIMEOUT,
+					           tapdisk_ctl_conn_send_event,
+					           conn);
 	if (conn->out.event_id < 0)
 		return NULL;
 
@@ -309,11 +371,13 @@ tapdisk_ctl_conn_open(int fd)
 	conn->out.prod = conn->out.buf;
 	conn->out.cons = conn->out.buf;
 	conn->out.done = 0;
+	conn->in.keep  = 0;
+	conn->in.headroom = -1;
 
 	tapdisk_ctl_conn_mask_out(conn);
 
 	if (td_control.n_conn >= TD_CTL_MAX_CONNECTIONS)
-		tapdisk_server_mask_event(td_control.event_id, 1);
+		tapdisk_server_mask_main_event(td_control.event_id, 1);
 
 	return conn;
 }
@@ -351,8 +415,9 @@ tapdisk_control_initialize(void)
 	struct tapdisk_ctl_conn *conn;
 	int i;
 
-	td_control.socket   = -1;
-	td_control.event_id = -1;
+	td_control.socket     = -1;
+	td_control.event_id   = -1;
+	td_control.kick_event = -1;
 
 	signal(SIGPIPE, SIG_IGN);
 
@@ -389,6 +454,18 @@ tapdisk_control_close(void)
 
 	DPRINTF("tapdisk-control: done\n");
 
+	if (td_control.kick_event >= 0) {
+		tapdisk_server_unregister_main_event(td_control.kick_event);
+		td_control.kick_event = -1;
+	}
+
+	if (td_control_kick_fd >= 0) {
+		close(td_control_kick_fd);
+		td_control_kick_fd = -1;
+	}
+
+	tapdisk_metrics_close();
+
 	if (td_control.path) {
 		unlink(td_control.path);
 		free(td_control.path);
@@ -405,7 +482,7 @@ static void
 tapdisk_control_release_connection(struct tapdisk_ctl_conn *conn)
 {
 	if (conn->in.event_id) {
-		tapdisk_server_unregister_event(conn->in.event_id);
+		tapdisk_server_unregister_main_event(conn->in.event_id);
 		conn->in.event_id = -1;
 	}
 
@@ -540,27 +617,33 @@ tapdisk_control_list(struct tapdisk_ctl_conn *conn, tapdisk_message_t *request)
 	tapdisk_message_t response;
 	int count;
 
+	int i;
+
 	memset(&response, 0, sizeof(response));
 	response.type = TAPDISK_MESSAGE_LIST_RSP;
 	response.cookie = request->cookie;
 
-	head = tapdisk_server_get_all_vbds();
-
 	count = 0;
-	list_for_each_entry(vbd, head, next)
-		count++;
+	for (i = 0; i < tapdisk_server_n_loops(); i++) {
+		head = tapdisk_server_get_loop_vbds(i);
+		list_for_each_entry(vbd, head, next)
+			count++;
+	}
 
-	list_for_each_entry(vbd, head, next) {
-		response.u.list.count   = count--;
-		response.u.list.minor   = vbd->tap ? vbd->tap->minor : -1;
-		response.u.list.state   = vbd->state;
-		response.u.list.path[0] = 0;
+	for (i = 0; i < tapdisk_server_n_loops(); i++) {
+		head = tapdisk_server_get_loop_vbds(i);
+		list_for_each_entry(vbd, head, next) {
+			response.u.list.count   = count--;
+			response.u.list.minor   = vbd->tap ? vbd->tap->minor : -1;
+			response.u.list.state   = vbd->state;
+			response.u.list.path[0] = 0;
 
-		if (vbd->name)
-			strncpy(response.u.list.path, vbd->name,
-				sizeof(response.u.list.path));
+			if (vbd->name)
+				strncpy(response.u.list.path, vbd->name,
+					sizeof(response.u.list.path));
 
-		tapdisk_control_write_message(conn, &response);
+			tapdisk_control_write_message(conn, &response);
+		}
 	}
 
 	response.u.list.count   = count;
@@ -729,6 +812,21 @@ tapdisk_control_open_image(struct tapdisk_ctl_conn *conn,
 		flags |= TD_OPEN_REUSE_PARENT;
 	if (request->u.params.flags & TAPDISK_MESSAGE_FLAG_STANDBY)
 		flags |= TD_OPEN_STANDBY;
+	if (request->u.params.flags & TAPDISK_MESSAGE_FLAG_ASYNC)
+		flags |= TD_OPEN_MIRROR_ASYNC;
+	if (request->u.params.bm_cache) {
+		uint32_t order = 0;
+		while (order < 31 &&
+		       (1U << order) < request->u.params.bm_cache)
+			order++;
+		flags |= order << TD_OPEN_BM_CACHE_SHIFT;
+	}
+	if (request->u.params.lazy_depth) {
+		uint32_t depth = request->u.params.lazy_depth;
+		if (depth > TD_OPEN_LAZY_MASK >> TD_OPEN_LAZY_SHIFT)
+			depth = TD_OPEN_LAZY_MASK >> TD_OPEN_LAZY_SHIFT;
+		flags |= depth << TD_OPEN_LAZY_SHIFT;
+	}
 	if (request->u.params.flags & TAPDISK_MESSAGE_FLAG_SECONDARY) {
 		char *name = strdup(request->u.params.secondary);
 		if (!name) {
@@ -967,6 +1065,16 @@ tapdisk_control_stats(struct tapdisk_ctl_conn *conn,
 	void *buf;
 	int new_size;
 
+	st->buf = NULL;
+
+	/* the last response, on a kept connection, is still going out */
+	if (conn->out.prod != conn->out.buf) {
+		rv = -EBUSY;
+		goto out;
+	}
+
+	conn->in.keep = !!(request->u.info.flags & TAPDISK_MESSAGE_STATS_KEEP);
+
 	buf = malloc(TD_CTL_SEND_BUFSZ);
 	if (!buf) {
 		rv = -ENOMEM;
@@ -986,12 +1094,16 @@ tapdisk_control_stats(struct tapdisk_ctl_conn *conn,
 		tapdisk_vbd_stats(vbd, st);
 
 	} else {
-		struct list_head *list = tapdisk_server_get_all_vbds();
+		struct list_head *list;
+		int i;
 
 		tapdisk_stats_enter(st, '[');
 
-		list_for_each_entry(vbd, list, next)
-			tapdisk_vbd_stats(vbd, st);
+		for (i = 0; i < tapdisk_server_n_loops(); i++) {
+			list = tapdisk_server_get_loop_vbds(i);
+			list_for_each_entry(vbd, list, next)
+				tapdisk_vbd_stats(vbd, st);
+		}
 
 		tapdisk_stats_leave(st, ']');
 	}
@@ -1027,168 +1139,1314 @@ out:
 		conn->out.prod += rv;
 }
 
-struct tapdisk_control_info message_infos[] = {
-	[TAPDISK_MESSAGE_PID] = {
-		.handler = tapdisk_control_get_pid,
-		.flags   = TAPDISK_MSG_REENTER,
-	},
-	[TAPDISK_MESSAGE_LIST] = {
-		.handler = tapdisk_control_list,
-		.flags   = TAPDISK_MSG_REENTER,
-	},
-	[TAPDISK_MESSAGE_ATTACH] = {
-		.handler = tapdisk_control_attach_vbd,
-		.flags   = TAPDISK_MSG_VERBOSE,
-	},
-	[TAPDISK_MESSAGE_DETACH] = {
-		.handler = tapdisk_control_detach_vbd,
-		.flags   = TAPDISK_MSG_VERBOSE,
-	},
-	[TAPDISK_MESSAGE_OPEN] = {
-		.handler = tapdisk_control_open_image,
-		.flags   = TAPDISK_MSG_VERBOSE,
-	},
-	[TAPDISK_MESSAGE_PAUSE] = {
-		.handler = tapdisk_control_pause_vbd,
-		.flags   = TAPDISK_MSG_VERBOSE,
-	},
-	[TAPDISK_MESSAGE_RESUME] = {
-		.handler = tapdisk_control_resume_vbd,
-		.flags   = TAPDISK_MSG_VERBOSE,
-	},
-	[TAPDISK_MESSAGE_CLOSE] = {
-		.handler = tapdisk_control_close_image,
-		.flags   = TAPDISK_MSG_VERBOSE,
-	},
-	[TAPDISK_MESSAGE_STATS] = {
-		.handler = tapdisk_control_stats,
-		.flags   = TAPDISK_MSG_REENTER,
-	},
-};
-
-
 static void
-tapdisk_control_handle_request(event_id_t id, char mode, void *private)
+tapdisk_control_trace(struct tapdisk_ctl_conn *conn,
+		      tapdisk_message_t *request)
 {
-	int err, excl;
-	tapdisk_message_t message, response;
-	struct tapdisk_ctl_conn *conn = private;
+	tapdisk_message_t response;
+	void *dump, *buf;
+	size_t len;
+	ssize_t rv;
+	int err;
 
-	conn->info = NULL;
+	dump = NULL;
 
-	err = tapdisk_control_read_message(conn->fd, &message, 2);
-	if (err)
-		goto close;
+	if (conn->out.prod != conn->out.buf) {
+		rv = -EBUSY;
+		goto out;
+	}
 
-	err = tapdisk_control_validate_request(&message);
-	if (err)
-		goto invalid;
+	switch (request->u.info.flags) {
+	case 0:
+		break;
+	case TAPDISK_MESSAGE_TRACE_ON:
+		td_trace_set(1);
+		break;
+	case TAPDISK_MESSAGE_TRACE_OFF:
+		td_trace_set(0);
+		break;
+	default:
+		rv = -EINVAL;
+		goto out;
+	}
 
-	if (message.type > TAPDISK_MESSAGE_EXIT)
-		goto invalid;
+	err = td_trace_dump(&dump, &len);
+	if (err) {
+		rv = err;
+		goto out;
+	}
 
-	conn->info = &message_infos[message.type];
+	if (len > conn->out.bufsz - sizeof(response)) {
+		buf = realloc(conn->out.buf, len + sizeof(response));
+		if (!buf) {
+			rv = -ENOMEM;
+			goto out;
+		}
+		conn->out.buf   = buf;
+		conn->out.bufsz = len + sizeof(response);
+		conn->out.prod  = buf;
+		conn->out.cons  = buf;
+	}
 
-	if (!conn->info->handler)
-		goto invalid;
+	memcpy(conn->out.buf + sizeof(response), dump, len);
+	rv = len;
 
-	if (conn->info->flags & TAPDISK_MSG_VERBOSE)
-		DBG("received '%s' message (uuid = %u)\n",
-		    tapdisk_message_name(message.type), message.cookie);
+out:
+	free(dump);
+	memset(&response, 0, sizeof(response));
+	response.type = TAPDISK_MESSAGE_TRACE_RSP;
+	response.cookie = request->cookie;
+	response.u.info.length = rv;
 
-	if (conn->in.busy)
-		goto busy;
+	tapdisk_control_write_message(conn, &response);
+	if (rv > 0)
+		conn->out.prod += rv;
+}
 
-	excl = !(conn->info->flags & TAPDISK_MSG_REENTER);
-	if (excl) {
-		if (td_control.busy)
-			goto busy;
+static void
+tapdisk_control_poll_vbd(struct tapdisk_ctl_conn *conn,
+			 tapdisk_message_t *request)
+{
+	tapdisk_message_t response;
+	td_vbd_t *vbd;
+	int err;
 
-		td_control.busy = 1;
+	memset(&response, 0, sizeof(response));
+	response.type = TAPDISK_MESSAGE_POLL_RSP;
+
+	vbd = tapdisk_server_get_vbd(request->cookie);
+	if (!vbd) {
+		err = -EINVAL;
+		goto out;
 	}
-	conn->in.busy = 1;
 
-	conn->info->handler(conn, &message);
+	if (!vbd->tap) {
+		err = -ENODEV;
+		goto out;
+	}
 
-	conn->in.busy = 0;
-	if (excl)
-		td_control.busy = 0;
+	err = tapdisk_blktap_set_poll(vbd->tap, request->u.poll.max_us);
+out:
+	response.cookie = request->cookie;
+	response.u.response.error = -err;
+	tapdisk_control_write_message(conn, &response);
+}
 
-	tapdisk_control_release_connection(conn);
-	return;
+static void
+tapdisk_control_fill_headroom(td_vbd_t *vbd, tapdisk_message_t *response)
+{
+	const struct td_vbd_headroom *h = &vbd->headroom;
+
+	response->u.headroom.lead_s  = h->lead_s;
+	response->u.headroom.hold_ms = h->hold_ms;
+	response->u.headroom.space   = h->space;
+	response->u.headroom.rate    = h->rate;
+	response->u.headroom.low     = h->low;
+	response->u.headroom.events  = h->events;
+}
+
+/* A waiting request keeps its connection, for the kick to answer. */
+static void
+tapdisk_control_headroom(struct tapdisk_ctl_conn *conn,
+			 tapdisk_message_t *request)
+{
+	tapdisk_message_headroom_t *hr = &request->u.headroom;
+	tapdisk_message_t response;
+	td_vbd_t *vbd;
+	int err = 0;
 
-error:
 	memset(&response, 0, sizeof(response));
-	response.type = TAPDISK_MESSAGE_ERROR;
-	response.u.response.error = (err ? -err : EINVAL);
+	response.type   = TAPDISK_MESSAGE_HEADROOM_RSP;
+	response.cookie = request->cookie;
+
+	vbd = tapdisk_server_get_vbd(request->cookie);
+	if (!vbd) {
+		err = -EINVAL;
+		goto out;
+	}
+
+	if (hr->flags & TAPDISK_MESSAGE_HEADROOM_SET) {
+		err = tapdisk_vbd_set_headroom(vbd, hr->lead_s, hr->hold_ms);
+		if (err)
+			goto out;
+
+		/* waiters on a VBD no longer watched are done */
+		tapdisk_control_kick_headroom();
+	}
+
+	if ((hr->flags & TAPDISK_MESSAGE_HEADROOM_WAIT) &&
+	    vbd->headroom.lead_s && !vbd->headroom.low) {
+		conn->in.keep     = 1;
+		conn->in.headroom = request->cookie;
+		return;
+	}
+
+	tapdisk_control_fill_headroom(vbd, &response);
+out:
+	response.u.headroom.error = -err;
 	tapdisk_control_write_message(conn, &response);
+}
 
-close:
-	tapdisk_control_close_connection(conn);
-	return;
+static void
+tapdisk_control_kick(void)
+{
+	uint64_t val = 1;
 
-busy:
-	err = -EBUSY;
-	ERR(err, "rejecting message '%s' while busy\n",
-	    tapdisk_message_name(message.type));
-	goto error;
+	if (td_control_kick_fd >= 0) {
+		int gcc = write(td_control_kick_fd, &val, sizeof(val));
+		if (gcc) {};
+	}
+}
 
-invalid:
-	err = -EINVAL;
-	ERR(err, "rejecting unsupported message '%s'\n",
-	    tapdisk_message_name(message.type));
-	goto error;
+void
+tapdisk_control_kick_headroom(void)
+{
+	tapdisk_control_kick();
 }
 
 static void
-tapdisk_control_accept(event_id_t id, char mode, void *private)
+tapdisk_control_wake_headroom(void)
 {
-	int err, fd;
 	struct tapdisk_ctl_conn *conn;
+	tapdisk_message_t response;
+	int i, entered, minor;
+	td_vbd_t *vbd;
 
-	fd = accept(td_control.socket, NULL, NULL);
-	if (fd == -1) {
-		ERR(-errno, "failed to accept new control connection: %d\n", errno);
-		return;
+	for (i = 0; i < TD_CTL_MAX_CONNECTIONS; i++) {
+		conn  = &td_control.__conn[i];
+		minor = conn->in.headroom;
+
+		if (minor < 0 || !tapdisk_ctl_conn_connected(conn))
+			continue;
+
+		memset(&response, 0, sizeof(response));
+		response.type   = TAPDISK_MESSAGE_HEADROOM_RSP;
+		response.cookie = minor;
+
+		entered = !tapdisk_server_enter_vbd(minor);
+		vbd     = entered ? tapdisk_server_get_vbd(minor) : NULL;
+
+		if (vbd && vbd->headroom.lead_s && !vbd->headroom.low) {
+			tapdisk_server_leave_vbd();
+			continue;
+		}
+
+		if (vbd)
+			tapdisk_control_fill_headroom(vbd, &response);
+		else
+			response.u.headroom.error = ENODEV;
+
+		if (entered)
+			tapdisk_server_leave_vbd();
+
+		conn->in.headroom = -1;
+		conn->in.keep     = 0;
+		tapdisk_control_write_message(conn, &response);
+		tapdisk_control_release_connection(conn);
 	}
+}
 
-	conn = tapdisk_ctl_conn_open(fd);
-	if (!conn) {
-		close(fd);
-		ERR(-ENOMEM, "failed to allocate new control connection\n");
+/*
+ * subscriptions
+ */
+
+void
+tapdisk_control_post_event(int minor, int event, int error, uint32_t state)
+{
+	struct td_ctl_event *ev;
+	unsigned int i;
+
+	if (!td_control_events.subscribers)
 		return;
+
+	pthread_mutex_lock(&td_control_events.lock);
+
+	for (i = td_control_events.cons; i != td_control_events.prod; i++) {
+		ev = &td_control_events.ev[i % TD_CTL_EVENTS];
+		if (ev->minor == minor && ev->event == event &&
+		    ev->error == error) {
+			ev->state = state;
+			ev->count++;
+			goto out;
+		}
 	}
 
-	err = tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
-					    conn->fd, TD_CTL_RECV_TIMEOUT,
-					    tapdisk_control_handle_request,
-					    conn);
-	if (err == -1) {
-		tapdisk_control_close_connection(conn);
-		ERR(err, "failed to register new control event\n");
-		return;
+	if (td_control_events.prod - td_control_events.cons >= TD_CTL_EVENTS) {
+		td_control_events.dropped++;
+		goto out;
 	}
 
-	conn->in.event_id = err;
+	ev = &td_control_events.ev[td_control_events.prod++ % TD_CTL_EVENTS];
+	ev->minor = minor;
+	ev->event = event;
+	ev->error = error;
+	ev->state = state;
+	ev->count = 1;
+
+out:
+	pthread_mutex_unlock(&td_control_events.lock);
+
+	tapdisk_control_kick();
 }
 
 static int
-tapdisk_control_mkdir(const char *dir)
+tapdisk_control_sub_match(struct tapdisk_ctl_conn *conn, int minor)
 {
-	int err;
-	char *ptr, *name, *start;
+	return conn->sub.minor < 0 || conn->sub.minor == minor;
+}
 
-	err = access(dir, W_OK | R_OK);
-	if (!err)
-		return 0;
+/* what does not fit behind a slow reader is dropped */
+static int
+tapdisk_control_push(struct tapdisk_ctl_conn *conn,
+		     tapdisk_message_t *message)
+{
+	size_t rest = conn->out.buf + conn->out.bufsz - conn->out.prod;
 
-	name = strdup(dir);
-	if (!name)
-		return -ENOMEM;
+	if (rest < sizeof(*message)) {
+		conn->sub.dropped++;
+		return -ENOBUFS;
+	}
 
-	start = name;
+	tapdisk_control_write_message(conn, message);
 
-	for (;;) {
+	return 0;
+}
+
+static void
+tapdisk_control_push_events(void)
+{
+	struct td_ctl_event ev[TD_CTL_EVENTS];
+	struct tapdisk_ctl_conn *conn;
+	tapdisk_message_t message;
+	uint64_t seq, dropped;
+	int i, j, n;
+
+	pthread_mutex_lock(&td_control_events.lock);
+
+	n = 0;
+	while (td_control_events.cons != td_control_events.prod)
+		ev[n++] = td_control_events.ev[td_control_events.cons++ %
+					       TD_CTL_EVENTS];
+
+	seq      = td_control_events.seq;
+	dropped  = td_control_events.dropped;
+	td_control_events.seq += n;
+
+	pthread_mutex_unlock(&td_control_events.lock);
+
+	for (i = 0; i < TD_CTL_MAX_CONNECTIONS; i++) {
+		conn = &td_control.__conn[i];
+
+		if (!(conn->sub.flags & TAPDISK_MESSAGE_SUBSCRIBE_EVENTS) ||
+		    !tapdisk_ctl_conn_connected(conn))
+			continue;
+
+		for (j = 0; j < n; j++) {
+			if (!tapdisk_control_sub_match(conn, ev[j].minor))
+				continue;
+
+			memset(&message, 0, sizeof(message));
+			message.type            = TAPDISK_MESSAGE_EVENT;
+			message.cookie          = ev[j].minor;
+			message.u.event.event   = ev[j].event;
+			message.u.event.error   = ev[j].error;
+			message.u.event.state   = ev[j].state;
+			message.u.event.count   = ev[j].count;
+			message.u.event.seq     = seq + j;
+			message.u.event.dropped = dropped;
+
+			tapdisk_control_push(conn, &message);
+		}
+	}
+}
+
+static void
+tapdisk_control_kick_event(event_id_t id, char mode, void *private)
+{
+	uint64_t val;
+	int gcc;
+
+	gcc = read(td_control_kick_fd, &val, sizeof(val));
+	if (gcc) {};
+
+	tapdisk_control_wake_headroom();
+	tapdisk_control_push_events();
+}
+
+#define td_ctl_delta(_dst, _cur, _prev, _f)		\
+	((_dst)->_f = (_cur)->_f - (_prev)->_f)
+
+/* changes of every VBD subscribed to since the last interval */
+static void
+tapdisk_control_push_counters(event_id_t id, char mode, void *private)
+{
+	struct tapdisk_ctl_conn *conn = private;
+	const struct td_shmstats_vbd *slot;
+	struct td_shmstats_vbd cur;
+	tapdisk_message_counters_t *c, now;
+	tapdisk_message_t message;
+	struct td_ctl_sample *prev;
+	int i;
+
+	for (i = 0; (slot = tapdisk_metrics_slot(i)); i++) {
+		prev = &conn->sub.prev[i];
+
+		if (td_shmstats_read(slot, &cur) ||
+		    !tapdisk_control_sub_match(conn, cur.minor)) {
+			prev->used = 0;
+			continue;
+		}
+
+		if (!prev->used || prev->minor != cur.minor) {
+			memset(prev, 0, sizeof(*prev));
+			prev->used  = 1;
+			prev->minor = cur.minor;
+		}
+
+		memset(&now, 0, sizeof(now));
+		now.updated     = cur.updated;
+		now.state       = cur.state;
+		now.inflight[0] = cur.inflight[0];
+		now.inflight[1] = cur.inflight[1];
+		now.received    = cur.received;
+		now.returned    = cur.returned;
+		now.errors      = cur.errors;
+		now.retries     = cur.retries;
+		now.secs[0]     = cur.secs[0];
+		now.secs[1]     = cur.secs[1];
+		now.zero_secs   = cur.zero_secs;
+		now.flushes     = cur.flushes;
+		now.held        = cur.held;
+		now.expired     = cur.expired;
+
+		/* idle VBDs are not pushed */
+		now.updated = prev->c.updated;
+		if (!memcmp(&now, &prev->c, sizeof(now)))
+			continue;
+		now.updated = cur.updated;
+
+		memset(&message, 0, sizeof(message));
+		message.type   = TAPDISK_MESSAGE_COUNTERS;
+		message.cookie = cur.minor;
+
+		c = &message.u.counters;
+		c->updated     = now.updated;
+		c->state       = now.state;
+		c->inflight[0] = now.inflight[0];
+		c->inflight[1] = now.inflight[1];
+		c->dropped     = conn->sub.dropped;
+		td_ctl_delta(c, &now, &prev->c, received);
+		td_ctl_delta(c, &now, &prev->c, returned);
+		td_ctl_delta(c, &now, &prev->c, errors);
+		td_ctl_delta(c, &now, &prev->c, retries);
+		td_ctl_delta(c, &now, &prev->c, secs[0]);
+		td_ctl_delta(c, &now, &prev->c, secs[1]);
+		td_ctl_delta(c, &now, &prev->c, zero_secs);
+		td_ctl_delta(c, &now, &prev->c, flushes);
+		td_ctl_delta(c, &now, &prev->c, held);
+		td_ctl_delta(c, &now, &prev->c, expired);
+
+		if (!tapdisk_control_push(conn, &message))
+			prev->c = now;
+	}
+}
+
+static void
+tapdisk_control_unsubscribe(struct tapdisk_ctl_conn *conn)
+{
+	if (conn->sub.event_id >= 0) {
+		tapdisk_server_unregister_main_event(conn->sub.event_id);
+		conn->sub.event_id = -1;
+	}
+
+	free(conn->sub.prev);
+	conn->sub.prev = NULL;
+
+	if (conn->sub.flags & TAPDISK_MESSAGE_SUBSCRIBE_EVENTS)
+		td_control_events.subscribers--;
+
+	conn->sub.flags   = 0;
+	conn->sub.dropped = 0;
+}
+
+/* The connection stays, for pushes, until closed or reused. */
+static void
+tapdisk_control_subscribe(struct tapdisk_ctl_conn *conn,
+			  tapdisk_message_t *request)
+{
+	tapdisk_message_subscribe_t *sub = &request->u.subscribe;
+	tapdisk_message_t response;
+	void *buf;
+	int err = 0;
+
+	if (!(sub->flags & (TAPDISK_MESSAGE_SUBSCRIBE_EVENTS |
+			    TAPDISK_MESSAGE_SUBSCRIBE_COUNTERS))) {
+		err = -EINVAL;
+		goto out;
+	}
+
+	if (conn->out.bufsz < TD_CTL_PUSH_BUFSZ &&
+	    conn->out.prod == conn->out.buf) {
+		buf = realloc(conn->out.buf, TD_CTL_PUSH_BUFSZ);
+		if (!buf) {
+			err = -ENOMEM;
+			goto out;
+		}
+		conn->out.buf   = buf;
+		conn->out.bufsz = TD_CTL_PUSH_BUFSZ;
+		conn->out.prod  = buf;
+		conn->out.cons  = buf;
+	}
+
+	if (sub->flags & TAPDISK_MESSAGE_SUBSCRIBE_COUNTERS) {
+		if (!sub->interval) {
+			err = -EINVAL;
+			goto out;
+		}
+
+		if (!tapdisk_metrics_slot(0)) {
+			err = -EOPNOTSUPP;
+			goto out;
+		}
+
+		conn->sub.prev = calloc(TD_SHMSTATS_VBDS,
+					sizeof(*conn->sub.prev));
+		if (!conn->sub.prev) {
+			err = -ENOMEM;
+			goto out;
+		}
+
+		err = tapdisk_server_register_main_event(SCHEDULER_POLL_TIMEOUT,
+							 -1, sub->interval,
+							 tapdisk_control_push_counters,
+							 conn);
+		if (err < 0)
+			goto out;
+
+		conn->sub.event_id = err;
+		err = 0;
+	}
+
+	if (sub->flags & TAPDISK_MESSAGE_SUBSCRIBE_EVENTS)
+		td_control_events.subscribers++;
+
+	conn->sub.flags = sub->flags;
+	conn->sub.minor = request->cookie == (uint16_t)-1 ? -1 : request->cookie;
+	conn->in.keep   = 1;
+
+out:
+	if (err)
+		tapdisk_control_unsubscribe(conn);
+
+	memset(&response, 0, sizeof(response));
+	response.type               = TAPDISK_MESSAGE_SUBSCRIBE_RSP;
+	response.cookie             = request->cookie;
+	response.u.subscribe.error  = -err;
+	response.u.subscribe.flags  = conn->sub.flags;
+	tapdisk_control_write_message(conn, &response);
+}
+
+static int
+tapdisk_control_open_kick(void)
+{
+	int err;
+
+	td_control_kick_fd = tapdisk_sys_eventfd(0);
+	if (td_control_kick_fd < 0)
+		return -errno;
+
+	err = tapdisk_server_register_main_event(SCHEDULER_POLL_READ_FD,
+						 td_control_kick_fd, 0,
+						 tapdisk_control_kick_event,
+						 NULL);
+	if (err < 0)
+		return err;
+
+	td_control.kick_event = err;
+
+	return 0;
+}
+
+static void
+tapdisk_control_sched_vbd(struct tapdisk_ctl_conn *conn,
+			  tapdisk_message_t *request)
+{
+	tapdisk_message_t response;
+	char policy[TAPDISK_MESSAGE_POLICY_LENGTH];
+	td_vbd_t *vbd;
+	int err;
+
+	memset(&response, 0, sizeof(response));
+	response.type = TAPDISK_MESSAGE_SCHED_RSP;
+
+	vbd = tapdisk_server_get_vbd(request->cookie);
+	if (!vbd) {
+		err = -EINVAL;
+		goto out;
+	}
+
+	memcpy(policy, request->u.sched.policy, sizeof(policy));
+	policy[sizeof(policy) - 1] = 0;
+
+	err = tapdisk_vbd_set_policy(vbd, policy, request->u.sched.weight);
+out:
+	response.cookie = request->cookie;
+	response.u.response.error = -err;
+	tapdisk_control_write_message(conn, &response);
+}
+
+static void
+tapdisk_control_coalesce_vbd(struct tapdisk_ctl_conn *conn,
+			     tapdisk_message_t *request)
+{
+	tapdisk_message_t response;
+	td_vbd_t *vbd;
+	int err;
+
+	memset(&response, 0, sizeof(response));
+	response.type = TAPDISK_MESSAGE_COALESCE_RSP;
+
+	vbd = tapdisk_server_get_vbd(request->cookie);
+	if (!vbd) {
+		err = -EINVAL;
+		goto out;
+	}
+
+	err = tapdisk_vbd_coalesce(vbd,
+				   (uint64_t)request->u.coalesce.rate << 20);
+out:
+	response.cookie = request->cookie;
+	response.u.response.error = -err;
+	tapdisk_control_write_message(conn, &response);
+}
+
+static void
+tapdisk_control_migrate_vbd(struct tapdisk_ctl_conn *conn,
+			    tapdisk_message_t *request)
+{
+	tapdisk_message_t response;
+	const char *target;
+	td_vbd_t *vbd;
+	int err;
+
+	memset(&response, 0, sizeof(response));
+	response.type = TAPDISK_MESSAGE_MIGRATE_RSP;
+
+	vbd = tapdisk_server_get_vbd(request->cookie);
+	if (!vbd) {
+		err = -EINVAL;
+		goto out;
+	}
+
+	target = request->u.migrate.target;
+	if (!target[0] ||
+	    strnlen(target, TAPDISK_MESSAGE_MAX_PATH_LENGTH) >=
+	    TAPDISK_MESSAGE_MAX_PATH_LENGTH) {
+		err = -EINVAL;
+		goto out;
+	}
+
+	err = tapdisk_vbd_migrate(vbd, target,
+				  (uint64_t)request->u.migrate.rate << 20);
+out:
+	response.cookie = request->cookie;
+	response.u.response.error = -err;
+	tapdisk_control_write_message(conn, &response);
+}
+
+static void
+tapdisk_control_record(struct tapdisk_ctl_conn *conn,
+		       tapdisk_message_t *request)
+{
+	tapdisk_message_t response;
+	const char *path;
+	td_vbd_t *vbd;
+	int err;
+
+	memset(&response, 0, sizeof(response));
+	response.type = TAPDISK_MESSAGE_RECORD_RSP;
+
+	vbd = tapdisk_server_get_vbd(request->cookie);
+	if (!vbd) {
+		err = -EINVAL;
+		goto out;
+	}
+
+	path = request->u.record.path;
+	if (strnlen(path, TAPDISK_MESSAGE_MAX_PATH_LENGTH) >=
+	    TAPDISK_MESSAGE_MAX_PATH_LENGTH ||
+	    !path[0] != !request->u.record.size) {
+		err = -EINVAL;
+		goto out;
+	}
+
+	err = tapdisk_vbd_record(vbd, path[0] ? path : NULL,
+				 (uint64_t)request->u.record.size << 20);
+out:
+	response.cookie = request->cookie;
+	response.u.response.error = -err;
+	tapdisk_control_write_message(conn, &response);
+}
+
+static void
+tapdisk_control_heat(struct tapdisk_ctl_conn *conn,
+		     tapdisk_message_t *request)
+{
+	tapdisk_message_heat_t *heat = &request->u.heat;
+	tapdisk_message_t response;
+	uint64_t blocks = 0, hot = 0;
+	td_vbd_t *vbd;
+	int err;
+
+	memset(&response, 0, sizeof(response));
+	response.type = TAPDISK_MESSAGE_HEAT_RSP;
+
+	vbd = tapdisk_server_get_vbd(request->cookie);
+	if (!vbd) {
+		err = -EINVAL;
+		goto out;
+	}
+
+	if (strnlen(heat->path, TAPDISK_MESSAGE_MAX_PATH_LENGTH) >=
+	    TAPDISK_MESSAGE_MAX_PATH_LENGTH ||
+	    !(heat->flags & TAPDISK_MESSAGE_HEAT_SNAPSHOT) != !heat->path[0]) {
+		err = -EINVAL;
+		goto out;
+	}
+
+	err = tapdisk_vbd_heat(vbd, heat->flags, heat->decay, heat->path,
+			       &blocks, &hot);
+out:
+	response.cookie           = request->cookie;
+	response.u.heat.error     = -err;
+	response.u.heat.flags     = heat->flags;
+	response.u.heat.blocks    = blocks;
+	response.u.heat.hot       = hot;
+	tapdisk_control_write_message(conn, &response);
+}
+
+static void
+tapdisk_control_warm(struct tapdisk_ctl_conn *conn,
+		     tapdisk_message_t *request)
+{
+	tapdisk_message_warm_t *warm = &request->u.warm;
+	tapdisk_message_t response;
+	td_vbd_t *vbd;
+	int err;
+
+	memset(&response, 0, sizeof(response));
+	response.type = TAPDISK_MESSAGE_WARM_RSP;
+
+	vbd = tapdisk_server_get_vbd(request->cookie);
+	if (!vbd) {
+		err = -EINVAL;
+		goto out;
+	}
+
+	if (strnlen(warm->path, TAPDISK_MESSAGE_MAX_PATH_LENGTH) >=
+	    TAPDISK_MESSAGE_MAX_PATH_LENGTH) {
+		err = -EINVAL;
+		goto out;
+	}
+
+	err = tapdisk_vbd_warm(vbd, warm->path[0] ? warm->path : NULL,
+			       (uint64_t)warm->size << 20,
+			       (uint64_t)warm->rate << 20);
+	if (!err && vbd->warm)
+		response.u.warm.blocks = vbd->warm->n_blocks;
+out:
+	response.cookie       = request->cookie;
+	response.u.warm.error = -err;
+	tapdisk_control_write_message(conn, &response);
+}
+
+static void
+tapdisk_control_ring(struct tapdisk_ctl_conn *conn,
+		     tapdisk_message_t *request)
+{
+	tapdisk_message_t response;
+	const char *path;
+	td_vbd_t *vbd;
+	int err;
+
+	memset(&response, 0, sizeof(response));
+	response.type = TAPDISK_MESSAGE_RING_RSP;
+
+	vbd = tapdisk_server_get_vbd(request->cookie);
+	if (!vbd) {
+		err = -EINVAL;
+		goto out;
+	}
+
+	path = request->u.ring.path;
+	if (strnlen(path, TAPDISK_MESSAGE_MAX_PATH_LENGTH) >=
+	    TAPDISK_MESSAGE_MAX_PATH_LENGTH ||
+	    !path[0] != !request->u.ring.size ||
+	    request->u.ring.size > 1024) {
+		err = -EINVAL;
+		goto out;
+	}
+
+	err = tapdisk_vbd_serve_ring(vbd, path[0] ? path : NULL,
+				     request->u.ring.slots,
+				     request->u.ring.size << 20,
+				     request->u.ring.poll_us);
+out:
+	response.cookie = request->cookie;
+	response.u.response.error = -err;
+	tapdisk_control_write_message(conn, &response);
+}
+
+static void
+tapdisk_control_cache(struct tapdisk_ctl_conn *conn,
+		      tapdisk_message_t *request)
+{
+	tapdisk_message_t response;
+	uint64_t limit, used, held, mapped;
+	uint32_t caches, flags;
+	int err, mode, dedup;
+
+	memset(&response, 0, sizeof(response));
+	response.type = TAPDISK_MESSAGE_CACHE_RSP;
+
+	flags = request->u.cache.flags;
+	dedup = -1;
+
+	switch (flags & (TAPDISK_MESSAGE_CACHE_DEDUP |
+			 TAPDISK_MESSAGE_CACHE_NODEDUP)) {
+	case 0:
+		break;
+	case TAPDISK_MESSAGE_CACHE_DEDUP:
+		dedup = 1;
+		break;
+	case TAPDISK_MESSAGE_CACHE_NODEDUP:
+		dedup = 0;
+		break;
+	default:
+		err = -EINVAL;
+		goto out;
+	}
+
+	switch (flags & ~(TAPDISK_MESSAGE_CACHE_DEDUP |
+			  TAPDISK_MESSAGE_CACHE_NODEDUP)) {
+	case 0:
+		mode = -1;
+		break;
+	case TAPDISK_MESSAGE_CACHE_PROCESS:
+		mode = BLOCK_CACHE_BUDGET_PROCESS;
+		break;
+	case TAPDISK_MESSAGE_CACHE_HOST:
+		mode = BLOCK_CACHE_BUDGET_HOST;
+		break;
+	default:
+		err = -EINVAL;
+		goto out;
+	}
+
+	err = block_cache_set_budget((uint64_t)request->u.cache.size << 20,
+				     mode);
+	if (err)
+		goto out;
+
+	if (dedup >= 0) {
+		err = block_cache_set_dedup(dedup);
+		if (err)
+			goto out;
+	}
+
+	block_cache_get_budget(&limit, &used, &caches, &mode);
+	block_cache_get_dedup(&dedup, &held, &mapped);
+	snprintf(response.u.response.message,
+		 sizeof(response.u.response.message),
+		 "budget=%s limit=%"PRIu64" used=%"PRIu64" caches=%u "
+		 "dedup=%s held=%"PRIu64" mapped=%"PRIu64,
+		 mode == BLOCK_CACHE_BUDGET_HOST ? "host" : "process",
+		 limit, used, caches, dedup ? "on" : "off", held, mapped);
+out:
+	response.cookie = request->cookie;
+	response.u.response.error = -err;
+	tapdisk_control_write_message(conn, &response);
+}
+
+static int tapdisk_control_enter(struct tapdisk_control_info *,
+				 tapdisk_message_t *);
+static void tapdisk_control_leave(int);
+extern struct tapdisk_control_info message_infos[];
+
+static void
+tapdisk_control_batch_error(struct tapdisk_ctl_conn *conn,
+			    tapdisk_message_t *request, int err)
+{
+	tapdisk_message_t response;
+
+	memset(&response, 0, sizeof(response));
+	response.type = TAPDISK_MESSAGE_ERROR;
+	response.cookie = request->cookie;
+	response.u.response.error = -err;
+
+	tapdisk_control_write_message(conn, &response);
+}
+
+/* whether the response a handler just wrote reports a failure */
+static int
+tapdisk_control_batch_failed(struct tapdisk_ctl_conn *conn, void *prod)
+{
+	tapdisk_message_t response;
+
+	if (conn->out.prod - prod != sizeof(response))
+		return 1;
+
+	memcpy(&response, prod, sizeof(response));
+
+	switch (response.type) {
+	case TAPDISK_MESSAGE_ERROR:
+		return 1;
+	case TAPDISK_MESSAGE_OPEN_RSP:
+		return 0;
+	default:
+		return !!response.u.response.error;
+	}
+}
+
+/*
+ * Pauses a run of VBDs together: all queues are asked to quiesce
+ * first, and drain side by side while we wait on each in turn.
+ */
+static int
+tapdisk_control_batch_pause(struct tapdisk_ctl_conn *conn,
+			    tapdisk_message_t *requests, int n)
+{
+	struct tapdisk_control_info *info;
+	int err[TAPDISK_MESSAGE_BATCH_MAX];
+	tapdisk_message_t response;
+	int i, entered, failed;
+	td_vbd_t *vbd;
+
+	info = &message_infos[TAPDISK_MESSAGE_PAUSE];
+
+	for (i = 0; i < n; i++) {
+		entered = tapdisk_control_enter(info, &requests[i]);
+
+		vbd = tapdisk_server_get_vbd(requests[i].cookie);
+		err[i] = vbd ? tapdisk_vbd_pause(vbd) : -EINVAL;
+
+		tapdisk_control_leave(entered);
+	}
+
+	for (i = 0; i < n; i++) {
+		if (err[i] != -EAGAIN)
+			continue;
+
+		entered = tapdisk_control_enter(info, &requests[i]);
+
+		vbd = tapdisk_server_get_vbd(requests[i].cookie);
+		while (vbd && err[i] == -EAGAIN && conn->fd >= 0) {
+			tapdisk_server_iterate();
+			err[i] = tapdisk_vbd_pause(vbd);
+		}
+
+		tapdisk_control_leave(entered);
+	}
+
+	for (i = 0, failed = 0; i < n; i++) {
+		memset(&response, 0, sizeof(response));
+		response.type = TAPDISK_MESSAGE_PAUSE_RSP;
+		response.cookie = requests[i].cookie;
+		response.u.response.error = -err[i];
+		tapdisk_control_write_message(conn, &response);
+
+		failed += !!err[i];
+	}
+
+	return failed;
+}
+
+static int
+tapdisk_control_batch_one(struct tapdisk_ctl_conn *conn,
+			  tapdisk_message_t *request)
+{
+	struct tapdisk_control_info *info;
+	void *prod = conn->out.prod;
+	int entered;
+
+	/* single response requests only, each with its own VBD */
+	info = request->type <= TAPDISK_MESSAGE_MAX ?
+		&message_infos[request->type] : NULL;
+
+	if (!info || !info->handler ||
+	    request->type == TAPDISK_MESSAGE_BATCH ||
+	    info->flags & (TAPDISK_MSG_REENTER | TAPDISK_MSG_ALL_VBDS) ||
+	    tapdisk_control_validate_request(request)) {
+		tapdisk_control_batch_error(conn, request, -EINVAL);
+		return 1;
+	}
+
+	conn->info = info;
+
+	entered = tapdisk_control_enter(info, request);
+	info->handler(conn, request);
+	tapdisk_control_leave(entered);
+
+	return tapdisk_control_batch_failed(conn, prod);
+}
+
+static void
+tapdisk_control_batch(struct tapdisk_ctl_conn *conn,
+		      tapdisk_message_t *request)
+{
+	struct tapdisk_control_info *info = conn->info;
+	tapdisk_message_t *requests, response;
+	int i, j, n, err, failed, stop;
+	size_t size;
+	void *buf;
+
+	n        = request->u.batch.count;
+	stop     = request->u.batch.flags & TAPDISK_MESSAGE_BATCH_STOP;
+	failed   = 0;
+	requests = NULL;
+
+	memset(&response, 0, sizeof(response));
+	response.cookie = request->cookie;
+
+	if (!n || n > TAPDISK_MESSAGE_BATCH_MAX) {
+		err = -EINVAL;
+		goto fail;
+	}
+
+	requests = calloc(n, sizeof(*requests));
+	if (!requests) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	for (i = 0; i < n; i++) {
+		err = tapdisk_control_read_message(conn->fd, &requests[i], 2);
+		if (err)
+			goto fail;
+	}
+
+	/* room for all responses */
+	size = (n + 1) * sizeof(response);
+	if (size > conn->out.bufsz) {
+		ASSERT(conn->out.prod == conn->out.buf);
+		ASSERT(conn->out.cons == conn->out.buf);
+		buf = realloc(conn->out.buf, size);
+		if (!buf) {
+			err = -ENOMEM;
+			goto fail;
+		}
+		conn->out.buf = buf;
+		conn->out.bufsz = size;
+		conn->out.prod = buf;
+		conn->out.cons = buf;
+	}
+
+	response.type          = TAPDISK_MESSAGE_BATCH_RSP;
+	response.u.batch.count = n;
+	tapdisk_control_write_message(conn, &response);
+
+	for (i = 0; i < n; i = j) {
+		j = i + 1;
+
+		if (failed && stop) {
+			tapdisk_control_batch_error(conn, &requests[i],
+						    -ECANCELED);
+			continue;
+		}
+
+		if (requests[i].type == TAPDISK_MESSAGE_PAUSE) {
+			while (j < n &&
+			       requests[j].type == TAPDISK_MESSAGE_PAUSE)
+				j++;
+			failed += tapdisk_control_batch_pause(conn,
+							      &requests[i],
+							      j - i);
+			continue;
+		}
+
+		failed += tapdisk_control_batch_one(conn, &requests[i]);
+	}
+
+	if (failed)
+		INFO("batch of %d requests, %d failed\n", n, failed);
+out:
+	free(requests);
+	conn->info = info;
+	return;
+
+fail:
+	ERR(err, "rejecting batch of %d requests\n", n);
+	response.type             = TAPDISK_MESSAGE_ERROR;
+	response.u.response.error = -err;
+	tapdisk_control_write_message(conn, &response);
+	goto out;
+}
+
+struct tapdisk_control_info message_infos[TAPDISK_MESSAGE_MAX + 1] = {
+	[TAPDISK_MESSAGE_PID] = {
+		.handler = tapdisk_control_get_pid,
+		.flags   = TAPDISK_MSG_REENTER,
+	},
+	[TAPDISK_MESSAGE_LIST] = {
+		.handler = tapdisk_control_list,
+		.flags   = TAPDISK_MSG_REENTER | TAPDISK_MSG_ALL_VBDS,
+	},
+	[TAPDISK_MESSAGE_ATTACH] = {
+		.handler = tapdisk_control_attach_vbd,
+		.flags   = TAPDISK_MSG_VERBOSE | TAPDISK_MSG_NEW_VBD,
+	},
+	[TAPDISK_MESSAGE_DETACH] = {
+		.handler = tapdisk_control_detach_vbd,
+		.flags   = TAPDISK_MSG_VERBOSE | TAPDISK_MSG_VBD,
+	},
+	[TAPDISK_MESSAGE_OPEN] = {
+		.handler = tapdisk_control_open_image,
+		.flags   = TAPDISK_MSG_VERBOSE | TAPDISK_MSG_VBD,
+	},
+	[TAPDISK_MESSAGE_PAUSE] = {
+		.handler = tapdisk_control_pause_vbd,
+		.flags   = TAPDISK_MSG_VERBOSE | TAPDISK_MSG_VBD,
+	},
+	[TAPDISK_MESSAGE_RESUME] = {
+		.handler = tapdisk_control_resume_vbd,
+		.flags   = TAPDISK_MSG_VERBOSE | TAPDISK_MSG_VBD,
+	},
+	[TAPDISK_MESSAGE_CLOSE] = {
+		.handler = tapdisk_control_close_image,
+		.flags   = TAPDISK_MSG_VERBOSE | TAPDISK_MSG_VBD,
+	},
+	[TAPDISK_MESSAGE_STATS] = {
+		.handler = tapdisk_control_stats,
+		.flags   = TAPDISK_MSG_REENTER | TAPDISK_MSG_VBD,
+	},
+	[TAPDISK_MESSAGE_POLL] = {
+		.handler = tapdisk_control_poll_vbd,
+		.flags   = TAPDISK_MSG_VERBOSE | TAPDISK_MSG_VBD,
+	},
+	[TAPDISK_MESSAGE_SCHED] = {
+		.handler = tapdisk_control_sched_vbd,
+		.flags   = TAPDISK_MSG_VERBOSE | TAPDISK_MSG_VBD,
+	},
+	[TAPDISK_MESSAGE_COALESCE] = {
+		.handler = tapdisk_control_coalesce_vbd,
+		.flags   = TAPDISK_MSG_VERBOSE | TAPDISK_MSG_VBD,
+	},
+	[TAPDISK_MESSAGE_MIGRATE] = {
+		.handler = tapdisk_control_migrate_vbd,
+		.flags   = TAPDISK_MSG_VERBOSE | TAPDISK_MSG_VBD,
+	},
+	[TAPDISK_MESSAGE_TRACE] = {
+		.handler = tapdisk_control_trace,
+		.flags   = TAPDISK_MSG_REENTER,
+	},
+	[TAPDISK_MESSAGE_RECORD] = {
+		.handler = tapdisk_control_record,
+		.flags   = TAPDISK_MSG_VERBOSE | TAPDISK_MSG_VBD,
+	},
+	[TAPDISK_MESSAGE_RING] = {
+		.handler = tapdisk_control_ring,
+		.flags   = TAPDISK_MSG_VERBOSE | TAPDISK_MSG_VBD,
+	},
+	[TAPDISK_MESSAGE_HEADROOM] = {
+		.handler = tapdisk_control_headroom,
+		.flags   = TAPDISK_MSG_VERBOSE | TAPDISK_MSG_VBD,
+	},
+	[TAPDISK_MESSAGE_HEAT] = {
+		.handler = tapdisk_control_heat,
+		.flags   = TAPDISK_MSG_VERBOSE | TAPDISK_MSG_VBD,
+	},
+	[TAPDISK_MESSAGE_WARM] = {
+		.handler = tapdisk_control_warm,
+		.flags   = TAPDISK_MSG_VERBOSE | TAPDISK_MSG_VBD,
+	},
+	[TAPDISK_MESSAGE_SUBSCRIBE] = {
+		.handler = tapdisk_control_subscribe,
+		.flags   = TAPDISK_MSG_REENTER,
+	},
+	[TAPDISK_MESSAGE_CACHE] = {
+		.handler = tapdisk_control_cache,
+		.flags   = TAPDISK_MSG_VERBOSE | TAPDISK_MSG_ALL_VBDS,
+	},
+	[TAPDISK_MESSAGE_BATCH] = {
+		.handler = tapdisk_control_batch,
+		.flags   = TAPDISK_MSG_VERBOSE,
+	},
+};
+
+/*
+ * Handlers run on the main thread, against the event loop of the VBD
+ * they act on. Returns what tapdisk_control_leave() needs to undo.
+ */
+static int
+tapdisk_control_enter(struct tapdisk_control_info *info,
+		      tapdisk_message_t *message)
+{
+	int flags = info->flags;
+
+	if ((flags & TAPDISK_MSG_VBD) && message->cookie == (uint16_t)-1)
+		flags = TAPDISK_MSG_ALL_VBDS;
+
+	if (flags & TAPDISK_MSG_ALL_VBDS) {
+		tapdisk_server_enter_all();
+		return TAPDISK_MSG_ALL_VBDS;
+	}
+
+	if (flags & TAPDISK_MSG_NEW_VBD) {
+		tapdisk_server_enter_new_vbd();
+		return TAPDISK_MSG_VBD;
+	}
+
+	/* no such VBD: the handler says so, from the main loop */
+	if ((flags & TAPDISK_MSG_VBD) &&
+	    !tapdisk_server_enter_vbd(message->cookie))
+		return TAPDISK_MSG_VBD;
+
+	return 0;
+}
+
+static void
+tapdisk_control_leave(int entered)
+{
+	if (entered & TAPDISK_MSG_ALL_VBDS)
+		tapdisk_server_leave_all();
+	if (entered & TAPDISK_MSG_VBD)
+		tapdisk_server_leave_vbd();
+}
+
+
+static void
+tapdisk_control_handle_request(event_id_t id, char mode, void *private)
+{
+	int err, excl, entered;
+	tapdisk_message_t message, response;
+	struct tapdisk_ctl_conn *conn = private;
+
+	conn->info = NULL;
+
+	/* kept connections wait for their next request */
+	if (conn->in.keep && !(mode & SCHEDULER_POLL_READ_FD))
+		return;
+
+	conn->in.keep = 0;
+	conn->in.headroom = -1;
+	tapdisk_control_unsubscribe(conn);
+
+	err = tapdisk_control_read_message(conn->fd, &message, 2);
+	if (err)
+		goto close;
+
+	err = tapdisk_control_validate_request(&message);
+	if (err)
+		goto invalid;
+
+	if (message.type > TAPDISK_MESSAGE_MAX)
+		goto invalid;
+
+	conn->info = &message_infos[message.type];
+
+	if (!conn->info->handler)
+		goto invalid;
+
+	if (conn->info->flags & TAPDISK_MSG_VERBOSE)
+		DBG("received '%s' message (uuid = %u)\n",
+		    tapdisk_message_name(message.type), message.cookie);
+
+	if (conn->in.busy)
+		goto busy;
+
+	excl = !(conn->info->flags & TAPDISK_MSG_REENTER);
+	if (excl) {
+		if (td_control.busy)
+			goto busy;
+
+		td_control.busy = 1;
+	}
+	conn->in.busy = 1;
+
+	entered = tapdisk_control_enter(conn->info, &message);
+	conn->info->handler(conn, &message);
+	tapdisk_control_leave(entered);
+
+	conn->in.busy = 0;
+	if (excl)
+		td_control.busy = 0;
+
+	if (!conn->in.keep)
+		tapdisk_control_release_connection(conn);
+	return;
+
+error:
+	memset(&response, 0, sizeof(response));
+	response.type = TAPDISK_MESSAGE_ERROR;
+	response.u.response.error = (err ? -err : EINVAL);
+	tapdisk_control_write_message(conn, &response);
+
+close:
+	tapdisk_control_close_connection(conn);
+	return;
+
+busy:
+	err = -EBUSY;
+	ERR(err, "rejecting message '%s' while busy\n",
+	    tapdisk_message_name(message.type));
+	goto error;
+
+invalid:
+	err = -EINVAL;
+	ERR(err, "rejecting unsupported message '%s'\n",
+	    tapdisk_message_name(message.type));
+	goto error;
+}
+
+static void
+tapdisk_control_accept(event_id_t id, char mode, void *private)
+{
+	int err, fd;
+	struct tapdisk_ctl_conn *conn;
+
+	fd = accept(td_control.socket, NULL, NULL);
+	if (fd == -1) {
+		ERR(-errno, "failed to accept new control connection: %d\n", errno);
+		return;
+	}
+
+	conn = tapdisk_ctl_conn_open(fd);
+	if (!conn) {
+		close(fd);
+		ERR(-ENOMEM, "failed to allocate new control connection\n");
+		return;
+	}
+
+	err = tapdisk_server_register_main_event(SCHEDULER_POLL_READ_FD,
+					         conn->fd, TD_CTL_RECV_TIMEOUT,
+					         tapdisk_control_handle_request,
+					         conn);
+	if (err == -1) {
+		tapdisk_control_close_connection(conn);
+		ERR(err, "failed to register new control event\n");
+		return;
+	}
+
+	conn->in.event_id = err;
+}
+
+static int
+tapdisk_control_mkdir(const char *dir)
+{
+	int err;
+	char *ptr, *name, *start;
+
+	err = access(dir, W_OK | R_OK);
+	if (!err)
+		return 0;
+
+	name = strdup(dir);
+	if (!name)
+		return -ENOMEM;
+
+	start = name;
+
+	for (;;) {
 		ptr = strchr(start + 1, '/');
 		if (ptr)
 			*ptr = '\0';
@@ -1266,9 +2524,9 @@ tapdisk_control_create_socket(char **socket_path)
 		goto fail;
 	}
 
-	err = tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
-					    td_control.socket, 0,
-					    tapdisk_control_accept, NULL);
+	err = tapdisk_server_register_main_event(SCHEDULER_POLL_READ_FD,
+					         td_control.socket, 0,
+					         tapdisk_control_accept, NULL);
 	if (err < 0) {
 		EPRINTF("failed to add watch: %d\n", err);
 		goto fail;
@@ -1287,7 +2545,22 @@ fail:
 int
 tapdisk_control_open(char **path)
 {
+	int err;
+
 	tapdisk_control_initialize();
 
-	return tapdisk_control_create_socket(path);
+	err = tapdisk_control_create_socket(path);
+	if (err)
+		return err;
+
+	err = tapdisk_control_open_kick();
+	if (err) {
+		tapdisk_control_close();
+		return err;
+	}
+
+	/* stats keep coming over the socket without */
+	tapdisk_metrics_open();
+
+	return 0;
 }
@@ -18,7 +18,14 @@
 #ifndef __TAPDISK_CONTROL_H__
 #define __TAPDISK_CONTROL_H__
 
+#include <stdint.h>
+
 int tapdisk_control_open(char **path);
 void tapdisk_control_close(void);
+void tapdisk_control_kick_headroom(void);
+
+/* from any loop: a TAPDISK_EVENT_* of VBD @minor, for subscribers */
+void tapdisk_control_post_event(int minor, int event, int error,
+				uint32_t state);
 
 #endif
@@ -1,4 +1,4 @@
-/* 
+/*
  * Copyright (C) Citrix Systems Inc.
  *
  * This program is free software; you can redistribute it and/or
@@ -24,708 +24,506 @@
 #include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
-#include <assert.h>
+#include <libgen.h>
 #include <unistd.h>
+#include <sys/mman.h>
 
 #include "list.h"
 #include "scheduler.h"
+#include "tapdisk.h"
 #include "tapdisk-vbd.h"
 #include "tapdisk-server.h"
-#include "tapdisk-disktype.h"
-#include "libvhd.h"
-
-#define POLL_READ                        0
-#define POLL_WRITE                       1
-
-#define SPB_SHIFT (VHD_BLOCK_SHIFT - SECTOR_SHIFT)
-
-/* 
- * we have to use half the max number of requests because we're using the same 
- * tapdisk server for both streams and all the parents will be shared. If we 
- * issue more than MAX_REQUESTS/2 requests, the vhd_state will run out of 
- * vhd_request's and return EBUSY, which we don't handle here. However, even 
- * with MAX_REQUESTS/2 we can still run out of vhd_request's because of 
- * splitting: if some sectors spanned by a segment are in a parent, a segment 
- * could be split into at most N/2 vhd_request's, where N is the number of 
- * sectors per segment. Therefore, if we use 11 segments, we need to divide 
- * MAX_REQUESTS by 11/2=6 on top of that. If we don't, we'd have to handle 
- * EBUSY by retrying here.
+
+#define MIN(a, b)                        ((a) < (b) ? (a) : (b))
+#define BUG_ON(_cond)                    if (unlikely(_cond)) { td_panic(); }
+
+/*
+ * Both images are read chunk by chunk, the same chunk from each, with
+ * up to TD_DIFF_MAX_CHUNKS in flight. Chunks are compared in order as
+ * both halves land, so differing extents come out sorted and merged.
  */
-#define MAX_SEGMENTS 8
-#define MAX_STREAM_REQUESTS (MAX_REQUESTS / 2 / (MAX_SEGMENTS / 2))
+#define TD_DIFF_MAX_CHUNKS               32
+#define TD_DIFF_CHUNK_SIZE               (sysconf(_SC_PAGE_SIZE) * 64)
 
-struct tapdisk_stream_poll {
-	int                              pipe[2];
-	int                              set;
-};
+typedef struct tapdisk_diff_chunk td_diff_chunk_t;
 
-struct tapdisk_stream_request {
-	uint64_t                         sec;
-	uint32_t                         secs;
-	uint64_t                         seqno;
-	blkif_request_t                  blkif_req;
-	struct list_head                 next;
+struct tapdisk_diff_chunk {
+	td_sector_t                      sec;
+	int                              secs;
+	int                              pending;
+	int                              done;
+	int                              err;
+	void                            *buf[2];
+	struct td_iovec                  iov[2];
+	td_vbd_request_t                 vreq[2];
+	struct list_head                 entry;
 };
 
-struct tapdisk_stream {
+struct tapdisk_diff_image {
+	const char                      *params;
 	td_vbd_t                        *vbd;
-
 	unsigned int                     id;
+	td_sector_t                      size;
+};
+
+struct tapdisk_diff {
+	struct tapdisk_diff_image        img[2];
 
 	int                              err;
+	td_sector_t                      cur;
+	td_sector_t                      end;
 
-	uint64_t                         cur;
-	uint64_t                         start;
-	uint64_t                         end;
+	/* differing extent not yet printed */
+	td_sector_t                      ext_sec;
+	td_sector_t                      ext_secs;
 
-	uint64_t                         started;
-	uint64_t                         completed;
+	FILE                            *out;
+	uint64_t                         extents;
+	uint64_t                         differ;
+	uint64_t                         compared;
+	uint64_t                         skipped;
 
-	struct tapdisk_stream_poll       poll;
-	event_id_t                       enqueue_event_id;
+	/* in flight, in the order queued */
+	struct list_head                 chunk_list;
 
-	struct list_head                 free_list;
-	struct list_head                 pending_list;
-	struct list_head                 completed_list;
+	td_diff_chunk_t                  chunks[TD_DIFF_MAX_CHUNKS];
+	td_diff_chunk_t                 *free[TD_DIFF_MAX_CHUNKS];
+	int                              n_free;
 
-	struct tapdisk_stream_request    requests[MAX_STREAM_REQUESTS];
+	event_id_t                       close_event;
 };
 
-static unsigned int tapdisk_stream_count;
-
-static void tapdisk_stream_close_image(struct tapdisk_stream *);
-
-static char *program;
-static struct tapdisk_stream stream1, stream2;
-static vhd_context_t vhd1;
+static void tapdisk_diff_queue_chunks(struct tapdisk_diff *);
 
 static void
-usage(FILE *stream)
+usage(const char *app, int err)
 {
-	printf("usage: %s <-n type:/path/to/image> <-m type:/path/to/image>\n",
-			program);
+	printf("usage: %s <-n type:/path/to/image> <-m type:/path/to/image> "
+	       "[-o extents file]\n", app);
+	exit(err);
 }
 
-static int
-open_vhd(const char *path, vhd_context_t *vhd)
+static void
+tapdisk_diff_close_image(struct tapdisk_diff_image *img)
 {
-	int err;
-
-	err = vhd_open(vhd, path, VHD_OPEN_RDONLY);
-	if (err) {
-		printf("error opening %s: %d\n", path, err);
-		return err;
-	}
+	td_vbd_t *vbd;
 
-	err = vhd_get_bat(vhd);
-	if (err)
-	{
-		printf("error reading BAT for %s: %d\n", path, err);
-		vhd_close(vhd);
-		return err;
+	vbd = tapdisk_server_get_vbd(img->id);
+	if (vbd) {
+		tapdisk_vbd_close_vdi(vbd);
+		tapdisk_server_remove_vbd(vbd);
+		free(vbd->name);
+		free(vbd);
+		img->vbd = NULL;
 	}
+}
 
-	return 0;
+static void
+tapdisk_diff_close_images(struct tapdisk_diff *d)
+{
+	tapdisk_diff_close_image(&d->img[0]);
+	tapdisk_diff_close_image(&d->img[1]);
 }
 
-static inline void
-tapdisk_stream_poll_initialize(struct tapdisk_stream_poll *p)
+static void
+tapdisk_diff_close_event(event_id_t id, char mode, void *private)
 {
-	p->set = 0;
-	p->pipe[POLL_READ] = p->pipe[POLL_WRITE] = -1;
+	struct tapdisk_diff *d = private;
+
+	tapdisk_server_unregister_event(d->close_event);
+	tapdisk_diff_close_images(d);
 }
 
 static int
-tapdisk_stream_poll_open(struct tapdisk_stream_poll *p)
+tapdisk_diff_open_image(struct tapdisk_diff_image *img, unsigned int id)
 {
+	td_disk_info_t info;
 	int err;
 
-	tapdisk_stream_poll_initialize(p);
+	img->id = id;
 
-	err = pipe(p->pipe);
+	err = tapdisk_vbd_initialize(-1, -1, img->id);
 	if (err)
-		return -errno;
+		goto out;
+
+	img->vbd = tapdisk_server_get_vbd(img->id);
+	if (!img->vbd) {
+		err = -ENODEV;
+		goto out;
+	}
 
-	err = fcntl(p->pipe[POLL_READ], F_SETFL, O_NONBLOCK);
+	err = tapdisk_vbd_open_vdi(img->vbd, img->params, TD_OPEN_RDONLY, -1);
 	if (err)
 		goto out;
 
-	err = fcntl(p->pipe[POLL_WRITE], F_SETFL, O_NONBLOCK);
+	err = tapdisk_vbd_get_disk_info(img->vbd, &info);
 	if (err)
 		goto out;
 
-	return 0;
+	img->size = info.size;
 
 out:
-	close(p->pipe[POLL_READ]);
-	close(p->pipe[POLL_WRITE]);
-	tapdisk_stream_poll_initialize(p);
-	return -errno;
+	if (err)
+		fprintf(stderr, "failed to open %s: %d\n", img->params, err);
+	return err;
 }
 
-static void
-tapdisk_stream_poll_close(struct tapdisk_stream_poll *p)
+/* sectors from sec on, a chunk at a time, that neither image holds */
+static td_sector_t
+tapdisk_diff_hole(struct tapdisk_diff *d, td_sector_t sec)
 {
-	if (p->pipe[POLL_READ] != -1)
-		close(p->pipe[POLL_READ]);
-	if (p->pipe[POLL_WRITE] != -1)
-		close(p->pipe[POLL_WRITE]);
-	tapdisk_stream_poll_initialize(p);
-}
+	td_sector_t hole, secs;
 
-static inline void
-tapdisk_stream_poll_clear(struct tapdisk_stream_poll *p)
-{
-	int gcc, dummy;
+	hole = 0;
 
-	gcc = read(p->pipe[POLL_READ], &dummy, sizeof(dummy));
-	p->set = 0;
-}
+	while (sec + hole < d->end) {
+		secs = MIN(TD_DIFF_CHUNK_SIZE >> SECTOR_SHIFT,
+			   d->end - sec - hole);
 
-static inline void
-tapdisk_stream_poll_set(struct tapdisk_stream_poll *p)
-{
-	int dummy = 0;
+		if (tapdisk_vbd_allocated(d->img[0].vbd, sec + hole, secs) ||
+		    tapdisk_vbd_allocated(d->img[1].vbd, sec + hole, secs))
+			break;
 
-	if (!p->set) {
-		int gcc = write(p->pipe[POLL_WRITE], &dummy, sizeof(dummy));
-		p->set = 1;
+		hole += secs;
 	}
-}
 
-static inline int
-tapdisk_stream_stop(struct tapdisk_stream *s)
-{
-	return ((s->cur == s->end || s->err) &&
-			list_empty(&s->pending_list) && 
-			list_empty(&s->completed_list));
+	return hole;
 }
 
-static inline void
-tapdisk_stream_initialize_request(struct tapdisk_stream_request *req)
+static void
+tapdisk_diff_flush_extent(struct tapdisk_diff *d)
 {
-	memset(req, 0, sizeof(*req));
-	INIT_LIST_HEAD(&req->next);
+	if (!d->ext_secs)
+		return;
+
+	fprintf(d->out, "%"PRIu64" %"PRIu64"\n", d->ext_sec, d->ext_secs);
+
+	d->extents++;
+	d->differ  += d->ext_secs;
+	d->ext_secs = 0;
 }
 
-static inline int
-tapdisk_stream_request_idx(struct tapdisk_stream *s,
-			   struct tapdisk_stream_request *req)
+static void
+tapdisk_diff_add_extent(struct tapdisk_diff *d, td_sector_t sec,
+			td_sector_t secs)
 {
-	return (req - s->requests);
+	if (d->ext_secs && d->ext_sec + d->ext_secs == sec) {
+		d->ext_secs += secs;
+		return;
+	}
+
+	tapdisk_diff_flush_extent(d);
+	d->ext_sec  = sec;
+	d->ext_secs = secs;
 }
 
-static inline struct tapdisk_stream_request *
-tapdisk_stream_get_request(struct tapdisk_stream *s)
+/*
+ * The whole chunk first, libc's memcmp being vectorised. Only a chunk
+ * that differs is walked sector by sector for its extents.
+ */
+static void
+tapdisk_diff_compare_chunk(struct tapdisk_diff *d, td_diff_chunk_t *c)
 {
-	struct tapdisk_stream_request *req;
+	const char *a = c->buf[0], *b = c->buf[1];
+	int i, run;
 
-	if (list_empty(&s->free_list))
-		return NULL;
+	d->compared += c->secs;
 
-	req = list_entry(s->free_list.next,
-			 struct tapdisk_stream_request, next);
+	if (!memcmp(a, b, c->secs << SECTOR_SHIFT))
+		return;
 
-	list_del_init(&req->next);
-	tapdisk_stream_initialize_request(req);
+	for (i = 0; i < c->secs; i += run) {
+		int same = !memcmp(a + (i << SECTOR_SHIFT),
+				   b + (i << SECTOR_SHIFT), 1 << SECTOR_SHIFT);
 
-	return req;
+		for (run = 1; i + run < c->secs; run++)
+			if (same != !memcmp(a + ((i + run) << SECTOR_SHIFT),
+					    b + ((i + run) << SECTOR_SHIFT),
+					    1 << SECTOR_SHIFT))
+				break;
+
+		if (!same)
+			tapdisk_diff_add_extent(d, c->sec + i, run);
+	}
 }
 
-static inline void
-tapdisk_stream_queue_completed(struct tapdisk_stream *s,
-			       struct tapdisk_stream_request *sreq)
+static inline int
+tapdisk_diff_stop(struct tapdisk_diff *d)
 {
-	struct tapdisk_stream_request *itr;
-
-	list_for_each_entry(itr, &s->completed_list, next)
-		if (sreq->seqno < itr->seqno) {
-			list_add_tail(&sreq->next, &itr->next);
-			return;
-		}
-
-	list_add_tail(&sreq->next, &s->completed_list);
+	return (list_empty(&d->chunk_list) && (d->cur == d->end || d->err));
 }
 
-static int 
-tapdisk_result_compare(struct tapdisk_stream_request *sreq1,
-		struct tapdisk_stream_request  *sreq2)
+static void
+tapdisk_diff_free_chunk(struct tapdisk_diff *d, td_diff_chunk_t *c)
 {
-	unsigned long idx1, idx2;
-	char *buf1, *buf2;
-	int result;
-
-	assert(sreq1->seqno == sreq2->seqno);
-	assert(sreq1->secs == sreq2->secs);
-	idx1 = (unsigned long)tapdisk_stream_request_idx(&stream1, 
-			sreq1);
-	idx2 = (unsigned long)tapdisk_stream_request_idx(&stream2,
-			sreq2);
-	buf1 = (char *)MMAP_VADDR(stream1.vbd->ring.vstart, idx1, 0);
-	buf2 = (char *)MMAP_VADDR(stream2.vbd->ring.vstart, idx2, 0);
-
-	result = memcmp(buf1, buf2, sreq1->secs << SECTOR_SHIFT);
-	return result;
+	BUG_ON(d->n_free >= TD_DIFF_MAX_CHUNKS);
+	list_del_init(&c->entry);
+	d->free[d->n_free++] = c;
 }
 
-static int
-tapdisk_stream_process_data(void)
+static void
+tapdisk_diff_process(struct tapdisk_diff *d)
 {
-	struct tapdisk_stream_request *sreq1, *sreq2, *tmp1, *tmp2;
-	int advance_both;
-	int result = 0;
-
-	sreq1 = list_entry(stream1.completed_list.next,
-			struct tapdisk_stream_request, next);
-	sreq2 = list_entry(stream2.completed_list.next,
-			struct tapdisk_stream_request, next);
-	tmp1 = list_entry(sreq1->next.next,
-			struct tapdisk_stream_request, next);
-	tmp2 = list_entry(sreq2->next.next,
-			struct tapdisk_stream_request, next);
-	while (result == 0 &&
-			&sreq1->next != &stream1.completed_list &&
-			&sreq2->next != &stream2.completed_list) {
-		//printf("checking: %llu|%llu\n", sreq1->seqno, sreq2->seqno);
-		advance_both = 1;
-		if (sreq1->seqno < sreq2->seqno) {
-			advance_both = 0;
-			goto advance1;
-		}
-		if (sreq1->seqno > sreq2->seqno)
-			goto advance2;
-
-		result = tapdisk_result_compare(sreq1, sreq2);
-
-		stream1.completed++;
-		stream2.completed++;
-		
-		list_del_init(&sreq1->next);
-		list_add_tail(&sreq1->next, &stream1.free_list);
-		list_del_init(&sreq2->next);
-		list_add_tail(&sreq2->next, &stream2.free_list);
-
-advance1:
-		sreq1 = tmp1;
-		tmp1 = list_entry(tmp1->next.next, 
-				struct tapdisk_stream_request, next);
-		if (!advance_both)
-			continue;
-advance2:
-		sreq2 = tmp2;
-		tmp2 = list_entry(tmp2->next.next, 
-				struct tapdisk_stream_request, next);
-	}
+	td_diff_chunk_t *c, *next;
 
-	return result;
+	list_for_each_entry_safe(c, next, &d->chunk_list, entry) {
+		if (!c->done)
+			break;
+
+		if (!d->err)
+			tapdisk_diff_compare_chunk(d, c);
+		tapdisk_diff_free_chunk(d, c);
+	}
 }
 
 static void
-tapdisk_stream_dequeue(void *arg, blkif_response_t *rsp)
+tapdisk_diff_complete_chunk(struct tapdisk_diff *d, td_diff_chunk_t *c)
 {
-	struct tapdisk_stream *s = (struct tapdisk_stream *)arg;
-	struct tapdisk_stream_request *sreq = s->requests + rsp->id;
-
-	list_del_init(&sreq->next);
-
-	if (rsp->status == BLKIF_RSP_OKAY)
-		tapdisk_stream_queue_completed(s, sreq);
-	else {
-		s->err = EIO;
-		list_add_tail(&sreq->next, &s->free_list);
-		fprintf(stderr, "error reading sector %llu (stream %d)\n",
-				sreq->sec, (s == &stream2) + 1);
-	}
+	c->done = 1;
 
-	if (tapdisk_stream_process_data()) {
-		fprintf(stderr, "mismatch at sector %llu\n",
-				sreq->sec);
-		stream1.err = EINVAL;
-		stream2.err = EINVAL;
+	if (c->err) {
+		fprintf(stderr, "error reading sector %"PRIu64": %d\n",
+			c->sec, c->err);
+		d->err = d->err ? : c->err;
 	}
-
-	tapdisk_stream_poll_set(&stream1.poll);
-	tapdisk_stream_poll_set(&stream2.poll);
 }
 
-static inline int
-tapdisk_stream_enqueue_copy(struct tapdisk_stream *s, 
-		struct tapdisk_stream_request *r)
+static void
+__tapdisk_diff_request_cb(td_vbd_request_t *vreq, int error,
+			  void *token, int final)
 {
-	td_vbd_t *vbd;
-	blkif_request_t *breq;
-	td_vbd_request_t *vreq;
-	struct tapdisk_stream_request *sreq;
-	int idx;
-
-	vbd = stream2.vbd;
-	sreq = tapdisk_stream_get_request(s);
-	if (!sreq)
-		return 1;
-
-	idx                 = tapdisk_stream_request_idx(s, sreq);
-
-	sreq->sec           = r->sec;
-	sreq->secs          = r->secs;
-	sreq->seqno         = r->seqno;
-
-	breq                = &sreq->blkif_req;
-	breq->id            = idx;
-	breq->nr_segments   = r->blkif_req.nr_segments;
-	breq->sector_number = r->blkif_req.sector_number;
-	breq->operation     = BLKIF_OP_READ;
-
-	for (int i = 0; i < r->blkif_req.nr_segments; i++) {
-		struct blkif_request_segment *seg = breq->seg + i;
-		seg->first_sect = r->blkif_req.seg[i].first_sect;
-		seg->last_sect  = r->blkif_req.seg[i].last_sect;
-	}
-	s->cur += sreq->secs;
+	struct tapdisk_diff *d = token;
+	td_diff_chunk_t *c;
+	int i;
 
-	vreq = vbd->request_list + idx;
-	assert(list_empty(&vreq->next));
-	assert(vreq->secs_pending == 0);
+	i = vreq->vbd == d->img[1].vbd;
+	c = containerof(vreq, td_diff_chunk_t, vreq[i]);
 
-	memcpy(&vreq->req, breq, sizeof(*breq));
-	s->started++;
-	vbd->received++;
-	vreq->vbd = vbd;
+	c->err = c->err ? : error;
+	if (!--c->pending)
+		tapdisk_diff_complete_chunk(d, c);
 
-	tapdisk_vbd_move_request(vreq, &vbd->new_requests);
-	list_add_tail(&sreq->next, &s->pending_list);
+	if (!final)
+		return;
 
-	return 0;
+	tapdisk_diff_process(d);
+	tapdisk_diff_queue_chunks(d);
 }
 
 static void
-tapdisk_stream_enqueue1(void)
+tapdisk_diff_queue_chunk(struct tapdisk_diff *d, td_diff_chunk_t *c)
 {
-	td_vbd_t *vbd;
-	int i, idx, psize, blk;
-	struct tapdisk_stream *s = &stream1;
-
-	vbd = s->vbd;
-	psize = getpagesize();
-
-	while (s->cur < s->end && !s->err) {
-		blkif_request_t *breq;
-		td_vbd_request_t *vreq;
-		struct tapdisk_stream_request *sreq;
-
-		/* skip any blocks that are not present in this image */
-		blk = s->cur >> SPB_SHIFT;
-		while (s->cur < s->end && vhd1.bat.bat[blk] == DD_BLK_UNUSED) {
-			//printf("skipping block %d\n", blk);
-			blk++;
-			s->cur = blk << SPB_SHIFT;
-		}
-
-		if (s->cur >= s->end)
-			break;
-
-		sreq = tapdisk_stream_get_request(s);
-		if (!sreq)
-			break;
-
-		idx                 = tapdisk_stream_request_idx(s, sreq);
-
-		sreq->sec           = s->cur;
-		sreq->secs          = 0;
-		sreq->seqno         = s->started++;
-
-		breq                = &sreq->blkif_req;
-		breq->id            = idx;
-		breq->nr_segments   = 0;
-		breq->sector_number = sreq->sec;
-		breq->operation     = BLKIF_OP_READ;
-
-		for (i = 0; i < MAX_SEGMENTS; i++) {
-			uint32_t secs;
-			struct blkif_request_segment *seg = breq->seg + i;
-
-			secs = MIN(s->end - s->cur, psize >> SECTOR_SHIFT);
-			secs = MIN(((blk + 1) << SPB_SHIFT) - s->cur, secs);
-			if (!secs)
-				break;
-
-			sreq->secs += secs;
-			s->cur     += secs;
-
-			seg->first_sect = 0;
-			seg->last_sect  = secs - 1;
-			breq->nr_segments++;
+	int i, err;
+
+	c->sec     = d->cur;
+	c->secs    = MIN(TD_DIFF_CHUNK_SIZE >> SECTOR_SHIFT, d->end - d->cur);
+	c->pending = 2;
+	c->done    = 0;
+	c->err     = 0;
+	d->cur    += c->secs;
+
+	list_add_tail(&c->entry, &d->chunk_list);
+
+	for (i = 0; i < 2; i++) {
+		td_vbd_request_t *vreq = &c->vreq[i];
+
+		c->iov[i].base = c->buf[i];
+		c->iov[i].secs = c->secs;
+
+		memset(vreq, 0, sizeof(*vreq));
+		vreq->iov    = &c->iov[i];
+		vreq->iovcnt = 1;
+		vreq->sec    = c->sec;
+		vreq->op     = TD_OP_READ;
+		vreq->token  = d;
+		vreq->cb     = __tapdisk_diff_request_cb;
+
+		err = tapdisk_vbd_queue_request(d->img[i].vbd, vreq);
+		if (err) {
+			c->err = c->err ? : err;
+			if (!--c->pending)
+				tapdisk_diff_complete_chunk(d, c);
 		}
-
-		vreq = vbd->request_list + idx;
-
-		assert(list_empty(&vreq->next));
-		assert(vreq->secs_pending == 0);
-
-		memcpy(&vreq->req, breq, sizeof(*breq));
-		vbd->received++;
-		vreq->vbd = vbd;
-
-		tapdisk_vbd_move_request(vreq, &vbd->new_requests);
-		list_add_tail(&sreq->next, &s->pending_list);
 	}
-
-	tapdisk_vbd_issue_requests(vbd);
 }
 
 static void
-tapdisk_stream_enqueue2(void)
+tapdisk_diff_queue_chunks(struct tapdisk_diff *d)
 {
-	td_vbd_t *vbd;
-	int i, blk;
-	struct tapdisk_stream_request *itr;
-	struct tapdisk_stream *s = &stream2;
-
-	vbd = s->vbd;
-
-	/* issue the same requests that we issued on stream1 */
-	list_for_each_entry(itr, &stream1.completed_list, next) {
-		if (itr->sec < s->cur)
-			continue;
-		if (tapdisk_stream_enqueue_copy(s, itr))
-			goto done;
-	}
+	td_sector_t hole;
 
-	list_for_each_entry(itr, &stream1.pending_list, next) {
-		if (itr->sec < s->cur)
+	while (d->cur < d->end && !d->err) {
+		hole = tapdisk_diff_hole(d, d->cur);
+		if (hole) {
+			d->cur     += hole;
+			d->skipped += hole;
 			continue;
-		if (tapdisk_stream_enqueue_copy(s, itr))
-			goto done;
-	}
+		}
 
-	stream2.cur = stream1.cur;
+		if (!d->n_free)
+			break;
 
-done:
-	tapdisk_vbd_issue_requests(vbd);
-}
+		tapdisk_diff_queue_chunk(d, d->free[--d->n_free]);
+	}
 
-static inline int
-tapdisk_diff_done(void)
-{
-	return (tapdisk_stream_stop(&stream1) && tapdisk_stream_stop(&stream2));
-}
+	/*
+	 * Not from here: we may be inside the server's walk of its VBDs,
+	 * and removing the other image's would break it.
+	 */
+	if (tapdisk_diff_stop(d) && !d->close_event) {
+		event_id_t id;
+
+		id = tapdisk_server_register_event(SCHEDULER_POLL_TIMEOUT,
+						   -1, 0,
+						   tapdisk_diff_close_event, d);
+		if (id < 0) {
+			d->err = d->err ? : id;
+			tapdisk_diff_close_images(d);
+			return;
+		}
 
-static void
-tapdisk_diff_stop(void)
-{
-	tapdisk_stream_close_image(&stream1);
-	tapdisk_stream_close_image(&stream2);
+		d->close_event = id;
+	}
 }
 
 static void
-tapdisk_stream_enqueue(event_id_t id, char mode, void *arg)
+tapdisk_diff_destroy_chunks(struct tapdisk_diff *d)
 {
-	struct tapdisk_stream *s = (struct tapdisk_stream *)arg;
+	size_t size = TD_DIFF_CHUNK_SIZE;
+	int i, j;
 
-	tapdisk_stream_poll_clear(&s->poll);
+	for (i = 0; i < TD_DIFF_MAX_CHUNKS; i++)
+		for (j = 0; j < 2; j++)
+			if (d->chunks[i].buf[j]) {
+				munmap(d->chunks[i].buf[j], size);
+				d->chunks[i].buf[j] = NULL;
+			}
 
-	if (tapdisk_diff_done()) {
-		tapdisk_diff_stop();
-		return;
-	}
-
-	if (s == &stream1) 
-		tapdisk_stream_enqueue1();
-	else if (s == &stream2)
-		tapdisk_stream_enqueue2();
-	else
-		assert(0);
-
-	if (tapdisk_diff_done()) {
-		// we have to check again for the case when stream1 had no 
-		// blocks at all
-		tapdisk_diff_stop();
-		return;
-	}
+	d->n_free = 0;
 }
 
 static int
-tapdisk_stream_open_image(struct tapdisk_stream *s, const char *name)
+tapdisk_diff_create_chunks(struct tapdisk_diff *d)
 {
-	int err;
-	td_disk_info_t info;
+	size_t size = TD_DIFF_CHUNK_SIZE;
+	int i, j, prot, flags;
 
-	s->id = tapdisk_stream_count++;
+	prot  = PROT_READ|PROT_WRITE;
+	flags = MAP_ANONYMOUS|MAP_PRIVATE;
 
-	err = tapdisk_vbd_initialize(-1, -1, s->id);
-	if (err)
-		goto out;
-
-	s->vbd = tapdisk_server_get_vbd(s->id);
-	if (!s->vbd) {
-		err = ENODEV;
-		goto out;
-	}
+	for (i = 0; i < TD_DIFF_MAX_CHUNKS; i++) {
+		td_diff_chunk_t *c = &d->chunks[i];
 
-	tapdisk_vbd_set_callback(s->vbd, tapdisk_stream_dequeue, s);
+		INIT_LIST_HEAD(&c->entry);
 
-	err = tapdisk_vbd_open_vdi(s->vbd, name, TD_OPEN_RDONLY, -1);
-	if (err)
-		goto out;
+		for (j = 0; j < 2; j++) {
+			c->buf[j] = mmap(NULL, size, prot, flags, -1, 0);
+			if (c->buf[j] == MAP_FAILED) {
+				c->buf[j] = NULL;
+				tapdisk_diff_destroy_chunks(d);
+				return -errno;
+			}
+		}
 
-	err = tapdisk_vbd_get_disk_info(s->vbd, &info);
-	if (err) {
-		fprintf(stderr, "failed getting image size: %d\n", err);
-		return err;
+		d->free[d->n_free++] = c;
 	}
 
-	s->start = 0;
-	s->cur   = s->start;
-	s->end   = info.size;
-
-	err = 0;
-
-out:
-	if (err)
-		fprintf(stderr, "failed to open image %s: %d\n", name, err);
-	return err;
+	return 0;
 }
 
 static void
-tapdisk_stream_close_image(struct tapdisk_stream *s)
+tapdisk_diff_close(struct tapdisk_diff *d)
 {
-	td_vbd_t *vbd;
-
-	vbd = tapdisk_server_get_vbd(s->id);
-	if (vbd) {
-		tapdisk_vbd_close_vdi(vbd);
-		tapdisk_server_remove_vbd(vbd);
-		free((void *)vbd->ring.vstart);
-		free(vbd->name);
-		free(vbd);
-		s->vbd = NULL;
-	}
-}
+	int i;
 
-static int
-tapdisk_stream_initialize_requests(struct tapdisk_stream *s)
-{
-	size_t size;
-	td_ring_t *ring;
-	int err, i, psize;
-
-	ring  = &s->vbd->ring;
-	psize = getpagesize();
-	size  = psize * BLKTAP_MMAP_REGION_SIZE;
-
-	/* sneaky -- set up ring->vstart so tapdisk_vbd will use our buffers */
-	err = posix_memalign((void **)&ring->vstart, psize, size);
-	if (err) {
-		fprintf(stderr, "failed to allocate buffers: %d\n", err);
-		ring->vstart = 0;
-		return err;
-	}
+	for (i = 0; i < 2; i++)
+		tapdisk_diff_close_image(&d->img[i]);
 
-	for (i = 0; i < MAX_STREAM_REQUESTS; i++) {
-		struct tapdisk_stream_request *req = s->requests + i;
-		tapdisk_stream_initialize_request(req);
-		list_add_tail(&req->next, &s->free_list);
-	}
+	tapdisk_diff_destroy_chunks(d);
 
-	return 0;
+	if (d->out && d->out != stdout)
+		fclose(d->out);
 }
 
 static int
-tapdisk_stream_register_enqueue_event(struct tapdisk_stream *s)
+tapdisk_diff_open(struct tapdisk_diff *d, const char *p1, const char *p2,
+		  const char *output)
 {
-	int err;
-	struct tapdisk_stream_poll *p = &s->poll;
-
-	err = tapdisk_stream_poll_open(p);
-	if (err)
-		goto out;
+	int i, err;
 
-	err = tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
-					    p->pipe[POLL_READ], 0,
-					    tapdisk_stream_enqueue, s);
-	if (err < 0)
-		goto out;
+	memset(d, 0, sizeof(*d));
+	INIT_LIST_HEAD(&d->chunk_list);
+	d->img[0].params = p1;
+	d->img[1].params = p2;
 
-	s->enqueue_event_id = err;
-	err = 0;
+	d->out = output ? fopen(output, "w") : stdout;
+	if (!d->out) {
+		err = -errno;
+		fprintf(stderr, "failed to open %s: %d\n", output, err);
+		return err;
+	}
 
-out:
+	err = tapdisk_server_initialize(NULL, NULL);
 	if (err)
-		fprintf(stderr, "failed to register event: %d\n", err);
-	return err;
-}
+		goto fail;
 
-static void
-tapdisk_stream_unregister_enqueue_event(struct tapdisk_stream *s)
-{
-	if (s->enqueue_event_id) {
-		tapdisk_server_unregister_event(s->enqueue_event_id);
-		s->enqueue_event_id = 0;
+	for (i = 0; i < 2; i++) {
+		err = tapdisk_diff_open_image(&d->img[i], i);
+		if (err)
+			goto fail;
 	}
-	tapdisk_stream_poll_close(&s->poll);
-}
-
-static inline void
-tapdisk_stream_initialize(struct tapdisk_stream *s)
-{
-	memset(s, 0, sizeof(*s));
-	INIT_LIST_HEAD(&s->free_list);
-	INIT_LIST_HEAD(&s->pending_list);
-	INIT_LIST_HEAD(&s->completed_list);
-}
 
-static int
-tapdisk_stream_open(struct tapdisk_stream *s, const char *arg)
-{
-	int err;
-
-	tapdisk_stream_initialize(s);
-
-	err = tapdisk_stream_open_image(s, arg);
-	if (err)
-		return err;
+	if (d->img[0].size != d->img[1].size) {
+		fprintf(stderr, "Image sizes differ: %"PRIu64" != %"PRIu64"\n",
+			d->img[0].size, d->img[1].size);
+		err = -EINVAL;
+		goto fail;
+	}
 
-	err = tapdisk_stream_initialize_requests(s);
-	if (err)
-		return err;
+	d->end = d->img[0].size;
 
-	err = tapdisk_stream_register_enqueue_event(s);
+	err = tapdisk_diff_create_chunks(d);
 	if (err)
-		return err;
-
-	tapdisk_stream_enqueue(s->enqueue_event_id, 
-			       SCHEDULER_POLL_READ_FD, s);
+		goto fail;
 
 	return 0;
-}
 
-static void
-tapdisk_stream_release(struct tapdisk_stream *s)
-{
-	tapdisk_stream_close_image(s);
-	tapdisk_stream_unregister_enqueue_event(s);
+fail:
+	tapdisk_diff_close(d);
+	return err;
 }
 
 static int
-tapdisk_stream_run(struct tapdisk_stream *s)
+tapdisk_diff_run(struct tapdisk_diff *d)
 {
-	tapdisk_stream_enqueue(s->enqueue_event_id, SCHEDULER_POLL_READ_FD, s);
+	tapdisk_diff_queue_chunks(d);
 	tapdisk_server_run();
-	return s->err;
+
+	tapdisk_diff_flush_extent(d);
+	fflush(d->out);
+
+	fprintf(stderr, "compared %"PRIu64", skipped %"PRIu64", "
+		"%"PRIu64" sectors differ in %"PRIu64" extents\n",
+		d->compared, d->skipped, d->differ, d->extents);
+
+	if (d->err)
+		return d->err;
+
+	return d->extents ? -EINVAL : 0;
 }
 
 int
 main(int argc, char *argv[])
 {
-	int c, err, type1;
-	const char *arg1 = NULL, *arg2 = NULL;
-	const disk_info_t *info;
-	const char *path1;
+	int c, err;
+	const char *arg1, *arg2, *output;
+	struct tapdisk_diff diff;
 
-	err    = 0;
+	arg1   = NULL;
+	arg2   = NULL;
+	output = NULL;
 
-	program = basename(argv[0]);
-	
-	while ((c = getopt(argc, argv, "n:m:h")) != -1) {
+	while ((c = getopt(argc, argv, "n:m:o:h")) != -1) {
 		switch (c) {
 		case 'n':
 			arg1 = optarg;
@@ -733,70 +531,29 @@ main(int argc, char *argv[])
 		case 'm':
 			arg2 = optarg;
 			break;
+		case 'o':
+			output = optarg;
+			break;
 		case 'h':
-			usage(stdout);
-			return 0;
+			usage(basename(argv[0]), 0);
 		default:
-			goto fail_usage;
+			usage(basename(argv[0]), EINVAL);
 		}
 	}
 
 	if (!arg1 || !arg2)
-		goto fail_usage;
-
-	type1 = tapdisk_disktype_parse_params(arg1, &path1);
-	if (type1 < 0)
-		return type1;
-
-	if (type1 != DISK_TYPE_VHD) {
-		printf("error: first VDI is not VHD\n");
-		return EINVAL;
-	}
-
-	err = open_vhd(path1, &vhd1);
-	if (err)
-		return err;
+		usage(basename(argv[0]), EINVAL);
 
 	tapdisk_start_logging("tapdisk-diff", "daemon");
 
-	err = tapdisk_server_initialize(NULL, NULL);
+	err = tapdisk_diff_open(&diff, arg1, arg2, output);
 	if (err)
 		goto out;
 
-	err = tapdisk_stream_open(&stream1, arg1);
-	if (err) {
-		fprintf(stderr, "Failed to open %s: %s\n", 
-			arg1, strerror(-err));
-		goto out;
-	}
-
-	err = tapdisk_stream_open(&stream2, arg2);
-	if (err) {
-		fprintf(stderr, "Failed to open %s: %s\n", 
-			arg2, strerror(-err));
-		goto out1;
-	}
+	err = tapdisk_diff_run(&diff);
+	tapdisk_diff_close(&diff);
 
-	if (stream1.end != stream2.end) {
-		fprintf(stderr, "Image sizes differ: %"PRIu64" != %"PRIu64"\n",
-				stream1.end, stream2.end);
-		err = EINVAL;
-		goto out2;
-	}
-
-	tapdisk_server_run();
-	
-out2:
-	tapdisk_stream_release(&stream2);
-out1:
-	tapdisk_stream_release(&stream1);
 out:
-	vhd_close(&vhd1);
 	tapdisk_stop_logging();
-
-	return err ? : stream1.err;
-
-fail_usage:
-	usage(stderr);
-	return 1;
+	return -err;
 }
@@ -28,7 +28,7 @@
 static const disk_info_t aio_disk = {
        "aio",
        "raw image (aio)",
-       0,
+       DISK_TYPE_OPEN_CONCURRENT,
 };
 
 static const disk_info_t sync_disk = {
@@ -52,7 +52,7 @@ static const disk_info_t vhdsync_disk = {
 static const disk_info_t vhd_disk = {
        "vhd",
        "virtual server image (vhd)",
-       0,
+       DISK_TYPE_OPEN_CONCURRENT,
 };
 
 
@@ -104,6 +104,12 @@ static const disk_info_t llpcache_disk = {
 	0,
 };
 
+static const disk_info_t llwcache_disk = {
+	"llw",
+	"local leaf cache, write-back (llw)",
+	0,
+};
+
 static const disk_info_t llecache_disk = {
 	"lle",
 	"local leaf cache, ephemeral (lle)",
@@ -124,17 +130,27 @@ static const disk_info_t nbd_disk = {
 static const disk_info_t adaptdr_disk = {
 	"adaptdr",
 	"Pipelined Syncrhonous replicated disk",
-	0,
+	DISK_TYPE_FILTER,
 };
 static const disk_info_t asyncdr_disk = {
 	"asyncdr",
 	"Asynchronous replicated disk",
-	0,
+	DISK_TYPE_FILTER,
 };
 static const disk_info_t syncdr_disk = {
 	"syncdr",
 	"Syncrhonous replicated disk",
-	0,
+	DISK_TYPE_FILTER,
+};
+static const disk_info_t ra_disk = {
+	"ra",
+	"sequential readahead (ra)",
+	DISK_TYPE_FILTER,
+};
+static const disk_info_t crypt_disk = {
+	"crypt",
+	"xts-aes encryption (crypt)",
+	DISK_TYPE_FILTER,
 };
 
 const disk_info_t *tapdisk_disk_types[] = {
@@ -157,6 +173,9 @@ const disk_info_t *tapdisk_disk_types[] = {
 	[DISK_TYPE_ADAPTDR]     = &adaptdr_disk,
 	[DISK_TYPE_ASYNCDR]     = &asyncdr_disk,
 	[DISK_TYPE_SYNCDR]     = &syncdr_disk,
+	[DISK_TYPE_RA]          = &ra_disk,
+	[DISK_TYPE_LLWCACHE]    = &llwcache_disk,
+	[DISK_TYPE_CRYPT]       = &crypt_disk,
 	0,
 };
 
@@ -179,12 +198,15 @@ extern struct tap_disk tapdisk_log;
 extern struct tap_disk tapdisk_lcache;
 extern struct tap_disk tapdisk_llpcache;
 extern struct tap_disk tapdisk_llecache;
+extern struct tap_disk tapdisk_llwcache;
 extern struct tap_disk tapdisk_valve;
 extern struct tap_disk tapdisk_nbd;
 
 extern struct tap_disk tapdisk_adaptdr;
 extern struct tap_disk tapdisk_asyncdr;
 extern struct tap_disk tapdisk_syncdr;
+extern struct tap_disk tapdisk_ra;
+extern struct tap_disk tapdisk_crypt;
 
 const struct tap_disk *tapdisk_disk_drivers[] = {
 	[DISK_TYPE_AIO]         = &tapdisk_aio,
@@ -211,6 +233,9 @@ const struct tap_disk *tapdisk_disk_drivers[] = {
 	[DISK_TYPE_ADAPTDR]     = &tapdisk_adaptdr,
 	[DISK_TYPE_ASYNCDR]     = &tapdisk_asyncdr,
 	[DISK_TYPE_SYNCDR]      = &tapdisk_syncdr,
+	[DISK_TYPE_RA]          = &tapdisk_ra,
+	[DISK_TYPE_LLWCACHE]    = &tapdisk_llwcache,
+	[DISK_TYPE_CRYPT]       = &tapdisk_crypt,
 	0,
 };
 
@@ -37,6 +37,9 @@
 #define DISK_TYPE_ADAPTDR	  16
 #define DISK_TYPE_ASYNCDR	  17
 #define DISK_TYPE_SYNCDR	  18
+#define DISK_TYPE_RA          19
+#define DISK_TYPE_LLWCACHE    20
+#define DISK_TYPE_CRYPT       21
 
 #define DISK_TYPE_NAME_MAX    32
 
@@ -55,6 +58,13 @@ extern const struct tap_disk *tapdisk_disk_drivers[];
 /* filter driver without physical image data */
 #define DISK_TYPE_FILTER            (1<<1)
 
+/*
+ * td_open() may run on several threads at once, none of them a loop:
+ * whatever the driver's instances share is set up under a lock, and
+ * nothing is registered with the server until the first request.
+ */
+#define DISK_TYPE_OPEN_CONCURRENT   (1<<2)
+
 int tapdisk_disktype_find(const char *name);
 int tapdisk_disktype_parse_params(const char *params, const char **_path);
 
@@ -19,8 +19,10 @@
 #include "config.h"
 #endif
 
+#include <errno.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "tapdisk-driver.h"
 #include "tapdisk-server.h"
@@ -124,7 +126,172 @@ tapdisk_driver_free(td_driver_t *driver)
 void
 tapdisk_driver_queue_tiocb(td_driver_t *driver, struct tiocb *tiocb)
 {
-	tapdisk_server_queue_tiocb(tiocb);
+	if (!driver->queue)
+		driver->queue = tapdisk_server_get_queue(&driver->profile,
+							 driver->owner);
+
+	tapdisk_queue_tiocb(driver->queue, tiocb);
+}
+
+void
+tapdisk_driver_release_queue(td_driver_t *driver)
+{
+	if (driver->queue) {
+		tapdisk_server_put_queue(driver->queue);
+		driver->queue = NULL;
+	}
+
+	driver->owner = NULL;
+}
+
+struct td_pool_chunk {
+	struct list_head             entry;
+	unsigned int                 n;
+};
+
+#define TD_POOL_CHUNK_HDR						\
+	((sizeof(struct td_pool_chunk) + TD_POOL_ALIGN - 1) &		\
+	 ~(TD_POOL_ALIGN - 1))
+
+void
+td_pool_init(struct td_pool *pool, size_t size,
+	     unsigned int chunk, unsigned int limit)
+{
+	memset(pool, 0, sizeof(*pool));
+
+	if (size < sizeof(void *))
+		size = sizeof(void *);
+
+	pool->size  = (size + TD_POOL_ALIGN - 1) & ~(TD_POOL_ALIGN - 1);
+	pool->chunk = chunk ? : 1;
+	pool->limit = limit;
+	INIT_LIST_HEAD(&pool->chunks);
+}
+
+void
+td_pool_destroy(struct td_pool *pool)
+{
+	struct td_pool_chunk *c, *tmp;
+
+	if (pool->used)
+		EPRINTF("destroying pool with %u objects in use\n",
+			pool->used);
+
+	list_for_each_entry_safe(c, tmp, &pool->chunks, entry) {
+		list_del(&c->entry);
+		free(c);
+	}
+
+	pool->count = 0;
+	pool->used  = 0;
+	pool->free  = NULL;
+	pool->bytes = 0;
+}
+
+/* Returns the bytes given back, 0 while objects are in use. */
+size_t
+td_pool_trim(struct td_pool *pool)
+{
+	size_t bytes;
+
+	if (pool->used || !pool->count)
+		return 0;
+
+	bytes = pool->bytes;
+	td_pool_destroy(pool);
+	pool->trims++;
+
+	return bytes;
+}
+
+void
+td_pool_for_each(struct td_pool *pool,
+		 void (*fn)(void *, unsigned int, void *), void *arg)
+{
+	struct td_pool_chunk *c;
+	unsigned int i, idx = 0;
+	char *obj;
+
+	list_for_each_entry(c, &pool->chunks, entry) {
+		obj = (char *)c + TD_POOL_CHUNK_HDR;
+		for (i = 0; i < c->n; i++, obj += pool->size)
+			fn(obj, idx++, arg);
+	}
+}
+
+static int
+td_pool_grow(struct td_pool *pool)
+{
+	struct td_pool_chunk *c;
+	unsigned int i, n;
+	char *obj;
+	size_t len;
+	int err;
+
+	n = pool->chunk;
+	if (pool->limit && pool->count + n > pool->limit)
+		n = pool->limit - pool->count;
+	if (!n)
+		return -EBUSY;
+
+	len = TD_POOL_CHUNK_HDR + n * pool->size;
+	err = posix_memalign((void **)&c, TD_POOL_ALIGN, len);
+	if (err)
+		return -err;
+
+	memset(c, 0, len);
+	c->n = n;
+	list_add_tail(&c->entry, &pool->chunks);
+
+	obj = (char *)c + TD_POOL_CHUNK_HDR;
+	for (i = 0; i < n; i++, obj += pool->size) {
+		*(void **)obj = pool->free;
+		pool->free    = obj;
+	}
+
+	pool->count += n;
+	pool->bytes += len;
+	return 0;
+}
+
+/*
+ * Returns NULL only once the pool reached its limit (or allocation
+ * failed), callers fail the request with -EBUSY as before.
+ */
+void *
+td_pool_get(struct td_pool *pool)
+{
+	void *obj;
+
+	if (!pool->free && td_pool_grow(pool)) {
+		pool->fails++;
+		return NULL;
+	}
+
+	obj        = pool->free;
+	pool->free = *(void **)obj;
+	pool->used++;
+
+	return obj;
+}
+
+void
+td_pool_put(struct td_pool *pool, void *obj)
+{
+	*(void **)obj = pool->free;
+	pool->free    = obj;
+	pool->used--;
+}
+
+void
+td_pool_stats(struct td_pool *pool, td_stats_t *st)
+{
+	tapdisk_stats_field(st, "max", "u", pool->limit);
+	tapdisk_stats_field(st, "allocated", "u", pool->count);
+	tapdisk_stats_field(st, "pending", "u", pool->used);
+	tapdisk_stats_field(st, "fails", "llu", pool->fails);
+	tapdisk_stats_field(st, "bytes", "zu", pool->bytes);
+	tapdisk_stats_field(st, "trims", "llu", pool->trims);
 }
 
 void
@@ -144,6 +311,31 @@ tapdisk_driver_stats(td_driver_t *driver, td_stats_t *st)
 	info = tapdisk_disk_types[driver->type];
 	tapdisk_stats_field(st, "name", "s", info->name);
 
+	if (driver->storage > 0) {
+		const struct td_io_profile *p = &driver->profile;
+
+		tapdisk_stats_field(st, "storage", "s",
+				    tapdisk_storage_name(driver->storage));
+		tapdisk_stats_field(st, "profile", "{");
+		tapdisk_stats_field(st, "name", "s", p->name);
+		tapdisk_stats_field(st, "engine", "s",
+				    driver->queue ? driver->queue->tio->name :
+				    tapdisk_queue_tio_name(p->tio_drv));
+		tapdisk_stats_field(st, "depth", "d",
+				    driver->queue ? driver->queue->size :
+				    p->depth);
+		tapdisk_stats_field(st, "merge", "s",
+				    p->merge == OPIO_MERGE_NONE ? "none" :
+				    p->merge == OPIO_MERGE_CONTIG ? "contig" :
+				    "vector");
+		tapdisk_stats_field(st, "direct", "d", p->direct);
+		tapdisk_stats_field(st, "readahead", "d", p->readahead);
+		tapdisk_stats_field(st, "queue", "s",
+				    p->queue == TD_IO_QUEUE_VBD ?
+				    "vbd" : "shared");
+		tapdisk_stats_leave(st, '}');
+	}
+
 	if (driver->ops->td_stats) {
 		tapdisk_stats_field(st, "status", "{");
 		driver->ops->td_stats(driver, st);
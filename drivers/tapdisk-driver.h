@@ -22,15 +22,45 @@
 #include "scheduler.h"
 #include "tapdisk-queue.h"
 #include "tapdisk-loglimit.h"
+#include "tapdisk-storage.h"
 
 #define TD_DRIVER_OPEN               0x0001
 #define TD_DRIVER_RDONLY             0x0002
 
+#define TD_POOL_ALIGN                64
+#define TD_POOL_CHUNK                32
+/* enough for a full ring of indirect requests, one object per segment */
+#define TD_POOL_LIMIT                (MAX_REQUESTS * 256)
+
+/*
+ * Object pool for driver request structs. Objects are carved from
+ * cache-line aligned, zeroed chunks allocated on demand, up to 'limit'
+ * objects, and recycled through a free list. td_pool_trim() gives all
+ * chunks back once none are in use, td_pool_destroy() in any case.
+ */
+struct td_pool {
+	size_t                       size;
+	unsigned int                 chunk;
+	unsigned int                 limit;
+
+	unsigned int                 count;
+	unsigned int                 used;
+	void                        *free;
+	struct list_head             chunks;
+	size_t                       bytes;
+
+	unsigned long long           fails;
+	unsigned long long           trims;
+};
+
 struct td_driver_handle {
 	int                          type;
 	char                        *name;
 
 	int                          storage;
+	struct td_io_profile         profile;	/* if storage is known */
+	struct tqueue               *queue;	/* bound on first I/O */
+	const void                  *owner;	/* vbd of the first request */
 
 	int                          refcnt;
 	td_flag_t                    state;
@@ -48,6 +78,7 @@ td_driver_t *tapdisk_driver_allocate(int, const char *, td_flag_t);
 void tapdisk_driver_free(td_driver_t *);
 
 void tapdisk_driver_queue_tiocb(td_driver_t *, struct tiocb *);
+void tapdisk_driver_release_queue(td_driver_t *);
 
 void tapdisk_driver_debug(td_driver_t *);
 
@@ -55,4 +86,23 @@ void tapdisk_driver_stats(td_driver_t *, td_stats_t *);
 
 int tapdisk_driver_log_pass(td_driver_t *, const char *caller);
 
+void td_pool_init(struct td_pool *, size_t size,
+		  unsigned int chunk, unsigned int limit);
+void td_pool_destroy(struct td_pool *);
+void *td_pool_get(struct td_pool *);
+void td_pool_put(struct td_pool *, void *);
+size_t td_pool_trim(struct td_pool *);
+void td_pool_stats(struct td_pool *, td_stats_t *);
+
+/* calls fn on every object carved so far, in use or not */
+void td_pool_for_each(struct td_pool *,
+		      void (*fn)(void *obj, unsigned int idx, void *arg),
+		      void *arg);
+
+static inline size_t
+td_pool_bytes(const struct td_pool *pool)
+{
+	return pool->bytes;
+}
+
 #endif
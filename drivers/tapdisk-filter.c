@@ -19,7 +19,9 @@
 #include "config.h"
 #endif
 
+#include <errno.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <libaio.h>
 #include <syslog.h>
@@ -27,6 +29,8 @@
 
 #include "tapdisk-log.h"
 #include "tapdisk-filter.h"
+#include "io-optimize.h"
+#include "dr-crc32c.h"
 
 #define RSEED      7
 #define PRE_CHECK  0
@@ -35,6 +39,8 @@
 #define WRITE_INTEGRITY   "buffer integrity failure after write"
 #define READ_INTEGRITY    "disk integrity failure after read"
 
+#define CRC_BLOCK         (1 << TD_CRC_SHIFT)
+
 #define DBG(f, a...) tlog_write(TLOG_WARN, f, ##a)
 
 /*
@@ -155,6 +161,224 @@ check_data(struct tfilter *filter, int type, struct iocb *io)
 	}
 }
 
+static inline size_t
+iocb_bytes(struct iocb *io)
+{
+	size_t bytes;
+	int i;
+
+	if (!io_iocb_vectored(io))
+		return io->u.c.nbytes;
+
+	for (i = 0, bytes = 0; i < io->u.v.nr; i++)
+		bytes += io->u.v.vec[i].iov_len;
+
+	return bytes;
+}
+
+/* sums CRC_BLOCK bytes from 'pos' of the iocb buffers */
+static uint32_t
+iocb_crc(struct iocb *io, size_t pos)
+{
+	const struct iovec *iov;
+	size_t len, n;
+	uint32_t crc;
+
+	if (!io_iocb_vectored(io))
+		return dr_crc32c(0, (char *)io->u.c.buf + pos, CRC_BLOCK);
+
+	iov = io->u.v.vec;
+	while (pos >= iov->iov_len)
+		pos -= (iov++)->iov_len;
+
+	for (crc = 0, len = CRC_BLOCK; len; len -= n, pos = 0, iov++) {
+		n   = iov->iov_len - pos < len ? iov->iov_len - pos : len;
+		crc = dr_crc32c(crc, (char *)iov->iov_base + pos, n);
+	}
+
+	return crc;
+}
+
+static inline struct tcrc *
+crc_slot(struct tfilter *filter, int fd, uint64_t blk)
+{
+	uint64_t h = (blk ^ ((uint64_t)fd << 40)) * 0x9e3779b97f4a7c15ULL;
+
+	return filter->crcs + (h >> (64 - TD_CRC_ORDER));
+}
+
+static inline int
+crc_match(struct tfilter *filter, struct tcrc *c, int fd, uint64_t blk)
+{
+	return c->epoch == filter->epoch && c->fd == fd && c->blk == blk;
+}
+
+static inline int
+crc_wrapped(struct tfilter *filter, struct iocb *io)
+{
+	unsigned long iop   = (unsigned long)io->data;
+	unsigned long start = (unsigned long)filter->ciocbs;
+	unsigned long end   = start + (filter->iocbs * sizeof(struct ciocb));
+
+	return (iop >= start && iop < end);
+}
+
+static void
+crc_claim(struct tfilter *filter, struct tcrc *c,
+	  int fd, uint64_t blk, uint64_t seq)
+{
+	memset(c, 0, sizeof(*c));
+	c->blk   = blk;
+	c->fd    = fd;
+	c->epoch = filter->epoch;
+	c->claim = seq;
+}
+
+static void
+crc_write_submit(struct tfilter *filter, struct iocb *io, uint64_t seq)
+{
+	uint64_t blk, end;
+	struct tcrc *c;
+	int fd;
+
+	fd  = io->aio_fildes;
+	end = io->u.c.offset + iocb_bytes(io);
+
+	for (blk = io->u.c.offset >> TD_CRC_SHIFT;
+	     blk << TD_CRC_SHIFT < end; blk++) {
+		c = crc_slot(filter, fd, blk);
+		if (!crc_match(filter, c, fd, blk)) {
+			/* a block with writes still to land keeps its slot */
+			if (c->epoch == filter->epoch && c->pending)
+				continue;
+			crc_claim(filter, c, fd, blk, seq);
+		}
+
+		if (c->pending)
+			c->overlap = 1;
+		c->pending++;
+		c->valid = 0;
+		c->seq   = seq;
+	}
+}
+
+static void
+crc_write_done(struct tfilter *filter, struct iocb *io,
+	       uint64_t seq, long res)
+{
+	uint64_t blk, start, end, off;
+	struct tcrc *c;
+	int fd, ok;
+
+	fd    = io->aio_fildes;
+	start = io->u.c.offset;
+	end   = start + iocb_bytes(io);
+	ok    = res == end - start;
+
+	for (blk = start >> TD_CRC_SHIFT;
+	     (off = blk << TD_CRC_SHIFT) < end; blk++) {
+		c = crc_slot(filter, fd, blk);
+
+		/* taken after this write went out, which it was not told of */
+		if (!crc_match(filter, c, fd, blk) || c->claim > seq)
+			continue;
+
+		c->pending--;
+		c->seq   = ++filter->seq;
+		c->valid = 0;
+
+		if (c->pending)
+			continue;
+
+		if (ok && !c->overlap &&
+		    off >= start && off + CRC_BLOCK <= end) {
+			c->crc   = iocb_crc(io, off - start);
+			c->valid = 1;
+		}
+		c->overlap = 0;
+	}
+}
+
+static void
+crc_read_done(struct tfilter *filter, struct iocb *io,
+	      uint64_t seq, long res)
+{
+	size_t bytes, pos;
+	uint64_t blk;
+	struct tcrc *c;
+	uint32_t crc;
+	int fd;
+
+	fd    = io->aio_fildes;
+	bytes = iocb_bytes(io);
+	if (res != bytes)
+		return;
+
+	pos = -io->u.c.offset & (CRC_BLOCK - 1);
+	for (; pos + CRC_BLOCK <= bytes; pos += CRC_BLOCK) {
+		blk = (io->u.c.offset + pos) >> TD_CRC_SHIFT;
+		c   = crc_slot(filter, fd, blk);
+
+		if (!crc_match(filter, c, fd, blk) ||
+		    !c->valid || c->pending || c->seq > seq)
+			continue;
+
+		filter->checked++;
+
+		crc = iocb_crc(io, pos);
+		if (crc == c->crc)
+			continue;
+
+		filter->mismatches++;
+		c->valid = 0;
+		DBG("%s: fd %d, block %" PRIu64 " (sector %" PRIu64 "): "
+		    "crc32c 0x%08x, written 0x%08x\n", READ_INTEGRITY,
+		    fd, blk, blk << (TD_CRC_SHIFT - 9), crc, c->crc);
+	}
+}
+
+static void
+crc_submit(struct tfilter *filter, struct iocb *io)
+{
+	struct ciocb *cio;
+	int rw;
+
+	rw = (io->aio_lio_opcode == IO_CMD_PWRITE ||
+	      io->aio_lio_opcode == IO_CMD_PWRITEV);
+
+	if (!filter->cfree) {
+		/* never lands: its blocks stay unchecked till a reset */
+		if (rw)
+			crc_write_submit(filter, io, ++filter->seq);
+		return;
+	}
+
+	cio       = filter->clist[--filter->cfree];
+	cio->data = io->data;
+	cio->seq  = rw ? ++filter->seq : filter->seq;
+	io->data  = cio;
+
+	if (rw)
+		crc_write_submit(filter, io, cio->seq);
+}
+
+static void
+crc_complete(struct tfilter *filter, struct iocb *io, long res)
+{
+	struct ciocb *cio = io->data;
+
+	io->data = cio->data;
+
+	if (io->aio_lio_opcode == IO_CMD_PWRITE ||
+	    io->aio_lio_opcode == IO_CMD_PWRITEV)
+		crc_write_done(filter, io, cio->seq, res);
+	else
+		crc_read_done(filter, io, cio->seq, res);
+
+	memset(cio, 0, sizeof(struct ciocb));
+	filter->clist[filter->cfree++] = cio;
+}
+
 struct tfilter *
 tapdisk_init_tfilter(int mode, int iocbs, uint64_t secs)
 {
@@ -191,6 +415,20 @@ tapdisk_init_tfilter(int mode, int iocbs, uint64_t secs)
 			filter->mode &= ~TD_CHECK_INTEGRITY;
 	}
 
+	if (filter->mode & TD_CHECK_CRC) {
+		filter->crcs   = calloc(TD_CRC_SLOTS, sizeof(struct tcrc));
+		filter->ciocbs = calloc(iocbs, sizeof(struct ciocb));
+		filter->clist  = calloc(iocbs, sizeof(struct ciocb *));
+		if (!filter->crcs || !filter->ciocbs || !filter->clist)
+			filter->mode &= ~TD_CHECK_CRC;
+		else {
+			filter->epoch = 1;
+			filter->cfree = iocbs;
+			for (i = 0; i < iocbs; i++)
+				filter->clist[i] = filter->ciocbs + i;
+		}
+	}
+
 	syslog(LOG_WARNING, "WARNING: "
 	       "FILTERING IN MODE 0x%04x\n", filter->mode);
 
@@ -207,6 +445,14 @@ tapdisk_free_tfilter(struct tfilter *filter)
 	if (!filter)
 		return;
 
+	if (filter->mode & TD_CHECK_CRC)
+		DBG("crc32c: %" PRIu64 " blocks checked, "
+		    "%" PRIu64 " mismatches\n",
+		    filter->checked, filter->mismatches);
+
+	free(filter->crcs);
+	free(filter->clist);
+	free(filter->ciocbs);
 	free(filter->dhash);
 	free(filter->flist);
 	free(filter->fiocbs);
@@ -233,6 +479,9 @@ tapdisk_filter_iocbs(struct tfilter *filter, struct iocb **iocbs, int num)
 
 		if (filter->mode & TD_CHECK_INTEGRITY)
 			check_data(filter, PRE_CHECK, io);
+
+		if (filter->mode & TD_CHECK_CRC)
+			crc_submit(filter, io);
 	}
 }
 
@@ -254,7 +503,38 @@ tapdisk_filter_events(struct tfilter *filter, struct io_event *events, int num)
 			}
 		}
 
+		if (filter->mode & TD_CHECK_CRC && crc_wrapped(filter, io))
+			crc_complete(filter, io, events[i].res);
+
 		if (filter->mode & TD_CHECK_INTEGRITY)
 			check_data(filter, POST_CHECK, io);
 	}
 }
+
+/* takes back iocbs filtered but never submitted */
+void
+tapdisk_filter_cancel(struct tfilter *filter, struct iocb **iocbs, int num)
+{
+	int i;
+
+	if (!filter)
+		return;
+
+	for (i = 0; i < num; i++) {
+		struct iocb *io = iocbs[i];
+
+		if (filter->mode & TD_INJECT_FAULTS &&
+		    fault_injected(filter, io))
+			recover_fault(filter, io);
+		else if (filter->mode & TD_CHECK_CRC &&
+			 crc_wrapped(filter, io))
+			crc_complete(filter, io, -ECANCELED);
+	}
+}
+
+void
+tapdisk_filter_reset(struct tfilter *filter)
+{
+	if (filter && filter->mode & TD_CHECK_CRC)
+		filter->epoch++;
+}
@@ -24,9 +24,22 @@
 
 #define TD_INJECT_FAULTS     0x00001  /* simulate random IO failures */
 #define TD_CHECK_INTEGRITY   0x00002  /* check data integrity */
+#define TD_CHECK_CRC         0x00004  /* CRC32C per 4K, cheap enough to keep on */
 
 #define TD_FAULT_RATE        5
 
+/*
+ * TD_CHECK_CRC sums each 4K block a write covers as it completes, and
+ * checks it on the reads that follow. Sums go in a direct-mapped table
+ * by fd and block, which a later write to a colliding block takes
+ * over, so it holds about the last TD_CRC_SLOTS blocks written. Blocks
+ * written while a read was in flight, or by overlapping writes, are not
+ * checked. Closing an image forgets all sums, fds being reused.
+ */
+#define TD_CRC_SHIFT         12
+#define TD_CRC_ORDER         18
+#define TD_CRC_SLOTS         (1 << TD_CRC_ORDER)  /* 1G of blocks, in 10M */
+
 struct dhash {
 	uint64_t             hash;
 	struct timeval       time;
@@ -37,6 +50,23 @@ struct fiocb {
 	void                *data;
 };
 
+struct tcrc {
+	uint64_t             blk;
+	int                  fd;
+	uint32_t             epoch;
+	uint64_t             claim;     /* seq when taken by the block */
+	uint64_t             seq;       /* of the last change */
+	uint32_t             crc;
+	uint16_t             pending;   /* writes in flight */
+	uint8_t              valid;
+	uint8_t              overlap;
+};
+
+struct ciocb {
+	void                *data;
+	uint64_t             seq;       /* at submission */
+};
+
 struct tfilter {
 	int                  mode;
 	uint64_t             secs;
@@ -47,11 +77,22 @@ struct tfilter {
 	int                  ffree;
 	struct fiocb        *fiocbs;
 	struct fiocb       **flist;
+
+	struct tcrc         *crcs;
+	uint32_t             epoch;
+	uint64_t             seq;
+	int                  cfree;
+	struct ciocb        *ciocbs;
+	struct ciocb       **clist;
+	uint64_t             checked;
+	uint64_t             mismatches;
 };
 
 struct tfilter *tapdisk_init_tfilter(int mode, int iocbs, uint64_t secs);
 void tapdisk_free_tfilter(struct tfilter *);
 void tapdisk_filter_iocbs(struct tfilter *, struct iocb **, int);
 void tapdisk_filter_events(struct tfilter *, struct io_event *, int);
+void tapdisk_filter_cancel(struct tfilter *, struct iocb **, int);
+void tapdisk_filter_reset(struct tfilter *);
 
 #endif
@@ -0,0 +1,207 @@
+/*
+ * Copyright (C) Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2.1 only
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "tapdisk-flush.h"
+#include "tapdisk-driver.h"
+#include "tapdisk-server.h"
+#include "libaio-compat.h"
+
+static void *
+td_flush_thread(void *arg)
+{
+	struct td_flush *f = arg;
+	uint64_t val = 1;
+	int i, n, err, gcc;
+
+	pthread_mutex_lock(&f->lock);
+
+	for (;;) {
+		while (!f->pending && !f->stop)
+			pthread_cond_wait(&f->cond, &f->lock);
+
+		if (f->stop)
+			break;
+
+		n = f->n_drivers;
+		pthread_mutex_unlock(&f->lock);
+
+		/* every driver gets synced, the first error is kept */
+		err = 0;
+		for (i = 0; i < n; i++) {
+			td_driver_t *driver = f->drivers[i];
+			int ret = driver->ops->td_sync(driver);
+			err = err ? : ret;
+		}
+
+		pthread_mutex_lock(&f->lock);
+		f->error   = err;
+		f->pending = 0;
+
+		gcc = write(f->efd, &val, sizeof(val));
+		if (gcc) {};
+	}
+
+	pthread_mutex_unlock(&f->lock);
+
+	return NULL;
+}
+
+static void
+td_flush_event(event_id_t id, char mode, void *private)
+{
+	struct td_flush *f = private;
+	uint64_t val;
+	int err, gcc;
+
+	gcc = read(f->efd, &val, sizeof(val));
+	if (gcc) {};
+
+	pthread_mutex_lock(&f->lock);
+	err = f->error;
+	pthread_mutex_unlock(&f->lock);
+
+	f->busy = 0;
+	f->syncs++;
+	if (err)
+		f->errors++;
+
+	f->done(f, err);
+}
+
+void
+td_flush_init(struct td_flush *f, void (*done)(struct td_flush *, int))
+{
+	memset(f, 0, sizeof(*f));
+	f->efd   = -1;
+	f->event = -1;
+	f->done  = done;
+}
+
+static int
+td_flush_create(struct td_flush *f)
+{
+	int err;
+
+	f->efd = tapdisk_sys_eventfd(0);
+	if (f->efd < 0) {
+		err = -errno;
+		goto fail;
+	}
+
+	f->event = tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
+						 f->efd, 0,
+						 td_flush_event, f);
+	if (f->event < 0) {
+		err = f->event;
+		goto fail;
+	}
+
+	pthread_mutex_init(&f->lock, NULL);
+	pthread_cond_init(&f->cond, NULL);
+
+	err = pthread_create(&f->thread, NULL, td_flush_thread, f);
+	if (err) {
+		err = -err;
+		pthread_cond_destroy(&f->cond);
+		pthread_mutex_destroy(&f->lock);
+		goto fail;
+	}
+
+	f->started = 1;
+	tapdisk_server_place_thread(f->thread);
+	return 0;
+
+fail:
+	if (f->event >= 0)
+		tapdisk_server_unregister_event(f->event);
+	if (f->efd >= 0)
+		close(f->efd);
+	f->event = -1;
+	f->efd   = -1;
+	return err;
+}
+
+int
+td_flush_start(struct td_flush *f, td_driver_t **drivers, int n)
+{
+	int err;
+
+	if (f->busy)
+		return -EBUSY;
+
+	if (n > TD_FLUSH_DRIVERS)
+		return -E2BIG;
+
+	if (!f->started) {
+		err = td_flush_create(f);
+		if (err)
+			return err;
+	}
+
+	pthread_mutex_lock(&f->lock);
+	memcpy(f->drivers, drivers, n * sizeof(*drivers));
+	f->n_drivers = n;
+	f->error     = 0;
+	f->pending   = 1;
+	pthread_cond_signal(&f->cond);
+	pthread_mutex_unlock(&f->lock);
+
+	f->busy = 1;
+
+	return 0;
+}
+
+/* Only once idle: the drivers may be closed right after. */
+void
+td_flush_destroy(struct td_flush *f)
+{
+	if (!f->started)
+		return;
+
+	pthread_mutex_lock(&f->lock);
+	f->stop = 1;
+	pthread_cond_signal(&f->cond);
+	pthread_mutex_unlock(&f->lock);
+
+	pthread_join(f->thread, NULL);
+
+	tapdisk_server_unregister_event(f->event);
+	close(f->efd);
+
+	pthread_cond_destroy(&f->cond);
+	pthread_mutex_destroy(&f->lock);
+
+	f->started = 0;
+	f->event   = -1;
+	f->efd     = -1;
+}
+
+void
+td_flush_stats(struct td_flush *f, td_stats_t *st)
+{
+	tapdisk_stats_field(st, "syncs", "llu", f->syncs);
+	tapdisk_stats_field(st, "errors", "llu", f->errors);
+	tapdisk_stats_field(st, "busy", "d", f->busy);
+}
@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2.1 only
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef _TAPDISK_FLUSH_H_
+#define _TAPDISK_FLUSH_H_
+
+#include <pthread.h>
+
+#include "tapdisk.h"
+#include "scheduler.h"
+
+/*
+ * Flush helper thread.
+ *
+ * Runs the td_sync op of a set of drivers off the event loop, one sync
+ * at a time, and calls 'done' back on the loop once all of them
+ * returned. The thread is started with the first sync.
+ */
+
+#define TD_FLUSH_DRIVERS     16
+
+struct td_flush {
+	pthread_t                    thread;
+	pthread_mutex_t              lock;
+	pthread_cond_t               cond;
+	int                          started;
+	int                          stop;
+	int                          pending;   /* thread has a sync to do */
+	int                          busy;      /* until 'done' was called */
+
+	int                          efd;
+	event_id_t                   event;
+
+	td_driver_t                 *drivers[TD_FLUSH_DRIVERS];
+	int                          n_drivers;
+	int                          error;
+
+	void                       (*done)(struct td_flush *, int error);
+
+	uint64_t                     syncs;
+	uint64_t                     errors;
+};
+
+void td_flush_init(struct td_flush *, void (*done)(struct td_flush *, int));
+int td_flush_start(struct td_flush *, td_driver_t **, int);
+void td_flush_destroy(struct td_flush *);
+void td_flush_stats(struct td_flush *, td_stats_t *);
+
+static inline int
+td_flush_busy(struct td_flush *f)
+{
+	return f->busy;
+}
+
+#endif /* _TAPDISK_FLUSH_H_ */
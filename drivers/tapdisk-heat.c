@@ -0,0 +1,164 @@
+/*
+ * Copyright (C) Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2.1 only
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "tapdisk-log.h"
+#include "tapdisk-heat.h"
+#include "atomicio.h"
+
+static uint64_t
+td_heat_now_us(void)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+
+	return now.tv_sec * 1000000ULL + now.tv_usec;
+}
+
+int
+td_heat_create(struct td_heat **_h, uint64_t secs)
+{
+	struct td_heat *h;
+	uint64_t blocks;
+
+	blocks = (secs + (1 << TD_HEAT_BLOCK_SHIFT) - 1) >> TD_HEAT_BLOCK_SHIFT;
+	if (!blocks)
+		return -EINVAL;
+
+	h = calloc(1, sizeof(*h));
+	if (!h)
+		return -ENOMEM;
+
+	h->map = calloc(blocks, sizeof(*h->map));
+	if (!h->map) {
+		free(h);
+		return -ENOMEM;
+	}
+
+	h->blocks   = blocks;
+	h->start_us = td_heat_now_us();
+
+	DPRINTF("heat map of %" PRIu64 " blocks\n", blocks);
+
+	*_h = h;
+	return 0;
+}
+
+void
+td_heat_free(struct td_heat *h)
+{
+	if (!h)
+		return;
+
+	free(h->map);
+	free(h);
+}
+
+void
+td_heat_decay(struct td_heat *h, unsigned int shift)
+{
+	uint64_t i;
+
+	if (!shift)
+		return;
+
+	if (shift > 16)
+		shift = 16;
+
+	for (i = 0; i < h->blocks; i++) {
+		h->map[i].reads  >>= shift;
+		h->map[i].writes >>= shift;
+	}
+
+	h->decays += shift;
+}
+
+uint64_t
+td_heat_blocks_hot(struct td_heat *h)
+{
+	uint64_t i, n = 0;
+
+	for (i = 0; i < h->blocks; i++)
+		if (h->map[i].reads || h->map[i].writes)
+			n++;
+
+	return n;
+}
+
+/* written aside, then renamed over path: readers see whole snapshots */
+int
+td_heat_save(struct td_heat *h, const char *path)
+{
+	struct td_heat_header hdr;
+	size_t size;
+	char *tmp;
+	int fd, err;
+
+	if (asprintf(&tmp, "%s.tmp", path) < 0)
+		return -ENOMEM;
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		err = -errno;
+		goto out;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic      = TD_HEAT_MAGIC;
+	hdr.version    = TD_HEAT_VERSION;
+	hdr.block_secs = 1 << TD_HEAT_BLOCK_SHIFT;
+	hdr.blocks     = h->blocks;
+	hdr.start_us   = h->start_us;
+	hdr.snap_us    = td_heat_now_us();
+	hdr.decays     = h->decays;
+
+	size = h->blocks * sizeof(*h->map);
+
+	if (atomicio(vwrite, fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+	    atomicio(vwrite, fd, h->map, size) != size) {
+		err = errno ? -errno : -EIO;
+		close(fd);
+		unlink(tmp);
+		goto out;
+	}
+
+	if (close(fd) || rename(tmp, path)) {
+		err = -errno;
+		unlink(tmp);
+		goto out;
+	}
+
+	err = 0;
+out:
+	if (err)
+		EPRINTF("cannot save heat map to %s: %d\n", path, err);
+	free(tmp);
+	return err;
+}
@@ -0,0 +1,91 @@
+/*
+ * Copyright (C) Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2.1 only
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef _TAPDISK_HEAT_H_
+#define _TAPDISK_HEAT_H_
+
+#include <stdint.h>
+
+/*
+ * Per-VBD heat map: read and write counts of every 2 MiB block,
+ * saturating at 0xffff. Decays halve them 'shift' times over, so old
+ * heat fades against new.
+ *
+ * Snapshots are files of a td_heat_header, then 'blocks' struct
+ * td_heat_count, block order. Times are gettimeofday() usecs.
+ */
+
+#define TD_HEAT_MAGIC            0x7461656874646974ULL  /* "tidtheat" */
+#define TD_HEAT_VERSION          1
+#define TD_HEAT_BLOCK_SHIFT      12                      /* sectors */
+#define TD_HEAT_COUNT_MAX        0xffff
+
+struct td_heat_header {
+	uint64_t                     magic;
+	uint32_t                     version;
+	uint32_t                     block_secs;
+	uint64_t                     blocks;
+	uint64_t                     start_us;
+	uint64_t                     snap_us;
+	uint32_t                     decays;    /* halvings, since start */
+	uint32_t                     pad;
+};
+
+struct td_heat_count {
+	uint16_t                     reads;
+	uint16_t                     writes;
+};
+
+struct td_heat {
+	struct td_heat_count        *map;
+	uint64_t                     blocks;
+	uint64_t                     start_us;
+	uint32_t                     decays;
+};
+
+int td_heat_create(struct td_heat **, uint64_t secs);
+void td_heat_free(struct td_heat *);
+void td_heat_decay(struct td_heat *, unsigned int shift);
+int td_heat_save(struct td_heat *, const char *path);
+uint64_t td_heat_blocks_hot(struct td_heat *);
+
+static inline void
+__td_heat_inc(uint16_t *c)
+{
+	if (*c < TD_HEAT_COUNT_MAX)
+		(*c)++;
+}
+
+/* on the request path: discards and flushes do not count */
+static inline void
+td_heat_add(struct td_heat *h, int op, uint64_t sec, uint32_t secs)
+{
+	uint64_t blk, end;
+
+	if (op > 1 || !secs)
+		return;
+
+	blk = sec >> TD_HEAT_BLOCK_SHIFT;
+	end = (sec + secs - 1) >> TD_HEAT_BLOCK_SHIFT;
+	if (end >= h->blocks)
+		end = h->blocks - 1;
+
+	for (; blk <= end; blk++)
+		__td_heat_inc(op ? &h->map[blk].writes : &h->map[blk].reads);
+}
+
+#endif
@@ -25,7 +25,11 @@
 #include <stdio.h>
 #include <limits.h>
 #include <regex.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/stat.h>
 
+#include "libvhd.h"
 #include "tapdisk-image.h"
 #include "tapdisk-driver.h"
 #include "tapdisk-server.h"
@@ -33,6 +37,7 @@
 #include "tapdisk-interface.h"
 #include "tapdisk-disktype.h"
 #include "tapdisk-storage.h"
+#include "libaio-compat.h"
 
 #define DBG(_f, _a...)       tlog_syslog(TLOG_DBG, _f, ##_a)
 #define INFO(_f, _a...)      tlog_syslog(TLOG_INFO, _f, ##_a)
@@ -48,6 +53,39 @@
 
 #define ARRAY_SIZE(_a) (sizeof(_a)/sizeof((_a)[0]))
 
+/*
+ * Lazily opened parents. From the depth the chain was opened with
+ * TD_OPEN_LAZY_*, read-only VHD parents are only read for their
+ * headers: the footer uuid checked against the child's parent uuid,
+ * the size taken from the footer, the next parent from the locators.
+ * They are linked as placeholders, with a driver not opened. The
+ * first request forwarded to one is parked, the image opened on a
+ * thread, then validated against the images around it, as the chain
+ * is at open, and the parked requests go on to it, or fail with it.
+ */
+struct td_image_lazy_req {
+	td_request_t                 treq;
+	struct list_head             next;
+};
+
+struct td_image_lazy {
+	td_disk_id_t                 parent;	/* name NULL: none */
+	uuid_t                       prt_uuid;
+
+	td_image_t                  *shadow;	/* opened on the thread */
+	pthread_t                    thread;
+	int                          busy;
+	int                          err;
+	int                          fd;
+	event_id_t                   event;
+
+	struct list_head             requests;
+	uint64_t                     parked;
+	uint64_t                     failed;
+};
+
+static void tapdisk_image_free_lazy(struct td_image_lazy *);
+
 td_image_t *
 tapdisk_image_allocate(const char *file, int type, td_flag_t flags)
 {
@@ -79,6 +117,9 @@ tapdisk_image_free(td_image_t *image)
 
 	list_del(&image->next);
 
+	if (image->lazy)
+		tapdisk_image_free_lazy(image->lazy);
+
 	free(image->name);
 	tapdisk_driver_free(image->driver);
 	free(image);
@@ -95,10 +136,11 @@ tapdisk_image_check_td_request(td_image_t *image, td_request_t treq)
 	info   = &image->info;
 	rdonly = td_flag_test(image->flags, TD_OPEN_RDONLY);
 
-	if (treq.op != TD_OP_READ && treq.op != TD_OP_WRITE)
+	if (treq.op != TD_OP_READ && treq.op != TD_OP_WRITE &&
+	    treq.op != TD_OP_DISCARD)
 		goto fail;
 
-	if (treq.op == TD_OP_WRITE && rdonly) {
+	if (td_op_write(treq.op) && rdonly) {
 		err = -EPERM;
 		goto fail;
 	}
@@ -121,7 +163,7 @@ tapdisk_image_check_request(td_image_t *image, td_vbd_request_t *vreq)
 {
 	td_driver_t *driver;
 	td_disk_info_t *info;
-	int i, rdonly, secs, err;
+	int i, rdonly, secs, spl, err;
 
 	driver = image->driver;
 	if (!driver)
@@ -142,6 +184,7 @@ tapdisk_image_check_request(td_image_t *image, td_vbd_request_t *vreq)
 
 	switch (vreq->op) {
 	case TD_OP_WRITE:
+	case TD_OP_DISCARD:
 		if (rdonly) {
 			err = -EPERM;
 			goto fail;
@@ -152,6 +195,14 @@ tapdisk_image_check_request(td_image_t *image, td_vbd_request_t *vreq)
 			err = -EINVAL;
 			goto fail;
 		}
+		/* whole logical blocks only */
+		spl = info->sector_size >> SECTOR_SHIFT;
+		if (spl > 1 && ((vreq->sec | secs) & (spl - 1))) {
+			err = -EINVAL;
+			goto fail;
+		}
+		break;
+	case TD_OP_FLUSH:
 		break;
 	default:
 		err = -EOPNOTSUPP;
@@ -171,7 +222,8 @@ fail:
 void
 tapdisk_image_close(td_image_t *image)
 {
-	td_close(image);
+	if (!image->lazy)
+		td_close(image);
 	tapdisk_image_free(image);
 }
 
@@ -213,8 +265,89 @@ fail:
 	return err;
 }
 
+/* regular files only: a device gives no sign of being written to */
+int
+tapdisk_image_stamp(td_image_t *image)
+{
+	struct stat st;
+
+	if (stat(image->name, &st))
+		return -errno;
+
+	if (!S_ISREG(st.st_mode))
+		return -ENOTSUP;
+
+	image->stamp.dev   = st.st_dev;
+	image->stamp.ino   = st.st_ino;
+	image->stamp.size  = st.st_size;
+	image->stamp.mtime = st.st_mtim;
+	image->stamp.ctime = st.st_ctim;
+
+	return 0;
+}
+
+static int
+tapdisk_image_unchanged(td_image_t *image)
+{
+	struct td_image_stamp stamp = image->stamp;
+
+	if (tapdisk_image_stamp(image))
+		return 0;
+
+	return stamp.dev == image->stamp.dev &&
+		stamp.ino == image->stamp.ino &&
+		stamp.size == image->stamp.size &&
+		stamp.mtime.tv_sec == image->stamp.mtime.tv_sec &&
+		stamp.mtime.tv_nsec == image->stamp.mtime.tv_nsec &&
+		stamp.ctime.tv_sec == image->stamp.ctime.tv_sec &&
+		stamp.ctime.tv_nsec == image->stamp.ctime.tv_nsec;
+}
+
+/* a parked image still good for @id */
+static td_image_t *
+tapdisk_image_find_parked(struct list_head *reuse, td_disk_id_t *id)
+{
+	td_image_t *image;
+
+	if (!reuse)
+		return NULL;
+
+	tapdisk_for_each_image(image, reuse) {
+		if (image->type != id->type || strcmp(image->name, id->name))
+			continue;
+
+		if ((image->flags ^ id->flags) & ~TD_OPEN_STRICT)
+			return NULL;
+
+		return tapdisk_image_unchanged(image) ? image : NULL;
+	}
+
+	return NULL;
+}
+
+/* placeholders know theirs from the header */
 static int
-tapdisk_image_open_parent(td_image_t *image, td_image_t **_parent)
+tapdisk_image_get_parent_id(td_image_t *image, td_disk_id_t *id)
+{
+	struct td_image_lazy *l = image->lazy;
+
+	if (!l)
+		return td_get_parent_id(image, id);
+
+	if (!l->parent.name)
+		return TD_NO_PARENT;
+
+	id->name  = strdup(l->parent.name);
+	id->type  = l->parent.type;
+	id->flags = l->parent.flags;
+
+	return id->name ? 0 : -ENOMEM;
+}
+
+/* 1 if the parent was found parked on @reuse */
+static int
+tapdisk_image_open_parent(td_image_t *image, td_image_t **_parent,
+			  struct list_head *reuse)
 {
 	td_image_t *parent = NULL;
 	td_disk_id_t id;
@@ -223,7 +356,7 @@ tapdisk_image_open_parent(td_image_t *image, td_image_t **_parent)
 	memset(&id, 0, sizeof(id));
 	id.flags = image->flags;
 
-	err = td_get_parent_id(image, &id);
+	err = tapdisk_image_get_parent_id(image, &id);
 	if (err == TD_NO_PARENT) {
 		err = 0;
 		goto out;
@@ -231,6 +364,12 @@ tapdisk_image_open_parent(td_image_t *image, td_image_t **_parent)
 	if (err)
 		return err;
 
+	parent = tapdisk_image_find_parked(reuse, &id);
+	if (parent) {
+		*_parent = parent;
+		return 1;
+	}
+
 	err = tapdisk_image_open(id.type, id.name, id.flags, &parent);
 	if (err)
 		return err;
@@ -240,20 +379,667 @@ out:
 	return 0;
 }
 
+/* the parent of VHD @id, from its header alone */
 static int
-tapdisk_image_open_parents(td_image_t *image)
+tapdisk_image_peek_parent(td_disk_id_t *id, td_disk_id_t *parent)
 {
-	td_image_t *parent;
+	vhd_context_t vhd;
+	char *name;
 	int err;
 
-	do {
-		err = tapdisk_image_open_parent(image, &parent);
+	if (id->type != DISK_TYPE_VHD)
+		return -ENOTSUP;
+
+	err = vhd_open(&vhd, id->name, VHD_OPEN_RDONLY | VHD_OPEN_FAST);
+	if (err)
+		return err;
+
+	if (vhd.footer.type != HD_TYPE_DIFF) {
+		err = TD_NO_PARENT;
+		goto out;
+	}
+
+	err = vhd_parent_locator_get(&vhd, &name);
+	if (err)
+		goto out;
+
+	parent->name  = name;
+	parent->type  = vhd_parent_raw(&vhd) ? DISK_TYPE_AIO : DISK_TYPE_VHD;
+	parent->flags = id->flags | TD_OPEN_SHAREABLE | TD_OPEN_RDONLY;
+
+out:
+	vhd_close(&vhd);
+	return err;
+}
+
+static int
+tapdisk_image_same_id(td_image_t *image, td_disk_id_t *id)
+{
+	td_disk_id_t pid;
+	int same;
+
+	memset(&pid, 0, sizeof(pid));
+	pid.flags = image->flags;
+
+	if (tapdisk_image_get_parent_id(image, &pid))
+		return 0;
+
+	same = pid.type == id->type && !strcmp(pid.name, id->name);
+	free(pid.name);
+
+	return same;
+}
+
+struct tapdisk_image_opener {
+	pthread_mutex_t              lock;
+	td_image_t                 **images;
+	int                         *errs;
+	int                          n;
+	int                          next;
+};
+
+static void *
+tapdisk_image_open_thread(void *arg)
+{
+	struct tapdisk_image_opener *o = arg;
+	int i;
+
+	for (;;) {
+		pthread_mutex_lock(&o->lock);
+		i = o->next++;
+		pthread_mutex_unlock(&o->lock);
+
+		if (i >= o->n)
+			break;
+
+		o->errs[i] = td_open(o->images[i]);
+	}
+
+	return NULL;
+}
+
+/*
+ * td_open()s @images, TD_IMAGE_OPEN_THREADS at a time. Only drivers
+ * flagged DISK_TYPE_OPEN_CONCURRENT get here.
+ */
+static void
+tapdisk_image_open_many(td_image_t **images, int *errs, int n)
+{
+	struct tapdisk_image_opener o;
+	pthread_t threads[TD_IMAGE_OPEN_THREADS - 1];
+	int i, err, started;
+
+	memset(&o, 0, sizeof(o));
+	pthread_mutex_init(&o.lock, NULL);
+	o.images = images;
+	o.errs   = errs;
+	o.n      = n;
+
+	for (started = 0;
+	     started < TD_IMAGE_OPEN_THREADS - 1 && started < n - 1;
+	     started++) {
+		err = pthread_create(&threads[started], NULL,
+				     tapdisk_image_open_thread, &o);
+		if (err) {
+			DPRINTF("opening parents: no thread: %d\n", -err);
+			break;
+		}
+	}
+
+	tapdisk_image_open_thread(&o);
+
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	pthread_mutex_destroy(&o.lock);
+}
+
+/*
+ * Opens up to @max parents of @image ahead of the serial walk. Their
+ * names come from each VHD header in turn, which is quick, and opening
+ * them, which loads the BAT and the rest, goes on concurrently.
+ * Whatever proves short of the chain, read back in order from the
+ * opened images, is dropped for the serial walk to redo and report.
+ * @_image is moved on to the last parent linked; returns how many were.
+ */
+static int
+tapdisk_image_open_ahead(td_image_t **_image, int max,
+			 struct list_head *reuse)
+{
+	td_disk_id_t ids[TD_IMAGE_OPEN_AHEAD], next;
+	td_image_t *images[TD_IMAGE_OPEN_AHEAD], *open[TD_IMAGE_OPEN_AHEAD];
+	int errs[TD_IMAGE_OPEN_AHEAD], reused[TD_IMAGE_OPEN_AHEAD];
+	int slot[TD_IMAGE_OPEN_AHEAD], open_errs[TD_IMAGE_OPEN_AHEAD];
+	td_image_t *image, *parent;
+	int i, n, n_ids, n_open, linked, err;
+
+	image = *_image;
+	n     = 0;
+
+	if (max <= 0)
+		return 0;
+
+	memset(&next, 0, sizeof(next));
+	next.flags = image->flags;
+
+	if (tapdisk_image_get_parent_id(image, &next))
+		return 0;
+
+	while (n < max) {
+		ids[n]    = next;
+		parent    = tapdisk_image_find_parked(reuse, &ids[n]);
+		images[n] = parent;
+		reused[n] = !!parent;
+		errs[n]   = 0;
+		n++;
+
+		memset(&next, 0, sizeof(next));
+		next.flags = ids[n - 1].flags;
+
+		if (parent)
+			err = tapdisk_image_get_parent_id(parent, &next);
+		else
+			err = tapdisk_image_peek_parent(&ids[n - 1], &next);
 		if (err)
 			break;
+	}
+
+	if (n == max)
+		free(next.name);
+
+	n_ids = n;
+
+	for (i = 0, n_open = 0; i < n; i++) {
+		slot[i] = -1;
+		if (images[i])
+			continue;
+
+		parent = tapdisk_image_allocate(ids[i].name, ids[i].type,
+						ids[i].flags);
+		if (!parent) {
+			n = i;
+			break;
+		}
+
+		images[i] = parent;
+		if (!td_load(parent))
+			continue;
+
+		parent->driver = tapdisk_driver_allocate(parent->type,
+							 parent->name,
+							 parent->flags);
+		if (!parent->driver) {
+			n = i + 1;
+			errs[i] = -ENOMEM;
+			break;
+		}
+
+		if (!(tapdisk_disk_types[parent->type]->flags &
+		      DISK_TYPE_OPEN_CONCURRENT)) {
+			errs[i] = td_open(parent);
+			continue;
+		}
+
+		slot[i] = n_open;
+		open[n_open++] = parent;
+	}
+
+	if (n_open > 1)
+		tapdisk_image_open_many(open, open_errs, n_open);
+	else if (n_open)
+		open_errs[0] = td_open(open[0]);
+
+	for (i = 0; i < n; i++)
+		if (slot[i] >= 0)
+			errs[i] = open_errs[slot[i]];
+
+	for (i = 0; i < n; i++) {
+		parent = images[i];
+
+		if (errs[i] || (i && !tapdisk_image_same_id(image, &ids[i])))
+			break;
+
+		if (reused[i]) {
+			DPRINTF("reusing open image %s\n", parent->name);
+			list_del(&parent->next);
+		}
+
+		list_add(&parent->next, &image->next);
+		image = parent;
+	}
+
+	linked = i;
+
+	for (; i < n; i++) {
+		if (reused[i])
+			continue;
+
+		if (errs[i] || !images[i])
+			tapdisk_image_free(images[i]);
+		else
+			tapdisk_image_close(images[i]);
+	}
+
+	for (i = 0; i < n_ids; i++)
+		free(ids[i].name);
+
+	*_image = image;
+	return linked;
+}
+
+static void
+tapdisk_image_free_lazy(struct td_image_lazy *l)
+{
+	struct td_image_lazy_req *r, *tmp;
+
+	if (l->busy)
+		pthread_join(l->thread, NULL);
+
+	if (l->event >= 0)
+		tapdisk_server_unregister_event(l->event);
+	if (l->fd >= 0)
+		close(l->fd);
+
+	if (l->shadow) {
+		if (l->shadow->driver &&
+		    td_flag_test(l->shadow->driver->state, TD_DRIVER_OPEN))
+			tapdisk_image_close(l->shadow);
+		else
+			tapdisk_image_free(l->shadow);
+	}
+
+	list_for_each_entry_safe(r, tmp, &l->requests, next) {
+		list_del(&r->next);
+		free(r);
+	}
+
+	free(l->parent.name);
+	free(l);
+}
+
+/* the parent uuid in the header of @image, if a VHD */
+static int
+tapdisk_image_prt_uuid(td_image_t *image, uuid_t uuid)
+{
+	vhd_context_t vhd;
+	int err;
+
+	if (image->lazy) {
+		uuid_copy(uuid, image->lazy->prt_uuid);
+		return 0;
+	}
+
+	if (image->type != DISK_TYPE_VHD)
+		return -ENOTSUP;
+
+	err = vhd_open(&vhd, image->name, VHD_OPEN_RDONLY | VHD_OPEN_FAST);
+	if (err)
+		return err;
+
+	uuid_copy(uuid, vhd.header.prt_uuid);
+	vhd_close(&vhd);
+
+	return 0;
+}
+
+/* a placeholder for VHD @id, child of @child */
+static int
+tapdisk_image_alloc_lazy(td_image_t *child, td_disk_id_t *id,
+			 td_image_t **_image)
+{
+	struct td_image_lazy *l;
+	td_image_t *image;
+	vhd_context_t vhd;
+	uuid_t prt_uuid;
+	int err, check;
+
+	check = !tapdisk_image_prt_uuid(child, prt_uuid);
+
+	err = vhd_open(&vhd, id->name, VHD_OPEN_RDONLY | VHD_OPEN_FAST);
+	if (err)
+		return err;
+
+	if (check && uuid_compare(vhd.footer.uuid, prt_uuid)) {
+		ERR(-EINVAL, "%s: not the parent of %s\n",
+		    id->name, child->name);
+		err = -EINVAL;
+		goto out;
+	}
+
+	err   = -ENOMEM;
+	l     = NULL;
+	image = tapdisk_image_allocate(id->name, id->type, id->flags);
+	if (!image)
+		goto out;
+
+	image->driver = tapdisk_driver_allocate(id->type, id->name, id->flags);
+	l = calloc(1, sizeof(*l));
+	if (!image->driver || !l)
+		goto fail;
+
+	l->fd    = -1;
+	l->event = -1;
+	INIT_LIST_HEAD(&l->requests);
+
+	if (vhd.footer.type == HD_TYPE_DIFF) {
+		err = vhd_parent_locator_get(&vhd, &l->parent.name);
+		if (err)
+			goto fail;
+
+		l->parent.type  = vhd_parent_raw(&vhd) ?
+			DISK_TYPE_AIO : DISK_TYPE_VHD;
+		l->parent.flags = id->flags | TD_OPEN_SHAREABLE | TD_OPEN_RDONLY;
+		uuid_copy(l->prt_uuid, vhd.header.prt_uuid);
+	}
+
+	image->info.size        = vhd.footer.curr_size >> VHD_SECTOR_SHIFT;
+	image->info.sector_size = VHD_SECTOR_SIZE;
+	image->info.physical_sector_size = VHD_SECTOR_SIZE;
+	image->driver->info     = image->info;
+	image->lazy             = l;
+
+	DPRINTF("linked image %s, opened on first use\n", image->name);
+
+	*_image = image;
+	err     = 0;
+out:
+	vhd_close(&vhd);
+	return err;
+
+fail:
+	free(l);
+	tapdisk_image_free(image);
+	goto out;
+}
+
+/* as tapdisk_image_open_parent, VHD parents linked as placeholders */
+static int
+tapdisk_image_open_lazy(td_image_t *image, td_image_t **_parent,
+			struct list_head *reuse)
+{
+	td_image_t *parent = NULL;
+	td_disk_id_t id;
+	int err;
+
+	memset(&id, 0, sizeof(id));
+	id.flags = image->flags;
+
+	err = tapdisk_image_get_parent_id(image, &id);
+	if (err == TD_NO_PARENT) {
+		err = 0;
+		goto out;
+	}
+	if (err)
+		return err;
+
+	parent = tapdisk_image_find_parked(reuse, &id);
+	if (parent) {
+		err = 1;
+		goto out;
+	}
+
+	if (id.type == DISK_TYPE_VHD && td_flag_test(id.flags, TD_OPEN_RDONLY))
+		err = tapdisk_image_alloc_lazy(image, &id, &parent);
+	else
+		err = tapdisk_image_open(id.type, id.name, id.flags, &parent);
+
+out:
+	free(id.name);
+	*_parent = parent;
+	return err;
+}
+
+static void *
+tapdisk_image_lazy_thread(void *arg)
+{
+	struct td_image_lazy *l = arg;
+	uint64_t one = 1;
+	int gcc;
+
+	l->err = td_open(l->shadow);
+
+	gcc = write(l->fd, &one, sizeof(one));
+	if (gcc) {};
+
+	return NULL;
+}
+
+/* parked requests go on to @image, or fail with @err */
+static void
+tapdisk_image_lazy_resume(td_image_t *image, int err)
+{
+	struct td_image_lazy *l = image->lazy;
+	struct list_head requests = LIST_HEAD_INIT(requests);
+	struct td_image_lazy_req *r, *tmp;
+
+	list_splice(&l->requests, &requests);
+	INIT_LIST_HEAD(&l->requests);
+
+	if (!err) {
+		image->lazy = NULL;
+		tapdisk_image_free_lazy(l);
+	} else
+		l->failed++;
+
+	list_for_each_entry_safe(r, tmp, &requests, next) {
+		td_request_t treq = r->treq;
+
+		list_del(&r->next);
+		free(r);
+
+		if (err) {
+			td_complete_request(treq, err);
+			continue;
+		}
+
+		switch (treq.op) {
+		case TD_OP_WRITE:
+			td_queue_write(image, treq);
+			break;
+		case TD_OP_READ:
+			td_queue_read(image, treq);
+			break;
+		case TD_OP_DISCARD:
+			td_queue_discard(image, treq);
+			break;
+		}
+	}
+}
+
+static void
+tapdisk_image_lazy_event(event_id_t id, char mode, void *private)
+{
+	td_image_t *image = private, *child, *parent, *shadow;
+	struct td_image_lazy *l = image->lazy;
+	struct td_image_lazy_req *r;
+	struct list_head *images;
+	td_vbd_t *vbd;
+	uint64_t val;
+	int gcc, err;
+
+	if (l->busy) {
+		gcc = read(l->fd, &val, sizeof(val));
+		if (gcc) {};
+
+		pthread_join(l->thread, NULL);
+		l->busy = 0;
+
+		tapdisk_server_unregister_event(l->event);
+		l->event = -1;
+		close(l->fd);
+		l->fd = -1;
+	}
+
+	r      = list_entry(l->requests.next, struct td_image_lazy_req, next);
+	vbd    = r->treq.vreq->vbd;
+	images = &vbd->images;
+	shadow = l->shadow;
+
+	err = l->err;
+	if (err)
+		goto out;
+
+	child = tapdisk_image_entry(image->next.prev);
+	if (&child->next != images && !child->lazy) {
+		err = td_validate_parent(child, shadow);
+		if (err)
+			goto out;
+	}
+
+	parent = tapdisk_image_entry(image->next.next);
+	if (&parent->next != images && !parent->lazy) {
+		err = td_validate_parent(shadow, parent);
+		if (err)
+			goto out;
+	}
+
+	tapdisk_driver_free(image->driver);
+	image->driver  = shadow->driver;
+	image->info    = shadow->info;
+	shadow->driver = NULL;
+
+	/* what it holds is known now */
+	td_chainmap_reset(&vbd->chainmap);
+
+out:
+	if (err) {
+		ERR(err, "opening %s on first use failed", image->name);
+		if (td_flag_test(shadow->driver->state, TD_DRIVER_OPEN))
+			tapdisk_image_close(shadow);
+		else
+			tapdisk_image_free(shadow);
+	} else
+		tapdisk_image_free(shadow);
+	l->shadow = NULL;
+
+	tapdisk_image_lazy_resume(image, err);
+}
+
+static int
+tapdisk_image_lazy_start(td_image_t *image)
+{
+	struct td_image_lazy *l = image->lazy;
+	td_image_t *shadow;
+	int err;
+
+	shadow = tapdisk_image_allocate(image->name, image->type,
+					image->flags);
+	if (!shadow)
+		return -ENOMEM;
+
+	/* another vbd of the loop may have it open already */
+	if (!td_load(shadow)) {
+		l->shadow = shadow;
+		l->err    = 0;
+		return 1;
+	}
+
+	shadow->driver = tapdisk_driver_allocate(image->type, image->name,
+						 image->flags);
+	if (!shadow->driver) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	l->fd = tapdisk_sys_eventfd(0);
+	if (l->fd < 0) {
+		err = -errno;
+		goto fail;
+	}
+
+	l->event = tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
+						 l->fd, 0,
+						 tapdisk_image_lazy_event,
+						 image);
+	if (l->event < 0) {
+		err = l->event;
+		goto fail;
+	}
+
+	l->shadow = shadow;
+	err = pthread_create(&l->thread, NULL, tapdisk_image_lazy_thread, l);
+	if (err) {
+		l->shadow = NULL;
+		err = -err;
+		goto fail;
+	}
+
+	l->busy = 1;
+	return 0;
+
+fail:
+	if (l->event >= 0) {
+		tapdisk_server_unregister_event(l->event);
+		l->event = -1;
+	}
+	if (l->fd >= 0) {
+		close(l->fd);
+		l->fd = -1;
+	}
+	tapdisk_image_free(shadow);
+	return err;
+}
+
+/* a request forwarded to a placeholder waits for it to open */
+void
+tapdisk_image_queue_lazy(td_image_t *image, td_request_t treq)
+{
+	struct td_image_lazy *l = image->lazy;
+	struct td_image_lazy_req *r;
+	int err;
+
+	r = malloc(sizeof(*r));
+	if (!r) {
+		td_complete_request(treq, -EBUSY);
+		return;
+	}
+
+	r->treq = treq;
+	list_add_tail(&r->next, &l->requests);
+	l->parked++;
+
+	if (l->busy)
+		return;
+
+	err = tapdisk_image_lazy_start(image);
+	if (err > 0)
+		tapdisk_image_lazy_event(-1, 0, image);
+	else if (err)
+		tapdisk_image_lazy_resume(image, err);
+}
+
+/* opens the parents of @image, or takes them from @reuse */
+static int
+tapdisk_image_open_parents(td_image_t *image, struct list_head *reuse)
+{
+	td_image_t *parent = NULL;
+	int err, lazy, depth, ahead;
+
+	lazy  = (image->flags & TD_OPEN_LAZY_MASK) >> TD_OPEN_LAZY_SHIFT;
+	ahead = TD_IMAGE_OPEN_AHEAD;
+	if (lazy && lazy - 1 < ahead)
+		ahead = lazy - 1;
+
+	depth = 1 + tapdisk_image_open_ahead(&image, ahead, reuse);
+
+	do {
+		if (lazy && depth >= lazy)
+			err = tapdisk_image_open_lazy(image, &parent, reuse);
+		else
+			err = tapdisk_image_open_parent(image, &parent, reuse);
+		if (err < 0)
+			break;
+
+		if (err) {
+			DPRINTF("reusing open image %s\n", parent->name);
+			list_del(&parent->next);
+			err = 0;
+		}
 
 		if (parent) {
 			list_add(&parent->next, &image->next);
 			image = parent;
+			depth++;
 		}
 	} while (parent);
 
@@ -271,7 +1057,8 @@ tapdisk_image_close_chain(struct list_head *list)
 
 static int
 __tapdisk_image_open_chain(int type, const char *name, int flags,
-			   struct list_head *_head, int prt_devnum)
+			   struct list_head *_head, int prt_devnum,
+			   struct list_head *reuse)
 {
 	struct list_head head = LIST_HEAD_INIT(head);
 	td_image_t *image;
@@ -296,7 +1083,7 @@ __tapdisk_image_open_chain(int type, const char *name, int flags,
 		goto done;
 	}
 
-	err = tapdisk_image_open_parents(image);
+	err = tapdisk_image_open_parents(image, reuse);
 	if (err)
 		goto fail;
 
@@ -347,7 +1134,8 @@ fail:
 }
 
 static int
-tapdisk_image_open_x_chain(const char *path, struct list_head *_head)
+tapdisk_image_open_x_chain(const char *path, struct list_head *_head,
+			   struct list_head *reuse)
 {
 	struct list_head head = LIST_HEAD_INIT(head);
 	td_image_t *image = NULL, *next;
@@ -430,7 +1218,7 @@ tapdisk_image_open_x_chain(const char *path, struct list_head *_head)
 		goto fail;
 	}
 
-	err = tapdisk_image_open_parents(image);
+	err = tapdisk_image_open_parents(image, reuse);
 	if (err)
 		goto fail;
 
@@ -452,9 +1240,9 @@ fail:
 	goto out;
 }
 
-int
-tapdisk_image_open_chain(const char *desc, int flags, int prt_devnum,
-			 struct list_head *head)
+static int
+__tapdisk_image_open_desc(const char *desc, int flags, int prt_devnum,
+			  struct list_head *head, struct list_head *reuse)
 {
 	const char *name;
 	int type, err;
@@ -462,7 +1250,7 @@ tapdisk_image_open_chain(const char *desc, int flags, int prt_devnum,
 	type = tapdisk_disktype_parse_params(desc, &name);
 	if (type >= 0)
 		return __tapdisk_image_open_chain(type, name, flags, head,
-						  prt_devnum);
+						  prt_devnum, reuse);
 
 	err = type;
 
@@ -470,7 +1258,8 @@ tapdisk_image_open_chain(const char *desc, int flags, int prt_devnum,
 		switch (desc[2]) {
 		case 'c':
 			if (!strncmp(desc, "x-chain", strlen("x-chain")))
-				err = tapdisk_image_open_x_chain(name, head);
+				err = tapdisk_image_open_x_chain(name, head,
+								 reuse);
 			break;
 		}
 	}
@@ -478,6 +1267,24 @@ tapdisk_image_open_chain(const char *desc, int flags, int prt_devnum,
 	return err;
 }
 
+int
+tapdisk_image_open_chain(const char *desc, int flags, int prt_devnum,
+			 struct list_head *head)
+{
+	return __tapdisk_image_open_desc(desc, flags, prt_devnum, head, NULL);
+}
+
+/*
+ * As above, with the parents taken from @reuse where they are still
+ * the same files. The rest of @reuse is left to the caller.
+ */
+int
+tapdisk_image_reopen_chain(const char *desc, int flags,
+			   struct list_head *reuse, struct list_head *head)
+{
+	return __tapdisk_image_open_desc(desc, flags, -1, head, reuse);
+}
+
 int
 tapdisk_image_validate_chain(struct list_head *head)
 {
@@ -492,14 +1299,24 @@ tapdisk_image_validate_chain(struct list_head *head)
 		if (image == tapdisk_image_entry(head))
 			break;
 
+		/* placeholders are, once opened */
+		if (image->lazy || parent->lazy)
+			continue;
+
 		err = td_validate_parent(image, parent);
 		if (err)
 			return err;
 
 		flags = tapdisk_disk_types[image->type]->flags;
+		/* filters run on the storage of the image they sit on */
 		if (flags & DISK_TYPE_FILTER) {
 			image->driver->info = parent->driver->info;
 			image->info         = parent->info;
+
+			if (image->driver->storage <= 0) {
+				image->driver->storage = parent->driver->storage;
+				image->driver->profile = parent->driver->profile;
+			}
 		}
 	}
 
@@ -531,9 +1348,21 @@ tapdisk_image_stats(td_image_t *image, td_stats_t *st)
 	tapdisk_stats_val(st, "llu", image->stats.fail.wr);
 	tapdisk_stats_leave(st, ']');
 
-	tapdisk_stats_field(st, "driver", "{");
-	tapdisk_driver_stats(image->driver, st);
+	tapdisk_stats_field(st, "latency", "{");
+	td_latency_stats(&image->latency, st);
 	tapdisk_stats_leave(st, '}');
 
+	if (image->lazy) {
+		tapdisk_stats_field(st, "lazy", "{");
+		tapdisk_stats_field(st, "opening", "d", image->lazy->busy);
+		tapdisk_stats_field(st, "parked", "llu", image->lazy->parked);
+		tapdisk_stats_field(st, "failed", "llu", image->lazy->failed);
+		tapdisk_stats_leave(st, '}');
+	} else {
+		tapdisk_stats_field(st, "driver", "{");
+		tapdisk_driver_stats(image->driver, st);
+		tapdisk_stats_leave(st, '}');
+	}
+
 	tapdisk_stats_leave(st, '}');
 }
@@ -18,7 +18,22 @@
 #ifndef _TAPDISK_IMAGE_H_
 #define _TAPDISK_IMAGE_H_
 
+#include <sys/types.h>
+#include <time.h>
+
 #include "tapdisk.h"
+#include "tapdisk-latency.h"
+
+/* the file behind an image, as last seen */
+struct td_image_stamp {
+	dev_t                        dev;
+	ino_t                        ino;
+	off_t                        size;
+	struct timespec              mtime;
+	struct timespec              ctime;
+};
+
+struct td_image_lazy;
 
 struct td_image_handle {
 	int                          type;
@@ -49,6 +64,15 @@ struct td_image_handle {
 		td_sector_count_t    hits;
 		td_sector_count_t    fail;
 	} stats;
+
+	/* issue to completion, of requests this image completed */
+	struct td_latency            latency;
+
+	/* kept open over a pause, while the file stays like this */
+	struct td_image_stamp        stamp;
+
+	/* a placeholder, until first forwarded to */
+	struct td_image_lazy        *lazy;
 };
 
 #define tapdisk_for_each_image(_image, _head)			\
@@ -63,10 +87,18 @@ struct td_image_handle {
 #define tapdisk_image_entry(_head)		\
 	list_entry(_head, td_image_t, next)
 
+/* parents found from their children's headers, then opened at once */
+#define TD_IMAGE_OPEN_AHEAD          64
+#define TD_IMAGE_OPEN_THREADS        8
+
 int tapdisk_image_open(int, const char *, int, td_image_t **);
 void tapdisk_image_close(td_image_t *);
+void tapdisk_image_queue_lazy(td_image_t *, td_request_t);
 
 int tapdisk_image_open_chain(const char *, int, int, struct list_head *);
+int tapdisk_image_reopen_chain(const char *, int, struct list_head *,
+			       struct list_head *);
+int tapdisk_image_stamp(td_image_t *);
 void tapdisk_image_close_chain(struct list_head *);
 int tapdisk_image_validate_chain(struct list_head *);
 
@@ -30,6 +30,7 @@
 #include "tapdisk-server.h"
 #include "tapdisk-interface.h"
 #include "tapdisk-log.h"
+#include "profile.h"
 
 int
 td_load(td_image_t *image)
@@ -42,7 +43,7 @@ td_load(td_image_t *image)
 		return -ENODEV;
 
 	driver = shared->driver;
-	if (!driver)
+	if (!driver || !td_flag_test(driver->state, TD_DRIVER_OPEN))
 		return -EBADF;
 
 	driver->refcnt++;
@@ -54,6 +55,30 @@ td_load(td_image_t *image)
 	return 0;
 }
 
+/* Picks the I/O profile of the storage @name is on, if any. */
+static void
+td_open_profile(td_driver_t *driver, const char *name)
+{
+	int type, err;
+
+	type = tapdisk_storage_type(name);
+	if (type <= 0)
+		return;
+
+	err = tapdisk_storage_profile(name, type, &driver->profile);
+	if (err)
+		EPRINTF("%s: bad I/O profile (%d), using the %s one\n",
+			name, err, tapdisk_storage_name(type));
+
+	driver->storage = type;
+
+	DPRINTF("%s: I/O profile %s: engine %s, depth %d, merge %d, "
+		"direct %d, readahead %d\n", name, driver->profile.name,
+		tapdisk_queue_tio_name(driver->profile.tio_drv),
+		driver->profile.depth, driver->profile.merge,
+		driver->profile.direct, driver->profile.readahead);
+}
+
 int
 __td_open(td_image_t *image, td_disk_info_t *info)
 {
@@ -73,6 +98,8 @@ __td_open(td_image_t *image, td_disk_info_t *info)
 	}
 
 	if (!td_flag_test(driver->state, TD_DRIVER_OPEN)) {
+		td_open_profile(driver, image->name);
+
 		err = driver->ops->td_open(driver, image->name, image->flags);
 		if (err) {
 			if (!image->driver)
@@ -112,6 +139,8 @@ td_close(td_image_t *image)
 	if (!driver->refcnt && td_flag_test(driver->state, TD_DRIVER_OPEN)) {
 		driver->ops->td_close(driver);
 		td_flag_clear(driver->state, TD_DRIVER_OPEN);
+		tapdisk_driver_release_queue(driver);
+		tapdisk_server_reset_filter();
 	}
 
 	DPRINTF("closed image %s (%d users, state: 0x%08x, type: %d)\n",
@@ -153,6 +182,14 @@ td_validate_parent(td_image_t *image, td_image_t *parent)
 	return driver->ops->td_validate_parent(driver, pdriver, 0);
 }
 
+/* the vbd whose queue a driver's I/O goes to, see TD_IO_QUEUE_VBD */
+static inline void
+td_bind_owner(td_driver_t *driver, td_request_t treq)
+{
+	if (!driver->owner && treq.vreq)
+		driver->owner = treq.vreq->vbd;
+}
+
 void
 td_queue_write(td_image_t *image, td_request_t treq)
 {
@@ -179,6 +216,9 @@ td_queue_write(td_image_t *image, td_request_t treq)
 	if (err)
 		goto fail;
 
+	td_bind_owner(driver, treq);
+
+	td_trace(queue, treq.vreq, TD_OP_WRITE, treq.sec, treq.secs, 0);
 	driver->ops->td_queue_write(driver, treq);
 
 	return;
@@ -213,6 +253,9 @@ td_queue_read(td_image_t *image, td_request_t treq)
 	if (err)
 		goto fail;
 
+	td_bind_owner(driver, treq);
+
+	td_trace(queue, treq.vreq, TD_OP_READ, treq.sec, treq.secs, 0);
 	driver->ops->td_queue_read(driver, treq);
 
 	return;
@@ -221,6 +264,129 @@ fail:
 	td_complete_request(treq, err);
 }
 
+void
+td_queue_discard(td_image_t *image, td_request_t treq)
+{
+	int err;
+	td_driver_t *driver;
+
+	driver = image->driver;
+	if (!driver) {
+		err = -ENODEV;
+		goto fail;
+	}
+
+	if (!td_flag_test(driver->state, TD_DRIVER_OPEN)) {
+		err = -EBADF;
+		goto fail;
+	}
+
+	if (!driver->ops->td_queue_discard) {
+		err = -EOPNOTSUPP;
+		goto fail;
+	}
+
+	err = tapdisk_image_check_td_request(image, treq);
+	if (err)
+		goto fail;
+
+	td_bind_owner(driver, treq);
+
+	driver->ops->td_queue_discard(driver, treq);
+
+	return;
+
+fail:
+	td_complete_request(treq, err);
+}
+
+int
+td_allocated(td_image_t *image, td_sector_t sec, int secs)
+{
+	td_driver_t *driver;
+
+	driver = image->driver;
+	if (!driver)
+		return -ENODEV;
+
+	if (!td_flag_test(driver->state, TD_DRIVER_OPEN))
+		return -EBADF;
+
+	if (!driver->ops->td_allocated)
+		return -EOPNOTSUPP;
+
+	return driver->ops->td_allocated(driver, sec, secs);
+}
+
+int
+td_get_uuid(td_image_t *image, uint8_t *uuid)
+{
+	td_driver_t *driver;
+
+	driver = image->driver;
+	if (!driver)
+		return -ENODEV;
+
+	if (!td_flag_test(driver->state, TD_DRIVER_OPEN))
+		return -EBADF;
+
+	if (!td_flag_test(driver->state, TD_DRIVER_RDONLY))
+		return -EINVAL;
+
+	if (!driver->ops->td_get_uuid)
+		return -EOPNOTSUPP;
+
+	return driver->ops->td_get_uuid(driver, uuid);
+}
+
+int
+td_drain(td_image_t *image)
+{
+	td_driver_t *driver;
+
+	driver = image->driver;
+	if (!driver || !td_flag_test(driver->state, TD_DRIVER_OPEN))
+		return 0;
+
+	if (!driver->ops->td_drain)
+		return 0;
+
+	return driver->ops->td_drain(driver);
+}
+
+int
+td_headroom(td_image_t *image, int64_t *space, uint64_t *allocated)
+{
+	td_driver_t *driver;
+
+	driver = image->driver;
+	if (!driver || !td_flag_test(driver->state, TD_DRIVER_OPEN))
+		return -EBADF;
+
+	if (td_flag_test(driver->state, TD_DRIVER_RDONLY) ||
+	    !driver->ops->td_headroom)
+		return -EOPNOTSUPP;
+
+	return driver->ops->td_headroom(driver, space, allocated);
+}
+
+int
+td_footprint(td_image_t *image, int trim, uint64_t *bytes)
+{
+	td_driver_t *driver;
+
+	*bytes = 0;
+
+	driver = image->driver;
+	if (!driver || !td_flag_test(driver->state, TD_DRIVER_OPEN))
+		return 0;
+
+	if (!driver->ops->td_footprint)
+		return -EOPNOTSUPP;
+
+	return driver->ops->td_footprint(driver, trim, bytes);
+}
+
 void
 td_forward_request(td_request_t treq)
 {
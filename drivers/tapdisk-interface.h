@@ -30,7 +30,13 @@ int td_validate_parent(td_image_t *, td_image_t *);
 
 void td_queue_write(td_image_t *, td_request_t);
 void td_queue_read(td_image_t *, td_request_t);
+void td_queue_discard(td_image_t *, td_request_t);
 void td_forward_request(td_request_t);
+int td_allocated(td_image_t *, td_sector_t, int);
+int td_get_uuid(td_image_t *, uint8_t *);
+int td_drain(td_image_t *);
+int td_headroom(td_image_t *, int64_t *space, uint64_t *allocated);
+int td_footprint(td_image_t *, int trim, uint64_t *bytes);
 void td_complete_request(td_request_t, int);
 
 void td_debug(td_image_t *);
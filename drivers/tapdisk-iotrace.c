@@ -0,0 +1,136 @@
+/*
+ * Copyright (C) Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2.1 only
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "tapdisk-log.h"
+#include "tapdisk-iotrace.h"
+
+int
+td_iotrace_open(struct td_iotrace **_t, const char *path,
+		uint64_t bytes, uint64_t secs)
+{
+	struct td_iotrace_header *hdr;
+	struct td_iotrace *t;
+	uint64_t capacity;
+	struct timeval now;
+	void *map;
+	int fd, err;
+
+	capacity = (bytes - TD_IOTRACE_HDR_SIZE) / sizeof(struct td_iotrace_rec);
+	if (bytes <= TD_IOTRACE_HDR_SIZE || capacity < TD_IOTRACE_MIN_RECS)
+		return -EINVAL;
+	bytes = TD_IOTRACE_HDR_SIZE + capacity * sizeof(struct td_iotrace_rec);
+
+	t = calloc(1, sizeof(*t));
+	if (!t)
+		return -ENOMEM;
+
+	t->path = strdup(path);
+	if (!t->path) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) {
+		err = -errno;
+		goto fail;
+	}
+
+	if (ftruncate(fd, bytes)) {
+		err = -errno;
+		close(fd);
+		goto fail;
+	}
+
+	map = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	err = -errno;
+	close(fd);
+	if (map == MAP_FAILED)
+		goto fail;
+
+	gettimeofday(&now, NULL);
+
+	hdr           = map;
+	hdr->magic    = TD_IOTRACE_MAGIC;
+	hdr->version  = TD_IOTRACE_VERSION;
+	hdr->rec_size = sizeof(struct td_iotrace_rec);
+	hdr->capacity = capacity;
+	hdr->head     = 0;
+	hdr->start_us = now.tv_sec * 1000000ULL + now.tv_usec;
+	hdr->secs     = secs;
+
+	t->hdr  = hdr;
+	t->recs = map + TD_IOTRACE_HDR_SIZE;
+	t->size = bytes;
+
+	DPRINTF("recording I/O to %s, %" PRIu64 " records\n", path, capacity);
+
+	*_t = t;
+	return 0;
+
+fail:
+	EPRINTF("cannot record I/O to %s: %d\n", path, err);
+	free(t->path);
+	free(t);
+	return err;
+}
+
+void
+td_iotrace_close(struct td_iotrace *t)
+{
+	if (!t)
+		return;
+
+	DPRINTF("recorded %" PRIu64 " requests to %s\n", t->hdr->head, t->path);
+
+	munmap(t->hdr, t->size);
+	free(t->path);
+	free(t);
+}
+
+void
+td_iotrace_add(struct td_iotrace *t, int op, uint64_t sec, uint32_t secs,
+	       const struct timeval *ts, uint32_t lat_us, int err)
+{
+	struct td_iotrace_header *hdr = t->hdr;
+	struct td_iotrace_rec *r;
+	uint64_t us;
+
+	us = ts->tv_sec * 1000000ULL + ts->tv_usec;
+
+	r         = &t->recs[hdr->head % hdr->capacity];
+	r->ts_us  = us > hdr->start_us ? us - hdr->start_us : 0;
+	r->sec    = sec;
+	r->secs   = secs;
+	r->lat_us = lat_us;
+	r->op     = op;
+	r->err    = err;
+
+	hdr->head++;
+}
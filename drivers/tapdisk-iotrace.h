@@ -0,0 +1,74 @@
+/*
+ * Copyright (C) Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2.1 only
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef _TAPDISK_IOTRACE_H_
+#define _TAPDISK_IOTRACE_H_
+
+#include <stdint.h>
+#include <sys/time.h>
+
+/*
+ * Per-VBD I/O trace, for td-bench -r to replay.
+ *
+ * A ring file: a td_iotrace_header, then 'capacity' records, written
+ * through a shared mapping as requests complete, so in completion
+ * order. Record 'head' % capacity is the next to go, overwriting the
+ * oldest once the ring went round. Arrival times are usecs since
+ * 'start_us', gettimeofday() time.
+ */
+
+#define TD_IOTRACE_MAGIC         0x6361727472646974ULL  /* "tidrtrac" */
+#define TD_IOTRACE_VERSION       1
+#define TD_IOTRACE_HDR_SIZE      4096
+#define TD_IOTRACE_MIN_RECS      1024
+
+struct td_iotrace_header {
+	uint64_t                     magic;
+	uint32_t                     version;
+	uint32_t                     rec_size;
+	uint64_t                     capacity;
+	uint64_t                     head;      /* records, ever */
+	uint64_t                     start_us;
+	uint64_t                     secs;      /* of the disk */
+};
+
+struct td_iotrace_rec {
+	uint64_t                     ts_us;     /* arrival */
+	uint64_t                     sec;
+	uint32_t                     secs;
+	uint32_t                     lat_us;    /* arrival to completion */
+	uint8_t                      op;        /* TD_OP_* */
+	uint8_t                      pad;
+	int16_t                      err;
+	uint32_t                     pad2;
+};
+
+struct td_iotrace {
+	struct td_iotrace_header    *hdr;
+	struct td_iotrace_rec       *recs;
+	size_t                       size;
+	char                        *path;
+};
+
+int td_iotrace_open(struct td_iotrace **, const char *path,
+		    uint64_t bytes, uint64_t secs);
+void td_iotrace_close(struct td_iotrace *);
+void td_iotrace_add(struct td_iotrace *, int op, uint64_t sec,
+		    uint32_t secs, const struct timeval *ts,
+		    uint32_t lat_us, int err);
+
+#endif
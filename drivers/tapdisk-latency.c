@@ -0,0 +1,74 @@
+/*
+ * Copyright (C) Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2.1 only
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "tapdisk-latency.h"
+
+static const unsigned int td_latency_size_secs[TD_LAT_SIZES] = {
+	1, 9, 33, 129, 513
+};
+
+static void
+td_histogram_stats(const struct td_histogram *h, unsigned int secs,
+		   td_stats_t *st)
+{
+	int i;
+
+	tapdisk_stats_enter(st, '{');
+	tapdisk_stats_field(st, "secs", "u", secs);
+	tapdisk_stats_field(st, "count", "llu", h->count);
+	tapdisk_stats_field(st, "p50", "llu", td_histogram_percentile(h, 500));
+	tapdisk_stats_field(st, "p99", "llu", td_histogram_percentile(h, 990));
+	tapdisk_stats_field(st, "p999", "llu", td_histogram_percentile(h, 999));
+	tapdisk_stats_field(st, "max", "llu", h->max);
+
+	/* bucket floor in usecs, count; empty buckets left out */
+	tapdisk_stats_field(st, "hist", "[");
+	for (i = 0; i < TD_LAT_BUCKETS; i++) {
+		if (!h->bucket[i])
+			continue;
+		tapdisk_stats_val(st, "llu", td_latency_bucket_us(i));
+		tapdisk_stats_val(st, "llu", h->bucket[i]);
+	}
+	tapdisk_stats_leave(st, ']');
+
+	tapdisk_stats_leave(st, '}');
+}
+
+static void
+td_latency_op_stats(struct td_histogram *hist, const char *name,
+		    td_stats_t *st)
+{
+	int i;
+
+	tapdisk_stats_field(st, name, "[");
+	for (i = 0; i < TD_LAT_SIZES; i++)
+		if (hist[i].count)
+			td_histogram_stats(&hist[i],
+					   td_latency_size_secs[i], st);
+	tapdisk_stats_leave(st, ']');
+}
+
+void
+td_latency_stats(struct td_latency *lat, td_stats_t *st)
+{
+	td_latency_op_stats(lat->hist[0], "read", st);
+	td_latency_op_stats(lat->hist[1], "write", st);
+}
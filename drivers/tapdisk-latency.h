@@ -0,0 +1,148 @@
+/*
+ * Copyright (C) Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2.1 only
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef _TAPDISK_LATENCY_H_
+#define _TAPDISK_LATENCY_H_
+
+#include <stdint.h>
+#include <sys/time.h>
+
+#include "tapdisk-stats.h"
+
+/*
+ * Log-linear latency histograms, in usecs.
+ *
+ * Every power of two is split into 2^TD_LAT_SUB_BITS linear buckets,
+ * so a bucket is within 12.5% of the values it holds. Values below
+ * 2^TD_LAT_SUB_BITS get a bucket each, anything beyond the last
+ * bucket (~9 minutes) lands in it.
+ *
+ * Adding a sample is a handful of integer ops, all the work is at
+ * stats time.
+ */
+
+#define TD_LAT_SUB_BITS      3
+#define TD_LAT_SUB           (1 << TD_LAT_SUB_BITS)
+#define TD_LAT_BUCKETS       (28 * TD_LAT_SUB)
+
+/* request size classes, by lower bound in sectors */
+#define TD_LAT_SIZES         5
+
+struct td_histogram {
+	uint64_t                     count;
+	uint64_t                     max;
+	uint64_t                     bucket[TD_LAT_BUCKETS];
+};
+
+struct td_latency {
+	struct td_histogram          hist[2][TD_LAT_SIZES];  /* rd, wr */
+};
+
+static inline int
+td_latency_bucket(uint64_t us)
+{
+	int e, idx;
+
+	if (us < TD_LAT_SUB)
+		return us;
+
+	e   = 63 - __builtin_clzll(us);
+	idx = (e - TD_LAT_SUB_BITS + 1) * TD_LAT_SUB +
+		((us >> (e - TD_LAT_SUB_BITS)) & (TD_LAT_SUB - 1));
+
+	return idx < TD_LAT_BUCKETS ? idx : TD_LAT_BUCKETS - 1;
+}
+
+/* smallest value held by bucket idx */
+static inline uint64_t
+td_latency_bucket_us(int idx)
+{
+	int e, m;
+
+	if (idx < TD_LAT_SUB)
+		return idx;
+
+	e = idx / TD_LAT_SUB + TD_LAT_SUB_BITS - 1;
+	m = idx % TD_LAT_SUB;
+
+	return (uint64_t)(TD_LAT_SUB + m) << (e - TD_LAT_SUB_BITS);
+}
+
+/* upper bound of the bucket holding the permille'th sample */
+static inline uint64_t
+td_histogram_percentile(const struct td_histogram *h, int permille)
+{
+	uint64_t rank, seen, hi;
+	int i;
+
+	rank = (h->count * permille + 999) / 1000;
+	seen = 0;
+
+	for (i = 0; i < TD_LAT_BUCKETS; i++) {
+		seen += h->bucket[i];
+		if (seen >= rank)
+			break;
+	}
+
+	if (i >= TD_LAT_BUCKETS - 1)
+		return h->max;
+
+	hi = td_latency_bucket_us(i + 1) - 1;
+
+	return hi < h->max ? hi : h->max;
+}
+
+static inline int
+td_latency_size(unsigned int secs)
+{
+	if (secs <= 8)
+		return 0;
+	if (secs <= 32)
+		return 1;
+	if (secs <= 128)
+		return 2;
+	if (secs <= 512)
+		return 3;
+	return 4;
+}
+
+static inline uint64_t
+td_latency_us(const struct timeval *from, const struct timeval *to)
+{
+	int64_t us;
+
+	us = (int64_t)(to->tv_sec - from->tv_sec) * 1000000 +
+		(to->tv_usec - from->tv_usec);
+
+	return us > 0 ? us : 0;
+}
+
+static inline void
+td_latency_add(struct td_latency *lat, int write,
+	       unsigned int secs, uint64_t us)
+{
+	struct td_histogram *h = &lat->hist[!!write][td_latency_size(secs)];
+
+	h->count++;
+	h->bucket[td_latency_bucket(us)]++;
+	if (us > h->max)
+		h->max = us;
+}
+
+void td_latency_stats(struct td_latency *, td_stats_t *);
+
+#endif /* _TAPDISK_LATENCY_H_ */
@@ -34,8 +34,8 @@
 #include "tapdisk-syslog.h"
 #include "tapdisk-server.h"
 
-#define TLOG_LOGFILE_BUFSZ (16<<10)
-#define TLOG_SYSLOG_BUFSZ   (8<<10)
+#define TLOG_LOGFILE_BUFSZ (64<<10)
+#define TLOG_SYSLOG_BUFSZ   (64<<10)
 
 #define MAX_ENTRY_LEN      512
 
@@ -169,6 +169,11 @@ tlog_vsyslog(int prio, const char *fmt, va_list ap)
 {
 	td_syslog_t *syslog = &tapdisk_log.syslog;
 
+	if (!syslog->ring) {
+		vsyslog(prio, fmt, ap);
+		return;
+	}
+
 	tapdisk_vsyslog(syslog, prio, fmt, ap);
 }
 
@@ -25,6 +25,7 @@
 #include <errno.h>
 #include <time.h>
 #include <stdarg.h>
+#include <signal.h>
 #include <sys/time.h>
 #include <sys/mman.h>
 
@@ -33,6 +34,8 @@
 
 #define MIN(a,b) (((a) < (b)) ? (a) : (b))
 
+static int __tapdisk_logfile_flush(td_logfile_t *);
+
 static inline size_t
 page_align(size_t size)
 {
@@ -134,10 +137,169 @@ tapdisk_logfile_rename(td_logfile_t *log,
 	return __tapdisk_logfile_rename(log, newpath);
 }
 
+/* hands the current half to the writer, with log->lock held */
+static void
+__tapdisk_logfile_handoff(td_logfile_t *log)
+{
+	int b = log->cur;
+	size_t n;
+
+	if (!log->len[b] || log->busy >= 0)
+		return;
+
+	if (!log->running) {
+		n = fwrite(log->half[b], log->len[b], 1, log->file);
+		if (n != 1)
+			log->error = -EIO;
+		log->len[b] = 0;
+		return;
+	}
+
+	log->busy = b;
+	log->cur  = !b;
+
+	pthread_cond_signal(&log->cond);
+}
+
+/* with log->lock held */
+static int
+__tapdisk_logfile_append(td_logfile_t *log, const char *buf, size_t len)
+{
+	size_t size = log->vbufsz / 2;
+	int b;
+
+	if (len > size)
+		return -EINVAL;
+
+	if (log->len[log->cur] + len > size)
+		__tapdisk_logfile_handoff(log);
+
+	b = log->cur;
+	if (log->len[b] + len > size) {
+		log->drops++;
+		log->dropped++;
+		return -ENOBUFS;
+	}
+
+	if (log->dropped && !log->len[b]) {
+		char note[64];
+		int n;
+
+		n = snprintf(note, sizeof(note),
+			     "%llu log entries dropped\n", log->dropped);
+		if (n + len <= size) {
+			memcpy(log->half[b], note, n);
+			log->len[b] = n;
+			log->dropped = 0;
+		}
+	}
+
+	memcpy(log->half[b] + log->len[b], buf, len);
+	log->len[b] += len;
+
+	if (log->mode == _IOLBF)
+		__tapdisk_logfile_handoff(log);
+
+	return 0;
+}
+
+static void *
+tapdisk_logfile_thread(void *arg)
+{
+	td_logfile_t *log = arg;
+	sigset_t set;
+	size_t n;
+	int b;
+
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	pthread_mutex_lock(&log->lock);
+
+	for (;;) {
+		while (log->busy < 0 && !log->stop)
+			pthread_cond_wait(&log->cond, &log->lock);
+
+		b = log->busy;
+		if (b < 0)
+			break;
+
+		pthread_mutex_unlock(&log->lock);
+
+		n = fwrite(log->half[b], log->len[b], 1, log->file);
+
+		pthread_mutex_lock(&log->lock);
+
+		if (n != 1)
+			log->error = -EIO;
+
+		log->len[b] = 0;
+		log->busy   = -1;
+
+		if (log->mode == _IOLBF)
+			__tapdisk_logfile_handoff(log);
+
+		pthread_cond_broadcast(&log->idle);
+	}
+
+	pthread_mutex_unlock(&log->lock);
+
+	return NULL;
+}
+
+static void
+tapdisk_logfile_stop(td_logfile_t *log)
+{
+	if (!log->running)
+		return;
+
+	pthread_mutex_lock(&log->lock);
+	log->stop = 1;
+	pthread_cond_signal(&log->cond);
+	pthread_mutex_unlock(&log->lock);
+
+	pthread_join(log->thread, NULL);
+	log->running = 0;
+}
+
+static int
+tapdisk_logfile_start(td_logfile_t *log)
+{
+	int err;
+
+	log->half[0] = log->vbuf;
+	log->half[1] = log->vbuf + log->vbufsz / 2;
+	log->busy    = -1;
+	log->mode    = _IOFBF;
+
+	pthread_mutex_init(&log->lock, NULL);
+	pthread_cond_init(&log->cond, NULL);
+	pthread_cond_init(&log->idle, NULL);
+
+	/* the writer thread does the buffering */
+	setvbuf(log->file, NULL, _IONBF, 0);
+
+	err = pthread_create(&log->thread, NULL, tapdisk_logfile_thread, log);
+	if (err)
+		return 0; /* writing synchronously */
+
+	log->running = 1;
+	return 0;
+}
+
 void
 tapdisk_logfile_close(td_logfile_t *log)
 {
 	if (log->file) {
+		tapdisk_logfile_flush(log);
+		tapdisk_logfile_stop(log);
+		if (log->half[0]) {
+			pthread_cond_destroy(&log->idle);
+			pthread_cond_destroy(&log->cond);
+			pthread_mutex_destroy(&log->lock);
+			log->half[0] = log->half[1] = NULL;
+		}
+
 		fclose(log->file);
 		log->file = NULL;
 	}
@@ -152,7 +314,7 @@ tapdisk_logfile_open(td_logfile_t *log,
 {
 	int err;
 
-	memset(log, 0, sizeof(log));
+	memset(log, 0, sizeof(*log));
 
 	tapdisk_logfile_name(log->path, sizeof(log->path), dir, ident, ext);
 
@@ -166,6 +328,10 @@ tapdisk_logfile_open(td_logfile_t *log,
 	if (err)
 		goto fail;
 
+	err = tapdisk_logfile_start(log);
+	if (err)
+		goto fail;
+
 	return 0;
 
 fail:
@@ -174,27 +340,30 @@ fail:
 	return err;
 }
 
+/* _IOLBF hands every line to the writer, _IONBF writes them out too */
 int
 tapdisk_logfile_setvbuf(td_logfile_t *log, int mode)
 {
-	int err = 0;
+	if (mode != _IOFBF && mode != _IOLBF && mode != _IONBF)
+		return -EINVAL;
 
 	if (log->file) {
-		err = setvbuf(log->file, log->vbuf, mode, log->vbufsz);
-		if (err)
-			err = -errno;
+		pthread_mutex_lock(&log->lock);
+		log->mode = mode;
+		pthread_mutex_unlock(&log->lock);
 	}
 
-	return err;
+	return 0;
 }
 
 ssize_t
 tapdisk_logfile_vprintf(td_logfile_t *log, const char *fmt, va_list ap)
 {
 	char buf[1024];
-	size_t size, n;
+	size_t size;
 	ssize_t len;
 	struct timeval tv;
+	int err;
 
 	if (!log->file)
 		return -EBADF;
@@ -210,14 +379,18 @@ tapdisk_logfile_vprintf(td_logfile_t *log, const char *fmt, va_list ap)
 	len += snprintf(buf + len, size - len, " ");
 	len += vsnprintf(buf + len, size - len, fmt, ap);
 
+	len = MIN(len, size - 1);
 	if (buf[len-1] != '\n')
 		len += snprintf(buf + len, size - len, "\n");
+	len = MIN(len, size - 1);
 
-	n = fwrite(buf, len, 1, log->file);
-	if (n != len)
-		len = -ferror(log->file);
+	pthread_mutex_lock(&log->lock);
+	err = __tapdisk_logfile_append(log, buf, len);
+	if (!err && log->mode == _IONBF)
+		err = __tapdisk_logfile_flush(log);
+	pthread_mutex_unlock(&log->lock);
 
-	return len;
+	return err ? : len;
 }
 
 ssize_t
@@ -233,13 +406,37 @@ tapdisk_logfile_printf(td_logfile_t *log, const char *fmt, ...)
 	return rv;
 }
 
+/* everything logged so far in the file, with log->lock held */
+static int
+__tapdisk_logfile_flush(td_logfile_t *log)
+{
+	int err;
+
+	while (log->busy >= 0)
+		pthread_cond_wait(&log->idle, &log->lock);
+
+	__tapdisk_logfile_handoff(log);
+
+	while (log->busy >= 0)
+		pthread_cond_wait(&log->idle, &log->lock);
+
+	err = log->error;
+	log->error = 0;
+
+	return err;
+}
+
 int
 tapdisk_logfile_flush(td_logfile_t *log)
 {
-	int rv = EOF;
+	int rv;
+
+	if (!log->file || !log->half[0])
+		return EOF;
 
-	if (log->file)
-		rv = fflush(log->file);
+	pthread_mutex_lock(&log->lock);
+	rv = __tapdisk_logfile_flush(log) ? EOF : 0;
+	pthread_mutex_unlock(&log->lock);
 
 	return rv;
 }
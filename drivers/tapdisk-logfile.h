@@ -19,16 +19,40 @@
 #define __TAPDISK_LOGFILE_H__
 
 #include <stdio.h>
+#include <pthread.h>
 
 typedef struct _td_logfile td_logfile_t;
 
 #define TD_LOGFILE_PATH_MAX    128UL
 
+/*
+ * The buffer is split in two. Entries go to one half while a writer
+ * thread writes out the other, handed to it once the first fills up,
+ * or with every line in line buffered mode. An entry finding both
+ * halves taken is dropped, and the drops noted in the next half.
+ */
 struct _td_logfile {
 	char           path[TD_LOGFILE_PATH_MAX];
 	FILE          *file;
 	char          *vbuf;
 	size_t         vbufsz;
+
+	int            mode;
+	char          *half[2];
+	size_t         len[2];
+	int            cur;       /* taking entries */
+	int            busy;      /* being written, or -1 */
+	int            error;
+
+	unsigned long long drops;
+	unsigned long long dropped; /* since the last note */
+
+	pthread_mutex_t lock;
+	pthread_cond_t  cond;     /* for the writer */
+	pthread_cond_t  idle;     /* for flushes */
+	pthread_t       thread;
+	int             running;
+	int             stop;
 };
 
 int tapdisk_logfile_open(td_logfile_t *,
@@ -0,0 +1,280 @@
+/*
+ * Copyright (C) Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2.1 only
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "tapdisk-metrics.h"
+#include "tapdisk-vbd.h"
+#include "tapdisk-image.h"
+#include "tapdisk-driver.h"
+#include "tapdisk-disktype.h"
+#include "tapdisk-log.h"
+
+#define MIN(a, b)                  ((a) < (b) ? (a) : (b))
+
+#define shm_set(_dst, _val)	\
+	__atomic_store_n(&(_dst), (_val), __ATOMIC_RELAXED)
+
+static struct {
+	char                      *path;
+	struct td_shmstats_page   *page;
+} td_metrics;
+
+int
+tapdisk_metrics_open(void)
+{
+	struct td_shmstats_page *page;
+	int fd = -1, err;
+
+	if (asprintf(&td_metrics.path, TD_SHMSTATS_PATH, getpid()) < 0) {
+		td_metrics.path = NULL;
+		return -ENOMEM;
+	}
+
+	fd = open(td_metrics.path, O_RDWR|O_CREAT|O_TRUNC, 0644);
+	if (fd < 0) {
+		err = -errno;
+		goto fail;
+	}
+
+	if (ftruncate(fd, sizeof(*page))) {
+		err = -errno;
+		goto fail;
+	}
+
+	page = mmap(NULL, sizeof(*page), PROT_READ|PROT_WRITE,
+		    MAP_SHARED, fd, 0);
+	if (page == MAP_FAILED) {
+		err = -errno;
+		goto fail;
+	}
+
+	close(fd);
+
+	page->version = TD_SHMSTATS_VERSION;
+	page->size    = sizeof(*page);
+	page->pid     = getpid();
+	page->n_vbds  = TD_SHMSTATS_VBDS;
+	__atomic_store_n(&page->magic, TD_SHMSTATS_MAGIC, __ATOMIC_RELEASE);
+
+	td_metrics.page = page;
+
+	return 0;
+
+fail:
+	EPRINTF("stats page %s: %d\n", td_metrics.path, err);
+	if (fd >= 0) {
+		close(fd);
+		unlink(td_metrics.path);
+	}
+	free(td_metrics.path);
+	td_metrics.path = NULL;
+	return err;
+}
+
+void
+tapdisk_metrics_close(void)
+{
+	if (td_metrics.page) {
+		munmap(td_metrics.page, sizeof(*td_metrics.page));
+		td_metrics.page = NULL;
+	}
+
+	if (td_metrics.path) {
+		unlink(td_metrics.path);
+		free(td_metrics.path);
+		td_metrics.path = NULL;
+	}
+}
+
+/* VBDs come and go on any loop */
+void
+tapdisk_metrics_attach(td_vbd_t *vbd)
+{
+	struct td_shmstats_vbd *m;
+	uint32_t free;
+	int i;
+
+	if (!td_metrics.page || vbd->shmstats)
+		return;
+
+	for (i = 0; i < TD_SHMSTATS_VBDS; i++) {
+		m    = &td_metrics.page->vbd[i];
+		free = 0;
+
+		if (__atomic_compare_exchange_n(&m->used, &free, 1, 0,
+						__ATOMIC_ACQ_REL,
+						__ATOMIC_RELAXED)) {
+			vbd->shmstats = m;
+			timerclear(&vbd->shmstats_ts);
+			return;
+		}
+	}
+
+	DPRINTF("no stats slot for vbd %u\n", vbd->uuid);
+}
+
+void
+tapdisk_metrics_detach(td_vbd_t *vbd)
+{
+	struct td_shmstats_vbd *m = vbd->shmstats;
+	uint32_t seq;
+
+	if (!m)
+		return;
+
+	seq = m->seq;
+	__atomic_store_n(&m->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	memset((char *)m + offsetof(struct td_shmstats_vbd, updated), 0,
+	       sizeof(*m) - offsetof(struct td_shmstats_vbd, updated));
+
+	__atomic_store_n(&m->seq, seq + 2, __ATOMIC_RELEASE);
+	__atomic_store_n(&m->used, 0, __ATOMIC_RELEASE);
+
+	vbd->shmstats = NULL;
+}
+
+const struct td_shmstats_vbd *
+tapdisk_metrics_slot(int i)
+{
+	if (!td_metrics.page || i < 0 || i >= TD_SHMSTATS_VBDS)
+		return NULL;
+
+	return &td_metrics.page->vbd[i];
+}
+
+/* counts and worst case, over all request sizes */
+static void
+tapdisk_metrics_latency(const struct td_latency *lat,
+			uint64_t *count, uint64_t *max)
+{
+	int op, s;
+
+	for (op = 0; op < 2; op++) {
+		uint64_t c = 0, m = 0;
+
+		for (s = 0; s < TD_LAT_SIZES; s++) {
+			c += lat->hist[op][s].count;
+			if (lat->hist[op][s].max > m)
+				m = lat->hist[op][s].max;
+		}
+
+		shm_set(count[op], c);
+		shm_set(max[op], m);
+	}
+}
+
+static void
+tapdisk_metrics_name(char *dst, const char *src, size_t size)
+{
+	size_t n = src ? MIN(strlen(src), size - 1) : 0;
+
+	/* the tail of a path tells more */
+	if (src && strlen(src) > n)
+		src += strlen(src) - n;
+
+	if (n)
+		memcpy(dst, src, n);
+	memset(dst + n, 0, size - n);
+}
+
+static void
+tapdisk_metrics_image(struct td_shmstats_image *m, td_image_t *image)
+{
+	const disk_info_t *info = tapdisk_disk_types[image->type];
+	int op;
+
+	tapdisk_metrics_name(m->name, image->name, sizeof(m->name));
+	tapdisk_metrics_name(m->driver, info ? info->name : NULL,
+			     sizeof(m->driver));
+
+	for (op = 0; op < 2; op++) {
+		shm_set(m->hits[op], op ? image->stats.hits.wr
+				   : image->stats.hits.rd);
+		shm_set(m->fail[op], op ? image->stats.fail.wr
+				   : image->stats.fail.rd);
+	}
+
+	tapdisk_metrics_latency(&image->latency, m->lat_count, m->lat_max);
+}
+
+int
+tapdisk_metrics_update(td_vbd_t *vbd, const struct timeval *now)
+{
+	struct td_shmstats_vbd *m = vbd->shmstats;
+	td_image_t *image, *next;
+	struct timeval delta;
+	uint32_t seq, n = 0;
+
+	if (!m)
+		return 0;
+
+	timersub(now, &vbd->shmstats_ts, &delta);
+	if (timerisset(&vbd->shmstats_ts) &&
+	    delta.tv_sec == 0 && delta.tv_usec < TD_SHMSTATS_INTERVAL * 1000)
+		return 1;
+
+	vbd->shmstats_ts = *now;
+
+	seq = m->seq;
+	__atomic_store_n(&m->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	shm_set(m->updated, (uint64_t)now->tv_sec * 1000000 + now->tv_usec);
+	tapdisk_metrics_name(m->name, vbd->name, sizeof(m->name));
+	shm_set(m->minor, vbd->uuid);
+	shm_set(m->state, vbd->state);
+
+	shm_set(m->received, vbd->received);
+	shm_set(m->returned, vbd->returned);
+	shm_set(m->errors, vbd->errors);
+	shm_set(m->retries, vbd->retries);
+	shm_set(m->secs[0], vbd->secs.rd);
+	shm_set(m->secs[1], vbd->secs.wr);
+	shm_set(m->secs_pending, vbd->secs_pending);
+	shm_set(m->zero_secs, vbd->zero_secs);
+	shm_set(m->flushes, vbd->flushes);
+	shm_set(m->held, vbd->held);
+	shm_set(m->expired, vbd->expired);
+	shm_set(m->inflight[0], vbd->inflight[TD_OP_READ]);
+	shm_set(m->inflight[1], vbd->inflight[TD_OP_WRITE]);
+	tapdisk_metrics_latency(&vbd->latency, m->lat_count, m->lat_max);
+
+	tapdisk_vbd_for_each_image(vbd, image, next) {
+		if (n == TD_SHMSTATS_IMAGES)
+			break;
+		tapdisk_metrics_image(&m->images[n++], image);
+	}
+	shm_set(m->n_images, n);
+
+	__atomic_store_n(&m->seq, seq + 2, __ATOMIC_RELEASE);
+
+	return 0;
+}
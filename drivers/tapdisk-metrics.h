@@ -0,0 +1,39 @@
+/*
+ * Copyright (C) Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2.1 only
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef _TAPDISK_METRICS_H_
+#define _TAPDISK_METRICS_H_
+
+#include <sys/time.h>
+
+#include "tapdisk.h"
+#include "tapdisk-shmstats.h"
+
+/* the stats page, see tapdisk-shmstats.h; optional, all are no-ops without */
+int tapdisk_metrics_open(void);
+void tapdisk_metrics_close(void);
+
+void tapdisk_metrics_attach(td_vbd_t *);
+void tapdisk_metrics_detach(td_vbd_t *);
+
+/* from the VBD's loop, at most every TD_SHMSTATS_INTERVAL: 1 if skipped */
+int tapdisk_metrics_update(td_vbd_t *, const struct timeval *now);
+
+/* slot @i, for td_shmstats_read(); NULL without the page */
+const struct td_shmstats_vbd *tapdisk_metrics_slot(int i);
+
+#endif
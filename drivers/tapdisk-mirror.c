@@ -0,0 +1,451 @@
+/*
+ * Copyright (C) Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2.1 only
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "list.h"
+#include "tapdisk-mirror.h"
+#include "tapdisk-vbd.h"
+#include "tapdisk-image.h"
+#include "tapdisk-server.h"
+#include "tapdisk-interface.h"
+#include "tapdisk-stats.h"
+#include "tapdisk-log.h"
+
+#define MIN(a, b)                        ((a) < (b) ? (a) : (b))
+
+static inline int
+td_mirror_test(struct td_mirror *m, uint64_t e)
+{
+	return !!(m->map[e >> 6] & (1ULL << (e & 63)));
+}
+
+static inline void
+td_mirror_set(struct td_mirror *m, uint64_t e)
+{
+	m->map[e >> 6] |= 1ULL << (e & 63);
+}
+
+static inline void
+td_mirror_clear(struct td_mirror *m, uint64_t e)
+{
+	m->map[e >> 6] &= ~(1ULL << (e & 63));
+}
+
+/* the run copying @e, if any */
+static struct td_mirror_batch *
+td_mirror_copying(struct td_mirror *m, uint64_t e)
+{
+	struct td_mirror_batch *b;
+	int i;
+
+	for (i = 0; i < TD_MIRROR_BATCHES; i++) {
+		b = &m->batches[i];
+		if (b->busy && e >= b->first && e < b->first + b->count)
+			return b;
+	}
+
+	return NULL;
+}
+
+/* the first dirty extent from @e on not being copied, or m->extents */
+static uint64_t
+td_mirror_next(struct td_mirror *m, uint64_t e)
+{
+	struct td_mirror_batch *b;
+	uint64_t word;
+
+	while (e < m->extents) {
+		word = m->map[e >> 6] >> (e & 63);
+		if (!word) {
+			e = (e | 63) + 1;
+			continue;
+		}
+
+		e += __builtin_ctzll(word);
+		if (e >= m->extents)
+			break;
+
+		b = td_mirror_copying(m, e);
+		if (!b)
+			return e;
+
+		e = b->first + b->count;
+	}
+
+	return m->extents;
+}
+
+static void td_mirror_read_done(td_vbd_request_t *, int, void *, int);
+
+static int
+td_mirror_start(struct td_mirror *m, struct td_mirror_batch *b)
+{
+	td_vbd_request_t *vreq = &b->vreq;
+	uint64_t e, n, sec, size;
+
+	if (m->bulk < m->extents && m->dirty < TD_MIRROR_LAG / 2) {
+		e = m->bulk;
+		n = MIN(TD_MIRROR_RUN, m->extents - e);
+		m->bulk += n;
+		goto start;
+	}
+
+	e = td_mirror_next(m, m->cursor);
+	if (e == m->extents) {
+		m->cursor = 0;
+		e = td_mirror_next(m, 0);
+		if (e == m->extents)
+			return 0;
+		if (m->bulk == m->extents)
+			m->rounds++;
+	}
+
+	for (n = 0; n < TD_MIRROR_RUN && e + n < m->extents; n++) {
+		if (!td_mirror_test(m, e + n) || td_mirror_copying(m, e + n))
+			break;
+		td_mirror_clear(m, e + n);
+	}
+
+	m->dirty  -= n;
+	m->cursor  = e + n;
+
+start:
+	size = m->image->info.size;
+	sec  = e << TD_MIRROR_SHIFT;
+
+	b->first   = e;
+	b->count   = n;
+	b->busy    = 1;
+	b->error   = 0;
+	b->pending = 0;
+	m->inflight++;
+
+	memset(vreq, 0, sizeof(*vreq));
+	b->iov.base    = b->buf;
+	b->iov.secs    = MIN(n << TD_MIRROR_SHIFT, size - sec);
+	m->budget     -= b->iov.secs << SECTOR_SHIFT;
+	vreq->op       = TD_OP_READ;
+	vreq->sec      = sec;
+	vreq->iov      = &b->iov;
+	vreq->iovcnt   = 1;
+	vreq->cb       = td_mirror_read_done;
+	vreq->token    = m;
+	vreq->name     = "mirror";
+
+	tapdisk_vbd_queue_request(m->vbd, vreq);
+
+	return 1;
+}
+
+static void
+td_mirror_done(struct td_mirror *m, struct td_mirror_batch *b, int err)
+{
+	b->busy = 0;
+	m->inflight--;
+
+	if (err) {
+		if (m->error)
+			return;
+
+		EPRINTF("%s: mirror to %s failed at 0x%08"PRIx64": %d, "
+			"%"PRIu64" extents behind\n", m->vbd->name,
+			m->image ? m->image->name : "(none)",
+			b->vreq.sec, err, m->dirty + b->count);
+
+		m->error = err;
+		m->dirty = 0;
+		m->failed(m, err);
+		return;
+	}
+
+	m->copies++;
+	m->copied += b->iov.secs;
+
+	td_mirror_kick(m, 0);
+}
+
+static void
+td_mirror_write_done(td_request_t treq, int err)
+{
+	struct td_mirror_batch *b = treq.cb_data;
+
+	b->pending -= treq.secs;
+	b->error    = (b->error ? : err);
+
+	if (b->pending)
+		return;
+
+	b->mirror->writing--;
+	td_mirror_done(b->mirror, b, b->error);
+}
+
+static void
+td_mirror_read_done(td_vbd_request_t *vreq, int error,
+		    void *token, int final)
+{
+	struct td_mirror_batch *b;
+	struct td_mirror *m;
+	td_request_t treq;
+
+	b = containerof(vreq, struct td_mirror_batch, vreq);
+	m = token;
+
+	if (error || m->error || !m->image) {
+		td_mirror_done(m, b, error ? : m->error ? : -ESHUTDOWN);
+		return;
+	}
+
+	memset(&treq, 0, sizeof(treq));
+	treq.op      = TD_OP_WRITE;
+	treq.buf     = b->buf;
+	treq.sec     = vreq->sec;
+	treq.secs    = b->iov.secs;
+	treq.image   = m->image;
+	treq.cb      = td_mirror_write_done;
+	treq.cb_data = b;
+	treq.vreq    = vreq;
+
+	b->pending   = treq.secs;
+	m->writing++;
+	td_queue_write(m->image, treq);
+}
+
+static inline int
+td_mirror_todo(struct td_mirror *m, int all)
+{
+	if (m->bulk < m->extents)
+		return 1;
+
+	return m->dirty && (all || m->dirty >= TD_MIRROR_RUN);
+}
+
+/*
+ * starts copies while batches are free: full runs only, unless @all.
+ * Nothing starts while the queue is held, a pause keeps the map.
+ */
+void
+td_mirror_kick(struct td_mirror *m, int all)
+{
+	td_flag_t state = m->vbd->state;
+	int i;
+
+	if (m->error || !m->image)
+		return;
+
+	all |= m->drain;
+
+	if (td_flag_test(state, TD_VBD_DEAD) ||
+	    td_flag_test(state, TD_VBD_CLOSED) ||
+	    td_flag_test(state, TD_VBD_QUIESCED) ||
+	    td_flag_test(state, TD_VBD_QUIESCE_REQUESTED))
+		return;
+
+	for (i = 0; i < TD_MIRROR_BATCHES; i++) {
+		if (!td_mirror_todo(m, all))
+			break;
+
+		if (m->rate && m->budget <= 0 && !m->drain)
+			break;
+
+		if (m->batches[i].busy)
+			continue;
+
+		if (!td_mirror_start(m, &m->batches[i]))
+			break;
+	}
+}
+
+void
+td_mirror_dirty(struct td_mirror *m, td_sector_t sec, uint64_t secs)
+{
+	uint64_t e, last;
+
+	if (m->error || !secs)
+		return;
+
+	last = (sec + secs - 1) >> TD_MIRROR_SHIFT;
+
+	/* the bulk copy has yet to read what lies past it */
+	for (e = sec >> TD_MIRROR_SHIFT; e <= last && e < m->bulk; e++)
+		if (!td_mirror_test(m, e)) {
+			td_mirror_set(m, e);
+			m->dirty++;
+			m->marked++;
+		}
+
+	td_mirror_kick(m, 0);
+}
+
+static void
+td_mirror_timeout(event_id_t id, char mode, void *private)
+{
+	struct td_mirror *m = private;
+
+	if (m->rate)
+		m->budget = m->rate * TD_MIRROR_INTERVAL;
+
+	td_mirror_kick(m, 1);
+}
+
+/*
+ * a stopped mirror restarts clean on the next secondary, which is
+ * taken to match the primary, as in synchronous mode
+ */
+void
+td_mirror_attach(struct td_mirror *m, td_image_t *image)
+{
+	if (image && m->error) {
+		memset(m->map, 0, ((m->extents + 63) / 64) * sizeof(uint64_t));
+		m->dirty  = 0;
+		m->cursor = 0;
+		m->error  = 0;
+	}
+
+	m->image = image;
+}
+
+/* copies all of the disk, then what is written meanwhile */
+void
+td_mirror_bulk(struct td_mirror *m, uint64_t rate)
+{
+	m->bulk   = 0;
+	m->rounds = 0;
+	m->rate   = rate;
+	m->budget = rate * TD_MIRROR_INTERVAL;
+
+	td_mirror_kick(m, 0);
+}
+
+void
+td_mirror_stop(struct td_mirror *m)
+{
+	if (m->dirty)
+		EPRINTF("%s: mirror stopped, %"PRIu64" extents behind\n",
+			m->vbd->name, m->dirty);
+
+	m->error = (m->error ? : -ESHUTDOWN);
+	m->dirty = 0;
+	m->image = NULL;
+}
+
+struct td_mirror *
+td_mirror_create(td_vbd_t *vbd, td_image_t *image,
+		 void (*failed)(struct td_mirror *, int), int *_err)
+{
+	struct td_mirror *m;
+	int i, err;
+
+	m = calloc(1, sizeof(*m));
+	if (!m) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	m->vbd     = vbd;
+	m->image   = image;
+	m->failed  = failed;
+	m->timer   = -1;
+	m->extents = (image->info.size + TD_MIRROR_SECS - 1) >> TD_MIRROR_SHIFT;
+	m->bulk    = m->extents;
+
+	m->map = calloc((m->extents + 63) / 64, sizeof(uint64_t));
+	if (!m->map) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	for (i = 0; i < TD_MIRROR_BATCHES; i++) {
+		struct td_mirror_batch *b = &m->batches[i];
+
+		err = posix_memalign((void **)&b->buf, 4096,
+				     (TD_MIRROR_RUN << TD_MIRROR_SHIFT) <<
+				     SECTOR_SHIFT);
+		if (err) {
+			b->buf = NULL;
+			err    = -err;
+			goto fail;
+		}
+
+		b->mirror = m;
+	}
+
+	m->timer = tapdisk_server_register_event(SCHEDULER_POLL_TIMEOUT,
+						 -1, TD_MIRROR_INTERVAL,
+						 td_mirror_timeout, m);
+	if (m->timer < 0) {
+		err = m->timer;
+		goto fail;
+	}
+
+	DPRINTF("%s: mirroring to %s asynchronously, "
+		"%"PRIu64" extents\n", vbd->name, image->name, m->extents);
+
+	return m;
+
+fail:
+	td_mirror_free(m);
+	*_err = err;
+	return NULL;
+}
+
+void
+td_mirror_free(struct td_mirror *m)
+{
+	int i;
+
+	if (!m)
+		return;
+
+	if (m->dirty && !m->error)
+		EPRINTF("%s: dropping mirror, %"PRIu64" extents behind\n",
+			m->vbd->name, m->dirty);
+
+	if (m->timer >= 0)
+		tapdisk_server_unregister_event(m->timer);
+
+	for (i = 0; i < TD_MIRROR_BATCHES; i++)
+		free(m->batches[i].buf);
+
+	free(m->map);
+	free(m);
+}
+
+void
+td_mirror_stats(struct td_mirror *m, td_stats_t *st)
+{
+	tapdisk_stats_field(st, "error", "d", m->error);
+	tapdisk_stats_field(st, "dirty", "llu", m->dirty);
+	tapdisk_stats_field(st, "lag", "llu",
+			    (m->dirty << TD_MIRROR_SHIFT) << SECTOR_SHIFT);
+	tapdisk_stats_field(st, "inflight", "d", m->inflight);
+	tapdisk_stats_field(st, "writing", "d", m->writing);
+	tapdisk_stats_field(st, "marked", "llu", m->marked);
+	tapdisk_stats_field(st, "copies", "llu", m->copies);
+	tapdisk_stats_field(st, "copied", "llu", m->copied);
+	tapdisk_stats_field(st, "held", "llu", m->held);
+	tapdisk_stats_field(st, "bulk_left", "llu", m->extents - m->bulk);
+	tapdisk_stats_field(st, "rounds", "llu", m->rounds);
+	tapdisk_stats_field(st, "rate", "llu", m->rate);
+	tapdisk_stats_field(st, "drain", "d", m->drain);
+}
@@ -0,0 +1,124 @@
+/*
+ * Copyright (C) Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2.1 only
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef _TAPDISK_MIRROR_H_
+#define _TAPDISK_MIRROR_H_
+
+#include <stdint.h>
+
+#include "tapdisk.h"
+#include "scheduler.h"
+
+/*
+ * Asynchronous mirror.
+ *
+ * Writes complete on the primary alone. The extents they covered are
+ * marked dirty and copied to the secondary behind them, read back
+ * through the vbd in runs of up to TD_MIRROR_RUN extents, in
+ * ascending sweeps, so that scattered writes go out as few large
+ * ones. Up to TD_MIRROR_BATCHES runs are in flight, none overlapping
+ * another; an extent written again meanwhile is copied again.
+ *
+ * The vbd holds new writes while TD_MIRROR_LAG extents are dirty. A
+ * pause keeps the map and copies go on with the queue, a close waits
+ * for them. A failed copy stops the mirror and calls 'failed' back.
+ *
+ * A migration starts it with a bulk copy: extents from 'bulk' on are
+ * still to be copied in order, ahead of dirty ones until half the lag
+ * is dirty, and do not count against it. Copies may be limited to 'rate'
+ * bytes per TD_MIRROR_INTERVAL. Each sweep over the dirty map once the
+ * bulk copy is done counts a round. In 'drain' mode the vbd holds all
+ * writes until the mirror goes idle, copies ignoring the rate.
+ */
+
+#define TD_MIRROR_SHIFT      7          /* 64K extents */
+#define TD_MIRROR_SECS       (1ULL << TD_MIRROR_SHIFT)
+#define TD_MIRROR_RUN        16         /* extents per copy, 1M */
+#define TD_MIRROR_BATCHES    4
+#define TD_MIRROR_LAG        4096       /* 256M dirty, at most */
+#define TD_MIRROR_INTERVAL   1          /* s, to copy a partial run */
+
+struct td_mirror;
+
+struct td_mirror_batch {
+	td_vbd_request_t             vreq;
+	struct td_iovec              iov;
+	char                        *buf;
+	struct td_mirror            *mirror;
+
+	uint64_t                     first;     /* extents */
+	uint64_t                     count;
+	int                          busy;
+	int                          pending;   /* secs, on the secondary */
+	int                          error;
+};
+
+struct td_mirror {
+	td_vbd_t                    *vbd;
+	td_image_t                  *image;
+	int                          error;
+
+	uint64_t                     extents;
+	uint64_t                    *map;
+	uint64_t                     dirty;
+	uint64_t                     cursor;
+	uint64_t                     bulk;      /* extents copied in bulk */
+	uint64_t                     rounds;
+
+	uint64_t                     rate;      /* bytes/s, 0 for no limit */
+	int64_t                      budget;
+	int                          drain;
+
+	struct td_mirror_batch       batches[TD_MIRROR_BATCHES];
+	int                          inflight;
+	int                          writing;   /* to the secondary */
+
+	event_id_t                   timer;
+	void                       (*failed)(struct td_mirror *, int error);
+
+	uint64_t                     marked;    /* extents */
+	uint64_t                     copies;
+	uint64_t                     copied;    /* secs */
+	uint64_t                     held;
+};
+
+struct td_mirror *td_mirror_create(td_vbd_t *, td_image_t *,
+				   void (*failed)(struct td_mirror *, int),
+				   int *err);
+void td_mirror_attach(struct td_mirror *, td_image_t *);
+void td_mirror_bulk(struct td_mirror *, uint64_t rate);
+void td_mirror_stop(struct td_mirror *);
+void td_mirror_free(struct td_mirror *);
+void td_mirror_dirty(struct td_mirror *, td_sector_t, uint64_t secs);
+void td_mirror_kick(struct td_mirror *, int all);
+void td_mirror_stats(struct td_mirror *, td_stats_t *);
+
+/* writes wait for the secondary to catch up */
+static inline int
+td_mirror_full(struct td_mirror *m)
+{
+	return !m->error && (m->drain || m->dirty >= TD_MIRROR_LAG);
+}
+
+static inline int
+td_mirror_busy(struct td_mirror *m)
+{
+	return m->inflight ||
+		(!m->error && (m->dirty || m->bulk < m->extents));
+}
+
+#endif
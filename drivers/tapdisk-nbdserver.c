@@ -22,11 +22,14 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <sys/wait.h>
 #include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "tapdisk.h"
 #include "tapdisk-server.h"
@@ -42,8 +45,44 @@
 #include "config.h"
 #endif
 
+#define MIN(a, b)           ((a) < (b) ? (a) : (b))
+
+#define NBD_SERVER_MIN_REQS 32
 #define NBD_SERVER_NUM_REQS TAPDISK_DATA_REQUESTS
 
+/*
+ * Flushes go through the vbd, which commits every write completed
+ * before them, whichever connection it came in on. FUA writes are
+ * followed by one. Zeroes are written from a shared buffer, in
+ * segments of NBD_SERVER_ZERO_SECS, unless no image holds data there.
+ */
+#define NBD_SERVER_FLAGS    (NBD_FLAG_HAS_FLAGS | NBD_FLAG_SEND_FLUSH | \
+			     NBD_FLAG_SEND_FUA | NBD_FLAG_SEND_WRITE_ZEROES | \
+			     NBD_FLAG_CAN_MULTI_CONN)
+#define NBD_SERVER_ZERO_SECS 2048
+
+/*
+ * Payloads go between the socket and the backend in the request's own
+ * buffer, page aligned for O_DIRECT. It stays with the request for the
+ * next one, unless larger than NBD_SERVER_BUF_KEEP.
+ */
+#define NBD_SERVER_BUF_ALIGN 4096
+#define NBD_SERVER_BUF_KEEP  (1 << 20)
+
+/*
+ * Clients which negotiated structured replies get holes, found in
+ * steps of NBD_SERVER_HOLE_SECS, as hole chunks. Block status walks at
+ * most NBD_SERVER_STATUS_SECS at a time.
+ */
+#define NBD_SERVER_HOLE_SECS     128
+#define NBD_SERVER_STATUS_SECS   (1 << 21)
+#define NBD_SERVER_OPTION_MAX    4096
+#define NBD_SERVER_CONTEXT_ALLOC 1
+
+/* negotiating: newstyle clients, up to the transmission phase */
+#define NBD_SERVER_NEGOTIATE_FLAGS   1
+#define NBD_SERVER_NEGOTIATE_OPTIONS 2
+
 #define TAPDISK_NBDSERVER_LISTEN_SOCK_PATH "/var/run/blktap-control/nbdserver"
 #define TAPDISK_NBDSERVER_MAX_PATH_LEN 256
 
@@ -58,24 +97,63 @@ struct td_nbdserver_req {
 	td_vbd_request_t        vreq;
 	char                    id[16];
 	struct td_iovec         iov;
+	struct td_iovec        *iovs;
+	uint32_t                flags;
+
+	void                   *buf;
+	size_t                  buf_size;
+};
+
+struct td_nbdserver_pool {
+	struct list_head        entry;
+	int                     n_reqs;
+	td_nbdserver_req_t      reqs[0];
 };
 
 static void tapdisk_nbdserver_disable_client(td_nbdserver_client_t *client);
+static int tapdisk_nbdserver_enable_client(td_nbdserver_client_t *client);
+static int tapdisk_nbdserver_reqs_grow(td_nbdserver_client_t *client,
+				       int n_reqs);
+static void tapdisk_nbdserver_reqs_free(td_nbdserver_client_t *client);
 static void tapdisk_nbdserver_clientcb(event_id_t id, char mode, void *data);
 int tapdisk_nbdserver_setup_listening_socket(td_nbdserver_t *server);
 int tapdisk_nbdserver_unpause(td_nbdserver_t *server);
 
+static void
+tapdisk_nbdserver_release_client(td_nbdserver_client_t *client)
+{
+	tapdisk_nbdserver_reqs_free(client);
+
+	if (client->shm)
+		munmap(client->shm, client->shm_size);
+
+	free(client);
+}
+
 static td_nbdserver_req_t *
 tapdisk_nbdserver_alloc_request(td_nbdserver_client_t *client)
 {
 	td_nbdserver_req_t *req = NULL;
 
+	if (unlikely(!client->n_reqs_free) &&
+	    client->n_reqs < NBD_SERVER_NUM_REQS)
+		tapdisk_nbdserver_reqs_grow(client,
+					    MIN(client->n_reqs,
+						NBD_SERVER_NUM_REQS -
+						client->n_reqs));
+
 	if (likely(client->n_reqs_free))
 		req = client->reqs_free[--client->n_reqs_free];
 
 	return req;
 }
 
+static inline int
+tapdisk_nbdserver_reqs_pending(td_nbdserver_client_t *client)
+{
+	return client->n_reqs - client->n_reqs_free;
+}
+
 static void
 tapdisk_nbdserver_free_request(td_nbdserver_client_t *client,
 		td_nbdserver_req_t *req)
@@ -86,64 +164,104 @@ tapdisk_nbdserver_free_request(td_nbdserver_client_t *client,
 		return;
 	}
 	client->reqs_free[client->n_reqs_free++] = req;
+
+	if (client->dead) {
+		if (!tapdisk_nbdserver_reqs_pending(client))
+			tapdisk_nbdserver_release_client(client);
+		return;
+	}
+
+	if (client->throttled && !client->paused) {
+		client->throttled = 0;
+		tapdisk_nbdserver_enable_client(client);
+	}
+}
+
+static void *
+tapdisk_nbdserver_get_buf(td_nbdserver_req_t *req, size_t size)
+{
+	if (req->buf_size < size) {
+		free(req->buf);
+		req->buf_size = 0;
+
+		if (posix_memalign(&req->buf, NBD_SERVER_BUF_ALIGN, size)) {
+			req->buf = NULL;
+			return NULL;
+		}
+
+		req->buf_size = size;
+	}
+
+	return req->buf;
 }
 
 static void
-tapdisk_nbdserver_reqs_free(td_nbdserver_client_t *client)
+tapdisk_nbdserver_put_buf(td_nbdserver_req_t *req)
 {
-	if (client->reqs) {
-		free(client->reqs);
-		client->reqs = NULL;
+	if (req->buf_size > NBD_SERVER_BUF_KEEP) {
+		free(req->buf);
+		req->buf      = NULL;
+		req->buf_size = 0;
 	}
 
-	if (client->iovecs) {
-		free(client->iovecs);
-		client->iovecs = NULL;
+	req->iov.base = NULL;
+	free(req->iovs);
+	req->iovs = NULL;
+}
+
+static void
+tapdisk_nbdserver_reqs_free(td_nbdserver_client_t *client)
+{
+	struct td_nbdserver_pool *pool, *next;
+	int i;
+
+	list_for_each_entry_safe(pool, next, &client->pools, entry) {
+		for (i = 0; i < pool->n_reqs; i++)
+			free(pool->reqs[i].buf);
+		list_del(&pool->entry);
+		free(pool);
 	}
 
 	if (client->reqs_free) {
 		free(client->reqs_free);
 		client->reqs_free = NULL;
 	}
+
+	client->n_reqs      = 0;
+	client->n_reqs_free = 0;
 }
 
+/* requests in flight stay where they are, a pool is never reallocated */
 static int
-tapdisk_nbdserver_reqs_init(td_nbdserver_client_t *client, int n_reqs)
+tapdisk_nbdserver_reqs_grow(td_nbdserver_client_t *client, int n_reqs)
 {
-	int i, err;
-
-	INFO("Reqs init");
-
-	client->reqs = malloc(n_reqs * sizeof(td_nbdserver_req_t));
-	if (!client->reqs) {
-		err = -errno;
-		goto fail;
-	}
-	client->iovecs = malloc(n_reqs * sizeof(struct td_iovec));
-	if (!client->iovecs) {
-		err = - errno;
-		goto fail;
-	}
-
-	client->reqs_free = malloc(n_reqs * sizeof(td_nbdserver_req_t*));
-	if (!client->reqs_free) {
-		err = -errno;
-		goto fail;
+	struct td_nbdserver_pool *pool;
+	td_nbdserver_req_t **reqs_free;
+	int i;
+
+	pool = malloc(sizeof(*pool) + n_reqs * sizeof(td_nbdserver_req_t));
+	if (!pool)
+		return -errno;
+
+	reqs_free = realloc(client->reqs_free, (client->n_reqs + n_reqs) *
+			    sizeof(td_nbdserver_req_t *));
+	if (!reqs_free) {
+		free(pool);
+		return -errno;
 	}
 
-	client->n_reqs      = n_reqs;
-	client->n_reqs_free = 0;
+	pool->n_reqs       = n_reqs;
+	client->reqs_free  = reqs_free;
+	client->n_reqs    += n_reqs;
+	list_add_tail(&pool->entry, &client->pools);
 
 	for (i = 0; i < n_reqs; i++) {
-		client->reqs[i].vreq.iov = &client->iovecs[i];
-		tapdisk_nbdserver_free_request(client, &client->reqs[i]);
+		pool->reqs[i].buf      = NULL;
+		pool->reqs[i].buf_size = 0;
+		client->reqs_free[client->n_reqs_free++] = &pool->reqs[i];
 	}
 
 	return 0;
-
-fail:
-	tapdisk_nbdserver_reqs_free(client);
-	return err;
 }
 
 static td_nbdserver_client_t *
@@ -162,8 +280,9 @@ tapdisk_nbdserver_alloc_client(td_nbdserver_t *server)
 	}
 
 	bzero(client, sizeof(td_nbdserver_client_t));
+	INIT_LIST_HEAD(&client->pools);
 
-	err = tapdisk_nbdserver_reqs_init(client, NBD_SERVER_NUM_REQS);
+	err = tapdisk_nbdserver_reqs_grow(client, NBD_SERVER_MIN_REQS);
 	if (err < 0) {
 		ERROR("Couldn't allocate client reqs: %d", err);
 		goto fail;
@@ -201,9 +320,26 @@ tapdisk_nbdserver_free_client(td_nbdserver_client_t *client)
 	if (client->client_event_id >= 0)
 		tapdisk_nbdserver_disable_client(client);
 
-	list_del(&client->clientlist);
-	tapdisk_nbdserver_reqs_free(client);
-	free(client);
+	list_del_init(&client->clientlist);
+
+	/* the last request to complete frees it */
+	if (tapdisk_nbdserver_reqs_pending(client)) {
+		client->dead = 1;
+		return;
+	}
+
+	tapdisk_nbdserver_release_client(client);
+}
+
+static void
+tapdisk_nbdserver_kill_client(td_nbdserver_client_t *client)
+{
+	if (client->client_fd >= 0) {
+		close(client->client_fd);
+		client->client_fd = -1;
+	}
+
+	tapdisk_nbdserver_free_client(client);
 }
 
 static int 
@@ -259,6 +395,686 @@ static void
 	return &(((struct sockaddr_in6*)ss)->sin6_addr);
 }
 
+static int
+tapdisk_nbdserver_recv(int fd, void *buf, size_t len)
+{
+	ssize_t n;
+	size_t done;
+
+	for (done = 0; done < len; done += n) {
+		n = recv(fd, (char *)buf + done, len - done, MSG_WAITALL);
+		if (n <= 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/* header and payload in one go, straight from the request buffers */
+static int
+tapdisk_nbdserver_sendv(int fd, struct iovec *iov, int cnt)
+{
+	struct msghdr msg;
+	ssize_t n;
+
+	memset(&msg, 0, sizeof(msg));
+
+	while (cnt) {
+		msg.msg_iov    = iov;
+		msg.msg_iovlen = cnt;
+
+		n = sendmsg(fd, &msg, 0);
+		if (n <= 0)
+			return -1;
+
+		while (cnt && n >= (ssize_t)iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			cnt--;
+		}
+
+		if (cnt) {
+			iov->iov_base  = (char *)iov->iov_base + n;
+			iov->iov_len  -= n;
+		}
+	}
+
+	return 0;
+}
+
+static int
+tapdisk_nbdserver_send(int fd, const void *buf, size_t len, int more)
+{
+	ssize_t n;
+	size_t done;
+
+	for (done = 0; done < len; done += n) {
+		n = send(fd, (const char *)buf + done, len - done,
+			 more ? MSG_MORE : 0);
+		if (n <= 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+static int
+tapdisk_nbdserver_is_local(int fd)
+{
+	struct sockaddr_storage ss;
+	socklen_t len = sizeof(ss);
+
+	if (getsockname(fd, (struct sockaddr *)&ss, &len))
+		return 0;
+
+	return ss.ss_family == AF_UNIX;
+}
+
+/* the request header, and the fd which came with it from a local client */
+static int
+tapdisk_nbdserver_recv_request(td_nbdserver_client_t *client,
+			       struct nbd_request *request, int *shm_fd)
+{
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	ssize_t n;
+
+	*shm_fd = -1;
+
+	if (!client->local)
+		return tapdisk_nbdserver_recv(client->client_fd, request,
+					      sizeof(*request));
+
+	iov.iov_base = request;
+	iov.iov_len  = sizeof(*request);
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov        = &iov;
+	msg.msg_iovlen     = 1;
+	msg.msg_control    = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+
+	n = recvmsg(client->client_fd, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+	if (n <= 0)
+		return -1;
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+		if (cmsg->cmsg_level == SOL_SOCKET &&
+		    cmsg->cmsg_type == SCM_RIGHTS &&
+		    cmsg->cmsg_len == CMSG_LEN(sizeof(int)))
+			memcpy(shm_fd, CMSG_DATA(cmsg), sizeof(int));
+
+	if (n < sizeof(*request) &&
+	    tapdisk_nbdserver_recv(client->client_fd, (char *)request + n,
+				   sizeof(*request) - n)) {
+		if (*shm_fd >= 0)
+			close(*shm_fd);
+		*shm_fd = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* a local client maps its region once, for the life of the connection */
+static int
+tapdisk_nbdserver_map_shm(td_nbdserver_client_t *client, int fd,
+			  uint32_t len)
+{
+	struct stat st;
+	void *shm;
+
+	if (!client->local || fd < 0 || !len)
+		return -EINVAL;
+
+	if (client->shm)
+		return -EBUSY;
+
+	if (fstat(fd, &st))
+		return -errno;
+
+	if (st.st_size < len)
+		return -EINVAL;
+
+	shm = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (shm == MAP_FAILED)
+		return -errno;
+
+	client->shm      = shm;
+	client->shm_size = len;
+
+	INFO("Mapped %u bytes shared with the client", len);
+
+	return 0;
+}
+
+/*
+ * Data of a shared memory request: the offset follows the header, and
+ * has to be aligned like our own buffers. -EINVAL is for the client,
+ * anything else loses the connection.
+ */
+static int
+tapdisk_nbdserver_shm_iov(td_nbdserver_client_t *client,
+			  td_nbdserver_req_t *req, uint32_t type, uint32_t len)
+{
+	uint64_t off;
+
+	if (tapdisk_nbdserver_recv(client->client_fd, &off, sizeof(off)))
+		return -EIO;
+
+	off = ntohll(off);
+
+	if (!client->shm || client->structured ||
+	    (type != NBD_CMD_READ && type != NBD_CMD_WRITE))
+		return -EINVAL;
+
+	if ((off & (NBD_SERVER_BUF_ALIGN - 1)) ||
+	    off > client->shm_size || len > client->shm_size - off)
+		return -EINVAL;
+
+	req->iov.base = client->shm + off;
+
+	return 0;
+}
+
+static uint16_t
+tapdisk_nbdserver_flags(td_nbdserver_t *server)
+{
+	uint16_t flags = NBD_SERVER_FLAGS;
+
+	if (tapdisk_vbd_discard_supported(server->vbd))
+		flags |= NBD_FLAG_SEND_TRIM;
+
+	return flags;
+}
+
+static uint16_t
+tapdisk_nbdserver_tx_flags(td_nbdserver_client_t *client)
+{
+	return tapdisk_nbdserver_flags(client->server) |
+		(client->structured ? NBD_FLAG_SEND_DF : 0);
+}
+
+static int
+tapdisk_nbdserver_send_reply(td_nbdserver_client_t *client, const char *id,
+			     int error)
+{
+	struct nbd_reply reply;
+
+	reply.magic = htonl(NBD_REPLY_MAGIC);
+	reply.error = htonl(error < 0 ? -error : error);
+	memcpy(reply.handle, id, sizeof(reply.handle));
+
+	return tapdisk_nbdserver_send(client->client_fd, &reply,
+				      sizeof(reply), 0);
+}
+
+/* @secs of zeros, segments all pointing at the shared buffer */
+static int
+tapdisk_nbdserver_zero_iovs(td_nbdserver_client_t *client,
+			    td_nbdserver_req_t *req, td_sector_t secs)
+{
+	td_nbdserver_t *server = client->server;
+	int i, n, err;
+
+	if (!server->zeros) {
+		err = posix_memalign((void **)&server->zeros, 4096,
+				     NBD_SERVER_ZERO_SECS << SECTOR_SHIFT);
+		if (err) {
+			server->zeros = NULL;
+			return -err;
+		}
+		memset(server->zeros, 0, NBD_SERVER_ZERO_SECS << SECTOR_SHIFT);
+	}
+
+	n = (secs + NBD_SERVER_ZERO_SECS - 1) / NBD_SERVER_ZERO_SECS;
+
+	req->iovs = malloc(n * sizeof(struct td_iovec));
+	if (!req->iovs)
+		return -ENOMEM;
+
+	for (i = 0; i < n; i++) {
+		req->iovs[i].base = server->zeros;
+		req->iovs[i].secs = MIN(secs, NBD_SERVER_ZERO_SECS);
+		secs -= req->iovs[i].secs;
+	}
+
+	req->vreq.iov    = req->iovs;
+	req->vreq.iovcnt = n;
+
+	return 0;
+}
+
+static int
+tapdisk_nbdserver_send_chunk(td_nbdserver_client_t *client, const char *id,
+			     int flags, int type, const void *payload,
+			     uint32_t len, void *data, uint32_t data_len)
+{
+	struct nbd_structured_reply reply;
+	struct iovec iov[3];
+
+	reply.magic  = htonl(NBD_STRUCTURED_REPLY_MAGIC);
+	reply.flags  = htons(flags);
+	reply.type   = htons(type);
+	reply.length = htonl(len + data_len);
+	memcpy(reply.handle, id, sizeof(reply.handle));
+
+	iov[0].iov_base = &reply;
+	iov[0].iov_len  = sizeof(reply);
+	iov[1].iov_base = (void *)payload;
+	iov[1].iov_len  = len;
+	iov[2].iov_base = data;
+	iov[2].iov_len  = data_len;
+
+	return tapdisk_nbdserver_sendv(client->client_fd, iov,
+				       data_len ? 3 : 2);
+}
+
+static int
+tapdisk_nbdserver_send_error(td_nbdserver_client_t *client, const char *id,
+			     int error)
+{
+	struct {
+		uint32_t error;
+		uint16_t len;
+	} __attribute__ ((packed)) payload;
+
+	payload.error = htonl(error < 0 ? -error : error);
+	payload.len   = 0;
+
+	return tapdisk_nbdserver_send_chunk(client, id, NBD_REPLY_FLAG_DONE,
+					    NBD_REPLY_TYPE_ERROR, &payload,
+					    sizeof(payload), NULL, 0);
+}
+
+static int
+tapdisk_nbdserver_send_extent(td_nbdserver_client_t *client, const char *id,
+			      char *data, uint64_t offset, uint32_t len,
+			      int hole, int done)
+{
+	int flags = done ? NBD_REPLY_FLAG_DONE : 0;
+	struct {
+		uint64_t offset;
+		uint32_t len;
+	} __attribute__ ((packed)) payload;
+
+	payload.offset = htonll(offset);
+	payload.len    = htonl(len);
+
+	if (hole)
+		return tapdisk_nbdserver_send_chunk(client, id, flags,
+						    NBD_REPLY_TYPE_OFFSET_HOLE,
+						    &payload, sizeof(payload),
+						    NULL, 0);
+
+	return tapdisk_nbdserver_send_chunk(client, id, flags,
+					    NBD_REPLY_TYPE_OFFSET_DATA,
+					    &payload, sizeof(payload.offset),
+					    data, len);
+}
+
+/*
+ * A read as structured reply: runs of sectors no image holds go out
+ * as holes, other runs as data, unless the client asked for one chunk.
+ */
+static int
+tapdisk_nbdserver_send_read(td_nbdserver_client_t *client,
+			    td_nbdserver_req_t *req, int df)
+{
+	td_vbd_request_t *vreq = &req->vreq;
+	td_sector_t sec, end, run, next;
+	int hole, prev;
+
+	sec = vreq->sec;
+	end = sec + vreq->iov->secs;
+
+	if (df || !vreq->iov->secs)
+		return tapdisk_nbdserver_send_extent(client, req->id,
+						     vreq->iov->base,
+						     sec << SECTOR_SHIFT,
+						     vreq->iov->secs <<
+						     SECTOR_SHIFT, 0, 1);
+
+	run  = sec;
+	prev = -1;
+
+	while (sec < end) {
+		next = MIN((sec / NBD_SERVER_HOLE_SECS + 1) *
+			   NBD_SERVER_HOLE_SECS, end);
+		hole = !tapdisk_vbd_allocated(client->server->vbd, sec,
+					      next - sec);
+
+		if (prev >= 0 && hole != prev) {
+			if (tapdisk_nbdserver_send_extent(client, req->id,
+							  vreq->iov->base +
+							  ((run - vreq->sec) <<
+							   SECTOR_SHIFT),
+							  run << SECTOR_SHIFT,
+							  (sec - run) <<
+							  SECTOR_SHIFT,
+							  prev, 0))
+				return -1;
+			run = sec;
+		}
+
+		prev = hole;
+		sec  = next;
+	}
+
+	return tapdisk_nbdserver_send_extent(client, req->id,
+					     vreq->iov->base +
+					     ((run - vreq->sec) << SECTOR_SHIFT),
+					     run << SECTOR_SHIFT,
+					     (end - run) << SECTOR_SHIFT,
+					     prev, 1);
+}
+
+/*
+ * "base:allocation" from offset on, as the chain would read it: holes
+ * where no image holds data. Extents are cut at the end of the request
+ * or after NBD_SERVER_STATUS_SECS, whichever comes first.
+ */
+static int
+tapdisk_nbdserver_block_status(td_nbdserver_client_t *client,
+			       const char *id, uint64_t offset,
+			       uint32_t len, int one)
+{
+	td_vbd_t *vbd = client->server->vbd;
+	uint64_t size, end, next, start;
+	uint32_t *desc, state, prev;
+	int n, max, hole, err;
+
+	size = client->server->info.size << SECTOR_SHIFT;
+
+	if (!client->meta_allocation || !len || offset >= size ||
+	    len > size - offset)
+		return tapdisk_nbdserver_send_error(client, id, -EINVAL);
+
+	end = MIN(offset + len,
+		  offset + ((uint64_t)NBD_SERVER_STATUS_SECS << SECTOR_SHIFT));
+	max = 2 + 2 * (((end - offset) >> SECTOR_SHIFT) /
+		       NBD_SERVER_HOLE_SECS + 2);
+
+	desc = malloc(max * sizeof(uint32_t));
+	if (!desc)
+		return tapdisk_nbdserver_send_error(client, id, -ENOMEM);
+
+	desc[0] = htonl(NBD_SERVER_CONTEXT_ALLOC);
+	n       = 1;
+	prev    = -1;
+	start   = offset;
+
+	while (offset < end) {
+		next = MIN(((offset >> SECTOR_SHIFT) / NBD_SERVER_HOLE_SECS + 1) *
+			   NBD_SERVER_HOLE_SECS << SECTOR_SHIFT, end);
+		hole = !tapdisk_vbd_allocated(vbd, offset >> SECTOR_SHIFT,
+					      ((next + (1 << SECTOR_SHIFT) - 1)
+					       >> SECTOR_SHIFT) -
+					      (offset >> SECTOR_SHIFT));
+		state = hole ? NBD_STATE_HOLE | NBD_STATE_ZERO : 0;
+
+		if (prev != (uint32_t)-1 && state != prev) {
+			desc[n++] = htonl(offset - start);
+			desc[n++] = htonl(prev);
+			start     = offset;
+			if (one)
+				break;
+		}
+
+		prev   = state;
+		offset = next;
+	}
+
+	if (n == 1 || !one) {
+		desc[n++] = htonl(offset - start);
+		desc[n++] = htonl(prev);
+	}
+
+	err = tapdisk_nbdserver_send_chunk(client, id, NBD_REPLY_FLAG_DONE,
+					   NBD_REPLY_TYPE_BLOCK_STATUS, desc,
+					   n * sizeof(uint32_t), NULL, 0);
+	free(desc);
+	return err;
+}
+
+static int
+tapdisk_nbdserver_send_option(td_nbdserver_client_t *client, uint32_t option,
+			      uint32_t type, const void *data, uint32_t len)
+{
+	struct nbd_option_reply reply;
+
+	reply.magic  = htonll(NBD_REP_MAGIC);
+	reply.option = htonl(option);
+	reply.type   = htonl(type);
+	reply.length = htonl(len);
+
+	if (tapdisk_nbdserver_send(client->client_fd, &reply, sizeof(reply),
+				   !!len))
+		return -1;
+
+	return tapdisk_nbdserver_send(client->client_fd, data, len, 0);
+}
+
+static int
+tapdisk_nbdserver_send_export(td_nbdserver_client_t *client, uint32_t option)
+{
+	struct {
+		uint16_t type;
+		uint64_t size;
+		uint16_t flags;
+	} __attribute__ ((packed)) info;
+
+	info.type  = htons(NBD_INFO_EXPORT);
+	info.size  = htonll(client->server->info.size << SECTOR_SHIFT);
+	info.flags = htons(tapdisk_nbdserver_tx_flags(client));
+
+	return tapdisk_nbdserver_send_option(client, option, NBD_REP_INFO,
+					     &info, sizeof(info));
+}
+
+/* the single export answers to any name, and to base:allocation */
+static int
+tapdisk_nbdserver_meta_context(td_nbdserver_client_t *client,
+			       uint32_t option, char *data, uint32_t len)
+{
+	uint32_t namelen, n, qlen, off;
+	int set, found;
+
+	set   = (option == NBD_OPT_SET_META_CONTEXT);
+	found = 0;
+
+	if (!client->structured || len < 8)
+		goto invalid;
+
+	memcpy(&namelen, data, 4);
+	namelen = ntohl(namelen);
+	if (namelen > len - 8)
+		goto invalid;
+
+	off = 4 + namelen;
+	memcpy(&n, data + off, 4);
+	n    = ntohl(n);
+	off += 4;
+
+	if (!n && !set)
+		found = 1;
+
+	while (n--) {
+		if (len - off < 4)
+			goto invalid;
+
+		memcpy(&qlen, data + off, 4);
+		qlen = ntohl(qlen);
+		off += 4;
+
+		if (qlen > len - off)
+			goto invalid;
+
+		if ((qlen == strlen(NBD_META_BASE_ALLOCATION) &&
+		     !memcmp(data + off, NBD_META_BASE_ALLOCATION, qlen)) ||
+		    (!set && qlen == strlen("base:") &&
+		     !memcmp(data + off, "base:", qlen)))
+			found = 1;
+
+		off += qlen;
+	}
+
+	if (set)
+		client->meta_allocation = found;
+
+	if (found) {
+		char reply[4 + sizeof(NBD_META_BASE_ALLOCATION) - 1];
+		uint32_t id = htonl(NBD_SERVER_CONTEXT_ALLOC);
+
+		memcpy(reply, &id, 4);
+		memcpy(reply + 4, NBD_META_BASE_ALLOCATION,
+		       sizeof(reply) - 4);
+
+		if (tapdisk_nbdserver_send_option(client, option,
+						  NBD_REP_META_CONTEXT,
+						  reply, sizeof(reply)))
+			return -1;
+	}
+
+	return tapdisk_nbdserver_send_option(client, option, NBD_REP_ACK,
+					     NULL, 0);
+
+invalid:
+	return tapdisk_nbdserver_send_option(client, option,
+					     NBD_REP_ERR_INVALID, NULL, 0);
+}
+
+/*
+ * Fixed newstyle negotiation, one message per call: 1 once the
+ * transmission phase begins, 0 for more to come, -1 to drop the client.
+ */
+static int
+tapdisk_nbdserver_negotiate(td_nbdserver_client_t *client)
+{
+	int fd = client->client_fd;
+	struct nbd_option opt;
+	uint32_t flags, option, len;
+	char *data;
+	int err;
+
+	if (client->negotiating == NBD_SERVER_NEGOTIATE_FLAGS) {
+		if (tapdisk_nbdserver_recv(fd, &flags, sizeof(flags)))
+			return -1;
+
+		flags = ntohl(flags);
+		client->no_zeroes   = !!(flags & NBD_FLAG_C_NO_ZEROES);
+		client->negotiating = NBD_SERVER_NEGOTIATE_OPTIONS;
+		return 0;
+	}
+
+	if (tapdisk_nbdserver_recv(fd, &opt, sizeof(opt)) ||
+	    ntohll(opt.magic) != NBD_OPTS_MAGIC)
+		return -1;
+
+	option = ntohl(opt.option);
+	len    = ntohl(opt.length);
+
+	if (len > NBD_SERVER_OPTION_MAX) {
+		ERROR("Option %u too long: %u", option, len);
+		return -1;
+	}
+
+	data = malloc(len + 1);
+	if (!data)
+		return -1;
+
+	if (tapdisk_nbdserver_recv(fd, data, len)) {
+		free(data);
+		return -1;
+	}
+
+	switch (option) {
+	case NBD_OPT_EXPORT_NAME: {
+		char info[8 + 2 + 124];
+		uint64_t size = htonll(client->server->info.size <<
+				       SECTOR_SHIFT);
+		uint16_t tx = htons(tapdisk_nbdserver_tx_flags(client));
+
+		memcpy(info, &size, 8);
+		memcpy(info + 8, &tx, 2);
+		bzero(info + 10, 124);
+
+		err = tapdisk_nbdserver_send(fd, info, client->no_zeroes ?
+					     10 : sizeof(info), 0) ? -1 : 1;
+		break;
+	}
+
+	case NBD_OPT_ABORT:
+		tapdisk_nbdserver_send_option(client, option, NBD_REP_ACK,
+					      NULL, 0);
+		err = -1;
+		break;
+
+	case NBD_OPT_LIST: {
+		uint32_t namelen = 0;
+
+		err = tapdisk_nbdserver_send_option(client, option,
+						    NBD_REP_SERVER, &namelen,
+						    sizeof(namelen)) ||
+		      tapdisk_nbdserver_send_option(client, option,
+						    NBD_REP_ACK, NULL, 0);
+		err = err ? -1 : 0;
+		break;
+	}
+
+	case NBD_OPT_INFO:
+	case NBD_OPT_GO:
+		if (len < 6) {
+			err = tapdisk_nbdserver_send_option(client, option,
+							    NBD_REP_ERR_INVALID,
+							    NULL, 0);
+			break;
+		}
+
+		err = tapdisk_nbdserver_send_export(client, option) ||
+		      tapdisk_nbdserver_send_option(client, option,
+						    NBD_REP_ACK, NULL, 0);
+		err = err ? -1 : option == NBD_OPT_GO;
+		break;
+
+	case NBD_OPT_STRUCTURED_REPLY:
+		if (len) {
+			err = tapdisk_nbdserver_send_option(client, option,
+							    NBD_REP_ERR_INVALID,
+							    NULL, 0);
+			break;
+		}
+
+		client->structured = 1;
+		err = tapdisk_nbdserver_send_option(client, option,
+						    NBD_REP_ACK, NULL, 0);
+		break;
+
+	case NBD_OPT_LIST_META_CONTEXT:
+	case NBD_OPT_SET_META_CONTEXT:
+		err = tapdisk_nbdserver_meta_context(client, option, data, len);
+		break;
+
+	default:
+		err = tapdisk_nbdserver_send_option(client, option,
+						    NBD_REP_ERR_UNSUP, NULL, 0);
+		break;
+	}
+
+	free(data);
+
+	if (err == 1) {
+		INFO("Client negotiated%s%s", client->structured ?
+		     " structured replies" : "", client->meta_allocation ?
+		     ", base:allocation" : "");
+		client->negotiating = 0;
+	}
+
+	return err;
+}
+
 static void
 __tapdisk_nbdserver_request_cb(td_vbd_request_t *vreq, int error,
 		void *token, int final)
@@ -266,12 +1082,11 @@ __tapdisk_nbdserver_request_cb(td_vbd_request_t *vreq, int error,
 	td_nbdserver_client_t *client = token;
 	td_nbdserver_req_t *req = containerof(vreq, td_nbdserver_req_t, vreq);
 	struct nbd_reply reply;
-	int tosend = 0;
-	int sent = 0;
-	int len = 0;
+	struct iovec iov[2];
+	int cnt;
 
 	reply.magic = htonl(NBD_REPLY_MAGIC);
-	reply.error = htonl(error);
+	reply.error = htonl(error < 0 ? -error : error);
 	memcpy(reply.handle, req->id, sizeof(reply.handle));
 
 	if (client->client_fd < 0) {
@@ -279,34 +1094,57 @@ __tapdisk_nbdserver_request_cb(td_vbd_request_t *vreq, int error,
 		goto finish;
 	}
 
-	send(client->client_fd, &reply, sizeof(reply), 0);
+	/* written, now make it stable before the reply */
+	if (!error && vreq->op == TD_OP_WRITE &&
+	    (req->flags & NBD_CMD_FLAG_FUA)) {
+		tapdisk_nbdserver_put_buf(req);
+		req->flags &= ~NBD_CMD_FLAG_FUA;
+
+		memset(vreq, 0, sizeof(*vreq));
+		vreq->op     = TD_OP_FLUSH;
+		vreq->iov    = &req->iov;
+		vreq->iovcnt = 0;
+		vreq->token  = client;
+		vreq->cb     = __tapdisk_nbdserver_request_cb;
+		vreq->name   = req->id;
+		vreq->vbd    = client->server->vbd;
+
+		error = tapdisk_vbd_queue_request(client->server->vbd, vreq);
+		if (!error)
+			return;
+	}
 
-	switch(vreq->op) {
-	case TD_OP_READ:
-		tosend = len = vreq->iov->secs << SECTOR_SHIFT;
-		while (tosend > 0) {
-			sent = send(client->client_fd,
-					vreq->iov->base + (len - tosend),
-					tosend, 0);
-			if (sent <= 0) {
-				ERROR("Short send or error in "
-						"callback: %d", sent);
-				goto finish;
-			}
+	if (client->structured && vreq->op == TD_OP_READ) {
+		if (error)
+			tapdisk_nbdserver_send_error(client, req->id, error);
+		else if (tapdisk_nbdserver_send_read(client, req,
+						     req->flags & NBD_CMD_FLAG_DF))
+			ERROR("Short send or error in callback");
+		goto finish;
+	}
 
-			tosend -= sent;
-		}
-		break;
-	default:
-		break;
+	iov[0].iov_base = &reply;
+	iov[0].iov_len  = sizeof(reply);
+	cnt             = 1;
+
+	/* no payload with an error, or in shared memory */
+	if (vreq->op == TD_OP_READ && !error && vreq->iov->secs &&
+	    !(req->flags & NBD_CMD_FLAG_TAPDISK_SHM)) {
+		iov[1].iov_base = vreq->iov->base;
+		iov[1].iov_len  = vreq->iov->secs << SECTOR_SHIFT;
+		cnt             = 2;
 	}
 
+	if (tapdisk_nbdserver_sendv(client->client_fd, iov, cnt))
+		ERROR("Short send or error in callback");
+
 finish:
-	free(vreq->iov->base);
+	tapdisk_nbdserver_put_buf(req);
 	tapdisk_nbdserver_free_request(client, req);
 }
 
-static void tapdisk_nbdserver_newclient_fd(td_nbdserver_t *server, int new_fd);
+static void tapdisk_nbdserver_newclient_fd(td_nbdserver_t *server, int new_fd,
+					   int newstyle);
 
 static void
 tapdisk_nbdserver_clientcb(event_id_t id, char mode, void *data)
@@ -314,65 +1152,131 @@ tapdisk_nbdserver_clientcb(event_id_t id, char mode, void *data)
 	td_nbdserver_client_t *client = data;
 	td_nbdserver_t *server = client->server;
 	int rc;
-	int len;
-	int hdrlen;
-	int n;
+	uint32_t len;
+	int shm_fd;
 	int fd = client->client_fd;
-	char *ptr;
 	td_vbd_request_t *vreq;
 	struct nbd_request request;
+	td_nbdserver_req_t *req;
+
+	if (client->negotiating) {
+		if (tapdisk_nbdserver_negotiate(client) < 0) {
+			INFO("Client dropped in negotiation");
+			tapdisk_nbdserver_kill_client(client);
+		}
+		return;
+	}
 
-	td_nbdserver_req_t *req = tapdisk_nbdserver_alloc_request(client);
+	req = tapdisk_nbdserver_alloc_request(client);
 
 	if (req == NULL) {
-		ERROR("Couldn't allocate request in clientcb - killing client");
-		tapdisk_nbdserver_free_client(client);
+		/* picked up again as soon as a request completes */
+		tapdisk_nbdserver_disable_client(client);
+		client->throttled = 1;
 		return;
 	}
 
 	vreq = &req->vreq;
 
-	memset(req, 0, sizeof(td_nbdserver_req_t));
+	memset(vreq, 0, sizeof(*vreq));
+	memset(&req->iov, 0, sizeof(req->iov));
+	req->iovs  = NULL;
+	req->flags = 0;
 	/* Read the request the client has sent */
 
-	hdrlen = sizeof(struct nbd_request);
-
-	n = 0;
-	ptr = (char *) &request;
-	while (n < hdrlen) {
-		rc = recv(fd, ptr + n, hdrlen - n, 0);
-		if (rc == 0) {
-			INFO("Client closed connection");
-			goto fail;
-		}
-		if (rc < 0) {
-			ERROR("Bad return in nbdserver_clientcb. Closing "
-					"connection");
-			goto fail;
-		}
-		n += rc;
+	if (tapdisk_nbdserver_recv_request(client, &request, &shm_fd)) {
+		INFO("Client closed connection");
+		goto fail;
 	}
 
 	if (request.magic != htonl(NBD_REQUEST_MAGIC)) {
 		ERROR("Not enough magic");
+		if (shm_fd >= 0)
+			close(shm_fd);
 		goto fail;
 	}
 
 	request.from = ntohll(request.from);
 	request.type = ntohl(request.type);
+	req->flags   = request.type & ~NBD_CMD_MASK_COMMAND;
+	request.type = request.type & NBD_CMD_MASK_COMMAND;
 	len = ntohl(request.len);
 	if (((len & 0x1ff) != 0) || ((request.from & 0x1ff) != 0)) {
-		ERROR("Non sector-aligned request (%"PRIu64", %d)",
+		ERROR("Non sector-aligned request (%"PRIu64", %u)",
 				request.from, len);
 	}
 
 	bzero(req->id, sizeof(req->id));
 	memcpy(req->id, request.handle, sizeof(request.handle));
 
-	rc = posix_memalign(&req->iov.base, 512, len);
-	if (rc < 0) {
-		ERROR("posix_memalign failed (%d)", rc);
-		goto fail;
+	if (request.type == NBD_CMD_TAPDISK_SHM || shm_fd >= 0) {
+		rc = request.type == NBD_CMD_TAPDISK_SHM ?
+			tapdisk_nbdserver_map_shm(client, shm_fd, len) :
+			-EINVAL;
+		if (shm_fd >= 0)
+			close(shm_fd);
+		rc = tapdisk_nbdserver_send_reply(client, req->id, rc);
+		tapdisk_nbdserver_free_request(client, req);
+		if (rc)
+			tapdisk_nbdserver_kill_client(client);
+		return;
+	}
+
+	if (req->flags & NBD_CMD_FLAG_TAPDISK_SHM) {
+		rc = tapdisk_nbdserver_shm_iov(client, req, request.type, len);
+		if (rc == -EINVAL) {
+			rc = tapdisk_nbdserver_send_reply(client, req->id, rc);
+			tapdisk_nbdserver_free_request(client, req);
+			if (rc)
+				tapdisk_nbdserver_kill_client(client);
+			return;
+		}
+		if (rc)
+			goto fail;
+	}
+
+	if (request.type == NBD_CMD_BLOCK_STATUS) {
+		rc = tapdisk_nbdserver_block_status(client, req->id,
+						    request.from, len,
+						    req->flags &
+						    NBD_CMD_FLAG_REQ_ONE);
+		tapdisk_nbdserver_free_request(client, req);
+		if (rc)
+			tapdisk_nbdserver_kill_client(client);
+		return;
+	}
+
+	/* nothing to read where no image holds data */
+	if (request.type == NBD_CMD_READ && client->structured && len &&
+	    !(req->flags & NBD_CMD_FLAG_DF) &&
+	    !tapdisk_vbd_allocated(server->vbd, request.from >> SECTOR_SHIFT,
+				   len >> SECTOR_SHIFT)) {
+		rc = tapdisk_nbdserver_send_extent(client, req->id, NULL,
+						   request.from, len, 1, 1);
+		tapdisk_nbdserver_free_request(client, req);
+		if (rc)
+			tapdisk_nbdserver_kill_client(client);
+		return;
+	}
+
+	/* already zero where no image holds data */
+	if (request.type == NBD_CMD_WRITE_ZEROES && len &&
+	    !tapdisk_vbd_allocated(server->vbd, request.from >> SECTOR_SHIFT,
+				   len >> SECTOR_SHIFT)) {
+		rc = tapdisk_nbdserver_send_reply(client, req->id, 0);
+		tapdisk_nbdserver_free_request(client, req);
+		if (rc)
+			tapdisk_nbdserver_kill_client(client);
+		return;
+	}
+
+	if (len && !req->iov.base &&
+	    (request.type == NBD_CMD_READ || request.type == NBD_CMD_WRITE)) {
+		req->iov.base = tapdisk_nbdserver_get_buf(req, len);
+		if (!req->iov.base) {
+			ERROR("Couldn't allocate %u bytes", len);
+			goto fail;
+		}
 	}
 
 	vreq->sec = request.from >> SECTOR_SHIFT;
@@ -391,25 +1295,52 @@ tapdisk_nbdserver_clientcb(event_id_t id, char mode, void *data)
 	case NBD_CMD_WRITE:
 		vreq->op = TD_OP_WRITE;
 
-		n = 0;
-		while (n < len) {
-			rc = recv(fd, vreq->iov->base + n, (len - n), 0);
-			if (rc <= 0) {
-				ERROR("Short send or error in "
-						"callback: %d", rc);
-				goto fail;
-			}
+		if (!(req->flags & NBD_CMD_FLAG_TAPDISK_SHM) &&
+		    tapdisk_nbdserver_recv(fd, vreq->iov->base, len)) {
+			ERROR("Short read or error in callback");
+			goto fail;
+		}
+
+		break;
+	case NBD_CMD_WRITE_ZEROES:
+		vreq->op = TD_OP_WRITE;
 
-			n += rc;
-		};
+		rc = tapdisk_nbdserver_zero_iovs(client, req,
+						 len >> SECTOR_SHIFT);
+		if (rc) {
+			ERROR("Couldn't set up zeros: %d", rc);
+			goto fail;
+		}
+		break;
+	case NBD_CMD_TRIM:
+		if (!tapdisk_vbd_discard_supported(server->vbd)) {
+			rc = tapdisk_nbdserver_send_reply(client, req->id,
+							  -EOPNOTSUPP);
+			tapdisk_nbdserver_free_request(client, req);
+			if (rc)
+				tapdisk_nbdserver_kill_client(client);
+			return;
+		}
 
+		vreq->op = TD_OP_DISCARD;
+		break;
+	case NBD_CMD_FLUSH:
+		vreq->op     = TD_OP_FLUSH;
+		vreq->sec    = 0;
+		vreq->iovcnt = 0;
 		break;
 	case NBD_CMD_DISC:
+		tapdisk_nbdserver_free_request(client, req);
+		if (client->newstyle) {
+			INFO("Received close message");
+			tapdisk_nbdserver_kill_client(client);
+			return;
+		}
 		INFO("Received close message. Sending reconnect "
 				"header");
 		tapdisk_nbdserver_free_client(client);
 		INFO("About to send initial connection message");
-		tapdisk_nbdserver_newclient_fd(server, fd);
+		tapdisk_nbdserver_newclient_fd(server, fd, 0);
 		INFO("Sent");
 		return;
 
@@ -427,42 +1358,74 @@ tapdisk_nbdserver_clientcb(event_id_t id, char mode, void *data)
 	return;
 
 fail:
-	tapdisk_nbdserver_free_client(client);
+	tapdisk_nbdserver_put_buf(req);
+	tapdisk_nbdserver_free_request(client, req);
+	tapdisk_nbdserver_kill_client(client);
 	return;
 }
 
+/*
+ * Oldstyle clients get the size and flags right away. Newstyle ones,
+ * on the listening socket, negotiate options first, structured
+ * replies and block status among them.
+ */
 static void
-tapdisk_nbdserver_newclient_fd(td_nbdserver_t *server, int new_fd)
+tapdisk_nbdserver_newclient_fd(td_nbdserver_t *server, int new_fd,
+			       int newstyle)
 {
 	char buffer[256];
-	int rc;
+	int rc, len;
 	uint64_t tmp64;
 	uint32_t tmp32;
+	uint16_t tmp16;
+	int local;
 
 	INFO("Got a new client!");
 
+	local = tapdisk_nbdserver_is_local(new_fd);
+
 	/* Spit out the NBD connection stuff */
 
 	memcpy(buffer, "NBDMAGIC", 8);
-	tmp64 = htonll(NBD_NEGOTIATION_MAGIC);
-	memcpy(buffer + 8, &tmp64, sizeof(tmp64));
-	tmp64 = htonll(server->info.size * server->info.sector_size);
-	memcpy(buffer + 16, &tmp64, sizeof(tmp64));
-	tmp32 = htonl(0);
-	memcpy(buffer + 24, &tmp32, sizeof(tmp32));
-	bzero(buffer + 28, 124);
+	if (newstyle) {
+		tmp64 = htonll(NBD_OPTS_MAGIC);
+		memcpy(buffer + 8, &tmp64, sizeof(tmp64));
+		tmp16 = htons(NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES);
+		memcpy(buffer + 16, &tmp16, sizeof(tmp16));
+		len = 18;
+	} else {
+		tmp64 = htonll(NBD_NEGOTIATION_MAGIC);
+		memcpy(buffer + 8, &tmp64, sizeof(tmp64));
+		tmp64 = htonll(server->info.size << SECTOR_SHIFT);
+		memcpy(buffer + 16, &tmp64, sizeof(tmp64));
+		tmp32 = htonl(tapdisk_nbdserver_flags(server) |
+			      (local ? NBD_FLAG_TAPDISK_SHM : 0));
+		memcpy(buffer + 24, &tmp32, sizeof(tmp32));
+		bzero(buffer + 28, 124);
+		len = 152;
+	}
 
-	rc = send(new_fd, buffer, 152, 0);
+	rc = send(new_fd, buffer, len, 0);
 
-	if (rc < 152) {
+	if (rc < len) {
 		close(new_fd);
 		INFO("Short write in negotiation!");
+		return;
 	}	
 
 	INFO("About to alloc client");
 	td_nbdserver_client_t *client = tapdisk_nbdserver_alloc_client(server);
 	INFO("Got an allocated client at %p", client);
+	if (!client) {
+		close(new_fd);
+		return;
+	}
 	client->client_fd = new_fd;
+	client->local     = local;
+	if (newstyle) {
+		client->newstyle    = 1;
+		client->negotiating = NBD_SERVER_NEGOTIATE_FLAGS;
+	}
 	INFO("About to enable client");
 
 	if (tapdisk_nbdserver_enable_client(client) < 0) {
@@ -478,7 +1441,7 @@ tapdisk_nbdserver_fdreceiver_cb(int fd, char *msg, void *data)
 {
 	td_nbdserver_t *server = data;
 	INFO("Received fd with msg: %s", msg);
-	tapdisk_nbdserver_newclient_fd(server, fd);
+	tapdisk_nbdserver_newclient_fd(server, fd, 0);
 }
 
 static void
@@ -504,7 +1467,7 @@ tapdisk_nbdserver_newclient(event_id_t id, char mode, void *data)
 
 	INFO("server: got connection from %s\n", s);
 
-	tapdisk_nbdserver_newclient_fd(server, new_fd);
+	tapdisk_nbdserver_newclient_fd(server, new_fd, 1);
 }
 
 td_nbdserver_t *
@@ -623,8 +1586,11 @@ tapdisk_nbdserver_pause(td_nbdserver_t *server)
 	INFO("NBD server pause(%p)", server);
 
 	list_for_each_entry_safe(pos, q, &server->clients, clientlist){
-		if (pos->paused != 1 && pos->client_event_id >= 0) { 
-			tapdisk_nbdserver_disable_client(pos);
+		if (pos->paused != 1 &&
+		    (pos->client_event_id >= 0 || pos->throttled)) {
+			if (pos->client_event_id >= 0)
+				tapdisk_nbdserver_disable_client(pos);
+			pos->throttled = 0;
 			pos->paused = 1;
 		}
 	}
@@ -683,5 +1649,6 @@ tapdisk_nbdserver_free(td_nbdserver_t *server)
 	if (server->fdreceiver)
 		td_fdreceiver_stop(server->fdreceiver);
 
+	free(server->zeros);
 	free(server);	
 }
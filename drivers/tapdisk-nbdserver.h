@@ -35,12 +35,18 @@ struct td_nbdserver {
 
 	struct td_fdreceiver   *fdreceiver;
 	struct list_head        clients;
+
+	char                   *zeros;
 };
 
+/*
+ * Every connection has its own pool of requests, grown on demand up
+ * to NBD_SERVER_NUM_REQS. A connection at the limit is not read from
+ * until one of its requests completes.
+ */
 struct td_nbdserver_client {
 	int                     n_reqs;
-	td_nbdserver_req_t     *reqs;
-	struct td_iovec        *iovecs;
+	struct list_head        pools;
 	int                     n_reqs_free;
 	td_nbdserver_req_t    **reqs_free;
 
@@ -51,6 +57,19 @@ struct td_nbdserver_client {
 	struct list_head        clientlist;
 
 	int                     paused;
+	int                     throttled;
+	int                     dead;
+
+	int                     newstyle;
+	int                     negotiating;
+	int                     no_zeroes;
+	int                     structured;
+	int                     meta_allocation;
+
+	/* unix socket clients: data through a region they share with us */
+	int                     local;
+	char                   *shm;
+	size_t                  shm_size;
 };
 
 td_nbdserver_t *tapdisk_nbdserver_alloc(td_vbd_t *, td_disk_info_t);
@@ -20,9 +20,16 @@
 #endif
 
 #include <errno.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <libaio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#endif
 #ifdef __linux__
 #include <linux/version.h>
 #endif
@@ -36,6 +43,7 @@
 
 #include "libaio-compat.h"
 #include "atomicio.h"
+#include "profile.h"
 
 #define WARN(_f, _a...) tlog_write(TLOG_WARN, _f, ##_a)
 #define DBG(_f, _a...) tlog_write(TLOG_DBG, _f, ##_a)
@@ -122,6 +130,11 @@ complete_tiocb(struct tqueue *queue, struct tiocb *tiocb, unsigned long res)
 	else
 		err = -EIO;
 
+	td_trace(complete, tiocb,
+		 iocb->aio_lio_opcode == IO_CMD_PWRITE ? TD_OP_WRITE : TD_OP_READ,
+		 iocb->u.c.offset >> SECTOR_SHIFT,
+		 iocb->u.c.nbytes >> SECTOR_SHIFT, err);
+
 	tiocb->cb(tiocb->arg, tiocb, err);
 }
 
@@ -160,6 +173,7 @@ fail_tiocbs(struct tqueue *queue, int succeeded, int total, int err)
 	 * off of the queue, split them, and fail them */
 	queue->queued = io_expand_iocbs(&queue->opioctx,
 					queue->iocbs, succeeded, total);
+	tapdisk_filter_cancel(queue->filter, queue->iocbs, queue->queued);
 
 	return cancel_tiocbs(queue, err);
 }
@@ -203,11 +217,27 @@ tapdisk_rwio_rw(const struct iocb *iocb)
 	long long off = iocb->u.c.offset;
 	size_t size   = iocb->u.c.nbytes;
 	ssize_t (*func)(int, void *, size_t) = 
-		(iocb->aio_lio_opcode == IO_CMD_PWRITE ? vwrite : read);
+		(iocb->aio_lio_opcode == IO_CMD_PWRITE ||
+		 iocb->aio_lio_opcode == IO_CMD_PWRITEV ? vwrite : read);
 
 	if (lseek64(fd, off, SEEK_SET) == (off64_t)-1)
 		return -errno;
 
+	if (io_iocb_vectored((struct iocb *)iocb)) {
+		const struct iovec *iov = iocb->u.v.vec;
+		int i;
+
+		size = 0;
+		for (i = 0; i < iocb->u.v.nr; i++) {
+			if (atomicio(func, fd, iov[i].iov_base,
+				     iov[i].iov_len) != iov[i].iov_len)
+				return -errno;
+			size += iov[i].iov_len;
+		}
+
+		return size;
+	}
+
 	if (atomicio(func, fd, buf, size) != size)
 		return -errno;
 
@@ -539,6 +569,407 @@ static const struct tio td_tio_lio = {
 	.tio_submit  = tapdisk_lio_submit,
 };
 
+/*
+ * io_uring
+ *
+ * Merged iocbs become IORING_OP_READ/WRITE sqes (READV/WRITEV where
+ * io-optimize gathered non-contiguous buffers), all of one batch
+ * submitted with a single io_uring_enter (none at all under SQPOLL,
+ * unless the poller went idle). Completion is signalled on an eventfd
+ * registered with the ring, and cqes are reaped straight from the
+ * shared ring. Buffers and files are not registered: neither is known
+ * up front, and a fixed file would outlive an fd the image closes.
+ */
+
+#if defined(HAVE_LINUX_IO_URING_H) && defined(__NR_io_uring_setup)
+
+struct uring {
+	int                  ring_fd;
+	unsigned             flags;
+
+	void                *sq_ring;
+	size_t               sq_ring_size;
+	unsigned            *sq_head;
+	unsigned            *sq_tail;
+	unsigned            *sq_mask;
+	unsigned            *sq_flags;
+	unsigned            *sq_array;
+	struct io_uring_sqe *sqes;
+	size_t               sqes_size;
+
+	void                *cq_ring;
+	size_t               cq_ring_size;
+	unsigned            *cq_head;
+	unsigned            *cq_tail;
+	unsigned            *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	struct io_event     *aio_events;
+
+	int                  event_fd;
+	int                  event_id;
+};
+
+#define URING_SQPOLL_IDLE_MS    50
+
+static inline int
+__io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static inline int
+__io_uring_enter(int fd, unsigned to_submit, unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, 0, flags, NULL, 0);
+}
+
+static inline int
+__io_uring_register(int fd, unsigned opcode, void *arg, unsigned n)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, n);
+}
+
+static void
+tapdisk_uring_destroy(struct tqueue *queue)
+{
+	struct uring *uring = queue->tio_data;
+
+	if (!uring)
+		return;
+
+	if (uring->event_id >= 0) {
+		tapdisk_server_unregister_event(uring->event_id);
+		uring->event_id = -1;
+	}
+
+	if (uring->sqes) {
+		munmap(uring->sqes, uring->sqes_size);
+		uring->sqes = NULL;
+	}
+
+	if (uring->cq_ring && uring->cq_ring != uring->sq_ring)
+		munmap(uring->cq_ring, uring->cq_ring_size);
+	uring->cq_ring = NULL;
+
+	if (uring->sq_ring) {
+		munmap(uring->sq_ring, uring->sq_ring_size);
+		uring->sq_ring = NULL;
+	}
+
+	if (uring->ring_fd >= 0) {
+		close(uring->ring_fd);
+		uring->ring_fd = -1;
+	}
+
+	if (uring->event_fd >= 0) {
+		close(uring->event_fd);
+		uring->event_fd = -1;
+	}
+
+	free(uring->aio_events);
+	uring->aio_events = NULL;
+}
+
+static int
+tapdisk_uring_map(struct tqueue *queue, struct io_uring_params *p)
+{
+	struct uring *uring = queue->tio_data;
+	char *sq, *cq;
+
+	uring->sq_ring_size = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+	uring->cq_ring_size = p->cq_off.cqes +
+		p->cq_entries * sizeof(struct io_uring_cqe);
+
+	if (p->features & IORING_FEAT_SINGLE_MMAP) {
+		if (uring->cq_ring_size > uring->sq_ring_size)
+			uring->sq_ring_size = uring->cq_ring_size;
+		uring->cq_ring_size = uring->sq_ring_size;
+	}
+
+	sq = mmap(NULL, uring->sq_ring_size, PROT_READ | PROT_WRITE,
+		  MAP_SHARED | MAP_POPULATE, uring->ring_fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED)
+		return -errno;
+	uring->sq_ring = sq;
+
+	if (p->features & IORING_FEAT_SINGLE_MMAP)
+		cq = sq;
+	else {
+		cq = mmap(NULL, uring->cq_ring_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, uring->ring_fd,
+			  IORING_OFF_CQ_RING);
+		if (cq == MAP_FAILED)
+			return -errno;
+	}
+	uring->cq_ring = cq;
+
+	uring->sqes_size = p->sq_entries * sizeof(struct io_uring_sqe);
+	uring->sqes = mmap(NULL, uring->sqes_size, PROT_READ | PROT_WRITE,
+			   MAP_SHARED | MAP_POPULATE, uring->ring_fd,
+			   IORING_OFF_SQES);
+	if (uring->sqes == MAP_FAILED) {
+		uring->sqes = NULL;
+		return -errno;
+	}
+
+	uring->sq_head  = (unsigned *)(sq + p->sq_off.head);
+	uring->sq_tail  = (unsigned *)(sq + p->sq_off.tail);
+	uring->sq_mask  = (unsigned *)(sq + p->sq_off.ring_mask);
+	uring->sq_flags = (unsigned *)(sq + p->sq_off.flags);
+	uring->sq_array = (unsigned *)(sq + p->sq_off.array);
+
+	uring->cq_head  = (unsigned *)(cq + p->cq_off.head);
+	uring->cq_tail  = (unsigned *)(cq + p->cq_off.tail);
+	uring->cq_mask  = (unsigned *)(cq + p->cq_off.ring_mask);
+	uring->cqes     = (struct io_uring_cqe *)(cq + p->cq_off.cqes);
+
+	return 0;
+}
+
+static void
+tapdisk_uring_event(event_id_t id, char mode, void *private)
+{
+	struct tqueue *queue = private;
+	struct uring *uring = queue->tio_data;
+	struct io_uring_cqe *cqe;
+	unsigned head, tail;
+	int i, ret, split;
+	struct iocb *iocb;
+	struct tiocb *tiocb;
+	struct io_event *ep;
+	uint64_t val;
+	int gcc;
+
+	gcc = read(uring->event_fd, &val, sizeof(val));
+	if (gcc) {};
+
+	head = *uring->cq_head;
+	tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+
+	for (ret = 0; head != tail && ret < queue->size; head++, ret++) {
+		cqe     = &uring->cqes[head & *uring->cq_mask];
+		ep      = uring->aio_events + ret;
+		ep->obj = (struct iocb *)(uintptr_t)cqe->user_data;
+		ep->res = (long)cqe->res;
+	}
+
+	__atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
+
+	split = io_split(&queue->opioctx, uring->aio_events, ret);
+	tapdisk_filter_events(queue->filter, uring->aio_events, split);
+
+	DBG("events: %d, tiocbs: %d\n", ret, split);
+
+	queue->iocbs_pending  -= ret;
+	queue->tiocbs_pending -= split;
+
+	for (i = split, ep = uring->aio_events; i-- > 0; ep++) {
+		iocb  = ep->obj;
+		tiocb = iocb->data;
+		complete_tiocb(queue, tiocb, ep->res);
+	}
+
+	queue_deferred_tiocbs(queue);
+
+	/* more arrived than we took, the eventfd was already read */
+	if (head != __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE))
+		tapdisk_uring_event(id, mode, private);
+}
+
+static int
+__tapdisk_uring_setup(struct tqueue *queue, int qlen, unsigned flags)
+{
+	struct uring *uring = queue->tio_data;
+	struct io_uring_params p;
+	int err;
+
+	uring->ring_fd  = -1;
+	uring->event_fd = -1;
+	uring->event_id = -1;
+
+	memset(&p, 0, sizeof(p));
+	p.flags = flags;
+	if (flags & IORING_SETUP_SQPOLL)
+		p.sq_thread_idle = URING_SQPOLL_IDLE_MS;
+
+	uring->ring_fd = __io_uring_setup(qlen, &p);
+	if (uring->ring_fd < 0) {
+		err = -errno;
+		goto fail;
+	}
+
+	/* IORING_OP_READ/WRITE came with it, in 5.6 */
+	if (!(p.features & IORING_FEAT_RW_CUR_POS)) {
+		err = -ENOSYS;
+		goto fail;
+	}
+
+	uring->flags = p.flags;
+
+	err = tapdisk_uring_map(queue, &p);
+	if (err)
+		goto fail;
+
+	uring->event_fd = tapdisk_sys_eventfd(0);
+	if (uring->event_fd < 0) {
+		err = -errno;
+		goto fail;
+	}
+
+	err = __io_uring_register(uring->ring_fd, IORING_REGISTER_EVENTFD,
+				  &uring->event_fd, 1);
+	if (err) {
+		err = -errno;
+		goto fail;
+	}
+
+	uring->event_id =
+		tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
+					      uring->event_fd, 0,
+					      tapdisk_uring_event,
+					      queue);
+	err = uring->event_id;
+	if (err < 0)
+		goto fail;
+
+	uring->aio_events = calloc(qlen, sizeof(struct io_event));
+	if (!uring->aio_events) {
+		err = -errno;
+		goto fail;
+	}
+
+	return 0;
+
+fail:
+	EPRINTF("Couldn't set up io_uring (%s): %d\n",
+		(flags & IORING_SETUP_SQPOLL) ? "sqpoll" : "no sqpoll", err);
+	tapdisk_uring_destroy(queue);
+	return err;
+}
+
+static int
+tapdisk_uring_setup(struct tqueue *queue, int qlen)
+{
+	return __tapdisk_uring_setup(queue, qlen, 0);
+}
+
+static int
+tapdisk_uring_setup_sqpoll(struct tqueue *queue, int qlen)
+{
+	return __tapdisk_uring_setup(queue, qlen, IORING_SETUP_SQPOLL);
+}
+
+static void
+tapdisk_uring_prep(struct io_uring_sqe *sqe, struct iocb *iocb)
+{
+	memset(sqe, 0, sizeof(*sqe));
+
+	switch (iocb->aio_lio_opcode) {
+	case IO_CMD_PWRITEV:
+		sqe->opcode = IORING_OP_WRITEV;
+		break;
+	case IO_CMD_PREADV:
+		sqe->opcode = IORING_OP_READV;
+		break;
+	case IO_CMD_PWRITE:
+		sqe->opcode = IORING_OP_WRITE;
+		break;
+	default:
+		sqe->opcode = IORING_OP_READ;
+		break;
+	}
+
+	sqe->fd        = iocb->aio_fildes;
+	sqe->off       = iocb->u.c.offset;
+	sqe->addr      = (uintptr_t)iocb->u.c.buf;
+	sqe->len       = iocb->u.c.nbytes;
+	sqe->user_data = (uintptr_t)iocb;
+}
+
+static int
+tapdisk_uring_submit(struct tqueue *queue)
+{
+	struct uring *uring = queue->tio_data;
+	int i, merged, submitted, err = 0;
+	unsigned tail, idx, flags;
+
+	if (!queue->queued)
+		return 0;
+
+	tapdisk_filter_iocbs(queue->filter, queue->iocbs, queue->queued);
+	merged = io_merge(&queue->opioctx, queue->iocbs, queue->queued);
+
+	/* iocbs_pending <= size <= sq_entries: the sq has room */
+	tail = *uring->sq_tail;
+	for (i = 0; i < merged; i++) {
+		idx = (tail + i) & *uring->sq_mask;
+		tapdisk_uring_prep(&uring->sqes[idx], queue->iocbs[i]);
+		uring->sq_array[idx] = idx;
+	}
+
+	__atomic_store_n(uring->sq_tail, tail + merged, __ATOMIC_RELEASE);
+
+	if (uring->flags & IORING_SETUP_SQPOLL) {
+		submitted = merged;
+
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		flags = __atomic_load_n(uring->sq_flags, __ATOMIC_RELAXED);
+		if (flags & IORING_SQ_NEED_WAKEUP &&
+		    __io_uring_enter(uring->ring_fd, 0,
+				     IORING_ENTER_SQ_WAKEUP) < 0)
+			/* queued all the same, the poller finds them */
+			WARN("io_uring sq wakeup: %d\n", -errno);
+	} else {
+		submitted = __io_uring_enter(uring->ring_fd, merged, 0);
+		if (submitted < 0)
+			submitted = -errno;
+	}
+
+	DBG("queued: %d, merged: %d, submitted: %d\n",
+	    queue->queued, merged, submitted);
+
+	if (submitted < 0) {
+		err = submitted;
+		submitted = 0;
+	} else if (submitted < merged)
+		err = -EIO;
+
+	/* the kernel only reads the sq in io_uring_enter: take back
+	 * what it left there, fail_tiocbs fails them */
+	if (err)
+		__atomic_store_n(uring->sq_tail, tail + submitted,
+				 __ATOMIC_RELEASE);
+
+	queue->iocbs_pending  += submitted;
+	queue->tiocbs_pending += queue->queued;
+	queue->queued          = 0;
+
+	if (err)
+		queue->tiocbs_pending -=
+			fail_tiocbs(queue, submitted, merged, err);
+
+	return submitted;
+}
+
+static const struct tio td_tio_uring = {
+	.name        = "uring",
+	.data_size   = sizeof(struct uring),
+	.tio_setup   = tapdisk_uring_setup,
+	.tio_destroy = tapdisk_uring_destroy,
+	.tio_submit  = tapdisk_uring_submit,
+};
+
+static const struct tio td_tio_uring_sqpoll = {
+	.name        = "uring-sqpoll",
+	.data_size   = sizeof(struct uring),
+	.tio_setup   = tapdisk_uring_setup_sqpoll,
+	.tio_destroy = tapdisk_uring_destroy,
+	.tio_submit  = tapdisk_uring_submit,
+};
+
+#endif /* HAVE_LINUX_IO_URING_H */
+
 static void
 tapdisk_queue_free_io(struct tqueue *queue)
 {
@@ -567,6 +998,14 @@ tapdisk_queue_init_io(struct tqueue *queue, int drv)
 	case TIO_DRV_RWIO:
 		tio = &td_tio_rwio;
 		break;
+#if defined(HAVE_LINUX_IO_URING_H) && defined(__NR_io_uring_setup)
+	case TIO_DRV_URING:
+		tio = &td_tio_uring;
+		break;
+	case TIO_DRV_URING_SQPOLL:
+		tio = &td_tio_uring_sqpoll;
+		break;
+#endif
 	default:
 		err = -EINVAL;
 		goto fail;
@@ -596,6 +1035,38 @@ fail:
 	return err;
 }
 
+int
+tapdisk_queue_tio_drv(const char *name)
+{
+	if (!strcmp(name, "lio"))
+		return TIO_DRV_LIO;
+	if (!strcmp(name, "rwio"))
+		return TIO_DRV_RWIO;
+	if (!strcmp(name, "uring"))
+		return TIO_DRV_URING;
+	if (!strcmp(name, "uring-sqpoll"))
+		return TIO_DRV_URING_SQPOLL;
+
+	return -EINVAL;
+}
+
+const char *
+tapdisk_queue_tio_name(int drv)
+{
+	switch (drv) {
+	case TIO_DRV_LIO:
+		return "lio";
+	case TIO_DRV_RWIO:
+		return "rwio";
+	case TIO_DRV_URING:
+		return "uring";
+	case TIO_DRV_URING_SQPOLL:
+		return "uring-sqpoll";
+	default:
+		return "default";
+	}
+}
+
 int
 tapdisk_init_queue(struct tqueue *queue, int size,
 		   int drv, struct tfilter *filter)
@@ -685,6 +1156,13 @@ tapdisk_prep_tiocb(struct tiocb *tiocb, int fd, int rw, char *buf, size_t size,
 void
 tapdisk_queue_tiocb(struct tqueue *queue, struct tiocb *tiocb)
 {
+	struct iocb *iocb = &tiocb->iocb;
+
+	td_trace(submit, tiocb,
+		 iocb->aio_lio_opcode == IO_CMD_PWRITE ? TD_OP_WRITE : TD_OP_READ,
+		 iocb->u.c.offset >> SECTOR_SHIFT,
+		 iocb->u.c.nbytes >> SECTOR_SHIFT, 0);
+
 	if (!tapdisk_queue_full(queue))
 		queue_tiocb(queue, tiocb);
 	else
@@ -1,4 +1,4 @@
-/* 
+/*
  * Copyright (C) Citrix Systems Inc.
  *
  * This program is free software; you can redistribute it and/or
@@ -20,34 +20,79 @@
 #endif
 
 #include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #include "tapdisk-ring.h"
 
+#define TD_URING_KICKS_MAX  64
+
+static size_t
+tapdisk_uring_ring_area(uint32_t ring_size)
+{
+	size_t size;
+
+	size = sizeof(td_uring_sring_t) +
+		ring_size * (sizeof(td_uring_request_t) +
+			     sizeof(td_uring_response_t));
+
+	return (size + TD_URING_PAGE_SIZE - 1) & ~(TD_URING_PAGE_SIZE - 1);
+}
+
+static void
+tapdisk_uring_map_areas(td_uring_t *ring, uint32_t data_offset)
+{
+	void *area = ring->shmem + sizeof(td_uring_header_t);
+
+	ring->sring     = area;
+	ring->reqs      = area + sizeof(td_uring_sring_t);
+	ring->rsps      = (void *)(ring->reqs + ring->ring_size);
+	ring->data_area = ring->shmem + data_offset;
+}
+
+static int
+tapdisk_uring_sockaddr(td_uring_t *ring, struct sockaddr_un *saddr)
+{
+	if (strnlen(ring->ctlfd_path, sizeof(saddr->sun_path)) >=
+	    sizeof(saddr->sun_path))
+		return -ENAMETOOLONG;
+
+	memset(saddr, 0, sizeof(struct sockaddr_un));
+	saddr->sun_family = AF_UNIX;
+	strcpy(saddr->sun_path, ring->ctlfd_path);
+
+	return 0;
+}
+
 static int
 tapdisk_uring_create_ctlfd(td_uring_t *ring)
 {
 	int fd, err;
 	struct sockaddr_un saddr;
 
-	if (strnlen(ring->ctlfd_path, sizeof(saddr.sun_family)) >=
-	    sizeof(saddr.sun_family))
-		return -ENAMETOOLONG;
+	err = tapdisk_uring_sockaddr(ring, &saddr);
+	if (err)
+		return err;
 
-	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
 	if (fd == -1)
 		return -errno;
 
-	memset(&saddr, 0, sizeof(struct sockaddr_un));
-	saddr.sun_family = AF_UNIX;
-	memcpy(saddr.sun_path, ring->ctlfd_path, strlen(ring->ctlfd_path));
-
 	err = unlink(ring->ctlfd_path);
 	if (err == -1 && errno != ENOENT) {
 		err = -errno;
 		goto fail;
 	}
 
-	err = bind(fd, &saddr, sizeof(struct sockaddr_un));
+	err = bind(fd, (struct sockaddr *)&saddr, sizeof(saddr));
 	if (err == -1) {
 		err = -errno;
 		goto fail;
@@ -59,7 +104,7 @@ tapdisk_uring_create_ctlfd(td_uring_t *ring)
 		goto fail;
 	}
 
-	ring->ctlfd = fd;
+	ring->listenfd = fd;
 	return 0;
 
 fail:
@@ -70,16 +115,16 @@ fail:
 static void
 tapdisk_uring_destroy_ctlfd(td_uring_t *ring)
 {
-	if (ring->ctlfd) {
-		close(ring->ctlfd);
-		ring->ctlfd = 0;
-	}
+	tapdisk_uring_hangup(ring);
 
-	if (ring->ctlfd_path) {
+	if (ring->listenfd >= 0) {
+		close(ring->listenfd);
+		ring->listenfd = -1;
 		unlink(ring->ctlfd_path);
-		free(ring->ctlfd_path);
-		ring->ctlfd_path = NULL;
 	}
+
+	free(ring->ctlfd_path);
+	ring->ctlfd_path = NULL;
 }
 
 static int
@@ -88,19 +133,15 @@ tapdisk_uring_connect_ctlfd(td_uring_t *ring)
 	int fd, err;
 	struct sockaddr_un saddr;
 
-	if (strnlen(ring->ctlfd_path, sizeof(saddr.sun_path)) >=
-	    sizeof(saddr.sun_path))
-		return -ENAMETOOLONG;
+	err = tapdisk_uring_sockaddr(ring, &saddr);
+	if (err)
+		return err;
 
-	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
 	if (fd == -1)
 		return -errno;
 
-	memset(&saddr, 0, sizeof(struct sockaddr_un));
-	saddr.sun_family = AF_UNIX;
-	memcpy(saddr.sun_path, ring->ctlfd_path, strlen(ring->ctlfd_path));
-
-	err = connect(fd, &saddr, sizeof(saddr));
+	err = connect(fd, (struct sockaddr *)&saddr, sizeof(saddr));
 	if (err == -1) {
 		err = -errno;
 		goto fail;
@@ -117,8 +158,11 @@ fail:
 static void
 tapdisk_uring_disconnect_ctlfd(td_uring_t *ring)
 {
-	if (ring->ctlfd)
+	if (ring->ctlfd >= 0) {
 		close(ring->ctlfd);
+		ring->ctlfd = -1;
+	}
+
 	free(ring->ctlfd_path);
 	ring->ctlfd_path = NULL;
 }
@@ -126,9 +170,16 @@ tapdisk_uring_disconnect_ctlfd(td_uring_t *ring)
 static int
 tapdisk_uring_create_shmem(td_uring_t *ring)
 {
+	td_uring_header_t *header;
+	uint32_t data_offset;
 	int fd, err;
 
-	fd = shm_open(ring->shmem_path, O_CREAT | O_RDWR, 0750);
+	data_offset = sizeof(td_uring_header_t) +
+		tapdisk_uring_ring_area(ring->ring_size);
+	ring->shmem_size = data_offset + ring->data_size;
+
+	fd = open(ring->shmem_path, O_CREAT | O_TRUNC | O_RDWR | O_CLOEXEC,
+		  0600);
 	if (fd == -1)
 		return -errno;
 
@@ -146,6 +197,20 @@ tapdisk_uring_create_shmem(td_uring_t *ring)
 		goto out;
 	}
 
+	tapdisk_uring_map_areas(ring, data_offset);
+	tapdisk_uring_reset(ring);
+
+	header = ring->shmem;
+	header->version     = TD_URING_CURRENT_VERSION;
+	header->shmem_size  = ring->shmem_size;
+	header->ring_size   = ring->ring_size;
+	header->data_size   = ring->data_size;
+	header->data_offset = data_offset;
+
+	/* the cookie goes last, a client only maps a complete header */
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(header->cookie, TAPDISK_URING_COOKIE, sizeof(header->cookie));
+
 	err = 0;
 
 out:
@@ -162,7 +227,7 @@ tapdisk_uring_destroy_shmem(td_uring_t *ring)
 	}
 
 	if (ring->shmem_path) {
-		shm_unlink(ring->shmem_path);
+		unlink(ring->shmem_path);
 		free(ring->shmem_path);
 		ring->shmem_path = NULL;
 	}
@@ -174,7 +239,7 @@ tapdisk_uring_connect_shmem(td_uring_t *ring)
 	int fd, err;
 	td_uring_header_t header, *p;
 
-	fd = shm_open(ring->shmem_path, O_RDWR);
+	fd = open(ring->shmem_path, O_RDWR | O_CLOEXEC);
 	if (fd == -1)
 		return -errno;
 
@@ -188,16 +253,21 @@ tapdisk_uring_connect_shmem(td_uring_t *ring)
 	memcpy(&header, p, sizeof(td_uring_header_t));
 	munmap(p, sizeof(td_uring_header_t));
 
+	err = -EINVAL;
+
 	if (memcmp(header.cookie,
-		   TAPDISK_URING_COOKIE, sizeof(header.cookie))) {
-		err = -EINVAL;
+		   TAPDISK_URING_COOKIE, sizeof(header.cookie)))
 		goto out;
-	}
 
-	if (header.version != TD_URING_CURRENT_VERSION) {
-		err = -EINVAL;
+	if (header.version != TD_URING_CURRENT_VERSION)
+		goto out;
+
+	if (!header.ring_size || header.ring_size > TD_URING_MAX_SLOTS ||
+	    header.ring_size & (header.ring_size - 1) ||
+	    header.data_offset < sizeof(td_uring_header_t) +
+	    tapdisk_uring_ring_area(header.ring_size) ||
+	    header.shmem_size < header.data_offset + header.data_size)
 		goto out;
-	}
 
 	ring->ring_size  = header.ring_size;
 	ring->data_size  = header.data_size;
@@ -206,11 +276,16 @@ tapdisk_uring_connect_shmem(td_uring_t *ring)
 	ring->shmem = mmap(NULL, ring->shmem_size,
 			   PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
 	if (ring->shmem == MAP_FAILED) {
-		rint->shmem = NULL;
+		ring->shmem = NULL;
 		err = -errno;
 		goto out;
 	}
 
+	tapdisk_uring_map_areas(ring, header.data_offset);
+
+	ring->req_prod_pvt = ring->sring->req_prod;
+	ring->rsp_cons     = ring->sring->rsp_prod;
+
 	err = 0;
 
 out:
@@ -221,48 +296,65 @@ out:
 static void
 tapdisk_uring_disconnect_shmem(td_uring_t *ring)
 {
-	if (ring->shmem)
+	if (ring->shmem) {
 		munmap(ring->shmem, ring->shmem_size);
+		ring->shmem = NULL;
+	}
+
 	free(ring->shmem_path);
 	ring->shmem_path = NULL;
 }
 
-int
-tapdisk_uring_create(td_uring_t *ring, const char *location,
-		    uint32_t ring_size, uint32_t data_size)
+static int
+tapdisk_uring_init(td_uring_t *ring, const char *location)
 {
-	int fd, err;
+	int err;
 
 	memset(ring, 0, sizeof(td_uring_t));
-
-	ring->ring_size  = ring_size;
-	ring->data_size  = data_size;
-	ring->shmem_size = ring_size + data_size + sizeof(td_uring_header_t);
+	ring->ctlfd    = -1;
+	ring->listenfd = -1;
 
 	err = asprintf(&ring->shmem_path, "%s.shm", location);
 	if (err == -1) {
 		ring->shmem_path = NULL;
-		err = -errno;
-		goto fail;
+		return -ENOMEM;
 	}
 
 	err = asprintf(&ring->ctlfd_path, "%s.cfd", location);
 	if (err == -1) {
 		ring->ctlfd_path = NULL;
-		err = -errno;
-		goto fail;
+		return -ENOMEM;
 	}
 
-	err = tapdisk_uring_create_ctlfd(ring);
+	return 0;
+}
+
+int
+tapdisk_uring_create(td_uring_t *ring, const char *location,
+		    uint32_t ring_size, uint32_t data_size)
+{
+	int err;
+
+	err = tapdisk_uring_init(ring, location);
 	if (err)
 		goto fail;
 
+	err = -EINVAL;
+	if (!ring_size || ring_size > TD_URING_MAX_SLOTS ||
+	    ring_size & (ring_size - 1) ||
+	    data_size & (TD_URING_PAGE_SIZE - 1))
+		goto fail;
+
+	ring->ring_size = ring_size;
+	ring->data_size = data_size;
+
 	err = tapdisk_uring_create_shmem(ring);
 	if (err)
 		goto fail;
 
-	ring->ring_area = (unsigned long)ring->shmem + sizeof(td_uring_header_t);
-	ring->data_area = (unsigned long)ring->ring_area + ring->ring_size;
+	err = tapdisk_uring_create_ctlfd(ring);
+	if (err)
+		goto fail;
 
 	return 0;
 
@@ -274,33 +366,57 @@ fail:
 int
 tapdisk_uring_destroy(td_uring_t *ring)
 {
-	tapdisk_uring_destroy_shmem(ring);
 	tapdisk_uring_destroy_ctlfd(ring);
+	tapdisk_uring_destroy_shmem(ring);
 	return 0;
 }
 
+/* one client at a time, others are turned away */
 int
-tapdisk_uring_connect(td_uring_t *ring, const char *location)
+tapdisk_uring_accept(td_uring_t *ring)
 {
-	int fd, err;
+	int fd;
 
-	memset(ring, 0, sizeof(td_uring_t));
+	fd = accept4(ring->listenfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd == -1)
+		return -errno;
 
-	err = asprintf(&ring->shmem_path, "%s.shm", location);
-	if (err == -1) {
-		ring->shmem_path = NULL;
-		err = -errno;
-		goto fail;
+	if (ring->ctlfd >= 0) {
+		close(fd);
+		return -EBUSY;
 	}
 
-	err = asprintf(&ring->ctlfd_path, "%s.cfd", location);
-	if (err == -1) {
-		ring->ctlfd_path = NULL;
-		err = -errno;
-		goto fail;
+	ring->ctlfd = fd;
+	return 0;
+}
+
+void
+tapdisk_uring_hangup(td_uring_t *ring)
+{
+	if (ring->ctlfd >= 0) {
+		close(ring->ctlfd);
+		ring->ctlfd = -1;
 	}
+}
 
-	err = tapdisk_uring_connect_ctlfd(ring);
+/* for the next client, once nothing is outstanding */
+void
+tapdisk_uring_reset(td_uring_t *ring)
+{
+	memset(ring->sring, 0, sizeof(td_uring_sring_t));
+	ring->sring->req_event = 1;
+	ring->sring->rsp_event = 1;
+
+	ring->req_cons     = 0;
+	ring->rsp_prod_pvt = 0;
+}
+
+int
+tapdisk_uring_connect(td_uring_t *ring, const char *location)
+{
+	int err;
+
+	err = tapdisk_uring_init(ring, location);
 	if (err)
 		goto fail;
 
@@ -308,9 +424,15 @@ tapdisk_uring_connect(td_uring_t *ring, const char *location)
 	if (err)
 		goto fail;
 
-	err = 0;
+	err = tapdisk_uring_connect_ctlfd(ring);
+	if (err)
+		goto fail;
+
+	return 0;
 
 fail:
+	tapdisk_uring_disconnect(ring);
+	return err;
 }
 
 int
@@ -322,112 +444,121 @@ tapdisk_uring_disconnect(td_uring_t *ring)
 }
 
 static int
-tapdisk_ring_read_message(int fd, td_uring_message_t *message, int timeout)
+tapdisk_uring_read_messages(td_uring_t *ring, int flags)
 {
-	fd_set readfds;
-	int ret, len, offset;
-	struct timeval tv, *t;
+	td_uring_message_t messages[TD_URING_KICKS_MAX];
+	ssize_t ret;
+	int i, n;
 
-	t      = NULL;
-	offset = 0;
-	len    = sizeof(td_uring_message_t);
+	ret = recv(ring->ctlfd, messages, sizeof(messages), flags);
+	if (ret == -1)
+		return errno == EAGAIN ? 0 : -errno;
+	if (!ret)
+		return -ECONNRESET;
 
-	if (timeout) {
-		tv.tv_sec  = timeout;
-		tv.tv_usec = 0;
-		t = &tv;
-	}
+	n = ret / sizeof(td_uring_message_t);
+	if (ret % sizeof(td_uring_message_t))
+		return -EPROTO;
 
-	while (offset < len) {
-		FD_ZERO(&readfds);
-		FD_SET(fd, &readfds);
+	for (i = 0; i < n; i++)
+		if (messages[i].type != TAPDISK_URING_MESSAGE_KICK)
+			return -EPROTO;
 
-		/* we don't bother reinitializing tv. at worst, it will wait a
-		 * bit more time than expected. */
+	return n;
+}
 
-		ret = select(fd + 1, &readfds, NULL, NULL, t);
-		if (ret == -1)
-			break;
-		else if (FD_ISSET(fd, &readfds)) {
-			ret = read(fd, message + offset, len - offset);
-			if (ret <= 0)
-				break;
-			offset += ret;
-		} else
-			break;
-	}
+/* the kicks received, without waiting */
+int
+tapdisk_uring_poll(td_uring_t *ring)
+{
+	int n, kicks = 0;
 
-	if (offset != len)
-		return -EIO;
+	do {
+		n = tapdisk_uring_read_messages(ring, MSG_DONTWAIT);
+		if (n < 0)
+			return n;
+		kicks += n;
+	} while (n == TD_URING_KICKS_MAX);
 
-	return 0;
+	return kicks;
 }
 
-static int
-tapdisk_ring_write_message(int fd, td_uring_message_t *message, int timeout)
+/* a full socket means the peer has kicks to read already */
+int
+tapdisk_uring_kick(td_uring_t *ring)
 {
-	fd_set writefds;
-	int ret, len, offset;
-	struct timeval tv, *t;
+	td_uring_message_t message;
+	ssize_t ret;
 
-	t      = NULL;
-	offset = 0;
-	len    = sizeof(td_uring_message_t);
+	if (ring->ctlfd < 0)
+		return -ENOTCONN;
 
-	if (timeout) {
-		tv.tv_sec  = timeout;
-		tv.tv_usec = 0;
-		t = &tv;
-	}
+	memset(&message, 0, sizeof(td_uring_message_t));
+	message.type = TAPDISK_URING_MESSAGE_KICK;
 
-	while (offset < len) {
-		FD_ZERO(&writefds);
-		FD_SET(fd, &writefds);
+	ret = send(ring->ctlfd, &message, sizeof(message),
+		   MSG_DONTWAIT | MSG_NOSIGNAL);
+	if (ret == -1)
+		return errno == EAGAIN ? 0 : -errno;
 
-		/* we don't bother reinitializing tv. at worst, it will wait a
-		 * bit more time than expected. */
+	return 0;
+}
 
-		ret = select(fd + 1, NULL, &writefds, NULL, t);
-		if (ret == -1)
-			break;
-		else if (FD_ISSET(fd, &writefds)) {
-			ret = write(fd, message + offset, len - offset);
-			if (ret <= 0)
-				break;
-			offset += ret;
-		} else
-			break;
-	}
+static uint64_t
+tapdisk_uring_now_us(void)
+{
+	struct timespec ts;
 
-	if (offset != len)
-		return -EIO;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
 
-	return 0;
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
 
+/*
+ * Client side: waits for responses, busy-polling spin_us first, then
+ * for kicks, up to timeout seconds (0: forever). 1 once there are.
+ */
 int
-tapdisk_uring_poll(td_uring_t *ring)
+tapdisk_uring_wait(td_uring_t *ring, unsigned int spin_us, int timeout)
 {
-	int err;
-	td_uring_message_t message;
+	struct timeval tv, *t;
+	uint64_t deadline;
+	fd_set readfds;
+	int ret;
+
+	if (spin_us) {
+		deadline = tapdisk_uring_now_us() + spin_us;
+		do {
+			if (__atomic_load_n(&ring->sring->rsp_prod,
+					    __ATOMIC_ACQUIRE) != ring->rsp_cons)
+				return 1;
+		} while (tapdisk_uring_now_us() < deadline);
+	}
 
-	err = tapdisk_uring_read_message(ring->ctlfd, &message, 1);
-	if (err)
-		return err;
+	t = NULL;
+	if (timeout) {
+		tv.tv_sec  = timeout;
+		tv.tv_usec = 0;
+		t = &tv;
+	}
 
-	if (message.type != TAPDISK_URING_MESSAGE_KICK)
-		return -EINVAL;
+	while (!tapdisk_uring_final_check_responses(ring)) {
+		FD_ZERO(&readfds);
+		FD_SET(ring->ctlfd, &readfds);
 
-	return 0;
-}
+		/* we don't bother reinitializing tv. at worst, it will wait a
+		 * bit more time than expected. */
 
-int
-tapdisk_uring_kick(td_uring_t *ring)
-{
-	td_uring_message_t message;
+		ret = select(ring->ctlfd + 1, &readfds, NULL, NULL, t);
+		if (ret == -1)
+			return -errno;
+		if (!ret)
+			return -ETIMEDOUT;
 
-	memset(&message, 0, sizeof(td_uring_message_t));
-	message.type = TAPDISK_URING_MESSAGE_KICK;
+		ret = tapdisk_uring_poll(ring);
+		if (ret < 0)
+			return ret;
+	}
 
-	return tapdisk_uring_write_message(ring->ctlfd, &message, 1);
+	return 1;
 }
@@ -1,4 +1,4 @@
-/* 
+/*
  * Copyright (C) Citrix Systems Inc.
  *
  * This program is free software; you can redistribute it and/or
@@ -18,60 +18,252 @@
 #ifndef _TAPDISK_RING_H_
 #define _TAPDISK_RING_H_
 
+#include <errno.h>
 #include <inttypes.h>
+#include <stddef.h>
 
-#include <xenctrl.h>
-#include <xen/io/ring.h>
+/*
+ * A request ring in shared memory, for userspace clients of a VBD.
+ *
+ * The server creates '<location>.shm': a header page, the shared
+ * indices, ring_size request and as many response slots, and a data
+ * area of data_size bytes, page aligned, which the client manages.
+ * It listens on '<location>.cfd' for the one client to map it.
+ *
+ * Both sides batch: slots are filled privately, then published at
+ * once by a push. Notifications follow the Xen ring protocol. Before
+ * it sleeps, a consumer sets the event index to the first index it
+ * wants to be kicked for, and a push only kicks past it, so a busy
+ * consumer costs its producer nothing. A consumer which busy-polls a
+ * while before setting it saves the kicks of a steady stream too.
+ * Kicks are messages on the control socket, which either side may
+ * read all at once.
+ *
+ * At most ring_size requests may be outstanding, the response of each
+ * is in the slot of the same index.
+ */
+
+#define TAPDISK_URING_COOKIE         "tdiskrng"
+#define TD_URING_CURRENT_VERSION     2
+
+#define TD_URING_PAGE_SIZE           4096
+#define TD_URING_MAX_SLOTS           4096    /* a power of 2 */
+
+#define TD_URING_OP_READ             0
+#define TD_URING_OP_WRITE            1
+#define TD_URING_OP_DISCARD          2
+#define TD_URING_OP_FLUSH            3
+
+#define TAPDISK_URING_MESSAGE_KICK   1
+
+typedef uint32_t                    td_uring_idx_t;
 
 typedef struct td_uring             td_uring_t;
 typedef struct td_uring_header      td_uring_header_t;
+typedef struct td_uring_sring       td_uring_sring_t;
 typedef struct td_uring_request     td_uring_request_t;
 typedef struct td_uring_response    td_uring_response_t;
-
-struct td_uring {
-	int                         ctlfd;
-
-	char                       *shmem_path;
-	char                       *ctlfd_path;
-
-	void                       *shmem;
-	void                       *ring_area;
-	void                       *data_area;
-};
+typedef struct td_uring_message     td_uring_message_t;
 
 struct td_uring_header {
 	char                        cookie[8];
 	uint32_t                    version;
 	uint32_t                    shmem_size;
-	uint32_t                    ring_size;
+	uint32_t                    ring_size;  /* slots */
 	uint32_t                    data_size;
-	char                        reserved[4064];
+	uint32_t                    data_offset;
+	char                        reserved[4068];
+};
+
+/* each side writes a cacheline of its own */
+struct td_uring_sring {
+	td_uring_idx_t              req_prod;
+	td_uring_idx_t              req_event;
+	char                        pad0[56];
+	td_uring_idx_t              rsp_prod;
+	td_uring_idx_t              rsp_event;
+	char                        pad1[56];
 };
 
 struct td_uring_request {
-	uint8_t                     op;
 	uint64_t                    id;
 	uint64_t                    sec;
 	uint32_t                    secs;
-	uint32_t                    offset;
+	uint32_t                    offset;     /* into the data area */
+	uint8_t                     op;         /* TD_URING_OP_* */
+	uint8_t                     pad[7];
 };
 
 struct td_uring_response {
-	uint8_t                     op;
 	uint64_t                    id;
-	uint8_t                     status;
+	int32_t                     status;     /* 0, or -errno */
+	uint8_t                     op;
+	uint8_t                     pad[3];
 };
 
-DEFINE_RING_TYPES(td_uring, td_uring_request_t, td_uring_response_t);
+struct td_uring_message {
+	uint32_t                    type;
+};
+
+struct td_uring {
+	int                         ctlfd;
+	int                         listenfd;
+
+	char                       *shmem_path;
+	char                       *ctlfd_path;
+
+	void                       *shmem;
+	size_t                      shmem_size;
+	uint32_t                    ring_size;
+	uint32_t                    data_size;
+
+	td_uring_sring_t           *sring;
+	td_uring_request_t         *reqs;
+	td_uring_response_t        *rsps;
+	void                       *data_area;
+
+	/* client */
+	td_uring_idx_t              req_prod_pvt;
+	td_uring_idx_t              rsp_cons;
+
+	/* server */
+	td_uring_idx_t              req_cons;
+	td_uring_idx_t              rsp_prod_pvt;
+};
 
 int tapdisk_uring_create(td_uring_t *, const char *location,
 			uint32_t ring_size, uint32_t data_size);
 int tapdisk_uring_destroy(td_uring_t *);
+int tapdisk_uring_accept(td_uring_t *);
+void tapdisk_uring_hangup(td_uring_t *);
+void tapdisk_uring_reset(td_uring_t *);
 
 int tapdisk_uring_connect(td_uring_t *, const char *location);
 int tapdisk_uring_disconnect(td_uring_t *);
 
 int tapdisk_uring_poll(td_uring_t *);
 int tapdisk_uring_kick(td_uring_t *);
+int tapdisk_uring_wait(td_uring_t *, unsigned int spin_us, int timeout);
+
+static inline void
+__tapdisk_uring_push(td_uring_t *ring, td_uring_idx_t *prod,
+		     td_uring_idx_t *event, td_uring_idx_t new)
+{
+	td_uring_idx_t old;
+
+	old = *prod;
+	if (old == new)
+		return;
+
+	__atomic_store_n(prod, new, __ATOMIC_RELEASE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	if ((td_uring_idx_t)(new - __atomic_load_n(event, __ATOMIC_RELAXED)) <
+	    (td_uring_idx_t)(new - old))
+		tapdisk_uring_kick(ring);
+}
+
+/* 1 if there is more past cons, else the event index is set */
+static inline int
+__tapdisk_uring_final_check(td_uring_idx_t *prod, td_uring_idx_t *event,
+			    td_uring_idx_t cons)
+{
+	if (__atomic_load_n(prod, __ATOMIC_ACQUIRE) != cons)
+		return 1;
+
+	__atomic_store_n(event, cons + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	return __atomic_load_n(prod, __ATOMIC_ACQUIRE) != cons;
+}
+
+/*
+ * Client side: new slots to fill, up to ring_size outstanding, go to
+ * the server by a push. Responses are copied out, their slots reused.
+ */
+
+static inline td_uring_request_t *
+tapdisk_uring_new_request(td_uring_t *ring)
+{
+	if ((td_uring_idx_t)(ring->req_prod_pvt - ring->rsp_cons) >=
+	    ring->ring_size)
+		return NULL;
+
+	return &ring->reqs[ring->req_prod_pvt++ & (ring->ring_size - 1)];
+}
+
+static inline void
+tapdisk_uring_push_requests(td_uring_t *ring)
+{
+	__tapdisk_uring_push(ring, &ring->sring->req_prod,
+			     &ring->sring->req_event, ring->req_prod_pvt);
+}
+
+static inline int
+tapdisk_uring_get_response(td_uring_t *ring, td_uring_response_t *rsp)
+{
+	td_uring_idx_t prod;
+
+	prod = __atomic_load_n(&ring->sring->rsp_prod, __ATOMIC_ACQUIRE);
+	if (prod == ring->rsp_cons)
+		return 0;
+
+	if ((td_uring_idx_t)(prod - ring->rsp_cons) >
+	    (td_uring_idx_t)(ring->req_prod_pvt - ring->rsp_cons))
+		return -EPROTO;
+
+	*rsp = ring->rsps[ring->rsp_cons++ & (ring->ring_size - 1)];
+	return 1;
+}
+
+static inline int
+tapdisk_uring_final_check_responses(td_uring_t *ring)
+{
+	return __tapdisk_uring_final_check(&ring->sring->rsp_prod,
+					   &ring->sring->rsp_event,
+					   ring->rsp_cons);
+}
+
+/*
+ * Server side: requests are copied out, clients are not trusted with
+ * them meanwhile. Responses go to private slots, up to a push.
+ */
+
+static inline int
+tapdisk_uring_get_request(td_uring_t *ring, td_uring_request_t *req)
+{
+	td_uring_idx_t prod;
+
+	prod = __atomic_load_n(&ring->sring->req_prod, __ATOMIC_ACQUIRE);
+	if (prod == ring->req_cons)
+		return 0;
+
+	if ((td_uring_idx_t)(prod - ring->rsp_prod_pvt) > ring->ring_size)
+		return -EPROTO;
+
+	*req = ring->reqs[ring->req_cons++ & (ring->ring_size - 1)];
+	return 1;
+}
+
+static inline int
+tapdisk_uring_final_check_requests(td_uring_t *ring)
+{
+	return __tapdisk_uring_final_check(&ring->sring->req_prod,
+					   &ring->sring->req_event,
+					   ring->req_cons);
+}
+
+static inline td_uring_response_t *
+tapdisk_uring_new_response(td_uring_t *ring)
+{
+	return &ring->rsps[ring->rsp_prod_pvt++ & (ring->ring_size - 1)];
+}
+
+static inline void
+tapdisk_uring_push_responses(td_uring_t *ring)
+{
+	__tapdisk_uring_push(ring, &ring->sring->rsp_prod,
+			     &ring->sring->rsp_event, ring->rsp_prod_pvt);
+}
 
 #endif
@@ -0,0 +1,495 @@
+/*
+ * Copyright (C) Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2.1 only
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "tapdisk.h"
+#include "tapdisk-server.h"
+#include "tapdisk-ringserver.h"
+#include "profile.h"
+
+#define INFO(_f, _a...)      tlog_syslog(TLOG_INFO, "ring: " _f, ##_a)
+#define ERR(_err, _f, _a...) tlog_error(_err, "ring: " _f, ##_a)
+
+/* busy-poll window bounds, in usecs */
+#define TD_RINGSERVER_POLL_MIN_US   5
+#define TD_RINGSERVER_POLL_MAX_US   10000
+
+static void tapdisk_ringserver_disconnect(td_ringserver_t *);
+static void tapdisk_ringserver_get_requests(td_ringserver_t *, int arm);
+
+static inline int
+tapdisk_ringserver_pending(td_ringserver_t *s)
+{
+	return s->n_reqs - s->n_reqs_free;
+}
+
+static void
+tapdisk_ringserver_release(td_ringserver_t *s)
+{
+	tapdisk_uring_destroy(&s->ring);
+	free(s->reqs_free);
+	free(s->reqs);
+	free(s);
+}
+
+static void
+tapdisk_ringserver_free_request(td_ringserver_t *s, td_ringserver_req_t *req)
+{
+	s->reqs_free[s->n_reqs_free++] = req;
+}
+
+static void
+tapdisk_ringserver_put_response(td_ringserver_t *s, uint64_t id, int op,
+				int error)
+{
+	td_uring_response_t *rsp;
+
+	rsp = tapdisk_uring_new_response(&s->ring);
+	rsp->id     = id;
+	rsp->op     = op;
+	rsp->status = error > 0 ? -error : error;
+
+	s->stats.reqs.out++;
+}
+
+/* the previous client's requests are all in, a new one may connect */
+static void
+tapdisk_ringserver_drained(td_ringserver_t *s)
+{
+	tapdisk_uring_reset(&s->ring);
+	tapdisk_server_mask_event(s->listen_event, 0);
+}
+
+static void
+tapdisk_ringserver_request_cb(td_vbd_request_t *vreq, int error,
+			      void *token, int final)
+{
+	td_ringserver_req_t *req =
+		containerof(vreq, td_ringserver_req_t, vreq);
+	td_ringserver_t *s = token;
+
+	td_trace(respond, vreq, vreq->op, vreq->sec, 0, error);
+
+	if (s->ring.ctlfd >= 0)
+		tapdisk_ringserver_put_response(s, req->id, req->op, error);
+
+	tapdisk_ringserver_free_request(s, req);
+
+	if (s->ring.ctlfd >= 0) {
+		if (final)
+			tapdisk_uring_push_responses(&s->ring);
+		return;
+	}
+
+	if (tapdisk_ringserver_pending(s))
+		return;
+
+	if (s->dead)
+		tapdisk_ringserver_release(s);
+	else
+		tapdisk_ringserver_drained(s);
+}
+
+static int
+tapdisk_ringserver_parse_request(td_ringserver_t *s,
+				 const td_uring_request_t *msg,
+				 td_ringserver_req_t *req)
+{
+	td_vbd_request_t *vreq = &req->vreq;
+	uint64_t len;
+
+	memset(vreq, 0, sizeof(*vreq));
+	vreq->name  = req->name;
+	vreq->token = s;
+	vreq->cb    = tapdisk_ringserver_request_cb;
+	vreq->iov   = &req->iov;
+
+	req->id = msg->id;
+	req->op = msg->op;
+
+	switch (msg->op) {
+	case TD_URING_OP_FLUSH:
+		vreq->op     = TD_OP_FLUSH;
+		vreq->iovcnt = 0;
+		return 0;
+	case TD_URING_OP_READ:
+		vreq->op = TD_OP_READ;
+		break;
+	case TD_URING_OP_WRITE:
+		vreq->op = TD_OP_WRITE;
+		break;
+	case TD_URING_OP_DISCARD:
+		vreq->op = TD_OP_DISCARD;
+		break;
+	default:
+		return -EOPNOTSUPP;
+	}
+
+	if (!msg->secs || msg->secs > s->secs || msg->sec > s->secs - msg->secs)
+		return -EINVAL;
+
+	vreq->sec    = msg->sec;
+	vreq->iovcnt = 1;
+
+	req->iov.secs = msg->secs;
+	req->iov.base = NULL;
+
+	if (vreq->op == TD_OP_DISCARD)
+		return 0;
+
+	len = (uint64_t)msg->secs << SECTOR_SHIFT;
+	if (msg->offset & ((1 << SECTOR_SHIFT) - 1) ||
+	    msg->offset > s->ring.data_size ||
+	    len > s->ring.data_size - msg->offset)
+		return -EINVAL;
+
+	req->iov.base = s->ring.data_area + msg->offset;
+
+	return 0;
+}
+
+/*
+ * Takes the requests in the ring, till the free slots run out. With
+ * @arm, leaves the event index set for the next, else a poll will
+ * look again.
+ */
+static void
+tapdisk_ringserver_get_requests(td_ringserver_t *s, int arm)
+{
+	td_uring_request_t msg;
+	td_ringserver_req_t *req;
+	int n, err, failed = 0;
+
+	while (s->n_reqs_free) {
+		n = tapdisk_uring_get_request(&s->ring, &msg);
+		if (!n) {
+			if (!arm || !tapdisk_uring_final_check_requests(&s->ring))
+				break;
+			continue;
+		}
+
+		if (n < 0) {
+			ERR(n, "ring error, disconnecting.");
+			tapdisk_ringserver_disconnect(s);
+			return;
+		}
+
+		s->stats.reqs.in++;
+
+		req = s->reqs_free[--s->n_reqs_free];
+
+		err = tapdisk_ringserver_parse_request(s, &msg, req);
+		if (!err) {
+			err = tapdisk_vbd_queue_request(s->vbd, &req->vreq);
+			if (!err)
+				continue;
+		}
+
+		tapdisk_ringserver_put_response(s, msg.id, msg.op, err);
+		tapdisk_ringserver_free_request(s, req);
+		failed++;
+	}
+
+	if (failed)
+		tapdisk_uring_push_responses(&s->ring);
+}
+
+static uint64_t
+tapdisk_ringserver_now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void
+tapdisk_ringserver_poll_stop(td_ringserver_t *s)
+{
+	if (s->poll_event >= 0) {
+		tapdisk_server_unregister_event(s->poll_event);
+		s->poll_event = -1;
+	}
+}
+
+static void tapdisk_ringserver_poll_event(event_id_t, char, void *);
+
+static void
+tapdisk_ringserver_poll_start(td_ringserver_t *s)
+{
+	event_id_t id;
+
+	s->poll_deadline = tapdisk_ringserver_now_us() + s->poll_us;
+
+	if (s->poll_event >= 0)
+		return;
+
+	id = tapdisk_server_register_event(SCHEDULER_POLL_TIMEOUT,
+					   -1, 0,
+					   tapdisk_ringserver_poll_event, s);
+	if (id < 0) {
+		ERR(id, "poll event");
+		return;
+	}
+
+	s->poll_event = id;
+}
+
+static int
+tapdisk_ringserver_ring_pending(td_ringserver_t *s)
+{
+	return __atomic_load_n(&s->ring.sring->req_prod, __ATOMIC_ACQUIRE) !=
+		s->ring.req_cons;
+}
+
+/* like blktap's: hits double the window, an idle one halves it */
+static void
+tapdisk_ringserver_poll_event(event_id_t id, char mode, void *data)
+{
+	td_ringserver_t *s = data;
+
+	if (tapdisk_ringserver_ring_pending(s)) {
+		s->stats.poll.hits++;
+
+		s->poll_us = s->poll_us * 2;
+		if (s->poll_us > s->poll_max_us)
+			s->poll_us = s->poll_max_us;
+
+		tapdisk_ringserver_get_requests(s, 0);
+		if (s->ring.ctlfd >= 0)
+			tapdisk_ringserver_poll_start(s);
+		return;
+	}
+
+	if (tapdisk_ringserver_now_us() < s->poll_deadline)
+		return;
+
+	s->stats.poll.idle++;
+
+	s->poll_us = s->poll_us / 2;
+	if (s->poll_us < TD_RINGSERVER_POLL_MIN_US)
+		s->poll_us = TD_RINGSERVER_POLL_MIN_US;
+
+	tapdisk_ringserver_poll_stop(s);
+
+	/* back to kicks, minding what came meanwhile */
+	tapdisk_ringserver_get_requests(s, 1);
+}
+
+static void
+tapdisk_ringserver_ctl_event(event_id_t id, char mode, void *data)
+{
+	td_ringserver_t *s = data;
+	td_uring_idx_t cons = s->ring.req_cons;
+	int kicks;
+
+	kicks = tapdisk_uring_poll(&s->ring);
+	if (kicks < 0) {
+		if (kicks != -ECONNRESET)
+			ERR(kicks, "control socket");
+		tapdisk_ringserver_disconnect(s);
+		return;
+	}
+
+	s->stats.kicks.in += kicks;
+
+	if (s->poll_event >= 0)
+		return;
+
+	tapdisk_ringserver_get_requests(s, !s->poll_max_us);
+
+	if (s->poll_max_us && s->ring.ctlfd >= 0) {
+		if (s->ring.req_cons != cons)
+			tapdisk_ringserver_poll_start(s);
+		else
+			tapdisk_ringserver_get_requests(s, 1);
+	}
+}
+
+static void
+tapdisk_ringserver_disconnect(td_ringserver_t *s)
+{
+	if (s->ctl_event >= 0) {
+		tapdisk_server_unregister_event(s->ctl_event);
+		s->ctl_event = -1;
+	}
+
+	tapdisk_ringserver_poll_stop(s);
+
+	if (s->ring.ctlfd < 0)
+		return;
+
+	tapdisk_uring_hangup(&s->ring);
+	INFO("client gone, %d requests pending\n",
+	     tapdisk_ringserver_pending(s));
+
+	if (!tapdisk_ringserver_pending(s))
+		tapdisk_ringserver_drained(s);
+}
+
+static void
+tapdisk_ringserver_listen_event(event_id_t id, char mode, void *data)
+{
+	td_ringserver_t *s = data;
+	event_id_t ctl;
+	int err;
+
+	err = tapdisk_uring_accept(&s->ring);
+	if (err) {
+		if (err != -EAGAIN)
+			ERR(err, "accept");
+		return;
+	}
+
+	ctl = tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
+					    s->ring.ctlfd, 0,
+					    tapdisk_ringserver_ctl_event, s);
+	if (ctl < 0) {
+		ERR(ctl, "control event");
+		tapdisk_uring_hangup(&s->ring);
+		return;
+	}
+
+	s->ctl_event = ctl;
+	s->stats.clients++;
+
+	/* one client at a time, the next waits in the backlog */
+	tapdisk_server_mask_event(s->listen_event, 1);
+
+	INFO("client connected\n");
+}
+
+int
+tapdisk_ringserver_create(td_vbd_t *vbd, const char *location,
+			  uint32_t slots, uint32_t data_size,
+			  unsigned int poll_us, td_ringserver_t **_s)
+{
+	td_ringserver_t *s;
+	td_disk_info_t info;
+	int i, err;
+
+	if (poll_us && (poll_us < TD_RINGSERVER_POLL_MIN_US ||
+			poll_us > TD_RINGSERVER_POLL_MAX_US))
+		return -EINVAL;
+
+	err = tapdisk_vbd_get_disk_info(vbd, &info);
+	if (err)
+		return err;
+
+	s = calloc(1, sizeof(*s));
+	if (!s)
+		return -ENOMEM;
+
+	s->vbd          = vbd;
+	s->secs         = info.size;
+	s->listen_event = -1;
+	s->ctl_event    = -1;
+	s->poll_event   = -1;
+	s->poll_max_us  = poll_us;
+	s->poll_us      = poll_us;
+
+	err = tapdisk_uring_create(&s->ring, location, slots, data_size);
+	if (err) {
+		free(s);
+		return err;
+	}
+
+	err = -ENOMEM;
+	s->reqs      = calloc(slots, sizeof(td_ringserver_req_t));
+	s->reqs_free = calloc(slots, sizeof(td_ringserver_req_t *));
+	if (!s->reqs || !s->reqs_free)
+		goto fail;
+
+	s->n_reqs = slots;
+	for (i = 0; i < slots; i++) {
+		snprintf(s->reqs[i].name, sizeof(s->reqs[i].name),
+			 "ring.%d", i);
+		s->reqs_free[s->n_reqs_free++] = &s->reqs[i];
+	}
+
+	s->listen_event =
+		tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
+					      s->ring.listenfd, 0,
+					      tapdisk_ringserver_listen_event,
+					      s);
+	if (s->listen_event < 0) {
+		err = s->listen_event;
+		goto fail;
+	}
+
+	INFO("%s: %u slots, %u bytes of data, polling up to %uus\n",
+	     location, slots, data_size, poll_us);
+
+	*_s = s;
+	return 0;
+
+fail:
+	tapdisk_ringserver_release(s);
+	return err;
+}
+
+/* the shared area stays till the requests in flight completed */
+void
+tapdisk_ringserver_free(td_ringserver_t *s)
+{
+	if (s->listen_event >= 0) {
+		tapdisk_server_unregister_event(s->listen_event);
+		s->listen_event = -1;
+	}
+
+	tapdisk_ringserver_disconnect(s);
+
+	if (tapdisk_ringserver_pending(s)) {
+		s->dead = 1;
+		return;
+	}
+
+	tapdisk_ringserver_release(s);
+}
+
+void
+tapdisk_ringserver_stats(td_ringserver_t *s, td_stats_t *st)
+{
+	tapdisk_stats_field(st, "slots", "u", s->ring.ring_size);
+	tapdisk_stats_field(st, "data", "u", s->ring.data_size);
+	tapdisk_stats_field(st, "clients", "llu", s->stats.clients);
+	tapdisk_stats_field(st, "connected", "d", s->ring.ctlfd >= 0);
+
+	tapdisk_stats_field(st, "reqs", "[");
+	tapdisk_stats_val(st, "llu", s->stats.reqs.in);
+	tapdisk_stats_val(st, "llu", s->stats.reqs.out);
+	tapdisk_stats_leave(st, ']');
+
+	tapdisk_stats_field(st, "kicks", "llu", s->stats.kicks.in);
+
+	tapdisk_stats_field(st, "poll", "{");
+	tapdisk_stats_field(st, "max_us", "u", s->poll_max_us);
+	tapdisk_stats_field(st, "window_us", "u", s->poll_us);
+	tapdisk_stats_field(st, "hits", "llu", s->stats.poll.hits);
+	tapdisk_stats_field(st, "idle", "llu", s->stats.poll.idle);
+	tapdisk_stats_leave(st, '}');
+}
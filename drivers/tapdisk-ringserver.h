@@ -0,0 +1,86 @@
+/*
+ * Copyright (C) Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2.1 only
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef _TAPDISK_RINGSERVER_H_
+#define _TAPDISK_RINGSERVER_H_
+
+typedef struct td_ringserver td_ringserver_t;
+typedef struct td_ringserver_req td_ringserver_req_t;
+
+#include "tapdisk-vbd.h"
+#include "tapdisk-ring.h"
+#include "tapdisk-stats.h"
+
+/*
+ * Serves a VBD to a userspace client over a tapdisk-ring, payloads in
+ * place in its data area. Requests are taken in batches, their
+ * responses pushed once per batch the VBD completes. After new
+ * requests, the ring is busy-polled the way blktap rings are.
+ */
+
+struct td_ringserver_stats {
+	struct {
+		unsigned long long      in;
+		unsigned long long      out;
+	} reqs;
+	struct {
+		unsigned long long      in;
+	} kicks;
+	struct {
+		unsigned long long      hits;
+		unsigned long long      idle;
+	} poll;
+	unsigned long long              clients;
+};
+
+struct td_ringserver_req {
+	td_vbd_request_t        vreq;
+	struct td_iovec         iov;
+	uint64_t                id;
+	uint8_t                 op;
+	char                    name[16];
+};
+
+struct td_ringserver {
+	td_vbd_t               *vbd;
+	td_uring_t              ring;
+	td_sector_t             secs;
+
+	event_id_t              listen_event;
+	event_id_t              ctl_event;
+	int                     dead;
+
+	event_id_t              poll_event;
+	unsigned int            poll_max_us;
+	unsigned int            poll_us;
+	uint64_t                poll_deadline;
+
+	int                     n_reqs;
+	td_ringserver_req_t    *reqs;
+	int                     n_reqs_free;
+	td_ringserver_req_t   **reqs_free;
+
+	struct td_ringserver_stats stats;
+};
+
+int tapdisk_ringserver_create(td_vbd_t *, const char *location,
+			      uint32_t slots, uint32_t data_size,
+			      unsigned int poll_us, td_ringserver_t **);
+void tapdisk_ringserver_free(td_ringserver_t *);
+void tapdisk_ringserver_stats(td_ringserver_t *, td_stats_t *);
+
+#endif
@@ -21,36 +21,147 @@
 
 #include <stdio.h>
 #include <errno.h>
+#include <sched.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
 #include <sys/ioctl.h>
 #include <sys/signal.h>
+#include <sys/syscall.h>
 
 #include "tapdisk-syslog.h"
 #include "tapdisk-server.h"
 #include "tapdisk-driver.h"
 #include "tapdisk-interface.h"
 #include "tapdisk-log.h"
+#include "tapdisk-metrics.h"
+#include "tapdisk-filter.h"
+#include "libaio-compat.h"
 
 #define DBG(_level, _f, _a...)       tlog_write(_level, _f, ##_a)
 #define ERR(_err, _f, _a...)         tlog_error(_err, _f, ##_a)
 
 #define TAPDISK_TIOCBS              (TAPDISK_DATA_REQUESTS + 50)
+#define TAPDISK_MAX_WORKERS         64
+
+#define TAPDISK_MPOL_PREFERRED      1
+#define TAPDISK_NUMA_NODES_MAX      1024
+
+#define TAPDISK_HOLD_MAX_US         50
+#define TAPDISK_HOLD_MIN_US         4
+#define TAPDISK_HOLD_BATCH          8
+#define TAPDISK_HOLD_PROBE          64
+
+/*
+ * Event loops. The main loop runs the control plane, and all VBDs
+ * unless worker loops were asked for. Each worker is a thread with its
+ * own scheduler, AIO queue and VBD list, pinned to a CPU. A VBD stays on
+ * the loop it was attached on, and everything it registers goes to
+ * that loop.
+ *
+ * Nothing on the request path is shared between loops. Control
+ * messages run on the main thread; one touching a worker's VBD first
+ * parks that worker in its doorbell callback (tapdisk_server_enter),
+ * then runs against the worker's loop, iterating it if need be, and
+ * lets it go again. The lock only guards the loop's VBD list against
+ * lookups from the main thread, and parking.
+ *
+ * Drivers whose I/O profile differs from the server's get a queue of
+ * its own kind, one per kind on the loop, shared by its drivers. With
+ * TD_IO_QUEUE_VBD, the queue is also the vbd's own, so a busy disk
+ * fills its own ring and defers its own tiocbs, not its neighbours'.
+ * Queues take turns going first at submission.
+ *
+ * All VBDs of a loop submit together, once per iteration. With several
+ * VBDs on a loop, a shallow batch is held back while the queues still
+ * have I/O in flight, busy-polling for up to hold.us, so that what
+ * other VBDs queue meanwhile goes in the same submission. A hold the
+ * batch grew in doubles the window, up to the server's hold_max_us; a
+ * wasted one halves it, down to nothing, and every TAPDISK_HOLD_PROBE
+ * submissions after that one window of TAPDISK_HOLD_MIN_US is tried
+ * again. Idle queues are never held: nothing would come back first to
+ * hide the wait behind.
+ */
+struct tapdisk_loop {
+	scheduler_t                  scheduler;
+	struct tqueue                aio_queue;
+	int                          aio_drv;
+	struct list_head             queues;
+	unsigned int                 tio_failed;	/* 1 << drv */
+	struct list_head             vbds;
+
+	pthread_t                    thread;
+	pthread_mutex_t              lock;
+	pthread_cond_t               cond;
+	int                          doorbell;
+	event_id_t                   doorbell_event;
+	int                          park;
+	int                          parked;
+	int                          stop;
+	volatile sig_atomic_t        signal;
+
+	struct {
+		unsigned int         us;
+		uint64_t             deadline;
+		int                  queued;	/* when the hold began */
+		unsigned int         skipped;	/* since us went 0 */
+		uint64_t             holds;
+		uint64_t             hits;
+	} hold;
+};
 
 typedef struct tapdisk_server {
 	int                          run;
-	struct list_head             vbds;
-	scheduler_t                  scheduler;
-	struct tqueue                aio_queue;
+	struct tapdisk_loop          main;
+	struct tapdisk_loop         *workers;
+	int                          n_workers;
+	int                          next_worker;
+	int                          tio_drv;
+	int                          filter;
 	char                        *name;
 	char                        *ident;
 	int                          facility;
+	int                          numa_node;
+	cpu_set_t                    numa_cpus;
+	cpu_set_t                    loop_cpus;	/* -c, empty if unset */
+	cpu_set_t                    helper_cpus;	/* -T, empty if unset */
+	unsigned int                 hold_max_us;
 } tapdisk_server_t;
 
 static tapdisk_server_t server;
 
+struct tapdisk_profile_queue {
+	struct tqueue                queue;
+	int                          drv;
+	int                          depth;
+	int                          merge;
+	const void                  *owner;	/* TD_IO_QUEUE_VBD */
+	int                          users;
+	struct list_head             next;
+};
+
+#define tapdisk_loop_for_each_queue(loop, pq, tmp)			\
+	list_for_each_entry_safe(pq, tmp, &(loop)->queues, next)
+
+/* the loop this thread runs, or the main thread runs for now */
+static __thread struct tapdisk_loop *td_loop;
+static __thread struct tapdisk_loop *td_self;
+
+#define tapdisk_server_loop()   (td_loop ? : &server.main)
+
+#define tapdisk_server_for_each_loop(loop, i)			        \
+	for (i = -1, loop = &server.main; i < server.n_workers;	\
+	     loop = &server.workers[++i])
+
+#define tapdisk_loop_for_each_vbd(loop, vbd, tmp)			\
+	list_for_each_entry_safe(vbd, tmp, &(loop)->vbds, next)
+
 #define tapdisk_server_for_each_vbd(vbd, tmp)			        \
-	list_for_each_entry_safe(vbd, tmp, &server.vbds, next)
+	tapdisk_loop_for_each_vbd(tapdisk_server_loop(), vbd, tmp)
+
+static void tapdisk_server_signal(struct tapdisk_loop *, int);
 
 td_image_t *
 tapdisk_server_get_shared_image(td_image_t *image)
@@ -61,6 +172,7 @@ tapdisk_server_get_shared_image(td_image_t *image)
 	if (!td_flag_test(image->flags, TD_OPEN_SHAREABLE))
 		return NULL;
 
+	/* only VBDs on the same loop share an image */
 	tapdisk_server_for_each_vbd(vbd, tmpv)
 		tapdisk_vbd_for_each_image(vbd, img, tmpi)
 			if (img->type == image->type &&
@@ -73,86 +185,322 @@ tapdisk_server_get_shared_image(td_image_t *image)
 struct list_head *
 tapdisk_server_get_all_vbds(void)
 {
-	return &server.vbds;
+	return &tapdisk_server_loop()->vbds;
 }
 
-td_vbd_t *
-tapdisk_server_get_vbd(uint16_t uuid)
+static td_vbd_t *
+tapdisk_loop_get_vbd(struct tapdisk_loop *loop, uint16_t uuid)
 {
 	td_vbd_t *vbd, *tmp;
 
-	tapdisk_server_for_each_vbd(vbd, tmp)
+	tapdisk_loop_for_each_vbd(loop, vbd, tmp)
 		if (vbd->uuid == uuid)
 			return vbd;
 
 	return NULL;
 }
 
+static struct tapdisk_loop *
+tapdisk_server_find_vbd(uint16_t uuid, td_vbd_t **_vbd)
+{
+	struct tapdisk_loop *loop;
+	td_vbd_t *vbd;
+	int i;
+
+	tapdisk_server_for_each_loop(loop, i) {
+		pthread_mutex_lock(&loop->lock);
+		vbd = tapdisk_loop_get_vbd(loop, uuid);
+		pthread_mutex_unlock(&loop->lock);
+
+		if (vbd) {
+			if (_vbd)
+				*_vbd = vbd;
+			return loop;
+		}
+	}
+
+	return NULL;
+}
+
+td_vbd_t *
+tapdisk_server_get_vbd(uint16_t uuid)
+{
+	td_vbd_t *vbd = NULL;
+
+	tapdisk_server_find_vbd(uuid, &vbd);
+
+	return vbd;
+}
+
 void
 tapdisk_server_add_vbd(td_vbd_t *vbd)
 {
-	list_add_tail(&vbd->next, &server.vbds);
+	struct tapdisk_loop *loop = tapdisk_server_loop();
+
+	pthread_mutex_lock(&loop->lock);
+	list_add_tail(&vbd->next, &loop->vbds);
+	pthread_mutex_unlock(&loop->lock);
 }
 
 void
 tapdisk_server_remove_vbd(td_vbd_t *vbd)
 {
+	struct tapdisk_loop *loop = tapdisk_server_loop();
+
+	pthread_mutex_lock(&loop->lock);
 	list_del(&vbd->next);
 	INIT_LIST_HEAD(&vbd->next);
+	pthread_mutex_unlock(&loop->lock);
+
 	tapdisk_server_check_state();
 }
 
 void
 tapdisk_server_queue_tiocb(struct tiocb *tiocb)
 {
-	tapdisk_queue_tiocb(&server.aio_queue, tiocb);
+	tapdisk_queue_tiocb(&tapdisk_server_loop()->aio_queue, tiocb);
 }
 
-void
-tapdisk_server_debug(void)
+static void
+tapdisk_loop_debug(struct tapdisk_loop *loop)
 {
+	struct tapdisk_profile_queue *pq, *tpq;
 	td_vbd_t *vbd, *tmp;
 
-	tapdisk_debug_queue(&server.aio_queue);
+	tapdisk_debug_queue(&loop->aio_queue);
+	tapdisk_loop_for_each_queue(loop, pq, tpq)
+		tapdisk_debug_queue(&pq->queue);
 
-	tapdisk_server_for_each_vbd(vbd, tmp)
+	DBG(TLOG_INFO, "hold: %uus, holds: %"PRIu64", hits: %"PRIu64"\n",
+	    loop->hold.us, loop->hold.holds, loop->hold.hits);
+
+	tapdisk_loop_for_each_vbd(loop, vbd, tmp)
 		tapdisk_vbd_debug(vbd);
+}
+
+void
+tapdisk_server_debug(void)
+{
+	tapdisk_loop_debug(&server.main);
 
 	DBG(TLOG_INFO, "debug log completed\n");
 	tlog_precious(1);
 }
 
+static void
+tapdisk_loop_kick(struct tapdisk_loop *loop)
+{
+	uint64_t val = 1;
+	int gcc = write(loop->doorbell, &val, sizeof(val));
+	if (gcc) {};
+}
+
 void
 tapdisk_server_check_state(void)
 {
-	if (list_empty(&server.vbds))
+	struct tapdisk_loop *loop;
+	int i, empty = 1;
+
+	tapdisk_server_for_each_loop(loop, i) {
+		pthread_mutex_lock(&loop->lock);
+		empty &= list_empty(&loop->vbds);
+		pthread_mutex_unlock(&loop->lock);
+	}
+
+	if (empty) {
 		server.run = 0;
+		if (td_self)
+			tapdisk_loop_kick(&server.main);
+	}
 }
 
 event_id_t
 tapdisk_server_register_event(char mode, int fd,
 			      int timeout, event_cb_t cb, void *data)
 {
-	return scheduler_register_event(&server.scheduler,
+	return scheduler_register_event(&tapdisk_server_loop()->scheduler,
 					mode, fd, timeout, cb, data);
 }
 
 void
 tapdisk_server_unregister_event(event_id_t event)
 {
-	return scheduler_unregister_event(&server.scheduler, event);
+	return scheduler_unregister_event(&tapdisk_server_loop()->scheduler,
+					  event);
 }
 
 void
 tapdisk_server_mask_event(event_id_t event, int masked)
 {
-	return scheduler_mask_event(&server.scheduler, event, masked);
+	return scheduler_mask_event(&tapdisk_server_loop()->scheduler,
+				    event, masked);
 }
 
 void
 tapdisk_server_set_max_timeout(int seconds)
 {
-	scheduler_set_max_timeout(&server.scheduler, seconds);
+	scheduler_set_max_timeout(&tapdisk_server_loop()->scheduler,
+				  seconds);
+}
+
+/*
+ * Control plane events (control socket, syslog) live on the main loop,
+ * whichever loop a control message is working on at the time.
+ */
+event_id_t
+tapdisk_server_register_main_event(char mode, int fd,
+				   int timeout, event_cb_t cb, void *data)
+{
+	return scheduler_register_event(&server.main.scheduler,
+					mode, fd, timeout, cb, data);
+}
+
+void
+tapdisk_server_unregister_main_event(event_id_t event)
+{
+	return scheduler_unregister_event(&server.main.scheduler, event);
+}
+
+void
+tapdisk_server_mask_main_event(event_id_t event, int masked)
+{
+	return scheduler_mask_event(&server.main.scheduler, event, masked);
+}
+
+int
+tapdisk_server_main_thread(void)
+{
+	return !server.main.thread ||
+		pthread_equal(pthread_self(), server.main.thread);
+}
+
+/* Park the worker running loop, so the main thread can work on it. */
+static void
+tapdisk_server_enter(struct tapdisk_loop *loop)
+{
+	if (loop != &server.main) {
+		pthread_mutex_lock(&loop->lock);
+		loop->park++;
+		tapdisk_loop_kick(loop);
+		while (!loop->parked)
+			pthread_cond_wait(&loop->cond, &loop->lock);
+		pthread_mutex_unlock(&loop->lock);
+	}
+
+	td_loop = loop;
+}
+
+static void
+tapdisk_server_leave(struct tapdisk_loop *loop)
+{
+	td_loop = NULL;
+
+	if (loop != &server.main) {
+		pthread_mutex_lock(&loop->lock);
+		loop->park--;
+		pthread_cond_broadcast(&loop->cond);
+		pthread_mutex_unlock(&loop->lock);
+	}
+}
+
+int
+tapdisk_server_enter_vbd(td_uuid_t uuid)
+{
+	struct tapdisk_loop *loop = tapdisk_server_find_vbd(uuid, NULL);
+
+	if (!loop)
+		return -ENODEV;
+
+	tapdisk_server_enter(loop);
+
+	return 0;
+}
+
+/* New VBDs go round-robin on the workers, or the main loop if none. */
+void
+tapdisk_server_enter_new_vbd(void)
+{
+	struct tapdisk_loop *loop = &server.main;
+
+	if (server.n_workers) {
+		loop = &server.workers[server.next_worker];
+		server.next_worker = (server.next_worker + 1) % server.n_workers;
+	}
+
+	tapdisk_server_enter(loop);
+}
+
+void
+tapdisk_server_enter_all(void)
+{
+	struct tapdisk_loop *loop;
+	int i;
+
+	tapdisk_server_for_each_loop(loop, i)
+		if (loop != &server.main)
+			tapdisk_server_enter(loop);
+
+	td_loop = NULL;
+}
+
+void
+tapdisk_server_leave_all(void)
+{
+	struct tapdisk_loop *loop;
+	int i;
+
+	tapdisk_server_for_each_loop(loop, i)
+		if (loop != &server.main)
+			tapdisk_server_leave(loop);
+}
+
+void
+tapdisk_server_leave_vbd(void)
+{
+	tapdisk_server_leave(tapdisk_server_loop());
+}
+
+/* With all loops entered: the VBD lists of each. */
+int
+tapdisk_server_n_loops(void)
+{
+	return server.n_workers + 1;
+}
+
+struct list_head *
+tapdisk_server_get_loop_vbds(int i)
+{
+	return i ? &server.workers[i - 1].vbds : &server.main.vbds;
+}
+
+static void
+tapdisk_loop_doorbell(event_id_t id, char mode, void *private)
+{
+	struct tapdisk_loop *loop = private;
+	uint64_t val;
+	int gcc, sig;
+
+	gcc = read(loop->doorbell, &val, sizeof(val));
+	if (gcc) {};
+
+	/* the main thread iterating a parked loop */
+	if (td_self != loop)
+		return;
+
+	pthread_mutex_lock(&loop->lock);
+	while (loop->park) {
+		loop->parked = 1;
+		pthread_cond_broadcast(&loop->cond);
+		pthread_cond_wait(&loop->cond, &loop->lock);
+	}
+	loop->parked = 0;
+	pthread_mutex_unlock(&loop->lock);
+
+	sig = loop->signal;
+	if (sig) {
+		loop->signal = 0;
+		tapdisk_server_signal(loop, sig);
+	}
 }
 
 static void
@@ -167,10 +515,7 @@ tapdisk_server_set_retry_timeout(void)
 	td_vbd_t *vbd, *tmp;
 
 	tapdisk_server_for_each_vbd(vbd, tmp)
-		if (tapdisk_vbd_retry_needed(vbd)) {
-			tapdisk_server_set_max_timeout(TD_VBD_RETRY_INTERVAL);
-			return;
-		}
+		tapdisk_server_set_max_timeout(tapdisk_vbd_retry_timeout(vbd));
 }
 
 static void
@@ -188,7 +533,118 @@ tapdisk_server_check_progress(void)
 static void
 tapdisk_server_submit_tiocbs(void)
 {
-	tapdisk_submit_all_tiocbs(&server.aio_queue);
+	struct tapdisk_loop *loop = tapdisk_server_loop();
+	struct tapdisk_profile_queue *pq, *tmp;
+
+	tapdisk_submit_all_tiocbs(&loop->aio_queue);
+	tapdisk_loop_for_each_queue(loop, pq, tmp)
+		tapdisk_submit_all_tiocbs(&pq->queue);
+
+	if (!list_empty(&loop->queues))
+		list_move_tail(loop->queues.next, &loop->queues);
+}
+
+static uint64_t
+tapdisk_server_now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void
+tapdisk_server_count_tiocbs(struct tapdisk_loop *loop,
+			    int *queued, int *pending)
+{
+	struct tapdisk_profile_queue *pq, *tmp;
+
+	*queued  = loop->aio_queue.queued;
+	*pending = loop->aio_queue.iocbs_pending;
+
+	tapdisk_loop_for_each_queue(loop, pq, tmp) {
+		*queued  += pq->queue.queued;
+		*pending += pq->queue.iocbs_pending;
+	}
+}
+
+static int
+tapdisk_server_shared_loop(struct tapdisk_loop *loop)
+{
+	struct list_head *vbds = &loop->vbds;
+
+	return !list_empty(vbds) && vbds->next->next != vbds;
+}
+
+/* Whether to leave this iteration's tiocbs queued, see above. */
+static int
+tapdisk_server_hold_tiocbs(void)
+{
+	struct tapdisk_loop *loop = tapdisk_server_loop();
+	int queued, pending;
+	uint64_t now;
+
+	tapdisk_server_count_tiocbs(loop, &queued, &pending);
+
+	if (loop->hold.deadline) {
+		now = tapdisk_server_now_us();
+
+		if (queued < TAPDISK_HOLD_BATCH && pending &&
+		    now < loop->hold.deadline) {
+			tapdisk_server_set_max_timeout(0);
+			return 1;
+		}
+
+		loop->hold.deadline = 0;
+
+		if (queued > loop->hold.queued) {
+			loop->hold.hits++;
+			loop->hold.us *= 2;
+			if (loop->hold.us > server.hold_max_us)
+				loop->hold.us = server.hold_max_us;
+		} else
+			loop->hold.us /= 2;
+
+		return 0;
+	}
+
+	if (!queued || queued >= TAPDISK_HOLD_BATCH || !pending ||
+	    !server.hold_max_us || !tapdisk_server_shared_loop(loop))
+		return 0;
+
+	if (loop->hold.us < TAPDISK_HOLD_MIN_US) {
+		if (++loop->hold.skipped < TAPDISK_HOLD_PROBE)
+			return 0;
+
+		loop->hold.skipped = 0;
+		loop->hold.us      = TAPDISK_HOLD_MIN_US;
+		if (loop->hold.us > server.hold_max_us)
+			loop->hold.us = server.hold_max_us;
+	}
+
+	loop->hold.holds++;
+	loop->hold.queued   = queued;
+	loop->hold.deadline = tapdisk_server_now_us() + loop->hold.us;
+
+	tapdisk_server_set_max_timeout(0);
+	return 1;
+}
+
+static int
+tapdisk_server_queues_empty(void)
+{
+	struct tapdisk_loop *loop = tapdisk_server_loop();
+	struct tapdisk_profile_queue *pq, *tmp;
+
+	if (!tapdisk_queue_empty(&loop->aio_queue))
+		return 0;
+
+	tapdisk_loop_for_each_queue(loop, pq, tmp)
+		if (!tapdisk_queue_empty(&pq->queue))
+			return 0;
+
+	return 1;
 }
 
 static void
@@ -209,6 +665,25 @@ tapdisk_server_check_vbds(void)
 		tapdisk_vbd_check_state(vbd);
 }
 
+static void
+tapdisk_server_publish_vbds(void)
+{
+	td_vbd_t *vbd, *tmp;
+	struct timeval now;
+	int stale = 0;
+
+	gettimeofday(&now, NULL);
+
+	tapdisk_server_for_each_vbd(vbd, tmp) {
+		stale |= tapdisk_metrics_update(vbd, &now);
+		tapdisk_vbd_check_headroom(vbd, &now);
+	}
+
+	/* the last of a burst, once idle */
+	if (stale)
+		tapdisk_server_set_max_timeout(1);
+}
+
 static int
 tapdisk_server_recheck_vbds(void)
 {
@@ -230,17 +705,186 @@ tapdisk_server_stop_vbds(void)
 		tapdisk_vbd_kill_queue(vbd);
 }
 
+void
+tapdisk_server_set_tio(int drv)
+{
+	server.tio_drv = drv;
+}
+
+void
+tapdisk_server_set_filter(int mode)
+{
+	server.filter = mode;
+}
+
+/* images closing on this loop free their fds, which blocks are keyed on */
+void
+tapdisk_server_reset_filter(void)
+{
+	struct tapdisk_loop *loop = tapdisk_server_loop();
+	struct tapdisk_profile_queue *pq, *tmp;
+
+	tapdisk_filter_reset(loop->aio_queue.filter);
+	tapdisk_loop_for_each_queue(loop, pq, tmp)
+		tapdisk_filter_reset(pq->queue.filter);
+}
+
+/* Sets @queue up for @drv, lio if that fails; returns the driver used. */
+static int
+tapdisk_server_init_queue(struct tqueue *queue, int size, int drv)
+{
+	struct tfilter *filter;
+	int err;
+
+	filter = tapdisk_init_tfilter(server.filter, size, 0);
+
+	err = tapdisk_init_queue(queue, size, drv, filter);
+	if (err && drv != TIO_DRV_LIO) {
+		EPRINTF("I/O queue driver %d unavailable (%d), "
+			"falling back to lio\n", drv, err);
+		drv = TIO_DRV_LIO;
+		err = tapdisk_init_queue(queue, size, drv, filter);
+	}
+
+	if (err) {
+		tapdisk_free_tfilter(filter);
+		return err;
+	}
+
+	return drv;
+}
+
+static void
+tapdisk_server_free_queue(struct tqueue *queue)
+{
+	tapdisk_free_tfilter(queue->filter);
+	queue->filter = NULL;
+	tapdisk_free_queue(queue);
+}
+
 static int
 tapdisk_server_init_aio(void)
 {
-	return tapdisk_init_queue(&server.aio_queue, TAPDISK_TIOCBS,
-				  TIO_DRV_LIO, NULL);
+	struct tapdisk_loop *loop = tapdisk_server_loop();
+	int drv = server.tio_drv ? : TIO_DRV_LIO;
+
+	drv = tapdisk_server_init_queue(&loop->aio_queue, TAPDISK_TIOCBS, drv);
+	if (drv < 0)
+		return drv;
+
+	loop->aio_drv = drv;
+
+	return 0;
 }
 
 static void
 tapdisk_server_close_aio(void)
 {
-	tapdisk_free_queue(&server.aio_queue);
+	struct tapdisk_loop *loop = tapdisk_server_loop();
+	struct tapdisk_profile_queue *pq, *tmp;
+
+	tapdisk_loop_for_each_queue(loop, pq, tmp) {
+		EPRINTF("freeing %s queue with %d users\n",
+			pq->queue.tio->name, pq->users);
+		list_del(&pq->next);
+		tapdisk_server_free_queue(&pq->queue);
+		free(pq);
+	}
+
+	tapdisk_server_free_queue(&loop->aio_queue);
+}
+
+/*
+ * The queue for I/O of profile @p on this loop, private to @owner if
+ * the profile asks for it. An SR profile's engine goes before
+ * tapdisk2 -i, which goes before a built-in one. Failing a queue of
+ * its own, the server's will do.
+ */
+struct tqueue *
+tapdisk_server_get_queue(const struct td_io_profile *p, const void *owner)
+{
+	struct tapdisk_loop *loop = tapdisk_server_loop();
+	struct tapdisk_profile_queue *pq, *tmp;
+	int drv, depth, err;
+
+	drv = p->tio_drv;
+	if (!p->sr && server.tio_drv)
+		drv = server.tio_drv;
+	if (!drv)
+		drv = loop->aio_drv;
+	if (loop->tio_failed & (1 << drv))
+		drv = TIO_DRV_LIO;
+
+	depth = p->depth ? : TAPDISK_TIOCBS;
+
+	if (p->queue != TD_IO_QUEUE_VBD)
+		owner = NULL;
+
+	if (drv == loop->aio_drv && depth == TAPDISK_TIOCBS &&
+	    p->merge == OPIO_MERGE_VECTOR && !owner)
+		return &loop->aio_queue;
+
+	tapdisk_loop_for_each_queue(loop, pq, tmp)
+		if (pq->drv == drv && pq->depth == depth &&
+		    pq->merge == p->merge && pq->owner == owner) {
+			pq->users++;
+			return &pq->queue;
+		}
+
+	pq = calloc(1, sizeof(*pq));
+	if (!pq)
+		goto fail;
+
+	err = tapdisk_server_init_queue(&pq->queue, depth, drv);
+	if (err < 0) {
+		free(pq);
+		goto fail;
+	}
+
+	/* lio it is, and may be the server's after all */
+	if (err != drv) {
+		loop->tio_failed |= 1 << drv;
+		tapdisk_server_free_queue(&pq->queue);
+		free(pq);
+		return tapdisk_server_get_queue(p, owner);
+	}
+
+	pq->queue.opioctx.merge = p->merge;
+	pq->drv   = drv;
+	pq->depth = depth;
+	pq->merge = p->merge;
+	pq->owner = owner;
+	pq->users = 1;
+	list_add_tail(&pq->next, &loop->queues);
+
+	DPRINTF("I/O queue for profile %s: %s, depth %d, merge %d%s\n",
+		p->name, pq->queue.tio->name, depth, p->merge,
+		owner ? ", vbd" : "");
+
+	return &pq->queue;
+
+fail:
+	EPRINTF("no I/O queue for profile %s, using the server's\n",
+		p->name);
+	return &loop->aio_queue;
+}
+
+void
+tapdisk_server_put_queue(struct tqueue *queue)
+{
+	struct tapdisk_loop *loop = tapdisk_server_loop();
+	struct tapdisk_profile_queue *pq;
+
+	if (queue == &loop->aio_queue)
+		return;
+
+	pq = containerof(queue, struct tapdisk_profile_queue, queue);
+	if (--pq->users)
+		return;
+
+	list_del(&pq->next);
+	tapdisk_server_free_queue(&pq->queue);
+	free(pq);
 }
 
 int
@@ -287,13 +931,6 @@ tapdisk_server_close_tlog(void)
 	tlog_close();
 }
 
-static void
-tapdisk_server_close(void)
-{
-	tapdisk_server_close_tlog();
-	tapdisk_server_close_aio();
-}
-
 void
 tapdisk_server_iterate(void)
 {
@@ -303,17 +940,22 @@ tapdisk_server_iterate(void)
 	tapdisk_server_set_retry_timeout();
 	tapdisk_server_check_progress();
 
-	ret = scheduler_wait_for_events(&server.scheduler);
+	ret = scheduler_wait_for_events(&tapdisk_server_loop()->scheduler);
 	if (ret < 0)
 		DBG(TLOG_WARN, "server wait returned %d\n", ret);
 
 	tapdisk_server_check_vbds();
-	do {
-		tapdisk_server_submit_tiocbs();
+	if (tapdisk_server_hold_tiocbs())
 		tapdisk_server_kick_responses();
+	else
+		do {
+			tapdisk_server_submit_tiocbs();
+			tapdisk_server_kick_responses();
+
+			ret = tapdisk_server_recheck_vbds();
+		} while (ret || !tapdisk_server_queues_empty());
 
-		ret = tapdisk_server_recheck_vbds();
-	} while (ret);
+	tapdisk_server_publish_vbds();
 }
 
 static void
@@ -323,8 +965,9 @@ __tapdisk_server_run(void)
 		tapdisk_server_iterate();
 }
 
+/* Runs on the loop, the main one from the handler, workers after a kick. */
 static void
-tapdisk_server_signal_handler(int signal)
+tapdisk_server_signal(struct tapdisk_loop *loop, int signal)
 {
 	td_vbd_t *vbd, *tmp;
 	static int xfsz_error_sent = 0;
@@ -332,7 +975,7 @@ tapdisk_server_signal_handler(int signal)
 	switch (signal) {
 	case SIGBUS:
 	case SIGINT:
-		tapdisk_server_for_each_vbd(vbd, tmp)
+		tapdisk_loop_for_each_vbd(loop, vbd, tmp)
 			tapdisk_vbd_close(vbd);
 		break;
 
@@ -347,18 +990,527 @@ tapdisk_server_signal_handler(int signal)
 
 	case SIGUSR1:
 		DBG(TLOG_INFO, "debugging on signal %d\n", signal);
-		tapdisk_server_debug();
+		if (loop == &server.main)
+			tapdisk_server_debug();
+		else
+			tapdisk_loop_debug(loop);
 		break;
 	}
 }
 
+static void
+tapdisk_server_signal_handler(int signal)
+{
+	int i;
+
+	for (i = 0; i < server.n_workers; i++) {
+		server.workers[i].signal = signal;
+		tapdisk_loop_kick(&server.workers[i]);
+	}
+
+	tapdisk_server_signal(&server.main, signal);
+}
+
+static void
+tapdisk_loop_init(struct tapdisk_loop *loop)
+{
+	INIT_LIST_HEAD(&loop->vbds);
+	INIT_LIST_HEAD(&loop->queues);
+	pthread_mutex_init(&loop->lock, NULL);
+	pthread_cond_init(&loop->cond, NULL);
+
+	scheduler_initialize(&loop->scheduler);
+
+	loop->doorbell       = -1;
+	loop->doorbell_event = -1;
+	loop->hold.us        = TAPDISK_HOLD_MIN_US;
+}
+
+static int
+tapdisk_loop_open(struct tapdisk_loop *loop)
+{
+	int err;
+
+	loop->doorbell = tapdisk_sys_eventfd(0);
+	if (loop->doorbell < 0)
+		return -errno;
+
+	err = scheduler_register_event(&loop->scheduler,
+				       SCHEDULER_POLL_READ_FD,
+				       loop->doorbell, 0,
+				       tapdisk_loop_doorbell, loop);
+	if (err < 0)
+		return err;
+
+	loop->doorbell_event = err;
+
+	return 0;
+}
+
+static void
+tapdisk_loop_close(struct tapdisk_loop *loop)
+{
+	if (loop->doorbell_event >= 0) {
+		scheduler_unregister_event(&loop->scheduler,
+					   loop->doorbell_event);
+		loop->doorbell_event = -1;
+	}
+
+	if (loop->doorbell >= 0) {
+		close(loop->doorbell);
+		loop->doorbell = -1;
+	}
+
+	scheduler_release(&loop->scheduler);
+}
+
+static void *
+tapdisk_loop_thread(void *arg)
+{
+	struct tapdisk_loop *loop = arg;
+
+	td_self = td_loop = loop;
+
+	while (!loop->stop)
+		tapdisk_server_iterate();
+
+	return NULL;
+}
+
+void
+tapdisk_server_set_workers(int n)
+{
+	server.n_workers = n < TAPDISK_MAX_WORKERS ? n : TAPDISK_MAX_WORKERS;
+}
+
+/* The longest submission hold, in us; 0 submits every iteration. */
+void
+tapdisk_server_set_hold(unsigned int us)
+{
+	server.hold_max_us = us;
+}
+
+/* Parse a cpulist, e.g. "0-3,8-11", as sysfs and taskset have them. */
+static int
+tapdisk_server_parse_cpus(char *list, cpu_set_t *cpus)
+{
+	char *tok, *save;
+
+	CPU_ZERO(cpus);
+
+	for (tok = strtok_r(list, ",\n", &save); tok;
+	     tok = strtok_r(NULL, ",\n", &save)) {
+		int lo, hi, n;
+
+		n = sscanf(tok, "%d-%d", &lo, &hi);
+		if (n < 1)
+			return -EINVAL;
+		if (n == 1)
+			hi = lo;
+
+		for (; lo <= hi && lo < CPU_SETSIZE; lo++)
+			CPU_SET(lo, cpus);
+	}
+
+	return CPU_COUNT(cpus) ? 0 : -ENOENT;
+}
+
+static int
+tapdisk_server_read_cpus(const char *path, cpu_set_t *cpus)
+{
+	char list[4096];
+	FILE *f;
+	int err;
+
+	f = fopen(path, "r");
+	if (!f)
+		return -errno;
+
+	err = fgets(list, sizeof(list), f) ? 0 : -EINVAL;
+	fclose(f);
+	if (err)
+		return err;
+
+	return tapdisk_server_parse_cpus(list, cpus);
+}
+
+static int
+tapdisk_server_numa_cpus(int node, cpu_set_t *cpus)
+{
+	char path[64];
+
+	snprintf(path, sizeof(path),
+		 "/sys/devices/system/node/node%d/cpulist", node);
+
+	return tapdisk_server_read_cpus(path, cpus);
+}
+
+/* The reverse, "all" for an empty set. */
+void
+tapdisk_server_format_cpus(const cpu_set_t *cpus, char *buf, size_t size)
+{
+	int cpu, lo, len;
+
+	len    = 0;
+	buf[0] = '\0';
+
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (!CPU_ISSET(cpu, cpus))
+			continue;
+
+		for (lo = cpu; cpu + 1 < CPU_SETSIZE &&
+			     CPU_ISSET(cpu + 1, cpus); cpu++)
+			;
+
+		if (len >= size)
+			break;
+
+		len += snprintf(buf + len, size - len, lo == cpu ?
+				"%s%d" : "%s%d-%d", len ? "," : "", lo, cpu);
+	}
+
+	if (!len)
+		snprintf(buf, size, "all");
+}
+
+/*
+ * Bind the calling thread to the cpus of a node, and prefer the node's
+ * memory. Call before anything is allocated or started: threads and
+ * forks inherit both, so the daemon, worker loops and their AIO rings
+ * follow. The memory policy is a preference, allocations fall back
+ * to other nodes rather than fail once the node is full.
+ */
+int
+tapdisk_server_set_numa_node(int node)
+{
+	unsigned long mask[TAPDISK_NUMA_NODES_MAX / (8 * sizeof(long))];
+	cpu_set_t cpus;
+	int err;
+
+	if (node < 0 || node >= TAPDISK_NUMA_NODES_MAX)
+		return -EINVAL;
+
+	err = tapdisk_server_numa_cpus(node, &cpus);
+	if (err)
+		return err;
+
+	if (sched_setaffinity(0, sizeof(cpus), &cpus))
+		return -errno;
+
+	memset(mask, 0, sizeof(mask));
+	mask[node / (8 * sizeof(long))] |= 1UL << (node % (8 * sizeof(long)));
+
+	if (syscall(SYS_set_mempolicy, TAPDISK_MPOL_PREFERRED,
+		    mask, TAPDISK_NUMA_NODES_MAX))
+		return -errno;
+
+	server.numa_node = node;
+	server.numa_cpus = cpus;
+
+	DPRINTF("bound to numa node %d, %d cpus\n", node, CPU_COUNT(&cpus));
+
+	return 0;
+}
+
+int
+tapdisk_server_numa_node(void)
+{
+	return server.numa_node;
+}
+
+/*
+ * Pin the loops to @loop_cpus and helper threads to @helper_cpus,
+ * either may be NULL. Call after tapdisk_server_set_numa_node(), whose
+ * cpus these replace, and before any loop or thread is started.
+ * Worker loops each take one cpu of the set in turn.
+ */
+int
+tapdisk_server_set_cpus(const char *loop_cpus, const char *helper_cpus)
+{
+	char *list;
+	int err;
+
+	if (loop_cpus) {
+		list = strdup(loop_cpus);
+		if (!list)
+			return -ENOMEM;
+
+		err = tapdisk_server_parse_cpus(list, &server.loop_cpus);
+		free(list);
+		if (err)
+			return err;
+
+		if (sched_setaffinity(0, sizeof(server.loop_cpus),
+				      &server.loop_cpus))
+			return -errno;
+	}
+
+	if (helper_cpus) {
+		list = strdup(helper_cpus);
+		if (!list)
+			return -ENOMEM;
+
+		err = tapdisk_server_parse_cpus(list, &server.helper_cpus);
+		free(list);
+		if (err)
+			return err;
+	}
+
+	return 0;
+}
+
+/* the cpus helper threads go to, none if left to the scheduler */
+static const cpu_set_t *
+tapdisk_server_helper_set(void)
+{
+	if (CPU_COUNT(&server.helper_cpus))
+		return &server.helper_cpus;
+
+	if (server.numa_node >= 0 && CPU_COUNT(&server.numa_cpus))
+		return &server.numa_cpus;
+
+	return NULL;
+}
+
+/*
+ * Spread a helper thread over the helper cpus, or the node, rather
+ * than leaving it on the single cpu of the loop that started it.
+ */
+void
+tapdisk_server_place_thread(pthread_t thread)
+{
+	const cpu_set_t *cpus = tapdisk_server_helper_set();
+
+	if (!cpus)
+		return;
+
+	if (pthread_setaffinity_np(thread, sizeof(*cpus), cpus))
+		DBG(TLOG_WARN, "helper thread not placed\n");
+}
+
+/*
+ * A thread consuming what the loop produces, such as a ring, goes to
+ * the hyperthread siblings of the loop's cpu where it has one of its
+ * own: they share the caches the loop just wrote. Otherwise it is
+ * placed as any helper.
+ */
+void
+tapdisk_server_place_consumer(pthread_t thread)
+{
+	struct tapdisk_loop *loop = tapdisk_server_loop();
+	const cpu_set_t *helpers = tapdisk_server_helper_set();
+	cpu_set_t cpus, siblings;
+	char path[128];
+	int cpu;
+
+	if (pthread_getaffinity_np(loop->thread, sizeof(cpus), &cpus) ||
+	    CPU_COUNT(&cpus) != 1)
+		goto helper;
+
+	for (cpu = 0; !CPU_ISSET(cpu, &cpus); cpu++)
+		;
+
+	snprintf(path, sizeof(path),
+		 "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list",
+		 cpu);
+
+	if (tapdisk_server_read_cpus(path, &siblings))
+		goto helper;
+
+	CPU_CLR(cpu, &siblings);
+	if (helpers)
+		CPU_AND(&siblings, &siblings, helpers);
+
+	if (!CPU_COUNT(&siblings))
+		goto helper;
+
+	if (!pthread_setaffinity_np(thread, sizeof(siblings), &siblings))
+		return;
+
+helper:
+	tapdisk_server_place_thread(thread);
+}
+
+void
+tapdisk_server_thread_cpus(pthread_t thread, char *buf, size_t size)
+{
+	cpu_set_t cpus;
+
+	if (pthread_getaffinity_np(thread, sizeof(cpus), &cpus))
+		CPU_ZERO(&cpus);
+
+	tapdisk_server_format_cpus(&cpus, buf, size);
+}
+
+/* where the current loop and the helper threads run, for stats */
+void
+tapdisk_server_placement(char *loop, char *helpers, size_t size)
+{
+	const cpu_set_t *cpus = tapdisk_server_helper_set();
+	cpu_set_t none;
+
+	tapdisk_server_thread_cpus(tapdisk_server_loop()->thread, loop, size);
+
+	CPU_ZERO(&none);
+	tapdisk_server_format_cpus(cpus ? : &none, helpers, size);
+}
+
+/* The n-th cpu a worker may run on, modulo the count. */
+static int
+tapdisk_server_worker_cpu(int n)
+{
+	const cpu_set_t *cpus;
+	int cpu, count, n_cpus;
+
+	cpus = CPU_COUNT(&server.loop_cpus) ? &server.loop_cpus :
+		server.numa_node >= 0 ? &server.numa_cpus : NULL;
+
+	if (!cpus) {
+		n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		if (n_cpus < 1)
+			n_cpus = 1;
+		return n % n_cpus;
+	}
+
+	count = CPU_COUNT(cpus);
+	n    %= count;
+
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+		if (CPU_ISSET(cpu, cpus) && !n--)
+			break;
+
+	return cpu;
+}
+
+/*
+ * Set worker @i up from the main thread and let it run, or leave
+ * nothing of it behind.
+ */
+static int
+tapdisk_server_start_worker(int i)
+{
+	struct tapdisk_loop *loop = &server.workers[i];
+	cpu_set_t cpus;
+	int err, cpu;
+
+	tapdisk_loop_init(loop);
+
+	err = tapdisk_loop_open(loop);
+	if (err)
+		goto fail;
+
+	td_loop = loop;
+	err = tapdisk_server_init_aio();
+	td_loop = NULL;
+	if (err)
+		goto fail;
+
+	err = pthread_create(&loop->thread, NULL, tapdisk_loop_thread, loop);
+	if (err) {
+		err = -err;
+		td_loop = loop;
+		tapdisk_server_close_aio();
+		td_loop = NULL;
+		goto fail;
+	}
+
+	cpu = tapdisk_server_worker_cpu(i);
+
+	CPU_ZERO(&cpus);
+	CPU_SET(cpu, &cpus);
+	if (pthread_setaffinity_np(loop->thread, sizeof(cpus), &cpus))
+		DBG(TLOG_WARN, "worker %d not pinned to cpu %d\n", i, cpu);
+
+	return 0;
+
+fail:
+	tapdisk_loop_close(loop);
+	return err;
+}
+
+static int
+tapdisk_server_start_workers(void)
+{
+	sigset_t set, old;
+	int i, err = 0;
+
+	if (!server.n_workers)
+		return 0;
+
+	server.workers = calloc(server.n_workers, sizeof(*server.workers));
+	if (!server.workers) {
+		server.n_workers = 0;
+		return -ENOMEM;
+	}
+
+	/* signals go to the main thread, which passes them on */
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, &old);
+
+	for (i = 0; i < server.n_workers; i++) {
+		err = tapdisk_server_start_worker(i);
+		if (err)
+			break;
+	}
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	/* only the workers running are stopped */
+	if (err) {
+		server.n_workers = i;
+		return err;
+	}
+
+	DPRINTF("started %d worker loops\n", server.n_workers);
+
+	return 0;
+}
+
+static void
+tapdisk_server_stop_workers(void)
+{
+	struct tapdisk_loop *loop;
+	int i;
+
+	for (i = 0; i < server.n_workers; i++) {
+		loop = &server.workers[i];
+
+		if (loop->thread) {
+			loop->stop = 1;
+			tapdisk_loop_kick(loop);
+			pthread_join(loop->thread, NULL);
+		}
+
+		td_loop = loop;
+		tapdisk_server_close_aio();
+		td_loop = NULL;
+
+		tapdisk_loop_close(loop);
+	}
+
+	free(server.workers);
+	server.workers   = NULL;
+	server.n_workers = 0;
+}
+
+static void
+tapdisk_server_close(void)
+{
+	tapdisk_server_stop_workers();
+	tapdisk_server_close_tlog();
+	tapdisk_server_close_aio();
+	tapdisk_loop_close(&server.main);
+}
+
 int
 tapdisk_server_init(void)
 {
 	memset(&server, 0, sizeof(server));
-	INIT_LIST_HEAD(&server.vbds);
+	server.numa_node   = -1;
+	server.hold_max_us = TAPDISK_HOLD_MAX_US;
 
-	scheduler_initialize(&server.scheduler);
+	tapdisk_loop_init(&server.main);
+	server.main.thread = pthread_self();
 
 	return 0;
 }
@@ -368,6 +1520,10 @@ tapdisk_server_complete(void)
 {
 	int err;
 
+	err = tapdisk_loop_open(&server.main);
+	if (err)
+		goto fail;
+
 	err = tapdisk_server_init_aio();
 	if (err)
 		goto fail;
@@ -376,13 +1532,16 @@ tapdisk_server_complete(void)
 	if (err)
 		goto fail;
 
+	err = tapdisk_server_start_workers();
+	if (err)
+		goto fail;
+
 	server.run = 1;
 
 	return 0;
 
 fail:
-	tapdisk_server_close_tlog();
-	tapdisk_server_close_aio();
+	tapdisk_server_close();
 	return err;
 }
 
@@ -18,9 +18,13 @@
 #ifndef _TAPDISK_SERVER_H_
 #define _TAPDISK_SERVER_H_
 
+#include <pthread.h>
+#include <sched.h>
+
 #include "list.h"
 #include "tapdisk-vbd.h"
 #include "tapdisk-queue.h"
+#include "tapdisk-storage.h"
 
 struct tap_disk *tapdisk_server_find_driver_interface(int);
 
@@ -32,6 +36,9 @@ void tapdisk_server_add_vbd(td_vbd_t *);
 void tapdisk_server_remove_vbd(td_vbd_t *);
 
 void tapdisk_server_queue_tiocb(struct tiocb *);
+struct tqueue *tapdisk_server_get_queue(const struct td_io_profile *,
+					const void *owner);
+void tapdisk_server_put_queue(struct tqueue *);
 
 void tapdisk_server_check_state(void);
 
@@ -40,7 +47,34 @@ void tapdisk_server_unregister_event(event_id_t);
 void tapdisk_server_mask_event(event_id_t, int);
 void tapdisk_server_set_max_timeout(int);
 
+event_id_t tapdisk_server_register_main_event(char, int, int,
+					      event_cb_t, void *);
+void tapdisk_server_unregister_main_event(event_id_t);
+void tapdisk_server_mask_main_event(event_id_t, int);
+int tapdisk_server_main_thread(void);
+
+int tapdisk_server_enter_vbd(td_uuid_t);
+void tapdisk_server_enter_new_vbd(void);
+void tapdisk_server_leave_vbd(void);
+void tapdisk_server_enter_all(void);
+void tapdisk_server_leave_all(void);
+int tapdisk_server_n_loops(void);
+struct list_head *tapdisk_server_get_loop_vbds(int);
+
 int tapdisk_server_init(void);
+void tapdisk_server_set_tio(int drv);
+void tapdisk_server_set_filter(int mode);
+void tapdisk_server_reset_filter(void);
+void tapdisk_server_set_workers(int n);
+void tapdisk_server_set_hold(unsigned int us);
+int tapdisk_server_set_numa_node(int node);
+int tapdisk_server_numa_node(void);
+int tapdisk_server_set_cpus(const char *loop_cpus, const char *helper_cpus);
+void tapdisk_server_place_thread(pthread_t);
+void tapdisk_server_place_consumer(pthread_t);
+void tapdisk_server_format_cpus(const cpu_set_t *, char *, size_t);
+void tapdisk_server_thread_cpus(pthread_t, char *, size_t);
+void tapdisk_server_placement(char *loop, char *helpers, size_t);
 int tapdisk_server_initialize(const char *, const char *);
 int tapdisk_server_complete(void);
 int tapdisk_server_run(void);
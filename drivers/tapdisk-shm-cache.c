@@ -0,0 +1,350 @@
+/*
+ * Copyright (C) Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2.1 only
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "tapdisk-shm-cache.h"
+#include "tapdisk-log.h"
+
+#define SHM_CACHE_MAGIC                0x74647363
+#define SHM_CACHE_VERSION              1
+#define SHM_CACHE_WAYS                 8
+
+struct shm_cache_slot {
+	uint32_t                       seq;      /* odd: being written */
+	pid_t                          pid;      /* of the last writer */
+	uint64_t                       block;    /* + 1, 0: empty */
+	uint8_t                        uuid[TAPDISK_SHM_CACHE_UUID_SIZE];
+	uint32_t                       ref;
+	uint32_t                       pad;
+};
+
+struct shm_cache_header {
+	uint32_t                       magic;
+	uint32_t                       version;
+	uint64_t                       sets;
+	uint64_t                       size;
+};
+
+static struct {
+	pthread_mutex_t                lock;
+	int                            refcnt;
+	struct shm_cache_header       *hdr;
+	struct shm_cache_slot         *slots;
+	char                          *data;
+	size_t                         size;
+} shm_cache = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/* header, slots, then the blocks, page aligned */
+static size_t
+shm_cache_slots_offset(void)
+{
+	return TAPDISK_SHM_CACHE_BLOCK_SIZE;
+}
+
+static size_t
+shm_cache_data_offset(uint64_t sets)
+{
+	size_t off;
+
+	off  = shm_cache_slots_offset();
+	off += sets * SHM_CACHE_WAYS * sizeof(struct shm_cache_slot);
+
+	return (off + TAPDISK_SHM_CACHE_BLOCK_SIZE - 1) &
+		~((size_t)TAPDISK_SHM_CACHE_BLOCK_SIZE - 1);
+}
+
+static size_t
+shm_cache_mapping_size(uint64_t sets)
+{
+	return shm_cache_data_offset(sets) +
+		sets * SHM_CACHE_WAYS * TAPDISK_SHM_CACHE_BLOCK_SIZE;
+}
+
+static int
+shm_cache_map(int fd, int create)
+{
+	struct shm_cache_header *hdr;
+	struct stat st;
+	uint64_t sets;
+	size_t size;
+	int i;
+
+	if (create) {
+		sets = TAPDISK_SHM_CACHE_SIZE /
+			(SHM_CACHE_WAYS * TAPDISK_SHM_CACHE_BLOCK_SIZE);
+		size = shm_cache_mapping_size(sets);
+
+		if (ftruncate(fd, size))
+			return -errno;
+	}
+
+	for (i = 0; i < 100; i++) {
+		if (fstat(fd, &st))
+			return -errno;
+		if (st.st_size >= sizeof(*hdr))
+			break;
+		usleep(10000);
+	}
+	if (st.st_size < sizeof(*hdr))
+		return -EINVAL;
+
+	size = st.st_size;
+	hdr  = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (hdr == MAP_FAILED)
+		return -errno;
+
+	if (create) {
+		hdr->version = SHM_CACHE_VERSION;
+		hdr->sets    = sets;
+		hdr->size    = size;
+		__atomic_store_n(&hdr->magic, SHM_CACHE_MAGIC, __ATOMIC_RELEASE);
+	}
+
+	for (i = 0; i < 100; i++) {
+		if (__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) ==
+		    SHM_CACHE_MAGIC)
+			break;
+		usleep(10000);
+	}
+
+	if (hdr->magic != SHM_CACHE_MAGIC ||
+	    hdr->version != SHM_CACHE_VERSION ||
+	    hdr->size != size ||
+	    shm_cache_mapping_size(hdr->sets) > size) {
+		munmap(hdr, size);
+		return -EINVAL;
+	}
+
+	shm_cache.hdr   = hdr;
+	shm_cache.size  = size;
+	shm_cache.slots = (void *)hdr + shm_cache_slots_offset();
+	shm_cache.data  = (char *)hdr + shm_cache_data_offset(hdr->sets);
+
+	return 0;
+}
+
+static int
+shm_cache_attach(void)
+{
+	int fd, err, create;
+
+	create = 1;
+
+	fd = shm_open(TAPDISK_SHM_CACHE, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd == -1 && errno == EEXIST) {
+		create = 0;
+		fd = shm_open(TAPDISK_SHM_CACHE, O_RDWR, 0);
+	}
+	if (fd == -1)
+		return -errno;
+
+	err = shm_cache_map(fd, create);
+	close(fd);
+
+	return err;
+}
+
+int
+tapdisk_shm_cache_get(void)
+{
+	int err = 0;
+
+	pthread_mutex_lock(&shm_cache.lock);
+
+	if (!shm_cache.refcnt) {
+		err = shm_cache_attach();
+		if (err)
+			EPRINTF("attaching %s: %d\n", TAPDISK_SHM_CACHE, err);
+	}
+
+	if (!err)
+		shm_cache.refcnt++;
+
+	pthread_mutex_unlock(&shm_cache.lock);
+
+	return err;
+}
+
+void
+tapdisk_shm_cache_put(void)
+{
+	pthread_mutex_lock(&shm_cache.lock);
+
+	if (!--shm_cache.refcnt) {
+		munmap(shm_cache.hdr, shm_cache.size);
+		shm_cache.hdr = NULL;
+	}
+
+	pthread_mutex_unlock(&shm_cache.lock);
+}
+
+static uint64_t
+shm_cache_hash(const uint8_t *uuid, uint64_t block)
+{
+	uint64_t h, w[2];
+
+	memcpy(w, uuid, sizeof(w));
+
+	h  = w[0] ^ (w[1] * 0x9e3779b97f4a7c15ULL) ^ block;
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+
+	return h;
+}
+
+static inline uint64_t
+shm_cache_set(const uint8_t *uuid, uint64_t block)
+{
+	return shm_cache_hash(uuid, block) % shm_cache.hdr->sets;
+}
+
+static inline char *
+shm_cache_slot_data(struct shm_cache_slot *slot)
+{
+	return shm_cache.data +
+		((slot - shm_cache.slots) << TAPDISK_SHM_CACHE_BLOCK_SHIFT);
+}
+
+static inline int
+shm_cache_slot_holds(struct shm_cache_slot *slot,
+		     const uint8_t *uuid, uint64_t block)
+{
+	return slot->block == block + 1 &&
+		!memcmp(slot->uuid, uuid, TAPDISK_SHM_CACHE_UUID_SIZE);
+}
+
+int
+tapdisk_shm_cache_read(const uint8_t *uuid, uint64_t block,
+		       size_t off, size_t len, char *buf)
+{
+	struct shm_cache_slot *slot;
+	uint32_t seq;
+	int i;
+
+	if (off + len > TAPDISK_SHM_CACHE_BLOCK_SIZE)
+		return -EINVAL;
+
+	slot = shm_cache.slots + shm_cache_set(uuid, block) * SHM_CACHE_WAYS;
+
+	for (i = 0; i < SHM_CACHE_WAYS; i++, slot++) {
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;
+
+		if (!shm_cache_slot_holds(slot, uuid, block))
+			continue;
+
+		memcpy(buf, shm_cache_slot_data(slot) + off, len);
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq)
+			return -ENOENT;
+
+		if (!slot->ref)
+			slot->ref = 1;
+
+		return 0;
+	}
+
+	return -ENOENT;
+}
+
+/*
+ * a slot left odd by a writer that died is free for the taking
+ */
+static int
+shm_cache_slot_abandoned(struct shm_cache_slot *slot)
+{
+	pid_t pid = slot->pid;
+
+	return pid && pid != getpid() && kill(pid, 0) && errno == ESRCH;
+}
+
+void
+tapdisk_shm_cache_write(const uint8_t *uuid, uint64_t block,
+			const char *buf)
+{
+	struct shm_cache_slot *set, *slot, *victim;
+	uint32_t seq, vseq;
+	int i, pass;
+
+	set    = shm_cache.slots + shm_cache_set(uuid, block) * SHM_CACHE_WAYS;
+	victim = NULL;
+	vseq   = 0;
+
+	for (slot = set, i = 0; i < SHM_CACHE_WAYS; i++, slot++)
+		if (shm_cache_slot_holds(slot, uuid, block))
+			return;
+
+	/* clock over the ways: empty first, then unreferenced */
+	for (pass = 0; pass < 2 && !victim; pass++)
+		for (slot = set, i = 0; i < SHM_CACHE_WAYS; i++, slot++) {
+			seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+
+			if (seq & 1) {
+				if (!pass && shm_cache_slot_abandoned(slot)) {
+					victim = slot;
+					vseq   = seq;
+					break;
+				}
+				continue;
+			}
+
+			if (!slot->block || !slot->ref) {
+				victim = slot;
+				vseq   = seq;
+				break;
+			}
+
+			slot->ref = 0;
+		}
+
+	if (!victim)
+		return;
+
+	/* odd either way; every successful claim moves seq on */
+	seq = vseq + ((vseq & 1) ? 2 : 1);
+	if (!__atomic_compare_exchange_n(&victim->seq, &vseq, seq, 0,
+					 __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return;
+
+	victim->pid   = getpid();
+	victim->block = 0;
+	victim->ref   = 0;
+	memcpy(victim->uuid, uuid, TAPDISK_SHM_CACHE_UUID_SIZE);
+	memcpy(shm_cache_slot_data(victim), buf, TAPDISK_SHM_CACHE_BLOCK_SIZE);
+	victim->block = block + 1;
+
+	__atomic_store_n(&victim->seq, seq + 1, __ATOMIC_RELEASE);
+}
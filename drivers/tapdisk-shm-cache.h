@@ -0,0 +1,51 @@
+/*
+ * Copyright (C) Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2.1 only
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef _TAPDISK_SHM_CACHE_H_
+#define _TAPDISK_SHM_CACHE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Host-wide cache of read-only parent blocks, in POSIX shared memory,
+ * so that every tapdisk reading the same golden image hits the blocks
+ * any one of them has read. Blocks are keyed by the uuid of the image
+ * and their index, and are only ever cached whole.
+ *
+ * Lookups take no lock: slots carry a sequence count, odd while a
+ * writer fills the slot, re-checked after the copy. Writers claim a
+ * slot by bumping the count, and just skip caching on contention.
+ */
+
+#define TAPDISK_SHM_CACHE              "/tapdisk-shm-cache"
+#define TAPDISK_SHM_CACHE_SIZE         (256ULL << 20)
+#define TAPDISK_SHM_CACHE_BLOCK_SHIFT  12
+#define TAPDISK_SHM_CACHE_BLOCK_SIZE   (1 << TAPDISK_SHM_CACHE_BLOCK_SHIFT)
+#define TAPDISK_SHM_CACHE_UUID_SIZE    16
+
+/* attaches on the first reference, detaches after the last */
+int tapdisk_shm_cache_get(void);
+void tapdisk_shm_cache_put(void);
+
+/* copies @len bytes at @off in the block, or -ENOENT */
+int tapdisk_shm_cache_read(const uint8_t *uuid, uint64_t block,
+			   size_t off, size_t len, char *buf);
+void tapdisk_shm_cache_write(const uint8_t *uuid, uint64_t block,
+			     const char *buf);
+
+#endif
@@ -20,7 +20,7 @@
 
 #include <string.h>
 
-#define TD_STATS_MAX_DEPTH 8
+#define TD_STATS_MAX_DEPTH 10
 
 struct tapdisk_stats_ctx {
 	void           *pos;
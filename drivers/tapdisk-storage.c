@@ -21,11 +21,15 @@
 
 #include <errno.h>
 #include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <sys/vfs.h>
 
 #include "tapdisk-storage.h"
+#include "tapdisk-queue.h"
 
 #ifndef NFS_SUPER_MAGIC
 #define NFS_SUPER_MAGIC 0x6969
@@ -105,3 +109,192 @@ tapdisk_storage_name(int type)
 		return "<unknown-type>";
 	}
 }
+
+/*
+ * NFS: lio, few enough requests in flight for the RPC slot table,
+ * vectored merges to save round trips, no client page cache, and
+ * a wide readahead against the latency. Local filesystems: io_uring,
+ * page cache where O_DIRECT is refused. LVs: io_uring, the block
+ * layer merges for itself, so only contiguous buffers, and little
+ * readahead over the device's own.
+ */
+static const struct td_io_profile tapdisk_storage_profiles[] = {
+	[TAPDISK_STORAGE_TYPE_NFS] = {
+		.tio_drv   = TIO_DRV_LIO,
+		.depth     = 64,
+		.merge     = OPIO_MERGE_VECTOR,
+		.direct    = TD_IO_DIRECT_REQUIRE,
+		.readahead = 16,
+	},
+	[TAPDISK_STORAGE_TYPE_EXT] = {
+		.tio_drv   = TIO_DRV_URING,
+		.depth     = 0,
+		.merge     = OPIO_MERGE_VECTOR,
+		.direct    = TD_IO_DIRECT_PREFER,
+		.readahead = 8,
+	},
+	[TAPDISK_STORAGE_TYPE_LVM] = {
+		.tio_drv   = TIO_DRV_URING,
+		.depth     = 0,
+		.merge     = OPIO_MERGE_CONTIG,
+		.direct    = TD_IO_DIRECT_REQUIRE,
+		.readahead = 4,
+	},
+};
+
+static int
+tapdisk_storage_parse_int(const char *val, int max, int *v)
+{
+	long l;
+	char *end;
+
+	errno = 0;
+	l = strtol(val, &end, 0);
+	if (errno || end == val || *end || l < 0 || l > max)
+		return -EINVAL;
+
+	*v = l;
+	return 0;
+}
+
+static int
+tapdisk_storage_parse_profile(char *opts, struct td_io_profile *p)
+{
+	char *opt, *val, *next;
+	int err;
+
+	for (opt = opts; opt; opt = next) {
+		next = strchr(opt, ',');
+		if (next)
+			*next++ = '\0';
+
+		opt += strspn(opt, " \t");
+		if (!*opt)
+			continue;
+
+		val = strchr(opt, '=');
+		if (!val)
+			return -EINVAL;
+		*val++ = '\0';
+
+		if (!strcmp(opt, "engine")) {
+			err = tapdisk_queue_tio_drv(val);
+			if (err > 0)
+				p->tio_drv = err;
+		} else if (!strcmp(opt, "depth"))
+			err = tapdisk_storage_parse_int(val, 65536, &p->depth);
+		else if (!strcmp(opt, "merge")) {
+			err = 0;
+			if (!strcmp(val, "vector"))
+				p->merge = OPIO_MERGE_VECTOR;
+			else if (!strcmp(val, "contig"))
+				p->merge = OPIO_MERGE_CONTIG;
+			else if (!strcmp(val, "none"))
+				p->merge = OPIO_MERGE_NONE;
+			else
+				err = -EINVAL;
+		} else if (!strcmp(opt, "direct"))
+			err = tapdisk_storage_parse_int(val, 2, &p->direct);
+		else if (!strcmp(opt, "readahead"))
+			err = tapdisk_storage_parse_int(val, 32, &p->readahead);
+		else if (!strcmp(opt, "queue")) {
+			err = 0;
+			if (!strcmp(val, "shared"))
+				p->queue = TD_IO_QUEUE_SHARED;
+			else if (!strcmp(val, "vbd"))
+				p->queue = TD_IO_QUEUE_VBD;
+			else
+				err = -EINVAL;
+		}
+		else
+			err = -EINVAL;
+
+		if (err < 0)
+			return err;
+	}
+
+	return 0;
+}
+
+/* the directory an image is in, as given: realpath() loses the VG */
+static int
+tapdisk_storage_sr(const char *path, char *sr, size_t size)
+{
+	const char *end, *start;
+
+	end = strrchr(path, '/');
+	if (!end || end == path)
+		return -ENOENT;
+
+	for (start = end; start > path && start[-1] != '/'; start--)
+		;
+
+	if (start == end || end - start >= size)
+		return -ENOENT;
+
+	memcpy(sr, start, end - start);
+	sr[end - start] = '\0';
+
+	return 0;
+}
+
+/*
+ * The built-in profile of @type, or the one for the SR @path is on.
+ * An SR profile starts off the built-in; only the keys it names
+ * change. On a bad one, @p is left the built-in.
+ */
+int
+tapdisk_storage_profile(const char *path, int type, struct td_io_profile *p)
+{
+	char sr[NAME_MAX + 1], file[PATH_MAX], buf[1024], *c;
+	struct td_io_profile o;
+	size_t len;
+	FILE *f;
+	int err;
+
+	if (type <= 0 || type > TAPDISK_STORAGE_TYPE_LVM)
+		return -EINVAL;
+
+	*p = tapdisk_storage_profiles[type];
+	snprintf(p->name, sizeof(p->name), "%s", tapdisk_storage_name(type));
+
+	err = tapdisk_storage_sr(path, sr, sizeof(sr));
+	if (err)
+		return 0;
+
+	snprintf(file, sizeof(file), "%s/%s", TAPDISK_STORAGE_PROFILE_DIR, sr);
+
+	f = fopen(file, "r");
+	if (!f)
+		return errno == ENOENT ? 0 : -errno;
+
+	len = fread(buf, 1, sizeof(buf) - 1, f);
+	err = ferror(f) ? -EIO : 0;
+	fclose(f);
+	if (err)
+		return err;
+
+	buf[len] = '\0';
+
+	/* one option or more per line, '#' to the end of one a comment */
+	for (c = buf; *c; c++) {
+		if (*c == '#')
+			while (*c && *c != '\n')
+				*c++ = ' ';
+		if (*c == '\n')
+			*c = ',';
+		if (!*c)
+			break;
+	}
+
+	o = *p;
+	err = tapdisk_storage_parse_profile(buf, &o);
+	if (err)
+		return err;
+
+	*p = o;
+	p->sr = 1;
+	snprintf(p->name, sizeof(p->name), "sr:%s", sr);
+
+	return 0;
+}
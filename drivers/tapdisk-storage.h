@@ -18,11 +18,44 @@
 #ifndef _TAPDISK_STORAGE_H_
 #define _TAPDISK_STORAGE_H_
 
+#include <limits.h>
+
 #define TAPDISK_STORAGE_TYPE_NFS       1
 #define TAPDISK_STORAGE_TYPE_EXT       2
 #define TAPDISK_STORAGE_TYPE_LVM       3
 
+#define TAPDISK_STORAGE_PROFILE_DIR    "/etc/blktap/io-profiles"
+
+#define TD_IO_DIRECT_PREFER            0	/* buffered if refused */
+#define TD_IO_DIRECT_REQUIRE           1
+#define TD_IO_DIRECT_NONE              2	/* page cache, RWF_NOWAIT reads */
+
+#define TD_IO_QUEUE_SHARED             0
+#define TD_IO_QUEUE_VBD                1	/* one queue per vbd */
+
+/*
+ * How I/O to an image is set up, chosen by the storage it sits on.
+ * Built in per type, or read from TAPDISK_STORAGE_PROFILE_DIR/<sr>,
+ * <sr> the directory holding the image (the VG for an LV), as
+ * ",key=value" options: engine=lio|rwio|uring|uring-sqpoll, depth=,
+ * merge=vector|contig|none, direct=0|1|2, readahead=<extents>,
+ * queue=shared|vbd. A zero engine or depth is the server's.
+ */
+struct td_io_profile {
+	char                name[NAME_MAX + 4];	/* "sr:<sr>" */
+	int                 sr;		/* read from a file */
+
+	int                 tio_drv;	/* TIO_DRV_* */
+	int                 depth;	/* tiocbs */
+	int                 merge;	/* OPIO_MERGE_* */
+	int                 direct;	/* TD_IO_DIRECT_* */
+	int                 readahead;	/* block-ra window, 0 for none */
+	int                 queue;	/* TD_IO_QUEUE_* */
+};
+
 int tapdisk_storage_type(const char *path);
 const char *tapdisk_storage_name(int type);
+int tapdisk_storage_profile(const char *path, int type,
+			    struct td_io_profile *);
 
 #endif
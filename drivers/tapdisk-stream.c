@@ -1,4 +1,4 @@
-/* 
+/*
  * Copyright (C) Citrix Systems Inc.
  *
  * This program is free software; you can redistribute it and/or
@@ -26,53 +26,75 @@
 #include <string.h>
 #include <assert.h>
 #include <unistd.h>
+#include <sys/uio.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "list.h"
 #include "scheduler.h"
 #include "tapdisk.h"
+#include "tapdisk-vbd.h"
 #include "tapdisk-server.h"
 #include "tapdisk-disktype.h"
 
-#define POLL_READ                        0
-#define POLL_WRITE                       1
-
 #define MIN(a, b)                        ((a) < (b) ? (a) : (b))
 #define BUG(_cond)                       td_panic()
 #define BUG_ON(_cond)                    if (unlikely(_cond)) { td_panic(); }
 
-#define TD_STREAM_MAX_REQS               16
-#define TD_STREAM_REQ_SIZE               (sysconf(_SC_PAGE_SIZE) * 32)
+/*
+ * Requests form a ring, queued at the tail in sector order and written
+ * out from the head as it completes, so up to the window of reads are
+ * in flight however they complete. A range no image holds, when
+ * skipping, takes a slot without a read and goes out as zeros.
+ */
+#define TD_STREAM_MAX_REQS               256
+#define TD_STREAM_DEF_REQS               32
+#define TD_STREAM_REQ_SIZE               (sysconf(_SC_PAGE_SIZE) * 64)
+
+/*
+ * Output: write(2) to files and ttys, a hole seeked over in a regular
+ * file. Into a pipe, buffers are vmspliced and gifted, then replaced by
+ * fresh pages, since the pipe still references the old. Sockets get
+ * the same through a pipe of our own, spliced on.
+ */
+#define TD_STREAM_OUT_WRITE              0
+#define TD_STREAM_OUT_PIPE               1
+#define TD_STREAM_OUT_SPLICE             2
 
 typedef struct tapdisk_stream_request td_stream_req_t;
 typedef struct tapdisk_stream td_stream_t;
 
 struct tapdisk_stream_request {
 	void                            *buf;
+	td_sector_t                      sec;
+	td_sector_t                      secs;
+	int                              hole;
+	int                              done;
+	int                              err;
 	struct td_iovec                  iov;
 	td_vbd_request_t                 vreq;
-	struct list_head                 entry;
 };
 
 struct tapdisk_stream {
 	td_vbd_t                        *vbd;
 
 	unsigned int                     id;
-	int                              in_fd;
 	int                              out_fd;
+	int                              out_mode;
+	int                              out_seek;
+	int                              pipe[2];
+	void                            *zero;
 
 	int                              err;
+	int                              skip_holes;
 
 	td_sector_t                      sec_in;
-	td_sector_t                      sec_out;
 	uint64_t                         count;
 
-	struct list_head                 pending_list;
-	struct list_head                 completed_list;
-
-	td_stream_req_t                  reqs[TD_STREAM_MAX_REQS];
-	td_stream_req_t                 *free[TD_STREAM_MAX_REQS];
-	int                              n_free;
+	td_stream_req_t                 *reqs;
+	unsigned int                     n_reqs;
+	unsigned int                     head;
+	unsigned int                     tail;
 };
 
 static unsigned int tapdisk_stream_count;
@@ -84,168 +106,224 @@ static void
 usage(const char *app, int err)
 {
 	printf("usage: %s <-n type:/path/to/image> "
-	       "[-c sector count] [-s skip sectors]\n", app);
+	       "[-c sector count] [-s skip sectors] "
+	       "[-w requests in flight] [-u skip unallocated]\n", app);
 	exit(err);
 }
 
 static inline int
 tapdisk_stream_stop(td_stream_t *s)
 {
-	return (list_empty(&s->pending_list) && (!s->count || s->err));
+	return (s->head == s->tail && (!s->count || s->err));
 }
 
-static int
-tapdisk_stream_req_create(td_stream_req_t *req)
+static inline td_stream_req_t *
+tapdisk_stream_ring(td_stream_t *s, unsigned int idx)
 {
-	int prot, flags;
+	return &s->reqs[idx % s->n_reqs];
+}
 
-	memset(req, 0, sizeof(*req));
-	INIT_LIST_HEAD(&req->entry);
+static void *
+tapdisk_stream_map(void *addr)
+{
+	int prot, flags;
+	void *buf;
 
 	prot  = PROT_READ|PROT_WRITE;
 	flags = MAP_ANONYMOUS|MAP_PRIVATE;
+	if (addr)
+		flags |= MAP_FIXED;
 
-	req->buf = mmap(NULL, TD_STREAM_REQ_SIZE, prot, flags, -1, 0);
-	if (req->buf == MAP_FAILED) {
-		req->buf = NULL;
-		return -errno;
-	}
+	buf = mmap(addr, TD_STREAM_REQ_SIZE, prot, flags, -1, 0);
 
-	return 0;
+	return buf == MAP_FAILED ? NULL : buf;
 }
 
 static void
-tapdisk_stream_req_destroy(td_stream_req_t *req)
+tapdisk_stream_destroy_reqs(td_stream_t *s)
 {
-	if (req->buf) {
-		int err = munmap(req->iov.base, TD_STREAM_REQ_SIZE);
-		BUG_ON(err);
-		req->iov.base = NULL;
-	}
+	unsigned int i;
+
+	if (!s->reqs)
+		return;
+
+	for (i = 0; i < s->n_reqs; i++)
+		if (s->reqs[i].buf) {
+			int err = munmap(s->reqs[i].buf, TD_STREAM_REQ_SIZE);
+			BUG_ON(err);
+		}
+
+	free(s->reqs);
+	s->reqs = NULL;
 }
 
-td_stream_req_t *
-tapdisk_stream_alloc_req(td_stream_t *s)
+static int
+tapdisk_stream_create_reqs(td_stream_t *s, unsigned int n_reqs)
 {
-	td_stream_req_t *req = NULL;
+	unsigned int i;
 
-	if (likely(s->n_free))
-		req = s->free[--s->n_free];
+	s->reqs = calloc(n_reqs, sizeof(*s->reqs));
+	if (!s->reqs)
+		return -ENOMEM;
+
+	s->n_reqs = n_reqs;
+
+	for (i = 0; i < n_reqs; i++) {
+		s->reqs[i].buf = tapdisk_stream_map(NULL);
+		if (!s->reqs[i].buf) {
+			int err = -errno;
+			tapdisk_stream_destroy_reqs(s);
+			return err;
+		}
+	}
 
-	return req;
+	return 0;
 }
 
-void
-tapdisk_stream_free_req(td_stream_t *s, td_stream_req_t *req)
+static int
+tapdisk_stream_write(td_stream_t *s, void *buf, size_t size)
 {
-	BUG_ON(s->n_free >= MAX_REQUESTS);
-	BUG_ON(!list_empty(&req->entry));
-	s->free[s->n_free++] = req;
+	ssize_t n;
+
+	while (size) {
+		if (buf != s->zero)
+			n = write(s->out_fd, buf, size);
+		else if (s->out_seek)
+			n = lseek(s->out_fd, size, SEEK_CUR) == (off_t)-1 ?
+				-1 : size;
+		else
+			n = write(s->out_fd, buf,
+				  MIN(size, TD_STREAM_REQ_SIZE));
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+
+		if (buf != s->zero)
+			buf += n;
+		size -= n;
+	}
+
+	return 0;
 }
 
-static void
-tapdisk_stream_destroy_reqs(td_stream_t *s)
+/* into a pipe; pipe from our own, then spliced on to out */
+static int
+tapdisk_stream_vmsplice(td_stream_t *s, int pipe, void *buf, size_t size,
+			unsigned int flags)
 {
-	td_stream_req_t *req;
+	struct iovec iov;
+	ssize_t n, m;
+
+	while (size) {
+		iov.iov_base = buf;
+		iov.iov_len  = size;
+
+		n = vmsplice(pipe, &iov, 1, flags);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
 
-	do {
-		req = tapdisk_stream_alloc_req(s);
-		if (!req)
-			break;
+		buf  += n;
+		size -= n;
+
+		while (s->out_mode == TD_STREAM_OUT_SPLICE && n) {
+			m = splice(s->pipe[0], NULL, s->out_fd, NULL, n,
+				   SPLICE_F_MOVE|SPLICE_F_MORE);
+			if (m < 0) {
+				if (errno == EINTR)
+					continue;
+				return -errno;
+			}
+
+			n -= m;
+		}
+	}
 
-		tapdisk_stream_req_destroy(req);
-	} while (1);
+	return 0;
 }
 
 static int
-tapdisk_stream_create_reqs(td_stream_t *s)
+tapdisk_stream_splice(td_stream_t *s, void *buf, size_t size)
 {
-	int i, err;
+	int pipe, err;
 
-	s->n_free = 0;
+	pipe = s->out_mode == TD_STREAM_OUT_SPLICE ? s->pipe[1] : s->out_fd;
 
-	for (i = 0; i < TD_STREAM_MAX_REQS; i++) {
-		td_stream_req_t *req = &s->reqs[i];
+	if (buf == s->zero) {
+		/* never written, so safe to leave referenced */
+		while (size) {
+			size_t n = MIN(size, TD_STREAM_REQ_SIZE);
 
-		err = tapdisk_stream_req_create(req);
-		if (err)
-			goto fail;
+			err = tapdisk_stream_vmsplice(s, pipe, s->zero, n, 0);
+			if (err)
+				return err;
+
+			size -= n;
+		}
 
-		tapdisk_stream_free_req(s, req);
+		return 0;
 	}
 
-	return 0;
+	err = tapdisk_stream_vmsplice(s, pipe, buf, size, SPLICE_F_GIFT);
+	if (err)
+		return err;
 
-fail:
-	tapdisk_stream_destroy_reqs(s);
-	return err;
+	return tapdisk_stream_map(buf) ? 0 : -errno;
 }
 
 static int
-tapdisk_stream_print_request(td_stream_t *s, td_stream_req_t *req)
+tapdisk_stream_output(td_stream_t *s, td_stream_req_t *req)
 {
-	struct td_iovec *iov = &req->iov;
+	size_t size = req->secs << SECTOR_SHIFT;
+	void *buf = req->hole ? s->zero : req->buf;
 
-	int gcc = write(s->out_fd, iov->base, iov->secs << SECTOR_SHIFT);
-	if (gcc) {};
+	if (s->out_mode == TD_STREAM_OUT_WRITE)
+		return tapdisk_stream_write(s, buf, size);
 
-	return iov->secs;
+	return tapdisk_stream_splice(s, buf, size);
 }
 
 static void
 tapdisk_stream_write_data(td_stream_t *s)
 {
-	td_stream_req_t *req, *next;
+	td_stream_req_t *req;
+	int err;
 
-	list_for_each_entry_safe(req, next, &s->completed_list, entry) {
-		if (req->vreq.sec != s->sec_out)
+	while (s->head != s->tail) {
+		req = tapdisk_stream_ring(s, s->head);
+		if (!req->done)
 			break;
 
-		s->sec_out += tapdisk_stream_print_request(s, req);
+		if (req->err) {
+			s->err = s->err ? : EIO;
+			fprintf(stderr, "error reading sector 0x%"PRIx64": %d\n",
+				req->sec, req->err);
+		} else if (!s->err) {
+			err = tapdisk_stream_output(s, req);
+			if (err) {
+				s->err = -err;
+				fprintf(stderr, "error writing output: %d\n",
+					err);
+			}
+		}
 
-		list_del_init(&req->entry);
-		tapdisk_stream_free_req(s, req);
+		s->head++;
 	}
 }
 
-static inline void
-tapdisk_stream_queue_completed(td_stream_t *s, td_stream_req_t *req)
-{
-	td_stream_req_t *itr;
-
-	list_for_each_entry(itr, &s->completed_list, entry)
-		if (req->vreq.sec < itr->vreq.sec)
-			break;
-
-	list_add_tail(&req->entry, &itr->entry);
-}
-
 static void
-tapdisk_stream_complete_request(td_stream_t *s, td_stream_req_t *req, 
+tapdisk_stream_complete_request(td_stream_t *s, td_stream_req_t *req,
 				int error, int final)
 {
-	list_del_init(&req->entry);
-
-	if (likely(!error))
-		tapdisk_stream_queue_completed(s, req);
-	else {
-		s->err = EIO;
-		tapdisk_stream_free_req(s, req);
-		fprintf(stderr, "error reading sector 0x%"PRIx64"\n",
-			req->vreq.sec);
-	}
-
-	if (!final)
-		return;
-
-	tapdisk_stream_write_data(s);
+	req->done = 1;
+	req->err  = error;
 
-	if (tapdisk_stream_stop(s)) {
-		tapdisk_stream_close_image(s);
-		return;
-	}
-
-	tapdisk_stream_queue_requests(s);
+	if (final)
+		tapdisk_stream_queue_requests(s);
 }
 
 static void
@@ -258,51 +336,86 @@ __tapdisk_stream_request_cb(td_vbd_request_t *vreq, int error,
 	tapdisk_stream_complete_request(s, req, error, final);
 }
 
+/* sectors from sec_in on, a request at a time, that no image holds */
+static td_sector_t
+tapdisk_stream_hole(td_stream_t *s)
+{
+	td_sector_t hole, secs;
+
+	hole = 0;
+
+	while (hole < s->count) {
+		secs = MIN(TD_STREAM_REQ_SIZE >> SECTOR_SHIFT,
+			   s->count - hole);
+
+		if (tapdisk_vbd_allocated(s->vbd, s->sec_in + hole, secs))
+			break;
+
+		hole += secs;
+	}
+
+	return hole;
+}
+
 static void
 tapdisk_stream_queue_request(td_stream_t *s, td_stream_req_t *req)
 {
 	td_vbd_request_t *vreq;
 	struct td_iovec *iov;
-	int secs, err;
+	td_sector_t hole;
+	int err;
+
+	hole = s->skip_holes ? tapdisk_stream_hole(s) : 0;
+
+	req->sec  = s->sec_in;
+	req->secs = hole ? : MIN(TD_STREAM_REQ_SIZE >> SECTOR_SHIFT, s->count);
+	req->hole = !!hole;
+	req->done = 0;
+	req->err  = 0;
 
-	iov   = &req->iov;
-	secs  = MIN(TD_STREAM_REQ_SIZE >> SECTOR_SHIFT, s->count);
+	s->count  -= req->secs;
+	s->sec_in += req->secs;
 
+	if (req->hole) {
+		req->done = 1;
+		return;
+	}
+
+	iov                 = &req->iov;
 	iov->base           = req->buf;
-	iov->secs           = secs;
+	iov->secs           = req->secs;
 
 	vreq                = &req->vreq;
 	vreq->iov           = iov;
 	vreq->iovcnt        = 1;
-	vreq->sec           = s->sec_in;
+	vreq->sec           = req->sec;
 	vreq->op            = TD_OP_READ;
 	vreq->name          = NULL;
 	vreq->token         = s;
 	vreq->cb            = __tapdisk_stream_request_cb;
 
-	s->count  -= secs;
-	s->sec_in += secs;
-
 	err = tapdisk_vbd_queue_request(s->vbd, vreq);
-	if (err)
-		tapdisk_stream_complete_request(s, req, err, 1);
-
-	list_add_tail(&req->entry, &s->pending_list);
+	if (err) {
+		req->done = 1;
+		req->err  = err;
+	}
 }
 
 static void
 tapdisk_stream_queue_requests(td_stream_t *s)
 {
+	for (;;) {
+		tapdisk_stream_write_data(s);
 
-	while (s->count && !s->err) {
-		td_stream_req_t *req;
-
-		req = tapdisk_stream_alloc_req(s);
-		if (!req)
+		if (!s->count || s->err || s->tail - s->head == s->n_reqs)
 			break;
 
-		tapdisk_stream_queue_request(s, req);
+		tapdisk_stream_queue_request(s,
+					     tapdisk_stream_ring(s, s->tail++));
 	}
+
+	if (tapdisk_stream_stop(s))
+		tapdisk_stream_close_image(s);
 }
 
 static int
@@ -376,32 +489,81 @@ tapdisk_stream_set_position(td_stream_t *s,
 	}
 
 	s->sec_in  = skip;
-	s->sec_out = skip;
 	s->count   = count;
 
 	return 0;
 }
 
-void
-__tapdisk_stream_event_cb(event_id_t id, char mode, void *arg)
-{
-}
-
 static int
-tapdisk_stream_open_fds(struct tapdisk_stream *s)
+tapdisk_stream_open_fds(struct tapdisk_stream *s, unsigned int n_reqs)
 {
+	struct stat st;
+	int size;
+
 	s->out_fd = dup(STDOUT_FILENO);
 	if (s->out_fd == -1) {
 		fprintf(stderr, "failed to open output: %d\n", errno);
 		return errno;
 	}
 
+	if (fstat(s->out_fd, &st)) {
+		fprintf(stderr, "failed to stat output: %d\n", errno);
+		return errno;
+	}
+
+	s->out_seek = S_ISREG(st.st_mode);
+
+	if (S_ISFIFO(st.st_mode))
+		s->out_mode = TD_STREAM_OUT_PIPE;
+	else if (S_ISSOCK(st.st_mode) && !pipe(s->pipe))
+		s->out_mode = TD_STREAM_OUT_SPLICE;
+
+	/* room for the window, as far as the pipe limit allows */
+	if (s->out_mode != TD_STREAM_OUT_WRITE) {
+		int fd = s->out_mode == TD_STREAM_OUT_PIPE ?
+			s->out_fd : s->pipe[1];
+
+		size = TD_STREAM_REQ_SIZE * n_reqs;
+		while (fcntl(fd, F_SETPIPE_SZ, size) < 0 &&
+		       size > TD_STREAM_REQ_SIZE)
+			size >>= 1;
+	}
+
+	s->zero = mmap(NULL, TD_STREAM_REQ_SIZE, PROT_READ,
+		       MAP_ANONYMOUS|MAP_PRIVATE, -1, 0);
+	if (s->zero == MAP_FAILED) {
+		s->zero = NULL;
+		return errno;
+	}
+
+	return 0;
+}
+
+/* a file ending in a hole seeked over still needs its size */
+static int
+tapdisk_stream_close_output(struct tapdisk_stream *s)
+{
+	struct stat st;
+	off_t off;
+
+	if (!s->out_seek || s->err)
+		return 0;
+
+	off = lseek(s->out_fd, 0, SEEK_CUR);
+	if (off == (off_t)-1 || fstat(s->out_fd, &st))
+		return -errno;
+
+	if (st.st_size < off && ftruncate(s->out_fd, off))
+		return -errno;
+
 	return 0;
 }
 
 static void
 tapdisk_stream_close(struct tapdisk_stream *s)
 {
+	int i;
+
 	tapdisk_stream_destroy_reqs(s);
 
 	tapdisk_stream_close_image(s);
@@ -410,27 +572,39 @@ tapdisk_stream_close(struct tapdisk_stream *s)
 		close(s->out_fd);
 		s->out_fd = -1;
 	}
+
+	for (i = 0; i < 2; i++)
+		if (s->pipe[i] >= 0) {
+			close(s->pipe[i]);
+			s->pipe[i] = -1;
+		}
+
+	if (s->zero) {
+		munmap(s->zero, TD_STREAM_REQ_SIZE);
+		s->zero = NULL;
+	}
 }
 
 static int
 tapdisk_stream_open(struct tapdisk_stream *s, const char *name,
-		    uint64_t count, uint64_t skip)
+		    uint64_t count, uint64_t skip, unsigned int n_reqs,
+		    int skip_holes)
 {
 	int err = 0;
 
 	memset(s, 0, sizeof(*s));
-	s->in_fd = s->out_fd = -1;
-	INIT_LIST_HEAD(&s->pending_list);
-	INIT_LIST_HEAD(&s->completed_list);
+	s->out_fd     = -1;
+	s->pipe[0]    = s->pipe[1] = -1;
+	s->skip_holes = skip_holes;
 
 	if (!err)
-		err = tapdisk_stream_open_fds(s);
+		err = tapdisk_stream_open_fds(s, n_reqs);
 	if (!err)
 		err = tapdisk_stream_open_image(s, name);
 	if (!err)
 		err = tapdisk_stream_set_position(s, count, skip);
 	if (!err)
-		err = tapdisk_stream_create_reqs(s);
+		err = tapdisk_stream_create_reqs(s, n_reqs);
 
 	if (err)
 		tapdisk_stream_close(s);
@@ -441,25 +615,34 @@ tapdisk_stream_open(struct tapdisk_stream *s, const char *name,
 static int
 tapdisk_stream_run(struct tapdisk_stream *s)
 {
+	int err;
+
 	tapdisk_stream_queue_requests(s);
-	tapdisk_server_run();
-	return s->err;
+	if (s->vbd)
+		tapdisk_server_run();
+
+	err = tapdisk_stream_close_output(s);
+
+	return s->err ? : -err;
 }
 
 int
 main(int argc, char *argv[])
 {
-	int c, err;
+	int c, err, skip_holes;
 	const char *params;
 	uint64_t count, skip;
+	unsigned int n_reqs;
 	struct tapdisk_stream stream;
 
-	err    = 0;
-	skip   = 0;
-	count  = (uint64_t)-1;
-	params = NULL;
+	err        = 0;
+	skip       = 0;
+	count      = (uint64_t)-1;
+	params     = NULL;
+	n_reqs     = TD_STREAM_DEF_REQS;
+	skip_holes = 0;
 
-	while ((c = getopt(argc, argv, "n:c:s:h")) != -1) {
+	while ((c = getopt(argc, argv, "n:c:s:w:uh")) != -1) {
 		switch (c) {
 		case 'n':
 			params = optarg;
@@ -470,6 +653,17 @@ main(int argc, char *argv[])
 		case 's':
 			skip = strtoull(optarg, NULL, 10);
 			break;
+		case 'w':
+			n_reqs = strtoul(optarg, NULL, 10);
+			if (!n_reqs || n_reqs > TD_STREAM_MAX_REQS) {
+				fprintf(stderr, "window of 1 to %d requests\n",
+					TD_STREAM_MAX_REQS);
+				usage(argv[0], EINVAL);
+			}
+			break;
+		case 'u':
+			skip_holes = 1;
+			break;
 		default:
 			err = EINVAL;
 		case 'h':
@@ -482,7 +676,8 @@ main(int argc, char *argv[])
 
 	tapdisk_start_logging("tapdisk-stream", "daemon");
 
-	err = tapdisk_stream_open(&stream, params, count, skip);
+	err = tapdisk_stream_open(&stream, params, count, skip,
+				  n_reqs, skip_holes);
 	if (err)
 		goto out;
 
@@ -34,9 +34,12 @@
 #include <fcntl.h>
 #include <stdarg.h>
 #include <sys/mman.h>
+#include <stdint.h>
+#include <string.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 
+#include "libaio-compat.h"
 #include "tapdisk-server.h"
 #include "tapdisk-syslog.h"
 #include "tapdisk-utils.h"
@@ -49,24 +52,46 @@ static int tapdisk_syslog_sock_connect(td_syslog_t *log);
 
 static void tapdisk_syslog_sock_mask(td_syslog_t *log);
 static void tapdisk_syslog_sock_unmask(td_syslog_t *log);
+static void tapdisk_syslog_kick(td_syslog_t *log);
 
 static const struct sockaddr_un syslog_addr = {
 	.sun_family = AF_UNIX,
 	.sun_path   = "/dev/log"
 };
 
-#define RING_PTR(_log, _idx)                                            \
-	(&(_log)->ring[(_idx) % (_log)->ringsz])
+struct td_syslog_rec {
+	uint32_t         size;  /* of the record, 0 until written */
+	uint32_t         len;   /* of the packet, 0 for padding */
+	char             data[0];
+};
+
+#define REC_ALIGN        8
+#define REC_SIZE(_len)                                                  \
+	((sizeof(struct td_syslog_rec) + (_len) + REC_ALIGN - 1) &      \
+	 ~(size_t)(REC_ALIGN - 1))
+
+#define RING_REC(_log, _idx)                                            \
+	((struct td_syslog_rec *)&(_log)->ring[(_idx) % (_log)->ringsz])
 
-#define RING_FREE(_log)                                                 \
-	((_log)->ringsz - ((_log)->prod - (_log)->cons))
+#define RING_EMPTY(_log)                                                \
+	(__atomic_load_n(&(_log)->prod, __ATOMIC_ACQUIRE) ==            \
+	 __atomic_load_n(&(_log)->cons, __ATOMIC_ACQUIRE))
+
+#define STAT_ADD(_log, _field, _n)                                      \
+	__atomic_fetch_add(&(_log)->stats._field, (_n), __ATOMIC_RELAXED)
 
 /*
  * NB. Ring buffer.
  *
  * We allocate a number of pages as indicated by @bufsz during
- * initialization. From that, 1K is reserved for message staging, the
- * rest is cyclic ring space.
+ * initialization, all of it cyclic ring space, holding one record per
+ * packet. Records never wrap: one not fitting at the end follows a
+ * padding record to it.
+ *
+ * Any thread may produce. Space is claimed with a CAS on 'prod', the
+ * record then written and its size stored last. Only the main loop
+ * consumes, in order, up to the first record not yet written, and
+ * clears each one before moving 'cons' past it.
  *
  * All producer/consumer offsets wrap on size_t range, not buffer
  * size. Hence the RING() macros.
@@ -77,7 +102,6 @@ __tapdisk_syslog_ring_init(td_syslog_t *log)
 {
 	log->buf     = NULL;
 	log->bufsz   = 0;
-	log->msg     = NULL;
 	log->ring    = NULL;
 	log->ringsz  = 0;
 }
@@ -117,15 +141,14 @@ tapdisk_syslog_ring_init(td_syslog_t *log, size_t size)
 		goto fail;
 	}
 
-	err = mlock(log->buf, size);
+	err = mlock(log->buf, log->bufsz);
 	if (err) {
 		err = -errno;
 		goto fail;
 	}
 
-	log->msg    = log->buf;
-	log->ring   = log->buf + TD_SYSLOG_PACKET_MAX;
-	log->ringsz = size     - TD_SYSLOG_PACKET_MAX;
+	log->ring   = log->buf;
+	log->ringsz = log->bufsz;
 
 	return 0;
 
@@ -138,88 +161,124 @@ fail:
 static int
 tapdisk_syslog_ring_write_str(td_syslog_t *log, const char *msg, size_t len)
 {
-	size_t size, prod, i;
+	struct td_syslog_rec *rec;
+	size_t need, pad, prod, cons, off;
 
-	len  = MIN(len, TD_SYSLOG_PACKET_MAX);
-	size = len + 1;
-
-	if (size > RING_FREE(log))
+	if (!log->ring)
 		return -ENOBUFS;
 
-	prod = log->prod;
-
-	for (i = 0; i < len; ++i) {
-		char c;
-
-		c = msg[i];
-		if (c == 0)
-			break;
+	len  = MIN(len, TD_SYSLOG_PACKET_MAX);
+	need = REC_SIZE(len);
 
-		*RING_PTR(log, prod) = c;
-		prod++;
+	prod = __atomic_load_n(&log->prod, __ATOMIC_RELAXED);
+	do {
+		cons = __atomic_load_n(&log->cons, __ATOMIC_ACQUIRE);
+		off  = prod % log->ringsz;
+		pad  = log->ringsz - off < need ? log->ringsz - off : 0;
+
+		if (pad + need > log->ringsz - (prod - cons))
+			return -ENOBUFS;
+
+	} while (!__atomic_compare_exchange_n(&log->prod, &prod,
+					      prod + pad + need, 1,
+					      __ATOMIC_ACQ_REL,
+					      __ATOMIC_RELAXED));
+
+	if (pad) {
+		rec      = RING_REC(log, prod);
+		rec->len = 0;
+		__atomic_store_n(&rec->size, pad, __ATOMIC_RELEASE);
+		prod    += pad;
 	}
 
-	*RING_PTR(log, prod) = 0;
-
-	log->prod = prod + 1;
+	rec      = RING_REC(log, prod);
+	rec->len = len;
+	memcpy(rec->data, msg, len);
+	__atomic_store_n(&rec->size, need, __ATOMIC_RELEASE);
 
 	return 0;
 }
 
-static ssize_t
-tapdisk_syslog_ring_read_pkt(td_syslog_t *log, char *msg, size_t size)
+/* clears the records up to @end, for producers to reuse */
+static void
+tapdisk_syslog_ring_release(td_syslog_t *log, size_t end)
 {
-	size_t cons;
-	ssize_t sz;
-
-	size = MIN(size, TD_SYSLOG_PACKET_MAX);
+	struct td_syslog_rec *rec;
+	size_t cons = log->cons;
 
-	sz   = 0;
-	cons = log->cons;
+	while (cons != end) {
+		rec  = RING_REC(log, cons);
+		cons += rec->size;
+		rec->size = 0;
+	}
 
-	while (sz < size) {
-		char c;
+	__atomic_store_n(&log->cons, end, __ATOMIC_RELEASE);
+}
 
-		if (cons == log->prod)
+/*
+ * Sends up to TD_SYSLOG_BATCH packets in one sendmmsg. -ENOMSG once
+ * the ring is out of written records.
+ */
+static int
+tapdisk_syslog_ring_dispatch_batch(td_syslog_t *log)
+{
+	struct mmsghdr msgs[TD_SYSLOG_BATCH];
+	struct iovec iov[TD_SYSLOG_BATCH];
+	size_t ends[TD_SYSLOG_BATCH];
+	struct td_syslog_rec *rec;
+	size_t pos, prod, size;
+	int i, n, err;
+
+	prod = __atomic_load_n(&log->prod, __ATOMIC_ACQUIRE);
+	pos  = log->cons;
+	n    = 0;
+
+	while (pos != prod && n < TD_SYSLOG_BATCH) {
+		rec  = RING_REC(log, pos);
+		size = __atomic_load_n(&rec->size, __ATOMIC_ACQUIRE);
+		if (!size)
 			break;
 
-		c = *RING_PTR(log, cons);
-		msg[sz++] = c;
-		cons++;
+		pos += size;
+		if (!rec->len)
+			continue;
 
-		if (c == 0)
-			break;
+		iov[n].iov_base = rec->data;
+		iov[n].iov_len  = rec->len;
+		ends[n]         = pos;
+		n++;
 	}
 
-	return sz - 1;
-}
+	if (!n) {
+		tapdisk_syslog_ring_release(log, pos);
+		return -ENOMSG;
+	}
 
-static int
-tapdisk_syslog_ring_dispatch_one(td_syslog_t *log)
-{
-	size_t len;
-	int err;
+	memset(msgs, 0, sizeof(msgs[0]) * n);
+	for (i = 0; i < n; i++) {
+		msgs[i].msg_hdr.msg_iov    = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
 
-	len = tapdisk_syslog_ring_read_pkt(log, log->msg,
-					   TD_SYSLOG_PACKET_MAX);
-	if (len == -1)
-		return -ENOMSG;
+	STAT_ADD(log, batches, 1);
 
-	err = tapdisk_syslog_sock_send(log, log->msg, len);
+	i = sendmmsg(log->sock, msgs, n, MSG_DONTWAIT);
+	if (i < 0) {
+		err = -errno;
 
-	if (err == -EAGAIN)
-		return err;
+		if (err == -EAGAIN)
+			return err;
 
-	if (err)
-		goto fail;
+		if (err == -ENOTCONN && !tapdisk_syslog_sock_connect(log))
+			return 0;
 
-done:
-	log->cons += len + 1;
-	return 0;
+		STAT_ADD(log, fails, 1);
+		i = 1;
+	} else
+		STAT_ADD(log, xmits, i);
 
-fail:
-	log->stats.fails++;
-	goto done;
+	tapdisk_syslog_ring_release(log, ends[i - 1]);
+	return 0;
 }
 
 static void
@@ -227,26 +286,28 @@ tapdisk_syslog_ring_warning(td_syslog_t *log)
 {
 	int n, err;
 
-	n        = log->oom;
-	log->oom = 0;
+	n = __atomic_exchange_n(&log->oom, 0, __ATOMIC_ACQ_REL);
 
 	err = tapdisk_syslog(log, TLOG_WARN,
 			     "tapdisk-syslog: %d messages dropped", n);
 	if (err)
-		log->oom = n;
+		__atomic_fetch_add(&log->oom, n, __ATOMIC_RELAXED);
 }
 
-static void
+/* -EAGAIN while the socket is full */
+static int
 tapdisk_syslog_ring_dispatch(td_syslog_t *log)
 {
 	int err;
 
 	do {
-		err = tapdisk_syslog_ring_dispatch_one(log);
+		err = tapdisk_syslog_ring_dispatch_batch(log);
 	} while (!err);
 
-	if (log->oom)
+	if (__atomic_load_n(&log->oom, __ATOMIC_RELAXED) && RING_EMPTY(log))
 		tapdisk_syslog_ring_warning(log);
+
+	return err;
 }
 
 static int
@@ -304,30 +365,35 @@ tapdisk_syslog_vsprintf(char *buf, size_t size,
  * message. Also, the write event handler will go on to discard any
  * remaining ring contents as well, once the socket is disconnected.
  *
+ * Only the main thread sends directly, and only into an empty ring.
+ * Other threads queue and kick the main loop to send for them.
+ *
  * In summary, no attempts to mask service blackouts in here.
  */
 
 int
 tapdisk_vsyslog(td_syslog_t *log, int prio, const char *fmt, va_list ap)
 {
+	char msg[TD_SYSLOG_PACKET_MAX];
 	struct timeval now;
+	int main, err;
 	size_t len;
-	int err;
 
 	gettimeofday(&now, NULL);
 
-	len = tapdisk_syslog_vsprintf(log->msg, TD_SYSLOG_PACKET_MAX,
+	len = tapdisk_syslog_vsprintf(msg, sizeof(msg),
 				      prio | log->facility,
 				      &now, log->ident, fmt, ap);
 
-	log->stats.count += 1;
-	log->stats.bytes += len;
+	STAT_ADD(log, count, 1);
+	STAT_ADD(log, bytes, len);
 
-	if (log->cons != log->prod)
+	main = tapdisk_server_main_thread();
+	if (!main || !RING_EMPTY(log))
 		goto busy;
 
 send:
-	err = tapdisk_syslog_sock_send(log, log->msg, len);
+	err = tapdisk_syslog_sock_send(log, msg, len);
 	if (!err)
 		return 0;
 
@@ -340,27 +406,30 @@ send:
 	if (err != -EAGAIN)
 		goto fail;
 
-	tapdisk_syslog_sock_unmask(log);
-
 busy:
-	if (log->oom) {
+	if (__atomic_load_n(&log->oom, __ATOMIC_RELAXED)) {
 		err = -ENOBUFS;
 		goto oom;
 	}
 
-	err = tapdisk_syslog_ring_write_str(log, log->msg, len);
-	if (!err)
-		return 0;
+	err = tapdisk_syslog_ring_write_str(log, msg, len);
+	if (err)
+		goto oom;
 
-	log->oom_tv = now;
+	if (main)
+		tapdisk_syslog_sock_unmask(log);
+	else
+		tapdisk_syslog_kick(log);
+
+	return 0;
 
 oom:
-	log->oom++;
-	log->stats.drops++;
+	__atomic_fetch_add(&log->oom, 1, __ATOMIC_RELAXED);
+	STAT_ADD(log, drops, 1);
 	return err;
 
 fail:
-	log->stats.fails++;
+	STAT_ADD(log, fails, 1);
 	return err;
 }
 
@@ -382,7 +451,7 @@ tapdisk_syslog_sock_send(td_syslog_t *log, const void *msg, size_t size)
 {
 	ssize_t n;
 
-	log->stats.xmits++;
+	STAT_ADD(log, xmits, 1);
 
 	n = send(log->sock, msg, size, MSG_DONTWAIT);
 	if (n < 0)
@@ -396,17 +465,47 @@ tapdisk_syslog_sock_event(event_id_t id, char mode, void *private)
 {
 	td_syslog_t *log = private;
 
-	tapdisk_syslog_ring_dispatch(log);
-
-	if (log->cons == log->prod)
+	/* a record still being written comes with a kick */
+	if (tapdisk_syslog_ring_dispatch(log) != -EAGAIN)
 		tapdisk_syslog_sock_mask(log);
 }
 
+static void
+tapdisk_syslog_kick(td_syslog_t *log)
+{
+	uint64_t val = 1;
+	int gcc;
+
+	if (__atomic_exchange_n(&log->kicked, 1, __ATOMIC_ACQ_REL))
+		return;
+
+	gcc = write(log->kick_fd, &val, sizeof(val));
+	if (gcc) {};
+}
+
+static void
+tapdisk_syslog_kick_event(event_id_t id, char mode, void *private)
+{
+	td_syslog_t *log = private;
+	uint64_t val;
+	int gcc;
+
+	gcc = read(log->kick_fd, &val, sizeof(val));
+	if (gcc) {};
+
+	__atomic_store_n(&log->kicked, 0, __ATOMIC_RELEASE);
+
+	if (tapdisk_syslog_ring_dispatch(log) == -EAGAIN)
+		tapdisk_syslog_sock_unmask(log);
+}
+
 static void
 __tapdisk_syslog_sock_init(td_syslog_t *log)
 {
 	log->sock     = -1;
 	log->event_id = -1;
+	log->kick_fd  = -1;
+	log->kick_id  = -1;
 }
 
 static void
@@ -416,7 +515,13 @@ tapdisk_syslog_sock_close(td_syslog_t *log)
 		close(log->sock);
 
 	if (log->event_id >= 0)
-		tapdisk_server_unregister_event(log->event_id);
+		tapdisk_server_unregister_main_event(log->event_id);
+
+	if (log->kick_id >= 0)
+		tapdisk_server_unregister_main_event(log->kick_id);
+
+	if (log->kick_fd >= 0)
+		close(log->kick_fd);
 
 	__tapdisk_syslog_sock_init(log);
 }
@@ -445,10 +550,10 @@ tapdisk_syslog_sock_open(td_syslog_t *log)
 	}
 #endif
 
-	id = tapdisk_server_register_event(SCHEDULER_POLL_WRITE_FD,
-					   s, 0,
-					   tapdisk_syslog_sock_event,
-					   log);
+	id = tapdisk_server_register_main_event(SCHEDULER_POLL_WRITE_FD,
+					        s, 0,
+					        tapdisk_syslog_sock_event,
+					        log);
 	if (id < 0) {
 		err = id;
 		goto fail;
@@ -458,6 +563,23 @@ tapdisk_syslog_sock_open(td_syslog_t *log)
 
 	tapdisk_syslog_sock_mask(log);
 
+	log->kick_fd = tapdisk_sys_eventfd(0);
+	if (log->kick_fd < 0) {
+		err = -errno;
+		goto fail;
+	}
+
+	id = tapdisk_server_register_main_event(SCHEDULER_POLL_READ_FD,
+					        log->kick_fd, 0,
+					        tapdisk_syslog_kick_event,
+					        log);
+	if (id < 0) {
+		err = id;
+		goto fail;
+	}
+
+	log->kick_id = id;
+
 	return 0;
 
 fail:
@@ -480,13 +602,13 @@ tapdisk_syslog_sock_connect(td_syslog_t *log)
 static void
 tapdisk_syslog_sock_mask(td_syslog_t *log)
 {
-	tapdisk_server_mask_event(log->event_id, 1);
+	tapdisk_server_mask_main_event(log->event_id, 1);
 }
 
 static void
 tapdisk_syslog_sock_unmask(td_syslog_t *log)
 {
-	tapdisk_server_mask_event(log->event_id, 0);
+	tapdisk_server_mask_main_event(log->event_id, 0);
 }
 
 void
@@ -542,14 +664,15 @@ tapdisk_syslog_stats(td_syslog_t *log, int prio)
 
 	tapdisk_syslog(log, prio,
 		       "tapdisk-syslog: %llu messages, %llu bytes, "
-		       "xmits: %llu, failed: %llu, dropped: %llu",
-		       s->count, s->bytes,
-		       s->xmits, s->fails, s->drops);
+		       "xmits: %llu, batches: %llu, failed: %llu, "
+		       "dropped: %llu",
+		       s->count, s->bytes, s->xmits, s->batches,
+		       s->fails, s->drops);
 }
 
 void
 tapdisk_syslog_flush(td_syslog_t *log)
 {
-	while (log->cons != log->prod)
+	while (!RING_EMPTY(log))
 		tapdisk_server_iterate();
 }
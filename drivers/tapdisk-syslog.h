@@ -25,11 +25,13 @@
 typedef struct _td_syslog td_syslog_t;
 
 #define TD_SYSLOG_PACKET_MAX  1024
+#define TD_SYSLOG_BATCH       32    /* packets per sendmmsg */
 
 struct _td_syslog_stats {
 	unsigned long long count;
 	unsigned long long bytes;
 	unsigned long long xmits;
+	unsigned long long batches;
 	unsigned long long fails;
 	unsigned long long drops;
 };
@@ -41,11 +43,14 @@ struct _td_syslog {
 	int              sock;
 	event_id_t       event_id;
 
+	/* rung by other threads, once per dispatch */
+	int              kick_fd;
+	event_id_t       kick_id;
+	int              kicked;
+
 	void            *buf;
 	size_t           bufsz;
 
-	char            *msg;
-
 	char            *ring;
 	size_t           ringsz;
 
@@ -53,7 +58,6 @@ struct _td_syslog {
 	size_t           cons;
 
 	int              oom;
-	struct timeval   oom_tv;
 
 	struct _td_syslog_stats stats;
 };
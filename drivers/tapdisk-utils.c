@@ -23,6 +23,7 @@
 #include <errno.h>
 #include <stdio.h>
 #include <string.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <linux/fs.h>
 #include <sys/stat.h>
@@ -30,7 +31,11 @@
 #include <sys/ioctl.h>
 #include <sys/resource.h>
 #include <sys/utsname.h>
+#include <sys/sysmacros.h>
 #include <arpa/inet.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #ifdef __linux__
 #include <linux/version.h>
@@ -177,6 +182,76 @@ tapdisk_namedup(char **dup, const char *name)
 	return 0;
 }
 
+static long
+tapdisk_sysfs_queue_val(dev_t dev, const char *attr)
+{
+	char path[128];
+	long val;
+	FILE *f;
+
+	/* partitions keep their queue on the parent */
+	snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/queue/%s",
+		 major(dev), minor(dev), attr);
+	f = fopen(path, "r");
+	if (!f) {
+		snprintf(path, sizeof(path),
+			 "/sys/dev/block/%u:%u/../queue/%s",
+			 major(dev), minor(dev), attr);
+		f = fopen(path, "r");
+	}
+	if (!f)
+		return 0;
+
+	if (fscanf(f, "%ld", &val) != 1)
+		val = 0;
+	fclose(f);
+
+	return val;
+}
+
+/*
+ * Logical and physical block size behind fd: the device's own for a
+ * block device, else those of the device holding the file, which
+ * O_DIRECT has to be aligned to. DEFAULT_SECTOR_SIZE when unknown.
+ */
+void
+tapdisk_get_sector_size(int fd, long *logical, long *physical)
+{
+	struct stat st;
+	int lsz, psz;
+
+	lsz = psz = DEFAULT_SECTOR_SIZE;
+
+	if (fstat(fd, &st))
+		goto out;
+
+	if (S_ISBLK(st.st_mode)) {
+#if defined(BLKSSZGET)
+		if (ioctl(fd, BLKSSZGET, &lsz))
+			lsz = DEFAULT_SECTOR_SIZE;
+#endif
+#if defined(BLKPBSZGET)
+		if (ioctl(fd, BLKPBSZGET, &psz))
+			psz = lsz;
+#endif
+	} else if (S_ISREG(st.st_mode)) {
+		lsz = tapdisk_sysfs_queue_val(st.st_dev,
+					      "logical_block_size") ? :
+			DEFAULT_SECTOR_SIZE;
+		psz = tapdisk_sysfs_queue_val(st.st_dev,
+					      "physical_block_size") ? : lsz;
+	}
+
+	if (lsz < DEFAULT_SECTOR_SIZE || (lsz & (lsz - 1)))
+		lsz = DEFAULT_SECTOR_SIZE;
+	if (psz < lsz || (psz & (psz - 1)))
+		psz = lsz;
+
+out:
+	*logical  = lsz;
+	*physical = psz;
+}
+
 /*Get Image size, secsize*/
 int
 tapdisk_get_image_size(int fd, uint64_t *_sectors, uint32_t *_sector_size)
@@ -232,6 +307,87 @@ tapdisk_get_image_size(int fd, uint64_t *_sectors, uint32_t *_sector_size)
 	return 0;
 }
 
+/*
+ * All bytes zero. The first 16 are checked by hand, the rest compared
+ * with themselves shifted by 16, which takes libc's vectorised memcmp.
+ */
+int
+tapdisk_buf_zero(const void *buf, size_t len)
+{
+	static const char zero[16];
+	const char *p = buf;
+
+	if (len <= sizeof(zero))
+		return !memcmp(p, zero, len);
+
+	return !memcmp(p, zero, sizeof(zero)) &&
+		!memcmp(p, p + sizeof(zero), len - sizeof(zero));
+}
+
+/*
+ * Zero a buffer the caller will not read back. Large aligned spans
+ * go out with non-temporal stores, so filling holes for the guest
+ * does not push the working set out of the cache.
+ */
+#define TD_ZERO_STREAM_MIN	4096
+
+void
+tapdisk_buf_fill_zero(void *buf, size_t len)
+{
+#ifdef __SSE2__
+	const __m128i zero = _mm_setzero_si128();
+	__m128i *p = buf;
+	size_t n;
+
+	if (len < TD_ZERO_STREAM_MIN || ((unsigned long)buf & 15)) {
+		memset(buf, 0, len);
+		return;
+	}
+
+	for (n = len >> 6; n; n--, p += 4) {
+		_mm_stream_si128(p, zero);
+		_mm_stream_si128(p + 1, zero);
+		_mm_stream_si128(p + 2, zero);
+		_mm_stream_si128(p + 3, zero);
+	}
+	_mm_sfence();
+
+	memset(p, 0, len & 63);
+#else
+	memset(buf, 0, len);
+#endif
+}
+
+/*
+ * Deallocate a byte range: BLKDISCARD on block devices, a hole punched
+ * with the file size kept on regular files. -EOPNOTSUPP if neither the
+ * device nor the filesystem can.
+ */
+int
+tapdisk_discard_range(int fd, uint64_t offset, uint64_t len)
+{
+	struct stat st;
+	int err;
+
+	if (fstat(fd, &st))
+		return -errno;
+
+	if (S_ISBLK(st.st_mode)) {
+		uint64_t range[2] = { offset, len };
+		err = ioctl(fd, BLKDISCARD, range);
+	} else
+		err = fallocate(fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,
+				offset, len);
+
+	if (err) {
+		err = -errno;
+		if (err == -EINVAL || err == -ENOTTY)
+			err = -EOPNOTSUPP;
+	}
+
+	return err;
+}
+
 #ifdef __linux__
 
 int tapdisk_linux_version(void)
@@ -260,6 +416,27 @@ int tapdisk_linux_version(void)
 
 #endif
 
+/* of the whole process, from /proc/self/statm */
+int
+tapdisk_resident_bytes(uint64_t *bytes)
+{
+	unsigned long size, resident;
+	FILE *f;
+	int n;
+
+	f = fopen("/proc/self/statm", "r");
+	if (!f)
+		return -errno;
+
+	n = fscanf(f, "%lu %lu", &size, &resident);
+	fclose(f);
+	if (n != 2)
+		return -EINVAL;
+
+	*bytes = (uint64_t)resident * sysconf(_SC_PAGE_SIZE);
+	return 0;
+}
+
 #ifdef WORDS_BIGENDIAN
 uint64_t ntohll(uint64_t a) {
 	return a;
@@ -33,7 +33,12 @@ int tapdisk_set_resource_limits(void);
 int tapdisk_namedup(char **, const char *);
 int tapdisk_parse_disk_type(const char *, char **, int *);
 int tapdisk_get_image_size(int, uint64_t *, uint32_t *);
+void tapdisk_get_sector_size(int, long *, long *);
+int tapdisk_discard_range(int, uint64_t, uint64_t);
+int tapdisk_buf_zero(const void *, size_t);
+void tapdisk_buf_fill_zero(void *, size_t);
 int tapdisk_linux_version(void);
+int tapdisk_resident_bytes(uint64_t *);
 uint64_t ntohll(uint64_t);
 #define htonll ntohll
 
@@ -38,8 +38,19 @@
 #include "tapdisk-disktype.h"
 #include "tapdisk-interface.h"
 #include "tapdisk-stats.h"
+#include "tapdisk-utils.h"
 #include "tapdisk-storage.h"
 #include "tapdisk-nbdserver.h"
+#include "tapdisk-shm-cache.h"
+#include "tapdisk-metrics.h"
+#include "block-cache.h"
+#include "tapdisk-iotrace.h"
+#include "tapdisk-heat.h"
+#include "tapdisk-warm.h"
+#include "tapdisk-ringserver.h"
+#include "tapdisk-control.h"
+#include "tapdisk-message.h"
+#include "profile.h"
 
 #define DBG(_level, _f, _a...) tlog_write(_level, _f, ##_a)
 #define ERR(_err, _f, _a...) tlog_error(_err, _f, ##_a)
@@ -67,6 +78,17 @@
 static void tapdisk_vbd_complete_vbd_request(td_vbd_t *, td_vbd_request_t *);
 static int  tapdisk_vbd_queue_ready(td_vbd_t *);
 static void tapdisk_vbd_check_queue_state(td_vbd_t *);
+static void tapdisk_vbd_flush_done(struct td_flush *, int);
+static void tapdisk_vbd_migrate_end(td_vbd_t *, int);
+static td_vbd_request_t *tapdisk_vbd_fifo_next(td_vbd_t *,
+					       const struct timeval *);
+static td_vbd_request_t *tapdisk_vbd_deadline_next(td_vbd_t *,
+						   const struct timeval *);
+
+static const struct td_vbd_policy tapdisk_vbd_policies[] = {
+	{ .name = "fifo",     .next = tapdisk_vbd_fifo_next     },
+	{ .name = "deadline", .next = tapdisk_vbd_deadline_next },
+};
 
 /* 
  * initialization
@@ -91,14 +113,21 @@ tapdisk_vbd_create(uint16_t uuid)
 
 	vbd->uuid        = uuid;
 	vbd->req_timeout = TD_VBD_REQUEST_TIMEOUT;
+	vbd->policy      = &tapdisk_vbd_policies[0];
+	vbd->weight      = TD_VBD_WEIGHT_DEFAULT;
+
+	td_flush_init(&vbd->flush, tapdisk_vbd_flush_done);
+	td_chainmap_init(&vbd->chainmap);
 
 	INIT_LIST_HEAD(&vbd->images);
+	INIT_LIST_HEAD(&vbd->parked);
 	INIT_LIST_HEAD(&vbd->new_requests);
 	INIT_LIST_HEAD(&vbd->pending_requests);
 	INIT_LIST_HEAD(&vbd->failed_requests);
 	INIT_LIST_HEAD(&vbd->completed_requests);
 	INIT_LIST_HEAD(&vbd->next);
 	tapdisk_vbd_mark_progress(vbd);
+	tapdisk_metrics_attach(vbd);
 
 	return vbd;
 }
@@ -127,17 +156,22 @@ tapdisk_vbd_validate_chain(td_vbd_t *vbd)
 	return tapdisk_image_validate_chain(&vbd->images);
 }
 
-void
-tapdisk_vbd_close_vdi(td_vbd_t *vbd)
+static void
+__tapdisk_vbd_close_vdi(td_vbd_t *vbd)
 {
 	tapdisk_image_close_chain(&vbd->images);
+	td_chainmap_reset(&vbd->chainmap);
 
 	if (vbd->secondary &&
-	    vbd->secondary_mode != TD_VBD_SECONDARY_MIRROR) {
+	    vbd->secondary_mode != TD_VBD_SECONDARY_MIRROR &&
+	    vbd->secondary_mode != TD_VBD_SECONDARY_ASYNC) {
 		tapdisk_image_close(vbd->secondary);
 		vbd->secondary = NULL;
 	}
 
+	if (vbd->mirror)
+		td_mirror_attach(vbd->mirror, NULL);
+
 	if (vbd->retired) {
 		tapdisk_image_close(vbd->retired);
 		vbd->retired = NULL;
@@ -146,10 +180,48 @@ tapdisk_vbd_close_vdi(td_vbd_t *vbd)
 	td_flag_set(vbd->state, TD_VBD_CLOSED);
 }
 
+void
+tapdisk_vbd_close_vdi(td_vbd_t *vbd)
+{
+	__tapdisk_vbd_close_vdi(vbd);
+	tapdisk_image_close_chain(&vbd->parked);
+}
+
+/*
+ * Keeps the parents of the leaf open over a pause. Only plain chains
+ * qualify, of regular files: the stamp taken here must still match
+ * on resume, or the image is opened again.
+ */
+static void
+tapdisk_vbd_park_parents(td_vbd_t *vbd)
+{
+	td_image_t *leaf, *image, *tmp;
+
+	if (td_flag_test(vbd->flags, TD_OPEN_LOG_DIRTY) ||
+	    td_flag_test(vbd->flags, TD_OPEN_ADD_CACHE) ||
+	    td_flag_test(vbd->flags, TD_OPEN_LOCAL_CACHE))
+		return;
+
+	if (vbd->secondary || vbd->retired || vbd->coalesce ||
+	    list_empty(&vbd->images))
+		return;
+
+	leaf = tapdisk_vbd_first_image(vbd);
+
+	tapdisk_vbd_for_each_image(vbd, image, tmp)
+		if (image != leaf && tapdisk_image_stamp(image))
+			return;
+
+	tapdisk_vbd_for_each_image(vbd, image, tmp)
+		if (image != leaf)
+			list_move_tail(&image->next, &vbd->parked);
+}
+
 static int
 tapdisk_vbd_add_block_cache(td_vbd_t *vbd)
 {
 	td_image_t *cache, *image, *target, *tmp;
+	uint8_t uuid[TAPDISK_SHM_CACHE_UUID_SIZE];
 	int err;
 
 	target = NULL;
@@ -193,8 +265,12 @@ tapdisk_vbd_add_block_cache(td_vbd_t *vbd)
 
 	/* try to open new cache */
 	err = td_open(cache);
-	if (!err)
+	if (!err) {
+		/* share the parent blocks with other tapdisks on the host */
+		if (!td_get_uuid(target, uuid))
+			block_cache_share(cache->driver, uuid);
 		goto done;
+	}
 
 fail:
 	/* give up */
@@ -258,6 +334,33 @@ done:
 	return 0;
 }
 
+/*
+ * A failed async copy leaves the secondary behind. An NBD one is gone
+ * and leaves the chain, others are left in it untouched.
+ */
+static void
+tapdisk_vbd_mirror_failed(struct td_mirror *m, int err)
+{
+	td_vbd_t *vbd = m->vbd;
+	td_image_t *image = vbd->secondary;
+
+	if (vbd->secondary_mode != TD_VBD_SECONDARY_ASYNC || !image)
+		return;
+
+	ERROR("%s: async mirror failed: %d, disabling mirroring\n",
+	      vbd->name, err);
+
+	if (image->type == DISK_TYPE_NBD && !vbd->retired) {
+		vbd->nbd_mirror_failed = 1;
+		list_del_init(&image->next);
+		td_chainmap_reset(&vbd->chainmap);
+		vbd->retired = image;
+	}
+
+	vbd->secondary      = NULL;
+	vbd->secondary_mode = TD_VBD_SECONDARY_DISABLED;
+}
+
 int
 tapdisk_vbd_add_secondary(td_vbd_t *vbd)
 {
@@ -270,9 +373,14 @@ tapdisk_vbd_add_secondary(td_vbd_t *vbd)
 		vbd->secondary_mode = TD_VBD_SECONDARY_DISABLED;
 		vbd->secondary = NULL;
 		vbd->nbd_mirror_failed = 0;
+		if (vbd->mirror)
+			td_mirror_stop(vbd->mirror);
 		return 0;
 	}
 
+	if (vbd->migrate_state)
+		return -EBUSY;
+
 	DPRINTF("Adding secondary image: %s\n", vbd->secondary_name);
 
 	type = tapdisk_disktype_parse_params(vbd->secondary_name, &path);
@@ -303,12 +411,35 @@ tapdisk_vbd_add_secondary(td_vbd_t *vbd)
 		goto fail;
 	}
 
+	if (td_flag_test(vbd->flags, TD_OPEN_MIRROR_ASYNC) &&
+	    !td_flag_test(vbd->flags, TD_OPEN_STANDBY)) {
+		if (vbd->mirror)
+			td_mirror_attach(vbd->mirror, second);
+		else {
+			vbd->mirror = td_mirror_create(vbd, second,
+						       tapdisk_vbd_mirror_failed,
+						       &err);
+			if (!vbd->mirror)
+				goto fail;
+		}
+	}
+
 	vbd->secondary = second;
-	leaf->flags |= TD_IGNORE_ENOSPC;
 	if (td_flag_test(vbd->flags, TD_OPEN_STANDBY)) {
 		DPRINTF("In standby mode\n");
+		leaf->flags |= TD_IGNORE_ENOSPC;
 		vbd->secondary_mode = TD_VBD_SECONDARY_STANDBY;
+	} else if (td_flag_test(vbd->flags, TD_OPEN_MIRROR_ASYNC)) {
+		/*
+		 * the secondary lags, failing over to it on ENOSPC would
+		 * lose writes: the primary just fails them
+		 */
+		DPRINTF("In async mirror mode\n");
+		vbd->secondary_mode = TD_VBD_SECONDARY_ASYNC;
+		list_add(&second->next, &leaf->next);
+		td_chainmap_reset(&vbd->chainmap);
 	} else {
+		leaf->flags |= TD_IGNORE_ENOSPC;
 		DPRINTF("In mirror mode\n");
 		vbd->secondary_mode = TD_VBD_SECONDARY_MIRROR;
 		/*
@@ -316,6 +447,7 @@ tapdisk_vbd_add_secondary(td_vbd_t *vbd)
 		 * since it may already contain data
 		 */
 		list_add(&second->next, &leaf->next);
+		td_chainmap_reset(&vbd->chainmap);
 	}
 
 	DPRINTF("Added secondary image\n");
@@ -422,7 +554,8 @@ tapdisk_vbd_add_dirty_log(td_vbd_t *vbd)
 	if (err)
 		goto fail;
 
-	tapdisk_vbd_add_image(vbd, log);
+	/* insert log before the leaf, so that it sees the writes */
+	list_add(&log->next, &vbd->images);
 	return 0;
 
 fail:
@@ -454,9 +587,32 @@ tapdisk_vbd_open_vdi(td_vbd_t *vbd, const char *name, td_flag_t flags, int prt_d
 		}
 	}
 
-	err = tapdisk_image_open_chain(vbd->name, flags, prt_devnum, &vbd->images);
-	if (err)
-		goto fail;
+	if (!list_empty(&vbd->parked) && prt_devnum < 0) {
+		td_image_t *image;
+		int parents = -1, reused = 0;
+
+		tapdisk_for_each_image(image, &vbd->parked)
+			reused++;
+
+		err = tapdisk_image_reopen_chain(vbd->name, flags,
+						 &vbd->parked, &vbd->images);
+		if (err)
+			goto fail;
+
+		tapdisk_for_each_image(image, &vbd->parked)
+			reused--;
+		tapdisk_for_each_image(image, &vbd->images)
+			parents++;
+
+		vbd->parents_reused   += reused;
+		vbd->parents_reopened += parents - reused;
+		tapdisk_image_close_chain(&vbd->parked);
+	} else {
+		err = tapdisk_image_open_chain(vbd->name, flags, prt_devnum,
+					       &vbd->images);
+		if (err)
+			goto fail;
+	}
 
 	td_flag_clear(vbd->state, TD_VBD_CLOSED);
 	vbd->flags = flags;
@@ -493,9 +649,14 @@ tapdisk_vbd_open_vdi(td_vbd_t *vbd, const char *name, td_flag_t flags, int prt_d
 		}
 	}
 
+	if (vbd->migrate_image)
+		td_mirror_attach(vbd->mirror, vbd->migrate_image);
+
 	if (tmp != vbd->name)
 		free(tmp);
 
+	td_chainmap_reset(&vbd->chainmap);
+
 	return err;
 
 fail:
@@ -609,22 +770,88 @@ tapdisk_vbd_shutdown(td_vbd_t *vbd)
 		vbd->errors, vbd->retries, vbd->received, vbd->returned,
 		vbd->kicked);
 
+	td_flush_destroy(&vbd->flush);
+	if (vbd->coalesce) {
+		td_coalesce_abandon(vbd->coalesce);
+		vbd->coalesce = NULL;
+	}
+	if (vbd->migrate_state)
+		tapdisk_vbd_migrate_end(vbd, -ESHUTDOWN);
 	tapdisk_vbd_close_vdi(vbd);
+	td_mirror_free(vbd->mirror);
+	td_iotrace_close(vbd->iotrace);
+	td_heat_free(vbd->heat);
+	td_warm_close(vbd->warm);
+	if (vbd->ringserver)
+		tapdisk_ringserver_free(vbd->ringserver);
+	/* headroom waiters learn the VBD is gone */
+	if (vbd->headroom.lead_s)
+		tapdisk_control_kick_headroom();
+	tapdisk_control_post_event(vbd->uuid, TAPDISK_EVENT_CLOSED, 0,
+				   vbd->state);
 	tapdisk_vbd_detach(vbd);
 	tapdisk_server_remove_vbd(vbd);
+	tapdisk_metrics_detach(vbd);
 	free(vbd->name);
 	free(vbd);
 
 	return 0;
 }
 
+/*
+ * Drivers may have writes of their own to finish first, such as a
+ * write-back cache destaging to its parent.
+ */
+static int
+tapdisk_vbd_drain_images(td_vbd_t *vbd)
+{
+	td_image_t *image;
+	int err = 0;
+
+	if (td_flag_test(vbd->state, TD_VBD_DEAD))
+		return 0;
+
+	tapdisk_for_each_image(image, &vbd->images)
+		err = td_drain(image) ? : err;
+
+	return err;
+}
+
+/*
+ * The async mirror catches up before the vbd closes, unless the queue
+ * is held: what it lacks is then lost, and logged. A migration is
+ * dropped.
+ */
+static int
+tapdisk_vbd_drain_mirror(td_vbd_t *vbd)
+{
+	struct td_mirror *m = vbd->mirror;
+
+	if (!m || td_flag_test(vbd->state, TD_VBD_DEAD))
+		return 0;
+
+	if (vbd->migrate_state && !m->error)
+		td_mirror_stop(m);
+
+	if (m->writing)
+		return -EAGAIN;
+
+	if (!tapdisk_vbd_queue_ready(vbd) || !td_mirror_busy(m))
+		return 0;
+
+	td_mirror_kick(m, 1);
+	return -EAGAIN;
+}
+
 int
 tapdisk_vbd_close(td_vbd_t *vbd)
 {
 	/*
 	 * don't close if any requests are pending in the aio layer
 	 */
-	if (!list_empty(&vbd->pending_requests))
+	if (!list_empty(&vbd->pending_requests) ||
+	    tapdisk_vbd_drain_images(vbd) ||
+	    tapdisk_vbd_drain_mirror(vbd))
 		goto fail;
 
 	/* 
@@ -684,10 +911,84 @@ tapdisk_vbd_drop_log(td_vbd_t *vbd)
 int
 tapdisk_vbd_get_disk_info(td_vbd_t *vbd, td_disk_info_t *info)
 {
+	td_image_t *image, *next;
+
 	if (list_empty(&vbd->images))
 		return -EINVAL;
 
 	*info = tapdisk_vbd_first_image(vbd)->info;
+
+	/* every layer must take what the device is told to send */
+	tapdisk_vbd_for_each_image(vbd, image, next) {
+		info->sector_size = MAX(info->sector_size,
+					image->info.sector_size);
+		info->physical_sector_size = MAX(info->physical_sector_size,
+						 image->info.physical_sector_size);
+	}
+	info->physical_sector_size = MAX(info->physical_sector_size,
+					 info->sector_size);
+
+	return 0;
+}
+
+/*
+ * Whether the range may read other than zeros: 0 only when no image
+ * of the chain can hold data there. Images without td_allocated, or
+ * failing it, count as holding data.
+ */
+int
+tapdisk_vbd_allocated(td_vbd_t *vbd, td_sector_t sec, int secs)
+{
+	td_image_t *image, *next;
+
+	tapdisk_vbd_for_each_image(vbd, image, next) {
+		if (sec >= image->info.size)
+			continue;
+
+		if (td_allocated(image, sec, MIN(secs, image->info.size - sec)))
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Discards go down the chain until the first read-only image, every
+ * image before it must take them.
+ */
+int
+tapdisk_vbd_discard_supported(td_vbd_t *vbd)
+{
+	td_image_t *image;
+
+	if (list_empty(&vbd->images))
+		return 0;
+
+	tapdisk_for_each_image(image, &vbd->images) {
+		if (td_flag_test(image->flags, TD_OPEN_RDONLY))
+			break;
+
+		if (!image->driver || !image->driver->ops->td_queue_discard)
+			return 0;
+	}
+
+	return 1;
+}
+
+/* a flush syncs every writable image which keeps data */
+int
+tapdisk_vbd_flush_supported(td_vbd_t *vbd)
+{
+	td_image_t *image;
+
+	tapdisk_for_each_image(image, &vbd->images) {
+		if (td_flag_test(image->flags, TD_OPEN_RDONLY))
+			break;
+
+		if (image->driver && image->driver->ops->td_sync)
+			return 1;
+	}
+
 	return 0;
 }
 
@@ -700,11 +1001,44 @@ tapdisk_vbd_queue_ready(td_vbd_t *vbd)
 		!td_flag_test(vbd->state, TD_VBD_QUIESCE_REQUESTED));
 }
 
+/*
+ * Seconds until the queue next needs a pass for retries, or -1. Busy
+ * requests with others pending are retried when those complete, the
+ * completion wakes the loop.
+ */
 int
-tapdisk_vbd_retry_needed(td_vbd_t *vbd)
+tapdisk_vbd_retry_timeout(td_vbd_t *vbd)
 {
-	return !(list_empty(&vbd->failed_requests) &&
-		 list_empty(&vbd->new_requests));
+	td_vbd_request_t *vreq, *tmp;
+	struct timeval now, delta;
+	int timeout = -1;
+
+	if (!list_empty(&vbd->new_requests))
+		timeout = TD_VBD_RETRY_INTERVAL;
+
+	if (list_empty(&vbd->failed_requests))
+		return timeout;
+
+	gettimeofday(&now, NULL);
+
+	tapdisk_vbd_for_each_request(vreq, tmp, &vbd->failed_requests) {
+		int secs;
+
+		if (vreq->error == -EBUSY) {
+			if (vbd->secs_pending)
+				continue;
+			secs = TD_VBD_RETRY_INTERVAL;
+		} else if (timercmp(&vreq->next_try, &now, >)) {
+			timersub(&vreq->next_try, &now, &delta);
+			secs = delta.tv_sec + !!delta.tv_usec;
+		} else
+			secs = 0;
+
+		if (timeout < 0 || secs < timeout)
+			timeout = secs;
+	}
+
+	return timeout;
 }
 
 int
@@ -716,7 +1050,10 @@ tapdisk_vbd_lock(td_vbd_t *vbd)
 int
 tapdisk_vbd_quiesce_queue(td_vbd_t *vbd)
 {
-	if (!list_empty(&vbd->pending_requests)) {
+	/* copies not yet read wait for the resume, with the dirty map */
+	if (!list_empty(&vbd->pending_requests) ||
+	    tapdisk_vbd_drain_images(vbd) ||
+	    (vbd->mirror && vbd->mirror->writing)) {
 		td_flag_set(vbd->state, TD_VBD_QUIESCE_REQUESTED);
 		return -EAGAIN;
 	}
@@ -774,6 +1111,9 @@ tapdisk_vbd_pause(td_vbd_t *vbd)
 
 	INFO("pause requested\n");
 
+	if (!td_flag_test(vbd->state, TD_VBD_PAUSE_REQUESTED))
+		gettimeofday(&vbd->pause_ts, NULL);
+
 	td_flag_set(vbd->state, TD_VBD_PAUSE_REQUESTED);
 
 	if (vbd->nbdserver)
@@ -783,19 +1123,25 @@ tapdisk_vbd_pause(td_vbd_t *vbd)
 	if (err)
 		return err;
 
-	tapdisk_vbd_close_vdi(vbd);
+	tapdisk_vbd_park_parents(vbd);
+	__tapdisk_vbd_close_vdi(vbd);
 
 	INFO("pause completed\n");
 
 	td_flag_clear(vbd->state, TD_VBD_PAUSE_REQUESTED);
 	td_flag_set(vbd->state, TD_VBD_PAUSED);
 
+	tapdisk_control_post_event(vbd->uuid, TAPDISK_EVENT_PAUSED, 0,
+				   vbd->state);
+
 	return 0;
 }
 
 int
 tapdisk_vbd_resume(td_vbd_t *vbd, const char *name)
 {
+	struct timeval now, delta;
+	uint64_t reused, us;
 	int i, err;
 
 	DBG(TLOG_DBG, "resume requested\n");
@@ -805,6 +1151,8 @@ tapdisk_vbd_resume(td_vbd_t *vbd, const char *name)
 		return -EINVAL;
 	}
 
+	reused = vbd->parents_reused;
+
 	for (i = 0; i < TD_VBD_EIO_RETRIES; i++) {
 		err = tapdisk_vbd_open_vdi(vbd, name, vbd->flags | TD_OPEN_STRICT, -1);
 		if (!err)
@@ -816,6 +1164,18 @@ tapdisk_vbd_resume(td_vbd_t *vbd, const char *name)
 	if (err)
 		return err;
 
+	gettimeofday(&now, NULL);
+	timersub(&now, &vbd->pause_ts, &delta);
+	us = delta.tv_sec * 1000000ULL + delta.tv_usec;
+
+	vbd->pauses++;
+	vbd->pause_us     = us;
+	if (us > vbd->pause_max_us)
+		vbd->pause_max_us = us;
+
+	INFO("%s: resumed after %"PRIu64" us, %"PRIu64" parents kept open\n",
+	     vbd->name, us, vbd->parents_reused - reused);
+
 	DBG(TLOG_DBG, "resume completed\n");
 
 	tapdisk_vbd_start_queue(vbd);
@@ -826,145 +1186,959 @@ tapdisk_vbd_resume(td_vbd_t *vbd, const char *name)
 	if (vbd->nbdserver)
 		tapdisk_nbdserver_unpause(vbd->nbdserver);
 
+	tapdisk_control_post_event(vbd->uuid, TAPDISK_EVENT_RESUMED, 0,
+				   vbd->state);
+
 	DBG(TLOG_DBG, "state checked\n");
 
 	return 0;
 }
 
+/*
+ * Online coalesce. The parent of the leaf is merged onto its own
+ * parent in the background. Once done, the queue is quiesced and the
+ * chain reopened with the leaf relinked past the merged image, which
+ * is left for the toolstack to delete.
+ *
+ * The ancestor must not be the parent of any other chain, as for an
+ * offline coalesce.
+ */
 static int
-tapdisk_vbd_request_ttl(td_vbd_request_t *vreq,
-			const struct timeval *now)
+tapdisk_vbd_coalesce_target(td_vbd_t *vbd, td_image_t **_leaf,
+			    td_image_t **_image, td_image_t **_parent)
 {
-	struct timeval delta;
-	timersub(now, &vreq->ts, &delta);
-	return vreq->vbd->req_timeout - delta.tv_sec;
-}
+	td_image_t *leaf, *image, *parent;
 
-static int
-__tapdisk_vbd_request_timeout(td_vbd_request_t *vreq,
-			      const struct timeval *now)
-{
-	int timeout;
+	if (list_empty(&vbd->images))
+		return -ENODEV;
 
-	timeout = tapdisk_vbd_request_ttl(vreq, now) < 0;
-	if (timeout)
-		ERR(vreq->error,
-		    "req %s timed out, retried %d times\n",
-		    vreq->name, vreq->num_retries);
+	leaf = tapdisk_vbd_first_image(vbd);
+	if (leaf->type != DISK_TYPE_VHD || tapdisk_vbd_is_last_image(vbd, leaf))
+		return -EINVAL;
 
-	return timeout;
-}
+	image = tapdisk_vbd_next_image(leaf);
+	if (image->type != DISK_TYPE_VHD ||
+	    !td_flag_test(image->flags, TD_OPEN_RDONLY) ||
+	    tapdisk_vbd_is_last_image(vbd, image))
+		return -EINVAL;
 
-static int
-tapdisk_vbd_request_timeout(td_vbd_request_t *vreq)
-{
-	struct timeval now;
-	gettimeofday(&now, NULL);
-	return __tapdisk_vbd_request_timeout(vreq, &now);
+	/* another vbd would not see the parent reopened */
+	parent = tapdisk_vbd_next_image(image);
+	if (!parent->driver || parent->driver->refcnt > 1)
+		return -EBUSY;
+
+	*_leaf   = leaf;
+	*_image  = image;
+	*_parent = parent;
+	return 0;
 }
 
 static void
-tapdisk_vbd_check_queue_state(td_vbd_t *vbd)
+tapdisk_vbd_relink(td_vbd_t *vbd)
 {
-	td_vbd_request_t *vreq, *tmp;
-	struct timeval now;
+	td_image_t *leaf, *image, *parent;
+	char *lname, *pname;
+	vhd_context_t vhd;
+	int i, err, raw;
+
+	lname = NULL;
+	pname = NULL;
+
+	if (td_flag_test(vbd->state, TD_VBD_PAUSED) ||
+	    td_flag_test(vbd->state, TD_VBD_PAUSE_REQUESTED) ||
+	    td_flag_test(vbd->state, TD_VBD_SHUTDOWN_REQUESTED) ||
+	    td_flag_test(vbd->state, TD_VBD_DEAD)) {
+		err = -ECANCELED;
+		goto out;
+	}
 
-	gettimeofday(&now, NULL);
-	tapdisk_vbd_for_each_request(vreq, tmp, &vbd->failed_requests)
-		if (__tapdisk_vbd_request_timeout(vreq, &now))
-			tapdisk_vbd_complete_vbd_request(vbd, vreq);
+	if (tapdisk_vbd_quiesce_queue(vbd))
+		return;
 
-	if (!list_empty(&vbd->new_requests) ||
-	    !list_empty(&vbd->failed_requests))
-		tapdisk_vbd_issue_requests(vbd);
+	err = tapdisk_vbd_coalesce_target(vbd, &leaf, &image, &parent);
+	if (!err && strcmp(image->name, vbd->coalesce->name))
+		err = -ESTALE;
+	if (err)
+		goto resume;
 
-}
+	lname = strdup(leaf->name);
+	pname = strdup(parent->name);
+	if (!lname || !pname) {
+		err = -ENOMEM;
+		goto resume;
+	}
+	raw = parent->type != DISK_TYPE_VHD;
 
-void
-tapdisk_vbd_check_state(td_vbd_t *vbd)
-{
-	tapdisk_vbd_check_queue_state(vbd);
+	tapdisk_vbd_close_vdi(vbd);
 
-	if (td_flag_test(vbd->state, TD_VBD_QUIESCE_REQUESTED))
-		tapdisk_vbd_quiesce_queue(vbd);
+	err = vhd_open(&vhd, lname, VHD_OPEN_RDWR);
+	if (!err) {
+		err = vhd_change_parent(&vhd, pname, raw);
+		vhd_close(&vhd);
+	}
+	if (err)
+		EPRINTF("%s: relinking %s onto %s: %d\n",
+			vbd->name, lname, pname, err);
 
-	if (td_flag_test(vbd->state, TD_VBD_PAUSE_REQUESTED))
-		tapdisk_vbd_pause(vbd);
+	/* the old chain reads the same, should the relink have failed */
+	for (i = 0; i < TD_VBD_EIO_RETRIES; i++) {
+		int ret = tapdisk_vbd_open_vdi(vbd, NULL,
+					       vbd->flags | TD_OPEN_STRICT, -1);
+		if (!ret)
+			break;
 
-	if (td_flag_test(vbd->state, TD_VBD_SHUTDOWN_REQUESTED))
-		tapdisk_vbd_close(vbd);
-}
+		if (i == TD_VBD_EIO_RETRIES - 1) {
+			EPRINTF("%s: reopening after coalesce: %d\n",
+				vbd->name, ret);
+			err = err ? : ret;
+		}
 
-void
-tapdisk_vbd_check_progress(td_vbd_t *vbd)
-{
-	time_t diff;
-	struct timeval now, delta;
+		sleep(TD_VBD_EIO_SLEEP);
+	}
 
-	if (list_empty(&vbd->pending_requests))
-		return;
+resume:
+	tapdisk_vbd_start_queue(vbd);
+out:
+	td_flag_clear(vbd->state, TD_VBD_RELINK_REQUESTED);
 
-	gettimeofday(&now, NULL);
-	timersub(&now, &vbd->ts, &delta);
-	diff = delta.tv_sec;
+	if (err)
+		EPRINTF("%s: coalesce of %s dropped: %d\n",
+			vbd->name, vbd->coalesce->name, err);
+	else
+		INFO("%s: coalesced %s\n", vbd->name, vbd->coalesce->name);
 
-	if (diff >= TD_VBD_WATCHDOG_TIMEOUT && tapdisk_vbd_queue_ready(vbd)) {
-		DBG(TLOG_WARN, "%s: watchdog timeout: pending requests "
-		    "idle for %ld seconds\n", vbd->name, diff);
-		tapdisk_vbd_drop_log(vbd);
-		return;
-	}
+	vbd->coalesce_error = err;
+	if (!err)
+		vbd->coalesces++;
 
-	tapdisk_server_set_max_timeout(TD_VBD_WATCHDOG_TIMEOUT - diff);
+	td_coalesce_free(vbd->coalesce);
+	vbd->coalesce = NULL;
+
+	free(lname);
+	free(pname);
+}
+
+static void
+tapdisk_vbd_coalesce_done(struct td_coalesce *c, int err)
+{
+	td_vbd_t *vbd = c->private;
+
+	if (err) {
+		EPRINTF("%s: coalescing %s: %d\n", vbd->name, c->name, err);
+		vbd->coalesce_error = err;
+		td_coalesce_free(c);
+		vbd->coalesce = NULL;
+		return;
+	}
+
+	td_flag_set(vbd->state, TD_VBD_RELINK_REQUESTED);
+	tapdisk_vbd_relink(vbd);
+}
+
+int
+tapdisk_vbd_coalesce(td_vbd_t *vbd, uint64_t rate)
+{
+	td_image_t *leaf, *image, *parent;
+	int err;
+
+	if (vbd->coalesce)
+		return -EALREADY;
+
+	if (!tapdisk_vbd_queue_ready(vbd))
+		return -EBUSY;
+
+	err = tapdisk_vbd_coalesce_target(vbd, &leaf, &image, &parent);
+	if (err)
+		return err;
+
+	vbd->coalesce = td_coalesce_start(image->name, rate,
+					  tapdisk_vbd_coalesce_done, vbd, &err);
+	if (!vbd->coalesce)
+		return err;
+
+	vbd->coalesce_error = 0;
+	return 0;
+}
+
+/*
+ * Live migration. The virtual disk is copied onto a single target
+ * image through the async mirror: in bulk first, then in rounds over
+ * what was written meanwhile. Once few enough extents are left, or a
+ * round leaves no fewer than the one before, or the rounds run out,
+ * writes are held while the mirror drains, and the vbd goes through
+ * a pause and resumes on the target. The lag bounds the drain.
+ *
+ * The target is the size of the disk, and has no parent. A pause of
+ * the vbd keeps the migration going, a close drops it.
+ */
+static void
+tapdisk_vbd_migrate_end(td_vbd_t *vbd, int err)
+{
+	struct timeval now, delta;
+
+	gettimeofday(&now, NULL);
+	timersub(&now, &vbd->migrate_ts, &delta);
+
+	if (err)
+		EPRINTF("%s: migration to %s dropped: %d\n",
+			vbd->name, vbd->migrate_target, err);
+	else
+		INFO("%s: migrated in %lu.%03lu s\n", vbd->name,
+		     delta.tv_sec, delta.tv_usec / 1000);
+
+	td_mirror_free(vbd->mirror);
+	vbd->mirror = NULL;
+
+	if (vbd->migrate_image) {
+		tapdisk_image_close(vbd->migrate_image);
+		vbd->migrate_image = NULL;
+	}
+
+	free(vbd->migrate_target);
+	vbd->migrate_target = NULL;
+	vbd->migrate_state  = TD_VBD_MIGRATE_NONE;
+	vbd->migrate_error  = err;
+	if (!err)
+		vbd->migrations++;
+}
+
+static void
+tapdisk_vbd_migrate_failed(struct td_mirror *m, int err)
+{
+	td_vbd_t *vbd = m->vbd;
+
+	EPRINTF("%s: copy to %s failed: %d\n",
+		vbd->name, vbd->migrate_target, err);
+}
+
+static int
+tapdisk_vbd_migrate_converged(td_vbd_t *vbd)
+{
+	struct td_mirror *m = vbd->mirror;
+	int shrinking;
+
+	if (m->bulk < m->extents)
+		return 0;
+
+	if (m->dirty <= TD_VBD_MIGRATE_DIRTY)
+		return 1;
+
+	if (m->rounds == vbd->migrate_rounds)
+		return 0;
+
+	shrinking = m->dirty < vbd->migrate_dirty;
+	vbd->migrate_rounds = m->rounds;
+	vbd->migrate_dirty  = m->dirty;
+
+	return !shrinking || m->rounds >= TD_VBD_MIGRATE_ROUNDS;
+}
+
+/* paused on the old chain, with the target up to date */
+static void
+tapdisk_vbd_migrate_switch(td_vbd_t *vbd)
+{
+	int err;
+
+	td_mirror_free(vbd->mirror);
+	vbd->mirror = NULL;
+
+	tapdisk_image_close(vbd->migrate_image);
+	vbd->migrate_image = NULL;
+
+	/* the resume checks the vbd state again */
+	vbd->migrate_state = TD_VBD_MIGRATE_NONE;
+
+	err = tapdisk_vbd_resume(vbd, vbd->migrate_target);
+	if (err) {
+		EPRINTF("%s: resuming on %s: %d, back on the old chain\n",
+			vbd->name, vbd->migrate_target, err);
+
+		if (tapdisk_vbd_resume(vbd, NULL))
+			EPRINTF("%s: resuming after a failed migration\n",
+				vbd->name);
+	}
+
+	tapdisk_vbd_migrate_end(vbd, err);
+}
+
+static void
+tapdisk_vbd_check_migrate(td_vbd_t *vbd)
+{
+	struct td_mirror *m = vbd->mirror;
+	int err;
+
+	if (m->error) {
+		if (!m->inflight)
+			tapdisk_vbd_migrate_end(vbd, m->error);
+		return;
+	}
+
+	switch (vbd->migrate_state) {
+	case TD_VBD_MIGRATE_COPY:
+		if (!tapdisk_vbd_queue_ready(vbd) ||
+		    !tapdisk_vbd_migrate_converged(vbd))
+			break;
+
+		INFO("%s: switching over to %s, %"PRIu64" rounds, "
+		     "%"PRIu64" extents left\n", vbd->name,
+		     vbd->migrate_target, m->rounds, m->dirty);
+
+		vbd->migrate_state = TD_VBD_MIGRATE_DRAIN;
+		m->drain = 1;
+		td_mirror_kick(m, 1);
+		/* fall through */
+
+	case TD_VBD_MIGRATE_DRAIN:
+		if (!tapdisk_vbd_queue_ready(vbd) ||
+		    vbd->inflight[1] ||
+		    td_mirror_busy(m) || m->writing)
+			break;
+
+		vbd->migrate_state = TD_VBD_MIGRATE_SWITCH;
+
+		err = tapdisk_vbd_pause(vbd);
+		if (err && err != -EAGAIN) {
+			m->drain = 0;
+			vbd->migrate_state = TD_VBD_MIGRATE_COPY;
+			td_flag_clear(vbd->state, TD_VBD_PAUSE_REQUESTED);
+			EPRINTF("%s: pausing to migrate: %d\n",
+				vbd->name, err);
+			break;
+		}
+		/* fall through */
+
+	case TD_VBD_MIGRATE_SWITCH:
+		if (td_flag_test(vbd->state, TD_VBD_PAUSED))
+			tapdisk_vbd_migrate_switch(vbd);
+		break;
+	}
+}
+
+int
+tapdisk_vbd_migrate(td_vbd_t *vbd, const char *target, uint64_t rate)
+{
+	td_image_t *leaf, *image;
+	const char *path;
+	int type, err;
+
+	if (vbd->migrate_state)
+		return -EALREADY;
+
+	if (vbd->secondary || vbd->mirror || vbd->coalesce ||
+	    list_empty(&vbd->images))
+		return -EBUSY;
+
+	if (!tapdisk_vbd_queue_ready(vbd))
+		return -EBUSY;
+
+	type = tapdisk_disktype_parse_params(target, &path);
+	if (type < 0)
+		return type;
+
+	leaf = tapdisk_vbd_first_image(vbd);
+
+	err = tapdisk_image_open(type, path, leaf->flags, &image);
+	if (err)
+		return err;
+
+	if (image->info.size != leaf->info.size) {
+		EPRINTF("%s: target size %"PRIu64" != image size %"PRIu64"\n",
+			vbd->name, image->info.size, leaf->info.size);
+		err = -EINVAL;
+		goto fail;
+	}
+
+	vbd->migrate_target = strdup(target);
+	if (!vbd->migrate_target) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	vbd->mirror = td_mirror_create(vbd, image,
+				       tapdisk_vbd_migrate_failed, &err);
+	if (!vbd->mirror)
+		goto fail;
+
+	INFO("%s: migrating to %s, %"PRIu64" MiB/s\n",
+	     vbd->name, target, rate >> 20);
+
+	gettimeofday(&vbd->migrate_ts, NULL);
+	vbd->migrate_image  = image;
+	vbd->migrate_state  = TD_VBD_MIGRATE_COPY;
+	vbd->migrate_rounds = 0;
+	vbd->migrate_dirty  = UINT64_MAX;
+	vbd->migrate_error  = 0;
+
+	td_mirror_bulk(vbd->mirror, rate);
+	return 0;
+
+fail:
+	free(vbd->migrate_target);
+	vbd->migrate_target = NULL;
+	tapdisk_image_close(image);
+	return err;
+}
+
+static int
+tapdisk_vbd_request_ttl(td_vbd_request_t *vreq,
+			const struct timeval *now)
+{
+	struct timeval delta;
+	timersub(now, &vreq->ts, &delta);
+	return vreq->vbd->req_timeout - delta.tv_sec;
+}
+
+static int
+__tapdisk_vbd_request_timeout(td_vbd_request_t *vreq,
+			      const struct timeval *now)
+{
+	int timeout;
+
+	timeout = tapdisk_vbd_request_ttl(vreq, now) < 0;
+	if (timeout)
+		ERR(vreq->error,
+		    "req %s timed out, retried %d times\n",
+		    vreq->name, vreq->num_retries);
+
+	return timeout;
+}
+
+static int
+tapdisk_vbd_request_timeout(td_vbd_request_t *vreq)
+{
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	return __tapdisk_vbd_request_timeout(vreq, &now);
+}
+
+static void
+tapdisk_vbd_check_queue_state(td_vbd_t *vbd)
+{
+	td_vbd_request_t *vreq, *tmp;
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	tapdisk_vbd_for_each_request(vreq, tmp, &vbd->failed_requests)
+		if (__tapdisk_vbd_request_timeout(vreq, &now))
+			tapdisk_vbd_complete_vbd_request(vbd, vreq);
+
+	if (!list_empty(&vbd->new_requests) ||
+	    !list_empty(&vbd->failed_requests))
+		tapdisk_vbd_issue_requests(vbd);
+
+}
+
+void
+tapdisk_vbd_check_state(td_vbd_t *vbd)
+{
+	tapdisk_vbd_check_queue_state(vbd);
+
+	if (td_flag_test(vbd->state, TD_VBD_QUIESCE_REQUESTED))
+		tapdisk_vbd_quiesce_queue(vbd);
+
+	if (td_flag_test(vbd->state, TD_VBD_RELINK_REQUESTED))
+		tapdisk_vbd_relink(vbd);
+
+	if (td_flag_test(vbd->state, TD_VBD_PAUSE_REQUESTED))
+		tapdisk_vbd_pause(vbd);
+
+	if (vbd->migrate_state)
+		tapdisk_vbd_check_migrate(vbd);
+
+	if (td_flag_test(vbd->state, TD_VBD_SHUTDOWN_REQUESTED))
+		tapdisk_vbd_close(vbd);
+}
+
+/* bytes the images hold for requests, trimmed first if 'trim' */
+static uint64_t
+tapdisk_vbd_footprint(td_vbd_t *vbd, int trim)
+{
+	td_image_t *image, *next;
+	uint64_t bytes, sum = 0;
+
+	tapdisk_vbd_for_each_image(vbd, image, next)
+		if (!td_footprint(image, trim, &bytes))
+			sum += bytes;
+
+	return sum;
+}
+
+static void
+tapdisk_vbd_check_idle(td_vbd_t *vbd)
+{
+	struct timeval now, delta;
+	uint64_t before, after;
+
+	if (vbd->ts.tv_sec == vbd->trim_ts.tv_sec &&
+	    vbd->ts.tv_usec == vbd->trim_ts.tv_usec)
+		return;
+
+	if (!list_empty(&vbd->new_requests) ||
+	    !list_empty(&vbd->failed_requests))
+		return;
+
+	gettimeofday(&now, NULL);
+	timersub(&now, &vbd->ts, &delta);
+
+	if (delta.tv_sec < TD_VBD_TRIM_IDLE) {
+		tapdisk_server_set_max_timeout(TD_VBD_TRIM_IDLE - delta.tv_sec);
+		return;
+	}
+
+	before = tapdisk_vbd_footprint(vbd, 0);
+	after  = tapdisk_vbd_footprint(vbd, 1);
+
+	vbd->trim_ts  = vbd->ts;
+	vbd->trims++;
+	vbd->trimmed += before - after;
+}
+
+void
+tapdisk_vbd_check_progress(td_vbd_t *vbd)
+{
+	time_t diff;
+	struct timeval now, delta;
+
+	if (list_empty(&vbd->pending_requests)) {
+		tapdisk_vbd_check_idle(vbd);
+		return;
+	}
+
+	gettimeofday(&now, NULL);
+	timersub(&now, &vbd->ts, &delta);
+	diff = delta.tv_sec;
+
+	if (diff >= TD_VBD_WATCHDOG_TIMEOUT && tapdisk_vbd_queue_ready(vbd)) {
+		DBG(TLOG_WARN, "%s: watchdog timeout: pending requests "
+		    "idle for %ld seconds\n", vbd->name, diff);
+		tapdisk_vbd_drop_log(vbd);
+		return;
+	}
+
+	tapdisk_server_set_max_timeout(TD_VBD_WATCHDOG_TIMEOUT - diff);
+}
+
+/*
+ * thin provisioning headroom
+ */
+
+/* the first image of the chain which grows, at its end */
+static int
+tapdisk_vbd_sample_headroom(td_vbd_t *vbd, int64_t *space,
+			    uint64_t *allocated)
+{
+	td_image_t *image, *next;
+	int err;
+
+	tapdisk_vbd_for_each_image(vbd, image, next) {
+		err = td_headroom(image, space, allocated);
+		if (err != -EOPNOTSUPP)
+			return err;
+	}
+
+	return -EOPNOTSUPP;
+}
+
+static int
+tapdisk_vbd_headroom_low(const struct td_vbd_headroom *h)
+{
+	if (h->space <= 0)
+		return 1;
+
+	return h->rate && (uint64_t)h->space / h->rate < h->lead_s;
+}
+
+static void
+tapdisk_vbd_signal_headroom(td_vbd_t *vbd, int low)
+{
+	struct td_vbd_headroom *h = &vbd->headroom;
+
+	if (low == h->low)
+		return;
+
+	h->low = low;
+	if (!low)
+		return;
+
+	h->events++;
+	DPRINTF("%s: headroom low: %"PRId64" bytes left, "
+		"allocating %"PRIu64" bytes/s\n",
+		vbd->name, h->space, h->rate);
+
+	tapdisk_control_kick_headroom();
+	tapdisk_control_post_event(vbd->uuid, TAPDISK_EVENT_HEADROOM, 0,
+				   vbd->state);
+}
+
+/* lead_s 0: stops watching */
+int
+tapdisk_vbd_set_headroom(td_vbd_t *vbd, unsigned int lead_s,
+			 unsigned int hold_ms)
+{
+	struct td_vbd_headroom *h = &vbd->headroom;
+	uint64_t allocated;
+	int64_t space;
+	int err;
+
+	if (!lead_s) {
+		h->lead_s = 0;
+		h->low    = 0;
+		return 0;
+	}
+
+	err = tapdisk_vbd_sample_headroom(vbd, &space, &allocated);
+	if (err)
+		return err;
+
+	if (!h->lead_s) {
+		gettimeofday(&h->ts, NULL);
+		h->allocated = allocated;
+		h->rate      = 0;
+	}
+
+	h->space   = space;
+	h->lead_s  = lead_s;
+	h->hold_ms = hold_ms;
+
+	tapdisk_vbd_signal_headroom(vbd, tapdisk_vbd_headroom_low(h));
+
+	return 0;
+}
+
+/*
+ * The rate follows a rise at once and decays over a few samples, so
+ * a burst of allocations is not averaged away before it is warned of.
+ */
+void
+tapdisk_vbd_check_headroom(td_vbd_t *vbd, const struct timeval *now)
+{
+	struct td_vbd_headroom *h = &vbd->headroom;
+	uint64_t us, allocated, rate;
+	struct timeval delta;
+	int64_t space;
+
+	if (!h->lead_s)
+		return;
+
+	timersub(now, &h->ts, &delta);
+	us = delta.tv_sec * 1000000ULL + delta.tv_usec;
+	if (us < TD_VBD_HEADROOM_SAMPLE_MS * 1000ULL)
+		return;
+
+	if (tapdisk_vbd_sample_headroom(vbd, &space, &allocated))
+		return;
+
+	rate = 0;
+	if (allocated > h->allocated)
+		rate = (allocated - h->allocated) * 1000000ULL / us;
+
+	h->rate      = MAX(rate, (h->rate * 3 + rate) / 4);
+	h->allocated = allocated;
+	h->space     = space;
+	h->ts        = *now;
+
+	tapdisk_vbd_signal_headroom(vbd, tapdisk_vbd_headroom_low(h));
+}
+
+/* ENOSPC writes wait for an extension, while the toolstack watches. */
+static int
+tapdisk_vbd_hold_enospc(td_vbd_t *vbd, td_vbd_request_t *vreq)
+{
+	struct td_vbd_headroom *h = &vbd->headroom;
+	struct timeval now, delta;
+
+	if (!h->lead_s || !h->hold_ms)
+		return 0;
+
+	gettimeofday(&now, NULL);
+	timersub(&now, &vreq->ts, &delta);
+	if (delta.tv_sec * 1000ULL + delta.tv_usec / 1000 >= h->hold_ms)
+		return 0;
+
+	if (!vreq->num_retries)
+		h->held++;
+
+	h->space = 0;
+	tapdisk_vbd_signal_headroom(vbd, 1);
+
+	return 1;
+}
+
+/*
+ * request submission 
+ */
+
+static int
+tapdisk_vbd_check_queue(td_vbd_t *vbd)
+{
+	if (list_empty(&vbd->images))
+		return -ENOSYS;
+
+	if (!tapdisk_vbd_queue_ready(vbd))
+		return -EAGAIN;
+
+	return 0;
+}
+
+static int
+tapdisk_vbd_request_should_retry(td_vbd_t *vbd, td_vbd_request_t *vreq)
+{
+	if (td_flag_test(vbd->state, TD_VBD_DEAD) ||
+	    td_flag_test(vbd->state, TD_VBD_SHUTDOWN_REQUESTED))
+		return 0;
+
+	switch (abs(vreq->error)) {
+	case EPERM:
+	case ENOSYS:
+	case ESTALE:
+		return 0;
+	case ENOSPC:
+		tapdisk_control_post_event(vbd->uuid, TAPDISK_EVENT_ENOSPC,
+					   vreq->error, vbd->state);
+		return tapdisk_vbd_hold_enospc(vbd, vreq);
+	}
+
+	if (tapdisk_vbd_request_timeout(vreq))
+		return 0;
+
+	return 1;
+}
+
+static unsigned int
+tapdisk_vbd_request_secs(const td_vbd_request_t *vreq)
+{
+	unsigned int secs = 0;
+	int i;
+
+	for (i = 0; i < vreq->iovcnt; i++)
+		secs += vreq->iov[i].secs;
+
+	return secs;
+}
+
+static void
+tapdisk_vbd_count_latency(td_vbd_t *vbd, td_vbd_request_t *vreq)
+{
+	struct timeval now;
+	unsigned int secs;
+	uint32_t us;
+
+	gettimeofday(&now, NULL);
+	secs = tapdisk_vbd_request_secs(vreq);
+	us   = td_latency_us(&vreq->ts, &now);
+
+	td_latency_add(&vbd->latency, td_op_write(vreq->op), secs, us);
+
+	if (vbd->iotrace)
+		td_iotrace_add(vbd->iotrace, vreq->op, vreq->sec, secs,
+			       &vreq->ts, us, vreq->error);
+
+	if (vbd->heat && !td_warm_request(vbd->warm, vreq))
+		td_heat_add(vbd->heat, vreq->op, vreq->sec, secs);
+}
+
+/* NULL path: stops recording */
+int
+tapdisk_vbd_record(td_vbd_t *vbd, const char *path, uint64_t bytes)
+{
+	td_disk_info_t info;
+	int err;
+
+	if (!path) {
+		if (!vbd->iotrace)
+			return -ENOENT;
+		td_iotrace_close(vbd->iotrace);
+		vbd->iotrace = NULL;
+		return 0;
+	}
+
+	if (vbd->iotrace)
+		return -EALREADY;
+
+	err = tapdisk_vbd_get_disk_info(vbd, &info);
+	if (err)
+		return err;
+
+	return td_iotrace_open(&vbd->iotrace, path, bytes, info.size);
+}
+
+/* NULL path: stops warming */
+int
+tapdisk_vbd_warm(td_vbd_t *vbd, const char *path, uint64_t size,
+		 uint64_t rate)
+{
+	int err;
+
+	if (!path) {
+		if (!vbd->warm)
+			return -ENOENT;
+		td_warm_free(vbd->warm);
+		vbd->warm = NULL;
+		return 0;
+	}
+
+	if (vbd->warm) {
+		if (!td_warm_done(vbd->warm))
+			return -EALREADY;
+		td_warm_free(vbd->warm);
+		vbd->warm = NULL;
+	}
+
+	err = td_warm_create(vbd, path, size, rate, &vbd->warm);
+	if (err)
+		return err;
+
+	td_warm_kick(vbd->warm);
+
+	return 0;
+}
+
+/* @flags TAPDISK_MESSAGE_HEAT_*, in that order */
+int
+tapdisk_vbd_heat(td_vbd_t *vbd, int flags, unsigned int decay,
+		 const char *path, uint64_t *blocks, uint64_t *hot)
+{
+	td_disk_info_t info;
+	int err;
+
+	if (flags & TAPDISK_MESSAGE_HEAT_START && !vbd->heat) {
+		err = tapdisk_vbd_get_disk_info(vbd, &info);
+		if (err)
+			return err;
+
+		err = td_heat_create(&vbd->heat, info.size);
+		if (err)
+			return err;
+	}
+
+	if (!vbd->heat)
+		return -ENOENT;
+
+	if (flags & TAPDISK_MESSAGE_HEAT_DECAY)
+		td_heat_decay(vbd->heat, decay);
+
+	if (flags & TAPDISK_MESSAGE_HEAT_SNAPSHOT) {
+		err = td_heat_save(vbd->heat, path);
+		if (err)
+			return err;
+	}
+
+	*blocks = vbd->heat->blocks;
+	*hot    = td_heat_blocks_hot(vbd->heat);
+
+	if (flags & TAPDISK_MESSAGE_HEAT_STOP) {
+		td_heat_free(vbd->heat);
+		vbd->heat = NULL;
+	}
+
+	return 0;
+}
+
+/* NULL location: stops serving */
+int
+tapdisk_vbd_serve_ring(td_vbd_t *vbd, const char *location, uint32_t slots,
+		       uint32_t data_size, unsigned int poll_us)
+{
+	if (!location) {
+		if (!vbd->ringserver)
+			return -ENOENT;
+		tapdisk_ringserver_free(vbd->ringserver);
+		vbd->ringserver = NULL;
+		return 0;
+	}
+
+	if (vbd->ringserver)
+		return -EALREADY;
+
+	return tapdisk_ringserver_create(vbd, location, slots, data_size,
+					 poll_us, &vbd->ringserver);
 }
 
 /*
- * request submission 
+ * Requests bounced with -EBUSY ran out of driver resources and are
+ * retried on the next pass over the queue. Anything else backs off
+ * exponentially, with the delay jittered over [d/2, d] so VBDs on a
+ * struggling SR do not retry in lockstep.
  */
-
-static int
-tapdisk_vbd_check_queue(td_vbd_t *vbd)
+static void
+tapdisk_vbd_schedule_retry(td_vbd_t *vbd, td_vbd_request_t *vreq)
 {
-	if (list_empty(&vbd->images))
-		return -ENOSYS;
+	struct timeval delay;
+	unsigned long ms;
 
-	if (!tapdisk_vbd_queue_ready(vbd))
-		return -EAGAIN;
+	gettimeofday(&vreq->next_try, NULL);
 
-	return 0;
+	if (vreq->error == -EBUSY)
+		return;
+
+	ms = TD_VBD_RETRY_BACKOFF_MAX;
+	if (vreq->backoff < 8)
+		ms = MIN(ms, TD_VBD_RETRY_BACKOFF_MIN << vreq->backoff);
+	ms = ms / 2 + random() % (ms / 2 + 1);
+
+	vreq->backoff++;
+	vbd->backoffs++;
+	vbd->backoff_ms += ms;
+
+	delay.tv_sec  = ms / 1000;
+	delay.tv_usec = (ms % 1000) * 1000;
+	timeradd(&vreq->next_try, &delay, &vreq->next_try);
 }
 
-static int
-tapdisk_vbd_request_should_retry(td_vbd_t *vbd, td_vbd_request_t *vreq)
+/* async mode: the secondary gets the write later */
+static void
+tapdisk_vbd_mirror_write(td_vbd_t *vbd, td_vbd_request_t *vreq)
 {
-	if (td_flag_test(vbd->state, TD_VBD_DEAD) ||
-	    td_flag_test(vbd->state, TD_VBD_SHUTDOWN_REQUESTED))
-		return 0;
-
-	switch (abs(vreq->error)) {
-	case EPERM:
-	case ENOSYS:
-	case ESTALE:
-	case ENOSPC:
-		return 0;
-	}
+	uint64_t secs = 0;
+	int i;
 
-	if (tapdisk_vbd_request_timeout(vreq))
-		return 0;
+	for (i = 0; i < vreq->iovcnt; i++)
+		secs += vreq->iov[i].secs;
 
-	return 1;
+	td_mirror_dirty(vbd->mirror, vreq->sec, secs);
 }
 
 static void
 tapdisk_vbd_complete_vbd_request(td_vbd_t *vbd, td_vbd_request_t *vreq)
 {
 	if (!vreq->submitting && !vreq->secs_pending) {
+		if (vreq->list_head == &vbd->pending_requests)
+			vbd->inflight[td_op_write(vreq->op)]--;
+
 		if (vreq->error &&
-		    tapdisk_vbd_request_should_retry(vbd, vreq))
+		    tapdisk_vbd_request_should_retry(vbd, vreq)) {
+			tapdisk_vbd_schedule_retry(vbd, vreq);
 			tapdisk_vbd_move_request(vreq, &vbd->failed_requests);
-		else
+		} else {
+			tapdisk_vbd_count_latency(vbd, vreq);
 			tapdisk_vbd_move_request(vreq, &vbd->completed_requests);
+
+			if (vreq->error)
+				tapdisk_control_post_event(vbd->uuid,
+							   TAPDISK_EVENT_ERROR,
+							   vreq->error,
+							   vbd->state);
+
+			if (vreq->op == TD_OP_WRITE && !vreq->error &&
+			    vbd->mirror)
+				tapdisk_vbd_mirror_write(vbd, vreq);
+		}
+	}
+}
+
+static const char *
+tapdisk_vbd_op_name(int op)
+{
+	switch (op) {
+	case TD_OP_READ:
+		return "read";
+	case TD_OP_WRITE:
+		return "write";
+	case TD_OP_DISCARD:
+		return "discard";
 	}
+
+	return "unknown";
 }
 
 static void
@@ -989,7 +2163,13 @@ __tapdisk_vbd_complete_td_request(td_vbd_t *vbd, td_vbd_request_t *vreq,
 	vreq->secs_pending -= treq.secs;
 
 	if (err != -EBUSY) {
-		int write = treq.op == TD_OP_WRITE;
+		int write = td_op_write(treq.op);
+		struct timeval now;
+
+		gettimeofday(&now, NULL);
+		td_latency_add(&image->latency, write, treq.secs,
+			       td_latency_us(&vreq->last_try, &now));
+
 		td_sector_count_add(&image->stats.hits, treq.secs, write);
 		if (err)
 			td_sector_count_add(&image->stats.fail,
@@ -1005,7 +2185,7 @@ __tapdisk_vbd_complete_td_request(td_vbd_t *vbd, td_vbd_request_t *vreq,
 				tlog_drv_error(image->driver, err,
 					       "req %s: %s 0x%04x secs @ 0x%08"PRIx64" - %s",
 					       vreq->name,
-					       (treq.op == TD_OP_WRITE ? "write" : "read"),
+					       tapdisk_vbd_op_name(treq.op),
 					       treq.secs, treq.sec, strerror(abs(err)));
 			vbd->errors++;
 		}
@@ -1015,6 +2195,15 @@ __tapdisk_vbd_complete_td_request(td_vbd_t *vbd, td_vbd_request_t *vreq,
 	tapdisk_vbd_complete_vbd_request(vbd, vreq);
 }
 
+/* reads nothing in the chain holds */
+static void
+tapdisk_vbd_zero_read(td_vbd_t *vbd, td_request_t treq)
+{
+	tapdisk_buf_fill_zero(treq.buf, treq.secs << SECTOR_SHIFT);
+	vbd->zero_reads++;
+	vbd->zero_secs += treq.secs;
+}
+
 static void
 __tapdisk_vbd_reissue_td_request(td_vbd_t *vbd,
 				 td_image_t *image, td_request_t treq)
@@ -1028,14 +2217,34 @@ __tapdisk_vbd_reissue_td_request(td_vbd_t *vbd,
 	vreq->submitting++;
 
 	if (tapdisk_vbd_is_last_image(vbd, image)) {
-		memset(treq.buf, 0, treq.secs << SECTOR_SHIFT);
+		if (treq.op == TD_OP_READ)
+			tapdisk_vbd_zero_read(vbd, treq);
 		td_complete_request(treq, 0);
 		goto done;
 	}
 
-	parent     = tapdisk_vbd_next_image(image);
+	parent = tapdisk_vbd_next_image(image);
+
+	/* past the writable images, reads skip layers holding no data */
+	if (treq.op == TD_OP_READ) {
+		parent = td_chainmap_route(&vbd->chainmap,
+					   &vbd->images, parent, &treq);
+		if (!parent) {
+			tapdisk_vbd_zero_read(vbd, treq);
+			td_complete_request(treq, 0);
+			goto done;
+		}
+	}
+
 	treq.image = parent;
 
+	/* discards stop at the first read-only image */
+	if (treq.op == TD_OP_DISCARD &&
+	    td_flag_test(parent->flags, TD_OPEN_RDONLY)) {
+		td_complete_request(treq, 0);
+		goto done;
+	}
+
 	/* return zeros for requests that extend beyond end of parent image */
 	if (treq.sec + treq.secs > parent->info.size) {
 		td_request_t clone  = treq;
@@ -1044,18 +2253,25 @@ __tapdisk_vbd_reissue_td_request(td_vbd_t *vbd,
 			int secs    = parent->info.size - treq.sec;
 			clone.sec  += secs;
 			clone.secs -= secs;
-			clone.buf  += (secs << SECTOR_SHIFT);
+			if (clone.buf)
+				clone.buf += (secs << SECTOR_SHIFT);
 			treq.secs   = secs;
 		} else
 			treq.secs   = 0;
 
-		memset(clone.buf, 0, clone.secs << SECTOR_SHIFT);
+		if (treq.op == TD_OP_READ)
+			tapdisk_vbd_zero_read(vbd, clone);
 		td_complete_request(clone, 0);
 
 		if (!treq.secs)
 			goto done;
 	}
 
+	if (unlikely(parent->lazy)) {
+		tapdisk_image_queue_lazy(parent, treq);
+		goto done;
+	}
+
 	switch (treq.op) {
 	case TD_OP_WRITE:
 		td_queue_write(parent, treq);
@@ -1064,6 +2280,10 @@ __tapdisk_vbd_reissue_td_request(td_vbd_t *vbd,
 	case TD_OP_READ:
 		td_queue_read(parent, treq);
 		break;
+
+	case TD_OP_DISCARD:
+		td_queue_discard(parent, treq);
+		break;
 	}
 
 done:
@@ -1117,6 +2337,7 @@ tapdisk_vbd_complete_td_request(td_request_t treq, int res)
 			list_add(&vbd->secondary->next, leaf->next.prev);
 			vbd->FIXME_enospc_redirect_count_enabled = 1;
 		}
+		td_chainmap_reset(&vbd->chainmap);
 		if (vbd->secondary_mode != TD_VBD_SECONDARY_DISABLED) {
 			vbd->secondary = NULL;
 			vbd->secondary_mode = TD_VBD_SECONDARY_DISABLED;
@@ -1137,6 +2358,7 @@ tapdisk_vbd_complete_td_request(td_request_t treq, int res)
 
 		/* It was the secondary that timed out - disable secondary */
 		list_del_init(&image->next);
+		td_chainmap_reset(&vbd->chainmap);
 		vbd->retired = image;
 		if (vbd->secondary_mode != TD_VBD_SECONDARY_DISABLED) {
 			vbd->secondary = NULL;
@@ -1159,6 +2381,112 @@ queue_mirror_req(td_vbd_t *vbd, td_request_t clone)
 	td_queue_write(vbd->secondary, clone);
 }
 
+/*
+ * Group commit. A flush covers the writes completed before it was
+ * issued, so it waits for the next sync to start, not for one already
+ * running. All flushes issued in one pass over the queue, or while a
+ * sync runs, share the next sync. The sync itself runs td_sync on
+ * every writable image, from the flush thread.
+ *
+ * A waiting flush holds one pending sector, dropped once its sync
+ * returned.
+ */
+static void
+tapdisk_vbd_queue_flush(td_vbd_t *vbd, td_vbd_request_t *vreq)
+{
+	vreq->secs_pending = 1;
+	vreq->flush_gen    = vbd->flush_gen + 1;
+
+	vbd->flush_waiting++;
+	vbd->flushes++;
+}
+
+static void
+tapdisk_vbd_complete_flushes(td_vbd_t *vbd, int err)
+{
+	td_vbd_request_t *vreq, *tmp;
+
+	tapdisk_vbd_for_each_request(vreq, tmp, &vbd->pending_requests) {
+		if (vreq->op != TD_OP_FLUSH || !vreq->secs_pending)
+			continue;
+
+		if ((int)(vreq->flush_gen - vbd->flush_gen) > 0)
+			continue;
+
+		vreq->secs_pending = 0;
+		vreq->error        = (vreq->error ? : err);
+		tapdisk_vbd_complete_vbd_request(vbd, vreq);
+	}
+}
+
+static void
+tapdisk_vbd_start_flush(td_vbd_t *vbd)
+{
+	td_driver_t *drivers[TD_FLUSH_DRIVERS];
+	td_image_t *image;
+	int n, err;
+
+	if (!vbd->flush_waiting || td_flush_busy(&vbd->flush))
+		return;
+
+	n   = 0;
+	err = 0;
+
+	tapdisk_for_each_image(image, &vbd->images) {
+		if (td_flag_test(image->flags, TD_OPEN_RDONLY))
+			break;
+
+		if (!image->driver || !image->driver->ops->td_sync)
+			continue;
+
+		/* the async secondary lags anyway, flushes don't wait */
+		if (image == vbd->secondary &&
+		    vbd->secondary_mode == TD_VBD_SECONDARY_ASYNC)
+			continue;
+
+		if (n == TD_FLUSH_DRIVERS) {
+			err = -E2BIG;
+			break;
+		}
+
+		drivers[n++] = image->driver;
+	}
+
+	image = vbd->secondary;
+	if (!err && image && image->driver && image->driver->ops->td_sync &&
+	    vbd->secondary_mode == TD_VBD_SECONDARY_MIRROR) {
+		if (n < TD_FLUSH_DRIVERS)
+			drivers[n++] = image->driver;
+		else
+			err = -E2BIG;
+	}
+
+	if (!err && n)
+		err = td_flush_start(&vbd->flush, drivers, n);
+
+	vbd->flush_gen++;
+	vbd->flush_waiting = 0;
+
+	/* nothing to sync, or no sync coming */
+	if (err || !n) {
+		if (err)
+			ERR(err, "%s: flush", vbd->name);
+		tapdisk_vbd_complete_flushes(vbd, err);
+	}
+}
+
+static void
+tapdisk_vbd_flush_done(struct td_flush *flush, int err)
+{
+	td_vbd_t *vbd = containerof(flush, td_vbd_t, flush);
+
+	if (err)
+		ERR(err, "%s: sync", vbd->name);
+
+	tapdisk_vbd_complete_flushes(vbd, err);
+	tapdisk_vbd_start_flush(vbd);
+}
+
 static int
 tapdisk_vbd_issue_request(td_vbd_t *vbd, td_vbd_request_t *vreq)
 {
@@ -1176,6 +2504,7 @@ tapdisk_vbd_issue_request(td_vbd_t *vbd, td_vbd_request_t *vreq)
 	vreq->last_try = vbd->ts;
 
 	tapdisk_vbd_move_request(vreq, &vbd->pending_requests);
+	vbd->inflight[td_op_write(vreq->op)]++;
 
 	err = tapdisk_vbd_check_queue(vbd);
 	if (err) {
@@ -1189,6 +2518,11 @@ tapdisk_vbd_issue_request(td_vbd_t *vbd, td_vbd_request_t *vreq)
 		goto fail;
 	}
 
+	if (vreq->op == TD_OP_FLUSH) {
+		tapdisk_vbd_queue_flush(vbd, vreq);
+		goto out;
+	}
+
 	for (i = 0; i < vreq->iovcnt; i++) {
 		struct td_iovec *iov = &vreq->iov[i];
 
@@ -1231,6 +2565,12 @@ tapdisk_vbd_issue_request(td_vbd_t *vbd, td_vbd_request_t *vreq)
 			treq.op = TD_OP_READ;
 			td_queue_read(treq.image, treq);
 			break;
+
+		case TD_OP_DISCARD:
+			/* not mirrored, the secondary may not discard */
+			treq.op = TD_OP_DISCARD;
+			td_queue_discard(treq.image, treq);
+			break;
 		}
 
 		DBG(TLOG_DBG, "%s: req %s seg %d sec 0x%08"PRIx64" secs 0x%04x "
@@ -1280,11 +2620,11 @@ tapdisk_vbd_reissue_failed_requests(td_vbd_t *vbd)
 			continue;
 		}
 
-		if (vreq->error != -EBUSY &&
-		    now.tv_sec - vreq->last_try.tv_sec < TD_VBD_RETRY_INTERVAL)
+		if (timercmp(&now, &vreq->next_try, <))
 			continue;
 
 		vbd->retries++;
+		vbd->retries_busy += vreq->error == -EBUSY;
 		vreq->num_retries++;
 
 		vreq->prev_error = vreq->error;
@@ -1303,6 +2643,8 @@ tapdisk_vbd_reissue_failed_requests(td_vbd_t *vbd)
 			break;
 	}
 
+	tapdisk_vbd_start_flush(vbd);
+
 	return 0;
 }
 
@@ -1312,36 +2654,222 @@ tapdisk_vbd_count_new_request(td_vbd_t *vbd, td_vbd_request_t *vreq)
 	struct td_iovec *iov;
 	int write;
 
-	write = vreq->op == TD_OP_WRITE;
+	write = td_op_write(vreq->op);
 
 	for (iov = &vreq->iov[0]; iov < &vreq->iov[vreq->iovcnt]; iov++)
 		td_sector_count_add(&vbd->secs, iov->secs, write);
 }
 
+/*
+ * Dequeue policies.
+ *
+ * fifo:     arrival order, nothing held back.
+ *
+ * deadline: reads before writes. Writes are held to a few in flight
+ *           while reads are in flight, and everything to a depth
+ *           scaled by the VBD weight, so a VBD sharing its event loop
+ *           and AIO queue takes a share of it. A request queued past
+ *           its deadline goes first regardless. Requests continuing
+ *           the last issued sector range go next, up to
+ *           TD_VBD_BATCH_SECS, so sequential runs reach io-optimize
+ *           together and merge.
+ */
+
+static td_vbd_request_t *
+tapdisk_vbd_fifo_next(td_vbd_t *vbd, const struct timeval *now)
+{
+	if (list_empty(&vbd->new_requests))
+		return NULL;
+
+	return list_entry(vbd->new_requests.next, td_vbd_request_t, next);
+}
+
 static int
-tapdisk_vbd_issue_new_requests(td_vbd_t *vbd)
+tapdisk_vbd_request_expired(const td_vbd_request_t *vreq,
+			    const struct timeval *now)
 {
-	int err;
-	td_vbd_request_t *vreq, *tmp;
+	uint64_t expire;
+
+	expire = (td_op_write(vreq->op) ?
+		  TD_VBD_WRITE_EXPIRE_MS : TD_VBD_READ_EXPIRE_MS);
+
+	return td_latency_us(&vreq->ts, now) >= expire * 1000;
+}
+
+static unsigned int
+tapdisk_vbd_weighted(td_vbd_t *vbd, unsigned int depth)
+{
+	depth = depth * vbd->weight / TD_VBD_WEIGHT_DEFAULT;
 
+	return depth ? : 1;
+}
+
+static td_vbd_request_t *
+tapdisk_vbd_deadline_next(td_vbd_t *vbd, const struct timeval *now)
+{
+	td_vbd_request_t *vreq, *tmp, *rd, *wr, *run, *old;
+	unsigned int inflight;
+
+	rd = wr = run = NULL;
+
+	/* arrival order, the first of each op is its oldest */
 	tapdisk_vbd_for_each_request(vreq, tmp, &vbd->new_requests) {
+		if (td_op_write(vreq->op)) {
+			if (!wr)
+				wr = vreq;
+		} else if (!rd)
+			rd = vreq;
+
+		if (!run && vreq->op == vbd->batch_op &&
+		    vreq->sec == vbd->batch_end &&
+		    vbd->batch_secs < TD_VBD_BATCH_SECS)
+			run = vreq;
+	}
+
+	if (!rd && !wr)
+		return NULL;
+
+	old = rd;
+	if (!old || (wr && timercmp(&wr->ts, &rd->ts, <)))
+		old = wr;
+
+	if (tapdisk_vbd_request_expired(old, now)) {
+		vbd->expired++;
+		return old;
+	}
+
+	inflight = vbd->inflight[TD_OP_READ] + vbd->inflight[TD_OP_WRITE];
+	if (inflight >= tapdisk_vbd_weighted(vbd, MAX_REQUESTS))
+		goto hold;
+
+	if (rd)
+		return run && run->op == TD_OP_READ ? run : rd;
+
+	if (vbd->inflight[TD_OP_READ] &&
+	    vbd->inflight[TD_OP_WRITE] >=
+	    tapdisk_vbd_weighted(vbd, TD_VBD_WRITE_DEPTH))
+		goto hold;
+
+	return run ? : wr;
+
+hold:
+	vbd->held++;
+	return NULL;
+}
+
+int
+tapdisk_vbd_set_policy(td_vbd_t *vbd, const char *name, int weight)
+{
+	const struct td_vbd_policy *policy = vbd->policy;
+	int i, n;
+
+	if (name && name[0]) {
+		n = sizeof(tapdisk_vbd_policies) / sizeof(tapdisk_vbd_policies[0]);
+
+		for (i = 0; i < n; i++)
+			if (!strcmp(tapdisk_vbd_policies[i].name, name))
+				break;
+
+		if (i == n)
+			return -EINVAL;
+
+		policy = &tapdisk_vbd_policies[i];
+	}
+
+	if (weight > TD_VBD_WEIGHT_MAX)
+		return -EINVAL;
+
+	vbd->policy = policy;
+	if (weight > 0)
+		vbd->weight = weight;
+
+	DPRINTF("%s: policy %s, weight %u\n",
+		vbd->name, vbd->policy->name, vbd->weight);
+
+	return 0;
+}
+
+static void
+tapdisk_vbd_count_batch(td_vbd_t *vbd, td_vbd_request_t *vreq)
+{
+	unsigned int secs = tapdisk_vbd_request_secs(vreq);
+
+	if (vreq->op == vbd->batch_op && vreq->sec == vbd->batch_end)
+		vbd->batch_secs += secs;
+	else {
+		vbd->batch_op   = vreq->op;
+		vbd->batch_secs = secs;
+	}
+
+	vbd->batch_end = vreq->sec + secs;
+}
+
+/*
+ * Writes past the lag window of the async mirror wait, the copies
+ * catching up go on.
+ */
+static td_vbd_request_t *
+tapdisk_vbd_mirror_next(td_vbd_t *vbd)
+{
+	td_vbd_request_t *vreq, *tmp;
+
+	tapdisk_vbd_for_each_request(vreq, tmp, &vbd->new_requests)
+		if (vreq->token == vbd->mirror)
+			return vreq;
+
+	return NULL;
+}
+
+/*
+ * @issued, if given, counts the requests taken off the queue
+ */
+static int
+tapdisk_vbd_issue_new_requests(td_vbd_t *vbd, int *issued)
+{
+	int err;
+	td_vbd_request_t *vreq;
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+
+	while ((vreq = vbd->policy->next(vbd, &now))) {
+		if (vreq->op == TD_OP_WRITE && vbd->mirror &&
+		    td_mirror_full(vbd->mirror)) {
+			vreq = tapdisk_vbd_mirror_next(vbd);
+			if (!vreq) {
+				vbd->mirror->held++;
+				break;
+			}
+		}
+
+		tapdisk_vbd_count_batch(vbd, vreq);
+		if (issued)
+			(*issued)++;
+
 		err = tapdisk_vbd_issue_request(vbd, vreq);
 		/*
 		 * if this request failed, but was not completed,
 		 * we'll back off for a while.
 		 */
 		if (err && !tapdisk_vbd_request_completed(vbd, vreq))
-			return err;
+			goto out;
 
 		tapdisk_vbd_count_new_request(vbd, vreq);
 	}
 
-	return 0;
+	err = 0;
+
+out:
+	tapdisk_vbd_start_flush(vbd);
+
+	return err;
 }
 
 int
 tapdisk_vbd_recheck_state(td_vbd_t *vbd)
 {
+	int issued = 0;
+
 	if (list_empty(&vbd->new_requests))
 		return 0;
 
@@ -1349,9 +2877,10 @@ tapdisk_vbd_recheck_state(td_vbd_t *vbd)
 	    td_flag_test(vbd->state, TD_VBD_QUIESCE_REQUESTED))
 		return 0;
 
-	tapdisk_vbd_issue_new_requests(vbd);
+	/* requests held back wait for a completion, don't spin on them */
+	tapdisk_vbd_issue_new_requests(vbd, &issued);
 
-	return 1;
+	return !!issued;
 }
 
 static int
@@ -1388,18 +2917,23 @@ tapdisk_vbd_issue_requests(td_vbd_t *vbd)
 	if (err)
 		return err;
 
-	return tapdisk_vbd_issue_new_requests(vbd);
+	return tapdisk_vbd_issue_new_requests(vbd, NULL);
 }
 
 int
 tapdisk_vbd_queue_request(td_vbd_t *vbd, td_vbd_request_t *vreq)
 {
 	gettimeofday(&vreq->ts, NULL);
-	vreq->vbd = vbd;
+	vreq->vbd         = vbd;
+	vreq->num_retries = 0;
+	vreq->backoff     = 0;
 
 	list_add_tail(&vreq->next, &vbd->new_requests);
 	vbd->received++;
 
+	td_trace(arrive, vreq, vreq->op, vreq->sec,
+		 tapdisk_vbd_request_secs(vreq), 0);
+
 	return 0;
 }
 
@@ -1452,19 +2986,120 @@ tapdisk_vbd_start_nbdserver(td_vbd_t *vbd)
 	return 0;
 }
 
+static void
+tapdisk_vbd_placement_stats(td_stats_t *st)
+{
+	char loop[128], helpers[128];
+
+	tapdisk_server_placement(loop, helpers, sizeof(loop));
+
+	tapdisk_stats_field(st, "cpus", "{");
+	tapdisk_stats_field(st, "loop", "s", loop);
+	tapdisk_stats_field(st, "helpers", "s", helpers);
+	tapdisk_stats_leave(st, '}');
+}
+
 void
 tapdisk_vbd_stats(td_vbd_t *vbd, td_stats_t *st)
 {
 	td_image_t *image, *next;
+	uint64_t rss;
 
 	tapdisk_stats_enter(st, '{');
 	tapdisk_stats_field(st, "name", "s", vbd->name);
+	tapdisk_stats_field(st, "numa_node", "d", tapdisk_server_numa_node());
+	tapdisk_vbd_placement_stats(st);
 
 	tapdisk_stats_field(st, "secs", "[");
 	tapdisk_stats_val(st, "llu", vbd->secs.rd);
 	tapdisk_stats_val(st, "llu", vbd->secs.wr);
 	tapdisk_stats_leave(st, ']');
 
+	tapdisk_stats_field(st, "zero_reads", "{");
+	tapdisk_stats_field(st, "count", "llu", vbd->zero_reads);
+	tapdisk_stats_field(st, "secs", "llu", vbd->zero_secs);
+	tapdisk_stats_leave(st, '}');
+
+	tapdisk_stats_field(st, "latency", "{");
+	td_latency_stats(&vbd->latency, st);
+	tapdisk_stats_leave(st, '}');
+
+	tapdisk_stats_field(st, "sched", "{");
+	tapdisk_stats_field(st, "policy", "s", vbd->policy->name);
+	tapdisk_stats_field(st, "weight", "u", vbd->weight);
+	tapdisk_stats_field(st, "inflight", "[");
+	tapdisk_stats_val(st, "u", vbd->inflight[TD_OP_READ]);
+	tapdisk_stats_val(st, "u", vbd->inflight[TD_OP_WRITE]);
+	tapdisk_stats_leave(st, ']');
+	tapdisk_stats_field(st, "held", "llu", vbd->held);
+	tapdisk_stats_field(st, "expired", "llu", vbd->expired);
+	tapdisk_stats_leave(st, '}');
+
+	tapdisk_stats_field(st, "retry", "{");
+	tapdisk_stats_field(st, "retries", "llu", vbd->retries);
+	tapdisk_stats_field(st, "busy", "llu", vbd->retries_busy);
+	tapdisk_stats_field(st, "backoffs", "llu", vbd->backoffs);
+	tapdisk_stats_field(st, "backoff_ms", "llu", vbd->backoff_ms);
+	tapdisk_stats_field(st, "backoff_min_ms", "d", TD_VBD_RETRY_BACKOFF_MIN);
+	tapdisk_stats_field(st, "backoff_max_ms", "d", TD_VBD_RETRY_BACKOFF_MAX);
+	tapdisk_stats_field(st, "timeout_s", "d", vbd->req_timeout);
+	tapdisk_stats_leave(st, '}');
+
+	tapdisk_stats_field(st, "flush", "{");
+	tapdisk_stats_field(st, "flushes", "llu", vbd->flushes);
+	tapdisk_stats_field(st, "waiting", "u", vbd->flush_waiting);
+	td_flush_stats(&vbd->flush, st);
+	tapdisk_stats_leave(st, '}');
+
+	tapdisk_stats_field(st, "chainmap", "{");
+	td_chainmap_stats(&vbd->chainmap, st);
+	tapdisk_stats_leave(st, '}');
+
+	tapdisk_stats_field(st, "pause", "{");
+	tapdisk_stats_field(st, "pauses", "llu", vbd->pauses);
+	tapdisk_stats_field(st, "last_us", "llu", vbd->pause_us);
+	tapdisk_stats_field(st, "max_us", "llu", vbd->pause_max_us);
+	tapdisk_stats_field(st, "reused", "llu", vbd->parents_reused);
+	tapdisk_stats_field(st, "reopened", "llu", vbd->parents_reopened);
+	tapdisk_stats_leave(st, '}');
+
+	tapdisk_stats_field(st, "coalesce", "{");
+	tapdisk_stats_field(st, "running", "d", !!vbd->coalesce);
+	if (vbd->coalesce)
+		tapdisk_stats_field(st, "image", "s", vbd->coalesce->name);
+	tapdisk_stats_field(st, "done", "llu", vbd->coalesces);
+	tapdisk_stats_field(st, "error", "d", vbd->coalesce_error);
+	tapdisk_stats_leave(st, '}');
+
+	tapdisk_stats_field(st, "migrate", "{");
+	tapdisk_stats_field(st, "state", "d", vbd->migrate_state);
+	if (vbd->migrate_target)
+		tapdisk_stats_field(st, "target", "s", vbd->migrate_target);
+	tapdisk_stats_field(st, "done", "llu", vbd->migrations);
+	tapdisk_stats_field(st, "error", "d", vbd->migrate_error);
+	tapdisk_stats_leave(st, '}');
+
+	if (vbd->mirror) {
+		tapdisk_stats_field(st, "mirror", "{");
+		td_mirror_stats(vbd->mirror, st);
+		tapdisk_stats_leave(st, '}');
+	}
+
+	if (vbd->warm) {
+		tapdisk_stats_field(st, "warm", "{");
+		td_warm_stats(vbd->warm, st);
+		tapdisk_stats_leave(st, '}');
+	}
+
+	/* rss is the process', shared by its VBDs */
+	tapdisk_stats_field(st, "memory", "{");
+	tapdisk_stats_field(st, "requests", "llu", tapdisk_vbd_footprint(vbd, 0));
+	tapdisk_stats_field(st, "trims", "llu", vbd->trims);
+	tapdisk_stats_field(st, "trimmed", "llu", vbd->trimmed);
+	if (!tapdisk_resident_bytes(&rss))
+		tapdisk_stats_field(st, "rss", "llu", rss);
+	tapdisk_stats_leave(st, '}');
+
 	tapdisk_stats_field(st, "images", "[");
 	tapdisk_vbd_for_each_image(vbd, image, next)
 		tapdisk_image_stats(image, st);
@@ -1476,6 +3111,26 @@ tapdisk_vbd_stats(td_vbd_t *vbd, td_stats_t *st)
 		tapdisk_stats_leave(st, '}');
 	}
 
+	if (vbd->ringserver) {
+		tapdisk_stats_field(st, "ring", "{");
+		tapdisk_ringserver_stats(vbd->ringserver, st);
+		tapdisk_stats_leave(st, '}');
+	}
+
+	if (vbd->headroom.lead_s) {
+		struct td_vbd_headroom *h = &vbd->headroom;
+
+		tapdisk_stats_field(st, "headroom", "{");
+		tapdisk_stats_field(st, "lead_s", "u", h->lead_s);
+		tapdisk_stats_field(st, "hold_ms", "u", h->hold_ms);
+		tapdisk_stats_field(st, "space", "lld", (long long)h->space);
+		tapdisk_stats_field(st, "rate", "llu", h->rate);
+		tapdisk_stats_field(st, "low", "d", h->low);
+		tapdisk_stats_field(st, "events", "llu", h->events);
+		tapdisk_stats_field(st, "held", "llu", h->held);
+		tapdisk_stats_leave(st, '}');
+	}
+
 	tapdisk_stats_field(st,
 			"FIXME_enospc_redirect_count",
 			"llu", vbd->FIXME_enospc_redirect_count);
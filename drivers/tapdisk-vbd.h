@@ -24,10 +24,16 @@
 #include "scheduler.h"
 #include "tapdisk-image.h"
 #include "tapdisk-blktap.h"
+#include "tapdisk-flush.h"
+#include "tapdisk-chainmap.h"
+#include "tapdisk-coalesce.h"
+#include "tapdisk-mirror.h"
 
 #define TD_VBD_REQUEST_TIMEOUT      120
 #define TD_VBD_MAX_RETRIES          100
 #define TD_VBD_RETRY_INTERVAL       1
+#define TD_VBD_RETRY_BACKOFF_MIN    50	/* ms */
+#define TD_VBD_RETRY_BACKOFF_MAX    8000	/* ms */
 
 #define TD_VBD_DEAD                 0x0001
 #define TD_VBD_CLOSED               0x0002
@@ -38,12 +44,70 @@
 #define TD_VBD_SHUTDOWN_REQUESTED   0x0040
 #define TD_VBD_LOCKING              0x0080
 #define TD_VBD_LOG_DROPPED          0x0100
+#define TD_VBD_RELINK_REQUESTED     0x0200
+
+/* deadline policy: ms a queued request may be passed over */
+#define TD_VBD_READ_EXPIRE_MS       20
+#define TD_VBD_WRITE_EXPIRE_MS      250
+/* writes in flight while reads are about, at the default weight */
+#define TD_VBD_WRITE_DEPTH          8
+/* most sectors issued back to back as one sequential run */
+#define TD_VBD_BATCH_SECS           2048
+
+#define TD_VBD_HEADROOM_SAMPLE_MS   1000
+
+/* seconds without requests before images give back request memory */
+#define TD_VBD_TRIM_IDLE            30
+
+#define TD_VBD_WEIGHT_DEFAULT       100
+#define TD_VBD_WEIGHT_MAX           1000
 
 #define TD_VBD_SECONDARY_DISABLED   0 
 #define TD_VBD_SECONDARY_MIRROR     1
 #define TD_VBD_SECONDARY_STANDBY    2
+#define TD_VBD_SECONDARY_ASYNC      3
+
+#define TD_VBD_MIGRATE_NONE         0
+#define TD_VBD_MIGRATE_COPY         1
+#define TD_VBD_MIGRATE_DRAIN        2	/* writes held */
+#define TD_VBD_MIGRATE_SWITCH       3	/* pausing onto the target */
+
+#define TD_VBD_MIGRATE_DIRTY        256	/* extents, 16M left to switch */
+#define TD_VBD_MIGRATE_ROUNDS       8
 
 struct td_nbdserver;
+struct td_ringserver;
+struct td_shmstats_vbd;
+struct td_heat;
+struct td_warm;
+
+/*
+ * Space the leaf can still grow into, sampled as it allocates. Once
+ * 'lead_s' is set, the VBD goes 'low' when that space would last
+ * less than lead_s at the allocation rate, and tells the control
+ * socket. ENOSPC writes are then held up to 'hold_ms' for the LV to
+ * be extended under them.
+ */
+struct td_vbd_headroom {
+	unsigned int                lead_s;		/* 0: off */
+	unsigned int                hold_ms;
+	struct timeval              ts;			/* last sample */
+	uint64_t                    allocated;		/* bytes, at ts */
+	uint64_t                    rate;		/* bytes/s */
+	int64_t                     space;		/* bytes, at ts */
+	int                         low;
+	uint64_t                    events;
+	uint64_t                    held;
+};
+
+/*
+ * Dequeue policy: picks the next of vbd->new_requests to issue, or
+ * NULL to hold the rest back until something completes.
+ */
+struct td_vbd_policy {
+	const char                 *name;
+	td_vbd_request_t         *(*next)(td_vbd_t *, const struct timeval *);
+};
 
 struct td_vbd_handle {
 	char                       *name;
@@ -57,6 +121,9 @@ struct td_vbd_handle {
 
 	struct list_head            images;
 
+	/* parents left open over a pause, for the resume to take back */
+	struct list_head            parked;
+
 	int                         parent_devnum;
 	char                       *secondary_name;
 	td_image_t                 *secondary;
@@ -76,6 +143,9 @@ struct td_vbd_handle {
 
 	int                         nbd_mirror_failed;
 
+	/* async mode: what the secondary still lacks */
+	struct td_mirror           *mirror;
+
 	struct list_head            new_requests;
 	struct list_head            pending_requests;
 	struct list_head            failed_requests;
@@ -93,10 +163,82 @@ struct td_vbd_handle {
 	uint64_t                    kicked;
 	uint64_t                    secs_pending;
 	uint64_t                    retries;
+	uint64_t                    retries_busy;
+	uint64_t                    backoffs;
+	uint64_t                    backoff_ms;
 	uint64_t                    errors;
 	td_sector_count_t           secs;
+	uint64_t                    zero_reads;  /* holes read as zeros */
+	uint64_t                    zero_secs;
+
+	/* queued to completion, per VBD request */
+	struct td_latency           latency;
+
+	const struct td_vbd_policy *policy;
+	unsigned int                weight;
+	unsigned int                inflight[2];	/* rd, wr */
+	int                         batch_op;
+	td_sector_t                 batch_end;
+	unsigned int                batch_secs;
+	uint64_t                    held;
+	uint64_t                    expired;
+
+	/* flushes waiting for the next sync share it */
+	struct td_flush             flush;
+	unsigned int                flush_gen;      /* syncs started */
+	unsigned int                flush_waiting;
+	uint64_t                    flushes;
+
+	/* read-only tail of the chain, per extent */
+	struct td_chainmap          chainmap;
+
+	/* online merge of the leaf's parent onto its own parent */
+	struct td_coalesce         *coalesce;
+	int                         coalesce_error;
+	uint64_t                    coalesces;
+
+	/* live copy onto migrate_image, through the mirror */
+	int                         migrate_state;
+	char                       *migrate_target;
+	td_image_t                 *migrate_image;
+	uint64_t                    migrate_rounds;
+	uint64_t                    migrate_dirty;  /* at the last round */
+	struct timeval              migrate_ts;
+	int                         migrate_error;
+	uint64_t                    migrations;
 
 	struct td_nbdserver        *nbdserver;
+
+	/* slot in the stats page, and when it was last written */
+	struct td_shmstats_vbd     *shmstats;
+	struct timeval              shmstats_ts;
+
+	/* requested to resumed, in usecs */
+	struct timeval              pause_ts;
+	uint64_t                    pauses;
+	uint64_t                    pause_us;
+	uint64_t                    pause_max_us;
+	uint64_t                    parents_reused;
+	uint64_t                    parents_reopened;
+
+	/* requests recorded as they complete, for replay */
+	struct td_iotrace          *iotrace;
+
+	/* a userspace client on a shared ring */
+	struct td_ringserver       *ringserver;
+
+	/* access counts per block, as requests complete */
+	struct td_heat             *heat;
+
+	/* hot blocks of a heat map, read ahead for the caches */
+	struct td_warm             *warm;
+
+	struct td_vbd_headroom      headroom;
+
+	/* last progress the images were trimmed at, and what it freed */
+	struct timeval              trim_ts;
+	uint64_t                    trims;
+	uint64_t                    trimmed;
 };
 
 #define tapdisk_vbd_for_each_request(vreq, tmp, list)	                \
@@ -165,7 +307,10 @@ int tapdisk_vbd_queue_request(td_vbd_t *, td_vbd_request_t *);
 void tapdisk_vbd_forward_request(td_request_t);
 
 int tapdisk_vbd_get_disk_info(td_vbd_t *, td_disk_info_t *);
-int tapdisk_vbd_retry_needed(td_vbd_t *);
+int tapdisk_vbd_allocated(td_vbd_t *, td_sector_t, int);
+int tapdisk_vbd_discard_supported(td_vbd_t *);
+int tapdisk_vbd_flush_supported(td_vbd_t *);
+int tapdisk_vbd_retry_timeout(td_vbd_t *);
 int tapdisk_vbd_quiesce_queue(td_vbd_t *);
 int tapdisk_vbd_start_queue(td_vbd_t *);
 int tapdisk_vbd_issue_requests(td_vbd_t *);
@@ -179,5 +324,18 @@ void tapdisk_vbd_check_progress(td_vbd_t *);
 void tapdisk_vbd_debug(td_vbd_t *);
 int tapdisk_vbd_start_nbdserver(td_vbd_t *);
 void tapdisk_vbd_stats(td_vbd_t *, td_stats_t *);
+int tapdisk_vbd_set_policy(td_vbd_t *, const char *, int weight);
+int tapdisk_vbd_coalesce(td_vbd_t *, uint64_t rate);
+int tapdisk_vbd_migrate(td_vbd_t *, const char *target, uint64_t rate);
+int tapdisk_vbd_record(td_vbd_t *, const char *path, uint64_t bytes);
+int tapdisk_vbd_heat(td_vbd_t *, int flags, unsigned int decay,
+		     const char *path, uint64_t *blocks, uint64_t *hot);
+int tapdisk_vbd_warm(td_vbd_t *, const char *path, uint64_t size,
+		     uint64_t rate);
+int tapdisk_vbd_serve_ring(td_vbd_t *, const char *location, uint32_t slots,
+			   uint32_t data_size, unsigned int poll_us);
+int tapdisk_vbd_set_headroom(td_vbd_t *, unsigned int lead_s,
+			     unsigned int hold_ms);
+void tapdisk_vbd_check_headroom(td_vbd_t *, const struct timeval *);
 
 #endif
@@ -0,0 +1,385 @@
+/*
+ * Copyright (C) Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2.1 only
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "tapdisk-warm.h"
+#include "tapdisk-heat.h"
+#include "tapdisk-vbd.h"
+#include "tapdisk-server.h"
+#include "tapdisk-stats.h"
+#include "tapdisk-log.h"
+#include "atomicio.h"
+
+#define MIN(a, b)                        ((a) < (b) ? (a) : (b))
+
+struct td_warm_block {
+	uint32_t                     heat;
+	uint64_t                     block;
+};
+
+static int
+td_warm_hotter(const void *_a, const void *_b)
+{
+	const struct td_warm_block *a = _a, *b = _b;
+
+	if (a->heat != b->heat)
+		return a->heat > b->heat ? -1 : 1;
+
+	return a->block < b->block ? -1 : a->block > b->block;
+}
+
+static int
+td_warm_ascending(const void *_a, const void *_b)
+{
+	const uint64_t *a = _a, *b = _b;
+
+	return *a < *b ? -1 : *a > *b;
+}
+
+/* the hottest blocks of the snapshot, up to @max of them */
+static int
+td_warm_load(struct td_warm *w, uint64_t disk_blocks, uint64_t max)
+{
+	struct td_warm_block *hot;
+	struct td_heat_header hdr;
+	struct td_heat_count *map;
+	uint64_t i, n, blocks;
+	size_t size;
+	int fd, err;
+
+	hot = NULL;
+	map = NULL;
+
+	fd = open(w->path, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+
+	if (atomicio(read, fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+	    hdr.magic != TD_HEAT_MAGIC || hdr.version != TD_HEAT_VERSION ||
+	    hdr.block_secs != 1 << TD_HEAT_BLOCK_SHIFT) {
+		err = -EINVAL;
+		goto out;
+	}
+
+	/* the disk may have been resized since */
+	blocks = MIN(hdr.blocks, disk_blocks);
+	size   = blocks * sizeof(*map);
+
+	map = malloc(size ? : 1);
+	hot = calloc(blocks ? : 1, sizeof(*hot));
+	if (!map || !hot) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	if (atomicio(read, fd, map, size) != size) {
+		err = -EINVAL;
+		goto out;
+	}
+
+	for (i = 0, n = 0; i < blocks; i++) {
+		if (!map[i].reads && !map[i].writes)
+			continue;
+
+		hot[n].heat  = map[i].reads + map[i].writes;
+		hot[n].block = i;
+		n++;
+	}
+
+	qsort(hot, n, sizeof(*hot), td_warm_hotter);
+	if (max && n > max)
+		n = max;
+
+	w->blocks = calloc(n ? : 1, sizeof(*w->blocks));
+	if (!w->blocks) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < n; i++)
+		w->blocks[i] = hot[i].block;
+
+	qsort(w->blocks, n, sizeof(*w->blocks), td_warm_ascending);
+	w->n_blocks = n;
+	err = 0;
+
+out:
+	close(fd);
+	free(map);
+	free(hot);
+	return err;
+}
+
+static void
+__td_warm_free(struct td_warm *w)
+{
+	if (w->vbd->warm == w)
+		w->vbd->warm = NULL;
+
+	if (w->timer >= 0)
+		tapdisk_server_unregister_event(w->timer);
+
+	free(w->buf);
+	free(w->blocks);
+	free(w->path);
+	free(w);
+}
+
+static void
+td_warm_finish(struct td_warm *w)
+{
+	struct timeval now, delta;
+
+	gettimeofday(&now, NULL);
+	timersub(&now, &w->start, &delta);
+	w->done_ms = delta.tv_sec * 1000ULL + delta.tv_usec / 1000;
+
+	DPRINTF("%s: warmed %"PRIu64" blocks from %s in %"PRIu64" ms, "
+		"%"PRIu64" reads\n", w->vbd->name, w->next, w->path,
+		w->done_ms, w->reads);
+
+	if (w->timer >= 0) {
+		tapdisk_server_unregister_event(w->timer);
+		w->timer = -1;
+	}
+}
+
+static void
+td_warm_read_done(td_vbd_request_t *vreq, int error, void *token, int final)
+{
+	struct td_warm *w = token;
+
+	w->busy = 0;
+
+	if (w->stop) {
+		__td_warm_free(w);
+		return;
+	}
+
+	if (error) {
+		EPRINTF("%s: warm-up read at 0x%08"PRIx64" failed: %d\n",
+			w->vbd->name, vreq->sec, error);
+		w->error = error;
+		td_warm_finish(w);
+		return;
+	}
+
+	w->reads++;
+	w->secs += w->iov.secs;
+	w->next += (w->iov.secs + (1 << TD_HEAT_BLOCK_SHIFT) - 1) >>
+		TD_HEAT_BLOCK_SHIFT;
+
+	if (w->next >= w->n_blocks) {
+		td_warm_finish(w);
+		return;
+	}
+
+	td_warm_kick(w);
+}
+
+/* reads the next run, while the vbd has nothing else to do */
+void
+td_warm_kick(struct td_warm *w)
+{
+	td_vbd_t *vbd = w->vbd;
+	td_vbd_request_t *vreq = &w->vreq;
+	uint64_t first, n, sec;
+	td_disk_info_t info;
+
+	if (w->busy || w->stop || w->error || w->next >= w->n_blocks)
+		return;
+
+	if (td_flag_test(vbd->state, TD_VBD_DEAD) ||
+	    td_flag_test(vbd->state, TD_VBD_CLOSED) ||
+	    td_flag_test(vbd->state, TD_VBD_PAUSED) ||
+	    td_flag_test(vbd->state, TD_VBD_PAUSE_REQUESTED) ||
+	    td_flag_test(vbd->state, TD_VBD_QUIESCED) ||
+	    td_flag_test(vbd->state, TD_VBD_QUIESCE_REQUESTED))
+		return;
+
+	if (w->rate && w->budget <= 0)
+		return;
+
+	if (vbd->inflight[0] || vbd->inflight[1] ||
+	    !list_empty(&vbd->new_requests)) {
+		w->deferred++;
+		return;
+	}
+
+	if (tapdisk_vbd_get_disk_info(vbd, &info))
+		return;
+
+	first = w->blocks[w->next];
+	for (n = 1; n < TD_WARM_RUN && w->next + n < w->n_blocks; n++)
+		if (w->blocks[w->next + n] != first + n)
+			break;
+
+	sec = first << TD_HEAT_BLOCK_SHIFT;
+	if (sec >= info.size) {
+		/* shrunk under the snapshot: nothing further out either */
+		w->next = w->n_blocks;
+		td_warm_finish(w);
+		return;
+	}
+
+	memset(vreq, 0, sizeof(*vreq));
+	w->iov.base  = w->buf;
+	w->iov.secs  = MIN(n << TD_HEAT_BLOCK_SHIFT, info.size - sec);
+	w->budget   -= w->iov.secs << SECTOR_SHIFT;
+	vreq->op     = TD_OP_READ;
+	vreq->sec    = sec;
+	vreq->iov    = &w->iov;
+	vreq->iovcnt = 1;
+	vreq->cb     = td_warm_read_done;
+	vreq->token  = w;
+	vreq->name   = "warm";
+
+	w->busy = 1;
+	tapdisk_vbd_queue_request(vbd, vreq);
+}
+
+static void
+td_warm_timeout(event_id_t id, char mode, void *private)
+{
+	struct td_warm *w = private;
+
+	if (w->rate)
+		w->budget = w->rate * TD_WARM_INTERVAL;
+
+	td_warm_kick(w);
+}
+
+/* @size bytes of the hottest blocks at most, 0 for all; @rate 0: no limit */
+int
+td_warm_create(td_vbd_t *vbd, const char *path, uint64_t size,
+	       uint64_t rate, struct td_warm **_w)
+{
+	td_disk_info_t info;
+	struct td_warm *w;
+	uint64_t blocks, max;
+	int err;
+
+	err = tapdisk_vbd_get_disk_info(vbd, &info);
+	if (err)
+		return err;
+
+	w = calloc(1, sizeof(*w));
+	if (!w)
+		return -ENOMEM;
+
+	w->vbd    = vbd;
+	w->timer  = -1;
+	w->rate   = rate;
+	w->budget = rate * TD_WARM_INTERVAL;
+	gettimeofday(&w->start, NULL);
+
+	w->path = strdup(path);
+	if (!w->path) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	blocks = (info.size + (1 << TD_HEAT_BLOCK_SHIFT) - 1) >>
+		TD_HEAT_BLOCK_SHIFT;
+
+	max = (size + (1ULL << (TD_HEAT_BLOCK_SHIFT + SECTOR_SHIFT)) - 1) >>
+		(TD_HEAT_BLOCK_SHIFT + SECTOR_SHIFT);
+
+	err = td_warm_load(w, blocks, max);
+	if (err)
+		goto fail;
+
+	err = posix_memalign((void **)&w->buf, 4096,
+			     (TD_WARM_RUN << TD_HEAT_BLOCK_SHIFT) <<
+			     SECTOR_SHIFT);
+	if (err) {
+		w->buf = NULL;
+		err    = -err;
+		goto fail;
+	}
+
+	w->timer = tapdisk_server_register_event(SCHEDULER_POLL_TIMEOUT,
+						 -1, TD_WARM_INTERVAL,
+						 td_warm_timeout, w);
+	if (w->timer < 0) {
+		err = w->timer;
+		goto fail;
+	}
+
+	DPRINTF("%s: warming %"PRIu64" blocks from %s, %"PRIu64" bytes/s\n",
+		vbd->name, w->n_blocks, path, rate);
+
+	*_w = w;
+	return 0;
+
+fail:
+	EPRINTF("%s: cannot warm up from %s: %d\n", vbd->name, path, err);
+	__td_warm_free(w);
+	return err;
+}
+
+/* a read in flight frees it as it completes */
+void
+td_warm_free(struct td_warm *w)
+{
+	if (!w)
+		return;
+
+	if (w->busy) {
+		w->stop = 1;
+		return;
+	}
+
+	__td_warm_free(w);
+}
+
+/* at vbd shutdown, nothing pending: a read still queued never went out */
+void
+td_warm_close(struct td_warm *w)
+{
+	if (!w)
+		return;
+
+	if (w->busy)
+		list_del(&w->vreq.next);
+
+	__td_warm_free(w);
+}
+
+void
+td_warm_stats(struct td_warm *w, td_stats_t *st)
+{
+	tapdisk_stats_field(st, "path", "s", w->path);
+	tapdisk_stats_field(st, "blocks", "llu", w->n_blocks);
+	tapdisk_stats_field(st, "warmed", "llu", w->next);
+	tapdisk_stats_field(st, "reads", "llu", w->reads);
+	tapdisk_stats_field(st, "secs", "llu", w->secs);
+	tapdisk_stats_field(st, "deferred", "llu", w->deferred);
+	tapdisk_stats_field(st, "rate", "llu", w->rate);
+	tapdisk_stats_field(st, "error", "d", w->error);
+	tapdisk_stats_field(st, "done_ms", "llu", w->done_ms);
+}
@@ -0,0 +1,84 @@
+/*
+ * Copyright (C) Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2.1 only
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef _TAPDISK_WARM_H_
+#define _TAPDISK_WARM_H_
+
+#include <stdint.h>
+
+#include "tapdisk.h"
+#include "scheduler.h"
+
+/*
+ * Cache warm-up from a heat map snapshot (tapdisk-heat.h).
+ *
+ * The hottest blocks, up to 'size' bytes of them, are read through
+ * the vbd in ascending order, adjacent ones in runs of up to
+ * TD_WARM_RUN blocks, so whichever caches the chain has fill on their
+ * own read path. One read is in flight at a time, started only while
+ * no other request is, within 'rate' bytes per TD_WARM_INTERVAL.
+ */
+
+#define TD_WARM_RUN          2          /* blocks per read, 4M */
+#define TD_WARM_INTERVAL     1          /* s */
+
+struct td_warm {
+	td_vbd_t                    *vbd;
+	char                        *path;
+
+	uint64_t                    *blocks;    /* to read, ascending */
+	uint64_t                     n_blocks;
+	uint64_t                     next;
+
+	td_vbd_request_t             vreq;
+	struct td_iovec              iov;
+	char                        *buf;
+	int                          busy;
+	int                          stop;      /* free once idle */
+	int                          error;
+
+	uint64_t                     rate;      /* bytes/s */
+	int64_t                      budget;
+	event_id_t                   timer;
+
+	struct timeval               start;
+	uint64_t                     reads;
+	uint64_t                     secs;
+	uint64_t                     deferred;  /* kicks others were busy */
+	uint64_t                     done_ms;
+};
+
+int td_warm_create(td_vbd_t *, const char *path, uint64_t size,
+		   uint64_t rate, struct td_warm **);
+void td_warm_free(struct td_warm *);
+void td_warm_close(struct td_warm *);
+void td_warm_kick(struct td_warm *);
+void td_warm_stats(struct td_warm *, td_stats_t *);
+
+static inline int
+td_warm_done(struct td_warm *w)
+{
+	return w->error || w->next >= w->n_blocks;
+}
+
+static inline int
+td_warm_request(struct td_warm *w, td_vbd_request_t *vreq)
+{
+	return w && vreq == &w->vreq;
+}
+
+#endif
@@ -0,0 +1,218 @@
+/*
+ * Copyright (C) Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2.1 only
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "tapdisk-zpool.h"
+#include "tapdisk-server.h"
+#include "tapdisk-log.h"
+#include "scheduler.h"
+#include "libaio-compat.h"
+
+static struct {
+	pthread_t                    threads[TD_ZPOOL_THREADS];
+	int                          n_threads;
+	int                          users;
+	int                          stop;
+
+	/* users, and starting and stopping the threads */
+	pthread_mutex_t              ctl;
+
+	pthread_mutex_t              lock;
+	pthread_cond_t               cond;
+	struct list_head             queued;
+} zpool = {
+	.ctl      = PTHREAD_MUTEX_INITIALIZER,
+	.lock     = PTHREAD_MUTEX_INITIALIZER,
+	.cond     = PTHREAD_COND_INITIALIZER,
+	.queued   = LIST_HEAD_INIT(zpool.queued),
+};
+
+static void *
+td_zpool_thread(void *arg)
+{
+	struct td_zjob *job;
+	uint64_t val = 1;
+	int gcc;
+
+	pthread_mutex_lock(&zpool.lock);
+
+	for (;;) {
+		while (list_empty(&zpool.queued) && !zpool.stop)
+			pthread_cond_wait(&zpool.cond, &zpool.lock);
+
+		if (zpool.stop)
+			break;
+
+		job = list_entry(zpool.queued.next, struct td_zjob, next);
+		list_del(&job->next);
+		pthread_mutex_unlock(&zpool.lock);
+
+		job->error = job->work(job);
+
+		pthread_mutex_lock(&zpool.lock);
+		list_add_tail(&job->next, &job->port->finished);
+
+		gcc = write(job->port->efd, &val, sizeof(val));
+		if (gcc) {};
+	}
+
+	pthread_mutex_unlock(&zpool.lock);
+
+	return NULL;
+}
+
+static void
+td_zpool_event(event_id_t id, char mode, void *private)
+{
+	struct td_zport *port = private;
+	struct td_zjob *job, *next;
+	struct list_head done;
+	uint64_t val;
+	int gcc;
+
+	gcc = read(port->efd, &val, sizeof(val));
+	if (gcc) {};
+
+	INIT_LIST_HEAD(&done);
+
+	pthread_mutex_lock(&zpool.lock);
+	list_splice(&port->finished, &done);
+	INIT_LIST_HEAD(&port->finished);
+	pthread_mutex_unlock(&zpool.lock);
+
+	list_for_each_entry_safe(job, next, &done, next) {
+		list_del(&job->next);
+		job->done(job, job->error);
+	}
+}
+
+/* with ctl held */
+static void
+td_zpool_stop(void)
+{
+	int i;
+
+	pthread_mutex_lock(&zpool.lock);
+	zpool.stop = 1;
+	pthread_cond_broadcast(&zpool.cond);
+	pthread_mutex_unlock(&zpool.lock);
+
+	for (i = 0; i < zpool.n_threads; i++)
+		pthread_join(zpool.threads[i], NULL);
+
+	zpool.n_threads = 0;
+	zpool.stop      = 0;
+}
+
+/* with ctl held */
+static int
+td_zpool_start(void)
+{
+	int err;
+
+	for (; zpool.n_threads < TD_ZPOOL_THREADS; zpool.n_threads++) {
+		pthread_t *t = &zpool.threads[zpool.n_threads];
+
+		err = pthread_create(t, NULL, td_zpool_thread, NULL);
+		if (err) {
+			EPRINTF("failed to start decompression threads: %d\n",
+				-err);
+			td_zpool_stop();
+			return -err;
+		}
+
+		tapdisk_server_place_thread(*t);
+	}
+
+	return 0;
+}
+
+int
+td_zpool_get(struct td_zport *port)
+{
+	int err;
+
+	port->event = -1;
+	INIT_LIST_HEAD(&port->finished);
+
+	port->efd = tapdisk_sys_eventfd(0);
+	if (port->efd < 0)
+		return -errno;
+
+	pthread_mutex_lock(&zpool.ctl);
+	err = zpool.users ? 0 : td_zpool_start();
+	if (!err)
+		zpool.users++;
+	pthread_mutex_unlock(&zpool.ctl);
+
+	if (err) {
+		close(port->efd);
+		port->efd = -1;
+	}
+
+	return err;
+}
+
+/* From the loop the port's jobs were queued on, if any were. */
+void
+td_zpool_put(struct td_zport *port)
+{
+	if (port->event >= 0)
+		tapdisk_server_unregister_event(port->event);
+	close(port->efd);
+	port->event = -1;
+	port->efd   = -1;
+
+	pthread_mutex_lock(&zpool.ctl);
+	if (!--zpool.users)
+		td_zpool_stop();
+	pthread_mutex_unlock(&zpool.ctl);
+}
+
+/* From the user's event loop, which 'done' then runs on. */
+int
+td_zpool_queue(struct td_zport *port, struct td_zjob *job)
+{
+	if (port->event < 0) {
+		port->event =
+			tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
+						      port->efd, 0,
+						      td_zpool_event, port);
+		if (port->event < 0) {
+			int err = port->event;
+			port->event = -1;
+			return err;
+		}
+	}
+
+	job->port = port;
+
+	pthread_mutex_lock(&zpool.lock);
+	list_add_tail(&job->next, &zpool.queued);
+	pthread_cond_signal(&zpool.cond);
+	pthread_mutex_unlock(&zpool.lock);
+
+	return 0;
+}
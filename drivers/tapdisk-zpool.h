@@ -0,0 +1,56 @@
+/*
+ * Copyright (C) Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2.1 only
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef _TAPDISK_ZPOOL_H_
+#define _TAPDISK_ZPOOL_H_
+
+#include "list.h"
+#include "scheduler.h"
+
+/*
+ * Decompression helper threads.
+ *
+ * One small pool serves every compressed image of the tapdisk: a job
+ * runs 'work' on a pool thread, then 'done' with its result on the
+ * event loop that queued it. Each user hands finished jobs back through
+ * a port of its own, whose event is registered by the first job queued,
+ * from the user's loop; a user may so take its reference from any
+ * thread. The threads start with the first user and stop with the
+ * last. A user must have no jobs queued when it lets go.
+ */
+
+#define TD_ZPOOL_THREADS             4
+
+struct td_zport {
+	int                          efd;
+	event_id_t                   event;
+	struct list_head             finished;
+};
+
+struct td_zjob {
+	struct list_head             next;
+	struct td_zport             *port;
+	int                        (*work)(struct td_zjob *);
+	void                       (*done)(struct td_zjob *, int error);
+	int                          error;
+};
+
+int td_zpool_get(struct td_zport *);
+void td_zpool_put(struct td_zport *);
+int td_zpool_queue(struct td_zport *, struct td_zjob *);
+
+#endif
@@ -34,6 +34,15 @@
  * the resulting iocbs to tapdisk using td_prep_[read,write]() and 
  * td_queue_tiocb().
  *
+ * td_sync() makes all writes completed so far durable. It is synchronous
+ * and called from a helper thread, not the event loop: it must not touch
+ * driver state beyond issuing fdatasync() or the like.
+ *
+ * Disks which can deallocate storage may also implement td_queue_discard().
+ * A discard request carries no buffer, only a sector range, and may span
+ * many blocks. Discards are advisory: the range reads back undefined
+ * afterwards, so a disk may ignore all or part of one.
+ *
  * NOTE: tapdisk uses the number of sectors submitted per request as a 
  * ref count.  Plugins must use the callback function to communicate the
  * completion -- or error -- of every sector submitted to them.
@@ -66,10 +75,15 @@
 //#define BLK_NOT_ALLOCATED            (-99)
 #define TD_NO_PARENT                 1
 
-#define MAX_RAMDISK_SIZE             1024000 /*500MB disk limit*/
+#define MAX_RAMDISK_SIZE             1024000 /*500MB, for empty images*/
 
 #define TD_OP_READ                   0
 #define TD_OP_WRITE                  1
+#define TD_OP_DISCARD                2
+#define TD_OP_FLUSH                  3
+
+/* discards change the image, they are accounted with writes */
+#define td_op_write(_op)             ((_op) != TD_OP_READ)
 
 #define TD_OPEN_QUIET                0x00001
 #define TD_OPEN_QUERY                0x00002
@@ -84,6 +98,15 @@
 #define TD_OPEN_SECONDARY            0x00400
 #define TD_OPEN_STANDBY              0x00800
 #define TD_IGNORE_ENOSPC             0x01000
+#define TD_OPEN_MIRROR_ASYNC         0x02000
+
+/* depth from which parents open on first use; 0: all at once */
+#define TD_OPEN_LAZY_SHIFT           16
+#define TD_OPEN_LAZY_MASK            (0xffU << TD_OPEN_LAZY_SHIFT)
+
+/* vhd bitmap cache size, as log2 of the bitmap count; 0: default */
+#define TD_OPEN_BM_CACHE_SHIFT       24
+#define TD_OPEN_BM_CACHE_MASK        (0x1fU << TD_OPEN_BM_CACHE_SHIFT)
 
 #define TD_CREATE_SPARSE             0x00001
 #define TD_CREATE_MULTITYPE          0x00002
@@ -116,9 +139,16 @@ struct td_disk_id {
 	int                          flags;
 };
 
+/*
+ * size and request sectors are 512-byte units whatever the device.
+ * sector_size is the logical block requests must be aligned to,
+ * physical_sector_size the unit the device writes without a
+ * read-modify-write (0 if no larger than sector_size).
+ */
 struct td_disk_info {
 	td_sector_t                  size;
         long                         sector_size;
+	long                         physical_sector_size;
 	uint32_t                     info;
 };
 
@@ -143,8 +173,11 @@ struct td_vbd_request {
 	int                         submitting;
 	int                         secs_pending;
 	int                         num_retries;
+	int                         backoff;    /* error retries so far */
+	unsigned int                flush_gen;  /* sync a flush waits for */
 	struct timeval		    ts;
 	struct timeval              last_try;
+	struct timeval              next_try;
 
 	td_vbd_t                   *vbd;
 	struct list_head            next;
@@ -181,8 +214,20 @@ struct tap_disk {
 	int (*td_validate_parent)    (td_driver_t *, td_driver_t *, td_flag_t);
 	void (*td_queue_read)        (td_driver_t *, td_request_t);
 	void (*td_queue_write)       (td_driver_t *, td_request_t);
+	void (*td_queue_discard)     (td_driver_t *, td_request_t);
+	int (*td_sync)               (td_driver_t *);
 	void (*td_debug)             (td_driver_t *);
 	void (*td_stats)             (td_driver_t *, td_stats_t *);
+	/* 1 if any of the sectors may hold data, 0 if none do, or -errno */
+	int (*td_allocated)          (td_driver_t *, td_sector_t, int);
+	/* 16 bytes naming contents which never change, when read-only */
+	int (*td_get_uuid)           (td_driver_t *, uint8_t *);
+	/* 0 once no writes of its own are left, else -EAGAIN */
+	int (*td_drain)              (td_driver_t *);
+	/* bytes left to grow into, and grown by since open, if it grows */
+	int (*td_headroom)           (td_driver_t *, int64_t *, uint64_t *);
+	/* bytes held for requests, after giving back idle ones if 'trim' */
+	int (*td_footprint)          (td_driver_t *, int, uint64_t *);
 };
 
 struct td_sector_count {
@@ -29,6 +29,7 @@
 #include "tapdisk-utils.h"
 #include "tapdisk-server.h"
 #include "tapdisk-control.h"
+#include "tapdisk-filter.h"
 
 void tdnbd_fdreceiver_start();
 void tdnbd_fdreceiver_stop();
@@ -36,7 +37,18 @@ void tdnbd_fdreceiver_stop();
 static void
 usage(const char *app, int err)
 {
-	fprintf(stderr, "usage: %s <-u uuid> <-c control socket>\n", app);
+	fprintf(stderr, "usage: %s <-u uuid> <-c control socket> "
+		"[-i lio|rwio|uring|uring-sqpoll] [-t workers] "
+		"[-n numa node] [-c cpus] [-T cpus] [-H hold us] [-C]\n"
+		"  -c  pin the event loops to these cpus, e.g. 0-3,8\n"
+		"  -T  pin helper threads to these cpus; ring consumers "
+		"prefer a\n"
+		"      hyperthread sibling of their loop's cpu\n"
+		"  -H  hold shallow submissions up to this long to batch "
+		"them across VBDs,\n"
+		"      0 to submit each iteration (default 50)\n"
+		"  -C  check the data read against CRC32Cs of the last "
+		"written\n", app);
 	exit(err);
 }
 
@@ -68,18 +80,54 @@ fail:
 int
 main(int argc, char *argv[])
 {
-	char *control;
-	int c, err, nodaemon;
+	char *control, *loop_cpus, *helper_cpus;
+	int c, err, nodaemon, tio, workers, node, filter, hold;
 	FILE *out;
 
-	control  = NULL;
+	control     = NULL;
+	loop_cpus   = NULL;
+	helper_cpus = NULL;
 	nodaemon = 0;
+	tio      = 0;
+	workers  = 0;
+	node     = -1;
+	filter   = 0;
+	hold     = -1;
 
-	while ((c = getopt(argc, argv, "Dh")) != -1) {
+	while ((c = getopt(argc, argv, "Dhi:t:n:c:T:H:C")) != -1) {
 		switch (c) {
 		case 'D':
 			nodaemon = 1;
 			break;
+		case 'i':
+			tio = tapdisk_queue_tio_drv(optarg);
+			if (tio < 0)
+				usage(argv[0], EINVAL);
+			break;
+		case 't':
+			workers = atoi(optarg);
+			if (workers < 0)
+				usage(argv[0], EINVAL);
+			break;
+		case 'n':
+			node = atoi(optarg);
+			if (node < 0)
+				usage(argv[0], EINVAL);
+			break;
+		case 'c':
+			loop_cpus = optarg;
+			break;
+		case 'T':
+			helper_cpus = optarg;
+			break;
+		case 'H':
+			hold = atoi(optarg);
+			if (hold < 0)
+				usage(argv[0], EINVAL);
+			break;
+		case 'C':
+			filter |= TD_CHECK_CRC;
+			break;
 		case 'h':
 			usage(argv[0], 0);
 			break;
@@ -97,6 +145,33 @@ main(int argc, char *argv[])
 		goto out;
 	}
 
+	if (node >= 0) {
+		err = tapdisk_server_set_numa_node(node);
+		if (err) {
+			DPRINTF("failed to bind to numa node %d: %d\n",
+				node, err);
+			goto out;
+		}
+	}
+
+	if (loop_cpus || helper_cpus) {
+		err = tapdisk_server_set_cpus(loop_cpus, helper_cpus);
+		if (err) {
+			DPRINTF("failed to place on cpus %s/%s: %d\n",
+				loop_cpus ? : "-", helper_cpus ? : "-", err);
+			goto out;
+		}
+	}
+
+	if (tio)
+		tapdisk_server_set_tio(tio);
+	if (workers)
+		tapdisk_server_set_workers(workers);
+	if (filter)
+		tapdisk_server_set_filter(filter);
+	if (hold >= 0)
+		tapdisk_server_set_hold(hold);
+
 	out = fdup(stdout, "w");
 	if (!out) {
 		err = -errno;
@@ -0,0 +1,1297 @@
+/*
+ * Copyright (C) Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2.1 only
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * I/O benchmark for the driver stack.
+ *
+ * Opens one VBD on any VDI name tapdisk takes (aio:, vhd:, the DR
+ * drivers, nbd:, ...) in a server of its own, without blktap, and runs
+ * each job given with -j on it in turn, as vbd requests. A job is a
+ * list of fio-like key=value pairs:
+ *
+ *   name       label in the report
+ *   rw         read, write, rw, randread, randwrite or randrw
+ *   bs         bytes per request, a multiple of 512
+ *   iodepth    requests in flight
+ *   rwmixread  percent of reads, for rw and randrw
+ *   runtime    seconds to run for
+ *   number_ios requests to complete, instead or first
+ *   offset     start of the range covered, in bytes
+ *   size       bytes of the range, to the end of the disk by default
+ *   verify     1 to check what reads return against what was written
+ *   snapshot   seconds between snapshots of a vhd: leaf under load
+ *
+ * Sequential jobs go round their range. Writes overwrite the image. The
+ * report is JSON on stdout, per job and direction: requests, errors,
+ * IOPS, bandwidth and latency percentiles in ns, queued to completed,
+ * and the CPU time the process spent per request.
+ *
+ * With verify=1, every sector written carries its sector number and a
+ * generation, remembered for the rest of the run; no two requests of
+ * the job overlap. Reads check sectors written before, by any verify
+ * job, and the job ends with a sweep reading back all it wrote. Any
+ * mismatch fails the run. With snapshot, the VBD is paused as tap-ctl
+ * would, a vhd snapshot of the leaf taken next to it, as <leaf path>.N,
+ * and the VBD resumed on it, while requests keep being queued; the
+ * pauses are reported. Verified sectors are checked across snapshots,
+ * through the chain they grow.
+ *
+ * As a regression suite for block-vhd, on a fresh sparse vhd:
+ *
+ *   td-bench -j name=alloc,rw=randwrite,iodepth=64,verify=1 \
+ *            -j name=snap,rw=randrw,verify=1,snapshot=1,runtime=20 \
+ *            -j name=chain,rw=randread,verify=1 vhd:/scratch/test.vhd
+ *
+ * The first job writes unallocated blocks concurrently, the second
+ * grows a chain of about 20 images under load, the third reads
+ * through it; the JSON is the baseline to compare runs against.
+ *
+ * With -r, it replays a trace 'tap-ctl record' took instead, in order
+ * of arrival: at the recorded times, up to -q requests in flight, or
+ * with -a as fast as -q in flight allow. Late requests count in
+ * issue_lag_ns. The recorded figures are reported along.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/timerfd.h>
+
+#include "libvhd.h"
+#include "tapdisk.h"
+#include "tapdisk-server.h"
+#include "tapdisk-vbd.h"
+#include "tapdisk-queue.h"
+#include "tapdisk-iotrace.h"
+
+#define BENCH_MAX_JOBS       32
+#define BENCH_MAX_DEPTH      TAPDISK_DATA_REQUESTS
+#define BENCH_MAX_BYTES      (1 << 20)
+#define BENCH_REPLAY_DEPTH   128
+
+#define BENCH_READ           0
+#define BENCH_WRITE          1
+
+struct bench_job {
+	char                 name[64];
+	const char          *rw;
+	int                  mix;       /* percent of reads */
+	int                  random;
+	size_t               bsize;
+	int                  depth;
+	uint64_t             runtime_ns;
+	uint64_t             ios;
+	uint64_t             offset;    /* bytes */
+	uint64_t             size;
+	int                  verify;
+	uint64_t             snapshot_ns;
+};
+
+struct bench_stat {
+	uint64_t             ios;
+	uint64_t             errors;
+	uint64_t             bytes;
+	uint64_t             sum_ns;
+	uint32_t            *lat;
+	size_t               n_lat;
+	size_t               max_lat;
+};
+
+struct bench_req {
+	td_vbd_request_t     vreq;
+	struct td_iovec      iov;
+	void                *buf;
+	uint64_t             ts;
+	int                  dir;
+	uint64_t             blk;
+	uint32_t             gen;
+};
+
+/* leads every sector written with verify=1 */
+struct bench_stamp {
+	uint64_t             sector;
+	uint64_t             gen;
+};
+
+struct bench_replay {
+	const char          *path;
+	struct td_iotrace_rec *recs;
+	uint64_t             n;
+	uint64_t             next;
+	uint64_t             skipped;
+	uint64_t             span_us;
+	size_t               max_bytes;
+	int                  writes;
+
+	int                  afap;
+	int                  depth;
+	uint64_t             ts0_us;    /* first arrival, in the trace */
+	uint64_t             t0_ns;     /* and in the replay */
+	int                  tfd;
+	event_id_t           event;
+	uint64_t             armed_ns;
+
+	struct bench_stat    lag;
+	struct bench_stat    recorded[2];
+};
+
+struct bench {
+	td_vbd_t            *vbd;
+	td_sector_t          secs;
+	struct bench_replay *replay;
+
+	const struct bench_job *job;
+	uint64_t             first;     /* blocks of bsize */
+	uint64_t             blocks;
+	uint64_t             cursor;
+	uint64_t             seed;
+
+	struct bench_req    *reqs;
+	struct bench_req   **free;
+	int                  n_free;
+	uint64_t             queued;
+	uint64_t             done;
+	uint64_t             start_ns;
+	uint64_t             end_ns;
+	int                  stop;
+
+	struct bench_stat    stat[2];
+
+	/*
+	 * verify: the generation last written to each sector, 0 if not
+	 * known, and the job's blocks in flight
+	 */
+	uint32_t            *gens;
+	uint32_t             gen;
+	uint8_t             *busy;
+	int                  sweep;
+	uint64_t             checked;
+	uint64_t             mismatches;
+
+	/* snapshots: the current leaf, how many taken, when the next */
+	char                 leaf[256];
+	int                  snapshots;
+	uint64_t             snap_due_ns;
+	struct bench_stat    snap;
+};
+
+static uint64_t
+bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* xorshift64*, so jobs are repeatable and cheap to drive */
+static uint64_t
+bench_rand(struct bench *b)
+{
+	b->seed ^= b->seed >> 12;
+	b->seed ^= b->seed << 25;
+	b->seed ^= b->seed >> 27;
+	return b->seed * 0x2545f4914f6cdd1dULL;
+}
+
+static void
+bench_record(struct bench_stat *s, uint64_t ns, uint64_t bytes, int error)
+{
+	uint32_t *lat;
+
+	s->ios++;
+	s->bytes  += bytes;
+	s->sum_ns += ns;
+	if (error)
+		s->errors++;
+
+	if (s->n_lat == s->max_lat) {
+		lat = realloc(s->lat, (s->max_lat ? : 4096) * 2 * sizeof(*lat));
+		if (!lat)
+			return;
+		s->lat     = lat;
+		s->max_lat = (s->max_lat ? : 4096) * 2;
+	}
+
+	s->lat[s->n_lat++] = ns > UINT32_MAX ? UINT32_MAX : ns;
+}
+
+static void bench_queue(struct bench *b);
+static void bench_replay_kick(struct bench *b);
+
+static td_sector_t
+bench_sector(const struct bench *b, uint64_t blk)
+{
+	return (b->first + blk) * (b->job->bsize >> SECTOR_SHIFT);
+}
+
+/* Stamp a write with its sectors and a new generation. */
+static void
+bench_verify_stamp(struct bench *b, struct bench_req *req)
+{
+	struct bench_stamp stamp;
+	td_sector_t sec = bench_sector(b, req->blk);
+	int i;
+
+	if (!++b->gen)
+		++b->gen;
+	req->gen = b->gen;
+
+	for (i = 0; i < req->iov.secs; i++) {
+		stamp.sector = sec + i;
+		stamp.gen    = req->gen;
+		memcpy((char *)req->buf + ((size_t)i << SECTOR_SHIFT),
+		       &stamp, sizeof(stamp));
+	}
+}
+
+static void
+bench_verify_done(struct bench *b, struct bench_req *req, int error)
+{
+	struct bench_stamp stamp;
+	td_sector_t sec = bench_sector(b, req->blk);
+	int i;
+
+	b->busy[req->blk] = 0;
+
+	for (i = 0; i < req->iov.secs; i++, sec++) {
+		if (req->dir == BENCH_WRITE) {
+			/* a failed write may have landed, or not */
+			b->gens[sec] = error ? 0 : req->gen;
+			continue;
+		}
+
+		if (error || !b->gens[sec])
+			continue;
+
+		memcpy(&stamp, (char *)req->buf + ((size_t)i << SECTOR_SHIFT),
+		       sizeof(stamp));
+		b->checked++;
+		if (stamp.sector == sec && stamp.gen == b->gens[sec])
+			continue;
+
+		if (!b->mismatches++)
+			fprintf(stderr, "%s: sector %llu holds sector %llu, "
+				"generation %llu, not generation %u\n",
+				b->job->name, (unsigned long long)sec,
+				(unsigned long long)stamp.sector,
+				(unsigned long long)stamp.gen, b->gens[sec]);
+	}
+}
+
+/* Next block the sweep reads back; b->blocks once through. */
+static uint64_t
+bench_sweep_next(struct bench *b)
+{
+	td_sector_t sec;
+	int i, secs = b->job->bsize >> SECTOR_SHIFT;
+
+	for (; b->cursor < b->blocks; b->cursor++) {
+		sec = bench_sector(b, b->cursor);
+		for (i = 0; i < secs; i++)
+			if (b->gens[sec + i])
+				return b->cursor++;
+	}
+
+	return b->blocks;
+}
+
+static void
+bench_request_cb(td_vbd_request_t *vreq, int error, void *token, int final)
+{
+	struct bench *b = token;
+	struct bench_req *req = containerof(vreq, struct bench_req, vreq);
+	uint64_t now = bench_now();
+
+	if (b->busy)
+		bench_verify_done(b, req, error);
+	if (!b->sweep)
+		bench_record(&b->stat[req->dir], now - req->ts,
+			     (uint64_t)req->iov.secs << SECTOR_SHIFT, error);
+	b->free[b->n_free++] = req;
+	b->done++;
+
+	if (!final)
+		return;
+
+	if (b->replay) {
+		bench_replay_kick(b);
+		if (b->stop && b->done == b->queued)
+			b->end_ns = now;
+		return;
+	}
+
+	if (!b->sweep && b->job->runtime_ns &&
+	    now - b->start_ns >= b->job->runtime_ns)
+		b->stop = 1;
+
+	if (!b->stop)
+		bench_queue(b);
+
+	if (b->done == b->queued) {
+		b->end_ns = now;
+		b->stop   = 1;
+	}
+}
+
+/* A few tries at a block no request of a verify job holds. */
+#define BENCH_PICK_TRIES     8
+
+/*
+ * Issue a request, unless there is nothing to issue until one
+ * completes, or at all: -EBUSY. With nothing in flight, no block is
+ * held, so the job never stalls.
+ */
+static int
+bench_queue_request(struct bench *b, struct bench_req *req)
+{
+	const struct bench_job *job = b->job;
+	td_vbd_request_t *vreq = &req->vreq;
+	uint64_t blk;
+	int tries = 0;
+
+	if (b->sweep) {
+		blk = bench_sweep_next(b);
+		if (blk == b->blocks) {
+			b->stop = 1;
+			return -EBUSY;
+		}
+		req->dir = BENCH_READ;
+		goto queue;
+	}
+
+	do {
+		if (job->random)
+			blk = bench_rand(b) % b->blocks;
+		else {
+			blk = b->cursor;
+			b->cursor = (b->cursor + 1) % b->blocks;
+		}
+	} while (b->busy && b->busy[blk] && ++tries < BENCH_PICK_TRIES);
+
+	if (b->busy && b->busy[blk])
+		return -EBUSY;
+
+	req->dir = (bench_rand(b) % 100) < job->mix ? BENCH_READ : BENCH_WRITE;
+
+queue:
+	req->blk      = blk;
+	req->iov.base = req->buf;
+	req->iov.secs = job->bsize >> SECTOR_SHIFT;
+
+	if (b->busy) {
+		b->busy[blk] = 1;
+		if (req->dir == BENCH_WRITE)
+			bench_verify_stamp(b, req);
+	}
+
+	memset(vreq, 0, sizeof(*vreq));
+	vreq->op     = req->dir == BENCH_READ ? TD_OP_READ : TD_OP_WRITE;
+	vreq->sec    = (b->first + blk) * req->iov.secs;
+	vreq->iov    = &req->iov;
+	vreq->iovcnt = 1;
+	vreq->token  = b;
+	vreq->cb     = bench_request_cb;
+
+	b->queued++;
+	req->ts = bench_now();
+	tapdisk_vbd_queue_request(b->vbd, vreq);
+	return 0;
+}
+
+static void
+bench_queue(struct bench *b)
+{
+	while (b->n_free) {
+		if (!b->sweep && b->job->ios && b->queued >= b->job->ios) {
+			b->stop = 1;
+			break;
+		}
+		if (bench_queue_request(b, b->free[b->n_free - 1]))
+			break;
+		b->n_free--;
+	}
+}
+
+/*
+ * Snapshot the leaf as tap-ctl pause, vhd-util snapshot and tap-ctl
+ * unpause would: requests queued meanwhile wait for the resume.
+ */
+static int
+bench_snapshot(struct bench *b)
+{
+	char path[sizeof(b->leaf)], name[sizeof(b->leaf) + 4];
+	uint64_t t0 = bench_now();
+	int n, err, _err;
+
+	tapdisk_vbd_pause(b->vbd);
+	while (!td_flag_test(b->vbd->state, TD_VBD_PAUSED))
+		tapdisk_server_iterate();
+
+	n = snprintf(path, sizeof(path), "%s.%d", b->leaf, b->snapshots + 1);
+	err = n >= sizeof(path) ? -ENAMETOOLONG :
+		vhd_snapshot(path, 0, b->leaf, 0, 0);
+	if (err)
+		fprintf(stderr, "failed to snapshot %s: %d\n", b->leaf, err);
+	else {
+		snprintf(name, sizeof(name), "vhd:%s", path);
+		snprintf(b->leaf, sizeof(b->leaf), "%s", path);
+		b->snapshots++;
+	}
+
+	_err = tapdisk_vbd_resume(b->vbd, err ? NULL : name);
+	if (_err) {
+		fprintf(stderr, "failed to resume on %s: %d\n",
+			err ? "the old leaf" : name, _err);
+		return _err;
+	}
+
+	bench_record(&b->snap, bench_now() - t0, 0, !!err);
+	return err;
+}
+
+/* Read back everything the job wrote, at depth, checking it. */
+static void
+bench_sweep(struct bench *b)
+{
+	uint64_t end_ns = b->end_ns;
+
+	b->sweep  = 1;
+	b->stop   = 0;
+	b->cursor = 0;
+
+	bench_queue(b);
+	while (!b->stop || b->done != b->queued)
+		tapdisk_server_iterate();
+
+	b->sweep  = 0;
+	b->end_ns = end_ns;
+}
+
+static int
+bench_cmp(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static uint64_t
+bench_pct(const struct bench_stat *s, int per_mille)
+{
+	size_t i = s->n_lat * per_mille / 1000;
+
+	return s->n_lat ? s->lat[i < s->n_lat ? i : s->n_lat - 1] : 0;
+}
+
+/* JSON, at indent 'ind' */
+static void
+bench_print_lat(const char *ind, const char *name,
+		struct bench_stat *s, int last)
+{
+	qsort(s->lat, s->n_lat, sizeof(*s->lat), bench_cmp);
+
+	printf("%s\"%s\": {\n", ind, name);
+	printf("%s  \"min\": %llu,\n", ind,
+	       (unsigned long long)(s->n_lat ? s->lat[0] : 0));
+	printf("%s  \"mean\": %llu,\n", ind,
+	       (unsigned long long)(s->ios ? s->sum_ns / s->ios : 0));
+	printf("%s  \"p50\": %llu,\n", ind, (unsigned long long)bench_pct(s, 500));
+	printf("%s  \"p90\": %llu,\n", ind, (unsigned long long)bench_pct(s, 900));
+	printf("%s  \"p99\": %llu,\n", ind, (unsigned long long)bench_pct(s, 990));
+	printf("%s  \"p999\": %llu,\n", ind, (unsigned long long)bench_pct(s, 999));
+	printf("%s  \"max\": %llu\n", ind,
+	       (unsigned long long)(s->n_lat ? s->lat[s->n_lat - 1] : 0));
+	printf("%s}%s\n", ind, last ? "" : ",");
+}
+
+static void
+bench_print_stat(const char *ind, const char *dir, struct bench_stat *s,
+		 uint64_t elapsed_ns, int last)
+{
+	double secs = elapsed_ns / 1e9;
+	char sub[32];
+
+	printf("%s\"%s\": {\n", ind, dir);
+	printf("%s  \"ios\": %llu,\n", ind, (unsigned long long)s->ios);
+	printf("%s  \"errors\": %llu,\n", ind,
+	       (unsigned long long)s->errors);
+	printf("%s  \"iops\": %.1f,\n", ind, secs ? s->ios / secs : 0.0);
+	printf("%s  \"bw_bytes\": %.0f,\n", ind,
+	       secs ? s->bytes / secs : 0.0);
+
+	snprintf(sub, sizeof(sub), "%s  ", ind);
+	bench_print_lat(sub, "lat_ns", s, 1);
+
+	printf("%s}%s\n", ind, last ? "" : ",");
+}
+
+static uint64_t
+bench_cpu_ns(void)
+{
+	struct rusage ru;
+
+	if (getrusage(RUSAGE_SELF, &ru))
+		return 0;
+
+	return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000ULL +
+		(ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000ULL;
+}
+
+static uint64_t
+bench_range(const struct bench *b, const struct bench_job *job)
+{
+	uint64_t bytes = b->secs << SECTOR_SHIFT;
+
+	if (job->offset >= bytes || job->offset % job->bsize)
+		return 0;
+
+	if (!job->size)
+		return (bytes - job->offset) / job->bsize;
+
+	return job->size <= bytes - job->offset ? job->size / job->bsize : 0;
+}
+
+static int
+bench_run(struct bench *b, const struct bench_job *job, int n, int last)
+{
+	uint64_t cpu_ns;
+	int i, err;
+
+	memset(&b->stat, 0, sizeof(b->stat));
+	memset(&b->snap, 0, sizeof(b->snap));
+	b->job    = job;
+	b->seed   = 0x9e3779b97f4a7c15ULL * (n + 1);
+	b->queued = 0;
+	b->done   = 0;
+	b->stop   = 0;
+	b->n_free = 0;
+	b->first  = job->offset / job->bsize;
+	b->blocks = bench_range(b, job);
+	b->cursor = 0;
+
+	err = -ENOMEM;
+	b->reqs = calloc(job->depth, sizeof(*b->reqs));
+	b->free = calloc(job->depth, sizeof(*b->free));
+	if (!b->reqs || !b->free)
+		goto out;
+
+	b->checked    = 0;
+	b->mismatches = 0;
+	b->snapshots  = 0;
+	if (job->verify) {
+		if (!b->gens)
+			b->gens = calloc(b->secs, sizeof(*b->gens));
+		b->busy = calloc(b->blocks, sizeof(*b->busy));
+		if (!b->gens || !b->busy)
+			goto out;
+	} else if (b->gens && job->mix < 100)
+		/* writes not stamped: forget what was */
+		memset(b->gens, 0, b->secs * sizeof(*b->gens));
+
+	/* random data, as dedup or compression would have it */
+	for (i = 0; i < job->depth; i++) {
+		size_t j;
+
+		if (posix_memalign(&b->reqs[i].buf, 4096, job->bsize))
+			goto out;
+		for (j = 0; j < job->bsize / sizeof(uint64_t); j++)
+			((uint64_t *)b->reqs[i].buf)[j] = bench_rand(b);
+
+		b->free[b->n_free++] = &b->reqs[i];
+	}
+
+	cpu_ns         = bench_cpu_ns();
+	b->start_ns    = bench_now();
+	b->snap_due_ns = b->start_ns + job->snapshot_ns;
+	bench_queue(b);
+
+	while (!b->stop || b->done != b->queued) {
+		tapdisk_server_iterate();
+
+		if (job->snapshot_ns && !b->stop &&
+		    bench_now() >= b->snap_due_ns) {
+			if (bench_snapshot(b))
+				b->stop = 1;
+			b->snap_due_ns = bench_now() + job->snapshot_ns;
+		}
+	}
+
+	cpu_ns = bench_cpu_ns() - cpu_ns;
+
+	if (job->verify)
+		bench_sweep(b);
+
+	printf("    {\n");
+	printf("      \"name\": \"%s\",\n", job->name);
+	printf("      \"rw\": \"%s\",\n", job->rw);
+	printf("      \"bs\": %zu,\n", job->bsize);
+	printf("      \"iodepth\": %d,\n", job->depth);
+	printf("      \"rwmixread\": %d,\n", job->mix);
+	printf("      \"elapsed_ns\": %llu,\n",
+	       (unsigned long long)(b->end_ns - b->start_ns));
+	printf("      \"cpu_ns\": %llu,\n", (unsigned long long)cpu_ns);
+	printf("      \"cpu_ns_per_io\": %llu,\n",
+	       (unsigned long long)(b->done ? cpu_ns / b->done : 0));
+	if (job->verify) {
+		printf("      \"verify\": {\n");
+		printf("        \"sectors_checked\": %llu,\n",
+		       (unsigned long long)b->checked);
+		printf("        \"mismatches\": %llu\n",
+		       (unsigned long long)b->mismatches);
+		printf("      },\n");
+	}
+	if (job->snapshot_ns) {
+		printf("      \"snapshots\": %d,\n", b->snapshots);
+		printf("      \"leaf\": \"%s\",\n", b->leaf);
+		bench_print_lat("      ", "pause_ns", &b->snap, 0);
+	}
+	bench_print_stat("      ", "read", &b->stat[BENCH_READ],
+			 b->end_ns - b->start_ns, 0);
+	bench_print_stat("      ", "write", &b->stat[BENCH_WRITE],
+			 b->end_ns - b->start_ns, 1);
+	printf("    }%s\n", last ? "" : ",");
+	fflush(stdout);
+
+	err = 0;
+	if (b->stat[BENCH_READ].errors || b->stat[BENCH_WRITE].errors ||
+	    b->snap.errors)
+		err = -EIO;
+	if (b->mismatches)
+		err = -EILSEQ;
+
+out:
+	if (b->reqs)
+		for (i = 0; i < job->depth; i++)
+			free(b->reqs[i].buf);
+	free(b->reqs);
+	free(b->free);
+	free(b->stat[BENCH_READ].lat);
+	free(b->stat[BENCH_WRITE].lat);
+	free(b->snap.lat);
+	free(b->busy);
+	b->reqs = NULL;
+	b->free = NULL;
+	b->busy = NULL;
+	return err;
+}
+
+static int
+bench_replay_cmp(const void *_a, const void *_b)
+{
+	const struct td_iotrace_rec *a = _a, *b = _b;
+
+	return a->ts_us < b->ts_us ? -1 : a->ts_us > b->ts_us;
+}
+
+/* the ring, oldest first, in order of arrival */
+static int
+bench_replay_load(struct bench_replay *r, const char *path)
+{
+	struct td_iotrace_header hdr;
+	struct td_iotrace_rec *rec;
+	uint64_t i, n, first, end;
+	int fd, err;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+
+	err = -EINVAL;
+	if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+	    hdr.magic != TD_IOTRACE_MAGIC ||
+	    hdr.version != TD_IOTRACE_VERSION ||
+	    hdr.rec_size != sizeof(*rec) || !hdr.capacity)
+		goto out;
+
+	n     = hdr.head < hdr.capacity ? hdr.head : hdr.capacity;
+	first = hdr.head < hdr.capacity ? 0 : hdr.head % hdr.capacity;
+
+	err = -ENOMEM;
+	r->recs = calloc(n ? : 1, sizeof(*rec));
+	if (!r->recs)
+		goto out;
+
+	/* the tail of the file first, then from the start */
+	err = -EIO;
+	for (i = 0; i < n; ) {
+		uint64_t slot = (first + i) % hdr.capacity;
+		uint64_t cnt  = n - i < hdr.capacity - slot ?
+				 n - i : hdr.capacity - slot;
+		size_t len = cnt * sizeof(*rec);
+
+		if (pread(fd, r->recs + i, len, TD_IOTRACE_HDR_SIZE +
+			  slot * sizeof(*rec)) != len)
+			goto out;
+		i += cnt;
+	}
+
+	qsort(r->recs, n, sizeof(*rec), bench_replay_cmp);
+
+	r->path = path;
+	r->n    = n;
+	err     = 0;
+
+	for (i = 0, end = 0; i < n; i++) {
+		rec = &r->recs[i];
+		if (end < rec->ts_us + rec->lat_us)
+			end = rec->ts_us + rec->lat_us;
+		if (r->max_bytes < (size_t)rec->secs << SECTOR_SHIFT &&
+		    (size_t)rec->secs << SECTOR_SHIFT <= BENCH_MAX_BYTES)
+			r->max_bytes = (size_t)rec->secs << SECTOR_SHIFT;
+		r->writes |= rec->op == TD_OP_WRITE;
+	}
+	r->ts0_us  = n ? r->recs[0].ts_us : 0;
+	r->span_us = end - r->ts0_us;
+
+out:
+	close(fd);
+	return err;
+}
+
+/* drops what the disk cannot take, counts what was recorded */
+static void
+bench_replay_filter(struct bench_replay *r, td_sector_t secs)
+{
+	struct td_iotrace_rec *rec;
+	uint64_t i, n;
+	int dir;
+
+	for (i = 0, n = 0; i < r->n; i++) {
+		rec = &r->recs[i];
+
+		if ((rec->op != TD_OP_READ && rec->op != TD_OP_WRITE) ||
+		    !rec->secs ||
+		    ((size_t)rec->secs << SECTOR_SHIFT) > r->max_bytes ||
+		    rec->sec + rec->secs > secs) {
+			r->skipped++;
+			continue;
+		}
+
+		dir = rec->op == TD_OP_READ ? BENCH_READ : BENCH_WRITE;
+		bench_record(&r->recorded[dir], rec->lat_us * 1000ULL,
+			     (uint64_t)rec->secs << SECTOR_SHIFT, rec->err);
+
+		r->recs[n++] = *rec;
+	}
+
+	r->n = n;
+}
+
+static void
+bench_replay_issue(struct bench *b, struct bench_req *req,
+		   const struct td_iotrace_rec *rec)
+{
+	td_vbd_request_t *vreq = &req->vreq;
+
+	req->dir      = rec->op == TD_OP_READ ? BENCH_READ : BENCH_WRITE;
+	req->iov.base = req->buf;
+	req->iov.secs = rec->secs;
+
+	memset(vreq, 0, sizeof(*vreq));
+	vreq->op     = rec->op;
+	vreq->sec    = rec->sec;
+	vreq->iov    = &req->iov;
+	vreq->iovcnt = 1;
+	vreq->token  = b;
+	vreq->cb     = bench_request_cb;
+
+	b->queued++;
+	req->ts = bench_now();
+	tapdisk_vbd_queue_request(b->vbd, vreq);
+}
+
+static void
+bench_replay_arm(struct bench_replay *r, uint64_t due_ns)
+{
+	struct itimerspec its;
+
+	if (r->armed_ns == due_ns)
+		return;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec  = due_ns / 1000000000ULL;
+	its.it_value.tv_nsec = due_ns % 1000000000ULL;
+
+	if (!timerfd_settime(r->tfd, TFD_TIMER_ABSTIME, &its, NULL))
+		r->armed_ns = due_ns;
+}
+
+/* issues what is due, then sleeps till the next is */
+static void
+bench_replay_kick(struct bench *b)
+{
+	struct bench_replay *r = b->replay;
+	const struct td_iotrace_rec *rec;
+	uint64_t now, due;
+
+	now = bench_now();
+
+	while (b->n_free && r->next < r->n) {
+		rec = &r->recs[r->next];
+
+		if (!r->afap) {
+			due = r->t0_ns + (rec->ts_us - r->ts0_us) * 1000;
+			if (due > now) {
+				bench_replay_arm(r, due);
+				break;
+			}
+			bench_record(&r->lag, now - due, 0, 0);
+		}
+
+		r->next++;
+		bench_replay_issue(b, b->free[--b->n_free], rec);
+	}
+
+	if (r->next == r->n)
+		b->stop = 1;
+}
+
+static void
+bench_replay_timer(event_id_t id, char mode, void *private)
+{
+	struct bench *b = private;
+	uint64_t ticks;
+
+	if (read(b->replay->tfd, &ticks, sizeof(ticks)) < 0 &&
+	    errno != EAGAIN)
+		return;
+
+	b->replay->armed_ns = 0;
+	bench_replay_kick(b);
+}
+
+static void
+bench_replay_print(struct bench *b, uint64_t cpu_ns)
+{
+	struct bench_replay *r = b->replay;
+
+	printf("  \"replay\": {\n");
+	printf("    \"trace\": \"%s\",\n", r->path);
+	printf("    \"mode\": \"%s\",\n", r->afap ? "afap" : "timed");
+	printf("    \"iodepth\": %d,\n", r->depth);
+	printf("    \"requests\": %llu,\n", (unsigned long long)r->n);
+	printf("    \"skipped\": %llu,\n", (unsigned long long)r->skipped);
+	printf("    \"elapsed_ns\": %llu,\n",
+	       (unsigned long long)(b->end_ns - b->start_ns));
+	printf("    \"cpu_ns\": %llu,\n", (unsigned long long)cpu_ns);
+	printf("    \"cpu_ns_per_io\": %llu,\n",
+	       (unsigned long long)(b->done ? cpu_ns / b->done : 0));
+	if (!r->afap)
+		bench_print_lat("    ", "issue_lag_ns", &r->lag, 0);
+	bench_print_stat("    ", "read", &b->stat[BENCH_READ],
+			 b->end_ns - b->start_ns, 0);
+	bench_print_stat("    ", "write", &b->stat[BENCH_WRITE],
+			 b->end_ns - b->start_ns, 0);
+	printf("    \"recorded\": {\n");
+	printf("      \"elapsed_ns\": %llu,\n",
+	       (unsigned long long)r->span_us * 1000);
+	bench_print_stat("      ", "read", &r->recorded[BENCH_READ],
+			 r->span_us * 1000, 0);
+	bench_print_stat("      ", "write", &r->recorded[BENCH_WRITE],
+			 r->span_us * 1000, 1);
+	printf("    }\n");
+	printf("  }\n");
+}
+
+static int
+bench_replay_run(struct bench *b)
+{
+	struct bench_replay *r = b->replay;
+	uint64_t cpu_ns;
+	int i, err;
+
+	bench_replay_filter(r, b->secs);
+
+	b->seed  = 0x9e3779b97f4a7c15ULL;
+	r->tfd   = -1;
+	r->event = -1;
+
+	err = -ENOMEM;
+	b->reqs = calloc(r->depth, sizeof(*b->reqs));
+	b->free = calloc(r->depth, sizeof(*b->free));
+	if (!b->reqs || !b->free)
+		goto out;
+
+	for (i = 0; i < r->depth; i++) {
+		size_t j;
+
+		if (posix_memalign(&b->reqs[i].buf, 4096, r->max_bytes ? : 4096))
+			goto out;
+		for (j = 0; j < r->max_bytes / sizeof(uint64_t); j++)
+			((uint64_t *)b->reqs[i].buf)[j] = bench_rand(b);
+
+		b->free[b->n_free++] = &b->reqs[i];
+	}
+
+	r->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (r->tfd < 0) {
+		err = -errno;
+		goto out;
+	}
+
+	r->event = tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
+						 r->tfd, 0,
+						 bench_replay_timer, b);
+	if (r->event < 0) {
+		err = r->event;
+		goto out;
+	}
+
+	cpu_ns      = bench_cpu_ns();
+	b->start_ns = r->t0_ns = bench_now();
+	b->end_ns   = b->start_ns;
+
+	if (r->n)
+		bench_replay_kick(b);
+	else
+		b->stop = 1;
+
+	while (!b->stop || b->done != b->queued)
+		tapdisk_server_iterate();
+
+	cpu_ns = bench_cpu_ns() - cpu_ns;
+
+	bench_replay_print(b, cpu_ns);
+
+	err = 0;
+	if (b->stat[BENCH_READ].errors || b->stat[BENCH_WRITE].errors)
+		err = -EIO;
+
+out:
+	if (r->event >= 0)
+		tapdisk_server_unregister_event(r->event);
+	if (r->tfd >= 0)
+		close(r->tfd);
+	if (b->reqs)
+		for (i = 0; i < r->depth; i++)
+			free(b->reqs[i].buf);
+	free(b->reqs);
+	free(b->free);
+	free(b->stat[BENCH_READ].lat);
+	free(b->stat[BENCH_WRITE].lat);
+	free(r->lag.lat);
+	free(r->recorded[BENCH_READ].lat);
+	free(r->recorded[BENCH_WRITE].lat);
+	free(r->recs);
+	return err;
+}
+
+static int
+bench_parse_size(const char *val, uint64_t *size)
+{
+	unsigned long long v;
+	char *end;
+
+	v = strtoull(val, &end, 0);
+	if (end == val)
+		return -EINVAL;
+
+	switch (*end) {
+	case 'G': case 'g': v <<= 10;
+	case 'M': case 'm': v <<= 10;
+	case 'K': case 'k': v <<= 10;
+		end++;
+	}
+
+	if (*end)
+		return -EINVAL;
+
+	*size = v;
+	return 0;
+}
+
+static int
+bench_parse_job(char *spec, struct bench_job *job, int n)
+{
+	static const char *rws[] = { "read", "write", "rw",
+				     "randread", "randwrite", "randrw" };
+	char *opt, *val, *save;
+	uint64_t v;
+	int i;
+
+	memset(job, 0, sizeof(*job));
+	snprintf(job->name, sizeof(job->name), "job%d", n);
+	job->rw         = "randread";
+	job->random     = 1;
+	job->mix        = -1;
+	job->bsize      = 4096;
+	job->depth      = 32;
+
+	for (opt = strtok_r(spec, ",", &save); opt;
+	     opt = strtok_r(NULL, ",", &save)) {
+		val = strchr(opt, '=');
+		if (!val)
+			goto fail;
+		*val++ = '\0';
+
+		if (!strcmp(opt, "name"))
+			snprintf(job->name, sizeof(job->name), "%s", val);
+		else if (!strcmp(opt, "rw")) {
+			for (i = 0; i < 6; i++)
+				if (!strcmp(val, rws[i]))
+					break;
+			if (i == 6)
+				goto fail;
+			job->rw     = rws[i];
+			job->random = i >= 3;
+		} else if (!strcmp(opt, "rwmixread")) {
+			job->mix = atoi(val);
+			if (job->mix < 0 || job->mix > 100)
+				goto fail;
+		} else if (!strcmp(opt, "iodepth")) {
+			job->depth = atoi(val);
+		} else if (!strcmp(opt, "runtime")) {
+			job->runtime_ns = strtoull(val, NULL, 10) * 1000000000ULL;
+		} else if (!strcmp(opt, "number_ios")) {
+			job->ios = strtoull(val, NULL, 10);
+		} else if (!strcmp(opt, "verify")) {
+			job->verify = !!atoi(val);
+		} else if (!strcmp(opt, "snapshot")) {
+			job->snapshot_ns = strtoull(val, NULL, 10) * 1000000000ULL;
+			if (!job->snapshot_ns)
+				goto fail;
+		} else {
+			if (bench_parse_size(val, &v))
+				goto fail;
+			if (!strcmp(opt, "bs"))
+				job->bsize = v;
+			else if (!strcmp(opt, "offset"))
+				job->offset = v;
+			else if (!strcmp(opt, "size"))
+				job->size = v;
+			else
+				goto fail;
+		}
+	}
+
+	/* only the mixed modes take a mix */
+	if (strstr(job->rw, "read"))
+		job->mix = 100;
+	else if (strstr(job->rw, "write"))
+		job->mix = 0;
+	else if (job->mix < 0)
+		job->mix = 50;
+
+	if (!job->runtime_ns && !job->ios)
+		job->runtime_ns = 10 * 1000000000ULL;
+
+	if (job->depth <= 0 || job->depth > BENCH_MAX_DEPTH ||
+	    !job->bsize || job->bsize % 512 || job->bsize > BENCH_MAX_BYTES ||
+	    job->size % job->bsize)
+		return -EINVAL;
+
+	return 0;
+
+fail:
+	fprintf(stderr, "bad job option '%s'\n", opt);
+	return -EINVAL;
+}
+
+static void
+usage(const char *prog, int err)
+{
+	fprintf(stderr, "usage: %s [-j <key=value,...>]... [-i <io driver>] "
+		"[-c] [-h] <type:/path>\n"
+		"       %s -r <trace> [-a] [-q <depth>] [-i <io driver>] "
+		"[-c] <type:/path>\n"
+		"  -j  job, as name, rw, bs, iodepth, rwmixread, runtime, "
+		"number_ios,\n"
+		"      offset, size, verify and snapshot (default: rw=randread,"
+		"bs=4k,\n"
+		"      iodepth=32,runtime=10)\n"
+		"  -i  lio, rwio, uring or uring-sqpoll\n"
+		"  -c  put a block cache over the shared parent "
+		"of the chain\n"
+		"  -r  replay a trace of tap-ctl record, as recorded "
+		"or -a as fast as -q allows\n", prog, prog);
+	exit(err);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct bench_job jobs[BENCH_MAX_JOBS];
+	td_disk_info_t info;
+	struct bench_replay replay;
+	struct bench b;
+	td_flag_t flags;
+	const char *name;
+	int c, i, err, tio, n_jobs, rdonly;
+	char def[] = "";
+
+	n_jobs = 0;
+	flags  = 0;
+	tio    = 0;
+
+	memset(&replay, 0, sizeof(replay));
+	replay.depth = BENCH_REPLAY_DEPTH;
+
+	while ((c = getopt(argc, argv, "j:i:cr:aq:h")) != -1) {
+		switch (c) {
+		case 'j':
+			if (n_jobs == BENCH_MAX_JOBS ||
+			    bench_parse_job(optarg, &jobs[n_jobs], n_jobs))
+				usage(argv[0], EINVAL);
+			n_jobs++;
+			break;
+		case 'i':
+			tio = tapdisk_queue_tio_drv(optarg);
+			if (tio < 0)
+				usage(argv[0], EINVAL);
+			break;
+		case 'c':
+			flags |= TD_OPEN_ADD_CACHE;
+			break;
+		case 'r':
+			replay.path = optarg;
+			break;
+		case 'a':
+			replay.afap = 1;
+			break;
+		case 'q':
+			replay.depth = atoi(optarg);
+			if (replay.depth < 1 ||
+			    replay.depth > TAPDISK_DATA_REQUESTS)
+				usage(argv[0], EINVAL);
+			break;
+		default:
+			usage(argv[0], EINVAL);
+		case 'h':
+			usage(argv[0], 0);
+		}
+	}
+
+	if (optind != argc - 1)
+		usage(argv[0], EINVAL);
+	name = argv[optind];
+
+	if (replay.path) {
+		if (n_jobs)
+			usage(argv[0], EINVAL);
+
+		err = bench_replay_load(&replay, replay.path);
+		if (err) {
+			fprintf(stderr, "failed to load %s: %d\n",
+				replay.path, err);
+			return -err;
+		}
+	} else if (!n_jobs && bench_parse_job(def, &jobs[n_jobs++], 0))
+		usage(argv[0], EINVAL);
+
+	rdonly = !replay.writes;
+	for (i = 0; i < n_jobs; i++)
+		rdonly &= jobs[i].mix == 100 && !jobs[i].snapshot_ns;
+	if (rdonly)
+		flags |= TD_OPEN_RDONLY;
+
+	memset(&b, 0, sizeof(b));
+
+	tapdisk_start_logging("td-bench", "daemon");
+
+	err = tapdisk_server_init();
+	if (err)
+		goto out;
+
+	if (tio)
+		tapdisk_server_set_tio(tio);
+
+	err = tapdisk_server_complete();
+	if (err) {
+		fprintf(stderr, "failed to start server: %d\n", err);
+		goto out;
+	}
+
+	err = tapdisk_vbd_initialize(-1, -1, 0);
+	if (err)
+		goto out;
+
+	b.vbd = tapdisk_server_get_vbd(0);
+	if (!b.vbd) {
+		err = -ENODEV;
+		goto out;
+	}
+
+	err = tapdisk_vbd_open_vdi(b.vbd, name, flags, -1);
+	if (err) {
+		fprintf(stderr, "failed to open %s: %d\n", name, err);
+		goto out;
+	}
+
+	err = tapdisk_vbd_get_disk_info(b.vbd, &info);
+	if (err)
+		goto close;
+	b.secs = info.size;
+
+	for (i = 0; i < n_jobs; i++) {
+		if (!bench_range(&b, &jobs[i])) {
+			fprintf(stderr, "%s: range past the disk, "
+				"of %llu bytes\n", jobs[i].name,
+				(unsigned long long)b.secs << SECTOR_SHIFT);
+			err = -EINVAL;
+			goto close;
+		}
+		if (!jobs[i].snapshot_ns)
+			continue;
+		if (strncmp(name, "vhd:", 4)) {
+			fprintf(stderr, "%s: snapshots need a vhd: leaf\n",
+				jobs[i].name);
+			err = -EINVAL;
+			goto close;
+		}
+		snprintf(b.leaf, sizeof(b.leaf), "%s", name + 4);
+	}
+
+	printf("{\n");
+	printf("  \"vdi\": \"%s\",\n", name);
+	printf("  \"size\": %llu,\n",
+	       (unsigned long long)b.secs << SECTOR_SHIFT);
+
+	if (replay.path) {
+		b.replay = &replay;
+		err = bench_replay_run(&b);
+		printf("}\n");
+		goto close;
+	}
+
+	printf("  \"jobs\": [\n");
+
+	for (i = 0; i < n_jobs; i++)
+		err = bench_run(&b, &jobs[i], i, i == n_jobs - 1) ? : err;
+
+	printf("  ]\n");
+	printf("}\n");
+
+close:
+	free(b.gens);
+	tapdisk_vbd_close_vdi(b.vbd);
+	tapdisk_server_remove_vbd(b.vbd);
+	free(b.vbd->name);
+	free(b.vbd);
+out:
+	tapdisk_stop_logging();
+	return -err;
+}
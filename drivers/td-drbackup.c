@@ -0,0 +1,2009 @@
+/*
+ * Copyright (c) 2007, XenSource Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of XenSource Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Backup receiver for the DR drivers (asyncdr, adaptdr, syncdr).
+ *
+ * One process serves any number of device streams. Each connection
+ * opens with the handshake of dr_handshake(): the image path, and
+ * optionally a codec request. What follows is a stream of struct
+ * req_info records, each followed by its data, or of struct dr_frame
+ * framed batches of them with a codec. A zeroed req_info closes the
+ * stream.
+ *
+ * Records are copied into aligned buffers and written with O_DIRECT
+ * through a tapdisk-queue LIO queue, up to DRB_MAX_RECS per stream at
+ * once. Every outstanding record is indexed by its byte extent in an
+ * interval tree; a record overlapping an earlier outstanding one waits
+ * until that one is on disk, so overlapping writes land in stream
+ * order while disjoint ones complete in any order.
+ *
+ * Concurrency never crosses an epoch barrier (dr_rec_barrier()):
+ * records after a barrier are only admitted once everything before it
+ * is on disk and fdatasync()ed. After a crash the image therefore holds
+ * the last barrier plus part of the following epoch, which is what the
+ * primary guarantees anyway, since absorption may drop writes within
+ * an epoch. With -s, the last epoch an image completed is kept in
+ * <dir>/<image path, '/' as '_'>.epoch, replaced atomically, as
+ * "epoch <n>\nwriteID <id>\n"; a failover restores to that epoch.
+ *
+ * With -g <name>=<image>[,<image>]..., the images are the members of a
+ * consistency group (struct dr_group, adaptdr.h), whose senders number
+ * epochs alike. Group epoch n is complete once every member applied a
+ * barrier at or past it; each member is then consistent with the
+ * others at the first such barrier, since all of its writes between
+ * two barriers belong to one group epoch. Members that never connected
+ * hold the group back. With -s, the last complete group epoch is kept
+ * in <dir>/<name>.group the same way, as "epoch <n>\n" and a line
+ * "<image> <writeID>\n" per member, the point a failover restores each
+ * of them to; the image's own epoch file may be past it.
+ *
+ * With dedup agreed, each stream has DR_DEDUP_SLOTS blocks the primary
+ * stores and references by slot (DR_REC_DEDUP, adaptdr.h). Records are
+ * decoded as they are admitted, in stream order, and duplicates still
+ * store their blocks, so the primary's view of the table holds. With
+ * deltas agreed too, DR_DEDUP_XOR patches a slot in place, duplicates
+ * included, and the result is checked against the hash it came with.
+ *
+ * Records with DR_REC_CRC are checked against their checksum once
+ * decoded; a mismatch drops the stream, so nothing after it is acked.
+ *
+ * Acks are cumulative struct dr_ack, for the longest prefix of the
+ * stream that is on disk. Records the backup already applied,
+ * retransmitted after a reconnect, are dropped by writeID.
+ *
+ * A connection opening with DR_MUX_HELLO is a mux link carrying many
+ * device streams as struct dr_mux messages (see adaptdr.h). Each device
+ * gets a channel of its own, with everything described above, and its
+ * acks carry its device number. A channel that is full holds up the
+ * link; an error on any of them drops the link, and with it every
+ * device the primary has on it.
+ *
+ * With -m <name>, the stream of a primary on this host is read from
+ * its ring in shared memory instead (struct dr_shm, adaptdr.h). A
+ * thread sleeps on the ring's futex and rings an eventfd for the
+ * server loop, which copies whole records out as the channel has room,
+ * skipping absorbed ones; acks go into the ring's header.
+ *
+ * With -j <dir>, images are not written in place but journalled
+ * (drb-journal.h) in <dir>/<image path, '/' as '_'>.journal, keeping
+ * the last -r <n> epochs (DRB_JOURNAL_RETAIN); older ones are merged
+ * into the image in the background. Acks are for records in the
+ * journal. For a failover, -t <epoch> <image>... rolls the images
+ * forward to a journalled epoch and drops what follows it, marking
+ * its extents in <dir>/<image path, '/' as '_'>.failback for the
+ * failback (failback=, adaptdr.h).
+ *
+ * With -c <cert> -k <key>, every primary connecting over TCP must go
+ * through a TLS handshake first, after which the kernel encrypts the
+ * connection (dr-tls.h); primaries give tls=<CA> to match.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+
+#include "list.h"
+#include "itree.h"
+#include "tapdisk.h"
+#include "tapdisk-server.h"
+#include "tapdisk-queue.h"
+#include "adaptdr.h"
+#include "dr-stream.h"
+#include "dr-crc32c.h"
+#include "dr-tls.h"
+#include "drb-journal.h"
+
+#define DRB_QUEUE_DEPTH      1024
+#define DRB_IN_BYTES         (8 << 20)
+#define DRB_RAW_BYTES        (8 << 20)
+#define DRB_MAX_RECS         256
+#define DRB_MAX_REC_BYTES    (4 << 20)
+#define DRB_MUX_BYTES        (8 << 20)
+#define DRB_MAX_SHM          16
+#define DRB_MAX_GROUPS       16
+
+struct drb_image {
+	char                *path;
+	int                  fd;
+	int                  refs;
+	uint64_t             applied;	/* highest writeID on disk */
+	uint64_t             epoch;	/* last complete epoch */
+	uint64_t             epoch_id;
+	char                *state;	/* where it is recorded, or NULL */
+	struct drb_member   *member;	/* of a consistency group, or NULL */
+	struct drb_journal  *journal;	/* with -j, or NULL */
+	struct list_head     next;
+};
+
+/* a barrier a group member applied, past the group's epoch */
+struct drb_mark {
+	uint64_t             epoch;
+	uint64_t             writeID;
+};
+
+struct drb_group;
+
+struct drb_member {
+	struct drb_group    *group;
+	char                *path;
+	uint64_t             epoch;	/* last barrier applied */
+	struct drb_mark     *marks;
+	int                  n_marks;
+	int                  max_marks;
+};
+
+struct drb_group {
+	char                *name;
+	char                *state;
+	uint64_t             epoch;	/* last complete in every member */
+	int                  n_members;
+	struct drb_member   *members;
+	struct list_head     next;
+};
+
+#define DRB_REC_WAITING      0
+#define DRB_REC_ISSUED       1
+#define DRB_REC_DONE         2
+
+struct drb_chan;
+
+struct drb_rec {
+	struct drb_chan     *chan;
+	uint64_t             writeID;
+	uint64_t             offset;
+	size_t               size;
+	uint64_t             seq;
+	char                *buf;	/* the journal header first, if any */
+	uint64_t             jpos;
+	int                  state;
+
+	struct itree_node    node;
+	struct tiocb         tiocb;
+	struct list_head     next;	/* chan->recs, stream order */
+	struct list_head     wait;	/* chan->waiting */
+};
+
+/* a block kept for DR_DEDUP_REF, allocated on first DR_DEDUP_KEEP */
+struct drb_dedup_slot {
+	uint64_t             hash[2];
+	char                *data;
+};
+
+/* One device stream: the whole connection, or a device on a mux link. */
+struct drb_chan {
+	struct drb_conn     *conn;
+	uint32_t             device;
+
+	struct drb_image    *image;
+	int                  codec;
+	struct drb_dedup_slot *dedup;	/* DR_DEDUP_SLOTS, if agreed */
+	int                  delta;
+
+	/* stream bytes, when framed */
+	char                *in;
+	size_t               in_len;
+
+	/* record stream */
+	char                *raw;
+	size_t               raw_len;
+
+	int                  closing;
+	int                  err;
+
+	/* outstanding records */
+	struct itree         tree;
+	struct list_head     recs;
+	struct list_head     waiting;
+	int                  outstanding;
+	int                  issued;
+	uint64_t             seq;
+	int                  dirty;		/* epoch not yet synced */
+
+	uint64_t             records;
+	uint64_t             dups;
+	uint64_t             conflicts;
+	uint64_t             epochs;
+	uint64_t             dedup_refs;
+	uint64_t             deltas;
+
+	struct list_head     next;	/* conn->chans */
+};
+
+struct drb_conn {
+	int                  sock;
+	event_id_t           event;
+	int                  masked;
+	int                  hello;
+	int                  codec;
+	int                  dedup;
+
+	/* socket bytes of a mux link, and the DATA being demuxed */
+	int                  mux;
+	char                *mbuf;
+	size_t               mbuf_len;
+	struct drb_chan     *cur;
+	size_t               left;
+
+	/* a primary's ring in shared memory, instead of the socket */
+	struct dr_shm       *shm;
+	int                  shm_fd;
+	pthread_t            shm_thread;
+	int                  shm_stop;
+	int                  shm_eof;
+
+	int                  closing;
+	struct list_head     chans;
+
+	struct list_head     next;
+};
+
+static struct tqueue         drb_queue;
+static LIST_HEAD(drb_images);
+static LIST_HEAD(drb_conns);
+static LIST_HEAD(drb_groups);
+static int                   drb_run = 1;
+static const char           *drb_state;
+static const char           *drb_tls_cert;
+static const char           *drb_tls_key;
+static const char           *drb_journal_dir;
+static int                   drb_retain = DRB_JOURNAL_RETAIN;
+
+static void drb_process(struct drb_conn *);
+static int drb_shm_fill(struct drb_conn *);
+static void drb_write_done(void *, struct tiocb *, int);
+
+static struct drb_member *
+drb_group_member(const char *path)
+{
+	struct drb_group *g;
+	int i;
+
+	list_for_each_entry(g, &drb_groups, next)
+		for (i = 0; i < g->n_members; i++)
+			if (!strcmp(g->members[i].path, path))
+				return &g->members[i];
+
+	return NULL;
+}
+
+/* -g <name>=<image>[,<image>]... */
+static int
+drb_group_add(char *arg)
+{
+	struct drb_group *g;
+	char *p, *path;
+	int n;
+
+	p = strchr(arg, '=');
+	if (!p || p == arg || !p[1] || memchr(arg, '/', p - arg))
+		return -EINVAL;
+	*p++ = '\0';
+
+	g = calloc(1, sizeof(*g));
+	if (!g)
+		return -ENOMEM;
+
+	for (n = 1, path = p; (path = strchr(path, ',')); path++)
+		n++;
+
+	g->name    = arg;
+	g->members = calloc(n, sizeof(*g->members));
+	if (!g->members) {
+		free(g);
+		return -ENOMEM;
+	}
+
+	for (path = strtok(p, ","); path; path = strtok(NULL, ",")) {
+		if (drb_group_member(path))
+			return -EEXIST;
+		g->members[g->n_members].group = g;
+		g->members[g->n_members].path  = path;
+		g->n_members++;
+	}
+
+	if (drb_state &&
+	    asprintf(&g->state, "%s/%s.group", drb_state, g->name) == -1)
+		g->state = NULL;
+
+	list_add_tail(&g->next, &drb_groups);
+	return 0;
+}
+
+static struct drb_image *
+drb_image_get(const char *path)
+{
+	struct drb_image *image;
+	int fd;
+
+	list_for_each_entry(image, &drb_images, next)
+		if (!strcmp(image->path, path)) {
+			image->refs++;
+			return image;
+		}
+
+	fd = open(path, O_RDWR | O_DIRECT | O_LARGEFILE);
+	if (fd == -1 && errno == EINVAL) {
+		fd = open(path, O_RDWR | O_LARGEFILE);
+		if (fd != -1)
+			DPRINTF("WARNING: Accessing image without "
+				"O_DIRECT! (%s)\n", path);
+	}
+	if (fd == -1) {
+		DPRINTF("Unable to open [%s] (%d)!\n", path, -errno);
+		return NULL;
+	}
+
+	image = calloc(1, sizeof(*image));
+	if (!image || !(image->path = strdup(path))) {
+		free(image);
+		close(fd);
+		return NULL;
+	}
+
+	image->fd   = fd;
+	image->refs = 1;
+
+	if (drb_state) {
+		char *p;
+
+		if (asprintf(&image->state, "%s/%s.epoch",
+			     drb_state, path) == -1) {
+			image->state = NULL;
+			DPRINTF("%s: epoch state disabled\n", path);
+		} else
+			for (p = image->state + strlen(drb_state) + 1;
+			     *p; p++)
+				if (*p == '/')
+					*p = '_';
+	}
+
+	image->member = drb_group_member(path);
+
+	if (drb_journal_dir) {
+		if (drb_journal_open(drb_journal_dir, path, fd, drb_retain,
+				     &image->journal)) {
+			close(fd);
+			free(image->state);
+			free(image->path);
+			free(image);
+			return NULL;
+		}
+		image->applied = image->journal->applied;
+	}
+
+	list_add_tail(&image->next, &drb_images);
+
+	return image;
+}
+
+static void
+drb_image_put(struct drb_image *image)
+{
+	if (--image->refs)
+		return;
+
+	if (image->journal)
+		drb_journal_close(image->journal);
+
+	if (fsync(image->fd))
+		DPRINTF("%s: fsync failed: %d\n", image->path, -errno);
+
+	list_del(&image->next);
+	close(image->fd);
+	free(image->state);
+	free(image->path);
+	free(image);
+}
+
+/*
+ * State files are replaced with a rename, so a crash leaves either the
+ * old contents or the new ones.
+ */
+static int
+drb_state_write(const char *path, const char *buf, int len)
+{
+	char *tmp;
+	int fd, err = 0;
+
+	if (asprintf(&tmp, "%s.tmp", path) == -1)
+		return -ENOMEM;
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1 || write(fd, buf, len) != len || fsync(fd) ||
+	    rename(tmp, path))
+		err = -errno;
+	if (fd != -1)
+		close(fd);
+
+	free(tmp);
+	return err;
+}
+
+/* Record the last epoch every member of the group has completed. */
+static int
+drb_group_update(struct drb_group *g)
+{
+	struct drb_member *m;
+	uint64_t epoch = UINT64_MAX;
+	char *buf, *p;
+	size_t size;
+	int i, j, err;
+
+	for (i = 0; i < g->n_members; i++)
+		if (g->members[i].epoch < epoch)
+			epoch = g->members[i].epoch;
+
+	if (epoch <= g->epoch)
+		return 0;
+
+	size = 32;
+	for (i = 0; i < g->n_members; i++)
+		size += strlen(g->members[i].path) + 24;
+
+	buf = malloc(size);
+	if (!buf)
+		return -ENOMEM;
+
+	p  = buf;
+	p += sprintf(p, "epoch %llu\n", (unsigned long long)epoch);
+
+	for (i = 0; i < g->n_members; i++) {
+		m = &g->members[i];
+
+		/* the first barrier at or past it, drop those before */
+		for (j = 0; m->marks[j].epoch < epoch; j++)
+			;
+		p += sprintf(p, "%s %llu\n", m->path,
+			     (unsigned long long)m->marks[j].writeID);
+
+		while (j < m->n_marks && m->marks[j].epoch <= epoch)
+			j++;
+		memmove(m->marks, m->marks + j,
+			(m->n_marks - j) * sizeof(*m->marks));
+		m->n_marks -= j;
+	}
+
+	g->epoch = epoch;
+
+	err = 0;
+	if (g->state) {
+		err = drb_state_write(g->state, buf, p - buf);
+		if (err)
+			DPRINTF("group %s: unable to record epoch %llu: %d\n",
+				g->name, (unsigned long long)epoch, err);
+	}
+
+	free(buf);
+	return err;
+}
+
+static int
+drb_member_barrier(struct drb_member *m, uint64_t epoch, uint64_t id)
+{
+	struct drb_mark *marks;
+	int max;
+
+	if (epoch <= m->epoch)
+		return 0;
+
+	if (m->n_marks == m->max_marks) {
+		max   = m->max_marks ? m->max_marks * 2 : 16;
+		marks = realloc(m->marks, max * sizeof(*marks));
+		if (!marks)
+			return -ENOMEM;
+		m->marks     = marks;
+		m->max_marks = max;
+	}
+
+	m->marks[m->n_marks].epoch   = epoch;
+	m->marks[m->n_marks].writeID = id;
+	m->n_marks++;
+	m->epoch = epoch;
+
+	return drb_group_update(m->group);
+}
+
+/* Record a completed epoch: everything up to it is on disk and synced. */
+static int
+drb_image_epoch(struct drb_image *image, uint64_t epoch, uint64_t id)
+{
+	char buf[64];
+	int len, err;
+
+	if (epoch <= image->epoch)
+		return 0;
+
+	image->epoch    = epoch;
+	image->epoch_id = id;
+
+	if (image->member) {
+		err = drb_member_barrier(image->member, epoch, id);
+		if (err)
+			DPRINTF("%s: unable to track group epoch %llu: %d\n",
+				image->path, (unsigned long long)epoch, err);
+	}
+
+	if (!image->state)
+		return 0;
+
+	len = snprintf(buf, sizeof(buf), "epoch %llu\nwriteID %llu\n",
+		       (unsigned long long)epoch, (unsigned long long)id);
+
+	err = drb_state_write(image->state, buf, len);
+	if (err)
+		DPRINTF("%s: unable to record epoch %llu: %d\n",
+			image->path, (unsigned long long)epoch, err);
+
+	return err;
+}
+
+static void
+drb_chan_free(struct drb_chan *ch)
+{
+	struct drb_rec *rec, *tmp;
+
+	if (!ch->err && ch->dirty &&
+	    fdatasync(ch->image->journal ? ch->image->journal->fd :
+		      ch->image->fd))
+		DPRINTF("%s: fdatasync failed: %d\n",
+			ch->image->path, -errno);
+
+	DPRINTF("closing stream %s: %llu records, %llu duplicates, "
+		"%llu conflicts, %llu epochs, %llu dedup refs, %llu deltas\n",
+		ch->image->path,
+		(unsigned long long)ch->records,
+		(unsigned long long)ch->dups,
+		(unsigned long long)ch->conflicts,
+		(unsigned long long)ch->epochs,
+		(unsigned long long)ch->dedup_refs,
+		(unsigned long long)ch->deltas);
+
+	if (ch->dedup) {
+		int i;
+
+		for (i = 0; i < DR_DEDUP_SLOTS; i++)
+			free(ch->dedup[i].data);
+		free(ch->dedup);
+	}
+
+	list_for_each_entry_safe(rec, tmp, &ch->recs, next) {
+		list_del(&rec->next);
+		free(rec->buf);
+		free(rec);
+	}
+
+	if (ch->conn->cur == ch) {
+		ch->conn->cur  = NULL;
+		ch->conn->left = 0;
+	}
+
+	drb_image_put(ch->image);
+	list_del(&ch->next);
+	free(ch->raw);
+	free(ch->in);
+	free(ch);
+}
+
+static struct drb_chan *
+drb_chan_open(struct drb_conn *c, uint32_t device, const char *path)
+{
+	struct drb_chan *ch;
+
+	ch = calloc(1, sizeof(*ch));
+	if (!ch)
+		return NULL;
+
+	ch->conn   = c;
+	ch->device = device;
+	ch->codec  = c->codec;
+	INIT_LIST_HEAD(&ch->recs);
+	INIT_LIST_HEAD(&ch->waiting);
+	itree_init(&ch->tree);
+
+	ch->raw = malloc(DRB_RAW_BYTES);
+	if (!ch->raw)
+		goto fail;
+
+	if (ch->codec) {
+		ch->in = malloc(DRB_IN_BYTES);
+		if (!ch->in)
+			goto fail;
+	}
+
+	if (c->dedup) {
+		ch->dedup = calloc(DR_DEDUP_SLOTS, sizeof(*ch->dedup));
+		if (!ch->dedup)
+			goto fail;
+		ch->delta = c->dedup == DR_DEDUP_DELTA;
+	}
+
+	ch->image = drb_image_get(path);
+	if (!ch->image)
+		goto fail;
+
+	DPRINTF("stream %s%s%s%s, device %u\n", ch->image->path,
+		ch->codec ? ", lz4" : "", ch->dedup ? ", dedup" : "",
+		ch->delta ? " with deltas" : "", device);
+
+	list_add_tail(&ch->next, &c->chans);
+	return ch;
+
+fail:
+	free(ch->dedup);
+	free(ch->raw);
+	free(ch->in);
+	free(ch);
+	return NULL;
+}
+
+/* The connection's channels must be gone. */
+static void
+drb_conn_free(struct drb_conn *c)
+{
+	if (c->event >= 0)
+		tapdisk_server_unregister_event(c->event);
+	if (c->sock >= 0)
+		close(c->sock);
+
+	if (c->shm) {
+		__atomic_store_n(&c->shm_stop, 1, __ATOMIC_RELEASE);
+		__atomic_store_n(&c->shm->head_wanted, 1, __ATOMIC_RELEASE);
+		dr_shm_wake(&c->shm->head_seq, &c->shm->head_wanted);
+		pthread_join(c->shm_thread, NULL);
+		close(c->shm_fd);
+
+		__atomic_store_n(&c->shm->attached, 0, __ATOMIC_RELEASE);
+		dr_shm_detach(c->shm);
+	}
+
+	list_del(&c->next);
+	free(c->mbuf);
+	free(c);
+}
+
+/* Stop reading, and let every channel finish what it has. */
+static void
+drb_conn_close(struct drb_conn *c)
+{
+	struct drb_chan *ch;
+
+	c->closing = 1;
+	list_for_each_entry(ch, &c->chans, next)
+		ch->closing = 1;
+}
+
+static const char *
+drb_conn_name(struct drb_conn *c)
+{
+	struct drb_chan *ch;
+
+	if (c->mux || list_empty(&c->chans))
+		return "mux link";
+
+	ch = list_entry(c->chans.next, struct drb_chan, next);
+	return ch->image->path;
+}
+
+/*
+ * "path", then optional lines "compress=lz4", "dedup" and "delta"; the
+ * reply echoes each we accept. DR_MUX_HELLO instead of a path opens a
+ * mux link.
+ */
+static int
+drb_handshake(struct drb_conn *c)
+{
+	char buffer[256], reply[64], *line, *next;
+	int delta = 0;
+	ssize_t n;
+
+	bzero(buffer, sizeof(buffer));
+	n = recv(c->sock, buffer, sizeof(buffer) - 1, 0);
+	if (n <= 0)
+		return n < 0 ? -errno : -ECONNRESET;
+
+	c->hello = 1;
+
+	line = strchr(buffer, '\n');
+	if (line)
+		*line++ = '\0';
+
+	for (; line; line = next) {
+		next = strchr(line, '\n');
+		if (next)
+			*next++ = '\0';
+#ifdef HAVE_LZ4
+		if (!strcmp(line, "compress=lz4"))
+			c->codec = DR_CODEC_LZ4;
+#endif
+		if (!strcmp(line, "dedup"))
+			c->dedup = 1;
+		if (!strcmp(line, "delta"))
+			delta = 1;
+	}
+
+	if (c->dedup && delta)
+		c->dedup = DR_DEDUP_DELTA;
+
+	if (!strcmp(buffer, DR_MUX_HELLO)) {
+		c->mux  = 1;
+		c->mbuf = malloc(DRB_MUX_BYTES);
+		if (!c->mbuf)
+			return -ENOMEM;
+
+		DPRINTF("mux link%s%s%s\n", c->codec ? ", lz4" : "",
+			c->dedup ? ", dedup" : "",
+			c->dedup == DR_DEDUP_DELTA ? " with deltas" : "");
+	} else if (!drb_chan_open(c, 0, buffer)) {
+		n = write(c->sock, "error", 5);
+		return -ENOENT;
+	}
+
+	snprintf(reply, sizeof(reply), "ok%s%s%s%s", c->mux ? " mux" : "",
+		 c->codec ? " compress=lz4" : "", c->dedup ? " dedup" : "",
+		 c->dedup == DR_DEDUP_DELTA ? " delta" : "");
+
+	n = write(c->sock, reply, strlen(reply));
+	return n < 0 ? -errno : 0;
+}
+
+/* Move whole frames from the socket buffer into the record stream. */
+static int
+drb_unframe(struct drb_chan *ch)
+{
+	struct dr_frame frame;
+	size_t len;
+
+	while (ch->in_len >= sizeof(frame)) {
+		memcpy(&frame, ch->in, sizeof(frame));
+		if (frame.magic != DR_FRAME_MAGIC || frame.len > frame.raw ||
+		    frame.raw > DRB_RAW_BYTES) {
+			DPRINTF("%s: bad frame\n", ch->image->path);
+			return -EINVAL;
+		}
+
+		len = sizeof(frame) + frame.len;
+		if (ch->in_len < len)
+			break;
+		if (ch->raw_len + frame.raw > DRB_RAW_BYTES)
+			break;
+
+		if (frame.len == frame.raw)
+			memcpy(ch->raw + ch->raw_len, ch->in + sizeof(frame),
+			       frame.raw);
+#ifdef HAVE_LZ4
+		else if (LZ4_decompress_safe(ch->in + sizeof(frame),
+					     ch->raw + ch->raw_len, frame.len,
+					     frame.raw) != frame.raw) {
+			DPRINTF("%s: bad lz4 frame\n", ch->image->path);
+			return -EINVAL;
+		}
+#else
+		else
+			return -EINVAL;
+#endif
+
+		ch->raw_len += frame.raw;
+		ch->in_len  -= len;
+		memmove(ch->in, ch->in + len, ch->in_len);
+	}
+
+	return 0;
+}
+
+static int
+drb_conflict(struct itree_node *node, void *arg)
+{
+	struct drb_rec *rec = arg;
+	struct drb_rec *other = containerof(node, struct drb_rec, node);
+
+	return other->seq < rec->seq;
+}
+
+static void
+drb_issue(struct drb_rec *rec)
+{
+	struct drb_chan *ch = rec->chan;
+	struct drb_journal *j = ch->image->journal;
+
+	rec->state = DRB_REC_ISSUED;
+	ch->issued++;
+
+	if (j)
+		tapdisk_prep_tiocb(&rec->tiocb, j->fd, 1, rec->buf,
+				   drb_journal_len(rec->size), rec->jpos,
+				   drb_write_done, rec);
+	else
+		tapdisk_prep_tiocb(&rec->tiocb, ch->image->fd, 1, rec->buf,
+				   rec->size, rec->offset, drb_write_done,
+				   rec);
+	tapdisk_queue_tiocb(&drb_queue, &rec->tiocb);
+}
+
+/* Ack the on-disk prefix of the stream, release its records. */
+static int
+drb_retire(struct drb_chan *ch)
+{
+	struct drb_rec *rec, *tmp;
+	struct dr_ack ack;
+	uint64_t applied = 0;
+
+	list_for_each_entry_safe(rec, tmp, &ch->recs, next) {
+		if (rec->state != DRB_REC_DONE)
+			break;
+
+		applied = rec->writeID;
+		list_del(&rec->next);
+		free(rec->buf);
+		free(rec);
+
+		ch->outstanding--;
+		ch->records++;
+	}
+
+	if (!applied)
+		return 0;
+
+	if (ch->image->applied < applied)
+		ch->image->applied = applied;
+
+	if (ch->conn->shm) {
+		__atomic_store_n(&ch->conn->shm->acked, ch->image->applied,
+				 __ATOMIC_RELEASE);
+		dr_shm_wake(&ch->conn->shm->ack_seq,
+			    &ch->conn->shm->ack_wanted);
+		return 0;
+	}
+
+	memset(&ack, 0, sizeof(ack));
+	ack.deviceID = ch->device;
+	ack.writeID  = ch->image->applied;
+	if (sendexact(ch->conn->sock, (char *)&ack, sizeof(ack))) {
+		DPRINTF("%s: ack failed: %d\n", ch->image->path, -errno);
+		return -errno;
+	}
+
+	return 0;
+}
+
+static void
+drb_write_done(void *arg, struct tiocb *tiocb, int err)
+{
+	struct drb_rec *rec = arg, *w, *tmp;
+	struct drb_chan *ch = rec->chan;
+
+	rec->state = DRB_REC_DONE;
+	ch->issued--;
+	itree_remove(&ch->tree, &rec->node);
+
+	if (err && !ch->err) {
+		DPRINTF("%s: write failed: %d, dropping stream\n",
+			ch->image->path, err);
+		ch->err = err;
+	}
+
+	if (ch->err)
+		goto out;
+
+	/* start waiters no longer behind an earlier overlapping record */
+	list_for_each_entry_safe(w, tmp, &ch->waiting, wait) {
+		if (w->offset < rec->offset + rec->size &&
+		    rec->offset < w->offset + w->size &&
+		    !itree_foreach_overlap(&ch->tree, w->offset,
+					   w->offset + w->size,
+					   drb_conflict, w)) {
+			list_del_init(&w->wait);
+			drb_issue(w);
+		}
+	}
+
+	ch->err = drb_retire(ch);
+
+out:
+	drb_process(ch->conn);
+}
+
+/*
+ * Wire length of a DR_REC_DEDUP record, 0 until its block map, and the
+ * length of every delta in it, is in.
+ */
+static size_t
+drb_dedup_len(const struct req_info *rinfo, const char *rec, size_t avail)
+{
+	struct dr_dedup_blk blk;
+	uint32_t xlen;
+	size_t len;
+	int i, n;
+
+	n   = rinfo->size / DR_DEDUP_BLOCK;
+	len = sizeof(*rinfo) + n * sizeof(blk);
+	if (avail < len)
+		return 0;
+
+	for (i = 0; i < n; i++) {
+		memcpy(&blk, rec + sizeof(*rinfo) + i * sizeof(blk),
+		       sizeof(blk));
+		switch (blk.op) {
+		case DR_DEDUP_REF:
+			break;
+		case DR_DEDUP_XOR:
+			if (avail < len + sizeof(xlen))
+				return 0;
+			memcpy(&xlen, rec + len, sizeof(xlen));
+			len += sizeof(xlen) + xlen;
+			break;
+		default:
+			len += DR_DEDUP_BLOCK;
+			break;
+		}
+	}
+
+	return len + rinfo->size - n * DR_DEDUP_BLOCK;
+}
+
+/*
+ * Patch a slot with the runs of a DR_DEDUP_XOR delta at 'p', 'len'
+ * bytes of them, and check the result against 'hash'.
+ */
+static int
+drb_dedup_xor(struct drb_dedup_slot *slot, const struct dr_dedup_blk *blk,
+	      const char *p, uint32_t len)
+{
+	struct dr_delta_run run;
+	uint64_t a, b, hash[2];
+	const char *end = p + len;
+	size_t i;
+
+	if (!slot->data)
+		return -EILSEQ;
+
+	while (p < end) {
+		if (end - p < sizeof(run))
+			return -EINVAL;
+		memcpy(&run, p, sizeof(run));
+		p += sizeof(run);
+
+		if (run.off % sizeof(a) || run.len % sizeof(a) ||
+		    run.off + run.len > DR_DEDUP_BLOCK || end - p < run.len)
+			return -EINVAL;
+
+		for (i = 0; i < run.len; i += sizeof(a)) {
+			memcpy(&a, slot->data + run.off + i, sizeof(a));
+			memcpy(&b, p + i, sizeof(b));
+			a ^= b;
+			memcpy(slot->data + run.off + i, &a, sizeof(a));
+		}
+		p += run.len;
+	}
+
+	dr_dedup_hash(slot->data, DR_DEDUP_BLOCK, hash);
+	if (hash[0] != blk->hash[0] || hash[1] != blk->hash[1])
+		return -EILSEQ;
+
+	slot->hash[0] = hash[0];
+	slot->hash[1] = hash[1];
+	return 0;
+}
+
+/*
+ * Apply the block map of a DR_REC_DEDUP record to the table, and
+ * rebuild its data into 'buf'. Without 'buf', for duplicates, only the
+ * blocks it stores or patches matter.
+ */
+static int
+drb_dedup_decode(struct drb_chan *ch, const struct req_info *rinfo,
+		 const char *rec, char *buf)
+{
+	struct drb_dedup_slot *slot;
+	struct dr_dedup_blk blk;
+	const char *map, *p;
+	uint32_t xlen;
+	int i, n, err;
+
+	if (!ch->dedup) {
+		DPRINTF("%s: dedup record, not agreed\n", ch->image->path);
+		return -EPROTO;
+	}
+
+	n   = rinfo->size / DR_DEDUP_BLOCK;
+	map = rec + sizeof(*rinfo);
+	p   = map + n * sizeof(blk);
+
+	for (i = 0; i < n; i++) {
+		memcpy(&blk, map + i * sizeof(blk), sizeof(blk));
+		if (blk.slot >= DR_DEDUP_SLOTS)
+			return -EINVAL;
+		slot = &ch->dedup[blk.slot];
+
+		switch (blk.op) {
+		case DR_DEDUP_REF:
+			if (!buf)
+				break;
+			if (!slot->data ||
+			    slot->hash[0] != blk.hash[0] ||
+			    slot->hash[1] != blk.hash[1]) {
+				DPRINTF("%s: stale dedup slot %u\n",
+					ch->image->path, blk.slot);
+				return -EILSEQ;
+			}
+			memcpy(buf + i * DR_DEDUP_BLOCK, slot->data,
+			       DR_DEDUP_BLOCK);
+			ch->dedup_refs++;
+			break;
+
+		case DR_DEDUP_XOR:
+			if (!ch->delta) {
+				DPRINTF("%s: delta record, not agreed\n",
+					ch->image->path);
+				return -EPROTO;
+			}
+			memcpy(&xlen, p, sizeof(xlen));
+			p += sizeof(xlen);
+			err = drb_dedup_xor(slot, &blk, p, xlen);
+			if (err) {
+				DPRINTF("%s: bad delta for dedup slot %u: "
+					"%d\n", ch->image->path, blk.slot,
+					err);
+				return err;
+			}
+			if (buf)
+				memcpy(buf + i * DR_DEDUP_BLOCK, slot->data,
+				       DR_DEDUP_BLOCK);
+			p += xlen;
+			ch->deltas++;
+			break;
+
+		case DR_DEDUP_KEEP:
+			if (!slot->data) {
+				slot->data = malloc(DR_DEDUP_BLOCK);
+				if (!slot->data)
+					return -ENOMEM;
+			}
+			memcpy(slot->data, p, DR_DEDUP_BLOCK);
+			slot->hash[0] = blk.hash[0];
+			slot->hash[1] = blk.hash[1];
+			/* fall through */
+		case DR_DEDUP_RAW:
+			if (buf)
+				memcpy(buf + i * DR_DEDUP_BLOCK, p,
+				       DR_DEDUP_BLOCK);
+			p += DR_DEDUP_BLOCK;
+			break;
+
+		default:
+			return -EINVAL;
+		}
+	}
+
+	if (buf)
+		memcpy(buf + n * DR_DEDUP_BLOCK, p,
+		       rinfo->size - n * DR_DEDUP_BLOCK);
+
+	return 0;
+}
+
+/*
+ * Take whole records off the stream, as long as there is room for
+ * them. A barrier waits for the epoch it closes to reach the disk.
+ */
+static int
+drb_admit(struct drb_chan *ch)
+{
+	struct drb_journal *j = ch->image->journal;
+	struct req_info rinfo;
+	struct drb_rec *rec;
+	size_t pos = 0, rlen;
+	char *data;
+	int err = 0, wait;
+
+	while (ch->outstanding < DRB_MAX_RECS &&
+	       pos + sizeof(rinfo) <= ch->raw_len) {
+		memcpy(&rinfo, ch->raw + pos, sizeof(rinfo));
+
+		if (dr_rec_close(&rinfo)) {
+			ch->closing = 1;
+			pos += sizeof(rinfo);
+			break;
+		}
+
+		/* applied even when retransmitted, it is idempotent */
+		if (dr_rec_barrier(&rinfo)) {
+			if (ch->outstanding)
+				break;
+
+			if (j) {
+				err = drb_journal_barrier(j, rinfo.offset,
+							  rinfo.writeID);
+				if (err) {
+					DPRINTF("%s: unable to journal epoch "
+						"%llu: %d\n", ch->image->path,
+						(unsigned long long)rinfo.offset,
+						err);
+					break;
+				}
+				ch->dirty = 0;
+			} else if (ch->dirty) {
+				if (fdatasync(ch->image->fd)) {
+					err = -errno;
+					DPRINTF("%s: fdatasync failed: %d\n",
+						ch->image->path, err);
+					break;
+				}
+				ch->dirty = 0;
+			}
+
+			/* a failed state update is not fatal, retry next */
+			drb_image_epoch(ch->image, rinfo.offset, rinfo.writeID);
+			ch->epochs++;
+			pos += sizeof(rinfo);
+			continue;
+		}
+
+		if (rinfo.size <= 0 || rinfo.size > DRB_MAX_REC_BYTES) {
+			DPRINTF("%s: bad record size %d\n",
+				ch->image->path, rinfo.size);
+			err = -EINVAL;
+			break;
+		}
+
+		rlen = dr_record_size(rinfo.size);
+		if (rinfo.state & DR_REC_DEDUP) {
+			rlen = drb_dedup_len(&rinfo, ch->raw + pos,
+					     ch->raw_len - pos);
+			if (!rlen)
+				break;
+		}
+		if (pos + rlen > ch->raw_len)
+			break;
+
+		if (rinfo.writeID <= ch->image->applied) {
+			if (rinfo.state & DR_REC_DEDUP) {
+				err = drb_dedup_decode(ch, &rinfo,
+						       ch->raw + pos, NULL);
+				if (err)
+					break;
+			}
+			ch->dups++;
+			pos += rlen;
+			continue;
+		}
+
+		rec = calloc(1, sizeof(*rec));
+		if (!rec ||
+		    posix_memalign((void **)&rec->buf, 4096,
+				   j ? drb_journal_len(rinfo.size) :
+				   rinfo.size)) {
+			free(rec);
+			err = -ENOMEM;
+			break;
+		}
+		data = j ? rec->buf + DRB_JOURNAL_HDR : rec->buf;
+
+		if (rinfo.state & DR_REC_DEDUP)
+			err = drb_dedup_decode(ch, &rinfo, ch->raw + pos,
+					       data);
+		else
+			memcpy(data, ch->raw + pos + sizeof(rinfo),
+			       rinfo.size);
+		if (!err && (rinfo.state & DR_REC_CRC) &&
+		    dr_crc32c(0, data, rinfo.size) != rinfo.crc) {
+			DPRINTF("%s: checksum mismatch in write %llu at %llu, "
+				"dropping stream\n", ch->image->path,
+				(unsigned long long)rinfo.writeID,
+				(unsigned long long)rinfo.offset);
+			err = -EBADMSG;
+		}
+		if (err) {
+			free(rec->buf);
+			free(rec);
+			break;
+		}
+
+		rec->chan    = ch;
+		rec->writeID = rinfo.writeID;
+		rec->offset  = rinfo.offset;
+		rec->size    = rinfo.size;
+		rec->seq     = ch->seq++;
+		INIT_LIST_HEAD(&rec->wait);
+		if (j)
+			rec->jpos = drb_journal_reserve(j, rec->buf,
+							rec->writeID,
+							rec->offset,
+							rec->size);
+
+		list_add_tail(&rec->next, &ch->recs);
+		ch->outstanding++;
+		ch->dirty = 1;
+		pos += rlen;
+
+		/*
+		 * A fresh record reads as waiting, so keep the verdict.
+		 * Journal appends never overlap.
+		 */
+		wait = !j && itree_foreach_overlap(&ch->tree, rec->offset,
+					     rec->offset + rec->size,
+					     drb_conflict, rec);
+		if (wait) {
+			rec->state = DRB_REC_WAITING;
+			list_add_tail(&rec->wait, &ch->waiting);
+			ch->conflicts++;
+		}
+
+		itree_insert(&ch->tree, &rec->node,
+			     rec->offset, rec->offset + rec->size);
+
+		if (!wait)
+			drb_issue(rec);
+	}
+
+	ch->raw_len -= pos;
+	memmove(ch->raw, ch->raw + pos, ch->raw_len);
+
+	return err;
+}
+
+/* Admit what a channel has buffered; a failed channel stops reading. */
+static int
+drb_chan_pump(struct drb_chan *ch)
+{
+	int err;
+
+	err = ch->err;
+
+	if (!err && ch->codec)
+		err = drb_unframe(ch);
+
+	if (!err)
+		err = drb_admit(ch);
+
+	if (err) {
+		if (!ch->err)
+			DPRINTF("%s: stream error %d\n", ch->image->path, err);
+		ch->err     = err;
+		ch->closing = 1;
+	}
+
+	return err;
+}
+
+static struct drb_chan *
+drb_conn_chan(struct drb_conn *c, uint32_t device)
+{
+	struct drb_chan *ch;
+
+	list_for_each_entry(ch, &c->chans, next)
+		if (ch->device == device && !ch->closing)
+			return ch;
+
+	return NULL;
+}
+
+/*
+ * Hand the messages of a mux link to their channels. DATA is copied as
+ * far as its channel has room, which holds up the link until that
+ * channel's writes complete.
+ */
+static int
+drb_demux(struct drb_conn *c)
+{
+	struct drb_chan *ch;
+	struct dr_mux msg;
+	size_t pos = 0, n, *len, size;
+	char *buf, *path;
+	int err = 0;
+
+	while (pos < c->mbuf_len) {
+		if (c->cur) {
+			ch = c->cur;
+			if (ch->codec) {
+				buf  = ch->in;
+				len  = &ch->in_len;
+				size = DRB_IN_BYTES;
+			} else {
+				buf  = ch->raw;
+				len  = &ch->raw_len;
+				size = DRB_RAW_BYTES;
+			}
+
+			n = c->mbuf_len - pos;
+			if (n > c->left)
+				n = c->left;
+			if (n > size - *len)
+				n = size - *len;
+			if (!n)
+				break;
+
+			memcpy(buf + *len, c->mbuf + pos, n);
+			*len    += n;
+			pos     += n;
+			c->left -= n;
+			if (!c->left)
+				c->cur = NULL;
+
+			err = drb_chan_pump(ch);
+			if (err)
+				break;
+			continue;
+		}
+
+		if (c->mbuf_len - pos < sizeof(msg))
+			break;
+
+		memcpy(&msg, c->mbuf + pos, sizeof(msg));
+		if (msg.magic != DR_MUX_MAGIC) {
+			DPRINTF("bad mux message\n");
+			err = -EINVAL;
+			break;
+		}
+
+		switch (msg.type) {
+		case DR_MUX_OPEN:
+			if (msg.len >= DRB_MUX_BYTES - sizeof(msg)) {
+				err = -ENAMETOOLONG;
+				break;
+			}
+			if (c->mbuf_len - pos < sizeof(msg) + msg.len)
+				goto out;
+
+			if (drb_conn_chan(c, msg.device)) {
+				DPRINTF("device %u opened twice\n", msg.device);
+				err = -EEXIST;
+				break;
+			}
+
+			path = strndup(c->mbuf + pos + sizeof(msg), msg.len);
+			if (!path || !drb_chan_open(c, msg.device, path))
+				err = -ENOENT;
+			free(path);
+			pos += sizeof(msg) + msg.len;
+			break;
+
+		case DR_MUX_DATA:
+		case DR_MUX_CLOSE:
+			ch = drb_conn_chan(c, msg.device);
+			if (!ch) {
+				DPRINTF("message for unknown device %u\n",
+					msg.device);
+				err = -ENOENT;
+				break;
+			}
+
+			if (msg.type == DR_MUX_CLOSE)
+				ch->closing = 1;
+			else if (msg.len) {
+				c->cur  = ch;
+				c->left = msg.len;
+			}
+			pos += sizeof(msg);
+			break;
+
+		default:
+			DPRINTF("bad mux message type %u\n", msg.type);
+			err = -EINVAL;
+		}
+
+		if (err)
+			break;
+	}
+
+out:
+	c->mbuf_len -= pos;
+	memmove(c->mbuf, c->mbuf + pos, c->mbuf_len);
+
+	return err;
+}
+
+/*
+ * Pump every channel, then what a mux link has buffered for them, and
+ * free what is done. A stream error on a mux link drops the whole link:
+ * it is all the primary can notice.
+ */
+static void
+drb_process(struct drb_conn *c)
+{
+	struct drb_chan *ch, *tmp;
+	int err = 0, full;
+
+	if (c->shm && !c->closing && drb_shm_fill(c))
+		drb_conn_close(c);
+
+	list_for_each_entry(ch, &c->chans, next) {
+		if (drb_chan_pump(ch))
+			err = ch->err;
+		if (!c->mux && ch->closing)
+			c->closing = 1;
+	}
+
+	if (!err && c->mux && !c->closing)
+		err = drb_demux(c);
+
+	if (err && c->mux && !c->closing) {
+		DPRINTF("mux link error %d, dropping it\n", err);
+		drb_conn_close(c);
+	}
+
+	list_for_each_entry_safe(ch, tmp, &c->chans, next)
+		if (ch->closing && !ch->issued &&
+		    (ch->err || !ch->outstanding))
+			drb_chan_free(ch);
+
+	if (c->closing && list_empty(&c->chans)) {
+		drb_conn_free(c);
+		return;
+	}
+
+	/* the ring is only read as there is room */
+	if (c->shm)
+		return;
+
+	/* stop reading while we cannot take more */
+	if (c->closing)
+		full = 1;
+	else if (c->mux)
+		full = c->mbuf_len == DRB_MUX_BYTES;
+	else {
+		ch   = list_entry(c->chans.next, struct drb_chan, next);
+		full = ch->codec ? ch->in_len == DRB_IN_BYTES
+				 : ch->raw_len == DRB_RAW_BYTES;
+	}
+	if (full != c->masked) {
+		tapdisk_server_mask_event(c->event, full);
+		c->masked = full;
+	}
+}
+
+static void
+drb_shm_copy(struct dr_shm *shm, uint64_t pos, void *dst, size_t len)
+{
+	const char *data = (const char *)shm + DR_SHM_HDR;
+	size_t off = pos % shm->size, part;
+
+	part = shm->size - off;
+	if (part > len)
+		part = len;
+
+	memcpy(dst, data + off, part);
+	memcpy((char *)dst + part, data, len - part);
+}
+
+/*
+ * Copy the whole records the primary published into the channel, as
+ * far as it has room, leaving out absorbed ones. Once the primary
+ * closed the ring and we read it all, end the stream as its close
+ * marker would.
+ */
+static int
+drb_shm_fill(struct drb_conn *c)
+{
+	struct dr_shm *shm = c->shm;
+	struct req_info rinfo;
+	struct drb_chan *ch;
+	uint64_t head, pos;
+	size_t rlen;
+	int closed;
+
+	ch     = list_entry(c->chans.next, struct drb_chan, next);
+	closed = __atomic_load_n(&shm->closed, __ATOMIC_ACQUIRE);
+	head   = __atomic_load_n(&shm->head, __ATOMIC_ACQUIRE);
+	pos    = shm->tail;
+
+	while (pos + sizeof(rinfo) <= head) {
+		drb_shm_copy(shm, pos, &rinfo, sizeof(rinfo));
+		if (rinfo.size < 0 || rinfo.size > DRB_MAX_REC_BYTES ||
+		    pos + dr_record_size(rinfo.size) > head) {
+			DPRINTF("%s: bad record in shared ring\n",
+				ch->image->path);
+			return -EINVAL;
+		}
+
+		rlen = dr_record_size(rinfo.size);
+		if (rinfo.state != DR_REC_ABSORBED) {
+			if (rlen > DRB_RAW_BYTES - ch->raw_len)
+				break;
+			drb_shm_copy(shm, pos, ch->raw + ch->raw_len, rlen);
+			ch->raw_len += rlen;
+		}
+		pos += rlen;
+	}
+
+	__atomic_store_n(&shm->tail, pos, __ATOMIC_RELEASE);
+
+	if (closed && pos == head && !c->shm_eof &&
+	    sizeof(rinfo) <= DRB_RAW_BYTES - ch->raw_len) {
+		memset(ch->raw + ch->raw_len, 0, sizeof(rinfo));
+		ch->raw_len += sizeof(rinfo);
+		c->shm_eof   = 1;
+	}
+
+	return 0;
+}
+
+/* Turn futex wakeups of the ring into events of the server loop. */
+static void *
+drb_shm_watch(void *arg)
+{
+	struct drb_conn *c = arg;
+	struct dr_shm *shm = c->shm;
+	uint64_t val = 1;
+	uint32_t seen;
+	int gcc;
+
+	while (!__atomic_load_n(&c->shm_stop, __ATOMIC_ACQUIRE)) {
+		seen = __atomic_load_n(&shm->head_seq, __ATOMIC_ACQUIRE);
+		gcc  = write(c->shm_fd, &val, sizeof(val));
+		if (gcc) {};
+
+		while (__atomic_load_n(&shm->head_seq, __ATOMIC_ACQUIRE) ==
+		       seen && !__atomic_load_n(&c->shm_stop, __ATOMIC_ACQUIRE))
+			dr_shm_wait(&shm->head_seq, &shm->head_wanted, seen,
+				    1000);
+	}
+
+	return NULL;
+}
+
+static void
+drb_shm_event(event_id_t id, char mode, void *private)
+{
+	struct drb_conn *c = private;
+	uint64_t val;
+	int gcc;
+
+	gcc = read(c->shm_fd, &val, sizeof(val));
+	if (gcc) {};
+
+	drb_process(c);
+}
+
+/* Read the ring of the primary that created /dr_<name>. */
+static int
+drb_shm_open(const char *name)
+{
+	struct dr_shm *shm;
+	struct drb_conn *c;
+	int err, idle = 0;
+
+	err = dr_shm_attach(name, &shm);
+	if (err) {
+		DPRINTF("cannot map DR ring %s: %d\n", name, err);
+		return err;
+	}
+
+	if (!__atomic_compare_exchange_n(&shm->attached, &idle, 1, 0,
+					 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		DPRINTF("DR ring %s already has a backup\n", name);
+		dr_shm_detach(shm);
+		return -EBUSY;
+	}
+
+	/* what the primary no longer keeps is on disk */
+	shm->tail = __atomic_load_n(&shm->kept, __ATOMIC_ACQUIRE);
+
+	err = -ENOMEM;
+	c = calloc(1, sizeof(*c));
+	if (!c)
+		goto fail;
+
+	c->sock   = -1;
+	c->event  = -1;
+	c->hello  = 1;
+	c->shm    = shm;
+	c->shm_fd = -1;
+	INIT_LIST_HEAD(&c->next);
+	INIT_LIST_HEAD(&c->chans);
+
+	if (!drb_chan_open(c, 0, shm->image)) {
+		err = -ENOENT;
+		goto fail;
+	}
+
+	c->shm_fd = tapdisk_sys_eventfd(0);
+	if (c->shm_fd < 0) {
+		err = -errno;
+		goto fail;
+	}
+
+	c->event = tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
+						 c->shm_fd, 0, drb_shm_event,
+						 c);
+	if (c->event < 0) {
+		err = c->event;
+		goto fail;
+	}
+
+	err = pthread_create(&c->shm_thread, NULL, drb_shm_watch, c);
+	if (err) {
+		err = -err;
+		goto fail;
+	}
+
+	list_add_tail(&c->next, &drb_conns);
+	DPRINTF("reading DR ring %s\n", name);
+	return 0;
+
+fail:
+	if (c) {
+		if (c->event >= 0)
+			tapdisk_server_unregister_event(c->event);
+		if (c->shm_fd >= 0)
+			close(c->shm_fd);
+		if (!list_empty(&c->chans))
+			drb_chan_free(list_entry(c->chans.next,
+						 struct drb_chan, next));
+		free(c);
+	}
+	__atomic_store_n(&shm->attached, 0, __ATOMIC_RELEASE);
+	dr_shm_detach(shm);
+	return err;
+}
+
+static void
+drb_conn_event(event_id_t id, char mode, void *private)
+{
+	struct drb_conn *c = private;
+	struct drb_chan *ch;
+	char *buf;
+	size_t *len, size;
+	ssize_t n;
+	int err;
+
+	if (!c->hello) {
+		err = drb_handshake(c);
+		if (err) {
+			DPRINTF("handshake failed: %d\n", err);
+			drb_conn_close(c);
+			drb_process(c);
+		}
+		return;
+	}
+
+	if (c->closing)
+		return;
+
+	if (c->mux) {
+		buf  = c->mbuf;
+		len  = &c->mbuf_len;
+		size = DRB_MUX_BYTES;
+	} else {
+		ch = list_entry(c->chans.next, struct drb_chan, next);
+		if (ch->codec) {
+			buf  = ch->in;
+			len  = &ch->in_len;
+			size = DRB_IN_BYTES;
+		} else {
+			buf  = ch->raw;
+			len  = &ch->raw_len;
+			size = DRB_RAW_BYTES;
+		}
+	}
+
+	n = recv(c->sock, buf + *len, size - *len, MSG_DONTWAIT);
+	if (n < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			return;
+		DPRINTF("%s: recv failed: %d\n", drb_conn_name(c), -errno);
+		drb_conn_close(c);
+	} else if (!n) {
+		DPRINTF("%s: stream closed without marker\n",
+			drb_conn_name(c));
+		drb_conn_close(c);
+	} else
+		*len += n;
+
+	drb_process(c);
+}
+
+/*
+ * The handshake blocks the server loop, for DR_CONNECT_MS at most in
+ * each direction: primaries only connect now and then.
+ */
+static int
+drb_tls_accept(int sock)
+{
+	struct timeval tv = { DR_CONNECT_MS / 1000,
+			      DR_CONNECT_MS % 1000 * 1000 };
+	int err;
+
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	err = dr_tls_server(sock, drb_tls_cert, drb_tls_key);
+	if (err)
+		DPRINTF("TLS handshake failed: %d, dropping connection\n",
+			err);
+
+	memset(&tv, 0, sizeof(tv));
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	return err;
+}
+
+static void
+drb_accept(event_id_t id, char mode, void *private)
+{
+	int lfd = (int)(long)private, sock, one = 1;
+	struct drb_conn *c;
+
+	sock = accept(lfd, NULL, NULL);
+	if (sock < 0) {
+		DPRINTF("accept failed: %d\n", -errno);
+		return;
+	}
+
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	if (drb_tls_cert && drb_tls_accept(sock)) {
+		close(sock);
+		return;
+	}
+
+	c = calloc(1, sizeof(*c));
+	if (!c)
+		goto fail;
+
+	c->sock = sock;
+	INIT_LIST_HEAD(&c->next);
+	INIT_LIST_HEAD(&c->chans);
+
+	c->event = tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
+						 sock, 0, drb_conn_event, c);
+	if (c->event < 0)
+		goto fail;
+
+	list_add_tail(&c->next, &drb_conns);
+	return;
+
+fail:
+	DPRINTF("unable to set up connection\n");
+	free(c);
+	close(sock);
+}
+
+static int
+drb_listen(int port)
+{
+	struct sockaddr_in addr;
+	int fd, one = 1;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -errno;
+
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family      = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port        = htons(port);
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+	    listen(fd, 16)) {
+		int err = -errno;
+		close(fd);
+		return err;
+	}
+
+	return fd;
+}
+
+static void
+drb_signal(int signal)
+{
+	drb_run = 0;
+}
+
+static void
+usage(const char *prog, int err)
+{
+	fprintf(stderr, "usage: %s [-p <port>] [-m <shm name>]... "
+		"[-s <state dir>] [-g <group>=<image>[,<image>]...]... "
+		"[-c <cert> -k <key>] [-j <journal dir> [-r <epochs>]] "
+		"[-D] [-h]\n"
+		"       %s -j <journal dir> -t <epoch> <image>...\n",
+		prog, prog);
+	exit(err);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int c, i, err, port = -1, fd, foreground = 0, n_shm = 0, n_groups = 0;
+	const char *shm[DRB_MAX_SHM];
+	char *groups[DRB_MAX_GROUPS], *p;
+	long long restore = -1;
+	event_id_t id;
+
+	while ((c = getopt(argc, argv, "p:m:s:g:c:k:j:r:t:Dh")) != -1) {
+		switch (c) {
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 'm':
+			if (n_shm == DRB_MAX_SHM)
+				usage(argv[0], EINVAL);
+			shm[n_shm++] = optarg;
+			break;
+		case 'g':
+			if (n_groups == DRB_MAX_GROUPS)
+				usage(argv[0], EINVAL);
+			groups[n_groups++] = optarg;
+			break;
+		case 's':
+			/* daemon() leaves us in / */
+			drb_state = realpath(optarg, NULL);
+			if (!drb_state) {
+				perror(optarg);
+				return errno;
+			}
+			break;
+		case 'c':
+		case 'k':
+			/* daemon() leaves us in / */
+			p = realpath(optarg, NULL);
+			if (!p) {
+				perror(optarg);
+				return errno;
+			}
+			if (c == 'c')
+				drb_tls_cert = p;
+			else
+				drb_tls_key = p;
+			break;
+		case 'j':
+			/* daemon() leaves us in / */
+			drb_journal_dir = realpath(optarg, NULL);
+			if (!drb_journal_dir) {
+				perror(optarg);
+				return errno;
+			}
+			break;
+		case 'r':
+			drb_retain = atoi(optarg);
+			if (drb_retain < 0)
+				usage(argv[0], EINVAL);
+			break;
+		case 't':
+			restore = strtoll(optarg, NULL, 0);
+			if (restore < 0)
+				usage(argv[0], EINVAL);
+			break;
+		case 'D':
+			foreground = 1;
+			break;
+		default:
+			usage(argv[0], EINVAL);
+		case 'h':
+			usage(argv[0], 0);
+		}
+	}
+
+	if (restore >= 0) {
+		struct drb_image *image;
+
+		if (!drb_journal_dir || optind == argc)
+			usage(argv[0], EINVAL);
+
+		for (err = 0; optind < argc && !err; optind++) {
+			image = drb_image_get(argv[optind]);
+			if (!image) {
+				err = -EINVAL;
+				break;
+			}
+			err = drb_journal_restore(image->journal, restore);
+			drb_image_put(image);
+		}
+
+		return err ? -err : 0;
+	}
+
+	if (port <= 0 && !n_shm)
+		usage(argv[0], EINVAL);
+
+	if (!drb_tls_cert != !drb_tls_key)
+		usage(argv[0], EINVAL);
+
+	/* after -s, wherever it was given */
+	for (i = 0; i < n_groups; i++)
+		if (drb_group_add(groups[i]))
+			usage(argv[0], EINVAL);
+
+	if (!foreground && daemon(0, 0)) {
+		perror("daemon");
+		return errno;
+	}
+
+	openlog("td-drbackup", LOG_PID, LOG_DAEMON);
+
+	err = tapdisk_server_initialize(NULL, NULL);
+	if (err)
+		goto out;
+
+	err = tapdisk_init_queue(&drb_queue, DRB_QUEUE_DEPTH,
+				 TIO_DRV_LIO, NULL);
+	if (err)
+		goto out;
+
+	for (i = 0; i < n_shm; i++) {
+		err = drb_shm_open(shm[i]);
+		if (err)
+			goto out;
+	}
+
+	if (port > 0) {
+		fd = drb_listen(port);
+		if (fd < 0) {
+			err = fd;
+			DPRINTF("unable to listen on port %d: %d\n", port,
+				err);
+			goto out;
+		}
+
+		id = tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
+						   fd, 0, drb_accept,
+						   (void *)(long)fd);
+		if (id < 0) {
+			err = id;
+			goto out;
+		}
+
+		DPRINTF("listening on port %d\n", port);
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGINT, drb_signal);
+	signal(SIGTERM, drb_signal);
+
+	while (drb_run) {
+		tapdisk_server_iterate();
+		tapdisk_submit_all_tiocbs(&drb_queue);
+	}
+
+	err = 0;
+
+out:
+	closelog();
+	return err ? -err : 0;
+}
@@ -0,0 +1,790 @@
+/*
+ * Copyright (c) 2007, XenSource Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of XenSource Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Microbenchmark for the DR drivers (syncdr, asyncdr, adaptdr).
+ *
+ * Each mode gets a fresh image on tmpfs, so the local write costs no
+ * more than a copy, and a backup built in: a sink thread that takes the
+ * handshake, reads and drops the record stream, and acks every record
+ * as td-drbackup would. The sink paces its reads to the bandwidth given
+ * with -w, and holds each ack back for the RTT given with -r, which
+ * stands in for the link. It declines compression and dedup.
+ *
+ * The device runs in a child process of its own, a tapdisk server with
+ * one VBD, which keeps -q random writes of -b bytes in flight until -n
+ * of them completed, then closes the VBD; that sends what is left in
+ * the ring to the sink. The parent reports, per mode:
+ *
+ *   p50/p99/p999  write latency, queued to completed, in us
+ *   local         MB/s the guest wrote
+ *   replicated    MB/s the sink received, first record to last
+ *   cpu           ms of CPU time the child spent per GB written
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "list.h"
+#include "tapdisk.h"
+#include "tapdisk-server.h"
+#include "tapdisk-vbd.h"
+#include "adaptdr.h"
+
+#define BENCH_MAX_DEPTH      TAPDISK_DATA_REQUESTS
+#define BENCH_ACK_SLOTS      4096
+#define BENCH_MAX_BYTES      (1 << 20)
+
+static const char *bench_modes[] = { "syncdr", "asyncdr", "adaptdr" };
+
+struct bench_opts {
+	uint64_t             writes;
+	size_t               bsize;
+	int                  depth;
+	uint64_t             image_mb;
+	uint64_t             rtt_us;
+	size_t               bw;
+	const char          *options;
+	const char          *dir;
+};
+
+/* What the child reports back. */
+struct bench_result {
+	int                  err;
+	uint64_t             done;
+	uint64_t             errors;
+	uint64_t             elapsed_us;
+	uint64_t             p50, p99, p999;
+};
+
+/*
+ * The sink, in the parent. Acks due for sending queue up in a ring;
+ * one that finds the ring full folds into the newest entry, which only
+ * ever makes that ack name a later write.
+ */
+struct bench_ack {
+	uint64_t             due_us;
+	uint64_t             writeID;
+};
+
+struct bench_sink {
+	int                  lsock;
+	int                  sock;
+	int                  port;
+	uint64_t             rtt_us;
+	size_t               bw;
+
+	uint64_t             records;
+	uint64_t             bytes;
+	uint64_t             first_us;
+	uint64_t             last_us;
+
+	pthread_mutex_t      lock;
+	pthread_cond_t       cond;
+	struct bench_ack     acks[BENCH_ACK_SLOTS];
+	unsigned int         ack_prod;
+	unsigned int         ack_cons;
+	int                  closed;
+
+	pthread_t            reader;
+	pthread_t            acker;
+};
+
+struct bench_req {
+	td_vbd_request_t     vreq;
+	struct td_iovec      iov;
+	void                *buf;
+};
+
+/* The device side, in the child. */
+struct bench {
+	const struct bench_opts *opts;
+	td_vbd_t            *vbd;
+	td_sector_t          secs;
+
+	struct bench_req    *reqs;
+	struct bench_req   **free;
+	int                  n_free;
+	uint32_t            *lat;
+	uint64_t             queued;
+	uint64_t             done;
+	uint64_t             errors;
+	uint64_t             start_us;
+	uint64_t             end_us;
+	int                  run;
+};
+
+static uint64_t
+bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void
+bench_sleep_until(uint64_t us)
+{
+	struct timespec ts;
+	uint64_t now = bench_now();
+
+	if (us <= now)
+		return;
+
+	us -= now;
+	ts.tv_sec  = us / 1000000;
+	ts.tv_nsec = (us % 1000000) * 1000;
+	nanosleep(&ts, NULL);
+}
+
+static void
+bench_sink_push(struct bench_sink *k, uint64_t writeID)
+{
+	struct bench_ack *ack;
+
+	pthread_mutex_lock(&k->lock);
+
+	if (k->ack_prod - k->ack_cons == BENCH_ACK_SLOTS) {
+		ack = &k->acks[(k->ack_prod - 1) % BENCH_ACK_SLOTS];
+		ack->writeID = writeID;
+	} else {
+		ack = &k->acks[k->ack_prod++ % BENCH_ACK_SLOTS];
+		ack->due_us  = bench_now() + k->rtt_us;
+		ack->writeID = writeID;
+	}
+
+	pthread_cond_signal(&k->cond);
+	pthread_mutex_unlock(&k->lock);
+}
+
+static void *
+bench_sink_acker(void *arg)
+{
+	struct bench_sink *k = arg;
+	struct bench_ack ack;
+	struct dr_ack msg;
+
+	for (;;) {
+		pthread_mutex_lock(&k->lock);
+		while (k->ack_prod == k->ack_cons && !k->closed)
+			pthread_cond_wait(&k->cond, &k->lock);
+		if (k->ack_prod == k->ack_cons) {
+			pthread_mutex_unlock(&k->lock);
+			break;
+		}
+		ack = k->acks[k->ack_cons % BENCH_ACK_SLOTS];
+		pthread_mutex_unlock(&k->lock);
+
+		bench_sleep_until(ack.due_us);
+
+		/* the producer may have folded a later write in meanwhile */
+		pthread_mutex_lock(&k->lock);
+		ack = k->acks[k->ack_cons++ % BENCH_ACK_SLOTS];
+		pthread_mutex_unlock(&k->lock);
+
+		memset(&msg, 0, sizeof(msg));
+		msg.writeID = ack.writeID;
+		if (sendexact(k->sock, (char *)&msg, sizeof(msg)))
+			break;
+	}
+
+	return NULL;
+}
+
+static int
+bench_sink_handshake(struct bench_sink *k)
+{
+	char buffer[256];
+	int n;
+
+	n = read(k->sock, buffer, sizeof(buffer) - 1);
+	if (n <= 0)
+		return n < 0 ? -errno : -ECONNRESET;
+
+	n = write(k->sock, "ok", 2);
+	return n < 0 ? -errno : 0;
+}
+
+static void *
+bench_sink_reader(void *arg)
+{
+	struct bench_sink *k = arg;
+	struct req_info rinfo;
+	char *buf;
+	int err;
+
+	buf = malloc(BENCH_MAX_BYTES);
+	if (!buf)
+		goto out;
+
+	k->sock = accept(k->lsock, NULL, NULL);
+	if (k->sock < 0 || bench_sink_handshake(k))
+		goto out;
+
+	for (;;) {
+		if (recvexact(k->sock, (char *)&rinfo, sizeof(rinfo)))
+			break;
+
+		if (dr_rec_close(&rinfo))
+			break;
+
+		if (rinfo.size < 0 || rinfo.size > BENCH_MAX_BYTES) {
+			fprintf(stderr, "sink: bad record of %d bytes\n",
+				rinfo.size);
+			break;
+		}
+
+		if (rinfo.size) {
+			err = recvexact(k->sock, buf, rinfo.size);
+			if (err)
+				break;
+		}
+
+		if (!k->first_us)
+			k->first_us = bench_now();
+
+		k->records++;
+		k->bytes  += sizeof(rinfo) + rinfo.size;
+		k->last_us = bench_now();
+
+		if (k->bw)
+			bench_sleep_until(k->first_us +
+					  k->bytes * 1000000 / k->bw);
+
+		bench_sink_push(k, rinfo.writeID);
+	}
+
+out:
+	pthread_mutex_lock(&k->lock);
+	k->closed = 1;
+	pthread_cond_signal(&k->cond);
+	pthread_mutex_unlock(&k->lock);
+
+	free(buf);
+	return NULL;
+}
+
+static int
+bench_sink_listen(struct bench_sink *k)
+{
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+
+	k->lsock = socket(AF_INET, SOCK_STREAM, 0);
+	if (k->lsock < 0)
+		return -errno;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family      = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port        = 0;
+
+	if (bind(k->lsock, (struct sockaddr *)&addr, sizeof(addr)) ||
+	    listen(k->lsock, 1) ||
+	    getsockname(k->lsock, (struct sockaddr *)&addr, &len)) {
+		int err = -errno;
+		close(k->lsock);
+		return err;
+	}
+
+	k->port = ntohs(addr.sin_port);
+	return 0;
+}
+
+static int
+bench_sink_start(struct bench_sink *k, const struct bench_opts *opts)
+{
+	int err;
+
+	memset(k, 0, sizeof(*k));
+	k->sock   = -1;
+	k->rtt_us = opts->rtt_us;
+	k->bw     = opts->bw;
+	pthread_mutex_init(&k->lock, NULL);
+	pthread_cond_init(&k->cond, NULL);
+
+	err = bench_sink_listen(k);
+	if (err)
+		return err;
+
+	err = pthread_create(&k->reader, NULL, bench_sink_reader, k);
+	if (err) {
+		close(k->lsock);
+		return -err;
+	}
+
+	err = pthread_create(&k->acker, NULL, bench_sink_acker, k);
+	if (err) {
+		shutdown(k->lsock, SHUT_RDWR);
+		pthread_join(k->reader, NULL);
+		close(k->lsock);
+		return -err;
+	}
+
+	return 0;
+}
+
+/* Once the child is gone, its end of the stream is closed too. */
+static void
+bench_sink_stop(struct bench_sink *k)
+{
+	shutdown(k->lsock, SHUT_RDWR);
+	pthread_join(k->reader, NULL);
+	pthread_join(k->acker, NULL);
+
+	if (k->sock >= 0)
+		close(k->sock);
+	close(k->lsock);
+}
+
+static void bench_queue(struct bench *b);
+
+static void
+bench_close(struct bench *b)
+{
+	if (!b->vbd)
+		return;
+
+	tapdisk_vbd_close_vdi(b->vbd);
+	tapdisk_server_remove_vbd(b->vbd);
+	free(b->vbd->name);
+	free(b->vbd);
+	b->vbd = NULL;
+}
+
+static void
+bench_request_cb(td_vbd_request_t *vreq, int error, void *token, int final)
+{
+	struct bench *b = token;
+	struct bench_req *req = containerof(vreq, struct bench_req, vreq);
+	struct timeval now;
+	uint64_t us;
+
+	b->free[b->n_free++] = req;
+
+	gettimeofday(&now, NULL);
+	us = (now.tv_sec - vreq->ts.tv_sec) * 1000000ULL +
+		now.tv_usec - vreq->ts.tv_usec;
+
+	b->lat[b->done++] = us > UINT32_MAX ? UINT32_MAX : us;
+	if (error)
+		b->errors++;
+
+	if (!final)
+		return;
+
+	if (b->done == b->opts->writes) {
+		b->end_us = bench_now();
+		b->run    = 0;
+		return;
+	}
+
+	bench_queue(b);
+}
+
+static void
+bench_queue_request(struct bench *b, struct bench_req *req)
+{
+	td_vbd_request_t *vreq = &req->vreq;
+	td_sector_t secs = b->opts->bsize >> SECTOR_SHIFT;
+
+	req->iov.base = req->buf;
+	req->iov.secs = secs;
+
+	memset(vreq, 0, sizeof(*vreq));
+	vreq->op     = TD_OP_WRITE;
+	vreq->sec    = ((td_sector_t)random() % (b->secs / secs)) * secs;
+	vreq->iov    = &req->iov;
+	vreq->iovcnt = 1;
+	vreq->token  = b;
+	vreq->cb     = bench_request_cb;
+
+	b->queued++;
+	tapdisk_vbd_queue_request(b->vbd, vreq);
+}
+
+/* Requests retire in any order, refill every one that did. */
+static void
+bench_queue(struct bench *b)
+{
+	while (b->n_free && b->queued < b->opts->writes)
+		bench_queue_request(b, b->free[--b->n_free]);
+}
+
+static int
+bench_cmp(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static uint64_t
+bench_pct(struct bench *b, int per_mille)
+{
+	uint64_t i = b->done * per_mille / 1000;
+
+	return b->done ? b->lat[i < b->done ? i : b->done - 1] : 0;
+}
+
+static int
+bench_child(const struct bench_opts *opts, const char *name,
+	    struct bench_result *res)
+{
+	struct bench b;
+	td_disk_info_t info;
+	int i, err;
+
+	memset(&b, 0, sizeof(b));
+	b.opts = opts;
+
+	err = tapdisk_server_initialize(NULL, NULL);
+	if (err)
+		return err;
+
+	err = tapdisk_vbd_initialize(-1, -1, 0);
+	if (err)
+		return err;
+
+	b.vbd = tapdisk_server_get_vbd(0);
+	if (!b.vbd)
+		return -ENODEV;
+
+	err = tapdisk_vbd_open_vdi(b.vbd, name, 0, -1);
+	if (err) {
+		fprintf(stderr, "failed to open %s: %d\n", name, err);
+		return err;
+	}
+
+	err = tapdisk_vbd_get_disk_info(b.vbd, &info);
+	if (err)
+		goto out;
+	b.secs = info.size;
+
+	err = -ENOMEM;
+	b.lat  = calloc(opts->writes, sizeof(*b.lat));
+	b.reqs = calloc(opts->depth, sizeof(*b.reqs));
+	b.free = calloc(opts->depth, sizeof(*b.free));
+	if (!b.lat || !b.reqs || !b.free)
+		goto out;
+
+	/* random data, as dedup or compression would have it */
+	for (i = 0; i < opts->depth; i++) {
+		size_t j;
+
+		if (posix_memalign(&b.reqs[i].buf, 4096, opts->bsize))
+			goto out;
+		for (j = 0; j < opts->bsize / sizeof(long); j++)
+			((long *)b.reqs[i].buf)[j] = random();
+
+		b.free[b.n_free++] = &b.reqs[i];
+	}
+
+	b.run      = 1;
+	b.start_us = bench_now();
+	bench_queue(&b);
+
+	while (b.run)
+		tapdisk_server_iterate();
+
+	qsort(b.lat, b.done, sizeof(*b.lat), bench_cmp);
+
+	res->done       = b.done;
+	res->errors     = b.errors;
+	res->elapsed_us = b.end_us - b.start_us;
+	res->p50        = bench_pct(&b, 500);
+	res->p99        = bench_pct(&b, 990);
+	res->p999       = bench_pct(&b, 999);
+	err = 0;
+
+out:
+	/* sends the rest of the ring to the sink */
+	bench_close(&b);
+
+	if (b.reqs)
+		for (i = 0; i < opts->depth; i++)
+			free(b.reqs[i].buf);
+	free(b.reqs);
+	free(b.free);
+	free(b.lat);
+	return err;
+}
+
+static int
+bench_image(const struct bench_opts *opts, char *path, size_t size)
+{
+	int fd;
+
+	snprintf(path, size, "%s/td-drbench.XXXXXX", opts->dir);
+
+	fd = mkstemp(path);
+	if (fd < 0)
+		return -errno;
+
+	if (ftruncate(fd, opts->image_mb << 20)) {
+		int err = -errno;
+		close(fd);
+		unlink(path);
+		return err;
+	}
+
+	close(fd);
+	return 0;
+}
+
+static int
+bench_mode(const struct bench_opts *opts, const char *mode)
+{
+	struct bench_result res;
+	struct bench_sink sink;
+	struct rusage ru;
+	char image[PATH_MAX], name[PATH_MAX + 256];
+	uint64_t cpu_us, written, repl_us;
+	int err, status, pfd[2];
+	pid_t pid;
+
+	err = bench_image(opts, image, sizeof(image));
+	if (err) {
+		fprintf(stderr, "cannot create image in %s: %d\n",
+			opts->dir, err);
+		return err;
+	}
+
+	err = bench_sink_start(&sink, opts);
+	if (err)
+		goto out;
+
+	snprintf(name, sizeof(name), "%s:127.0.0.1:%d:%s%s", mode,
+		 sink.port, image, opts->options);
+
+	if (pipe(pfd)) {
+		err = -errno;
+		bench_sink_stop(&sink);
+		goto out;
+	}
+
+	pid = fork();
+	if (pid < 0) {
+		err = -errno;
+		close(pfd[0]);
+		close(pfd[1]);
+		bench_sink_stop(&sink);
+		goto out;
+	}
+
+	if (!pid) {
+		close(pfd[0]);
+		close(sink.lsock);
+
+		tapdisk_start_logging("td-drbench", "daemon");
+		memset(&res, 0, sizeof(res));
+		res.err = bench_child(opts, name, &res);
+		tapdisk_stop_logging();
+
+		err = write(pfd[1], &res, sizeof(res)) != sizeof(res);
+		_exit(err);
+	}
+
+	close(pfd[1]);
+	memset(&res, 0, sizeof(res));
+	if (read(pfd[0], &res, sizeof(res)) != sizeof(res))
+		res.err = -EPIPE;
+	close(pfd[0]);
+
+	if (wait4(pid, &status, 0, &ru) < 0)
+		memset(&ru, 0, sizeof(ru));
+
+	bench_sink_stop(&sink);
+
+	err = res.err;
+	if (err) {
+		fprintf(stderr, "%s: failed: %d\n", mode, err);
+		goto out;
+	}
+
+	cpu_us  = ru.ru_utime.tv_sec * 1000000ULL + ru.ru_utime.tv_usec +
+		ru.ru_stime.tv_sec * 1000000ULL + ru.ru_stime.tv_usec;
+	written = res.done * opts->bsize;
+	repl_us = sink.last_us - sink.first_us;
+
+	printf("%-8s %10llu %8llu %8llu %8llu %10.1f %10.1f %10.1f%s\n",
+	       mode, (unsigned long long)res.done,
+	       (unsigned long long)res.p50, (unsigned long long)res.p99,
+	       (unsigned long long)res.p999,
+	       res.elapsed_us ? written / (double)res.elapsed_us : 0.0,
+	       repl_us ? sink.bytes / (double)repl_us : 0.0,
+	       written ? cpu_us / 1000.0 / (written / (double)(1 << 30)) : 0.0,
+	       res.errors ? " (errors)" : "");
+	fflush(stdout);
+
+out:
+	unlink(image);
+	return err;
+}
+
+static int
+bench_parse_size(const char *val, size_t *size)
+{
+	unsigned long long v;
+	char *end;
+
+	v = strtoull(val, &end, 0);
+	if (end == val)
+		return -EINVAL;
+
+	switch (*end) {
+	case 'G': case 'g': v <<= 10;
+	case 'M': case 'm': v <<= 10;
+	case 'K': case 'k': v <<= 10;
+		end++;
+	}
+
+	if (*end)
+		return -EINVAL;
+
+	*size = v;
+	return 0;
+}
+
+static void
+usage(const char *prog, int err)
+{
+	fprintf(stderr, "usage: %s [-m syncdr|asyncdr|adaptdr]... "
+		"[-n <writes>] [-b <bytes>] [-q <depth>]\n"
+		"       [-s <image MB>] [-r <rtt us>] [-w <bytes/s>] "
+		"[-o <,key=value driver options>] [-d <dir>] [-h]\n", prog);
+	exit(err);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct bench_opts opts;
+	const char *modes[3];
+	int c, i, err, n_modes = 0;
+
+	opts.writes   = 100000;
+	opts.bsize    = 4096;
+	opts.depth    = 16;
+	opts.image_mb = 1024;
+	opts.rtt_us   = 0;
+	opts.bw       = 0;
+	opts.options  = "";
+	opts.dir      = "/dev/shm";
+
+	while ((c = getopt(argc, argv, "m:n:b:q:s:r:w:o:d:h")) != -1) {
+		switch (c) {
+		case 'm':
+			for (i = 0; i < 3; i++)
+				if (!strcmp(optarg, bench_modes[i]))
+					break;
+			if (i == 3 || n_modes == 3)
+				usage(argv[0], EINVAL);
+			modes[n_modes++] = bench_modes[i];
+			break;
+		case 'n':
+			opts.writes = strtoull(optarg, NULL, 10);
+			break;
+		case 'b':
+			if (bench_parse_size(optarg, &opts.bsize))
+				usage(argv[0], EINVAL);
+			break;
+		case 'q':
+			opts.depth = atoi(optarg);
+			break;
+		case 's':
+			opts.image_mb = strtoull(optarg, NULL, 10);
+			break;
+		case 'r':
+			opts.rtt_us = strtoull(optarg, NULL, 10);
+			break;
+		case 'w':
+			if (bench_parse_size(optarg, &opts.bw))
+				usage(argv[0], EINVAL);
+			break;
+		case 'o':
+			opts.options = optarg;
+			break;
+		case 'd':
+			opts.dir = optarg;
+			break;
+		default:
+			usage(argv[0], EINVAL);
+		case 'h':
+			usage(argv[0], 0);
+		}
+	}
+
+	if (!opts.writes || opts.depth <= 0 ||
+	    opts.depth > BENCH_MAX_DEPTH ||
+	    !opts.bsize || opts.bsize % 4096 ||
+	    opts.bsize > BENCH_MAX_BYTES ||
+	    (opts.image_mb << 20) < opts.bsize ||
+	    (*opts.options && *opts.options != ','))
+		usage(argv[0], EINVAL);
+
+	if (!n_modes)
+		for (n_modes = 0; n_modes < 3; n_modes++)
+			modes[n_modes] = bench_modes[n_modes];
+
+	signal(SIGPIPE, SIG_IGN);
+
+	printf("# %llu writes of %zu bytes, depth %d, rtt %lluus, "
+	       "bw %zu bytes/s (0: unlimited)\n",
+	       (unsigned long long)opts.writes, opts.bsize, opts.depth,
+	       (unsigned long long)opts.rtt_us, opts.bw);
+	printf("%-8s %10s %8s %8s %8s %10s %10s %10s\n", "# mode",
+	       "writes", "p50_us", "p99_us", "p999_us", "local_MB/s",
+	       "repl_MB/s", "cpu_ms/GB");
+
+	err = 0;
+	for (i = 0; i < n_modes; i++)
+		err = bench_mode(&opts, modes[i]) ? : err;
+
+	return -err;
+}
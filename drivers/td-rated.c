@@ -24,6 +24,7 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
+#include <limits.h>
 #include <stdarg.h>
 #include <signal.h>
 #include <getopt.h>
@@ -33,6 +34,7 @@
 #include <sys/time.h>
 
 #include "block-valve.h"
+#include "tapdisk-latency.h"
 #include "compiler.h"
 #include "list.h"
 
@@ -94,10 +96,13 @@ struct ratelimit_connection {
 
 	unsigned long                  need; /* I/O requested */
 	unsigned long                  gntd; /* I/O granted, pending */
+	unsigned long                  ops;  /* requests in need */
 
 	struct list_head               open; /* connected */
 	struct list_head               wait; /* need > 0 */
 
+	void                          *cls;  /* of the socket accepted on */
+
 	struct {
 		struct timeval         since;
 		struct timeval         total;
@@ -105,6 +110,7 @@ struct ratelimit_connection {
 };
 
 #define RLB_CONN_MAX                   1024
+#define RLB_LISTEN_MAX                 64
 
 struct ratelimit_ops {
 	void    (*usage)(td_rlb_t *rlb, FILE *stream, void *data);
@@ -118,6 +124,19 @@ struct ratelimit_ops {
 	void    (*timeout)(td_rlb_t *rlb, void *data);
 	void    (*dispatch)(td_rlb_t *rlb, void *data);
 	void    (*reset)(td_rlb_t *rlb, void *data);
+
+	/* optional: credit a valve leased and did not use, back */
+	void    (*refund)(td_rlb_t *rlb, td_rlb_conn_t *conn,
+			  unsigned long bytes, void *data);
+
+	/* optional: fds to watch for exceptions, and their events */
+	void    (*fdset)(td_rlb_t *rlb, fd_set *xfds, int *nfds, void *data);
+	int     (*fdevent)(td_rlb_t *rlb, fd_set *xfds, void *data);
+
+	/* optional: a new connection, and latencies it reports */
+	void    (*accept)(td_rlb_t *rlb, td_rlb_conn_t *conn, void *data);
+	void    (*latency)(td_rlb_t *rlb, td_rlb_conn_t *conn,
+			   int bucket, unsigned long count, void *data);
 };
 
 struct ratelimit_bridge {
@@ -128,6 +147,14 @@ struct ratelimit_bridge {
 	char                          *path;
 	int                            sock;
 
+	/* valve sockets, <path>.<suffix> */
+	struct rlb_listener {
+		struct sockaddr_un     addr;
+		int                    sock;
+		void                  *cls;
+	} lsnr[RLB_LISTEN_MAX];
+	int                            n_lsnr;
+
 	struct list_head               open; /* all connections */
 	struct list_head               wait; /* all in need */
 
@@ -360,6 +387,14 @@ rlb_argv_shift(int *optind, int *argc, char ***argv)
 static void
 rlb_sock_close(td_rlb_t *rlb)
 {
+	struct rlb_listener *l;
+
+	while (rlb->n_lsnr) {
+		l = &rlb->lsnr[--rlb->n_lsnr];
+		unlink(l->addr.sun_path);
+		close(l->sock);
+	}
+
 	if (rlb->path) {
 		unlink(rlb->path);
 		rlb->path = NULL;
@@ -419,6 +454,55 @@ fail:
 	return err;
 }
 
+/*
+ * another socket for a valve, next to the bridge's: connections
+ * accepted there carry @cls
+ */
+static int
+rlb_sock_listen(td_rlb_t *rlb, const char *suffix, void *cls)
+{
+	struct rlb_listener *l;
+	int s, err;
+
+	if (rlb->n_lsnr >= RLB_LISTEN_MAX)
+		return -ENOSPC;
+
+	l = &rlb->lsnr[rlb->n_lsnr];
+
+	s = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (s < 0) {
+		PERROR("socket");
+		return -errno;
+	}
+
+	l->addr.sun_family = AF_UNIX;
+	snprintf(l->addr.sun_path, sizeof(l->addr.sun_path),
+		 "%s.%s", rlb->path, suffix);
+
+	err = bind(s, &l->addr, sizeof(l->addr));
+	if (err) {
+		err = -errno;
+		PERROR("%s", l->addr.sun_path);
+		close(s);
+		return err;
+	}
+
+	err = listen(s, RLB_CONN_MAX);
+	if (err) {
+		err = -errno;
+		PERROR("listen(%s)", l->addr.sun_path);
+		unlink(l->addr.sun_path);
+		close(s);
+		return err;
+	}
+
+	l->sock = s;
+	l->cls  = cls;
+	rlb->n_lsnr++;
+
+	return 0;
+}
+
 static int
 rlb_sock_send(td_rlb_t *rlb, td_rlb_conn_t *conn,
 	      const void *msg, size_t size)
@@ -543,9 +627,28 @@ rlb_conn_receive(td_rlb_t *rlb, td_rlb_conn_t *conn)
 	}
 
 	for (i = 0; i < n / sizeof(buf[0]); i++) {
-		req = buf[i];
+		unsigned long flags, need;
+
+		req   = buf[i];
+		flags = req.need & TD_VALVE_REQ_FLAGS;
+		need  = req.need & ~TD_VALVE_REQ_FLAGS;
+
+		/* 'done' is a count, no bytes */
+		if (flags & TD_VALVE_REQ_LATENCY) {
+			if (unlikely(need >= TD_LAT_BUCKETS ||
+				     flags != TD_VALVE_REQ_LATENCY)) {
+				err = -EINVAL;
+				goto fail;
+			}
+
+			if (rlb->valve.ops->latency)
+				rlb->valve.ops->latency(rlb, conn, need,
+							req.done,
+							rlb->valve.data);
+			continue;
+		}
 
-		if (unlikely(req.need > TD_RLB_REQUEST_MAX)) {
+		if (unlikely(need > TD_RLB_REQUEST_MAX)) {
 			err = -EINVAL;
 			goto fail;
 		}
@@ -555,9 +658,29 @@ rlb_conn_receive(td_rlb_t *rlb, td_rlb_conn_t *conn)
 			goto fail;
 		}
 
-		conn->need += req.need;
 		conn->gntd -= req.done;
 
+		if (flags & TD_VALVE_REQ_RETURN) {
+			if (need) {
+				err = -EINVAL;
+				goto fail;
+			}
+
+			if (rlb->valve.ops->refund)
+				rlb->valve.ops->refund(rlb, conn, req.done,
+						       rlb->valve.data);
+			continue;
+		}
+
+		/* charged with the next grant */
+		if (flags & TD_VALVE_REQ_OPS) {
+			conn->ops += need;
+			continue;
+		}
+
+		conn->need += need;
+		conn->ops  += need && !(flags & TD_VALVE_REQ_LEASE);
+
 		DBG(8, "rcv: %lu/%lu need=%lu gntd=%lu",
 		    req.need, req.done, conn->need, conn->gntd);
 
@@ -605,6 +728,8 @@ rlb_conn_respond(td_rlb_t *rlb, td_rlb_conn_t *conn, unsigned long need)
 	if (!conn->need) {
 		struct timeval delta;
 
+		conn->ops = 0;
+
 		timersub(&rlb->now, &conn->wstat.since, &delta);
 		timeradd(&conn->wstat.total, &delta, &conn->wstat.total);
 
@@ -619,12 +744,12 @@ fail:
 }
 
 static void
-rlb_accept_conn(td_rlb_t *rlb)
+rlb_accept_conn(td_rlb_t *rlb, int sock, void *cls)
 {
 	td_rlb_conn_t *conn;
 	int s, err;
 
-	s = accept(rlb->sock, NULL, NULL);
+	s = accept(sock, NULL, NULL);
 	if (!s) {
 		err = -errno;
 		goto fail;
@@ -642,8 +767,12 @@ rlb_accept_conn(td_rlb_t *rlb)
 	memset(conn, 0, sizeof(*conn));
 	INIT_LIST_HEAD(&conn->wait);
 	conn->sock = s;
+	conn->cls  = cls;
 	list_add_tail(&conn->open, &rlb->open);
 
+	if (rlb->valve.ops->accept)
+		rlb->valve.ops->accept(rlb, conn, rlb->valve.data);
+
 	return;
 
 fail:
@@ -668,13 +797,39 @@ rlb_pending(td_rlb_t *rlb)
 
 typedef struct ratelimit_token td_rlb_token_t;
 
+/*
+ * Every request costs its size plus op_cost bytes. With an --iops
+ * limit, a second bucket counts requests, in 1/RLB_OPS_SCALE units
+ * to refill smoothly at low rates; a request waits for both.
+ */
+#define RLB_OPS_SCALE             1000000
+
 struct ratelimit_token {
 	long                      cred;
 	long                      cap;
 	long                      rate;
+	long                      op_cost;
+	td_rlb_token_t           *ops;
 	struct timeval            timeo;
 };
 
+/* until @token is out of debt */
+static long long
+rlb_token_usec(td_rlb_token_t *token)
+{
+	long long us;
+
+	if (token->cred >= 0)
+		return 0;
+
+	us  = -token->cred;
+	us *= 1000000;
+	us += token->rate - 1;
+	us /= token->rate;
+
+	return us;
+}
+
 static void
 rlb_token_settimeo(td_rlb_t *rlb, struct timeval **_tv, void *data)
 {
@@ -687,11 +842,11 @@ rlb_token_settimeo(td_rlb_t *rlb, struct timeval **_tv, void *data)
 		return;
 	}
 
-	WARN_ON(token->cred >= 0);
+	us = rlb_token_usec(token);
+	if (token->ops)
+		us = MAX(us, rlb_token_usec(token->ops));
 
-	us  = -token->cred;
-	us *= 1000000;
-	us /= token->rate;
+	WARN_ON(!us);
 
 	tv->tv_sec  = us / 1000000;
 	tv->tv_usec = us % 1000000;
@@ -736,12 +891,19 @@ rlb_token_dispatch(td_rlb_t *rlb, void *data)
 	td_rlb_conn_t *conn, *next;
 
 	rlb_token_refill(rlb, token);
+	if (token->ops)
+		rlb_token_refill(rlb, token->ops);
 
 	rlb_for_each_waiting_safe(conn, next, rlb) {
 		if (token->cred < 0)
 			break;
 
-		token->cred -= conn->need;
+		if (token->ops && token->ops->cred < 0)
+			break;
+
+		token->cred -= conn->need + conn->ops * token->op_cost;
+		if (token->ops)
+			token->ops->cred -= conn->ops * RLB_OPS_SCALE;
 
 		rlb_conn_respond(rlb, conn, conn->need);
 	}
@@ -753,6 +915,17 @@ rlb_token_reset(td_rlb_t *rlb, void *data)
 	td_rlb_token_t *token = data;
 
 	token->cred = token->cap;
+	if (token->ops)
+		token->ops->cred = token->ops->cap;
+}
+
+static void
+rlb_token_refund(td_rlb_t *rlb, td_rlb_conn_t *conn,
+		 unsigned long bytes, void *data)
+{
+	td_rlb_token_t *token = data;
+
+	token->cred = MIN(token->cred + (long)bytes, token->cap);
 }
 
 static void
@@ -760,8 +933,10 @@ rlb_token_destroy(td_rlb_t *rlb, void *data)
 {
 	td_rlb_token_t *token = data;
 
-	if (token)
+	if (token) {
+		free(token->ops);
 		free(token);
+	}
 }
 
 static int
@@ -783,11 +958,14 @@ rlb_token_create(td_rlb_t *rlb, int argc, char **argv, void **data)
 		const struct option longopts[] = {
 			{ "rate",        1, NULL, 'r' },
 			{ "cap",         1, NULL, 'c' },
+			{ "op-cost",     1, NULL, 'o' },
+			{ "iops",        1, NULL, 'i' },
+			{ "iops-cap",    1, NULL, 'I' },
 			{ NULL,          0, NULL,  0  }
 		};
 		int c;
 
-		c = getopt_long(argc, argv, "r:c:", longopts, NULL);
+		c = getopt_long(argc, argv, "r:c:o:i:I:", longopts, NULL);
 		if (c < 0)
 			break;
 
@@ -808,6 +986,35 @@ rlb_token_create(td_rlb_t *rlb, int argc, char **argv, void **data)
 			}
 			break;
 
+		case 'o':
+			token->op_cost = rlb_strtol(optarg);
+			if (token->op_cost < 0) {
+				ERR("invalid --op-cost");
+				goto usage;
+			}
+			break;
+
+		case 'i':
+		case 'I':
+			if (!token->ops) {
+				token->ops = calloc(1, sizeof(*token->ops));
+				if (!token->ops) {
+					err = -ENOMEM;
+					goto fail;
+				}
+			}
+
+			if (c == 'i')
+				token->ops->rate = rlb_strtol(optarg);
+			else
+				token->ops->cap  = rlb_strtol(optarg);
+
+			if (token->ops->rate < 0 || token->ops->cap < 0) {
+				ERR("invalid --iops or --iops-cap");
+				goto usage;
+			}
+			break;
+
 		case '?':
 			goto usage;
 
@@ -821,6 +1028,16 @@ rlb_token_create(td_rlb_t *rlb, int argc, char **argv, void **data)
 		goto usage;
 	}
 
+	if (token->ops) {
+		if (!token->ops->rate) {
+			ERR("--iops required with --iops-cap");
+			goto usage;
+		}
+
+		token->ops->rate *= RLB_OPS_SCALE;
+		token->ops->cap  *= RLB_OPS_SCALE;
+	}
+
 	rlb_token_reset(rlb, token);
 
 	*data = token;
@@ -828,8 +1045,7 @@ rlb_token_create(td_rlb_t *rlb, int argc, char **argv, void **data)
 	return 0;
 
 fail:
-	if (token)
-		free(token);
+	rlb_token_destroy(rlb, token);
 
 	return err;
 
@@ -844,7 +1060,9 @@ rlb_token_usage(td_rlb_t *rlb, FILE *stream, void *data)
 	fprintf(stream,
 		" {-t|--type}=token --"
 		" {-r|--rate}=<rate [KMG]>"
-		" {-c|--cap}=<size [KMG]>");
+		" {-c|--cap}=<size [KMG]>"
+		" [{-o|--op-cost}=<size [KMG]>]"
+		" [{-i|--iops}=<rate> [{-I|--iops-cap}=<ops>]]");
 }
 
 static void
@@ -852,8 +1070,14 @@ rlb_token_info(td_rlb_t *rlb, void *data)
 {
 	td_rlb_token_t *token = data;
 
-	INFO("TOKEN: rate: %ld B/s cap: %ld B cred: %ld B",
-	     token->rate, token->cap, token->cred);
+	INFO("TOKEN: rate: %ld B/s cap: %ld B cred: %ld B op-cost: %ld B",
+	     token->rate, token->cap, token->cred, token->op_cost);
+
+	if (token->ops)
+		INFO("TOKEN: iops: %ld/s cap: %ld cred: %ld",
+		     token->ops->rate / RLB_OPS_SCALE,
+		     token->ops->cap / RLB_OPS_SCALE,
+		     token->ops->cred / RLB_OPS_SCALE);
 }
 
 static struct ratelimit_ops rlb_token_ops = {
@@ -866,192 +1090,1009 @@ static struct ratelimit_ops rlb_token_ops = {
 	.timeout  = rlb_token_dispatch,
 	.dispatch = rlb_token_dispatch,
 	.reset    = rlb_token_reset,
+	.refund   = rlb_token_refund,
 };
 
 /*
- * meminfo valve
+ * hierarchical token buckets
+ *
+ * The valve's own rate and cap limit the host. Classes below it, one
+ * per tenant and each with its own socket, <bridge>.<class>, get an
+ * assured rate and a ceiling. A class within its rate sends on its
+ * own credit. Past it, it borrows what the nearest ancestor within
+ * its rate leaves unused, up to its ceiling. Connections to the bridge
+ * socket itself are in the host class, and get what the classes within
+ * their rates leave, before any borrower.
  */
 
-typedef struct ratelimit_meminfo td_rlb_meminfo_t;
+#define RLB_HTB_CLASS_MAX              RLB_LISTEN_MAX
 
-struct ratelimit_meminfo {
-	unsigned int                   period;
-	struct timeval                 ts;
+typedef struct ratelimit_htb           td_rlb_htb_t;
+typedef struct ratelimit_htb_class     td_rlb_class_t;
 
-	FILE                          *s;
+struct ratelimit_htb_class {
+	char                     *name;
+	td_rlb_class_t           *parent;
 
-	unsigned long                  total;
-	unsigned long                  dirty;
-	unsigned long                  writeback;
+	td_rlb_token_t            rate; /* assured */
+	td_rlb_token_t            ceil; /* at most, borrowing */
 
-	unsigned int                   limit_hi;
-	unsigned int                   limit_lo;
-	unsigned int                   congested;
+	unsigned long long        sent;
+	unsigned long long        borrowed;
+};
 
-	struct rlb_valve               valve;
-	struct timeval                 timeo;
+struct ratelimit_htb {
+	td_rlb_class_t            host;
+	td_rlb_class_t           *classv[RLB_HTB_CLASS_MAX];
+	int                       n_classes;
+	long                      op_cost;
+	struct timeval            timeo;
 };
 
-static void
-rlb_meminfo_info(td_rlb_t *rlb, void *data)
+static td_rlb_class_t *
+rlb_htb_class(td_rlb_htb_t *htb, td_rlb_conn_t *conn)
 {
-	td_rlb_meminfo_t *m = data;
+	return conn->cls ? : &htb->host;
+}
 
-	INFO("MEMINFO: lo/hi: %u/%u%% period: %u ms",
-	     m->limit_lo, m->limit_hi, m->period);
+/* who lends @c credit: itself within its rate, an ancestor, or none */
+static td_rlb_class_t *
+rlb_htb_lender(td_rlb_class_t *c)
+{
+	td_rlb_class_t *x, *lender = NULL;
 
-	INFO("MEMINFO: total %lu kB, dirty/writeback %lu/%lu kB",
-	     m->total, m->dirty, m->writeback);
+	for (x = c; x; x = x->parent) {
+		if (x->ceil.cred < 0)
+			return NULL;
 
-	m->valve.ops->info(rlb, m->valve.data);
+		if (!lender && x->rate.cred >= 0)
+			lender = x;
+	}
+
+	return lender;
 }
 
+/*
+ * against every ceiling on the way up, and the rates from the lender
+ * up: a borrower keeps its own rate for what it sends within it
+ */
 static void
-rlb_meminfo_close(td_rlb_meminfo_t *m)
+rlb_htb_charge(td_rlb_class_t *c, td_rlb_class_t *lender, long need)
 {
-	if (m->s) {
-		fclose(m->s);
-		m->s = NULL;
+	td_rlb_class_t *x;
+	int lent = 0;
+
+	c->sent += need;
+	if (lender != c)
+		c->borrowed += need;
+
+	for (x = c; x; x = x->parent) {
+		lent |= x == lender;
+		if (lent)
+			x->rate.cred -= need;
+		x->ceil.cred -= need;
 	}
 }
 
-static int
-rlb_meminfo_open(td_rlb_meminfo_t *m)
+/* until @c may send: within its ceiling, and lent to */
+static long long
+rlb_htb_avail(td_rlb_class_t *c)
 {
-	FILE *s;
-	int err;
-
-	m->s = NULL;
-
-	s = fopen("/proc/meminfo", "r");
-	if (!s) {
-		err = -errno;
-		goto fail;
-	}
-
-	m->s = s;
+	long long us = rlb_token_usec(&c->rate);
 
-	return 0;
+	if (c->parent)
+		us = MIN(us, rlb_htb_avail(c->parent));
 
-fail:
-	rlb_meminfo_close(m);
-	return err;
+	return MAX(us, rlb_token_usec(&c->ceil));
 }
 
-static inline int __test_bit(int n, unsigned long *bitmap)
+static void
+rlb_htb_settimeo(td_rlb_t *rlb, struct timeval **_tv, void *data)
 {
-	return !!(*bitmap & (1UL<<n));
-}
+	td_rlb_htb_t *htb = data;
+	struct timeval *tv = &htb->timeo;
+	td_rlb_conn_t *conn;
+	long long us = -1;
 
-static inline void __clear_bit(int n, unsigned long *bitmap)
-{
-	*bitmap &= ~(1UL<<n);
-}
+	if (list_empty(&rlb->wait)) {
+		*_tv = NULL;
+		return;
+	}
 
-static struct ratelimit_meminfo_scan {
-	const char    *format;
-	ptrdiff_t      ptrdiff;
-} rlb_meminfo_scanfs[] = {
-	{ "MemTotal:  %lu kB",
-	  offsetof(struct ratelimit_meminfo, total) },
-	{ "Dirty:     %lu kB",
-	  offsetof(struct ratelimit_meminfo, dirty) },
-	{ "Writeback: %lu kB",
-	  offsetof(struct ratelimit_meminfo, writeback) },
-};
+	list_for_each_entry(conn, &rlb->wait, wait) {
+		long long t = rlb_htb_avail(rlb_htb_class(htb, conn));
+		us = us < 0 ? t : MIN(us, t);
+	}
 
-static int
-rlb_meminfo_scan(td_rlb_meminfo_t *m)
-{
-	const int n_keys = ARRAY_SIZE(rlb_meminfo_scanfs);
-	unsigned long pending;
-	int err;
+	WARN_ON(!us);
+	us = MAX(us, 1);
 
-	err = rlb_meminfo_open(m);
-	if (err)
-		goto fail;
+	tv->tv_sec  = us / 1000000;
+	tv->tv_usec = us % 1000000;
 
-	pending = (1UL << n_keys) - 1;
+	*_tv = tv;
+}
 
-	do {
-		char buf[80], *b;
-		int i;
+static void
+rlb_htb_refill(td_rlb_t *rlb, td_rlb_htb_t *htb)
+{
+	td_rlb_class_t *c;
+	int i;
 
-		b = fgets(buf, sizeof(buf), m->s);
-		if (!b)
-			break;
+	rlb_token_refill(rlb, &htb->host.rate);
+	rlb_token_refill(rlb, &htb->host.ceil);
 
-		for (i = 0; i < n_keys; i++) {
-			struct ratelimit_meminfo_scan *scan;
-			unsigned long val, *ptr;
-			int n;
+	for (i = 0; i < htb->n_classes; i++) {
+		c = htb->classv[i];
+		rlb_token_refill(rlb, &c->rate);
+		rlb_token_refill(rlb, &c->ceil);
+	}
+}
 
-			if (!__test_bit(i, &pending))
-				continue;
+/* classes within their rates first, then the borrowers */
+static void
+rlb_htb_dispatch(td_rlb_t *rlb, void *data)
+{
+	td_rlb_htb_t *htb = data;
+	td_rlb_conn_t *conn, *next;
+	td_rlb_class_t *c, *lender;
+	int borrow;
 
-			scan = &rlb_meminfo_scanfs[i];
+	rlb_htb_refill(rlb, htb);
 
-			n = sscanf(buf, scan->format, &val);
-			if (n != 1)
-				continue;
+	for (borrow = 0; borrow <= 1; borrow++)
+		rlb_for_each_waiting_safe(conn, next, rlb) {
+			c      = rlb_htb_class(htb, conn);
+			lender = rlb_htb_lender(c);
 
-			ptr  = (void*)m + scan->ptrdiff;
-			*ptr = val;
+			if (!lender || (!borrow && lender != c))
+				continue;
 
-			__clear_bit(i, &pending);
+			rlb_htb_charge(c, lender, conn->need +
+				       conn->ops * htb->op_cost);
+			rlb_conn_respond(rlb, conn, conn->need);
 		}
+}
 
-	} while (pending);
+static void
+rlb_htb_reset_class(td_rlb_class_t *c)
+{
+	c->rate.cred = c->rate.cap;
+	c->ceil.cred = c->ceil.cap;
+}
 
-	if (pending) {
-		err = -ESRCH;
-		goto fail;
-	}
+static void
+rlb_htb_reset(td_rlb_t *rlb, void *data)
+{
+	td_rlb_htb_t *htb = data;
+	int i;
 
-	err = 0;
-fail:
-	rlb_meminfo_close(m);
-	return err;
+	rlb_htb_reset_class(&htb->host);
+
+	for (i = 0; i < htb->n_classes; i++)
+		rlb_htb_reset_class(htb->classv[i]);
 }
 
+/*
+ * the lender charged is not known any more: ceilings on the way up
+ * and the class's own rate get the bytes back, up to their caps
+ */
 static void
-rlb_meminfo_usage(td_rlb_t *rlb, FILE *stream, void *data)
+rlb_htb_refund(td_rlb_t *rlb, td_rlb_conn_t *conn,
+	       unsigned long bytes, void *data)
 {
-	td_rlb_meminfo_t *m = data;
+	td_rlb_htb_t *htb = data;
+	td_rlb_class_t *c, *x;
 
-	fprintf(stream,
-		" {-t|--type}=meminfo "
-		" {-H|--high}=<percent> {-L|--low}=<percent>"
-		" {-p|--period}=<msecs> --");
+	c = rlb_htb_class(htb, conn);
+	c->rate.cred = MIN(c->rate.cred + (long)bytes, c->rate.cap);
 
-	if (m && m->valve.ops) {
-		m->valve.ops->usage(rlb, stream, m->valve.data);
-	} else
-		fprintf(stream, " {-t|--type}={...}");
+	for (x = c; x; x = x->parent)
+		x->ceil.cred = MIN(x->ceil.cred + (long)bytes, x->ceil.cap);
 }
 
 static void
-rlb_meminfo_destroy(td_rlb_t *rlb, void *data)
+rlb_htb_destroy(td_rlb_t *rlb, void *data)
 {
-	td_rlb_meminfo_t *m = data;
+	td_rlb_htb_t *htb = data;
+	int i;
 
-	if (m) {
-		if (m->valve.data) {
-			m->valve.ops->destroy(rlb, m->valve.data);
-			m->valve.data = NULL;
-		}
+	if (!htb)
+		return;
 
-		free(m);
+	for (i = 0; i < htb->n_classes; i++) {
+		free(htb->classv[i]->name);
+		free(htb->classv[i]);
 	}
+
+	free(htb);
 }
 
-static int
-rlb_meminfo_create(td_rlb_t *rlb, int argc, char **argv, void **data)
+static td_rlb_class_t *
+rlb_htb_find_class(td_rlb_htb_t *htb, const char *name)
 {
-	td_rlb_meminfo_t *m;
+	int i;
+
+	for (i = 0; i < htb->n_classes; i++)
+		if (!strcmp(htb->classv[i]->name, name))
+			return htb->classv[i];
+
+	return NULL;
+}
+
+/* <name>:<rate>[:<ceil>[:<parent>]], the parent defined before */
+static int
+rlb_htb_add_class(td_rlb_t *rlb, td_rlb_htb_t *htb, char *arg)
+{
+	char *name, *rate, *ceil, *parent;
+	td_rlb_class_t *c;
+
+	name   = strsep(&arg, ":");
+	rate   = strsep(&arg, ":");
+	ceil   = strsep(&arg, ":");
+	parent = strsep(&arg, ":");
+
+	if (!*name || strchr(name, '/') || !rate || arg) {
+		ERR("invalid --class");
+		return -EINVAL;
+	}
+
+	if (rlb_htb_find_class(htb, name)) {
+		ERR("class %s defined twice", name);
+		return -EINVAL;
+	}
+
+	if (htb->n_classes >= RLB_HTB_CLASS_MAX) {
+		ERR("more than %d classes", RLB_HTB_CLASS_MAX);
+		return -EINVAL;
+	}
+
+	c = calloc(1, sizeof(*c));
+	if (!c)
+		return -ENOMEM;
+
+	htb->classv[htb->n_classes++] = c;
+
+	c->name = strdup(name);
+	if (!c->name)
+		return -ENOMEM;
+
+	c->parent = &htb->host;
+	if (parent && *parent) {
+		c->parent = rlb_htb_find_class(htb, parent);
+		if (!c->parent) {
+			ERR("class %s: no parent %s", name, parent);
+			return -EINVAL;
+		}
+	}
+
+	c->rate.rate = rlb_strtol(rate);
+	c->ceil.rate = ceil && *ceil ? rlb_strtol(ceil) : c->parent->ceil.rate;
+
+	if (c->rate.rate <= 0 || c->ceil.rate < c->rate.rate) {
+		ERR("class %s: invalid rate or ceiling", name);
+		return -EINVAL;
+	}
+
+	c->rate.cap = htb->host.rate.cap;
+	c->ceil.cap = htb->host.ceil.cap;
+
+	return 0;
+}
+
+static int
+rlb_htb_create(td_rlb_t *rlb, int argc, char **argv, void **data)
+{
+	td_rlb_htb_t *htb;
+	char *classv[RLB_HTB_CLASS_MAX];
+	int i, n_classes = 0, err;
+
+	htb = calloc(1, sizeof(*htb));
+	if (!htb) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	htb->host.name = "host";
+
+	do {
+		const struct option longopts[] = {
+			{ "rate",        1, NULL, 'r' },
+			{ "cap",         1, NULL, 'c' },
+			{ "class",       1, NULL, 'C' },
+			{ "op-cost",     1, NULL, 'o' },
+			{ NULL,          0, NULL,  0  }
+		};
+		int c;
+
+		c = getopt_long(argc, argv, "r:c:C:o:", longopts, NULL);
+		if (c < 0)
+			break;
+
+		switch (c) {
+		case 'r':
+			htb->host.rate.rate = rlb_strtol(optarg);
+			if (htb->host.rate.rate < 0) {
+				ERR("invalid --rate");
+				goto usage;
+			}
+			break;
+
+		case 'c':
+			htb->host.rate.cap = rlb_strtol(optarg);
+			if (htb->host.rate.cap < 0) {
+				ERR("invalid --cap");
+				goto usage;
+			}
+			break;
+
+		case 'o':
+			htb->op_cost = rlb_strtol(optarg);
+			if (htb->op_cost < 0) {
+				ERR("invalid --op-cost");
+				goto usage;
+			}
+			break;
+
+		case 'C':
+			if (n_classes >= RLB_HTB_CLASS_MAX) {
+				ERR("more than %d classes",
+				    RLB_HTB_CLASS_MAX);
+				goto usage;
+			}
+			classv[n_classes++] = optarg;
+			break;
+
+		case '?':
+			goto usage;
+
+		default:
+			BUG();
+		}
+	} while (1);
+
+	if (!htb->host.rate.rate) {
+		ERR("--rate required");
+		goto usage;
+	}
+
+	htb->host.ceil = htb->host.rate;
+
+	for (i = 0; i < n_classes; i++) {
+		err = rlb_htb_add_class(rlb, htb, classv[i]);
+		if (err)
+			goto fail;
+	}
+
+	for (i = 0; i < htb->n_classes; i++) {
+		err = rlb_sock_listen(rlb, htb->classv[i]->name,
+				      htb->classv[i]);
+		if (err)
+			goto fail;
+	}
+
+	rlb_htb_reset(rlb, htb);
+
+	*data = htb;
+
+	return 0;
+
+fail:
+	rlb_htb_destroy(rlb, htb);
+
+	return err;
+
+usage:
+	err = -EINVAL;
+	goto fail;
+}
+
+static void
+rlb_htb_usage(td_rlb_t *rlb, FILE *stream, void *data)
+{
+	fprintf(stream,
+		" {-t|--type}=htb --"
+		" {-r|--rate}=<rate [KMG]>"
+		" {-c|--cap}=<size [KMG]>"
+		" [{-o|--op-cost}=<size [KMG]>]"
+		" [{-C|--class}=<name>:<rate>[:<ceil>[:<parent>]] ...]");
+}
+
+static void
+rlb_htb_info_class(td_rlb_class_t *c)
+{
+	INFO("HTB: %s%s%s: rate: %ld B/s ceil: %ld B/s"
+	     " cred: %ld/%ld B sent: %llu B borrowed: %llu B",
+	     c->name, c->parent ? " < " : "", c->parent ? c->parent->name : "",
+	     c->rate.rate, c->ceil.rate, c->rate.cred, c->ceil.cred,
+	     c->sent, c->borrowed);
+}
+
+static void
+rlb_htb_info(td_rlb_t *rlb, void *data)
+{
+	td_rlb_htb_t *htb = data;
+	int i;
+
+	rlb_htb_info_class(&htb->host);
+
+	for (i = 0; i < htb->n_classes; i++)
+		rlb_htb_info_class(htb->classv[i]);
+}
+
+static struct ratelimit_ops rlb_htb_ops = {
+	.usage    = rlb_htb_usage,
+	.create   = rlb_htb_create,
+	.destroy  = rlb_htb_destroy,
+	.info     = rlb_htb_info,
+
+	.settimeo = rlb_htb_settimeo,
+	.timeout  = rlb_htb_dispatch,
+	.dispatch = rlb_htb_dispatch,
+	.reset    = rlb_htb_reset,
+	.refund   = rlb_htb_refund,
+};
+
+/*
+ * meminfo valve
+ */
+
+typedef struct ratelimit_meminfo td_rlb_meminfo_t;
+
+struct ratelimit_meminfo {
+	unsigned int                   period;
+	struct timeval                 ts;
+
+	FILE                          *s;
+
+	unsigned long                  total;
+	unsigned long                  dirty;
+	unsigned long                  writeback;
+
+	unsigned int                   limit_hi;
+	unsigned int                   limit_lo;
+	unsigned int                   congested;
+
+	struct rlb_valve               valve;
+	struct timeval                 timeo;
+};
+
+static void
+rlb_meminfo_info(td_rlb_t *rlb, void *data)
+{
+	td_rlb_meminfo_t *m = data;
+
+	INFO("MEMINFO: lo/hi: %u/%u%% period: %u ms",
+	     m->limit_lo, m->limit_hi, m->period);
+
+	INFO("MEMINFO: total %lu kB, dirty/writeback %lu/%lu kB",
+	     m->total, m->dirty, m->writeback);
+
+	m->valve.ops->info(rlb, m->valve.data);
+}
+
+static void
+rlb_meminfo_close(td_rlb_meminfo_t *m)
+{
+	if (m->s) {
+		fclose(m->s);
+		m->s = NULL;
+	}
+}
+
+static int
+rlb_meminfo_open(td_rlb_meminfo_t *m)
+{
+	FILE *s;
+	int err;
+
+	m->s = NULL;
+
+	s = fopen("/proc/meminfo", "r");
+	if (!s) {
+		err = -errno;
+		goto fail;
+	}
+
+	m->s = s;
+
+	return 0;
+
+fail:
+	rlb_meminfo_close(m);
+	return err;
+}
+
+static inline int __test_bit(int n, unsigned long *bitmap)
+{
+	return !!(*bitmap & (1UL<<n));
+}
+
+static inline void __clear_bit(int n, unsigned long *bitmap)
+{
+	*bitmap &= ~(1UL<<n);
+}
+
+static struct ratelimit_meminfo_scan {
+	const char    *format;
+	ptrdiff_t      ptrdiff;
+} rlb_meminfo_scanfs[] = {
+	{ "MemTotal:  %lu kB",
+	  offsetof(struct ratelimit_meminfo, total) },
+	{ "Dirty:     %lu kB",
+	  offsetof(struct ratelimit_meminfo, dirty) },
+	{ "Writeback: %lu kB",
+	  offsetof(struct ratelimit_meminfo, writeback) },
+};
+
+static int
+rlb_meminfo_scan(td_rlb_meminfo_t *m)
+{
+	const int n_keys = ARRAY_SIZE(rlb_meminfo_scanfs);
+	unsigned long pending;
+	int err;
+
+	err = rlb_meminfo_open(m);
+	if (err)
+		goto fail;
+
+	pending = (1UL << n_keys) - 1;
+
+	do {
+		char buf[80], *b;
+		int i;
+
+		b = fgets(buf, sizeof(buf), m->s);
+		if (!b)
+			break;
+
+		for (i = 0; i < n_keys; i++) {
+			struct ratelimit_meminfo_scan *scan;
+			unsigned long val, *ptr;
+			int n;
+
+			if (!__test_bit(i, &pending))
+				continue;
+
+			scan = &rlb_meminfo_scanfs[i];
+
+			n = sscanf(buf, scan->format, &val);
+			if (n != 1)
+				continue;
+
+			ptr  = (void*)m + scan->ptrdiff;
+			*ptr = val;
+
+			__clear_bit(i, &pending);
+		}
+
+	} while (pending);
+
+	if (pending) {
+		err = -ESRCH;
+		goto fail;
+	}
+
+	err = 0;
+fail:
+	rlb_meminfo_close(m);
+	return err;
+}
+
+static void
+rlb_meminfo_usage(td_rlb_t *rlb, FILE *stream, void *data)
+{
+	td_rlb_meminfo_t *m = data;
+
+	fprintf(stream,
+		" {-t|--type}=meminfo "
+		" {-H|--high}=<percent> {-L|--low}=<percent>"
+		" {-p|--period}=<msecs> --");
+
+	if (m && m->valve.ops) {
+		m->valve.ops->usage(rlb, stream, m->valve.data);
+	} else
+		fprintf(stream, " {-t|--type}={...}");
+}
+
+static void
+rlb_meminfo_destroy(td_rlb_t *rlb, void *data)
+{
+	td_rlb_meminfo_t *m = data;
+
+	if (m) {
+		if (m->valve.data) {
+			m->valve.ops->destroy(rlb, m->valve.data);
+			m->valve.data = NULL;
+		}
+
+		free(m);
+	}
+}
+
+static int
+rlb_meminfo_create(td_rlb_t *rlb, int argc, char **argv, void **data)
+{
+	td_rlb_meminfo_t *m;
+	const char *type;
+	long dbr;
+	int err;
+
+	m = calloc(1, sizeof(*m));
+	if (!m) {
+		PERROR("calloc");
+		err = -errno;
+		goto fail;
+	}
+
+	type      = NULL;
+	m->period = 100;
+
+	do {
+		const struct option longopts[] = {
+			{ "period",    1, NULL, 'p' },
+			{ "type",      1, NULL, 't' },
+			{ "high",      1, NULL, 'H' },
+			{ "low",       1, NULL, 'L' },
+			{ NULL,        0, NULL,  0  }
+		};
+		int c;
+
+		c = getopt_long(argc, argv, "p:t:H:L:", longopts, NULL);
+		if (c < 0)
+			break;
+
+		switch (c) {
+		case 'p':
+			m->period = rlb_strtol(optarg);
+			if (m->period < 0)
+				goto usage;
+			break;
+
+		case 'H':
+			m->limit_hi = strtoul(optarg, NULL, 0);
+			break;
+
+		case 'L':
+			m->limit_lo = strtoul(optarg, NULL, 0);
+			break;
+
+		case 't':
+			type = optarg;
+			break;
+
+		case '?':
+			goto usage;
+
+		default:
+			BUG();
+		}
+	} while (1);
+
+	if (!m->limit_hi || !m->limit_lo) {
+		ERR("--high/--low required");
+		goto usage;
+	}
+
+	if (m->limit_lo >= m->limit_hi) {
+		ERR("invalid --high/--low ratio");
+		goto usage;
+	}
+
+	if (!type) {
+		ERR("(sub) --type required");
+		goto usage;
+	}
+
+	dbr = sysctl_strtoul("vm/dirty_background_ratio");
+	if (dbr < 0) {
+		err = dbr;
+		ERR("vm/dirty_background_ratio: %d", err);
+		goto fail;
+	}
+
+	if (0 && m->limit_lo < dbr) {
+		ERR("--low %u is less than vm.dirty_background_ratio (= %ld)",
+		    m->limit_lo, dbr);
+		err = -EINVAL;
+		goto fail;
+	}
+
+	*data = m;
+
+	rlb_argv_shift(&optind, &argc, &argv);
+
+	err = rlb_create_valve(rlb, &m->valve, type, argc, argv);
+	if (err) {
+		if (err == -EINVAL)
+			goto usage;
+		goto fail;
+	}
+
+	err = rlb_meminfo_scan(m);
+	if (err) {
+		PERROR("/proc/meminfo");
+		goto fail;
+	}
+
+	return 0;
+
+fail:
+	ERR("err = %d", err);
+	return err;
+
+usage:
+	err = -EINVAL;
+	return err;
+};
+
+static void
+rlb_meminfo_settimeo(td_rlb_t *rlb, struct timeval **_tv, void *data)
+{
+	td_rlb_meminfo_t *m = data;
+	int idle;
+
+	idle = list_empty(&rlb->wait);
+	BUG_ON(!idle && !m->congested);
+
+	if (m->congested) {
+		m->valve.ops->settimeo(rlb, _tv, m->valve.data);
+		return;
+	}
+
+	*_tv = NULL;
+}
+
+static void
+rlb_meminfo_timeout(td_rlb_t *rlb, void *data)
+{
+	td_rlb_meminfo_t *m = data;
+
+	WARN_ON(!m->congested);
+
+	if (m->congested)
+		m->valve.ops->timeout(rlb, m->valve.data);
+}
+
+static int
+rlb_meminfo_test_high(td_rlb_t *rlb, td_rlb_meminfo_t *m, long long cred)
+{
+	long long lo;
+
+	if (m->congested) {
+		/* hysteresis */
+
+		lo  = m->total;
+		lo *= m->limit_lo;
+		lo /= 100;
+
+		if (cred >= lo)
+			return 0;
+
+	} else
+		if (cred <= 0) {
+			m->valve.ops->reset(rlb, m->valve.data);
+			return 1;
+		}
+
+	return m->congested;
+}
+
+static void
+rlb_meminfo_dispatch_low(td_rlb_t *rlb, td_rlb_meminfo_t *m,
+			 long long *_cred)
+{
+	td_rlb_conn_t *conn, *next;
+	long long cred = *_cred, grant;
+
+	rlb_for_each_waiting_safe(conn, next, rlb) {
+
+		if (cred <= 0)
+			break;
+
+		grant = MIN(cred, conn->need);
+
+		rlb_conn_respond(rlb, conn, grant);
+
+		cred -= grant;
+	}
+
+	*_cred = cred;
+}
+
+static void
+rlb_meminfo_dispatch(td_rlb_t *rlb, void *data)
+{
+	td_rlb_meminfo_t *m = data;
+	long long us, hi, cred, dirty, pend;
+
+	/* we run only once per m->period */
+
+	us = rlb_usec_since(rlb, &m->ts);
+	if (us / 1000 > m->period) {
+		rlb_meminfo_scan(m);
+		m->ts = rlb->now;
+	}
+
+	/* uncongested credit:
+	   memory below hi watermark minus pending I/O */
+
+	hi  = m->total;
+	hi *= m->limit_hi;
+	hi /= 100;
+
+	dirty = m->dirty + m->writeback;
+
+	cred  = hi - dirty;
+	cred *= 1000;
+
+	pend  = rlb_pending(rlb);
+	cred -= pend;
+
+	m->congested = rlb_meminfo_test_high(rlb, m, cred);
+
+	DBG(3, "dirty=%lld (%lld) pend=%llu cred=%lld %s",
+	    dirty, dirty * 100 / m->total, pend, cred,
+	    m->congested ? "congested" : "");
+
+	if (!m->congested) {
+		rlb_meminfo_dispatch_low(rlb, m, &cred);
+
+		m->congested = rlb_meminfo_test_high(rlb, m, cred);
+	}
+
+	if (m->congested)
+		m->valve.ops->dispatch(rlb, m->valve.data);
+}
+
+static struct ratelimit_ops rlb_meminfo_ops = {
+	.usage    = rlb_meminfo_usage,
+	.create   = rlb_meminfo_create,
+	.destroy  = rlb_meminfo_destroy,
+	.info     = rlb_meminfo_info,
+
+	.settimeo = rlb_meminfo_settimeo,
+	.timeout  = rlb_meminfo_timeout,
+	.dispatch = rlb_meminfo_dispatch,
+};
+
+/*
+ * psi valve
+ *
+ * Runs at full rate until the kernel reports a stall: a PSI trigger,
+ * on memory or io pressure, host-wide or of a cgroup, fires when
+ * tasks stalled for more than <stall> us over the window. The
+ * sub-valve limits from then on, until no trigger fired for --hold.
+ */
+
+typedef struct ratelimit_psi td_rlb_psi_t;
+
+#define RLB_PSI_MEMORY            0
+#define RLB_PSI_IO                1
+#define RLB_PSI_MAX               2
+
+static const char *rlb_psi_names[RLB_PSI_MAX] = { "memory", "io" };
+
+struct ratelimit_psi {
+	const char                    *cgroup;
+	int                            full;
+	long                           window; /* ms */
+	long                           hold;   /* ms */
+
+	struct {
+		long                   stall;  /* us */
+		int                    fd;
+		unsigned long long     events;
+	} trig[RLB_PSI_MAX];
+
+	struct timeval                 ts;     /* last stall */
+	unsigned int                   congested;
+
+	struct rlb_valve               valve;
+	struct timeval                 timeo;
+};
+
+static void
+rlb_psi_info(td_rlb_t *rlb, void *data)
+{
+	td_rlb_psi_t *m = data;
+	int i;
+
+	INFO("PSI: %s%s %s window: %ld ms hold: %ld ms%s",
+	     m->cgroup ? "cgroup " : "host", m->cgroup ? : "",
+	     m->full ? "full" : "some", m->window, m->hold,
+	     m->congested ? " congested" : "");
+
+	for (i = 0; i < RLB_PSI_MAX; i++)
+		if (m->trig[i].fd >= 0)
+			INFO("PSI: %s stall: %ld us, events: %llu",
+			     rlb_psi_names[i], m->trig[i].stall,
+			     m->trig[i].events);
+
+	m->valve.ops->info(rlb, m->valve.data);
+}
+
+static int
+rlb_psi_trigger(td_rlb_psi_t *m, int i)
+{
+	char path[PATH_MAX], trig[64];
+	int fd, n, err;
+
+	if (m->cgroup)
+		n = snprintf(path, sizeof(path), "%s/%s.pressure",
+			     m->cgroup, rlb_psi_names[i]);
+	else
+		n = snprintf(path, sizeof(path), "/proc/pressure/%s",
+			     rlb_psi_names[i]);
+	if (n >= sizeof(path))
+		return -ENAMETOOLONG;
+
+	fd = open(path, O_RDWR|O_NONBLOCK);
+	if (fd < 0) {
+		err = -errno;
+		PERROR("%s", path);
+		return err;
+	}
+
+	n = snprintf(trig, sizeof(trig), "%s %ld %ld",
+		     m->full ? "full" : "some",
+		     m->trig[i].stall, m->window * 1000);
+
+	if (write(fd, trig, n + 1) < 0) {
+		err = -errno;
+		PERROR("%s: '%s'", path, trig);
+		close(fd);
+		return err;
+	}
+
+	m->trig[i].fd = fd;
+
+	return 0;
+}
+
+static void
+rlb_psi_usage(td_rlb_t *rlb, FILE *stream, void *data)
+{
+	td_rlb_psi_t *m = data;
+
+	fprintf(stream,
+		" {-t|--type}=psi "
+		" [{-M|--memory}=<stall usecs>] [{-I|--io}=<stall usecs>]"
+		" [{-w|--window}=<msecs>] [{-h|--hold}=<msecs>]"
+		" [{-g|--cgroup}=<dir>] [-f|--full] --");
+
+	if (m && m->valve.ops) {
+		m->valve.ops->usage(rlb, stream, m->valve.data);
+	} else
+		fprintf(stream, " {-t|--type}={...}");
+}
+
+static void
+rlb_psi_destroy(td_rlb_t *rlb, void *data)
+{
+	td_rlb_psi_t *m = data;
+	int i;
+
+	if (m) {
+		if (m->valve.data) {
+			m->valve.ops->destroy(rlb, m->valve.data);
+			m->valve.data = NULL;
+		}
+
+		for (i = 0; i < RLB_PSI_MAX; i++)
+			if (m->trig[i].fd >= 0)
+				close(m->trig[i].fd);
+
+		free(m);
+	}
+}
+
+static int
+rlb_psi_create(td_rlb_t *rlb, int argc, char **argv, void **data)
+{
+	td_rlb_psi_t *m;
 	const char *type;
-	long dbr;
-	int err;
+	int i, n, err;
 
 	m = calloc(1, sizeof(*m));
 	if (!m) {
@@ -1060,235 +2101,585 @@ rlb_meminfo_create(td_rlb_t *rlb, int argc, char **argv, void **data)
 		goto fail;
 	}
 
+	for (i = 0; i < RLB_PSI_MAX; i++)
+		m->trig[i].fd = -1;
+
 	type      = NULL;
-	m->period = 100;
+	m->window = 1000;
+	m->hold   = 1000;
+
+	*data = m;
 
 	do {
 		const struct option longopts[] = {
-			{ "period",    1, NULL, 'p' },
+			{ "memory",    1, NULL, 'M' },
+			{ "io",        1, NULL, 'I' },
+			{ "window",    1, NULL, 'w' },
+			{ "hold",      1, NULL, 'h' },
+			{ "cgroup",    1, NULL, 'g' },
+			{ "full",      0, NULL, 'f' },
 			{ "type",      1, NULL, 't' },
-			{ "high",      1, NULL, 'H' },
-			{ "low",       1, NULL, 'L' },
 			{ NULL,        0, NULL,  0  }
 		};
 		int c;
 
-		c = getopt_long(argc, argv, "p:t:H:L:", longopts, NULL);
+		c = getopt_long(argc, argv, "M:I:w:h:g:ft:", longopts, NULL);
 		if (c < 0)
 			break;
 
 		switch (c) {
-		case 'p':
-			m->period = rlb_strtol(optarg);
-			if (m->period < 0)
+		case 'M':
+			m->trig[RLB_PSI_MEMORY].stall = rlb_strtol(optarg);
+			if (m->trig[RLB_PSI_MEMORY].stall <= 0)
+				goto usage;
+			break;
+
+		case 'I':
+			m->trig[RLB_PSI_IO].stall = rlb_strtol(optarg);
+			if (m->trig[RLB_PSI_IO].stall <= 0)
+				goto usage;
+			break;
+
+		case 'w':
+			m->window = rlb_strtol(optarg);
+			if (m->window <= 0)
+				goto usage;
+			break;
+
+		case 'h':
+			m->hold = rlb_strtol(optarg);
+			if (m->hold < 0)
 				goto usage;
 			break;
 
-		case 'H':
-			m->limit_hi = strtoul(optarg, NULL, 0);
-			break;
+		case 'g':
+			m->cgroup = optarg;
+			break;
+
+		case 'f':
+			m->full = 1;
+			break;
+
+		case 't':
+			type = optarg;
+			break;
+
+		case '?':
+			goto usage;
+
+		default:
+			BUG();
+		}
+	} while (1);
+
+	for (i = n = 0; i < RLB_PSI_MAX; i++)
+		n += !!m->trig[i].stall;
+
+	if (!n) {
+		ERR("--memory and/or --io required");
+		goto usage;
+	}
+
+	if (!type) {
+		ERR("(sub) --type required");
+		goto usage;
+	}
+
+	rlb_argv_shift(&optind, &argc, &argv);
+
+	err = rlb_create_valve(rlb, &m->valve, type, argc, argv);
+	if (err) {
+		if (err == -EINVAL)
+			goto usage;
+		goto fail;
+	}
+
+	for (i = 0; i < RLB_PSI_MAX; i++)
+		if (m->trig[i].stall) {
+			err = rlb_psi_trigger(m, i);
+			if (err)
+				goto fail;
+		}
+
+	return 0;
+
+fail:
+	ERR("err = %d", err);
+	return err;
+
+usage:
+	err = -EINVAL;
+	return err;
+}
+
+static void
+rlb_psi_fdset(td_rlb_t *rlb, fd_set *xfds, int *nfds, void *data)
+{
+	td_rlb_psi_t *m = data;
+	int i;
+
+	for (i = 0; i < RLB_PSI_MAX; i++)
+		if (m->trig[i].fd >= 0) {
+			FD_SET(m->trig[i].fd, xfds);
+			*nfds = MAX(*nfds, m->trig[i].fd);
+		}
+}
+
+/* a stall: limit through the sub-valve, from a full bucket */
+static int
+rlb_psi_fdevent(td_rlb_t *rlb, fd_set *xfds, void *data)
+{
+	td_rlb_psi_t *m = data;
+	int i, n = 0;
+
+	for (i = 0; i < RLB_PSI_MAX; i++)
+		if (m->trig[i].fd >= 0 && FD_ISSET(m->trig[i].fd, xfds)) {
+			m->trig[i].events++;
+			n++;
+		}
+
+	if (n) {
+		if (!m->congested) {
+			DBG(3, "stalled, congested");
+			m->valve.ops->reset(rlb, m->valve.data);
+		}
+
+		m->congested = 1;
+		m->ts        = rlb->now;
+	}
+
+	return n;
+}
+
+static long long
+rlb_psi_held(td_rlb_t *rlb, td_rlb_psi_t *m)
+{
+	return m->hold * 1000 - rlb_usec_since(rlb, &m->ts);
+}
+
+static void
+rlb_psi_settimeo(td_rlb_t *rlb, struct timeval **_tv, void *data)
+{
+	td_rlb_psi_t *m = data;
+	struct timeval *tv = &m->timeo;
+	long long us;
+
+	if (!m->congested) {
+		*_tv = NULL;
+		return;
+	}
+
+	us = MAX(rlb_psi_held(rlb, m), 1);
+
+	m->valve.ops->settimeo(rlb, _tv, m->valve.data);
+	if (*_tv)
+		us = MIN(us, rlb_tv_usec(*_tv));
+
+	tv->tv_sec  = us / 1000000;
+	tv->tv_usec = us % 1000000;
+
+	*_tv = tv;
+}
+
+static void
+rlb_psi_dispatch_all(td_rlb_t *rlb, td_rlb_psi_t *m)
+{
+	td_rlb_conn_t *conn, *next;
+
+	rlb_for_each_waiting_safe(conn, next, rlb)
+		rlb_conn_respond(rlb, conn, conn->need);
+}
+
+static void
+rlb_psi_dispatch(td_rlb_t *rlb, void *data)
+{
+	td_rlb_psi_t *m = data;
+
+	if (m->congested && rlb_psi_held(rlb, m) <= 0) {
+		DBG(3, "uncongested");
+		m->congested = 0;
+	}
+
+	if (m->congested)
+		m->valve.ops->dispatch(rlb, m->valve.data);
+	else
+		rlb_psi_dispatch_all(rlb, m);
+}
+
+static void
+rlb_psi_refund(td_rlb_t *rlb, td_rlb_conn_t *conn,
+	       unsigned long bytes, void *data)
+{
+	td_rlb_psi_t *m = data;
+
+	if (m->valve.ops->refund)
+		m->valve.ops->refund(rlb, conn, bytes, m->valve.data);
+}
+
+static struct ratelimit_ops rlb_psi_ops = {
+	.usage    = rlb_psi_usage,
+	.create   = rlb_psi_create,
+	.destroy  = rlb_psi_destroy,
+	.info     = rlb_psi_info,
+
+	.settimeo = rlb_psi_settimeo,
+	.timeout  = rlb_psi_dispatch,
+	.dispatch = rlb_psi_dispatch,
+	.refund   = rlb_psi_refund,
+	.fdset    = rlb_psi_fdset,
+	.fdevent  = rlb_psi_fdevent,
+};
+
+/*
+ * latency valve
+ *
+ * Connections to <bridge>.<class> are the protected class: never held,
+ * and asked to report their completion latencies. Everyone else is
+ * best effort. Every --window, the class's --percentile latency is
+ * held against --target. Over it, best effort is throttled to half of
+ * what it sent in the window, and halved again every window it stays
+ * over. Within it, the rate grows by a quarter per window, until best
+ * effort uses less than half of it, which ends throttling. Windows of
+ * fewer than RLB_LAT_MIN_SAMPLES completions are within target.
+ */
+
+#define RLB_LAT_MIN_SAMPLES       16
+
+typedef struct ratelimit_latency td_rlb_latency_t;
+
+struct ratelimit_latency {
+	const char                    *cls;
+	long                           target;   /* us */
+	long                           permille;
+	long                           window;   /* ms */
+	long                           min_rate;
 
-		case 'L':
-			m->limit_lo = strtoul(optarg, NULL, 0);
-			break;
+	struct td_histogram            hist;     /* this window */
+	struct timeval                 ts;       /* window start */
+	unsigned long long             sent;     /* best effort, this window */
+	unsigned long long             last;     /* last window's percentile */
 
-		case 't':
-			type = optarg;
-			break;
+	td_rlb_token_t                 token;    /* rate 0: unthrottled */
 
-		case '?':
-			goto usage;
+	unsigned long long             windows;
+	unsigned long long             over;
+	struct timeval                 timeo;
+};
 
-		default:
-			BUG();
-		}
-	} while (1);
+#define rlb_latency_protected(_m, _conn) ((_conn)->cls == (_m))
 
-	if (!m->limit_hi || !m->limit_lo) {
-		ERR("--high/--low required");
-		goto usage;
-	}
+static void
+rlb_latency_info(td_rlb_t *rlb, void *data)
+{
+	td_rlb_latency_t *m = data;
 
-	if (m->limit_lo >= m->limit_hi) {
-		ERR("invalid --high/--low ratio");
-		goto usage;
-	}
+	INFO("LATENCY: class %s p%ld.%ld target: %ld us window: %ld ms"
+	     " last: %llu us, over in %llu/%llu windows",
+	     m->cls, m->permille / 10, m->permille % 10, m->target,
+	     m->window, m->last, m->over, m->windows);
 
-	if (!type) {
-		ERR("(sub) --type required");
-		goto usage;
-	}
+	if (m->token.rate)
+		INFO("LATENCY: best effort rate: %ld B/s cred: %ld B",
+		     m->token.rate, m->token.cred);
+	else
+		INFO("LATENCY: best effort unthrottled");
+}
 
-	dbr = sysctl_strtoul("vm/dirty_background_ratio");
-	if (dbr < 0) {
-		err = dbr;
-		ERR("vm/dirty_background_ratio: %d", err);
-		goto fail;
-	}
+static void
+rlb_latency_throttle(td_rlb_latency_t *m, long rate)
+{
+	if (!m->token.rate)
+		m->token.cred = 0;
 
-	if (0 && m->limit_lo < dbr) {
-		ERR("--low %u is less than vm.dirty_background_ratio (= %ld)",
-		    m->limit_lo, dbr);
-		err = -EINVAL;
-		goto fail;
-	}
+	m->token.rate = MAX(rate, m->min_rate);
+	m->token.cap  = m->token.rate / 10;
+	m->token.cred = MIN(m->token.cred, m->token.cap);
+}
 
-	*data = m;
+static void
+rlb_latency_window(td_rlb_t *rlb, td_rlb_latency_t *m)
+{
+	long long us, rate;
 
-	rlb_argv_shift(&optind, &argc, &argv);
+	us   = MAX(rlb_usec_since(rlb, &m->ts), 1);
+	rate = m->sent * 1000000 / us;
 
-	err = rlb_create_valve(rlb, &m->valve, type, argc, argv);
-	if (err) {
-		if (err == -EINVAL)
-			goto usage;
-		goto fail;
-	}
+	m->last = 0;
+	if (m->hist.count >= RLB_LAT_MIN_SAMPLES)
+		m->last = td_histogram_percentile(&m->hist, m->permille);
 
-	err = rlb_meminfo_scan(m);
-	if (err) {
-		PERROR("/proc/meminfo");
-		goto fail;
-	}
+	m->windows++;
 
-	return 0;
+	if (m->last > m->target) {
+		if (!m->token.rate)
+			DBG(3, "%llu us over target, throttling", m->last);
 
-fail:
-	ERR("err = %d", err);
-	return err;
+		m->over++;
+		rlb_latency_throttle(m, m->token.rate ?
+				     m->token.rate / 2 : rate / 2);
 
-usage:
-	err = -EINVAL;
-	return err;
-};
+	} else if (m->token.rate) {
+		if (rate < m->token.rate / 2) {
+			DBG(3, "unthrottled");
+			m->token.rate = 0;
+		} else
+			rlb_latency_throttle(m, m->token.rate +
+					     m->token.rate / 4);
+	}
+
+	memset(&m->hist, 0, sizeof(m->hist));
+	m->sent = 0;
+	m->ts   = rlb->now;
+}
 
 static void
-rlb_meminfo_settimeo(td_rlb_t *rlb, struct timeval **_tv, void *data)
+rlb_latency_settimeo(td_rlb_t *rlb, struct timeval **_tv, void *data)
 {
-	td_rlb_meminfo_t *m = data;
-	int idle;
+	td_rlb_latency_t *m = data;
+	struct timeval *tv = &m->timeo;
+	td_rlb_conn_t *conn;
+	long long us = -1;
 
-	idle = list_empty(&rlb->wait);
-	BUG_ON(!idle && !m->congested);
+	if (m->hist.count || m->token.rate)
+		us = MAX(m->window * 1000 - rlb_usec_since(rlb, &m->ts), 1);
 
-	if (m->congested) {
-		m->valve.ops->settimeo(rlb, _tv, m->valve.data);
+	if (m->token.rate)
+		list_for_each_entry(conn, &rlb->wait, wait)
+			if (!rlb_latency_protected(m, conn)) {
+				us = MIN(us, MAX(rlb_token_usec(&m->token), 1));
+				break;
+			}
+
+	if (us < 0) {
+		*_tv = NULL;
 		return;
 	}
 
-	*_tv = NULL;
+	tv->tv_sec  = us / 1000000;
+	tv->tv_usec = us % 1000000;
+
+	*_tv = tv;
 }
 
+/* the protected class right away, best effort as the rate permits */
 static void
-rlb_meminfo_timeout(td_rlb_t *rlb, void *data)
+rlb_latency_dispatch(td_rlb_t *rlb, void *data)
 {
-	td_rlb_meminfo_t *m = data;
+	td_rlb_latency_t *m = data;
+	td_rlb_conn_t *conn, *next;
 
-	WARN_ON(!m->congested);
+	if (rlb_usec_since(rlb, &m->ts) >= m->window * 1000)
+		rlb_latency_window(rlb, m);
 
-	if (m->congested)
-		m->valve.ops->timeout(rlb, m->valve.data);
+	if (m->token.rate)
+		rlb_token_refill(rlb, &m->token);
+
+	rlb_for_each_waiting_safe(conn, next, rlb) {
+		if (!rlb_latency_protected(m, conn)) {
+			if (m->token.rate) {
+				if (m->token.cred < 0)
+					continue;
+				m->token.cred -= conn->need;
+			}
+			m->sent += conn->need;
+		}
+
+		rlb_conn_respond(rlb, conn, conn->need);
+	}
 }
 
-static int
-rlb_meminfo_test_high(td_rlb_t *rlb, td_rlb_meminfo_t *m, long long cred)
+static void
+rlb_latency_reset(td_rlb_t *rlb, void *data)
 {
-	long long lo;
+	td_rlb_latency_t *m = data;
 
-	if (m->congested) {
-		/* hysteresis */
+	m->token.cred = m->token.cap;
+}
 
-		lo  = m->total;
-		lo *= m->limit_lo;
-		lo /= 100;
+static void
+rlb_latency_refund(td_rlb_t *rlb, td_rlb_conn_t *conn,
+		   unsigned long bytes, void *data)
+{
+	td_rlb_latency_t *m = data;
 
-		if (cred >= lo)
-			return 0;
+	if (rlb_latency_protected(m, conn))
+		return;
 
-	} else
-		if (cred <= 0) {
-			m->valve.ops->reset(rlb, m->valve.data);
-			return 1;
-		}
+	m->sent -= MIN(m->sent, bytes);
 
-	return m->congested;
+	if (m->token.rate)
+		m->token.cred = MIN(m->token.cred + (long)bytes,
+				    m->token.cap);
 }
 
 static void
-rlb_meminfo_dispatch_low(td_rlb_t *rlb, td_rlb_meminfo_t *m,
-			 long long *_cred)
+rlb_latency_accept(td_rlb_t *rlb, td_rlb_conn_t *conn, void *data)
 {
-	td_rlb_conn_t *conn, *next;
-	long long cred = *_cred, grant;
+	td_rlb_latency_t *m = data;
+	unsigned long rsp = TD_VALVE_RSP_LATENCY;
+	int err;
 
-	rlb_for_each_waiting_safe(conn, next, rlb) {
+	if (!rlb_latency_protected(m, conn))
+		return;
 
-		if (cred <= 0)
-			break;
+	err = rlb_sock_send(rlb, conn, &rsp, sizeof(rsp));
+	if (err)
+		WARN("conn[%d]: err = %d, no latencies",
+		     rlb_conn_id(rlb, conn), err);
+}
 
-		grant = MIN(cred, conn->need);
+static void
+rlb_latency_add(td_rlb_t *rlb, td_rlb_conn_t *conn,
+		int bucket, unsigned long count, void *data)
+{
+	td_rlb_latency_t *m = data;
+	struct td_histogram *h = &m->hist;
 
-		rlb_conn_respond(rlb, conn, grant);
+	if (!rlb_latency_protected(m, conn))
+		return;
 
-		cred -= grant;
-	}
+	h->bucket[bucket] += count;
+	h->count          += count;
+	h->max             = MAX(h->max, td_latency_bucket_us(bucket + 1) - 1);
+}
 
-	*_cred = cred;
+static void
+rlb_latency_usage(td_rlb_t *rlb, FILE *stream, void *data)
+{
+	fprintf(stream,
+		" {-t|--type}=latency --"
+		" {-T|--target}=<usecs>"
+		" [{-p|--percentile}=<permille>]"
+		" [{-w|--window}=<msecs>]"
+		" [{-m|--min-rate}=<rate [KMG]>]"
+		" [{-C|--class}=<name>]");
 }
 
 static void
-rlb_meminfo_dispatch(td_rlb_t *rlb, void *data)
+rlb_latency_destroy(td_rlb_t *rlb, void *data)
 {
-	td_rlb_meminfo_t *m = data;
-	long long us, hi, cred, dirty, pend;
+	free(data);
+}
 
-	/* we run only once per m->period */
+static int
+rlb_latency_create(td_rlb_t *rlb, int argc, char **argv, void **data)
+{
+	td_rlb_latency_t *m;
+	int err;
 
-	us = rlb_usec_since(rlb, &m->ts);
-	if (us / 1000 > m->period) {
-		rlb_meminfo_scan(m);
-		m->ts = rlb->now;
+	m = calloc(1, sizeof(*m));
+	if (!m) {
+		err = -ENOMEM;
+		goto fail;
 	}
 
-	/* uncongested credit:
-	   memory below hi watermark minus pending I/O */
+	m->cls      = "protected";
+	m->permille = 990;
+	m->window   = 500;
+	m->min_rate = 1 << 20;
 
-	hi  = m->total;
-	hi *= m->limit_hi;
-	hi /= 100;
+	do {
+		const struct option longopts[] = {
+			{ "target",      1, NULL, 'T' },
+			{ "percentile",  1, NULL, 'p' },
+			{ "window",      1, NULL, 'w' },
+			{ "min-rate",    1, NULL, 'm' },
+			{ "class",       1, NULL, 'C' },
+			{ NULL,          0, NULL,  0  }
+		};
+		int c;
 
-	dirty = m->dirty + m->writeback;
+		c = getopt_long(argc, argv, "T:p:w:m:C:", longopts, NULL);
+		if (c < 0)
+			break;
 
-	cred  = hi - dirty;
-	cred *= 1000;
+		switch (c) {
+		case 'T':
+			m->target = rlb_strtol(optarg);
+			if (m->target <= 0) {
+				ERR("invalid --target");
+				goto usage;
+			}
+			break;
 
-	pend  = rlb_pending(rlb);
-	cred -= pend;
+		case 'p':
+			m->permille = rlb_strtol(optarg);
+			if (m->permille <= 0 || m->permille > 1000) {
+				ERR("invalid --percentile");
+				goto usage;
+			}
+			break;
 
-	m->congested = rlb_meminfo_test_high(rlb, m, cred);
+		case 'w':
+			m->window = rlb_strtol(optarg);
+			if (m->window <= 0) {
+				ERR("invalid --window");
+				goto usage;
+			}
+			break;
 
-	DBG(3, "dirty=%lld (%lld) pend=%llu cred=%lld %s",
-	    dirty, dirty * 100 / m->total, pend, cred,
-	    m->congested ? "congested" : "");
+		case 'm':
+			m->min_rate = rlb_strtol(optarg);
+			if (m->min_rate <= 0) {
+				ERR("invalid --min-rate");
+				goto usage;
+			}
+			break;
 
-	if (!m->congested) {
-		rlb_meminfo_dispatch_low(rlb, m, &cred);
+		case 'C':
+			m->cls = optarg;
+			if (!*m->cls || strchr(m->cls, '/')) {
+				ERR("invalid --class");
+				goto usage;
+			}
+			break;
 
-		m->congested = rlb_meminfo_test_high(rlb, m, cred);
+		case '?':
+			goto usage;
+
+		default:
+			BUG();
+		}
+	} while (1);
+
+	if (!m->target) {
+		ERR("--target required");
+		goto usage;
 	}
 
-	if (m->congested)
-		m->valve.ops->dispatch(rlb, m->valve.data);
-}
+	err = rlb_sock_listen(rlb, m->cls, m);
+	if (err)
+		goto fail;
 
-static struct ratelimit_ops rlb_meminfo_ops = {
-	.usage    = rlb_meminfo_usage,
-	.create   = rlb_meminfo_create,
-	.destroy  = rlb_meminfo_destroy,
-	.info     = rlb_meminfo_info,
+	gettimeofday(&m->ts, NULL);
 
-	.settimeo = rlb_meminfo_settimeo,
-	.timeout  = rlb_meminfo_timeout,
-	.dispatch = rlb_meminfo_dispatch,
+	*data = m;
+
+	return 0;
+
+fail:
+	rlb_latency_destroy(rlb, m);
+
+	return err;
+
+usage:
+	err = -EINVAL;
+	goto fail;
+}
+
+static struct ratelimit_ops rlb_latency_ops = {
+	.usage    = rlb_latency_usage,
+	.create   = rlb_latency_create,
+	.destroy  = rlb_latency_destroy,
+	.info     = rlb_latency_info,
+
+	.settimeo = rlb_latency_settimeo,
+	.timeout  = rlb_latency_dispatch,
+	.dispatch = rlb_latency_dispatch,
+	.reset    = rlb_latency_reset,
+	.refund   = rlb_latency_refund,
+	.accept   = rlb_latency_accept,
+	.latency  = rlb_latency_add,
 };
 
 /*
@@ -1369,12 +2760,14 @@ rlb_find_valve(const char *name)
 	struct ratelimit_ops *ops = NULL;
 
 	switch (name[0]) {
-#if 0
 	case 'l':
+		if (!strcmp(name, "latency"))
+			ops = &rlb_latency_ops;
+#if 0
 		if (!strcmp(name, "leaky"))
 			ops = &rlb_leaky_ops;
-		break;
 #endif
+		break;
 
 	case 't':
 		if (!strcmp(name, "token"))
@@ -1385,6 +2778,16 @@ rlb_find_valve(const char *name)
 		if (!strcmp(name, "meminfo"))
 			ops = &rlb_meminfo_ops;
 		break;
+
+	case 'h':
+		if (!strcmp(name, "htb"))
+			ops = &rlb_htb_ops;
+		break;
+
+	case 'p':
+		if (!strcmp(name, "psi"))
+			ops = &rlb_psi_ops;
+		break;
 	}
 
 	return ops;
@@ -1396,10 +2799,11 @@ rlb_main_iterate(td_rlb_t *rlb)
 	td_rlb_conn_t *conn, *next;
 	struct timeval *tv;
 	struct timespec _ts, *ts = &_ts;
-	int nfds, err;
-	fd_set rfds;
+	int nfds, xfd, err, i;
+	fd_set rfds, xfds;
 
 	FD_ZERO(&rfds);
+	FD_ZERO(&xfds);
 	nfds = 0;
 
 	if (stdin) {
@@ -1412,11 +2816,19 @@ rlb_main_iterate(td_rlb_t *rlb)
 		nfds = MAX(nfds, rlb->sock);
 	}
 
+	for (i = 0; i < rlb->n_lsnr; i++) {
+		FD_SET(rlb->lsnr[i].sock, &rfds);
+		nfds = MAX(nfds, rlb->lsnr[i].sock);
+	}
+
 	rlb_for_each_conn(conn, rlb) {
 		FD_SET(conn->sock, &rfds);
 		nfds = MAX(nfds, conn->sock);
 	}
 
+	if (rlb->valve.ops->fdset)
+		rlb->valve.ops->fdset(rlb, &xfds, &nfds, rlb->valve.data);
+
 	rlb->valve.ops->settimeo(rlb, &tv, rlb->valve.data);
 	if (tv) {
 		TIMEVAL_TO_TIMESPEC(tv, ts);
@@ -1425,7 +2837,7 @@ rlb_main_iterate(td_rlb_t *rlb)
 
 	rlb->ts = rlb->now;
 
-	nfds = pselect(nfds + 1, &rfds, NULL, NULL, ts, &rlb_sigunblock);
+	nfds = pselect(nfds + 1, &rfds, NULL, &xfds, ts, &rlb_sigunblock);
 	if (nfds < 0) {
 		err = -errno;
 		if (err != -EINTR)
@@ -1435,12 +2847,18 @@ rlb_main_iterate(td_rlb_t *rlb)
 
 	gettimeofday(&rlb->now, NULL);
 
-	if (!nfds) {
+	xfd = 0;
+	if (nfds && rlb->valve.ops->fdevent) {
+		xfd   = rlb->valve.ops->fdevent(rlb, &xfds, rlb->valve.data);
+		nfds -= xfd;
+	}
+
+	if (!nfds && !xfd) {
 		BUG_ON(!ts);
 		rlb->valve.ops->timeout(rlb, rlb->valve.data);
 	}
 
-	if (nfds) {
+	if (nfds || xfd) {
 		rlb_for_each_conn_safe(conn, next, rlb)
 			if (FD_ISSET(conn->sock, &rfds)) {
 				rlb_conn_receive(rlb, conn);
@@ -1461,11 +2879,18 @@ rlb_main_iterate(td_rlb_t *rlb)
 
 	if (unlikely(nfds)) {
 		if (FD_ISSET(rlb->sock, &rfds)) {
-			rlb_accept_conn(rlb);
+			rlb_accept_conn(rlb, rlb->sock, NULL);
 			nfds--;
 		}
 	}
 
+	for (i = 0; unlikely(nfds) && i < rlb->n_lsnr; i++)
+		if (FD_ISSET(rlb->lsnr[i].sock, &rfds)) {
+			rlb_accept_conn(rlb, rlb->lsnr[i].sock,
+					rlb->lsnr[i].cls);
+			nfds--;
+		}
+
 	BUG_ON(nfds);
 	err = 0;
 fail:
@@ -1515,7 +2940,7 @@ rlb_usage(td_rlb_t *rlb, const char *prog, FILE *stream)
 		rlb->valve.ops->usage(rlb, stream, rlb->valve.data);
 	else
 		fprintf(stream,
-			" {-t|--type}={token|meminfo}"
+			" {-t|--type}={token|meminfo|htb|psi|latency}"
 			" [-h|--help] [-D|--debug=<n>]");
 
 	fprintf(stream, "\n");
@@ -0,0 +1,354 @@
+/* 
+ * Copyright (C) Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2.1 only
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "writelog.h"
+
+#define BITS_PER_LONG (sizeof(unsigned long) * 8)
+#define BITS_TO_LONGS(bits) (((bits)+BITS_PER_LONG-1)/BITS_PER_LONG)
+
+#define BITMAP_ENTRY(_nr, _bmap) ((_bmap)[(_nr)/BITS_PER_LONG])
+#define BITMAP_SHIFT(_nr) ((_nr) % BITS_PER_LONG)
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+/* bits [first, last] of a word */
+static inline unsigned long
+writelog_mask(unsigned int first, unsigned int last)
+{
+	unsigned long mask = ~0UL << first;
+
+	if (last < BITS_PER_LONG - 1)
+		mask &= ~(~0UL << (last + 1));
+
+	return mask;
+}
+
+int
+writelog_create(struct writelog *wl, uint64_t sectors, unsigned int shift)
+{
+	uint64_t words;
+
+	memset(wl, 0, sizeof(*wl));
+
+	if (shift >= 32)
+		return -EINVAL;
+
+	wl->size   = sectors;
+	wl->shift  = shift;
+	wl->chunks = (sectors + (1ULL << shift) - 1) >> shift;
+
+	words       = BITS_TO_LONGS(wl->chunks);
+	wl->bitmap  = calloc(words ? : 1, sizeof(unsigned long));
+	wl->summary = calloc(BITS_TO_LONGS(words) ? : 1,
+			     sizeof(unsigned long));
+	if (!wl->bitmap || !wl->summary) {
+		writelog_free(wl);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+void
+writelog_free(struct writelog *wl)
+{
+	free(wl->bitmap);
+	free(wl->summary);
+	wl->bitmap  = NULL;
+	wl->summary = NULL;
+}
+
+int
+writelog_test(struct writelog *wl, uint64_t nr)
+{
+	nr >>= wl->shift;
+	return (BITMAP_ENTRY(nr, wl->bitmap) >> BITMAP_SHIFT(nr)) & 1;
+}
+
+void
+writelog_set(struct writelog *wl, uint64_t sector, uint64_t count)
+{
+	uint64_t c, last, w, end = sector + count;
+
+	if (end > wl->size)
+		end = wl->size;
+	if (sector >= end)
+		return;
+
+	c    = sector >> wl->shift;
+	last = (end - 1) >> wl->shift;
+
+	for (w = c / BITS_PER_LONG; w <= last / BITS_PER_LONG; w++) {
+		unsigned int first = w == c / BITS_PER_LONG ?
+			BITMAP_SHIFT(c) : 0;
+		unsigned int lbit  = w == last / BITS_PER_LONG ?
+			BITMAP_SHIFT(last) : BITS_PER_LONG - 1;
+
+		wl->bitmap[w] |= writelog_mask(first, lbit);
+		BITMAP_ENTRY(w, wl->summary) |= 1UL << BITMAP_SHIFT(w);
+	}
+}
+
+/* the first bitmap word at or after @w with any bit set, or -1 */
+static int64_t
+writelog_next_word(struct writelog *wl, uint64_t w)
+{
+	uint64_t words = BITS_TO_LONGS(wl->chunks), sw;
+	unsigned long bits;
+
+	if (w >= words)
+		return -1;
+
+	sw   = w / BITS_PER_LONG;
+	bits = wl->summary[sw] & (~0UL << BITMAP_SHIFT(w));
+
+	while (!bits) {
+		if (++sw >= BITS_TO_LONGS(words))
+			return -1;
+		bits = wl->summary[sw];
+	}
+
+	return sw * BITS_PER_LONG + __builtin_ctzl(bits);
+}
+
+/* clear [start, end); if end is 0, clear to end of disk */
+void
+writelog_clear(struct writelog *wl, uint64_t start, uint64_t end)
+{
+	uint64_t c, last, w;
+	int64_t next;
+
+	if (!end || end > wl->size)
+		end = wl->size;
+
+	/* whole chunks only, the last one may end with the disk */
+	c = (start + (1ULL << wl->shift) - 1) >> wl->shift;
+	if (end == wl->size)
+		last = wl->chunks;
+	else
+		last = end >> wl->shift;
+	if (c >= last)
+		return;
+	last--;
+
+	for (w = c / BITS_PER_LONG; w <= last / BITS_PER_LONG; w++) {
+		unsigned int first, lbit;
+
+		next = writelog_next_word(wl, w);
+		if (next < 0 || next > last / BITS_PER_LONG)
+			break;
+		w = next;
+
+		first = w == c / BITS_PER_LONG ? BITMAP_SHIFT(c) : 0;
+		lbit  = w == last / BITS_PER_LONG ?
+			BITMAP_SHIFT(last) : BITS_PER_LONG - 1;
+
+		wl->bitmap[w] &= ~writelog_mask(first, lbit);
+		if (!wl->bitmap[w])
+			BITMAP_ENTRY(w, wl->summary) &= ~(1UL << BITMAP_SHIFT(w));
+	}
+}
+
+/*
+ * Find the first dirty extent at or after 'from', at most 'max'
+ * sectors long. Clean regions are skipped through the summary.
+ * Returns -ENOENT once there is nothing dirty left past 'from'.
+ */
+int
+writelog_next(struct writelog *wl, uint64_t from, uint64_t max,
+	      uint64_t *sector, uint64_t *count)
+{
+	uint64_t c, e, start, end;
+	unsigned long bits;
+	int64_t w;
+
+	if (from >= wl->size || !max)
+		return -ENOENT;
+
+	c = from >> wl->shift;
+	w = c / BITS_PER_LONG;
+
+	bits = wl->bitmap[w] & (~0UL << BITMAP_SHIFT(c));
+	if (!bits) {
+		w = writelog_next_word(wl, w + 1);
+		if (w < 0)
+			return -ENOENT;
+		bits = wl->bitmap[w];
+	}
+
+	c = w * BITS_PER_LONG + __builtin_ctzl(bits);
+	if (c >= wl->chunks)
+		return -ENOENT;
+
+	start = c << wl->shift;
+	if (start < from)
+		start = from;
+
+	/* the first clean chunk after c, or the end */
+	e = c + 1;
+	while (e < wl->chunks && (e << wl->shift) - start < max) {
+		bits = ~wl->bitmap[e / BITS_PER_LONG] >> BITMAP_SHIFT(e);
+		if (bits & 1)
+			break;
+		if (!bits)
+			e = (e / BITS_PER_LONG + 1) * BITS_PER_LONG;
+		else
+			e += __builtin_ctzl(bits);
+	}
+
+	end = MIN(e << wl->shift, wl->size);
+	*sector = start;
+	*count  = MIN(end - start, max);
+	return 0;
+}
+
+/* the 64 chunks from 'chunk' on, as one word */
+static uint64_t
+writelog_word(struct writelog *wl, uint64_t chunk)
+{
+	uint64_t bits = 0;
+	unsigned int i;
+
+	for (i = 0; i < 64; i += BITS_PER_LONG)
+		if ((chunk + i) / BITS_PER_LONG < BITS_TO_LONGS(wl->chunks))
+			bits |= (uint64_t)BITMAP_ENTRY(chunk + i, wl->bitmap)
+				<< i;
+
+	return bits;
+}
+
+static void
+writelog_or(struct writelog *wl, uint64_t chunk, uint64_t bits)
+{
+	unsigned long piece;
+	uint64_t w;
+	unsigned int i;
+
+	for (i = 0; i < 64; i += BITS_PER_LONG) {
+		w = (chunk + i) / BITS_PER_LONG;
+		if (w >= BITS_TO_LONGS(wl->chunks))
+			break;
+
+		piece = (unsigned long)(bits >> i);
+		if (!piece)
+			continue;
+
+		wl->bitmap[w] |= piece;
+		BITMAP_ENTRY(w, wl->summary) |= 1UL << BITMAP_SHIFT(w);
+	}
+}
+
+int
+writelog_save(struct writelog *wl, const char *path)
+{
+	struct writelog_hdr hdr;
+	struct writelog_word *words = NULL, *tmp;
+	uint64_t chunk;
+	size_t n = 0, max = 0, len;
+	int64_t w;
+	char *tpath;
+	int fd, err = 0;
+
+	for (w = writelog_next_word(wl, 0); w >= 0;
+	     w = writelog_next_word(wl, (chunk + 64) / BITS_PER_LONG)) {
+		chunk = w * BITS_PER_LONG & ~63ULL;
+
+		if (n == max) {
+			max = max ? max * 2 : 256;
+			tmp = realloc(words, max * sizeof(*words));
+			if (!tmp) {
+				free(words);
+				return -ENOMEM;
+			}
+			words = tmp;
+		}
+
+		words[n].chunk = chunk;
+		words[n].bits  = writelog_word(wl, chunk);
+		n++;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, WRITELOG_MAGIC, sizeof(hdr.magic));
+	hdr.size  = wl->size;
+	hdr.shift = wl->shift;
+	hdr.words = n;
+
+	if (asprintf(&tpath, "%s.tmp", path) == -1) {
+		free(words);
+		return -ENOMEM;
+	}
+
+	len = n * sizeof(*words);
+	fd  = open(tpath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1 ||
+	    write(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+	    (len && write(fd, words, len) != len) ||
+	    fsync(fd) || rename(tpath, path))
+		err = errno ? -errno : -EIO;
+	if (fd != -1)
+		close(fd);
+
+	free(tpath);
+	free(words);
+	return err;
+}
+
+int
+writelog_load(struct writelog *wl, const char *path)
+{
+	struct writelog_hdr hdr;
+	struct writelog_word word;
+	uint64_t i;
+	FILE *f;
+	int err = 0;
+
+	f = fopen(path, "r");
+	if (!f)
+		return -errno;
+
+	if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+	    memcmp(hdr.magic, WRITELOG_MAGIC, sizeof(hdr.magic)) ||
+	    hdr.size != wl->size || hdr.shift != wl->shift) {
+		err = -EINVAL;
+		goto out;
+	}
+
+	for (i = 0; i < hdr.words; i++) {
+		if (fread(&word, sizeof(word), 1, f) != 1 ||
+		    word.chunk & 63 || word.chunk >= wl->chunks) {
+			err = -EINVAL;
+			goto out;
+		}
+		writelog_or(wl, word.chunk, word.bits);
+	}
+
+out:
+	fclose(f);
+	return err;
+}
@@ -0,0 +1,76 @@
+/* 
+ * Copyright (C) Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2.1 only
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef _WRITELOG_H_
+#define _WRITELOG_H_
+
+#include <inttypes.h>
+
+/*
+ * Dirty bitmap, shared by the write logger (block-log) and the DR
+ * drivers' resync, one bit per chunk of 1 << shift sectors. A summary
+ * bitmap has one bit per bitmap word with any bit set, so that scans
+ * and clears skip clean regions 4096 chunks at a time. The bitmap is
+ * calloc'd: pages never written to take no memory.
+ *
+ * Extents go by sectors, rounded out to chunks when set and found,
+ * and in to chunks when cleared: a clear leaves dirty a chunk it
+ * covers only in part.
+ */
+struct writelog {
+	unsigned long  *bitmap;
+	unsigned long  *summary;
+	uint64_t        size;			/* in sectors */
+	uint64_t        chunks;
+	unsigned int    shift;
+};
+
+int writelog_create(struct writelog *, uint64_t sectors, unsigned int shift);
+void writelog_free(struct writelog *);
+
+void writelog_set(struct writelog *, uint64_t sector, uint64_t count);
+void writelog_clear(struct writelog *, uint64_t start, uint64_t end);
+int writelog_test(struct writelog *, uint64_t sector);
+
+int writelog_next(struct writelog *, uint64_t from, uint64_t max,
+		  uint64_t *sector, uint64_t *count);
+
+/*
+ * On disk, a struct writelog_hdr and a struct writelog_word for every
+ * 64 chunks with any of them dirty, in order. Saves replace the file
+ * with a rename; a load ors the file into a bitmap of the same size
+ * and chunk.
+ */
+#define WRITELOG_MAGIC  "tdwlog01"
+
+struct writelog_hdr {
+	char            magic[8];
+	uint64_t        size;
+	uint32_t        shift;
+	uint32_t        pad;
+	uint64_t        words;
+};
+
+struct writelog_word {
+	uint64_t        chunk;			/* a multiple of 64 */
+	uint64_t        bits;
+};
+
+int writelog_save(struct writelog *, const char *path);
+int writelog_load(struct writelog *, const char *path);
+
+#endif /* _WRITELOG_H_ */
@@ -51,6 +51,9 @@ typedef struct vhd_journal {
 int vhd_journal_create(vhd_journal_t *, const char *file, const char *jfile);
 int vhd_journal_open(vhd_journal_t *, const char *file, const char *jfile);
 int vhd_journal_add_block(vhd_journal_t *, uint32_t block, char mode);
+int vhd_journal_add_blocks(vhd_journal_t *, const uint32_t *blocks, int cnt);
+int vhd_journal_add_bitmaps(vhd_journal_t *, const uint32_t *blocks,
+			    char **maps, int cnt);
 int vhd_journal_commit(vhd_journal_t *);
 int vhd_journal_revert(vhd_journal_t *);
 int vhd_journal_close(vhd_journal_t *);
@@ -18,6 +18,7 @@
 #ifndef _VHD_LIB_H_
 #define _VHD_LIB_H_
 
+#include <errno.h>
 #include <string.h>
 #include <endian.h>
 #include <byteswap.h>
@@ -51,6 +52,8 @@
 
 #define VHD_BLOCK_SHIFT            21
 #define VHD_BLOCK_SIZE             (1ULL << VHD_BLOCK_SHIFT)
+#define VHD_BLOCK_SHIFT_MAX        26
+#define VHD_BLOCK_SIZE_MAX         (1ULL << VHD_BLOCK_SHIFT_MAX)
 
 #define UTF_16                     "UTF-16"
 #define UTF_16LE                   "UTF-16LE"
@@ -67,6 +70,11 @@
 #define VHD_FLAG_CREAT_FILE_SIZE_FIXED   0x00001
 #define VHD_FLAG_CREAT_PARENT_RAW        0x00002
 
+/* log2 of a new dynamic disk's block size; 0: VHD_BLOCK_SIZE, or the parent's */
+#define VHD_FLAG_CREAT_BLOCK_SHIFT       8
+#define VHD_FLAG_CREAT_BLOCK_MASK        (0x3fU << VHD_FLAG_CREAT_BLOCK_SHIFT)
+#define vhd_flag_creat_block(shift)      ((vhd_flag_creat_t)(shift) << VHD_FLAG_CREAT_BLOCK_SHIFT)
+
 #define vhd_flag_set(word, flag)         ((word) |= (flag))
 #define vhd_flag_clear(word, flag)       ((word) &= ~(flag))
 #define vhd_flag_test(word, flag)        ((word) & (flag))
@@ -110,8 +118,16 @@ struct vhd_bat {
 	uint32_t                   spb;
 	uint32_t                   entries;
 	uint32_t                  *bat;
+
+	/* vhd_map_bat: decoded chunks, NULL once all of it is */
+	uint8_t                   *chunks;
+	void                      *map;
+	size_t                     map_size;
 };
 
+/* BAT entries decoded at a time by a mapped BAT, one page worth */
+#define VHD_BAT_CHUNK_SHIFT        10
+
 struct vhd_batmap {
 	vhd_batmap_header_t        header;
 	char                      *map;
@@ -130,6 +146,7 @@ struct vhd_context {
 	vhd_footer_t               footer;
 	vhd_bat_t                  bat;
 	vhd_batmap_t               batmap;
+	uint32_t                  *zmap;      /* HD_COMPRESSED, vhd_get_zmap */
 
 	struct list_head           next;
 };
@@ -152,6 +169,22 @@ clear_bit (volatile char *addr, int nr)
 	addr[nr >> 3] &= ~(BIT_MASK >> (nr & 7));
 }
 
+void vhd_bat_decode(vhd_bat_t *, uint32_t chunk);
+
+/*
+ * Entry 'blk' of a BAT, be it read whole or mapped by vhd_map_bat.
+ */
+static inline uint32_t *
+vhd_bat_slot(vhd_bat_t *bat, uint32_t blk)
+{
+	uint32_t chunk = blk >> VHD_BAT_CHUNK_SHIFT;
+
+	if (bat->chunks && !(bat->chunks[chunk >> 3] & (1 << (chunk & 7))))
+		vhd_bat_decode(bat, chunk);
+
+	return &bat->bat[blk];
+}
+
 static inline uint32_t
 secs_round_up(uint64_t bytes)
 {
@@ -183,6 +216,76 @@ vhd_type_dynamic(vhd_context_t *ctx)
 		ctx->footer.type == HD_TYPE_DIFF);
 }
 
+static inline uint64_t
+vhd_block_size(vhd_context_t *ctx)
+{
+	if (vhd_type_dynamic(ctx) && ctx->header.block_size)
+		return ctx->header.block_size;
+	return VHD_BLOCK_SIZE;
+}
+
+/*
+ * Sector 0 of a dynamic disk may sit data_shift sectors into block 0,
+ * so that a guest partition starting at an odd offset starts on a block.
+ */
+static inline uint32_t
+vhd_data_shift(vhd_context_t *ctx)
+{
+	return vhd_type_dynamic(ctx) ? ctx->header.data_shift : 0;
+}
+
+/* read-only image with compressed block data, see DD_ZCODEC_* */
+static inline int
+vhd_compressed(vhd_context_t *ctx)
+{
+	return vhd_type_dynamic(ctx) &&
+		(ctx->footer.features & HD_COMPRESSED);
+}
+
+static inline size_t
+vhd_zmap_size(vhd_context_t *ctx)
+{
+	return vhd_bytes_padded(ctx->header.max_bat_size * sizeof(uint32_t));
+}
+
+/* the shift which puts virtual sector @offset at the start of a block */
+static inline uint32_t
+vhd_align_shift(uint32_t spb, uint64_t offset)
+{
+	return (spb - offset % spb) % spb;
+}
+
+/* BAT entries spanned by the virtual size */
+static inline uint64_t
+vhd_data_blocks(vhd_context_t *ctx)
+{
+	uint64_t shift = vhd_sectors_to_bytes(vhd_data_shift(ctx));
+
+	if (!shift)
+		return ctx->footer.curr_size / vhd_block_size(ctx);
+
+	return (ctx->footer.curr_size + shift + vhd_block_size(ctx) - 1) /
+		vhd_block_size(ctx);
+}
+
+/* set the block size in creation @flags; a power of two, 2 MB to 64 MB */
+static inline int
+vhd_flag_set_block_size(vhd_flag_creat_t *flags, uint64_t bytes)
+{
+	int shift;
+
+	if (!bytes || (bytes & (bytes - 1)))
+		return -EINVAL;
+
+	shift = __builtin_ctzll(bytes);
+	if (shift < VHD_BLOCK_SHIFT || shift > VHD_BLOCK_SHIFT_MAX)
+		return -EINVAL;
+
+	vhd_flag_clear(*flags, VHD_FLAG_CREAT_BLOCK_MASK);
+	vhd_flag_set(*flags, vhd_flag_creat_block(shift));
+	return 0;
+}
+
 static inline int
 vhd_creator_tapdisk(vhd_context_t *ctx)
 {
@@ -247,6 +350,15 @@ int vhd_validate_platform_code(uint32_t code);
 
 int vhd_open(vhd_context_t *, const char *file, int flags);
 void vhd_close(vhd_context_t *);
+
+/* shared read-only contexts of chain walks, see libvhd-chain.c */
+#define VHD_CHAIN_CACHE_MAX        64
+void vhd_chain_cache_enable(int max);
+void vhd_chain_cache_flush(void);
+int vhd_chain_get(const char *file, int flags, const unsigned char *uuid,
+		  vhd_context_t **);
+void vhd_chain_put(vhd_context_t *);
+void vhd_chain_invalidate(const char *file);
 /* vhd_create: mbytes is the virtual size for BAT/batmap preallocation - see 
  * vhd-util-resize.c
  */
@@ -256,6 +368,15 @@ int vhd_create(const char *name, uint64_t bytes, int type, uint64_t mbytes,
  * is to have the same size as the (first non-empty) parent */
 int vhd_snapshot(const char *snapshot, uint64_t bytes, const char *parent,
 		uint64_t mbytes, vhd_flag_creat_t);
+/* as above, with virtual sector @align starting a block; snapshots
+ * otherwise keep the data shift of their parent */
+int vhd_create_aligned(const char *name, uint64_t bytes, int type,
+		uint64_t mbytes, vhd_flag_creat_t, uint64_t align);
+int vhd_snapshot_aligned(const char *snapshot, uint64_t bytes,
+		const char *parent, uint64_t mbytes, vhd_flag_creat_t,
+		uint64_t align);
+/* start sector of the first primary partition of the disk, by its MBR */
+int vhd_first_partition(vhd_context_t *, uint64_t *);
 
 int vhd_hidden(vhd_context_t *, int *);
 int vhd_chain_depth(vhd_context_t *, int *);
@@ -277,6 +398,7 @@ int vhd_get_header(vhd_context_t *);
 int vhd_get_footer(vhd_context_t *);
 int vhd_get_bat(vhd_context_t *);
 int vhd_get_batmap(vhd_context_t *);
+int vhd_get_zmap(vhd_context_t *);
 
 void vhd_put_header(vhd_context_t *);
 void vhd_put_footer(vhd_context_t *);
@@ -294,6 +416,7 @@ int vhd_set_phys_size(vhd_context_t *, off64_t);
 int vhd_set_virt_size(vhd_context_t *, uint64_t);
 
 int vhd_bitmap_test(vhd_context_t *, char *, uint32_t);
+uint32_t vhd_bitmap_span(vhd_context_t *, char *, uint32_t, uint32_t, int);
 void vhd_bitmap_set(vhd_context_t *, char *, uint32_t);
 void vhd_bitmap_clear(vhd_context_t *, char *, uint32_t);
 
@@ -318,9 +441,14 @@ int vhd_read_footer_strict(vhd_context_t *, vhd_footer_t *);
 int vhd_read_header(vhd_context_t *, vhd_header_t *);
 int vhd_read_header_at(vhd_context_t *, vhd_header_t *, off64_t);
 int vhd_read_bat(vhd_context_t *, vhd_bat_t *);
+int vhd_map_bat(vhd_context_t *, vhd_bat_t *);
+void vhd_release_bat(vhd_bat_t *);
 int vhd_read_batmap(vhd_context_t *, vhd_batmap_t *);
 int vhd_read_bitmap(vhd_context_t *, uint32_t block, char **bufp);
 int vhd_read_block(vhd_context_t *, uint32_t block, char **bufp);
+int vhd_read_zmap(vhd_context_t *, uint32_t **zmapp);
+int vhd_zblock_decode(vhd_context_t *, const char *src, uint32_t len,
+		      char *dst);
 
 int vhd_write_footer(vhd_context_t *, vhd_footer_t *);
 int vhd_write_footer_at(vhd_context_t *, vhd_footer_t *, off64_t);
@@ -328,6 +456,7 @@ int vhd_write_header(vhd_context_t *, vhd_header_t *);
 int vhd_write_header_at(vhd_context_t *, vhd_header_t *, off64_t);
 int vhd_write_bat(vhd_context_t *, vhd_bat_t *);
 int vhd_write_batmap(vhd_context_t *, vhd_batmap_t *);
+int vhd_write_zmap(vhd_context_t *, uint32_t *zmap);
 int vhd_write_bitmap(vhd_context_t *, uint32_t block, char *bitmap);
 int vhd_write_block(vhd_context_t *, uint32_t block, char *data);
 
@@ -336,4 +465,7 @@ int vhd_io_write(vhd_context_t *, char *, uint64_t, uint32_t);
 int vhd_io_read_bytes(vhd_context_t *, void *, size_t, uint64_t);
 int vhd_io_write_bytes(vhd_context_t *, void *, size_t, uint64_t);
 
+int vhd_copy_range(int sfd, off64_t soff, int dfd, off64_t doff, size_t len);
+int vhd_io_clone_block(vhd_context_t *dst, vhd_context_t *src, uint32_t block);
+
 #endif
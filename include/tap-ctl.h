@@ -86,18 +86,22 @@ int tap_ctl_allocate(int *minor, char **devname);
 int tap_ctl_free(const int minor);
 
 int tap_ctl_create(const char *params, char **devname, int flags, 
-		int prt_minor, char *secondary, int timeout);
+		int prt_minor, char *secondary, int timeout, int bm_cache,
+		int lazy_depth, const char *loop_cpus,
+		const char *helper_cpus);
 int tap_ctl_destroy(const int id, const int minor, int force,
 		    struct timeval *timeout);
 
-int tap_ctl_spawn(void);
+int tap_ctl_spawn(int numa_node, const char *loop_cpus,
+		  const char *helper_cpus);
 pid_t tap_ctl_get_pid(const int id);
 
 int tap_ctl_attach(const int id, const int minor);
 int tap_ctl_detach(const int id, const int minor);
 
 int tap_ctl_open(const int id, const int minor, const char *params, int flags,
-		const int prt_minor, const char *secondary, int timeout);
+		const int prt_minor, const char *secondary, int timeout,
+		int bm_cache, int lazy_depth);
 int tap_ctl_close(const int id, const int minor, const int force,
 		  struct timeval *timeout);
 
@@ -105,8 +109,46 @@ int tap_ctl_pause(const int id, const int minor, struct timeval *timeout);
 int tap_ctl_unpause(const int id, const int minor, const char *params,
 		int flags, char *secondary);
 
+int tap_ctl_batch(const int id, tapdisk_message_t *messages, int n,
+		  int flags, struct timeval *timeout);
+int tap_ctl_batch_error(tapdisk_message_t *message);
+
+int tap_ctl_pool_claim(void);
+int tap_ctl_pool_fill(void);
+int tap_ctl_pool_refill(void);
+int tap_ctl_pool_idle(int *ids, int max);
+int tap_ctl_pool_get_size(void);
+int tap_ctl_pool_set_size(int size);
+
 ssize_t tap_ctl_stats(pid_t pid, int minor, char *buf, size_t size);
 int tap_ctl_stats_fwrite(pid_t pid, int minor, FILE *out);
+ssize_t tap_ctl_stats_keep(int sfd, char **buf, size_t *size,
+			   struct timeval *timeout);
+
+int tap_ctl_poll(const int id, const int minor, unsigned int max_us);
+int tap_ctl_sched(const int id, const int minor,
+		  const char *policy, int weight);
+int tap_ctl_coalesce(const int id, const int minor, unsigned int rate);
+int tap_ctl_migrate(const int id, const int minor, const char *target,
+		    unsigned int rate);
+int tap_ctl_cache(const int id, unsigned int size, int flags,
+		  char *buf, size_t len);
+int tap_ctl_trace(const int id, int flags, void **buf, size_t *len);
+int tap_ctl_record(const int id, const int minor, const char *path,
+		   unsigned int size);
+int tap_ctl_ring(const int id, const int minor, const char *path,
+		 unsigned int slots, unsigned int size, unsigned int poll_us);
+int tap_ctl_headroom(const int id, const int minor, int flags,
+		     unsigned int lead_s, unsigned int hold_ms,
+		     tapdisk_message_headroom_t *hr);
+int tap_ctl_heat(const int id, const int minor, int flags,
+		 unsigned int decay, const char *path,
+		 tapdisk_message_heat_t *heat);
+int tap_ctl_warm(const int id, const int minor, const char *path,
+		 unsigned int size, unsigned int rate, uint64_t *blocks);
+int tap_ctl_subscribe(const int id, const int minor, int flags,
+		      unsigned int interval, int *sfd);
+int tap_ctl_subscribe_next(int sfd, tapdisk_message_t *message);
 
 int tap_ctl_blk_major(void);
 
@@ -36,6 +36,7 @@
 #define TAPDISK_MESSAGE_FLAG_REUSE_PRT   0x040
 #define TAPDISK_MESSAGE_FLAG_SECONDARY   0x080
 #define TAPDISK_MESSAGE_FLAG_STANDBY     0x100
+#define TAPDISK_MESSAGE_FLAG_ASYNC       0x200
 
 typedef struct tapdisk_message           tapdisk_message_t;
 typedef uint32_t                         tapdisk_message_flag_t;
@@ -46,6 +47,20 @@ typedef struct tapdisk_message_response  tapdisk_message_response_t;
 typedef struct tapdisk_message_minors    tapdisk_message_minors_t;
 typedef struct tapdisk_message_list      tapdisk_message_list_t;
 typedef struct tapdisk_message_stat      tapdisk_message_stat_t;
+typedef struct tapdisk_message_poll      tapdisk_message_poll_t;
+typedef struct tapdisk_message_sched     tapdisk_message_sched_t;
+typedef struct tapdisk_message_coalesce  tapdisk_message_coalesce_t;
+typedef struct tapdisk_message_migrate   tapdisk_message_migrate_t;
+typedef struct tapdisk_message_cache     tapdisk_message_cache_t;
+typedef struct tapdisk_message_batch     tapdisk_message_batch_t;
+typedef struct tapdisk_message_record    tapdisk_message_record_t;
+typedef struct tapdisk_message_ring      tapdisk_message_ring_t;
+typedef struct tapdisk_message_headroom  tapdisk_message_headroom_t;
+typedef struct tapdisk_message_subscribe tapdisk_message_subscribe_t;
+typedef struct tapdisk_message_event     tapdisk_message_event_t;
+typedef struct tapdisk_message_counters  tapdisk_message_counters_t;
+typedef struct tapdisk_message_heat      tapdisk_message_heat_t;
+typedef struct tapdisk_message_warm      tapdisk_message_warm_t;
 
 struct tapdisk_message_params {
 	tapdisk_message_flag_t           flags;
@@ -56,6 +71,8 @@ struct tapdisk_message_params {
 	uint32_t                         prt_devnum;
 	uint16_t                         req_timeout;
 	char                             secondary[TAPDISK_MESSAGE_MAX_PATH_LENGTH];
+	uint32_t                         bm_cache;
+	uint32_t                         lazy_depth;
 };
 
 struct tapdisk_message_image {
@@ -85,10 +102,177 @@ struct tapdisk_message_list {
 	char                             path[TAPDISK_MESSAGE_MAX_PATH_LENGTH];
 };
 
+/* keeps the connection open for the next stats request */
+#define TAPDISK_MESSAGE_STATS_KEEP       0x1
+
+/* trace requests, in u.info.flags; the response carries a dump */
+#define TAPDISK_MESSAGE_TRACE_ON         0x1
+#define TAPDISK_MESSAGE_TRACE_OFF        0x2
+
 struct tapdisk_message_stat {
 	uint16_t                         type;
 	uint16_t                         cookie;
 	size_t                           length;
+	uint32_t                         flags;
+};
+
+struct tapdisk_message_poll {
+	uint32_t                         max_us; /* 0: off */
+};
+
+#define TAPDISK_MESSAGE_POLICY_LENGTH    16
+
+struct tapdisk_message_sched {
+	char                             policy[TAPDISK_MESSAGE_POLICY_LENGTH];
+	int32_t                          weight; /* <= 0: unchanged */
+};
+
+struct tapdisk_message_coalesce {
+	uint32_t                         rate;   /* MiB/s, 0: no limit */
+};
+
+struct tapdisk_message_migrate {
+	uint32_t                         rate;   /* MiB/s, 0: no limit */
+	char                             target[TAPDISK_MESSAGE_MAX_PATH_LENGTH];
+};
+
+struct tapdisk_message_record {
+	uint32_t                         size;   /* MiB of ring, 0: stop */
+	char                             path[TAPDISK_MESSAGE_MAX_PATH_LENGTH];
+};
+
+struct tapdisk_message_ring {
+	uint32_t                         slots;
+	uint32_t                         size;   /* MiB of data, 0: stop */
+	uint32_t                         poll_us;
+	char                             path[TAPDISK_MESSAGE_MAX_PATH_LENGTH];
+};
+
+/*
+ * Sets the lead time a VBD warns ahead of a full leaf at, in u.headroom.
+ * With WAIT, the response waits until headroom runs low, or the VBD
+ * goes; it carries the headroom at that point either way.
+ */
+#define TAPDISK_MESSAGE_HEADROOM_SET     0x1
+#define TAPDISK_MESSAGE_HEADROOM_WAIT    0x2
+
+struct tapdisk_message_headroom {
+	int32_t                          error;  /* in the response */
+	uint32_t                         flags;
+	uint32_t                         lead_s; /* 0: off */
+	uint32_t                         hold_ms;
+	int64_t                          space;  /* bytes */
+	uint64_t                         rate;   /* bytes/s */
+	uint32_t                         low;
+	uint64_t                         events;
+};
+
+/*
+ * Subscribes the connection to VBD events, and/or counters every
+ * 'interval' seconds, of minor 'cookie' or all. After the response,
+ * the tapdisk keeps pushing EVENT and COUNTERS messages, cookie the
+ * minor, until the connection closes or takes another request.
+ * Messages a slow reader has no room for are dropped and counted.
+ */
+#define TAPDISK_MESSAGE_SUBSCRIBE_EVENTS   0x1
+#define TAPDISK_MESSAGE_SUBSCRIBE_COUNTERS 0x2
+
+struct tapdisk_message_subscribe {
+	int32_t                          error;  /* in the response */
+	uint32_t                         flags;
+	uint32_t                         interval; /* s, for counters */
+};
+
+#define TAPDISK_EVENT_PAUSED             1
+#define TAPDISK_EVENT_RESUMED            2
+#define TAPDISK_EVENT_ERROR              3	/* a request failed */
+#define TAPDISK_EVENT_ENOSPC             4	/* a write hit ENOSPC */
+#define TAPDISK_EVENT_HEADROOM           5	/* headroom ran low */
+#define TAPDISK_EVENT_CLOSED             6
+
+/* 'count' events alike since the last, 'seq' numbers them all */
+struct tapdisk_message_event {
+	uint32_t                         event;
+	int32_t                          error;
+	uint32_t                         state;
+	uint32_t                         count;
+	uint64_t                         seq;
+	uint64_t                         dropped; /* by the tapdisk, ever */
+};
+
+/* changes since the last, or totals the first time; 'inflight' is now */
+struct tapdisk_message_counters {
+	uint64_t                         updated; /* usecs, epoch */
+	uint32_t                         state;
+	uint32_t                         inflight[2];
+	uint32_t                         dropped; /* to this connection */
+	uint64_t                         received;
+	uint64_t                         returned;
+	uint64_t                         errors;
+	uint64_t                         retries;
+	uint64_t                         secs[2];
+	uint64_t                         zero_secs;
+	uint64_t                         flushes;
+	uint64_t                         held;
+	uint64_t                         expired;
+};
+
+/*
+ * Heat map of the VBD's 2 MiB blocks. Flags apply in order: START
+ * (if off), DECAY halving the counts 'decay' times, SNAPSHOT to
+ * 'path', STOP. The response tells the map's blocks, and how many
+ * have counts.
+ */
+#define TAPDISK_MESSAGE_HEAT_START       0x1
+#define TAPDISK_MESSAGE_HEAT_DECAY       0x2
+#define TAPDISK_MESSAGE_HEAT_SNAPSHOT    0x4
+#define TAPDISK_MESSAGE_HEAT_STOP        0x8
+
+struct tapdisk_message_heat {
+	int32_t                          error;  /* in the response */
+	uint32_t                         flags;
+	uint32_t                         decay;
+	uint64_t                         blocks;
+	uint64_t                         hot;
+	char                             path[TAPDISK_MESSAGE_MAX_PATH_LENGTH];
+};
+
+/*
+ * Reads the hottest blocks of heat map snapshot 'path' ahead, up to
+ * 'size' MiB of them (0: all), at 'rate' MiB/s (0: unlimited), while
+ * the VBD is otherwise idle. An empty path stops. The response tells
+ * the blocks to warm.
+ */
+struct tapdisk_message_warm {
+	int32_t                          error;  /* in the response */
+	uint32_t                         size;
+	uint32_t                         rate;
+	uint64_t                         blocks;
+	char                             path[TAPDISK_MESSAGE_MAX_PATH_LENGTH];
+};
+
+#define TAPDISK_MESSAGE_CACHE_PROCESS    0x1
+#define TAPDISK_MESSAGE_CACHE_HOST       0x2
+#define TAPDISK_MESSAGE_CACHE_DEDUP      0x4
+#define TAPDISK_MESSAGE_CACHE_NODEDUP    0x8
+
+struct tapdisk_message_cache {
+	uint32_t                         size;   /* MiB, 0: unchanged */
+	uint32_t                         flags;
+};
+
+/*
+ * A batch request is followed by 'count' ordinary requests on the
+ * same connection. Once all are in, the batch response comes back,
+ * then the usual response of each, in order. Consecutive pauses run
+ * side by side.
+ */
+#define TAPDISK_MESSAGE_BATCH_MAX        32
+#define TAPDISK_MESSAGE_BATCH_STOP       0x1 /* cancel after a failure */
+
+struct tapdisk_message_batch {
+	uint32_t                         count;
+	uint32_t                         flags;
 };
 
 
@@ -105,6 +289,20 @@ struct tapdisk_message {
 		tapdisk_message_response_t response;
 		tapdisk_message_list_t   list;
 		tapdisk_message_stat_t   info;
+		tapdisk_message_poll_t   poll;
+		tapdisk_message_sched_t  sched;
+		tapdisk_message_coalesce_t coalesce;
+		tapdisk_message_migrate_t migrate;
+		tapdisk_message_cache_t  cache;
+		tapdisk_message_batch_t  batch;
+		tapdisk_message_record_t record;
+		tapdisk_message_ring_t   ring;
+		tapdisk_message_headroom_t headroom;
+		tapdisk_message_subscribe_t subscribe;
+		tapdisk_message_event_t  event;
+		tapdisk_message_counters_t counters;
+		tapdisk_message_heat_t   heat;
+		tapdisk_message_warm_t   warm;
 	} u;
 };
 
@@ -133,9 +331,37 @@ enum tapdisk_message_id {
 	TAPDISK_MESSAGE_STATS_RSP,
 	TAPDISK_MESSAGE_FORCE_SHUTDOWN,
 	TAPDISK_MESSAGE_EXIT,
+	TAPDISK_MESSAGE_POLL,
+	TAPDISK_MESSAGE_POLL_RSP,
+	TAPDISK_MESSAGE_SCHED,
+	TAPDISK_MESSAGE_SCHED_RSP,
+	TAPDISK_MESSAGE_COALESCE,
+	TAPDISK_MESSAGE_COALESCE_RSP,
+	TAPDISK_MESSAGE_CACHE,
+	TAPDISK_MESSAGE_CACHE_RSP,
+	TAPDISK_MESSAGE_BATCH,
+	TAPDISK_MESSAGE_BATCH_RSP,
+	TAPDISK_MESSAGE_MIGRATE,
+	TAPDISK_MESSAGE_MIGRATE_RSP,
+	TAPDISK_MESSAGE_TRACE,
+	TAPDISK_MESSAGE_TRACE_RSP,
+	TAPDISK_MESSAGE_RECORD,
+	TAPDISK_MESSAGE_RECORD_RSP,
+	TAPDISK_MESSAGE_RING,
+	TAPDISK_MESSAGE_RING_RSP,
+	TAPDISK_MESSAGE_HEADROOM,
+	TAPDISK_MESSAGE_HEADROOM_RSP,
+	TAPDISK_MESSAGE_SUBSCRIBE,
+	TAPDISK_MESSAGE_SUBSCRIBE_RSP,
+	TAPDISK_MESSAGE_EVENT,
+	TAPDISK_MESSAGE_COUNTERS,
+	TAPDISK_MESSAGE_HEAT,
+	TAPDISK_MESSAGE_HEAT_RSP,
+	TAPDISK_MESSAGE_WARM,
+	TAPDISK_MESSAGE_WARM_RSP,
 };
 
-#define TAPDISK_MESSAGE_MAX TAPDISK_MESSAGE_EXIT
+#define TAPDISK_MESSAGE_MAX TAPDISK_MESSAGE_WARM_RSP
 
 static inline char *
 tapdisk_message_name(enum tapdisk_message_id id)
@@ -210,6 +436,111 @@ tapdisk_message_name(enum tapdisk_message_id id)
 	case TAPDISK_MESSAGE_EXIT:
 		return "exit";
 
+	case TAPDISK_MESSAGE_POLL:
+		return "poll";
+
+	case TAPDISK_MESSAGE_POLL_RSP:
+		return "poll response";
+
+	case TAPDISK_MESSAGE_SCHED:
+		return "sched";
+
+	case TAPDISK_MESSAGE_SCHED_RSP:
+		return "sched response";
+
+	case TAPDISK_MESSAGE_COALESCE:
+		return "coalesce";
+
+	case TAPDISK_MESSAGE_COALESCE_RSP:
+		return "coalesce response";
+
+	case TAPDISK_MESSAGE_CACHE:
+		return "cache";
+
+	case TAPDISK_MESSAGE_CACHE_RSP:
+		return "cache response";
+
+	case TAPDISK_MESSAGE_BATCH:
+		return "batch";
+
+	case TAPDISK_MESSAGE_BATCH_RSP:
+		return "batch response";
+
+	case TAPDISK_MESSAGE_MIGRATE:
+		return "migrate";
+
+	case TAPDISK_MESSAGE_MIGRATE_RSP:
+		return "migrate response";
+
+	case TAPDISK_MESSAGE_TRACE:
+		return "trace";
+
+	case TAPDISK_MESSAGE_TRACE_RSP:
+		return "trace response";
+
+	case TAPDISK_MESSAGE_RECORD:
+		return "record";
+
+	case TAPDISK_MESSAGE_RECORD_RSP:
+		return "record response";
+
+	case TAPDISK_MESSAGE_RING:
+		return "ring";
+
+	case TAPDISK_MESSAGE_RING_RSP:
+		return "ring response";
+
+	case TAPDISK_MESSAGE_HEADROOM:
+		return "headroom";
+
+	case TAPDISK_MESSAGE_HEADROOM_RSP:
+		return "headroom response";
+
+	case TAPDISK_MESSAGE_SUBSCRIBE:
+		return "subscribe";
+
+	case TAPDISK_MESSAGE_SUBSCRIBE_RSP:
+		return "subscribe response";
+
+	case TAPDISK_MESSAGE_EVENT:
+		return "event";
+
+	case TAPDISK_MESSAGE_COUNTERS:
+		return "counters";
+
+	case TAPDISK_MESSAGE_HEAT:
+		return "heat";
+
+	case TAPDISK_MESSAGE_HEAT_RSP:
+		return "heat response";
+
+	case TAPDISK_MESSAGE_WARM:
+		return "warm";
+
+	case TAPDISK_MESSAGE_WARM_RSP:
+		return "warm response";
+
+	default:
+		return "unknown";
+	}
+}
+
+static inline const char *
+tapdisk_event_name(uint32_t event)
+{
+	switch (event) {
+	case TAPDISK_EVENT_PAUSED:
+		return "paused";
+	case TAPDISK_EVENT_RESUMED:
+		return "resumed";
+	case TAPDISK_EVENT_ERROR:
+		return "error";
+	case TAPDISK_EVENT_ENOSPC:
+		return "enospc";
+	case TAPDISK_EVENT_HEADROOM:
+		return "headroom";
+	case TAPDISK_EVENT_CLOSED:
+		return "closed";
 	default:
 		return "unknown";
 	}
@@ -0,0 +1,112 @@
+/*
+ * Copyright (C) Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2.1 only
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef _TAPDISK_SHMSTATS_H_
+#define _TAPDISK_SHMSTATS_H_
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Binary stats page of a tapdisk, at TD_SHMSTATS_PATH, mapped shared.
+ *
+ * Every VBD owns a slot while it exists. The loop running it copies
+ * its counters in, at most every TD_SHMSTATS_INTERVAL ms, bracketed
+ * by a seqlock: 'seq' is odd while a slot is written. Readers copy a
+ * slot with td_shmstats_read(), without ever calling the tapdisk.
+ *
+ * Sectors and requests are counters since the VBD was created,
+ * 'inflight' is a gauge. Latencies are in usecs.
+ */
+
+#define TD_SHMSTATS_PATH         "/var/run/blktap-control/stats%d"
+#define TD_SHMSTATS_MAGIC        0x7464736873746174ULL /* "tdshstat" */
+#define TD_SHMSTATS_VERSION      1
+#define TD_SHMSTATS_INTERVAL     100  /* ms */
+
+#define TD_SHMSTATS_VBDS         64
+#define TD_SHMSTATS_IMAGES       8
+#define TD_SHMSTATS_NAME         64
+
+struct td_shmstats_image {
+	char                         name[TD_SHMSTATS_NAME];
+	char                         driver[16];
+	uint64_t                     hits[2];       /* secs, rd/wr */
+	uint64_t                     fail[2];
+	uint64_t                     lat_count[2];
+	uint64_t                     lat_max[2];
+};
+
+struct td_shmstats_vbd {
+	uint32_t                     seq;
+	uint32_t                     used;
+	uint64_t                     updated;       /* usecs, epoch */
+
+	char                         name[TD_SHMSTATS_NAME];
+	uint32_t                     minor;
+	uint32_t                     state;
+
+	uint64_t                     received;      /* requests */
+	uint64_t                     returned;
+	uint64_t                     errors;
+	uint64_t                     retries;
+	uint64_t                     secs[2];       /* rd/wr */
+	uint64_t                     secs_pending;
+	uint64_t                     zero_secs;
+	uint64_t                     flushes;
+	uint64_t                     held;
+	uint64_t                     expired;
+	uint32_t                     inflight[2];
+	uint64_t                     lat_count[2];
+	uint64_t                     lat_max[2];
+
+	uint32_t                     n_images;
+	struct td_shmstats_image     images[TD_SHMSTATS_IMAGES];
+};
+
+struct td_shmstats_page {
+	uint64_t                     magic;
+	uint32_t                     version;
+	uint32_t                     size;          /* of the page */
+	uint32_t                     pid;
+	uint32_t                     n_vbds;        /* slots */
+
+	struct td_shmstats_vbd       vbd[TD_SHMSTATS_VBDS];
+};
+
+/* a consistent copy of @src, 0 if in use, else -1 */
+static inline int
+td_shmstats_read(const struct td_shmstats_vbd *src,
+		 struct td_shmstats_vbd *dst)
+{
+	uint32_t seq;
+
+	do {
+		seq = __atomic_load_n(&src->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;
+
+		memcpy(dst, (const void *)src, sizeof(*dst));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+	} while (seq & 1 ||
+		 __atomic_load_n(&src->seq, __ATOMIC_RELAXED) != seq);
+
+	return dst->used ? 0 : -1;
+}
+
+#endif
@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2.1 only
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef _TAPDISK_TRACE_H_
+#define _TAPDISK_TRACE_H_
+
+#include <stdint.h>
+
+/*
+ * Binary hot-path trace of a tapdisk, as dumped by TAPDISK_MESSAGE_TRACE.
+ *
+ * A td_trace_header, then 'threads' times a td_trace_thread followed
+ * by its 'count' records, oldest first. Timestamps are CLOCK_MONOTONIC
+ * nsecs. The id ties the records of one request together: the vreq up
+ * to the driver queue and back, the tiocb from submit to completion.
+ */
+
+#define TD_TRACE_MAGIC           0x7464747263ULL  /* "tdtrc" */
+#define TD_TRACE_VERSION         1
+
+enum {
+	TD_TRACE_ARRIVE = 1,     /* request reaches the vbd */
+	TD_TRACE_QUEUE,          /* handed to an image driver */
+	TD_TRACE_SUBMIT,         /* tiocb queued for the kernel */
+	TD_TRACE_COMPLETE,       /* tiocb completion */
+	TD_TRACE_RESPOND,        /* response on the ring */
+	TD_TRACE_POINTS,
+};
+
+struct td_trace_rec {
+	uint64_t                     ts;
+	uint64_t                     id;
+	uint64_t                     sec;
+	uint32_t                     secs;
+	uint8_t                      point;
+	uint8_t                      op;
+	int16_t                      err;
+};
+
+struct td_trace_thread {
+	uint32_t                     tid;
+	uint32_t                     count;
+	uint64_t                     lost;      /* overwritten, since enabled */
+};
+
+struct td_trace_header {
+	uint64_t                     magic;
+	uint32_t                     version;
+	uint32_t                     enabled;
+	uint32_t                     threads;
+	uint32_t                     rec_size;
+};
+
+static inline const char *
+td_trace_point_name(int point)
+{
+	switch (point) {
+	case TD_TRACE_ARRIVE:   return "arrive";
+	case TD_TRACE_QUEUE:    return "queue";
+	case TD_TRACE_SUBMIT:   return "submit";
+	case TD_TRACE_COMPLETE: return "complete";
+	case TD_TRACE_RESPOND:  return "respond";
+	default:                return "unknown";
+	}
+}
+
+#endif
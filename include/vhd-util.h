@@ -18,6 +18,8 @@
 #ifndef _VHD_UTIL_H_
 #define _VHD_UTIL_H_
 
+#include <stdint.h>
+
 int vhd_util_create(int argc, char **argv);
 int vhd_util_snapshot(int argc, char **argv);
 int vhd_util_query(int argc, char **argv);
@@ -27,9 +29,14 @@ int vhd_util_repair(int argc, char **argv);
 int vhd_util_fill(int argc, char **argv);
 int vhd_util_resize(int argc, char **argv);
 int vhd_util_coalesce(int argc, char **argv);
+int vhd_util_coalesce_parent(const char *name, int sparse,
+			     int progress, uint64_t rate);
 int vhd_util_modify(int argc, char **argv);
 int vhd_util_scan(int argc, char **argv);
 int vhd_util_check(int argc, char **argv);
 int vhd_util_revert(int argc, char **argv);
+int vhd_util_changes(int argc, char **argv);
+int vhd_util_compress(int argc, char **argv);
+int vhd_util_copy(int argc, char **argv);
 
 #endif
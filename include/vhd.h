@@ -61,6 +61,9 @@ static const char HD_COOKIE[9]  =  "conectix";
 #define HD_NO_FEATURES     0x00000000
 #define HD_TEMPORARY       0x00000001 /* disk can be deleted on shutdown */
 #define HD_RESERVED        0x00000002 /* NOTE: must always be set        */
+#define HD_COMPRESSED      0x00000100 /* tapdisk-specific: read-only,
+					 block data compressed, see
+					 dd_hdr.zmap_offset               */
 
 /* Version field in hd_ftr */
 #define HD_FF_VERSION      0x00010000
@@ -126,10 +129,12 @@ struct dd_hdr {
   uint32_t    checksum;        /* Header checksum.  1's comp of all fields.    */
   uuid_t      prt_uuid;        /* ID of the parent disk.                       */
   uint32_t    prt_ts;          /* Modification time of the parent disk         */
-  uint32_t    res1;            /* Reserved.                                    */
+  uint32_t    data_shift;      /* tapdisk-specific: sectors data is offset by  */
   char        prt_name[512];   /* Parent unicode name.                         */
   struct prt_loc loc[8];  /* Parent locator entries.                      */
-  char        res2[256];       /* Reserved.                                    */
+  uint64_t    zmap_offset;     /* tapdisk-specific: offset of compressed sizes */
+  uint32_t    zcodec;          /* tapdisk-specific: block compression codec    */
+  char        res2[244];       /* Reserved.                                    */
 };
 
 /* VHD cookie string. */
@@ -138,6 +143,16 @@ static const char DD_COOKIE[9]  =  "cxsparse";
 /* Version field in hd_ftr */
 #define DD_VERSION 0x00010000
 
+/*
+ * Compressed images (HD_COMPRESSED) keep each block's bitmap where a
+ * dynamic disk has it, followed by the block data compressed with
+ * zcodec and padded to a sector. The zmap, a big endian uint32_t per
+ * BAT entry, holds the compressed length in bytes; a length of a whole
+ * block means the block is stored as is.
+ */
+#define DD_ZCODEC_NONE 0
+#define DD_ZCODEC_LZ4  1
+
 /* Default blocksize is 2 meg. */
 #define DD_BLOCKSIZE_DEFAULT 0x00200000
 
@@ -21,9 +21,13 @@
 
 #include <stdio.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
+#include <unistd.h>
+#include <endian.h>
+#include <sys/stat.h>
 
 #include "lvm-util.h"
 
@@ -35,6 +39,58 @@
 #define _NAME "%255s"
 static char line[1024];
 
+#define LVM_SECTOR_SIZE          512
+#define LVM_IO_ALIGN             4096
+#define LVM_LABEL_SCAN_SECTORS   4
+#define LVM_LABEL_ID             "LABELONE"
+#define LVM_LABEL_TYPE           "LVM2 001"
+#define LVM_MDA_MAGIC            " LVM2 x[5A%r0N*>"
+#define LVM_MDA_HEADER_SIZE      512
+#define LVM_RAW_LOCN_IGNORED     0x1
+#define LVM_SEQNO_SCAN           1024
+
+#define LVM_CACHE_MAGIC          0x6c766d63 /* "lvmc" */
+#define LVM_CACHE_VERSION        1
+
+struct lvm_label_header {
+	char                     id[8];
+	uint64_t                 sector;
+	uint32_t                 crc;
+	uint32_t                 offset;    /* of the pv_header */
+	char                     type[8];
+} __attribute__((packed));
+
+struct lvm_disk_locn {
+	uint64_t                 offset;
+	uint64_t                 size;
+} __attribute__((packed));
+
+struct lvm_raw_locn {
+	uint64_t                 offset;
+	uint64_t                 size;
+	uint32_t                 checksum;
+	uint32_t                 flags;
+} __attribute__((packed));
+
+struct lvm_mda_header {
+	uint32_t                 checksum;
+	char                     magic[16];
+	uint32_t                 version;
+	uint64_t                 start;
+	uint64_t                 size;
+	struct lvm_raw_locn      raw_locns[1];
+} __attribute__((packed));
+
+struct lvm_cache_header {
+	uint32_t                 magic;
+	uint32_t                 version;
+	uint64_t                 seqno;
+	uint64_t                 extent_size;
+	int32_t                  pv_cnt;
+	int32_t                  lv_cnt;
+	char                     name[MAX_NAME_SIZE];
+};
+
 static inline int
 lvm_read_line(FILE *scan)
 {
@@ -102,13 +158,14 @@ lvm_open_vg(const char *vgname, struct vg *vg)
 	FILE *scan;
 	int i, err, pvs, lvs;
 	char *cmd, pvname[256];
-	uint64_t size, pv_start;
+	uint64_t size, pv_start, seqno;
 
 	memset(vg, 0, sizeof(*vg));
 
 	err = asprintf(&cmd, "/usr/sbin/vgs %s --noheadings --nosuffix --units=b "
 		       "--options=vg_name,vg_extent_size,lv_count,pv_count,"
-		       "pv_name,pe_start --unbuffered 2> /dev/null", vgname);
+		       "pv_name,pe_start,vg_seqno --unbuffered 2> /dev/null",
+		       vgname);
 	if (err == -1)
 		return -ENOMEM;
 
@@ -124,8 +181,9 @@ lvm_open_vg(const char *vgname, struct vg *vg)
 			break;
 
 		err = -EINVAL;
-		if (sscanf(line, _NAME" %"PRIu64" %d %d "_NAME" %"PRIu64, vg->name,
-			   &size, &lvs, &pvs, pvname, &pv_start) != 6) {
+		if (sscanf(line, _NAME" %"PRIu64" %d %d "_NAME" %"PRIu64" %"PRIu64,
+			   vg->name, &size, &lvs, &pvs, pvname, &pv_start,
+			   &seqno) != 7) {
 			EPRINTF("sscanf failed on '%s'\n", line);
 			goto out;
 		}
@@ -163,6 +221,7 @@ lvm_open_vg(const char *vgname, struct vg *vg)
 	vg->lv_cnt      = lvs;
 	vg->pv_cnt      = pvs;
 	vg->extent_size = size;
+	vg->seqno       = seqno;
 
 out:
 	if (scan)
@@ -213,7 +272,8 @@ lvm_scan_lvs(struct vg *vg)
 
 	err = asprintf(&cmd, "/usr/sbin/lvs %s --noheadings --nosuffix --units=b "
 		       "--options=lv_name,lv_size,segtype,seg_count,seg_start,"
-		       "seg_size,devices --unbuffered 2> /dev/null", vg->name);
+		       "seg_size,vg_seqno,devices --unbuffered 2> /dev/null",
+		       vg->name);
 	if (err == -1)
 		return -ENOMEM;
 
@@ -230,6 +290,7 @@ lvm_scan_lvs(struct vg *vg)
 		struct lv_segment seg;
 		unsigned long long size, seg_start;
 		char type[32], name[256], devices[1024];
+		uint64_t seqno;
 
 		if (i >= vg->lv_cnt)
 			break;
@@ -242,13 +303,17 @@ lvm_scan_lvs(struct vg *vg)
 		err = -EINVAL;
 		lv  = vg->lvs + i;
 
-		if (sscanf(line, _NAME" %llu %31s %u %llu %"PRIu64" %1023s",
-			   name, &size, type, &segs, &seg_start,
-			   &seg.pe_size, devices) != 7) {
+		if (sscanf(line, _NAME" %llu %31s %u %llu %"PRIu64" %"PRIu64
+			   " %1023s", name, &size, type, &segs, &seg_start,
+			   &seg.pe_size, &seqno, devices) != 8) {
 			EPRINTF("sscanf failed on '%s'\n", line);
 			goto out;
 		}
 
+		/* metadata changed between vgs and lvs: don't cache this */
+		if (seqno != vg->seqno)
+			vg->seqno = 0;
+
 		if (seg_start)
 			goto next;
 
@@ -287,6 +352,279 @@ out:
 	return err;
 }
 
+/* O_DIRECT read of @size bytes at @off: unaligned ends are read around */
+static int
+lvm_read_dev(int fd, void *dst, size_t size, uint64_t off)
+{
+	int err;
+	void *buf;
+	uint64_t start;
+	size_t len;
+	ssize_t n;
+
+	start = off & ~((uint64_t)LVM_IO_ALIGN - 1);
+	len   = (off - start + size + LVM_IO_ALIGN - 1) & ~(LVM_IO_ALIGN - 1);
+
+	err = posix_memalign(&buf, LVM_IO_ALIGN, len);
+	if (err)
+		return -err;
+
+	n = pread(fd, buf, len, start);
+	if (n < 0)
+		err = -errno;
+	else if (n < off - start + size)
+		err = -EIO;
+	else
+		memcpy(dst, buf + (off - start), size);
+
+	free(buf);
+	return err;
+}
+
+static int
+lvm_find_label(int fd, uint64_t *mda, uint64_t *mda_size)
+{
+	int i, err;
+	char buf[LVM_LABEL_SCAN_SECTORS * LVM_SECTOR_SIZE];
+	struct lvm_label_header *label;
+	struct lvm_disk_locn *locn;
+	size_t off;
+
+	err = lvm_read_dev(fd, buf, sizeof(buf), 0);
+	if (err)
+		return err;
+
+	for (i = 0; i < LVM_LABEL_SCAN_SECTORS; i++) {
+		label = (struct lvm_label_header *)(buf + i * LVM_SECTOR_SIZE);
+		if (!memcmp(label->id, LVM_LABEL_ID, sizeof(label->id)) &&
+		    !memcmp(label->type, LVM_LABEL_TYPE, sizeof(label->type)))
+			break;
+	}
+
+	if (i == LVM_LABEL_SCAN_SECTORS)
+		return -EINVAL;
+
+	/* pv_header: uuid, device size, then data and metadata areas */
+	off = i * LVM_SECTOR_SIZE + le32toh(label->offset) + 32 + 8;
+
+	for (locn = (void *)buf + off; ; locn++) {
+		if ((void *)(locn + 1) > (void *)buf + sizeof(buf))
+			return -EINVAL;
+		if (!locn->offset && !locn->size)
+			break;
+	}
+
+	locn++;
+	if ((void *)(locn + 1) > (void *)buf + sizeof(buf) ||
+	    (!locn->offset && !locn->size))
+		return -ENOENT;
+
+	*mda      = le64toh(locn->offset);
+	*mda_size = le64toh(locn->size);
+	return 0;
+}
+
+/* seqno of the committed metadata of @vgname on @dev */
+static int
+lvm_read_seqno(const char *vgname, const char *dev, uint64_t *seqno)
+{
+	int fd, err;
+	uint64_t mda, mda_size, off, len;
+	struct lvm_mda_header hdr;
+	struct lvm_raw_locn *rl;
+	char text[LVM_SEQNO_SCAN + 1], *p;
+	size_t n, name_len;
+
+	fd = open(dev, O_RDONLY | O_DIRECT);
+	if (fd == -1)
+		return -errno;
+
+	err = lvm_find_label(fd, &mda, &mda_size);
+	if (err)
+		goto out;
+
+	err = lvm_read_dev(fd, &hdr, sizeof(hdr), mda);
+	if (err)
+		goto out;
+
+	err = -EINVAL;
+	if (memcmp(hdr.magic, LVM_MDA_MAGIC, sizeof(hdr.magic)))
+		goto out;
+
+	/* an ignored area is not kept up to date */
+	rl  = &hdr.raw_locns[0];
+	if (le32toh(rl->flags) & LVM_RAW_LOCN_IGNORED) {
+		err = -ENOENT;
+		goto out;
+	}
+
+	off = le64toh(rl->offset);
+	len = le64toh(rl->size);
+	if (!off || off >= mda_size || off < LVM_MDA_HEADER_SIZE)
+		goto out;
+
+	/* the text area is a ring after the header */
+	memset(text, 0, sizeof(text));
+	n = len < LVM_SEQNO_SCAN ? len : LVM_SEQNO_SCAN;
+	if (off + n > mda_size) {
+		size_t head = mda_size - off;
+
+		err = lvm_read_dev(fd, text, head, mda + off);
+		if (!err)
+			err = lvm_read_dev(fd, text + head, n - head,
+					   mda + LVM_MDA_HEADER_SIZE);
+	} else
+		err = lvm_read_dev(fd, text, n, mda + off);
+	if (err)
+		goto out;
+
+	err = -EINVAL;
+	name_len = strlen(vgname);
+	if (strncmp(text, vgname, name_len) || text[name_len] != ' ')
+		goto out;
+
+	p = strstr(text, "\nseqno = ");
+	if (!p || sscanf(p, "\nseqno = %"SCNu64, seqno) != 1)
+		goto out;
+
+	err = 0;
+
+out:
+	close(fd);
+	return err;
+}
+
+static int
+lvm_vg_seqno(const struct vg *vg, uint64_t *seqno)
+{
+	int i, err;
+
+	err = -ENOENT;
+	for (i = 0; i < vg->pv_cnt; i++) {
+		err = lvm_read_seqno(vg->name, vg->pvs[i].name, seqno);
+		if (err != -ENOENT)
+			break;
+	}
+
+	return err;
+}
+
+static char *
+lvm_cache_path(const char *vgname)
+{
+	char *path;
+
+	if (!vgname[0] || vgname[0] == '.' || strchr(vgname, '/'))
+		return NULL;
+
+	if (asprintf(&path, "%s/%s", LVM_CACHE_DIR, vgname) == -1)
+		return NULL;
+
+	return path;
+}
+
+static int
+lvm_load_cache(const char *vgname, struct vg *vg)
+{
+	FILE *f;
+	int err;
+	char *path;
+	struct lvm_cache_header hdr;
+
+	memset(vg, 0, sizeof(*vg));
+
+	path = lvm_cache_path(vgname);
+	if (!path)
+		return -EINVAL;
+
+	f = fopen(path, "r");
+	free(path);
+	if (!f)
+		return -errno;
+
+	err = -EINVAL;
+	if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+	    hdr.magic != LVM_CACHE_MAGIC ||
+	    hdr.version != LVM_CACHE_VERSION ||
+	    hdr.pv_cnt <= 0 || hdr.lv_cnt < 0 || !hdr.seqno ||
+	    strncmp(hdr.name, vgname, sizeof(hdr.name)))
+		goto out;
+
+	err = -ENOMEM;
+	vg->pvs = calloc(hdr.pv_cnt, sizeof(struct pv));
+	vg->lvs = calloc(hdr.lv_cnt ? : 1, sizeof(struct lv));
+	if (!vg->pvs || !vg->lvs)
+		goto out;
+
+	err = -EINVAL;
+	if (fread(vg->pvs, sizeof(struct pv), hdr.pv_cnt, f) != hdr.pv_cnt ||
+	    fread(vg->lvs, sizeof(struct lv), hdr.lv_cnt, f) != hdr.lv_cnt ||
+	    fgetc(f) != EOF)
+		goto out;
+
+	strcpy(vg->name, vgname);
+	vg->extent_size = hdr.extent_size;
+	vg->seqno       = hdr.seqno;
+	vg->pv_cnt      = hdr.pv_cnt;
+	vg->lv_cnt      = hdr.lv_cnt;
+	err             = 0;
+
+out:
+	fclose(f);
+	if (err)
+		lvm_free_vg(vg);
+	return err;
+}
+
+static void
+lvm_save_cache(const struct vg *vg)
+{
+	FILE *f;
+	int err;
+	char *path, *tmp;
+	struct lvm_cache_header hdr;
+
+	path = lvm_cache_path(vg->name);
+	if (!path)
+		return;
+
+	tmp = NULL;
+	if (asprintf(&tmp, "%s.%d", path, getpid()) == -1) {
+		tmp = NULL;
+		goto out;
+	}
+
+	if (mkdir(LVM_CACHE_DIR, 0700) == -1 && errno != EEXIST)
+		goto out;
+
+	f = fopen(tmp, "w");
+	if (!f)
+		goto out;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic       = LVM_CACHE_MAGIC;
+	hdr.version     = LVM_CACHE_VERSION;
+	hdr.seqno       = vg->seqno;
+	hdr.extent_size = vg->extent_size;
+	hdr.pv_cnt      = vg->pv_cnt;
+	hdr.lv_cnt      = vg->lv_cnt;
+	strcpy(hdr.name, vg->name);
+
+	err = fwrite(&hdr, sizeof(hdr), 1, f) != 1 ||
+		fwrite(vg->pvs, sizeof(struct pv), vg->pv_cnt, f) != vg->pv_cnt ||
+		fwrite(vg->lvs, sizeof(struct lv), vg->lv_cnt, f) != vg->lv_cnt;
+	err |= fclose(f) != 0;
+
+	if (err || rename(tmp, path) == -1) {
+		EPRINTF("failed to cache %s: %d\n", vg->name, errno);
+		unlink(tmp);
+	}
+
+out:
+	free(tmp);
+	free(path);
+}
+
 void
 lvm_free_vg(struct vg *vg)
 {
@@ -299,8 +637,13 @@ int
 lvm_scan_vg(const char *vg_name, struct vg *vg)
 {
 	int err;
+	uint64_t seqno;
 
-	memset(vg, 0, sizeof(*vg));
+	if (!lvm_load_cache(vg_name, vg)) {
+		if (!lvm_vg_seqno(vg, &seqno) && seqno == vg->seqno)
+			return 0;
+		lvm_free_vg(vg);
+	}
 
 	err = lvm_open_vg(vg_name, vg);
 	if (err)
@@ -312,6 +655,9 @@ lvm_scan_vg(const char *vg_name, struct vg *vg)
 		return err;
 	}
 
+	if (vg->seqno)
+		lvm_save_cache(vg);
+
 	return 0;
 }
 
@@ -47,6 +47,7 @@ struct pv {
 struct vg {
 	char                     name[MAX_NAME_SIZE];
 	uint64_t                 extent_size;
+	uint64_t                 seqno;     /* of the metadata, 0 if mixed */
 
 	int                      pv_cnt;
 	struct pv               *pvs;
@@ -55,6 +56,12 @@ struct vg {
 	struct lv               *lvs;
 };
 
+/*
+ * A scan is cached in LVM_CACHE_DIR, and reused for as long as the
+ * metadata seqno on the first PV holding metadata stays the same.
+ */
+#define LVM_CACHE_DIR            "/var/run/lvm-util"
+
 int lvm_scan_vg(const char *vg_name, struct vg *vg);
 void lvm_free_vg(struct vg *vg);
 
@@ -0,0 +1,302 @@
+/*
+ * Copyright (C) Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2.1 only
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+
+/*
+ * Process-wide cache of read-only contexts, for tools walking chains:
+ * each parent is opened and its footer, header, BAT and batmap parsed
+ * once, however many children or reads come by. Entries are found by
+ * device and inode, checked against the UUID a child expects and, for
+ * regular files, their size and mtime. Opening an image read-write in
+ * this process, or closing it after, drops its entry.
+ *
+ * Disabled until vhd_chain_cache_enable(): contexts got then are
+ * private, opened and closed by each get and put. Contexts are shared
+ * between threads; their I/O is not serialized here.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "libvhd.h"
+#include "list.h"
+
+struct vhd_chain_entry {
+	vhd_context_t           vhd;
+	int                     flags;
+	int                     refs;
+	int                     stale;
+	struct stat             st;
+	struct list_head        lru;   /* of the cache, MRU first */
+};
+
+static struct {
+	pthread_mutex_t         lock;
+	int                     max;   /* unreferenced entries kept */
+	int                     idle;
+	struct list_head        entries;
+} vhd_chain = {
+	.lock    = PTHREAD_MUTEX_INITIALIZER,
+	.entries = LIST_HEAD_INIT(vhd_chain.entries),
+};
+
+static void
+vhd_chain_entry_free(struct vhd_chain_entry *e)
+{
+	vhd_close(&e->vhd);
+	free(e);
+}
+
+static int
+vhd_chain_entry_open(const char *file, int flags, struct vhd_chain_entry **_e)
+{
+	struct vhd_chain_entry *e;
+	int err;
+
+	e = calloc(1, sizeof(*e));
+	if (!e)
+		return -ENOMEM;
+
+	INIT_LIST_HEAD(&e->lru);
+	e->flags = flags;
+	e->refs  = 1;
+
+	if (stat(file, &e->st)) {
+		err = -errno;
+		free(e);
+		return err;
+	}
+
+	err = vhd_open(&e->vhd, file, flags);
+	if (err) {
+		free(e);
+		return err;
+	}
+
+	if (vhd_chain.max && vhd_type_dynamic(&e->vhd)) {
+		err = vhd_get_bat(&e->vhd);
+		if (err)
+			goto fail;
+
+		if (vhd_has_batmap(&e->vhd)) {
+			err = vhd_get_batmap(&e->vhd);
+			if (err)
+				goto fail;
+		}
+	}
+
+	*_e = e;
+	return 0;
+
+fail:
+	vhd_chain_entry_free(e);
+	return err;
+}
+
+static int
+vhd_chain_entry_valid(struct vhd_chain_entry *e, const struct stat *st,
+		      const unsigned char *uuid)
+{
+	if (e->stale)
+		return 0;
+
+	if (uuid && uuid_compare(e->vhd.footer.uuid, uuid))
+		return 0;
+
+	if (!S_ISREG(st->st_mode))
+		return 1;
+
+	return e->st.st_size == st->st_size &&
+		e->st.st_mtim.tv_sec == st->st_mtim.tv_sec &&
+		e->st.st_mtim.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+/* drops unreferenced entries past the limit, oldest first */
+static void
+vhd_chain_trim(int max)
+{
+	struct list_head *pos, *prev;
+	struct vhd_chain_entry *e;
+
+	for (pos = vhd_chain.entries.prev;
+	     pos != &vhd_chain.entries && vhd_chain.idle > max; pos = prev) {
+		prev = pos->prev;
+		e    = list_entry(pos, struct vhd_chain_entry, lru);
+		if (e->refs)
+			continue;
+
+		list_del(&e->lru);
+		vhd_chain.idle--;
+		vhd_chain_entry_free(e);
+	}
+}
+
+void
+vhd_chain_cache_enable(int max)
+{
+	pthread_mutex_lock(&vhd_chain.lock);
+	vhd_chain.max = max;
+	vhd_chain_trim(max);
+	pthread_mutex_unlock(&vhd_chain.lock);
+}
+
+void
+vhd_chain_cache_flush(void)
+{
+	pthread_mutex_lock(&vhd_chain.lock);
+	vhd_chain_trim(0);
+	pthread_mutex_unlock(&vhd_chain.lock);
+}
+
+/*
+ * @flags VHD_OPEN_RDONLY plus e.g. VHD_OPEN_IGNORE_DISABLED, @uuid the
+ * one expected, or NULL. Cached contexts come with BAT and batmap.
+ */
+int
+vhd_chain_get(const char *file, int flags, const unsigned char *uuid,
+	      vhd_context_t **ctx)
+{
+	struct vhd_chain_entry *e = NULL, *found;
+	struct stat st;
+	int err;
+
+	if (flags & VHD_OPEN_RDWR)
+		return -EINVAL;
+
+	if (stat(file, &st))
+		return -errno;
+
+	found = NULL;
+
+	pthread_mutex_lock(&vhd_chain.lock);
+
+	if (!vhd_chain.max)
+		goto miss;
+
+	list_for_each_entry(e, &vhd_chain.entries, lru) {
+		if (e->st.st_dev != st.st_dev || e->st.st_ino != st.st_ino ||
+		    e->flags != flags || e->stale)
+			continue;
+
+		if (!vhd_chain_entry_valid(e, &st, uuid)) {
+			e->stale = 1;
+			continue;
+		}
+
+		found = e;
+		break;
+	}
+
+	if (found) {
+		if (!found->refs++)
+			vhd_chain.idle--;
+		list_move(&found->lru, &vhd_chain.entries);
+		pthread_mutex_unlock(&vhd_chain.lock);
+		*ctx = &found->vhd;
+		return 0;
+	}
+
+miss:
+	pthread_mutex_unlock(&vhd_chain.lock);
+
+	err = vhd_chain_entry_open(file, flags, &e);
+	if (err)
+		return err;
+
+	if (uuid && uuid_compare(e->vhd.footer.uuid, uuid)) {
+		vhd_chain_entry_free(e);
+		return -EINVAL;
+	}
+
+	pthread_mutex_lock(&vhd_chain.lock);
+	if (vhd_chain.max)
+		list_add(&e->lru, &vhd_chain.entries);
+	pthread_mutex_unlock(&vhd_chain.lock);
+
+	*ctx = &e->vhd;
+	return 0;
+}
+
+void
+vhd_chain_put(vhd_context_t *ctx)
+{
+	struct vhd_chain_entry *e;
+
+	if (!ctx)
+		return;
+
+	e = containerof(ctx, struct vhd_chain_entry, vhd);
+
+	pthread_mutex_lock(&vhd_chain.lock);
+
+	if (--e->refs) {
+		pthread_mutex_unlock(&vhd_chain.lock);
+		return;
+	}
+
+	if (list_empty(&e->lru) || e->stale) {
+		list_del_init(&e->lru);
+		pthread_mutex_unlock(&vhd_chain.lock);
+		vhd_chain_entry_free(e);
+		return;
+	}
+
+	vhd_chain.idle++;
+	vhd_chain_trim(vhd_chain.max);
+
+	pthread_mutex_unlock(&vhd_chain.lock);
+}
+
+/* vhd_open and vhd_close, of an image about to or having changed */
+void
+vhd_chain_invalidate(const char *file)
+{
+	struct vhd_chain_entry *e, *tmp;
+	struct stat st;
+
+	if (list_empty(&vhd_chain.entries))
+		return;
+
+	if (stat(file, &st))
+		return;
+
+	pthread_mutex_lock(&vhd_chain.lock);
+
+	list_for_each_entry_safe(e, tmp, &vhd_chain.entries, lru) {
+		if (e->st.st_dev != st.st_dev || e->st.st_ino != st.st_ino)
+			continue;
+
+		if (e->refs) {
+			e->stale = 1;
+			continue;
+		}
+
+		list_del(&e->lru);
+		vhd_chain.idle--;
+		vhd_chain_entry_free(e);
+	}
+
+	pthread_mutex_unlock(&vhd_chain.lock);
+}
@@ -25,6 +25,8 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <limits.h>
+#include <sys/uio.h>
 
 #include "atomicio.h"
 #include "libvhd-journal.h"
@@ -38,6 +40,9 @@
 #define VHD_JOURNAL_ENTRY_TYPE_BATMAP_M  7
 #define VHD_JOURNAL_ENTRY_TYPE_DATA      8
 
+/* staged entries are written out once they reach this size */
+#define VHD_JOURNAL_BATCH_SIZE           (16 << 20)
+
 typedef struct vhd_journal_entry {
 	uint64_t                         cookie;
 	uint32_t                         type;
@@ -46,6 +51,15 @@ typedef struct vhd_journal_entry {
 	uint32_t                         checksum;
 } vhd_journal_entry_t;
 
+/* entries staged for one vectored write to the journal */
+typedef struct vhd_journal_batch {
+	struct iovec                    *iov;
+	int                              cnt;
+	int                              size;
+	size_t                           bytes;
+	vhd_journal_header_t             header;
+} vhd_journal_batch_t;
+
 static inline int
 vhd_journal_seek(vhd_journal_t *j, off64_t offset, int whence)
 {
@@ -313,66 +327,197 @@ vhd_journal_read_entry(vhd_journal_t *j, vhd_journal_entry_t *entry)
 }
 
 static int
-vhd_journal_write_entry(vhd_journal_t *j, vhd_journal_entry_t *entry)
+vhd_journal_validate_entry_data(vhd_journal_entry_t *entry, char *buf)
 {
 	int err;
-	vhd_journal_entry_t e;
+	uint32_t checksum;
 
-	err = vhd_journal_validate_entry(entry);
-	if (err)
-		return err;
+	err      = 0;
+	checksum = vhd_journal_checksum_entry(entry, buf, entry->size);
 
-	memcpy(&e, entry, sizeof(vhd_journal_entry_t));
-	vhd_journal_entry_out(&e);
+	if (checksum != entry->checksum)
+		return -EINVAL;
 
-	err = vhd_journal_write(j, &e, sizeof(vhd_journal_entry_t));
-	if (err)
-		return err;
+	return err;
+}
+
+static void
+vhd_journal_batch_init(vhd_journal_t *j, vhd_journal_batch_t *batch)
+{
+	memset(batch, 0, sizeof(*batch));
+	batch->header = j->header;
+}
+
+static void
+vhd_journal_batch_release(vhd_journal_batch_t *batch)
+{
+	int i;
+
+	for (i = 0; i < batch->cnt; i++)
+		free(batch->iov[i].iov_base);
+
+	free(batch->iov);
+	batch->iov   = NULL;
+	batch->cnt   = 0;
+	batch->size  = 0;
+	batch->bytes = 0;
+}
+
+/*
+ * drop whatever was staged since the last write, and put the journal
+ * header back the way it was then
+ */
+static void
+vhd_journal_batch_abort(vhd_journal_t *j, vhd_journal_batch_t *batch)
+{
+	j->header = batch->header;
+	vhd_journal_batch_release(batch);
+}
+
+static int
+vhd_journal_batch_push(vhd_journal_batch_t *batch, void *base, size_t len)
+{
+	if (batch->cnt == batch->size) {
+		struct iovec *iov;
+		int size = (batch->size ? batch->size * 2 : 16);
+
+		iov = realloc(batch->iov, size * sizeof(struct iovec));
+		if (!iov)
+			return -ENOMEM;
+
+		batch->iov  = iov;
+		batch->size = size;
+	}
+
+	batch->iov[batch->cnt].iov_base = base;
+	batch->iov[batch->cnt].iov_len  = len;
+	batch->cnt++;
+	batch->bytes += len;
 
 	return 0;
 }
 
+/*
+ * write everything staged in one go, at the end of the journal as of
+ * the last write, then the journal header that accounts for it.
+ */
 static int
-vhd_journal_validate_entry_data(vhd_journal_entry_t *entry, char *buf)
+vhd_journal_batch_write(vhd_journal_t *j, vhd_journal_batch_t *batch)
 {
-	int err;
-	uint32_t checksum;
+	int cnt, err;
+	off64_t off;
+	ssize_t ret;
+	struct iovec *iov;
 
-	err      = 0;
-	checksum = vhd_journal_checksum_entry(entry, buf, entry->size);
+	off = batch->header.journal_eof;
+	iov = batch->iov;
+	cnt = batch->cnt;
 
-	if (checksum != entry->checksum)
-		return -EINVAL;
+	while (cnt) {
+		if (!iov->iov_len) {
+			iov++;
+			cnt--;
+			continue;
+		}
+
+		ret = pwritev(j->jfd, iov, MIN(cnt, IOV_MAX), off);
+		if (ret <= 0) {
+			if (ret == -1 && errno == EINTR)
+				continue;
+			err = (ret == -1 ? -errno : -EIO);
+			goto fail;
+		}
+
+		off += ret;
+
+		for (; cnt && ret >= iov->iov_len; iov++, cnt--)
+			ret -= iov->iov_len;
+
+		/* short write: finish this buffer by hand */
+		if (ret) {
+			char *buf  = (char *)iov->iov_base + ret;
+			size_t len = iov->iov_len - ret;
+
+			while (len) {
+				ret = pwrite(j->jfd, buf, len, off);
+				if (ret <= 0) {
+					if (ret == -1 && errno == EINTR)
+						continue;
+					err = (ret == -1 ? -errno : -EIO);
+					goto fail;
+				}
+
+				buf += ret;
+				len -= ret;
+				off += ret;
+			}
+
+			iov++;
+			cnt--;
+		}
+	}
 
+	err = vhd_journal_write_header(j, &j->header);
+	if (err)
+		goto fail;
+
+	vhd_journal_batch_release(batch);
+	batch->header = j->header;
+	return 0;
+
+fail:
+	vhd_journal_batch_abort(j, batch);
+	if (!j->is_block)
+		vhd_journal_truncate(j, j->header.journal_eof);
 	return err;
 }
 
+/*
+ * queue an entry for buf, which the batch takes over in all cases;
+ * large batches are written out as they fill
+ */
 static int
-vhd_journal_update(vhd_journal_t *j, off64_t offset,
-		   char *buf, size_t size, uint32_t type)
+vhd_journal_batch_take(vhd_journal_t *j, vhd_journal_batch_t *batch,
+		       off64_t offset, char *buf, size_t size, uint32_t type)
 {
 	int err;
-	uint64_t *off, off_bak;
+	uint64_t *off;
 	uint32_t *entries;
-	vhd_journal_entry_t entry;
+	vhd_journal_entry_t *entry;
 
-	entry.type     = type;
-	entry.size     = size;
-	entry.offset   = offset;
-	entry.cookie   = VHD_JOURNAL_ENTRY_COOKIE;
-	entry.checksum = vhd_journal_checksum_entry(&entry, buf, size);
+	entry = malloc(sizeof(vhd_journal_entry_t));
+	if (!entry) {
+		free(buf);
+		return -ENOMEM;
+	}
 
-	err = vhd_journal_seek(j, j->header.journal_eof, SEEK_SET);
-	if (err)
+	entry->type     = type;
+	entry->size     = size;
+	entry->offset   = offset;
+	entry->cookie   = VHD_JOURNAL_ENTRY_COOKIE;
+	entry->checksum = vhd_journal_checksum_entry(entry, buf, size);
+
+	err = vhd_journal_validate_entry(entry);
+	if (err) {
+		free(entry);
+		free(buf);
 		return err;
+	}
 
-	err = vhd_journal_write_entry(j, &entry);
-	if (err)
-		goto fail;
+	vhd_journal_entry_out(entry);
 
-	err = vhd_journal_write(j, buf, size);
-	if (err)
-		goto fail;
+	err = vhd_journal_batch_push(batch, entry, sizeof(*entry));
+	if (err) {
+		free(entry);
+		free(buf);
+		return err;
+	}
+
+	err = vhd_journal_batch_push(batch, buf, size);
+	if (err) {
+		free(buf);
+		return err;
+	}
 
 	if (type == VHD_JOURNAL_ENTRY_TYPE_DATA) {
 		off     = &j->header.journal_data_offset;
@@ -382,29 +527,46 @@ vhd_journal_update(vhd_journal_t *j, off64_t offset,
 		entries = &j->header.journal_metadata_entries;
 	}
 
-	off_bak = *off;
 	if (!(*entries)++)
 		*off = j->header.journal_eof;
 	j->header.journal_eof += (size + sizeof(vhd_journal_entry_t));
 
-	err = vhd_journal_write_header(j, &j->header);
-	if (err) {
-		if (!--(*entries))
-			*off = off_bak;
-		j->header.journal_eof -= (size + sizeof(vhd_journal_entry_t));
-		goto fail;
-	}
+	if (batch->bytes >= VHD_JOURNAL_BATCH_SIZE)
+		return vhd_journal_batch_write(j, batch);
 
 	return 0;
+}
 
-fail:
-	if (!j->is_block)
-		vhd_journal_truncate(j, j->header.journal_eof);
-	return err;
+/* as vhd_journal_batch_take, for a buffer the caller keeps */
+static int
+vhd_journal_batch_add(vhd_journal_t *j, vhd_journal_batch_t *batch,
+		      off64_t offset, char *buf, size_t size, uint32_t type)
+{
+	char *copy;
+
+	copy = malloc(size);
+	if (!copy)
+		return -ENOMEM;
+
+	memcpy(copy, buf, size);
+	return vhd_journal_batch_take(j, batch, offset, copy, size, type);
 }
 
+/* write out the batch and make the whole transaction durable */
 static int
-vhd_journal_add_footer(vhd_journal_t *j)
+vhd_journal_batch_commit(vhd_journal_t *j, vhd_journal_batch_t *batch)
+{
+	int err;
+
+	err = vhd_journal_batch_write(j, batch);
+	if (err)
+		return err;
+
+	return vhd_journal_sync(j);
+}
+
+static int
+vhd_journal_add_footer(vhd_journal_t *j, vhd_journal_batch_t *batch)
 {
 	int err;
 	off64_t off;
@@ -426,7 +588,7 @@ vhd_journal_add_footer(vhd_journal_t *j)
 		return err;
 
 	vhd_footer_out(&footer);
-	err = vhd_journal_update(j, off - sizeof(vhd_footer_t),
+	err = vhd_journal_batch_add(j, batch, off - sizeof(vhd_footer_t),
 				 (char *)&footer,
 				 sizeof(vhd_footer_t),
 				 VHD_JOURNAL_ENTRY_TYPE_FOOTER_P);
@@ -441,7 +603,7 @@ vhd_journal_add_footer(vhd_journal_t *j)
 		return err;
 
 	vhd_footer_out(&footer);
-	err = vhd_journal_update(j, 0,
+	err = vhd_journal_batch_add(j, batch, 0,
 				 (char *)&footer,
 				 sizeof(vhd_footer_t),
 				 VHD_JOURNAL_ENTRY_TYPE_FOOTER_C);
@@ -450,7 +612,7 @@ vhd_journal_add_footer(vhd_journal_t *j)
 }
 
 static int
-vhd_journal_add_header(vhd_journal_t *j)
+vhd_journal_add_header(vhd_journal_t *j, vhd_journal_batch_t *batch)
 {
 	int err;
 	off64_t off;
@@ -466,7 +628,7 @@ vhd_journal_add_header(vhd_journal_t *j)
 	off = vhd->footer.data_offset;
 
 	vhd_header_out(&header);
-	err = vhd_journal_update(j, off,
+	err = vhd_journal_batch_add(j, batch, off,
 				 (char *)&header,
 				 sizeof(vhd_header_t),
 				 VHD_JOURNAL_ENTRY_TYPE_HEADER);
@@ -475,7 +637,7 @@ vhd_journal_add_header(vhd_journal_t *j)
 }
 
 static int
-vhd_journal_add_locators(vhd_journal_t *j)
+vhd_journal_add_locators(vhd_journal_t *j, vhd_journal_batch_t *batch)
 {
 	int i, n, err;
 	vhd_context_t *vhd;
@@ -516,24 +678,23 @@ vhd_journal_add_locators(vhd_journal_t *j)
 		if (err)
 			goto end;
 
-		err  = vhd_journal_update(j, off, buf, size,
-					  VHD_JOURNAL_ENTRY_TYPE_LOCATOR);
+		err  = vhd_journal_batch_take(j, batch, off, buf, size,
+					      VHD_JOURNAL_ENTRY_TYPE_LOCATOR);
 		if (err)
-			goto end;
+			break;
 
-		err = 0;
+		continue;
 
 	end:
 		free(buf);
-		if (err)
-			break;
+		break;
 	}
 
 	return err;
 }
 
 static int
-vhd_journal_add_bat(vhd_journal_t *j)
+vhd_journal_add_bat(vhd_journal_t *j, vhd_journal_batch_t *batch)
 {
 	int err;
 	off64_t off;
@@ -555,19 +716,17 @@ vhd_journal_add_bat(vhd_journal_t *j)
 	size = vhd_bytes_padded(bat.entries * sizeof(uint32_t));
 
 	vhd_bat_out(&bat);
-	err  = vhd_journal_update(j, off, (char *)bat.bat, size,
-				  VHD_JOURNAL_ENTRY_TYPE_BAT);
-
-	free(bat.bat);
-	return err;
+	return vhd_journal_batch_take(j, batch, off, (char *)bat.bat, size,
+				      VHD_JOURNAL_ENTRY_TYPE_BAT);
 }
 
 static int
-vhd_journal_add_batmap(vhd_journal_t *j)
+vhd_journal_add_batmap(vhd_journal_t *j, vhd_journal_batch_t *batch)
 {
 	int err;
 	off64_t off;
 	size_t size;
+	char *hdr;
 	vhd_context_t *vhd;
 	vhd_batmap_t batmap;
 
@@ -581,24 +740,30 @@ vhd_journal_add_batmap(vhd_journal_t *j)
 	if (err)
 		return err;
 
+	/* the header, zero-padded to its sector */
 	size = vhd_bytes_padded(sizeof(struct dd_batmap_hdr));
+	hdr  = calloc(1, size);
+	if (!hdr) {
+		free(batmap.map);
+		return -ENOMEM;
+	}
 
 	vhd_batmap_header_out(&batmap);
-	err  = vhd_journal_update(j, off, (char *)&batmap.header, size,
-				  VHD_JOURNAL_ENTRY_TYPE_BATMAP_H);
-	if (err)
-		goto out;
-
+	memcpy(hdr, &batmap.header, sizeof(batmap.header));
 	vhd_batmap_header_in(&batmap);
+
+	err  = vhd_journal_batch_take(j, batch, off, hdr, size,
+				      VHD_JOURNAL_ENTRY_TYPE_BATMAP_H);
+	if (err) {
+		free(batmap.map);
+		return err;
+	}
+
 	off  = batmap.header.batmap_offset;
 	size = vhd_sectors_to_bytes(batmap.header.batmap_size);
 
-	err  = vhd_journal_update(j, off, batmap.map, size,
-				  VHD_JOURNAL_ENTRY_TYPE_BATMAP_M);
-
-out:
-	free(batmap.map);
-	return err;
+	return vhd_journal_batch_take(j, batch, off, batmap.map, size,
+				      VHD_JOURNAL_ENTRY_TYPE_BATMAP_M);
 }
 
 static int
@@ -606,36 +771,42 @@ vhd_journal_add_metadata(vhd_journal_t *j)
 {
 	int err;
 	vhd_context_t *vhd;
+	vhd_journal_batch_t batch;
 
 	vhd = &j->vhd;
+	vhd_journal_batch_init(j, &batch);
 
-	err = vhd_journal_add_footer(j);
+	err = vhd_journal_add_footer(j, &batch);
 	if (err)
-		return err;
+		goto fail;
 
 	if (!vhd_type_dynamic(vhd))
-		return 0;
+		return vhd_journal_batch_commit(j, &batch);
 
-	err = vhd_journal_add_header(j);
+	err = vhd_journal_add_header(j, &batch);
 	if (err)
-		return err;
+		goto fail;
 
-	err = vhd_journal_add_locators(j);
+	err = vhd_journal_add_locators(j, &batch);
 	if (err)
-		return err;
+		goto fail;
 
-	err = vhd_journal_add_bat(j);
+	err = vhd_journal_add_bat(j, &batch);
 	if (err)
-		return err;
+		goto fail;
 
 	if (vhd_has_batmap(vhd)) {
-		err = vhd_journal_add_batmap(j);
+		err = vhd_journal_add_batmap(j, &batch);
 		if (err)
-			return err;
+			goto fail;
 	}
 
 	j->header.journal_data_offset = j->header.journal_eof;
-	return vhd_journal_write_header(j, &j->header);
+	return vhd_journal_batch_commit(j, &batch);
+
+fail:
+	vhd_journal_batch_abort(j, &batch);
+	return err;
 }
 
 static int
@@ -1342,6 +1513,7 @@ vhd_journal_add_block(vhd_journal_t *j, uint32_t block, char mode)
 	size_t size;
 	uint64_t blk;
 	vhd_context_t *vhd;
+	vhd_journal_batch_t batch;
 
 	buf = NULL;
 	vhd = &j->vhd;
@@ -1361,21 +1533,19 @@ vhd_journal_add_block(vhd_journal_t *j, uint32_t block, char mode)
 		return 0;
 
 	off = vhd_sectors_to_bytes(blk);
+	vhd_journal_batch_init(j, &batch);
 
 	if (mode & VHD_JOURNAL_METADATA) {
 		size = vhd_sectors_to_bytes(vhd->bm_secs);
 
 		err  = vhd_read_bitmap(vhd, block, &buf);
 		if (err)
-			return err;
-
-		err  = vhd_journal_update(j, off, buf, size,
-					  VHD_JOURNAL_ENTRY_TYPE_DATA);
-
-		free(buf);
+			goto fail;
 
+		err  = vhd_journal_batch_take(j, &batch, off, buf, size,
+					      VHD_JOURNAL_ENTRY_TYPE_DATA);
 		if (err)
-			return err;
+			goto fail;
 	}
 
 	if (mode & VHD_JOURNAL_DATA) {
@@ -1384,17 +1554,136 @@ vhd_journal_add_block(vhd_journal_t *j, uint32_t block, char mode)
 
 		err  = vhd_read_block(vhd, block, &buf);
 		if (err)
-			return err;
+			goto fail;
 
-		err  = vhd_journal_update(j, off, buf, size,
-					  VHD_JOURNAL_ENTRY_TYPE_DATA);
-		free(buf);
+		err  = vhd_journal_batch_take(j, &batch, off, buf, size,
+					      VHD_JOURNAL_ENTRY_TYPE_DATA);
+		if (err)
+			goto fail;
+	}
+
+	return vhd_journal_batch_commit(j, &batch);
 
+fail:
+	vhd_journal_batch_abort(j, &batch);
+	return err;
+}
+
+/*
+ * journal the bitmaps and data of several blocks, each as one entry,
+ * with a single vectored write and sync for the lot
+ */
+int
+vhd_journal_add_blocks(vhd_journal_t *j, const uint32_t *blocks, int cnt)
+{
+	int i, err;
+	void *buf;
+	off64_t off;
+	size_t size;
+	ssize_t ret;
+	uint64_t blk;
+	vhd_context_t *vhd;
+	vhd_journal_batch_t batch;
+
+	vhd = &j->vhd;
+
+	if (!vhd_type_dynamic(vhd))
+		return -EINVAL;
+
+	err = vhd_get_bat(vhd);
+	if (err)
+		return err;
+
+	size = vhd_sectors_to_bytes(vhd->bm_secs + vhd->spb);
+	vhd_journal_batch_init(j, &batch);
+
+	for (i = 0; i < cnt; i++) {
+		if (blocks[i] >= vhd->bat.entries) {
+			err = -ERANGE;
+			goto fail;
+		}
+
+		blk = vhd->bat.bat[blocks[i]];
+		if (blk == DD_BLK_UNUSED)
+			continue;
+
+		off = vhd_sectors_to_bytes(blk);
+
+		err = posix_memalign(&buf, VHD_SECTOR_SIZE, size);
+		if (err) {
+			err = -err;
+			goto fail;
+		}
+
+		ret = pread(vhd->fd, buf, size, off);
+		if (ret != size) {
+			err = (ret == -1 ? -errno : -EIO);
+			free(buf);
+			goto fail;
+		}
+
+		err = vhd_journal_batch_take(j, &batch, off, buf, size,
+					     VHD_JOURNAL_ENTRY_TYPE_DATA);
 		if (err)
-			return err;
+			goto fail;
 	}
 
-	return vhd_journal_sync(j);
+	return vhd_journal_batch_commit(j, &batch);
+
+fail:
+	vhd_journal_batch_abort(j, &batch);
+	return err;
+}
+
+/*
+ * journal bitmaps the caller has already read, @maps[i] for @blocks[i],
+ * with a single vectored write and sync for the lot
+ */
+int
+vhd_journal_add_bitmaps(vhd_journal_t *j, const uint32_t *blocks,
+			char **maps, int cnt)
+{
+	int i, err;
+	size_t size;
+	uint64_t blk;
+	vhd_context_t *vhd;
+	vhd_journal_batch_t batch;
+
+	vhd = &j->vhd;
+
+	if (!vhd_type_dynamic(vhd))
+		return -EINVAL;
+
+	err = vhd_get_bat(vhd);
+	if (err)
+		return err;
+
+	size = vhd_sectors_to_bytes(vhd->bm_secs);
+	vhd_journal_batch_init(j, &batch);
+
+	for (i = 0; i < cnt; i++) {
+		if (blocks[i] >= vhd->bat.entries) {
+			err = -ERANGE;
+			goto fail;
+		}
+
+		blk = vhd->bat.bat[blocks[i]];
+		if (blk == DD_BLK_UNUSED)
+			continue;
+
+		err = vhd_journal_batch_add(j, &batch,
+					    vhd_sectors_to_bytes(blk),
+					    maps[i], size,
+					    VHD_JOURNAL_ENTRY_TYPE_DATA);
+		if (err)
+			goto fail;
+	}
+
+	return vhd_journal_batch_commit(j, &batch);
+
+fail:
+	vhd_journal_batch_abort(j, &batch);
+	return err;
 }
 
 /*
@@ -31,12 +31,21 @@
 #include <libgen.h>
 #include <iconv.h>
 #include <limits.h>
+#include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <linux/fs.h>
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
 
 #include "libvhd.h"
 #include "relative-path.h"
+#include "partition.h"
 
 /* VHD uses an epoch of 12:00AM, Jan 1, 2000. This is the Unix timestamp for 
  * the start of the VHD epoch. */
@@ -149,6 +158,7 @@ vhd_header_in(vhd_header_t *header)
 	BE32_IN(&header->block_size);
 	BE32_IN(&header->checksum);
 	BE32_IN(&header->prt_ts);
+	BE32_IN(&header->data_shift);
 
 	n = sizeof(header->loc) / sizeof(vhd_parent_locator_t);
 
@@ -158,6 +168,9 @@ vhd_header_in(vhd_header_t *header)
 		BE32_IN(&header->loc[i].data_len);
 		BE64_IN(&header->loc[i].data_offset);
 	}
+
+	BE64_IN(&header->zmap_offset);
+	BE32_IN(&header->zcodec);
 }
 
 void
@@ -172,6 +185,7 @@ vhd_header_out(vhd_header_t *header)
 	BE32_OUT(&header->block_size);
 	BE32_OUT(&header->checksum);
 	BE32_OUT(&header->prt_ts);
+	BE32_OUT(&header->data_shift);
 
 	n = sizeof(header->loc) / sizeof(vhd_parent_locator_t);
 
@@ -181,6 +195,9 @@ vhd_header_out(vhd_header_t *header)
 		BE32_OUT(&header->loc[i].data_len);
 		BE64_OUT(&header->loc[i].data_offset);
 	}
+
+	BE64_OUT(&header->zmap_offset);
+	BE32_OUT(&header->zcodec);
 }
 
 void
@@ -363,7 +380,7 @@ vhd_checksum_batmap(vhd_context_t *ctx, vhd_batmap_t *batmap)
 	checksum = 0;
 
 	map_size = vhd_sectors_to_bytes(secs_round_up_no_zero(
-			ctx->footer.curr_size >> (VHD_BLOCK_SHIFT + 3)));
+			(ctx->footer.curr_size / vhd_block_size(ctx)) >> 3));
 
 	for (i = 0; i < map_size; i++) {
 		if (batmap->header.batmap_version == VHD_BATMAP_VERSION(1, 1))
@@ -472,7 +489,7 @@ vhd_chain_depth(vhd_context_t *ctx, int *depth)
 {
 	char *file;
 	int err, cnt;
-	vhd_context_t vhd, *cur;
+	vhd_context_t *cur;
 
 	err    = 0;
 	cnt    = 0;
@@ -498,22 +515,23 @@ vhd_chain_depth(vhd_context_t *ctx, int *depth)
 		}
 
 		if (cur != ctx) {
-			vhd_close(cur);
+			vhd_chain_put(cur);
 			cur = NULL;
 		}
 
-		err = vhd_open(&vhd, file, VHD_OPEN_RDONLY);
-		if (err)
+		err = vhd_chain_get(file, VHD_OPEN_RDONLY, NULL, &cur);
+		if (err) {
+			cur = NULL;
 			break;
+		}
 
-		cur = &vhd;
 		free(file);
 		file = NULL;
 	}
 
 	free(file);
 	if (cur && cur != ctx)
-		vhd_close(cur);
+		vhd_chain_put(cur);
 
 	if (!err)
 		*depth = cnt;
@@ -567,6 +585,62 @@ vhd_bitmap_test(vhd_context_t *ctx, char *map, uint32_t block)
 	return test_bit(map, block);
 }
 
+/*
+ * Length of the run of bits equal to 'value' from 'start', stopping
+ * at 'end'. Tests a word at a time; map must be readable up to the
+ * word holding bit end - 1, which any sector-sized bitmap is.
+ */
+uint32_t
+vhd_bitmap_span(vhd_context_t *ctx, char *map,
+		uint32_t start, uint32_t end, int value)
+{
+	uint32_t pos, left;
+
+	pos = start;
+
+	if (vhd_creator_tapdisk(ctx) &&
+	    ctx->footer.crtr_ver == 0x00000001) {
+		/* host order 32 bit words, lsb first */
+		while (pos < end) {
+			uint32_t w = ((uint32_t *)map)[pos >> 5];
+
+			if (value)
+				w = ~w;
+			w  >>= pos & 31;
+			left = 32 - (pos & 31);
+
+			if (w) {
+				pos += __builtin_ctz(w);
+				break;
+			}
+			pos += left;
+		}
+		goto out;
+	}
+
+	/* msb first, read as big endian 64 bit words */
+	while (pos < end) {
+		uint64_t w;
+
+		memcpy(&w, map + ((pos >> 6) << 3), sizeof(w));
+		BE64_IN(&w);
+
+		if (value)
+			w = ~w;
+		w  <<= pos & 63;
+		left = 64 - (pos & 63);
+
+		if (w) {
+			pos += __builtin_clzll(w);
+			break;
+		}
+		pos += left;
+	}
+
+out:
+	return (pos < end ? pos : end) - start;
+}
+
 void
 vhd_bitmap_set(vhd_context_t *ctx, char *map, uint32_t block)
 {
@@ -670,6 +744,12 @@ vhd_end_of_data(vhd_context_t *ctx, off64_t *end)
 		return 0;
 	}
 
+	/* the zmap follows the last block */
+	if (vhd_compressed(ctx)) {
+		*end = ctx->header.zmap_offset + vhd_zmap_size(ctx);
+		return 0;
+	}
+
 	err = vhd_end_of_headers(ctx, &max);
 	if (err)
 		return err;
@@ -809,6 +889,18 @@ vhd_get_batmap(vhd_context_t *ctx)
 	return vhd_read_batmap(ctx, &ctx->batmap);
 }
 
+int
+vhd_get_zmap(vhd_context_t *ctx)
+{
+	if (!vhd_compressed(ctx))
+		return -EINVAL;
+
+	if (ctx->zmap)
+		return 0;
+
+	return vhd_read_zmap(ctx, &ctx->zmap);
+}
+
 void
 vhd_put_footer(vhd_context_t *ctx)
 {
@@ -827,8 +919,7 @@ vhd_put_bat(vhd_context_t *ctx)
 	if (!vhd_type_dynamic(ctx))
 		return;
 
-	free(ctx->bat.bat);
-	memset(&ctx->bat, 0, sizeof(vhd_bat_t));
+	vhd_release_bat(&ctx->bat);
 }
 
 void
@@ -1041,7 +1132,7 @@ vhd_read_bat(vhd_context_t *ctx, vhd_bat_t *bat)
 	/* The BAT size is stored in ctx->header.max_bat_size. However, we
 	 * sometimes preallocate BAT + batmap for max VHD size, so only read in
 	 * the BAT entries that are in use for curr_size */
-	vhd_blks = ctx->footer.curr_size >> VHD_BLOCK_SHIFT;
+	vhd_blks = vhd_data_blocks(ctx);
 	ASSERT(ctx->header.max_bat_size >= vhd_blks);
 	size = vhd_bytes_padded(vhd_blks * sizeof(uint32_t));
 
@@ -1075,6 +1166,113 @@ fail:
 	return err;
 }
 
+/*
+ * Maps the BAT instead of reading it: only the pages of it in use get
+ * read, and are decoded a chunk at a time by vhd_bat_slot. The mapping
+ * is private, so entries changed in memory never reach the file; this
+ * is for images opened read-only.
+ */
+int
+vhd_map_bat(vhd_context_t *ctx, vhd_bat_t *bat)
+{
+	int err;
+	void *map;
+	uint8_t *chunks;
+	off64_t off, pg_off;
+	uint32_t vhd_blks;
+	size_t size, n_chunks;
+	struct stat stats;
+
+	map    = MAP_FAILED;
+	chunks = NULL;
+
+	if (!vhd_type_dynamic(ctx)) {
+		err = -EINVAL;
+		goto fail;
+	}
+
+	off      = ctx->header.table_offset;
+	vhd_blks = vhd_data_blocks(ctx);
+	ASSERT(ctx->header.max_bat_size >= vhd_blks);
+
+	if (!vhd_blks) {
+		err = -EINVAL;
+		goto fail;
+	}
+
+	/* a truncated table would fault on access instead of failing here */
+	if (!ctx->is_block) {
+		if (fstat(ctx->fd, &stats)) {
+			err = -errno;
+			goto fail;
+		}
+
+		if (stats.st_size < off + (off64_t)vhd_blks * sizeof(uint32_t)) {
+			err = -EIO;
+			goto fail;
+		}
+	}
+
+	pg_off = off & ~((off64_t)getpagesize() - 1);
+	size   = off - pg_off + vhd_blks * sizeof(uint32_t);
+
+	n_chunks = ((vhd_blks - 1) >> VHD_BAT_CHUNK_SHIFT) + 1;
+	chunks   = calloc((n_chunks + 7) >> 3, 1);
+	if (!chunks) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE, ctx->fd, pg_off);
+	if (map == MAP_FAILED) {
+		err = -errno;
+		goto fail;
+	}
+
+	memset(bat, 0, sizeof(vhd_bat_t));
+	bat->spb      = ctx->header.block_size >> VHD_SECTOR_SHIFT;
+	bat->entries  = vhd_blks;
+	bat->bat      = (uint32_t *)((char *)map + (off - pg_off));
+	bat->chunks   = chunks;
+	bat->map      = map;
+	bat->map_size = size;
+
+	return 0;
+
+fail:
+	free(chunks);
+	memset(bat, 0, sizeof(vhd_bat_t));
+	VHDLOG("%s: failed to map bat: %d\n", ctx->file, err);
+	return err;
+}
+
+void
+vhd_bat_decode(vhd_bat_t *bat, uint32_t chunk)
+{
+	uint32_t i, end;
+
+	i   = chunk << VHD_BAT_CHUNK_SHIFT;
+	end = MIN(bat->entries, i + (1 << VHD_BAT_CHUNK_SHIFT));
+
+	for (; i < end; i++)
+		BE32_IN(&bat->bat[i]);
+
+	bat->chunks[chunk >> 3] |= 1 << (chunk & 7);
+}
+
+void
+vhd_release_bat(vhd_bat_t *bat)
+{
+	if (bat->map)
+		munmap(bat->map, bat->map_size);
+	else
+		free(bat->bat);
+
+	free(bat->chunks);
+	memset(bat, 0, sizeof(vhd_bat_t));
+}
+
 static int
 vhd_read_batmap_header(vhd_context_t *ctx, vhd_batmap_t *batmap)
 {
@@ -1129,7 +1327,7 @@ vhd_read_batmap_map(vhd_context_t *ctx, vhd_batmap_t *batmap)
 	size_t map_size;
 
 	map_size = vhd_sectors_to_bytes(secs_round_up_no_zero(
-			ctx->footer.curr_size >> (VHD_BLOCK_SHIFT + 3)));
+			(ctx->footer.curr_size / vhd_block_size(ctx)) >> 3));
 	ASSERT(vhd_sectors_to_bytes(batmap->header.batmap_size) >= map_size);
 
 	err = posix_memalign(&buf, VHD_SECTOR_SIZE, map_size);
@@ -1637,10 +1835,15 @@ vhd_parent_locator_get(vhd_context_t *ctx, char **parent)
 	return err;
 }
 
-int
-vhd_parent_locator_write_at(vhd_context_t *ctx,
-			    const char *parent, off64_t off, uint32_t code,
-			    size_t max_bytes, vhd_parent_locator_t *loc)
+/*
+ * fill @loc for a locator at @off, and return the sectors to write
+ * there in @_block
+ */
+static int
+vhd_parent_locator_encode(vhd_context_t *ctx,
+			  const char *parent, off64_t off, uint32_t code,
+			  size_t max_bytes, vhd_parent_locator_t *loc,
+			  void **_block)
 {
 	struct stat stats;
 	int err, len, size;
@@ -1704,10 +1907,6 @@ vhd_parent_locator_write_at(vhd_context_t *ctx,
 		err = -EINVAL;
 	}
 
-	if (err)
-		goto out;
-
-	err = vhd_seek(ctx, off, SEEK_SET);
 	if (err)
 		goto out;
 
@@ -1728,11 +1927,9 @@ vhd_parent_locator_write_at(vhd_context_t *ctx,
 	memset(block, 0, size);
 	memcpy(block, encoded, len);
 
-	err = vhd_write(ctx, block, size);
-	if (err)
-		goto out;
-
-	err = 0;
+	*_block = block;
+	block   = NULL;
+	err     = 0;
 
 out:
 	free(relative_path);
@@ -1755,6 +1952,29 @@ out:
 	return err;
 }
 
+int
+vhd_parent_locator_write_at(vhd_context_t *ctx,
+			    const char *parent, off64_t off, uint32_t code,
+			    size_t max_bytes, vhd_parent_locator_t *loc)
+{
+	int err;
+	void *block;
+
+	err = vhd_parent_locator_encode(ctx, parent, off, code,
+					max_bytes, loc, &block);
+	if (err)
+		return err;
+
+	err = vhd_seek(ctx, off, SEEK_SET);
+	if (!err)
+		err = vhd_write(ctx, block, vhd_bytes_padded(loc->data_len));
+	if (err)
+		memset(loc, 0, sizeof(vhd_parent_locator_t));
+
+	free(block);
+	return err;
+}
+
 static int
 vhd_footer_offset_at_eof(vhd_context_t *ctx, off64_t *off)
 {
@@ -1814,6 +2034,90 @@ fail:
 	return err;
 }
 
+/*
+ * inflate the @len bytes of block data at @src into the whole
+ * block at @dst; safe to call from any thread
+ */
+int
+vhd_zblock_decode(vhd_context_t *ctx, const char *src, uint32_t len,
+		  char *dst)
+{
+	int size = ctx->header.block_size;
+
+	if (len == size) {
+		memcpy(dst, src, size);
+		return 0;
+	}
+
+	switch (ctx->header.zcodec) {
+#ifdef HAVE_LZ4
+	case DD_ZCODEC_LZ4:
+		if (LZ4_decompress_safe(src, dst, len, size) != size)
+			return -EIO;
+		return 0;
+#endif
+	default:
+		return -EOPNOTSUPP;
+	}
+}
+
+/* as vhd_read_block, for compressed images */
+static int
+vhd_read_zblock(vhd_context_t *ctx, uint32_t block, char **bufp)
+{
+	int err;
+	void *buf, *zbuf;
+	uint32_t len;
+	off64_t off;
+
+	buf  = NULL;
+	zbuf = NULL;
+
+	err  = vhd_get_zmap(ctx);
+	if (err)
+		return err;
+
+	len  = ctx->zmap[block];
+	if (!len || len > ctx->header.block_size)
+		return -EINVAL;
+
+	off  = vhd_sectors_to_bytes(ctx->bat.bat[block] + ctx->bm_secs);
+
+	err  = posix_memalign(&zbuf, VHD_SECTOR_SIZE, vhd_bytes_padded(len));
+	if (err) {
+		zbuf = NULL;
+		err  = -err;
+		goto out;
+	}
+
+	err  = vhd_seek(ctx, off, SEEK_SET);
+	if (err)
+		goto out;
+
+	err  = vhd_read(ctx, zbuf, vhd_bytes_padded(len));
+	if (err)
+		goto out;
+
+	err  = posix_memalign(&buf, VHD_SECTOR_SIZE, ctx->header.block_size);
+	if (err) {
+		buf = NULL;
+		err = -err;
+		goto out;
+	}
+
+	err  = vhd_zblock_decode(ctx, zbuf, len, buf);
+	if (err)
+		goto out;
+
+	*bufp = buf;
+	buf   = NULL;
+
+out:
+	free(zbuf);
+	free(buf);
+	return err;
+}
+
 int
 vhd_read_block(vhd_context_t *ctx, uint32_t block, char **bufp)
 {
@@ -1840,6 +2144,9 @@ vhd_read_block(vhd_context_t *ctx, uint32_t block, char **bufp)
 	if (blk == DD_BLK_UNUSED)
 		return -EINVAL;
 
+	if (vhd_compressed(ctx))
+		return vhd_read_zblock(ctx, block, bufp);
+
 	off  = vhd_sectors_to_bytes(blk + ctx->bm_secs);
 	size = vhd_sectors_to_bytes(ctx->spb);
 
@@ -2043,6 +2350,67 @@ vhd_write_bat(vhd_context_t *ctx, vhd_bat_t *bat)
 	return err;
 }
 
+int
+vhd_read_zmap(vhd_context_t *ctx, uint32_t **zmapp)
+{
+	int i, err;
+	void *buf;
+	size_t size;
+
+	*zmapp = NULL;
+
+	if (!vhd_compressed(ctx))
+		return -EINVAL;
+
+	size = vhd_zmap_size(ctx);
+	err  = posix_memalign(&buf, VHD_SECTOR_SIZE, size);
+	if (err)
+		return -err;
+
+	err  = vhd_seek(ctx, ctx->header.zmap_offset, SEEK_SET);
+	if (!err)
+		err = vhd_read(ctx, buf, size);
+	if (err) {
+		free(buf);
+		return err;
+	}
+
+	for (i = 0; i < ctx->header.max_bat_size; i++)
+		BE32_IN((uint32_t *)buf + i);
+
+	*zmapp = buf;
+	return 0;
+}
+
+int
+vhd_write_zmap(vhd_context_t *ctx, uint32_t *zmap)
+{
+	int i, err;
+	void *buf;
+	size_t size;
+
+	if (!vhd_compressed(ctx))
+		return -EINVAL;
+
+	size = vhd_zmap_size(ctx);
+	err  = posix_memalign(&buf, VHD_SECTOR_SIZE, size);
+	if (err)
+		return -err;
+
+	memset(buf, 0, size);
+	memcpy(buf, zmap, ctx->header.max_bat_size * sizeof(uint32_t));
+
+	for (i = 0; i < ctx->header.max_bat_size; i++)
+		BE32_OUT((uint32_t *)buf + i);
+
+	err = vhd_seek(ctx, ctx->header.zmap_offset, SEEK_SET);
+	if (!err)
+		err = vhd_write(ctx, buf, size);
+	free(buf);
+
+	return err;
+}
+
 static int
 vhd_write_batmap_header(vhd_context_t *ctx, vhd_batmap_t *batmap)
 {
@@ -2107,7 +2475,7 @@ vhd_write_batmap(vhd_context_t *ctx, vhd_batmap_t *batmap)
 
 	off      = b.header.batmap_offset;
 	map_size = vhd_sectors_to_bytes(secs_round_up_no_zero(
-			ctx->footer.curr_size >> (VHD_BLOCK_SHIFT + 3)));
+			(ctx->footer.curr_size / vhd_block_size(ctx)) >> 3));
 	ASSERT(vhd_sectors_to_bytes(b.header.batmap_size) >= map_size);
 
 	err  = vhd_seek(ctx, off, SEEK_SET);
@@ -2208,6 +2576,9 @@ vhd_write_block(vhd_context_t *ctx, uint32_t block, char *data)
 	if (!vhd_type_dynamic(ctx))
 		return -EINVAL;
 
+	if (vhd_compressed(ctx))
+		return -EROFS;
+
 	err = vhd_validate_bat(&ctx->bat);
 	if (err)
 		return err;
@@ -2495,6 +2866,9 @@ vhd_open(vhd_context_t *ctx, const char *file, int flags)
 	if (err)
 		return err;
 
+	if (flags & VHD_OPEN_RDWR)
+		vhd_chain_invalidate(ctx->file);
+
 	oflags = O_LARGEFILE;
 	if (!(flags & VHD_OPEN_CACHED))
 		oflags |= O_DIRECT;
@@ -2570,11 +2944,14 @@ vhd_close(vhd_context_t *ctx)
 	if (ctx->file) {
 		fsync(ctx->fd);
 		close(ctx->fd);
+		if (ctx->oflags & VHD_OPEN_RDWR)
+			vhd_chain_invalidate(ctx->file);
 	}
 
 	free(ctx->file);
-	free(ctx->bat.bat);
+	vhd_release_bat(&ctx->bat);
 	free(ctx->batmap.map);
+	free(ctx->zmap);
 	memset(ctx, 0, sizeof(vhd_context_t));
 }
 
@@ -2663,9 +3040,25 @@ get_file_size(const char *name)
 	return end;
 }
 
+/* @align < 0 keeps the shift there is, none or the parent's */
+static void
+vhd_initialize_data_shift(vhd_context_t *ctx, int64_t align)
+{
+	uint32_t block_size = ctx->header.block_size;
+
+	if (align >= 0)
+		ctx->header.data_shift =
+			vhd_align_shift(block_size >> VHD_SECTOR_SHIFT, align);
+
+	ctx->header.max_bat_size = (ctx->footer.curr_size +
+			vhd_sectors_to_bytes(ctx->header.data_shift) +
+			block_size - 1) / block_size;
+}
+
 static int
 vhd_initialize_header(vhd_context_t *ctx, const char *parent_path, 
-		uint64_t size, int raw, uint64_t *psize)
+		uint64_t size, uint64_t block_size, int raw, uint64_t *psize,
+		int64_t align)
 {
 	int err;
 	struct stat stats;
@@ -2679,11 +3072,10 @@ vhd_initialize_header(vhd_context_t *ctx, const char *parent_path,
 	ctx->header.data_offset  = (uint64_t)-1;
 	ctx->header.table_offset = VHD_SECTOR_SIZE * 3; /* 1 ftr + 2 hdr */
 	ctx->header.hdr_ver      = DD_VERSION;
-	ctx->header.block_size   = VHD_BLOCK_SIZE;
+	ctx->header.block_size   = block_size ? : VHD_BLOCK_SIZE;
 	ctx->header.prt_ts       = 0;
-	ctx->header.res1         = 0;
-	ctx->header.max_bat_size = (ctx->footer.curr_size +
-			VHD_BLOCK_SIZE - 1) >> VHD_BLOCK_SHIFT;
+	ctx->header.data_shift   = 0;
+	vhd_initialize_data_shift(ctx, align);
 
 	ctx->footer.data_offset  = VHD_SECTOR_SIZE;
 
@@ -2710,6 +3102,20 @@ vhd_initialize_header(vhd_context_t *ctx, const char *parent_path,
 		*psize = parent.footer.curr_size;
 		if (!size)
 			size = *psize;
+
+		/* children keep their parent's block size */
+		if (vhd_type_dynamic(&parent)) {
+			if (block_size &&
+			    block_size != parent.header.block_size) {
+				VHDLOG("block size (%"PRIu64") != parent "
+				       "block size (%u)\n", block_size,
+				       parent.header.block_size);
+				vhd_close(&parent);
+				return -EINVAL;
+			}
+			ctx->header.block_size = parent.header.block_size;
+			ctx->header.data_shift = parent.header.data_shift;
+		}
 		vhd_close(&parent);
 	}
 	if (size < *psize) {
@@ -2717,11 +3123,12 @@ vhd_initialize_header(vhd_context_t *ctx, const char *parent_path,
 				size, *psize);
 		return -EINVAL;
 	}
+	size = (size + ctx->header.block_size - 1) /
+		ctx->header.block_size * ctx->header.block_size;
 	ctx->footer.orig_size    = size;
 	ctx->footer.curr_size    = size;
 	ctx->footer.geometry     = vhd_chs(size);
-	ctx->header.max_bat_size = 
-		(size + VHD_BLOCK_SIZE - 1) >> VHD_BLOCK_SHIFT;
+	vhd_initialize_data_shift(ctx, align);
 
 	return vhd_initialize_header_parent_name(ctx, parent_path);
 }
@@ -2887,7 +3294,7 @@ vhd_create_batmap(vhd_context_t *ctx)
 	memset(map, 0, map_bytes);
 	ctx->batmap.map = map;
 
-	return vhd_write_batmap(ctx, &ctx->batmap);
+	return 0;
 }
 
 static int
@@ -2911,14 +3318,262 @@ vhd_create_bat(vhd_context_t *ctx)
 	for (i = 0; i < ctx->header.max_bat_size; i++)
 		ctx->bat.bat[i] = DD_BLK_UNUSED;
 
-	err = vhd_seek(ctx, ctx->header.table_offset, SEEK_SET);
-	if (err)
-		return err;
-
 	ctx->bat.entries = ctx->header.max_bat_size;
 	ctx->bat.spb     = ctx->header.block_size >> VHD_SECTOR_SHIFT;
 
-	return vhd_write_bat(ctx, &ctx->bat);
+	return 0;
+}
+
+/*
+ * the metadata of a new dynamic vhd is laid out back to back from
+ * offset 0, so it is staged here in on-disk byte order and written
+ * with one pwritev (two for block devices, which keep the footer at
+ * the end of the device) and one fsync.
+ */
+#define VHD_CREATE_PIECES 12
+
+struct vhd_create_image {
+	int                        cnt;
+	struct {
+		off64_t            off;
+		size_t             size;
+		void              *buf;
+	}                          piece[VHD_CREATE_PIECES];
+};
+
+static void
+vhd_create_image_free(struct vhd_create_image *img)
+{
+	while (img->cnt--)
+		free(img->piece[img->cnt].buf);
+	img->cnt = 0;
+}
+
+static void *
+vhd_create_image_add(struct vhd_create_image *img,
+		     off64_t off, const void *src, size_t len, size_t size)
+{
+	void *buf;
+
+	if (img->cnt == VHD_CREATE_PIECES)
+		return NULL;
+
+	if (posix_memalign(&buf, VHD_SECTOR_SIZE, size))
+		return NULL;
+
+	memset(buf, 0, size);
+	memcpy(buf, src, len);
+
+	img->piece[img->cnt].off  = off;
+	img->piece[img->cnt].size = size;
+	img->piece[img->cnt].buf  = buf;
+	img->cnt++;
+
+	return buf;
+}
+
+static int
+vhd_create_stage_footer(vhd_context_t *ctx,
+			struct vhd_create_image *img, off64_t off)
+{
+	int err;
+	vhd_footer_t *f;
+
+	f = vhd_create_image_add(img, off, &ctx->footer,
+				 sizeof(vhd_footer_t), sizeof(vhd_footer_t));
+	if (!f)
+		return -ENOMEM;
+
+	f->checksum = vhd_checksum_footer(f);
+	err = vhd_validate_footer(f);
+	if (err)
+		return err;
+
+	vhd_footer_out(f);
+	return 0;
+}
+
+static int
+vhd_create_stage_header(vhd_context_t *ctx, struct vhd_create_image *img)
+{
+	int err;
+	vhd_header_t *h;
+
+	h = vhd_create_image_add(img, ctx->footer.data_offset, &ctx->header,
+				 sizeof(vhd_header_t), sizeof(vhd_header_t));
+	if (!h)
+		return -ENOMEM;
+
+	h->checksum = vhd_checksum_header(h);
+	err = vhd_validate_header(h);
+	if (err)
+		return err;
+
+	vhd_header_out(h);
+	return 0;
+}
+
+static int
+vhd_create_stage_bat(vhd_context_t *ctx, struct vhd_create_image *img)
+{
+	size_t size;
+	vhd_bat_t b;
+
+	size  = vhd_bytes_padded(ctx->bat.entries * sizeof(uint32_t));
+	b     = ctx->bat;
+	b.bat = vhd_create_image_add(img, ctx->header.table_offset,
+				     ctx->bat.bat, size, size);
+	if (!b.bat)
+		return -ENOMEM;
+
+	vhd_bat_out(&b);
+	return 0;
+}
+
+static int
+vhd_create_stage_batmap(vhd_context_t *ctx, struct vhd_create_image *img)
+{
+	int err;
+	off64_t off;
+	size_t size;
+	vhd_batmap_t b;
+
+	b = ctx->batmap;
+	b.header.checksum = vhd_checksum_batmap(ctx, &b);
+	err = vhd_validate_batmap(ctx, &b);
+	if (err)
+		return err;
+
+	size = vhd_sectors_to_bytes(b.header.batmap_size);
+	if (!vhd_create_image_add(img, b.header.batmap_offset,
+				  b.map, size, size))
+		return -ENOMEM;
+
+	err = vhd_batmap_header_offset(ctx, &off);
+	if (err)
+		return err;
+
+	vhd_batmap_header_out(&b);
+	if (!vhd_create_image_add(img, off, &b.header,
+				  sizeof(vhd_batmap_header_t),
+				  vhd_bytes_padded(sizeof(vhd_batmap_header_t))))
+		return -ENOMEM;
+
+	return 0;
+}
+
+/* as vhd_write_parent_locators */
+static int
+vhd_create_stage_locators(vhd_context_t *ctx,
+			  struct vhd_create_image *img, const char *parent)
+{
+	int i, err;
+	off64_t off;
+	void *block;
+	uint32_t code;
+	vhd_parent_locator_t *loc;
+
+	off = ctx->batmap.header.batmap_offset +
+		vhd_sectors_to_bytes(ctx->batmap.header.batmap_size);
+	if (off & (VHD_SECTOR_SIZE - 1))
+		off = vhd_bytes_padded(off);
+
+	for (i = 0; i < 3; i++) {
+		switch (i) {
+		case 0:
+			code = PLAT_CODE_MACX;
+			break;
+		case 1:
+			code = PLAT_CODE_W2KU;
+			break;
+		default:
+			code = PLAT_CODE_W2RU;
+			break;
+		}
+
+		loc = ctx->header.loc + i;
+		err = vhd_parent_locator_encode(ctx, parent, off, code,
+						0, loc, &block);
+		if (err)
+			return err;
+
+		if (img->cnt == VHD_CREATE_PIECES) {
+			free(block);
+			return -ENOMEM;
+		}
+
+		img->piece[img->cnt].off  = off;
+		img->piece[img->cnt].size = vhd_bytes_padded(loc->data_len);
+		img->piece[img->cnt].buf  = block;
+		img->cnt++;
+
+		off += vhd_parent_locator_size(loc);
+	}
+
+	return 0;
+}
+
+static off64_t
+vhd_create_image_end(struct vhd_create_image *img)
+{
+	int i;
+	off64_t end;
+
+	end = 0;
+	for (i = 0; i < img->cnt; i++)
+		end = MAX(end, img->piece[i].off + (off64_t)img->piece[i].size);
+
+	return end;
+}
+
+static int
+vhd_create_image_write(vhd_context_t *ctx, struct vhd_create_image *img)
+{
+	int i, j, n;
+	ssize_t ret;
+	size_t size;
+	off64_t off, end;
+	struct iovec iov[VHD_CREATE_PIECES];
+
+	/* a handful of pieces: insertion sort on offset */
+	for (i = 1; i < img->cnt; i++)
+		for (j = i; j > 0 &&
+			     img->piece[j - 1].off > img->piece[j].off; j--) {
+			typeof(img->piece[0]) tmp = img->piece[j];
+			img->piece[j]     = img->piece[j - 1];
+			img->piece[j - 1] = tmp;
+		}
+
+	for (i = 0; i < img->cnt; i = j) {
+		off  = img->piece[i].off;
+		end  = off;
+		size = 0;
+
+		for (j = i, n = 0; j < img->cnt && img->piece[j].off == end;
+		     j++, n++) {
+			iov[n].iov_base = img->piece[j].buf;
+			iov[n].iov_len  = img->piece[j].size;
+			end            += img->piece[j].size;
+			size           += img->piece[j].size;
+		}
+
+		if (j < img->cnt && img->piece[j].off < end)
+			return -EINVAL;
+
+		errno = 0;
+		ret   = pwritev(ctx->fd, iov, n, off);
+		if (ret != size) {
+			VHDLOG("%s: write of %zu at 0x%08"PRIx64" returned "
+			       "%zd, errno: %d\n", ctx->file, size, off,
+			       ret, -errno);
+			return (errno ? -errno : -EIO);
+		}
+	}
+
+	if (fsync(ctx->fd))
+		return -errno;
+
+	return 0;
 }
 
 static int
@@ -2985,11 +3640,17 @@ vhd_set_phys_size(vhd_context_t *ctx, off64_t size)
 static int
 vhd_set_virt_size_no_write(vhd_context_t *ctx, uint64_t size)
 {
-	if ((size >> VHD_BLOCK_SHIFT) > ctx->header.max_bat_size) {
+	uint64_t blks, block_size = vhd_block_size(ctx);
+
+	blks = size / block_size;
+	if (vhd_data_shift(ctx))
+		blks = (size + vhd_sectors_to_bytes(vhd_data_shift(ctx)) +
+			block_size - 1) / block_size;
+
+	if (blks > ctx->header.max_bat_size) {
 		VHDLOG("not enough metadata space reserved for fast "
 				"resize (BAT size %u, need %"PRIu64")\n",
-				ctx->header.max_bat_size, 
-				size >> VHD_BLOCK_SHIFT);
+				ctx->header.max_bat_size, blks);
 		return -EINVAL;
 	}
 
@@ -3013,12 +3674,13 @@ vhd_set_virt_size(vhd_context_t *ctx, uint64_t size)
 
 static int
 __vhd_create(const char *name, const char *parent, uint64_t bytes, int type,
-		uint64_t mbytes, vhd_flag_creat_t flags)
+		uint64_t mbytes, vhd_flag_creat_t flags, int64_t align)
 {
 	int err;
 	off64_t off;
 	vhd_context_t ctx;
-	uint64_t size, psize, blks;
+	uint64_t size, psize, blks, bsize, block_size;
+	struct vhd_create_image img;
 
 	switch (type) {
 	case HD_TYPE_DIFF:
@@ -3037,17 +3699,34 @@ __vhd_create(const char *name, const char *parent, uint64_t bytes, int type,
 	if (bytes && mbytes && mbytes < bytes)
 		return -EINVAL;
 
+	block_size = 0;
+	if (flags & VHD_FLAG_CREAT_BLOCK_MASK) {
+		int shift = (flags & VHD_FLAG_CREAT_BLOCK_MASK) >>
+			VHD_FLAG_CREAT_BLOCK_SHIFT;
+
+		if (type == HD_TYPE_FIXED ||
+		    shift < VHD_BLOCK_SHIFT || shift > VHD_BLOCK_SHIFT_MAX)
+			return -EINVAL;
+
+		block_size = 1ULL << shift;
+	}
+
+	if (align >= 0 && type == HD_TYPE_FIXED)
+		return -EINVAL;
+
 	memset(&ctx, 0, sizeof(vhd_context_t));
+	memset(&img, 0, sizeof(img));
 	psize = 0;
-	blks   = (bytes + VHD_BLOCK_SIZE - 1) >> VHD_BLOCK_SHIFT;
+	bsize = block_size ? : VHD_BLOCK_SIZE;
+	blks  = (bytes + bsize - 1) / bsize;
 	/* If mbytes is provided (virtual-size-for-metadata-preallocation),
 	 * create the VHD of size mbytes, which will create the BAT & the 
 	 * batmap of the appropriate size. Once the BAT & batmap are 
 	 * initialized, reset the virtual size to the requested one.
 	 */
 	if (mbytes)
-		blks = (mbytes + VHD_BLOCK_SIZE - 1) >> VHD_BLOCK_SHIFT;
-	size = blks << VHD_BLOCK_SHIFT;
+		blks = (mbytes + bsize - 1) / bsize;
+	size = blks * bsize;
 
 	ctx.fd = open(name, O_WRONLY | O_CREAT |
 		      O_TRUNC | O_LARGEFILE | O_DIRECT, 0644);
@@ -3072,7 +3751,8 @@ __vhd_create(const char *name, const char *parent, uint64_t bytes, int type,
 			goto out;
 	} else {
 		int raw = vhd_flag_test(flags, VHD_FLAG_CREAT_PARENT_RAW);
-		err = vhd_initialize_header(&ctx, parent, size, raw, &psize);
+		err = vhd_initialize_header(&ctx, parent, size,
+					    block_size, raw, &psize, align);
 		if (err)
 			goto out;
 
@@ -3080,12 +3760,20 @@ __vhd_create(const char *name, const char *parent, uint64_t bytes, int type,
 		if (err)
 			goto out;
 
+		err = vhd_create_stage_batmap(&ctx, &img);
+		if (err)
+			goto out;
+
 		err = vhd_create_bat(&ctx);
 		if (err)
 			goto out;
 
+		err = vhd_create_stage_bat(&ctx, &img);
+		if (err)
+			goto out;
+
 		if (type == HD_TYPE_DIFF) {
-			err = vhd_write_parent_locators(&ctx, parent);
+			err = vhd_create_stage_locators(&ctx, &img, parent);
 			if (err)
 				goto out;
 		}
@@ -3094,9 +3782,9 @@ __vhd_create(const char *name, const char *parent, uint64_t bytes, int type,
 	if (mbytes) {
 		/* set the virtual size to the requested size */
 		if (bytes) {
-			blks = (bytes + VHD_BLOCK_SIZE - 1) >> VHD_BLOCK_SHIFT;
-			size = blks << VHD_BLOCK_SHIFT;
-
+			bsize = vhd_block_size(&ctx);
+			blks  = (bytes + bsize - 1) / bsize;
+			size  = blks * bsize;
 		}
 		else {
 			size = psize;
@@ -3108,13 +3796,30 @@ __vhd_create(const char *name, const char *parent, uint64_t bytes, int type,
 	}
 
 	if (type != HD_TYPE_FIXED) {
-		err = vhd_write_footer_at(&ctx, &ctx.footer, 0);
+		off = vhd_create_image_end(&img);
+		if (ctx.is_block) {
+			off = lseek64(ctx.fd, 0, SEEK_END);
+			if (off == (off64_t)-1) {
+				err = -errno;
+				goto out;
+			}
+			off -= sizeof(vhd_footer_t);
+		}
+
+		err = vhd_create_stage_footer(&ctx, &img, 0);
 		if (err)
 			goto out;
 
-		err = vhd_write_header_at(&ctx, &ctx.header, VHD_SECTOR_SIZE);
+		err = vhd_create_stage_header(&ctx, &img);
 		if (err)
 			goto out;
+
+		err = vhd_create_stage_footer(&ctx, &img, off);
+		if (err)
+			goto out;
+
+		err = vhd_create_image_write(&ctx, &img);
+		goto out;
 	}
 
 	err = vhd_seek(&ctx, 0, SEEK_END);
@@ -3137,6 +3842,7 @@ __vhd_create(const char *name, const char *parent, uint64_t bytes, int type,
 	err = 0;
 
 out:
+	vhd_create_image_free(&img);
 	vhd_close(&ctx);
 	if (err && !ctx.is_block)
 		unlink(name);
@@ -3147,14 +3853,64 @@ int
 vhd_create(const char *name, uint64_t bytes, int type, uint64_t mbytes,
 		vhd_flag_creat_t flags)
 {
-	return __vhd_create(name, NULL, bytes, type, mbytes, flags);
+	return __vhd_create(name, NULL, bytes, type, mbytes, flags, -1);
 }
 
 int
 vhd_snapshot(const char *name, uint64_t bytes, const char *parent,
 		uint64_t mbytes, vhd_flag_creat_t flags)
 {
-	return __vhd_create(name, parent, bytes, HD_TYPE_DIFF, mbytes, flags);
+	return __vhd_create(name, parent, bytes, HD_TYPE_DIFF, mbytes, flags,
+			    -1);
+}
+
+int
+vhd_create_aligned(const char *name, uint64_t bytes, int type,
+		uint64_t mbytes, vhd_flag_creat_t flags, uint64_t align)
+{
+	return __vhd_create(name, NULL, bytes, type, mbytes, flags, align);
+}
+
+int
+vhd_snapshot_aligned(const char *name, uint64_t bytes, const char *parent,
+		uint64_t mbytes, vhd_flag_creat_t flags, uint64_t align)
+{
+	return __vhd_create(name, parent, bytes, HD_TYPE_DIFF, mbytes, flags,
+			    align);
+}
+
+int
+vhd_first_partition(vhd_context_t *ctx, uint64_t *lba)
+{
+	int i, err;
+	void *buf;
+	struct partition_table *pt;
+
+	err = posix_memalign(&buf, VHD_SECTOR_SIZE, VHD_SECTOR_SIZE);
+	if (err)
+		return -err;
+
+	err = vhd_io_read(ctx, buf, 0, 1);
+	if (err)
+		goto out;
+
+	pt = buf;
+	partition_table_in(pt);
+
+	err = -ENOENT;
+	if (partition_table_validate(pt))
+		goto out;
+
+	for (i = 0; i < 4; i++)
+		if (pt->partitions[i].type && pt->partitions[i].lba) {
+			*lba = pt->partitions[i].lba;
+			err  = 0;
+			break;
+		}
+
+out:
+	free(buf);
+	return err;
 }
 
 static int
@@ -3199,11 +3955,12 @@ __vhd_io_dynamic_read_link(vhd_context_t *ctx, char *map,
 			   char *buf, uint64_t sector, uint32_t secs)
 {
 	off64_t off;
-	uint32_t blk, sec;
+	uint32_t blk, sec, shift;
 	int err, cnt, map_off, i;
 	char *bitmap, *data, *src;
 
 	map_off = 0;
+	shift   = vhd_data_shift(ctx);
 
 	do {
 		data   = NULL;
@@ -3216,8 +3973,8 @@ __vhd_io_dynamic_read_link(vhd_context_t *ctx, char *map,
 			goto next;
 		}
 
-		blk = sector / ctx->spb;
-		sec = sector % ctx->spb;
+		blk = (sector + shift) / ctx->spb;
+		sec = (sector + shift) % ctx->spb;
 		cnt = MIN(secs, ctx->spb - sec);
 		off = ctx->bat.bat[blk];
 
@@ -3309,7 +4066,7 @@ __vhd_io_dynamic_read(vhd_context_t *ctx,
 	int err;
 	uint32_t i, done;
 	char *map, *next;
-	vhd_context_t parent, *vhd;
+	vhd_context_t *parent, *vhd;
 
 	err  = vhd_get_bat(ctx);
 	if (err)
@@ -3362,24 +4119,25 @@ __vhd_io_dynamic_read(vhd_context_t *ctx,
 		}
 
 		if (vhd != ctx)
-			vhd_close(vhd);
-		vhd = &parent;
+			vhd_chain_put(vhd);
+		vhd = ctx;
 
-		err = vhd_open(vhd, next, VHD_OPEN_RDONLY);
+		err = vhd_chain_get(next, VHD_OPEN_RDONLY, NULL, &parent);
 		if (err)
 			goto out;
 
+		vhd = parent;
+		free(next);
+		next = NULL;
+
 		err = vhd_get_bat(vhd);
 		if (err)
 			goto close;
-
-		free(next);
-		next = NULL;
 	}
 
 close:
 	if (vhd != ctx && !vhd_flag_test(vhd->oflags, VHD_OPEN_CACHED))
-		vhd_close(vhd);
+		vhd_chain_put(vhd);
 out:
 	free(map);
 	free(next);
@@ -3486,6 +4244,8 @@ __vhd_io_dynamic_write(vhd_context_t *ctx,
 			return err;
 	}
 
+	sector += vhd_data_shift(ctx);
+
 	do {
 		blk = sector / ctx->spb;
 		sec = sector % ctx->spb;
@@ -3566,9 +4326,204 @@ vhd_io_write(vhd_context_t *ctx, char *buf, uint64_t sec, uint32_t secs)
 	if (!vhd_type_dynamic(ctx))
 		return __vhd_io_fixed_write(ctx, buf, sec, secs);
 
+	if (vhd_compressed(ctx))
+		return -EROFS;
+
 	return __vhd_io_dynamic_write(ctx, buf, sec, secs);
 }
 
+/*
+ * Copy @len bytes of @sfd at @soff to @dfd at @doff, in the kernel:
+ * FICLONERANGE shares the extents where the filesystem can (XFS and
+ * btrfs reflinks, NFS 4.2 clones) if the range is aligned to its
+ * blocks; copy_file_range otherwise, which may still share them.
+ * -EOPNOTSUPP if neither will, and the caller copies by hand.
+ */
+int
+vhd_copy_range(int sfd, off64_t soff, int dfd, off64_t doff, size_t len)
+{
+	ssize_t ret;
+	size_t done;
+	loff_t from, to;
+
+#ifdef FICLONERANGE
+	struct file_clone_range fcr;
+
+	fcr.src_fd      = sfd;
+	fcr.src_offset  = soff;
+	fcr.src_length  = len;
+	fcr.dest_offset = doff;
+
+	/* unaligned, or another filesystem: EINVAL, EXDEV, EOPNOTSUPP... */
+	if (len && !ioctl(dfd, FICLONERANGE, &fcr))
+		return 0;
+#endif
+
+#ifdef __NR_copy_file_range
+	from = soff;
+	to   = doff;
+	ret  = 0;
+
+	for (done = 0; done < len; done += ret) {
+		ret = syscall(__NR_copy_file_range, sfd, &from,
+			      dfd, &to, len - done, 0);
+		if (ret <= 0)
+			break;
+	}
+
+	if (done == len)
+		return 0;
+
+	if (ret == -1 && errno != ENOSYS && errno != EXDEV &&
+	    errno != EINVAL && errno != EOPNOTSUPP)
+		return -errno;
+#endif
+
+	return -EOPNOTSUPP;
+}
+
+/*
+ * the image of @ctx's chain holding all of @block, if none above it
+ * holds any of it; NULL if there is none, or it may not be shared
+ */
+static vhd_context_t *
+vhd_clone_block_owner(vhd_context_t *ctx, uint32_t block)
+{
+	int i, err;
+	char *map;
+	vhd_context_t *vhd;
+
+	for (vhd = ctx; vhd; vhd = vhd_cache_get_parent(vhd)) {
+		if (!vhd_type_dynamic(vhd) || vhd_compressed(vhd))
+			return NULL;
+
+		if (vhd_get_bat(vhd) || block >= vhd->bat.entries)
+			return NULL;
+
+		if (vhd->bat.bat[block] != DD_BLK_UNUSED)
+			break;
+
+		/* a raw parent, or one not cached, may hold it */
+		if (vhd->footer.type != HD_TYPE_DYNAMIC &&
+		    !vhd_cache_get_parent(vhd))
+			return NULL;
+	}
+
+	if (!vhd)
+		return NULL;
+
+	if (vhd_has_batmap(vhd) && !vhd_get_batmap(vhd) &&
+	    vhd_batmap_test(vhd, &vhd->batmap, block))
+		return vhd;
+
+	err = vhd_read_bitmap(vhd, block, &map);
+	if (err)
+		return NULL;
+
+	for (i = 0; i < vhd->spb; i++)
+		if (!vhd_bitmap_test(vhd, map, i))
+			break;
+
+	free(map);
+	return i == vhd->spb ? vhd : NULL;
+}
+
+/*
+ * Allocate @block of @dst with the data of the same block of @src's
+ * chain, sharing its extents rather than copying them: only metadata
+ * is written. @src is opened VHD_OPEN_CACHED to look past the leaf.
+ * 1 if it did, 0 if the block has to be copied: it is spread over
+ * several images, or held by a compressed or raw one, laid out
+ * differently, or the filesystem cannot share it.
+ */
+int
+vhd_io_clone_block(vhd_context_t *dst, vhd_context_t *src, uint32_t block)
+{
+	int i, err, spp;
+	off64_t max;
+	char *map;
+	vhd_context_t *vhd;
+
+	if (!vhd_type_dynamic(dst) || vhd_compressed(dst))
+		return -EINVAL;
+
+	err = vhd_get_bat(dst);
+	if (err)
+		return err;
+
+	if (block >= dst->bat.entries)
+		return -ERANGE;
+
+	if (dst->bat.bat[block] != DD_BLK_UNUSED)
+		return -EEXIST;
+
+	vhd = vhd_clone_block_owner(src, block);
+	if (!vhd || vhd->spb != dst->spb || vhd->bm_secs != dst->bm_secs ||
+	    vhd_data_shift(vhd) != vhd_data_shift(dst))
+		return 0;
+
+	/* place it as __vhd_io_allocate_block would */
+	err = vhd_end_of_data(dst, &max);
+	if (err)
+		return err;
+
+	max >>= VHD_SECTOR_SHIFT;
+	spp   = getpagesize() >> VHD_SECTOR_SHIFT;
+	if ((max + dst->bm_secs) % spp)
+		max += spp - ((max + dst->bm_secs) % spp);
+
+	/* nothing refers to the data until the bat does */
+	err = vhd_copy_range(vhd->fd,
+			     vhd_sectors_to_bytes(vhd->bat.bat[block] +
+						  vhd->bm_secs),
+			     dst->fd, vhd_sectors_to_bytes(max + dst->bm_secs),
+			     dst->header.block_size);
+	if (err)
+		return err == -EOPNOTSUPP ? 0 : err;
+
+	err = vhd_read_bitmap(vhd, block, &map);
+	if (err)
+		return err;
+
+	dst->bat.bat[block] = max;
+
+	err = vhd_write_bitmap(dst, block, map);
+	if (err)
+		goto fail;
+
+	err = vhd_write_bat(dst, &dst->bat);
+	if (err)
+		goto fail;
+
+	if (vhd_has_batmap(dst)) {
+		err = vhd_get_batmap(dst);
+		if (err)
+			goto out;
+
+		for (i = 0; i < dst->spb; i++)
+			if (!vhd_bitmap_test(dst, map, i))
+				break;
+
+		if (i == dst->spb) {
+			vhd_batmap_set(dst, &dst->batmap, block);
+			err = vhd_write_batmap(dst, &dst->batmap);
+			if (err)
+				goto out;
+		}
+	}
+
+	err = vhd_write_footer(dst, &dst->footer);
+	if (!err)
+		err = 1;
+out:
+	free(map);
+	return err;
+
+fail:
+	dst->bat.bat[block] = DD_BLK_UNUSED;
+	goto out;
+}
+
 static void
 vhd_cache_init(vhd_context_t *ctx)
 {
@@ -3724,6 +4679,22 @@ vhd_block_vector_read(vhd_context_t *ctx, vhd_block_vector_t *vec)
 		goto out;
 	}
 
+	if (vhd_compressed(ctx)) {
+		char *data;
+
+		err = vhd_read_zblock(ctx, vec->block, &data);
+		if (err)
+			goto out;
+
+		for (i = 0; i < vec->entries; i++) {
+			vhd_block_vector_entry_t *v = vec->array + i;
+			memcpy(v->buf, data + v->off, v->bytes);
+		}
+
+		free(data);
+		goto out;
+	}
+
 	off = vhd_sectors_to_bytes(blk + ctx->bm_secs);
 
 	for (i = 0; i < vec->entries; i++) {
@@ -3912,6 +4883,7 @@ __vhd_io_dynamic_read_link_bytes(vhd_context_t *ctx, char *map,
 
 	map_off  = 0;
 	blk_size = vhd_sectors_to_bytes(ctx->spb);
+	off     += vhd_sectors_to_bytes(vhd_data_shift(ctx));
 
 	do {
 		blk     = off / blk_size;
@@ -4149,6 +5121,7 @@ __vhd_io_dynamic_write_bytes_aligned(vhd_context_t *ctx,
 
 	map      = NULL;
 	blk_size = vhd_sectors_to_bytes(ctx->spb);
+	off     += vhd_sectors_to_bytes(vhd_data_shift(ctx));
 
 	do {
 		blk     = off / blk_size;
@@ -4312,6 +5285,9 @@ vhd_io_write_bytes(vhd_context_t *ctx, void *buf, size_t size, uint64_t off)
 	if (!vhd_type_dynamic(ctx))
 		return vhd_pwrite(ctx, buf, size, off);
 
+	if (vhd_compressed(ctx))
+		return -EROFS;
+
 	return __vhd_io_dynamic_write_bytes(ctx, buf, size, off);
 }
 
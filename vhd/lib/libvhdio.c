@@ -76,6 +76,9 @@
 #define LIBVHD_IO_DUMP  "LIBVHD_IO_DUMP"
 #define LIBVHD_IO_TEST  "LIBVHD_IO_TEST"
 
+/* sequential reads are served from a window this big */
+#define LIBVHD_IO_READAHEAD (1 << 20)
+
 static int libvhdio_logging;
 static FILE *libvhdio_log;
 #define LOG(_f, _a...)						        \
@@ -104,11 +107,32 @@ struct _function {
 	void                          *fn;
 };
 
+/*
+ * one image of a vhd's chain, with the bitmaps read from it so far;
+ * reads walk these instead of going through vhd_io_read_bytes, which
+ * rereads every bitmap it touches.
+ */
+struct vhd_layer {
+	vhd_context_t                 *vhd;
+	uint32_t                       blocks;
+	char                         **bitmaps;
+};
+
 struct vhd_object {
 	vhd_context_t                  vhd;
 	int                            refcnt;
 	uint64_t                       ino;
 	struct list_head               next;
+
+	int                            chained;   /* layers built */
+	int                            nr_layers; /* 0: use libvhd */
+	struct vhd_layer              *layers;
+	char                          *filled;    /* block scratch map */
+
+	char                          *ra_buf;
+	uint64_t                       ra_off;
+	size_t                         ra_len;
+	uint64_t                       last_end;
 };
 
 struct vhd_partition {
@@ -248,6 +272,291 @@ _init_vhd_objs(void)
 	INIT_LIST_HEAD(&_vhd_objects);
 }
 
+static void
+_libvhd_io_cache_free(vhd_object_t *obj)
+{
+	int i;
+	uint32_t blk;
+	struct vhd_layer *layer;
+
+	for (i = 0; i < obj->nr_layers; i++) {
+		layer = obj->layers + i;
+		if (!layer->bitmaps)
+			continue;
+
+		for (blk = 0; blk < layer->blocks; blk++)
+			free(layer->bitmaps[blk]);
+		free(layer->bitmaps);
+	}
+
+	free(obj->layers);
+	free(obj->filled);
+	free(obj->ra_buf);
+
+	obj->chained   = 0;
+	obj->nr_layers = 0;
+	obj->layers    = NULL;
+	obj->filled    = NULL;
+	obj->ra_buf    = NULL;
+	obj->ra_len    = 0;
+	obj->last_end  = 0;
+}
+
+/*
+ * collect the chain libvhd has already opened for a VHD_OPEN_CACHED
+ * vhd.  anything unusual -- fixed images, a raw parent, mixed block
+ * sizes -- leaves nr_layers at 0 and reads to vhd_io_read_bytes.
+ */
+static void
+_libvhd_io_cache_build(vhd_object_t *obj)
+{
+	int i, n;
+	vhd_context_t *vhd, *p;
+	struct vhd_layer *layers;
+
+	obj->chained = 1;
+	vhd = &obj->vhd;
+
+	if (!vhd_type_dynamic(vhd))
+		return;
+
+	n = 1;
+	list_for_each_entry(p, &vhd->next, next)
+		n++;
+
+	layers = calloc(n, sizeof(struct vhd_layer));
+	if (!layers)
+		return;
+
+	i = 0;
+	layers[i++].vhd = vhd;
+	list_for_each_entry(p, &vhd->next, next)
+		layers[i++].vhd = p;
+
+	obj->layers    = layers;
+	obj->nr_layers = n;
+
+	if (layers[n - 1].vhd->footer.type == HD_TYPE_DIFF)
+		goto fail;
+
+	for (i = 0; i < n; i++) {
+		p = layers[i].vhd;
+
+		if (!vhd_type_dynamic(p) || p->spb != vhd->spb ||
+		    vhd_data_shift(p) || vhd_compressed(p))
+			goto fail;
+
+		if (vhd_get_bat(p))
+			goto fail;
+
+		layers[i].blocks  = p->bat.entries;
+		layers[i].bitmaps = calloc(p->bat.entries, sizeof(char *));
+		if (!layers[i].bitmaps)
+			goto fail;
+	}
+
+	obj->filled = malloc((vhd->spb + 7) >> 3);
+	if (!obj->filled)
+		goto fail;
+
+	LOG("%s: %s caching bitmaps over %d layers\n",
+	    __func__, vhd->file, n);
+	return;
+
+fail:
+	_libvhd_io_cache_free(obj);
+	obj->chained = 1;
+}
+
+static int
+_libvhd_io_cache_bitmap(struct vhd_layer *layer, uint32_t blk, char **map)
+{
+	int err;
+
+	if (!layer->bitmaps[blk]) {
+		err = vhd_read_bitmap(layer->vhd, blk, &layer->bitmaps[blk]);
+		if (err) {
+			layer->bitmaps[blk] = NULL;
+			return err;
+		}
+	}
+
+	*map = layer->bitmaps[blk];
+	return 0;
+}
+
+/*
+ * read through the chain a block at a time, each sector from the
+ * first layer whose (cached) bitmap has it, in runs as long as the
+ * bitmaps allow; sectors no layer has read as zero.
+ */
+static int
+_libvhd_io_cache_read(vhd_object_t *obj, char *buf, size_t size, uint64_t off)
+{
+	int i, err;
+	char *map;
+	ssize_t ret;
+	struct vhd_layer *layer;
+	vhd_context_t *vhd, *lvhd;
+	uint64_t blk_size, blk_off, data, start, end;
+	uint32_t blk, bytes, s, n, k, first, last, left;
+
+	vhd      = &obj->vhd;
+	blk_size = vhd_sectors_to_bytes(vhd->spb);
+
+	while (size) {
+		blk     = off / blk_size;
+		blk_off = off % blk_size;
+		bytes   = MIN(blk_size - blk_off, size);
+		first   = blk_off >> VHD_SECTOR_SHIFT;
+		last    = secs_round_up_no_zero(blk_off + bytes);
+		left    = last - first;
+
+		memset(obj->filled, 0, (vhd->spb + 7) >> 3);
+
+		for (i = 0; i < obj->nr_layers && left; i++) {
+			layer = obj->layers + i;
+			lvhd  = layer->vhd;
+
+			if (blk >= layer->blocks ||
+			    lvhd->bat.bat[blk] == DD_BLK_UNUSED)
+				continue;
+
+			err = _libvhd_io_cache_bitmap(layer, blk, &map);
+			if (err)
+				return err;
+
+			data = vhd_sectors_to_bytes(lvhd->bat.bat[blk] +
+						    lvhd->bm_secs);
+
+			for (s = first; s < last; s += n) {
+				n = 1;
+				if (test_bit(obj->filled, s) ||
+				    !vhd_bitmap_test(lvhd, map, s))
+					continue;
+
+				while (s + n < last &&
+				       !test_bit(obj->filled, s + n) &&
+				       vhd_bitmap_test(lvhd, map, s + n))
+					n++;
+
+				start = MAX(vhd_sectors_to_bytes(s), blk_off);
+				end   = MIN(vhd_sectors_to_bytes(s + n),
+					    blk_off + bytes);
+
+				errno = 0;
+				ret   = pread64(lvhd->fd, buf + start - blk_off,
+						end - start, data + start);
+				if (ret != end - start)
+					return (errno ? -errno : -EIO);
+
+				for (k = s; k < s + n; k++)
+					set_bit(obj->filled, k);
+				left -= n;
+			}
+		}
+
+		for (s = first; left && s < last; s++) {
+			if (test_bit(obj->filled, s))
+				continue;
+
+			start = MAX(vhd_sectors_to_bytes(s), blk_off);
+			end   = MIN(vhd_sectors_to_bytes(s + 1), blk_off + bytes);
+			memset(buf + start - blk_off, 0, end - start);
+		}
+
+		buf  += bytes;
+		off  += bytes;
+		size -= bytes;
+	}
+
+	return 0;
+}
+
+static int
+_libvhd_io_cache_fill(vhd_object_t *obj, char *buf, size_t size, uint64_t off)
+{
+	if (!obj->chained)
+		_libvhd_io_cache_build(obj);
+
+	if (!obj->nr_layers)
+		return vhd_io_read_bytes(&obj->vhd, buf, size, off);
+
+	if (off + size > obj->vhd.footer.curr_size)
+		return -ERANGE;
+
+	return _libvhd_io_cache_read(obj, buf, size, off);
+}
+
+/*
+ * a read starting where the last one ended fills a whole window, so
+ * that tools reading a few KB at a time go to the vhd once per window
+ */
+static int
+_libvhd_io_cache_get(vhd_object_t *obj, char *buf, size_t size, uint64_t off)
+{
+	int err;
+	size_t len;
+
+	if (obj->ra_len &&
+	    off >= obj->ra_off && off + size <= obj->ra_off + obj->ra_len)
+		goto copy;
+
+	if (off != obj->last_end || size >= LIBVHD_IO_READAHEAD ||
+	    off + size > obj->vhd.footer.curr_size)
+		goto direct;
+
+	if (!obj->ra_buf) {
+		obj->ra_buf = malloc(LIBVHD_IO_READAHEAD);
+		if (!obj->ra_buf)
+			goto direct;
+	}
+
+	len = MIN(LIBVHD_IO_READAHEAD, obj->vhd.footer.curr_size - off);
+
+	obj->ra_len = 0;
+	err = _libvhd_io_cache_fill(obj, obj->ra_buf, len, off);
+	if (err)
+		return err;
+
+	obj->ra_off = off;
+	obj->ra_len = len;
+
+copy:
+	memcpy(buf, obj->ra_buf + (off - obj->ra_off), size);
+	obj->last_end = off + size;
+	return 0;
+
+direct:
+	err = _libvhd_io_cache_fill(obj, buf, size, off);
+	if (!err)
+		obj->last_end = off + size;
+	return err;
+}
+
+/* a write may have allocated or changed any leaf bitmap it touched */
+static void
+_libvhd_io_cache_invalidate(vhd_object_t *obj, size_t size, uint64_t off)
+{
+	uint64_t blk_size;
+	uint32_t blk, last;
+	struct vhd_layer *leaf;
+
+	obj->ra_len = 0;
+
+	if (!obj->nr_layers || !size)
+		return;
+
+	leaf     = obj->layers;
+	blk_size = vhd_sectors_to_bytes(obj->vhd.spb);
+	last     = (off + size - 1) / blk_size;
+
+	for (blk = off / blk_size; blk <= last && blk < leaf->blocks; blk++) {
+		free(leaf->bitmaps[blk]);
+		leaf->bitmaps[blk] = NULL;
+	}
+}
+
 static void
 _libvhd_io_reset(void)
 {
@@ -280,6 +589,7 @@ _libvhd_io_reset(void)
 			exit(ENOMEM);
 
 		LOG("resetting vhd fd %d user fd %d\n", vhd->fd, i);
+		_libvhd_io_cache_free(vhd_fd->vhd_part.vhd_obj);
 		vhd_close(vhd);
 
 		if (asprintf(&parent, "%s.%d.vhd",
@@ -407,7 +717,7 @@ _libvhd_io_get_vhd(const char *path, int flags)
 		vhd_flags |= VHD_OPEN_RDWR;
 	}
 
-	obj = malloc(sizeof(*obj));
+	obj = calloc(1, sizeof(*obj));
 	if (!obj) {
 		errno = ENOMEM;
 		goto out;
@@ -442,6 +752,7 @@ _libvhd_io_put_vhd(vhd_object_t *obj)
 {
 	LOG("%s: 0x%"PRIx64" 0x%x\n", __func__, obj->ino, obj->refcnt - 1);
 	if (--obj->refcnt == 0) {
+		_libvhd_io_cache_free(obj);
 		vhd_close(&obj->vhd);
 		list_del(&obj->next);
 		free(obj);
@@ -489,10 +800,11 @@ _libvhd_io_read_bytes(vhd_partition_t *vhd_part,
 		      void *buf, size_t size, uint64_t off)
 {
 	int ret;
-	vhd_context_t *vhd = &vhd_part->vhd_obj->vhd;
+	vhd_object_t *obj = vhd_part->vhd_obj;
+	vhd_context_t *vhd = &obj->vhd;
 
 	_libvhd_io_interpose = 0;
-	ret = vhd_io_read_bytes(vhd, buf, size, off);
+	ret = _libvhd_io_cache_get(obj, buf, size, off);
 	_libvhd_io_interpose = 1;
 
 	if (ret) {
@@ -514,10 +826,12 @@ _libvhd_io_write_bytes(vhd_partition_t *vhd_part,
 		       const void *buf, size_t size, uint64_t off)
 {
 	int ret;
-	vhd_context_t *vhd = &vhd_part->vhd_obj->vhd;
+	vhd_object_t *obj = vhd_part->vhd_obj;
+	vhd_context_t *vhd = &obj->vhd;
 
 	_libvhd_io_interpose = 0;
 	ret = vhd_io_write_bytes(vhd, (void *)buf, size, off);
+	_libvhd_io_cache_invalidate(obj, size, off);
 	_libvhd_io_interpose = 1;
 
 	if (ret) {
@@ -0,0 +1,509 @@
+/*
+ * Copyright (C) Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2.1 only
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libvhd.h"
+#include "vhd-util.h"
+
+/*
+ * Changes between a snapshot and a newer image of its chain: the
+ * sectors allocated in any image from the newer one up to, but not
+ * including, the snapshot. Found from BATs, batmaps and bitmaps only;
+ * the data of a changed sector is read from the nearest image holding
+ * it, so the cost follows the amount changed, not the disk size.
+ *
+ * With -l, extents are listed as "sector count" lines. Otherwise they
+ * are streamed, all fields big endian:
+ *
+ *   header:  cookie "vhd-chgs", u32 version, u32 sector size,
+ *            u64 newer size in sectors, newer and base uuids
+ *   extent:  u64 sector, u32 count, u32 reserved, count sectors of data
+ *   end:     an extent of count 0
+ */
+#define VHD_CHANGES_COOKIE       "vhd-chgs"
+#define VHD_CHANGES_VERSION      1
+
+struct vhd_changes_header {
+	char                     cookie[8];
+	uint32_t                 version;
+	uint32_t                 sector_size;
+	uint64_t                 size;
+	uuid_t                   uuid;
+	uuid_t                   base_uuid;
+};
+
+struct vhd_changes_extent {
+	uint64_t                 sec;
+	uint32_t                 secs;
+	uint32_t                 reserved;
+};
+
+struct vhd_changes {
+	vhd_context_t           *chain;     /* newest first */
+	int                      depth;
+	uint32_t                 spb;
+	uint64_t                 size;      /* of the newest, sectors */
+
+	uint16_t                *src;       /* per sector, chain index + 1 */
+	char                    *buf;
+
+	FILE                    *out;
+	int                      list;
+
+	uint64_t                 ext_sec;   /* extent not yet listed */
+	uint64_t                 ext_secs;
+
+	uint64_t                 extents;
+	uint64_t                 changed;
+};
+
+static void
+vhd_changes_close(struct vhd_changes *c)
+{
+	int i;
+
+	for (i = 0; i < c->depth; i++)
+		vhd_close(&c->chain[i]);
+
+	free(c->chain);
+	free(c->src);
+	free(c->buf);
+}
+
+/*
+ * Opens the images from name up to the child of base, failing unless
+ * base is an ancestor.
+ */
+static int
+vhd_changes_open(struct vhd_changes *c, const char *name, const char *base)
+{
+	vhd_context_t bvhd, *vhd, *chain;
+	char *next;
+	int err;
+
+	next = NULL;
+
+	err = vhd_open(&bvhd, base, VHD_OPEN_RDONLY);
+	if (err) {
+		fprintf(stderr, "error opening %s: %d\n", base, err);
+		return err;
+	}
+
+	for (;;) {
+		chain = realloc(c->chain, (c->depth + 1) * sizeof(*chain));
+		if (!chain) {
+			err = -ENOMEM;
+			goto out;
+		}
+		c->chain = chain;
+		vhd      = &chain[c->depth];
+
+		err = vhd_open(vhd, next ? : name, VHD_OPEN_RDONLY);
+		if (err) {
+			fprintf(stderr, "error opening %s: %d\n",
+				next ? : name, err);
+			goto out;
+		}
+
+		if (!uuid_compare(vhd->footer.uuid, bvhd.footer.uuid)) {
+			vhd_close(vhd);
+			break;
+		}
+
+		c->depth++;
+
+		if (vhd->footer.type != HD_TYPE_DIFF ||
+		    vhd_parent_raw(vhd)) {
+			fprintf(stderr, "%s is not an ancestor of %s\n",
+				base, name);
+			err = -EINVAL;
+			goto out;
+		}
+
+		if (c->depth == 1)
+			c->spb = vhd->spb;
+		else if (vhd->spb != c->spb) {
+			fprintf(stderr, "%s: block size differs\n", vhd->file);
+			err = -EINVAL;
+			goto out;
+		}
+
+		if (vhd_data_shift(vhd)) {
+			fprintf(stderr, "%s: aligned layout\n", vhd->file);
+			err = -EINVAL;
+			goto out;
+		}
+
+		err = vhd_get_bat(vhd);
+		if (err)
+			goto out;
+
+		if (vhd_has_batmap(vhd)) {
+			err = vhd_get_batmap(vhd);
+			if (err)
+				goto out;
+		}
+
+		free(next);
+		next = NULL;
+
+		err = vhd_parent_locator_get(vhd, &next);
+		if (err) {
+			next = NULL;
+			fprintf(stderr, "%s: no parent: %d\n", vhd->file, err);
+			goto out;
+		}
+	}
+
+	if (c->depth) {
+		c->size = c->chain[0].footer.curr_size >> VHD_SECTOR_SHIFT;
+
+		c->src = malloc(c->spb * sizeof(*c->src));
+		if (!c->src) {
+			err = -ENOMEM;
+			goto out;
+		}
+
+		err = posix_memalign((void **)&c->buf, VHD_SECTOR_SIZE,
+				     vhd_sectors_to_bytes(c->spb));
+		if (err) {
+			c->buf = NULL;
+			err    = -err;
+			goto out;
+		}
+	}
+
+	err = 0;
+
+out:
+	free(next);
+	vhd_close(&bvhd);
+	return err;
+}
+
+static int
+vhd_changes_write(struct vhd_changes *c, void *buf, size_t size)
+{
+	if (fwrite(buf, size, 1, c->out) != 1)
+		return -errno ? : -EIO;
+	return 0;
+}
+
+static int
+vhd_changes_write_header(struct vhd_changes *c, const char *base)
+{
+	struct vhd_changes_header h;
+	vhd_context_t bvhd;
+	int err;
+
+	err = vhd_open(&bvhd, base, VHD_OPEN_RDONLY);
+	if (err)
+		return err;
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.cookie, VHD_CHANGES_COOKIE, sizeof(h.cookie));
+	h.version     = VHD_CHANGES_VERSION;
+	h.sector_size = VHD_SECTOR_SIZE;
+	h.size        = c->depth ? c->size :
+		bvhd.footer.curr_size >> VHD_SECTOR_SHIFT;
+	uuid_copy(h.uuid, c->depth ? c->chain[0].footer.uuid :
+		  bvhd.footer.uuid);
+	uuid_copy(h.base_uuid, bvhd.footer.uuid);
+	vhd_close(&bvhd);
+
+	BE32_OUT(&h.version);
+	BE32_OUT(&h.sector_size);
+	BE64_OUT(&h.size);
+
+	return vhd_changes_write(c, &h, sizeof(h));
+}
+
+static int
+vhd_changes_write_extent(struct vhd_changes *c, uint64_t sec, uint32_t secs,
+			 void *data)
+{
+	struct vhd_changes_extent e;
+	int err;
+
+	memset(&e, 0, sizeof(e));
+	e.sec  = sec;
+	e.secs = secs;
+	BE64_OUT(&e.sec);
+	BE32_OUT(&e.secs);
+
+	err = vhd_changes_write(c, &e, sizeof(e));
+	if (err || !secs)
+		return err;
+
+	return vhd_changes_write(c, data, vhd_sectors_to_bytes(secs));
+}
+
+static void
+vhd_changes_flush_extent(struct vhd_changes *c)
+{
+	if (!c->ext_secs)
+		return;
+
+	fprintf(c->out, "%"PRIu64" %"PRIu64"\n", c->ext_sec, c->ext_secs);
+	c->extents++;
+	c->ext_secs = 0;
+}
+
+static void
+vhd_changes_list_extent(struct vhd_changes *c, uint64_t sec, uint32_t secs)
+{
+	if (c->ext_secs && c->ext_sec + c->ext_secs == sec) {
+		c->ext_secs += secs;
+		return;
+	}
+
+	vhd_changes_flush_extent(c);
+	c->ext_sec  = sec;
+	c->ext_secs = secs;
+}
+
+/*
+ * Marks each sector of blk with the nearest image allocating it.
+ * Returns the number of sectors changed.
+ */
+static int
+vhd_changes_map_block(struct vhd_changes *c, uint32_t blk, uint32_t secs)
+{
+	int i, err, changed;
+	uint32_t s;
+	char *map;
+
+	changed = 0;
+	memset(c->src, 0, secs * sizeof(*c->src));
+
+	for (i = 0; i < c->depth && changed < secs; i++) {
+		vhd_context_t *vhd = &c->chain[i];
+
+		if (blk >= vhd->bat.entries ||
+		    vhd->bat.bat[blk] == DD_BLK_UNUSED)
+			continue;
+
+		if (vhd_batmap_test(vhd, &vhd->batmap, blk)) {
+			for (s = 0; s < secs; s++)
+				if (!c->src[s]) {
+					c->src[s] = i + 1;
+					changed++;
+				}
+			break;
+		}
+
+		err = vhd_read_bitmap(vhd, blk, &map);
+		if (err)
+			return err;
+
+		for (s = 0; s < secs; s++)
+			if (!c->src[s] && vhd_bitmap_test(vhd, map, s)) {
+				c->src[s] = i + 1;
+				changed++;
+			}
+
+		free(map);
+	}
+
+	return changed;
+}
+
+static int
+vhd_changes_read(struct vhd_changes *c, uint32_t blk, uint32_t s,
+		 uint32_t n)
+{
+	vhd_context_t *vhd = &c->chain[c->src[s] - 1];
+	off64_t off;
+	int err;
+
+	off = vhd_sectors_to_bytes(vhd->bat.bat[blk] + vhd->bm_secs + s);
+
+	err = vhd_seek(vhd, off, SEEK_SET);
+	if (err)
+		return err;
+
+	return vhd_read(vhd, c->buf + vhd_sectors_to_bytes(s),
+			vhd_sectors_to_bytes(n));
+}
+
+static int
+vhd_changes_block(struct vhd_changes *c, uint32_t blk)
+{
+	uint32_t s, n, secs;
+	uint64_t sec;
+	int err;
+
+	sec  = (uint64_t)blk * c->spb;
+	secs = MIN(c->spb, c->size - sec);
+
+	err = vhd_changes_map_block(c, blk, secs);
+	if (err <= 0)
+		return err;
+
+	c->changed += err;
+
+	/* payload first, a read per run from one image */
+	for (s = 0; !c->list && s < secs; s += n) {
+		for (n = 1; s + n < secs; n++)
+			if (c->src[s + n] != c->src[s])
+				break;
+
+		if (!c->src[s])
+			continue;
+
+		err = vhd_changes_read(c, blk, s, n);
+		if (err)
+			return err;
+	}
+
+	for (s = 0; s < secs; s += n) {
+		for (n = 1; s + n < secs; n++)
+			if (!c->src[s + n] != !c->src[s])
+				break;
+
+		if (!c->src[s])
+			continue;
+
+		if (c->list) {
+			vhd_changes_list_extent(c, sec + s, n);
+			continue;
+		}
+
+		err = vhd_changes_write_extent(c, sec + s, n,
+					       c->buf + vhd_sectors_to_bytes(s));
+		if (err)
+			return err;
+
+		c->extents++;
+	}
+
+	return 0;
+}
+
+static int
+vhd_changes(struct vhd_changes *c, const char *base)
+{
+	uint32_t blk, blks;
+	int err;
+
+	if (!c->list) {
+		err = vhd_changes_write_header(c, base);
+		if (err)
+			return err;
+	}
+
+	blks = c->depth ? (c->size + c->spb - 1) / c->spb : 0;
+
+	for (blk = 0; blk < blks; blk++) {
+		err = vhd_changes_block(c, blk);
+		if (err)
+			return err;
+	}
+
+	if (c->list) {
+		vhd_changes_flush_extent(c);
+		return 0;
+	}
+
+	return vhd_changes_write_extent(c, 0, 0, NULL);
+}
+
+int
+vhd_util_changes(int argc, char **argv)
+{
+	char *name, *base, *output;
+	struct vhd_changes c;
+	int err, ret;
+
+	name   = NULL;
+	base   = NULL;
+	output = NULL;
+
+	memset(&c, 0, sizeof(c));
+
+	if (!argc || !argv)
+		goto usage;
+
+	optind = 0;
+	while ((ret = getopt(argc, argv, "n:p:o:lh")) != -1) {
+		switch (ret) {
+		case 'n':
+			name = optarg;
+			break;
+		case 'p':
+			base = optarg;
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		case 'l':
+			c.list = 1;
+			break;
+		case 'h':
+		default:
+			goto usage;
+		}
+	}
+
+	if (!name || !base || optind != argc)
+		goto usage;
+
+	err = vhd_changes_open(&c, name, base);
+	if (err)
+		goto out;
+
+	c.out = stdout;
+	if (output) {
+		c.out = fopen(output, "w");
+		if (!c.out) {
+			err = -errno;
+			fprintf(stderr, "error opening %s: %d\n", output, err);
+			goto out;
+		}
+	}
+
+	err = vhd_changes(&c, base);
+
+	if (fflush(c.out))
+		err = err ? : -errno;
+	if (c.out != stdout && fclose(c.out))
+		err = err ? : -errno;
+
+	if (err)
+		fprintf(stderr, "error exporting changes: %d\n", err);
+	else
+		fprintf(stderr, "%"PRIu64" sectors changed in %"PRIu64
+			" extents\n", c.changed, c.extents);
+
+out:
+	vhd_changes_close(&c);
+	return err;
+
+usage:
+	printf("options: <-n name> <-p base snapshot> [-l list extents] "
+	       "[-o output] [-h help]\n");
+	return -EINVAL;
+}
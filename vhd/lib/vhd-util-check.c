@@ -26,6 +26,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <libgen.h>
+#include <pthread.h>
 #include <inttypes.h>
 #include <sys/stat.h>
 
@@ -37,6 +38,11 @@
 // account for time skew with NFS servers
 #define TIMESTAMP_MAX_SLACK 1800
 
+#define VHD_CHECK_THREADS   8
+
+/* largest single read of contiguous blocks when checking data */
+#define VHD_CHECK_READ_SIZE (8 << 20)
+
 struct vhd_util_check_options {
 	char                             ignore_footer;
 	char                             ignore_parent_uuid;
@@ -44,11 +50,18 @@ struct vhd_util_check_options {
 	char                             check_data;
 	char                             no_check_bat;
 	char                             collect_stats;
+	int                              threads;
 };
 
+/*
+ * written sectors are tracked per block, and only for blocks that are
+ * allocated, so the stats grow with the data rather than the disk.
+ */
 struct vhd_util_check_stats {
 	char                            *name;
-	char                            *bitmap;
+	char                           **bitmaps;
+	uint32_t                         blocks;
+	uint32_t                         spb;
 	uint64_t                         secs_total;
 	uint64_t                         secs_allocated;
 	uint64_t                         secs_written;
@@ -64,6 +77,23 @@ struct vhd_util_check_ctx {
 #define ctx_cur_stats(ctx) \
 	list_entry((ctx)->stats.next, struct vhd_util_check_stats, next)
 
+struct vhd_util_check_extent {
+	uint32_t                         off;
+	uint32_t                         block;
+};
+
+struct vhd_util_check_pool {
+	pthread_mutex_t                  lock;
+	struct vhd_util_check_ctx       *ctx;
+	vhd_context_t                   *vhd;
+	struct vhd_util_check_extent    *extents;
+	uint32_t                         cnt;
+	uint32_t                         next;
+	uint32_t                         run;
+	uint64_t                         secs_written;
+	int                              err;
+};
+
 static inline int
 test_bit_u64(volatile char *addr, uint64_t nr)
 {
@@ -86,18 +116,59 @@ vhd_util_check_stats_init(struct vhd_util_check_ctx *ctx)
 static void
 vhd_util_check_stats_free_one(struct vhd_util_check_stats *stats)
 {
+	uint32_t i;
+
 	if (stats) {
+		if (stats->bitmaps)
+			for (i = 0; i < stats->blocks; i++)
+				free(stats->bitmaps[i]);
 		free(stats->name);
-		free(stats->bitmap);
+		free(stats->bitmaps);
 		free(stats);
 	}
 }
 
+static inline int
+vhd_util_check_stats_test(struct vhd_util_check_stats *stats, uint64_t sec)
+{
+	uint64_t blk = sec / stats->spb;
+
+	if (blk >= stats->blocks || !stats->bitmaps[blk])
+		return 0;
+
+	return test_bit_u64(stats->bitmaps[blk], sec % stats->spb);
+}
+
+static inline char *
+vhd_util_check_stats_block(struct vhd_util_check_stats *stats, uint32_t blk)
+{
+	if (!stats->bitmaps[blk])
+		stats->bitmaps[blk] = calloc(1, (stats->spb + 7) >> 3);
+
+	return stats->bitmaps[blk];
+}
+
+static int
+vhd_util_check_stats_set(struct vhd_util_check_stats *stats, uint64_t sec)
+{
+	char *bitmap;
+	uint64_t blk = sec / stats->spb;
+
+	if (blk >= stats->blocks)
+		return 0;
+
+	bitmap = vhd_util_check_stats_block(stats, blk);
+	if (!bitmap)
+		return -ENOMEM;
+
+	set_bit_u64(bitmap, sec % stats->spb);
+	return 0;
+}
+
 static int
 vhd_util_check_stats_alloc_one(struct vhd_util_check_ctx *ctx,
 			       vhd_context_t *vhd)
 {
-	int size;
 	struct vhd_util_check_stats *stats;
 
 	stats = calloc(1, sizeof(*stats));
@@ -108,10 +179,11 @@ vhd_util_check_stats_alloc_one(struct vhd_util_check_ctx *ctx,
 	if (!stats->name)
 		goto fail;
 
+	stats->spb        = vhd->spb;
+	stats->blocks     = vhd->header.max_bat_size;
 	stats->secs_total = (uint64_t)vhd->spb * vhd->header.max_bat_size;
-	size = (stats->secs_total + 7) >> 3;
-	stats->bitmap = calloc(1, size);
-	if (!stats->bitmap)
+	stats->bitmaps    = calloc(stats->blocks, sizeof(char *));
+	if (!stats->bitmaps)
 		goto fail;
 
 	INIT_LIST_HEAD(&stats->next);
@@ -154,9 +226,9 @@ name(const char *path)
 static void
 vhd_util_check_stats_print(struct vhd_util_check_ctx *ctx)
 {
-	char *bitmap;
-	uint64_t secs;
-	struct vhd_util_check_stats *head, *cur, *prev;
+	uint32_t b, j;
+	uint64_t secs, sec;
+	struct vhd_util_check_stats *head, *cur, *prev, chain;
 
 	if (list_empty(&ctx->stats))
 		return;
@@ -171,29 +243,52 @@ vhd_util_check_stats_print(struct vhd_util_check_ctx *ctx)
 
 	secs = head->secs_total;
 
-	bitmap = malloc((secs + 7) >> 3);
-	if (!bitmap) {
-		printf("failed to allocate bitmap\n");
-		return;
+	memset(&chain, 0, sizeof(chain));
+	chain.spb     = head->spb;
+	chain.blocks  = head->blocks;
+	chain.bitmaps = calloc(chain.blocks, sizeof(char *));
+	if (!chain.bitmaps)
+		goto fail;
+
+	for (b = 0; b < head->blocks; b++) {
+		if (!head->bitmaps[b])
+			continue;
+
+		chain.bitmaps[b] = malloc((head->spb + 7) >> 3);
+		if (!chain.bitmaps[b])
+			goto fail;
+
+		memcpy(chain.bitmaps[b], head->bitmaps[b],
+		       (head->spb + 7) >> 3);
 	}
-	memcpy(bitmap, head->bitmap, ((secs + 7) >> 3));
 
 	cur = prev = head;
 	while (!list_is_last(&cur->next, &ctx->stats)) {
-		uint64_t i, up = 0, uc = 0;
+		uint64_t up = 0, uc = 0;
 
 		cur = list_entry(cur->next.next,
 				 struct vhd_util_check_stats, next);
 
-		for (i = 0; i < secs; i++) {
-			if (test_bit_u64(cur->bitmap, i)) {
-				if (!test_bit_u64(prev->bitmap, i))
+		for (b = 0; b < cur->blocks; b++) {
+			if (!cur->bitmaps[b])
+				continue;
+
+			for (j = 0; j < cur->spb; j++) {
+				sec = (uint64_t)b * cur->spb + j;
+				if (sec >= secs)
+					break;
+
+				if (!test_bit_u64(cur->bitmaps[b], j))
+					continue;
+
+				if (!vhd_util_check_stats_test(prev, sec))
 					up++; /* sector is unique wrt parent */
 
-				if (!test_bit_u64(bitmap, i))
+				if (!vhd_util_check_stats_test(&chain, sec))
 					uc++; /* sector is unique wrt chain */
 
-				set_bit_u64(bitmap, i);
+				if (vhd_util_check_stats_set(&chain, sec))
+					goto fail;
 			}
 		}
 
@@ -208,7 +303,16 @@ vhd_util_check_stats_print(struct vhd_util_check_ctx *ctx)
 		prev = cur;
 	}
 
-	free(bitmap);
+out:
+	if (chain.bitmaps)
+		for (b = 0; b < chain.blocks; b++)
+			free(chain.bitmaps[b]);
+	free(chain.bitmaps);
+	return;
+
+fail:
+	printf("failed to allocate bitmap\n");
+	goto out;
 }
 
 static int
@@ -258,7 +362,7 @@ ok:
 	if (!(footer->features & HD_RESERVED))
 		return "invalid 'reserved' feature";
 
-	if (footer->features & ~(HD_TEMPORARY | HD_RESERVED))
+	if (footer->features & ~(HD_TEMPORARY | HD_RESERVED | HD_COMPRESSED))
 		return "invalid extra features";
 
 	if (footer->ff_version != HD_FF_VERSION)
@@ -339,8 +443,8 @@ vhd_util_check_validate_header(int fd, vhd_header_t *header)
 	if (cnt != 1)
 		return "invalid block size";
 
-	if (header->res1)
-		return "invalid reserved bits";
+	if (header->data_shift >= header->block_size >> VHD_SECTOR_SHIFT)
+		return "invalid data shift";
 
 	if (vhd_util_check_zeros(header->res2, sizeof(header->res2)))
 		return "invalid reserved bits";
@@ -472,7 +576,7 @@ vhd_util_check_validate_parent(struct vhd_util_check_ctx *ctx,
 			       vhd_context_t *vhd, const char *ppath)
 {
 	char *msg;
-	vhd_context_t parent;
+	vhd_context_t *parent;
 
 	msg = NULL;
 
@@ -482,17 +586,17 @@ vhd_util_check_validate_parent(struct vhd_util_check_ctx *ctx,
 	if (ctx->opts.ignore_parent_uuid)
 		return msg;
 
-	if (vhd_open(&parent, ppath,
-				VHD_OPEN_RDONLY | VHD_OPEN_IGNORE_DISABLED))
+	if (vhd_chain_get(ppath, VHD_OPEN_RDONLY | VHD_OPEN_IGNORE_DISABLED,
+			  NULL, &parent))
 		return "error opening parent";
 
-	if (uuid_compare(vhd->header.prt_uuid, parent.footer.uuid)) {
+	if (uuid_compare(vhd->header.prt_uuid, parent->footer.uuid)) {
 		msg = "invalid parent uuid";
 		goto out;
 	}
 
 out:
-	vhd_close(&parent);
+	vhd_chain_put(parent);
 	return msg;
 }
 
@@ -682,40 +786,55 @@ vhd_util_check_differencing_header(struct vhd_util_check_ctx *ctx,
 	return 0;
 }
 
+/*
+ * checks one block whose bitmap (and data, with -b) has been read into
+ * 'bitmap'; runs on the check threads, and every block belongs to one
+ * thread only, so its stats bitmap needs no locking.
+ */
 static int
-vhd_util_check_bitmap(struct vhd_util_check_ctx *ctx,
-		      vhd_context_t *vhd, uint32_t block)
+vhd_util_check_bitmap(struct vhd_util_check_pool *pool,
+		      uint32_t block, char *bitmap, uint64_t *written)
 {
-	int err, i;
-	uint64_t sector;
-	char *bitmap, *data;
+	int err;
+	uint32_t i, k, n;
+	char *data, *map;
+	vhd_context_t *vhd;
+	struct vhd_util_check_ctx *ctx;
 
-	data   = NULL;
-	bitmap = NULL;
-	sector = (uint64_t)block * vhd->spb;
+	err  = 0;
+	ctx  = pool->ctx;
+	vhd  = pool->vhd;
+	data = bitmap + (vhd->bm_secs << VHD_SECTOR_SHIFT);
 
-	err = vhd_read_bitmap(vhd, block, &bitmap);
-	if (err) {
-		printf("error reading bitmap 0x%x\n", block);
-		goto out;
-	}
+	if (ctx->opts.collect_stats) {
+		map = NULL;
+
+		for (i = 0; i < vhd->spb; i += n) {
+			i += vhd_bitmap_span(vhd, bitmap, i, vhd->spb, 0);
+			if (i >= vhd->spb)
+				break;
+
+			n = vhd_bitmap_span(vhd, bitmap, i, vhd->spb, 1);
+
+			if (!map) {
+				map = vhd_util_check_stats_block(
+					ctx_cur_stats(ctx), block);
+				if (!map) {
+					printf("failed to allocate stats for "
+					       "block 0x%x\n", block);
+					return -ENOMEM;
+				}
+			}
 
-	if (ctx->opts.check_data) {
-		err = vhd_read_block(vhd, block, &data);
-		if (err) {
-			printf("error reading data block 0x%x\n", block);
-			goto out;
+			*written += n;
+			for (k = i; k < i + n; k++)
+				set_bit_u64(map, k);
 		}
 	}
 
-	for (i = 0; i < vhd->spb; i++) {
-		if (ctx->opts.collect_stats &&
-		    vhd_bitmap_test(vhd, bitmap, i)) {
-			ctx_cur_stats(ctx)->secs_written++;
-			set_bit_u64(ctx_cur_stats(ctx)->bitmap, sector + i);
-		}
-
-		if (ctx->opts.check_data) {
+	/* compressed data is only checked by decompressing it */
+	if (ctx->opts.check_data && !vhd_compressed(vhd)) {
+		for (i = 0; i < vhd->spb; i++) {
 			char *buf = data + (i << VHD_SECTOR_SHIFT);
 			int set   = vhd_util_check_zeros(buf, VHD_SECTOR_SIZE);
 			int map   = vhd_bitmap_test(vhd, bitmap, i);
@@ -728,18 +847,188 @@ vhd_util_check_bitmap(struct vhd_util_check_ctx *ctx,
 		}
 	}
 
-out:
-	free(data);
-	free(bitmap);
 	return err;
 }
 
+/*
+ * take the next run of extents that are contiguous on disk, up to
+ * pool->run of them; returns the number taken.
+ */
+static uint32_t
+vhd_util_check_pool_take(struct vhd_util_check_pool *pool,
+			 uint32_t *first, uint32_t block_size)
+{
+	uint32_t i, n;
+	struct vhd_util_check_extent *e;
+
+	pthread_mutex_lock(&pool->lock);
+
+	n = 0;
+	i = pool->next;
+
+	if (!pool->err && i < pool->cnt) {
+		e = pool->extents + i;
+		for (n = 1; n < pool->run && i + n < pool->cnt; n++)
+			if (e[n].off != e[n - 1].off + block_size)
+				break;
+		pool->next += n;
+	}
+
+	pthread_mutex_unlock(&pool->lock);
+
+	*first = i;
+	return n;
+}
+
+static void *
+vhd_util_check_worker(void *arg)
+{
+	int err;
+	char *buf;
+	ssize_t ret;
+	size_t size, stride;
+	uint64_t written;
+	uint32_t i, k, n, block_size;
+	struct vhd_util_check_pool *pool;
+	struct vhd_util_check_extent *e;
+
+	pool    = arg;
+	buf     = NULL;
+	err     = 0;
+	written = 0;
+
+	block_size = pool->vhd->spb + pool->vhd->bm_secs;
+
+	/* stats alone need just the bitmaps; -b reads whole blocks */
+	if (pool->ctx->opts.check_data && !vhd_compressed(pool->vhd))
+		stride = (size_t)block_size << VHD_SECTOR_SHIFT;
+	else
+		stride = pool->vhd->bm_secs << VHD_SECTOR_SHIFT;
+
+	err = posix_memalign((void **)&buf, VHD_SECTOR_SIZE,
+			     stride * pool->run);
+	if (err) {
+		buf = NULL;
+		err = -err;
+		printf("failed to allocate check buffer\n");
+		goto out;
+	}
+
+	while ((n = vhd_util_check_pool_take(pool, &i, block_size))) {
+		e    = pool->extents + i;
+		size = stride * n;
+
+		ret = pread(pool->vhd->fd, buf, size,
+			    (off64_t)e->off << VHD_SECTOR_SHIFT);
+		if (ret != size) {
+			err = (ret == -1 ? -errno : -EIO);
+			printf("error reading bitmap 0x%x\n", e->block);
+			goto out;
+		}
+
+		for (k = 0; k < n; k++) {
+			err = vhd_util_check_bitmap(pool, e[k].block,
+						    buf + k * stride,
+						    &written);
+			if (err)
+				goto out;
+		}
+	}
+
+out:
+	pthread_mutex_lock(&pool->lock);
+	pool->secs_written += written;
+	if (err && !pool->err)
+		pool->err = err;
+	pthread_mutex_unlock(&pool->lock);
+
+	free(buf);
+	return NULL;
+}
+
+/*
+ * reads the bitmaps of all allocated blocks, in disk order, across
+ * ctx->opts.threads threads.
+ */
+static int
+vhd_util_check_bitmaps(struct vhd_util_check_ctx *ctx, vhd_context_t *vhd,
+		       struct vhd_util_check_extent *extents, uint32_t cnt)
+{
+	int i, n, err;
+	size_t block_bytes;
+	pthread_t tids[VHD_CHECK_THREADS];
+	struct vhd_util_check_pool pool;
+
+	memset(&pool, 0, sizeof(pool));
+	pthread_mutex_init(&pool.lock, NULL);
+	pool.ctx     = ctx;
+	pool.vhd     = vhd;
+	pool.extents = extents;
+	pool.cnt     = cnt;
+	pool.run     = 1;
+
+	if (ctx->opts.check_data && !vhd_compressed(vhd)) {
+		block_bytes = (size_t)(vhd->spb + vhd->bm_secs) <<
+			VHD_SECTOR_SHIFT;
+		if (block_bytes < VHD_CHECK_READ_SIZE)
+			pool.run = VHD_CHECK_READ_SIZE / block_bytes;
+	}
+
+	n = (ctx->opts.threads < cnt ? ctx->opts.threads : cnt) - 1;
+	for (i = 0; i < n; i++) {
+		err = pthread_create(&tids[i], NULL,
+				     vhd_util_check_worker, &pool);
+		if (err) {
+			printf("failed to start check thread: %d\n", err);
+			break;
+		}
+	}
+	n = i;
+
+	vhd_util_check_worker(&pool);
+
+	for (i = 0; i < n; i++)
+		pthread_join(tids[i], NULL);
+
+	pthread_mutex_destroy(&pool.lock);
+
+	if (ctx->opts.collect_stats)
+		ctx_cur_stats(ctx)->secs_written += pool.secs_written;
+
+	return pool.err;
+}
+
+static int
+vhd_util_check_extent_compare(const void *lhs, const void *rhs)
+{
+	const struct vhd_util_check_extent *l = lhs, *r = rhs;
+
+	if (l->off != r->off)
+		return (l->off < r->off ? -1 : 1);
+
+	return (l->block < r->block ? -1 : (l->block > r->block));
+}
+
+/* sectors taken by a block on disk, less for compressed images */
+static uint32_t
+vhd_util_check_block_secs(vhd_context_t *vhd, uint32_t block)
+{
+	if (vhd_compressed(vhd))
+		return vhd->bm_secs + secs_round_up_no_zero(vhd->zmap[block]);
+
+	return vhd->spb + vhd->bm_secs;
+}
+
 static int
 vhd_util_check_bat(struct vhd_util_check_ctx *ctx, vhd_context_t *vhd)
 {
 	off64_t eof, eoh;
 	uint64_t vhd_blks;
-	int i, j, err, block_size;
+	uint32_t i, cnt, block_size;
+	struct vhd_util_check_extent *extents, *e;
+	int err;
+
+	extents = NULL;
 
 	if (ctx->opts.collect_stats) {
 		err = vhd_util_check_stats_alloc_one(ctx, vhd);
@@ -782,18 +1071,41 @@ vhd_util_check_bat(struct vhd_util_check_ctx *ctx, vhd_context_t *vhd)
 	}
 
 	eof  -= sizeof(vhd_footer_t);
+
+	if (vhd_compressed(vhd)) {
+		err = vhd_get_zmap(vhd);
+		if (err) {
+			printf("error reading zmap: %d\n", err);
+			return err;
+		}
+
+		if (vhd->header.zmap_offset + vhd_zmap_size(vhd) > eof) {
+			printf("zmap (offset 0x%"PRIx64") clobbers footer\n",
+			       vhd->header.zmap_offset);
+			return -EINVAL;
+		}
+
+		/* blocks end where the zmap starts */
+		eof = vhd->header.zmap_offset;
+	}
+
 	eof >>= VHD_SECTOR_SHIFT;
 	eoh >>= VHD_SECTOR_SHIFT;
-	block_size = vhd->spb + vhd->bm_secs;
 
-	vhd_blks = vhd->footer.curr_size >> VHD_BLOCK_SHIFT;
+	vhd_blks = vhd_data_blocks(vhd);
 	if (vhd_blks > vhd->header.max_bat_size) {
 		printf("VHD size (%"PRIu64" blocks) exceeds BAT size (%u)\n",
 		       vhd_blks, vhd->header.max_bat_size);
 		return -EINVAL;
 	}
 
-	for (i = 0; i < vhd_blks; i++) {
+	extents = malloc((vhd_blks ? vhd_blks : 1) * sizeof(*extents));
+	if (!extents) {
+		printf("failed to allocate block extents\n");
+		return -ENOMEM;
+	}
+
+	for (cnt = 0, i = 0; i < vhd_blks; i++) {
 		uint32_t off = vhd->bat.bat[i];
 		if (off == DD_BLK_UNUSED)
 			continue;
@@ -801,60 +1113,69 @@ vhd_util_check_bat(struct vhd_util_check_ctx *ctx, vhd_context_t *vhd)
 		if (off < eoh) {
 			printf("block %d (offset 0x%x) clobbers headers\n",
 			       i, off);
-			return -EINVAL;
+			err = -EINVAL;
+			goto out;
 		}
 
+		if (vhd_compressed(vhd) &&
+		    (!vhd->zmap[i] || vhd->zmap[i] > vhd->header.block_size)) {
+			printf("block %d has invalid compressed size %u\n",
+			       i, vhd->zmap[i]);
+			err = -EINVAL;
+			goto out;
+		}
+
+		block_size = vhd_util_check_block_secs(vhd, i);
+
 		if (off + block_size > eof) {
 			if (!(ctx->primary_footer_missing &&
 			      ctx->opts.ignore_footer     &&
 			      off + block_size == eof + 1)) {
 				printf("block %d (offset 0x%x) clobbers "
 				       "footer\n", i, off);
-				return -EINVAL;
+				err = -EINVAL;
+				goto out;
 			}
 		}
 
-		if (ctx->opts.no_check_bat)
-			continue;
-
-		for (j = 0; j < vhd_blks; j++) {
-			uint32_t joff = vhd->bat.bat[j];
-
-			if (i == j)
-				continue;
-
-			if (joff == DD_BLK_UNUSED)
-				continue;
+		extents[cnt].off   = off;
+		extents[cnt].block = i;
+		cnt++;
+	}
 
-			if (off == joff)
-				err = -EINVAL;
+	if (ctx->opts.no_check_bat)
+		goto out;
 
-			if (off > joff && off < joff + block_size)
-				err = -EINVAL;
+	/*
+	 * blocks don't nest, so sorted by offset any overlap shows up
+	 * between neighbours.
+	 */
+	qsort(extents, cnt, sizeof(*extents), vhd_util_check_extent_compare);
 
-			if (off + block_size > joff &&
-			    off + block_size < joff + block_size)
-				err = -EINVAL;
+	for (i = 1; i < cnt; i++) {
+		e = extents + i;
+		block_size = vhd_util_check_block_secs(vhd, e[-1].block);
 
-			if (err) {
-				printf("block %d (offset 0x%x) clobbers "
-				       "block %d (offset 0x%x)\n",
-				       i, off, j, joff);
-				return err;
-			}
+		if (e->off < e[-1].off + block_size) {
+			printf("block %d (offset 0x%x) clobbers "
+			       "block %d (offset 0x%x)\n",
+			       e->block, e->off, e[-1].block, e[-1].off);
+			err = -EINVAL;
+			goto out;
 		}
+	}
 
-		if (ctx->opts.check_data || ctx->opts.collect_stats) {
-			if (ctx->opts.collect_stats)
-				ctx_cur_stats(ctx)->secs_allocated += vhd->spb;
+	if (cnt && (ctx->opts.check_data || ctx->opts.collect_stats)) {
+		if (ctx->opts.collect_stats)
+			ctx_cur_stats(ctx)->secs_allocated +=
+				(uint64_t)vhd->spb * cnt;
 
-			err = vhd_util_check_bitmap(ctx, vhd, i);
-			if (err)
-				return err;
-		}
+		err = vhd_util_check_bitmaps(ctx, vhd, extents, cnt);
 	}
 
-	return 0;
+out:
+	free(extents);
+	return err;
 }
 
 static int
@@ -881,7 +1202,7 @@ vhd_util_check_batmap(vhd_context_t *vhd)
 		return -EINVAL;
 	}
 
-	for (i = 0; i < vhd->footer.curr_size >> VHD_BLOCK_SHIFT; i++) {
+	for (i = 0; i < vhd_data_blocks(vhd); i++) {
 		if (!vhd_batmap_test(vhd, &vhd->batmap, i))
 			continue;
 
@@ -1135,24 +1456,25 @@ static int
 vhd_util_check_parents(struct vhd_util_check_ctx *ctx, const char *name)
 {
 	int err;
-	vhd_context_t vhd;
+	vhd_context_t *vhd;
 	char *cur, *parent;
 
 	cur = (char *)name;
 
 	for (;;) {
-		err = vhd_open(&vhd, cur, 
-				VHD_OPEN_RDONLY | VHD_OPEN_IGNORE_DISABLED);
+		err = vhd_chain_get(cur,
+				    VHD_OPEN_RDONLY | VHD_OPEN_IGNORE_DISABLED,
+				    NULL, &vhd);
 		if (err)
 			goto out;
 
-		if (vhd.footer.type != HD_TYPE_DIFF || vhd_parent_raw(&vhd)) {
-			vhd_close(&vhd);
+		if (vhd->footer.type != HD_TYPE_DIFF || vhd_parent_raw(vhd)) {
+			vhd_chain_put(vhd);
 			goto out;
 		}
 
-		err = vhd_parent_locator_get(&vhd, &parent);
-		vhd_close(&vhd);
+		err = vhd_parent_locator_get(vhd, &parent);
+		vhd_chain_put(vhd);
 
 		if (err) {
 			printf("error getting parent: %d\n", err);
@@ -1192,9 +1514,10 @@ vhd_util_check(int argc, char **argv)
 	parents = 0;
 	memset(&ctx, 0, sizeof(ctx));
 	vhd_util_check_stats_init(&ctx);
+	ctx.opts.threads = VHD_CHECK_THREADS;
 
 	optind = 0;
-	while ((c = getopt(argc, argv, "n:iItpbBsh")) != -1) {
+	while ((c = getopt(argc, argv, "n:iItpbBsj:h")) != -1) {
 		switch (c) {
 		case 'n':
 			name = optarg;
@@ -1220,6 +1543,14 @@ vhd_util_check(int argc, char **argv)
 		case 's':
 			ctx.opts.collect_stats = 1;
 			break;
+		case 'j':
+			ctx.opts.threads = strtol(optarg, NULL, 10);
+			if (ctx.opts.threads < 1 ||
+			    ctx.opts.threads > VHD_CHECK_THREADS) {
+				err = -EINVAL;
+				goto usage;
+			}
+			break;
 		case 'h':
 			err = 0;
 			goto usage;
@@ -1240,6 +1571,9 @@ vhd_util_check(int argc, char **argv)
 		goto usage;
 	}
 
+	/* every parent is opened by its child's check and its own */
+	vhd_chain_cache_enable(VHD_CHAIN_CACHE_MAX);
+
 	err = vhd_util_check_vhd(&ctx, name);
 	if (err)
 		goto out;
@@ -1253,12 +1587,14 @@ vhd_util_check(int argc, char **argv)
 	vhd_util_check_stats_free(&ctx);
 
 out:
+	vhd_chain_cache_enable(0);
 	return err;
 
 usage:
 	printf("options: -n <file> [-i ignore missing primary footers] "
 	       "[-I ignore parent uuids] [-t ignore timestamps] "
 	       "[-B do not check BAT for overlapping (precludes -s, -b)] "
-	       "[-p check parents] [-b check bitmaps] [-s stats] [-h help]\n");
+	       "[-p check parents] [-b check bitmaps] [-s stats] "
+	       "[-j threads (1-%d)] [-h help]\n", VHD_CHECK_THREADS);
 	return err;
 }
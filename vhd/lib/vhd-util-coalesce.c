@@ -25,8 +25,12 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <limits.h>
+#include <string.h>
+#include <sys/time.h>
+#include <libaio.h>
 
 #include "libvhd.h"
+#include "vhd-util.h"
 
 static int
 __raw_io_write(int fd, char* buf, uint64_t sec, uint32_t secs)
@@ -51,6 +55,25 @@ __raw_io_write(int fd, char* buf, uint64_t sec, uint32_t secs)
 	return (errno ? -errno : -EIO);
 }
 
+/*
+ * The sectors [*first, *last) of a block which hold virtual sectors,
+ * from virtual sector *sec on, see vhd_data_shift().
+ */
+static void
+vhd_util_coalesce_block_span(vhd_context_t *vhd, uint64_t block,
+			     uint64_t *sec, uint32_t *first, uint32_t *last)
+{
+	uint64_t start, shift, end;
+
+	start = block * vhd->spb;
+	shift = vhd_data_shift(vhd);
+	end   = (vhd->footer.curr_size >> VHD_SECTOR_SHIFT) + shift;
+
+	*first = start < shift ? shift - start : 0;
+	*last  = end < start + vhd->spb ? end - start : vhd->spb;
+	*sec   = start + *first - shift;
+}
+
 /*
  * Use 'parent' if the parent is VHD, and 'parent_fd' if the parent is raw
  */
@@ -62,27 +85,36 @@ vhd_util_coalesce_block(vhd_context_t *vhd, vhd_context_t *parent,
 	void *buf;
 	char *map;
 	uint64_t sec, secs;
+	uint32_t first, last;
 
 	buf = NULL;
 	map = NULL;
-	sec = block * vhd->spb;
 
 	if (vhd->bat.bat[block] == DD_BLK_UNUSED)
 		return 0;
 
+	vhd_util_coalesce_block_span(vhd, block, &sec, &first, &last);
+	if (first >= last)
+		return 0;
+
 	err = posix_memalign(&buf, 4096, vhd->header.block_size);
 	if (err)
 		return -err;
 
-	err = vhd_io_read(vhd, buf, sec, vhd->spb);
+	err = vhd_io_read(vhd, buf + vhd_sectors_to_bytes(first), sec,
+			  last - first);
 	if (err)
 		goto done;
 
 	if (vhd_has_batmap(vhd) && vhd_batmap_test(vhd, &vhd->batmap, block)) {
 		if (parent->file)
-			err = vhd_io_write(parent, buf, sec, vhd->spb);
+			err = vhd_io_write(parent,
+					   buf + vhd_sectors_to_bytes(first),
+					   sec, last - first);
 		else
-			err = __raw_io_write(parent_fd, buf, sec, vhd->spb);
+			err = __raw_io_write(parent_fd,
+					     buf + vhd_sectors_to_bytes(first),
+					     sec, last - first);
 		goto done;
 	}
 
@@ -90,22 +122,22 @@ vhd_util_coalesce_block(vhd_context_t *vhd, vhd_context_t *parent,
 	if (err)
 		goto done;
 
-	for (i = 0; i < vhd->spb; i++) {
+	for (i = first; i < last; i++) {
 		if (!vhd_bitmap_test(vhd, map, i))
 			continue;
 
-		for (secs = 0; i + secs < vhd->spb; secs++)
+		for (secs = 0; i + secs < last; secs++)
 			if (!vhd_bitmap_test(vhd, map, i + secs))
 				break;
 
 		if (parent->file)
 			err = vhd_io_write(parent,
 					   buf + vhd_sectors_to_bytes(i),
-					   sec + i, secs);
+					   sec + i - first, secs);
 		else
 			err = __raw_io_write(parent_fd,
 					     buf + vhd_sectors_to_bytes(i),
-					     sec + i, secs);
+					     sec + i - first, secs);
 		if (err)
 			goto done;
 
@@ -120,12 +152,609 @@ done:
 	return err;
 }
 
+/*
+ * Pipelined coalesce. Up to VHD_COALESCE_DEPTH allocated blocks of the
+ * child are copied at a time over libaio: the bitmap and data of each
+ * are read straight from the child, and the sectors present written to
+ * the target. Bitmaps, BAT and batmap of a VHD target are only updated
+ * once the data of a run of VHD_COALESCE_RUN blocks is down, BAT
+ * sectors touched and footer written once per run.
+ */
+#define VHD_COALESCE_DEPTH       8
+#define VHD_COALESCE_WRITES      16      /* in flight, per block */
+#define VHD_COALESCE_RUN         512
+#define VHD_COALESCE_EVENTS      (VHD_COALESCE_DEPTH * VHD_COALESCE_WRITES)
+
+struct vhd_coalesce;
+
+struct vhd_coalesce_copy {
+	struct vhd_coalesce     *c;
+	int                      busy;
+	int                      pending;
+	uint32_t                 blk;
+	int                      fresh;     /* newly allocated in target */
+	int                      full;      /* child batmap bit set */
+	uint32_t                 cursor;    /* next sector to write */
+	uint64_t                 dst;       /* target sector of sector 0 */
+	char                    *map;
+	char                    *buf;
+	struct iocb              iocb[VHD_COALESCE_WRITES];
+};
+
+struct vhd_coalesce_block {
+	uint32_t                 blk;
+	int                      fresh;
+	int                      full;
+	char                    *map;       /* child bitmap */
+	char                    *dmap;      /* target bitmap */
+};
+
+struct vhd_coalesce {
+	vhd_context_t           *from;
+	vhd_context_t           *to;        /* dynamic target, else NULL */
+	int                      to_fd;
+	int                      sparse;
+	uint64_t                 size;      /* of a fixed target, bytes */
+	io_context_t             aio;
+	int                      busy;
+	int                      error;
+
+	size_t                   bm_size;
+	struct vhd_coalesce_copy copies[VHD_COALESCE_DEPTH];
+
+	struct vhd_coalesce_block run[VHD_COALESCE_RUN];
+	int                      n_run;
+	char                    *maps;
+
+	uint64_t                 end;       /* target end of data, sectors */
+	int                      bat_dirty;
+	uint32_t                 bat_lo;
+	uint32_t                 bat_hi;
+	int                      batmap_dirty;
+
+	uint64_t                 rate;      /* bytes/s, 0 for no limit */
+	uint64_t                 bytes;
+	struct timeval           start;
+};
+
+static void
+vhd_coalesce_throttle(struct vhd_coalesce *c, uint64_t bytes)
+{
+	struct timeval now;
+	uint64_t due, elapsed;
+
+	c->bytes += bytes;
+	if (!c->rate)
+		return;
+
+	gettimeofday(&now, NULL);
+	elapsed = (now.tv_sec - c->start.tv_sec) * 1000000ULL +
+		now.tv_usec - c->start.tv_usec;
+	due     = c->bytes * 1000000ULL / c->rate;
+
+	if (due > elapsed)
+		usleep(due - elapsed);
+}
+
 static int
-vhd_util_coalesce_onto(vhd_context_t *from,
-		       vhd_context_t *to, int to_fd, int progress)
+vhd_coalesce_submit(struct vhd_coalesce *c, struct iocb **iocbs, int n)
+{
+	int ret;
+
+	while (n) {
+		ret = io_submit(c->aio, n, iocbs);
+		if (ret < 0)
+			return ret;
+		if (!ret)
+			return -EIO;
+
+		iocbs += ret;
+		n     -= ret;
+	}
+
+	return 0;
+}
+
+static void
+vhd_coalesce_done(struct vhd_coalesce_copy *copy)
+{
+	struct vhd_coalesce *c = copy->c;
+	struct vhd_coalesce_block *b;
+
+	if (!c->error && c->to) {
+		b        = &c->run[c->n_run++];
+		b->blk   = copy->blk;
+		b->fresh = copy->fresh;
+		b->full  = copy->full;
+		if (!copy->full)
+			memcpy(b->map, copy->map, c->bm_size);
+	}
+
+	copy->busy = 0;
+	c->busy--;
+}
+
+/*
+ * Issues the next writes of a block read in, or retires it.
+ */
+static void
+vhd_coalesce_write(struct vhd_coalesce_copy *copy)
+{
+	struct vhd_coalesce *c = copy->c;
+	vhd_context_t *from = c->from;
+	struct iocb *iocbs[VHD_COALESCE_WRITES];
+	uint32_t spb, secs;
+	int n, err;
+
+	spb = from->spb;
+	n   = 0;
+
+	while (copy->cursor < spb && n < VHD_COALESCE_WRITES) {
+		uint32_t sec = copy->cursor;
+
+		if (copy->full || (copy->fresh && !c->sparse))
+			secs = spb - sec;
+		else {
+			sec += vhd_bitmap_span(from, copy->map, sec, spb, 0);
+			if (sec >= spb)
+				break;
+			secs = vhd_bitmap_span(from, copy->map, sec, spb, 1);
+		}
+
+		io_prep_pwrite(&copy->iocb[n], c->to_fd,
+			       copy->buf + vhd_sectors_to_bytes(sec),
+			       vhd_sectors_to_bytes(secs),
+			       vhd_sectors_to_bytes(copy->dst + sec));
+		copy->iocb[n].data = copy;
+		iocbs[n]           = &copy->iocb[n];
+
+		vhd_coalesce_throttle(c, vhd_sectors_to_bytes(secs));
+
+		copy->cursor = sec + secs;
+		n++;
+	}
+
+	if (!n) {
+		vhd_coalesce_done(copy);
+		return;
+	}
+
+	copy->pending = n;
+
+	err = vhd_coalesce_submit(c, iocbs, n);
+	if (err) {
+		c->error      = c->error ? : err;
+		copy->pending = 0;
+		vhd_coalesce_done(copy);
+	}
+}
+
+static void
+vhd_coalesce_read_done(struct vhd_coalesce_copy *copy)
+{
+	struct vhd_coalesce *c = copy->c;
+	vhd_context_t *from = c->from;
+	uint32_t sec, secs;
+
+	/* a fresh block is written whole: zero what the child lacks */
+	if (copy->fresh && !c->sparse && !copy->full) {
+		sec = 0;
+		while (sec < from->spb) {
+			secs = vhd_bitmap_span(from, copy->map,
+					       sec, from->spb, 0);
+			memset(copy->buf + vhd_sectors_to_bytes(sec), 0,
+			       vhd_sectors_to_bytes(secs));
+
+			sec += secs;
+			if (sec < from->spb)
+				sec += vhd_bitmap_span(from, copy->map,
+						       sec, from->spb, 1);
+		}
+	}
+
+	copy->cursor = 0;
+	vhd_coalesce_write(copy);
+}
+
+static int
+vhd_coalesce_reap(struct vhd_coalesce *c, int min)
+{
+	struct io_event events[VHD_COALESCE_EVENTS];
+	int i, n;
+
+	n = io_getevents(c->aio, min, VHD_COALESCE_EVENTS, events, NULL);
+	if (n < 0)
+		return n;
+
+	for (i = 0; i < n; i++) {
+		struct iocb *iocb = events[i].obj;
+		struct vhd_coalesce_copy *copy = iocb->data;
+		long res = (long)events[i].res;
+
+		if (res != (long)iocb->u.c.nbytes)
+			c->error = c->error ? : (res < 0 ? res : -EIO);
+
+		if (--copy->pending)
+			continue;
+
+		if (c->error)
+			vhd_coalesce_done(copy);
+		else if (iocb->aio_lio_opcode == IO_CMD_PREAD)
+			vhd_coalesce_read_done(copy);
+		else
+			vhd_coalesce_write(copy);
+	}
+
+	return 0;
+}
+
+static int
+vhd_coalesce_drain(struct vhd_coalesce *c)
+{
+	int err;
+
+	while (c->busy) {
+		err = vhd_coalesce_reap(c, 1);
+		if (err)
+			return err;
+	}
+
+	return c->error;
+}
+
+static void
+vhd_coalesce_dirty_bat(struct vhd_coalesce *c, uint32_t blk)
+{
+	if (!c->bat_dirty) {
+		c->bat_lo = c->bat_hi = blk;
+		c->bat_dirty = 1;
+	}
+
+	c->bat_lo = MIN(c->bat_lo, blk);
+	c->bat_hi = MAX(c->bat_hi, blk);
+}
+
+static int
+vhd_coalesce_start(struct vhd_coalesce *c, uint32_t blk)
+{
+	vhd_context_t *from = c->from, *to = c->to;
+	struct vhd_coalesce_copy *copy;
+	struct iocb *iocbs[2];
+	uint64_t off;
+	int i, n, err;
+
+	copy = NULL;
+	for (i = 0; i < VHD_COALESCE_DEPTH; i++)
+		if (!c->copies[i].busy) {
+			copy = &c->copies[i];
+			break;
+		}
+
+	if (!copy)
+		return -EBUSY;
+
+	copy->blk   = blk;
+	copy->fresh = 0;
+	copy->full  = (vhd_has_batmap(from) &&
+		       vhd_batmap_test(from, &from->batmap, blk));
+	copy->dst   = (uint64_t)blk * from->spb;
+
+	if (to) {
+		if (blk >= to->bat.entries)
+			return -ERANGE;
+
+		if (to->bat.bat[blk] == DD_BLK_UNUSED) {
+			int spp = getpagesize() >> VHD_SECTOR_SHIFT;
+
+			/* data region of segment should begin on page boundary */
+			if ((c->end + to->bm_secs) % spp)
+				c->end += spp - ((c->end + to->bm_secs) % spp);
+
+			to->bat.bat[blk] = c->end;
+			c->end          += to->bm_secs + to->spb;
+			copy->fresh      = 1;
+			vhd_coalesce_dirty_bat(c, blk);
+		}
+
+		copy->dst = to->bat.bat[blk] + to->bm_secs;
+	} else if (c->size &&
+		   vhd_sectors_to_bytes(copy->dst + from->spb) > c->size)
+		return -ERANGE;
+
+	off = from->bat.bat[blk];
+	n   = 0;
+
+	if (!copy->full) {
+		io_prep_pread(&copy->iocb[n], from->fd, copy->map, c->bm_size,
+			      vhd_sectors_to_bytes(off));
+		copy->iocb[n].data = copy;
+		iocbs[n] = &copy->iocb[n];
+		n++;
+	}
+
+	io_prep_pread(&copy->iocb[n], from->fd, copy->buf,
+		      from->header.block_size,
+		      vhd_sectors_to_bytes(off + from->bm_secs));
+	copy->iocb[n].data = copy;
+	iocbs[n] = &copy->iocb[n];
+	n++;
+
+	vhd_coalesce_throttle(c, from->header.block_size);
+
+	copy->busy    = 1;
+	copy->pending = n;
+	c->busy++;
+
+	err = vhd_coalesce_submit(c, iocbs, n);
+	if (err) {
+		copy->pending = 0;
+		c->error = c->error ? : err;
+		vhd_coalesce_done(copy);
+	}
+
+	return err;
+}
+
+static int
+vhd_coalesce_batch(struct vhd_coalesce *c, int write)
+{
+	struct iocb iocb[VHD_COALESCE_EVENTS], *iocbs[VHD_COALESCE_EVENTS];
+	struct io_event events[VHD_COALESCE_EVENTS];
+	vhd_context_t *to = c->to;
+	int i, n, done, err;
+
+	err = 0;
+
+	for (i = 0; i < c->n_run; ) {
+		for (n = 0; i < c->n_run && n < VHD_COALESCE_EVENTS; i++) {
+			struct vhd_coalesce_block *b = &c->run[i];
+			uint64_t off = to->bat.bat[b->blk];
+
+			if (b->fresh && !write)
+				continue;
+
+			if (write)
+				io_prep_pwrite(&iocb[n], to->fd, b->dmap,
+					       c->bm_size,
+					       vhd_sectors_to_bytes(off));
+			else
+				io_prep_pread(&iocb[n], to->fd, b->dmap,
+					      c->bm_size,
+					      vhd_sectors_to_bytes(off));
+			iocbs[n] = &iocb[n];
+			n++;
+		}
+
+		err = vhd_coalesce_submit(c, iocbs, n);
+		if (err)
+			return err;
+
+		for (done = 0; done < n; ) {
+			int j, ret;
+
+			ret = io_getevents(c->aio, n - done, n - done,
+					   events, NULL);
+			if (ret < 0)
+				return ret;
+
+			for (j = 0; j < ret; j++)
+				if ((long)events[j].res != (long)c->bm_size)
+					err = err ? : -EIO;
+
+			done += ret;
+		}
+
+		if (err)
+			return err;
+	}
+
+	return 0;
+}
+
+static int
+vhd_coalesce_write_bat(struct vhd_coalesce *c)
+{
+	vhd_context_t *to = c->to;
+	uint32_t i, first, last;
+	uint32_t *buf;
+	size_t size;
+	void *p;
+	int err;
+
+	first = (c->bat_lo * sizeof(uint32_t)) >> VHD_SECTOR_SHIFT;
+	last  = (c->bat_hi * sizeof(uint32_t)) >> VHD_SECTOR_SHIFT;
+	size  = vhd_sectors_to_bytes(last - first + 1);
+
+	err = posix_memalign(&p, VHD_SECTOR_SIZE, size);
+	if (err)
+		return -err;
+
+	buf = p;
+	for (i = 0; i < size / sizeof(uint32_t); i++) {
+		uint32_t blk = first * (VHD_SECTOR_SIZE / sizeof(uint32_t)) + i;
+		buf[i] = (blk < to->bat.entries ?
+			  to->bat.bat[blk] : DD_BLK_UNUSED);
+		BE32_OUT(&buf[i]);
+	}
+
+	err = vhd_seek(to, to->header.table_offset +
+		       vhd_sectors_to_bytes(first), SEEK_SET);
+	if (!err)
+		err = vhd_write(to, buf, size);
+
+	free(buf);
+	return err;
+}
+
+/*
+ * Commits a run once its data is down: bitmaps first, then the BAT
+ * entries pointing at new blocks, then batmap and footer.
+ */
+static int
+vhd_coalesce_commit(struct vhd_coalesce *c)
+{
+	vhd_context_t *from = c->from, *to = c->to;
+	int i, err;
+
+	if (!to || !c->n_run)
+		goto out;
+
+	err = vhd_coalesce_batch(c, 0);
+	if (err)
+		return err;
+
+	for (i = 0; i < c->n_run; i++) {
+		struct vhd_coalesce_block *b = &c->run[i];
+		uint32_t sec, end;
+
+		if (b->fresh)
+			memset(b->dmap, 0, c->bm_size);
+
+		sec = 0;
+		while (sec < from->spb) {
+			if (b->full)
+				end = from->spb;
+			else {
+				sec += vhd_bitmap_span(from, b->map,
+						       sec, from->spb, 0);
+				if (sec >= from->spb)
+					break;
+				end  = sec + vhd_bitmap_span(from, b->map,
+							     sec, from->spb, 1);
+			}
+
+			for (; sec < end; sec++)
+				vhd_bitmap_set(to, b->dmap, sec);
+		}
+
+		if (vhd_has_batmap(to) &&
+		    !vhd_batmap_test(to, &to->batmap, b->blk) &&
+		    vhd_bitmap_span(to, b->dmap, 0, to->spb, 1) == to->spb) {
+			vhd_batmap_set(to, &to->batmap, b->blk);
+			c->batmap_dirty = 1;
+		}
+	}
+
+	err = vhd_coalesce_batch(c, 1);
+	if (err)
+		return err;
+
+	if (c->bat_dirty) {
+		err = vhd_coalesce_write_bat(c);
+		if (err)
+			return err;
+	}
+
+	if (c->batmap_dirty) {
+		err = vhd_write_batmap(to, &to->batmap);
+		if (err)
+			return err;
+	}
+
+	if (c->bat_dirty) {
+		err = vhd_write_footer(to, &to->footer);
+		if (err)
+			return err;
+	}
+
+out:
+	c->n_run        = 0;
+	c->bat_dirty    = 0;
+	c->batmap_dirty = 0;
+	return 0;
+}
+
+static void
+vhd_coalesce_free(struct vhd_coalesce *c)
+{
+	int i;
+
+	for (i = 0; i < VHD_COALESCE_DEPTH; i++) {
+		free(c->copies[i].map);
+		free(c->copies[i].buf);
+	}
+
+	free(c->maps);
+
+	if (c->aio)
+		io_destroy(c->aio);
+}
+
+static int
+vhd_coalesce_init(struct vhd_coalesce *c, vhd_context_t *from,
+		  vhd_context_t *to, int to_fd, uint64_t rate)
+{
+	off64_t end;
+	void *p;
+	int i, err;
+
+	memset(c, 0, sizeof(*c));
+	c->from    = from;
+	c->to      = to->file && vhd_type_dynamic(to) ? to : NULL;
+	c->to_fd   = to->file ? to->fd : to_fd;
+	c->sparse  = to->file && vhd_flag_test(to->oflags,
+					       VHD_OPEN_IO_WRITE_SPARSE);
+	c->size    = to->file && !c->to ? to->footer.curr_size : 0;
+	c->rate    = rate;
+	c->bm_size = vhd_sectors_to_bytes(from->bm_secs);
+	gettimeofday(&c->start, NULL);
+
+	err = io_setup(VHD_COALESCE_EVENTS, &c->aio);
+	if (err) {
+		c->aio = NULL;
+		return err;
+	}
+
+	for (i = 0; i < VHD_COALESCE_DEPTH; i++) {
+		struct vhd_coalesce_copy *copy = &c->copies[i];
+
+		copy->c = c;
+
+		err = posix_memalign(&p, 4096, c->bm_size);
+		if (err)
+			goto fail;
+		copy->map = p;
+
+		err = posix_memalign(&p, 4096, from->header.block_size);
+		if (err)
+			goto fail;
+		copy->buf = p;
+	}
+
+	if (!c->to)
+		return 0;
+
+	err = posix_memalign(&p, 4096, 2 * c->bm_size * VHD_COALESCE_RUN);
+	if (err)
+		goto fail;
+	c->maps = p;
+
+	for (i = 0; i < VHD_COALESCE_RUN; i++) {
+		c->run[i].map  = c->maps + 2 * i * c->bm_size;
+		c->run[i].dmap = c->run[i].map + c->bm_size;
+	}
+
+	err = vhd_end_of_data(to, &end);
+	if (err)
+		goto out;
+
+	c->end = end >> VHD_SECTOR_SHIFT;
+	return 0;
+
+fail:
+	err = -err;
+out:
+	vhd_coalesce_free(c);
+	return err;
+}
+
+static int
+vhd_util_coalesce_onto(vhd_context_t *from, vhd_context_t *to,
+		       int to_fd, int progress, uint64_t rate)
 {
 	int err;
 	uint64_t i;
+	struct vhd_coalesce c;
 
 	err = vhd_get_bat(from);
 	if (err)
@@ -137,28 +766,74 @@ vhd_util_coalesce_onto(vhd_context_t *from,
 			goto out;
 	}
 
-	for (i = 0; i < from->bat.entries; i++) {
+	if (to->file && vhd_type_dynamic(to)) {
+		err = vhd_get_bat(to);
+		if (err)
+			goto out;
+
+		if (vhd_has_batmap(to)) {
+			err = vhd_get_batmap(to);
+			if (err)
+				goto out;
+		}
+
+	}
+
+	/* mismatched blocks or layouts take the old way, sector by sector */
+	if ((to->file && vhd_type_dynamic(to) && to->spb != from->spb) ||
+	    vhd_data_shift(from) != vhd_data_shift(to) ||
+	    vhd_compressed(from)) {
+		for (i = 0; i < from->bat.entries; i++) {
+			err = vhd_util_coalesce_block(from, to, to_fd, i);
+			if (err)
+				goto out;
+		}
+		goto out;
+	}
+
+	err = vhd_coalesce_init(&c, from, to, to_fd, rate);
+	if (err)
+		goto out;
+
+	for (i = 0; i < from->bat.entries && !err; i++) {
 		if (progress) {
 			printf("\r%6.2f%%",
 			       ((float)i / (float)from->bat.entries) * 100.00);
 			fflush(stdout);
 		}
-		err = vhd_util_coalesce_block(from, to, to_fd, i);
-		if (err)
-			goto out;
+
+		if (from->bat.bat[i] == DD_BLK_UNUSED)
+			continue;
+
+		if (c.n_run + c.busy == VHD_COALESCE_RUN) {
+			err = vhd_coalesce_drain(&c) ? : vhd_coalesce_commit(&c);
+			if (err)
+				break;
+		}
+
+		while (c.busy == VHD_COALESCE_DEPTH && !err)
+			err = vhd_coalesce_reap(&c, 1) ? : c.error;
+
+		if (!err)
+			err = vhd_coalesce_start(&c, i);
 	}
 
-	err = 0;
+	err = vhd_coalesce_drain(&c) ? : err;
+	if (!err)
+		err = vhd_coalesce_commit(&c);
 
-	if (progress)
+	vhd_coalesce_free(&c);
+
+	if (!err && progress)
 		printf("\r100.00%%\n");
 
 out:
 	return err;
 }
 
-static int
-vhd_util_coalesce_parent(const char *name, int sparse, int progress)
+int
+vhd_util_coalesce_parent(const char *name, int sparse,
+			 int progress, uint64_t rate)
 {
 	char *pname;
 	int err, parent_fd;
@@ -200,7 +875,7 @@ vhd_util_coalesce_parent(const char *name, int sparse, int progress)
 		}
 	}
 
-	err = vhd_util_coalesce_onto(&vhd, &parent, parent_fd, progress);
+	err = vhd_util_coalesce_onto(&vhd, &parent, parent_fd, progress, rate);
 
 	free(pname);
 	vhd_close(&vhd);
@@ -389,7 +1064,8 @@ vhd_util_coalesce_clear_bitmap(vhd_context_t *child, char *cmap,
 	char *amap = NULL;
 	int i, dirty, err;
 
-	if (child->spb != ancestor->spb) {
+	if (child->spb != ancestor->spb ||
+	    vhd_data_shift(child) != vhd_data_shift(ancestor)) {
 		err = -EINVAL;
 		goto out;
 	}
@@ -467,8 +1143,8 @@ out:
 }
 
 static int
-vhd_util_coalesce_ancestor(const char *cname,
-			   const char *aname, int sparse, int progress)
+vhd_util_coalesce_ancestor(const char *cname, const char *aname,
+			   int sparse, int progress, uint64_t rate)
 {
 	uint64_t i;
 	int err, raw_fd;
@@ -498,7 +1174,7 @@ vhd_util_coalesce_ancestor(const char *cname,
 		goto out;
 	}
 
-	err = vhd_util_coalesce_onto(child, ancestor, raw_fd, progress);
+	err = vhd_util_coalesce_onto(child, ancestor, raw_fd, progress, rate);
 	if (err)
 		goto out;
 
@@ -529,7 +1205,13 @@ vhd_util_coalesce_open_output(vhd_context_t *dst,
 		return -errno;
 	}
 
-	err = vhd_create(name, src->footer.curr_size, HD_TYPE_DYNAMIC, 0, 0);
+	if (vhd_data_shift(src))
+		err = vhd_create_aligned(name, src->footer.curr_size,
+					 HD_TYPE_DYNAMIC, 0, 0,
+					 src->spb - vhd_data_shift(src));
+	else
+		err = vhd_create(name, src->footer.curr_size,
+				 HD_TYPE_DYNAMIC, 0, 0);
 	if (err) {
 		printf("error creating %s: %d\n", name, err);
 		return err;
@@ -546,7 +1228,8 @@ vhd_util_coalesce_open_output(vhd_context_t *dst,
 }
 
 /*
- * read block from @src chain and write it to @dst, unless it is all zeros
+ * share block of @src chain with @dst where the filesystem can, else
+ * read it and write it to @dst, unless it is all zeros
  */
 static int
 vhd_util_coalesce_block_out(vhd_context_t *dst,
@@ -554,23 +1237,31 @@ vhd_util_coalesce_block_out(vhd_context_t *dst,
 {
 	int i, err;
 	uint64_t sec;
+	uint32_t first, last;
 	void *buf;
 	char *p;
 
 	buf = NULL;
-	sec = block * src->spb;
+
+	vhd_util_coalesce_block_span(src, block, &sec, &first, &last);
+	if (first >= last)
+		return 0;
+
+	err = vhd_io_clone_block(dst, src, block);
+	if (err)
+		return err < 0 ? err : 0;
 
 	err = posix_memalign(&buf, 4096, src->header.block_size);
 	if (err)
 		return -err;
 
-	err = vhd_io_read(src, buf, sec, src->spb);
+	err = vhd_io_read(src, buf, sec, last - first);
 	if (err)
 		goto done;
 
-	for (p = buf, i = 0; i < src->header.block_size; i++, p++) {
+	for (p = buf, i = 0; i < vhd_sectors_to_bytes(last - first); i++, p++) {
 		if (*p) {
-			err = vhd_io_write(dst, buf, sec, src->spb);
+			err = vhd_io_write(dst, buf, sec, last - first);
 			break;
 		}
 	}
@@ -638,18 +1329,20 @@ vhd_util_coalesce(int argc, char **argv)
 {
 	char *name, *oname, *ancestor;
 	int err, c, progress, sparse;
+	uint64_t rate;
 
 	name      = NULL;
 	oname     = NULL;
 	ancestor  = NULL;
 	sparse    = 0;
 	progress  = 0;
+	rate      = 0;
 
 	if (!argc || !argv)
 		goto usage;
 
 	optind = 0;
-	while ((c = getopt(argc, argv, "n:o:a:sph")) != -1) {
+	while ((c = getopt(argc, argv, "n:o:a:r:sph")) != -1) {
 		switch (c) {
 		case 'n':
 			name = optarg;
@@ -660,6 +1353,10 @@ vhd_util_coalesce(int argc, char **argv)
 		case 'a':
 			ancestor = optarg;
 			break;
+		case 'r':
+			/* MiB/s */
+			rate = strtoull(optarg, NULL, 10) << 20;
+			break;
 		case 's':
 			sparse = 1;
 			break;
@@ -682,9 +1379,9 @@ vhd_util_coalesce(int argc, char **argv)
 		err = vhd_util_coalesce_out(name, oname, sparse, progress);
 	else if (ancestor)
 		err = vhd_util_coalesce_ancestor(name, ancestor,
-						 sparse, progress);
+						 sparse, progress, rate);
 	else
-		err = vhd_util_coalesce_parent(name, sparse, progress);
+		err = vhd_util_coalesce_parent(name, sparse, progress, rate);
 
 	if (err)
 		printf("error coalescing: %d\n", err);
@@ -693,6 +1390,7 @@ vhd_util_coalesce(int argc, char **argv)
 
 usage:
 	printf("options: <-n name> [-a ancestor] "
-	       "[-o output] [-s sparse] [-p progress] [-h help]\n");
+	       "[-o output] [-r rate limit, MiB/s] [-s sparse] "
+	       "[-p progress] [-h help]\n");
 	return -EINVAL;
 }
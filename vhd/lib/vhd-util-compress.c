@@ -0,0 +1,366 @@
+/*
+ * Copyright (C) Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2.1 only
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Write a read-only, compressed copy of a VHD chain, for golden images
+ * and other parents which are never written again. See HD_COMPRESSED
+ * in vhd.h for the layout.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+
+#include "libvhd.h"
+#include "vhd-util.h"
+
+#ifdef HAVE_LZ4
+
+struct vhd_compress {
+	vhd_context_t            src;
+	vhd_context_t            dst;
+
+	char                    *data;      /* one block, as read */
+	char                    *out;       /* bitmap, then compressed data */
+	size_t                   out_size;
+	uint32_t                *zmap;
+	off64_t                  next;      /* sector of the next block */
+
+	uint64_t                 raw;
+	uint64_t                 stored;
+};
+
+static int
+vhd_compress_open(struct vhd_compress *c, const char *name,
+		  const char *oname)
+{
+	int err;
+	uint32_t shift;
+	vhd_flag_creat_t flags;
+
+	err = vhd_open(&c->src, name, VHD_OPEN_RDONLY | VHD_OPEN_CACHED);
+	if (err) {
+		printf("error opening %s: %d\n", name, err);
+		return err;
+	}
+
+	err = access(oname, F_OK);
+	if (!err) {
+		printf("%s already exists\n", oname);
+		return -EEXIST;
+	} else if (errno != ENOENT) {
+		printf("error checking %s: %d\n", oname, errno);
+		return -errno;
+	}
+
+	/* keep the block size and layout, so children stay valid */
+	flags = 0;
+	shift = vhd_data_shift(&c->src);
+
+	if (vhd_type_dynamic(&c->src)) {
+		err = vhd_flag_set_block_size(&flags,
+					      vhd_block_size(&c->src));
+		if (err)
+			return err;
+	}
+
+	if (shift)
+		err = vhd_create_aligned(oname, c->src.footer.curr_size,
+					 HD_TYPE_DYNAMIC, 0, flags,
+					 c->src.spb - shift);
+	else
+		err = vhd_create(oname, c->src.footer.curr_size,
+				 HD_TYPE_DYNAMIC, 0, flags);
+	if (err) {
+		printf("error creating %s: %d\n", oname, err);
+		return err;
+	}
+
+	err = vhd_open(&c->dst, oname, VHD_OPEN_RDWR);
+	if (err) {
+		printf("error opening %s: %d\n", oname, err);
+		unlink(oname);
+		return err;
+	}
+
+	err = vhd_get_bat(&c->dst);
+	if (err)
+		return err;
+
+	err = vhd_get_batmap(&c->dst);
+	if (err)
+		return err;
+
+	c->zmap = calloc(c->dst.header.max_bat_size, sizeof(uint32_t));
+	if (!c->zmap)
+		return -ENOMEM;
+
+	c->out_size = vhd_sectors_to_bytes(c->dst.bm_secs) +
+		vhd_bytes_padded(LZ4_compressBound(c->dst.header.block_size));
+
+	err = posix_memalign((void **)&c->data, VHD_SECTOR_SIZE,
+			     c->dst.header.block_size);
+	if (err) {
+		c->data = NULL;
+		return -err;
+	}
+
+	err = posix_memalign((void **)&c->out, VHD_SECTOR_SIZE, c->out_size);
+	if (err) {
+		c->out = NULL;
+		return -err;
+	}
+
+	err = vhd_end_of_data(&c->dst, &c->next);
+	if (err)
+		return err;
+
+	c->next >>= VHD_SECTOR_SHIFT;
+	return 0;
+}
+
+/* read block @blk of the source into c->data; 1 if it holds any data */
+static int
+vhd_compress_read(struct vhd_compress *c, uint32_t blk)
+{
+	int i, err;
+	uint64_t start, end, shift, first, last;
+	vhd_context_t *vhd = &c->dst;
+
+	shift = vhd_data_shift(vhd);
+	start = (uint64_t)blk * vhd->spb;
+	end   = (vhd->footer.curr_size >> VHD_SECTOR_SHIFT) + shift;
+
+	first = start < shift ? shift - start : 0;
+	last  = end < start + vhd->spb ? end - start : vhd->spb;
+
+	memset(c->data, 0, vhd->header.block_size);
+	if (first >= last)
+		return 0;
+
+	err = vhd_io_read(&c->src, c->data + vhd_sectors_to_bytes(first),
+			  start + first - shift, last - first);
+	if (err)
+		return err;
+
+	for (i = 0; i < vhd->header.block_size; i++)
+		if (c->data[i])
+			return 1;
+
+	return 0;
+}
+
+static int
+vhd_compress_block(struct vhd_compress *c, uint32_t blk)
+{
+	int err, len;
+	size_t bm_size, size;
+	vhd_context_t *vhd = &c->dst;
+
+	err = vhd_compress_read(c, blk);
+	if (err <= 0)
+		return err;
+
+	bm_size = vhd_sectors_to_bytes(vhd->bm_secs);
+	memset(c->out, 0xff, bm_size);
+
+	len = LZ4_compress_default(c->data, c->out + bm_size,
+				   vhd->header.block_size,
+				   c->out_size - bm_size);
+
+	/* not worth a decompression on every read */
+	if (len <= 0 || vhd_bytes_padded(len) >= vhd->header.block_size) {
+		len = vhd->header.block_size;
+		memcpy(c->out + bm_size, c->data, len);
+	}
+
+	size = bm_size + vhd_bytes_padded(len);
+	memset(c->out + bm_size + len, 0, vhd_bytes_padded(len) - len);
+
+	if (c->next > UINT32_MAX)
+		return -EFBIG;
+
+	err = vhd_seek(vhd, vhd_sectors_to_bytes(c->next), SEEK_SET);
+	if (err)
+		return err;
+
+	err = vhd_write(vhd, c->out, size);
+	if (err)
+		return err;
+
+	vhd->bat.bat[blk] = c->next;
+	c->zmap[blk]      = len;
+	vhd_batmap_set(vhd, &vhd->batmap, blk);
+
+	c->next   += size >> VHD_SECTOR_SHIFT;
+	c->raw    += vhd->header.block_size;
+	c->stored += size;
+
+	return 0;
+}
+
+/*
+ * the zmap goes after the last block; the footer, which marks the image
+ * compressed, goes last of all
+ */
+static int
+vhd_compress_finish(struct vhd_compress *c)
+{
+	int err;
+	vhd_context_t *vhd = &c->dst;
+
+	vhd->footer.features   |= HD_COMPRESSED;
+	vhd->header.zcodec      = DD_ZCODEC_LZ4;
+	vhd->header.zmap_offset = vhd_sectors_to_bytes(c->next);
+
+	err = vhd_write_zmap(vhd, c->zmap);
+	if (err)
+		return err;
+
+	err = vhd_write_bat(vhd, &vhd->bat);
+	if (err)
+		return err;
+
+	err = vhd_write_batmap(vhd, &vhd->batmap);
+	if (err)
+		return err;
+
+	err = vhd_write_header(vhd, &vhd->header);
+	if (err)
+		return err;
+
+	if (fdatasync(vhd->fd))
+		return -errno;
+
+	return vhd_write_footer(vhd, &vhd->footer);
+}
+
+static int
+vhd_compress(const char *name, const char *oname, int progress)
+{
+	int err;
+	uint32_t i;
+	struct vhd_compress c;
+
+	memset(&c, 0, sizeof(c));
+
+	err = vhd_compress_open(&c, name, oname);
+	if (err)
+		goto out;
+
+	for (i = 0; i < c.dst.bat.entries; i++) {
+		if (progress) {
+			printf("\r%6.2f%%",
+			       ((float)i / (float)c.dst.bat.entries) * 100.0);
+			fflush(stdout);
+		}
+
+		err = vhd_compress_block(&c, i);
+		if (err) {
+			printf("error compressing block %u: %d\n", i, err);
+			goto out;
+		}
+	}
+
+	err = vhd_compress_finish(&c);
+	if (err) {
+		printf("error writing metadata: %d\n", err);
+		goto out;
+	}
+
+	if (progress)
+		printf("\r100.00%%\n");
+
+	if (c.raw)
+		printf("%"PRIu64" MB of data stored in %"PRIu64" MB\n",
+		       c.raw >> 20, c.stored >> 20);
+
+out:
+	if (err && c.dst.file)
+		unlink(c.dst.file);
+	vhd_close(&c.src);
+	vhd_close(&c.dst);
+	free(c.data);
+	free(c.out);
+	free(c.zmap);
+	return err;
+}
+
+#else
+
+static int
+vhd_compress(const char *name, const char *oname, int progress)
+{
+	printf("built without lz4, cannot compress\n");
+	return -EOPNOTSUPP;
+}
+
+#endif
+
+int
+vhd_util_compress(int argc, char **argv)
+{
+	char *name, *oname;
+	int c, progress;
+
+	name     = NULL;
+	oname    = NULL;
+	progress = 0;
+
+	if (!argc || !argv)
+		goto usage;
+
+	optind = 0;
+	while ((c = getopt(argc, argv, "n:o:ph")) != -1) {
+		switch (c) {
+		case 'n':
+			name = optarg;
+			break;
+		case 'o':
+			oname = optarg;
+			break;
+		case 'p':
+			progress = 1;
+			break;
+		case 'h':
+		default:
+			goto usage;
+		}
+	}
+
+	if (!name || !oname || optind != argc)
+		goto usage;
+
+	return vhd_compress(name, oname, progress);
+
+usage:
+	printf("options: <-n name> <-o output> [-p progress] [-h help]\n"
+	       "writes a read-only copy of the chain of <name>, with block "
+	       "data compressed, to use as a parent\n");
+	return -EINVAL;
+}
@@ -0,0 +1,218 @@
+/*
+ * Copyright (C) Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2.1 only
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Copy one image, as a new VDI with a uuid of its own: its parent, if
+ * any, stays its parent. On filesystems sharing extents the copy takes
+ * no more than the metadata; elsewhere the kernel copies the data.
+ * See coalesce -o for a copy of a whole chain.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "libvhd.h"
+#include "vhd-util.h"
+
+/* copied this much at a time, so progress moves */
+#define VHD_COPY_CHUNK   (64ULL << 20)
+#define VHD_COPY_BUF     (1 << 20)
+
+static int
+vhd_copy_chunk(int sfd, int dfd, off64_t off, size_t len,
+	       char **bufp, int *by_hand)
+{
+	int err;
+	ssize_t ret;
+	size_t n, done;
+
+	if (!*by_hand) {
+		err = vhd_copy_range(sfd, off, dfd, off, len);
+		if (err != -EOPNOTSUPP)
+			return err;
+
+		/* not supported here: copy by hand from now on */
+		*by_hand = 1;
+	}
+
+	if (!*bufp) {
+		err = posix_memalign((void **)bufp, VHD_SECTOR_SIZE,
+				     VHD_COPY_BUF);
+		if (err) {
+			*bufp = NULL;
+			return -err;
+		}
+	}
+
+	for (done = 0; done < len; done += n) {
+		n = len - done < VHD_COPY_BUF ? len - done : VHD_COPY_BUF;
+
+		ret = pread(sfd, *bufp, n, off + done);
+		if (ret != n)
+			return (ret == -1 ? -errno : -EIO);
+
+		ret = pwrite(dfd, *bufp, n, off + done);
+		if (ret != n)
+			return (ret == -1 ? -errno : -EIO);
+	}
+
+	return 0;
+}
+
+static int
+vhd_copy(const char *name, const char *oname, int progress)
+{
+	int err, fd, by_hand;
+	off64_t off, size;
+	struct stat st;
+	vhd_context_t src, dst;
+	char *buf;
+
+	fd      = -1;
+	buf     = NULL;
+	by_hand = 0;
+	memset(&dst, 0, sizeof(dst));
+
+	err = vhd_open(&src, name, VHD_OPEN_RDONLY);
+	if (err) {
+		printf("error opening %s: %d\n", name, err);
+		return err;
+	}
+
+	if (src.is_block) {
+		printf("%s is not a file\n", name);
+		err = -EINVAL;
+		goto out;
+	}
+
+	if (fstat(src.fd, &st)) {
+		err = -errno;
+		goto out;
+	}
+	size = st.st_size;
+
+	fd = open(oname, O_WRONLY | O_CREAT | O_EXCL, 0644);
+	if (fd == -1) {
+		err = -errno;
+		printf("error creating %s: %d\n", oname, err);
+		goto out;
+	}
+
+	for (off = 0; off < size; off += VHD_COPY_CHUNK) {
+		if (progress) {
+			printf("\r%6.2f%%", ((float)off / (float)size) * 100.0);
+			fflush(stdout);
+		}
+
+		err = vhd_copy_chunk(src.fd, fd, off,
+				     size - off < VHD_COPY_CHUNK ?
+				     size - off : VHD_COPY_CHUNK,
+				     &buf, &by_hand);
+		if (err) {
+			printf("error copying at %"PRIu64": %d\n",
+			       (uint64_t)off, err);
+			goto out;
+		}
+	}
+
+	if (fsync(fd)) {
+		err = -errno;
+		goto out;
+	}
+
+	err = vhd_open(&dst, oname, VHD_OPEN_RDWR);
+	if (err) {
+		printf("error opening %s: %d\n", oname, err);
+		goto out;
+	}
+
+	uuid_generate(dst.footer.uuid);
+	err = vhd_write_footer(&dst, &dst.footer);
+	if (err) {
+		printf("error writing footer: %d\n", err);
+		goto out;
+	}
+
+	if (progress)
+		printf("\r100.00%%\n");
+
+	if (by_hand)
+		printf("extents not shared, %"PRIu64" MB copied\n",
+		       (uint64_t)size >> 20);
+
+out:
+	if (err && fd != -1)
+		unlink(oname);
+	if (fd != -1)
+		close(fd);
+	vhd_close(&src);
+	vhd_close(&dst);
+	free(buf);
+	return err;
+}
+
+int
+vhd_util_copy(int argc, char **argv)
+{
+	char *name, *oname;
+	int c, progress;
+
+	name     = NULL;
+	oname    = NULL;
+	progress = 0;
+
+	if (!argc || !argv)
+		goto usage;
+
+	optind = 0;
+	while ((c = getopt(argc, argv, "n:o:ph")) != -1) {
+		switch (c) {
+		case 'n':
+			name = optarg;
+			break;
+		case 'o':
+			oname = optarg;
+			break;
+		case 'p':
+			progress = 1;
+			break;
+		case 'h':
+		default:
+			goto usage;
+		}
+	}
+
+	if (!name || !oname || optind != argc)
+		goto usage;
+
+	return vhd_copy(name, oname, progress);
+
+usage:
+	printf("options: <-n name> <-o output> [-p progress] [-h help]\n"
+	       "copies <name>, not its parents, to a new VDI, sharing "
+	       "extents where the filesystem can\n");
+	return -EINVAL;
+}
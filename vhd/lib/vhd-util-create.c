@@ -30,22 +30,25 @@ int
 vhd_util_create(int argc, char **argv)
 {
 	char *name;
-	uint64_t size, msize;
-	int c, sparse, err;
+	uint64_t size, msize, bsize, align;
+	int c, sparse, err, aligned;
 	vhd_flag_creat_t flags;
 
 	err       = -EINVAL;
 	size      = 0;
 	msize     = 0;
+	bsize     = 0;
 	sparse    = 1;
 	name      = NULL;
 	flags     = 0;
+	align     = 0;
+	aligned   = 0;
 
 	if (!argc || !argv)
 		goto usage;
 
 	optind = 0;
-	while ((c = getopt(argc, argv, "n:s:S:rh")) != -1) {
+	while ((c = getopt(argc, argv, "n:s:S:b:A:rh")) != -1) {
 		switch (c) {
 		case 'n':
 			name = optarg;
@@ -58,6 +61,13 @@ vhd_util_create(int argc, char **argv)
 			err = 0;
 			msize = strtoull(optarg, NULL, 10);
 			break;
+		case 'b':
+			bsize = strtoull(optarg, NULL, 10);
+			break;
+		case 'A':
+			align   = strtoull(optarg, NULL, 10);
+			aligned = 1;
+			break;
 		case 'r':
 			sparse = 0;
 			break;
@@ -75,6 +85,25 @@ vhd_util_create(int argc, char **argv)
 		return -EINVAL;
 	}
 
+	if (bsize) {
+		if (!sparse ||
+		    vhd_flag_set_block_size(&flags, bsize << 20)) {
+			printf("Error: <-b block size> must be a power of two "
+			       "from 2 to 64, for sparse disks\n");
+			return -EINVAL;
+		}
+	}
+
+	if (aligned) {
+		if (!sparse) {
+			printf("Error: <-A sector> is for sparse disks\n");
+			return -EINVAL;
+		}
+
+		return vhd_create_aligned(name, size << 20, HD_TYPE_DYNAMIC,
+					  msize << 20, flags, align);
+	}
+
 	return vhd_create(name, size << 20,
 				  (sparse ? HD_TYPE_DYNAMIC : HD_TYPE_FIXED),
 				  msize << 20, flags);
@@ -82,6 +111,9 @@ vhd_util_create(int argc, char **argv)
 usage:
 	printf("options: <-n name> <-s size (MB)> [-r reserve] [-h help] "
 			"[<-S size (MB) for metadata preallocation "
-			"(see vhd-util resize)>]\n");
+			"(see vhd-util resize)>] "
+			"[-b block size (MB), 2 (default) to 64] "
+			"[-A sector to start a block, e.g. of the first "
+			"partition]\n");
 	return -EINVAL;
 }
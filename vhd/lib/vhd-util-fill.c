@@ -23,10 +23,199 @@
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
 
 #include "libvhd.h"
 
+/* space for a block at sector off: its bitmap, data starting on a page */
+static off64_t
+vhd_fill_next_block(vhd_context_t *vhd, off64_t off)
+{
+	int spp = getpagesize() >> VHD_SECTOR_SHIFT;
+
+	if ((off + vhd->bm_secs) % spp)
+		off += spp - ((off + vhd->bm_secs) % spp);
+
+	return off;
+}
+
+static int
+vhd_fill_reserve(vhd_context_t *vhd, off64_t start, off64_t end)
+{
+	uint64_t range[2];
+	off64_t eof;
+
+	if (!vhd->is_block) {
+		if (fallocate(vhd->fd, 0, start, end - start))
+			return -errno;
+		return 0;
+	}
+
+	eof = lseek64(vhd->fd, 0, SEEK_END);
+	if (eof == (off64_t)-1)
+		return -errno;
+
+	if (end + sizeof(vhd_footer_t) > eof)
+		return -ENOSPC;
+
+	range[0] = start;
+	range[1] = end - start;
+	if (ioctl(vhd->fd, BLKZEROOUT, range))
+		return -errno;
+
+	return 0;
+}
+
+/*
+ * Allocate every unwritten block of a disk without a parent in one
+ * pass. The data area past the end of data is reserved in one go, so
+ * it reads zeros, and only bitmaps, BAT and batmap are written. The
+ * bitmaps go through the page cache and are synced before the BAT
+ * points at them. -EOPNOTSUPP if space cannot be reserved this way.
+ */
+static int
+vhd_util_fill_fast(vhd_context_t *vhd)
+{
+	int err, fd;
+	void *map;
+	size_t size;
+	off64_t end, off;
+	uint32_t i, *bat;
+
+	if (vhd->footer.type != HD_TYPE_DYNAMIC)
+		return -EOPNOTSUPP;
+
+	fd  = -1;
+	map = NULL;
+	bat = NULL;
+
+	err = vhd_end_of_data(vhd, &end);
+	if (err)
+		return err;
+
+	bat = malloc(vhd->bat.entries * sizeof(uint32_t));
+	if (!bat)
+		return -ENOMEM;
+
+	off = end >> VHD_SECTOR_SHIFT;
+	for (i = 0; i < vhd->bat.entries; i++) {
+		bat[i] = vhd->bat.bat[i];
+		if (bat[i] != DD_BLK_UNUSED)
+			continue;
+
+		off    = vhd_fill_next_block(vhd, off);
+		bat[i] = off;
+		off   += vhd->bm_secs + vhd->spb;
+	}
+
+	if (vhd_sectors_to_bytes(off) == end) {
+		err = 0;
+		goto out;
+	}
+
+	if (off > UINT32_MAX) {
+		err = -EFBIG;
+		goto out;
+	}
+
+	err = vhd_fill_reserve(vhd, end, vhd_sectors_to_bytes(off));
+	if (err) {
+		if (err == -EINVAL || err == -ENOTTY)
+			err = -EOPNOTSUPP;
+		goto out;
+	}
+
+	size = vhd_sectors_to_bytes(vhd->bm_secs);
+	map  = malloc(size);
+	if (!map) {
+		err = -ENOMEM;
+		goto out;
+	}
+	memset(map, 0xff, size);
+
+	fd = open(vhd->file, O_WRONLY | O_LARGEFILE);
+	if (fd == -1) {
+		err = -errno;
+		goto out;
+	}
+
+	for (i = 0; i < vhd->bat.entries; i++) {
+		if (vhd->bat.bat[i] != DD_BLK_UNUSED)
+			continue;
+
+		if (pwrite(fd, map, size,
+			   vhd_sectors_to_bytes(bat[i])) != size) {
+			err = -errno ? : -EIO;
+			goto out;
+		}
+	}
+
+	if (fdatasync(fd)) {
+		err = -errno;
+		goto out;
+	}
+
+	if (vhd_has_batmap(vhd)) {
+		err = vhd_get_batmap(vhd);
+		if (err)
+			goto out;
+
+		for (i = 0; i < vhd->bat.entries; i++)
+			if (vhd->bat.bat[i] == DD_BLK_UNUSED)
+				vhd_batmap_set(vhd, &vhd->batmap, i);
+	}
+
+	memcpy(vhd->bat.bat, bat, vhd->bat.entries * sizeof(uint32_t));
+
+	err = vhd_write_bat(vhd, &vhd->bat);
+	if (err)
+		goto out;
+
+	if (vhd_has_batmap(vhd)) {
+		err = vhd_write_batmap(vhd, &vhd->batmap);
+		if (err)
+			goto out;
+	}
+
+	err = vhd_write_footer(vhd, &vhd->footer);
+
+out:
+	if (fd != -1)
+		close(fd);
+	free(map);
+	free(bat);
+	return err;
+}
+
+/* every sector of the block already written */
+static int
+vhd_fill_block_full(vhd_context_t *vhd, uint32_t blk)
+{
+	char *map;
+	int i, err;
+
+	if (vhd->bat.bat[blk] == DD_BLK_UNUSED)
+		return 0;
+
+	if (vhd_has_batmap(vhd) &&
+	    vhd_batmap_test(vhd, &vhd->batmap, blk))
+		return 1;
+
+	err = vhd_read_bitmap(vhd, blk, &map);
+	if (err)
+		return err;
+
+	for (i = 0; i < vhd->spb; i++)
+		if (!vhd_bitmap_test(vhd, map, i))
+			break;
+
+	free(map);
+	return i == vhd->spb;
+}
+
 int
 vhd_util_fill(int argc, char **argv)
 {
@@ -67,6 +256,16 @@ vhd_util_fill(int argc, char **argv)
 	if (err)
 		goto done;
 
+	err = vhd_util_fill_fast(&vhd);
+	if (err && err != -EOPNOTSUPP)
+		goto done;
+
+	if (vhd_has_batmap(&vhd)) {
+		err = vhd_get_batmap(&vhd);
+		if (err)
+			goto done;
+	}
+
 	err = posix_memalign(&buf, 4096, vhd.header.block_size);
 	if (err) {
 		err = -err;
@@ -76,7 +275,13 @@ vhd_util_fill(int argc, char **argv)
 	sec  = 0;
 	secs = vhd.header.block_size >> VHD_SECTOR_SHIFT;
 
-	for (i = 0; i < vhd.header.max_bat_size; i++) {
+	for (i = 0; i < vhd.header.max_bat_size; i++, sec += secs) {
+		err = vhd_fill_block_full(&vhd, i);
+		if (err < 0)
+			goto done;
+		if (err)
+			continue;
+
 		err = vhd_io_read(&vhd, buf, sec, secs);
 		if (err)
 			goto done;
@@ -84,8 +289,6 @@ vhd_util_fill(int argc, char **argv)
 		err = vhd_io_write(&vhd, buf, sec, secs);
 		if (err)
 			goto done;
-
-		sec += secs;
 	}
 
 	err = 0;
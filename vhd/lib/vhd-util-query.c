@@ -166,7 +166,9 @@ vhd_util_query(int argc, char **argv)
 	if (fastresize) {
 		uint64_t max_size;
 
-		max_size = vhd.header.max_bat_size << (VHD_BLOCK_SHIFT - 20);
+		max_size = ((uint64_t)vhd.header.max_bat_size *
+			    vhd_block_size(&vhd) -
+			    vhd_sectors_to_bytes(vhd_data_shift(&vhd))) >> 20;
 		printf("%"PRIu64"\n", max_size);
 	}
 		
@@ -79,6 +79,12 @@ vhd_print_header(vhd_context_t *vhd, vhd_header_t *h, int hex)
 	vhd_time_to_string(h->prt_ts, time_str);
 	printf("Parent timestamp    : %s\n", time_str);
 
+	if (h->zmap_offset) {
+		printf("Zmap offset         : %s\n", conv(hex, h->zmap_offset));
+		printf("Compression codec   : %s\n",
+		       h->zcodec == DD_ZCODEC_LZ4 ? "lz4" : "unknown");
+	}
+
 	cksm = vhd_checksum_header(h);
 	printf("Checksum            : 0x%x|0x%x (%s)\n", h->checksum, cksm,
 		h->checksum == cksm ? "Good!" : "Bad!");
@@ -108,9 +114,10 @@ vhd_print_footer(vhd_footer_t *f, int hex)
 	snprintf(cookie, 9, "%s", f->cookie);
 	printf("Cookie              : %s\n", cookie);
 
-	printf("Features            : (0x%08x) %s%s\n", f->features,
-		(f->features & HD_TEMPORARY) ? "<TEMP>" : "",
-		(f->features & HD_RESERVED)  ? "<RESV>" : "");
+	printf("Features            : (0x%08x) %s%s%s\n", f->features,
+		(f->features & HD_TEMPORARY)  ? "<TEMP>" : "",
+		(f->features & HD_RESERVED)   ? "<RESV>" : "",
+		(f->features & HD_COMPRESSED) ? "<COMPRESSED>" : "");
 
 	ff_maj = f->ff_version >> 16;
 	ff_min = f->ff_version & 0xffff;
@@ -816,6 +823,10 @@ vhd_util_read(int argc, char **argv)
 		return err;
 	}
 
+	/* uncached, chain reads would reopen the parents every call */
+	if (!cache)
+		vhd_chain_cache_enable(VHD_CHAIN_CACHE_MAX);
+
 	err = vhd_get_bat(&vhd);
 	if (err) {
 		printf("Failed to get bat for %s: %d\n", name, err);
@@ -895,6 +906,7 @@ vhd_util_read(int argc, char **argv)
 
  out:
 	vhd_close(&vhd);
+	vhd_chain_cache_enable(0);
 	return err;
 
  usage:
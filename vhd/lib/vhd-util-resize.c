@@ -26,6 +26,7 @@
 #include <unistd.h>
 #include <string.h>
 #include <syslog.h>
+#include <pthread.h>
 #include <inttypes.h>
 #include <sys/mman.h>
 
@@ -43,11 +44,33 @@
 		DFPRINTF(_f, _a);				\
 	} while (0)
 
+/* block moves are journaled and copied this many at a time */
+#define VHD_RESIZE_BATCH   64
+#define VHD_RESIZE_THREADS 4
+
 typedef struct vhd_block {
 	uint32_t block;
 	uint32_t offset;
 } vhd_block_t;
 
+typedef struct vhd_move {
+	uint32_t src;   /* block being moved */
+	uint32_t dst;   /* removed block whose slot it takes */
+	uint32_t from;
+	uint32_t to;
+} vhd_move_t;
+
+struct vhd_resize_copy {
+	pthread_mutex_t  lock;
+	vhd_context_t   *vhd;
+	vhd_move_t      *moves;
+	int              cnt;
+	int              next;
+	int              err;
+	int              no_copy_range;
+	size_t           size;
+};
+
 TEST_FAIL_EXTERN_VARS;
 
 static inline uint32_t
@@ -184,50 +207,6 @@ vhd_fixed_resize(vhd_journal_t *journal, uint64_t size)
 	return err;
 }
 
-static inline void
-swap(vhd_block_t *list, int a, int b)
-{
-	vhd_block_t tmp;
-
-	tmp     = list[a];
-	list[a] = list[b];
-	list[b] = tmp;
-}
-
-static int
-partition(vhd_block_t *list, int left, int right, int pidx)
-{
-	int i, sidx;
-	long long pval;
-
-	sidx = left;
-	pval = list[pidx].offset;
-	swap(list, pidx, right);
-
-	for (i = left; i < right; i++)
-		if (list[i].offset >= pval) {
-			swap(list, sidx, i);
-			++sidx;
-		}
-
-	swap(list, right, sidx);
-	return sidx;
-}
-
-static void
-quicksort(vhd_block_t *list, int left, int right)
-{
-	int pidx, new_pidx;
-
-	if (right < left)
-		return;
-
-	pidx     = left;
-	new_pidx = partition(list, left, right, pidx);
-	quicksort(list, left, new_pidx - 1);
-	quicksort(list, new_pidx + 1, right);
-}
-
 static int
 vhd_move_block(vhd_journal_t *journal, uint32_t src, off64_t offset)
 {
@@ -292,104 +271,243 @@ out:
 }
 
 static int
-vhd_clobber_block(vhd_journal_t *journal, uint32_t src, uint32_t dest)
+vhd_block_compare_up(const void *lhs, const void *rhs)
+{
+	const vhd_block_t *l = lhs, *r = rhs;
+
+	return (l->offset < r->offset ? -1 : (l->offset > r->offset));
+}
+
+static int
+vhd_block_compare_down(const void *lhs, const void *rhs)
+{
+	return vhd_block_compare_up(rhs, lhs);
+}
+
+/*
+ * copy one block within the file; vhd_copy_range lets the kernel
+ * do the copy, and share the extents where the filesystem can.
+ */
+static int
+vhd_copy_block(struct vhd_resize_copy *copy, vhd_move_t *move, char **bufp)
 {
 	int err;
-	off64_t off;
+	ssize_t ret;
+	size_t size;
+	vhd_context_t *vhd;
+	off64_t from, to;
+
+	vhd  = copy->vhd;
+	size = copy->size;
+	from = vhd_sectors_to_bytes(move->from);
+	to   = vhd_sectors_to_bytes(move->to);
+
+	if (!copy->no_copy_range) {
+		err = vhd_copy_range(vhd->fd, from, vhd->fd, to, size);
+		if (err != -EOPNOTSUPP)
+			return err;
+
+		/* not supported here: copy by hand from now on */
+		copy->no_copy_range = 1;
+	}
+
+	if (!*bufp) {
+		err = posix_memalign((void **)bufp, VHD_SECTOR_SIZE, size);
+		if (err) {
+			*bufp = NULL;
+			return -err;
+		}
+	}
+
+	ret = pread(vhd->fd, *bufp, size, from);
+	if (ret != size)
+		return (ret == -1 ? -errno : -EIO);
+
+	ret = pwrite(vhd->fd, *bufp, size, to);
+	if (ret != size)
+		return (ret == -1 ? -errno : -EIO);
+
+	return 0;
+}
+
+static void *
+vhd_copy_worker(void *arg)
+{
+	int i, err;
+	char *buf;
+	struct vhd_resize_copy *copy;
+
+	buf  = NULL;
+	copy = arg;
+
+	for (;;) {
+		pthread_mutex_lock(&copy->lock);
+		i = (copy->err ? copy->cnt : copy->next++);
+		pthread_mutex_unlock(&copy->lock);
+
+		if (i >= copy->cnt)
+			break;
+
+		err = vhd_copy_block(copy, copy->moves + i, &buf);
+		if (err) {
+			pthread_mutex_lock(&copy->lock);
+			if (!copy->err)
+				copy->err = err;
+			pthread_mutex_unlock(&copy->lock);
+			break;
+		}
+	}
+
+	free(buf);
+	return NULL;
+}
+
+static int
+vhd_copy_blocks(vhd_context_t *vhd, vhd_move_t *moves, int cnt)
+{
+	int i, n, err;
+	pthread_t tids[VHD_RESIZE_THREADS];
+	struct vhd_resize_copy copy;
+
+	memset(&copy, 0, sizeof(copy));
+	pthread_mutex_init(&copy.lock, NULL);
+	copy.vhd   = vhd;
+	copy.moves = moves;
+	copy.cnt   = cnt;
+	copy.size  = vhd_sectors_to_bytes(vhd->spb + vhd->bm_secs);
+
+	n = MIN(cnt, VHD_RESIZE_THREADS) - 1;
+	for (i = 0; i < n; i++) {
+		err = pthread_create(&tids[i], NULL, vhd_copy_worker, &copy);
+		if (err) {
+			EPRINTF("creating copy thread failed: %d\n", err);
+			break;
+		}
+	}
+	n = i;
+
+	vhd_copy_worker(&copy);
+
+	for (i = 0; i < n; i++)
+		pthread_join(tids[i], NULL);
+
+	pthread_mutex_destroy(&copy.lock);
+
+	if (!copy.err && fdatasync(vhd->fd))
+		return -errno;
+
+	return copy.err;
+}
+
+/*
+ * journal a batch of moves, then copy them all.  both ends are journaled:
+ * the destination is overwritten here, and the source is cut off when
+ * the file is truncated at the end of the shrink.
+ */
+static int
+vhd_move_blocks(vhd_journal_t *journal, vhd_move_t *moves, int cnt)
+{
+	int i, err;
+	uint32_t *blocks;
 	vhd_context_t *vhd;
 
 	vhd = &journal->vhd;
-	off = vhd_sectors_to_bytes(vhd->bat.bat[dest]);
 
-	err = vhd_journal_add_block(journal, dest,
-				    VHD_JOURNAL_DATA | VHD_JOURNAL_METADATA);
+	blocks = malloc(2 * cnt * sizeof(uint32_t));
+	if (!blocks)
+		return -ENOMEM;
+
+	for (i = 0; i < cnt; i++) {
+		blocks[2 * i]     = moves[i].src;
+		blocks[2 * i + 1] = moves[i].dst;
+	}
+
+	err = vhd_journal_add_blocks(journal, blocks, 2 * cnt);
+	free(blocks);
 	if (err)
 		return err;
 
-	err = vhd_move_block(journal, src, off);
+	err = vhd_copy_blocks(vhd, moves, cnt);
 	if (err)
 		return err;
 
-	vhd->bat.bat[dest] = DD_BLK_UNUSED;
+	for (i = 0; i < cnt; i++) {
+		vhd->bat.bat[moves[i].src] = moves[i].to;
+		vhd->bat.bat[moves[i].dst] = DD_BLK_UNUSED;
+	}
 
 	return 0;
 }
 
 /*
- * remove a list of blocks from the vhd file
- * if a block to be removed:
- *   - resides at the end of the file: simply clear its bat entry
- *   - resides elsewhere: move the last block in the file into its position
- *                        and update the bat to reflect this
+ * remove the blocks at and beyond 'entries' from the vhd file.
+ * every move is planned up front: the kept blocks nearest the end of
+ * the file are moved, in order, into the lowest slots the removed
+ * blocks leave behind, until no kept block lies above a free slot.
+ * everything past the last kept block can then be truncated.
  */
 static int
-vhd_defrag_shrink(vhd_journal_t *journal,
-		  vhd_block_t *original_free_list, int free_cnt)
+vhd_defrag_shrink(vhd_journal_t *journal, uint32_t entries)
 {
 	vhd_context_t *vhd;
-	int i, j, free_idx, err;
-	vhd_block_t *blocks, *free_list;
-
-	err       = 0;
-	blocks    = NULL;
-	free_list = NULL;
-	vhd       = &journal->vhd;
-
-	blocks = malloc(vhd->bat.entries * sizeof(vhd_block_t));
-	if (!blocks) {
-		err = -ENOMEM;
-		goto out;
-	}
-
-	free_list = malloc(free_cnt * sizeof(vhd_block_t));
-	if (!free_list) {
+	vhd_move_t *moves;
+	vhd_block_t *kept, *freed;
+	int i, k, f, kcnt, fcnt, mcnt, err;
+
+	err   = 0;
+	kept  = NULL;
+	freed = NULL;
+	moves = NULL;
+	vhd   = &journal->vhd;
+
+	kept  = malloc(vhd->bat.entries * sizeof(vhd_block_t));
+	freed = malloc(vhd->bat.entries * sizeof(vhd_block_t));
+	moves = malloc(vhd->bat.entries * sizeof(vhd_move_t));
+	if (!kept || !freed || !moves) {
 		err = -ENOMEM;
 		goto out;
 	}
 
-	for (i = 0; i < vhd->bat.entries; i++) {
-		blocks[i].block  = i;
-		blocks[i].offset = vhd->bat.bat[i];
-	}
+	for (i = 0, kcnt = 0, fcnt = 0; i < vhd->bat.entries; i++) {
+		vhd_block_t *b;
 
-	memcpy(free_list, original_free_list,
-	       free_cnt * sizeof(vhd_block_t));
+		if (vhd->bat.bat[i] == DD_BLK_UNUSED)
+			continue;
 
-	/* sort both the to-free list and the bat list
-	 * in order of descending file offset */
-	quicksort(free_list, 0, free_cnt - 1);
-	quicksort(blocks, 0, vhd->bat.entries - 1);
+		b = (i < entries ? kept + kcnt++ : freed + fcnt++);
+		b->block  = i;
+		b->offset = vhd->bat.bat[i];
+	}
 
-	for (i = 0, free_idx = 0;
-	     i < vhd->bat.entries && free_idx < free_cnt; i++) {
-		vhd_block_t *b = blocks + i;
+	qsort(kept, kcnt, sizeof(vhd_block_t), vhd_block_compare_down);
+	qsort(freed, fcnt, sizeof(vhd_block_t), vhd_block_compare_up);
 
-		if (b->offset == DD_BLK_UNUSED)
-			continue;
-
-		for (j = free_idx; j < free_cnt; j++)
-			if (b->block == free_list[j].block) {
-				/* the last block in the file is in the list of
-				 * blocks to remove; no need to shuffle the
-				 * data -- just clear the bat entry */
-				vhd->bat.bat[free_list[j].block] = DD_BLK_UNUSED;
-				free_idx++;
-				continue;
-			}
+	for (k = 0, f = 0, mcnt = 0;
+	     k < kcnt && f < fcnt && kept[k].offset > freed[f].offset;
+	     k++, f++, mcnt++) {
+		moves[mcnt].src  = kept[k].block;
+		moves[mcnt].dst  = freed[f].block;
+		moves[mcnt].from = kept[k].offset;
+		moves[mcnt].to   = freed[f].offset;
+	}
 
-		err = vhd_clobber_block(journal, b->block,
-					free_list[free_idx++].block);
+	for (i = 0; i < mcnt; i += VHD_RESIZE_BATCH) {
+		err = vhd_move_blocks(journal, moves + i,
+				      MIN(mcnt - i, VHD_RESIZE_BATCH));
 		if (err)
 			goto out;
 	}
 
-	/* clear any bat entries for blocks we did not shuffle */
-	for (i = free_idx; i < free_cnt; i++)
-		vhd->bat.bat[free_list[i].block] = DD_BLK_UNUSED;
+	TEST_FAIL_AT(FAIL_RESIZE_DATA_MOVED);
+
+	/* clear the bat entries of removed blocks nothing moved into */
+	for (; f < fcnt; f++)
+		vhd->bat.bat[freed[f].block] = DD_BLK_UNUSED;
 
 out:
-	free(blocks);
-	free(free_list);
+	free(kept);
+	free(freed);
+	free(moves);
 
 	return err;
 }
@@ -468,18 +586,12 @@ vhd_clear_bat_entries(vhd_journal_t *journal, uint32_t entries)
 static int
 vhd_dynamic_shrink(vhd_journal_t *journal, uint64_t secs)
 {
+	int err;
 	off64_t eof;
 	uint32_t blocks;
 	vhd_context_t *vhd;
-	int i, j, err, free_cnt;
-	struct vhd_block *free_list;
-
-	printf("dynamic shrink not fully implemented\n");
-	return -ENOSYS;
 
 	eof       = 0;
-	free_cnt  = 0;
-	free_list = NULL;
 	vhd       = &journal->vhd;
 
 	blocks    = secs_to_blocks_down(vhd, secs);
@@ -492,46 +604,24 @@ vhd_dynamic_shrink(vhd_journal_t *journal, uint64_t secs)
 			return err;
 	}
 
-	free_list = malloc(blocks * sizeof(struct vhd_block));
-	if (!free_list)
-		return -ENOMEM;
-
-	for (i = vhd->bat.entries - 1, j = 0; i >= 0 && j < blocks; i--, j++) {
-		uint32_t blk = vhd->bat.bat[i];
-
-		if (blk != DD_BLK_UNUSED) {
-			free_list[free_cnt].block  = i;
-			free_list[free_cnt].offset = blk;
-			free_cnt++;
-		}
-	}
-
-	if (free_cnt) {
-		err = vhd_defrag_shrink(journal, free_list, free_cnt);
-		if (err)
-			goto out;
-	}
+	err = vhd_defrag_shrink(journal, vhd->bat.entries - blocks);
+	if (err)
+		return err;
 
 	err = vhd_clear_bat_entries(journal, blocks);
 	if (err)
-		goto out;
+		return err;
 
 	/* remove data beyond footer */
 	err = vhd_end_of_data(vhd, &eof);
 	if (err)
-		goto out;
+		return err;
 
 	err = ftruncate(vhd->fd, eof + sizeof(vhd_footer_t));
-	if (err) {
-		err = -errno;
-		goto out;
-	}
-
-	err = 0;
+	if (err)
+		return -errno;
 
-out:
-	free(free_list);
-	return err;
+	return 0;
 }
 
 static inline void
@@ -653,7 +743,7 @@ vhd_check_for_clobber(vhd_context_t *vhd, off64_t off, int mode)
 		vhd_first_data_block(vhd, &fb);
 		if (fb.offset && in_range(off,
 					  vhd_sectors_to_bytes(fb.offset),
-					  VHD_BLOCK_SIZE)) {
+					  vhd_block_size(vhd))) {
 			msg = "data block";
 			goto fail;
 		}
@@ -1066,8 +1156,8 @@ vhd_dynamic_grow_fast(const char *name, uint64_t bytes)
 			goto done;
 	}
 
-	blks   = (bytes + VHD_BLOCK_SIZE - 1) >> VHD_BLOCK_SHIFT;
-	size   = blks << VHD_BLOCK_SHIFT;
+	blks   = (bytes + vhd_block_size(&vhd) - 1) / vhd_block_size(&vhd);
+	size   = blks * vhd_block_size(&vhd);
 	if (size < vhd.footer.curr_size) {
 		printf("%s: size (%"PRIu64") < curr size (%"PRIu64")\n", 
 		       name, size, vhd.footer.curr_size);
@@ -1150,6 +1240,19 @@ vhd_util_resize(int argc, char **argv)
 
 	TEST_FAIL_AT(FAIL_RESIZE_BEGIN);
 
+	if (vhd_data_shift(vhd)) {
+		printf("%s has an aligned layout, it resizes with -f only\n",
+		       name);
+		err = -EINVAL;
+		goto out;
+	}
+
+	if (vhd_compressed(vhd)) {
+		printf("%s is compressed and read-only\n", name);
+		err = -EROFS;
+		goto out;
+	}
+
 	if (vhd_type_dynamic(vhd))
 		err = vhd_dynamic_resize(&journal, size);
 	else
@@ -30,6 +30,7 @@
 #include <limits.h>
 #include <libgen.h>
 #include <syslog.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
@@ -50,6 +51,8 @@
 #define VHD_TYPE_RAW_VOLUME  0x04
 #define VHD_TYPE_VHD_VOLUME  0x08
 
+#define VHD_SCAN_THREADS     16
+
 #define EPRINTF(_f, _a...)					\
 	do {							\
 		syslog(LOG_INFO, "%s: " _f, __func__, ##_a);	\
@@ -100,6 +103,25 @@ struct vhd_image {
 	struct vhd_image    *parent_image;
 };
 
+/*
+ * one unit of work for the scan threads: the target is copied in so
+ * that image->target stays put while parents grow the iterator.
+ */
+struct vhd_scan_result {
+	struct target        target;
+	struct vhd_image     image;
+	uint8_t              parent_type;
+	int                  ret;
+	int                  err;
+};
+
+struct vhd_scan_pool {
+	pthread_mutex_t      lock;
+	int                  next;
+	int                  cnt;
+	struct vhd_scan_result *results;
+};
+
 struct vhd_scan {
 	int                  cur;
 	int                  size;
@@ -112,6 +134,7 @@ struct vhd_scan {
 };
 
 static int flags;
+static int threads;
 static struct vg vg;
 static struct vhd_scan scan;
 
@@ -942,100 +965,218 @@ iterator_free(struct iterator *itr)
 	memset(itr, 0, sizeof(*itr));
 }
 
+static uint8_t
+vhd_util_scan_parent_type(vhd_context_t *vhd, struct vhd_image *image)
+{
+	if (vhd_parent_raw(vhd))
+		return target_volume(image->target->type) ?
+			VHD_TYPE_RAW_VOLUME : VHD_TYPE_RAW_FILE;
+
+	return target_volume(image->target->type) ?
+		VHD_TYPE_VHD_VOLUME : VHD_TYPE_VHD_FILE;
+}
+
 static void
 vhd_util_scan_add_parent(struct iterator *itr,
-			 vhd_context_t *vhd, struct vhd_image *image)
+			 struct vhd_image *image, uint8_t type)
 {
 	int err;
-	uint8_t type;
-
-	if (vhd_parent_raw(vhd))
-		type = target_volume(image->target->type) ? 
-			VHD_TYPE_RAW_VOLUME : VHD_TYPE_RAW_FILE;
-	else
-		type = target_volume(image->target->type) ? 
-			VHD_TYPE_VHD_VOLUME : VHD_TYPE_VHD_FILE;
 
 	err = iterator_add(itr, image->parent, type);
 	if (err)
 		vhd_util_scan_error(image->parent, err);
 }
 
-static int
-vhd_util_scan_targets(int cnt, struct target *targets)
+/*
+ * reads everything printed for one target; runs on the scan threads,
+ * so it must not touch the iterator, the pretty list or stdout.
+ */
+static void
+vhd_util_scan_target(struct vhd_scan_result *res)
 {
 	int ret, err;
 	vhd_context_t vhd;
-	struct iterator itr;
-	struct target *target;
 	struct vhd_image image;
 
 	ret = 0;
-	err = 0;
 
-	err = iterator_init(&itr, cnt, targets);
-	if (err)
-		return err;
-
-	while ((target = iterator_next(&itr))) {
-		memset(&vhd, 0, sizeof(vhd));
-		memset(&image, 0, sizeof(image));
+	memset(&vhd, 0, sizeof(vhd));
+	memset(&image, 0, sizeof(image));
 
-		image.target = target;
+	image.target = &res->target;
 
-		err = vhd_util_scan_open(&vhd, &image);
-		if (err) {
-			ret = -EAGAIN;
-			goto end;
-		}
+	err = vhd_util_scan_open(&vhd, &image);
+	if (err) {
+		ret = -EAGAIN;
+		goto end;
+	}
 
 		err = vhd_util_scan_get_size(&vhd, &image);
+	if (err) {
+		ret           = -EAGAIN;
+		image.message = "getting physical size";
+		image.error   = err;
+		goto end;
+	}
+
+	err = vhd_util_scan_get_hidden(&vhd, &image);
+	if (err) {
+		ret           = -EAGAIN;
+		image.message = "checking 'hidden' field";
+		image.error   = err;
+		goto end;
+	}
+
+	if (flags & VHD_SCAN_MARKERS) {
+		err = vhd_util_scan_get_marker(&vhd, &image);
 		if (err) {
 			ret           = -EAGAIN;
-			image.message = "getting physical size";
+			image.message = "checking marker";
 			image.error   = err;
 			goto end;
 		}
+	}
 
-		err = vhd_util_scan_get_hidden(&vhd, &image);
+	if (vhd.footer.type == HD_TYPE_DIFF) {
+		err = vhd_util_scan_get_parent(&vhd, &image);
 		if (err) {
 			ret           = -EAGAIN;
-			image.message = "checking 'hidden' field";
+			image.message = "getting parent";
 			image.error   = err;
 			goto end;
 		}
+	}
 
-		if (flags & VHD_SCAN_MARKERS) {
-			err = vhd_util_scan_get_marker(&vhd, &image);
-			if (err) {
-				ret           = -EAGAIN;
-				image.message = "checking marker";
-				image.error   = err;
-				goto end;
-			}
+end:
+	if (image.parent)
+		res->parent_type = vhd_util_scan_parent_type(&vhd, &image);
+
+	if (vhd.file)
+		vhd_close(&vhd);
+
+	res->image = image;
+	res->ret   = ret;
+	res->err   = err;
+}
+
+static void *
+vhd_util_scan_worker(void *arg)
+{
+	int i;
+	struct vhd_scan_pool *pool;
+
+	pool = arg;
+
+	for (;;) {
+		pthread_mutex_lock(&pool->lock);
+		i = pool->next++;
+		pthread_mutex_unlock(&pool->lock);
+
+		if (i >= pool->cnt)
+			break;
+
+		vhd_util_scan_target(pool->results + i);
+	}
+
+	return NULL;
+}
+
+/*
+ * header reads are small and synchronous, so a scan of a large SR is
+ * bound by I/O latency; spread the targets over a few threads and let
+ * the caller print the results in order.
+ */
+static void
+vhd_util_scan_run(struct vhd_scan_result *results, int cnt)
+{
+	int i, n, err;
+	pthread_t tids[VHD_SCAN_THREADS];
+	struct vhd_scan_pool pool;
+
+	memset(&pool, 0, sizeof(pool));
+	pthread_mutex_init(&pool.lock, NULL);
+	pool.results = results;
+	pool.cnt     = cnt;
+
+	n = (threads < cnt ? threads : cnt) - 1;
+	for (i = 0; i < n; i++) {
+		err = pthread_create(&tids[i], NULL,
+				     vhd_util_scan_worker, &pool);
+		if (err) {
+			EPRINTF("creating scan thread failed: %d\n", err);
+			break;
 		}
+	}
+	n = i;
 
-		if (vhd.footer.type == HD_TYPE_DIFF) {
-			err = vhd_util_scan_get_parent(&vhd, &image);
-			if (err) {
-				ret           = -EAGAIN;
-				image.message = "getting parent";
-				image.error   = err;
-				goto end;
-			}
+	vhd_util_scan_worker(&pool);
+
+	for (i = 0; i < n; i++)
+		pthread_join(tids[i], NULL);
+
+	pthread_mutex_destroy(&pool.lock);
+}
+
+static void
+vhd_util_scan_free_result(struct vhd_scan_result *res)
+{
+	if (res->image.name != res->target.name)
+		free(res->image.name);
+	free(res->image.parent);
+}
+
+static int
+vhd_util_scan_targets(int cnt, struct target *targets)
+{
+	int i, n, ret, err;
+	struct iterator itr;
+	struct target *target;
+	struct vhd_scan_result *res, *results;
+
+	ret = 0;
+	err = 0;
+
+	err = iterator_init(&itr, cnt, targets);
+	if (err)
+		return err;
+
+	/*
+	 * scan whatever the iterator holds in one pass; parents found
+	 * along the way are appended and picked up by the next pass.
+	 */
+	while (itr.cur < itr.cur_size) {
+		n       = itr.cur_size - itr.cur;
+		results = calloc(n, sizeof(struct vhd_scan_result));
+		if (!results) {
+			err = -ENOMEM;
+			break;
 		}
 
-	end:
-		vhd_util_scan_print_image(&image);
+		for (i = 0; (target = iterator_next(&itr)); i++)
+			memcpy(&results[i].target, target, sizeof(*target));
+
+		vhd_util_scan_run(results, n);
+
+		for (i = 0; i < n; i++) {
+			res = results + i;
 
-		if (flags & VHD_SCAN_PARENTS && image.parent)
-			vhd_util_scan_add_parent(&itr, &vhd, &image);
+			vhd_util_scan_print_image(&res->image);
 
-		if (vhd.file)
-			vhd_close(&vhd);
-		if (image.name != target->name)
-			free(image.name);
-		free(image.parent);
+			if (flags & VHD_SCAN_PARENTS && res->image.parent)
+				vhd_util_scan_add_parent(&itr, &res->image,
+							 res->parent_type);
+
+			if (res->ret)
+				ret = res->ret;
+
+			err = res->err;
+			if (err && !(flags & VHD_SCAN_NOFAIL))
+				break;
+		}
+
+		for (i = 0; i < n; i++)
+			vhd_util_scan_free_result(results + i);
+		free(results);
 
 		if (err && !(flags & VHD_SCAN_NOFAIL))
 			break;
@@ -1286,12 +1427,13 @@ vhd_util_scan(int argc, char **argv)
 	cnt     = 0;
 	err     = 0;
 	flags   = 0;
+	threads = VHD_SCAN_THREADS;
 	filter  = NULL;
 	volume  = NULL;
 	targets = NULL;
 
 	optind = 0;
-	while ((c = getopt(argc, argv, "m:fcl:pavMh")) != -1) {
+	while ((c = getopt(argc, argv, "m:fcl:pavMj:h")) != -1) {
 		switch (c) {
 		case 'm':
 			filter = optarg;
@@ -1318,6 +1460,13 @@ vhd_util_scan(int argc, char **argv)
 		case 'M':
 			flags |= VHD_SCAN_MARKERS;
 			break;
+		case 'j':
+			threads = strtol(optarg, NULL, 10);
+			if (threads < 1 || threads > VHD_SCAN_THREADS) {
+				err = -EINVAL;
+				goto usage;
+			}
+			break;
 		case 'h':
 			goto usage;
 		default:
@@ -1358,6 +1507,7 @@ usage:
 	printf("usage: [OPTIONS] FILES\n"
 	       "options: [-m match filter] [-f fast] [-c continue on failure] "
 	       "[-l LVM volume] [-p pretty print] [-a scan parents] "
-	       "[-v verbose] [-h help] [-M show markers]\n");
+	       "[-v verbose] [-h help] [-M show markers] "
+	       "[-j threads (1-%d)]\n", VHD_SCAN_THREADS);
 	return err;
 }
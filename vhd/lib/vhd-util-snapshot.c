@@ -81,6 +81,23 @@ out:
 	return err;
 }
 
+/* the first partition of the guest, as the parent chain has it */
+static int
+vhd_util_guess_align(const char *name, uint64_t *align)
+{
+	int err;
+	vhd_context_t vhd;
+
+	err = vhd_open(&vhd, name, VHD_OPEN_RDONLY);
+	if (err)
+		return err;
+
+	err = vhd_first_partition(&vhd, align);
+	vhd_close(&vhd);
+
+	return err;
+}
+
 static int
 vhd_util_check_depth(const char *name, int *depth)
 {
@@ -101,10 +118,10 @@ int
 vhd_util_snapshot(int argc, char **argv)
 {
 	vhd_flag_creat_t flags;
-	int c, err, prt_raw, limit, empty_check;
+	int c, err, prt_raw, limit, empty_check, aligned;
 	char *name, *pname, *backing;
 	char *ppath, __ppath[PATH_MAX];
-	uint64_t size, msize;
+	uint64_t size, msize, bsize, align;
 	vhd_context_t vhd;
 
 	name        = NULL;
@@ -113,9 +130,12 @@ vhd_util_snapshot(int argc, char **argv)
 	backing     = NULL;
 	size        = 0;
 	msize       = 0;
+	bsize       = 0;
 	flags       = 0;
 	limit       = 0;
 	empty_check = 1;
+	align       = 0;
+	aligned     = 0;
 
 	if (!argc || !argv) {
 		err = -EINVAL;
@@ -123,7 +143,7 @@ vhd_util_snapshot(int argc, char **argv)
 	}
 
 	optind = 0;
-	while ((c = getopt(argc, argv, "n:p:S:l:meh")) != -1) {
+	while ((c = getopt(argc, argv, "n:p:S:l:b:A:ameh")) != -1) {
 
 		switch (c) {
 		case 'n':
@@ -137,12 +157,22 @@ vhd_util_snapshot(int argc, char **argv)
 		case 'l':
 			limit = strtol(optarg, NULL, 10);
 			break;
+		case 'b':
+			bsize = strtoull(optarg, NULL, 10);
+			break;
 		case 'm':
 			vhd_flag_set(flags, VHD_FLAG_CREAT_PARENT_RAW);
 			break;
 		case 'e':
 			empty_check = 0;
 			break;
+		case 'A':
+			align   = strtoull(optarg, NULL, 10);
+			aligned = 1;
+			break;
+		case 'a':
+			aligned = -1;
+			break;
 		case 'h':
 			err = 0;
 			goto usage;
@@ -157,6 +187,12 @@ vhd_util_snapshot(int argc, char **argv)
 		goto usage;
 	}
 
+	if (bsize && vhd_flag_set_block_size(&flags, bsize << 20)) {
+		printf("Error: <-b block size> must be a power of two "
+		       "from 2 to 64\n");
+		return -EINVAL;
+	}
+
 	ppath = realpath(pname, __ppath);
 	if (!ppath)
 		return -errno;
@@ -206,7 +242,25 @@ vhd_util_snapshot(int argc, char **argv)
 			goto out;
 	}
 
-	err = vhd_snapshot(name, size, backing, msize << 20, flags);
+	if (aligned < 0) {
+		if (vhd_flag_test(flags, VHD_FLAG_CREAT_PARENT_RAW)) {
+			printf("Error: <-a> needs a VHD parent\n");
+			err = -EINVAL;
+			goto out;
+		}
+
+		err = vhd_util_guess_align(backing, &align);
+		if (err) {
+			printf("error finding the first partition: %d\n", err);
+			goto out;
+		}
+	}
+
+	if (aligned)
+		err = vhd_snapshot_aligned(name, size, backing, msize << 20,
+					   flags, align);
+	else
+		err = vhd_snapshot(name, size, backing, msize << 20, flags);
 
 out:
 	free(backing);
@@ -217,6 +271,9 @@ usage:
 	printf("options: <-n name> <-p parent name> [-l snapshot depth limit]"
 	       " [-m parent_is_raw] [-S size (MB) for metadata preallocation "
 	       "(see vhd-util resize)] [-e link to supplied parent name even "
-	       "if it's empty] [-h help]\n");
+	       "if it's empty] [-b block size (MB), default: the parent's] "
+	       "[-A sector to start a block, default: the parent's layout] "
+	       "[-a align to the first partition of the parent] "
+	       "[-h help]\n");
 	return err;
 }
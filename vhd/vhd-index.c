@@ -26,16 +26,19 @@
 #include <unistd.h>
 #include <string.h>
 #include <limits.h>
+#include <pthread.h>
 
 #include "libvhd.h"
 #include "libvhd-index.h"
 
+#define VHD_INDEX_THREADS 8
+
 static void
 usage(void)
 {
 	printf("usage: vhd-index <command>\n"
 	       "commands:\n"
-	       "\t   index: <-i index name> <-v vhd file>\n"
+	       "\t   index: <-i index name> <-v vhd file> [-j threads]\n"
 	       "\t summary: <-s index name> [-v vhd file [-b block]]\n");
 	exit(-EINVAL);
 }
@@ -175,208 +178,344 @@ vhd_index_get_block(vhdi_context_t *vhdi, vhd_context_t *vhd,
 	return 0;
 }
 
+/*
+ * a chain being indexed, leaf first.  each layer's bat is read by a
+ * thread of its own; blocks are then indexed by a pool of threads,
+ * which read bitmaps with pread and take the lock for the index file.
+ */
+struct vhd_index_layer {
+	vhd_context_t                 vhd;
+	vhdi_file_id_t                fid;
+	int                           err;
+	pthread_t                     thread;
+};
+
+struct vhd_index_pool {
+	vhdi_context_t               *vhdi;
+	vhdi_bat_t                   *bat;
+	struct vhd_index_layer       *layers;
+	int                           nr_layers;
+
+	pthread_mutex_t               lock;
+	uint32_t                      next;
+	int                           err;
+};
+
+static int threads = VHD_INDEX_THREADS;
+
+static void
+vhd_index_close_chain(struct vhd_index_layer *layers, int nr_layers)
+{
+	int i;
+
+	for (i = 0; i < nr_layers; i++)
+		vhd_close(&layers[i].vhd);
+
+	free(layers);
+}
+
+/* open @file and, up to @max layers, the parents it names */
 static int
-vhd_index_add_bat_entry(vhdi_name_t *name, vhdi_context_t *vhdi,
-			vhdi_bat_t *bat, vhdi_file_table_t *files,
-			vhd_context_t *vhd, uint32_t block, char *finished)
+vhd_index_open_chain(const char *file, int max,
+		     struct vhd_index_layer **_layers, int *_nr_layers)
 {
-	char *map;
-	vhdi_file_id_t fid;
-	uint32_t i, count, off;
-	vhdi_block_t vhdi_block;
-	int err, update, append;
+	int err, n;
+	char *path, *parent;
+	vhd_context_t *vhd;
+	struct vhd_index_layer *layers, *tmp;
 
-	fid    = 0;
-	count  = 0;
-	update = 0;
-	append = (bat->table[block] == 0);
+	n      = 0;
+	layers = NULL;
+	parent = NULL;
 
-	if (vhd->bat.bat[block] == DD_BLK_UNUSED)
-		return 0;
+	path = strdup(file);
+	if (!path)
+		return -ENOMEM;
 
-	err = vhd_index_get_block(vhdi, vhd, bat->table[block], &vhdi_block);
-	if (err)
-		return err;
+	for (;;) {
+		tmp = realloc(layers, (n + 1) * sizeof(struct vhd_index_layer));
+		if (!tmp) {
+			err = -ENOMEM;
+			goto fail;
+		}
 
-	err = vhd_read_bitmap(vhd, block, &map);
-	if (err)
-		goto out;
+		layers = tmp;
+		vhd    = &layers[n].vhd;
+		memset(layers + n, 0, sizeof(struct vhd_index_layer));
 
-	err = vhd_index_get_file_id(name, vhd->file, files, &fid);
-	if (err)
-		goto out;
+		err = vhd_open(vhd, path, VHD_OPEN_RDONLY);
+		if (err)
+			goto fail;
+		n++;
 
-	for (i = 0; i < vhd->spb; i++) {
-		if (vhdi_block.table[i].file_id) {
-			count++;
-			continue;
+		if (!vhd_type_dynamic(vhd)) {
+			err = -EINVAL;
+			goto fail;
 		}
 
-		if (!vhd_bitmap_test(vhd, map, i))
-			continue;
+		if (n == max || vhd->footer.type != HD_TYPE_DIFF)
+			break;
 
-		err = vhd_offset(vhd, (uint64_t)block * vhd->spb + i, &off);
+		err = vhd_parent_locator_get(vhd, &parent);
 		if (err)
-			goto out;
+			goto fail;
 
-		vhdi_block.table[i].file_id = fid;
-		vhdi_block.table[i].offset  = off;
-		count++;
-		update++;
+		free(path);
+		path   = parent;
+		parent = NULL;
 	}
 
-	if (update) {
-		if (append) {
-			uint32_t location;
-
-			err = vhdi_append_block(vhdi, &vhdi_block, &location);
-			if (err)
-				goto out;
-
-			bat->table[block] = location;
-		} else {
-			err = vhdi_write_block(vhdi, &vhdi_block,
-					       bat->table[block]);
-			if (err)
-				goto out;
+	free(path);
+	*_layers    = layers;
+	*_nr_layers = n;
+	return 0;
+
+fail:
+	free(path);
+	vhd_index_close_chain(layers, n);
+	return err;
+}
+
+static void *
+vhd_index_bat_thread(void *arg)
+{
+	struct vhd_index_layer *layer = arg;
+
+	layer->err = vhd_get_bat(&layer->vhd);
+	return NULL;
+}
+
+static int
+vhd_index_load_bats(struct vhd_index_layer *layers, int nr_layers)
+{
+	int i, err;
+
+	for (i = 0; i < nr_layers; i++) {
+		err = pthread_create(&layers[i].thread, NULL,
+				     vhd_index_bat_thread, layers + i);
+		if (err) {
+			layers[i].err = vhd_get_bat(&layers[i].vhd);
+			layers[i].thread = 0;
 		}
 	}
 
-	if (count == vhd->spb)
-		*finished = 1;
-
 	err = 0;
-
-out:
-	free(vhdi_block.table);
-	free(map);
+	for (i = 0; i < nr_layers; i++) {
+		if (layers[i].thread)
+			pthread_join(layers[i].thread, NULL);
+		if (layers[i].err && !err)
+			err = layers[i].err;
+	}
 
 	return err;
 }
 
 static int
-vhd_index_clone_bat_entry(vhdi_name_t *name, vhdi_context_t *vhdi,
-			  vhdi_bat_t *bat, vhdi_file_table_t *files,
-			  vhd_context_t *vhd, uint32_t block)
+vhd_index_read_bitmap(vhd_context_t *vhd, uint32_t block, char *map)
+{
+	ssize_t ret;
+	size_t size;
+	off64_t off;
+
+	size = vhd_sectors_to_bytes(vhd->bm_secs);
+	off  = vhd_sectors_to_bytes(vhd->bat.bat[block]);
+
+	errno = 0;
+	ret   = pread(vhd->fd, map, size, off);
+	if (ret != size)
+		return (errno ? -errno : -EIO);
+
+	return 0;
+}
+
+/*
+ * point each sector of @block at the first layer holding it.  sectors
+ * no layer holds keep the entries of the block's current index table,
+ * so applying the leaf alone to a parent's bat gives the leaf's index.
+ * index tables are never rewritten in place: other bats may share them.
+ */
+static int
+vhd_index_block(struct vhd_index_pool *pool, uint32_t block,
+		char *map, char *claimed)
 {
-	char *map;
-	int err, update;
-	uint32_t i, off;
-	vhdi_file_id_t fid;
+	int i, err;
+	vhd_context_t *vhd;
 	vhdi_block_t vhdi_block;
+	uint32_t s, spb, off, location, left, update;
 
-	fid    = 0;
-	update = 0;
+	vhd    = &pool->layers[0].vhd;
+	spb    = vhd->spb;
 
-	if (vhd->bat.bat[block] == DD_BLK_UNUSED)
+	for (i = 0; i < pool->nr_layers; i++) {
+		vhd = &pool->layers[i].vhd;
+		if (block < vhd->bat.entries &&
+		    vhd->bat.bat[block] != DD_BLK_UNUSED)
+			break;
+	}
+
+	if (i == pool->nr_layers)
 		return 0;
 
-	err = vhd_index_get_block(vhdi, vhd, bat->table[block], &vhdi_block);
+	pthread_mutex_lock(&pool->lock);
+	err = vhd_index_get_block(pool->vhdi, vhd,
+				  pool->bat->table[block], &vhdi_block);
+	pthread_mutex_unlock(&pool->lock);
 	if (err)
 		return err;
 
-	err = vhd_read_bitmap(vhd, block, &map);
-	if (err)
-		goto out;
+	left   = spb;
+	update = 0;
+	memset(claimed, 0, (spb + 7) >> 3);
 
-	err = vhd_index_get_file_id(name, vhd->file, files, &fid);
-	if (err)
-		goto out;
+	for (; i < pool->nr_layers && left; i++) {
+		vhd = &pool->layers[i].vhd;
 
-	for (i = 0; i < vhd->spb; i++) {
-		if (!vhd_bitmap_test(vhd, map, i))
+		if (block >= vhd->bat.entries ||
+		    vhd->bat.bat[block] == DD_BLK_UNUSED)
 			continue;
 
-		err = vhd_offset(vhd, (uint64_t)block * vhd->spb + i, &off);
+		err = vhd_index_read_bitmap(vhd, block, map);
 		if (err)
 			goto out;
 
-		vhdi_block.table[i].file_id = fid;
-		vhdi_block.table[i].offset  = off;
-		update++;
-	}
+		for (s = 0; s < spb; s++) {
+			if (test_bit(claimed, s) || !vhd_bitmap_test(vhd, map, s))
+				continue;
 
-	if (update) {
-		uint32_t location;
+			set_bit(claimed, s);
+			left--;
 
-		err = vhdi_append_block(vhdi, &vhdi_block, &location);
-		if (err)
-			goto out;
+			off = vhd->bat.bat[block] + vhd->bm_secs + s;
+			if (vhdi_block.table[s].file_id == pool->layers[i].fid &&
+			    vhdi_block.table[s].offset  == off)
+				continue;
 
-		bat->table[block] = location;
+			vhdi_block.table[s].file_id = pool->layers[i].fid;
+			vhdi_block.table[s].offset  = off;
+			update++;
+		}
 	}
 
 	err = 0;
+	if (update) {
+		pthread_mutex_lock(&pool->lock);
+		err = vhdi_append_block(pool->vhdi, &vhdi_block, &location);
+		pthread_mutex_unlock(&pool->lock);
+
+		if (!err)
+			pool->bat->table[block] = location;
+	}
 
 out:
 	free(vhdi_block.table);
-	free(map);
-
 	return err;
 }
 
-static int
-vhd_index_update_bat_entry(vhdi_name_t *name, vhdi_context_t *vhdi,
-			   vhdi_bat_t *bat, vhdi_file_table_t *files,
-			   vhd_context_t *vhd, uint32_t block)
+static void *
+vhd_index_worker(void *arg)
 {
-	char *map;
-	int err, update;
-	uint32_t i, off;
-	vhdi_file_id_t fid;
-	vhdi_block_t vhdi_block;
+	int err;
+	uint32_t block;
+	char *map, *claimed;
+	struct vhd_index_pool *pool = arg;
+	vhd_context_t *vhd = &pool->layers[0].vhd;
+
+	map     = NULL;
+	claimed = malloc((vhd->spb + 7) >> 3);
+	err     = posix_memalign((void **)&map, VHD_SECTOR_SIZE,
+				 vhd_sectors_to_bytes(vhd->bm_secs));
+	if (err || !claimed) {
+		err = -ENOMEM;
+		goto out;
+	}
 
-	fid    = 0;
-	update = 0;
+	for (;;) {
+		pthread_mutex_lock(&pool->lock);
+		block = pool->next++;
+		err   = pool->err;
+		pthread_mutex_unlock(&pool->lock);
 
-	if (vhd->bat.bat[block] == DD_BLK_UNUSED)
-		return 0;
+		if (err || block >= pool->bat->vhd_blocks)
+			break;
 
-	err = vhd_index_get_block(vhdi, vhd, bat->table[block], &vhdi_block);
-	if (err)
-		return err;
+		err = vhd_index_block(pool, block, map, claimed);
+		if (err)
+			break;
+	}
 
-	err = vhd_read_bitmap(vhd, block, &map);
-	if (err)
-		goto out;
+out:
+	if (err) {
+		pthread_mutex_lock(&pool->lock);
+		if (!pool->err)
+			pool->err = err;
+		pthread_mutex_unlock(&pool->lock);
+	}
 
-	err = vhd_index_get_file_id(name, vhd->file, files, &fid);
-	if (err)
-		goto out;
+	free(map);
+	free(claimed);
+	return NULL;
+}
 
-	for (i = 0; i < vhd->spb; i++) {
-		if (!vhd_bitmap_test(vhd, map, i))
-			continue;
+/* index the blocks of @layers into @bat */
+static int
+vhd_index_build(vhdi_name_t *name, vhdi_context_t *vhdi, vhdi_bat_t *bat,
+		vhdi_file_table_t *files,
+		struct vhd_index_layer *layers, int nr_layers)
+{
+	pthread_t *tids;
+	int i, n, err;
+	struct vhd_index_pool pool;
 
-		err = vhd_offset(vhd, (uint64_t)block * vhd->spb + i, &off);
+	for (i = 0; i < nr_layers; i++) {
+		if (layers[i].vhd.spb != layers[0].vhd.spb)
+			return -EINVAL;
+
+		err = vhd_index_get_file_id(name, layers[i].vhd.file,
+					    files, &layers[i].fid);
 		if (err)
-			goto out;
+			return err;
+	}
 
-		if (vhdi_block.table[i].file_id == fid &&
-		    vhdi_block.table[i].offset  == off)
-			continue;
+	err = vhd_index_load_bats(layers, nr_layers);
+	if (err)
+		return err;
+
+	memset(&pool, 0, sizeof(pool));
+	pool.vhdi      = vhdi;
+	pool.bat       = bat;
+	pool.layers    = layers;
+	pool.nr_layers = nr_layers;
+	pthread_mutex_init(&pool.lock, NULL);
 
-		vhdi_block.table[i].file_id = fid;
-		vhdi_block.table[i].offset  = off;
-		update++;
+	n    = MAX(MIN(threads, bat->vhd_blocks), 1);
+	tids = calloc(n, sizeof(pthread_t));
+	if (!tids) {
+		err = -ENOMEM;
+		goto out;
 	}
 
-	if (update) {
-		uint32_t location;
+	for (i = 0; i < n; i++) {
+		err = pthread_create(tids + i, NULL, vhd_index_worker, &pool);
+		if (err) {
+			err = -err;
+			break;
+		}
+	}
 
-		err = vhdi_append_block(vhdi, &vhdi_block, &location);
-		if (err)
-			goto out;
+	if (!i)
+		vhd_index_worker(&pool);
 
-		bat->table[block] = location;
-	}
+	while (i--)
+		pthread_join(tids[i], NULL);
 
-	err = 0;
+	if (!pool.err)
+		err = 0;
+	else
+		err = pool.err;
 
+	free(tids);
 out:
-	free(vhdi_block.table);
-	free(map);
-
+	pthread_mutex_destroy(&pool.lock);
 	return err;
 }
 
@@ -384,19 +523,17 @@ static int
 vhd_index_add_bat(vhdi_name_t *name,
 		  uint64_t vhd_blocks, uint32_t vhd_block_size)
 {
-	int err;
+	int err, nr_layers;
 	vhdi_bat_t bat;
-	vhd_context_t vhd;
 	vhdi_context_t vhdi;
 	vhdi_file_table_t files;
-	char *vhd_file, *finished;
-	uint32_t block, remaining;
+	struct vhd_index_layer *layers;
 
 	memset(&bat, 0, sizeof(vhdi_bat_t));
 	memset(&files, 0, sizeof(vhdi_file_table_t));
 
-	vhd_file           = NULL;
-	finished           = NULL;
+	layers             = NULL;
+	nr_layers          = 0;
 	bat.vhd_blocks     = vhd_blocks;
 	bat.vhd_block_size = vhd_block_size;
 
@@ -424,60 +561,13 @@ vhd_index_add_bat(vhdi_name_t *name,
 		goto out;
 	}
 
-	vhd_file = strdup(name->vhd);
-	if (!vhd_file)
+	err = vhd_index_open_chain(name->vhd, INT_MAX, &layers, &nr_layers);
+	if (err)
 		goto out;
 
-	remaining = vhd_blocks;
-	finished  = calloc(remaining, sizeof(char));
-	if (!finished) {
-		err = -ENOMEM;
+	err = vhd_index_build(name, &vhdi, &bat, &files, layers, nr_layers);
+	if (err)
 		goto out;
-	}
-
-	for (;;) {
-		err = vhd_open(&vhd, vhd_file, VHD_OPEN_RDONLY);
-		if (err)
-			goto out;
-
-		err = vhd_get_bat(&vhd);
-		if (err)
-			goto out_vhd;
-
-		for (block = 0; block < vhd.bat.entries; block++) {
-			if (finished[block])
-				continue;
-
-			err = vhd_index_add_bat_entry(name, &vhdi, &bat,
-						      &files, &vhd, block,
-						      &finished[block]);
-			if (err)
-				goto out_bat;
-
-			if (finished[block])
-				remaining--;
-		}
-
-		free(vhd_file);
-		vhd_file = NULL;
-
-		if (!remaining || vhd.footer.type != HD_TYPE_DIFF) {
-			vhd_put_bat(&vhd);
-			vhd_close(&vhd);
-			break;
-		}
-
-		err = vhd_parent_locator_get(&vhd, &vhd_file);
-		if (err)
-			goto out_bat;
-
-	out_bat:
-		vhd_put_bat(&vhd);
-	out_vhd:
-		vhd_close(&vhd);
-		if (err)
-			goto out;
-	} 
 
 	err = vhdi_bat_write(name->bat, &bat);
 	if (err)
@@ -489,23 +579,44 @@ out:
 	if (err)
 		unlink(name->bat);
 
+	if (layers)
+		vhd_index_close_chain(layers, nr_layers);
 	vhdi_file_table_free(&files);
 	vhdi_close(&vhdi);
 	free(bat.table);
-	free(finished);
-	free(vhd_file);
 
 	return err;
 }
 
+/*
+ * apply the leaf's allocated blocks to @bat, which is the leaf's own
+ * bat or a copy of its parent's, and write the result as the leaf's
+ */
+static int
+vhd_index_apply_leaf(vhdi_name_t *name, vhdi_context_t *vhdi,
+		     vhdi_bat_t *bat, vhdi_file_table_t *files)
+{
+	int err, nr_layers;
+	struct vhd_index_layer *layers;
+
+	err = vhd_index_open_chain(name->vhd, 1, &layers, &nr_layers);
+	if (err)
+		return err;
+
+	err = vhd_index_build(name, vhdi, bat, files, layers, nr_layers);
+	if (!err)
+		err = vhdi_bat_write(name->bat, bat);
+
+	vhd_index_close_chain(layers, nr_layers);
+	return err;
+}
+
 static int
 vhd_index_clone_bat(vhdi_name_t *name, const char *parent)
 {
 	int err;
 	char *pbat;
-	uint32_t block;
 	vhdi_bat_t bat;
-	vhd_context_t vhd;
 	vhdi_context_t vhdi;
 	vhdi_file_table_t files;
 
@@ -542,31 +653,8 @@ vhd_index_clone_bat(vhdi_name_t *name, const char *parent)
 	if (err)
 		goto out_ft;
 
-	err = vhd_open(&vhd, name->vhd, VHD_OPEN_RDONLY);
-	if (err)
-		goto out_ft;
+	err = vhd_index_apply_leaf(name, &vhdi, &bat, &files);
 
-	err = vhd_get_bat(&vhd);
-	if (err)
-		goto out_vhd;
-
-	for (block = 0; block < vhd.bat.entries; block++) {
-		err = vhd_index_clone_bat_entry(name, &vhdi, &bat,
-						&files, &vhd, block);
-		if (err)
-			goto out_bat;
-	}
-
-	err = vhdi_bat_write(name->bat, &bat);
-	if (err)
-		goto out_bat;
-
-	err = 0;
-
-out_bat:
-	vhd_put_bat(&vhd);
-out_vhd:
-	vhd_close(&vhd);
 out_ft:
 	vhdi_file_table_free(&files);
 out_vhdi:
@@ -583,9 +671,7 @@ static int
 vhd_index_update_bat(vhdi_name_t *name)
 {
 	int err;
-	uint32_t block;
 	vhdi_bat_t bat;
-	vhd_context_t vhd;
 	vhdi_context_t vhdi;
 	vhdi_file_table_t files;
 
@@ -608,32 +694,8 @@ vhd_index_update_bat(vhdi_name_t *name)
 	if (err)
 		goto out_vhdi;
 
-	err = vhd_open(&vhd, name->vhd, VHD_OPEN_RDONLY);
-	if (err)
-		goto out_ft;
+	err = vhd_index_apply_leaf(name, &vhdi, &bat, &files);
 
-	err = vhd_get_bat(&vhd);
-	if (err)
-		goto out_vhd;
-
-	for (block = 0; block < vhd.bat.entries; block++) {
-		err = vhd_index_update_bat_entry(name, &vhdi, &bat,
-						 &files, &vhd, block);
-		if (err)
-			goto out_bat;
-	}
-
-	err = vhdi_bat_write(name->bat, &bat);
-	if (err)
-		goto out_bat;
-
-	err = 0;
-
-out_bat:
-	vhd_put_bat(&vhd);
-out_vhd:
-	vhd_close(&vhd);
-out_ft:
 	vhdi_file_table_free(&files);
 out_vhdi:
 	vhdi_close(&vhdi);
@@ -946,7 +1008,7 @@ main(int argc, char *argv[])
 	update  = 0;
 	summary = 0;
 
-	while ((c = getopt(argc, argv, "i:v:s:b:h")) != -1) {
+	while ((c = getopt(argc, argv, "i:v:s:b:j:h")) != -1) {
 		switch (c) {
 		case 'i':
 			index   = optarg;
@@ -966,6 +1028,12 @@ main(int argc, char *argv[])
 			block   = strtoul(optarg, NULL, 10);
 			break;
 
+		case 'j':
+			threads = atoi(optarg);
+			if (threads <= 0)
+				usage();
+			break;
+
 		default:
 			usage();
 		}
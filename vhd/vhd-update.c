@@ -22,6 +22,12 @@
  *                            its corresponding bitmap in the original file)
  * Updates are performed in place by writing appropriately 
  * transformed versions of journaled bitmaps to the original file.
+ * Bitmaps are journaled a chunk at a time, with one sync per chunk, and
+ * the data blocks themselves are never read or written. Images which
+ * lack a batmap get one built from the same pass over the bitmaps.
+ *
+ * Several images may be updated at once (-p), within one I/O budget
+ * shared between them (-B).
  */
 
 #ifdef HAVE_CONFIG_H
@@ -35,17 +41,63 @@
 #include <unistd.h>
 #include <endian.h>
 #include <byteswap.h>
+#include <pthread.h>
+#include <sys/time.h>
 
 #include "libvhd.h"
 #include "libvhd-journal.h"
 
+/* bitmaps read, journaled and rewritten at a time */
+#define UPDATE_CHUNK 256
+
 static void
 usage(void)
 {
-	printf("usage: vhd-update <-n name> [-j existing journal] [-h]\n");
+	printf("usage: vhd-update <-n name> [-n name ...] [-j existing journal] "
+	       "[-p images in parallel] [-B I/O budget, MiB/s] [-h]\n");
 	exit(EINVAL);
 }
 
+/*
+ * all images being updated share one budget, so that upgrading a
+ * whole SR does not starve the VMs running on it
+ */
+static struct {
+	pthread_mutex_t  lock;
+	uint64_t         rate;      /* bytes/s, 0 for no limit */
+	uint64_t         bytes;
+	struct timeval   start;
+} budget = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static void
+update_throttle(uint64_t bytes)
+{
+	struct timeval now;
+	uint64_t due, elapsed;
+
+	if (!budget.rate)
+		return;
+
+	pthread_mutex_lock(&budget.lock);
+	budget.bytes += bytes;
+	due = budget.bytes * 1000000ULL / budget.rate;
+	pthread_mutex_unlock(&budget.lock);
+
+	gettimeofday(&now, NULL);
+	elapsed = (now.tv_sec - budget.start.tv_sec) * 1000000ULL +
+		now.tv_usec - budget.start.tv_usec;
+
+	if (due > elapsed)
+		usleep(due - elapsed);
+}
+
+struct update_job {
+	const char      *file;
+	const char      *jfile;
+	int              rollback;
+	int              err;
+};
+
 /*
  * update vhd creator version to reflect its new bitmap ordering
  */
@@ -56,20 +108,6 @@ update_creator_version(vhd_journal_t *journal)
 	return vhd_write_footer(&journal->vhd, &journal->vhd.footer);
 }
 
-static int
-journal_bitmaps(vhd_journal_t *journal)
-{
-	int i, err;
-
-	for (i = 0; i < journal->vhd.bat.entries; i++) {
-		err = vhd_journal_add_block(journal, i, VHD_JOURNAL_METADATA);
-		if (err)
-			return err;
-	}
-
-	return 0;
-}
-
 /*
  * older VHD bitmaps were little endian
  * and bits within a word were set from right to left
@@ -104,50 +142,233 @@ convert_bitmap(char *in, char *out, int bytes)
 			new_set_bit(i, out);
 }
 
+struct update_block {
+	uint32_t                 blk;
+	uint32_t                 off;
+};
+
+static int
+update_block_compare(const void *a, const void *b)
+{
+	const struct update_block *x = a, *y = b;
+
+	return (x->off > y->off) - (x->off < y->off);
+}
+
+/*
+ * allocated blocks in the order they sit in the file, so that the
+ * bitmap pass is one forward sweep rather than a seek per block
+ */
+static int
+update_sorted_blocks(vhd_context_t *vhd, struct update_block **blocksp,
+		     int *cntp)
+{
+	int i, cnt;
+	struct update_block *blocks;
+
+	blocks = calloc(vhd->bat.entries ? : 1, sizeof(*blocks));
+	if (!blocks)
+		return -ENOMEM;
+
+	for (cnt = 0, i = 0; i < vhd->bat.entries; i++) {
+		if (vhd->bat.bat[i] == DD_BLK_UNUSED)
+			continue;
+
+		blocks[cnt].blk = i;
+		blocks[cnt].off = vhd->bat.bat[i];
+		cnt++;
+	}
+
+	qsort(blocks, cnt, sizeof(*blocks), update_block_compare);
+
+	*blocksp = blocks;
+	*cntp    = cnt;
+	return 0;
+}
+
+/*
+ * images updated from 0.1 get a batmap, laid out as vhd_create() would,
+ * if the space after the BAT holds nothing else
+ */
 static int
-update_vhd(vhd_journal_t *journal, int rollback)
+init_batmap(vhd_context_t *vhd, vhd_batmap_t *batmap)
 {
-	int i, err;
+	int i, n, err;
+	off64_t off, end, limit;
+	vhd_parent_locator_t *loc;
+	void *map;
+
+	memset(batmap, 0, sizeof(*batmap));
+	memcpy(batmap->header.cookie, VHD_BATMAP_COOKIE,
+	       sizeof(batmap->header.cookie));
+
+	err = vhd_batmap_header_offset(vhd, &off);
+	if (err)
+		return err;
+
+	batmap->header.batmap_offset  = off +
+		vhd_bytes_padded(sizeof(vhd_batmap_header_t));
+	batmap->header.batmap_size    =
+		secs_round_up_no_zero((vhd->header.max_bat_size + 7) >> 3);
+	batmap->header.batmap_version = VHD_BATMAP_CURRENT_VERSION;
+
+	end = batmap->header.batmap_offset +
+		vhd_sectors_to_bytes(batmap->header.batmap_size);
+
+	err = vhd_seek(vhd, 0, SEEK_END);
+	if (err)
+		return err;
+
+	limit = vhd_position(vhd);
+	if (limit == (off64_t)-1)
+		return -errno;
+	limit -= sizeof(vhd_footer_t);
+
+	for (i = 0; i < vhd->bat.entries; i++)
+		if (vhd->bat.bat[i] != DD_BLK_UNUSED)
+			limit = MIN(limit, vhd_sectors_to_bytes(vhd->bat.bat[i]));
+
+	n = sizeof(vhd->header.loc) / sizeof(vhd_parent_locator_t);
+	for (i = 0; i < n; i++) {
+		loc = &vhd->header.loc[i];
+		if (loc->code != PLAT_CODE_NONE)
+			limit = MIN(limit, (off64_t)loc->data_offset);
+	}
+
+	if (end > limit)
+		return -ENOSPC;
+
+	err = posix_memalign(&map, VHD_SECTOR_SIZE,
+			     vhd_sectors_to_bytes(batmap->header.batmap_size));
+	if (err)
+		return -err;
+
+	memset(map, 0, vhd_sectors_to_bytes(batmap->header.batmap_size));
+	batmap->map = map;
+	return 0;
+}
+
+/* every sector of the block is set, whichever way round the bits go */
+static int
+bitmap_full(vhd_context_t *vhd, const char *map)
+{
+	int i;
+
+	for (i = 0; i < vhd->spb >> 3; i++)
+		if ((unsigned char)map[i] != 0xff)
+			return 0;
+
+	return 1;
+}
+
+/*
+ * one pass over the bitmaps, a chunk at a time: read each once, journal
+ * the chunk with a single sync, rewrite it in the new order, and note
+ * the full blocks for the batmap on the way
+ */
+static int
+update_bitmaps(vhd_journal_t *journal, int convert, int rollback,
+	       vhd_batmap_t *batmap)
+{
+	int i, j, n, cnt, err;
 	size_t size;
-	char *buf;
+	char *maps[UPDATE_CHUNK];
+	uint32_t chunk[UPDATE_CHUNK];
+	struct update_block *blocks;
+	vhd_context_t *vhd;
 	void *converted;
 
-	buf       = NULL;
+	vhd       = &journal->vhd;
+	blocks    = NULL;
 	converted = NULL;
 
-	size = vhd_bytes_padded(journal->vhd.spb / 8);
+	size = vhd_bytes_padded(vhd->spb / 8);
 	err  = posix_memalign(&converted, 512, size);
 	if (err) {
 		converted = NULL;
+		err = -err;
 		goto out;
 	}
 
-	for (i = 0; i < journal->vhd.bat.entries; i++) {
-		if (journal->vhd.bat.bat[i] == DD_BLK_UNUSED)
-			continue;
+	err = update_sorted_blocks(vhd, &blocks, &cnt);
+	if (err)
+		goto out;
 
-		err = vhd_read_bitmap(&journal->vhd, i, &buf);
-		if (err)
-			goto out;
+	for (i = 0; i < cnt; i += n) {
+		n = MIN(UPDATE_CHUNK, cnt - i);
+		memset(maps, 0, sizeof(maps));
 
-		if (rollback)
-			memcpy(converted, buf, size);
-		else
-			convert_bitmap(buf, converted, size);
+		for (j = 0; j < n; j++) {
+			chunk[j] = blocks[i + j].blk;
+			err = vhd_read_bitmap(vhd, chunk[j], &maps[j]);
+			if (err)
+				goto free;
+			update_throttle(size);
+		}
+
+		if (convert) {
+			err = vhd_journal_add_bitmaps(journal, chunk, maps, n);
+			if (err)
+				goto free;
+			update_throttle(n * size);
+		}
 
-		free(buf);
+		for (j = 0; j < n; j++) {
+			if (batmap->map && bitmap_full(vhd, maps[j]))
+				set_bit(batmap->map, chunk[j]);
+
+			if (!convert)
+				continue;
+
+			if (rollback)
+				memcpy(converted, maps[j], size);
+			else
+				convert_bitmap(maps[j], converted, size);
+
+			err = vhd_write_bitmap(vhd, chunk[j], converted);
+			if (err)
+				goto free;
+			update_throttle(size);
+		}
+
+	free:
+		for (j = 0; j < n; j++)
+			free(maps[j]);
 
-		err = vhd_write_bitmap(&journal->vhd, i, converted);
 		if (err)
 			goto out;
 	}
 
 	err = 0;
  out:
+	free(blocks);
 	free(converted);
 	return err;
 }
 
+/*
+ * the map goes out before the header, and for 0.1 images before the
+ * footer which makes the batmap count; either way an interrupted update
+ * leaves no batmap claiming a block is full when it is not
+ */
+static int
+update_batmap(vhd_journal_t *journal, vhd_batmap_t *batmap)
+{
+	int err;
+	vhd_context_t *vhd = &journal->vhd;
+
+	free(vhd->batmap.map);
+	vhd->batmap = *batmap;
+	memset(batmap, 0, sizeof(*batmap));
+
+	err = vhd_write_batmap(vhd, &vhd->batmap);
+	if (err)
+		return err;
+
+	update_throttle(vhd_sectors_to_bytes(vhd->batmap.header.batmap_size));
+	return 0;
+}
+
 static int
 open_journal(vhd_journal_t *journal, const char *file, const char *jfile)
 {
@@ -176,21 +397,155 @@ close_journal(vhd_journal_t *journal, int err)
 		return vhd_journal_remove(journal);
 }
 
+/*
+ * what an image needs, found without a journal so that images already
+ * up to date cost a read of their headers and nothing else
+ */
+static int
+update_needed(const char *file, int *convert, int *batmap)
+{
+	int err;
+	vhd_context_t vhd;
+
+	*convert = 0;
+	*batmap  = 0;
+
+	err = vhd_open(&vhd, file, VHD_OPEN_RDONLY);
+	if (err) {
+		printf("error opening %s: %d\n", file, err);
+		return err;
+	}
+
+	if (vhd_creator_tapdisk(&vhd) && vhd_type_dynamic(&vhd)) {
+		*convert = (vhd.footer.crtr_ver == VHD_VERSION(0, 1));
+		*batmap  = (vhd.footer.crtr_ver <= VHD_VERSION(1, 1) &&
+			    !vhd_has_batmap(&vhd));
+	}
+
+	vhd_close(&vhd);
+	return 0;
+}
+
+static int
+update_image(struct update_job *job)
+{
+	int err, convert, add_batmap;
+	vhd_journal_t journal;
+	vhd_batmap_t batmap;
+
+	memset(&batmap, 0, sizeof(batmap));
+
+	err = update_needed(job->file, &convert, &add_batmap);
+	if (err)
+		return err;
+
+	if (!convert && !add_batmap)
+		return 0;
+
+	err = open_journal(&journal, job->file, job->jfile);
+	if (err)
+		return err;
+
+	err = vhd_get_bat(&journal.vhd);
+	if (err)
+		goto out;
+
+	if (add_batmap) {
+		err = init_batmap(&journal.vhd, &batmap);
+		if (err == -ENOSPC && convert) {
+			printf("%s: no room for a batmap, converting only\n",
+			       job->file);
+			err = 0;
+		} else if (err == -ENOSPC) {
+			err = 0;
+			goto out;
+		} else if (err)
+			goto out;
+	}
+
+	err = update_bitmaps(&journal, convert, job->rollback, &batmap);
+	if (err) {
+		printf("%s: update failed: %d; saving journal\n",
+		       job->file, err);
+		goto out;
+	}
+
+	/* bitmaps are in the new order from here on */
+	if (convert)
+		journal.vhd.footer.crtr_ver = VHD_VERSION(1, 1);
+
+	if (batmap.map) {
+		err = update_batmap(&journal, &batmap);
+		if (err) {
+			printf("%s: failed to write batmap: %d\n",
+			       job->file, err);
+			goto out;
+		}
+	}
+
+	if (convert) {
+		err = update_creator_version(&journal);
+		if (err) {
+			printf("%s: failed to update creator version: %d\n",
+			       job->file, err);
+			goto out;
+		}
+	}
+
+	err = 0;
+
+out:
+	free(batmap.map);
+	return close_journal(&journal, err) ? : err;
+}
+
+static struct {
+	pthread_mutex_t    lock;
+	struct update_job *jobs;
+	int                cnt;
+	int                next;
+} queue = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static void *
+update_worker(void *arg)
+{
+	struct update_job *job;
+
+	for (;;) {
+		pthread_mutex_lock(&queue.lock);
+		job = (queue.next < queue.cnt ? &queue.jobs[queue.next++] : NULL);
+		pthread_mutex_unlock(&queue.lock);
+
+		if (!job)
+			break;
+
+		job->err = update_image(job);
+	}
+
+	return NULL;
+}
+
 int
 main(int argc, char **argv)
 {
-	char *file, *jfile;
-	int c, err, rollback;
-	vhd_journal_t journal;
+	char *jfile;
+	int i, c, err, rollback, parallel;
+	struct update_job *jobs;
+	pthread_t *threads;
 
-	file     = NULL;
 	jfile    = NULL;
 	rollback = 0;
+	parallel = 1;
 
-	while ((c = getopt(argc, argv, "n:j:rh")) != -1) {
+	queue.jobs = calloc(argc, sizeof(struct update_job));
+	if (!queue.jobs)
+		return -ENOMEM;
+	jobs = queue.jobs;
+
+	while ((c = getopt(argc, argv, "n:j:p:B:rh")) != -1) {
 		switch(c) {
 		case 'n':
-			file = optarg;
+			jobs[queue.cnt++].file = optarg;
 			break;
 		case 'j':
 			jfile = optarg;
@@ -200,6 +555,14 @@ main(int argc, char **argv)
 				return -errno;
 			}
 			break;
+		case 'p':
+			parallel = atoi(optarg);
+			if (parallel < 1)
+				usage();
+			break;
+		case 'B':
+			budget.rate = strtoull(optarg, NULL, 10) << 20;
+			break;
 		case 'r':
 			/* add a rollback option for debugging which
 			 * pushes journalled bitmaps to original file
@@ -211,7 +574,7 @@ main(int argc, char **argv)
 		}
 	}
 
-	if (!file)
+	if (!queue.cnt)
 		usage();
 
 	if (rollback && !jfile) {
@@ -219,40 +582,44 @@ main(int argc, char **argv)
 		usage();
 	}
 
-	err = open_journal(&journal, file, jfile);
-	if (err)
-		return err;
-
-	if (!vhd_creator_tapdisk(&journal.vhd) ||
-	    journal.vhd.footer.crtr_ver != VHD_VERSION(0, 1) ||
-	    journal.vhd.footer.type == HD_TYPE_FIXED) {
-		err = 0;
-		goto out;
+	if (jfile && queue.cnt > 1) {
+		printf("a journal argument is for a single image\n");
+		usage();
 	}
 
-	err = journal_bitmaps(&journal);
-	if (err) {
-		/* no changes to vhd file yet,
-		 * so close the journal and bail */
-		vhd_journal_close(&journal);
-		return err;
-	}
+	jobs[0].jfile    = jfile;
+	jobs[0].rollback = rollback;
 
-	err = update_vhd(&journal, rollback);
-	if (err) {
-		printf("update failed: %d; saving journal\n", err);
-		goto out;
-	}
+	gettimeofday(&budget.start, NULL);
 
-	err = update_creator_version(&journal);
-	if (err) {
-		printf("failed to udpate creator version: %d\n", err);
-		goto out;
+	parallel = MIN(parallel, queue.cnt);
+	threads  = calloc(parallel, sizeof(pthread_t));
+	if (!threads)
+		return -ENOMEM;
+
+	for (i = 0; i < parallel; i++) {
+		err = pthread_create(&threads[i], NULL, update_worker, NULL);
+		if (err) {
+			printf("error starting worker: %d\n", err);
+			break;
+		}
 	}
 
+	/* whatever did start works through the whole queue */
+	if (!i)
+		update_worker(NULL);
+
+	while (i--)
+		pthread_join(threads[i], NULL);
+
 	err = 0;
+	for (i = 0; i < queue.cnt; i++)
+		if (jobs[i].err) {
+			printf("%s: %d\n", jobs[i].file, jobs[i].err);
+			err = err ? : jobs[i].err;
+		}
 
-out:
-	err = close_journal(&journal, err);
+	free(threads);
+	free(jobs);
 	return err;
 }
@@ -54,6 +54,9 @@ struct command commands[] = {
 	{ .name = "scan",        .func = vhd_util_scan          },
 	{ .name = "check",       .func = vhd_util_check         },
 	{ .name = "revert",      .func = vhd_util_revert        },
+	{ .name = "changes",     .func = vhd_util_changes       },
+	{ .name = "compress",    .func = vhd_util_compress      },
+	{ .name = "copy",        .func = vhd_util_copy          },
 };
 
 #define print_commands()					\